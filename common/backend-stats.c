@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <time.h>
+
+#include "backend-stats.h"
+
+/*
+ * Latencies are kept in a log-linear histogram: values below 16 usec
+ * have a bucket each, larger ones have 8 buckets for every power of two.
+ * Values above 2^40 usec (about 12 days) go to the last bucket.
+ */
+#define LINEAR_MAX 16
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MIN_EXP 4
+#define MAX_EXP 39
+#define N_BUCKETS (LINEAR_MAX + (MAX_EXP - MIN_EXP + 1) * SUB_BUCKETS)
+
+typedef struct OpStats {
+    guint64 n_ops;
+    guint64 n_errors;
+    guint64 bytes;
+    guint64 total_usec;
+    guint64 max_usec;
+    guint64 buckets[N_BUCKETS];
+} OpStats;
+
+struct BackendStats {
+    OpStats ops[N_BACKEND_OPS];
+};
+
+static const char *op_names[N_BACKEND_OPS] = {
+    "read", "write", "exists", "stat", "commit", "delete",
+};
+
+BackendStats *
+backend_stats_new ()
+{
+    return g_new0 (BackendStats, 1);
+}
+
+gint64
+backend_stats_now ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static int
+bucket_index (guint64 usec)
+{
+    int e;
+
+    if (usec < LINEAR_MAX)
+        return (int)usec;
+
+    e = 63 - __builtin_clzll (usec);
+    if (e > MAX_EXP)
+        return N_BUCKETS - 1;
+
+    return LINEAR_MAX + (e - MIN_EXP) * SUB_BUCKETS +
+        (int)((usec >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The largest value that falls into bucket @i. */
+static guint64
+bucket_upper_bound (int i)
+{
+    int e, sub;
+
+    if (i < LINEAR_MAX)
+        return i;
+
+    e = MIN_EXP + (i - LINEAR_MAX) / SUB_BUCKETS;
+    sub = (i - LINEAR_MAX) % SUB_BUCKETS;
+
+    return ((guint64)(SUB_BUCKETS + sub + 1) << (e - SUB_BITS)) - 1;
+}
+
+void
+backend_stats_record (BackendStats *stats, int op,
+                      gint64 usec, gint64 bytes, gboolean success)
+{
+    OpStats *st = &stats->ops[op];
+    guint64 max;
+
+    if (usec < 0)
+        usec = 0;
+
+    __sync_fetch_and_add (&st->n_ops, 1);
+    if (!success)
+        __sync_fetch_and_add (&st->n_errors, 1);
+    if (bytes > 0)
+        __sync_fetch_and_add (&st->bytes, (guint64)bytes);
+    __sync_fetch_and_add (&st->total_usec, (guint64)usec);
+    __sync_fetch_and_add (&st->buckets[bucket_index (usec)], 1);
+
+    max = st->max_usec;
+    while ((guint64)usec > max) {
+        guint64 old = __sync_val_compare_and_swap (&st->max_usec, max, usec);
+        if (old == max)
+            break;
+        max = old;
+    }
+}
+
+static guint64
+read_counter (guint64 *counter, gboolean reset)
+{
+    if (reset)
+        return __sync_lock_test_and_set (counter, 0);
+    return *(volatile guint64 *)counter;
+}
+
+static guint64
+percentile (const guint64 *buckets, guint64 total, double q)
+{
+    guint64 rank, seen = 0;
+    int i;
+
+    if (total == 0)
+        return 0;
+
+    rank = (guint64)(total * q);
+    if (rank >= total)
+        rank = total - 1;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen > rank)
+            return bucket_upper_bound (i);
+    }
+
+    return bucket_upper_bound (N_BUCKETS - 1);
+}
+
+void
+backend_stats_get (BackendStats *stats, int op, BackendOpStats *op_stats,
+                   gboolean reset)
+{
+    OpStats *st = &stats->ops[op];
+    guint64 buckets[N_BUCKETS];
+    guint64 total = 0;
+    int i;
+
+    /* Count from the buckets, so that the percentiles are consistent
+     * even if calls are recorded meanwhile.
+     */
+    for (i = 0; i < N_BUCKETS; ++i) {
+        buckets[i] = read_counter (&st->buckets[i], reset);
+        total += buckets[i];
+    }
+
+    op_stats->n_ops = read_counter (&st->n_ops, reset);
+    op_stats->n_errors = read_counter (&st->n_errors, reset);
+    op_stats->bytes = read_counter (&st->bytes, reset);
+    op_stats->total_usec = read_counter (&st->total_usec, reset);
+    op_stats->max_usec = read_counter (&st->max_usec, reset);
+
+    op_stats->p50 = percentile (buckets, total, 0.5);
+    op_stats->p99 = percentile (buckets, total, 0.99);
+    op_stats->p999 = percentile (buckets, total, 0.999);
+
+    /* Bucket bounds can be above the largest value seen. */
+    op_stats->p50 = MIN (op_stats->p50, op_stats->max_usec);
+    op_stats->p99 = MIN (op_stats->p99, op_stats->max_usec);
+    op_stats->p999 = MIN (op_stats->p999, op_stats->max_usec);
+}
+
+const char *
+backend_stats_op_name (int op)
+{
+    return op_names[op];
+}
+
+void
+backend_stats_format (GString *buf, const char *store,
+                      BackendStats *stats, gboolean reset)
+{
+    BackendOpStats st;
+    int op;
+
+    for (op = 0; op < N_BACKEND_OPS; ++op) {
+        backend_stats_get (stats, op, &st, reset);
+        if (st.n_ops == 0)
+            continue;
+
+        g_string_append_printf (buf, "%s\t%s\t%"G_GUINT64_FORMAT
+                                "\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT
+                                "\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT
+                                "\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT
+                                "\t%"G_GUINT64_FORMAT"\n",
+                                store, op_names[op], st.n_ops, st.n_errors,
+                                st.bytes, st.total_usec / st.n_ops,
+                                st.p50, st.p99, st.p999, st.max_usec);
+    }
+}
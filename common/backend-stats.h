@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BACKEND_STATS_H
+#define BACKEND_STATS_H
+
+#include <glib.h>
+
+#include "obj-backend.h"
+#include "block-backend.h"
+
+/*
+ * Operation counters and latency histograms of a storage backend.
+ *
+ * A backend is instrumented by wrapping it: the wrapper times every call
+ * into the inner backend and records it here. Recording is lock free, so
+ * it can be done from any thread.
+ */
+
+enum {
+    BACKEND_OP_READ = 0,
+    BACKEND_OP_WRITE,
+    BACKEND_OP_EXISTS,
+    BACKEND_OP_STAT,
+    BACKEND_OP_COMMIT,
+    BACKEND_OP_DELETE,
+    N_BACKEND_OPS,
+};
+
+typedef struct BackendStats BackendStats;
+
+BackendStats *
+backend_stats_new ();
+
+/* Monotonic time in usec, for timing the calls. */
+gint64
+backend_stats_now ();
+
+/* Record one call of @op that took @usec and moved @bytes. */
+void
+backend_stats_record (BackendStats *stats, int op,
+                      gint64 usec, gint64 bytes, gboolean success);
+
+typedef struct BackendOpStats {
+    guint64 n_ops;
+    guint64 n_errors;
+    guint64 bytes;
+    guint64 total_usec;
+    guint64 max_usec;
+    /* Latency percentiles, in usec, within 1/8 of the real value. */
+    guint64 p50;
+    guint64 p99;
+    guint64 p999;
+} BackendOpStats;
+
+/*
+ * Get the statistics of @op since the start, or since the last reset.
+ * If @reset is TRUE the statistics of @op start over. Calls made while
+ * resetting may be partly lost.
+ */
+void
+backend_stats_get (BackendStats *stats, int op, BackendOpStats *op_stats,
+                   gboolean reset);
+
+const char *
+backend_stats_op_name (int op);
+
+/*
+ * Append one line for every op that was called:
+ * store, op, count, errors, bytes, avg, p50, p99, p999, max (usec).
+ */
+void
+backend_stats_format (GString *buf, const char *store,
+                      BackendStats *stats, gboolean reset);
+
+/* Wrappers that record every call into @inner in @stats. */
+
+ObjBackend *
+obj_backend_stats_new (ObjBackend *inner, BackendStats *stats);
+
+BlockBackend *
+block_backend_stats_new (BlockBackend *inner, BackendStats *stats);
+
+#endif
@@ -0,0 +1,909 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block backend that keeps recently used blocks of a remote backend in a
+ * local directory.
+ *
+ * Cached blocks are plain files under <cache_dir>/blocks, laid out like
+ * the fs backend. Whether a block is cached is decided by the file, so
+ * several processes can share a cache dir. Each process keeps an LRU
+ * index of the cached blocks it uses and evicts from it when they take
+ * more than the configured size.
+ *
+ * In write-through mode a block is committed to the remote backend
+ * before commit returns. In write-back mode commit only moves the block
+ * to <cache_dir>/dirty; a background thread uploads it and then moves
+ * it into the cache. Dirty blocks are never evicted, and those left
+ * over by an earlier run are uploaded at startup.
+ *
+ * Blocks read from the remote backend are only cached on their second
+ * read in a while, so that a large one-off download doesn't push
+ * everything else out of the cache.
+ */
+
+#include "common.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "utils.h"
+
+#include "block-backend.h"
+
+/* Number of missed blocks remembered for admission. */
+#define DOORKEEPER_SIZE 65536
+
+/* Temp files older than this are from crashed writers. */
+#define STALE_TMP_SECS 3600
+
+#define COPY_BUF_SIZE (64 * 1024)
+
+enum {
+    CACHE_WRITE_THROUGH = 0,
+    CACHE_WRITE_BACK,
+};
+
+struct _BHandle {
+    char        block_id[41];
+    int         rw_type;
+    int         fd;         /* cached block being read, or -1 */
+    BHandle    *remote;     /* handle of the remote backend, or NULL */
+    int         tmp_fd;     /* block being added to the cache, or -1 */
+    char       *tmp_path;
+    gint64      tmp_size;
+};
+
+typedef struct CacheEntry {
+    char        block_id[41];
+    gint64      size;
+    gboolean    dirty;
+    GList       *link;      /* in CachePriv.lru */
+} CacheEntry;
+
+typedef struct {
+    BlockBackend    *remote;
+    char            *cache_dir;
+    gint64          max_size;
+    int             mode;
+    gboolean        admit_always;
+
+    pthread_mutex_t lock;
+    GHashTable      *entries;       /* block id -> CacheEntry */
+    GQueue          *lru;           /* most recently used first */
+    gint64          size;
+    GHashTable      *doorkeeper;    /* blocks missed once */
+
+    /* Dirty blocks waiting for upload. */
+    GQueue          *flush_queue;
+    pthread_cond_t  flush_cond;
+} CachePriv;
+
+static void
+get_cache_path (CachePriv *priv, const char *block_id, char path[])
+{
+    snprintf (path, PATH_MAX, "%s/blocks/%.2s/%s",
+              priv->cache_dir, block_id, block_id + 2);
+}
+
+static void
+get_dirty_path (CachePriv *priv, const char *block_id, char path[])
+{
+    snprintf (path, PATH_MAX, "%s/dirty/%s", priv->cache_dir, block_id);
+}
+
+/* Called with the lock held. */
+static void
+evict (CachePriv *priv)
+{
+    CacheEntry *entry;
+    GList *ptr, *prev;
+    char path[PATH_MAX];
+
+    for (ptr = priv->lru->tail; ptr && priv->size > priv->max_size;
+         ptr = prev) {
+        prev = ptr->prev;
+        entry = ptr->data;
+        if (entry->dirty)
+            continue;
+
+        get_cache_path (priv, entry->block_id, path);
+        g_unlink (path);
+
+        priv->size -= entry->size;
+        g_queue_delete_link (priv->lru, ptr);
+        g_hash_table_remove (priv->entries, entry->block_id);
+    }
+}
+
+/* Record a use of a cached block. Called with the lock held. */
+static void
+touch_entry (CachePriv *priv, const char *block_id, gint64 size,
+             gboolean dirty)
+{
+    CacheEntry *entry;
+
+    entry = g_hash_table_lookup (priv->entries, block_id);
+    if (entry) {
+        g_queue_unlink (priv->lru, entry->link);
+        g_queue_push_head_link (priv->lru, entry->link);
+        if (size >= 0) {
+            priv->size += size - entry->size;
+            entry->size = size;
+            entry->dirty = dirty;
+        }
+        return;
+    }
+
+    if (size < 0)
+        return;
+
+    entry = g_new0 (CacheEntry, 1);
+    memcpy (entry->block_id, block_id, 41);
+    entry->size = size;
+    entry->dirty = dirty;
+    g_queue_push_head (priv->lru, entry);
+    entry->link = priv->lru->head;
+    g_hash_table_insert (priv->entries, entry->block_id, entry);
+    priv->size += size;
+
+    evict (priv);
+}
+
+static void
+forget_entry (CachePriv *priv, const char *block_id)
+{
+    CacheEntry *entry;
+
+    pthread_mutex_lock (&priv->lock);
+    entry = g_hash_table_lookup (priv->entries, block_id);
+    if (entry) {
+        priv->size -= entry->size;
+        g_queue_delete_link (priv->lru, entry->link);
+        g_hash_table_remove (priv->entries, block_id);
+    }
+    pthread_mutex_unlock (&priv->lock);
+}
+
+/* Whether a block read from the remote backend should be cached. */
+static gboolean
+admit (CachePriv *priv, const char *block_id)
+{
+    gboolean ret = FALSE;
+
+    if (priv->admit_always)
+        return TRUE;
+
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup (priv->doorkeeper, block_id)) {
+        g_hash_table_remove (priv->doorkeeper, block_id);
+        ret = TRUE;
+    } else {
+        if (g_hash_table_size (priv->doorkeeper) >= DOORKEEPER_SIZE)
+            g_hash_table_remove_all (priv->doorkeeper);
+        g_hash_table_insert (priv->doorkeeper, g_strdup(block_id),
+                             GINT_TO_POINTER(1));
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return ret;
+}
+
+static void
+drop_tmp (BHandle *handle)
+{
+    if (handle->tmp_fd >= 0)
+        close (handle->tmp_fd);
+    handle->tmp_fd = -1;
+    if (handle->tmp_path) {
+        g_unlink (handle->tmp_path);
+        g_free (handle->tmp_path);
+        handle->tmp_path = NULL;
+    }
+}
+
+static int
+open_tmp (CachePriv *priv, BHandle *handle)
+{
+    handle->tmp_path = g_strdup_printf ("%s/tmp/%s.XXXXXX",
+                                        priv->cache_dir, handle->block_id);
+    handle->tmp_fd = g_mkstemp (handle->tmp_path);
+    if (handle->tmp_fd < 0) {
+        g_warning ("[block cache] Failed to create %s: %s.\n",
+                   handle->tmp_path, strerror(errno));
+        g_free (handle->tmp_path);
+        handle->tmp_path = NULL;
+        return -1;
+    }
+    handle->tmp_size = 0;
+    return 0;
+}
+
+/* Move the temp file of @handle into the cache, or into the dirty dir. */
+static int
+install_tmp (CachePriv *priv, BHandle *handle, gboolean dirty)
+{
+    char path[PATH_MAX];
+
+    if (handle->tmp_fd >= 0) {
+        close (handle->tmp_fd);
+        handle->tmp_fd = -1;
+    }
+
+    if (dirty)
+        get_dirty_path (priv, handle->block_id, path);
+    else
+        get_cache_path (priv, handle->block_id, path);
+
+    if (g_rename (handle->tmp_path, path) < 0) {
+        g_warning ("[block cache] Failed to move block %s to %s: %s.\n",
+                   handle->block_id, path, strerror(errno));
+        drop_tmp (handle);
+        return -1;
+    }
+    g_free (handle->tmp_path);
+    handle->tmp_path = NULL;
+
+    pthread_mutex_lock (&priv->lock);
+    touch_entry (priv, handle->block_id, handle->tmp_size, dirty);
+    if (dirty) {
+        g_queue_push_tail (priv->flush_queue, g_strdup(handle->block_id));
+        pthread_cond_signal (&priv->flush_cond);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return 0;
+}
+
+static int
+open_cached (CachePriv *priv, const char *block_id)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    gboolean dirty = FALSE;
+    int fd;
+
+    get_cache_path (priv, block_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        get_dirty_path (priv, block_id, path);
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        dirty = TRUE;
+    }
+    if (fd < 0)
+        return -1;
+
+    /* The block may have been cached by another process. */
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup (priv->entries, block_id))
+        touch_entry (priv, block_id, -1, dirty);
+    else if (fstat (fd, &st) == 0)
+        touch_entry (priv, block_id, (gint64)st.st_size, dirty);
+    pthread_mutex_unlock (&priv->lock);
+
+    return fd;
+}
+
+static BHandle *
+block_backend_cache_open_block (BlockBackend *bend,
+                                const char *block_id,
+                                int rw_type)
+{
+    CachePriv *priv = bend->be_priv;
+    BHandle *handle;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_assert (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE);
+
+    handle = g_new0 (BHandle, 1);
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    handle->fd = -1;
+    handle->tmp_fd = -1;
+
+    if (rw_type == BLOCK_READ) {
+        handle->fd = open_cached (priv, block_id);
+        if (handle->fd >= 0)
+            return handle;
+
+        handle->remote = priv->remote->open_block (priv->remote,
+                                                   block_id, BLOCK_READ);
+        if (!handle->remote)
+            goto error;
+        if (admit (priv, block_id))
+            open_tmp (priv, handle);
+        return handle;
+    }
+
+    /* Without a temp file, write-back falls back to write-through. */
+    if (open_tmp (priv, handle) < 0 || priv->mode == CACHE_WRITE_THROUGH) {
+        handle->remote = priv->remote->open_block (priv->remote,
+                                                   block_id, BLOCK_WRITE);
+        if (!handle->remote)
+            goto error;
+    }
+    return handle;
+
+error:
+    drop_tmp (handle);
+    g_free (handle);
+    return NULL;
+}
+
+static int
+block_backend_cache_read_block (BlockBackend *bend,
+                                BHandle *handle,
+                                void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+    int n;
+
+    if (handle->fd >= 0)
+        return readn (handle->fd, buf, len);
+
+    n = priv->remote->read_block (priv->remote, handle->remote, buf, len);
+    if (n < 0) {
+        drop_tmp (handle);
+        return n;
+    }
+
+    if (handle->tmp_fd >= 0 && n > 0) {
+        if (writen (handle->tmp_fd, buf, n) != n)
+            drop_tmp (handle);
+        else
+            handle->tmp_size += n;
+    }
+
+    return n;
+}
+
+static int
+block_backend_cache_write_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 const void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+    int n = len;
+
+    if (handle->remote) {
+        n = priv->remote->write_block (priv->remote, handle->remote, buf, len);
+        if (n < 0)
+            return n;
+    }
+
+    if (handle->tmp_fd >= 0) {
+        if (writen (handle->tmp_fd, buf, n) != n) {
+            /* Only write-back depends on the temp file. */
+            if (!handle->remote)
+                return -1;
+            drop_tmp (handle);
+        } else {
+            handle->tmp_size += n;
+        }
+    }
+
+    return n;
+}
+
+static int
+block_backend_cache_close_block (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+    BMetadata *md;
+    int ret = 0;
+
+    if (handle->fd >= 0) {
+        ret = close (handle->fd);
+        handle->fd = -1;
+        return ret;
+    }
+
+    /* Cache a block read from the remote backend if it was read whole. */
+    if (handle->rw_type == BLOCK_READ && handle->tmp_path) {
+        md = priv->remote->stat_block_by_handle (priv->remote, handle->remote);
+        if (md && md->size == handle->tmp_size)
+            install_tmp (priv, handle, FALSE);
+        else
+            drop_tmp (handle);
+        g_free (md);
+    }
+
+    if (handle->remote)
+        ret = priv->remote->close_block (priv->remote, handle->remote);
+
+    return ret;
+}
+
+static int
+block_backend_cache_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    g_assert (handle->rw_type == BLOCK_WRITE);
+
+    if (!handle->remote) {
+        /* Write-back: the cached copy must survive until uploaded. */
+        if (fsync (handle->tmp_fd) < 0) {
+            g_warning ("[block cache] Failed to sync block %s: %s.\n",
+                       handle->block_id, strerror(errno));
+            return -1;
+        }
+        return install_tmp (priv, handle, TRUE);
+    }
+
+    if (priv->remote->commit_block (priv->remote, handle->remote) < 0) {
+        drop_tmp (handle);
+        return -1;
+    }
+
+    if (handle->tmp_path)
+        install_tmp (priv, handle, FALSE);
+    return 0;
+}
+
+static void
+block_backend_cache_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (handle->fd >= 0)
+        close (handle->fd);
+    drop_tmp (handle);
+    if (handle->remote)
+        priv->remote->block_handle_free (priv->remote, handle->remote);
+    g_free (handle);
+}
+
+static gboolean
+is_cached (CachePriv *priv, const char *block_id)
+{
+    char path[PATH_MAX];
+
+    get_cache_path (priv, block_id, path);
+    if (g_access (path, F_OK) == 0)
+        return TRUE;
+
+    get_dirty_path (priv, block_id, path);
+    return (g_access (path, F_OK) == 0);
+}
+
+static int
+block_backend_cache_exists (BlockBackend *bend, const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (is_cached (priv, block_id))
+        return TRUE;
+
+    return priv->remote->exists (priv->remote, block_id);
+}
+
+static void
+block_backend_cache_exists_batch (BlockBackend *bend,
+                                  const char **block_ids,
+                                  int n_blocks,
+                                  gboolean *exists)
+{
+    CachePriv *priv = bend->be_priv;
+    const char **missed;
+    gboolean *missed_exists;
+    int *missed_idx;
+    int i, n = 0;
+
+    missed = g_new (const char *, n_blocks);
+    missed_idx = g_new (int, n_blocks);
+    missed_exists = g_new0 (gboolean, n_blocks);
+
+    for (i = 0; i < n_blocks; ++i) {
+        exists[i] = is_cached (priv, block_ids[i]);
+        if (!exists[i]) {
+            missed[n] = block_ids[i];
+            missed_idx[n++] = i;
+        }
+    }
+
+    if (n > 0) {
+        priv->remote->exists_batch (priv->remote, missed, n, missed_exists);
+        for (i = 0; i < n; ++i)
+            exists[missed_idx[i]] = missed_exists[i];
+    }
+
+    g_free (missed);
+    g_free (missed_idx);
+    g_free (missed_exists);
+}
+
+static int
+block_backend_cache_remove_block (BlockBackend *bend, const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+    char path[PATH_MAX];
+    gboolean was_dirty;
+    int ret;
+
+    forget_entry (priv, block_id);
+
+    get_cache_path (priv, block_id, path);
+    g_unlink (path);
+    get_dirty_path (priv, block_id, path);
+    was_dirty = (g_unlink (path) == 0);
+
+    ret = priv->remote->remove_block (priv->remote, block_id);
+
+    /* A dirty block may not have reached the remote backend yet. */
+    return was_dirty ? 0 : ret;
+}
+
+static int
+block_backend_cache_read_range (BlockBackend *bend, const char *block_id,
+                                guint64 offset, void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+    int fd, n;
+
+    fd = open_cached (priv, block_id);
+    if (fd < 0)
+        return priv->remote->read_range (priv->remote, block_id,
+                                         offset, buf, len);
+
+    if (lseek (fd, (off_t)offset, SEEK_SET) < 0)
+        n = -1;
+    else
+        n = readn (fd, buf, len);
+
+    close (fd);
+    return n;
+}
+
+static BMetadata *
+stat_fd (const char *block_id, int fd)
+{
+    struct stat st;
+    BMetadata *block_md;
+
+    if (fstat (fd, &st) < 0) {
+        g_warning ("[block cache] Failed to stat block %s.\n", block_id);
+        return NULL;
+    }
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = (uint32_t) st.st_size;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_cache_stat_block (BlockBackend *bend, const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+    BMetadata *block_md;
+    int fd;
+
+    fd = open_cached (priv, block_id);
+    if (fd < 0)
+        return priv->remote->stat_block (priv->remote, block_id);
+
+    block_md = stat_fd (block_id, fd);
+    close (fd);
+    return block_md;
+}
+
+static BMetadata *
+block_backend_cache_stat_block_by_handle (BlockBackend *bend,
+                                          BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (handle->fd >= 0)
+        return stat_fd (handle->block_id, handle->fd);
+    if (handle->remote)
+        return priv->remote->stat_block_by_handle (priv->remote,
+                                                   handle->remote);
+
+    /* Block being written in write-back mode. */
+    return stat_fd (handle->block_id, handle->tmp_fd);
+}
+
+static int
+block_backend_cache_foreach_block (BlockBackend *bend,
+                                   SeafBlockFunc process,
+                                   void *user_data)
+{
+    CachePriv *priv = bend->be_priv;
+    char *dirty_dir;
+    GDir *dir;
+    const char *dname;
+    gboolean stop = FALSE;
+
+    /* Dirty blocks are not in the remote backend yet. */
+    dirty_dir = g_build_filename (priv->cache_dir, "dirty", NULL);
+    dir = g_dir_open (dirty_dir, 0, NULL);
+    if (dir) {
+        while (!stop && (dname = g_dir_read_name (dir)) != NULL) {
+            if (strlen (dname) == 40)
+                stop = !process (dname, user_data);
+        }
+        g_dir_close (dir);
+    }
+    g_free (dirty_dir);
+
+    if (stop)
+        return 0;
+
+    return priv->remote->foreach_block (priv->remote, process, user_data);
+}
+
+static int
+upload_block (CachePriv *priv, const char *block_id)
+{
+    char path[PATH_MAX], dst_path[PATH_MAX];
+    char *buf = NULL;
+    BHandle *handle = NULL;
+    CacheEntry *entry;
+    int fd, n;
+    int ret = 0;
+
+    get_dirty_path (priv, block_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        /* Removed, or uploaded by another process. */
+        return 0;
+    }
+
+    handle = priv->remote->open_block (priv->remote, block_id, BLOCK_WRITE);
+    if (!handle) {
+        ret = -1;
+        goto out;
+    }
+
+    buf = g_malloc (COPY_BUF_SIZE);
+    while ((n = readn (fd, buf, COPY_BUF_SIZE)) > 0) {
+        if (priv->remote->write_block (priv->remote, handle, buf, n) != n) {
+            ret = -1;
+            goto out;
+        }
+    }
+    if (n < 0 ||
+        priv->remote->close_block (priv->remote, handle) < 0 ||
+        priv->remote->commit_block (priv->remote, handle) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    get_cache_path (priv, block_id, dst_path);
+    if (g_rename (path, dst_path) == 0) {
+        pthread_mutex_lock (&priv->lock);
+        entry = g_hash_table_lookup (priv->entries, block_id);
+        if (entry) {
+            entry->dirty = FALSE;
+            evict (priv);
+        }
+        pthread_mutex_unlock (&priv->lock);
+    }
+
+out:
+    if (ret < 0)
+        g_warning ("[block cache] Failed to upload block %s.\n", block_id);
+    if (handle)
+        priv->remote->block_handle_free (priv->remote, handle);
+    g_free (buf);
+    close (fd);
+    return ret;
+}
+
+static void *
+flush_thread (void *vpriv)
+{
+    CachePriv *priv = vpriv;
+    char *block_id;
+
+    while (1) {
+        pthread_mutex_lock (&priv->lock);
+        while (g_queue_is_empty (priv->flush_queue))
+            pthread_cond_wait (&priv->flush_cond, &priv->lock);
+        block_id = g_queue_pop_head (priv->flush_queue);
+        pthread_mutex_unlock (&priv->lock);
+
+        if (upload_block (priv, block_id) < 0) {
+            /* Retry later, the remote backend may be down. */
+            g_usleep (G_USEC_PER_SEC);
+            pthread_mutex_lock (&priv->lock);
+            g_queue_push_tail (priv->flush_queue, block_id);
+            pthread_mutex_unlock (&priv->lock);
+            continue;
+        }
+        g_free (block_id);
+    }
+
+    return NULL;
+}
+
+typedef struct ScannedBlock {
+    char    block_id[41];
+    gint64  size;
+    time_t  mtime;
+} ScannedBlock;
+
+static gint
+compare_mtime (gconstpointer a, gconstpointer b)
+{
+    const ScannedBlock *sa = a, *sb = b;
+
+    return (sa->mtime < sb->mtime) ? -1 : (sa->mtime > sb->mtime);
+}
+
+/* Scan @dir_path, appending the blocks named @prefix + file name. */
+static void
+scan_dir (const char *dir_path, const char *prefix, GArray *blocks)
+{
+    GDir *dir;
+    const char *dname;
+    char path[PATH_MAX];
+    ScannedBlock blk;
+    struct stat st;
+
+    dir = g_dir_open (dir_path, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (strlen(prefix) + strlen(dname) != 40)
+            continue;
+        snprintf (path, sizeof(path), "%s/%s", dir_path, dname);
+        if (g_stat (path, &st) < 0)
+            continue;
+        snprintf (blk.block_id, sizeof(blk.block_id), "%s%s", prefix, dname);
+        blk.size = (gint64)st.st_size;
+        blk.mtime = st.st_mtime;
+        g_array_append_val (blocks, blk);
+    }
+    g_dir_close (dir);
+}
+
+static void
+remove_stale_tmp_files (CachePriv *priv)
+{
+    char *tmp_dir;
+    GDir *dir;
+    const char *dname;
+    char path[PATH_MAX];
+    struct stat st;
+    time_t now = time (NULL);
+
+    tmp_dir = g_build_filename (priv->cache_dir, "tmp", NULL);
+    dir = g_dir_open (tmp_dir, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            snprintf (path, sizeof(path), "%s/%s", tmp_dir, dname);
+            if (g_stat (path, &st) == 0 && now - st.st_mtime > STALE_TMP_SECS)
+                g_unlink (path);
+        }
+        g_dir_close (dir);
+    }
+    g_free (tmp_dir);
+}
+
+/* Build the index from the cache dir, oldest to newest. */
+static void
+load_cache_dir (CachePriv *priv)
+{
+    GArray *blocks;
+    ScannedBlock *blk;
+    char path[PATH_MAX], prefix[3];
+    int i;
+
+    blocks = g_array_new (FALSE, FALSE, sizeof(ScannedBlock));
+    for (i = 0; i < 256; ++i) {
+        snprintf (prefix, sizeof(prefix), "%02x", i);
+        snprintf (path, sizeof(path), "%s/blocks/%s", priv->cache_dir, prefix);
+        scan_dir (path, prefix, blocks);
+    }
+    g_array_sort (blocks, compare_mtime);
+
+    for (i = 0; i < blocks->len; ++i) {
+        blk = &g_array_index (blocks, ScannedBlock, i);
+        touch_entry (priv, blk->block_id, blk->size, FALSE);
+    }
+
+    g_array_set_size (blocks, 0);
+    snprintf (path, sizeof(path), "%s/dirty", priv->cache_dir);
+    scan_dir (path, "", blocks);
+    for (i = 0; i < blocks->len; ++i) {
+        blk = &g_array_index (blocks, ScannedBlock, i);
+        touch_entry (priv, blk->block_id, blk->size, TRUE);
+        g_queue_push_tail (priv->flush_queue, g_strdup(blk->block_id));
+    }
+
+    g_array_free (blocks, TRUE);
+}
+
+static int
+init_cache_dir (const char *cache_dir)
+{
+    char path[PATH_MAX];
+    int i;
+
+    snprintf (path, sizeof(path), "%s/blocks", cache_dir);
+    if (checkdir_with_mkdir (path) < 0)
+        return -1;
+    for (i = 0; i < 256; ++i) {
+        snprintf (path, sizeof(path), "%s/blocks/%02x", cache_dir, i);
+        if (checkdir_with_mkdir (path) < 0)
+            return -1;
+    }
+
+    snprintf (path, sizeof(path), "%s/dirty", cache_dir);
+    if (checkdir_with_mkdir (path) < 0)
+        return -1;
+    snprintf (path, sizeof(path), "%s/tmp", cache_dir);
+    if (checkdir_with_mkdir (path) < 0)
+        return -1;
+
+    return 0;
+}
+
+BlockBackend *
+block_backend_cache_new (BlockBackend *remote,
+                         const char *cache_dir,
+                         gint64 max_size,
+                         gboolean write_back,
+                         gboolean admit_always)
+{
+    BlockBackend *bend;
+    CachePriv *priv;
+    pthread_t tid;
+
+    if (init_cache_dir (cache_dir) < 0) {
+        g_warning ("[block cache] Failed to create cache dir %s.\n", cache_dir);
+        return NULL;
+    }
+
+    priv = g_new0 (CachePriv, 1);
+    priv->remote = remote;
+    priv->cache_dir = g_strdup (cache_dir);
+    priv->max_size = max_size;
+    priv->mode = write_back ? CACHE_WRITE_BACK : CACHE_WRITE_THROUGH;
+    priv->admit_always = admit_always;
+
+    pthread_mutex_init (&priv->lock, NULL);
+    pthread_cond_init (&priv->flush_cond, NULL);
+    priv->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, g_free);
+    priv->lru = g_queue_new ();
+    priv->doorkeeper = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+    priv->flush_queue = g_queue_new ();
+
+    remove_stale_tmp_files (priv);
+    load_cache_dir (priv);
+
+    /* Also needed in write-through mode, for dirty blocks left over
+     * from a write-back run. */
+    if (pthread_create (&tid, NULL, flush_thread, priv) != 0) {
+        g_warning ("[block cache] Failed to start flush thread.\n");
+        return NULL;
+    }
+    pthread_detach (tid);
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_cache_open_block;
+    bend->read_block = block_backend_cache_read_block;
+    bend->write_block = block_backend_cache_write_block;
+    bend->commit_block = block_backend_cache_commit_block;
+    bend->close_block = block_backend_cache_close_block;
+    bend->exists = block_backend_cache_exists;
+    bend->remove_block = block_backend_cache_remove_block;
+    bend->stat_block = block_backend_cache_stat_block;
+    bend->stat_block_by_handle = block_backend_cache_stat_block_by_handle;
+    bend->block_handle_free = block_backend_cache_block_handle_free;
+    bend->foreach_block = block_backend_cache_foreach_block;
+    if (remote->exists_batch)
+        bend->exists_batch = block_backend_cache_exists_batch;
+    if (remote->read_range)
+        bend->read_range = block_backend_cache_read_range;
+
+    return bend;
+}
@@ -8,11 +8,21 @@
 #include <rados/librados.h>
 #include <event2/buffer.h>
 
+#include <pthread.h>
+
 #include "utils.h"
 
 #define CEPH_COMMIT_EA_NAME "commit"
 #define MAX_BUFFER_SIZE 1 << 20 /* Buffer 1MB data */
 
+/* Read in the same operation as the stat, enough for most blocks. */
+#define FIRST_READ_SIZE (4 << 20)
+
+/* Operations in flight at a time in a batch. */
+#define MAX_AIO_INFLIGHT 64
+
+#define DEFAULT_LIST_THREADS 8
+
 struct _BHandle {
     char block_id[41];
     int rw_type;
@@ -21,6 +31,10 @@ struct _BHandle {
      * read/write data in small pieces for Rados.
      */
     struct evbuffer *buffer;
+
+    /* In async_io mode, a block is read with its size in one go. */
+    gboolean loaded;
+    uint64_t size;
 };
 
 typedef struct {
@@ -28,6 +42,17 @@ typedef struct {
     char *poolname;
     rados_t cluster;
     rados_ioctx_t io;
+    /*
+     * Use compound operations: a block is written and committed in one
+     * operation, read together with its size, and exists checks of a
+     * batch are sent in parallel.
+     */
+    gboolean async_io;
+
+    /* For foreach_block. list_rate is in objects per second, 0 if
+     * unlimited. */
+    int list_threads;
+    int list_rate;
 } CephPriv;
 
 BHandle *
@@ -50,6 +75,47 @@ block_backend_ceph_open_block (BlockBackend *bend,
     return handle;
 }
 
+#ifdef HAVE_RADOS_OPS
+/* Read the size and the whole content of a block into its buffer. */
+static int
+load_block (CephPriv *priv, BHandle *handle)
+{
+    rados_read_op_t op;
+    char *buf;
+    size_t n_read = 0;
+    time_t mtime;
+    int stat_ret = 0, read_ret = 0;
+    int err;
+
+    buf = g_new (char, FIRST_READ_SIZE);
+
+    op = rados_create_read_op ();
+    rados_read_op_stat (op, &handle->size, &mtime, &stat_ret);
+    rados_read_op_read (op, 0, FIRST_READ_SIZE, buf, &n_read, &read_ret);
+    err = rados_read_op_operate (op, priv->io, handle->block_id, 0);
+    rados_release_read_op (op);
+
+    if (err < 0 || stat_ret < 0 || read_ret < 0) {
+        seaf_warning ("[block bend] Failed to read block %s.\n",
+                      handle->block_id);
+        g_free (buf);
+        return -1;
+    }
+
+    if (evbuffer_add (handle->buffer, buf, n_read) < 0) {
+        seaf_warning ("[block bend] Failed to add to buffer.\n");
+        g_free (buf);
+        return -1;
+    }
+    g_free (buf);
+
+    /* Larger blocks are read on as usual. */
+    handle->off = n_read;
+    handle->loaded = TRUE;
+    return 0;
+}
+#endif
+
 int
 block_backend_ceph_read_block (BlockBackend *bend, BHandle *handle,
                                void *buf, int len)
@@ -58,6 +124,15 @@ block_backend_ceph_read_block (BlockBackend *bend, BHandle *handle,
     char *tmp_buf;
     int ret;
 
+#ifdef HAVE_RADOS_OPS
+    if (priv->async_io) {
+        if (!handle->loaded && load_block (priv, handle) < 0)
+            return -1;
+        if (handle->off >= handle->size)
+            return evbuffer_remove (handle->buffer, buf, len);
+    }
+#endif
+
     if (len <= evbuffer_get_length (handle->buffer)) {
         evbuffer_remove (handle->buffer, buf, len);
         return len;
@@ -157,7 +232,9 @@ block_backend_ceph_write_block (BlockBackend *bend,
         return -1;
     }
 
-    if (evbuffer_get_length (handle->buffer) < MAX_BUFFER_SIZE)
+    /* In async_io mode the whole block is written on commit. */
+    if (priv->async_io ||
+        evbuffer_get_length (handle->buffer) < MAX_BUFFER_SIZE)
         return len;
 
     return flush_buffer (priv->io, handle);
@@ -168,7 +245,7 @@ block_backend_ceph_close_block (BlockBackend *bend, BHandle *handle)
 {
     CephPriv *priv = bend->be_priv;
 
-    if (handle->rw_type == BLOCK_WRITE &&
+    if (!priv->async_io && handle->rw_type == BLOCK_WRITE &&
         evbuffer_get_length (handle->buffer) != 0)
         return flush_buffer (priv->io, handle);
 
@@ -182,6 +259,36 @@ block_backend_ceph_block_handle_free (BlockBackend *bend, BHandle *handle)
     g_free (handle);
 }
 
+#ifdef HAVE_RADOS_OPS
+/* Write the buffered block and its commit attribute in one operation. */
+static int
+write_and_commit (CephPriv *priv, BHandle *handle)
+{
+    rados_write_op_t op;
+    size_t len;
+    char *data;
+    int err;
+
+    len = evbuffer_get_length (handle->buffer);
+    data = (char *)evbuffer_pullup (handle->buffer, -1);
+
+    op = rados_create_write_op ();
+    rados_write_op_write_full (op, data, len);
+    rados_write_op_setxattr (op, CEPH_COMMIT_EA_NAME, "1", 1);
+    err = rados_write_op_operate (op, priv->io, handle->block_id, NULL, 0);
+    rados_release_write_op (op);
+
+    if (err < 0) {
+        seaf_warning ("[block bend] Failed to write block %s: %s\n",
+                      handle->block_id, strerror(-err));
+        return -1;
+    }
+
+    evbuffer_drain (handle->buffer, len);
+    return 0;
+}
+#endif
+
 int
 block_backend_ceph_commit_block (BlockBackend *bend, BHandle *handle)
 {
@@ -192,6 +299,11 @@ block_backend_ceph_commit_block (BlockBackend *bend, BHandle *handle)
 
     g_assert (handle->rw_type == BLOCK_WRITE);
 
+#ifdef HAVE_RADOS_OPS
+    if (priv->async_io)
+        return write_and_commit (priv, handle);
+#endif
+
     err = rados_setxattr (priv->io, handle->block_id, key,
                           value, strlen(value));
     if (err < 0) {
@@ -231,6 +343,51 @@ block_backend_ceph_block_exists (BlockBackend *bend, const char *block_sha1)
     return TRUE;
 }
 
+#ifdef HAVE_RADOS_OPS
+/*
+ * Check the commit attribute of many blocks with compare operations,
+ * up to MAX_AIO_INFLIGHT of them in flight at a time.
+ */
+static void
+block_backend_ceph_exists_batch (BlockBackend *bend,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *exists)
+{
+    CephPriv *priv = bend->be_priv;
+    rados_read_op_t ops[MAX_AIO_INFLIGHT];
+    rados_completion_t comps[MAX_AIO_INFLIGHT];
+    int started[MAX_AIO_INFLIGHT];
+    int base, n, i;
+    int err;
+
+    for (base = 0; base < n_blocks; base += MAX_AIO_INFLIGHT) {
+        n = MIN (n_blocks - base, MAX_AIO_INFLIGHT);
+
+        for (i = 0; i < n; ++i) {
+            exists[base + i] = FALSE;
+            ops[i] = rados_create_read_op ();
+            rados_read_op_cmpxattr (ops[i], CEPH_COMMIT_EA_NAME,
+                                    LIBRADOS_CMPXATTR_OP_EQ, "1", 1);
+            rados_aio_create_completion (NULL, NULL, NULL, &comps[i]);
+            err = rados_aio_read_op_operate (ops[i], priv->io, comps[i],
+                                             block_ids[base + i], 0);
+            started[i] = (err == 0);
+        }
+
+        /* A failed compare or a missing block fails the operation. */
+        for (i = 0; i < n; ++i) {
+            if (started[i]) {
+                rados_aio_wait_for_complete (comps[i]);
+                exists[base + i] = (rados_aio_get_return_value (comps[i]) >= 0);
+            }
+            rados_aio_release (comps[i]);
+            rados_release_read_op (ops[i]);
+        }
+    }
+}
+#endif
+
 int
 block_backend_ceph_remove_block (BlockBackend *bend,
                                  const char *block_id)
@@ -251,6 +408,29 @@ block_backend_ceph_remove_block (BlockBackend *bend,
     return 0;
 }
 
+int
+block_backend_ceph_read_range (BlockBackend *bend, const char *block_id,
+                               guint64 offset, void *buf, int len)
+{
+    CephPriv *priv = bend->be_priv;
+    int n = 0, ret;
+
+    while (n < len) {
+        ret = rados_read (priv->io, block_id, (char *)buf + n, len - n,
+                          offset + n);
+        if (ret < 0) {
+            seaf_warning ("[block bend] Failed to read block %s: %s.\n",
+                          block_id, strerror(-ret));
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        n += ret;
+    }
+
+    return n;
+}
+
 BMetadata *
 block_backend_ceph_stat_block (BlockBackend *bend,
                                const char *block_id)
@@ -277,15 +457,292 @@ BMetadata *
 block_backend_ceph_stat_block_by_handle (BlockBackend *bend,
                                          BHandle *handle)
 {
+#ifdef HAVE_RADOS_OPS
+    CephPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    /* Reading a block starts with a stat, so fetch the data with it. */
+    if (priv->async_io && handle->rw_type == BLOCK_READ) {
+        if (!handle->loaded && load_block (priv, handle) < 0)
+            return NULL;
+        block_md = g_new0(BMetadata, 1);
+        memcpy (block_md->id, handle->block_id, 40);
+        block_md->size = (uint32_t)handle->size;
+        return block_md;
+    }
+#endif
+
     return block_backend_ceph_stat_block(bend, handle->block_id);
 }
 
+/*
+ * Listing the pool. Every worker thread lists the placement groups
+ * i, i + n_threads, ... by seeking to their hash positions. The callback
+ * is not expected to be thread safe, so it is called under a lock, with
+ * the ids a worker has collected.
+ */
+
+#define LIST_BATCH 256
+
+typedef struct ListData {
+    CephPriv        *priv;
+    SeafBlockFunc   process;
+    void            *user_data;
+    guint32         n_pgs;      /* 0 if unknown */
+    int             n_threads;
+
+    pthread_mutex_t lock;
+    gboolean        stop;
+} ListData;
+
+typedef struct ListWorker {
+    ListData        *data;
+    int             id;
+    pthread_t       thread;
+    gboolean        error;
+} ListWorker;
+
+static gboolean
+is_block_id (const char *name)
+{
+    int i;
+
+    for (i = 0; i < 40; ++i) {
+        if (!g_ascii_isxdigit (name[i]))
+            return FALSE;
+    }
+    return name[40] == '\0';
+}
+
+/* Returns FALSE if listing should stop. */
+static gboolean
+process_batch (ListData *data, char ids[][41], int n)
+{
+    gboolean ret;
+    int i;
+
+    pthread_mutex_lock (&data->lock);
+    for (i = 0; i < n && !data->stop; ++i) {
+        if (!data->process (ids[i], data->user_data))
+            data->stop = TRUE;
+    }
+    ret = !data->stop;
+    pthread_mutex_unlock (&data->lock);
+
+    return ret;
+}
+
+static gint64
+now_usec ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+/* Keep each worker to its share of the configured listing rate. */
+static void
+throttle (ListData *data, gint64 start, guint64 n_listed)
+{
+    gint64 elapsed, due;
+
+    if (data->priv->list_rate <= 0)
+        return;
+
+    due = (gint64)(n_listed * G_USEC_PER_SEC * data->n_threads /
+                   data->priv->list_rate);
+    elapsed = now_usec () - start;
+    if (due > elapsed && due - elapsed < 10 * G_USEC_PER_SEC)
+        g_usleep (due - elapsed);
+}
+
+#ifdef HAVE_RADOS_NOBJECTS_LIST
+#define list_open rados_nobjects_list_open
+#define list_seek rados_nobjects_list_seek
+#define list_get_pg_hash_position rados_nobjects_list_get_pg_hash_position
+#define list_close rados_nobjects_list_close
+#define list_next(ctx, entry) rados_nobjects_list_next ((ctx), (entry), NULL, NULL)
+#else
+#define list_open rados_objects_list_open
+#define list_seek rados_objects_list_seek
+#define list_get_pg_hash_position rados_objects_list_get_pg_hash_position
+#define list_close rados_objects_list_close
+#define list_next(ctx, entry) rados_objects_list_next ((ctx), (entry), NULL)
+#endif
+
+/*
+ * List the objects at the current position of @ctx until the listing is
+ * done, or moves on from @pg if @pg is not -1. Returns -1 on error and 1
+ * if the callback stopped the listing.
+ */
+static int
+list_objects (ListData *data, rados_list_ctx_t ctx, gint64 pg,
+              char ids[][41], int *n, guint64 *n_listed, gint64 start)
+{
+    const char *name;
+    int err;
+
+    while (pg < 0 || list_get_pg_hash_position (ctx) == pg) {
+        err = list_next (ctx, &name);
+        if (err == -ENOENT)
+            break;
+        if (err < 0) {
+            seaf_warning ("[block bend] Failed to list pool %s: %s.\n",
+                          data->priv->poolname, strerror(-err));
+            return -1;
+        }
+
+        /* Names are only valid until the next call. */
+        if (!is_block_id (name))
+            continue;
+        memcpy (ids[(*n)++], name, 41);
+        ++(*n_listed);
+
+        if (*n == LIST_BATCH) {
+            if (!process_batch (data, ids, *n))
+                return 1;
+            *n = 0;
+            throttle (data, start, *n_listed);
+        }
+    }
+
+    return 0;
+}
+
+static void *
+list_worker (void *vworker)
+{
+    ListWorker *worker = vworker;
+    ListData *data = worker->data;
+    rados_list_ctx_t ctx;
+    char (*ids)[41];
+    guint64 n_listed = 0;
+    gint64 start = now_usec ();
+    guint32 pg;
+    int n = 0;
+    int ret = 0;
+    int err;
+
+    err = list_open (data->priv->io, &ctx);
+    if (err < 0) {
+        seaf_warning ("[block bend] Failed to list pool %s: %s.\n",
+                      data->priv->poolname, strerror(-err));
+        worker->error = TRUE;
+        return NULL;
+    }
+
+    ids = g_malloc (LIST_BATCH * 41);
+
+    if (data->n_pgs == 0) {
+        ret = list_objects (data, ctx, -1, ids, &n, &n_listed, start);
+    } else {
+        for (pg = worker->id; pg < data->n_pgs && ret == 0;
+             pg += data->n_threads) {
+            /* An empty pg is skipped by the seek. */
+            if (list_seek (ctx, pg) != pg)
+                continue;
+            ret = list_objects (data, ctx, pg, ids, &n, &n_listed, start);
+        }
+    }
+
+    if (ret == 0)
+        process_batch (data, ids, n);
+    else if (ret < 0)
+        worker->error = TRUE;
+
+    g_free (ids);
+    list_close (ctx);
+    return NULL;
+}
+
+/* Number of placement groups of the pool, from the monitor. */
+static guint32
+get_pg_num (CephPriv *priv)
+{
+    char *cmd[1];
+    char *outbuf = NULL, *outs = NULL;
+    size_t outbuf_len = 0, outs_len = 0;
+    char *pos;
+    guint32 pg_num = 0;
+    int err;
+
+    cmd[0] = g_strdup_printf ("{\"prefix\": \"osd pool get\", \"pool\": \"%s\","
+                              " \"var\": \"pg_num\", \"format\": \"json\"}",
+                              priv->poolname);
+    err = rados_mon_command (priv->cluster, (const char **)cmd, 1, "", 0,
+                             &outbuf, &outbuf_len, &outs, &outs_len);
+    g_free (cmd[0]);
+    if (err < 0) {
+        seaf_warning ("[block bend] Failed to get pg_num of pool %s: %s.\n",
+                      priv->poolname, strerror(-err));
+        goto out;
+    }
+
+    /* The reply looks like {"pool":"x","pool_id":1,"pg_num":64}. */
+    if (outbuf) {
+        char *reply = g_strndup (outbuf, outbuf_len);
+        pos = strstr (reply, "\"pg_num\":");
+        if (pos)
+            pg_num = (guint32)strtoul (pos + strlen("\"pg_num\":"), NULL, 10);
+        g_free (reply);
+    }
+
+out:
+    if (outbuf)
+        rados_buffer_free (outbuf);
+    if (outs)
+        rados_buffer_free (outs);
+    return pg_num;
+}
+
 int
 block_backend_ceph_foreach_block (BlockBackend *bend,
                                   SeafBlockFunc process,
                                   void *user_data)
 {
-    return 0;
+    CephPriv *priv = bend->be_priv;
+    ListData data;
+    ListWorker *workers;
+    int n_threads, n_started, i;
+    int ret = 0;
+
+    memset (&data, 0, sizeof(data));
+    data.priv = priv;
+    data.process = process;
+    data.user_data = user_data;
+    pthread_mutex_init (&data.lock, NULL);
+
+    /* Without the number of pgs, the pool is listed by one thread. */
+    data.n_pgs = get_pg_num (priv);
+    if (data.n_pgs == 0)
+        n_threads = 1;
+    else
+        n_threads = MIN (priv->list_threads, (int)data.n_pgs);
+    data.n_threads = n_threads;
+
+    workers = g_new0 (ListWorker, n_threads);
+    for (n_started = 0; n_started < n_threads; ++n_started) {
+        workers[n_started].data = &data;
+        workers[n_started].id = n_started;
+        if (pthread_create (&workers[n_started].thread, NULL,
+                            list_worker, &workers[n_started]) != 0) {
+            seaf_warning ("[block bend] Failed to start list thread.\n");
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < n_started; ++i) {
+        pthread_join (workers[i].thread, NULL);
+        if (workers[i].error)
+            ret = -1;
+    }
+
+    g_free (workers);
+    pthread_mutex_destroy (&data.lock);
+
+    return ret;
 }
 
 static int ceph_init (CephPriv *priv, const char *ceph_conf,
@@ -326,7 +783,8 @@ static int ceph_init (CephPriv *priv, const char *ceph_conf,
 }
 
 BlockBackend *
-block_backend_ceph_new (const char *ceph_conf, const char *poolname)
+block_backend_ceph_new (const char *ceph_conf, const char *poolname,
+                        gboolean async_io, int list_threads, int list_rate)
 {
     BlockBackend *bend;
     CephPriv *priv;
@@ -335,6 +793,17 @@ block_backend_ceph_new (const char *ceph_conf, const char *poolname)
     priv = g_new0(CephPriv, 1);
     bend->be_priv = priv;
 
+    priv->list_threads = (list_threads > 0) ? list_threads : DEFAULT_LIST_THREADS;
+    priv->list_rate = (list_rate > 0) ? list_rate : 0;
+
+#ifdef HAVE_RADOS_OPS
+    priv->async_io = async_io;
+#else
+    if (async_io)
+        seaf_warning ("[Block backend] librados has no compound operations,"
+                      " async_io is disabled.\n");
+#endif
+
     if (ceph_init(priv, ceph_conf, poolname) < 0) {
         g_warning ("[Block backend] Failed to init ceph: pool name is %s.\n",
                    poolname);
@@ -352,6 +821,11 @@ block_backend_ceph_new (const char *ceph_conf, const char *poolname)
     bend->stat_block_by_handle = block_backend_ceph_stat_block_by_handle;
     bend->block_handle_free = block_backend_ceph_block_handle_free;
     bend->foreach_block = block_backend_ceph_foreach_block;
+    bend->read_range = block_backend_ceph_read_range;
+#ifdef HAVE_RADOS_OPS
+    if (priv->async_io)
+        bend->exists_batch = block_backend_ceph_exists_batch;
+#endif
 
     return bend;
 
@@ -365,7 +839,8 @@ error:
 #else
 
 BlockBackend *
-block_backend_ceph_new (const char *ceph_conf, const char *poolname)
+block_backend_ceph_new (const char *ceph_conf, const char *poolname,
+                        gboolean async_io, int list_threads, int list_rate)
 {
     seaf_warning ("Rados backend is not enabled.\n");
     return NULL;
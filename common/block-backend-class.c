@@ -0,0 +1,516 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block backend that routes blocks to one of several named backends, the
+ * storage classes. See load_storage_classes() in block-backend.h.
+ *
+ * Blocks are content addressed and shared between repos, so a block may
+ * be in more than one class. A read looks in the given class first and
+ * then in the others in order, the default first. Index 0 is the default.
+ */
+
+#include "common.h"
+
+#include "block-backend.h"
+
+/* Blocks are moved in pieces of this size. */
+#define MOVE_BUF_SIZE (1 << 20)
+
+typedef struct ClassPriv {
+    char         **names;
+    BlockBackend **backends;
+    int            n;
+} ClassPriv;
+
+struct _BHandle {
+    BlockBackend *bend;         /* backend of the class */
+    BHandle      *inner;
+};
+
+static BHandle *
+wrap_handle (BlockBackend *bend, BHandle *inner)
+{
+    BHandle *handle;
+
+    if (!inner)
+        return NULL;
+
+    handle = g_new0 (BHandle, 1);
+    handle->bend = bend;
+    handle->inner = inner;
+    return handle;
+}
+
+/* First class that has @block_id, starting at @first. */
+static int
+find_block (ClassPriv *priv, int first, const char *block_id)
+{
+    BlockBackend *b;
+    int i;
+
+    b = priv->backends[first];
+    if (b->exists (b, block_id))
+        return first;
+
+    for (i = 0; i < priv->n; ++i) {
+        if (i == first)
+            continue;
+        b = priv->backends[i];
+        if (b->exists (b, block_id))
+            return i;
+    }
+
+    return -1;
+}
+
+BHandle *
+block_backend_class_open_block (BlockBackend *bend, int class_idx,
+                                const char *block_id, int rw_type)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i;
+
+    if (class_idx < 0 || class_idx >= priv->n)
+        class_idx = 0;
+
+    if (rw_type == BLOCK_READ) {
+        i = find_block (priv, class_idx, block_id);
+        if (i < 0)
+            return NULL;
+        class_idx = i;
+    }
+
+    b = priv->backends[class_idx];
+    return wrap_handle (b, b->open_block (b, block_id, rw_type));
+}
+
+static BHandle *
+block_backend_class_open (BlockBackend *bend,
+                          const char *block_id,
+                          int rw_type)
+{
+    return block_backend_class_open_block (bend, 0, block_id, rw_type);
+}
+
+static int
+block_backend_class_read_block (BlockBackend *bend,
+                                BHandle *handle,
+                                void *buf, int len)
+{
+    return handle->bend->read_block (handle->bend, handle->inner, buf, len);
+}
+
+static int
+block_backend_class_write_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 const void *buf, int len)
+{
+    return handle->bend->write_block (handle->bend, handle->inner, buf, len);
+}
+
+static int
+block_backend_class_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    return handle->bend->commit_block (handle->bend, handle->inner);
+}
+
+static int
+block_backend_class_close_block (BlockBackend *bend, BHandle *handle)
+{
+    return handle->bend->close_block (handle->bend, handle->inner);
+}
+
+static void
+block_backend_class_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    handle->bend->block_handle_free (handle->bend, handle->inner);
+    g_free (handle);
+}
+
+static BMetadata *
+block_backend_class_stat_block_by_handle (BlockBackend *bend,
+                                          BHandle *handle)
+{
+    return handle->bend->stat_block_by_handle (handle->bend, handle->inner);
+}
+
+static int
+block_backend_class_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    if (!handle->bend->get_fd)
+        return -1;
+    return handle->bend->get_fd (handle->bend, handle->inner);
+}
+
+static int
+block_backend_class_exists (BlockBackend *bend, const char *block_id)
+{
+    return (find_block (bend->be_priv, 0, block_id) >= 0);
+}
+
+/* Only the blocks not found yet are looked up in the next class. */
+static void
+block_backend_class_exists_batch (BlockBackend *bend,
+                                  const char **block_ids,
+                                  int n_blocks,
+                                  gboolean *exists)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    const char **rest;
+    gboolean *rest_exists;
+    int *rest_idx;
+    int i, j, n_rest;
+
+    memset (exists, 0, sizeof(gboolean) * n_blocks);
+
+    rest = g_new (const char *, n_blocks);
+    rest_exists = g_new (gboolean, n_blocks);
+    rest_idx = g_new (int, n_blocks);
+
+    for (i = 0; i < priv->n; ++i) {
+        n_rest = 0;
+        for (j = 0; j < n_blocks; ++j) {
+            if (!exists[j]) {
+                rest[n_rest] = block_ids[j];
+                rest_idx[n_rest++] = j;
+            }
+        }
+        if (n_rest == 0)
+            break;
+
+        b = priv->backends[i];
+        if (b->exists_batch) {
+            b->exists_batch (b, rest, n_rest, rest_exists);
+        } else {
+            for (j = 0; j < n_rest; ++j)
+                rest_exists[j] = b->exists (b, rest[j]);
+        }
+
+        for (j = 0; j < n_rest; ++j) {
+            if (rest_exists[j])
+                exists[rest_idx[j]] = TRUE;
+        }
+    }
+
+    g_free (rest);
+    g_free (rest_exists);
+    g_free (rest_idx);
+}
+
+/* From every class, since a block may be in several. */
+static int
+block_backend_class_remove_block (BlockBackend *bend, const char *block_id)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i, ret = 0;
+
+    for (i = 0; i < priv->n; ++i) {
+        b = priv->backends[i];
+        if (b->exists (b, block_id) && b->remove_block (b, block_id) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static BMetadata *
+block_backend_class_stat_block (BlockBackend *bend, const char *block_id)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i;
+
+    i = find_block (priv, 0, block_id);
+    if (i < 0)
+        return NULL;
+
+    b = priv->backends[i];
+    return b->stat_block (b, block_id);
+}
+
+static int
+block_backend_class_read_range (BlockBackend *bend, const char *block_id,
+                                guint64 offset, void *buf, int len)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i;
+
+    i = find_block (priv, 0, block_id);
+    if (i < 0)
+        return -1;
+
+    b = priv->backends[i];
+    return b->read_range (b, block_id, offset, buf, len);
+}
+
+/* A block that is in several classes is visited once for each. */
+static int
+block_backend_class_foreach_block (BlockBackend *bend,
+                                   SeafBlockFunc process,
+                                   void *user_data)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i;
+
+    for (i = 0; i < priv->n; ++i) {
+        b = priv->backends[i];
+        if (b->foreach_block (b, process, user_data) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+block_backend_class_foreach_block_parallel (BlockBackend *bend,
+                                            int n_threads,
+                                            SeafBlockFunc process,
+                                            void *user_data)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i, ret;
+
+    for (i = 0; i < priv->n; ++i) {
+        b = priv->backends[i];
+        if (b->foreach_block_parallel)
+            ret = b->foreach_block_parallel (b, n_threads, process, user_data);
+        else
+            ret = b->foreach_block (b, process, user_data);
+        if (ret < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+block_backend_class_compact (BlockBackend *bend)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i, ret = 0;
+
+    for (i = 0; i < priv->n; ++i) {
+        b = priv->backends[i];
+        if (b->compact && b->compact (b) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * A partial block is kept by the class it was written to, which isn't
+ * known on resume, so all classes are asked.
+ */
+static guint32
+block_backend_class_partial_size (BlockBackend *bend, const char *block_id)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    guint32 size;
+    int i;
+
+    for (i = 0; i < priv->n; ++i) {
+        b = priv->backends[i];
+        if (b->partial_size && (size = b->partial_size (b, block_id)) > 0)
+            return size;
+    }
+
+    return 0;
+}
+
+static BHandle *
+block_backend_class_open_partial (BlockBackend *bend, const char *block_id,
+                                  guint32 offset)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    BHandle *inner;
+    int i;
+
+    for (i = 0; i < priv->n; ++i) {
+        b = priv->backends[i];
+        if (!b->partial_size || !b->open_partial ||
+            b->partial_size (b, block_id) == 0)
+            continue;
+        inner = b->open_partial (b, block_id, offset);
+        if (inner)
+            return wrap_handle (b, inner);
+    }
+
+    return NULL;
+}
+
+static int
+block_backend_class_remove_partial (BlockBackend *bend, const char *block_id)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *b;
+    int i, ret = 0;
+
+    for (i = 0; i < priv->n; ++i) {
+        b = priv->backends[i];
+        if (b->remove_partial && b->remove_partial (b, block_id) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int
+block_backend_class_find (BlockBackend *bend, const char *name)
+{
+    ClassPriv *priv = bend->be_priv;
+    int i;
+
+    for (i = 0; i < priv->n; ++i) {
+        if (strcmp (priv->names[i], name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+const char *
+block_backend_class_name (BlockBackend *bend, int class_idx)
+{
+    ClassPriv *priv = bend->be_priv;
+
+    return priv->names[class_idx];
+}
+
+static int
+copy_block (BlockBackend *src, BlockBackend *dst, const char *block_id)
+{
+    BHandle *in, *out;
+    char *buf;
+    int n, ret = 0;
+
+    in = src->open_block (src, block_id, BLOCK_READ);
+    if (!in)
+        return -1;
+    out = dst->open_block (dst, block_id, BLOCK_WRITE);
+    if (!out) {
+        src->close_block (src, in);
+        src->block_handle_free (src, in);
+        return -1;
+    }
+
+    buf = g_malloc (MOVE_BUF_SIZE);
+    while ((n = src->read_block (src, in, buf, MOVE_BUF_SIZE)) > 0) {
+        if (dst->write_block (dst, out, buf, n) != n) {
+            ret = -1;
+            break;
+        }
+    }
+    if (n < 0)
+        ret = -1;
+    g_free (buf);
+
+    src->close_block (src, in);
+    src->block_handle_free (src, in);
+
+    if (dst->close_block (dst, out) < 0)
+        ret = -1;
+    if (ret == 0 && dst->commit_block (dst, out) < 0)
+        ret = -1;
+    dst->block_handle_free (dst, out);
+
+    return ret;
+}
+
+int
+block_backend_class_move_block (BlockBackend *bend, int class_idx,
+                                const char *block_id)
+{
+    ClassPriv *priv = bend->be_priv;
+    BlockBackend *dst, *b;
+    int src_idx, i;
+
+    dst = priv->backends[class_idx];
+    if (!dst->exists (dst, block_id)) {
+        src_idx = find_block (priv, class_idx, block_id);
+        if (src_idx < 0)
+            return -1;
+        if (copy_block (priv->backends[src_idx], dst, block_id) < 0) {
+            g_warning ("[storage class] Failed to copy block %s to %s.\n",
+                       block_id, priv->names[class_idx]);
+            return -1;
+        }
+    }
+
+    /* The block is in @class_idx now, so new reads find it there. A
+     * read that already opened an old copy may fail on backends that
+     * don't keep removed blocks open. */
+    for (i = 0; i < priv->n; ++i) {
+        if (i == class_idx)
+            continue;
+        b = priv->backends[i];
+        if (b->exists (b, block_id))
+            b->remove_block (b, block_id);
+    }
+
+    return 0;
+}
+
+BlockBackend *
+block_backend_class_new (char **names, BlockBackend **backends, int n)
+{
+    BlockBackend *bend;
+    ClassPriv *priv;
+    gboolean all_get_fd = TRUE, all_read_range = TRUE;
+    gboolean any_partial = FALSE;
+    int i;
+
+    priv = g_new0 (ClassPriv, 1);
+    priv->names = g_new0 (char *, n + 1);
+    priv->backends = g_new0 (BlockBackend *, n);
+    priv->n = n;
+    for (i = 0; i < n; ++i) {
+        priv->names[i] = g_strdup (names[i]);
+        priv->backends[i] = backends[i];
+        if (!backends[i]->get_fd)
+            all_get_fd = FALSE;
+        if (!backends[i]->read_range)
+            all_read_range = FALSE;
+        if (backends[i]->partial_size)
+            any_partial = TRUE;
+    }
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_class_open;
+    bend->read_block = block_backend_class_read_block;
+    bend->write_block = block_backend_class_write_block;
+    bend->commit_block = block_backend_class_commit_block;
+    bend->close_block = block_backend_class_close_block;
+    bend->exists = block_backend_class_exists;
+    bend->remove_block = block_backend_class_remove_block;
+    bend->stat_block = block_backend_class_stat_block;
+    bend->stat_block_by_handle = block_backend_class_stat_block_by_handle;
+    bend->block_handle_free = block_backend_class_block_handle_free;
+    bend->foreach_block = block_backend_class_foreach_block;
+    bend->exists_batch = block_backend_class_exists_batch;
+    bend->foreach_block_parallel = block_backend_class_foreach_block_parallel;
+    bend->compact = block_backend_class_compact;
+    /* Blocks opened as files must be local files in every class. */
+    if (all_get_fd)
+        bend->get_fd = block_backend_class_get_fd;
+    if (all_read_range)
+        bend->read_range = block_backend_class_read_range;
+    if (any_partial) {
+        bend->partial_size = block_backend_class_partial_size;
+        bend->open_partial = block_backend_class_open_partial;
+        bend->remove_partial = block_backend_class_remove_partial;
+    }
+
+    return bend;
+}
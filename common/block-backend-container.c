@@ -0,0 +1,1081 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block backend that packs small blocks into larger container blocks of
+ * another backend, to save the per-block cost of the latter.
+ *
+ * A block smaller than the threshold is still committed to the inner
+ * backend on its own, so commit is as durable as before. It is also
+ * appended to the container this process is filling. Once the container
+ * is full, or has waited long enough, it is written to the inner backend
+ * under a random id, its blocks are recorded in the database, and their
+ * own copies are removed.
+ *
+ * The database is shared by all processes and servers:
+ *   BlockContainer (container_id, size, live_size)
+ *   ContainedBlock (block_id, container_id, pos, size)
+ *
+ * Removing a contained block only drops its row. A container is removed
+ * once none of its blocks are left, and compact() rewrites containers
+ * that are mostly garbage. Readers look a block up again if its
+ * container went away meanwhile.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "block-backend.h"
+#include "seaf-db.h"
+
+#define DEFAULT_CONTAINER_SIZE (8 << 20)
+
+/* A container is flushed if it hasn't filled up in this time. */
+#define FLUSH_INTERVAL 30
+
+/* Containers with less live data than this are rewritten by compact(). */
+#define COMPACT_LIVE_RATIO 0.5
+
+/* Block ids per query when checking for contained blocks. */
+#define QUERY_BATCH 100
+
+struct _BHandle {
+    char        block_id[41];
+    int         rw_type;
+    BHandle     *inner;     /* NULL for a contained block */
+
+    /* Contained block being read. */
+    char        *data;
+    int         size;
+    int         pos;
+
+    /* Copy of a block being written, while it's small enough. */
+    GByteArray  *copy;
+};
+
+typedef struct PendingBlock {
+    char        block_id[41];
+    guint64     pos;
+    int         size;
+} PendingBlock;
+
+typedef struct ContainerPriv {
+    BlockBackend    *inner;
+    SeafDB          *db;
+    int             threshold;
+    int             container_size;
+
+    /* Container being filled by this process. */
+    pthread_mutex_t lock;
+    GByteArray      *pending;
+    GList           *pending_blocks;
+    GHashTable      *pending_ids;
+    time_t          pending_since;
+} ContainerPriv;
+
+typedef struct BlockLoc {
+    char        container_id[41];
+    guint64     pos;
+    int         size;
+} BlockLoc;
+
+static gboolean
+get_loc (SeafDBRow *row, void *data)
+{
+    BlockLoc *loc = data;
+
+    g_strlcpy (loc->container_id, seaf_db_row_get_column_text (row, 0), 41);
+    loc->pos = (guint64)seaf_db_row_get_column_int64 (row, 1);
+    loc->size = seaf_db_row_get_column_int (row, 2);
+
+    return FALSE;
+}
+
+/* Returns 1 if @block_id is contained, 0 if not and -1 on error. */
+static int
+lookup_block (ContainerPriv *priv, const char *block_id, BlockLoc *loc)
+{
+    char sql[256];
+
+    loc->container_id[0] = '\0';
+    snprintf (sql, sizeof(sql),
+              "SELECT container_id, pos, size FROM ContainedBlock "
+              "WHERE block_id='%s'", block_id);
+    if (seaf_db_foreach_selected_row (priv->db, sql, get_loc, loc) < 0)
+        return -1;
+
+    return (loc->container_id[0] != '\0');
+}
+
+static int
+read_container (ContainerPriv *priv, const char *container_id,
+                guint64 pos, char *buf, int len)
+{
+    BlockBackend *inner = priv->inner;
+    BHandle *handle;
+    char *skip;
+    guint64 skipped = 0;
+    int n = 0, ret;
+
+    if (inner->read_range)
+        return inner->read_range (inner, container_id, pos, buf, len);
+
+    /* Without ranged reads, read up to the block. */
+    handle = inner->open_block (inner, container_id, BLOCK_READ);
+    if (!handle)
+        return -1;
+
+    skip = g_malloc (64 * 1024);
+    while (skipped < pos) {
+        ret = inner->read_block (inner, handle, skip,
+                                 (int)MIN (pos - skipped, 64 * 1024));
+        if (ret <= 0) {
+            n = -1;
+            goto out;
+        }
+        skipped += ret;
+    }
+
+    while (n < len) {
+        ret = inner->read_block (inner, handle, buf + n, len - n);
+        if (ret < 0) {
+            n = -1;
+            goto out;
+        }
+        if (ret == 0)
+            break;
+        n += ret;
+    }
+
+out:
+    g_free (skip);
+    inner->close_block (inner, handle);
+    inner->block_handle_free (inner, handle);
+    return n;
+}
+
+/* Read a contained block into @handle. Returns 1 if @block_id isn't
+ * contained. */
+static int
+load_contained (ContainerPriv *priv, BHandle *handle)
+{
+    BlockLoc loc;
+    int i, ret;
+
+    /* Look up again if the container was rewritten meanwhile. */
+    for (i = 0; i < 2; ++i) {
+        ret = lookup_block (priv, handle->block_id, &loc);
+        if (ret <= 0)
+            return (ret < 0) ? -1 : 1;
+
+        handle->data = g_malloc (loc.size);
+        if (read_container (priv, loc.container_id, loc.pos,
+                            handle->data, loc.size) == loc.size) {
+            handle->size = loc.size;
+            handle->pos = 0;
+            return 0;
+        }
+        g_free (handle->data);
+        handle->data = NULL;
+    }
+
+    g_warning ("[block container] Failed to read block %s from %s.\n",
+               handle->block_id, loc.container_id);
+    return -1;
+}
+
+static BHandle *
+block_backend_container_open_block (BlockBackend *bend,
+                                    const char *block_id,
+                                    int rw_type)
+{
+    ContainerPriv *priv = bend->be_priv;
+    BHandle *handle;
+    int ret;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_assert (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE);
+
+    handle = g_new0 (BHandle, 1);
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+
+    if (rw_type == BLOCK_READ) {
+        ret = load_contained (priv, handle);
+        if (ret == 0)
+            return handle;
+        if (ret < 0)
+            goto error;
+    }
+
+    handle->inner = priv->inner->open_block (priv->inner, block_id, rw_type);
+    if (!handle->inner) {
+        /* It may have been packed just now. */
+        if (rw_type == BLOCK_READ && load_contained (priv, handle) == 0)
+            return handle;
+        goto error;
+    }
+
+    if (rw_type == BLOCK_WRITE)
+        handle->copy = g_byte_array_new ();
+
+    return handle;
+
+error:
+    g_free (handle);
+    return NULL;
+}
+
+static int
+block_backend_container_read_block (BlockBackend *bend,
+                                    BHandle *handle,
+                                    void *buf, int len)
+{
+    ContainerPriv *priv = bend->be_priv;
+    int n;
+
+    if (handle->inner)
+        return priv->inner->read_block (priv->inner, handle->inner, buf, len);
+
+    n = MIN (len, handle->size - handle->pos);
+    memcpy (buf, handle->data + handle->pos, n);
+    handle->pos += n;
+    return n;
+}
+
+static int
+block_backend_container_write_block (BlockBackend *bend,
+                                     BHandle *handle,
+                                     const void *buf, int len)
+{
+    ContainerPriv *priv = bend->be_priv;
+    int n;
+
+    n = priv->inner->write_block (priv->inner, handle->inner, buf, len);
+    if (n <= 0 || !handle->copy)
+        return n;
+
+    if (handle->copy->len + n < priv->threshold) {
+        g_byte_array_append (handle->copy, buf, n);
+    } else {
+        g_byte_array_free (handle->copy, TRUE);
+        handle->copy = NULL;
+    }
+
+    return n;
+}
+
+static int
+block_backend_container_close_block (BlockBackend *bend, BHandle *handle)
+{
+    ContainerPriv *priv = bend->be_priv;
+
+    if (handle->inner)
+        return priv->inner->close_block (priv->inner, handle->inner);
+    return 0;
+}
+
+static char *
+new_container_id ()
+{
+    return g_strdup_printf ("%08x%08x%08x%08x%08x",
+                            g_random_int (), g_random_int (), g_random_int (),
+                            g_random_int (), g_random_int ());
+}
+
+static int
+write_container (ContainerPriv *priv, const char *container_id,
+                 const void *data, int len)
+{
+    BlockBackend *inner = priv->inner;
+    BHandle *handle;
+    int ret = 0;
+
+    handle = inner->open_block (inner, container_id, BLOCK_WRITE);
+    if (!handle)
+        return -1;
+
+    if (inner->write_block (inner, handle, data, len) != len ||
+        inner->close_block (inner, handle) < 0 ||
+        inner->commit_block (inner, handle) < 0) {
+        g_warning ("[block container] Failed to write container %s.\n",
+                   container_id);
+        ret = -1;
+    }
+
+    inner->block_handle_free (inner, handle);
+    return ret;
+}
+
+static gboolean
+get_int64 (SeafDBRow *row, void *data)
+{
+    gint64 *value = data;
+
+    *value = seaf_db_row_get_column_int64 (row, 0);
+    return FALSE;
+}
+
+/*
+ * Write @data as a new container holding @blocks and record them.
+ * Blocks that are contained already are skipped. Returns the id of the
+ * container, or NULL if none was needed or on error.
+ */
+static char *
+add_container (ContainerPriv *priv, GByteArray *data, GList *blocks)
+{
+    SeafDBTrans *trans;
+    PendingBlock *blk;
+    GList *ptr;
+    char *container_id;
+    char sql[256];
+    gint64 live_size = 0;
+
+    container_id = new_container_id ();
+    if (write_container (priv, container_id, data->data, data->len) < 0)
+        goto error;
+
+    trans = seaf_db_begin_transaction (priv->db);
+    if (!trans)
+        goto error;
+
+    snprintf (sql, sizeof(sql),
+              "INSERT INTO BlockContainer VALUES ('%s', %u, 0)",
+              container_id, data->len);
+    if (seaf_db_trans_query (trans, sql) < 0)
+        goto rollback;
+
+    for (ptr = blocks; ptr; ptr = ptr->next) {
+        blk = ptr->data;
+        snprintf (sql, sizeof(sql),
+                  "SELECT 1 FROM ContainedBlock WHERE block_id='%s'",
+                  blk->block_id);
+        if (seaf_db_trans_check_for_existence (trans, sql))
+            continue;
+
+        snprintf (sql, sizeof(sql),
+                  "INSERT INTO ContainedBlock VALUES "
+                  "('%s', '%s', %"G_GUINT64_FORMAT", %d)",
+                  blk->block_id, container_id, blk->pos, blk->size);
+        if (seaf_db_trans_query (trans, sql) < 0)
+            goto rollback;
+        live_size += blk->size;
+    }
+
+    if (live_size == 0) {
+        seaf_db_rollback (trans);
+        priv->inner->remove_block (priv->inner, container_id);
+        g_free (container_id);
+        return NULL;
+    }
+
+    snprintf (sql, sizeof(sql),
+              "UPDATE BlockContainer SET live_size=%"G_GINT64_FORMAT
+              " WHERE container_id='%s'", live_size, container_id);
+    if (seaf_db_trans_query (trans, sql) < 0)
+        goto rollback;
+
+    seaf_db_commit (trans);
+    return container_id;
+
+rollback:
+    seaf_db_rollback (trans);
+error:
+    priv->inner->remove_block (priv->inner, container_id);
+    g_free (container_id);
+    return NULL;
+}
+
+static void
+flush_blocks (ContainerPriv *priv, GByteArray *data, GList *blocks)
+{
+    PendingBlock *blk;
+    GList *ptr;
+    char *container_id;
+
+    container_id = add_container (priv, data, blocks);
+
+    /* Every block is now contained, by us or by another writer. */
+    if (container_id) {
+        for (ptr = blocks; ptr; ptr = ptr->next) {
+            blk = ptr->data;
+            priv->inner->remove_block (priv->inner, blk->block_id);
+        }
+    }
+
+    g_free (container_id);
+    g_byte_array_free (data, TRUE);
+    for (ptr = blocks; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (blocks);
+}
+
+/* Take the pending container for flushing. Called with the lock held. */
+static void
+take_pending (ContainerPriv *priv, GByteArray **data, GList **blocks)
+{
+    *data = priv->pending;
+    *blocks = g_list_reverse (priv->pending_blocks);
+
+    priv->pending = g_byte_array_new ();
+    priv->pending_blocks = NULL;
+    g_hash_table_remove_all (priv->pending_ids);
+}
+
+static void
+add_pending (ContainerPriv *priv, const char *block_id, GByteArray *copy)
+{
+    PendingBlock *blk;
+    GByteArray *data = NULL;
+    GList *blocks = NULL;
+
+    pthread_mutex_lock (&priv->lock);
+
+    if (!g_hash_table_lookup (priv->pending_ids, block_id)) {
+        if (!priv->pending_blocks)
+            priv->pending_since = time (NULL);
+
+        blk = g_new0 (PendingBlock, 1);
+        memcpy (blk->block_id, block_id, 41);
+        blk->pos = priv->pending->len;
+        blk->size = copy->len;
+        g_byte_array_append (priv->pending, copy->data, copy->len);
+        priv->pending_blocks = g_list_prepend (priv->pending_blocks, blk);
+        g_hash_table_insert (priv->pending_ids, blk->block_id, blk);
+
+        if (priv->pending->len >= priv->container_size)
+            take_pending (priv, &data, &blocks);
+    }
+
+    pthread_mutex_unlock (&priv->lock);
+
+    if (data)
+        flush_blocks (priv, data, blocks);
+}
+
+static void *
+flush_thread (void *vpriv)
+{
+    ContainerPriv *priv = vpriv;
+    GByteArray *data;
+    GList *blocks;
+
+    while (1) {
+        g_usleep (5 * G_USEC_PER_SEC);
+
+        data = NULL;
+        pthread_mutex_lock (&priv->lock);
+        if (priv->pending_blocks &&
+            time (NULL) - priv->pending_since >= FLUSH_INTERVAL)
+            take_pending (priv, &data, &blocks);
+        pthread_mutex_unlock (&priv->lock);
+
+        if (data)
+            flush_blocks (priv, data, blocks);
+    }
+
+    return NULL;
+}
+
+static int
+block_backend_container_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    ContainerPriv *priv = bend->be_priv;
+
+    g_assert (handle->rw_type == BLOCK_WRITE);
+
+    if (priv->inner->commit_block (priv->inner, handle->inner) < 0)
+        return -1;
+
+    if (handle->copy)
+        add_pending (priv, handle->block_id, handle->copy);
+
+    return 0;
+}
+
+static void
+block_backend_container_block_handle_free (BlockBackend *bend,
+                                           BHandle *handle)
+{
+    ContainerPriv *priv = bend->be_priv;
+
+    if (handle->inner)
+        priv->inner->block_handle_free (priv->inner, handle->inner);
+    if (handle->copy)
+        g_byte_array_free (handle->copy, TRUE);
+    g_free (handle->data);
+    g_free (handle);
+}
+
+static int
+block_backend_container_exists (BlockBackend *bend, const char *block_id)
+{
+    ContainerPriv *priv = bend->be_priv;
+    BlockLoc loc;
+
+    if (lookup_block (priv, block_id, &loc) > 0)
+        return TRUE;
+
+    return priv->inner->exists (priv->inner, block_id);
+}
+
+typedef struct ExistsData {
+    const char  **block_ids;
+    int         n_blocks;
+    gboolean    *exists;
+} ExistsData;
+
+static gboolean
+mark_exists (SeafDBRow *row, void *vdata)
+{
+    ExistsData *data = vdata;
+    const char *block_id = seaf_db_row_get_column_text (row, 0);
+    int i;
+
+    for (i = 0; i < data->n_blocks; ++i) {
+        if (strcmp (data->block_ids[i], block_id) == 0)
+            data->exists[i] = TRUE;
+    }
+
+    return TRUE;
+}
+
+static void
+block_backend_container_exists_batch (BlockBackend *bend,
+                                      const char **block_ids,
+                                      int n_blocks,
+                                      gboolean *exists)
+{
+    ContainerPriv *priv = bend->be_priv;
+    ExistsData data;
+    GString *sql;
+    const char **rest;
+    gboolean *rest_exists;
+    int *rest_idx;
+    int i, j, n_rest = 0;
+
+    memset (exists, 0, sizeof(gboolean) * n_blocks);
+
+    sql = g_string_new (NULL);
+    for (i = 0; i < n_blocks; i += QUERY_BATCH) {
+        g_string_assign (sql, "SELECT block_id FROM ContainedBlock "
+                         "WHERE block_id IN (");
+        for (j = i; j < n_blocks && j < i + QUERY_BATCH; ++j)
+            g_string_append_printf (sql, "%s'%s'", (j > i) ? "," : "",
+                                    block_ids[j]);
+        g_string_append (sql, ")");
+
+        data.block_ids = block_ids + i;
+        data.n_blocks = j - i;
+        data.exists = exists + i;
+        seaf_db_foreach_selected_row (priv->db, sql->str, mark_exists, &data);
+    }
+    g_string_free (sql, TRUE);
+
+    rest = g_new (const char *, n_blocks);
+    rest_idx = g_new (int, n_blocks);
+    rest_exists = g_new0 (gboolean, n_blocks);
+    for (i = 0; i < n_blocks; ++i) {
+        if (!exists[i]) {
+            rest[n_rest] = block_ids[i];
+            rest_idx[n_rest++] = i;
+        }
+    }
+
+    if (priv->inner->exists_batch) {
+        priv->inner->exists_batch (priv->inner, rest, n_rest, rest_exists);
+    } else {
+        for (i = 0; i < n_rest; ++i)
+            rest_exists[i] = priv->inner->exists (priv->inner, rest[i]);
+    }
+    for (i = 0; i < n_rest; ++i)
+        exists[rest_idx[i]] = rest_exists[i];
+
+    g_free (rest);
+    g_free (rest_idx);
+    g_free (rest_exists);
+}
+
+/*
+ * Drop the row of a contained block. Sets @empty_container to the id of
+ * its container if no blocks are left in it. Returns 1 if @block_id was
+ * contained.
+ */
+static int
+uncontain_block (ContainerPriv *priv, const char *block_id,
+                 char *empty_container)
+{
+    SeafDBTrans *trans;
+    BlockLoc loc;
+    char sql[256];
+    gint64 live_size = -1;
+
+    empty_container[0] = '\0';
+
+    trans = seaf_db_begin_transaction (priv->db);
+    if (!trans)
+        return -1;
+
+    loc.container_id[0] = '\0';
+    snprintf (sql, sizeof(sql),
+              "SELECT container_id, pos, size FROM ContainedBlock "
+              "WHERE block_id='%s'", block_id);
+    if (seaf_db_trans_foreach_selected_row (trans, sql, get_loc, &loc) < 0)
+        goto rollback;
+    if (loc.container_id[0] == '\0') {
+        seaf_db_rollback (trans);
+        return 0;
+    }
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM ContainedBlock WHERE block_id='%s'", block_id);
+    if (seaf_db_trans_query (trans, sql) < 0)
+        goto rollback;
+
+    snprintf (sql, sizeof(sql),
+              "UPDATE BlockContainer SET live_size=live_size-%d "
+              "WHERE container_id='%s'", loc.size, loc.container_id);
+    if (seaf_db_trans_query (trans, sql) < 0)
+        goto rollback;
+
+    snprintf (sql, sizeof(sql),
+              "SELECT live_size FROM BlockContainer WHERE container_id='%s'",
+              loc.container_id);
+    if (seaf_db_trans_foreach_selected_row (trans, sql,
+                                            get_int64, &live_size) < 0)
+        goto rollback;
+
+    if (live_size == 0) {
+        snprintf (sql, sizeof(sql),
+                  "DELETE FROM BlockContainer WHERE container_id='%s'",
+                  loc.container_id);
+        if (seaf_db_trans_query (trans, sql) < 0)
+            goto rollback;
+        memcpy (empty_container, loc.container_id, 41);
+    }
+
+    seaf_db_commit (trans);
+    return 1;
+
+rollback:
+    seaf_db_rollback (trans);
+    return -1;
+}
+
+static int
+block_backend_container_remove_block (BlockBackend *bend,
+                                      const char *block_id)
+{
+    ContainerPriv *priv = bend->be_priv;
+    char empty_container[41];
+    int ret;
+
+    ret = uncontain_block (priv, block_id, empty_container);
+    if (ret < 0)
+        return -1;
+    if (empty_container[0] != '\0')
+        priv->inner->remove_block (priv->inner, empty_container);
+
+    /* A block may also have its own copy if it hasn't been packed yet. */
+    if (ret == 1) {
+        priv->inner->remove_block (priv->inner, block_id);
+        return 0;
+    }
+    return priv->inner->remove_block (priv->inner, block_id);
+}
+
+static BMetadata *
+block_backend_container_stat_block (BlockBackend *bend, const char *block_id)
+{
+    ContainerPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+    BlockLoc loc;
+
+    if (lookup_block (priv, block_id, &loc) <= 0)
+        return priv->inner->stat_block (priv->inner, block_id);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = (uint32_t)loc.size;
+    return block_md;
+}
+
+static BMetadata *
+block_backend_container_stat_block_by_handle (BlockBackend *bend,
+                                              BHandle *handle)
+{
+    ContainerPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    if (handle->inner)
+        return priv->inner->stat_block_by_handle (priv->inner, handle->inner);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    block_md->size = (uint32_t)handle->size;
+    return block_md;
+}
+
+static gboolean
+collect_id (SeafDBRow *row, void *data)
+{
+    GHashTable *ids = data;
+
+    g_hash_table_insert (ids, g_strdup (seaf_db_row_get_column_text (row, 0)),
+                         GINT_TO_POINTER(1));
+    return TRUE;
+}
+
+typedef struct ForeachData {
+    GHashTable      *containers;
+    SeafBlockFunc   process;
+    void            *user_data;
+} ForeachData;
+
+/* Containers are not blocks. */
+static gboolean
+skip_containers (const char *block_id, void *vdata)
+{
+    ForeachData *data = vdata;
+
+    if (g_hash_table_lookup (data->containers, block_id))
+        return TRUE;
+    return data->process (block_id, data->user_data);
+}
+
+static int
+block_backend_container_foreach_block (BlockBackend *bend,
+                                       SeafBlockFunc process,
+                                       void *user_data)
+{
+    ContainerPriv *priv = bend->be_priv;
+    ForeachData data;
+    GHashTable *contained;
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    data.containers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    data.process = process;
+    data.user_data = user_data;
+
+    /* The ids are collected first, since @process may remove blocks. */
+    contained = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    if (seaf_db_foreach_selected_row (priv->db,
+                                      "SELECT container_id FROM BlockContainer",
+                                      collect_id, data.containers) < 0 ||
+        seaf_db_foreach_selected_row (priv->db,
+                                      "SELECT block_id FROM ContainedBlock",
+                                      collect_id, contained) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    g_hash_table_iter_init (&iter, contained);
+    while (!stop && g_hash_table_iter_next (&iter, &key, &value))
+        stop = !process (key, user_data);
+
+    if (!stop)
+        ret = priv->inner->foreach_block (priv->inner, skip_containers, &data);
+
+out:
+    g_hash_table_destroy (contained);
+    g_hash_table_destroy (data.containers);
+    return ret;
+}
+
+typedef struct SparseContainer {
+    char        container_id[41];
+    guint64     size;
+} SparseContainer;
+
+static gboolean
+collect_sparse (SeafDBRow *row, void *data)
+{
+    GList **containers = data;
+    SparseContainer *c = g_new0 (SparseContainer, 1);
+
+    g_strlcpy (c->container_id, seaf_db_row_get_column_text (row, 0), 41);
+    c->size = (guint64)seaf_db_row_get_column_int64 (row, 1);
+    *containers = g_list_prepend (*containers, c);
+    return TRUE;
+}
+
+typedef struct MovingBlocks {
+    GByteArray  *data;          /* content of the new container */
+    GList       *blocks;        /* PendingBlock, at their new position */
+    GList       *sources;       /* ids of the containers being emptied */
+    char        *old_data;
+} MovingBlocks;
+
+static gboolean
+collect_live (SeafDBRow *row, void *vdata)
+{
+    MovingBlocks *mv = vdata;
+    PendingBlock *blk = g_new0 (PendingBlock, 1);
+    guint64 old_pos;
+
+    g_strlcpy (blk->block_id, seaf_db_row_get_column_text (row, 0), 41);
+    old_pos = (guint64)seaf_db_row_get_column_int64 (row, 1);
+    blk->size = seaf_db_row_get_column_int (row, 2);
+    blk->pos = mv->data->len;
+
+    g_byte_array_append (mv->data, (guint8 *)mv->old_data + old_pos,
+                         blk->size);
+    mv->blocks = g_list_prepend (mv->blocks, blk);
+    return TRUE;
+}
+
+/* Write the collected live blocks to a new container and point their
+ * rows at it. */
+static int
+move_blocks (ContainerPriv *priv, MovingBlocks *mv)
+{
+    SeafDBTrans *trans;
+    PendingBlock *blk;
+    GList *ptr;
+    char *container_id;
+    char sql[256];
+    gint64 live_size = 0;
+    int ret = 0;
+
+    container_id = new_container_id ();
+    if (mv->data->len > 0 &&
+        write_container (priv, container_id, mv->data->data,
+                         mv->data->len) < 0) {
+        g_free (container_id);
+        return -1;
+    }
+
+    trans = seaf_db_begin_transaction (priv->db);
+    if (!trans) {
+        ret = -1;
+        goto out;
+    }
+
+    for (ptr = mv->blocks; ptr; ptr = ptr->next) {
+        blk = ptr->data;
+        snprintf (sql, sizeof(sql),
+                  "UPDATE ContainedBlock SET container_id='%s', "
+                  "pos=%"G_GUINT64_FORMAT" WHERE block_id='%s'",
+                  container_id, blk->pos, blk->block_id);
+        if (seaf_db_trans_query (trans, sql) < 0)
+            goto rollback;
+    }
+
+    /* Blocks removed during the copy are not counted. */
+    snprintf (sql, sizeof(sql),
+              "SELECT SUM(size) FROM ContainedBlock WHERE container_id='%s'",
+              container_id);
+    if (seaf_db_trans_foreach_selected_row (trans, sql,
+                                            get_int64, &live_size) < 0)
+        goto rollback;
+
+    if (live_size > 0) {
+        snprintf (sql, sizeof(sql),
+                  "INSERT INTO BlockContainer VALUES ('%s', %u, "
+                  "%"G_GINT64_FORMAT")",
+                  container_id, mv->data->len, live_size);
+        if (seaf_db_trans_query (trans, sql) < 0)
+            goto rollback;
+    }
+
+    for (ptr = mv->sources; ptr; ptr = ptr->next) {
+        snprintf (sql, sizeof(sql),
+                  "DELETE FROM BlockContainer WHERE container_id='%s'",
+                  (char *)ptr->data);
+        if (seaf_db_trans_query (trans, sql) < 0)
+            goto rollback;
+    }
+
+    seaf_db_commit (trans);
+
+    for (ptr = mv->sources; ptr; ptr = ptr->next)
+        priv->inner->remove_block (priv->inner, ptr->data);
+    if (live_size == 0 && mv->data->len > 0)
+        priv->inner->remove_block (priv->inner, container_id);
+    goto out;
+
+rollback:
+    seaf_db_rollback (trans);
+    if (mv->data->len > 0)
+        priv->inner->remove_block (priv->inner, container_id);
+    ret = -1;
+out:
+    g_free (container_id);
+    return ret;
+}
+
+static void
+reset_moving (MovingBlocks *mv)
+{
+    GList *ptr;
+
+    g_byte_array_set_size (mv->data, 0);
+    for (ptr = mv->blocks; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (mv->blocks);
+    mv->blocks = NULL;
+    for (ptr = mv->sources; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (mv->sources);
+    mv->sources = NULL;
+}
+
+/*
+ * Copy the live blocks of containers with little live data into new
+ * containers, and remove the old ones.
+ */
+static int
+block_backend_container_compact (BlockBackend *bend)
+{
+    ContainerPriv *priv = bend->be_priv;
+    GList *containers = NULL, *ptr;
+    SparseContainer *c;
+    MovingBlocks mv;
+    char sql[256];
+    int n_compacted = 0;
+    int ret = 0;
+
+    snprintf (sql, sizeof(sql),
+              "SELECT container_id, size FROM BlockContainer "
+              "WHERE live_size < size * %f", COMPACT_LIVE_RATIO);
+    if (seaf_db_foreach_selected_row (priv->db, sql,
+                                      collect_sparse, &containers) < 0)
+        return -1;
+
+    memset (&mv, 0, sizeof(mv));
+    mv.data = g_byte_array_new ();
+
+    for (ptr = containers; ptr; ptr = ptr->next) {
+        c = ptr->data;
+
+        mv.old_data = g_malloc (c->size);
+        if (read_container (priv, c->container_id, 0,
+                            mv.old_data, (int)c->size) != (int)c->size) {
+            g_warning ("[block container] Failed to read container %s.\n",
+                       c->container_id);
+            g_free (mv.old_data);
+            ret = -1;
+            continue;
+        }
+
+        snprintf (sql, sizeof(sql),
+                  "SELECT block_id, pos, size FROM ContainedBlock "
+                  "WHERE container_id='%s'", c->container_id);
+        if (seaf_db_foreach_selected_row (priv->db, sql,
+                                          collect_live, &mv) < 0) {
+            g_free (mv.old_data);
+            ret = -1;
+            break;
+        }
+        g_free (mv.old_data);
+        mv.old_data = NULL;
+
+        mv.sources = g_list_prepend (mv.sources, g_strdup(c->container_id));
+        ++n_compacted;
+
+        if (mv.data->len >= priv->container_size) {
+            if (move_blocks (priv, &mv) < 0)
+                ret = -1;
+            reset_moving (&mv);
+        }
+    }
+
+    if (mv.sources && move_blocks (priv, &mv) < 0)
+        ret = -1;
+    reset_moving (&mv);
+    g_byte_array_free (mv.data, TRUE);
+
+    for (ptr = containers; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (containers);
+
+    g_message ("Compacted %d block containers.\n", n_compacted);
+    return ret;
+}
+
+static int
+create_tables (SeafDB *db)
+{
+    char *sql;
+
+    sql = "CREATE TABLE IF NOT EXISTS BlockContainer ("
+        "container_id CHAR(40) PRIMARY KEY, size BIGINT, live_size BIGINT)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL) {
+        sql = "CREATE TABLE IF NOT EXISTS ContainedBlock ("
+            "block_id CHAR(40) PRIMARY KEY, container_id CHAR(40), "
+            "pos BIGINT, size INTEGER, INDEX (container_id))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    } else {
+        sql = "CREATE TABLE IF NOT EXISTS ContainedBlock ("
+            "block_id CHAR(40) PRIMARY KEY, container_id CHAR(40), "
+            "pos BIGINT, size INTEGER)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE INDEX IF NOT EXISTS ContainedBlockContainer "
+            "ON ContainedBlock (container_id)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+BlockBackend *
+block_backend_container_new (BlockBackend *inner, SeafDB *db,
+                             int threshold, int container_size)
+{
+    BlockBackend *bend;
+    ContainerPriv *priv;
+    pthread_t tid;
+
+    if (create_tables (db) < 0) {
+        g_warning ("[block container] Failed to create tables.\n");
+        return NULL;
+    }
+
+    priv = g_new0 (ContainerPriv, 1);
+    priv->inner = inner;
+    priv->db = db;
+    priv->threshold = threshold;
+    priv->container_size = (container_size > 0) ? container_size :
+        DEFAULT_CONTAINER_SIZE;
+
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->pending = g_byte_array_new ();
+    priv->pending_ids = g_hash_table_new (g_str_hash, g_str_equal);
+
+    if (pthread_create (&tid, NULL, flush_thread, priv) != 0) {
+        g_warning ("[block container] Failed to start flush thread.\n");
+        return NULL;
+    }
+    pthread_detach (tid);
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_container_open_block;
+    bend->read_block = block_backend_container_read_block;
+    bend->write_block = block_backend_container_write_block;
+    bend->commit_block = block_backend_container_commit_block;
+    bend->close_block = block_backend_container_close_block;
+    bend->exists = block_backend_container_exists;
+    bend->remove_block = block_backend_container_remove_block;
+    bend->stat_block = block_backend_container_stat_block;
+    bend->stat_block_by_handle = block_backend_container_stat_block_by_handle;
+    bend->block_handle_free = block_backend_container_block_handle_free;
+    bend->foreach_block = block_backend_container_foreach_block;
+    bend->exists_batch = block_backend_container_exists_batch;
+    bend->compact = block_backend_container_compact;
+
+    return bend;
+}
@@ -1,5 +1,8 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
+/* For sync_file_range. */
+#define _GNU_SOURCE
+
 #include "common.h"
 
 #include "utils.h"
@@ -7,10 +10,20 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "block-backend.h"
 #include "obj-store.h"
 
+#ifdef WIN32
+#define fsync(fd) _commit(fd)
+#endif
+
+#ifdef __linux__
+#define sync_data(fd) fdatasync(fd)
+#else
+#define sync_data(fd) fsync(fd)
+#endif
 
 struct _BHandle {
     char    block_id[41];
@@ -18,11 +31,31 @@ struct _BHandle {
     int     rw_type;
 };
 
+/* A block waiting in the group commit queue. */
+typedef struct PendingCommit {
+    BHandle       *handle;
+    int            result;
+    gboolean       done;
+} PendingCommit;
+
 typedef struct {
     char          *block_dir;
     int            block_dir_len;
     char          *tmp_dir;
     int            tmp_dir_len;
+
+    int            durability;
+    gboolean       sync_dir;
+
+    /*
+     * Group commit. Commits are queued in @pending. One of the
+     * committing threads takes the whole queue and syncs it while the
+     * others wait; commits that arrive meanwhile form the next batch.
+     */
+    pthread_mutex_t commit_lock;
+    pthread_cond_t  commit_cond;
+    GList          *pending;
+    gboolean        committing;
 } FsPriv;
 
 static char *
@@ -53,7 +86,8 @@ block_backend_fs_open_block (BlockBackend *bend,
         fd = g_open (path, O_RDONLY | O_BINARY, 0);
     } else {
         get_tmp_file_path (bend, block_id, path);
-        fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0644);
+        /* May be left from an interrupted write. */
+        fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
     }
 
     if (fd < 0) {
@@ -90,28 +124,119 @@ static int
 block_backend_fs_close_block (BlockBackend *bend,
                                 BHandle *handle)
 {
+    FsPriv *priv = bend->be_priv;
     int ret;
 
+    /* Blocks being written are synced on commit, so keep them open
+     * until then.
+     */
+    if (handle->rw_type == BLOCK_WRITE &&
+        priv->durability != BLOCK_DURABILITY_NONE)
+        return 0;
+
     ret = close (handle->fd);
+    handle->fd = -1;
 
     return ret;
 }
 
+static int
+block_backend_fs_read_range (BlockBackend *bend, const char *block_id,
+                             guint64 offset, void *buf, int len)
+{
+    char path[PATH_MAX];
+    int fd, n;
+
+    get_block_path (bend, block_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        ccnet_warning ("[block bend] failed to open block %s: %s\n",
+                       block_id, strerror(errno));
+        return -1;
+    }
+
+    if (lseek (fd, (off_t)offset, SEEK_SET) < 0)
+        n = -1;
+    else
+        n = readn (fd, buf, len);
+
+    close (fd);
+    return n;
+}
+
+static guint32
+block_backend_fs_partial_size (BlockBackend *bend, const char *block_id)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    get_tmp_file_path (bend, block_id, path);
+    if (g_stat (path, &st) < 0)
+        return 0;
+
+    return (guint32) MIN (st.st_size, G_MAXUINT32);
+}
+
+static BHandle *
+block_backend_fs_open_partial (BlockBackend *bend, const char *block_id,
+                               guint32 offset)
+{
+    BHandle *handle;
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+
+    get_tmp_file_path (bend, block_id, path);
+    fd = g_open (path, O_RDWR | O_BINARY, 0);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat (fd, &st) < 0 || st.st_size < offset ||
+        ftruncate (fd, offset) < 0) {
+        close (fd);
+        return NULL;
+    }
+
+    handle = g_new0(BHandle, 1);
+    handle->fd = fd;
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = BLOCK_WRITE;
+
+    return handle;
+}
+
+static int
+block_backend_fs_remove_partial (BlockBackend *bend, const char *block_id)
+{
+    char path[PATH_MAX];
+
+    get_tmp_file_path (bend, block_id, path);
+
+    return g_unlink (path);
+}
+
+static int
+block_backend_fs_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    return handle->fd;
+}
+
 static void
 block_backend_fs_block_handle_free (BlockBackend *bend,
                                     BHandle *handle)
 {
+    if (handle->fd >= 0)
+        close (handle->fd);
     g_free (handle);
 }
 
 static int
-block_backend_fs_commit_block (BlockBackend *bend,
-                               BHandle *handle)
+rename_block (BlockBackend *bend, BHandle *handle)
 {
     char path[PATH_MAX], tmp_path[PATH_MAX];
 
-    g_assert (handle->rw_type == BLOCK_WRITE);
-
     get_block_path (bend, handle->block_id, path);
     get_tmp_file_path (bend, handle->block_id, tmp_path);
     if (ccnet_rename (tmp_path, path) < 0) {
@@ -122,6 +247,158 @@ block_backend_fs_commit_block (BlockBackend *bend,
 
     return 0;
 }
+
+#ifndef WIN32
+static int
+sync_block_dir (BlockBackend *bend, const char *block_id)
+{
+    FsPriv *priv = bend->be_priv;
+    char path[PATH_MAX];
+    int fd, ret = 0;
+
+    snprintf (path, sizeof(path), "%s/%.2s", priv->block_dir, block_id);
+    fd = open (path, O_RDONLY);
+    if (fd < 0 || fsync (fd) < 0) {
+        g_warning ("[block bend] failed to sync dir %s: %s\n",
+                   path, strerror(errno));
+        ret = -1;
+    }
+    if (fd >= 0)
+        close (fd);
+
+    return ret;
+}
+#endif
+
+/*
+ * Sync, close and rename every block of @batch, then sync each block
+ * directory once. Writeback of all the blocks is started before waiting
+ * for any of them, so the disk can order the writes.
+ */
+static void
+commit_batch (BlockBackend *bend, GList *batch)
+{
+    FsPriv *priv = bend->be_priv;
+    PendingCommit *pc;
+    GList *ptr;
+
+#ifdef __linux__
+    for (ptr = batch; ptr; ptr = ptr->next) {
+        pc = ptr->data;
+        sync_file_range (pc->handle->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+
+    for (ptr = batch; ptr; ptr = ptr->next) {
+        pc = ptr->data;
+        if (sync_data (pc->handle->fd) < 0) {
+            g_warning ("[block bend] failed to sync block %s: %s\n",
+                       pc->handle->block_id, strerror(errno));
+            pc->result = -1;
+        }
+        if (close (pc->handle->fd) < 0)
+            pc->result = -1;
+        pc->handle->fd = -1;
+
+        if (pc->result == 0)
+            pc->result = rename_block (bend, pc->handle);
+    }
+
+#ifndef WIN32
+    if (priv->sync_dir) {
+        gboolean synced[256] = { 0 };
+        gboolean failed[256] = { 0 };
+        int dir;
+
+        for (ptr = batch; ptr; ptr = ptr->next) {
+            pc = ptr->data;
+            if (pc->result < 0)
+                continue;
+            dir = g_ascii_xdigit_value (pc->handle->block_id[0]) * 16 +
+                g_ascii_xdigit_value (pc->handle->block_id[1]);
+            if (!synced[dir]) {
+                synced[dir] = TRUE;
+                failed[dir] = (sync_block_dir (bend, pc->handle->block_id) < 0);
+            }
+            if (failed[dir])
+                pc->result = -1;
+        }
+    }
+#endif
+}
+
+static void
+mark_done (gpointer data, gpointer user_data)
+{
+    PendingCommit *pc = data;
+
+    pc->done = TRUE;
+}
+
+static int
+group_commit (BlockBackend *bend, BHandle *handle)
+{
+    FsPriv *priv = bend->be_priv;
+    PendingCommit pc;
+    GList *batch;
+
+    pc.handle = handle;
+    pc.result = 0;
+    pc.done = FALSE;
+
+    pthread_mutex_lock (&priv->commit_lock);
+    priv->pending = g_list_prepend (priv->pending, &pc);
+
+    while (!pc.done) {
+        if (priv->committing) {
+            pthread_cond_wait (&priv->commit_cond, &priv->commit_lock);
+            continue;
+        }
+
+        /* Commit everything queued so far, including our block. */
+        priv->committing = TRUE;
+        batch = priv->pending;
+        priv->pending = NULL;
+        pthread_mutex_unlock (&priv->commit_lock);
+
+        commit_batch (bend, batch);
+
+        pthread_mutex_lock (&priv->commit_lock);
+        g_list_foreach (batch, mark_done, NULL);
+        g_list_free (batch);
+        priv->committing = FALSE;
+        pthread_cond_broadcast (&priv->commit_cond);
+    }
+
+    pthread_mutex_unlock (&priv->commit_lock);
+
+    return pc.result;
+}
+
+static int
+block_backend_fs_commit_block (BlockBackend *bend,
+                               BHandle *handle)
+{
+    FsPriv *priv = bend->be_priv;
+    PendingCommit pc;
+    GList batch;
+
+    g_assert (handle->rw_type == BLOCK_WRITE);
+
+    switch (priv->durability) {
+    case BLOCK_DURABILITY_FSYNC:
+        pc.handle = handle;
+        pc.result = 0;
+        batch.data = &pc;
+        batch.next = batch.prev = NULL;
+        commit_batch (bend, &batch);
+        return pc.result;
+    case BLOCK_DURABILITY_GROUP:
+        return group_commit (bend, handle);
+    default:
+        return rename_block (bend, handle);
+    }
+}
     
 static gboolean
 block_backend_fs_block_exists (BlockBackend *bend, const char *block_sha1)
@@ -184,54 +461,161 @@ block_backend_fs_stat_block_by_handle (BlockBackend *bend,
     return block_md;
 }
 
+/* Returns -1 on error, 1 if @process asks to stop and 0 otherwise. */
+static int
+foreach_block_in_dir (FsPriv *priv, const char *dname1,
+                      SeafBlockFunc process, void *user_data)
+{
+    GDir *dir2;
+    const char *dname2;
+    char block_id[128];
+    char path[PATH_MAX];
+    int ret = 0;
+
+    snprintf (path, sizeof(path), "%s/%s", priv->block_dir, dname1);
+
+    dir2 = g_dir_open (path, 0, NULL);
+    if (!dir2) {
+        g_warning ("Failed to open object dir %s.\n", path);
+        return 0;
+    }
+
+    while ((dname2 = g_dir_read_name(dir2)) != NULL) {
+        snprintf (block_id, sizeof(block_id), "%s%s", dname1, dname2);
+        if (!process (block_id, user_data)) {
+            ret = 1;
+            break;
+        }
+    }
+    g_dir_close (dir2);
+
+    return ret;
+}
+
 static int
 block_backend_fs_foreach_block (BlockBackend *bend,
                                 SeafBlockFunc process,
                                 void *user_data)
 {
     FsPriv *priv = bend->be_priv;
-    char *block_dir = priv->block_dir;
-    int dir_len = priv->block_dir_len;
-    GDir *dir1, *dir2;
-    const char *dname1, *dname2;
-    char block_id[128];
-    char path[PATH_MAX], *pos;
+    GDir *dir1;
+    const char *dname1;
     int ret = 0;
 
-    dir1 = g_dir_open (block_dir, 0, NULL);
+    dir1 = g_dir_open (priv->block_dir, 0, NULL);
     if (!dir1) {
-        g_warning ("Failed to open object dir %s.\n", block_dir);
+        g_warning ("Failed to open object dir %s.\n", priv->block_dir);
         return -1;
     }
 
-    memcpy (path, block_dir, dir_len);
-    pos = path + dir_len;
-
     errno = 0;
     while ((dname1 = g_dir_read_name(dir1)) != NULL) {
-        snprintf (pos, sizeof(path) - dir_len, "/%s", dname1);
+        if (foreach_block_in_dir (priv, dname1, process, user_data) != 0)
+            goto out;
+    }
+    if (errno != 0)
+        ret = -1;
 
-        dir2 = g_dir_open (path, 0, NULL);
-        if (!dir2) {
-            g_warning ("Failed to open object dir %s.\n", path);
-            continue;
-        }
+out:
+    g_dir_close (dir1);
 
-        while ((dname2 = g_dir_read_name(dir2)) != NULL) {
-            snprintf (block_id, sizeof(block_id), "%s%s", dname1, dname2);
-            if (!process (block_id, user_data)) {
-                g_dir_close (dir2);
-                goto out;
-            }
+    return ret;
+}
+
+typedef struct ForeachData {
+    FsPriv          *priv;
+    SeafBlockFunc   process;
+    void            *user_data;
+    pthread_mutex_t lock;
+    GList           *dirs;      /* top level dirs not scanned yet */
+    gboolean        stop;
+} ForeachData;
+
+static void *
+foreach_worker (void *vdata)
+{
+    ForeachData *data = vdata;
+    char *dname;
+
+    while (1) {
+        pthread_mutex_lock (&data->lock);
+        dname = NULL;
+        if (data->dirs && !data->stop) {
+            dname = data->dirs->data;
+            data->dirs = g_list_delete_link (data->dirs, data->dirs);
+        }
+        pthread_mutex_unlock (&data->lock);
+        if (!dname)
+            break;
+
+        if (foreach_block_in_dir (data->priv, dname,
+                                  data->process, data->user_data) != 0) {
+            pthread_mutex_lock (&data->lock);
+            data->stop = TRUE;
+            pthread_mutex_unlock (&data->lock);
         }
-        g_dir_close (dir2);
+        g_free (dname);
     }
+
+    return NULL;
+}
+
+/* The top level dirs are handed out to the threads one at a time. */
+static int
+block_backend_fs_foreach_block_parallel (BlockBackend *bend,
+                                         int n_threads,
+                                         SeafBlockFunc process,
+                                         void *user_data)
+{
+    FsPriv *priv = bend->be_priv;
+    ForeachData data;
+    GDir *dir1;
+    const char *dname1;
+    pthread_t *threads;
+    GList *ptr;
+    int i, ret = 0;
+
+    memset (&data, 0, sizeof(data));
+    data.priv = priv;
+    data.process = process;
+    data.user_data = user_data;
+
+    dir1 = g_dir_open (priv->block_dir, 0, NULL);
+    if (!dir1) {
+        g_warning ("Failed to open object dir %s.\n", priv->block_dir);
+        return -1;
+    }
+
+    errno = 0;
+    while ((dname1 = g_dir_read_name(dir1)) != NULL)
+        data.dirs = g_list_prepend (data.dirs, g_strdup(dname1));
     if (errno != 0)
         ret = -1;
-
-out:
     g_dir_close (dir1);
 
+    pthread_mutex_init (&data.lock, NULL);
+
+    threads = g_new0 (pthread_t, n_threads);
+    for (i = 0; i < n_threads; ++i) {
+        if (pthread_create (&threads[i], NULL, foreach_worker, &data) != 0)
+            break;
+    }
+    n_threads = i;
+
+    /* Carry on in this thread if no thread could be started. */
+    if (n_threads == 0)
+        foreach_worker (&data);
+    for (i = 0; i < n_threads; ++i)
+        pthread_join (threads[i], NULL);
+
+    g_free (threads);
+    pthread_mutex_destroy (&data.lock);
+
+    /* Left over if stopped. */
+    for (ptr = data.dirs; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (data.dirs);
+
     return ret;
 }
 
@@ -295,7 +679,8 @@ init_block_dir (BlockBackend *bend)
 }
 
 BlockBackend *
-block_backend_fs_new (const char *block_dir, const char *tmp_dir)
+block_backend_fs_new (const char *block_dir, const char *tmp_dir,
+                      int durability, gboolean sync_dir)
 {
     BlockBackend *bend;
     FsPriv *priv;
@@ -309,6 +694,11 @@ block_backend_fs_new (const char *block_dir, const char *tmp_dir)
     priv->block_dir_len = strlen (block_dir);
     priv->tmp_dir_len = strlen (tmp_dir);
 
+    priv->durability = durability;
+    priv->sync_dir = sync_dir;
+    pthread_mutex_init (&priv->commit_lock, NULL);
+    pthread_cond_init (&priv->commit_cond, NULL);
+
     if (checkdir_with_mkdir (block_dir) < 0) {
         g_warning ("[Block Backend] Blocks dir %s does not exist and"
                    " is unable to create\n", block_dir);
@@ -334,6 +724,12 @@ block_backend_fs_new (const char *block_dir, const char *tmp_dir)
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
     bend->block_handle_free = block_backend_fs_block_handle_free;
     bend->foreach_block = block_backend_fs_foreach_block;
+    bend->foreach_block_parallel = block_backend_fs_foreach_block_parallel;
+    bend->get_fd = block_backend_fs_get_fd;
+    bend->read_range = block_backend_fs_read_range;
+    bend->partial_size = block_backend_fs_partial_size;
+    bend->open_partial = block_backend_fs_open_partial;
+    bend->remove_partial = block_backend_fs_remove_partial;
 
     return bend;
 
@@ -0,0 +1,540 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block backend for S3 compatible object storage. Every block is an
+ * object named by its id.
+ *
+ * Requests go over a pool of keep-alive connections. Blocks larger than
+ * the multipart threshold are uploaded in parts, several at a time, and
+ * blocks are read with ranged GETs: the first part tells the size, the
+ * rest are fetched in parallel.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "block-backend.h"
+#include "s3-client.h"
+
+#ifdef S3_BACKEND
+
+#include <pthread.h>
+
+#define DEFAULT_MAX_CONNECTIONS 32
+#define DEFAULT_PARALLEL 8
+#define DEFAULT_PART_SIZE (8 << 20)
+#define DEFAULT_LIST_THREADS 8
+
+/* The smallest part S3 accepts, except for the last one. */
+#define MIN_PART_SIZE (5 << 20)
+
+struct _BHandle {
+    char        block_id[41];
+    int         rw_type;
+
+    /* Block being written. */
+    GByteArray  *buf;
+
+    /* Block being read, fetched on the first read. */
+    char        *data;
+    int         size;
+    int         pos;
+    gboolean    fetched;
+};
+
+typedef struct S3Priv {
+    SeafS3Config conf;
+
+    /*
+     * Idle clients. Each one keeps its keep-alive connections, so they
+     * are reused rather than freed. At most max_connections clients
+     * exist; callers wait for one beyond that.
+     */
+    GQueue          *conn_pool;
+    int             n_conns;
+    int             max_conns;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    /* Requests run at a time for one block or batch. */
+    int             parallel;
+    int             part_size;
+    gint64          multipart_threshold;
+    int             list_threads;
+} S3Priv;
+
+static SeafS3Client *
+get_connection (S3Priv *priv)
+{
+    SeafS3Client *connection;
+
+    pthread_mutex_lock (&priv->lock);
+
+    while ((connection = g_queue_pop_head (priv->conn_pool)) == NULL &&
+           priv->n_conns >= priv->max_conns)
+        pthread_cond_wait (&priv->cond, &priv->lock);
+
+    if (!connection) {
+        connection = seaf_s3_client_new (&priv->conf);
+        priv->n_conns++;
+    }
+    pthread_mutex_unlock (&priv->lock);
+    return connection;
+}
+
+static void
+return_connection (S3Priv *priv, SeafS3Client *connection)
+{
+    pthread_mutex_lock (&priv->lock);
+    /* Most recently used first, its connection is least likely closed. */
+    g_queue_push_head (priv->conn_pool, connection);
+    pthread_cond_signal (&priv->cond);
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static BHandle *
+block_backend_s3_open_block (BlockBackend *bend,
+                             const char *block_id,
+                             int rw_type)
+{
+    BHandle *handle;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_assert (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE);
+
+    handle = g_new0 (BHandle, 1);
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    if (rw_type == BLOCK_WRITE)
+        handle->buf = g_byte_array_new ();
+
+    return handle;
+}
+
+/*
+ * Get the first part of the block, which also tells its size, then the
+ * other parts in parallel.
+ */
+static int
+fetch_block (S3Priv *priv, BHandle *handle)
+{
+    SeafS3Client *conn = get_connection (priv);
+    SeafS3BatchItem *items = NULL;
+    void *first = NULL;
+    int first_size;
+    gint64 total = -1;
+    int n_items = 0, i, pos;
+    int ret = 0;
+
+    if (seaf_s3_client_get (conn, handle->block_id, 0, priv->part_size,
+                            &first, &first_size, &total) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (total <= first_size) {
+        handle->data = first;
+        handle->size = first_size;
+        goto out;
+    }
+
+    n_items = (int)((total - first_size + priv->part_size - 1) /
+                    priv->part_size);
+    items = g_new0 (SeafS3BatchItem, n_items);
+    for (i = 0; i < n_items; ++i) {
+        items[i].key = handle->block_id;
+        items[i].offset = first_size + (guint64)i * priv->part_size;
+        items[i].len = (int)MIN (priv->part_size, total - items[i].offset);
+    }
+
+    seaf_s3_client_get_batch (conn, items, n_items, priv->parallel);
+
+    handle->data = g_malloc (total);
+    memcpy (handle->data, first, first_size);
+    pos = first_size;
+    for (i = 0; i < n_items; ++i) {
+        /* The block can't change, so it must be a failed request. */
+        if (!items[i].success || items[i].size != items[i].len) {
+            seaf_warning ("[block bend] Failed to read block %s.\n",
+                          handle->block_id);
+            g_free (handle->data);
+            handle->data = NULL;
+            ret = -1;
+            break;
+        }
+        memcpy (handle->data + pos, items[i].value, items[i].size);
+        pos += items[i].size;
+    }
+    handle->size = pos;
+
+    for (i = 0; i < n_items; ++i)
+        g_free (items[i].value);
+    g_free (items);
+    g_free (first);
+
+out:
+    return_connection (priv, conn);
+    return ret;
+}
+
+static int
+block_backend_s3_read_block (BlockBackend *bend,
+                             BHandle *handle,
+                             void *buf, int len)
+{
+    int n;
+
+    g_assert (handle->rw_type == BLOCK_READ);
+
+    if (!handle->fetched) {
+        if (fetch_block (bend->be_priv, handle) < 0)
+            return -1;
+        handle->fetched = TRUE;
+    }
+
+    n = MIN (len, handle->size - handle->pos);
+    if (n > 0)
+        memcpy (buf, handle->data + handle->pos, n);
+    handle->pos += n;
+    return n;
+}
+
+static int
+block_backend_s3_write_block (BlockBackend *bend,
+                              BHandle *handle,
+                              const void *buf, int len)
+{
+    g_assert (handle->rw_type == BLOCK_WRITE);
+
+    g_byte_array_append (handle->buf, buf, len);
+    return len;
+}
+
+static int
+block_backend_s3_close_block (BlockBackend *bend, BHandle *handle)
+{
+    return 0;
+}
+
+static int
+block_backend_s3_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    S3Priv *priv = bend->be_priv;
+    SeafS3Client *conn;
+    int ret;
+
+    g_assert (handle->rw_type == BLOCK_WRITE);
+
+    conn = get_connection (priv);
+    if (handle->buf->len > priv->multipart_threshold)
+        ret = seaf_s3_client_put_multipart (conn, handle->block_id,
+                                            handle->buf->data,
+                                            handle->buf->len,
+                                            priv->part_size,
+                                            priv->parallel);
+    else
+        ret = seaf_s3_client_put (conn, handle->block_id,
+                                  handle->buf->data, handle->buf->len);
+    return_connection (priv, conn);
+
+    if (ret < 0)
+        seaf_warning ("[block bend] Failed to commit block %s.\n",
+                      handle->block_id);
+    return ret;
+}
+
+static void
+block_backend_s3_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    if (handle->buf)
+        g_byte_array_free (handle->buf, TRUE);
+    g_free (handle->data);
+    g_free (handle);
+}
+
+static int
+block_backend_s3_exists (BlockBackend *bend, const char *block_id)
+{
+    S3Priv *priv = bend->be_priv;
+    SeafS3Client *conn = get_connection (priv);
+    int ret;
+
+    ret = seaf_s3_client_head (conn, block_id, NULL);
+    return_connection (priv, conn);
+
+    return (ret > 0);
+}
+
+static void
+block_backend_s3_exists_batch (BlockBackend *bend,
+                               const char **block_ids,
+                               int n_blocks,
+                               gboolean *exists)
+{
+    S3Priv *priv = bend->be_priv;
+    SeafS3Client *conn;
+    SeafS3BatchItem *items;
+    int i;
+
+    items = g_new0 (SeafS3BatchItem, n_blocks);
+    for (i = 0; i < n_blocks; ++i)
+        items[i].key = block_ids[i];
+
+    conn = get_connection (priv);
+    seaf_s3_client_head_batch (conn, items, n_blocks, priv->parallel);
+    return_connection (priv, conn);
+
+    for (i = 0; i < n_blocks; ++i)
+        exists[i] = items[i].success;
+    g_free (items);
+}
+
+static int
+block_backend_s3_remove_block (BlockBackend *bend, const char *block_id)
+{
+    S3Priv *priv = bend->be_priv;
+    SeafS3Client *conn = get_connection (priv);
+    int ret;
+
+    ret = seaf_s3_client_delete (conn, block_id);
+    return_connection (priv, conn);
+
+    return ret;
+}
+
+static BMetadata *
+block_backend_s3_stat_block (BlockBackend *bend, const char *block_id)
+{
+    S3Priv *priv = bend->be_priv;
+    SeafS3Client *conn = get_connection (priv);
+    BMetadata *block_md;
+    gint64 size;
+    int ret;
+
+    ret = seaf_s3_client_head (conn, block_id, &size);
+    return_connection (priv, conn);
+    if (ret <= 0)
+        return NULL;
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = (uint32_t)size;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_s3_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    BMetadata *block_md;
+
+    if (handle->rw_type == BLOCK_READ && !handle->fetched)
+        return block_backend_s3_stat_block (bend, handle->block_id);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    if (handle->rw_type == BLOCK_WRITE)
+        block_md->size = handle->buf->len;
+    else
+        block_md->size = (uint32_t)handle->size;
+
+    return block_md;
+}
+
+static int
+block_backend_s3_read_range (BlockBackend *bend, const char *block_id,
+                             guint64 offset, void *buf, int len)
+{
+    S3Priv *priv = bend->be_priv;
+    SeafS3Client *conn = get_connection (priv);
+    void *data = NULL;
+    int size, ret;
+
+    ret = seaf_s3_client_get (conn, block_id, offset, len, &data, &size, NULL);
+    return_connection (priv, conn);
+    if (ret < 0)
+        return -1;
+
+    size = MIN (size, len);
+    memcpy (buf, data, size);
+    g_free (data);
+    return size;
+}
+
+/*
+ * The bucket is listed by the first two hex digits of the ids, by
+ * list_threads threads at a time. Calls to @process are serialized.
+ */
+#define N_LIST_PREFIXES 256
+
+typedef struct ListData {
+    S3Priv          *priv;
+    SeafBlockFunc   process;
+    void            *user_data;
+    pthread_mutex_t lock;
+    int             next_prefix;
+    gboolean        stop;
+    gboolean        error;
+} ListData;
+
+static gboolean
+list_block (const char *key, gint64 size, void *vdata)
+{
+    ListData *data = vdata;
+    gboolean ret;
+
+    /* Skip objects that aren't blocks. */
+    if (strlen (key) != 40)
+        return TRUE;
+
+    pthread_mutex_lock (&data->lock);
+    if (!data->stop && !data->process (key, data->user_data))
+        data->stop = TRUE;
+    ret = !data->stop;
+    pthread_mutex_unlock (&data->lock);
+
+    return ret;
+}
+
+static void *
+list_worker (void *vdata)
+{
+    ListData *data = vdata;
+    SeafS3Client *conn;
+    char prefix[3];
+    int i;
+
+    while (1) {
+        pthread_mutex_lock (&data->lock);
+        i = data->next_prefix++;
+        if (data->stop)
+            i = N_LIST_PREFIXES;
+        pthread_mutex_unlock (&data->lock);
+        if (i >= N_LIST_PREFIXES)
+            break;
+
+        snprintf (prefix, sizeof(prefix), "%02x", i);
+        conn = get_connection (data->priv);
+        if (seaf_s3_client_list (conn, prefix, list_block, data) < 0) {
+            pthread_mutex_lock (&data->lock);
+            data->error = TRUE;
+            data->stop = TRUE;
+            pthread_mutex_unlock (&data->lock);
+        }
+        return_connection (data->priv, conn);
+    }
+
+    return NULL;
+}
+
+static int
+block_backend_s3_foreach_block (BlockBackend *bend,
+                                SeafBlockFunc process,
+                                void *user_data)
+{
+    S3Priv *priv = bend->be_priv;
+    ListData data;
+    pthread_t *threads;
+    int n_threads, i;
+
+    memset (&data, 0, sizeof(data));
+    data.priv = priv;
+    data.process = process;
+    data.user_data = user_data;
+    pthread_mutex_init (&data.lock, NULL);
+
+    /* Each thread holds a connection. */
+    n_threads = MIN (priv->list_threads, priv->max_conns);
+    threads = g_new0 (pthread_t, n_threads);
+    for (i = 0; i < n_threads; ++i) {
+        if (pthread_create (&threads[i], NULL, list_worker, &data) != 0) {
+            seaf_warning ("[block bend] Failed to start list thread.\n");
+            break;
+        }
+    }
+    n_threads = i;
+
+    /* Carry on in this thread if no thread could be started. */
+    if (n_threads == 0)
+        list_worker (&data);
+    for (i = 0; i < n_threads; ++i)
+        pthread_join (threads[i], NULL);
+
+    g_free (threads);
+    pthread_mutex_destroy (&data.lock);
+
+    if (data.error) {
+        seaf_warning ("[block bend] Failed to list blocks.\n");
+        return -1;
+    }
+    return 0;
+}
+
+BlockBackend *
+block_backend_s3_new (const SeafS3Config *conf,
+                      int max_connections,
+                      int parallel,
+                      int part_size,
+                      gint64 multipart_threshold,
+                      int list_threads)
+{
+    BlockBackend *bend;
+    S3Priv *priv;
+
+    bend = g_new0 (BlockBackend, 1);
+    priv = g_new0 (S3Priv, 1);
+    bend->be_priv = priv;
+
+    priv->conf.host = g_strdup (conf->host);
+    priv->conf.bucket = g_strdup (conf->bucket);
+    priv->conf.access_key = g_strdup (conf->access_key);
+    priv->conf.secret_key = g_strdup (conf->secret_key);
+    priv->conf.region = g_strdup (conf->region);
+    priv->conf.use_https = conf->use_https;
+    priv->conf.path_style = conf->path_style;
+
+    priv->conn_pool = g_queue_new ();
+    priv->max_conns = max_connections > 0 ? max_connections :
+        DEFAULT_MAX_CONNECTIONS;
+    priv->parallel = parallel > 0 ? parallel : DEFAULT_PARALLEL;
+    priv->part_size = part_size > 0 ? MAX (part_size, MIN_PART_SIZE) :
+        DEFAULT_PART_SIZE;
+    priv->multipart_threshold = multipart_threshold > 0 ?
+        multipart_threshold : priv->part_size;
+    priv->list_threads = list_threads > 0 ? list_threads :
+        DEFAULT_LIST_THREADS;
+    pthread_mutex_init (&priv->lock, NULL);
+    pthread_cond_init (&priv->cond, NULL);
+
+    bend->open_block = block_backend_s3_open_block;
+    bend->read_block = block_backend_s3_read_block;
+    bend->write_block = block_backend_s3_write_block;
+    bend->commit_block = block_backend_s3_commit_block;
+    bend->close_block = block_backend_s3_close_block;
+    bend->exists = block_backend_s3_exists;
+    bend->remove_block = block_backend_s3_remove_block;
+    bend->stat_block = block_backend_s3_stat_block;
+    bend->stat_block_by_handle = block_backend_s3_stat_block_by_handle;
+    bend->block_handle_free = block_backend_s3_block_handle_free;
+    bend->foreach_block = block_backend_s3_foreach_block;
+    bend->exists_batch = block_backend_s3_exists_batch;
+    bend->read_range = block_backend_s3_read_range;
+
+    return bend;
+}
+
+#else
+
+BlockBackend *
+block_backend_s3_new (const SeafS3Config *conf,
+                      int max_connections,
+                      int parallel,
+                      int part_size,
+                      gint64 multipart_threshold,
+                      int list_threads)
+{
+    seaf_warning ("S3 backend is not enabled.\n");
+    return NULL;
+}
+
+#endif  /* S3_BACKEND */
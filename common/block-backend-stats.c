@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block backend that records the latency of every call into another
+ * backend. Handles of the inner backend are passed through unchanged.
+ */
+
+#include "common.h"
+
+#include "block-backend.h"
+#include "backend-stats.h"
+
+typedef struct StatsPriv {
+    BlockBackend *inner;
+    BackendStats *stats;
+} StatsPriv;
+
+static BHandle *
+block_backend_stats_open_block (BlockBackend *bend,
+                                const char *block_id,
+                                int rw_type)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->open_block (priv->inner, block_id, rw_type);
+}
+
+static int
+block_backend_stats_read_block (BlockBackend *bend,
+                                BHandle *handle,
+                                void *buf, int len)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->read_block (priv->inner, handle, buf, len);
+
+    backend_stats_record (priv->stats, BACKEND_OP_READ,
+                          backend_stats_now () - start, ret, ret >= 0);
+    return ret;
+}
+
+static int
+block_backend_stats_write_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 const void *buf, int len)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->write_block (priv->inner, handle, buf, len);
+
+    backend_stats_record (priv->stats, BACKEND_OP_WRITE,
+                          backend_stats_now () - start, ret, ret >= 0);
+    return ret;
+}
+
+static int
+block_backend_stats_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->commit_block (priv->inner, handle);
+
+    backend_stats_record (priv->stats, BACKEND_OP_COMMIT,
+                          backend_stats_now () - start, 0, ret >= 0);
+    return ret;
+}
+
+static int
+block_backend_stats_close_block (BlockBackend *bend, BHandle *handle)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->close_block (priv->inner, handle);
+}
+
+static int
+block_backend_stats_exists (BlockBackend *bend, const char *block_id)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->exists (priv->inner, block_id);
+
+    backend_stats_record (priv->stats, BACKEND_OP_EXISTS,
+                          backend_stats_now () - start, 0, TRUE);
+    return ret;
+}
+
+static int
+block_backend_stats_remove_block (BlockBackend *bend, const char *block_id)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->remove_block (priv->inner, block_id);
+
+    backend_stats_record (priv->stats, BACKEND_OP_DELETE,
+                          backend_stats_now () - start, 0, ret >= 0);
+    return ret;
+}
+
+/* Recorded as one exists call per block, each taking an equal share. */
+static void
+block_backend_stats_exists_batch (BlockBackend *bend,
+                                  const char **block_ids,
+                                  int n_blocks,
+                                  gboolean *exists)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    gint64 usec;
+    int i;
+
+    priv->inner->exists_batch (priv->inner, block_ids, n_blocks, exists);
+
+    if (n_blocks == 0)
+        return;
+    usec = (backend_stats_now () - start) / n_blocks;
+    for (i = 0; i < n_blocks; ++i)
+        backend_stats_record (priv->stats, BACKEND_OP_EXISTS, usec, 0, TRUE);
+}
+
+static BMetadata *
+block_backend_stats_stat_block (BlockBackend *bend, const char *block_id)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    BMetadata *ret;
+
+    ret = priv->inner->stat_block (priv->inner, block_id);
+
+    backend_stats_record (priv->stats, BACKEND_OP_STAT,
+                          backend_stats_now () - start, 0, ret != NULL);
+    return ret;
+}
+
+static BMetadata *
+block_backend_stats_stat_block_by_handle (BlockBackend *bend,
+                                          BHandle *handle)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    BMetadata *ret;
+
+    ret = priv->inner->stat_block_by_handle (priv->inner, handle);
+
+    backend_stats_record (priv->stats, BACKEND_OP_STAT,
+                          backend_stats_now () - start, 0, ret != NULL);
+    return ret;
+}
+
+static void
+block_backend_stats_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    priv->inner->block_handle_free (priv->inner, handle);
+}
+
+static int
+block_backend_stats_foreach_block (BlockBackend *bend,
+                                   SeafBlockFunc process,
+                                   void *user_data)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->foreach_block (priv->inner, process, user_data);
+}
+
+static int
+block_backend_stats_foreach_block_parallel (BlockBackend *bend,
+                                            int n_threads,
+                                            SeafBlockFunc process,
+                                            void *user_data)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->foreach_block_parallel (priv->inner, n_threads,
+                                                process, user_data);
+}
+
+static int
+block_backend_stats_get_fd (BlockBackend *bend, BHandle *handle)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->get_fd (priv->inner, handle);
+}
+
+static int
+block_backend_stats_read_range (BlockBackend *bend, const char *block_id,
+                                guint64 offset, void *buf, int len)
+{
+    StatsPriv *priv = bend->be_priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->read_range (priv->inner, block_id, offset, buf, len);
+
+    backend_stats_record (priv->stats, BACKEND_OP_READ,
+                          backend_stats_now () - start, ret, ret >= 0);
+    return ret;
+}
+
+static int
+block_backend_stats_compact (BlockBackend *bend)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->compact (priv->inner);
+}
+
+static guint32
+block_backend_stats_partial_size (BlockBackend *bend, const char *block_id)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->partial_size (priv->inner, block_id);
+}
+
+static BHandle *
+block_backend_stats_open_partial (BlockBackend *bend, const char *block_id,
+                                  guint32 offset)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->open_partial (priv->inner, block_id, offset);
+}
+
+static int
+block_backend_stats_remove_partial (BlockBackend *bend, const char *block_id)
+{
+    StatsPriv *priv = bend->be_priv;
+
+    return priv->inner->remove_partial (priv->inner, block_id);
+}
+
+BlockBackend *
+block_backend_stats_new (BlockBackend *inner, BackendStats *stats)
+{
+    BlockBackend *bend;
+    StatsPriv *priv;
+
+    priv = g_new0 (StatsPriv, 1);
+    priv->inner = inner;
+    priv->stats = stats;
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_stats_open_block;
+    bend->read_block = block_backend_stats_read_block;
+    bend->write_block = block_backend_stats_write_block;
+    bend->commit_block = block_backend_stats_commit_block;
+    bend->close_block = block_backend_stats_close_block;
+    bend->exists = block_backend_stats_exists;
+    bend->remove_block = block_backend_stats_remove_block;
+    bend->stat_block = block_backend_stats_stat_block;
+    bend->stat_block_by_handle = block_backend_stats_stat_block_by_handle;
+    bend->block_handle_free = block_backend_stats_block_handle_free;
+    bend->foreach_block = block_backend_stats_foreach_block;
+    if (inner->exists_batch)
+        bend->exists_batch = block_backend_stats_exists_batch;
+    if (inner->get_fd)
+        bend->get_fd = block_backend_stats_get_fd;
+    if (inner->read_range)
+        bend->read_range = block_backend_stats_read_range;
+    if (inner->compact)
+        bend->compact = block_backend_stats_compact;
+    if (inner->partial_size)
+        bend->partial_size = block_backend_stats_partial_size;
+    if (inner->open_partial)
+        bend->open_partial = block_backend_stats_open_partial;
+    if (inner->remove_partial)
+        bend->remove_partial = block_backend_stats_remove_partial;
+    if (inner->foreach_block_parallel)
+        bend->foreach_block_parallel =
+            block_backend_stats_foreach_block_parallel;
+
+    return bend;
+}
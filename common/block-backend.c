@@ -2,35 +2,76 @@
 #include "common.h"
 
 #include "block-backend.h"
+#include "backend-stats.h"
+#include "s3-client.h"
 
 extern BlockBackend *
-block_backend_fs_new (const char *block_dir, const char *tmp_dir);
+block_backend_fs_new (const char *block_dir, const char *tmp_dir,
+                      int durability, gboolean sync_dir);
 
 #ifdef SEAFILE_SERVER
 extern BlockBackend *
-block_backend_ceph_new (const char *ceph_conf, const char *poolname);
+block_backend_ceph_new (const char *ceph_conf, const char *poolname,
+                        gboolean async_io, int list_threads, int list_rate);
+
+extern BlockBackend *
+block_backend_cache_new (BlockBackend *remote, const char *cache_dir,
+                         gint64 max_size, gboolean write_back,
+                         gboolean admit_always);
+
+extern BlockBackend *
+block_backend_s3_new (const SeafS3Config *conf, int max_connections,
+                      int parallel, int part_size,
+                      gint64 multipart_threshold, int list_threads);
+
+extern BlockBackend *
+block_backend_container_new (BlockBackend *inner, struct SeafDB *db,
+                             int threshold, int container_size);
 #endif
 
 BlockBackend*
-load_filesystem_block_backend(GKeyFile *config)
+load_filesystem_block_backend(GKeyFile *config, const char *group)
 {
     BlockBackend *bend;
     char *tmp_dir;
     char *block_dir;
+    char *durability;
+    int mode = BLOCK_DURABILITY_NONE;
+    gboolean sync_dir;
+    GError *error = NULL;
     
-    block_dir = g_key_file_get_string (config, "block_backend", "block_dir", NULL);
+    block_dir = g_key_file_get_string (config, group, "block_dir", NULL);
     if (!block_dir) {
         g_warning ("Block dir not set in config.\n");
         return NULL;
     }
 
-    tmp_dir = g_key_file_get_string (config, "block_backend", "tmp_dir", NULL);
+    tmp_dir = g_key_file_get_string (config, group, "tmp_dir", NULL);
     if (!tmp_dir) {
         g_warning ("Block tmp dir not set in config.\n");
         return NULL;
     }
 
-    bend = block_backend_fs_new (block_dir, tmp_dir);
+    durability = g_key_file_get_string (config, group, "durability", NULL);
+    if (durability) {
+        if (strcmp (durability, "fsync") == 0)
+            mode = BLOCK_DURABILITY_FSYNC;
+        else if (strcmp (durability, "group") == 0)
+            mode = BLOCK_DURABILITY_GROUP;
+        else if (strcmp (durability, "none") != 0)
+            g_warning ("Unknown block durability %s, using none.\n",
+                       durability);
+        g_free (durability);
+    }
+
+    /* Sync the block directories after renaming, unless turned off. */
+    sync_dir = g_key_file_get_boolean (config, group, "sync_dir", &error);
+    if (error) {
+        sync_dir = TRUE;
+        g_clear_error (&error);
+    }
+
+    bend = block_backend_fs_new (block_dir, tmp_dir, mode, sync_dir);
 
     g_free (block_dir);
     g_free (tmp_dir);
@@ -39,25 +80,35 @@ load_filesystem_block_backend(GKeyFile *config)
 
 #ifdef SEAFILE_SERVER
 BlockBackend*
-load_ceph_block_backend(GKeyFile *config)
+load_ceph_block_backend(GKeyFile *config, const char *group)
 {
     BlockBackend *bend;
     char *ceph_conf;
     char *poolname;
+    gboolean async_io;
+    int list_threads, list_rate;
 
-    ceph_conf = g_key_file_get_string (config, "block_backend",  "ceph_config", NULL);
+    ceph_conf = g_key_file_get_string (config, group, "ceph_config", NULL);
     if (!ceph_conf) {
         g_warning("Ceph config file not set in config.\n");
         return NULL;
     }
 
-    poolname = g_key_file_get_string (config, "block_backend", "pool", NULL);
+    poolname = g_key_file_get_string (config, group, "pool", NULL);
     if (!poolname) {
         g_warning("Ceph poolname not set in config.\n");
         return NULL;
     }
 
-    bend = block_backend_ceph_new (ceph_conf, poolname);
+    /* Write and commit blocks in one operation, see block-backend-ceph.c. */
+    async_io = g_key_file_get_boolean (config, group, "async_io", NULL);
+
+    /* Listing the pool for GC, see block_backend_ceph_foreach_block(). */
+    list_threads = g_key_file_get_integer (config, group, "list_threads", NULL);
+    list_rate = g_key_file_get_integer (config, group, "list_rate", NULL);
+
+    bend = block_backend_ceph_new (ceph_conf, poolname, async_io,
+                                   list_threads, list_rate);
 
     g_free (ceph_conf);
     g_free (poolname);
@@ -66,26 +117,182 @@ load_ceph_block_backend(GKeyFile *config)
 }
 #endif
 
+#ifdef SEAFILE_SERVER
 BlockBackend*
-load_block_backend (GKeyFile *config)
+load_s3_block_backend(GKeyFile *config, const char *group)
+{
+    BlockBackend *bend = NULL;
+    SeafS3Config conf;
+    GError *error = NULL;
+    int max_connections, parallel, part_size, threshold, list_threads;
+
+    memset (&conf, 0, sizeof(conf));
+
+    conf.host = g_key_file_get_string (config, group, "host", NULL);
+    conf.bucket = g_key_file_get_string (config, group, "bucket", NULL);
+    conf.access_key = g_key_file_get_string (config, group, "access_key", NULL);
+    conf.secret_key = g_key_file_get_string (config, group, "secret_key", NULL);
+    if (!conf.host || !conf.bucket || !conf.access_key || !conf.secret_key) {
+        g_warning ("S3 host, bucket, access_key or secret_key "
+                   "not set in config.\n");
+        goto out;
+    }
+
+    conf.region = g_key_file_get_string (config, group, "region", NULL);
+    if (!conf.region)
+        conf.region = g_strdup ("us-east-1");
+
+    conf.use_https = g_key_file_get_boolean (config, group,
+                                             "use_https", &error);
+    if (error) {
+        conf.use_https = TRUE;
+        g_clear_error (&error);
+    }
+
+    /* Most S3 compatible stores don't have bucket subdomains. */
+    conf.path_style = g_key_file_get_boolean (config, group,
+                                              "path_style", &error);
+    if (error) {
+        conf.path_style = TRUE;
+        g_clear_error (&error);
+    }
+
+    max_connections = g_key_file_get_integer (config, group,
+                                              "max_connections", NULL);
+    parallel = g_key_file_get_integer (config, group,
+                                       "parallel_requests", NULL);
+    /* In MB. */
+    part_size = g_key_file_get_integer (config, group, "part_size", NULL);
+    threshold = g_key_file_get_integer (config, group,
+                                        "multipart_threshold", NULL);
+    list_threads = g_key_file_get_integer (config, group, "list_threads", NULL);
+
+    bend = block_backend_s3_new (&conf, max_connections, parallel,
+                                 part_size << 20, (gint64)threshold << 20,
+                                 list_threads);
+
+out:
+    g_free (conf.host);
+    g_free (conf.bucket);
+    g_free (conf.access_key);
+    g_free (conf.secret_key);
+    g_free (conf.region);
+    return bend;
+}
+#endif
+
+#ifdef SEAFILE_SERVER
+/* Size of the cache in MB, if cache_size is not set. */
+#define DEFAULT_CACHE_SIZE 10240
+
+/*
+ * Put a local cache in front of a remote backend if cache_dir is set.
+ * See block-backend-cache.c.
+ */
+static BlockBackend *
+load_block_cache (GKeyFile *config, const char *group,
+                  BlockBackend *remote)
+{
+    BlockBackend *bend;
+    char *cache_dir;
+    char *mode, *admission;
+    gint64 size;
+    gboolean write_back = FALSE, admit_always = FALSE;
+
+    cache_dir = g_key_file_get_string (config, group, "cache_dir", NULL);
+    if (!cache_dir)
+        return remote;
+
+    size = g_key_file_get_integer (config, group, "cache_size", NULL);
+    if (size <= 0)
+        size = DEFAULT_CACHE_SIZE;
+
+    mode = g_key_file_get_string (config, group, "cache_mode", NULL);
+    if (mode) {
+        if (strcmp (mode, "write-back") == 0)
+            write_back = TRUE;
+        else if (strcmp (mode, "write-through") != 0)
+            g_warning ("Unknown cache mode %s, using write-through.\n", mode);
+        g_free (mode);
+    }
+
+    /* By default a block read from the remote is cached on its second read. */
+    admission = g_key_file_get_string (config, group, "cache_admission", NULL);
+    if (admission) {
+        if (strcmp (admission, "always") == 0)
+            admit_always = TRUE;
+        else if (strcmp (admission, "second-read") != 0)
+            g_warning ("Unknown cache admission %s, using second-read.\n",
+                       admission);
+        g_free (admission);
+    }
+
+    bend = block_backend_cache_new (remote, cache_dir, size << 20,
+                                    write_back, admit_always);
+    g_free (cache_dir);
+
+    /* Still usable without the cache. */
+    return bend ? bend : remote;
+}
+
+#define DEFAULT_CONTAINER_SIZE 8
+
+BlockBackend *
+load_block_containers (GKeyFile *config, BlockBackend *inner,
+                       struct SeafDB *db)
+{
+    BlockBackend *bend;
+    int threshold, size;
+
+    /* In KB, blocks of this size or larger are stored on their own. */
+    threshold = g_key_file_get_integer (config, "block_backend",
+                                        "container_threshold", NULL);
+    if (threshold <= 0)
+        return inner;
+
+    size = g_key_file_get_integer (config, "block_backend",
+                                   "container_size", NULL);
+    if (size <= 0)
+        size = DEFAULT_CONTAINER_SIZE;
+
+    bend = block_backend_container_new (inner, db, threshold << 10,
+                                        size << 20);
+    if (!bend)
+        g_warning ("Failed to load block containers.\n");
+
+    return bend ? bend : inner;
+}
+#endif
+
+BlockBackend*
+load_block_backend_group (GKeyFile *config, const char *group)
 {
     char *backend;
     BlockBackend *bend;
 
-    backend = g_key_file_get_string (config, "block_backend", "name", NULL);
+    backend = g_key_file_get_string (config, group, "name", NULL);
     if (!backend) {
         return NULL;
     }
 
     if (strcmp(backend, "filesystem") == 0) {
-        bend = load_filesystem_block_backend(config);
+        bend = load_filesystem_block_backend(config, group);
         g_free (backend);
         return bend;
     }
 #ifdef SEAFILE_SERVER
     else if (strcmp(backend, "ceph") == 0) {
-        bend = load_ceph_block_backend(config);
+        bend = load_ceph_block_backend(config, group);
+        g_free(backend);
+        if (bend)
+            bend = load_block_cache (config, group, bend);
+        return bend;
+    }
+    else if (strcmp(backend, "s3") == 0) {
+        bend = load_s3_block_backend(config, group);
         g_free(backend);
+        if (bend)
+            bend = load_block_cache (config, group, bend);
         return bend;
     }
 #endif
@@ -93,3 +300,62 @@ load_block_backend (GKeyFile *config)
     g_warning ("Unknown backend\n");
     return NULL;
 }
+
+BlockBackend*
+load_block_backend (GKeyFile *config)
+{
+    return load_block_backend_group (config, "block_backend");
+}
+
+#ifdef SEAFILE_SERVER
+BlockBackend *
+load_storage_classes (GKeyFile *config, BlockBackend *default_bend,
+                      BackendStats *stats)
+{
+    char **names;
+    gsize n_names, i;
+    char **class_names;
+    BlockBackend **backends;
+    BlockBackend *bend = NULL;
+    char *group;
+    int n = 0;
+
+    names = g_key_file_get_string_list (config, "storage_classes", "names",
+                                        &n_names, NULL);
+    if (!names || n_names == 0) {
+        g_strfreev (names);
+        return default_bend;
+    }
+
+    class_names = g_new0 (char *, n_names + 2);
+    backends = g_new0 (BlockBackend *, n_names + 1);
+    class_names[n] = g_strdup (STORAGE_CLASS_DEFAULT);
+    backends[n++] = default_bend;
+
+    for (i = 0; i < n_names; ++i) {
+        g_strstrip (names[i]);
+        if (names[i][0] == '\0' ||
+            strcmp (names[i], STORAGE_CLASS_DEFAULT) == 0)
+            continue;
+
+        group = g_strdup_printf ("storage_class:%s", names[i]);
+        backends[n] = load_block_backend_group (config, group);
+        g_free (group);
+        if (!backends[n]) {
+            g_warning ("Failed to load storage class %s.\n", names[i]);
+            goto out;
+        }
+        if (stats)
+            backends[n] = block_backend_stats_new (backends[n], stats);
+        class_names[n++] = g_strdup (names[i]);
+    }
+
+    bend = block_backend_class_new (class_names, backends, n);
+
+out:
+    g_strfreev (names);
+    g_strfreev (class_names);
+    g_free (backends);
+    return bend;
+}
+#endif
@@ -31,6 +31,43 @@ struct BlockBackend {
 
     int      (*foreach_block) (BlockBackend *bend, SeafBlockFunc process, void *user_data);
 
+    /* Optional. Set @exists[i] for each of @n_blocks blocks at once. */
+    void     (*exists_batch) (BlockBackend *bend, const char **block_ids,
+                              int n_blocks, gboolean *exists);
+
+    /* Optional. The file descriptor of an open block, owned by @handle.
+     * Only for backends that keep blocks in local files. */
+    int      (*get_fd) (BlockBackend *bend, BHandle *handle);
+
+    /* Optional. Read @len bytes at @offset of a block without opening it.
+     * Returns the bytes read, or -1 on error. */
+    int      (*read_range) (BlockBackend *bend, const char *block_id,
+                            guint64 offset, void *buf, int len);
+
+    /* Optional. Reclaim space left by removed blocks, see
+     * seaf_block_manager_compact(). */
+    int      (*compact) (BlockBackend *bend);
+
+    /* Optional. Like foreach_block, but @process is called from up to
+     * @n_threads threads at once. */
+    int      (*foreach_block_parallel) (BlockBackend *bend, int n_threads,
+                                        SeafBlockFunc process,
+                                        void *user_data);
+
+    /* Optional. Blocks written but not committed are kept, so that an
+     * interrupted transfer can continue. Returns the size of the partial
+     * block @block_id, 0 if there is none. */
+    guint32  (*partial_size) (BlockBackend *bend, const char *block_id);
+
+    /* Optional. Reopen the partial block @block_id for write, cut to its
+     * first @offset bytes. The kept bytes can be read from the handle
+     * before the rest is written. NULL if it has less than @offset bytes. */
+    BHandle* (*open_partial) (BlockBackend *bend, const char *block_id,
+                              guint32 offset);
+
+    /* Optional. */
+    int      (*remove_partial) (BlockBackend *bend, const char *block_id);
+
     void*    be_priv;           /* backend private field */
 
 };
@@ -38,4 +75,83 @@ struct BlockBackend {
 
 BlockBackend* load_block_backend (GKeyFile *config);
 
+/* Load the backend configured in the @group section of @config. */
+BlockBackend* load_block_backend_group (GKeyFile *config, const char *group);
+
+struct SeafDB;
+
+/*
+ * Pack small blocks of @inner into containers indexed in @db, if
+ * container_threshold is set in [block_backend]. Returns @inner otherwise.
+ */
+BlockBackend *
+load_block_containers (GKeyFile *config, BlockBackend *inner,
+                       struct SeafDB *db);
+
+/*
+ * Storage classes, several named backends behind one.
+ *
+ * The backend of [block_backend] is the class "default". Other classes
+ * are listed in the [storage_classes] section,
+ *
+ *     [storage_classes]
+ *     names = ssd;archive
+ *
+ *     [storage_class:ssd]
+ *     name = filesystem
+ *     block_dir = ...
+ *
+ * with the same options as [block_backend] in each [storage_class:<name>]
+ * section. The other classes are wrapped with @stats if it's not NULL,
+ * like @default_bend is expected to be. Returns @default_bend if no
+ * other class is set, NULL if a class fails to load.
+ */
+#define STORAGE_CLASS_DEFAULT "default"
+
+struct BackendStats;
+
+BlockBackend *
+load_storage_classes (GKeyFile *config, BlockBackend *default_bend,
+                      struct BackendStats *stats);
+
+/*
+ * @backends[i] is the class named @names[i], the first one is the
+ * default. Blocks opened for write without a class go to the default.
+ * Blocks are read, stat'ed and removed in whichever class has them, so
+ * a block stays readable while it's moved between classes.
+ */
+BlockBackend *
+block_backend_class_new (char **names, BlockBackend **backends, int n);
+
+/* Index of the class @name, or -1. */
+int
+block_backend_class_find (BlockBackend *bend, const char *name);
+
+const char *
+block_backend_class_name (BlockBackend *bend, int class_idx);
+
+/* Blocks opened for read are looked up in class @class_idx first. */
+BHandle *
+block_backend_class_open_block (BlockBackend *bend, int class_idx,
+                                const char *block_id, int rw_type);
+
+/*
+ * Copy @block_id into class @class_idx if it's not there, then remove it
+ * from the other classes. Returns -1 if the block is in no class.
+ */
+int
+block_backend_class_move_block (BlockBackend *bend, int class_idx,
+                                const char *block_id);
+
+/*
+ * How the filesystem backend makes committed blocks durable.
+ * NONE leaves it to the kernel. FSYNC syncs every block on commit.
+ * GROUP makes commits from concurrent writers share their syncs.
+ */
+enum {
+    BLOCK_DURABILITY_NONE = 0,
+    BLOCK_DURABILITY_FSYNC,
+    BLOCK_DURABILITY_GROUP,
+};
+
 #endif
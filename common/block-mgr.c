@@ -14,22 +14,39 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <glib/gstdio.h>
 
 #include "block-backend.h"
+#include "backend-stats.h"
+#include "seaf-probes.h"
 
 #define SEAF_BLOCK_DIR "blocks"
 
 
 extern BlockBackend *
-block_backend_fs_new (const char *block_dir, const char *tmp_dir);
+block_backend_fs_new (const char *block_dir, const char *tmp_dir,
+                      int durability, gboolean sync_dir);
 
+#ifdef SEAFILE_SERVER
+static void
+load_prefetch_config (SeafBlockManager *mgr, GKeyFile *config);
+
+static int
+init_storage_classes (SeafBlockManager *mgr);
+
+static int
+get_repo_class (SeafBlockManager *mgr, const char *repo_id);
+#endif
 
 SeafBlockManager *
 seaf_block_manager_new (struct _SeafileSession *seaf,
                         const char *seaf_dir)
 {
     SeafBlockManager *mgr;
+#ifdef SEAFILE_SERVER
+    BlockBackend *bend;
+#endif
 
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
@@ -40,7 +57,8 @@ seaf_block_manager_new (struct _SeafileSession *seaf,
     if (!mgr->backend) {
         char *block_dir;
         block_dir = g_build_filename (seaf_dir, SEAF_BLOCK_DIR, NULL);
-        mgr->backend = block_backend_fs_new (block_dir, seaf->tmp_file_dir);
+        mgr->backend = block_backend_fs_new (block_dir, seaf->tmp_file_dir,
+                                              BLOCK_DURABILITY_NONE, FALSE);
         g_free (block_dir);
         if (!mgr->backend) {
             g_warning ("[Block mgr] Failed to load backend.\n");
@@ -48,6 +66,26 @@ seaf_block_manager_new (struct _SeafileSession *seaf,
         }
     }
 
+#ifdef SEAFILE_SERVER
+    mgr->backend = load_block_containers (seaf->config, mgr->backend, seaf->db);
+
+    mgr->stats = backend_stats_new ();
+    mgr->backend = block_backend_stats_new (mgr->backend, mgr->stats);
+
+    /* The router goes outside the stats, so that it hands out its own
+     * handles. Each class is counted in the same stats. */
+    bend = load_storage_classes (seaf->config, mgr->backend, mgr->stats);
+    if (!bend)
+        goto onerror;
+    if (bend != mgr->backend) {
+        mgr->backend = mgr->router = bend;
+        if (init_storage_classes (mgr) < 0)
+            goto onerror;
+    }
+
+    load_prefetch_config (mgr, seaf->config);
+#endif
+
     return mgr;
 
 onerror:
@@ -68,7 +106,42 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
                                const char *block_id,
                                int rw_type)
 {
-    return mgr->backend->open_block (mgr->backend, block_id, rw_type);
+    BlockHandle *handle;
+
+    /* Added before the block exists, see exists-filter.h. */
+    if (mgr->filter && rw_type == BLOCK_WRITE)
+        exists_filter_add (mgr->filter, block_id);
+
+    handle = mgr->backend->open_block (mgr->backend, block_id, rw_type);
+    SEAF_PROBE3 (block_open, block_id, rw_type, handle);
+
+    return handle;
+}
+
+BlockHandle *
+seaf_block_manager_open_repo_block (SeafBlockManager *mgr,
+                                    const char *repo_id,
+                                    const char *block_id,
+                                    int rw_type)
+{
+#ifdef SEAFILE_SERVER
+    BlockHandle *handle;
+
+    if (!mgr->router || !repo_id)
+        return seaf_block_manager_open_block (mgr, block_id, rw_type);
+
+    if (mgr->filter && rw_type == BLOCK_WRITE)
+        exists_filter_add (mgr->filter, block_id);
+
+    handle = block_backend_class_open_block (mgr->router,
+                                             get_repo_class (mgr, repo_id),
+                                             block_id, rw_type);
+    SEAF_PROBE3 (block_open, block_id, rw_type, handle);
+
+    return handle;
+#else
+    return seaf_block_manager_open_block (mgr, block_id, rw_type);
+#endif
 }
 
 int
@@ -76,7 +149,13 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len)
 {
-    return mgr->backend->read_block (mgr->backend, handle, buf, len);
+    int ret;
+
+    SEAF_PROBE2 (block_read_start, handle, len);
+    ret = mgr->backend->read_block (mgr->backend, handle, buf, len);
+    SEAF_PROBE2 (block_read_done, handle, ret);
+
+    return ret;
 }
 
 int
@@ -84,7 +163,13 @@ seaf_block_manager_write_block (SeafBlockManager *mgr,
                                 BlockHandle *handle,
                                 const void *buf, int len)
 {
-    return mgr->backend->write_block (mgr->backend, handle, buf, len);
+    int ret;
+
+    SEAF_PROBE2 (block_write_start, handle, len);
+    ret = mgr->backend->write_block (mgr->backend, handle, buf, len);
+    SEAF_PROBE2 (block_write_done, handle, ret);
+
+    return ret;
 }
 
 int
@@ -105,15 +190,66 @@ int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle)
 {
-    return mgr->backend->commit_block (mgr->backend, handle);
+    int ret;
+
+    SEAF_PROBE1 (block_commit_start, handle);
+    ret = mgr->backend->commit_block (mgr->backend, handle);
+    SEAF_PROBE2 (block_commit_done, handle, ret);
+
+    return ret;
 }
     
 gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                           const char *block_id)
 {
+    if (mgr->filter && !exists_filter_test (mgr->filter, block_id))
+        return FALSE;
+
     return mgr->backend->exists (mgr->backend, block_id);
 }
 
+void
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *exists)
+{
+    BlockBackend *bend = mgr->backend;
+    const char **ids = block_ids;
+    gboolean *res = exists;
+    int *index = NULL;
+    int i, n = n_blocks;
+
+    /* Only ask the backend about the blocks the filter doesn't rule out. */
+    if (mgr->filter) {
+        ids = g_new (const char *, n_blocks);
+        res = g_new (gboolean, n_blocks);
+        index = g_new (int, n_blocks);
+        for (i = 0, n = 0; i < n_blocks; ++i) {
+            exists[i] = FALSE;
+            if (exists_filter_test (mgr->filter, block_ids[i])) {
+                index[n] = i;
+                ids[n++] = block_ids[i];
+            }
+        }
+    }
+
+    if (n > 1 && bend->exists_batch) {
+        bend->exists_batch (bend, ids, n, res);
+    } else {
+        for (i = 0; i < n; ++i)
+            res[i] = bend->exists (bend, ids[i]);
+    }
+
+    if (index) {
+        for (i = 0; i < n; ++i)
+            exists[index[i]] = res[i];
+        g_free (ids);
+        g_free (res);
+        g_free (index);
+    }
+}
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *block_id)
@@ -135,6 +271,93 @@ seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
     return mgr->backend->stat_block_by_handle (mgr->backend, handle);
 }
 
+gboolean
+seaf_block_manager_has_block_fds (SeafBlockManager *mgr)
+{
+    return (mgr->backend->get_fd != NULL);
+}
+
+int
+seaf_block_manager_get_handle_fd (SeafBlockManager *mgr, BlockHandle *handle)
+{
+    if (!mgr->backend->get_fd)
+        return -1;
+    return mgr->backend->get_fd (mgr->backend, handle);
+}
+
+int
+seaf_block_manager_open_block_fd (SeafBlockManager *mgr,
+                                  const char *block_id,
+                                  gint64 *size)
+{
+    BlockHandle *handle;
+    struct stat st;
+    int fd = -1;
+
+    if (!mgr->backend->get_fd)
+        return -1;
+
+    handle = seaf_block_manager_open_block (mgr, block_id, BLOCK_READ);
+    if (!handle)
+        return -1;
+
+    /* The handle's descriptor is closed with the handle. */
+    fd = dup (mgr->backend->get_fd (mgr->backend, handle));
+    if (fd < 0 || fstat (fd, &st) < 0) {
+        g_warning ("[block mgr] Failed to open block %s: %s.\n",
+                   block_id, strerror(errno));
+        if (fd >= 0)
+            close (fd);
+        fd = -1;
+        goto out;
+    }
+    *size = (gint64)st.st_size;
+
+out:
+    seaf_block_manager_close_block (mgr, handle);
+    seaf_block_manager_block_handle_free (mgr, handle);
+    return fd;
+}
+
+int
+seaf_block_manager_compact (SeafBlockManager *mgr)
+{
+    if (!mgr->backend->compact)
+        return 0;
+    return mgr->backend->compact (mgr->backend);
+}
+
+guint32
+seaf_block_manager_partial_block_size (SeafBlockManager *mgr,
+                                       const char *block_id)
+{
+    if (!mgr->backend->partial_size)
+        return 0;
+    return mgr->backend->partial_size (mgr->backend, block_id);
+}
+
+BlockHandle *
+seaf_block_manager_open_partial_block (SeafBlockManager *mgr,
+                                       const char *block_id,
+                                       guint32 offset)
+{
+    if (!mgr->backend->open_partial)
+        return NULL;
+
+    if (mgr->filter)
+        exists_filter_add (mgr->filter, block_id);
+
+    return mgr->backend->open_partial (mgr->backend, block_id, offset);
+}
+
+void
+seaf_block_manager_remove_partial_block (SeafBlockManager *mgr,
+                                         const char *block_id)
+{
+    if (mgr->backend->remove_partial)
+        mgr->backend->remove_partial (mgr->backend, block_id);
+}
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   SeafBlockFunc process,
@@ -143,6 +366,19 @@ seaf_block_manager_foreach_block (SeafBlockManager *mgr,
     return mgr->backend->foreach_block (mgr->backend, process, user_data);
 }
 
+int
+seaf_block_manager_foreach_block_parallel (SeafBlockManager *mgr,
+                                           int n_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data)
+{
+    if (n_threads <= 1 || !mgr->backend->foreach_block_parallel)
+        return mgr->backend->foreach_block (mgr->backend, process, user_data);
+
+    return mgr->backend->foreach_block_parallel (mgr->backend, n_threads,
+                                                 process, user_data);
+}
+
 static gboolean
 get_block_number (const char *block_id, void *data)
 {
@@ -163,3 +399,646 @@ seaf_block_manager_get_block_number (SeafBlockManager *mgr)
     return n_blocks;
 }
 
+
+#ifdef SEAFILE_SERVER
+
+#define DEFAULT_FILTER_CAPACITY 50000000
+
+static gboolean
+add_to_filter (const char *block_id, void *user_data)
+{
+    exists_filter_add (user_data, block_id);
+    return TRUE;
+}
+
+static int
+load_filter (ExistsFilter *filter, void *user_data)
+{
+    SeafBlockManager *mgr = user_data;
+
+    return seaf_block_manager_foreach_block (mgr, add_to_filter, filter);
+}
+
+/*
+ * [block_backend]
+ * exists_filter = true
+ * exists_filter_capacity = 50000000   (number of blocks, optional)
+ */
+int
+seaf_block_manager_load_exists_filter (SeafBlockManager *mgr,
+                                       GKeyFile *config)
+{
+    gint64 capacity;
+
+    if (!g_key_file_get_boolean (config, "block_backend", "exists_filter", NULL))
+        return 0;
+
+    capacity = g_key_file_get_integer (config, "block_backend",
+                                       "exists_filter_capacity", NULL);
+    if (capacity <= 0)
+        capacity = DEFAULT_FILTER_CAPACITY;
+
+    mgr->filter = exists_filter_new ((guint64)capacity);
+    return exists_filter_load (mgr->filter, load_filter, mgr);
+}
+
+/* Storage classes */
+
+/* Classes set for a repo or an org are seen by other processes after
+ * at most this long. */
+#define CLASS_CACHE_TTL 60      /* seconds */
+
+typedef struct CachedClass {
+    int    idx;
+    gint64 expire;
+} CachedClass;
+
+struct StorageClassCache {
+    GHashTable      *repos;     /* repo id -> CachedClass */
+    pthread_mutex_t lock;
+};
+
+static int
+init_storage_classes (SeafBlockManager *mgr)
+{
+    SeafDB *db = mgr->seaf->db;
+    char *sql;
+
+    sql = "CREATE TABLE IF NOT EXISTS RepoStorageClass ("
+        "repo_id CHAR(37) PRIMARY KEY, class_name VARCHAR(255))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS OrgStorageClass ("
+        "org_id INTEGER PRIMARY KEY, class_name VARCHAR(255))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    mgr->class_cache = g_new0 (struct StorageClassCache, 1);
+    mgr->class_cache->repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, g_free);
+    pthread_mutex_init (&mgr->class_cache->lock, NULL);
+
+    return 0;
+}
+
+/* The class of the repo, else the class of its org, else the default. */
+static int
+load_repo_class (SeafBlockManager *mgr, const char *repo_id)
+{
+    SeafDB *db = mgr->seaf->db;
+    char *name;
+    int idx = 0;
+
+    name = seaf_db_statement_get_string (db,
+                                         "SELECT class_name FROM "
+                                         "RepoStorageClass WHERE repo_id=?",
+                                         1, "string", repo_id);
+    if (!name)
+        name = seaf_db_statement_get_string (db,
+                                             "SELECT s.class_name FROM "
+                                             "OrgRepo r, OrgStorageClass s "
+                                             "WHERE r.repo_id=? AND "
+                                             "r.org_id=s.org_id",
+                                             1, "string", repo_id);
+    if (name) {
+        idx = block_backend_class_find (mgr->router, name);
+        if (idx < 0) {
+            g_warning ("[block mgr] Unknown storage class %s of repo %s, "
+                       "using the default.\n", name, repo_id);
+            idx = 0;
+        }
+        g_free (name);
+    }
+
+    return idx;
+}
+
+static int
+get_repo_class (SeafBlockManager *mgr, const char *repo_id)
+{
+    struct StorageClassCache *cache = mgr->class_cache;
+    CachedClass *cached;
+    gint64 now = (gint64)time(NULL);
+    int idx;
+
+    pthread_mutex_lock (&cache->lock);
+    cached = g_hash_table_lookup (cache->repos, repo_id);
+    if (cached && cached->expire > now) {
+        idx = cached->idx;
+        pthread_mutex_unlock (&cache->lock);
+        return idx;
+    }
+    pthread_mutex_unlock (&cache->lock);
+
+    idx = load_repo_class (mgr, repo_id);
+
+    cached = g_new0 (CachedClass, 1);
+    cached->idx = idx;
+    cached->expire = now + CLASS_CACHE_TTL;
+    pthread_mutex_lock (&cache->lock);
+    g_hash_table_replace (cache->repos, g_strdup(repo_id), cached);
+    pthread_mutex_unlock (&cache->lock);
+
+    return idx;
+}
+
+gboolean
+seaf_block_manager_has_storage_classes (SeafBlockManager *mgr)
+{
+    return (mgr->router != NULL);
+}
+
+static int
+find_class (SeafBlockManager *mgr, const char *class_name)
+{
+    int idx;
+
+    if (!mgr->router) {
+        g_warning ("[block mgr] No storage classes are set.\n");
+        return -1;
+    }
+
+    idx = block_backend_class_find (mgr->router, class_name);
+    if (idx < 0)
+        g_warning ("[block mgr] Unknown storage class %s.\n", class_name);
+    return idx;
+}
+
+int
+seaf_block_manager_set_repo_class (SeafBlockManager *mgr,
+                                   const char *repo_id,
+                                   const char *class_name)
+{
+    SeafDB *db = mgr->seaf->db;
+    int idx, ret;
+
+    idx = find_class (mgr, class_name);
+    if (idx < 0)
+        return -1;
+
+    if (seaf_db_statement_query (db,
+                                 "DELETE FROM RepoStorageClass WHERE repo_id=?",
+                                 1, "string", repo_id) < 0)
+        return -1;
+    ret = seaf_db_statement_query (db,
+                                   "INSERT INTO RepoStorageClass "
+                                   "(repo_id, class_name) VALUES (?, ?)",
+                                   2, "string", repo_id, "string", class_name);
+    if (ret < 0)
+        return -1;
+
+    pthread_mutex_lock (&mgr->class_cache->lock);
+    g_hash_table_remove (mgr->class_cache->repos, repo_id);
+    pthread_mutex_unlock (&mgr->class_cache->lock);
+
+    return 0;
+}
+
+int
+seaf_block_manager_set_org_class (SeafBlockManager *mgr,
+                                  int org_id,
+                                  const char *class_name)
+{
+    SeafDB *db = mgr->seaf->db;
+    int idx, ret;
+
+    idx = find_class (mgr, class_name);
+    if (idx < 0)
+        return -1;
+
+    if (seaf_db_statement_query (db,
+                                 "DELETE FROM OrgStorageClass WHERE org_id=?",
+                                 1, "int", org_id) < 0)
+        return -1;
+    ret = seaf_db_statement_query (db,
+                                   "INSERT INTO OrgStorageClass "
+                                   "(org_id, class_name) VALUES (?, ?)",
+                                   2, "int", org_id, "string", class_name);
+    if (ret < 0)
+        return -1;
+
+    /* Which cached repos are in the org isn't known. */
+    pthread_mutex_lock (&mgr->class_cache->lock);
+    g_hash_table_remove_all (mgr->class_cache->repos);
+    pthread_mutex_unlock (&mgr->class_cache->lock);
+
+    return 0;
+}
+
+char *
+seaf_block_manager_get_repo_class (SeafBlockManager *mgr,
+                                   const char *repo_id)
+{
+    if (!mgr->router)
+        return g_strdup (STORAGE_CLASS_DEFAULT);
+
+    return g_strdup (block_backend_class_name (mgr->router,
+                                               get_repo_class (mgr, repo_id)));
+}
+
+int
+seaf_block_manager_move_block (SeafBlockManager *mgr,
+                               const char *block_id,
+                               const char *class_name)
+{
+    int idx;
+
+    idx = find_class (mgr, class_name);
+    if (idx < 0)
+        return -1;
+
+    return block_backend_class_move_block (mgr->router, idx, block_id);
+}
+
+/* Prefetching */
+
+#define DEFAULT_PREFETCH_BLOCKS 4
+#define DEFAULT_PREFETCH_THREADS 8
+#define DEFAULT_PREFETCH_MEMORY 256     /* MB */
+
+enum {
+    SLOT_PENDING,
+    SLOT_DONE,
+    SLOT_FAILED,
+};
+
+typedef struct PrefetchSlot {
+    int     status;
+    char    *data;
+    int     len;
+} PrefetchSlot;
+
+struct _SeafBlockPrefetcher {
+    SeafBlockManager *mgr;
+
+    char    *blk_ids;           /* n_blocks ids of 41 bytes each */
+    int     n_blocks;
+
+    /* Block i is fetched into slot i % depth. */
+    int     depth;
+    PrefetchSlot *slots;
+
+    int     next_read;          /* next block returned to the reader */
+    int     next_fetch;         /* next block to queue */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int     refcnt;             /* the reader and every queued fetch */
+    gboolean cancelled;
+
+    SeafPrefetchNotifyFunc notify;
+    void   *notify_data;
+
+    SeafPrefetchTransformFunc transform;
+    void   *transform_data;
+    GDestroyNotify transform_destroy;
+};
+
+typedef struct PrefetchTask {
+    SeafBlockPrefetcher *pf;
+    int     idx;
+} PrefetchTask;
+
+static pthread_mutex_t prefetch_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes of fetched blocks not yet taken by readers, of all prefetchers. */
+static gint64 prefetch_mem;
+static pthread_mutex_t prefetch_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void prefetch_thread (void *data, void *user_data);
+
+/*
+ * [block_backend]
+ * prefetch_blocks = 4      (blocks read ahead for each reader)
+ * prefetch_threads = 8     (threads shared by all readers)
+ * prefetch_memory = 256    (MB held by all readers, beyond which each
+ *                           reader only fetches the block it needs next)
+ */
+static void
+load_prefetch_config (SeafBlockManager *mgr, GKeyFile *config)
+{
+    int n;
+
+    n = g_key_file_get_integer (config, "block_backend", "prefetch_blocks", NULL);
+    mgr->prefetch_blocks = (n > 0) ? n : DEFAULT_PREFETCH_BLOCKS;
+
+    n = g_key_file_get_integer (config, "block_backend", "prefetch_threads", NULL);
+    mgr->prefetch_threads = (n > 0) ? n : DEFAULT_PREFETCH_THREADS;
+
+    n = g_key_file_get_integer (config, "block_backend", "prefetch_memory", NULL);
+    mgr->prefetch_memory = (gint64)((n > 0) ? n : DEFAULT_PREFETCH_MEMORY) << 20;
+}
+
+static void
+account_prefetch_mem (gint64 delta)
+{
+    pthread_mutex_lock (&prefetch_mem_lock);
+    prefetch_mem += delta;
+    pthread_mutex_unlock (&prefetch_mem_lock);
+}
+
+static gboolean
+prefetch_mem_exceeded (SeafBlockManager *mgr)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&prefetch_mem_lock);
+    ret = (prefetch_mem >= mgr->prefetch_memory);
+    pthread_mutex_unlock (&prefetch_mem_lock);
+
+    return ret;
+}
+
+/* The pool is created on first use, after threads are initialized. */
+static GThreadPool *
+get_prefetch_pool (SeafBlockManager *mgr)
+{
+    GError *error = NULL;
+
+    pthread_mutex_lock (&prefetch_pool_lock);
+    if (!mgr->prefetch_pool) {
+        mgr->prefetch_pool = g_thread_pool_new (prefetch_thread, mgr,
+                                                mgr->prefetch_threads,
+                                                FALSE, &error);
+        if (error) {
+            g_warning ("Failed to start prefetch thread pool: %s.\n",
+                       error->message);
+            g_clear_error (&error);
+        }
+    }
+    pthread_mutex_unlock (&prefetch_pool_lock);
+
+    return mgr->prefetch_pool;
+}
+
+int
+seaf_block_manager_read_whole_block (SeafBlockManager *mgr,
+                                     const char *blk_id,
+                                     char **data, int *len)
+{
+    BlockHandle *handle;
+    BlockMetadata *bmd;
+    char *buf = NULL;
+    int size, off = 0, n;
+    int ret = -1;
+
+    handle = seaf_block_manager_open_block (mgr, blk_id, BLOCK_READ);
+    if (!handle) {
+        g_warning ("Failed to open block %s.\n", blk_id);
+        return -1;
+    }
+
+    bmd = seaf_block_manager_stat_block_by_handle (mgr, handle);
+    if (!bmd) {
+        g_warning ("Failed to stat block %s.\n", blk_id);
+        goto out;
+    }
+    size = bmd->size;
+    g_free (bmd);
+
+    buf = g_malloc (size > 0 ? size : 1);
+    while (off < size) {
+        n = seaf_block_manager_read_block (mgr, handle, buf + off, size - off);
+        if (n <= 0) {
+            g_warning ("Failed to read block %s.\n", blk_id);
+            goto out;
+        }
+        off += n;
+    }
+
+    *data = buf;
+    *len = size;
+    buf = NULL;
+    ret = 0;
+
+out:
+    g_free (buf);
+    seaf_block_manager_close_block (mgr, handle);
+    seaf_block_manager_block_handle_free (mgr, handle);
+    return ret;
+}
+
+static void
+prefetcher_free (SeafBlockPrefetcher *pf)
+{
+    int i;
+
+    for (i = 0; i < pf->depth; ++i) {
+        if (pf->slots[i].data)
+            account_prefetch_mem (-(gint64)pf->slots[i].len);
+        g_free (pf->slots[i].data);
+    }
+    g_free (pf->slots);
+    if (pf->transform_destroy)
+        pf->transform_destroy (pf->transform_data);
+    g_free (pf->blk_ids);
+    pthread_mutex_destroy (&pf->lock);
+    pthread_cond_destroy (&pf->cond);
+    g_free (pf);
+}
+
+/* Called with pf->lock held. */
+static void
+queue_fetches (SeafBlockPrefetcher *pf)
+{
+    GThreadPool *pool = pf->mgr->prefetch_pool;
+    PrefetchTask *task;
+    PrefetchSlot *slot;
+    GError *error = NULL;
+
+    while (pf->next_fetch < pf->n_blocks &&
+           pf->next_fetch < pf->next_read + pf->depth) {
+        /* The block needed next is always fetched, so every reader
+         * makes progress however much memory the others hold.
+         */
+        if (pf->next_fetch > pf->next_read &&
+            prefetch_mem_exceeded (pf->mgr))
+            break;
+
+        slot = &pf->slots[pf->next_fetch % pf->depth];
+        slot->status = SLOT_PENDING;
+
+        task = g_new0 (PrefetchTask, 1);
+        task->pf = pf;
+        task->idx = pf->next_fetch++;
+
+        g_thread_pool_push (pool, task, &error);
+        if (error) {
+            g_warning ("Failed to queue prefetch: %s.\n", error->message);
+            g_clear_error (&error);
+            g_free (task);
+            slot->status = SLOT_FAILED;
+            continue;
+        }
+        pf->refcnt++;
+    }
+}
+
+static void
+prefetch_thread (void *data, void *user_data)
+{
+    PrefetchTask *task = data;
+    SeafBlockPrefetcher *pf = task->pf;
+    SeafBlockManager *mgr = user_data;
+    PrefetchSlot *slot;
+    char *buf = NULL;
+    int len = 0, ret = -1;
+    gboolean cancelled;
+    int refcnt;
+
+    pthread_mutex_lock (&pf->lock);
+    cancelled = pf->cancelled;
+    pthread_mutex_unlock (&pf->lock);
+
+    if (!cancelled)
+        ret = seaf_block_manager_read_whole_block (mgr,
+                                                   pf->blk_ids + task->idx * 41,
+                                                   &buf, &len);
+    if (ret == 0 && pf->transform)
+        ret = pf->transform (&buf, &len, pf->transform_data);
+
+    pthread_mutex_lock (&pf->lock);
+    if (!pf->cancelled) {
+        slot = &pf->slots[task->idx % pf->depth];
+        slot->data = buf;
+        slot->len = len;
+        slot->status = (ret < 0) ? SLOT_FAILED : SLOT_DONE;
+        if (buf)
+            account_prefetch_mem (len);
+        buf = NULL;
+        pthread_cond_broadcast (&pf->cond);
+        if (pf->notify)
+            pf->notify (pf->notify_data);
+    }
+    refcnt = --pf->refcnt;
+    pthread_mutex_unlock (&pf->lock);
+
+    g_free (buf);
+    if (refcnt == 0)
+        prefetcher_free (pf);
+    g_free (task);
+}
+
+SeafBlockPrefetcher *
+seaf_block_manager_prefetch_blocks (SeafBlockManager *mgr,
+                                    char **blk_ids,
+                                    int n_blocks)
+{
+    return seaf_block_manager_prefetch_blocks_full (mgr, blk_ids, n_blocks,
+                                                    NULL, NULL, NULL);
+}
+
+SeafBlockPrefetcher *
+seaf_block_manager_prefetch_blocks_full (SeafBlockManager *mgr,
+                                         char **blk_ids,
+                                         int n_blocks,
+                                         SeafPrefetchTransformFunc transform,
+                                         void *transform_data,
+                                         GDestroyNotify destroy)
+{
+    SeafBlockPrefetcher *pf;
+    int i;
+
+    if (!get_prefetch_pool (mgr)) {
+        if (destroy)
+            destroy (transform_data);
+        return NULL;
+    }
+
+    pf = g_new0 (SeafBlockPrefetcher, 1);
+    pf->mgr = mgr;
+    pf->n_blocks = n_blocks;
+    pf->blk_ids = g_new (char, n_blocks * 41 + 1);
+    for (i = 0; i < n_blocks; ++i)
+        memcpy (pf->blk_ids + i * 41, blk_ids[i], 41);
+    pf->depth = mgr->prefetch_blocks;
+    pf->slots = g_new0 (PrefetchSlot, pf->depth);
+    pf->refcnt = 1;
+    pf->transform = transform;
+    pf->transform_data = transform_data;
+    pf->transform_destroy = destroy;
+    pthread_mutex_init (&pf->lock, NULL);
+    pthread_cond_init (&pf->cond, NULL);
+
+    pthread_mutex_lock (&pf->lock);
+    queue_fetches (pf);
+    pthread_mutex_unlock (&pf->lock);
+
+    return pf;
+}
+
+static int
+take_next_block (SeafBlockPrefetcher *pf, char **data, int *len,
+                 gboolean wait)
+{
+    PrefetchSlot *slot;
+    int status;
+
+    if (pf->next_read >= pf->n_blocks)
+        return 1;
+
+    pthread_mutex_lock (&pf->lock);
+
+    slot = &pf->slots[pf->next_read % pf->depth];
+    if (!wait && slot->status == SLOT_PENDING) {
+        pthread_mutex_unlock (&pf->lock);
+        return 2;
+    }
+    while (slot->status == SLOT_PENDING)
+        pthread_cond_wait (&pf->cond, &pf->lock);
+
+    status = slot->status;
+    *data = slot->data;
+    *len = slot->len;
+    if (slot->data)
+        account_prefetch_mem (-(gint64)slot->len);
+    slot->data = NULL;
+
+    pf->next_read++;
+    queue_fetches (pf);
+
+    pthread_mutex_unlock (&pf->lock);
+
+    return (status == SLOT_DONE) ? 0 : -1;
+}
+
+int
+seaf_block_prefetcher_next (SeafBlockPrefetcher *pf, char **data, int *len)
+{
+    return take_next_block (pf, data, len, TRUE);
+}
+
+int
+seaf_block_prefetcher_try_next (SeafBlockPrefetcher *pf, char **data, int *len)
+{
+    return take_next_block (pf, data, len, FALSE);
+}
+
+void
+seaf_block_prefetcher_set_notify (SeafBlockPrefetcher *pf,
+                                  SeafPrefetchNotifyFunc func,
+                                  void *data)
+{
+    pthread_mutex_lock (&pf->lock);
+    pf->notify = func;
+    pf->notify_data = data;
+    pthread_mutex_unlock (&pf->lock);
+}
+
+void
+seaf_block_prefetcher_free (SeafBlockPrefetcher *pf)
+{
+    int refcnt;
+
+    /* Fetches still running drop their blocks and the last one frees @pf. */
+    pthread_mutex_lock (&pf->lock);
+    pf->cancelled = TRUE;
+    refcnt = --pf->refcnt;
+    pthread_mutex_unlock (&pf->lock);
+
+    if (refcnt == 0)
+        prefetcher_free (pf);
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #include "block.h"
+#include "exists-filter.h"
 
 struct _SeafileSession;
 
@@ -17,6 +18,23 @@ struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    /* Optional negative lookup filter for seaf_block_manager_block_exists. */
+    ExistsFilter *filter;
+
+    /* Calls into the backend, server only. See backend-stats.h. */
+    struct BackendStats *stats;
+
+    /* Storage classes, server only. The router is the backend if classes
+     * are set in seafile.conf, NULL otherwise. See block-backend.h. */
+    struct BlockBackend *router;
+    struct StorageClassCache *class_cache;
+
+    /* Read-ahead for seaf_block_manager_prefetch_blocks. */
+    GThreadPool *prefetch_pool;
+    int prefetch_blocks;
+    int prefetch_threads;
+    gint64 prefetch_memory;
 };
 
 
@@ -36,6 +54,17 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
                                const char *block_id,
                                int rw_type);
 
+/*
+ * Like seaf_block_manager_open_block(), for a block of @repo_id. Blocks
+ * opened for write are put in the storage class of the repo, and looked
+ * up there first when opened for read.
+ */
+BlockHandle *
+seaf_block_manager_open_repo_block (SeafBlockManager *mgr,
+                                    const char *repo_id,
+                                    const char *block_id,
+                                    int rw_type);
+
 /*
  * Read data from a block.
  * The semantics is similar to readn.
@@ -51,6 +80,12 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len);
 
+/* Read the whole content of a block into a newly allocated buffer. */
+int
+seaf_block_manager_read_whole_block (SeafBlockManager *mgr,
+                                     const char *blk_id,
+                                     char **data, int *len);
+
 /*
  * Write data to a block.
  * The semantics is similar to writen.
@@ -97,6 +132,16 @@ gboolean
 seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                  const char *block_id);
 
+/*
+ * Check many blocks at once, which is much faster than one by one on
+ * backends that support it. @exists[i] is set for @block_ids[i].
+ */
+void
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *exists);
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *block_id);
@@ -109,12 +154,187 @@ BlockMetadata *
 seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
                                          BlockHandle *handle);
 
+/*
+ * Whether the backend keeps blocks in local files, so that they can be
+ * read with seaf_block_manager_open_block_fd().
+ */
+gboolean
+seaf_block_manager_has_block_fds (SeafBlockManager *mgr);
+
+/*
+ * The file descriptor of an open block, e.g. to splice received data
+ * into it. It belongs to @handle and must not be closed.
+ *
+ * Returns: -1 if the backend doesn't keep blocks in local files.
+ */
+int
+seaf_block_manager_get_handle_fd (SeafBlockManager *mgr, BlockHandle *handle);
+
+/*
+ * Open a block as a file, e.g. to send it with sendfile.
+ *
+ * Returns: a file descriptor the caller must close, or -1 on error.
+ * The size of the block is returned in @size.
+ */
+int
+seaf_block_manager_open_block_fd (SeafBlockManager *mgr,
+                                  const char *block_id,
+                                  gint64 *size);
+
+/*
+ * Blocks that were opened for write but never committed, e.g. because
+ * the connection dropped, are kept by backends that support it.
+ * Returns the size of the partial block, 0 if there is none.
+ */
+guint32
+seaf_block_manager_partial_block_size (SeafBlockManager *mgr,
+                                       const char *block_id);
+
+/*
+ * Continue writing a partial block after its first @offset bytes.
+ * The kept bytes are read through the handle first, if needed.
+ *
+ * Returns: NULL if the partial block is shorter than @offset.
+ */
+BlockHandle *
+seaf_block_manager_open_partial_block (SeafBlockManager *mgr,
+                                       const char *block_id,
+                                       guint32 offset);
+
+void
+seaf_block_manager_remove_partial_block (SeafBlockManager *mgr,
+                                         const char *block_id);
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   SeafBlockFunc process,
                                   void *user_data);
 
+/*
+ * Like seaf_block_manager_foreach_block(), but @process may be called
+ * from up to @n_threads threads at once if the backend supports it.
+ */
+int
+seaf_block_manager_foreach_block_parallel (SeafBlockManager *mgr,
+                                           int n_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data);
+
+/*
+ * Reclaim the space of removed blocks that backends can't free right
+ * away, such as blocks packed into containers. Run after GC.
+ */
+int
+seaf_block_manager_compact (SeafBlockManager *mgr);
+
 guint64
 seaf_block_manager_get_block_number (SeafBlockManager *mgr);
 
+#ifdef SEAFILE_SERVER
+/*
+ * Put a negative lookup filter in front of block_exists, if enabled in
+ * @config. Only for the process that writes the blocks, see
+ * exists-filter.h.
+ */
+int
+seaf_block_manager_load_exists_filter (SeafBlockManager *mgr,
+                                       GKeyFile *config);
+
+gboolean
+seaf_block_manager_has_storage_classes (SeafBlockManager *mgr);
+
+/*
+ * Put new blocks of a repo in @class_name. A repo without a class of its
+ * own uses the class of its org, else the default. Blocks already
+ * written stay where they are until moved.
+ */
+int
+seaf_block_manager_set_repo_class (SeafBlockManager *mgr,
+                                   const char *repo_id,
+                                   const char *class_name);
+
+int
+seaf_block_manager_set_org_class (SeafBlockManager *mgr,
+                                  int org_id,
+                                  const char *class_name);
+
+char *
+seaf_block_manager_get_repo_class (SeafBlockManager *mgr,
+                                   const char *repo_id);
+
+/*
+ * Move a block into @class_name, removing it from the other classes.
+ * The block stays readable while it's moved.
+ */
+int
+seaf_block_manager_move_block (SeafBlockManager *mgr,
+                               const char *block_id,
+                               const char *class_name);
+
+/*
+ * Read a list of blocks in order, with the next few blocks fetched in
+ * background threads while the current one is used. The number of blocks
+ * read ahead is set by prefetch_blocks in [block_backend], so at most that
+ * many blocks are held in memory for each reader.
+ */
+typedef struct _SeafBlockPrefetcher SeafBlockPrefetcher;
+
+SeafBlockPrefetcher *
+seaf_block_manager_prefetch_blocks (SeafBlockManager *mgr,
+                                    char **blk_ids,
+                                    int n_blocks);
+
+/*
+ * Called in a prefetch thread on the content of each block read, e.g.
+ * to decrypt it. Replaces *data and *len, freeing the old buffer.
+ * Returns -1 on error.
+ */
+typedef int (*SeafPrefetchTransformFunc) (char **data, int *len,
+                                          void *user_data);
+
+/*
+ * Like seaf_block_manager_prefetch_blocks(), with the blocks passed
+ * through @transform. @destroy is called on @transform_data when the
+ * last fetch is done, which may be after the prefetcher is freed.
+ */
+SeafBlockPrefetcher *
+seaf_block_manager_prefetch_blocks_full (SeafBlockManager *mgr,
+                                         char **blk_ids,
+                                         int n_blocks,
+                                         SeafPrefetchTransformFunc transform,
+                                         void *transform_data,
+                                         GDestroyNotify destroy);
+
+/*
+ * Wait for the next block and return its content in @data, which the
+ * caller must free. Returns 0 on success, 1 after the last block and -1
+ * if the block could not be read.
+ */
+int
+seaf_block_prefetcher_next (SeafBlockPrefetcher *pf, char **data, int *len);
+
+/*
+ * Like seaf_block_prefetcher_next(), but returns 2 instead of waiting if
+ * the next block isn't read yet, so that event loops don't block on I/O.
+ */
+int
+seaf_block_prefetcher_try_next (SeafBlockPrefetcher *pf, char **data, int *len);
+
+/*
+ * @func is called in a prefetch thread whenever a block has been read,
+ * to wake up a reader waiting after _try_next() returned 2. It's never
+ * called after seaf_block_prefetcher_free() returns.
+ */
+typedef void (*SeafPrefetchNotifyFunc) (void *data);
+
+void
+seaf_block_prefetcher_set_notify (SeafBlockPrefetcher *pf,
+                                  SeafPrefetchNotifyFunc func,
+                                  void *data);
+
+/* Can be called before all blocks are read. */
+void
+seaf_block_prefetcher_free (SeafBlockPrefetcher *pf);
+#endif
+
 #endif
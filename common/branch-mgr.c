@@ -12,6 +12,20 @@
 
 #define BRANCH_DB "branch.db"
 
+#ifdef SEAFILE_SERVER
+/* Processes that don't update branches themselves keep cached heads for
+ * this many seconds, unless they watch the updates of seaf-server. */
+#define DEFAULT_CACHE_TTL 2
+/* The cache is cleared when it grows larger than this. */
+#define MAX_CACHED_BRANCHES 100000
+
+typedef struct CachedBranch {
+    char    *name;
+    char    commit_id[41];
+    gint64  fetch_time;
+} CachedBranch;
+#endif
+
 SeafBranch *
 seaf_branch_new (const char *name, const char *repo_id, const char *commit_id)
 {
@@ -82,6 +96,17 @@ struct _SeafBranchManagerPriv {
 #if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
     uint32_t cevent_id;
 #endif    
+
+#ifdef SEAFILE_SERVER
+    /* repo_id -> list of CachedBranch */
+    GHashTable *cache;
+    pthread_mutex_t cache_lock;
+    /* Bumped by every invalidation, so that a lookup that raced with an
+     * update doesn't cache the old head. */
+    guint64 cache_gen;
+    /* In seconds. 0: entries don't expire, < 0: no caching. */
+    int cache_ttl;
+#endif
 };
 
 #if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
@@ -94,6 +119,22 @@ static void publish_repo_update_event (CEvent *event, void *data);
 
 static int open_db (SeafBranchManager *mgr);
 
+#ifdef SEAFILE_SERVER
+static void
+free_cached_list (GList *list)
+{
+    GList *ptr;
+    CachedBranch *cb;
+
+    for (ptr = list; ptr != NULL; ptr = ptr->next) {
+        cb = ptr->data;
+        g_free (cb->name);
+        g_free (cb);
+    }
+    g_list_free (list);
+}
+#endif
+
 SeafBranchManager *
 seaf_branch_manager_new (struct _SeafileSession *seaf)
 {
@@ -105,11 +146,41 @@ seaf_branch_manager_new (struct _SeafileSession *seaf)
 
 #ifndef SEAFILE_SERVER
     pthread_mutex_init (&mgr->priv->db_lock, NULL);
+#else
+    mgr->priv->cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify)free_cached_list);
+    pthread_mutex_init (&mgr->priv->cache_lock, NULL);
 #endif
 
     return mgr;
 }
 
+#ifdef SEAFILE_SERVER
+static void
+load_cache_ttl (SeafBranchManager *mgr)
+{
+#ifdef FULL_FEATURE
+    /* seaf-server makes all branch updates, they invalidate the cache. */
+    mgr->priv->cache_ttl = 0;
+#else
+    GError *error = NULL;
+    int ttl;
+
+    ttl = g_key_file_get_integer (mgr->seaf->config,
+                                  "branch", "cache_ttl", &error);
+    if (error) {
+        ttl = DEFAULT_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    /* Disable the cache. */
+    if (ttl <= 0)
+        ttl = -1;
+    mgr->priv->cache_ttl = ttl;
+#endif
+}
+#endif
+
 int
 seaf_branch_manager_init (SeafBranchManager *mgr)
 {
@@ -119,6 +190,10 @@ seaf_branch_manager_init (SeafBranchManager *mgr)
                                                     NULL);
 #endif    
 
+#ifdef SEAFILE_SERVER
+    load_cache_ttl (mgr);
+#endif
+
     return open_db (mgr);
 }
 
@@ -173,12 +248,13 @@ seaf_branch_manager_add_branch (SeafBranchManager *mgr, SeafBranch *branch)
 
     return 0;
 #else
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "REPLACE INTO Branch VALUES ('%s', '%s', '%s')",
-              branch->name, branch->repo_id, branch->commit_id);
-    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "REPLACE INTO Branch VALUES (?, ?, ?)",
+                                 3, "string", branch->name,
+                                 "string", branch->repo_id,
+                                 "string", branch->commit_id) < 0)
         return -1;
+    seaf_branch_manager_invalidate_cache (mgr, branch->repo_id);
     return 0;
 #endif
 }
@@ -203,13 +279,11 @@ seaf_branch_manager_del_branch (SeafBranchManager *mgr,
 
     return 0;
 #else
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), 
-              "DELETE FROM Branch WHERE name = '%s' AND repo_id = '%s'",
-              name, repo_id);
-    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "DELETE FROM Branch WHERE name = ? AND repo_id = ?",
+                                 2, "string", name, "string", repo_id) < 0)
         return -1;
+    seaf_branch_manager_invalidate_cache (mgr, repo_id);
     return 0;
 #endif
 }
@@ -234,14 +308,14 @@ seaf_branch_manager_update_branch (SeafBranchManager *mgr, SeafBranch *branch)
 
     return 0;
 #else
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), 
-              "UPDATE Branch SET commit_id = '%s' "
-              "WHERE name = '%s' AND repo_id = '%s'",
-              branch->commit_id, branch->name, branch->repo_id);
-    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "UPDATE Branch SET commit_id = ? "
+                                 "WHERE name = ? AND repo_id = ?",
+                                 3, "string", branch->commit_id,
+                                 "string", branch->name,
+                                 "string", branch->repo_id) < 0)
         return -1;
+    seaf_branch_manager_invalidate_cache (mgr, branch->repo_id);
     return 0;
 #endif
 }
@@ -270,11 +344,16 @@ publish_repo_update_event (CEvent *event, void *data)
 {
     RepoUpdateEventData *rdata = event->data;
 
+    char key[64];
     char buf[128];
+    snprintf (key, sizeof(key), "repo-update\t%s", rdata->repo_id);
     snprintf (buf, sizeof(buf), "repo-update\t%s\t%s",
               rdata->repo_id, rdata->commit_id);
 
-    seaf_mq_manager_publish_event (seaf->mq_mgr, buf);
+    seaf_mq_manager_publish_event_coalesced (seaf->mq_mgr, key, buf);
+
+    seaf_notif_manager_repo_updated (seaf->notif_mgr,
+                                     rdata->repo_id, rdata->commit_id);
 
     g_free (rdata->repo_id);
     g_free (rdata->commit_id);
@@ -290,6 +369,11 @@ on_branch_updated (SeafBranchManager *mgr, SeafBranch *branch)
     rdata->commit_id = g_strdup (branch->commit_id);
     
     cevent_manager_add_event (seaf->ev_mgr, mgr->priv->cevent_id, rdata);
+
+    seaf_file_history_manager_queue_update (seaf->file_history_mgr,
+                                            branch->repo_id);
+    seaf_block_ref_manager_repo_changed (seaf->block_ref_mgr,
+                                         branch->repo_id);
 }
 
 int
@@ -298,16 +382,18 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
                                             const char *old_commit_id)
 {
     SeafDBTrans *trans;
-    char sql[256];
     char commit_id[41] = { 0 };
 
     trans = seaf_db_begin_transaction (mgr->seaf->db);
+    if (!trans)
+        return -1;
 
-    snprintf (sql, sizeof(sql),
-              "SELECT commit_id FROM Branch WHERE name='%s' AND repo_id='%s'",
-              branch->name, branch->repo_id);
-    if (seaf_db_trans_foreach_selected_row (trans, sql,
-                                            get_commit_id, commit_id) < 0) {
+    if (seaf_db_trans_statement_foreach_row (trans,
+                                             "SELECT commit_id FROM Branch "
+                                             "WHERE name=? AND repo_id=?",
+                                             get_commit_id, commit_id,
+                                             2, "string", branch->name,
+                                             "string", branch->repo_id) < 0) {
         seaf_db_rollback (trans);
         return -1;
     }
@@ -318,16 +404,18 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
         return -1;
     }
 
-    snprintf (sql, sizeof(sql), 
-              "UPDATE Branch SET commit_id = '%s' "
-              "WHERE name = '%s' AND repo_id = '%s'",
-              branch->commit_id, branch->name, branch->repo_id);
-    if (seaf_db_trans_query (trans, sql) < 0) {
+    if (seaf_db_trans_statement_query (trans,
+                                       "UPDATE Branch SET commit_id = ? "
+                                       "WHERE name = ? AND repo_id = ?",
+                                       3, "string", branch->commit_id,
+                                       "string", branch->name,
+                                       "string", branch->repo_id) < 0) {
         seaf_db_rollback (trans);
         return -1;
     }
 
     seaf_db_commit (trans);
+    seaf_branch_manager_invalidate_cache (mgr, branch->repo_id);
     on_branch_updated (mgr, branch);
 
     return 0;
@@ -401,6 +489,105 @@ seaf_branch_manager_get_branch (SeafBranchManager *mgr,
 
 #else
 
+static gboolean
+cache_lookup (SeafBranchManager *mgr,
+              const char *repo_id,
+              const char *name,
+              char *commit_id,
+              guint64 *gen)
+{
+    SeafBranchManagerPriv *priv = mgr->priv;
+    CachedBranch *cb;
+    GList *ptr;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    *gen = priv->cache_gen;
+    ptr = g_hash_table_lookup (priv->cache, repo_id);
+    for (; ptr != NULL; ptr = ptr->next) {
+        cb = ptr->data;
+        if (strcmp (cb->name, name) != 0)
+            continue;
+        if (priv->cache_ttl == 0 ||
+            (gint64)time(NULL) - cb->fetch_time < priv->cache_ttl) {
+            memcpy (commit_id, cb->commit_id, 41);
+            found = TRUE;
+        }
+        break;
+    }
+
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return found;
+}
+
+static void
+cache_insert (SeafBranchManager *mgr,
+              const char *repo_id,
+              const char *name,
+              const char *commit_id,
+              guint64 gen)
+{
+    SeafBranchManagerPriv *priv = mgr->priv;
+    CachedBranch *cb = NULL;
+    GList *list, *ptr;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    if (gen != priv->cache_gen)
+        goto out;
+
+    if (g_hash_table_size (priv->cache) >= MAX_CACHED_BRANCHES)
+        g_hash_table_remove_all (priv->cache);
+
+    list = g_hash_table_lookup (priv->cache, repo_id);
+    for (ptr = list; ptr != NULL; ptr = ptr->next) {
+        if (strcmp (((CachedBranch *)ptr->data)->name, name) == 0) {
+            cb = ptr->data;
+            break;
+        }
+    }
+    if (!cb) {
+        cb = g_new0 (CachedBranch, 1);
+        cb->name = g_strdup (name);
+        /* Appending keeps the head of a non-empty list. */
+        if (list)
+            g_list_append (list, cb);
+        else
+            g_hash_table_insert (priv->cache, g_strdup (repo_id),
+                                 g_list_append (NULL, cb));
+    }
+    memcpy (cb->commit_id, commit_id, 41);
+    cb->fetch_time = (gint64)time(NULL);
+
+out:
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+void
+seaf_branch_manager_invalidate_cache (SeafBranchManager *mgr,
+                                      const char *repo_id)
+{
+    SeafBranchManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    ++priv->cache_gen;
+    g_hash_table_remove (priv->cache, repo_id);
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+void
+seaf_branch_manager_set_cache_ttl (SeafBranchManager *mgr, int ttl)
+{
+    SeafBranchManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    priv->cache_ttl = ttl;
+    g_hash_table_remove_all (priv->cache);
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
 static gboolean
 get_branch (SeafDBRow *row, void *vid)
 {
@@ -419,14 +606,19 @@ real_get_branch (SeafBranchManager *mgr,
                  const char *name)
 {
     char commit_id[41];
-    char sql[256];
+    guint64 gen;
+
+    if (mgr->priv->cache_ttl >= 0 &&
+        cache_lookup (mgr, repo_id, name, commit_id, &gen))
+        return seaf_branch_new (name, repo_id, commit_id);
 
     commit_id[0] = 0;
-    snprintf (sql, sizeof(sql),
-              "SELECT commit_id FROM Branch WHERE name='%s' AND repo_id='%s'",
-              name, repo_id);
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql, 
-                                      get_branch, commit_id) < 0) {
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT commit_id FROM Branch "
+                                       "WHERE name=? AND repo_id=?",
+                                       get_branch, commit_id,
+                                       2, "string", name,
+                                       "string", repo_id) < 0) {
         g_warning ("[branch mgr] DB error when get branch %s.\n", name);
         return NULL;
     }
@@ -434,6 +626,9 @@ real_get_branch (SeafBranchManager *mgr,
     if (commit_id[0] == 0)
         return NULL;
 
+    if (mgr->priv->cache_ttl >= 0)
+        cache_insert (mgr, repo_id, name, commit_id, gen);
+
     return seaf_branch_new (name, repo_id, commit_id);
 }
 
@@ -473,11 +668,10 @@ seaf_branch_manager_branch_exists (SeafBranchManager *mgr,
     pthread_mutex_unlock (&mgr->priv->db_lock);
     return ret;
 #else
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "SELECT name FROM Branch WHERE name='%s' "
-              "AND repo_id='%s'", name, repo_id);
-    return seaf_db_check_for_existence (mgr->seaf->db, sql);
+    return seaf_db_statement_exists (mgr->seaf->db,
+                                     "SELECT name FROM Branch WHERE name=? "
+                                     "AND repo_id=?",
+                                     2, "string", name, "string", repo_id);
 #endif
 }
 
@@ -556,13 +750,12 @@ seaf_branch_manager_get_branch_list (SeafBranchManager *mgr,
                                      const char *repo_id)
 {
     GList *ret = NULL;
-    char sql[256];
 
-    snprintf (sql, sizeof(sql),
-              "SELECT name, repo_id, commit_id FROM Branch WHERE repo_id='%s'",
-              repo_id);
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql, 
-                                      get_branches, &ret) < 0) {
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT name, repo_id, commit_id "
+                                       "FROM Branch WHERE repo_id=?",
+                                       get_branches, &ret,
+                                       1, "string", repo_id) < 0) {
         g_warning ("[branch mgr] DB error when get branch list.\n");
         return NULL;
     }
@@ -60,6 +60,21 @@ int
 seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
                                             SeafBranch *branch,
                                             const char *old_commit_id);
+
+/*
+ * Branch heads are cached. Branch updates in this process invalidate the
+ * cache; other processes call this when seaf-server updates a repo.
+ */
+void
+seaf_branch_manager_invalidate_cache (SeafBranchManager *mgr,
+                                      const char *repo_id);
+
+/*
+ * Cached heads expire after @ttl seconds. 0 means they don't expire,
+ * which needs every update to be invalidated, < 0 disables the cache.
+ */
+void
+seaf_branch_manager_set_cache_ttl (SeafBranchManager *mgr, int ttl);
 #endif
 
 SeafBranch *
@@ -0,0 +1,170 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "cdc/cdc.h"
+#include "buf-pool.h"
+
+static const size_t class_sizes[] = {
+    4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20, BLOCK_MAX_SZ,
+};
+
+#define N_CLASSES ((int)G_N_ELEMENTS(class_sizes))
+#define HEAP_CLASS -1
+
+/* Buffers kept by each thread, per class. */
+#define THREAD_CACHE_LEN 2
+
+/* Put in front of each buffer, large enough to keep it aligned. */
+typedef union BufHeader {
+    struct {
+        int class_idx;
+        union BufHeader *next;  /* in a free list */
+    } h;
+    long double align;
+} BufHeader;
+
+typedef struct ThreadCache {
+    BufHeader *bufs[N_CLASSES][THREAD_CACHE_LEN];
+    int n_bufs[N_CLASSES];
+} ThreadCache;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static BufHeader *free_lists[N_CLASSES];
+static size_t cached_bytes;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static inline size_t
+class_alloc_size (int idx)
+{
+    return sizeof(BufHeader) + class_sizes[idx] + BUF_POOL_SLACK;
+}
+
+static void
+release_to_pool (BufHeader *hdr)
+{
+    int idx = hdr->h.class_idx;
+    size_t size = class_alloc_size (idx);
+
+    pthread_mutex_lock (&pool_lock);
+    if (cached_bytes + size <= BUF_POOL_MAX_CACHED) {
+        hdr->h.next = free_lists[idx];
+        free_lists[idx] = hdr;
+        cached_bytes += size;
+        hdr = NULL;
+    }
+    pthread_mutex_unlock (&pool_lock);
+
+    g_free (hdr);
+}
+
+/* Give the buffers of an exiting thread back to the shared lists. */
+static void
+thread_cache_free (void *vcache)
+{
+    ThreadCache *cache = vcache;
+    int i;
+
+    for (i = 0; i < N_CLASSES; ++i)
+        while (cache->n_bufs[i] > 0)
+            release_to_pool (cache->bufs[i][--cache->n_bufs[i]]);
+    free (cache);
+}
+
+static void
+create_cache_key ()
+{
+    pthread_key_create (&cache_key, thread_cache_free);
+}
+
+static ThreadCache *
+get_thread_cache ()
+{
+    ThreadCache *cache;
+
+    pthread_once (&key_once, create_cache_key);
+
+    cache = pthread_getspecific (cache_key);
+    if (!cache) {
+        cache = calloc (1, sizeof(ThreadCache));
+        if (cache && pthread_setspecific (cache_key, cache) != 0) {
+            free (cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+static int
+size_to_class (size_t size)
+{
+    int i;
+
+    for (i = 0; i < N_CLASSES; ++i)
+        if (size <= class_sizes[i] + BUF_POOL_SLACK)
+            return i;
+    return HEAP_CLASS;
+}
+
+void *
+buf_pool_alloc (size_t size)
+{
+    ThreadCache *cache;
+    BufHeader *hdr = NULL;
+    int idx = size_to_class (size);
+
+    if (idx == HEAP_CLASS) {
+        hdr = g_malloc (sizeof(BufHeader) + size);
+        hdr->h.class_idx = HEAP_CLASS;
+        return hdr + 1;
+    }
+
+    cache = get_thread_cache ();
+    if (cache && cache->n_bufs[idx] > 0)
+        return cache->bufs[idx][--cache->n_bufs[idx]] + 1;
+
+    pthread_mutex_lock (&pool_lock);
+    if (free_lists[idx]) {
+        hdr = free_lists[idx];
+        free_lists[idx] = hdr->h.next;
+        cached_bytes -= class_alloc_size (idx);
+    }
+    pthread_mutex_unlock (&pool_lock);
+
+    if (!hdr) {
+        hdr = g_malloc (class_alloc_size (idx));
+        hdr->h.class_idx = idx;
+    }
+
+    return hdr + 1;
+}
+
+void
+buf_pool_free (void *buf)
+{
+    ThreadCache *cache;
+    BufHeader *hdr;
+    int idx;
+
+    if (!buf)
+        return;
+
+    hdr = (BufHeader *)buf - 1;
+    idx = hdr->h.class_idx;
+    if (idx == HEAP_CLASS) {
+        g_free (hdr);
+        return;
+    }
+
+    cache = get_thread_cache ();
+    if (cache && cache->n_bufs[idx] < THREAD_CACHE_LEN) {
+        cache->bufs[idx][cache->n_bufs[idx]++] = hdr;
+        return;
+    }
+
+    release_to_pool (hdr);
+}
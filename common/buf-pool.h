@@ -0,0 +1,31 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Pool of transfer buffers in a few size classes, from 4KB up to
+ * BLOCK_MAX_SZ. Freed buffers are kept in a small per-thread cache, then
+ * in a shared free list, and are reused by later transfers instead of
+ * going back to the heap. The shared list holds at most
+ * BUF_POOL_MAX_CACHED bytes, so a load spike doesn't pin its peak memory.
+ *
+ * Each class has BUF_POOL_SLACK spare bytes, so that sizes like
+ * n + ENC_BLOCK_SIZE or compressBound(n) fall into the class of n.
+ * Larger requests are served from the heap. It can be used from any
+ * thread.
+ */
+
+#define BUF_POOL_SLACK 4096
+#define BUF_POOL_MAX_CACHED (64 << 20)
+
+void *
+buf_pool_alloc (size_t size);
+
+/* Does nothing if @buf is NULL. */
+void
+buf_pool_free (void *buf);
+
+#endif
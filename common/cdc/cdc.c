@@ -7,9 +7,16 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#include <pthread.h>
 #include <glib/gstdio.h>
 
 #include "cdc.h"
+#include "gear.h"
+#include "seaf-sha1.h"
+#include "hex-codec.h"
 #include "../seafile-crypt.h"
 
 #ifdef HAVE_ADLER
@@ -31,7 +38,14 @@
 #endif
 #endif //HAVE_ADLER
 
-#define READ_SIZE 1024 * 4
+/* Files at least this large are mmapped instead of read, see map_file. */
+#define CDC_MMAP_MIN_SIZE (1024 * 1024 * 16)
+
+/* Size of the read buffer, in units of block_max_sz. */
+#define CDC_BUF_BLOCKS 4
+
+/* Granularity for releasing already chunked pages of a mapping. */
+#define CDC_MAP_RELEASE_MASK (1024 * 64 - 1)
 
 #define BYTE_TO_HEX(b)  (((b)>=10)?('a'+b-10):('0'+b))
 
@@ -44,19 +58,6 @@
 /*     SHA1_Final (sha1, &ctx); */
 /* } */
 
-static void rawdata_to_hex (const unsigned char *rawdata, 
-                            char *hex_str, int n_bytes)
-{
-    static const char hex[] = "0123456789abcdef";
-    int i;
-
-    for (i = 0; i < n_bytes; i++) {
-        unsigned int val = *rawdata++;
-        *hex_str++ = hex[val >> 4];
-        *hex_str++ = hex[val & 0xf];
-    }
-    *hex_str = '\0';
-}
 
 /* Read "n" bytes from a descriptor. */
 static ssize_t
@@ -114,7 +115,7 @@ static int default_write_chunk (CDCDescriptor *chunk_descr)
     int fd_chunk, ret;
 
     memset(chksum_str, 0, sizeof(chksum_str));
-    rawdata_to_hex (chunk_descr->checksum, chksum_str, CHECKSUM_LENGTH);
+    hex_codec_encode (chunk_descr->checksum, chksum_str, CHECKSUM_LENGTH);
     snprintf (filename, NAME_MAX_SZ, "./%s", chksum_str);
     fd_chunk = open (filename, O_RDWR | O_CREAT | O_BINARY, 0644);
     if (fd_chunk < 0)
@@ -124,9 +125,31 @@ static int default_write_chunk (CDCDescriptor *chunk_descr)
     return ret;
 }
 
-static int init_cdc_file_descriptor (int fd, CDCFileDescriptor *file_descr)
+/* The file grew while we're reading it. */
+static int
+grow_block_list (CDCFileDescriptor *file_descr, uint32_t *max_block_nr)
+{
+    uint32_t n = *max_block_nr * 2 + 1;
+    uint8_t *sha1s;
+    uint32_t *sizes;
+
+    sha1s = realloc (file_descr->blk_sha1s, n * CHECKSUM_LENGTH);
+    if (!sha1s)
+        return -1;
+    file_descr->blk_sha1s = sha1s;
+
+    sizes = realloc (file_descr->blk_sizes, n * sizeof(uint32_t));
+    if (!sizes)
+        return -1;
+    file_descr->blk_sizes = sizes;
+
+    *max_block_nr = n;
+    return 0;
+}
+
+static int init_cdc_file_descriptor (int fd, CDCFileDescriptor *file_descr,
+                                     uint32_t *max_block_nr, uint64_t *file_size)
 {
-    int max_block_nr = 0;
     int block_min_sz = 0;
     struct stat sb;
 
@@ -146,105 +169,586 @@ static int init_cdc_file_descriptor (int fd, CDCFileDescriptor *file_descr)
         return -1;
     }
 
+    if (file_descr->resume_offset > (uint64_t)sb.st_size)
+        return -1;
+
     block_min_sz = file_descr->block_min_sz;
-    max_block_nr = ((sb.st_size + block_min_sz - 1) / block_min_sz);
+    *max_block_nr = file_descr->resume_block_nr +
+        ((sb.st_size - file_descr->resume_offset + block_min_sz - 1) / block_min_sz);
+    /* Always have room for at least the last block. */
+    if (*max_block_nr == file_descr->resume_block_nr)
+        *max_block_nr += 1;
+    *file_size = (uint64_t)sb.st_size;
     file_descr->blk_sha1s = (uint8_t *)calloc (sizeof(uint8_t),
-                                               max_block_nr * CHECKSUM_LENGTH);
+                                               *max_block_nr * CHECKSUM_LENGTH);
+    file_descr->blk_sizes = (uint32_t *)calloc (sizeof(uint32_t),
+                                                *max_block_nr);
+    if (!file_descr->blk_sha1s || !file_descr->blk_sizes) {
+        free (file_descr->blk_sha1s);
+        free (file_descr->blk_sizes);
+        file_descr->blk_sha1s = NULL;
+        file_descr->blk_sizes = NULL;
+        return -1;
+    }
+
+    if (file_descr->resume_block_nr > 0) {
+        memcpy (file_descr->blk_sha1s, file_descr->resume_sha1s,
+                file_descr->resume_block_nr * CHECKSUM_LENGTH);
+        if (file_descr->resume_sizes)
+            memcpy (file_descr->blk_sizes, file_descr->resume_sizes,
+                    file_descr->resume_block_nr * sizeof(uint32_t));
+        file_descr->block_nr = file_descr->resume_block_nr;
+    }
 
     return 0;
 }
 
-#define WRITE_CDC_BLOCK(block_sz, write_data)                \
-do {                                                         \
-    int _block_sz = block_sz;                                \
-    chunk_descr.len = _block_sz;                             \
-    chunk_descr.offset = offset;                             \
-    ret = file_descr->write_block (&chunk_descr,             \
-            crypt, chunk_descr.checksum,                     \
-                                   (write_data));            \
-    if (ret < 0)                                             \
-        return -1;                                           \
-    memcpy (file_descr->blk_sha1s +                          \
-            file_descr->block_nr * CHECKSUM_LENGTH,          \
-            chunk_descr.checksum, CHECKSUM_LENGTH);          \
-    SHA1_Update (&file_ctx, chunk_descr.checksum, 20);       \
-    file_descr->block_nr++;                                  \
-    offset += _block_sz;                                     \
-                                                             \
-    memmove (buf, buf + _block_sz, tail - _block_sz +1);     \
-    tail = tail - _block_sz;                                 \
-    cur = 0;                                                 \
-    break;                                                   \
-}while(0);
+/*
+ * Find the end of the chunk that starts at @buf.
+ * @len is the number of bytes available at @buf. It must be at least
+ * block_max_sz, unless the end of file is within the window.
+ *
+ * Each chunk starts fingerprinting from scratch at block_min_sz, so the
+ * boundary only depends on the bytes of the chunk itself. That lets
+ * the callers pass in any slice of the file without carrying state.
+ */
+static uint32_t
+find_chunk_boundary (CDCFileDescriptor *file_descr,
+                     char *buf, uint32_t len,
+                     uint64_t mask_s, uint64_t mask_l)
+{
+    uint32_t block_min_sz = file_descr->block_min_sz;
+    uint32_t block_max_sz = file_descr->block_max_sz;
+    uint32_t block_mask = file_descr->block_sz - 1;
+    uint32_t end = len < block_max_sz ? len : block_max_sz;
+    uint32_t cur;
 
-/* content-defined chunking */
-int file_chunk_cdc(int fd_src,
+    if (file_descr->algo == CDC_ALGO_FIXED)
+        return len < file_descr->block_sz ? len : file_descr->block_sz;
+
+    if (len < block_min_sz)
+        return len;
+
+    cur = block_min_sz - 1;
+
+    if (file_descr->algo == CDC_ALGO_GEAR) {
+        uint64_t fp = gear_checksum (buf + cur - GEAR_WIN_SZ + 1, GEAR_WIN_SZ);
+
+        /* Before the target size. */
+        while (cur + 1 < end && cur + 1 < file_descr->block_sz) {
+            if ((fp & mask_s) == 0)
+                return cur + 1;
+            fp = gear_rolling_checksum (fp, buf[++cur]);
+        }
+        /* After it. */
+        while (cur + 1 < end) {
+            if ((fp & mask_l) == 0)
+                return cur + 1;
+            fp = gear_rolling_checksum (fp, buf[++cur]);
+        }
+        return end;
+    }
+
+    int fingerprint = finger (buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ);
+    while (cur + 1 < end) {
+        if ((fingerprint & block_mask) == (BREAK_VALUE & block_mask))
+            return cur + 1;
+        ++cur;
+        fingerprint = rolling_finger (fingerprint, BLOCK_WIN_SZ,
+                                      *(buf + cur - BLOCK_WIN_SZ), *(buf + cur));
+    }
+    return end;
+}
+
+/*
+ * Pipelined chunking.
+ *
+ * The calling thread finds chunk boundaries and queues each chunk to a
+ * pool of hash workers. Hashed chunks are passed on to a pool with a
+ * single writer thread, so blocks with the same id are never stored
+ * concurrently. Every chunk is assigned its index in blk_sha1s when it's
+ * queued, so the block list comes out in file order no matter in which
+ * order the workers finish. The number of chunks in flight is bounded to
+ * keep memory usage in check.
+ */
+
+typedef struct CDCPipeline {
+    CDCFileDescriptor *file_descr;
+    SeafileCrypt *crypt;
+    gboolean write_data;
+    /* Chunk buffers are reused by the caller and must be copied. */
+    gboolean copy_data;
+
+    GThreadPool *hash_pool;
+    GThreadPool *write_pool;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    int max_pending;
+    gboolean error;
+} CDCPipeline;
+
+typedef struct CDCJob {
+    CDCPipeline *pl;
+    uint32_t idx;
+    CDCDescriptor chunk;
+    char *data;                 /* copy of the chunk, if needed */
+    char *out_buf;              /* data to store, if not the chunk itself */
+    int out_len;
+} CDCJob;
+
+static void
+pipeline_finish_job (CDCJob *job, gboolean failed)
+{
+    CDCPipeline *pl = job->pl;
+
+    free (job->data);
+    g_free (job->out_buf);
+    g_free (job);
+
+    pthread_mutex_lock (&pl->lock);
+    if (failed)
+        pl->error = TRUE;
+    pl->pending--;
+    pthread_cond_broadcast (&pl->cond);
+    pthread_mutex_unlock (&pl->lock);
+}
+
+static void
+pipeline_write_block (gpointer data, gpointer user_data)
+{
+    CDCJob *job = data;
+    CDCPipeline *pl = user_data;
+    gboolean failed = FALSE;
+
+    if (pl->error)
+        goto out;
+
+    if (job->out_buf)
+        failed = (pl->file_descr->store_block (job->chunk.checksum,
+                                               job->out_buf,
+                                               job->out_len) < 0);
+    else
+        failed = (pl->file_descr->store_block (job->chunk.checksum,
+                                               job->chunk.block_buf,
+                                               job->chunk.len) < 0);
+
+out:
+    pipeline_finish_job (job, failed);
+}
+
+static void
+pipeline_hash_block (gpointer data, gpointer user_data)
+{
+    CDCJob *job = data;
+    CDCPipeline *pl = user_data;
+    CDCFileDescriptor *file_descr = pl->file_descr;
+
+    if (pl->error)
+        goto error;
+
+    if (file_descr->hash_block (&job->chunk, pl->crypt, job->chunk.checksum,
+                                &job->out_buf, &job->out_len) < 0)
+        goto error;
+
+    /* blk_sha1s may be reallocated by the caller, so hold the lock. */
+    pthread_mutex_lock (&pl->lock);
+    memcpy (file_descr->blk_sha1s + job->idx * CHECKSUM_LENGTH,
+            job->chunk.checksum, CHECKSUM_LENGTH);
+    pthread_mutex_unlock (&pl->lock);
+
+    if (!pl->write_data) {
+        pipeline_finish_job (job, FALSE);
+        return;
+    }
+
+    g_thread_pool_push (pl->write_pool, job, NULL);
+    return;
+
+error:
+    pipeline_finish_job (job, TRUE);
+}
+
+static CDCPipeline *
+pipeline_new (CDCFileDescriptor *file_descr,
+              SeafileCrypt *crypt,
+              gboolean write_data)
+{
+    CDCPipeline *pl;
+    GError *error = NULL;
+
+    pl = g_new0 (CDCPipeline, 1);
+    pl->file_descr = file_descr;
+    pl->crypt = crypt;
+    pl->write_data = write_data;
+    pl->max_pending = file_descr->n_workers + 2;
+    pthread_mutex_init (&pl->lock, NULL);
+    pthread_cond_init (&pl->cond, NULL);
+
+    pl->hash_pool = g_thread_pool_new (pipeline_hash_block, pl,
+                                       file_descr->n_workers, FALSE, &error);
+    if (error) {
+        g_warning ("Failed to start hash thread pool: %s.\n", error->message);
+        g_clear_error (&error);
+        goto error;
+    }
+
+    pl->write_pool = g_thread_pool_new (pipeline_write_block, pl,
+                                        1, FALSE, &error);
+    if (error) {
+        g_warning ("Failed to start block writer thread: %s.\n", error->message);
+        g_clear_error (&error);
+        goto error;
+    }
+
+    return pl;
+
+error:
+    if (pl->hash_pool)
+        g_thread_pool_free (pl->hash_pool, TRUE, TRUE);
+    pthread_mutex_destroy (&pl->lock);
+    pthread_cond_destroy (&pl->cond);
+    g_free (pl);
+    return NULL;
+}
+
+/* Wait until all queued chunks are done. Returns -1 if any of them failed. */
+static int
+pipeline_wait (CDCPipeline *pl)
+{
+    int ret;
+
+    pthread_mutex_lock (&pl->lock);
+    while (pl->pending > 0)
+        pthread_cond_wait (&pl->cond, &pl->lock);
+    ret = pl->error ? -1 : 0;
+    pthread_mutex_unlock (&pl->lock);
+
+    return ret;
+}
+
+static void
+pipeline_free (CDCPipeline *pl)
+{
+    pipeline_wait (pl);
+    g_thread_pool_free (pl->hash_pool, FALSE, TRUE);
+    g_thread_pool_free (pl->write_pool, FALSE, TRUE);
+    pthread_mutex_destroy (&pl->lock);
+    pthread_cond_destroy (&pl->cond);
+    g_free (pl);
+}
+
+static int
+pipeline_submit (CDCPipeline *pl,
+                 CDCDescriptor *chunk_descr,
+                 uint32_t *max_block_nr)
+{
+    CDCFileDescriptor *file_descr = pl->file_descr;
+    CDCJob *job;
+
+    job = g_new0 (CDCJob, 1);
+    job->pl = pl;
+    job->chunk = *chunk_descr;
+    if (pl->copy_data) {
+        job->data = malloc (chunk_descr->len ? chunk_descr->len : 1);
+        if (!job->data) {
+            g_free (job);
+            return -1;
+        }
+        memcpy (job->data, chunk_descr->block_buf, chunk_descr->len);
+        job->chunk.block_buf = job->data;
+    }
+
+    pthread_mutex_lock (&pl->lock);
+    while (pl->pending >= pl->max_pending && !pl->error)
+        pthread_cond_wait (&pl->cond, &pl->lock);
+    if (pl->error)
+        goto error;
+
+    if (file_descr->block_nr >= *max_block_nr &&
+        grow_block_list (file_descr, max_block_nr) < 0)
+        goto error;
+
+    file_descr->blk_sizes[file_descr->block_nr] = chunk_descr->len;
+    job->idx = file_descr->block_nr++;
+    pl->pending++;
+    pthread_mutex_unlock (&pl->lock);
+
+    g_thread_pool_push (pl->hash_pool, job, NULL);
+    return 0;
+
+error:
+    pthread_mutex_unlock (&pl->lock);
+    free (job->data);
+    g_free (job);
+    return -1;
+}
+
+static int
+write_cdc_block (CDCFileDescriptor *file_descr,
+                 CDCDescriptor *chunk_descr,
+                 SeafileCrypt *crypt,
+                 gboolean write_data,
+                 SeafSHA1Ctx *file_ctx,
+                 uint32_t *max_block_nr,
+                 CDCPipeline *pl)
+{
+    if (pl)
+        return pipeline_submit (pl, chunk_descr, max_block_nr);
+
+    if (file_descr->block_nr >= *max_block_nr &&
+        grow_block_list (file_descr, max_block_nr) < 0)
+        return -1;
+
+    if (file_descr->write_block (chunk_descr, crypt,
+                                 chunk_descr->checksum, write_data) < 0)
+        return -1;
+
+    memcpy (file_descr->blk_sha1s + file_descr->block_nr * CHECKSUM_LENGTH,
+            chunk_descr->checksum, CHECKSUM_LENGTH);
+    file_descr->blk_sizes[file_descr->block_nr] = chunk_descr->len;
+    seaf_sha1_update (file_ctx, chunk_descr->checksum, 20);
+    file_descr->block_nr++;
+
+    return 0;
+}
+
+static void
+get_gear_masks (CDCFileDescriptor *file_descr, uint64_t *mask_s, uint64_t *mask_l)
+{
+    *mask_s = *mask_l = 0;
+
+    if (file_descr->algo == CDC_ALGO_GEAR) {
+        /* Normalized chunking: make cut points harder to hit before the
+         * target size and easier after it, which narrows the chunk size
+         * distribution around block_sz.
+         */
+        int bits = g_bit_storage (file_descr->block_sz) - 1;
+        *mask_s = GEAR_MASK (bits + 2);
+        *mask_l = GEAR_MASK (bits - 2);
+        gear_init ();
+    }
+}
+
+#ifndef WIN32
+/*
+ * Chunk a file mapped into memory. Chunks are handed to write_block as
+ * slices of the mapping, so no data is copied by the chunker.
+ */
+static int
+chunk_mapped_file (int fd_src,
+                   uint64_t file_size,
                    CDCFileDescriptor *file_descr,
                    SeafileCrypt *crypt,
-                   gboolean write_data)
+                   gboolean write_data,
+                   SeafSHA1Ctx *file_ctx,
+                   uint32_t *max_block_nr,
+                   CDCPipeline *pl)
 {
-    char *buf;
-    uint32_t buf_sz;
-    SHA_CTX file_ctx;
     CDCDescriptor chunk_descr;
-    SHA1_Init (&file_ctx);
+    uint64_t mask_s, mask_l;
+    uint64_t offset = file_descr->resume_offset, released, done;
+    uint32_t len, avail;
+    char *map;
+    int ret = 0;
 
-    init_cdc_file_descriptor (fd_src, file_descr);
-    uint32_t block_min_sz = file_descr->block_min_sz;
-    uint32_t block_mask = file_descr->block_sz - 1;
+    /* Private writable mapping: write_block gets a plain char buffer
+     * and must never be able to modify the file through it.
+     */
+    map = mmap (NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_src, 0);
+    if (map == MAP_FAILED)
+        return -1;
+#ifdef MADV_SEQUENTIAL
+    madvise (map, file_size, MADV_SEQUENTIAL);
+#endif
+
+    get_gear_masks (file_descr, &mask_s, &mask_l);
+
+    released = offset & ~((uint64_t)CDC_MAP_RELEASE_MASK);
+
+    while (offset < file_size) {
+        avail = (file_size - offset > file_descr->block_max_sz) ?
+            file_descr->block_max_sz : (uint32_t)(file_size - offset);
+
+        len = find_chunk_boundary (file_descr, map + offset, avail,
+                                   mask_s, mask_l);
+
+        chunk_descr.block_buf = map + offset;
+        chunk_descr.len = len;
+        chunk_descr.offset = offset;
+        if (write_cdc_block (file_descr, &chunk_descr, crypt,
+                             write_data, file_ctx, max_block_nr, pl) < 0) {
+            ret = -1;
+            break;
+        }
+        offset += len;
+
+#ifdef MADV_DONTNEED
+        /* Drop pages we're done with, so that the resident set stays
+         * bounded for huge files. Chunks in the pipeline may still be
+         * using them, so leave that to the kernel then.
+         */
+        done = offset & ~((uint64_t)CDC_MAP_RELEASE_MASK);
+        if (!pl && done > released) {
+            madvise (map + released, done - released, MADV_DONTNEED);
+            released = done;
+        }
+#endif
+    }
 
-    int fingerprint = 0;
-    int offset = 0;
+    /* The workers must be done with the mapping before it goes away. */
+    if (pl && pipeline_wait (pl) < 0)
+        ret = -1;
+
+    munmap (map, file_size);
+    return ret;
+}
+#endif  /* WIN32 */
+
+/*
+ * Chunk a file through a read buffer that holds several max-sized
+ * blocks. Chunks are handed out as slices of the buffer. The unconsumed
+ * tail is only moved to the front when less than one max-sized block
+ * is left at the end of the buffer, instead of after every chunk.
+ */
+static int
+chunk_buffered_file (int fd_src,
+                     CDCFileDescriptor *file_descr,
+                     SeafileCrypt *crypt,
+                     gboolean write_data,
+                     SeafSHA1Ctx *file_ctx,
+                     uint32_t *max_block_nr,
+                     CDCPipeline *pl)
+{
+    CDCDescriptor chunk_descr;
+    uint64_t mask_s, mask_l;
+    uint64_t offset = file_descr->resume_offset;
+    uint32_t block_max_sz = file_descr->block_max_sz;
+    uint32_t buf_sz = block_max_sz * CDC_BUF_BLOCKS;
+    uint32_t head = 0, tail = 0, len;
+    gboolean eof = FALSE;
+    ssize_t n;
+    char *buf;
     int ret = 0;
-    int tail, cur, rsize;
 
-    buf_sz = file_descr->block_max_sz;
-    buf = chunk_descr.block_buf = malloc (buf_sz);
+    if (offset > 0 && lseek (fd_src, (off_t)offset, SEEK_SET) != (off_t)offset)
+        return -1;
+
+    buf = malloc (buf_sz);
     if (!buf)
         return -1;
 
-    tail = cur = 0;
+    get_gear_masks (file_descr, &mask_s, &mask_l);
+
     while (1) {
-        if (cur < block_min_sz) {
-            rsize = block_min_sz - cur + READ_SIZE;
-        } else {
-            rsize = (buf_sz - tail < READ_SIZE) ? (buf_sz - tail) : READ_SIZE;
-        }
-        ret = readn (fd_src, buf + tail, rsize);
-        if (ret < 0) {
-            free (buf);
-            return -1;
+        if (!eof && tail - head < block_max_sz) {
+            if (buf_sz - head < block_max_sz) {
+                memmove (buf, buf + head, tail - head);
+                tail -= head;
+                head = 0;
+            }
+            while (!eof && tail - head < block_max_sz) {
+                n = readn (fd_src, buf + tail, buf_sz - tail);
+                if (n < 0) {
+                    ret = -1;
+                    goto out;
+                }
+                if (n == 0)
+                    eof = TRUE;
+                tail += n;
+            }
         }
-        tail = tail + ret;
-        if (tail < block_min_sz || cur >= tail) {
-            if (tail > 0)
-                WRITE_CDC_BLOCK (tail, write_data);
+
+        if (head == tail)
             break;
+
+        len = find_chunk_boundary (file_descr, buf + head, tail - head,
+                                   mask_s, mask_l);
+
+        chunk_descr.block_buf = buf + head;
+        chunk_descr.len = len;
+        chunk_descr.offset = offset;
+        if (write_cdc_block (file_descr, &chunk_descr, crypt,
+                             write_data, file_ctx, max_block_nr, pl) < 0) {
+            ret = -1;
+            goto out;
         }
 
-        if (cur < block_min_sz - 1)
-            cur = block_min_sz - 1;
-
-        while (cur < tail) {
-            fingerprint = (cur == block_min_sz - 1) ?
-                finger(buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
-                rolling_finger (fingerprint, BLOCK_WIN_SZ, 
-                                *(buf+cur-BLOCK_WIN_SZ), *(buf + cur));
-
-            /* get a chunk, write block info to chunk file */
-            if (((fingerprint & block_mask) ==  ((BREAK_VALUE & block_mask)))
-                || cur + 1 >= file_descr->block_max_sz) {
-                WRITE_CDC_BLOCK (cur + 1, write_data);
-                break;
-            } else {
-                cur ++;
-            }
+        head += len;
+        offset += len;
+    }
+
+out:
+    free (buf);
+    return ret;
+}
+
+/* content-defined chunking */
+int file_chunk_cdc(int fd_src,
+                   CDCFileDescriptor *file_descr,
+                   SeafileCrypt *crypt,
+                   gboolean write_data)
+{
+    SeafSHA1Ctx file_ctx;
+    CDCPipeline *pl = NULL;
+    uint32_t max_block_nr = 0;
+    uint64_t file_size = 0;
+    int ret;
+
+    seaf_sha1_init (&file_ctx);
+
+    if (init_cdc_file_descriptor (fd_src, file_descr,
+                                  &max_block_nr, &file_size) < 0)
+        return -1;
+
+    /* If the pipeline can't be started, write_block is used instead. */
+    if (file_descr->n_workers > 1 &&
+        file_descr->hash_block && file_descr->store_block)
+        pl = pipeline_new (file_descr, crypt, write_data);
+
+    /* Ids of the blocks we resume after. The pipeline hashes all ids
+     * at the end instead.
+     */
+    if (!pl && file_descr->block_nr > 0)
+        seaf_sha1_update (&file_ctx, file_descr->blk_sha1s,
+                          file_descr->block_nr * CHECKSUM_LENGTH);
+
+#ifndef WIN32
+    if (file_descr->map_file && file_size >= CDC_MMAP_MIN_SIZE &&
+        file_size == (uint64_t)(size_t)file_size) {
+        ret = chunk_mapped_file (fd_src, file_size, file_descr, crypt,
+                                 write_data, &file_ctx, &max_block_nr, pl);
+        /* mmap may not be supported by the file system. */
+        if (ret < 0 && file_descr->block_nr == file_descr->resume_block_nr) {
+            if (pl)
+                pl->copy_data = TRUE;
+            ret = chunk_buffered_file (fd_src, file_descr, crypt,
+                                       write_data, &file_ctx, &max_block_nr, pl);
         }
+    } else
+#endif
+    {
+        if (pl)
+            pl->copy_data = TRUE;
+        ret = chunk_buffered_file (fd_src, file_descr, crypt,
+                                   write_data, &file_ctx, &max_block_nr, pl);
+    }
+
+    if (pl) {
+        if (pipeline_wait (pl) < 0)
+            ret = -1;
+        pipeline_free (pl);
     }
 
-    SHA1_Final (file_descr->file_sum, &file_ctx);
+    if (ret < 0)
+        return -1;
 
-    free (buf);
+    if (pl)
+        /* Same as hashing the block ids one by one in file order. */
+        seaf_sha1_update (&file_ctx, file_descr->blk_sha1s,
+                          file_descr->block_nr * CHECKSUM_LENGTH);
+    seaf_sha1_final (file_descr->file_sum, &file_ctx);
 
     return 0;
 }
@@ -262,3 +766,199 @@ int filename_chunk_cdc(const char *filename,
     close (fd_src);
     return ret;
 }
+
+/* Size of the stream buffer, in units of block_max_sz. */
+#define CDC_STREAM_BUF_BLOCKS 2
+
+struct _CDCStream {
+    CDCFileDescriptor *file_descr;
+    SeafileCrypt *crypt;
+    gboolean write_data;
+
+    SeafSHA1Ctx file_ctx;
+    uint64_t mask_s, mask_l;
+    uint32_t max_block_nr;
+
+    char *buf;
+    uint32_t buf_sz;
+    uint32_t head, tail;
+    uint64_t offset;            /* file offset of buf + head */
+    gboolean error;
+
+    CDCPipeline *pl;
+};
+
+CDCStream *
+cdc_stream_new (CDCFileDescriptor *file_descr,
+                SeafileCrypt *crypt,
+                gboolean write_data)
+{
+    CDCStream *stream;
+
+    if (file_descr->block_min_sz <= 0)
+        file_descr->block_min_sz = BLOCK_MIN_SZ;
+    if (file_descr->block_max_sz <= 0)
+        file_descr->block_max_sz = BLOCK_MAX_SZ;
+    if (file_descr->block_sz <= 0)
+        file_descr->block_sz = BLOCK_SZ;
+
+    if (file_descr->write_block == NULL)
+        file_descr->write_block = (WriteblockFunc)default_write_chunk;
+
+    /* The block list grows as blocks are cut. */
+    file_descr->block_nr = 0;
+    file_descr->blk_sha1s = NULL;
+    file_descr->blk_sizes = NULL;
+
+    stream = g_new0 (CDCStream, 1);
+    stream->file_descr = file_descr;
+    stream->crypt = crypt;
+    stream->write_data = write_data;
+    stream->buf_sz = file_descr->block_max_sz * CDC_STREAM_BUF_BLOCKS;
+    stream->buf = malloc (stream->buf_sz);
+    if (!stream->buf) {
+        g_free (stream);
+        return NULL;
+    }
+
+    seaf_sha1_init (&stream->file_ctx);
+    get_gear_masks (file_descr, &stream->mask_s, &stream->mask_l);
+
+    /* If the pipeline can't be started, write_block is used instead.
+     * The stream buffer is reused, so chunks have to be copied. */
+    if (file_descr->n_workers > 1 &&
+        file_descr->hash_block && file_descr->store_block) {
+        stream->pl = pipeline_new (file_descr, crypt, write_data);
+        if (stream->pl)
+            stream->pl->copy_data = TRUE;
+    }
+
+    return stream;
+}
+
+/*
+ * Cut the chunks that can't change with more data, i.e. while a whole
+ * max-sized window is buffered. At the end of data, cut everything.
+ */
+static int
+stream_cut_chunks (CDCStream *stream, gboolean eof)
+{
+    CDCFileDescriptor *file_descr = stream->file_descr;
+    CDCDescriptor chunk_descr;
+    uint32_t len;
+
+    while (stream->tail - stream->head >= file_descr->block_max_sz ||
+           (eof && stream->head < stream->tail)) {
+        len = find_chunk_boundary (file_descr, stream->buf + stream->head,
+                                   stream->tail - stream->head,
+                                   stream->mask_s, stream->mask_l);
+
+        chunk_descr.block_buf = stream->buf + stream->head;
+        chunk_descr.len = len;
+        chunk_descr.offset = stream->offset;
+        if (write_cdc_block (file_descr, &chunk_descr, stream->crypt,
+                             stream->write_data, &stream->file_ctx,
+                             &stream->max_block_nr, stream->pl) < 0)
+            return -1;
+
+        stream->head += len;
+        stream->offset += len;
+    }
+
+    return 0;
+}
+
+int
+cdc_stream_feed (CDCStream *stream, const char *data, uint32_t len)
+{
+    uint32_t n;
+
+    if (stream->error)
+        return -1;
+
+    while (len > 0) {
+        /* Less than block_max_sz bytes are left unchunked, so there's
+         * always room after moving them to the front.
+         */
+        if (stream->tail == stream->buf_sz) {
+            memmove (stream->buf, stream->buf + stream->head,
+                     stream->tail - stream->head);
+            stream->tail -= stream->head;
+            stream->head = 0;
+        }
+
+        n = stream->buf_sz - stream->tail;
+        if (n > len)
+            n = len;
+        memcpy (stream->buf + stream->tail, data, n);
+        stream->tail += n;
+        data += n;
+        len -= n;
+
+        if (stream_cut_chunks (stream, FALSE) < 0) {
+            stream->error = TRUE;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+cdc_stream_finish (CDCStream *stream)
+{
+    if (stream->error)
+        return -1;
+
+    if (stream_cut_chunks (stream, TRUE) < 0 ||
+        (stream->pl && pipeline_wait (stream->pl) < 0)) {
+        stream->error = TRUE;
+        return -1;
+    }
+
+    if (stream->pl)
+        /* Same as hashing the block ids one by one in stream order. */
+        seaf_sha1_update (&stream->file_ctx, stream->file_descr->blk_sha1s,
+                          stream->file_descr->block_nr * CHECKSUM_LENGTH);
+    seaf_sha1_final (stream->file_descr->file_sum, &stream->file_ctx);
+    return 0;
+}
+
+uint64_t
+cdc_stream_get_size (CDCStream *stream)
+{
+    return stream->offset + (stream->tail - stream->head);
+}
+
+void
+cdc_stream_free (CDCStream *stream)
+{
+    if (!stream)
+        return;
+
+    if (stream->pl)
+        pipeline_free (stream->pl);
+    free (stream->buf);
+    g_free (stream);
+}
+
+int cdc_algo_from_name (const char *name)
+{
+    if (!name || strcmp (name, "rabin") == 0)
+        return CDC_ALGO_RABIN;
+    if (strcmp (name, "gear") == 0 || strcmp (name, "fastcdc") == 0)
+        return CDC_ALGO_GEAR;
+    return -1;
+}
+
+const char *cdc_algo_to_name (int algo)
+{
+    switch (algo) {
+    case CDC_ALGO_GEAR:
+        return "gear";
+    case CDC_ALGO_FIXED:
+        return "fixed";
+    default:
+        return "rabin";
+    }
+}
@@ -15,6 +15,20 @@
 
 #define BREAK_VALUE     0x0013    ///0x0513
 
+/*
+ * Fingerprint engines for finding chunk boundaries.
+ * The engine used determines the block ids produced for a file, so it
+ * must be recorded with the repo and never changed for existing data.
+ */
+enum {
+    CDC_ALGO_RABIN = 0,         /* rolling rabin over BLOCK_WIN_SZ, default */
+    CDC_ALGO_GEAR  = 1,         /* gear hash with normalized chunking */
+    /* Blocks of exactly block_sz bytes. Never recorded as a repo's
+     * chunker, only picked by the chunking policy for single files.
+     */
+    CDC_ALGO_FIXED = 2,
+};
+
 
 #ifdef HAVE_MD5
 #include "md5.h"
@@ -39,17 +53,62 @@ typedef int (*WriteblockFunc)(struct _CDCDescriptor *chunk_descr,
                               uint8_t *checksum,
                               gboolean write_data);
 
+/*
+ * Split version of WriteblockFunc, used by the pipelined chunker.
+ * HashblockFunc computes the block id. If the data to store differs from
+ * the chunk (e.g. it's encrypted), a newly allocated buffer is returned
+ * in @out_buf, to be released with g_free(). StoreblockFunc writes the
+ * block. HashblockFunc may be called from several threads at once,
+ * StoreblockFunc is only called from one thread at a time.
+ */
+typedef int (*HashblockFunc)(struct _CDCDescriptor *chunk_descr,
+                             struct SeafileCrypt *crypt,
+                             uint8_t *checksum,
+                             char **out_buf,
+                             int *out_len);
+
+typedef int (*StoreblockFunc)(uint8_t *checksum,
+                              const char *buf,
+                              int len);
+
 /* define chunk file header and block entry */
 typedef struct _CDCFileDescriptor {
     uint32_t block_min_sz;
     uint32_t block_max_sz;
     uint32_t block_sz;
+    int      algo;              /* CDC_ALGO_*, 0 means rabin */
 
     uint32_t block_nr;
     uint8_t *blk_sha1s;
+    uint32_t *blk_sizes;        /* plain text size of each block */
     uint8_t  file_sum[CHECKSUM_LENGTH];
 
     WriteblockFunc write_block;
+
+    /* If n_workers > 1 and both functions are set, chunks are hashed
+     * by n_workers threads and stored by a separate writer thread,
+     * while the calling thread keeps finding boundaries.
+     * write_block is not used in that case.
+     */
+    int            n_workers;
+    HashblockFunc  hash_block;
+    StoreblockFunc store_block;
+
+    /* Start chunking at resume_offset, which must be a chunk boundary
+     * with the same block sizes and algo. The ids and sizes of the
+     * resume_block_nr blocks before it are given in resume_sha1s and
+     * resume_sizes.
+     */
+    uint64_t        resume_offset;
+    const uint8_t  *resume_sha1s;
+    const uint32_t *resume_sizes;
+    uint32_t        resume_block_nr;
+
+    /* Map large files into memory instead of reading them. Only for
+     * files nobody else changes while they're chunked: reading a mapping
+     * past the end of a file truncated meanwhile raises SIGBUS.
+     */
+    gboolean        map_file;
 } CDCFileDescriptor;
 
 typedef struct _CDCDescriptor {
@@ -70,4 +129,36 @@ int filename_chunk_cdc(const char *filename,
                        struct SeafileCrypt *crypt,
                        gboolean write_data);
 
+/*
+ * Incremental chunking, for data that arrives piece by piece instead of
+ * from a file. Blocks are written with write_block as soon as they're
+ * cut, or handed to the hash/store pipeline if n_workers is set, and the
+ * result is the same as chunking all the data at once with the same
+ * settings. Memory use is bounded by block_max_sz, plus the chunks in
+ * flight in the pipeline. Resuming is not supported.
+ *
+ * blk_sha1s and blk_sizes of @file_descr are allocated by the stream,
+ * and file_sum is set by cdc_stream_finish().
+ */
+typedef struct _CDCStream CDCStream;
+
+CDCStream *cdc_stream_new (CDCFileDescriptor *file_descr,
+                           struct SeafileCrypt *crypt,
+                           gboolean write_data);
+
+int cdc_stream_feed (CDCStream *stream, const char *data, uint32_t len);
+
+/* Chunk the data left in the buffer and compute file_sum. */
+int cdc_stream_finish (CDCStream *stream);
+
+/* Number of bytes fed so far. */
+uint64_t cdc_stream_get_size (CDCStream *stream);
+
+void cdc_stream_free (CDCStream *stream);
+
+/* Returns CDC_ALGO_* for @name ("rabin" or "gear"), or -1 if unknown. */
+int cdc_algo_from_name (const char *name);
+
+const char *cdc_algo_to_name (int algo);
+
 #endif
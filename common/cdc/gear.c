@@ -0,0 +1,48 @@
+#include <glib.h>
+
+#include "gear.h"
+
+uint64_t gear_table[256];
+
+/*
+ * The table must never change once chunks have been written with it,
+ * otherwise the chunk boundaries (and hence block ids) of existing
+ * files would change. So it's generated from a fixed seed with
+ * splitmix64 instead of a system random source.
+ */
+static void __init ()
+{
+    uint64_t seed = 0x5eaf11e5eaf11e00ULL;
+    uint64_t z;
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        seed += 0x9e3779b97f4a7c15ULL;
+        z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+void gear_init ()
+{
+    static gsize inited = 0;
+
+    if (g_once_init_enter (&inited)) {
+        __init ();
+        g_once_init_leave (&inited, 1);
+    }
+}
+
+uint64_t gear_checksum (const char *buf, int len)
+{
+    uint64_t sum = 0;
+    int i;
+
+    gear_init ();
+
+    for (i = 0; i < len; ++i)
+        sum = gear_rolling_checksum (sum, buf[i]);
+    return sum;
+}
@@ -0,0 +1,37 @@
+#ifndef _GEAR_H
+#define _GEAR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Window size of the gear hash. Only the last 64 bytes contribute to
+ * the high bits of the fingerprint.
+ */
+#define GEAR_WIN_SZ 64
+
+extern uint64_t gear_table[256];
+
+void gear_init ();
+
+uint64_t gear_checksum (const char *buf, int len);
+
+/*
+ * gear_checksum(X0, ..., Xn) ----> gear_checksum(X0, ..., Xn+1)
+ * Bytes older than GEAR_WIN_SZ are shifted out automatically.
+ */
+#define gear_rolling_checksum(csum, c)                          \
+    (((csum) << 1) + gear_table[(unsigned char)(c)])
+
+/* A mask with the highest @bits bits set. */
+#define GEAR_MASK(bits)                                         \
+    ((bits) <= 0 ? 0 : ((bits) >= 64 ? ~(uint64_t)0 :           \
+                        ~(uint64_t)0 << (64 - (bits))))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,488 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "seaf-sha1.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SHA1_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__linux__) || defined(__APPLE__))
+#define HAVE_SHA1_ARMV8 1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#endif
+#endif
+
+#endif  /* __GNUC__ */
+
+enum {
+    IMPL_OPENSSL = 0,
+    IMPL_SHANI,
+    IMPL_ARMV8,
+};
+
+typedef void (*CompressFunc) (uint32_t h[5], const unsigned char *data,
+                              size_t blocks);
+
+static int impl = IMPL_OPENSSL;
+static CompressFunc compress;
+
+#ifdef HAVE_SHA1_SHANI
+
+/*
+ * Message schedule for four rounds: W0 holds w[t-16..t-13] on entry
+ * and w[t..t+3] on return.
+ */
+#define SHANI_SCHED(W0, W1, W2, W3)                                     \
+    W0 = _mm_sha1msg2_epu32 (_mm_xor_si128 (_mm_sha1msg1_epu32 (W0, W1), \
+                                            W2), W3)
+
+#define SHANI_ROUND4(f, E, E_NEXT, W)                   \
+    E = _mm_sha1nexte_epu32 (E, W);                     \
+    E_NEXT = abcd;                                      \
+    abcd = _mm_sha1rnds4_epu32 (abcd, E, f)
+
+#define SHANI_ROUND16(f0, f1, f2, f3)                   \
+    SHANI_SCHED (m0, m1, m2, m3);                       \
+    SHANI_ROUND4 (f0, e0, e1, m0);                      \
+    SHANI_SCHED (m1, m2, m3, m0);                       \
+    SHANI_ROUND4 (f1, e1, e0, m1);                      \
+    SHANI_SCHED (m2, m3, m0, m1);                       \
+    SHANI_ROUND4 (f2, e0, e1, m2);                      \
+    SHANI_SCHED (m3, m0, m1, m2);                       \
+    SHANI_ROUND4 (f3, e1, e0, m3)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void
+compress_shani (uint32_t h[5], const unsigned char *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x (0x0001020304050607ULL,
+                                          0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i m0, m1, m2, m3;
+
+    abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)h), 0x1B);
+    e0 = _mm_set_epi32 (h[4], 0, 0, 0);
+
+    while (blocks--) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)data), bswap);
+        m1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 16)), bswap);
+        m2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 32)), bswap);
+        m3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 48)), bswap);
+
+        /* Rounds 0-15 use the message as is. */
+        e0 = _mm_add_epi32 (e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+        SHANI_ROUND4 (0, e1, e0, m1);
+        SHANI_ROUND4 (0, e0, e1, m2);
+        SHANI_ROUND4 (0, e1, e0, m3);
+
+        SHANI_ROUND16 (0, 1, 1, 1);
+        SHANI_ROUND16 (1, 1, 2, 2);
+        SHANI_ROUND16 (2, 2, 2, 3);
+        SHANI_ROUND16 (3, 3, 3, 3);
+
+        e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+        abcd = _mm_add_epi32 (abcd, abcd_save);
+
+        data += 64;
+    }
+
+    _mm_storeu_si128 ((__m128i *)h, _mm_shuffle_epi32 (abcd, 0x1B));
+    h[4] = _mm_extract_epi32 (e0, 3);
+}
+
+/*
+ * Two independent messages in lock step. A single SHA-1 stream is bound
+ * by the latency of the round instructions, so interleaving a second one
+ * comes at little extra cost. Used by seaf_sha1_batch().
+ */
+#define SHANI2_SCHED(a, b, c, d)                \
+    SHANI_SCHED (a##_a, b##_a, c##_a, d##_a);   \
+    SHANI_SCHED (a##_b, b##_b, c##_b, d##_b)
+
+#define SHANI2_ROUND4(f, E, E_NEXT, W)                  \
+    E##_a = _mm_sha1nexte_epu32 (E##_a, W##_a);         \
+    E##_b = _mm_sha1nexte_epu32 (E##_b, W##_b);         \
+    E_NEXT##_a = abcd_a;                                \
+    E_NEXT##_b = abcd_b;                                \
+    abcd_a = _mm_sha1rnds4_epu32 (abcd_a, E##_a, f);    \
+    abcd_b = _mm_sha1rnds4_epu32 (abcd_b, E##_b, f)
+
+#define SHANI2_ROUND16(f0, f1, f2, f3)          \
+    SHANI2_SCHED (m0, m1, m2, m3);              \
+    SHANI2_ROUND4 (f0, e0, e1, m0);             \
+    SHANI2_SCHED (m1, m2, m3, m0);              \
+    SHANI2_ROUND4 (f1, e1, e0, m1);             \
+    SHANI2_SCHED (m2, m3, m0, m1);              \
+    SHANI2_ROUND4 (f2, e0, e1, m2);             \
+    SHANI2_SCHED (m3, m0, m1, m2);              \
+    SHANI2_ROUND4 (f3, e1, e0, m3)
+
+#define SHANI2_LOAD(m, off)                                             \
+    m##_a = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data_a + off)), \
+                              bswap);                                   \
+    m##_b = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data_b + off)), \
+                              bswap)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void
+compress2_shani (uint32_t h_a[5], const unsigned char *data_a,
+                 uint32_t h_b[5], const unsigned char *data_b,
+                 size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x (0x0001020304050607ULL,
+                                          0x08090a0b0c0d0e0fULL);
+    __m128i abcd_a, abcd_save_a, e0_a, e0_save_a, e1_a;
+    __m128i abcd_b, abcd_save_b, e0_b, e0_save_b, e1_b;
+    __m128i m0_a, m1_a, m2_a, m3_a;
+    __m128i m0_b, m1_b, m2_b, m3_b;
+
+    abcd_a = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)h_a), 0x1B);
+    abcd_b = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)h_b), 0x1B);
+    e0_a = _mm_set_epi32 (h_a[4], 0, 0, 0);
+    e0_b = _mm_set_epi32 (h_b[4], 0, 0, 0);
+
+    while (blocks--) {
+        abcd_save_a = abcd_a;
+        abcd_save_b = abcd_b;
+        e0_save_a = e0_a;
+        e0_save_b = e0_b;
+
+        SHANI2_LOAD (m0, 0);
+        SHANI2_LOAD (m1, 16);
+        SHANI2_LOAD (m2, 32);
+        SHANI2_LOAD (m3, 48);
+
+        e0_a = _mm_add_epi32 (e0_a, m0_a);
+        e0_b = _mm_add_epi32 (e0_b, m0_b);
+        e1_a = abcd_a;
+        e1_b = abcd_b;
+        abcd_a = _mm_sha1rnds4_epu32 (abcd_a, e0_a, 0);
+        abcd_b = _mm_sha1rnds4_epu32 (abcd_b, e0_b, 0);
+        SHANI2_ROUND4 (0, e1, e0, m1);
+        SHANI2_ROUND4 (0, e0, e1, m2);
+        SHANI2_ROUND4 (0, e1, e0, m3);
+
+        SHANI2_ROUND16 (0, 1, 1, 1);
+        SHANI2_ROUND16 (1, 1, 2, 2);
+        SHANI2_ROUND16 (2, 2, 2, 3);
+        SHANI2_ROUND16 (3, 3, 3, 3);
+
+        e0_a = _mm_sha1nexte_epu32 (e0_a, e0_save_a);
+        e0_b = _mm_sha1nexte_epu32 (e0_b, e0_save_b);
+        abcd_a = _mm_add_epi32 (abcd_a, abcd_save_a);
+        abcd_b = _mm_add_epi32 (abcd_b, abcd_save_b);
+
+        data_a += 64;
+        data_b += 64;
+    }
+
+    _mm_storeu_si128 ((__m128i *)h_a, _mm_shuffle_epi32 (abcd_a, 0x1B));
+    _mm_storeu_si128 ((__m128i *)h_b, _mm_shuffle_epi32 (abcd_b, 0x1B));
+    h_a[4] = _mm_extract_epi32 (e0_a, 3);
+    h_b[4] = _mm_extract_epi32 (e0_b, 3);
+}
+
+static int
+cpu_has_shani ()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    /* SSSE3 and SSE4.1 */
+    if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+        return 0;
+
+    if (__get_cpuid_max (0, NULL) < 7)
+        return 0;
+    __cpuid_count (7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+
+#endif  /* HAVE_SHA1_SHANI */
+
+#ifdef HAVE_SHA1_ARMV8
+
+/* w[t..t+3] from w[t-16..t-1]. */
+#define ARMV8_SCHED(W0, W1, W2, W3)                                 \
+    W0 = vsha1su1q_u32 (vsha1su0q_u32 (W0, W1, W2), W3)
+
+#define ARMV8_ROUND4(op, k, W)                                      \
+    do {                                                            \
+        uint32x4_t t = vaddq_u32 (W, vdupq_n_u32 (k));              \
+        e_next = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));             \
+        abcd = op (abcd, e, t);                                     \
+        e = e_next;                                                 \
+    } while (0)
+
+#define ARMV8_ROUND16(op0, k0, op1, k1, op2, k2, op3, k3)           \
+    ARMV8_SCHED (m0, m1, m2, m3);                                   \
+    ARMV8_ROUND4 (op0, k0, m0);                                     \
+    ARMV8_SCHED (m1, m2, m3, m0);                                   \
+    ARMV8_ROUND4 (op1, k1, m1);                                     \
+    ARMV8_SCHED (m2, m3, m0, m1);                                   \
+    ARMV8_ROUND4 (op2, k2, m2);                                     \
+    ARMV8_SCHED (m3, m0, m1, m2);                                   \
+    ARMV8_ROUND4 (op3, k3, m3)
+
+#define K0 0x5A827999
+#define K1 0x6ED9EBA1
+#define K2 0x8F1BBCDC
+#define K3 0xCA62C1D6
+
+__attribute__((target("arch=armv8-a+crypto")))
+static void
+compress_armv8 (uint32_t h[5], const unsigned char *data, size_t blocks)
+{
+    uint32x4_t abcd, abcd_save;
+    uint32x4_t m0, m1, m2, m3;
+    uint32_t e, e_save, e_next;
+
+    abcd = vld1q_u32 (h);
+    e = h[4];
+
+    while (blocks--) {
+        abcd_save = abcd;
+        e_save = e;
+
+        m0 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data)));
+        m1 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 16)));
+        m2 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 32)));
+        m3 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 48)));
+
+        ARMV8_ROUND4 (vsha1cq_u32, K0, m0);
+        ARMV8_ROUND4 (vsha1cq_u32, K0, m1);
+        ARMV8_ROUND4 (vsha1cq_u32, K0, m2);
+        ARMV8_ROUND4 (vsha1cq_u32, K0, m3);
+
+        ARMV8_ROUND16 (vsha1cq_u32, K0, vsha1pq_u32, K1,
+                       vsha1pq_u32, K1, vsha1pq_u32, K1);
+        ARMV8_ROUND16 (vsha1pq_u32, K1, vsha1pq_u32, K1,
+                       vsha1mq_u32, K2, vsha1mq_u32, K2);
+        ARMV8_ROUND16 (vsha1mq_u32, K2, vsha1mq_u32, K2,
+                       vsha1mq_u32, K2, vsha1pq_u32, K3);
+        ARMV8_ROUND16 (vsha1pq_u32, K3, vsha1pq_u32, K3,
+                       vsha1pq_u32, K3, vsha1pq_u32, K3);
+
+        abcd = vaddq_u32 (abcd, abcd_save);
+        e += e_save;
+
+        data += 64;
+    }
+
+    vst1q_u32 (h, abcd);
+    h[4] = e;
+}
+
+static int
+cpu_has_armv8_sha1 ()
+{
+#ifdef __APPLE__
+    return 1;
+#else
+    return (getauxval (AT_HWCAP) & HWCAP_SHA1) != 0;
+#endif
+}
+
+#endif  /* HAVE_SHA1_ARMV8 */
+
+static void
+select_impl ()
+{
+    static gsize inited = 0;
+    const char *env;
+
+    if (!g_once_init_enter (&inited))
+        return;
+
+    env = g_getenv ("SEAFILE_SHA1_IMPL");
+    if (env && strcmp (env, "openssl") == 0)
+        goto out;
+
+#ifdef HAVE_SHA1_SHANI
+    if (cpu_has_shani ()) {
+        impl = IMPL_SHANI;
+        compress = compress_shani;
+    }
+#endif
+#ifdef HAVE_SHA1_ARMV8
+    if (cpu_has_armv8_sha1 ()) {
+        impl = IMPL_ARMV8;
+        compress = compress_armv8;
+    }
+#endif
+
+out:
+    g_once_init_leave (&inited, 1);
+}
+
+void
+seaf_sha1_init (SeafSHA1Ctx *ctx)
+{
+    select_impl ();
+
+    if (impl == IMPL_OPENSSL) {
+        SHA1_Init (&ctx->ossl);
+        return;
+    }
+
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xEFCDAB89;
+    ctx->h[2] = 0x98BADCFE;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xC3D2E1F0;
+    ctx->total = 0;
+    ctx->n = 0;
+}
+
+void
+seaf_sha1_update (SeafSHA1Ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t blocks;
+
+    if (impl == IMPL_OPENSSL) {
+        SHA1_Update (&ctx->ossl, data, len);
+        return;
+    }
+
+    ctx->total += len;
+
+    if (ctx->n > 0) {
+        size_t fill = 64 - ctx->n;
+        if (fill > len)
+            fill = len;
+        memcpy (ctx->buf + ctx->n, p, fill);
+        ctx->n += fill;
+        p += fill;
+        len -= fill;
+        if (ctx->n < 64)
+            return;
+        compress (ctx->h, ctx->buf, 1);
+        ctx->n = 0;
+    }
+
+    blocks = len / 64;
+    if (blocks > 0) {
+        compress (ctx->h, p, blocks);
+        p += blocks * 64;
+        len -= blocks * 64;
+    }
+
+    if (len > 0) {
+        memcpy (ctx->buf, p, len);
+        ctx->n = len;
+    }
+}
+
+void
+seaf_sha1_final (unsigned char *md, SeafSHA1Ctx *ctx)
+{
+    uint64_t bits;
+    int i;
+
+    if (impl == IMPL_OPENSSL) {
+        SHA1_Final (md, &ctx->ossl);
+        return;
+    }
+
+    bits = ctx->total * 8;
+
+    ctx->buf[ctx->n++] = 0x80;
+    if (ctx->n > 56) {
+        memset (ctx->buf + ctx->n, 0, 64 - ctx->n);
+        compress (ctx->h, ctx->buf, 1);
+        ctx->n = 0;
+    }
+    memset (ctx->buf + ctx->n, 0, 56 - ctx->n);
+    for (i = 0; i < 8; ++i)
+        ctx->buf[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+    compress (ctx->h, ctx->buf, 1);
+
+    for (i = 0; i < 5; ++i) {
+        md[i * 4] = (unsigned char)(ctx->h[i] >> 24);
+        md[i * 4 + 1] = (unsigned char)(ctx->h[i] >> 16);
+        md[i * 4 + 2] = (unsigned char)(ctx->h[i] >> 8);
+        md[i * 4 + 3] = (unsigned char)ctx->h[i];
+    }
+}
+
+void
+seaf_sha1 (const void *data, size_t len, unsigned char *md)
+{
+    SeafSHA1Ctx ctx;
+
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, data, len);
+    seaf_sha1_final (md, &ctx);
+}
+
+void
+seaf_sha1_batch (const void * const *bufs, const size_t *lens, int n,
+                 unsigned char *mds)
+{
+    int i = 0;
+
+    select_impl ();
+
+#ifdef HAVE_SHA1_SHANI
+    if (impl == IMPL_SHANI) {
+        /* Hash the common full blocks of each pair together, then
+         * finish them one by one.
+         */
+        for (; i + 1 < n; i += 2) {
+            const unsigned char *a = bufs[i], *b = bufs[i + 1];
+            size_t len_a = lens[i], len_b = lens[i + 1];
+            size_t blocks = (len_a < len_b ? len_a : len_b) / 64;
+            SeafSHA1Ctx ctx_a, ctx_b;
+
+            seaf_sha1_init (&ctx_a);
+            seaf_sha1_init (&ctx_b);
+            if (blocks > 0) {
+                compress2_shani (ctx_a.h, a, ctx_b.h, b, blocks);
+                ctx_a.total = ctx_b.total = blocks * 64;
+            }
+            seaf_sha1_update (&ctx_a, a + blocks * 64, len_a - blocks * 64);
+            seaf_sha1_update (&ctx_b, b + blocks * 64, len_b - blocks * 64);
+            seaf_sha1_final (mds + i * 20, &ctx_a);
+            seaf_sha1_final (mds + (i + 1) * 20, &ctx_b);
+        }
+    }
+#endif
+
+    for (; i < n; ++i)
+        seaf_sha1 (bufs[i], lens[i], mds + i * 20);
+}
+
+const char *
+seaf_sha1_impl_name ()
+{
+    select_impl ();
+
+    switch (impl) {
+    case IMPL_SHANI:
+        return "shani";
+    case IMPL_ARMV8:
+        return "armv8";
+    default:
+        return "openssl";
+    }
+}
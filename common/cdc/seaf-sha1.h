@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_SHA1_H
+#define SEAF_SHA1_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/sha.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * SHA-1 used for block ids, fs object ids and commit ids.
+ *
+ * The implementation is picked once at run time: the x86 SHA extensions
+ * or the ARMv8 crypto extensions if the CPU has them, OpenSSL otherwise.
+ * Setting SEAFILE_SHA1_IMPL=openssl in the environment forces the
+ * OpenSSL code, e.g. for comparison.
+ *
+ * The functions mirror the OpenSSL SHA1_* interface.
+ */
+
+typedef struct SeafSHA1Ctx {
+    SHA_CTX ossl;               /* only used by the OpenSSL implementation */
+    uint32_t h[5];
+    uint64_t total;
+    unsigned char buf[64];
+    unsigned int n;
+} SeafSHA1Ctx;
+
+void seaf_sha1_init (SeafSHA1Ctx *ctx);
+
+void seaf_sha1_update (SeafSHA1Ctx *ctx, const void *data, size_t len);
+
+void seaf_sha1_final (unsigned char *md, SeafSHA1Ctx *ctx);
+
+/* Hash @len bytes at @data into the 20 bytes at @md. */
+void seaf_sha1 (const void *data, size_t len, unsigned char *md);
+
+/*
+ * Hash @n independent buffers. The digest of bufs[i] is stored at
+ * mds + i * 20.
+ */
+void seaf_sha1_batch (const void * const *bufs, const size_t *lens, int n,
+                      unsigned char *mds);
+
+/* Name of the implementation in use: "shani", "armv8" or "openssl". */
+const char *seaf_sha1_impl_name ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,799 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * The graph file is a header followed by fixed-size records, appended in
+ * topological order, so the parents of a commit always come before it
+ * and are referred to by record index. Integers are in network order.
+ * The file is mmapped and the record of a commit is found through an
+ * in-memory hash table of ids.
+ *
+ * seaf-server, httpserver and gc may update the same file. Writers hold
+ * an exclusive flock on it and pick up records appended by others before
+ * appending. A partial record left by a crash is cut off by the next
+ * writer.
+ */
+
+#include "common.h"
+
+#include "commit-graph.h"
+
+#ifndef WIN32
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "seafile-session.h"
+#include "commit-mgr.h"
+
+#define GRAPH_MAGIC "SEAFCGRH"
+#define GRAPH_VERSION 1
+
+#define NO_PARENT 0xFFFFFFFF
+
+/* Flags for finding merge bases. */
+#define PARENT1 1
+#define PARENT2 2
+#define STALE   4
+#define RESULT  8
+
+typedef struct GraphHeader {
+    char    magic[8];
+    guint32 version;
+} __attribute__((gcc_struct, __packed__)) GraphHeader;
+
+typedef struct GraphRecord {
+    unsigned char id[20];
+    unsigned char root_id[20];
+    guint32 parents[2];
+    guint32 generation;
+    guint64 ctime;
+} __attribute__((gcc_struct, __packed__)) GraphRecord;
+
+struct CommitGraph {
+    /* Held for every operation, records may be remapped. */
+    pthread_mutex_t lock;
+    char        *path;
+    int         fd;
+
+    void        *map;
+    gsize       map_len;
+    GraphRecord *records;
+    guint32     n_records;
+
+    GHashTable  *index;         /* raw id -> record index + 1 */
+};
+
+static guint
+id_hash (gconstpointer key)
+{
+    guint h;
+
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, 20) == 0;
+}
+
+static gboolean
+lookup_record (GHashTable *index, const unsigned char *id, guint32 *idx)
+{
+    gpointer value = g_hash_table_lookup (index, id);
+
+    if (!value)
+        return FALSE;
+    *idx = GPOINTER_TO_UINT (value) - 1;
+    return TRUE;
+}
+
+static inline guint32
+record_parent (CommitGraph *graph, guint32 idx, int k)
+{
+    return ntohl (graph->records[idx].parents[k]);
+}
+
+static inline guint32
+record_generation (CommitGraph *graph, guint32 idx)
+{
+    return ntohl (graph->records[idx].generation);
+}
+
+static inline guint64
+record_ctime (CommitGraph *graph, guint32 idx)
+{
+    return ntoh64 (graph->records[idx].ctime);
+}
+
+static int
+lock_graph (CommitGraph *graph)
+{
+    while (flock (graph->fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            seaf_warning ("Failed to lock %s: %s.\n",
+                          graph->path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+unlock_graph (CommitGraph *graph)
+{
+    flock (graph->fd, LOCK_UN);
+}
+
+/*
+ * Maps the complete records in the file and indexes the new ones.
+ * Indexing stops at the first bad record.
+ */
+static int
+refresh_graph (CommitGraph *graph)
+{
+    struct stat st;
+    GraphHeader *hdr;
+    GraphRecord *rec;
+    void *map;
+    gsize len;
+    guint32 n, i, p, generation;
+    int k;
+
+    if (fstat (graph->fd, &st) < 0) {
+        seaf_warning ("Failed to stat %s: %s.\n", graph->path, strerror(errno));
+        return -1;
+    }
+    if (st.st_size < sizeof(GraphHeader))
+        return 0;
+
+    n = (st.st_size - sizeof(GraphHeader)) / sizeof(GraphRecord);
+    if (n <= graph->n_records && graph->map)
+        return 0;
+
+    len = sizeof(GraphHeader) + (gsize)n * sizeof(GraphRecord);
+    map = mmap (NULL, len, PROT_READ, MAP_SHARED, graph->fd, 0);
+    if (map == MAP_FAILED) {
+        seaf_warning ("Failed to map %s: %s.\n", graph->path, strerror(errno));
+        return -1;
+    }
+
+    hdr = map;
+    if (memcmp (hdr->magic, GRAPH_MAGIC, 8) != 0 ||
+        ntohl (hdr->version) != GRAPH_VERSION) {
+        seaf_warning ("Bad commit graph %s.\n", graph->path);
+        munmap (map, len);
+        return -1;
+    }
+
+    if (graph->map)
+        munmap (graph->map, graph->map_len);
+    graph->map = map;
+    graph->map_len = len;
+    graph->records = (GraphRecord *)(hdr + 1);
+
+    for (i = graph->n_records; i < n; ++i) {
+        rec = &graph->records[i];
+        generation = 0;
+        for (k = 0; k < 2; ++k) {
+            p = ntohl (rec->parents[k]);
+            if (p == NO_PARENT)
+                continue;
+            if (p >= i)
+                break;
+            generation = MAX (generation, record_generation (graph, p));
+        }
+        /* Also catches zeroed records. */
+        if (k < 2 || ntohl (rec->generation) != generation + 1) {
+            seaf_warning ("Bad record %u in commit graph %s.\n",
+                          i, graph->path);
+            break;
+        }
+        g_hash_table_insert (graph->index, g_memdup (rec->id, 20),
+                             GUINT_TO_POINTER (i + 1));
+    }
+
+    graph->n_records = i;
+    return 0;
+}
+
+CommitGraph *
+commit_graph_open (const char *path)
+{
+    CommitGraph *graph;
+    GraphHeader hdr;
+    struct stat st;
+    int ret = 0;
+
+    graph = g_new0 (CommitGraph, 1);
+    pthread_mutex_init (&graph->lock, NULL);
+    graph->path = g_strdup (path);
+    graph->index = g_hash_table_new_full (id_hash, id_equal, g_free, NULL);
+
+    graph->fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (graph->fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        goto error;
+    }
+
+    if (lock_graph (graph) < 0)
+        goto error;
+
+    if (fstat (graph->fd, &st) < 0) {
+        seaf_warning ("Failed to stat %s: %s.\n", path, strerror(errno));
+        ret = -1;
+    } else if (st.st_size < sizeof(GraphHeader)) {
+        memcpy (hdr.magic, GRAPH_MAGIC, 8);
+        hdr.version = htonl (GRAPH_VERSION);
+        if (ftruncate (graph->fd, 0) < 0 ||
+            writen (graph->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+            ret = -1;
+        }
+    }
+    if (ret == 0)
+        ret = refresh_graph (graph);
+
+    unlock_graph (graph);
+    if (ret < 0)
+        goto error;
+
+    return graph;
+
+error:
+    commit_graph_free (graph);
+    return NULL;
+}
+
+void
+commit_graph_free (CommitGraph *graph)
+{
+    if (graph->map)
+        munmap (graph->map, graph->map_len);
+    if (graph->fd >= 0)
+        close (graph->fd);
+    g_hash_table_destroy (graph->index);
+    pthread_mutex_destroy (&graph->lock);
+    g_free (graph->path);
+    g_free (graph);
+}
+
+/* A record that is either mapped or in @pending, not written yet. */
+static GraphRecord *
+get_record (CommitGraph *graph, GByteArray *pending, guint32 idx)
+{
+    if (idx < graph->n_records)
+        return &graph->records[idx];
+    return (GraphRecord *)pending->data + (idx - graph->n_records);
+}
+
+/*
+ * Appends @head and its missing ancestors, parents first. Only ids are
+ * kept on the stack; a commit whose parents are missing is loaded again
+ * after them, usually from the commit cache.
+ */
+static int
+append_missing (CommitGraph *graph, const char *head)
+{
+    GHashTable *added;
+    GByteArray *pending;
+    GPtrArray *stack;
+    GraphRecord rec;
+    SeafCommit *commit;
+    const char *parent_ids[2];
+    unsigned char raw[20];
+    guint32 idx, next = graph->n_records, generation;
+    gsize end;
+    char *id;
+    int k, n_missing, ret = 0;
+
+    added = g_hash_table_new_full (id_hash, id_equal, g_free, NULL);
+    pending = g_byte_array_new ();
+    stack = g_ptr_array_new ();
+    g_ptr_array_add (stack, g_strdup (head));
+
+    while (stack->len > 0) {
+        id = g_ptr_array_index (stack, stack->len - 1);
+
+        if (hex_to_sha1 (id, raw) < 0) {
+            seaf_warning ("Invalid commit id %s.\n", id);
+            ret = -1;
+            break;
+        }
+        if (lookup_record (graph->index, raw, &idx) ||
+            lookup_record (added, raw, &idx)) {
+            g_free (g_ptr_array_remove_index (stack, stack->len - 1));
+            continue;
+        }
+
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr, id);
+        if (!commit) {
+            seaf_warning ("Failed to find commit %s.\n", id);
+            ret = -1;
+            break;
+        }
+
+        memset (&rec, 0, sizeof(rec));
+        memcpy (rec.id, raw, 20);
+        parent_ids[0] = commit->parent_id;
+        parent_ids[1] = commit->second_parent_id;
+        generation = 0;
+        n_missing = 0;
+
+        for (k = 0; k < 2; ++k) {
+            rec.parents[k] = htonl (NO_PARENT);
+            if (!parent_ids[k])
+                continue;
+            if (hex_to_sha1 (parent_ids[k], raw) < 0) {
+                seaf_warning ("Invalid parent of commit %s.\n", id);
+                ret = -1;
+                break;
+            }
+            if (lookup_record (graph->index, raw, &idx) ||
+                lookup_record (added, raw, &idx)) {
+                rec.parents[k] = htonl (idx);
+                generation = MAX (generation,
+                                  ntohl (get_record (graph, pending, idx)->generation));
+            } else {
+                g_ptr_array_add (stack, g_strdup (parent_ids[k]));
+                ++n_missing;
+            }
+        }
+
+        if (ret == 0 && n_missing == 0) {
+            hex_to_sha1 (commit->root_id, rec.root_id);
+            rec.generation = htonl (generation + 1);
+            rec.ctime = hton64 (commit->ctime);
+            g_byte_array_append (pending, (guint8 *)&rec, sizeof(rec));
+            g_hash_table_insert (added, g_memdup (rec.id, 20),
+                                 GUINT_TO_POINTER (next + 1));
+            ++next;
+            g_free (g_ptr_array_remove_index (stack, stack->len - 1));
+        }
+        seaf_commit_unref (commit);
+        if (ret < 0)
+            break;
+    }
+
+    /* Records already built are valid even if some commit is missing. */
+    if (pending->len > 0) {
+        end = sizeof(GraphHeader) + (gsize)graph->n_records * sizeof(GraphRecord);
+        if (ftruncate (graph->fd, end) < 0 ||
+            lseek (graph->fd, end, SEEK_SET) < 0 ||
+            writen (graph->fd, pending->data, pending->len) != pending->len) {
+            seaf_warning ("Failed to write %s: %s.\n",
+                          graph->path, strerror(errno));
+            ret = -1;
+        }
+    }
+
+    g_ptr_array_foreach (stack, (GFunc)g_free, NULL);
+    g_ptr_array_free (stack, TRUE);
+    g_byte_array_free (pending, TRUE);
+    g_hash_table_destroy (added);
+
+    return ret;
+}
+
+/* Called with the mutex held. */
+static int
+add_commits (CommitGraph *graph, const char *head, guint32 *head_idx)
+{
+    unsigned char raw[20];
+    int ret = 0;
+
+    if (!head || hex_to_sha1 (head, raw) < 0) {
+        seaf_warning ("Invalid commit id %s.\n", head);
+        return -1;
+    }
+    if (lookup_record (graph->index, raw, head_idx))
+        return 0;
+
+    if (lock_graph (graph) < 0)
+        return -1;
+
+    /* Another process may have added it. */
+    if (refresh_graph (graph) < 0) {
+        ret = -1;
+        goto out;
+    }
+    if (lookup_record (graph->index, raw, head_idx))
+        goto out;
+
+    ret = append_missing (graph, head);
+    if (refresh_graph (graph) < 0)
+        ret = -1;
+    if (ret == 0 && !lookup_record (graph->index, raw, head_idx))
+        ret = -1;
+
+out:
+    unlock_graph (graph);
+    return ret;
+}
+
+int
+commit_graph_add (CommitGraph *graph, const char *head)
+{
+    guint32 idx;
+    int ret;
+
+    pthread_mutex_lock (&graph->lock);
+    ret = add_commits (graph, head, &idx);
+    pthread_mutex_unlock (&graph->lock);
+
+    return ret;
+}
+
+/*
+ * Ancestors of @from are only followed while their generation is above
+ * that of @to, since an ancestor always has a lower generation.
+ */
+static gboolean
+is_reachable (CommitGraph *graph, guint32 from, guint32 to)
+{
+    guint32 to_gen = record_generation (graph, to);
+    guint8 *seen;
+    GArray *stack;
+    guint32 idx, p;
+    gboolean found = FALSE;
+    int k;
+
+    if (from == to)
+        return TRUE;
+    if (record_generation (graph, from) <= to_gen)
+        return FALSE;
+
+    seen = g_new0 (guint8, graph->n_records / 8 + 1);
+    stack = g_array_new (FALSE, FALSE, sizeof(guint32));
+    g_array_append_val (stack, from);
+
+    while (stack->len > 0 && !found) {
+        idx = g_array_index (stack, guint32, stack->len - 1);
+        g_array_set_size (stack, stack->len - 1);
+
+        for (k = 0; k < 2; ++k) {
+            p = record_parent (graph, idx, k);
+            if (p == NO_PARENT || (seen[p / 8] & (1 << (p % 8))))
+                continue;
+            if (p == to) {
+                found = TRUE;
+                break;
+            }
+            seen[p / 8] |= 1 << (p % 8);
+            if (record_generation (graph, p) > to_gen)
+                g_array_append_val (stack, p);
+        }
+    }
+
+    g_array_free (stack, TRUE);
+    g_free (seen);
+    return found;
+}
+
+int
+commit_graph_is_ancestor (CommitGraph *graph,
+                          const char *ancestor,
+                          const char *commit)
+{
+    guint32 a, c;
+    int ret;
+
+    pthread_mutex_lock (&graph->lock);
+
+    if (add_commits (graph, ancestor, &a) < 0 ||
+        add_commits (graph, commit, &c) < 0) {
+        ret = -1;
+        goto out;
+    }
+    ret = is_reachable (graph, c, a) ? 1 : 0;
+
+out:
+    pthread_mutex_unlock (&graph->lock);
+    return ret;
+}
+
+/* Max-heap of record indexes, by generation or by ctime. */
+typedef struct RecordQueue {
+    CommitGraph *graph;
+    gboolean    by_ctime;
+    GArray      *heap;
+} RecordQueue;
+
+static inline guint64
+queue_key (RecordQueue *q, guint32 idx)
+{
+    if (q->by_ctime)
+        return record_ctime (q->graph, idx);
+    return record_generation (q->graph, idx);
+}
+
+static void
+queue_push (RecordQueue *q, guint32 idx)
+{
+    guint32 *heap;
+    guint i, parent;
+
+    g_array_append_val (q->heap, idx);
+    heap = (guint32 *)q->heap->data;
+
+    for (i = q->heap->len - 1; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (queue_key (q, heap[parent]) >= queue_key (q, heap[i]))
+            break;
+        idx = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = idx;
+    }
+}
+
+static guint32
+queue_pop (RecordQueue *q)
+{
+    guint32 *heap = (guint32 *)q->heap->data;
+    guint32 top = heap[0], tmp;
+    guint i = 0, child, n = q->heap->len - 1;
+
+    heap[0] = heap[n];
+    g_array_set_size (q->heap, n);
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n &&
+            queue_key (q, heap[child + 1]) > queue_key (q, heap[child]))
+            ++child;
+        if (queue_key (q, heap[i]) >= queue_key (q, heap[child]))
+            break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+
+    return top;
+}
+
+static gint
+compare_by_ctime (gconstpointer a, gconstpointer b, gpointer vgraph)
+{
+    guint64 ta = record_ctime (vgraph, *(const guint32 *)a);
+    guint64 tb = record_ctime (vgraph, *(const guint32 *)b);
+
+    /* Latest commit comes first. */
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+/*
+ * Common ancestors of @one and any of @twos, none of which is an ancestor
+ * of another, latest first. As merge_bases_many() in vc-common.c.
+ */
+static GArray *
+merge_bases (CommitGraph *graph, guint32 one, guint32 *twos, int n_twos)
+{
+    RecordQueue q;
+    GArray *result;
+    guint8 *flags;
+    guint32 idx, p;
+    guint i, j;
+    int k, f;
+    gboolean nonstale;
+
+    flags = g_new0 (guint8, graph->n_records);
+    result = g_array_new (FALSE, FALSE, sizeof(guint32));
+    q.graph = graph;
+    q.by_ctime = FALSE;
+    q.heap = g_array_new (FALSE, FALSE, sizeof(guint32));
+
+    flags[one] |= PARENT1;
+    queue_push (&q, one);
+    for (k = 0; k < n_twos; ++k) {
+        flags[twos[k]] |= PARENT2;
+        queue_push (&q, twos[k]);
+    }
+
+    /* Paint down until only commits below a common ancestor are left. */
+    while (1) {
+        nonstale = FALSE;
+        for (i = 0; i < q.heap->len; ++i)
+            if (!(flags[g_array_index (q.heap, guint32, i)] & STALE)) {
+                nonstale = TRUE;
+                break;
+            }
+        if (!nonstale)
+            break;
+
+        idx = queue_pop (&q);
+        f = flags[idx] & (PARENT1 | PARENT2 | STALE);
+        if (f == (PARENT1 | PARENT2)) {
+            if (!(flags[idx] & RESULT)) {
+                flags[idx] |= RESULT;
+                g_array_append_val (result, idx);
+            }
+            f |= STALE;
+        }
+        for (k = 0; k < 2; ++k) {
+            p = record_parent (graph, idx, k);
+            if (p == NO_PARENT || (flags[p] & f) == f)
+                continue;
+            flags[p] |= f;
+            queue_push (&q, p);
+        }
+    }
+
+    g_array_free (q.heap, TRUE);
+    g_free (flags);
+
+    /* Drop the ones that are ancestors of others. */
+    for (i = 0; i < result->len; ) {
+        for (j = 0; j < result->len; ++j) {
+            if (i != j && is_reachable (graph,
+                                        g_array_index (result, guint32, j),
+                                        g_array_index (result, guint32, i)))
+                break;
+        }
+        if (j < result->len)
+            g_array_remove_index (result, i);
+        else
+            ++i;
+    }
+
+    g_array_sort_with_data (result, compare_by_ctime, graph);
+    return result;
+}
+
+char *
+commit_graph_merge_base (CommitGraph *graph,
+                         const char *commit1,
+                         const char *commit2)
+{
+    GArray *result;
+    guint32 one, two;
+    char *ret = NULL;
+
+    pthread_mutex_lock (&graph->lock);
+
+    if (add_commits (graph, commit1, &one) < 0 ||
+        add_commits (graph, commit2, &two) < 0)
+        goto out;
+
+    result = merge_bases (graph, one, &two, 1);
+
+    /*
+     * More than one common ancestors.
+     * Loop until the oldest common ancestor is found.
+     */
+    while (result->len > 1) {
+        GArray *next = merge_bases (graph,
+                                    g_array_index (result, guint32, 0),
+                                    &g_array_index (result, guint32, 1),
+                                    result->len - 1);
+        g_array_free (result, TRUE);
+        result = next;
+    }
+
+    if (result->len == 1) {
+        ret = g_malloc (41);
+        rawdata_to_hex (graph->records[g_array_index (result, guint32, 0)].id,
+                        ret, 20);
+    }
+    g_array_free (result, TRUE);
+
+out:
+    pthread_mutex_unlock (&graph->lock);
+    return ret;
+}
+
+gboolean
+commit_graph_traverse (CommitGraph *graph,
+                       const char *head,
+                       CommitGraphFunc func,
+                       void *data)
+{
+    CommitGraphEntry entry;
+    RecordQueue q;
+    GraphRecord *rec;
+    guint8 *seen;
+    guint32 idx, p;
+    gboolean stop, ret = TRUE;
+    int k;
+
+    pthread_mutex_lock (&graph->lock);
+
+    if (add_commits (graph, head, &idx) < 0) {
+        pthread_mutex_unlock (&graph->lock);
+        return FALSE;
+    }
+
+    seen = g_new0 (guint8, graph->n_records / 8 + 1);
+    q.graph = graph;
+    q.by_ctime = TRUE;
+    q.heap = g_array_new (FALSE, FALSE, sizeof(guint32));
+
+    seen[idx / 8] |= 1 << (idx % 8);
+    queue_push (&q, idx);
+
+    while (q.heap->len > 0) {
+        idx = queue_pop (&q);
+        rec = &graph->records[idx];
+
+        rawdata_to_hex (rec->id, entry.commit_id, 20);
+        rawdata_to_hex (rec->root_id, entry.root_id, 20);
+        entry.ctime = ntoh64 (rec->ctime);
+        entry.generation = ntohl (rec->generation);
+
+        stop = FALSE;
+        if (!func (&entry, data, &stop)) {
+            ret = FALSE;
+            break;
+        }
+        if (stop)
+            continue;
+
+        for (k = 0; k < 2; ++k) {
+            p = record_parent (graph, idx, k);
+            if (p == NO_PARENT || (seen[p / 8] & (1 << (p % 8))))
+                continue;
+            seen[p / 8] |= 1 << (p % 8);
+            queue_push (&q, p);
+        }
+    }
+
+    g_array_free (q.heap, TRUE);
+    g_free (seen);
+    pthread_mutex_unlock (&graph->lock);
+
+    return ret;
+}
+
+#else
+
+/* seaf_commit_manager_get_graph() returns NULL, so none of these is used. */
+
+CommitGraph *
+commit_graph_open (const char *path)
+{
+    return NULL;
+}
+
+void
+commit_graph_free (CommitGraph *graph)
+{
+}
+
+int
+commit_graph_add (CommitGraph *graph, const char *head)
+{
+    return -1;
+}
+
+int
+commit_graph_is_ancestor (CommitGraph *graph,
+                          const char *ancestor,
+                          const char *commit)
+{
+    return -1;
+}
+
+char *
+commit_graph_merge_base (CommitGraph *graph,
+                         const char *commit1,
+                         const char *commit2)
+{
+    return NULL;
+}
+
+gboolean
+commit_graph_traverse (CommitGraph *graph,
+                       const char *head,
+                       CommitGraphFunc func,
+                       void *data)
+{
+    return FALSE;
+}
+
+#endif  /* WIN32 */
@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+/*
+ * Commit graph of a repo. For each commit it records the parents, the
+ * generation number (1 + the largest generation of the parents), the
+ * root id and the ctime, so that ancestry queries and history walks
+ * don't need to load commit objects.
+ *
+ * Commits are added lazily: every query first adds its commits and the
+ * missing ancestors, loading only the commits not in the graph yet.
+ *
+ * Not available on Windows.
+ */
+
+struct CommitGraph;
+typedef struct CommitGraph CommitGraph;
+
+typedef struct CommitGraphEntry {
+    char        commit_id[41];
+    char        root_id[41];
+    guint64     ctime;
+    guint32     generation;
+} CommitGraphEntry;
+
+/* @func must not call into the graph. */
+typedef gboolean (*CommitGraphFunc) (const CommitGraphEntry *entry,
+                                     void *data,
+                                     gboolean *stop);
+
+/* The file is created if it doesn't exist. */
+CommitGraph *
+commit_graph_open (const char *path);
+
+void
+commit_graph_free (CommitGraph *graph);
+
+/* Adds @head and its ancestors that aren't in the graph yet. */
+int
+commit_graph_add (CommitGraph *graph, const char *head);
+
+/*
+ * Returns 1 if @ancestor is @commit or one of its ancestors, 0 if not,
+ * -1 on error.
+ */
+int
+commit_graph_is_ancestor (CommitGraph *graph,
+                          const char *ancestor,
+                          const char *commit);
+
+/* Same result as get_merge_base(). Returns NULL on error. */
+char *
+commit_graph_merge_base (CommitGraph *graph,
+                         const char *commit1,
+                         const char *commit2);
+
+/*
+ * Walks the history from @head, latest commit first, like
+ * seaf_commit_manager_traverse_commit_tree().
+ */
+gboolean
+commit_graph_traverse (CommitGraph *graph,
+                       const char *head,
+                       CommitGraphFunc func,
+                       void *data);
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "common.h"
 
+#include <pthread.h>
 #include <json-glib/json-glib.h>
 #include <openssl/sha.h>
 
@@ -10,16 +11,45 @@
 #include "searpc-utils.h"
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 #include "commit-mgr.h"
+#include "commit-graph.h"
 #include "seaf-utils.h"
+#include "cdc/seaf-sha1.h"
 
 #define MAX_TIME_SKEW 259200    /* 3 days */
 
+#define COMMIT_GRAPH_DIR "commit-graph"
+
+/* Default memory budget of the commit cache, in MB. */
+#define DEFAULT_COMMIT_CACHE_SIZE 8
+
+/*
+ * LRU cache of parsed commits. Commits are immutable once added, so the
+ * cache only needs to drop deleted commits. It holds one reference on
+ * each cached commit.
+ */
+typedef struct CommitCache {
+    GHashTable      *commits;   /* commit id -> GList link in lru */
+    GQueue          *lru;       /* most recently used at head */
+    gsize           size;
+    gsize           capacity;
+    guint64         hits;
+    guint64         misses;
+    pthread_mutex_t lock;
+} CommitCache;
+
 struct _SeafCommitManagerPriv {
-    /* GHashTable *commit_cache; */
     /* JsonGenerator   *gen; */
     /* JsonParser      *parser; */
-    int dummy;
+    CommitCache     cache;
+
+    /* Write new commits in the binary encoding. */
+    gboolean        binary_format;
+
+    /* repo id -> CommitGraph, opened on first use */
+    GHashTable      *graphs;
+    pthread_mutex_t graphs_lock;
 };
 
 static SeafCommit *
@@ -32,24 +62,28 @@ static JsonNode *
 commit_to_json_node (SeafCommit *commit);
 static SeafCommit *
 commit_from_json_node (const char *id, JsonNode *node);
+static char *
+commit_to_binary (SeafCommit *commit, gsize *len);
+static SeafCommit *
+commit_from_binary (const char *id, const char *data, gsize len);
 
 static void compute_commit_id (SeafCommit* commit)
 {
-    SHA_CTX ctx;
+    SeafSHA1Ctx ctx;
     uint8_t sha1[20];    
     gint64 ctime_n;
 
-    SHA1_Init (&ctx);
-    SHA1_Update (&ctx, commit->root_id, 41);
-    SHA1_Update (&ctx, commit->creator_id, 41);
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, commit->root_id, 41);
+    seaf_sha1_update (&ctx, commit->creator_id, 41);
     if (commit->creator_name)
-        SHA1_Update (&ctx, commit->creator_name, strlen(commit->creator_name)+1);
-    SHA1_Update (&ctx, commit->desc, strlen(commit->desc)+1);
+        seaf_sha1_update (&ctx, commit->creator_name, strlen(commit->creator_name)+1);
+    seaf_sha1_update (&ctx, commit->desc, strlen(commit->desc)+1);
 
     /* convert to network byte order */
     ctime_n = hton64 (commit->ctime);
-    SHA1_Update (&ctx, &ctime_n, sizeof(ctime_n));
-    SHA1_Final (sha1, &ctx);
+    seaf_sha1_update (&ctx, &ctime_n, sizeof(ctime_n));
+    seaf_sha1_final (sha1, &ctx);
     
     rawdata_to_hex (sha1, commit->commit_id, 20);
 }
@@ -100,6 +134,15 @@ seaf_commit_new (const char *commit_id,
     return commit;
 }
 
+gboolean
+seaf_commit_verify_id (SeafCommit *commit)
+{
+    SeafCommit tmp = *commit;
+
+    compute_commit_id (&tmp);
+    return memcmp (tmp.commit_id, commit->commit_id, 40) == 0;
+}
+
 char *
 seaf_commit_to_data (SeafCommit *commit, gsize *len)
 {
@@ -126,6 +169,11 @@ seaf_commit_from_data (const char *id, const char *data, gsize len)
     SeafCommit *commit;
     GError *error = NULL;
 
+    if (seaf_commit_data_is_binary (data, len)) {
+        g_object_unref (parser);
+        return commit_from_binary (id, data, len);
+    }
+
     if (!json_parser_load_from_data (parser, data, len, &error)) {
         g_warning ("Failed to parse commit data: %s.\n", error->message);
         g_object_unref (parser);
@@ -151,13 +199,14 @@ seaf_commit_free (SeafCommit *commit)
     if (commit->repo_name) g_free (commit->repo_name);
     if (commit->repo_desc) g_free (commit->repo_desc);
     g_free (commit->magic);
+    g_free (commit->chunk_policy);
     g_free (commit);
 }
 
 void
 seaf_commit_ref (SeafCommit *commit)
 {
-    commit->ref++;
+    g_atomic_int_inc (&commit->ref);
 }
 
 void
@@ -166,7 +215,7 @@ seaf_commit_unref (SeafCommit *commit)
     if (!commit)
         return;
 
-    if (--commit->ref <= 0)
+    if (g_atomic_int_dec_and_test (&commit->ref))
         seaf_commit_free (commit);
 }
 
@@ -179,9 +228,73 @@ seaf_commit_manager_new (SeafileSession *seaf)
     mgr->seaf = seaf;
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
 
+    mgr->priv->cache.commits = g_hash_table_new (g_str_hash, g_str_equal);
+    mgr->priv->cache.lru = g_queue_new ();
+    pthread_mutex_init (&mgr->priv->cache.lock, NULL);
+
+    mgr->priv->graphs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+    pthread_mutex_init (&mgr->priv->graphs_lock, NULL);
+
     return mgr;
 }
 
+/*
+ * [commit_cache]
+ * size = <MB>
+ *
+ * on the server, commit_cache_size in the config db on the client.
+ * 0 disables the cache.
+ */
+static void
+load_commit_cache_size (SeafCommitManager *mgr)
+{
+    CommitCache *cache = &mgr->priv->cache;
+    char *value;
+    gint64 size = DEFAULT_COMMIT_CACHE_SIZE;
+
+#ifdef SEAFILE_SERVER
+    value = g_key_file_get_string (mgr->seaf->config,
+                                   "commit_cache", "size", NULL);
+#else
+    value = seafile_session_config_get_string (mgr->seaf, "commit_cache_size");
+#endif
+    if (value) {
+        size = g_ascii_strtoll (value, NULL, 10);
+        if (size < 0) {
+            g_warning ("Invalid commit cache size %s.\n", value);
+            size = DEFAULT_COMMIT_CACHE_SIZE;
+        }
+        g_free (value);
+    }
+
+    cache->capacity = (gsize)size << 20;
+}
+
+/*
+ * [commit]
+ * format = binary
+ *
+ * Server only. Clients always get JSON commits, see
+ * seaf_commit_data_to_json().
+ */
+static void
+load_commit_format (SeafCommitManager *mgr)
+{
+#ifdef SEAFILE_SERVER
+    char *format;
+
+    format = g_key_file_get_string (mgr->seaf->config, "commit", "format", NULL);
+    if (format) {
+        if (strcmp (format, "binary") == 0)
+            mgr->priv->binary_format = TRUE;
+        else if (strcmp (format, "json") != 0)
+            g_warning ("Unknown commit format %s.\n", format);
+        g_free (format);
+    }
+#endif
+}
+
 int
 seaf_commit_manager_init (SeafCommitManager *mgr)
 {
@@ -197,33 +310,130 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
     }
 #endif
 
+    load_commit_cache_size (mgr);
+    load_commit_format (mgr);
+
     return 0;
 }
 
-#if 0
-inline static void
+static gsize
+commit_mem_size (SeafCommit *commit)
+{
+    gsize size = sizeof(SeafCommit);
+
+#define STR_SIZE(s) ((s) ? strlen(s) + 1 : 0)
+    size += STR_SIZE(commit->desc) + STR_SIZE(commit->creator_name) +
+        STR_SIZE(commit->parent_id) + STR_SIZE(commit->second_parent_id) +
+        STR_SIZE(commit->repo_name) + STR_SIZE(commit->repo_desc) +
+        STR_SIZE(commit->repo_category) + STR_SIZE(commit->magic) +
+        STR_SIZE(commit->chunk_policy);
+#undef STR_SIZE
+
+    return size;
+}
+
+/* Returns a new reference to the cached commit, or NULL. */
+static SeafCommit *
+lookup_commit_in_cache (SeafCommitManager *mgr, const char *id)
+{
+    CommitCache *cache = &mgr->priv->cache;
+    GList *link;
+    SeafCommit *commit = NULL;
+
+    if (cache->capacity == 0)
+        return NULL;
+
+    pthread_mutex_lock (&cache->lock);
+
+    link = g_hash_table_lookup (cache->commits, id);
+    if (link) {
+        g_queue_unlink (cache->lru, link);
+        g_queue_push_head_link (cache->lru, link);
+        commit = link->data;
+        seaf_commit_ref (commit);
+        cache->hits++;
+    } else
+        cache->misses++;
+
+    pthread_mutex_unlock (&cache->lock);
+
+    return commit;
+}
+
+static void
+remove_cache_link (CommitCache *cache, GList *link)
+{
+    SeafCommit *commit = link->data;
+
+    g_hash_table_remove (cache->commits, commit->commit_id);
+    g_queue_delete_link (cache->lru, link);
+    cache->size -= commit_mem_size (commit);
+    seaf_commit_unref (commit);
+}
+
+static void
 add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
 {
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
+    CommitCache *cache = &mgr->priv->cache;
+    gsize size = commit_mem_size (commit);
+
+    if (size > cache->capacity)
+        return;
+
+    pthread_mutex_lock (&cache->lock);
+
+    /* Another thread may have loaded the same commit meanwhile. */
+    if (g_hash_table_lookup (cache->commits, commit->commit_id)) {
+        pthread_mutex_unlock (&cache->lock);
+        return;
+    }
+
     seaf_commit_ref (commit);
+    g_queue_push_head (cache->lru, commit);
+    g_hash_table_insert (cache->commits, commit->commit_id, cache->lru->head);
+    cache->size += size;
+
+    while (cache->size > cache->capacity)
+        remove_cache_link (cache, cache->lru->tail);
+
+    pthread_mutex_unlock (&cache->lock);
 }
 
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
+static void
+remove_commit_from_cache (SeafCommitManager *mgr, const char *id)
 {
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
-    seaf_commit_unref (commit);
+    CommitCache *cache = &mgr->priv->cache;
+    GList *link;
+
+    pthread_mutex_lock (&cache->lock);
+
+    link = g_hash_table_lookup (cache->commits, id);
+    if (link)
+        remove_cache_link (cache, link);
+
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+seaf_commit_manager_get_cache_stats (SeafCommitManager *mgr,
+                                     SeafCommitCacheStats *stats)
+{
+    CommitCache *cache = &mgr->priv->cache;
+
+    pthread_mutex_lock (&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->n_commits = g_queue_get_length (cache->lru);
+    stats->size = cache->size;
+    stats->capacity = cache->capacity;
+    pthread_mutex_unlock (&cache->lock);
 }
-#endif
 
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr, SeafCommit *commit)
 {
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
     if ((ret = save_commit (mgr, commit)) < 0)
         return -1;
     
@@ -235,20 +445,7 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr, const char *id)
 {
     g_assert (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
-
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    remove_commit_from_cache (mgr, id);
 
     delete_commit (mgr, id);
 }
@@ -258,23 +455,58 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr, const char *id)
 {
     SeafCommit *commit;
 
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
+    commit = lookup_commit_in_cache (mgr, id);
+    if (commit)
         return commit;
-    }
-#endif
 
     commit = load_commit (mgr, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    add_commit_to_cache (mgr, commit);
 
     return commit;
 }
 
+CommitGraph *
+seaf_commit_manager_get_graph (SeafCommitManager *mgr, const char *repo_id)
+{
+#ifdef WIN32
+    return NULL;
+#else
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CommitGraph *graph;
+    char *dir, *path;
+
+    if (!is_uuid_valid (repo_id))
+        return NULL;
+
+    pthread_mutex_lock (&priv->graphs_lock);
+
+    graph = g_hash_table_lookup (priv->graphs, repo_id);
+    if (graph)
+        goto out;
+
+    dir = g_build_filename (mgr->seaf->seaf_dir, COMMIT_GRAPH_DIR, NULL);
+    if (g_mkdir_with_parents (dir, 0777) < 0) {
+        g_warning ("Failed to create %s.\n", dir);
+        g_free (dir);
+        goto out;
+    }
+    path = g_build_filename (dir, repo_id, NULL);
+    g_free (dir);
+
+    graph = commit_graph_open (path);
+    if (graph)
+        g_hash_table_insert (priv->graphs, g_strdup (repo_id), graph);
+    g_free (path);
+
+out:
+    pthread_mutex_unlock (&priv->graphs_lock);
+    return graph;
+#endif
+}
+
 static gint
 compare_commit_by_time (gconstpointer a, gconstpointer b, gpointer unused)
 {
@@ -501,7 +733,8 @@ seaf_commit_manager_compare_commit (SeafCommitManager *mgr,
                                     const char *commit2)
 {
     SeafCommit *c1, *c2;
-    int ret = 0;
+    CommitGraph *graph;
+    int ret = 0, rc;
 
     if (!commit1 || !commit2)
         return -2;
@@ -522,9 +755,28 @@ seaf_commit_manager_compare_commit (SeafCommitManager *mgr,
     c2 = seaf_commit_manager_get_commit (mgr, commit2);
     if (!c2) {
         g_warning ("Failed to find commit %s.\n", commit2);
+        seaf_commit_unref (c1);
         return -2;
     }
 
+    /* The generation numbers answer this without loading the history. */
+    graph = seaf_commit_manager_get_graph (mgr, c1->repo_id);
+    if (graph) {
+        rc = commit_graph_is_ancestor (graph, commit2, commit1);
+        if (rc == 1) {
+            ret = 1;
+            goto out;
+        }
+        if (rc == 0) {
+            rc = commit_graph_is_ancestor (graph, commit1, commit2);
+            if (rc >= 0) {
+                ret = rc ? -1 : 0;
+                goto out;
+            }
+        }
+        /* Fall back to walking the history. */
+    }
+
     if (c1->ctime > c2->ctime) {
         FindingHelp f;
         f.to_find = c2;
@@ -549,6 +801,7 @@ seaf_commit_manager_compare_commit (SeafCommitManager *mgr,
             ret = 0;
     }
 
+out:
     seaf_commit_unref (c1);
     seaf_commit_unref (c2);
     return ret;
@@ -599,11 +852,14 @@ end:
 gboolean
 seaf_commit_manager_commit_exists (SeafCommitManager *mgr, const char *id)
 {
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL)
+    CommitCache *cache = &mgr->priv->cache;
+    gboolean cached;
+
+    pthread_mutex_lock (&cache->lock);
+    cached = (g_hash_table_lookup (cache->commits, id) != NULL);
+    pthread_mutex_unlock (&cache->lock);
+    if (cached)
         return TRUE;
-#endif
 
     return seaf_obj_store_obj_exists (mgr->obj_store, id);
 }
@@ -647,6 +903,14 @@ commit_to_json_node (SeafCommit *commit)
     }
     if (commit->no_local_history)
         json_object_set_int_member (object, "no_local_history", 1);
+    /* Only record non-default chunkers, so that old clients can still
+     * parse commits (and compute the same ids) for rabin-chunked repos.
+     */
+    if (commit->chunker != 0)
+        json_object_set_int_member (object, "chunker", commit->chunker);
+    if (commit->chunk_policy)
+        json_object_set_string_member (object, "chunk_policy",
+                                       commit->chunk_policy);
 
     json_node_take_object (root, object);
 
@@ -672,6 +936,8 @@ commit_from_json_node (const char *commit_id, JsonNode *node)
     int enc_version = 0;
     const char *magic = NULL;
     int no_local_history = 0;
+    int chunker = 0;
+    const char *chunk_policy = NULL;
 
     object = json_node_get_object (node);
 
@@ -698,6 +964,11 @@ commit_from_json_node (const char *commit_id, JsonNode *node)
     }
     if (json_object_has_member (object, "no_local_history"))
         no_local_history = json_object_get_int_member (object, "no_local_history");
+    if (json_object_has_member (object, "chunker"))
+        chunker = json_object_get_int_member (object, "chunker");
+    if (json_object_has_member (object, "chunk_policy"))
+        chunk_policy = json_object_get_string_or_null_member (object,
+                                                              "chunk_policy");
 
     /* sanity check for incoming values. */
     if (strlen(repo_id) != 36 ||
@@ -731,17 +1002,282 @@ commit_from_json_node (const char *commit_id, JsonNode *node)
     }
     if (no_local_history)
         commit->no_local_history = TRUE;
+    commit->chunker = chunker;
+    commit->chunk_policy = g_strdup (chunk_policy);
 
     return commit;
 }
 
+/*
+ * Binary commit encoding, version 1. Integers are in network order.
+ *
+ *   magic "SCMB", version, flags       (1 byte each after the magic)
+ *   repo id                            (36 bytes)
+ *   root id, creator id                (20 bytes each)
+ *   parent id, second parent id        (20 bytes each, if in flags)
+ *   ctime                              (8 bytes)
+ *   enc_version, chunker               (4 bytes each)
+ *   creator_name, desc, repo_name, repo_desc, repo_category, magic
+ *                                      (4-byte length and the bytes,
+ *                                       NO_STRING for NULL)
+ *   chunk_policy                       (same, if in flags)
+ *
+ * JSON commits start with '{', so the two can't be confused.
+ */
+#define COMMIT_BIN_MAGIC "SCMB"
+#define COMMIT_BIN_VERSION 1
+
+#define COMMIT_FLAG_PARENT              1
+#define COMMIT_FLAG_SECOND_PARENT       2
+#define COMMIT_FLAG_ENCRYPTED           4
+#define COMMIT_FLAG_NO_LOCAL_HISTORY    8
+#define COMMIT_FLAG_CHUNK_POLICY        16
+
+#define NO_STRING 0xFFFFFFFF
+
+gboolean
+seaf_commit_data_is_binary (const char *data, gsize len)
+{
+    return (len >= 4 && memcmp (data, COMMIT_BIN_MAGIC, 4) == 0);
+}
+
+static void
+append_id (GByteArray *buf, const char *hex)
+{
+    unsigned char raw[20];
+
+    hex_to_rawdata (hex, raw, 20);
+    g_byte_array_append (buf, raw, 20);
+}
+
+static void
+append_u32 (GByteArray *buf, guint32 val)
+{
+    val = g_htonl (val);
+    g_byte_array_append (buf, (guint8 *)&val, 4);
+}
+
+static void
+append_string (GByteArray *buf, const char *str)
+{
+    if (!str) {
+        append_u32 (buf, NO_STRING);
+        return;
+    }
+    append_u32 (buf, strlen(str));
+    g_byte_array_append (buf, (guint8 *)str, strlen(str));
+}
+
+static char *
+commit_to_binary (SeafCommit *commit, gsize *len)
+{
+    GByteArray *buf = g_byte_array_new ();
+    guint8 header[6];
+    guint64 ctime;
+
+    memcpy (header, COMMIT_BIN_MAGIC, 4);
+    header[4] = COMMIT_BIN_VERSION;
+    header[5] = 0;
+    if (commit->parent_id)
+        header[5] |= COMMIT_FLAG_PARENT;
+    if (commit->second_parent_id)
+        header[5] |= COMMIT_FLAG_SECOND_PARENT;
+    if (commit->encrypted)
+        header[5] |= COMMIT_FLAG_ENCRYPTED;
+    if (commit->no_local_history)
+        header[5] |= COMMIT_FLAG_NO_LOCAL_HISTORY;
+    if (commit->chunk_policy)
+        header[5] |= COMMIT_FLAG_CHUNK_POLICY;
+    g_byte_array_append (buf, header, sizeof(header));
+
+    g_byte_array_append (buf, (guint8 *)commit->repo_id, 36);
+    append_id (buf, commit->root_id);
+    append_id (buf, commit->creator_id);
+    if (commit->parent_id)
+        append_id (buf, commit->parent_id);
+    if (commit->second_parent_id)
+        append_id (buf, commit->second_parent_id);
+
+    ctime = hton64 (commit->ctime);
+    g_byte_array_append (buf, (guint8 *)&ctime, 8);
+    append_u32 (buf, commit->encrypted ? commit->enc_version : 0);
+    append_u32 (buf, commit->chunker);
+
+    append_string (buf, commit->creator_name);
+    append_string (buf, commit->desc);
+    append_string (buf, commit->repo_name);
+    append_string (buf, commit->repo_desc);
+    append_string (buf, commit->repo_category);
+    append_string (buf, commit->encrypted ? commit->magic : NULL);
+    if (commit->chunk_policy)
+        append_string (buf, commit->chunk_policy);
+
+    *len = buf->len;
+    return (char *)g_byte_array_free (buf, FALSE);
+}
+
+typedef struct CommitReader {
+    const guint8 *p;
+    const guint8 *end;
+} CommitReader;
+
+static const guint8 *
+read_bytes (CommitReader *r, gsize n)
+{
+    const guint8 *p = r->p;
+
+    if (r->end - r->p < n)
+        return NULL;
+    r->p += n;
+    return p;
+}
+
+static int
+read_id (CommitReader *r, char *hex)
+{
+    const guint8 *p = read_bytes (r, 20);
+
+    if (!p)
+        return -1;
+    rawdata_to_hex (p, hex, 20);
+    return 0;
+}
+
+static int
+read_u32 (CommitReader *r, guint32 *val)
+{
+    const guint8 *p = read_bytes (r, 4);
+
+    if (!p)
+        return -1;
+    memcpy (val, p, 4);
+    *val = g_ntohl (*val);
+    return 0;
+}
+
+/* Strings are copied straight out of the object data into the commit. */
+static int
+read_string (CommitReader *r, char **str)
+{
+    const guint8 *p;
+    guint32 len;
+
+    if (read_u32 (r, &len) < 0)
+        return -1;
+    if (len == NO_STRING) {
+        *str = NULL;
+        return 0;
+    }
+    if (!(p = read_bytes (r, len)))
+        return -1;
+    *str = g_strndup ((const char *)p, len);
+    return 0;
+}
+
+static SeafCommit *
+commit_from_binary (const char *commit_id, const char *data, gsize len)
+{
+    CommitReader r;
+    SeafCommit *commit;
+    const guint8 *header, *p;
+    guint32 enc_version, chunker;
+    guint64 ctime;
+    guint8 flags;
+
+    r.p = (const guint8 *)data;
+    r.end = r.p + len;
+
+    header = read_bytes (&r, 6);
+    if (!header || header[4] != COMMIT_BIN_VERSION) {
+        g_warning ("Unknown binary commit version.\n");
+        return NULL;
+    }
+    flags = header[5];
+
+    commit = g_new0 (SeafCommit, 1);
+    commit->ref = 1;
+    memcpy (commit->commit_id, commit_id, 40);
+
+    if (!(p = read_bytes (&r, 36)))
+        goto bad;
+    memcpy (commit->repo_id, p, 36);
+
+    if (read_id (&r, commit->root_id) < 0 ||
+        read_id (&r, commit->creator_id) < 0)
+        goto bad;
+    if (flags & COMMIT_FLAG_PARENT) {
+        commit->parent_id = g_malloc (41);
+        if (read_id (&r, commit->parent_id) < 0)
+            goto bad;
+    }
+    if (flags & COMMIT_FLAG_SECOND_PARENT) {
+        commit->second_parent_id = g_malloc (41);
+        if (read_id (&r, commit->second_parent_id) < 0)
+            goto bad;
+    }
+
+    if (!(p = read_bytes (&r, 8)))
+        goto bad;
+    memcpy (&ctime, p, 8);
+    commit->ctime = ntoh64 (ctime);
+
+    if (read_u32 (&r, &enc_version) < 0 ||
+        read_u32 (&r, &chunker) < 0)
+        goto bad;
+    commit->chunker = chunker;
+    commit->encrypted = (flags & COMMIT_FLAG_ENCRYPTED) ? TRUE : FALSE;
+    commit->no_local_history = (flags & COMMIT_FLAG_NO_LOCAL_HISTORY) ? TRUE : FALSE;
+    if (commit->encrypted)
+        commit->enc_version = enc_version;
+
+    if (read_string (&r, &commit->creator_name) < 0 ||
+        read_string (&r, &commit->desc) < 0 ||
+        read_string (&r, &commit->repo_name) < 0 ||
+        read_string (&r, &commit->repo_desc) < 0 ||
+        read_string (&r, &commit->repo_category) < 0 ||
+        read_string (&r, &commit->magic) < 0)
+        goto bad;
+    if ((flags & COMMIT_FLAG_CHUNK_POLICY) &&
+        read_string (&r, &commit->chunk_policy) < 0)
+        goto bad;
+
+    /* Same checks as for JSON commits. */
+    if (!commit->desc ||
+        (commit->enc_version >= 1 && !commit->magic) ||
+        (commit->magic && strlen(commit->magic) != 32))
+        goto bad;
+
+    return commit;
+
+bad:
+    seaf_commit_unref (commit);
+    return NULL;
+}
+
+char *
+seaf_commit_data_to_json (const char *id, const char *data, gsize len,
+                          gsize *json_len)
+{
+    SeafCommit *commit;
+    char *json;
+
+    commit = seaf_commit_from_data (id, data, len);
+    if (!commit)
+        return NULL;
+
+    json = seaf_commit_to_data (commit, json_len);
+    seaf_commit_unref (commit);
+
+    return json;
+}
+
 static SeafCommit *
 load_commit (SeafCommitManager *mgr, const char *commit_id)
 {
     char *data;
     int len;
     SeafCommit *commit = NULL;
-    JsonParser *parser;
+    JsonParser *parser = NULL;
     GError *error = NULL;
 
     if (!commit_id || strlen(commit_id) != 40)
@@ -750,6 +1286,13 @@ load_commit (SeafCommitManager *mgr, const char *commit_id)
     if (seaf_obj_store_read_obj (mgr->obj_store, commit_id, (void **)&data, &len) < 0)
         return NULL;
 
+    if (seaf_commit_data_is_binary (data, len)) {
+        commit = commit_from_binary (commit_id, data, len);
+        if (!commit)
+            g_warning ("Unable to parse commit %s.\n", commit_id);
+        goto out;
+    }
+
     parser = json_parser_new ();
     json_parser_load_from_data (parser, data, len, &error);
     if (error) {
@@ -764,11 +1307,12 @@ load_commit (SeafCommitManager *mgr, const char *commit_id)
     root = json_parser_get_root (parser);
 
     commit = commit_from_json_node (commit_id, root);
-    if (commit)
-        commit->manager = mgr;
 
 out:
-    g_object_unref (parser);
+    if (commit)
+        commit->manager = mgr;
+    if (parser)
+        g_object_unref (parser);
     g_free (data);
 
     return commit;
@@ -777,11 +1321,17 @@ out:
 static int
 save_commit (SeafCommitManager *manager, SeafCommit *commit)
 {
-    JsonGenerator *gen = json_generator_new ();
+    JsonGenerator *gen;
     JsonNode *root;
     char *data;
     gsize len;
 
+    if (manager->priv->binary_format) {
+        data = commit_to_binary (commit, &len);
+        goto write;
+    }
+
+    gen = json_generator_new ();
     root = commit_to_json_node (commit);
 
     json_generator_set_root (gen, root);
@@ -796,6 +1346,7 @@ save_commit (SeafCommitManager *manager, SeafCommit *commit)
     json_node_free (root);
     g_object_unref (gen);
 
+write:
     if (seaf_obj_store_write_obj (manager->obj_store, commit->commit_id,
                                   data, (int)len) < 0) {
         g_free (data);
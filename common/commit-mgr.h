@@ -33,6 +33,8 @@ struct _SeafCommit {
     int         enc_version;
     char       *magic;
     gboolean    no_local_history;
+    int         chunker;        /* CDC_ALGO_* used to split files */
+    char       *chunk_policy;   /* see chunker_with_policy(), may be NULL */
 };
 
 
@@ -51,12 +53,25 @@ seaf_commit_new (const char *commit_id,
                  const char *desc,
                  guint64 ctime);
 
+/* Whether the id of @commit is the hash of its content. */
+gboolean
+seaf_commit_verify_id (SeafCommit *commit);
+
 char *
 seaf_commit_to_data (SeafCommit *commit, gsize *len);
 
+/* Reads both JSON and binary commits. */
 SeafCommit *
 seaf_commit_from_data (const char *id, const char *data, gsize len);
 
+gboolean
+seaf_commit_data_is_binary (const char *data, gsize len);
+
+/* Re-encodes commit object data as JSON, for peers that only read JSON. */
+char *
+seaf_commit_data_to_json (const char *id, const char *data, gsize len,
+                          gsize *json_len);
+
 void
 seaf_commit_ref (SeafCommit *commit);
 
@@ -109,11 +124,23 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr, const char *id);
 /**
  * Find a commit object.
  * This function increments ref count of returned object.
- * Not MT safe.
+ * The commit may be shared with the commit cache, so don't modify it.
  */
 SeafCommit* 
 seaf_commit_manager_get_commit (SeafCommitManager *mgr, const char *id);
 
+typedef struct SeafCommitCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint   n_commits;
+    gsize   size;
+    gsize   capacity;
+} SeafCommitCacheStats;
+
+void
+seaf_commit_manager_get_cache_stats (SeafCommitManager *mgr,
+                                     SeafCommitCacheStats *stats);
+
 /**
  * Traverse the commits DAG start from head in topological order.
  * The ordering is based on commit time.
@@ -158,4 +185,13 @@ seaf_commit_manager_get_repo_commits (SeafCommitManager *mgr, const char *repo_i
 gboolean
 seaf_commit_manager_commit_exists (SeafCommitManager *mgr, const char *id);
 
+struct CommitGraph;
+
+/**
+ * The commit graph of a repo, see commit-graph.h. Shared by all threads
+ * and kept open. Returns NULL if it isn't available.
+ */
+struct CommitGraph *
+seaf_commit_manager_get_graph (SeafCommitManager *mgr, const char *repo_id);
+
 #endif
@@ -25,7 +25,7 @@
 #define CURRENT_ENC_VERSION 1
 
 #define DEFAULT_PROTO_VERSION 1
-#define CURRENT_PROTO_VERSION 3
+#define CURRENT_PROTO_VERSION 4
 
 #ifndef ccnet_warning
 #define ccnet_warning(fmt, ...) g_warning("%s(%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
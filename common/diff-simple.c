@@ -127,23 +127,163 @@ ce_same (struct cache_entry *ce1, struct cache_entry *ce2)
             hashcmp(ce1->sha1, ce2->sha1) == 0);
 }
 
-static int 
-twoway_diff(struct cache_entry **src, struct unpack_trees_options *o)
+/*
+ * Diff between two commits walks the two trees directly instead of
+ * going through unpack_trees(). Subtrees with the same id are skipped
+ * without being loaded, so the cost depends on the size of the change
+ * rather than the size of the repo.
+ */
+
+/* Empty dirs are treated as files, the same as in traverse_trees(). */
+static inline gboolean
+dirent_is_subtree (SeafDirent *dent)
 {
-    struct cache_entry *tree1 = src[1];
-    struct cache_entry *tree2 = src[2];
-    GList **results = o->unpack_data;
+    return S_ISDIR(dent->mode) && strcmp (dent->id, EMPTY_SHA1) != 0;
+}
+
+static void
+add_dirent_result (char status, SeafDirent *dent, const char *path,
+                   GList **results)
+{
+    unsigned char sha1[20];
+    DiffEntry *de;
+
+    hex_to_rawdata (dent->id, sha1, 20);
+    de = diff_entry_new (DIFF_TYPE_COMMITS, status, sha1, path);
+    *results = g_list_prepend (*results, de);
+}
+
+static int
+diff_trees (const char *dir_id1, const char *dir_id2,
+            const char *basedir, GList **results);
+
+/* @dent only exists in one of the trees. */
+static int
+diff_single_dirent (SeafDirent *dent, gboolean added,
+                    const char *path, GList **results)
+{
+    if (dirent_is_subtree (dent)) {
+        if (added)
+            return diff_trees (NULL, dent->id, path, results);
+        return diff_trees (dent->id, NULL, path, results);
+    }
+
+    if (S_ISDIR(dent->mode))
+        add_dirent_result (added ? DIFF_STATUS_DIR_ADDED : DIFF_STATUS_DIR_DELETED,
+                           dent, path, results);
+    else
+        add_dirent_result (added ? DIFF_STATUS_ADDED : DIFF_STATUS_DELETED,
+                           dent, path, results);
+    return 0;
+}
 
-    if (tree1 == o->df_conflict_entry)
-        tree1 = NULL;
-    if (tree2 == o->df_conflict_entry)
-        tree2 = NULL;
+static int
+diff_dirents (SeafDirent *dent1, SeafDirent *dent2,
+              const char *path, GList **results)
+{
+    if (dent1->mode == dent2->mode && strcmp (dent1->id, dent2->id) == 0)
+        return 0;
 
-    diff_two_cache_entries (tree1, tree2, DIFF_TYPE_COMMITS, results);
+    if (dirent_is_subtree (dent1) && dirent_is_subtree (dent2))
+        return diff_trees (dent1->id, dent2->id, path, results);
 
+    if (dirent_is_subtree (dent1) || dirent_is_subtree (dent2)) {
+        if (diff_single_dirent (dent1, FALSE, path, results) < 0)
+            return -1;
+        return diff_single_dirent (dent2, TRUE, path, results);
+    }
+
+    /* Same as diff_two_cache_entries(). */
+    if (S_ISDIR(dent2->mode)) {
+        add_dirent_result (DIFF_STATUS_DELETED, dent1, path, results);
+        add_dirent_result (DIFF_STATUS_DIR_ADDED, dent2, path, results);
+    } else if (S_ISDIR(dent1->mode)) {
+        add_dirent_result (DIFF_STATUS_DIR_DELETED, dent1, path, results);
+        add_dirent_result (DIFF_STATUS_ADDED, dent2, path, results);
+    } else {
+        add_dirent_result (DIFF_STATUS_MODIFIED, dent2, path, results);
+    }
     return 0;
 }
 
+static SeafDir *
+load_sorted_dir (const char *dir_id, int *error)
+{
+    SeafDir *dir;
+
+    if (!dir_id || strcmp (dir_id, EMPTY_SHA1) == 0)
+        return NULL;
+
+    dir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        seaf_warning ("Failed to get dir %s.\n", dir_id);
+        *error = -1;
+    }
+    return dir;
+}
+
+static int
+diff_trees (const char *dir_id1, const char *dir_id2,
+            const char *basedir, GList **results)
+{
+    SeafDir *dir1 = NULL, *dir2 = NULL;
+    GList *p1, *p2;
+    SeafDirent *dent1, *dent2;
+    char *path;
+    int cmp, ret = 0;
+
+    if (dir_id1 && dir_id2 && strcmp (dir_id1, dir_id2) == 0)
+        return 0;
+
+    dir1 = load_sorted_dir (dir_id1, &ret);
+    dir2 = load_sorted_dir (dir_id2, &ret);
+    if (ret < 0)
+        goto out;
+
+    p1 = dir1 ? dir1->entries : NULL;
+    p2 = dir2 ? dir2->entries : NULL;
+
+    /* Dirents are sorted in descending order of names. */
+    while (ret == 0 && (p1 || p2)) {
+        dent1 = p1 ? p1->data : NULL;
+        dent2 = p2 ? p2->data : NULL;
+
+        if (!dent1)
+            cmp = -1;
+        else if (!dent2)
+            cmp = 1;
+        else
+            cmp = strcmp (dent1->name, dent2->name);
+
+        if (basedir[0] != 0)
+            path = g_strconcat (basedir, "/", cmp >= 0 ? dent1->name : dent2->name,
+                                NULL);
+        else
+            path = g_strdup (cmp >= 0 ? dent1->name : dent2->name);
+
+        if (cmp == 0) {
+            ret = diff_dirents (dent1, dent2, path, results);
+            p1 = p1->next;
+            p2 = p2->next;
+        } else if (cmp > 0) {
+            ret = diff_single_dirent (dent1, FALSE, path, results);
+            p1 = p1->next;
+        } else {
+            ret = diff_single_dirent (dent2, TRUE, path, results);
+            p2 = p2->next;
+        }
+
+        g_free (path);
+    }
+
+out:
+    if (dir1)
+        seaf_dir_free (dir1);
+    if (dir2)
+        seaf_dir_free (dir2);
+    return ret;
+}
+
 #ifdef DEBUG
 static void
 print_results (GList *results)
@@ -160,55 +300,43 @@ print_results (GList *results)
 #endif
 
 int
-diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results)
+diff_roots (const char *root1, const char *root2, GList **results)
 {
-    struct tree_desc t[2];
-    struct unpack_trees_options opts;
-    struct index_state istate;
+    GList *ptr;
 
     g_assert (*results == NULL);
 
-    if (strcmp (commit1->commit_id, commit2->commit_id) == 0)
-        return 0;
-
-    if (strcmp (commit1->root_id, EMPTY_SHA1) != 0) {
-        fill_tree_descriptor(&t[0], commit1->root_id);
-    } else {
-        fill_tree_descriptor(&t[0], NULL);
+    if (diff_trees (root1, root2, "", results) < 0) {
+        for (ptr = *results; ptr; ptr = ptr->next)
+            diff_entry_free ((DiffEntry *)ptr->data);
+        g_list_free (*results);
+        *results = NULL;
+        return -1;
     }
 
-    if (strcmp (commit2->root_id, EMPTY_SHA1) != 0) {
-        fill_tree_descriptor(&t[1], commit2->root_id);
-    } else {
-        fill_tree_descriptor(&t[1], NULL);
-    }
+    return 0;
+}
 
-    /* Empty index */
-    memset(&istate, 0, sizeof(istate));
-    memset(&opts, 0, sizeof(opts));
+int
+diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results)
+{
+    g_assert (*results == NULL);
 
-    opts.head_idx = -1;
-    opts.index_only = 1;
-    opts.merge = 1;
-    opts.fn = twoway_diff;
-    opts.unpack_data = results;
-    opts.src_index = &istate;
-    opts.dst_index = NULL;
+    if (strcmp (commit1->commit_id, commit2->commit_id) == 0)
+        return 0;
 
-    if (unpack_trees(2, t, &opts) < 0) {
-        seaf_warning ("failed to unpack trees.\n");
+    if (diff_roots (commit1->root_id, commit2->root_id, results) < 0) {
+        seaf_warning ("failed to diff commit %s and %s.\n",
+                      commit1->commit_id, commit2->commit_id);
         return -1;
     }
 
-    if (results != NULL)
+    if (*results != NULL)
         diff_resolve_empty_dirs (results);
 
     if (*results != NULL)
         diff_resolve_renames (results);
 
-    tree_desc_free (&t[0]);
-    tree_desc_free (&t[1]);
-
     return 0;
 }
 
@@ -314,6 +442,8 @@ diff_merge (SeafCommit *merge, GList **results)
     opts.index_only = 1;
     opts.merge = 1;
     opts.fn = threeway_diff;
+    /* Nothing changed under a dir that is the same in all three. */
+    opts.skip_same_trees = 1;
     opts.unpack_data = results;
     opts.src_index = &istate;
     opts.dst_index = NULL;
@@ -333,8 +463,237 @@ diff_merge (SeafCommit *merge, GList **results)
     return 0;
 }
 
-/* This function only resolve "strict" rename, i.e. two files must be
- * exactly the same.
+/*
+ * Renames with small edits are detected by the fraction of blocks the
+ * two files share. Blocks of all deleted files are indexed by block id,
+ * then each added file only needs to be compared with the deleted files
+ * sharing at least one of its blocks.
+ */
+
+/* Minimum percentage of shared blocks to count as a rename. */
+#define RENAME_MIN_SIMILARITY   50
+/* Skip similarity detection if there are more added or deleted files. */
+#define RENAME_MAX_CANDIDATES   1000
+/* Blocks shared by more deleted files than this say nothing about
+ * which file was renamed (e.g. zero-filled blocks), ignore them.
+ */
+#define RENAME_MAX_BLOCK_OWNERS 8
+
+typedef struct RenameCandidate {
+    GList *link;                /* link in the diff results */
+    Seafile *file;
+    gboolean paired;
+    /* Used while scoring one added file. */
+    struct RenameCandidate *scored_for;
+    guint32 shared;
+} RenameCandidate;
+
+typedef struct BlockOwners {
+    int n;
+    GList *cands;
+} BlockOwners;
+
+typedef struct RenamePair {
+    int score;
+    RenameCandidate *add;
+    RenameCandidate *del;
+} RenamePair;
+
+static void
+block_owners_free (BlockOwners *owners)
+{
+    g_list_free (owners->cands);
+    g_free (owners);
+}
+
+static gint
+compare_rename_pairs (gconstpointer a, gconstpointer b)
+{
+    const RenamePair *pa = a, *pb = b;
+
+    return pb->score - pa->score;
+}
+
+static GList *
+collect_rename_candidates (GList *diff_entries, char status)
+{
+    static const unsigned char null_sha1[20] = { 0 };
+    GList *p, *cands = NULL;
+    DiffEntry *de;
+    RenameCandidate *cand;
+    Seafile *file;
+    char file_id[41];
+
+    for (p = diff_entries; p != NULL; p = p->next) {
+        de = p->data;
+        if (de->status != status || memcmp (de->sha1, null_sha1, 20) == 0)
+            continue;
+
+        rawdata_to_hex (de->sha1, file_id, 20);
+        file = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+        if (!file)
+            continue;
+        if (file->n_blocks == 0) {
+            seafile_unref (file);
+            continue;
+        }
+
+        cand = g_new0 (RenameCandidate, 1);
+        cand->link = p;
+        cand->file = file;
+        cands = g_list_prepend (cands, cand);
+    }
+
+    return cands;
+}
+
+static void
+free_rename_candidates (GList *cands)
+{
+    GList *p;
+    RenameCandidate *cand;
+
+    for (p = cands; p != NULL; p = p->next) {
+        cand = p->data;
+        seafile_unref (cand->file);
+        g_free (cand);
+    }
+    g_list_free (cands);
+}
+
+static GList *
+score_added_file (GHashTable *block_index, RenameCandidate *add, GList *pairs)
+{
+    GHashTable *seen;
+    GList *touched = NULL, *p, *q;
+    BlockOwners *owners;
+    RenameCandidate *del;
+    RenamePair *pair;
+    guint32 i, max_blocks;
+    int score;
+
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < add->file->n_blocks; ++i) {
+        char *blk_id = add->file->blk_sha1s[i];
+
+        if (g_hash_table_lookup (seen, blk_id))
+            continue;
+        g_hash_table_insert (seen, blk_id, blk_id);
+
+        owners = g_hash_table_lookup (block_index, blk_id);
+        if (!owners || owners->n > RENAME_MAX_BLOCK_OWNERS)
+            continue;
+
+        for (q = owners->cands; q != NULL; q = q->next) {
+            del = q->data;
+            if (del->scored_for != add) {
+                del->scored_for = add;
+                del->shared = 0;
+                touched = g_list_prepend (touched, del);
+            }
+            del->shared++;
+        }
+    }
+
+    for (p = touched; p != NULL; p = p->next) {
+        del = p->data;
+        max_blocks = MAX (add->file->n_blocks, del->file->n_blocks);
+        score = (int)((guint64)del->shared * 100 / max_blocks);
+        if (score < RENAME_MIN_SIMILARITY)
+            continue;
+
+        pair = g_new0 (RenamePair, 1);
+        pair->score = score;
+        pair->add = add;
+        pair->del = del;
+        pairs = g_list_prepend (pairs, pair);
+    }
+
+    g_list_free (touched);
+    g_hash_table_destroy (seen);
+    return pairs;
+}
+
+static void
+resolve_similar_renames (GList **diff_entries)
+{
+    GList *added = NULL, *deleted = NULL, *pairs = NULL;
+    GHashTable *block_index;
+    GList *p;
+    RenameCandidate *cand;
+    RenamePair *pair;
+    BlockOwners *owners;
+    DiffEntry *de_add, *de_del, *de_rename;
+    guint32 i;
+
+    deleted = collect_rename_candidates (*diff_entries, DIFF_STATUS_DELETED);
+    if (!deleted || g_list_length (deleted) > RENAME_MAX_CANDIDATES)
+        goto out;
+
+    added = collect_rename_candidates (*diff_entries, DIFF_STATUS_ADDED);
+    if (!added || g_list_length (added) > RENAME_MAX_CANDIDATES)
+        goto out;
+
+    block_index = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify)block_owners_free);
+    for (p = deleted; p != NULL; p = p->next) {
+        cand = p->data;
+        for (i = 0; i < cand->file->n_blocks; ++i) {
+            char *blk_id = cand->file->blk_sha1s[i];
+
+            owners = g_hash_table_lookup (block_index, blk_id);
+            if (!owners) {
+                owners = g_new0 (BlockOwners, 1);
+                g_hash_table_insert (block_index, blk_id, owners);
+            }
+            /* Blocks are added one file at a time, so repeated blocks of
+             * the same file are always at the head of the list.
+             */
+            if (owners->cands && owners->cands->data == cand)
+                continue;
+            owners->cands = g_list_prepend (owners->cands, cand);
+            owners->n++;
+        }
+    }
+
+    for (p = added; p != NULL; p = p->next)
+        pairs = score_added_file (block_index, p->data, pairs);
+
+    g_hash_table_destroy (block_index);
+
+    /* Pair files greedily, most similar first. */
+    pairs = g_list_sort (pairs, compare_rename_pairs);
+    for (p = pairs; p != NULL; p = p->next) {
+        pair = p->data;
+        if (pair->add->paired || pair->del->paired)
+            continue;
+        pair->add->paired = pair->del->paired = TRUE;
+
+        de_add = pair->add->link->data;
+        de_del = pair->del->link->data;
+        de_rename = diff_entry_new (de_del->type, DIFF_STATUS_RENAMED,
+                                    de_add->sha1, de_del->name);
+        de_rename->new_name = g_strdup(de_add->name);
+
+        diff_entry_free (de_add);
+        diff_entry_free (de_del);
+        *diff_entries = g_list_delete_link (*diff_entries, pair->add->link);
+        *diff_entries = g_list_delete_link (*diff_entries, pair->del->link);
+        *diff_entries = g_list_prepend (*diff_entries, de_rename);
+    }
+
+    for (p = pairs; p != NULL; p = p->next)
+        g_free (p->data);
+    g_list_free (pairs);
+
+out:
+    free_rename_candidates (added);
+    free_rename_candidates (deleted);
+}
+
+/* Exact renames (the two files are exactly the same) are resolved first,
+ * then the remaining files are paired by shared blocks.
  */
 void
 diff_resolve_renames (GList **diff_entries)
@@ -390,6 +749,8 @@ diff_resolve_renames (GList **diff_entries)
     }
 
     g_hash_table_destroy (deleted);
+
+    resolve_similar_renames (diff_entries);
 }
 
 static gboolean
@@ -54,6 +54,13 @@ diff_index (struct index_state *istate, SeafDir *root, GList **results);
 int
 diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results);
 
+/*
+ * Changes from the tree @root1 to @root2, file by file. Unlike
+ * diff_commits(), renames and empty dirs are not resolved.
+ */
+int
+diff_roots (const char *root1, const char *root2, GList **results);
+
 int
 diff_merge (SeafCommit *merge, GList **results);
 
@@ -0,0 +1,213 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "log.h"
+#include "exists-filter.h"
+
+/* About 1% false positives at 10 bits per id with 7 hashes. */
+#define BITS_PER_ID 10
+#define N_HASHES 7
+#define MIN_BITS (1 << 16)
+
+struct ExistsFilter {
+    guint32     *bits;
+    guint64     mask;           /* number of bits - 1 */
+
+    volatile gint ready;
+
+    ExistsFilterLoadFunc load;
+    void        *load_data;
+
+    guint64     n_added;
+    guint64     n_tests;
+    guint64     n_absent;
+};
+
+ExistsFilter *
+exists_filter_new (guint64 capacity)
+{
+    ExistsFilter *filter = g_new0 (ExistsFilter, 1);
+    guint64 n_bits = MIN_BITS;
+
+    while (n_bits < capacity * BITS_PER_ID)
+        n_bits <<= 1;
+
+    filter->bits = g_new0 (guint32, n_bits / 32);
+    filter->mask = n_bits - 1;
+
+    return filter;
+}
+
+ExistsFilter *
+exists_filter_new_empty (guint64 capacity)
+{
+    ExistsFilter *filter = exists_filter_new (capacity);
+
+    filter->ready = 1;
+    return filter;
+}
+
+ExistsFilter *
+exists_filter_new_from_bits (const guint32 *bits, guint64 n_bits)
+{
+    ExistsFilter *filter;
+
+    if (n_bits < 32 || (n_bits & (n_bits - 1)) != 0)
+        return NULL;
+
+    filter = g_new0 (ExistsFilter, 1);
+    filter->bits = g_memdup (bits, n_bits / 8);
+    filter->mask = n_bits - 1;
+    filter->ready = 1;
+
+    return filter;
+}
+
+void
+exists_filter_free (ExistsFilter *filter)
+{
+    if (!filter)
+        return;
+    g_free (filter->bits);
+    g_free (filter);
+}
+
+const guint32 *
+exists_filter_get_bits (ExistsFilter *filter, guint64 *n_bits)
+{
+    *n_bits = filter->mask + 1;
+    return filter->bits;
+}
+
+static guint64
+mix64 (guint64 x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * Ids are hex SHA1s. All their digits are folded into two 64-bit
+ * values, which are combined by double hashing.
+ */
+static void
+id_hashes (const char *id, guint64 *h1, guint64 *h2)
+{
+    guint64 v = 0, h = 0;
+    const char *p;
+    int n = 0;
+
+    for (p = id; *p; ++p) {
+        v = (v << 4) | (g_ascii_xdigit_value (*p) & 0xF);
+        if (++n == 16) {
+            h = mix64 (h ^ v);
+            v = 0;
+            n = 0;
+        }
+    }
+    h = mix64 (h ^ v ^ ((guint64)n << 60));
+
+    *h1 = h;
+    *h2 = mix64 (h ^ 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+void
+exists_filter_add (ExistsFilter *filter, const char *id)
+{
+    guint64 h1, h2, bit;
+    int i;
+
+    id_hashes (id, &h1, &h2);
+    for (i = 0; i < N_HASHES; ++i) {
+        bit = (h1 + i * h2) & filter->mask;
+        __sync_fetch_and_or (&filter->bits[bit >> 5], 1U << (bit & 31));
+    }
+    __sync_fetch_and_add (&filter->n_added, 1);
+}
+
+gboolean
+exists_filter_test (ExistsFilter *filter, const char *id)
+{
+    guint64 h1, h2, bit;
+    int i;
+
+    if (!g_atomic_int_get (&filter->ready))
+        return TRUE;
+
+    __sync_fetch_and_add (&filter->n_tests, 1);
+
+    id_hashes (id, &h1, &h2);
+    for (i = 0; i < N_HASHES; ++i) {
+        bit = (h1 + i * h2) & filter->mask;
+        if (!(filter->bits[bit >> 5] & (1U << (bit & 31)))) {
+            __sync_fetch_and_add (&filter->n_absent, 1);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void *
+load_thread (void *vdata)
+{
+    ExistsFilter *filter = vdata;
+    GTimeVal start, end;
+
+    g_get_current_time (&start);
+    if (filter->load (filter, filter->load_data) < 0) {
+        seaf_warning ("Failed to load exists filter, it stays disabled.\n");
+        return NULL;
+    }
+    g_get_current_time (&end);
+
+    seaf_message ("Exists filter loaded with %"G_GUINT64_FORMAT" ids"
+                  " in %ld seconds.\n",
+                  filter->n_added, (long)(end.tv_sec - start.tv_sec));
+
+    __sync_synchronize ();
+    g_atomic_int_set (&filter->ready, 1);
+    return NULL;
+}
+
+int
+exists_filter_load (ExistsFilter *filter,
+                    ExistsFilterLoadFunc load,
+                    void *user_data)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    int rc;
+
+    filter->load = load;
+    filter->load_data = user_data;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create (&tid, &attr, load_thread, filter);
+    pthread_attr_destroy (&attr);
+    if (rc != 0) {
+        seaf_warning ("Failed to start exists filter thread: %s.\n",
+                      strerror(rc));
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+exists_filter_get_stats (ExistsFilter *filter, ExistsFilterStats *stats)
+{
+    stats->ready = g_atomic_int_get (&filter->ready);
+    stats->n_bits = filter->mask + 1;
+    stats->n_added = filter->n_added;
+    stats->n_tests = filter->n_tests;
+    stats->n_absent = filter->n_absent;
+}
@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef EXISTS_FILTER_H
+#define EXISTS_FILTER_H
+
+#include <glib.h>
+
+/*
+ * An in-memory bloom filter of the ids in an object or block store, so
+ * that lookups of ids the store doesn't have can be answered without
+ * asking the backend.
+ *
+ * The filter is filled in a background thread by walking the store.
+ * Until that is finished every id tests as possibly present. Ids must be
+ * added before they are written, so the filter never misses an id
+ * written by this process. Other processes writing to the same store
+ * are not seen. Only enable it where one process does most writes, and
+ * check ids that other processes may have written without the filter.
+ * Removed ids stay in the filter, which only costs a backend lookup.
+ */
+
+typedef struct ExistsFilter ExistsFilter;
+
+/* Adds every id of the store with exists_filter_add(). */
+typedef int (*ExistsFilterLoadFunc) (ExistsFilter *filter, void *user_data);
+
+/* @capacity is the expected number of ids, for about 1% false positives. */
+ExistsFilter *
+exists_filter_new (guint64 capacity);
+
+/* Start filling the filter in a background thread. */
+int
+exists_filter_load (ExistsFilter *filter,
+                    ExistsFilterLoadFunc load,
+                    void *user_data);
+
+/*
+ * A filter filled by the caller instead of a load function. It's ready
+ * at once, so every id tests as absent until it's added.
+ */
+ExistsFilter *
+exists_filter_new_empty (guint64 capacity);
+
+/*
+ * A ready filter from the bits of another one, as returned by
+ * exists_filter_get_bits(). @n_bits must be a power of 2.
+ */
+ExistsFilter *
+exists_filter_new_from_bits (const guint32 *bits, guint64 n_bits);
+
+void
+exists_filter_free (ExistsFilter *filter);
+
+/* The bit array of @filter, in host byte order. */
+const guint32 *
+exists_filter_get_bits (ExistsFilter *filter, guint64 *n_bits);
+
+void
+exists_filter_add (ExistsFilter *filter, const char *id);
+
+/* Returns FALSE only if @id is definitely not in the store. */
+gboolean
+exists_filter_test (ExistsFilter *filter, const char *id);
+
+typedef struct ExistsFilterStats {
+    gboolean ready;
+    guint64  n_bits;
+    guint64  n_added;
+    guint64  n_tests;
+    guint64  n_absent;          /* tests answered without the backend */
+} ExistsFilterStats;
+
+void
+exists_filter_get_stats (ExistsFilter *filter, ExistsFilterStats *stats);
+
+#endif
@@ -7,9 +7,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #ifndef WIN32
     #include <arpa/inet.h>
+    #include <sys/mman.h>
+#else
+    #include <windows.h>
 #endif
 
 #include <json-glib/json-glib.h>
@@ -17,11 +21,14 @@
 #include <searpc-utils.h>
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 #include "seafile-error.h"
 #include "fs-mgr.h"
 #include "block-mgr.h"
+#include "cdc/seaf-sha1.h"
 #include "utils.h"
 #include "seaf-utils.h"
+#include "obj-id.h"
 #include "log.h"
 #include "../common/seafile-crypt.h"
 
@@ -34,9 +41,97 @@
 
 #define SEAF_TMP_EXT ".seaftmp~"
 
+/* Default memory budget of the fs object cache, in MB. */
+#define DEFAULT_FS_CACHE_SIZE 16
+#define DEFAULT_PATH_CACHE_ENTRIES 65536
+
+/* Defaults in the client's low-memory mode. */
+#define LOW_MEMORY_FS_CACHE_SIZE 4
+#define LOW_MEMORY_PATH_CACHE_ENTRIES 4096
+#define LOW_MEMORY_INDEX_WORKERS 2
+
+/*
+ * LRU cache of parsed dir and file objects. Objects are immutable, so
+ * entries never need to be invalidated, only evicted. The cache holds
+ * one reference on each cached object.
+ */
+/* Cache type of the raw data of indexed dirs, which are searched in place. */
+#define FS_CACHE_TYPE_INDEXED_DIR   100
+/* Matches both parsed and indexed dirs in fs_cache_lookup_full(). */
+#define FS_CACHE_TYPE_ANY_DIR       101
+
+typedef struct FSCacheEntry {
+    SeafObjId   obj_id;
+    int         type;           /* SEAF_METADATA_TYPE_DIR, _FILE or
+                                 * FS_CACHE_TYPE_INDEXED_DIR */
+    void        *obj;
+    gsize       size;
+} FSCacheEntry;
+
+typedef struct FSCache {
+    GHashTable      *entries;   /* binary obj id -> GList link in lru */
+    GQueue          *lru;       /* most recently used at head */
+    gsize           size;
+    gsize           capacity;
+    guint64         hits;
+    guint64         misses;
+    pthread_mutex_t lock;
+} FSCache;
+
+/*
+ * Cache of resolved paths, keyed by "<root id>/<path>". Root ids are
+ * immutable, so entries never go stale; they're only evicted when the
+ * cache is full. Every prefix of a resolved path is cached too, so paths
+ * in the same dir share the walk to it.
+ */
+typedef struct PathCacheEntry {
+    char        *key;
+    char        obj_id[41];
+    guint32     mode;
+} PathCacheEntry;
+
+typedef struct PathCache {
+    GHashTable      *entries;   /* key -> GList link in lru */
+    GQueue          *lru;       /* most recently used at head */
+    guint           capacity;   /* number of entries */
+    pthread_mutex_t lock;
+} PathCache;
+
+/*
+ * Cache of sorted listings of large dirs, keyed by "<dir id>/<sort>", so
+ * that paging through a huge dir doesn't sort it for every page. Like
+ * dirs, listings never go stale.
+ */
+#define LISTING_CACHE_ENTRIES       64
+/* Smaller dirs are cheap to sort on each call. */
+#define LISTING_CACHE_MIN_ENTRIES   1000
+
+typedef struct ListingCache {
+    GHashTable      *entries;   /* key -> SeafDirListing */
+    GQueue          *lru;       /* keys, most recently used at head */
+    pthread_mutex_t lock;
+} ListingCache;
+
 struct _SeafFSManagerPriv {
     /* GHashTable      *seafile_cache; */
     GHashTable      *bl_cache;
+    FSCache         obj_cache;
+    PathCache       path_cache;
+    ListingCache    listing_cache;
+    /* dir id -> DirStats. Dir ids are content hashes, so the stats of a
+     * dir never change. */
+    GHashTable      *dir_stats;
+    pthread_mutex_t dir_stats_lock;
+    /* The stats are also saved in the DirStats table. Server only. */
+    gboolean        dir_stats_in_db;
+    /* Save large dirs in the indexed format. Server only. */
+    gboolean        indexed_dirs;
+    /* Save huge dirs in the sharded format. Server only. */
+    gboolean        sharded_dirs;
+    /* file id -> LocalFile, files known to be in a worktree with that
+     * content. Checkouts copy them instead of reading blocks. Client only. */
+    GHashTable      *local_files;
+    pthread_mutex_t local_files_lock;
 };
 
 typedef struct SeafileOndisk {
@@ -57,15 +152,102 @@ typedef struct SeafdirOndisk {
     char    dirents[0];
 } __attribute__((gcc_struct, __packed__)) SeafdirOndisk;
 
+/*
+ * Indexed dir format. The header is followed by a table of the offsets of
+ * the dirents in the object, sorted by name, and by the dirents in the
+ * same layout and order as the plain format. A name is looked up with a
+ * binary search over the offset table, without parsing the other dirents.
+ *
+ * The marker is never a valid dirent mode, so the plain format can't be
+ * mistaken for this one. Dir ids are computed from the entries, so both
+ * formats of a dir have the same id.
+ */
+#define DIR_INDEXED_MARKER 0xFFFFFFFF
+
+/* Smaller dirs are saved in the plain format. */
+#define INDEXED_DIR_MIN_ENTRIES 64
+
+typedef struct IndexedDirOndisk {
+    guint32 type;
+    guint32 marker;
+    guint32 n_entries;
+    guint32 offsets[0];
+} __attribute__((gcc_struct, __packed__)) IndexedDirOndisk;
+
+/*
+ * Sharded dir format, for huge dirs. The entries are split into shards,
+ * each saved as a dir object of its own, and the object of the dir lists
+ * the shards with the number of entries and the last name of each. The
+ * id of a shard is computed from its entries like for any dir.
+ *
+ * The shards end at entries whose name hash has the low bits clear, so
+ * adding or removing an entry only changes the shard it falls in. Saving
+ * the dir again only writes that shard and the list of shards.
+ *
+ * Only dirs sorted by name are sharded, the shards are in the same order.
+ */
+#define DIR_SHARDED_MARKER 0xFFFFFFFE
+
+#define SHARDED_DIR_MIN_ENTRIES 4096
+/* Shards have 512 entries on average. */
+#define DIR_SHARD_BOUNDARY_MASK 0x1FF
+/* Must be less than SHARDED_DIR_MIN_ENTRIES, shards aren't sharded. */
+#define DIR_SHARD_MAX_ENTRIES 2048
+
+typedef struct ShardedDirOndisk {
+    guint32 type;
+    guint32 marker;
+    guint32 n_shards;
+    char    shards[0];
+} __attribute__((gcc_struct, __packed__)) ShardedDirOndisk;
+
+typedef struct DirShardOndisk {
+    char    id[40];
+    guint32 n_entries;
+    guint32 name_len;
+    char    last_name[0];
+} __attribute__((gcc_struct, __packed__)) DirShardOndisk;
+
+/* Raw data of an indexed or sharded dir, shared with the fs cache. */
+typedef struct IndexedDir {
+    gint        ref_count;
+    int         len;
+    uint8_t     *data;
+} IndexedDir;
+
 #ifndef SEAFILE_SERVER
 uint32_t
 calculate_chunk_size (uint64_t total_size);
+static void
+free_local_file (gpointer p);
+static void
+record_local_file (SeafFSManager *mgr,
+                   const char *file_id,
+                   const char *path,
+                   struct stat *st,
+                   const uint32_t *sizes,
+                   uint32_t n_blocks);
 static int
 write_seafile (SeafFSManager *fs_mgr,
                uint64_t file_size,
                CDCFileDescriptor *cdc);
 #endif  /* SEAFILE_SERVER */
 
+static void
+load_chunk_policy (SeafileSession *session);
+
+static void
+load_fs_cache_size (SeafFSManager *mgr);
+
+static void
+load_dir_format (SeafFSManager *mgr);
+
+static void
+load_path_cache_size (SeafFSManager *mgr);
+
+static gboolean
+is_dirents_sorted (GList *dirents);
+
 SeafFSManager *
 seaf_fs_manager_new (SeafileSession *seaf,
                      const char *seaf_dir)
@@ -81,6 +263,31 @@ seaf_fs_manager_new (SeafileSession *seaf,
     }
 
     mgr->priv = g_new0(SeafFSManagerPriv, 1);
+
+    mgr->priv->obj_cache.entries = g_hash_table_new (seaf_obj_id_hash,
+                                                     seaf_obj_id_equal);
+    mgr->priv->obj_cache.lru = g_queue_new ();
+    pthread_mutex_init (&mgr->priv->obj_cache.lock, NULL);
+
+    mgr->priv->path_cache.entries = g_hash_table_new (g_str_hash, g_str_equal);
+    mgr->priv->path_cache.lru = g_queue_new ();
+    pthread_mutex_init (&mgr->priv->path_cache.lock, NULL);
+
+    mgr->priv->listing_cache.entries =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                               (GDestroyNotify)seaf_dir_listing_unref);
+    mgr->priv->listing_cache.lru = g_queue_new ();
+    pthread_mutex_init (&mgr->priv->listing_cache.lock, NULL);
+
+    mgr->priv->dir_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+    pthread_mutex_init (&mgr->priv->dir_stats_lock, NULL);
+
+#ifndef SEAFILE_SERVER
+    mgr->priv->local_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, free_local_file);
+    pthread_mutex_init (&mgr->priv->local_files_lock, NULL);
+#endif
     
     return mgr;
 }
@@ -100,21 +307,214 @@ seaf_fs_manager_init (SeafFSManager *mgr)
     }
 #endif
 
+    load_chunk_policy (mgr->seaf);
+    load_fs_cache_size (mgr);
+    load_path_cache_size (mgr);
+    load_dir_format (mgr);
+
+#ifdef SEAFILE_SERVER
+    if (mgr->seaf->db) {
+        const char *sql = "CREATE TABLE IF NOT EXISTS DirStats ("
+            "dir_id CHAR(40) PRIMARY KEY, size BIGINT, file_count BIGINT)";
+        if (seaf_db_query (mgr->seaf->db, sql) < 0)
+            g_warning ("[fs mgr] Failed to create DirStats table.\n");
+        else
+            mgr->priv->dir_stats_in_db = TRUE;
+    }
+#endif
+
     return 0;
 }
 
 #ifndef SEAFILE_SERVER
+
+/*
+ * Local content index. Files smaller than LOCAL_FILE_MIN_SIZE aren't
+ * worth it, they're quick to rebuild from blocks.
+ */
+#define LOCAL_FILE_MIN_SIZE (1 << 16)
+#define MAX_LOCAL_FILES 100000
+
+typedef struct {
+    char        *path;
+    gint64      mtime;      /* in nanoseconds */
+    gint64      ctime;      /* in nanoseconds */
+    guint64     ino;
+    gint64      size;
+    uint32_t    *sizes;     /* plain text block sizes, may be NULL */
+    uint32_t    n_blocks;
+} LocalFile;
+
+#ifdef WIN32
+#define ST_MTIME_NSEC(st) 0
+#define ST_CTIME_NSEC(st) 0
+#elif defined __APPLE__
+#define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#define ST_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#endif
+
+#define STAT_MTIME(st) ((gint64)(st)->st_mtime * 1000000000 + ST_MTIME_NSEC(st))
+#define STAT_CTIME(st) ((gint64)(st)->st_ctime * 1000000000 + ST_CTIME_NSEC(st))
+
+static gboolean
+local_file_unchanged (const LocalFile *lf, const struct stat *st)
+{
+    return (S_ISREG(st->st_mode) &&
+            st->st_size == lf->size &&
+            STAT_MTIME(st) == lf->mtime &&
+            STAT_CTIME(st) == lf->ctime &&
+            (guint64)st->st_ino == lf->ino);
+}
+
+static void
+free_local_file (gpointer p)
+{
+    LocalFile *lf = p;
+
+    g_free (lf->path);
+    g_free (lf->sizes);
+    g_free (lf);
+}
+
+/*
+ * Record that @path has the content of @file_id. @st is the stat of
+ * @path from before its content was read, or NULL to stat it now.
+ */
+static void
+record_local_file (SeafFSManager *mgr,
+                   const char *file_id,
+                   const char *path,
+                   struct stat *st,
+                   const uint32_t *sizes,
+                   uint32_t n_blocks)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    struct stat sb;
+    LocalFile *lf;
+
+    if (!st) {
+        if (g_lstat (path, &sb) < 0)
+            return;
+        st = &sb;
+    }
+    if (!S_ISREG(st->st_mode) || st->st_size < LOCAL_FILE_MIN_SIZE)
+        return;
+
+    /* A change made in the same second may not show in the stat on file
+     * systems with coarse timestamps, so the file may not be the content
+     * read. Such files aren't recorded. */
+    if ((gint64)st->st_mtime >= (gint64)time(NULL))
+        return;
+
+    lf = g_new0 (LocalFile, 1);
+    lf->path = g_strdup (path);
+    lf->mtime = STAT_MTIME(st);
+    lf->ctime = STAT_CTIME(st);
+    lf->ino = st->st_ino;
+    lf->size = st->st_size;
+    if (sizes && n_blocks > 0) {
+        lf->sizes = g_memdup (sizes, n_blocks * sizeof(uint32_t));
+        lf->n_blocks = n_blocks;
+    }
+
+    pthread_mutex_lock (&priv->local_files_lock);
+    if (g_hash_table_size (priv->local_files) < MAX_LOCAL_FILES ||
+        g_hash_table_lookup (priv->local_files, file_id))
+        g_hash_table_replace (priv->local_files, g_strdup(file_id), lf);
+    else
+        free_local_file (lf);
+    pthread_mutex_unlock (&priv->local_files_lock);
+}
+
+/*
+ * Copy a local file with the content of @seafile to @dst_path, sharing
+ * its data if the file system can. The file must not have changed since
+ * it was recorded. Returns 0 on success, -1 if blocks have to be read.
+ */
+static int
+clone_local_file (SeafFSManager *mgr,
+                  Seafile *seafile,
+                  const char *dst_path,
+                  guint32 mode,
+                  uint32_t **sizes)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    LocalFile *lf, recorded;
+    char *src_path = NULL;
+    uint32_t *src_sizes = NULL;
+    struct stat st;
+    int ret = -1;
+
+    if (seafile->file_size < LOCAL_FILE_MIN_SIZE)
+        return -1;
+
+    pthread_mutex_lock (&priv->local_files_lock);
+    lf = g_hash_table_lookup (priv->local_files, seafile->file_id);
+    if (lf && lf->size == (gint64)seafile->file_size) {
+        src_path = g_strdup (lf->path);
+        recorded = *lf;
+        if (lf->sizes && lf->n_blocks == seafile->n_blocks)
+            src_sizes = g_memdup (lf->sizes,
+                                  lf->n_blocks * sizeof(uint32_t));
+    }
+    pthread_mutex_unlock (&priv->local_files_lock);
+
+    if (!src_path)
+        return -1;
+
+    if (g_lstat (src_path, &st) < 0 || !local_file_unchanged (&recorded, &st)) {
+        /* Changed or removed since, forget it. */
+        pthread_mutex_lock (&priv->local_files_lock);
+        lf = g_hash_table_lookup (priv->local_files, seafile->file_id);
+        if (lf && strcmp (lf->path, src_path) == 0)
+            g_hash_table_remove (priv->local_files, seafile->file_id);
+        pthread_mutex_unlock (&priv->local_files_lock);
+        goto out;
+    }
+
+    if (clone_file (dst_path, src_path, mode & ~S_IFMT) < 0) {
+        g_unlink (dst_path);
+        goto out;
+    }
+
+    if (sizes) {
+        /* Copy them with malloc(), as the caller free()s them. */
+        *sizes = NULL;
+        if (src_sizes) {
+            *sizes = malloc (seafile->n_blocks * sizeof(uint32_t));
+            memcpy (*sizes, src_sizes, seafile->n_blocks * sizeof(uint32_t));
+        }
+    }
+    ret = 0;
+
+out:
+    g_free (src_path);
+    g_free (src_sizes);
+    return ret;
+}
+
+/* Block and decryption buffers, reused for all blocks of a file. */
+typedef struct CheckoutBuffers {
+    char *blk;
+    char *dec;
+    int size;
+} CheckoutBuffers;
+
+/* Returns the number of bytes written, or -1. */
 static int
 checkout_block (const char *block_id,
                 int wfd,
-                SeafileCrypt *crypt)
+                SeafileCipher *cipher,
+                CheckoutBuffers *bufs)
 {
     SeafBlockManager *block_mgr = seaf->block_mgr;
     BlockHandle *handle;
     BlockMetadata *bmd;
-    char *dec_out = NULL;
     int dec_out_len = -1;
-    char *blk_content = NULL;
+    int written = -1;
 
     handle = seaf_block_manager_open_block (block_mgr, block_id, BLOCK_READ);
     if (!handle) {
@@ -126,87 +526,69 @@ checkout_block (const char *block_id,
     bmd = seaf_block_manager_stat_block_by_handle (block_mgr, handle);
     if (!bmd) {
         g_warning ("can't stat block %s.\n", block_id);    
-        goto checkout_blk_error;
+        goto out;
     }
 
     /* empty file, skip it */
     if (bmd->size == 0) {
-        seaf_block_manager_close_block (block_mgr, handle);
-        seaf_block_manager_block_handle_free (block_mgr, handle);
-        return 0;
+        written = 0;
+        goto out;
     }
 
-    blk_content = (char *)malloc (bmd->size * sizeof(char));
+    if (bmd->size > bufs->size) {
+        bufs->blk = g_realloc (bufs->blk, bmd->size);
+        if (cipher)
+            bufs->dec = g_realloc (bufs->dec, bmd->size);
+        bufs->size = bmd->size;
+    }
 
     /* read the block to prepare decryption */
     if (seaf_block_manager_read_block (block_mgr, handle, 
-                                       blk_content, bmd->size) != bmd->size) {
+                                       bufs->blk, bmd->size) != bmd->size) {
         g_warning ("Error when reading from block %s.\n", block_id);
-        goto checkout_blk_error;
+        goto out;
     }
     
-    if (crypt != NULL) {
+    if (cipher != NULL) {
 
         /* An encrypted block size must be a multiple of
            ENCRYPT_BLK_SIZE
         */
         if (bmd->size % ENCRYPT_BLK_SIZE != 0) {
             g_warning ("Error: An invalid encrypted block, %s \n", block_id);
-            goto checkout_blk_error;
+            goto out;
         }
         
         /* decrypt the block */
-        int ret = seafile_decrypt (&dec_out,
-                                   &dec_out_len,
-                                   blk_content,
-                                   bmd->size, 
-                                   crypt);
-
-        if (ret != 0) {
+        if (seafile_cipher_block (cipher, bufs->blk, bmd->size,
+                                  bufs->dec, &dec_out_len) < 0) {
             g_warning ("Decryt block %s failed. \n", block_id);
-            goto checkout_blk_error;
+            goto out;
         }
 
         /* write the decrypted content */
-        ret = writen (wfd, dec_out, dec_out_len);
-
-
-        if (ret !=  dec_out_len) {
+        if (writen (wfd, bufs->dec, dec_out_len) != dec_out_len) {
             g_warning ("Failed to write the decryted block %s.\n",
                        block_id);
-            goto checkout_blk_error;
+            goto out;
         }
-
-        g_free (blk_content);
-        g_free (dec_out);
+        written = dec_out_len;
         
     } else {
         /* not an encrypted block */
-        if (writen(wfd, blk_content, bmd->size) != bmd->size) {
+        if (writen(wfd, bufs->blk, bmd->size) != bmd->size) {
             g_warning ("Failed to write the decryted block %s.\n",
                        block_id);
-            goto checkout_blk_error;
+            goto out;
         }
-        g_free (blk_content);
+        written = bmd->size;
     }
 
+out:
     g_free (bmd);
     seaf_block_manager_close_block (block_mgr, handle);
     seaf_block_manager_block_handle_free (block_mgr, handle);
-    return 0;
-
-checkout_blk_error:
-    
-    if (blk_content)
-        free (blk_content);
-    if (dec_out)
-        g_free (dec_out);
-    if (bmd)
-        g_free (bmd);
-
-    seaf_block_manager_close_block (block_mgr, handle);
-    seaf_block_manager_block_handle_free (block_mgr, handle);
-    return -1;
+    return written;
 }
 
 int 
@@ -215,13 +597,19 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
                                const char *file_path,
                                guint32 mode,
                                SeafileCrypt *crypt,
-                               const char *conflict_suffix)
+                               const char *conflict_suffix,
+                               uint32_t **block_sizes,
+                               uint32_t *n_blocks)
 {
     Seafile *seafile;
     char *blk_id;
-    int wfd;
-    int i;
+    int wfd = -1;
+    int i, n;
     char *tmp_path;
+    char *conflict_path = NULL;
+    uint32_t *sizes = NULL;
+    SeafileCipher cipher;
+    CheckoutBuffers bufs = { NULL, NULL, 0 };
 
     seafile = seaf_fs_manager_get_seafile (mgr, file_id);
     if (!seafile) {
@@ -231,6 +619,11 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
 
     tmp_path = g_strconcat (file_path, SEAF_TMP_EXT, NULL);
 
+    /* Duplicated content, or the same file in another worktree. */
+    if (clone_local_file (mgr, seafile, tmp_path, mode,
+                          block_sizes ? &sizes : NULL) == 0)
+        goto rename;
+
     wfd = g_open (tmp_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY, mode & ~S_IFMT);
     if (wfd < 0) {
         g_warning ("Failed to open file %s for checkout: %s.\n", 
@@ -238,27 +631,56 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
         goto bad;
     }
 
+    if (block_sizes && seafile->n_blocks > 0)
+        sizes = malloc (seafile->n_blocks * sizeof(uint32_t));
+
+    /* Set up the key once for all blocks. */
+    if (crypt && seafile_cipher_init (&cipher, crypt, 0) < 0) {
+        g_warning ("Failed to init decrypt.\n");
+        goto bad;
+    }
+
     for (i = 0; i < seafile->n_blocks; ++i) {
         blk_id = seafile->blk_sha1s[i];
-        if (checkout_block (blk_id, wfd, crypt) < 0)
-            goto bad;
+        n = checkout_block (blk_id, wfd, crypt ? &cipher : NULL, &bufs);
+        if (n < 0)
+            break;
+        if (sizes)
+            sizes[i] = n;
     }
 
+    if (crypt)
+        seafile_cipher_cleanup (&cipher);
+    g_free (bufs.blk);
+    g_free (bufs.dec);
+    if (i < seafile->n_blocks)
+        goto bad;
+
     close (wfd);
     wfd = -1;
+
+rename:
     if (ccnet_rename (tmp_path, file_path) < 0) {
         if (conflict_suffix) {
-            char *conflict_path = gen_conflict_path (file_path,
-                                                     conflict_suffix);
+            conflict_path = gen_conflict_path (file_path, conflict_suffix);
             if (ccnet_rename (tmp_path, conflict_path) < 0) {
                 g_free (conflict_path);
                 goto bad;
             }
-            g_free (conflict_path);
         } else
             goto bad;
     }
 
+    record_local_file (mgr, seafile->file_id,
+                       conflict_path ? conflict_path : file_path, NULL,
+                       sizes, seafile->n_blocks);
+    g_free (conflict_path);
+
+    if (block_sizes) {
+        *block_sizes = sizes;
+        *n_blocks = sizes ? seafile->n_blocks : 0;
+    }
+
     g_free (tmp_path);
     seafile_unref (seafile);
     return 0;
@@ -269,6 +691,7 @@ bad:
     /* Remove the tmp file if it still exists, in case that rename fails. */
     g_unlink (tmp_path);
     g_free (tmp_path);
+    free (sizes);
     seafile_unref (seafile);
     return -1;
 }
@@ -315,6 +738,356 @@ calculate_chunk_size (uint64_t total_size)
     return 1 * MiB;
 }
 
+/*
+ * Chunking policy, from the [chunking] section of seafile.conf on the
+ * server and from the "chunking_*" config keys on the client. Every
+ * rule is off by default, since changing how a file is chunked changes
+ * its block ids.
+ *
+ * fixed_size_types: file extensions (e.g. "zip;mp4;jpg") of compressed
+ *     formats, which rarely dedup with CDC. They're split into
+ *     fixed_block_size MB blocks instead, default 4.
+ * single_block_kb: files up to this size are stored as one block.
+ * large_file_size, large_block_size: files of at least large_file_size
+ *     MB are chunked with a large_block_size MB target.
+ *
+ * The local policy only applies to new repos. It's recorded in their
+ * commits as a string, like the chunker, and every node chunks the
+ * files of a repo with the policy recorded in it. The policies in use
+ * are kept in a table, and a chunker carries the index of its policy
+ * above CHUNKER_ALGO_MASK, see chunker_with_policy().
+ */
+typedef struct ChunkPolicy {
+    GHashTable *fixed_types;    /* lower case extension -> TRUE */
+    uint32_t fixed_block_sz;
+    uint64_t single_block_max;
+    uint64_t large_file_min;
+    uint32_t large_block_sz;
+    char *str;                  /* as recorded in commits */
+} ChunkPolicy;
+
+/* Index 0 is the empty policy. */
+static GPtrArray *chunk_policies;
+static GHashTable *chunk_policy_ids;    /* policy string -> index */
+static pthread_mutex_t chunk_policies_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *local_chunk_policy_str;
+
+static char *
+get_chunking_option (SeafileSession *session, const char *key)
+{
+#ifdef SEAFILE_SERVER
+    return g_key_file_get_string (session->config, "chunking", key, NULL);
+#else
+    char *db_key = g_strconcat ("chunking_", key, NULL);
+    char *value = seafile_session_config_get_string (session, db_key);
+    g_free (db_key);
+    return value;
+#endif
+}
+
+static gint64
+parse_chunking_size (const char *key, const char *value, gint64 unit)
+{
+    gint64 n;
+
+    if (!value)
+        return 0;
+    n = g_ascii_strtoll (value, NULL, 10);
+    if (n < 0) {
+        g_warning ("Invalid chunking option %s.\n", key);
+        return 0;
+    }
+    return n * unit;
+}
+
+static gint64
+get_chunking_size (SeafileSession *session, const char *key, gint64 unit)
+{
+    char *value = get_chunking_option (session, key);
+    gint64 n = parse_chunking_size (key, value, unit);
+
+    g_free (value);
+    return n;
+}
+
+/* The fingerprint masks need a power of two target size. */
+static uint32_t
+round_block_size (gint64 size)
+{
+    uint32_t sz = 1;
+
+    if (size > BLOCK_MAX_SZ * 4)
+        size = BLOCK_MAX_SZ * 4;
+    while ((gint64)sz * 2 <= size)
+        sz *= 2;
+    return sz;
+}
+
+static void
+add_fixed_types (ChunkPolicy *policy, const char *types)
+{
+    char **exts, **p;
+
+    policy->fixed_types = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+    exts = g_strsplit_set (types, ";, ", -1);
+    for (p = exts; *p; ++p) {
+        char *ext = g_strstrip (*p);
+        if (*ext == '.')
+            ++ext;
+        if (*ext != '\0')
+            g_hash_table_insert (policy->fixed_types,
+                                 g_ascii_strdown (ext, -1),
+                                 GINT_TO_POINTER(1));
+    }
+    g_strfreev (exts);
+}
+
+static gint
+compare_strings (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/*
+ * The policy as recorded in commits: "<key>=<value>" pairs separated by
+ * spaces, in a fixed order and only for the rules that are on. Sizes are
+ * in bytes. NULL if every rule is off.
+ */
+static char *
+chunk_policy_to_string (const ChunkPolicy *policy)
+{
+    GString *buf = g_string_new (NULL);
+    GPtrArray *exts;
+    GHashTableIter iter;
+    gpointer key;
+    guint i;
+
+    if (policy->fixed_types) {
+        exts = g_ptr_array_new ();
+        g_hash_table_iter_init (&iter, policy->fixed_types);
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+            g_ptr_array_add (exts, key);
+        g_ptr_array_sort (exts, compare_strings);
+        g_string_append (buf, "fixed_types=");
+        for (i = 0; i < exts->len; ++i)
+            g_string_append_printf (buf, "%s%s", i ? "," : "",
+                                    (char *)g_ptr_array_index (exts, i));
+        g_string_append_printf (buf, " fixed_block_size=%u",
+                                policy->fixed_block_sz);
+        g_ptr_array_free (exts, TRUE);
+    }
+    if (policy->single_block_max > 0)
+        g_string_append_printf (buf, "%ssingle_block_max=%"G_GUINT64_FORMAT,
+                                buf->len ? " " : "",
+                                policy->single_block_max);
+    if (policy->large_file_min > 0)
+        g_string_append_printf (buf, "%slarge_file_min=%"G_GUINT64_FORMAT
+                                " large_block_size=%u",
+                                buf->len ? " " : "",
+                                policy->large_file_min,
+                                policy->large_block_sz);
+
+    if (buf->len == 0) {
+        g_string_free (buf, TRUE);
+        return NULL;
+    }
+    return g_string_free (buf, FALSE);
+}
+
+/* Unknown keys are skipped, sizes are checked like in the config. */
+static ChunkPolicy *
+chunk_policy_from_string (const char *str)
+{
+    ChunkPolicy *policy = g_new0 (ChunkPolicy, 1);
+    char **pairs, **p, *value;
+
+    pairs = g_strsplit (str, " ", -1);
+    for (p = pairs; *p; ++p) {
+        value = strchr (*p, '=');
+        if (!value)
+            continue;
+        *value++ = '\0';
+
+        if (strcmp (*p, "fixed_types") == 0)
+            add_fixed_types (policy, value);
+        else if (strcmp (*p, "fixed_block_size") == 0)
+            policy->fixed_block_sz =
+                round_block_size (parse_chunking_size (*p, value, 1));
+        else if (strcmp (*p, "single_block_max") == 0)
+            policy->single_block_max =
+                MIN (parse_chunking_size (*p, value, 1), BLOCK_MAX_SZ);
+        else if (strcmp (*p, "large_file_min") == 0)
+            policy->large_file_min = parse_chunking_size (*p, value, 1);
+        else if (strcmp (*p, "large_block_size") == 0)
+            policy->large_block_sz =
+                round_block_size (parse_chunking_size (*p, value, 1));
+    }
+    g_strfreev (pairs);
+
+    if (policy->fixed_types && policy->fixed_block_sz == 0)
+        policy->fixed_block_sz = round_block_size (4 << 20);
+    if (policy->large_block_sz == 0)
+        policy->large_file_min = 0;
+
+    return policy;
+}
+
+static void
+load_chunk_policy (SeafileSession *session)
+{
+    ChunkPolicy policy;
+    char *types;
+    gint64 sz;
+
+    memset (&policy, 0, sizeof(policy));
+
+    types = get_chunking_option (session, "fixed_size_types");
+    if (types) {
+        add_fixed_types (&policy, types);
+        g_free (types);
+
+        sz = get_chunking_size (session, "fixed_block_size", 1 << 20);
+        policy.fixed_block_sz = round_block_size (sz ? sz : 4 << 20);
+    }
+
+    policy.single_block_max = get_chunking_size (session,
+                                                 "single_block_kb",
+                                                 1 << 10);
+    if (policy.single_block_max > BLOCK_MAX_SZ)
+        policy.single_block_max = BLOCK_MAX_SZ;
+
+    policy.large_file_min = get_chunking_size (session,
+                                               "large_file_size",
+                                               1 << 20);
+    sz = get_chunking_size (session, "large_block_size", 1 << 20);
+    if (policy.large_file_min > 0 && sz > 0)
+        policy.large_block_sz = round_block_size (sz);
+    else
+        policy.large_file_min = 0;
+
+    local_chunk_policy_str = chunk_policy_to_string (&policy);
+    if (policy.fixed_types)
+        g_hash_table_destroy (policy.fixed_types);
+}
+
+const char *
+local_chunk_policy ()
+{
+    return local_chunk_policy_str;
+}
+
+int
+chunker_with_policy (int algo, const char *policy)
+{
+    gpointer id;
+
+    if (!policy || *policy == '\0')
+        return algo;
+
+    pthread_mutex_lock (&chunk_policies_lock);
+    if (!chunk_policies) {
+        chunk_policies = g_ptr_array_new ();
+        g_ptr_array_add (chunk_policies, g_new0 (ChunkPolicy, 1));
+        chunk_policy_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+    }
+    id = g_hash_table_lookup (chunk_policy_ids, policy);
+    if (!id) {
+        ChunkPolicy *p = chunk_policy_from_string (policy);
+
+        p->str = g_strdup (policy);
+        id = GINT_TO_POINTER (chunk_policies->len);
+        g_ptr_array_add (chunk_policies, p);
+        g_hash_table_insert (chunk_policy_ids, g_strdup (policy), id);
+    }
+    pthread_mutex_unlock (&chunk_policies_lock);
+
+    return CHUNKER_ALGO(algo) | (GPOINTER_TO_INT(id) << CHUNKER_POLICY_SHIFT);
+}
+
+/* Policies are never freed, the pointer stays valid. */
+static const ChunkPolicy *
+get_chunker_policy (int chunker)
+{
+    static const ChunkPolicy no_policy;
+    const ChunkPolicy *policy = &no_policy;
+    guint id = (guint)chunker >> CHUNKER_POLICY_SHIFT;
+
+    if (id == 0)
+        return policy;
+
+    pthread_mutex_lock (&chunk_policies_lock);
+    if (chunk_policies && id < chunk_policies->len)
+        policy = g_ptr_array_index (chunk_policies, id);
+    pthread_mutex_unlock (&chunk_policies_lock);
+
+    return policy;
+}
+
+const char *
+chunker_get_policy (int chunker)
+{
+    return get_chunker_policy (chunker)->str;
+}
+
+static gboolean
+is_fixed_size_type (const ChunkPolicy *policy, const char *file_name)
+{
+    const char *base, *dot;
+    char *ext;
+    gboolean ret;
+
+    if (!policy->fixed_types || !file_name)
+        return FALSE;
+
+    base = strrchr (file_name, '/');
+    base = base ? base + 1 : file_name;
+    dot = strrchr (base, '.');
+    if (!dot || dot[1] == '\0')
+        return FALSE;
+
+    ext = g_ascii_strdown (dot + 1, -1);
+    ret = (g_hash_table_lookup (policy->fixed_types, ext) != NULL);
+    g_free (ext);
+    return ret;
+}
+
+void
+prepare_cdc_file_descriptor (CDCFileDescriptor *cdc,
+                             const char *file_name,
+                             uint64_t file_size,
+                             int chunker)
+{
+    const ChunkPolicy *policy = get_chunker_policy (chunker);
+
+    memset (cdc, 0, sizeof(CDCFileDescriptor));
+
+    if (file_size > 0 && file_size <= policy->single_block_max) {
+        cdc->algo = CDC_ALGO_FIXED;
+        cdc->block_sz = cdc->block_min_sz = cdc->block_max_sz = file_size;
+        return;
+    }
+
+    if (is_fixed_size_type (policy, file_name)) {
+        cdc->algo = CDC_ALGO_FIXED;
+        cdc->block_sz = policy->fixed_block_sz;
+        cdc->block_min_sz = cdc->block_max_sz = cdc->block_sz;
+        return;
+    }
+
+    if (policy->large_file_min > 0 &&
+        file_size >= policy->large_file_min &&
+        policy->large_block_sz > calculate_chunk_size (file_size))
+        cdc->block_sz = policy->large_block_sz;
+    else
+        cdc->block_sz = calculate_chunk_size (file_size);
+    cdc->block_min_sz = cdc->block_sz >> 2;
+    cdc->block_max_sz = cdc->block_sz << 2;
+    cdc->algo = CHUNKER_ALGO(chunker);
+}
+
 static int
 do_write_chunk (uint8_t *checksum, const char *buf, int len)
 {
@@ -350,16 +1123,20 @@ do_write_chunk (uint8_t *checksum, const char *buf, int len)
     return 0;
 }
 
-/* write the chunk and store its checksum */
-int
-seafile_write_chunk (CDCDescriptor *chunk,
-                     SeafileCrypt *crypt,
-                     uint8_t *checksum,
-                     gboolean write_data)
+/* Compute the id of a chunk, encrypting it first if needed. */
+static int
+seafile_hash_chunk (CDCDescriptor *chunk,
+                    SeafileCrypt *crypt,
+                    uint8_t *checksum,
+                    char **out_buf,
+                    int *out_len)
 {
-    SHA_CTX ctx;
+    SeafSHA1Ctx ctx;
     int ret = 0;
 
+    *out_buf = NULL;
+    *out_len = 0;
+
     /* Encrypt before write to disk if needed, and we don't encrypt
      * empty files. */
     if (crypt != NULL && chunk->len) {
@@ -376,37 +1153,273 @@ seafile_write_chunk (CDCDescriptor *chunk,
             return -1;
         }
 
-        SHA1_Init (&ctx);
-        SHA1_Update (&ctx, encrypted_buf, enc_len);
-        SHA1_Final (checksum, &ctx);
+        seaf_sha1_init (&ctx);
+        seaf_sha1_update (&ctx, encrypted_buf, enc_len);
+        seaf_sha1_final (checksum, &ctx);
 
-        if (write_data)
-            ret = do_write_chunk (checksum, encrypted_buf, enc_len);
-        g_free (encrypted_buf);
+        *out_buf = encrypted_buf;
+        *out_len = enc_len;
     } else {
         /* not a encrypted repo, go ahead */
-        SHA1_Init (&ctx);
-        SHA1_Update (&ctx, chunk->block_buf, chunk->len);
-        SHA1_Final (checksum, &ctx);
+        seaf_sha1_init (&ctx);
+        seaf_sha1_update (&ctx, chunk->block_buf, chunk->len);
+        seaf_sha1_final (checksum, &ctx);
+    }
+
+    return 0;
+}
+
+/* write the chunk and store its checksum */
+int
+seafile_write_chunk (CDCDescriptor *chunk,
+                     SeafileCrypt *crypt,
+                     uint8_t *checksum,
+                     gboolean write_data)
+{
+    char *buf = NULL;
+    int len = 0;
+    int ret = 0;
+
+    if (seafile_hash_chunk (chunk, crypt, checksum, &buf, &len) < 0)
+        return -1;
 
-        if (write_data)
+    if (write_data) {
+        if (buf)
+            ret = do_write_chunk (checksum, buf, len);
+        else
             ret = do_write_chunk (checksum, chunk->block_buf, chunk->len);
     }
+    g_free (buf);
 
     return ret;
 }
 
-static void
-create_cdc_for_empty_file (CDCFileDescriptor *cdc)
+/* Files smaller than this are not worth spreading over several threads.
+ * Encryption costs much more than hashing, so encrypted files are spread
+ * as soon as they have more than one block. */
+#define PIPELINE_MIN_BLOCKS 4
+#define PIPELINE_MIN_BLOCKS_ENCRYPTED 1
+
+#define MAX_INDEX_WORKERS 8
+
+static int
+get_index_workers ()
 {
-    memset (cdc, 0, sizeof(CDCFileDescriptor));
-}
+    static int n_workers = 0;
+    int n;
 
-int
-seaf_fs_manager_index_blocks (SeafFSManager *mgr,
-                              const char *file_path,
-                              unsigned char sha1[],
-                              SeafileCrypt *crypt)
+    if (n_workers > 0)
+        return n_workers;
+
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo (&info);
+    n = info.dwNumberOfProcessors;
+#else
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1)
+        n = 1;
+    if (n > MAX_INDEX_WORKERS)
+        n = MAX_INDEX_WORKERS;
+#ifndef SEAFILE_SERVER
+    /* Every worker holds a block, and its encrypted copy. */
+    if (seaf->low_memory && n > LOW_MEMORY_INDEX_WORKERS)
+        n = LOW_MEMORY_INDEX_WORKERS;
+#endif
+
+    n_workers = n;
+    return n_workers;
+}
+
+static void
+create_cdc_for_empty_file (CDCFileDescriptor *cdc)
+{
+    memset (cdc, 0, sizeof(CDCFileDescriptor));
+}
+
+/*
+ * Read the content of a block, decrypted if @crypt is set.
+ * Returns a newly allocated buffer in @data.
+ */
+static int
+read_block_data (const char *block_id, SeafileCrypt *crypt,
+                 char **data, int *len)
+{
+    SeafBlockManager *block_mgr = seaf->block_mgr;
+    BlockHandle *handle;
+    BlockMetadata *bmd = NULL;
+    char *blk_content = NULL;
+    int ret = -1;
+
+    handle = seaf_block_manager_open_block (block_mgr, block_id, BLOCK_READ);
+    if (!handle)
+        return -1;
+
+    bmd = seaf_block_manager_stat_block_by_handle (block_mgr, handle);
+    if (!bmd || bmd->size <= 0)
+        goto out;
+
+    blk_content = g_malloc (bmd->size);
+    if (seaf_block_manager_read_block (block_mgr, handle,
+                                       blk_content, bmd->size) != bmd->size)
+        goto out;
+
+    if (crypt != NULL) {
+        if (bmd->size % ENCRYPT_BLK_SIZE != 0 ||
+            seafile_decrypt (data, len, blk_content, bmd->size, crypt) != 0)
+            goto out;
+        g_free (blk_content);
+    } else {
+        *data = blk_content;
+        *len = bmd->size;
+    }
+    blk_content = NULL;
+    ret = 0;
+
+out:
+    g_free (blk_content);
+    g_free (bmd);
+    seaf_block_manager_close_block (block_mgr, handle);
+    seaf_block_manager_block_handle_free (block_mgr, handle);
+    return ret;
+}
+
+/*
+ * Find the blocks at the start of @file_path that are the same as in the
+ * old version @old_file_id. Since a chunk boundary only depends on the
+ * content of the chunk, such blocks would be cut at the same offsets by
+ * chunking the whole file again. The last old block is never reused, as
+ * it may have been cut short by the end of the old file.
+ *
+ * If the sizes of the old blocks are given in @old_sizes, the file is
+ * compared by computing the id of each range like the chunker would,
+ * instead of reading the old blocks. A wrong size just fails to match.
+ *
+ * On success, @cdc is set up to resume chunking after those blocks.
+ * Returns the number of reused blocks.
+ */
+static int
+reuse_unchanged_blocks (SeafFSManager *mgr,
+                        const char *file_path,
+                        const char *file_name,
+                        const char *old_file_id,
+                        const uint32_t *old_sizes,
+                        uint32_t n_old_sizes,
+                        SeafileCrypt *crypt,
+                        int chunker,
+                        CDCFileDescriptor *cdc)
+{
+    Seafile *old;
+    CDCFileDescriptor old_cdc;
+    CDCDescriptor chunk;
+    uint8_t *ids = NULL, checksum[20];
+    uint32_t *sizes = NULL;
+    char *old_data = NULL, *buf = NULL, *enc_buf;
+    int old_len, buf_sz = 0, enc_len;
+    uint64_t offset = 0;
+    int fd = -1, i, n = 0;
+
+    old = seaf_fs_manager_get_seafile (mgr, old_file_id);
+    if (!old)
+        return 0;
+    if (old->n_blocks < 2)
+        goto out;
+
+    /* The old blocks must have been cut with the same settings. */
+    prepare_cdc_file_descriptor (&old_cdc, file_name, old->file_size, chunker);
+    if (old_cdc.block_sz != cdc->block_sz ||
+        old_cdc.block_min_sz != cdc->block_min_sz ||
+        old_cdc.block_max_sz != cdc->block_max_sz ||
+        old_cdc.algo != cdc->algo)
+        goto out;
+
+    fd = g_open (file_path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        goto out;
+
+    ids = g_new (uint8_t, (old->n_blocks - 1) * 20);
+    sizes = g_new (uint32_t, old->n_blocks - 1);
+
+    if (old_sizes && n_old_sizes != old->n_blocks)
+        old_sizes = NULL;
+
+    for (i = 0; i < old->n_blocks - 1; ++i) {
+        hex_to_rawdata (old->blk_sha1s[i], ids + i * 20, 20);
+
+        if (old_sizes) {
+            if (old_sizes[i] == 0 || old_sizes[i] > cdc->block_max_sz)
+                break;
+            old_len = old_sizes[i];
+            if (old_len > buf_sz) {
+                buf_sz = old_len;
+                buf = g_realloc (buf, buf_sz);
+            }
+            if (readn (fd, buf, old_len) != old_len)
+                break;
+
+            chunk.offset = offset;
+            chunk.len = old_len;
+            chunk.block_buf = buf;
+            if (seafile_hash_chunk (&chunk, crypt, checksum,
+                                    &enc_buf, &enc_len) < 0)
+                break;
+            g_free (enc_buf);
+            if (memcmp (checksum, ids + i * 20, 20) != 0)
+                break;
+        } else {
+            if (read_block_data (old->blk_sha1s[i], crypt,
+                                 &old_data, &old_len) < 0)
+                break;
+
+            if (old_len > buf_sz) {
+                buf_sz = old_len;
+                buf = g_realloc (buf, buf_sz);
+            }
+            if (readn (fd, buf, old_len) != old_len ||
+                memcmp (buf, old_data, old_len) != 0) {
+                g_free (old_data);
+                break;
+            }
+            g_free (old_data);
+        }
+
+        sizes[i] = old_len;
+        offset += old_len;
+        ++n;
+    }
+
+    if (n > 0) {
+        cdc->resume_offset = offset;
+        cdc->resume_sha1s = ids;
+        cdc->resume_sizes = sizes;
+        cdc->resume_block_nr = n;
+        ids = NULL;
+        sizes = NULL;
+    }
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (buf);
+    g_free (ids);
+    g_free (sizes);
+    seafile_unref (old);
+    return n;
+}
+
+static int
+index_blocks (SeafFSManager *mgr,
+              const char *file_path,
+              const char *file_name,
+              const char *old_file_id,
+              const uint32_t *old_sizes,
+              uint32_t n_old_sizes,
+              unsigned char sha1[],
+              uint32_t **block_sizes,
+              uint32_t *n_blocks,
+              SeafileCrypt *crypt,
+              int chunker)
 {
     struct stat sb;
     CDCFileDescriptor cdc;
@@ -418,34 +1431,233 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
 
     g_assert (S_ISREG(sb.st_mode));
 
+    if (!file_name)
+        file_name = file_path;
+
     if (sb.st_size == 0) {
         /* handle empty file. */
         memset (sha1, 0, 20);
         create_cdc_for_empty_file (&cdc);
     } else {
-        memset (&cdc, 0, sizeof(cdc));
-        cdc.block_sz = calculate_chunk_size (sb.st_size);
-        cdc.block_min_sz = cdc.block_sz >> 2;
-        cdc.block_max_sz = cdc.block_sz << 2;
+        prepare_cdc_file_descriptor (&cdc, file_name, sb.st_size, chunker);
         cdc.write_block = seafile_write_chunk;
+        if (sb.st_size > (gint64)cdc.block_sz *
+            (crypt ? PIPELINE_MIN_BLOCKS_ENCRYPTED : PIPELINE_MIN_BLOCKS)) {
+            cdc.n_workers = get_index_workers ();
+            cdc.hash_block = seafile_hash_chunk;
+            cdc.store_block = do_write_chunk;
+        }
+#ifdef SEAFILE_SERVER
+        /* The server only indexes its own temp files. Worktree files can
+         * be truncated by other programs while they're chunked. */
+        cdc.map_file = TRUE;
+#endif
+        if (old_file_id)
+            reuse_unchanged_blocks (mgr, file_path, file_name, old_file_id,
+                                    old_sizes, n_old_sizes,
+                                    crypt, chunker, &cdc);
         if (filename_chunk_cdc (file_path, &cdc, crypt, TRUE) < 0) {
             g_warning ("Failed to chunk file with CDC.\n");
+            g_free ((uint8_t *)cdc.resume_sha1s);
+            g_free ((uint32_t *)cdc.resume_sizes);
             return -1;
         }
+        g_free ((uint8_t *)cdc.resume_sha1s);
+        g_free ((uint32_t *)cdc.resume_sizes);
         memcpy (sha1, cdc.file_sum, 20);
     }
 
     if (write_seafile (mgr, (uint64_t)sb.st_size, &cdc) < 0) {
         g_warning ("Failed to write seafile for %s.\n", file_path);
+        free (cdc.blk_sha1s);
+        free (cdc.blk_sizes);
         return -1;
     }
 
+#ifndef SEAFILE_SERVER
+    if (sb.st_size >= LOCAL_FILE_MIN_SIZE) {
+        char file_id[41];
+        rawdata_to_hex (cdc.file_sum, file_id, 20);
+        record_local_file (mgr, file_id, file_path, &sb,
+                           cdc.blk_sizes, cdc.block_nr);
+    }
+#endif
+
     if (cdc.blk_sha1s)
         free (cdc.blk_sha1s);
 
+    if (block_sizes) {
+        *block_sizes = cdc.blk_sizes;
+        *n_blocks = cdc.block_nr;
+    } else
+        free (cdc.blk_sizes);
+
+    return 0;
+}
+
+int
+seaf_fs_manager_index_blocks (SeafFSManager *mgr,
+                              const char *file_path,
+                              const char *file_name,
+                              unsigned char sha1[],
+                              SeafileCrypt *crypt,
+                              int chunker)
+{
+    return index_blocks (mgr, file_path, file_name, NULL, NULL, 0,
+                         sha1, NULL, NULL, crypt, chunker);
+}
+
+int
+seaf_fs_manager_reindex_blocks (SeafFSManager *mgr,
+                                const char *file_path,
+                                const char *old_file_id,
+                                const uint32_t *old_block_sizes,
+                                uint32_t n_old_blocks,
+                                unsigned char sha1[],
+                                uint32_t **block_sizes,
+                                uint32_t *n_blocks,
+                                SeafileCrypt *crypt,
+                                int chunker)
+{
+    return index_blocks (mgr, file_path, NULL, old_file_id,
+                         old_block_sizes, n_old_blocks,
+                         sha1, block_sizes, n_blocks, crypt, chunker);
+}
+
+struct _SeafIndexStream {
+    SeafFSManager *mgr;
+    CDCFileDescriptor cdc;
+    CDCStream *stream;
+};
+
+SeafIndexStream *
+seaf_fs_manager_index_stream_new (SeafFSManager *mgr,
+                                  const char *file_name,
+                                  uint64_t size_hint,
+                                  SeafileCrypt *crypt,
+                                  int chunker)
+{
+    SeafIndexStream *is = g_new0 (SeafIndexStream, 1);
+
+    is->mgr = mgr;
+    prepare_cdc_file_descriptor (&is->cdc, file_name, size_hint, chunker);
+    is->cdc.write_block = seafile_write_chunk;
+    /* The size of a stream may not be known up front, so an unknown
+     * size (0) is taken to be big. */
+    if (size_hint == 0 || size_hint > (uint64_t)is->cdc.block_sz *
+        (crypt ? PIPELINE_MIN_BLOCKS_ENCRYPTED : PIPELINE_MIN_BLOCKS)) {
+        is->cdc.n_workers = get_index_workers ();
+        is->cdc.hash_block = seafile_hash_chunk;
+        is->cdc.store_block = do_write_chunk;
+    }
+
+    is->stream = cdc_stream_new (&is->cdc, crypt, TRUE);
+    if (!is->stream) {
+        g_free (is);
+        return NULL;
+    }
+
+    return is;
+}
+
+int
+seaf_fs_manager_index_stream_feed (SeafIndexStream *is,
+                                   const char *data,
+                                   int len)
+{
+    return cdc_stream_feed (is->stream, data, (uint32_t)len);
+}
+
+int
+seaf_fs_manager_index_stream_finish (SeafIndexStream *is,
+                                     unsigned char sha1[])
+{
+    CDCFileDescriptor empty;
+    uint64_t size = cdc_stream_get_size (is->stream);
+
+    if (size == 0) {
+        /* Same as indexing an empty file. */
+        memset (sha1, 0, 20);
+        create_cdc_for_empty_file (&empty);
+        return write_seafile (is->mgr, 0, &empty);
+    }
+
+    if (cdc_stream_finish (is->stream) < 0) {
+        g_warning ("Failed to chunk file with CDC.\n");
+        return -1;
+    }
+    memcpy (sha1, is->cdc.file_sum, 20);
+
+    if (write_seafile (is->mgr, size, &is->cdc) < 0) {
+        g_warning ("Failed to write seafile.\n");
+        return -1;
+    }
+
     return 0;
 }
 
+void
+seaf_fs_manager_index_stream_free (SeafIndexStream *is)
+{
+    if (!is)
+        return;
+
+    cdc_stream_free (is->stream);
+    free (is->cdc.blk_sha1s);
+    free (is->cdc.blk_sizes);
+    g_free (is);
+}
+
+#ifdef SEAFILE_SERVER
+int
+seaf_fs_manager_index_existing_blocks (SeafFSManager *mgr,
+                                       const char **blk_ids,
+                                       int n_blocks,
+                                       unsigned char sha1[])
+{
+    CDCFileDescriptor cdc;
+    SeafSHA1Ctx ctx;
+    BlockMetadata *bmd;
+    uint64_t size = 0;
+    int i, ret = 0;
+
+    memset (&cdc, 0, sizeof(cdc));
+    if (n_blocks == 0) {
+        memset (sha1, 0, 20);
+        return write_seafile (mgr, 0, &cdc);
+    }
+
+    cdc.block_nr = n_blocks;
+    cdc.blk_sha1s = g_new0 (uint8_t, n_blocks * 20);
+    seaf_sha1_init (&ctx);
+    for (i = 0; i < n_blocks; ++i) {
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr, blk_ids[i]);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s.\n", blk_ids[i]);
+            ret = -1;
+            goto out;
+        }
+        size += bmd->size;
+        g_free (bmd);
+
+        hex_to_rawdata (blk_ids[i], cdc.blk_sha1s + i * 20, 20);
+        seaf_sha1_update (&ctx, cdc.blk_sha1s + i * 20, 20);
+    }
+    /* Same as the file sum of chunking the file. */
+    seaf_sha1_final (cdc.file_sum, &ctx);
+    memcpy (sha1, cdc.file_sum, 20);
+
+    if (write_seafile (mgr, size, &cdc) < 0) {
+        seaf_warning ("Failed to write seafile.\n");
+        ret = -1;
+    }
+
+out:
+    g_free (cdc.blk_sha1s);
+    return ret;
+}
+#endif
+
 Seafile *
 seafile_from_data (const char *id, const void *data, int len)
 {
@@ -500,7 +1712,7 @@ seafile_to_data (Seafile *seafile, int *len)
 void
 seafile_ref (Seafile *seafile)
 {
-    ++seafile->ref_count;
+    g_atomic_int_inc (&seafile->ref_count);
 }
 
 static void
@@ -523,123 +1735,554 @@ seafile_unref (Seafile *seafile)
     if (!seafile)
         return;
 
-    if (--seafile->ref_count <= 0)
+    if (g_atomic_int_dec_and_test (&seafile->ref_count))
         seafile_free (seafile);
 }
 
-Seafile *
-seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id)
+/* FS object cache. */
+
+/*
+ * [fs_cache]
+ * size = <MB>
+ *
+ * on the server, fs_cache_size in the config db on the client.
+ * 0 disables the cache.
+ */
+static void
+load_fs_cache_size (SeafFSManager *mgr)
 {
-    void *data;
-    int len;
-    Seafile *seafile;
+    FSCache *cache = &mgr->priv->obj_cache;
+    char *value;
+    gint64 size = DEFAULT_FS_CACHE_SIZE;
 
-#if 0
-    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
-    if (seafile) {
-        seafile_ref (seafile);
-        return seafile;
-    }
+#ifdef SEAFILE_SERVER
+    value = g_key_file_get_string (mgr->seaf->config, "fs_cache", "size", NULL);
+#else
+    if (mgr->seaf->low_memory)
+        size = LOW_MEMORY_FS_CACHE_SIZE;
+    value = seafile_session_config_get_string (mgr->seaf, "fs_cache_size");
 #endif
-
-    if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
-        seafile = g_new0 (Seafile, 1);
-        memset (seafile->file_id, '0', 40);
-        seafile->ref_count = 1;
-        return seafile;
+    if (value) {
+        size = g_ascii_strtoll (value, NULL, 10);
+        if (size < 0) {
+            g_warning ("Invalid fs cache size %s.\n", value);
+            size = DEFAULT_FS_CACHE_SIZE;
+#ifndef SEAFILE_SERVER
+            if (mgr->seaf->low_memory)
+                size = LOW_MEMORY_FS_CACHE_SIZE;
+#endif
+        }
+        g_free (value);
     }
 
-    if (seaf_obj_store_read_obj (mgr->obj_store, file_id, &data, &len) < 0) {
-        g_warning ("[fs mgr] Failed to read file %s.\n", file_id);
-        return NULL;
-    }
+    cache->capacity = (gsize)size << 20;
+}
 
-    seafile = seafile_from_data (file_id, data, len);
-    g_free (data);
+/*
+ * [fs_cache]
+ * path_entries = <number of paths>
+ *
+ * on the server, path_cache_entries in the config db on the client.
+ * 0 disables the path cache.
+ */
+static void
+load_path_cache_size (SeafFSManager *mgr)
+{
+    PathCache *cache = &mgr->priv->path_cache;
+    char *value;
+    gint64 entries = DEFAULT_PATH_CACHE_ENTRIES;
 
-#if 0
-    /*
-     * Add to cache. Also increase ref count.
-     */
-    seafile_ref (seafile);
-    g_hash_table_insert (mgr->priv->seafile_cache, g_strdup(file_id), seafile);
+#ifdef SEAFILE_SERVER
+    value = g_key_file_get_string (mgr->seaf->config,
+                                   "fs_cache", "path_entries", NULL);
+#else
+    if (mgr->seaf->low_memory)
+        entries = LOW_MEMORY_PATH_CACHE_ENTRIES;
+    value = seafile_session_config_get_string (mgr->seaf, "path_cache_entries");
+#endif
+    if (value) {
+        entries = g_ascii_strtoll (value, NULL, 10);
+        if (entries < 0 || entries > G_MAXUINT) {
+            g_warning ("Invalid path cache size %s.\n", value);
+            entries = DEFAULT_PATH_CACHE_ENTRIES;
+#ifndef SEAFILE_SERVER
+            if (mgr->seaf->low_memory)
+                entries = LOW_MEMORY_PATH_CACHE_ENTRIES;
 #endif
+        }
+        g_free (value);
+    }
 
-    return seafile;
+    cache->capacity = (guint)entries;
 }
 
-static void compute_dir_id (SeafDir *dir, GList *entries)
+static gboolean
+path_cache_lookup (PathCache *cache, const char *key,
+                   char *obj_id, guint32 *mode)
 {
-    SHA_CTX ctx;
-    GList *p;
-    uint8_t sha1[20];
-    SeafDirent *dent;
+    GList *link;
+    PathCacheEntry *entry;
+    gboolean found = FALSE;
 
-    /* ID for empty dirs is EMPTY_SHA1. */
-    if (entries == NULL) {
-        memset (dir->dir_id, '0', 40);
-        return;
-    }
+    if (cache->capacity == 0)
+        return FALSE;
 
-    SHA1_Init (&ctx);
-    for (p = entries; p; p = p->next) {
-        dent = (SeafDirent *)p->data;
-        SHA1_Update (&ctx, dent->id, 40);
-        SHA1_Update (&ctx, dent->name, dent->name_len);
-        SHA1_Update (&ctx, &dent->mode, sizeof(dent->mode));
+    pthread_mutex_lock (&cache->lock);
+
+    link = g_hash_table_lookup (cache->entries, key);
+    if (link) {
+        entry = link->data;
+        g_queue_unlink (cache->lru, link);
+        g_queue_push_head_link (cache->lru, link);
+
+        memcpy (obj_id, entry->obj_id, 41);
+        *mode = entry->mode;
+        found = TRUE;
     }
-    SHA1_Final (sha1, &ctx);
 
-    rawdata_to_hex (sha1, dir->dir_id, 20);
+    pthread_mutex_unlock (&cache->lock);
+
+    return found;
 }
 
-SeafDir *
-seaf_dir_new (const char *id, GList *entries, gint64 ctime)
+static void
+path_cache_insert (PathCache *cache, const char *key,
+                   const char *obj_id, guint32 mode)
 {
-    SeafDir *dir;
+    GList *link;
+    PathCacheEntry *entry;
 
-    dir = g_new0(SeafDir, 1);
+    if (cache->capacity == 0)
+        return;
 
-    if (id == NULL)
-        compute_dir_id (dir, entries);
-    else {
-        memcpy(dir->dir_id, id, 40);
-        dir->dir_id[40] = '\0';
+    pthread_mutex_lock (&cache->lock);
+
+    if (g_hash_table_lookup (cache->entries, key)) {
+        pthread_mutex_unlock (&cache->lock);
+        return;
     }
 
-    dir->entries = entries;
+    entry = g_new0 (PathCacheEntry, 1);
+    entry->key = g_strdup (key);
+    memcpy (entry->obj_id, obj_id, 41);
+    entry->mode = mode;
+
+    g_queue_push_head (cache->lru, entry);
+    g_hash_table_insert (cache->entries, entry->key, cache->lru->head);
+
+    while (g_queue_get_length (cache->lru) > cache->capacity) {
+        link = g_queue_pop_tail_link (cache->lru);
+        entry = link->data;
+        g_hash_table_remove (cache->entries, entry->key);
+        g_free (entry->key);
+        g_free (entry);
+        g_list_free_1 (link);
+    }
 
-    return dir;
-} 
+    pthread_mutex_unlock (&cache->lock);
+}
 
-void 
-seaf_dir_free (SeafDir *dir)
+/*
+ * [fs]
+ * dir_format = indexed | sharded
+ *
+ * saves large dirs in the indexed format, and huge dirs in the sharded
+ * format with indexed shards. Clients only get the plain format, so this
+ * is a server option.
+ */
+static void
+load_dir_format (SeafFSManager *mgr)
 {
-    if (dir == NULL)
+#ifdef SEAFILE_SERVER
+    char *value;
+
+    value = g_key_file_get_string (mgr->seaf->config, "fs", "dir_format", NULL);
+    if (!value)
         return;
 
-    GList *ptr = dir->entries;
-    while (ptr) {
-        g_free (ptr->data);
-        ptr = ptr->next;
-    }
+    if (strcmp (value, "indexed") == 0)
+        mgr->priv->indexed_dirs = TRUE;
+    else if (strcmp (value, "sharded") == 0) {
+        mgr->priv->indexed_dirs = TRUE;
+        mgr->priv->sharded_dirs = TRUE;
+    } else if (strcmp (value, "plain") != 0)
+        g_warning ("Unknown dir format %s.\n", value);
+    g_free (value);
+#endif
+}
 
-    g_list_free (dir->entries);
-    g_free(dir);
+static gsize
+seafile_mem_size (Seafile *seafile)
+{
+    return sizeof(Seafile) + seafile->n_blocks * (sizeof(char *) + 41);
 }
 
-SeafDir *
-seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len)
+static gsize
+seafdir_mem_size (SeafDir *dir)
 {
-    SeafDir *root;
-    SeafDirent *dent;
-    const uint8_t *ptr;
-    int remain;
-    int dirent_base_size;
-    guint32 meta_type;
+    return sizeof(SeafDir) +
+        g_list_length (dir->entries) * (sizeof(SeafDirent) + sizeof(GList));
+}
 
-    ptr = data;
-    remain = len;
+static void
+indexed_dir_ref (IndexedDir *idir)
+{
+    g_atomic_int_inc (&idir->ref_count);
+}
+
+static void
+indexed_dir_unref (IndexedDir *idir)
+{
+    if (!g_atomic_int_dec_and_test (&idir->ref_count))
+        return;
+    g_free (idir->data);
+    g_free (idir);
+}
+
+static void
+fs_cache_obj_ref (int type, void *obj)
+{
+    if (type == SEAF_METADATA_TYPE_DIR)
+        seaf_dir_ref (obj);
+    else if (type == FS_CACHE_TYPE_INDEXED_DIR)
+        indexed_dir_ref (obj);
+    else
+        seafile_ref (obj);
+}
+
+static void
+fs_cache_entry_free (FSCacheEntry *entry)
+{
+    if (entry->type == SEAF_METADATA_TYPE_DIR)
+        seaf_dir_free (entry->obj);
+    else if (entry->type == FS_CACHE_TYPE_INDEXED_DIR)
+        indexed_dir_unref (entry->obj);
+    else
+        seafile_unref (entry->obj);
+    g_free (entry);
+}
+
+static gboolean
+fs_cache_type_matches (int entry_type, int type)
+{
+    if (type == FS_CACHE_TYPE_ANY_DIR)
+        return (entry_type == SEAF_METADATA_TYPE_DIR ||
+                entry_type == FS_CACHE_TYPE_INDEXED_DIR);
+    return entry_type == type;
+}
+
+/* Returns a new reference to the cached object, or NULL. The type of the
+ * object is returned in @found_type if @type is FS_CACHE_TYPE_ANY_DIR. */
+static void *
+fs_cache_lookup_full (FSCache *cache, const char *obj_id, int type,
+                      int *found_type)
+{
+    GList *link;
+    FSCacheEntry *entry;
+    SeafObjId id;
+    void *obj = NULL;
+
+    if (cache->capacity == 0 || seaf_obj_id_from_hex (&id, obj_id) < 0)
+        return NULL;
+
+    pthread_mutex_lock (&cache->lock);
+
+    link = g_hash_table_lookup (cache->entries, &id);
+    if (link && fs_cache_type_matches (((FSCacheEntry *)link->data)->type,
+                                       type)) {
+        entry = link->data;
+        g_queue_unlink (cache->lru, link);
+        g_queue_push_head_link (cache->lru, link);
+
+        obj = entry->obj;
+        fs_cache_obj_ref (entry->type, obj);
+        if (found_type)
+            *found_type = entry->type;
+        cache->hits++;
+    } else
+        cache->misses++;
+
+    pthread_mutex_unlock (&cache->lock);
+
+    return obj;
+}
+
+static void *
+fs_cache_lookup (FSCache *cache, const char *obj_id, int type)
+{
+    return fs_cache_lookup_full (cache, obj_id, type, NULL);
+}
+
+static void
+fs_cache_insert (FSCache *cache, const char *obj_id, int type,
+                 void *obj, gsize size)
+{
+    FSCacheEntry *entry;
+    GList *link;
+    SeafObjId id;
+
+    if (size > cache->capacity || seaf_obj_id_from_hex (&id, obj_id) < 0)
+        return;
+
+    pthread_mutex_lock (&cache->lock);
+
+    /* Another thread may have loaded the same object meanwhile. A parsed
+     * dir replaces the raw data of the same dir. */
+    link = g_hash_table_lookup (cache->entries, &id);
+    if (link) {
+        entry = link->data;
+        if (!(entry->type == FS_CACHE_TYPE_INDEXED_DIR &&
+              type == SEAF_METADATA_TYPE_DIR)) {
+            pthread_mutex_unlock (&cache->lock);
+            return;
+        }
+        g_hash_table_remove (cache->entries, &id);
+        g_queue_delete_link (cache->lru, link);
+        cache->size -= entry->size;
+        fs_cache_entry_free (entry);
+    }
+
+    entry = g_new0 (FSCacheEntry, 1);
+    entry->obj_id = id;
+    entry->type = type;
+    entry->obj = obj;
+    entry->size = size;
+    fs_cache_obj_ref (type, obj);
+
+    g_queue_push_head (cache->lru, entry);
+    g_hash_table_insert (cache->entries, &entry->obj_id, cache->lru->head);
+    cache->size += size;
+
+    while (cache->size > cache->capacity) {
+        link = g_queue_pop_tail_link (cache->lru);
+        entry = link->data;
+        g_hash_table_remove (cache->entries, &entry->obj_id);
+        cache->size -= entry->size;
+        fs_cache_entry_free (entry);
+        g_list_free_1 (link);
+    }
+
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, SeafFSCacheStats *stats)
+{
+    FSCache *cache = &mgr->priv->obj_cache;
+
+    pthread_mutex_lock (&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->n_objects = g_queue_get_length (cache->lru);
+    stats->size = cache->size;
+    stats->capacity = cache->capacity;
+    pthread_mutex_unlock (&cache->lock);
+}
+
+uint32_t
+seaf_fs_manager_get_type (SeafFSManager *mgr, const char *id)
+{
+    void *data;
+    int len;
+    uint32_t type;
+
+    if (seaf_obj_store_read_obj (mgr->obj_store, id, &data, &len) < 0) {
+        g_warning ("[fs mgr] Failed to read object %s.\n", id);
+        return SEAF_METADATA_TYPE_INVALID;
+    }
+
+    type = (uint32_t)seaf_metadata_type_from_data (data, len);
+    g_free (data);
+
+    return type;
+}
+
+Seafile *
+seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id)
+{
+    void *data;
+    int len;
+    Seafile *seafile;
+
+    if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
+        seafile = g_new0 (Seafile, 1);
+        memset (seafile->file_id, '0', 40);
+        seafile->ref_count = 1;
+        return seafile;
+    }
+
+    seafile = fs_cache_lookup (&mgr->priv->obj_cache, file_id,
+                               SEAF_METADATA_TYPE_FILE);
+    if (seafile)
+        return seafile;
+
+    if (seaf_obj_store_read_obj (mgr->obj_store, file_id, &data, &len) < 0) {
+        g_warning ("[fs mgr] Failed to read file %s.\n", file_id);
+        return NULL;
+    }
+
+    seafile = seafile_from_data (file_id, data, len);
+    g_free (data);
+
+    if (seafile)
+        fs_cache_insert (&mgr->priv->obj_cache, file_id,
+                         SEAF_METADATA_TYPE_FILE,
+                         seafile, seafile_mem_size (seafile));
+
+    return seafile;
+}
+
+static void compute_dir_id (SeafDir *dir, GList *entries)
+{
+    SeafSHA1Ctx ctx;
+    GList *p;
+    uint8_t sha1[20];
+    SeafDirent *dent;
+
+    /* ID for empty dirs is EMPTY_SHA1. */
+    if (entries == NULL) {
+        memset (dir->dir_id, '0', 40);
+        return;
+    }
+
+    seaf_sha1_init (&ctx);
+    for (p = entries; p; p = p->next) {
+        dent = (SeafDirent *)p->data;
+        seaf_sha1_update (&ctx, dent->id, 40);
+        seaf_sha1_update (&ctx, dent->name, dent->name_len);
+        seaf_sha1_update (&ctx, &dent->mode, sizeof(dent->mode));
+    }
+    seaf_sha1_final (sha1, &ctx);
+
+    rawdata_to_hex (sha1, dir->dir_id, 20);
+}
+
+SeafDir *
+seaf_dir_new (const char *id, GList *entries, gint64 ctime)
+{
+    SeafDir *dir;
+
+    dir = g_new0(SeafDir, 1);
+
+    if (id == NULL)
+        compute_dir_id (dir, entries);
+    else {
+        memcpy(dir->dir_id, id, 40);
+        dir->dir_id[40] = '\0';
+    }
+
+    dir->entries = entries;
+    dir->ref_count = 1;
+
+    return dir;
+} 
+
+gboolean
+seaf_dir_verify_id (SeafDir *dir)
+{
+    SeafDir tmp;
+
+    compute_dir_id (&tmp, dir->entries);
+    return memcmp (tmp.dir_id, dir->dir_id, 40) == 0;
+}
+
+gboolean
+seafile_verify_id (Seafile *seafile)
+{
+    SeafSHA1Ctx ctx;
+    uint8_t sha1[20], blk_sha1[20];
+    char file_id[41];
+    int i;
+
+    /* Same as the file sum of the chunking. Empty files have EMPTY_SHA1. */
+    if (seafile->n_blocks == 0)
+        return memcmp (seafile->file_id, EMPTY_SHA1, 40) == 0;
+
+    seaf_sha1_init (&ctx);
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        hex_to_rawdata (seafile->blk_sha1s[i], blk_sha1, 20);
+        seaf_sha1_update (&ctx, blk_sha1, 20);
+    }
+    seaf_sha1_final (sha1, &ctx);
+    rawdata_to_hex (sha1, file_id, 20);
+
+    return memcmp (file_id, seafile->file_id, 40) == 0;
+}
+
+void
+seaf_dir_ref (SeafDir *dir)
+{
+    g_atomic_int_inc (&dir->ref_count);
+}
+
+void 
+seaf_dir_free (SeafDir *dir)
+{
+    if (dir == NULL)
+        return;
+
+    if (!g_atomic_int_dec_and_test (&dir->ref_count))
+        return;
+
+    GList *ptr = dir->entries;
+    while (ptr) {
+        g_free (ptr->data);
+        ptr = ptr->next;
+    }
+
+    g_list_free (dir->entries);
+    g_free(dir);
+}
+
+gboolean
+seaf_dir_data_is_indexed (const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data;
+
+    if (len < sizeof(IndexedDirOndisk))
+        return FALSE;
+
+    return (get32bit (&ptr) == SEAF_METADATA_TYPE_DIR &&
+            get32bit (&ptr) == DIR_INDEXED_MARKER);
+}
+
+gboolean
+seaf_dir_data_is_sharded (const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data;
+
+    if (len < sizeof(ShardedDirOndisk))
+        return FALSE;
+
+    return (get32bit (&ptr) == SEAF_METADATA_TYPE_DIR &&
+            get32bit (&ptr) == DIR_SHARDED_MARKER);
+}
+
+/* Returns the number of entries, or -1 if the offset table is truncated. */
+static int
+indexed_dir_n_entries (const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + 2 * sizeof(guint32);
+    guint32 n;
+
+    n = get32bit (&ptr);
+    if (n > (len - sizeof(IndexedDirOndisk)) / sizeof(guint32))
+        return -1;
+    return (int)n;
+}
+
+SeafDir *
+seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len)
+{
+    SeafDir *root;
+    SeafDirent *dent;
+    const uint8_t *ptr;
+    int remain;
+    int dirent_base_size;
+    guint32 meta_type;
+
+    ptr = data;
+    remain = len;
 
     meta_type = get32bit (&ptr);
     remain -= 4;
@@ -648,7 +2291,25 @@ seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len)
         return NULL;
     }
 
+    if (seaf_dir_data_is_sharded (data, len)) {
+        g_warning ("Dir %s is sharded, it can only be read from the fs manager.\n",
+                   dir_id);
+        return NULL;
+    }
+
+    /* The dirents of an indexed dir follow the offset table. */
+    if (seaf_dir_data_is_indexed (data, len)) {
+        int n_entries = indexed_dir_n_entries (data, len);
+        if (n_entries < 0) {
+            g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+            return NULL;
+        }
+        ptr = data + sizeof(IndexedDirOndisk) + n_entries * sizeof(guint32);
+        remain = len - (ptr - data);
+    }
+
     root = g_new0(SeafDir, 1);
+    root->ref_count = 1;
     memcpy(root->dir_id, dir_id, 40);
     root->dir_id[40] = '\0';
 
@@ -663,6 +2324,11 @@ seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len)
         dent->name_len = get32bit (&ptr);
         remain -= dirent_base_size;
         if (remain >= dent->name_len) {
+            if (dent->name_len >= SEAF_DIR_NAME_LEN) {
+                g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+                g_free (dent);
+                goto bad;
+            }
             memcpy (dent->name, ptr, dent->name_len);
             ptr += dent->name_len;
             remain -= dent->name_len;
@@ -672,8 +2338,9 @@ seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len)
             goto bad;
         }
         
-        root->entries = g_list_append(root->entries, dent);
+        root->entries = g_list_prepend(root->entries, dent);
     }
+    root->entries = g_list_reverse (root->entries);
 
     return root;
 
@@ -682,6 +2349,147 @@ bad:
     return NULL;
 }
 
+static SeafDirView *
+dir_view_alloc (const char *dir_id, int n_entries, gsize names_size)
+{
+    SeafDirView *view;
+
+    view = g_malloc (sizeof(SeafDirView) +
+                     n_entries * sizeof(SeafDirViewEntry) + names_size);
+    memcpy (view->dir_id, dir_id, 40);
+    view->dir_id[40] = '\0';
+    view->n_entries = n_entries;
+    view->entries = (SeafDirViewEntry *)(view + 1);
+
+    return view;
+}
+
+/*
+ * Two passes over the dirents: the first checks them and sizes the
+ * allocation, the second fills it.
+ */
+SeafDirView *
+seaf_dir_view_from_data (const char *dir_id, const uint8_t *data, int len)
+{
+    SeafDirView *view;
+    SeafDirViewEntry *e;
+    const uint8_t *start, *ptr;
+    int remain, n_entries = 0, dirent_base_size = 2 * sizeof(guint32) + 40;
+    gsize names_size = 0;
+    guint32 name_len;
+    char *names;
+    int i;
+
+    if (seaf_metadata_type_from_data (data, len) != SEAF_METADATA_TYPE_DIR) {
+        g_warning ("Data does not contain a directory.\n");
+        return NULL;
+    }
+
+    if (seaf_dir_data_is_sharded (data, len)) {
+        g_warning ("Dir %s is sharded, it can only be read from the fs manager.\n",
+                   dir_id);
+        return NULL;
+    }
+
+    start = data + sizeof(guint32);
+    if (seaf_dir_data_is_indexed (data, len)) {
+        int n = indexed_dir_n_entries (data, len);
+        if (n < 0) {
+            g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+            return NULL;
+        }
+        start = data + sizeof(IndexedDirOndisk) + n * sizeof(guint32);
+    }
+
+    ptr = start;
+    remain = len - (start - data);
+    while (remain > dirent_base_size) {
+        ptr += sizeof(guint32) + 40;
+        name_len = get32bit (&ptr);
+        remain -= dirent_base_size;
+        if ((guint32)remain < name_len || name_len >= SEAF_DIR_NAME_LEN) {
+            g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+            return NULL;
+        }
+        ptr += name_len;
+        remain -= name_len;
+        names_size += name_len + 1;
+        ++n_entries;
+    }
+
+    view = dir_view_alloc (dir_id, n_entries, names_size);
+    names = (char *)(view->entries + n_entries);
+
+    ptr = start;
+    for (i = 0; i < n_entries; ++i) {
+        e = &view->entries[i];
+        e->mode = get32bit (&ptr);
+        memcpy (e->id, ptr, 40);
+        e->id[40] = '\0';
+        ptr += 40;
+        e->name_len = get32bit (&ptr);
+        memcpy (names, ptr, e->name_len);
+        names[e->name_len] = '\0';
+        e->name = names;
+        ptr += e->name_len;
+        names += e->name_len + 1;
+    }
+
+    return view;
+}
+
+static SeafDirView *
+dir_view_from_dir (SeafDir *dir)
+{
+    SeafDirView *view;
+    SeafDirViewEntry *e;
+    SeafDirent *dent;
+    gsize names_size = 0;
+    char *names;
+    GList *ptr;
+    int n_entries = 0;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        names_size += ((SeafDirent *)ptr->data)->name_len + 1;
+        ++n_entries;
+    }
+
+    view = dir_view_alloc (dir->dir_id, n_entries, names_size);
+    names = (char *)(view->entries + n_entries);
+
+    for (ptr = dir->entries, e = view->entries; ptr; ptr = ptr->next, ++e) {
+        dent = ptr->data;
+        e->mode = dent->mode;
+        memcpy (e->id, dent->id, 41);
+        e->name_len = dent->name_len;
+        memcpy (names, dent->name, dent->name_len);
+        names[dent->name_len] = '\0';
+        e->name = names;
+        names += dent->name_len + 1;
+    }
+
+    return view;
+}
+
+void
+seaf_dir_view_free (SeafDirView *view)
+{
+    g_free (view);
+}
+
+const SeafDirViewEntry *
+seaf_dir_view_lookup (SeafDirView *view, const char *name)
+{
+    int i;
+
+    for (i = 0; i < view->n_entries; ++i) {
+        if (strcmp (view->entries[i].name, name) == 0)
+            return &view->entries[i];
+    }
+
+    return NULL;
+}
+
 int
 seaf_metadata_type_from_data (const uint8_t *data, int len)
 {
@@ -715,72 +2523,624 @@ seaf_dir_to_data (SeafDir *dir, int *len)
         dir_ondisk_size += ondisk_dirent_size (de);
     }
 
-    *len = dir_ondisk_size;
-    ondisk = (SeafdirOndisk *) g_new0 (char, dir_ondisk_size);
-
-    ondisk->type = htonl (SEAF_METADATA_TYPE_DIR);
-    p = ondisk->dirents;
-    for (ptr = dirents; ptr; ptr = ptr->next) {
-        de = ptr->data;
-        de_ondisk = (DirentOndisk *) p;
+    *len = dir_ondisk_size;
+    ondisk = (SeafdirOndisk *) g_new0 (char, dir_ondisk_size);
+
+    ondisk->type = htonl (SEAF_METADATA_TYPE_DIR);
+    p = ondisk->dirents;
+    for (ptr = dirents; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        de_ondisk = (DirentOndisk *) p;
+
+        de_ondisk->mode = htonl(de->mode);
+        memcpy (de_ondisk->id, de->id, 40);
+        de_ondisk->name_len = htonl (de->name_len);
+        memcpy (de_ondisk->name, de->name, de->name_len);
+
+        p += ondisk_dirent_size (de);
+    }
+
+    return (void *)ondisk;
+}
+
+static int
+compare_names (const char *a, int a_len, const char *b, int b_len)
+{
+    int ret = memcmp (a, b, MIN(a_len, b_len));
+
+    if (ret != 0)
+        return ret;
+    return a_len - b_len;
+}
+
+static int
+compare_dirent_names (const void *a, const void *b)
+{
+    const SeafDirent *dent_a = *(SeafDirent * const *)a;
+    const SeafDirent *dent_b = *(SeafDirent * const *)b;
+
+    return compare_names (dent_a->name, dent_a->name_len,
+                          dent_b->name, dent_b->name_len);
+}
+
+static void *
+seaf_dir_to_indexed_data (SeafDir *dir, int *len)
+{
+    IndexedDirOndisk *ondisk;
+    int n_entries = g_list_length (dir->entries);
+    int size, offset, i;
+    SeafDirent **sorted;
+    GHashTable *offsets;
+    GList *ptr;
+    SeafDirent *de;
+    DirentOndisk *de_ondisk;
+
+    size = sizeof(IndexedDirOndisk) + n_entries * sizeof(guint32);
+    offsets = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        g_hash_table_insert (offsets, de, GINT_TO_POINTER(size));
+        size += ondisk_dirent_size (de);
+    }
+
+    *len = size;
+    ondisk = (IndexedDirOndisk *) g_new0 (char, size);
+    ondisk->type = htonl (SEAF_METADATA_TYPE_DIR);
+    ondisk->marker = htonl (DIR_INDEXED_MARKER);
+    ondisk->n_entries = htonl (n_entries);
+
+    offset = sizeof(IndexedDirOndisk) + n_entries * sizeof(guint32);
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        de_ondisk = (DirentOndisk *) ((char *)ondisk + offset);
+
+        de_ondisk->mode = htonl(de->mode);
+        memcpy (de_ondisk->id, de->id, 40);
+        de_ondisk->name_len = htonl (de->name_len);
+        memcpy (de_ondisk->name, de->name, de->name_len);
+
+        offset += ondisk_dirent_size (de);
+    }
+
+    sorted = g_new (SeafDirent *, n_entries);
+    for (ptr = dir->entries, i = 0; ptr; ptr = ptr->next, i++)
+        sorted[i] = ptr->data;
+    qsort (sorted, n_entries, sizeof(SeafDirent *), compare_dirent_names);
+    for (i = 0; i < n_entries; i++) {
+        offset = GPOINTER_TO_INT(g_hash_table_lookup (offsets, sorted[i]));
+        ondisk->offsets[i] = htonl (offset);
+    }
+
+    g_free (sorted);
+    g_hash_table_destroy (offsets);
+    return (void *)ondisk;
+}
+
+/*
+ * Reads the dirent at @offset of an indexed dir. Only the name is read if
+ * @dent is NULL. Returns -1 if the offset or the dirent is out of bounds.
+ */
+static int
+indexed_dir_read_dirent (const uint8_t *data, int len, guint32 offset,
+                         const char **name, guint32 *name_len,
+                         SeafDirent *dent)
+{
+    const uint8_t *ptr;
+    guint32 mode, n;
+
+    if (len < sizeof(DirentOndisk) ||
+        offset < sizeof(IndexedDirOndisk) ||
+        offset > len - sizeof(DirentOndisk))
+        return -1;
+
+    ptr = data + offset;
+    mode = get32bit (&ptr);
+    ptr += 40;
+    n = get32bit (&ptr);
+    if (n >= SEAF_DIR_NAME_LEN || n > len - offset - sizeof(DirentOndisk))
+        return -1;
+
+    *name = (const char *)ptr;
+    *name_len = n;
+
+    if (dent) {
+        dent->mode = mode;
+        memcpy (dent->id, data + offset + sizeof(guint32), 40);
+        dent->id[40] = '\0';
+        dent->name_len = n;
+        memcpy (dent->name, ptr, n);
+        dent->name[n] = '\0';
+    }
+
+    return 0;
+}
+
+/* Binary search over the offset table. Returns 1 if @name is found, 0 if
+ * not and -1 on bad data. */
+static int
+indexed_dir_lookup (const char *dir_id, const uint8_t *data, int len,
+                    const char *name, SeafDirent *dent)
+{
+    int n_entries;
+    int low, high, mid, cmp;
+    int name_len = strlen (name);
+    const uint8_t *ptr;
+    const char *mid_name;
+    guint32 mid_len;
+
+    n_entries = indexed_dir_n_entries (data, len);
+    if (n_entries < 0)
+        goto bad;
+
+    low = 0;
+    high = n_entries - 1;
+    while (low <= high) {
+        mid = low + (high - low) / 2;
+
+        ptr = data + sizeof(IndexedDirOndisk) + mid * sizeof(guint32);
+        if (indexed_dir_read_dirent (data, len, get32bit (&ptr),
+                                     &mid_name, &mid_len, NULL) < 0)
+            goto bad;
+
+        cmp = compare_names (name, name_len, mid_name, mid_len);
+        if (cmp == 0) {
+            ptr = data + sizeof(IndexedDirOndisk) + mid * sizeof(guint32);
+            indexed_dir_read_dirent (data, len, get32bit (&ptr),
+                                     &mid_name, &mid_len, dent);
+            return 1;
+        } else if (cmp < 0)
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+
+    return 0;
+
+bad:
+    g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+    return -1;
+}
+
+/*
+ * Reads the shard record at *@ptr of a sharded dir and moves @ptr past
+ * it. Returns -1 if it's out of bounds.
+ */
+static int
+sharded_dir_read_shard (const uint8_t **ptr, const uint8_t *end,
+                        char *shard_id, guint32 *n_entries,
+                        const char **last_name, guint32 *name_len)
+{
+    const uint8_t *p = *ptr;
+    guint32 n;
+
+    if (end - p < sizeof(DirShardOndisk))
+        return -1;
+
+    memcpy (shard_id, p, 40);
+    shard_id[40] = '\0';
+    p += 40;
+    *n_entries = get32bit (&p);
+    n = get32bit (&p);
+    if (n >= SEAF_DIR_NAME_LEN || n > end - p)
+        return -1;
+
+    *last_name = (const char *)p;
+    *name_len = n;
+    *ptr = p + n;
+    return 0;
+}
+
+/* The shard that would hold @name is the first one whose last name isn't
+ * greater than @name, since the shards are in descending order. */
+static int
+sharded_dir_lookup (SeafFSManager *mgr, const char *dir_id,
+                    const uint8_t *data, int len,
+                    const char *name, SeafDirent *dent)
+{
+    const uint8_t *ptr = data + 2 * sizeof(guint32);
+    const uint8_t *end = data + len;
+    guint32 n_shards, i;
+    char shard_id[41];
+    guint32 n_entries, last_len;
+    const char *last_name;
+    int name_len = strlen (name);
+
+    n_shards = get32bit (&ptr);
+    for (i = 0; i < n_shards; ++i) {
+        if (sharded_dir_read_shard (&ptr, end, shard_id, &n_entries,
+                                    &last_name, &last_len) < 0) {
+            g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+            return -1;
+        }
+
+        if (compare_names (name, name_len, last_name, last_len) >= 0)
+            return seaf_fs_manager_lookup_dirent (mgr, shard_id, name, dent);
+    }
+
+    return 0;
+}
+
+static int
+raw_dir_lookup (SeafFSManager *mgr, const char *dir_id,
+                const uint8_t *data, int len,
+                const char *name, SeafDirent *dent)
+{
+    if (seaf_dir_data_is_sharded (data, len))
+        return sharded_dir_lookup (mgr, dir_id, data, len, name, dent);
+    return indexed_dir_lookup (dir_id, data, len, name, dent);
+}
+
+static SeafDir *
+sharded_dir_load (SeafFSManager *mgr, const char *dir_id,
+                  const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + 2 * sizeof(guint32);
+    const uint8_t *end = data + len;
+    guint32 n_shards, i;
+    char shard_id[41];
+    guint32 n_entries, last_len;
+    const char *last_name;
+    SeafDir *shard;
+    GList *entries = NULL, *p;
+
+    n_shards = get32bit (&ptr);
+    for (i = 0; i < n_shards; ++i) {
+        if (sharded_dir_read_shard (&ptr, end, shard_id, &n_entries,
+                                    &last_name, &last_len) < 0) {
+            g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+            goto error;
+        }
+
+        shard = seaf_fs_manager_get_seafdir (mgr, shard_id);
+        if (!shard) {
+            g_warning ("Failed to read shard %s of dir %s.\n",
+                       shard_id, dir_id);
+            goto error;
+        }
+        if (g_list_length (shard->entries) != n_entries) {
+            g_warning ("Bad shard %s of dir %s.\n", shard_id, dir_id);
+            seaf_dir_free (shard);
+            goto error;
+        }
+
+        /* The shard may be shared with the cache. */
+        for (p = shard->entries; p; p = p->next)
+            entries = g_list_prepend (entries, seaf_dirent_dup (p->data));
+        seaf_dir_free (shard);
+    }
+
+    return seaf_dir_new (dir_id, g_list_reverse (entries), 0);
+
+error:
+    for (p = entries; p; p = p->next)
+        g_free (p->data);
+    g_list_free (entries);
+    return NULL;
+}
+
+static SeafDir *
+dir_from_object_data (SeafFSManager *mgr, const char *dir_id,
+                      const uint8_t *data, int len)
+{
+    if (seaf_dir_data_is_sharded (data, len))
+        return sharded_dir_load (mgr, dir_id, data, len);
+    return seaf_dir_from_data (dir_id, data, len);
+}
+
+void *
+seaf_fs_manager_dir_data_to_plain (SeafFSManager *mgr,
+                                   const char *dir_id,
+                                   const uint8_t *data, int len,
+                                   int *plain_len)
+{
+    SeafDir *dir;
+    void *plain;
+
+    dir = dir_from_object_data (mgr, dir_id, data, len);
+    if (!dir)
+        return NULL;
+
+    plain = seaf_dir_to_data (dir, plain_len);
+    seaf_dir_free (dir);
+    return plain;
+}
+
+static int
+write_dir_object (SeafFSManager *fs_mgr, SeafDir *dir)
+{
+    void *data;
+    int len;
+    int ret = 0;
+
+    if (fs_mgr->priv->indexed_dirs &&
+        g_list_length (dir->entries) >= INDEXED_DIR_MIN_ENTRIES)
+        data = seaf_dir_to_indexed_data (dir, &len);
+    else
+        data = seaf_dir_to_data (dir, &len);
+
+    if (seaf_obj_store_write_obj (fs_mgr->obj_store, dir->dir_id,
+                                  data, len) < 0)
+        ret = -1;
+
+    g_free (data);
+
+    return ret;
+}
+
+static guint32
+dirent_name_hash (const char *name, int len)
+{
+    guint32 hash = 2166136261U;
+    int i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; ++i) {
+        hash ^= (guint8)name[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static void
+append_u32 (GByteArray *buf, guint32 val)
+{
+    val = htonl (val);
+    g_byte_array_append (buf, (guint8 *)&val, 4);
+}
+
+/* Saves the shard of @entries, unless it exists from an earlier version
+ * of the dir, and adds it to the list of shards in @buf. */
+static int
+save_dir_shard (SeafFSManager *fs_mgr, GList *entries, int n_entries,
+                SeafDirent *last, GByteArray *buf)
+{
+    SeafDir *shard;
+    int ret = 0;
+
+    shard = seaf_dir_new (NULL, entries, 0);
+    if (!seaf_obj_store_obj_exists (fs_mgr->obj_store, shard->dir_id))
+        ret = write_dir_object (fs_mgr, shard);
+
+    g_byte_array_append (buf, (guint8 *)shard->dir_id, 40);
+    append_u32 (buf, n_entries);
+    append_u32 (buf, last->name_len);
+    g_byte_array_append (buf, (guint8 *)last->name, last->name_len);
+
+    /* The entries belong to the dir. */
+    g_free (shard);
+    return ret;
+}
+
+static int
+save_sharded_dir (SeafFSManager *fs_mgr, SeafDir *dir)
+{
+    GByteArray *buf = g_byte_array_new ();
+    GList *ptr, *shard_entries = NULL;
+    SeafDirent *dent;
+    int n_entries = 0;
+    guint32 n_shards = 0;
+    int ret = 0;
+
+    append_u32 (buf, SEAF_METADATA_TYPE_DIR);
+    append_u32 (buf, DIR_SHARDED_MARKER);
+    append_u32 (buf, 0);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        shard_entries = g_list_prepend (shard_entries, dent);
+        ++n_entries;
+
+        if (ptr->next != NULL && n_entries < DIR_SHARD_MAX_ENTRIES &&
+            (dirent_name_hash (dent->name, dent->name_len) &
+             DIR_SHARD_BOUNDARY_MASK) != 0)
+            continue;
+
+        shard_entries = g_list_reverse (shard_entries);
+        ret = save_dir_shard (fs_mgr, shard_entries, n_entries, dent, buf);
+        g_list_free (shard_entries);
+        shard_entries = NULL;
+        n_entries = 0;
+        ++n_shards;
+        if (ret < 0)
+            goto out;
+    }
+
+    n_shards = htonl (n_shards);
+    memcpy (buf->data + 2 * sizeof(guint32), &n_shards, sizeof(guint32));
+
+    if (seaf_obj_store_write_obj (fs_mgr->obj_store, dir->dir_id,
+                                  buf->data, buf->len) < 0)
+        ret = -1;
+
+out:
+    g_byte_array_free (buf, TRUE);
+    return ret;
+}
+
+int 
+seaf_dir_save (SeafFSManager *fs_mgr, SeafDir *dir)
+{
+    /* Don't need to save empty dir on disk. */
+    if (memcmp (dir->dir_id, EMPTY_SHA1, 40) == 0)
+        return 0;
+
+    if (fs_mgr->priv->sharded_dirs &&
+        g_list_length (dir->entries) >= SHARDED_DIR_MIN_ENTRIES &&
+        is_dirents_sorted (dir->entries))
+        return save_sharded_dir (fs_mgr, dir);
+
+    return write_dir_object (fs_mgr, dir);
+}
+
+SeafDir *
+seaf_fs_manager_get_seafdir (SeafFSManager *mgr, const char *dir_id)
+{
+    void *data;
+    int len;
+    SeafDir *dir;
+    void *obj;
+    int type;
+    IndexedDir *idir;
+
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
+        dir = g_new0 (SeafDir, 1);
+        memset (dir->dir_id, '0', 40);
+        dir->ref_count = 1;
+        return dir;
+    }
+
+    obj = fs_cache_lookup_full (&mgr->priv->obj_cache, dir_id,
+                                FS_CACHE_TYPE_ANY_DIR, &type);
+    if (obj && type == SEAF_METADATA_TYPE_DIR)
+        return obj;
 
-        de_ondisk->mode = htonl(de->mode);
-        memcpy (de_ondisk->id, de->id, 40);
-        de_ondisk->name_len = htonl (de->name_len);
-        memcpy (de_ondisk->name, de->name, de->name_len);
+    if (obj) {
+        /* Only the raw data was cached by a lookup, parse it. */
+        idir = obj;
+        dir = dir_from_object_data (mgr, dir_id, idir->data, idir->len);
+        indexed_dir_unref (idir);
+    } else {
+        if (seaf_obj_store_read_obj (mgr->obj_store, dir_id,
+                                     &data, &len) < 0) {
+            g_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
+            return NULL;
+        }
 
-        p += ondisk_dirent_size (de);
+        dir = dir_from_object_data (mgr, dir_id, data, len);
+        g_free (data);
     }
 
-    return (void *)ondisk;
+    if (dir)
+        fs_cache_insert (&mgr->priv->obj_cache, dir_id,
+                         SEAF_METADATA_TYPE_DIR,
+                         dir, seafdir_mem_size (dir));
+
+    return dir;
 }
 
-int 
-seaf_dir_save (SeafFSManager *fs_mgr, SeafDir *dir)
+SeafDirView *
+seaf_fs_manager_get_dir_view (SeafFSManager *mgr, const char *dir_id)
 {
     void *data;
     int len;
-    int ret = 0;
-
-    /* Don't need to save empty dir on disk. */
-    if (memcmp (dir->dir_id, EMPTY_SHA1, 40) == 0)
-        return 0;
+    SeafDir *dir;
+    SeafDirView *view;
+    void *obj;
+    int type;
+    IndexedDir *idir;
+
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0)
+        return dir_view_alloc (EMPTY_SHA1, 0, 0);
+
+    obj = fs_cache_lookup_full (&mgr->priv->obj_cache, dir_id,
+                                FS_CACHE_TYPE_ANY_DIR, &type);
+    if (obj && type == SEAF_METADATA_TYPE_DIR) {
+        view = dir_view_from_dir (obj);
+        seaf_dir_free (obj);
+        return view;
+    }
 
-    data = seaf_dir_to_data (dir, &len);
+    if (obj) {
+        idir = obj;
+        data = g_memdup (idir->data, idir->len);
+        len = idir->len;
+        indexed_dir_unref (idir);
+    } else if (seaf_obj_store_read_obj (mgr->obj_store, dir_id,
+                                        &data, &len) < 0) {
+        g_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
+        return NULL;
+    }
 
-    if (seaf_obj_store_write_obj (fs_mgr->obj_store, dir->dir_id,
-                                  data, len) < 0)
-        ret = -1;
+    if (seaf_dir_data_is_sharded (data, len)) {
+        dir = sharded_dir_load (mgr, dir_id, data, len);
+        view = dir ? dir_view_from_dir (dir) : NULL;
+        seaf_dir_free (dir);
+    } else
+        view = seaf_dir_view_from_data (dir_id, data, len);
 
     g_free (data);
+    return view;
+}
 
-    return ret;
+static int
+seaf_dir_find_dirent (SeafDir *dir, const char *name, SeafDirent *dent)
+{
+    GList *ptr;
+    SeafDirent *d;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        d = ptr->data;
+        if (strcmp (d->name, name) == 0) {
+            *dent = *d;
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
-SeafDir *
-seaf_fs_manager_get_seafdir (SeafFSManager *mgr, const char *dir_id)
+int
+seaf_fs_manager_lookup_dirent (SeafFSManager *mgr,
+                               const char *dir_id,
+                               const char *name,
+                               SeafDirent *dent)
 {
+    FSCache *cache = &mgr->priv->obj_cache;
     void *data;
     int len;
+    void *obj;
+    int type;
     SeafDir *dir;
+    IndexedDir *idir;
+    int ret;
 
-    /* TODO: add hash cache */
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0)
+        return 0;
 
-    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
-        dir = g_new0 (SeafDir, 1);
-        memset (dir->dir_id, '0', 40);
-        return dir;
+    obj = fs_cache_lookup_full (cache, dir_id, FS_CACHE_TYPE_ANY_DIR, &type);
+    if (obj && type == SEAF_METADATA_TYPE_DIR) {
+        ret = seaf_dir_find_dirent (obj, name, dent);
+        seaf_dir_free (obj);
+        return ret;
+    } else if (obj) {
+        idir = obj;
+        ret = raw_dir_lookup (mgr, dir_id, idir->data, idir->len, name, dent);
+        indexed_dir_unref (idir);
+        return ret;
     }
 
     if (seaf_obj_store_read_obj (mgr->obj_store, dir_id, &data, &len) < 0) {
         g_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
-        return NULL;
+        return -1;
+    }
+
+    /* Indexed and sharded dirs are searched in place and cached unparsed. */
+    if (seaf_dir_data_is_indexed (data, len) ||
+        seaf_dir_data_is_sharded (data, len)) {
+        idir = g_new0 (IndexedDir, 1);
+        idir->ref_count = 1;
+        idir->data = data;
+        idir->len = len;
+
+        ret = raw_dir_lookup (mgr, dir_id, data, len, name, dent);
+        if (ret >= 0)
+            fs_cache_insert (cache, dir_id, FS_CACHE_TYPE_INDEXED_DIR,
+                             idir, sizeof(IndexedDir) + len);
+        indexed_dir_unref (idir);
+        return ret;
     }
 
     dir = seaf_dir_from_data (dir_id, data, len);
     g_free (data);
+    if (!dir)
+        return -1;
 
-    return dir;
+    fs_cache_insert (cache, dir_id, SEAF_METADATA_TYPE_DIR,
+                     dir, seafdir_mem_size (dir));
+    ret = seaf_dir_find_dirent (dir, name, dent);
+    seaf_dir_free (dir);
+    return ret;
 }
 
 static gint
@@ -818,11 +3178,97 @@ SeafDir *
 seaf_fs_manager_get_seafdir_sorted (SeafFSManager *mgr, const char *dir_id)
 {
     SeafDir *dir = seaf_fs_manager_get_seafdir(mgr, dir_id);
+    SeafDir *sorted;
+    GList *entries = NULL, *ptr;
 
-    if (!is_dirents_sorted (dir->entries))
-        dir->entries = g_list_sort (dir->entries, compare_dirents);
+    if (!dir || is_dirents_sorted (dir->entries))
+        return dir;
 
-    return dir;
+    /* The dir may be shared with the cache, sort a copy. */
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        entries = g_list_prepend (entries, seaf_dirent_dup (ptr->data));
+    entries = g_list_sort (entries, compare_dirents);
+
+    sorted = seaf_dir_new (dir->dir_id, entries, 0);
+    seaf_dir_free (dir);
+
+    return sorted;
+}
+
+GPtrArray *
+seaf_dirent_array_new (const GList *sorted_entries)
+{
+    GPtrArray *array = g_ptr_array_new ();
+    const GList *ptr;
+
+    for (ptr = sorted_entries; ptr; ptr = ptr->next)
+        g_ptr_array_add (array, ptr->data);
+    return array;
+}
+
+int
+seaf_dirent_array_find (GPtrArray *array, const char *name, guint *pos)
+{
+    guint lo = 0, hi = array->len, mid;
+    SeafDirent *dent;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        dent = g_ptr_array_index (array, mid);
+        cmp = strcmp (name, dent->name);
+        if (cmp == 0) {
+            lo = mid;
+            break;
+        }
+        /* Descending order: greater names come first. */
+        if (cmp > 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    if (pos)
+        *pos = lo;
+    if (lo < array->len &&
+        strcmp (((SeafDirent *)g_ptr_array_index (array, lo))->name, name) == 0)
+        return (int)lo;
+    return -1;
+}
+
+void
+seaf_dirent_array_insert_sorted (GPtrArray *array, SeafDirent *dent)
+{
+    guint pos;
+
+    seaf_dirent_array_find (array, dent->name, &pos);
+
+    /* g_ptr_array_insert() needs GLib 2.40. */
+    g_ptr_array_add (array, NULL);
+    memmove (&array->pdata[pos + 1], &array->pdata[pos],
+             (array->len - 1 - pos) * sizeof(gpointer));
+    array->pdata[pos] = dent;
+}
+
+SeafDirent *
+seaf_dirent_array_remove (GPtrArray *array, const char *name)
+{
+    int i = seaf_dirent_array_find (array, name, NULL);
+
+    if (i < 0)
+        return NULL;
+    return g_ptr_array_remove_index (array, (guint)i);
+}
+
+GList *
+seaf_dirent_array_to_list (GPtrArray *array)
+{
+    GList *list = NULL;
+    guint i;
+
+    for (i = array->len; i > 0; --i)
+        list = g_list_prepend (list, g_ptr_array_index (array, i - 1));
+    return list;
 }
 
 SeafDirent *
@@ -846,28 +3292,231 @@ seaf_dirent_dup (SeafDirent *dent)
     return g_memdup (dent, sizeof(SeafDirent));
 }
 
-BlockList *
-block_list_new ()
+#define BLOCK_ID_LEN 20
+
+/* Id arrays at least this big are spilled in low-memory mode. */
+#define SPILL_MIN_BYTES (4 << 20)
+
+#define BLOCK_ID_AT(array, i) \
+    ((array)->data + (gsize)(i) * BLOCK_ID_LEN)
+
+static void
+id_array_free_data (BlockIdArray *a)
+{
+#if !defined(SEAFILE_SERVER) && !defined(WIN32)
+    if (a->mapped)
+        munmap (a->data, (gsize)a->alloc * BLOCK_ID_LEN);
+    else
+#endif
+        g_free (a->data);
+    memset (a, 0, sizeof(*a));
+}
+
+#if !defined(SEAFILE_SERVER) && !defined(WIN32)
+/* Returns a shared mapping of a new, already unlinked temp file. */
+static unsigned char *
+map_spill_file (gsize size)
 {
-    BlockList *bl = g_new0 (BlockList, 1);
+    char *path;
+    void *p;
+    int fd;
+
+    path = g_build_filename (seaf->tmp_file_dir, "blocklist-XXXXXX", NULL);
+    fd = g_mkstemp (path);
+    if (fd < 0) {
+        g_warning ("Failed to create %s: %s.\n", path, strerror(errno));
+        g_free (path);
+        return NULL;
+    }
+    g_unlink (path);
+    g_free (path);
 
-    bl->block_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-    bl->block_ids = g_ptr_array_new_with_free_func (g_free);
+    if (ftruncate (fd, size) < 0) {
+        g_warning ("Failed to resize block list file: %s.\n", strerror(errno));
+        close (fd);
+        return NULL;
+    }
 
-    return bl;
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED) {
+        g_warning ("Failed to map block list file: %s.\n", strerror(errno));
+        return NULL;
+    }
+    return p;
+}
+#endif
+
+/* Make room for @n ids in total. */
+static void
+id_array_reserve (BlockIdArray *a, guint n)
+{
+    unsigned char *data = NULL;
+    gboolean mapped = FALSE;
+    guint alloc, len;
+
+    if (n <= a->alloc)
+        return;
+
+    alloc = MAX (n, MAX (a->alloc * 2, 64));
+
+#if !defined(SEAFILE_SERVER) && !defined(WIN32)
+    if (seaf->low_memory && (gsize)alloc * BLOCK_ID_LEN >= SPILL_MIN_BYTES) {
+        data = map_spill_file ((gsize)alloc * BLOCK_ID_LEN);
+        mapped = (data != NULL);
+    }
+#endif
+
+    if (!data) {
+        if (!a->mapped) {
+            a->data = g_realloc (a->data, (gsize)alloc * BLOCK_ID_LEN);
+            a->alloc = alloc;
+            return;
+        }
+        data = g_malloc ((gsize)alloc * BLOCK_ID_LEN);
+    }
+
+    len = a->len;
+    if (len > 0)
+        memcpy (data, a->data, (gsize)len * BLOCK_ID_LEN);
+    id_array_free_data (a);
+    a->data = data;
+    a->len = len;
+    a->alloc = alloc;
+    a->mapped = mapped;
+}
+
+static void
+id_array_append (BlockIdArray *a, const unsigned char *ids, guint n)
+{
+    id_array_reserve (a, a->len + n);
+    memcpy (BLOCK_ID_AT(a, a->len), ids, (gsize)n * BLOCK_ID_LEN);
+    a->len += n;
+}
+
+BlockList *
+block_list_new ()
+{
+    return g_new0 (BlockList, 1);
 }
 
 void
 block_list_free (BlockList *bl)
 {
-    if (bl->block_hash)
-        g_hash_table_destroy (bl->block_hash);
-    g_ptr_array_free (bl->block_ids, TRUE);
+    id_array_free_data (&bl->block_ids);
     if (bl->block_map.bits != NULL)
         BitfieldDestruct (&bl->block_map);
     g_free (bl);
 }
 
+static int
+compare_block_ids (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, BLOCK_ID_LEN);
+}
+
+/* Sort @ids[start..] in place and drop duplicates, return the new length. */
+static guint
+sort_unique_ids (BlockIdArray *ids, guint start)
+{
+    guint i, n;
+
+    if (ids->len - start < 2)
+        return ids->len;
+
+    qsort (BLOCK_ID_AT(ids, start), ids->len - start, BLOCK_ID_LEN,
+           compare_block_ids);
+
+    n = start + 1;
+    for (i = start + 1; i < ids->len; ++i) {
+        if (memcmp (BLOCK_ID_AT(ids, i), BLOCK_ID_AT(ids, n - 1),
+                    BLOCK_ID_LEN) == 0)
+            continue;
+        if (i != n)
+            memcpy (BLOCK_ID_AT(ids, n), BLOCK_ID_AT(ids, i), BLOCK_ID_LEN);
+        ++n;
+    }
+    return n;
+}
+
+void
+block_list_sort (BlockList *bl)
+{
+    BlockIdArray *ids = &bl->block_ids, merged;
+    guint i, j;
+    int cmp;
+
+    if (bl->n_sorted == ids->len)
+        goto out;
+
+    ids->len = sort_unique_ids (ids, bl->n_sorted);
+
+    if (bl->n_sorted == 0)
+        goto out;
+
+    /* Merge the sorted tail into the sorted head. */
+    memset (&merged, 0, sizeof(merged));
+    id_array_reserve (&merged, ids->len);
+    for (i = 0, j = bl->n_sorted; i < bl->n_sorted || j < ids->len; ) {
+        if (i == bl->n_sorted)
+            cmp = 1;
+        else if (j == ids->len)
+            cmp = -1;
+        else
+            cmp = memcmp (BLOCK_ID_AT(ids, i), BLOCK_ID_AT(ids, j),
+                          BLOCK_ID_LEN);
+
+        if (cmp <= 0) {
+            id_array_append (&merged, BLOCK_ID_AT(ids, i), 1);
+            ++i;
+            if (cmp == 0)
+                ++j;
+        } else {
+            id_array_append (&merged, BLOCK_ID_AT(ids, j), 1);
+            ++j;
+        }
+    }
+
+    id_array_free_data (ids);
+    *ids = merged;
+
+out:
+    bl->n_sorted = bl->block_ids.len;
+    bl->n_blocks = bl->block_ids.len;
+}
+
+void
+block_list_get_id (BlockList *bl, int i, char *block_id)
+{
+    rawdata_to_hex (BLOCK_ID_AT(&bl->block_ids, i), block_id, BLOCK_ID_LEN);
+}
+
+int
+block_list_find (BlockList *bl, const char *block_id)
+{
+    unsigned char sha1[BLOCK_ID_LEN];
+    guint lo = 0, hi = bl->n_sorted, mid;
+    int cmp;
+
+    if (hex_to_rawdata (block_id, sha1, BLOCK_ID_LEN) < 0)
+        return -1;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = memcmp (BLOCK_ID_AT(&bl->block_ids, mid), sha1, BLOCK_ID_LEN);
+        if (cmp == 0)
+            return (int)mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
+
+#define CHECK_BATCH_SIZE 1000
+
 /** 
  * Determine which blocks exist in local.
  */
@@ -875,34 +3524,47 @@ void
 block_list_generate_bitmap (BlockList *bl)
 {
     SeafBlockManager *blk_mgr = seaf->block_mgr;
-    char *block_id;
-    size_t i = 0;
+    char (*hex)[41];
+    const char *ids[CHECK_BATCH_SIZE];
+    gboolean exists[CHECK_BATCH_SIZE];
+    uint32_t i, j, n;
+
+    block_list_sort (bl);
 
     BitfieldConstruct (&bl->block_map, bl->n_blocks);
-    for (i = 0; i < bl->n_blocks; ++i) {
-        block_id = g_ptr_array_index (bl->block_ids, i);
-        if (seaf_block_manager_block_exists (blk_mgr, block_id)) {
-            BitfieldAdd (&bl->block_map, i);
-            ++bl->n_valid_blocks;
+    bl->n_valid_blocks = 0;
+
+    hex = g_new (char[41], CHECK_BATCH_SIZE);
+    for (i = 0; i < bl->n_blocks; i += n) {
+        n = MIN (CHECK_BATCH_SIZE, bl->n_blocks - i);
+        for (j = 0; j < n; ++j) {
+            block_list_get_id (bl, i + j, hex[j]);
+            ids[j] = hex[j];
         }
-    }
 
-    g_hash_table_destroy (bl->block_hash);
-    bl->block_hash = NULL;
+        seaf_block_manager_blocks_exist (blk_mgr, ids, n, exists);
+
+        for (j = 0; j < n; ++j) {
+            if (exists[j]) {
+                BitfieldAdd (&bl->block_map, i + j);
+                ++bl->n_valid_blocks;
+            }
+        }
+    }
+    g_free (hex);
 }
 
 void
 block_list_serialize (BlockList *bl, uint8_t **buffer, uint32_t *len)
 {
     uint32_t i;
-    uint32_t offset = 0;
     uint8_t *buf;
 
+    block_list_sort (bl);
+
     buf = g_new (uint8_t, 41 * bl->n_blocks);
-    for (i = 0; i < bl->n_blocks; ++i) {
-        memcpy (&buf[offset], g_ptr_array_index(bl->block_ids, i), 41);
-        offset += 41;
-    }
+    for (i = 0; i < bl->n_blocks; ++i)
+        block_list_get_id (bl, i, (char *)&buf[41 * i]);
 
     *buffer = buf;
     *len = 41 * bl->n_blocks;
@@ -911,35 +3573,50 @@ block_list_serialize (BlockList *bl, uint8_t **buffer, uint32_t *len)
 void
 block_list_insert (BlockList *bl, const char *block_id)
 {
-    if (g_hash_table_lookup (bl->block_hash, block_id))
-        return;
+    unsigned char sha1[BLOCK_ID_LEN];
 
-    char *key = g_strdup(block_id);
-    g_hash_table_insert (bl->block_hash, key, key);
-    g_ptr_array_add (bl->block_ids, g_strdup(block_id));
-    ++bl->n_blocks;
+    if (hex_to_rawdata (block_id, sha1, BLOCK_ID_LEN) < 0) {
+        g_warning ("[fs mgr] Invalid block id %s.\n", block_id);
+        return;
+    }
+    id_array_append (&bl->block_ids, sha1, 1);
 }
 
 BlockList *
 block_list_difference (BlockList *bl1, BlockList *bl2)
 {
     BlockList *bl;
-    int i;
-    char *block_id;
-    char *key;
+    BlockIdArray *ids1, *ids2;
+    guint i, j;
+    int cmp;
+
+    block_list_sort (bl1);
+    block_list_sort (bl2);
+    ids1 = &bl1->block_ids;
+    ids2 = &bl2->block_ids;
 
     bl = block_list_new ();
 
-    for (i = 0; i < bl1->block_ids->len; ++i) {
-        block_id = g_ptr_array_index (bl1->block_ids, i);
-        if (g_hash_table_lookup (bl2->block_hash, block_id) == NULL) {
-            key = g_strdup(block_id);
-            g_hash_table_insert (bl->block_hash, key, key);
-            g_ptr_array_add (bl->block_ids, g_strdup(block_id));
-            ++bl->n_blocks;
+    for (i = 0, j = 0; i < ids1->len; ) {
+        if (j == ids2->len)
+            cmp = -1;
+        else
+            cmp = memcmp (BLOCK_ID_AT(ids1, i), BLOCK_ID_AT(ids2, j),
+                          BLOCK_ID_LEN);
+
+        if (cmp < 0) {
+            id_array_append (&bl->block_ids, BLOCK_ID_AT(ids1, i), 1);
+            ++i;
+        } else if (cmp == 0) {
+            ++i;
+            ++j;
+        } else {
+            ++j;
         }
     }
 
+    block_list_sort (bl);
+
     return bl;
 }
 
@@ -966,10 +3643,10 @@ traverse_dir (SeafFSManager *mgr,
               TraverseFSTreeCallback callback,
               void *user_data)
 {
-    SeafDir *dir;
-    GList *p;
-    SeafDirent *seaf_dent;
+    SeafDirView *dir;
+    SeafDirViewEntry *seaf_dent;
     gboolean stop = FALSE;
+    int i;
 
     if (!callback (mgr, id, SEAF_METADATA_TYPE_DIR, user_data, &stop))
         return -1;
@@ -977,51 +3654,232 @@ traverse_dir (SeafFSManager *mgr,
     if (stop)
         return 0;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, id);
+    dir = seaf_fs_manager_get_dir_view (mgr, id);
     if (!dir) {
         g_warning ("[fs-mgr]get seafdir %s failed\n", id);
         return -1;
     }
-    for (p = dir->entries; p; p = p->next) {
-        seaf_dent = (SeafDirent *)p->data;
+    for (i = 0; i < dir->n_entries; ++i) {
+        seaf_dent = &dir->entries[i];
+
+        if (S_ISREG(seaf_dent->mode)) {
+            if (traverse_file (mgr, seaf_dent->id, callback, user_data) < 0) {
+                seaf_dir_view_free (dir);
+                return -1;
+            }
+        } else if (S_ISDIR(seaf_dent->mode)) {
+            if (traverse_dir (mgr, seaf_dent->id, callback, user_data) < 0) {
+                seaf_dir_view_free (dir);
+                return -1;
+            }
+        }
+    }
+
+    seaf_dir_view_free (dir);
+    return 0;
+}
+
+int
+seaf_fs_manager_traverse_tree (SeafFSManager *mgr,
+                               const char *root_id,
+                               TraverseFSTreeCallback callback,
+                               void *user_data)
+{
+    if (strcmp (root_id, EMPTY_SHA1) == 0) {
+#if 0
+        g_debug ("[fs-mgr] populate blocklist for empty root id\n");
+#endif        
+        return 0;
+    }
+    return traverse_dir (mgr, root_id, callback, user_data);
+}
+
+/*
+ * Parallel traversal. Dirs to load are queued in breadth-first order and
+ * taken by the workers, so the objects of a level are read concurrently
+ * instead of one at a time. The callback is run for a subdir before it's
+ * queued, so it can still stop the traversal of the subtree.
+ */
+typedef struct ParallelTraverse {
+    SeafFSManager           *mgr;
+    TraverseFSTreeCallback  callback;
+    void                    *user_data;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    GQueue                  *queue;     /* dir ids to load */
+    GHashTable              *seen;      /* dir ids queued once */
+    int                     n_busy;     /* workers loading a dir */
+    gboolean                failed;
+} ParallelTraverse;
+
+static void
+parallel_traverse_queue_dir (ParallelTraverse *pt, const char *dir_id)
+{
+    pthread_mutex_lock (&pt->lock);
+    if (!g_hash_table_lookup (pt->seen, dir_id)) {
+        char *id = g_strdup (dir_id);
+        g_hash_table_insert (pt->seen, id, id);
+        g_queue_push_tail (pt->queue, g_strdup (dir_id));
+        pthread_cond_signal (&pt->cond);
+    }
+    pthread_mutex_unlock (&pt->lock);
+}
+
+static int
+parallel_traverse_dir (ParallelTraverse *pt, const char *dir_id)
+{
+    SeafDirView *dir;
+    SeafDirViewEntry *seaf_dent;
+    gboolean stop;
+    int i, ret = 0;
+
+    dir = seaf_fs_manager_get_dir_view (pt->mgr, dir_id);
+    if (!dir) {
+        g_warning ("[fs-mgr]get seafdir %s failed\n", dir_id);
+        return -1;
+    }
+
+    for (i = 0; i < dir->n_entries; ++i) {
+        seaf_dent = &dir->entries[i];
+        stop = FALSE;
+
+        if (S_ISREG(seaf_dent->mode)) {
+            if (memcmp (seaf_dent->id, EMPTY_SHA1, 40) == 0)
+                continue;
+            if (!pt->callback (pt->mgr, seaf_dent->id, SEAF_METADATA_TYPE_FILE,
+                               pt->user_data, &stop)) {
+                ret = -1;
+                break;
+            }
+        } else if (S_ISDIR(seaf_dent->mode)) {
+            if (!pt->callback (pt->mgr, seaf_dent->id, SEAF_METADATA_TYPE_DIR,
+                               pt->user_data, &stop)) {
+                ret = -1;
+                break;
+            }
+            if (!stop)
+                parallel_traverse_queue_dir (pt, seaf_dent->id);
+        }
+    }
+
+    seaf_dir_view_free (dir);
+    return ret;
+}
+
+static void *
+parallel_traverse_worker (void *vpt)
+{
+    ParallelTraverse *pt = vpt;
+    char *dir_id;
+    int ret;
+
+    pthread_mutex_lock (&pt->lock);
+    while (1) {
+        while (g_queue_is_empty (pt->queue) && pt->n_busy > 0 && !pt->failed)
+            pthread_cond_wait (&pt->cond, &pt->lock);
+
+        /* Done when nothing is queued and no dir is being loaded, which
+         * could queue more. */
+        if (pt->failed || g_queue_is_empty (pt->queue))
+            break;
+
+        dir_id = g_queue_pop_head (pt->queue);
+        ++pt->n_busy;
+        pthread_mutex_unlock (&pt->lock);
 
-        if (S_ISREG(seaf_dent->mode)) {
-            if (traverse_file (mgr, seaf_dent->id, callback, user_data) < 0) {
-                seaf_dir_free (dir);
-                return -1;
-            }
-        } else if (S_ISDIR(seaf_dent->mode)) {
-            if (traverse_dir (mgr, seaf_dent->id, callback, user_data) < 0) {
-                seaf_dir_free (dir);
-                return -1;
-            }
-        }
+        ret = parallel_traverse_dir (pt, dir_id);
+        g_free (dir_id);
+
+        pthread_mutex_lock (&pt->lock);
+        --pt->n_busy;
+        if (ret < 0)
+            pt->failed = TRUE;
+        if (pt->n_busy == 0 || pt->failed)
+            pthread_cond_broadcast (&pt->cond);
     }
+    pthread_cond_broadcast (&pt->cond);
+    pthread_mutex_unlock (&pt->lock);
 
-    seaf_dir_free (dir);
-    return 0;
+    return NULL;
 }
 
 int
-seaf_fs_manager_traverse_tree (SeafFSManager *mgr,
-                               const char *root_id,
-                               TraverseFSTreeCallback callback,
-                               void *user_data)
+seaf_fs_manager_traverse_tree_parallel (SeafFSManager *mgr,
+                                        const char *root_id,
+                                        TraverseFSTreeCallback callback,
+                                        void *user_data,
+                                        int n_workers)
 {
-    if (strcmp (root_id, EMPTY_SHA1) == 0) {
-#if 0
-        g_debug ("[fs-mgr] populate blocklist for empty root id\n");
-#endif        
+    ParallelTraverse pt;
+    pthread_t *threads;
+    gboolean stop = FALSE;
+    int i, n_started;
+    char *dir_id;
+
+    if (strcmp (root_id, EMPTY_SHA1) == 0)
+        return 0;
+
+    if (n_workers <= 1)
+        return seaf_fs_manager_traverse_tree (mgr, root_id,
+                                              callback, user_data);
+
+    if (!callback (mgr, root_id, SEAF_METADATA_TYPE_DIR, user_data, &stop))
+        return -1;
+    if (stop)
         return 0;
+
+    memset (&pt, 0, sizeof(pt));
+    pt.mgr = mgr;
+    pt.callback = callback;
+    pt.user_data = user_data;
+    pthread_mutex_init (&pt.lock, NULL);
+    pthread_cond_init (&pt.cond, NULL);
+    pt.queue = g_queue_new ();
+    pt.seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    parallel_traverse_queue_dir (&pt, root_id);
+
+    threads = g_new0 (pthread_t, n_workers);
+    for (n_started = 0; n_started < n_workers; ++n_started) {
+        if (pthread_create (&threads[n_started], NULL,
+                            parallel_traverse_worker, &pt) != 0) {
+            g_warning ("[fs mgr] Failed to create traverse worker.\n");
+            break;
+        }
     }
-    return traverse_dir (mgr, root_id, callback, user_data);
+
+    /* Traverse in this thread if no worker could be started. */
+    if (n_started == 0)
+        parallel_traverse_worker (&pt);
+
+    for (i = 0; i < n_started; ++i)
+        pthread_join (threads[i], NULL);
+    g_free (threads);
+
+    while ((dir_id = g_queue_pop_head (pt.queue)) != NULL)
+        g_free (dir_id);
+    g_queue_free (pt.queue);
+    g_hash_table_destroy (pt.seen);
+    pthread_mutex_destroy (&pt.lock);
+    pthread_cond_destroy (&pt.cond);
+
+    return pt.failed ? -1 : 0;
 }
 
+/* Files are loaded concurrently, only the block list is locked. */
+typedef struct FillBlocklistData {
+    BlockList       *bl;
+    pthread_mutex_t lock;
+} FillBlocklistData;
+
+#define POPULATE_BLOCKLIST_WORKERS 4
+
 static gboolean
 fill_blocklist (SeafFSManager *mgr, const char *obj_id, int type,
                 void *user_data, gboolean *stop)
 {
-    BlockList *bl = user_data;
+    FillBlocklistData *data = user_data;
     Seafile *seafile;
     int i;
 
@@ -1032,8 +3890,10 @@ fill_blocklist (SeafFSManager *mgr, const char *obj_id, int type,
             return FALSE;
         }
 
+        pthread_mutex_lock (&data->lock);
         for (i = 0; i < seafile->n_blocks; ++i)
-            block_list_insert (bl, seafile->blk_sha1s[i]);
+            block_list_insert (data->bl, seafile->blk_sha1s[i]);
+        pthread_mutex_unlock (&data->lock);
 
         seafile_unref (seafile);
     }
@@ -1046,9 +3906,22 @@ seaf_fs_manager_populate_blocklist (SeafFSManager *mgr,
                                     const char *root_id,
                                     BlockList *bl)
 {
-    return seaf_fs_manager_traverse_tree (mgr, root_id, 
-                                          fill_blocklist,
-                                          bl);
+    FillBlocklistData data;
+    int ret;
+
+    data.bl = bl;
+    pthread_mutex_init (&data.lock, NULL);
+
+    ret = seaf_fs_manager_traverse_tree_parallel (mgr, root_id,
+                                                  fill_blocklist,
+                                                  &data,
+                                                  POPULATE_BLOCKLIST_WORKERS);
+
+    pthread_mutex_destroy (&data.lock);
+
+    block_list_sort (bl);
+
+    return ret;
 }
 
 gboolean
@@ -1061,36 +3934,155 @@ seaf_fs_manager_object_exists (SeafFSManager *mgr, const char *id)
     return seaf_obj_store_obj_exists (mgr->obj_store, id);
 }
 
+gboolean
+seaf_fs_manager_object_exists_unfiltered (SeafFSManager *mgr, const char *id)
+{
+    if (memcmp (id, EMPTY_SHA1, 40) == 0)
+        return TRUE;
+
+    return seaf_obj_store_obj_exists_unfiltered (mgr->obj_store, id);
+}
+
 static gint64
 get_file_size (SeafFSManager *mgr, const char *id)
 {
     SeafileOndisk *ondisk;
     int len;
+    gint64 size = -1;
+
+    if (memcmp (id, EMPTY_SHA1, 40) == 0)
+        return 0;
 
     if (seaf_obj_store_read_obj (mgr->obj_store, id, (void **)&ondisk, &len) < 0) {
         g_warning ("[fs mgr] Failed to read file %s.\n", id);
         return -1;
     }
 
-    if (ondisk->type != SEAF_METADATA_TYPE_FILE)
-        return -1;
+    if (len >= sizeof(SeafileOndisk) &&
+        ntohl(ondisk->type) == SEAF_METADATA_TYPE_FILE)
+        size = (gint64) ntoh64(ondisk->file_size);
 
-    return (gint64) ntoh64(ondisk->file_size);
+    g_free (ondisk);
+    return size;
 }
 
-static gint64
-get_dir_size (SeafFSManager *mgr, const char *id)
+gint64
+seaf_fs_manager_get_file_size (SeafFSManager *mgr, const char *file_id)
+{
+    return get_file_size (mgr, file_id);
+}
+
+/*
+ * Total size and number of files of a dir tree, memoized by dir id. A new
+ * version of a tree only walks the dirs that changed, the others are
+ * found in the memo.
+ */
+typedef struct DirStats {
+    gint64  size;
+    gint64  file_count;
+} DirStats;
+
+/* The in-memory memo is cleared when it gets larger. */
+#define DIR_STATS_MAX_ENTRIES 100000
+
+#ifdef SEAFILE_SERVER
+static gboolean
+collect_dir_stats (SeafDBRow *row, void *vstats)
+{
+    DirStats *stats = vstats;
+
+    stats->size = seaf_db_row_get_column_int64 (row, 0);
+    stats->file_count = seaf_db_row_get_column_int64 (row, 1);
+    return FALSE;
+}
+#endif
+
+static gboolean
+dir_stats_lookup (SeafFSManager *mgr, const char *id, DirStats *stats)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    DirStats *cached;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&priv->dir_stats_lock);
+    cached = g_hash_table_lookup (priv->dir_stats, id);
+    if (cached) {
+        *stats = *cached;
+        found = TRUE;
+    }
+    pthread_mutex_unlock (&priv->dir_stats_lock);
+
+#ifdef SEAFILE_SERVER
+    if (!found && priv->dir_stats_in_db) {
+        char sql[256];
+
+        stats->size = -1;
+        snprintf (sql, sizeof(sql),
+                  "SELECT size, file_count FROM DirStats WHERE dir_id='%s'",
+                  id);
+        if (seaf_db_foreach_selected_row (mgr->seaf->db, sql,
+                                          collect_dir_stats, stats) > 0 &&
+            stats->size >= 0)
+            found = TRUE;
+    }
+#endif
+
+    return found;
+}
+
+static void
+dir_stats_insert (SeafFSManager *mgr, const char *id, DirStats *stats,
+                  gboolean save)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->dir_stats_lock);
+    if (g_hash_table_size (priv->dir_stats) >= DIR_STATS_MAX_ENTRIES)
+        g_hash_table_remove_all (priv->dir_stats);
+    g_hash_table_replace (priv->dir_stats, g_strdup (id),
+                          g_memdup (stats, sizeof(DirStats)));
+    pthread_mutex_unlock (&priv->dir_stats_lock);
+
+#ifdef SEAFILE_SERVER
+    if (save && priv->dir_stats_in_db) {
+        char sql[256];
+
+        snprintf (sql, sizeof(sql),
+                  "REPLACE INTO DirStats VALUES ('%s', %"G_GINT64_FORMAT", "
+                  "%"G_GINT64_FORMAT")", id, stats->size, stats->file_count);
+        if (seaf_db_query (mgr->seaf->db, sql) < 0)
+            g_warning ("[fs mgr] Failed to save stats of dir %s.\n", id);
+    }
+#endif
+}
+
+static int
+get_dir_stats (SeafFSManager *mgr, const char *id, DirStats *stats)
 {
     SeafDir *dir;
     SeafDirent *seaf_dent;
-    guint64 size = 0;
-    int result;
+    DirStats sub;
+    gint64 result;
     GList *p;
 
+    if (memcmp (id, EMPTY_SHA1, 40) == 0) {
+        stats->size = 0;
+        stats->file_count = 0;
+        return 0;
+    }
+
+    if (dir_stats_lookup (mgr, id, stats)) {
+        /* Found in the db, keep it in memory too. */
+        dir_stats_insert (mgr, id, stats, FALSE);
+        return 0;
+    }
+
     dir = seaf_fs_manager_get_seafdir (mgr, id);
     if (!dir)
         return -1;
 
+    stats->size = 0;
+    stats->file_count = 0;
     for (p = dir->entries; p; p = p->next) {
         seaf_dent = (SeafDirent *)p->data;
 
@@ -1098,71 +4090,136 @@ get_dir_size (SeafFSManager *mgr, const char *id)
             result = get_file_size (mgr, seaf_dent->id);
             if (result < 0) {
                 seaf_dir_free (dir);
-                return result;
+                return -1;
             }
-            size += result;
+            stats->size += result;
+            stats->file_count++;
         } else if (S_ISDIR(seaf_dent->mode)) {
-            result = get_dir_size (mgr, seaf_dent->id);
-            if (result < 0) {
+            if (get_dir_stats (mgr, seaf_dent->id, &sub) < 0) {
                 seaf_dir_free (dir);
-                return result;
+                return -1;
             }
-            size += result;
+            stats->size += sub.size;
+            stats->file_count += sub.file_count;
         }
     }
 
     seaf_dir_free (dir);
-    return size;
+
+    dir_stats_insert (mgr, id, stats, TRUE);
+    return 0;
 }
 
 gint64
 seaf_fs_manager_get_fs_size (SeafFSManager *mgr,
                              const char *root_id)
 {
-     if (strcmp (root_id, EMPTY_SHA1) == 0)
-        return 0;
-     return get_dir_size (mgr, root_id);
+    DirStats stats;
+
+    if (get_dir_stats (mgr, root_id, &stats) < 0)
+        return -1;
+    return stats.size;
 }
 
-static int
-count_dir_files (SeafFSManager *mgr, const char *id)
+int
+seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
+                                const char *root_id)
 {
-    SeafDir *dir;
-    SeafDirent *seaf_dent;
-    int count = 0;
-    int result;
-    GList *p;
+    DirStats stats;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, id);
-    if (!dir)
+    if (get_dir_stats (mgr, root_id, &stats) < 0)
         return -1;
+    return (int)stats.file_count;
+}
 
-    for (p = dir->entries; p; p = p->next) {
-        seaf_dent = (SeafDirent *)p->data;
+/*
+ * Resolves @path under @root_id to the id and mode of its object. The
+ * walk starts from the longest prefix of the path in the path cache.
+ *
+ * Returns 1 if resolved, 0 if the path doesn't exist and -1 if a dir on
+ * the way can't be read. @depth is set to the number of path components
+ * resolved before the failure.
+ */
+static int
+resolve_path (SeafFSManager *mgr,
+              const char *root_id,
+              const char *path,
+              char *obj_id,
+              guint32 *mode,
+              int *depth)
+{
+    PathCache *cache = &mgr->priv->path_cache;
+    char *copy = g_strdup (path);
+    char *name, *saveptr;
+    GPtrArray *names = g_ptr_array_new ();
+    gsize *key_lens;
+    GString *key;
+    char dir_id[41];
+    guint32 dir_mode = S_IFDIR;
+    SeafDirent dent;
+    int i, start;
+    gboolean found;
+    int ret = 1;
+
+    for (name = strtok_r (copy, "/", &saveptr); name != NULL;
+         name = strtok_r (NULL, "/", &saveptr))
+        g_ptr_array_add (names, name);
+    /* The root itself is looked up as an empty name, which never exists. */
+    if (names->len == 0)
+        g_ptr_array_add (names, "");
+
+    key = g_string_new (NULL);
+    g_string_append_len (key, root_id, 40);
+    key_lens = g_new (gsize, names->len);
+    for (i = 0; i < names->len; ++i) {
+        g_string_append_c (key, '/');
+        g_string_append (key, g_ptr_array_index (names, i));
+        key_lens[i] = key->len;
+    }
 
-        if (S_ISREG(seaf_dent->mode)) {
-            count ++;
-        } else if (S_ISDIR(seaf_dent->mode)) {
-            result = count_dir_files (mgr, seaf_dent->id);
-            if (result < 0) {
-                seaf_dir_free (dir);
-                return result;
-            }
-            count += result;
+    memcpy (dir_id, root_id, 40);
+    dir_id[40] = '\0';
+
+    for (start = names->len; start > 0; --start) {
+        char saved = key->str[key_lens[start - 1]];
+
+        key->str[key_lens[start - 1]] = '\0';
+        found = path_cache_lookup (cache, key->str, dir_id, &dir_mode);
+        key->str[key_lens[start - 1]] = saved;
+        if (found)
+            break;
+    }
+
+    for (i = start; i < names->len; ++i) {
+        ret = seaf_fs_manager_lookup_dirent (mgr, dir_id,
+                                             g_ptr_array_index (names, i),
+                                             &dent);
+        if (ret <= 0) {
+            *depth = i;
+            goto out;
         }
+
+        memcpy (dir_id, dent.id, 41);
+        dir_mode = dent.mode;
+
+        if (i < names->len - 1) {
+            key->str[key_lens[i]] = '\0';
+            path_cache_insert (cache, key->str, dir_id, dir_mode);
+            key->str[key_lens[i]] = '/';
+        } else
+            path_cache_insert (cache, key->str, dir_id, dir_mode);
     }
 
-    seaf_dir_free (dir);
-    return count;
-}
+    memcpy (obj_id, dir_id, 41);
+    *mode = dir_mode;
+    *depth = names->len;
 
-int
-seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
-                                const char *root_id)
-{
-     if (strcmp (root_id, EMPTY_SHA1) == 0)
-        return 0;
-     return count_dir_files (mgr, root_id);
+out:
+    g_string_free (key, TRUE);
+    g_free (key_lens);
+    g_ptr_array_free (names, TRUE);
+    g_free (copy);
+    return ret;
 }
 
 SeafDir *
@@ -1171,52 +4228,35 @@ seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
                                      const char *path,
                                      GError **error)
 {
-    SeafDir *dir;
-    SeafDirent *dent;
-    const char *dir_id = root_id;
-    char *name, *saveptr;
-    char *tmp_path = g_strdup(path);
-
-    dir = seaf_fs_manager_get_seafdir (mgr, dir_id);
-    if (!dir) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
-        return NULL;
-    }
+    SeafDir *dir = NULL;
+    char dir_id[41];
+    guint32 mode;
+    int depth;
+    int ret;
 
-    name = strtok_r (tmp_path, "/", &saveptr);
-    while (name != NULL) {
-        GList *l;
-        for (l = dir->entries; l != NULL; l = l->next) {
-            dent = l->data;
-            
-            if (strcmp(dent->name, name) == 0) {
-                dir_id = dent->id;
-                break;
-            }
+    /* Only the last dir is parsed, the others are only searched. */
+    if (path[strspn (path, "/")] == '\0') {
+        memcpy (dir_id, root_id, 40);
+        dir_id[40] = '\0';
+    } else {
+        ret = resolve_path (mgr, root_id, path, dir_id, &mode, &depth);
+        if (ret < 0) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, 
+                         "directory is missing");
+            return NULL;
         }
-
-        if (!l) {
+        if (ret == 0) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
                          "Path does not exists %s", path);
-            seaf_dir_free (dir);
-            dir = NULL;
-            break;
-        }
-
-        SeafDir *prev = dir;
-        dir = seaf_fs_manager_get_seafdir (mgr, dir_id);
-        seaf_dir_free (prev);
-
-        if (!dir) {
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, 
-                         "directory is missing");
-            break;
+            return NULL;
         }
-
-        name = strtok_r (NULL, "/", &saveptr);
     }
 
-    g_free (tmp_path);
+    dir = seaf_fs_manager_get_seafdir (mgr, dir_id);
+    if (!dir)
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                     "directory is missing");
+
     return dir;
 }
 
@@ -1227,64 +4267,31 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
                                  guint32 *mode,
                                  GError **error)
 {
-    char *copy = g_strdup (path);
-    int off = strlen(copy) - 1;
-    char *slash, *name;
-    SeafDir *base_dir = NULL;
-    SeafDirent *dent;
-    GList *p;
-    char *file_id = NULL;
-
-    while (off >= 0 && copy[off] == '/')
-        copy[off--] = 0;
-
-    slash = strrchr (copy, '/');
-    if (!slash) {
-        base_dir = seaf_fs_manager_get_seafdir (mgr, root_id);
-        if (!base_dir) {
+    char obj_id[41];
+    guint32 obj_mode;
+    int depth;
+    int ret;
+
+    ret = resolve_path (mgr, root_id, path, obj_id, &obj_mode, &depth);
+    if (ret < 0) {
+        if (depth == 0) {
             g_warning ("Failed to find root dir %s.\n", root_id);
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, " ");
-            goto out;
-        }
-        name = copy;
-    } else {
-        *slash = 0;
-        name = slash + 1;
-        GError *tmp_error = NULL;
-        base_dir = seaf_fs_manager_get_seafdir_by_path (mgr,
-                                                        root_id,
-                                                        copy,
-                                                        &tmp_error);
-        if (tmp_error &&
-            !g_error_matches(tmp_error,
-                             SEAFILE_DOMAIN,
-                             SEAF_ERR_PATH_NO_EXIST)) {
-            g_warning ("Failed to get dir for %s.\n", copy);
-            g_propagate_error (error, tmp_error);
-            goto out;
+        } else {
+            g_warning ("Failed to get dir for %s.\n", path);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                         "directory is missing");
         }
-
-        /* The path doesn't exist in this commit. */
-        if (!base_dir)
-            goto out;
+        return NULL;
     }
 
-    for (p = base_dir->entries; p != NULL; p = p->next) {
-        dent = p->data;
-        if (strcmp (dent->name, name) == 0) {
-            file_id = g_strdup (dent->id);
-            if (mode) {
-                *mode = dent->mode;
-            }
-            break;
-        }
-    }
+    /* The path doesn't exist in this commit. */
+    if (ret == 0)
+        return NULL;
 
-out:
-    if (base_dir)
-        seaf_dir_free (base_dir);
-    g_free (copy);
-    return file_id;
+    if (mode)
+        *mode = obj_mode;
+    return g_strdup (obj_id);
 }
 
 char *
@@ -1336,3 +4343,189 @@ seaf_fs_manager_get_seafdir_id_by_path (SeafFSManager *mgr,
 }
                                         
 
+
+/*
+ * Sorted dir listings.
+ */
+
+void
+seaf_dir_listing_unref (SeafDirListing *listing)
+{
+    if (!listing || !g_atomic_int_dec_and_test (&listing->ref_count))
+        return;
+    g_free (listing->entries);
+    seaf_dir_free (listing->dir);
+    g_free (listing);
+}
+
+static int
+compare_dirent_names_asc (const void *a, const void *b)
+{
+    const SeafDirent *d1 = *(SeafDirent * const *)a;
+    const SeafDirent *d2 = *(SeafDirent * const *)b;
+
+    return strcmp (d1->name, d2->name);
+}
+
+static int
+compare_dirent_names_desc (const void *a, const void *b)
+{
+    return compare_dirent_names_asc (b, a);
+}
+
+static int
+compare_dirents_dirs_first (const void *a, const void *b)
+{
+    const SeafDirent *d1 = *(SeafDirent * const *)a;
+    const SeafDirent *d2 = *(SeafDirent * const *)b;
+    gboolean is_dir1 = S_ISDIR(d1->mode), is_dir2 = S_ISDIR(d2->mode);
+
+    if (is_dir1 != is_dir2)
+        return is_dir1 ? -1 : 1;
+    return strcmp (d1->name, d2->name);
+}
+
+static SeafDirListing *
+build_dir_listing (SeafDir *dir, int sort)
+{
+    SeafDirListing *listing = g_new0 (SeafDirListing, 1);
+    GList *ptr;
+    guint i = 0;
+
+    listing->ref_count = 1;
+    listing->sort = sort;
+    listing->dir = dir;
+    seaf_dir_ref (dir);
+
+    listing->n_entries = g_list_length (dir->entries);
+    listing->entries = g_new (SeafDirent *, listing->n_entries);
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        listing->entries[i++] = ptr->data;
+        if (S_ISDIR(((SeafDirent *)ptr->data)->mode))
+            ++listing->n_dirs;
+    }
+
+    if (sort == SEAF_DIR_SORT_NAME_DESC)
+        qsort (listing->entries, listing->n_entries, sizeof(SeafDirent *),
+               compare_dirent_names_desc);
+    else if (sort == SEAF_DIR_SORT_DIRS_FIRST)
+        qsort (listing->entries, listing->n_entries, sizeof(SeafDirent *),
+               compare_dirents_dirs_first);
+    else
+        qsort (listing->entries, listing->n_entries, sizeof(SeafDirent *),
+               compare_dirent_names_asc);
+
+    return listing;
+}
+
+SeafDirListing *
+seaf_fs_manager_get_dir_listing (SeafFSManager *mgr,
+                                 const char *dir_id,
+                                 int sort)
+{
+    ListingCache *cache = &mgr->priv->listing_cache;
+    SeafDirListing *listing;
+    SeafDir *dir;
+    GList *link;
+    char *key, *old_key;
+
+    key = g_strdup_printf ("%s/%d", dir_id, sort);
+
+    pthread_mutex_lock (&cache->lock);
+    listing = g_hash_table_lookup (cache->entries, key);
+    if (listing) {
+        g_atomic_int_inc (&listing->ref_count);
+        link = g_queue_find_custom (cache->lru, key, (GCompareFunc)strcmp);
+        g_queue_unlink (cache->lru, link);
+        g_queue_push_head_link (cache->lru, link);
+    }
+    pthread_mutex_unlock (&cache->lock);
+
+    if (listing) {
+        g_free (key);
+        return listing;
+    }
+
+    dir = seaf_fs_manager_get_seafdir (mgr, dir_id);
+    if (!dir) {
+        g_free (key);
+        return NULL;
+    }
+    listing = build_dir_listing (dir, sort);
+    seaf_dir_free (dir);
+
+    if (listing->n_entries < LISTING_CACHE_MIN_ENTRIES) {
+        g_free (key);
+        return listing;
+    }
+
+    pthread_mutex_lock (&cache->lock);
+
+    /* Another thread may have built the same listing meanwhile. */
+    if (g_hash_table_lookup (cache->entries, key)) {
+        pthread_mutex_unlock (&cache->lock);
+        g_free (key);
+        return listing;
+    }
+
+    g_atomic_int_inc (&listing->ref_count);
+    g_hash_table_insert (cache->entries, key, listing);
+    g_queue_push_head (cache->lru, key);
+
+    while (g_queue_get_length (cache->lru) > LISTING_CACHE_ENTRIES) {
+        old_key = g_queue_pop_tail (cache->lru);
+        g_hash_table_remove (cache->entries, old_key);
+    }
+
+    pthread_mutex_unlock (&cache->lock);
+
+    return listing;
+}
+
+/* First index in [lo, hi) whose name sorts after @name. */
+static guint
+listing_upper_bound (SeafDirListing *listing, guint lo, guint hi,
+                     const char *name, gboolean desc, gboolean *found)
+{
+    guint mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp (listing->entries[mid]->name, name);
+        if (desc)
+            cmp = -cmp;
+        if (cmp == 0)
+            *found = TRUE;
+        if (cmp <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+guint
+seaf_dir_listing_find_after (SeafDirListing *listing, const char *name)
+{
+    gboolean found = FALSE;
+    guint pos, dir_pos;
+
+    if (listing->sort == SEAF_DIR_SORT_NAME_DESC)
+        return listing_upper_bound (listing, 0, listing->n_entries,
+                                    name, TRUE, &found);
+    if (listing->sort != SEAF_DIR_SORT_DIRS_FIRST)
+        return listing_upper_bound (listing, 0, listing->n_entries,
+                                    name, FALSE, &found);
+
+    /* The type of @name isn't known. If it's not found in either part,
+     * it was removed, resume in the dirs so that nothing is skipped. */
+    dir_pos = listing_upper_bound (listing, 0, listing->n_dirs,
+                                   name, FALSE, &found);
+    if (found)
+        return dir_pos;
+    pos = listing_upper_bound (listing, listing->n_dirs, listing->n_entries,
+                               name, FALSE, &found);
+    return found ? pos : dir_pos;
+}
@@ -32,6 +32,10 @@ seafile_ref (Seafile *seafile);
 void
 seafile_unref (Seafile *seafile);
 
+/* Whether the id of @seafile is the hash of its block list. */
+gboolean
+seafile_verify_id (Seafile *seafile);
+
 typedef enum {
     SEAF_METADATA_TYPE_INVALID,
     SEAF_METADATA_TYPE_FILE,
@@ -52,34 +56,99 @@ struct _SeafDirent {
 struct _SeafDir {
     char   dir_id[41];
     GList *entries;
+    int    ref_count;
 };
 
 SeafDir *
 seaf_dir_new (const char *id, GList *entries, gint64 ctime);
 
+/* Whether the id of @dir is the hash of its entries. */
+gboolean
+seaf_dir_verify_id (SeafDir *dir);
+
+void
+seaf_dir_ref (SeafDir *dir);
+
+/* Drop a reference. Dirs returned by the fs manager may be shared with
+ * its object cache, so don't modify them.
+ */
 void 
 seaf_dir_free (SeafDir *dir);
 
 SeafDir *
 seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len);
 
+/* Serializes @dir in the plain format. Free the result with g_free(). */
+void *
+seaf_dir_to_data (SeafDir *dir, int *len);
+
+/*
+ * Read-only form of a dir for traversal and lookups. The view, its
+ * entry array and the names are one allocation, freed with
+ * seaf_dir_view_free().
+ */
+typedef struct _SeafDirViewEntry {
+    guint32     mode;
+    guint32     name_len;
+    char        id[41];
+    const char *name;           /* NUL-terminated */
+} SeafDirViewEntry;
+
+typedef struct _SeafDirView {
+    char              dir_id[41];
+    int               n_entries;
+    SeafDirViewEntry *entries;
+} SeafDirView;
+
+/* Like seaf_dir_from_data(), sharded dirs are not supported. */
+SeafDirView *
+seaf_dir_view_from_data (const char *dir_id, const uint8_t *data, int len);
+
+void
+seaf_dir_view_free (SeafDirView *view);
+
+const SeafDirViewEntry *
+seaf_dir_view_lookup (SeafDirView *view, const char *name);
+
 int 
 seaf_dir_save (SeafFSManager *fs_mgr, SeafDir *dir);
 
 int
 seaf_metadata_type_from_data (const uint8_t *data, int len);
 
+/* Whether @data is a dir object in the indexed format. */
+gboolean
+seaf_dir_data_is_indexed (const uint8_t *data, int len);
+
+/* Whether @data is a dir object in the sharded format. */
+gboolean
+seaf_dir_data_is_sharded (const uint8_t *data, int len);
+
 SeafDirent *
 seaf_dirent_new (const char *sha1, int mode, const char *name);
 
 SeafDirent *
 seaf_dirent_dup (SeafDirent *dent);
 
+/* Growable array of binary (20-byte) block ids. */
+typedef struct {
+    unsigned char *data;
+    guint          len;
+    guint          alloc;
+    /* In low-memory mode on the client, large arrays are kept in an
+     * unlinked temp file mapped into memory, so that they can be paged
+     * out like file data. */
+    gboolean       mapped;
+} BlockIdArray;
+
 typedef struct {
-    /* TODO: GHashTable may be inefficient when we have large number of IDs. */
-    GHashTable  *block_hash;
-    GPtrArray   *block_ids;
+    /* The first n_sorted ids are sorted and unique, later inserts are
+     * appended and merged in by block_list_sort().
+     */
+    BlockIdArray block_ids;
+    guint        n_sorted;
     Bitfield     block_map;
+    /* Only valid after block_list_sort(). */
     uint32_t     n_blocks;
     uint32_t     n_valid_blocks;
 } BlockList;
@@ -99,6 +168,22 @@ block_list_serialize (BlockList *bl, uint8_t **buffer, uint32_t *len);
 void
 block_list_insert (BlockList *bl, const char *block_id);
 
+/* Sort and dedup the ids inserted so far. Indexes are stable afterwards
+ * until the next insert.
+ */
+void
+block_list_sort (BlockList *bl);
+
+/* Copy the hex id of the @i-th block into @block_id, which must hold
+ * 41 bytes.
+ */
+void
+block_list_get_id (BlockList *bl, int i, char *block_id);
+
+/* Index of @block_id among the sorted ids, or -1. */
+int
+block_list_find (BlockList *bl, const char *block_id);
+
 /* Return a blocklist containing block ids which are in @bl1 but
  * not in @bl2.
  */
@@ -135,25 +220,98 @@ seaf_fs_manager_checkout (SeafFSManager *mgr,
                           const char *root_id,
                           const char *output_path);
 
+/*
+ * The sizes of the blocks written are returned in @block_sizes if it's
+ * not NULL, to be released with free().
+ */
 int 
 seaf_fs_manager_checkout_file (SeafFSManager *mgr, 
                                const char *file_id, 
                                const char *file_path,
                                guint32 mode,
                                struct SeafileCrypt *crypt,
-                               const char *conflict_suffix);
+                               const char *conflict_suffix,
+                               uint32_t **block_sizes,
+                               uint32_t *n_blocks);
 
 #endif  /* not SEAFILE_SERVER */
 
 /**
  * Check in blocks and create seafile/symlink object.
  * Returns sha1 id for the seafile/symlink object in @sha1 parameter.
+ * @file_name is the name the chunking policy goes by, if @file_path is
+ * a temp file. NULL means @file_path.
  */
 int
 seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               const char *file_path,
+                              const char *file_name,
                               unsigned char sha1[],
-                              SeafileCrypt *crypt);
+                              SeafileCrypt *crypt,
+                              int chunker);
+
+/*
+ * Like seaf_fs_manager_index_blocks(), for a new version of the file
+ * @old_file_id, which may be NULL. The blocks at the start of the file
+ * that didn't change are taken from the old version instead of being
+ * chunked and written again. The result is the same as indexing the
+ * whole file.
+ *
+ * If the sizes of the old blocks are known, pass them in
+ * @old_block_sizes so that the old blocks needn't be read. The sizes of
+ * the new blocks are returned in @block_sizes, to be released with free().
+ */
+int
+seaf_fs_manager_reindex_blocks (SeafFSManager *mgr,
+                                const char *file_path,
+                                const char *old_file_id,
+                                const uint32_t *old_block_sizes,
+                                uint32_t n_old_blocks,
+                                unsigned char sha1[],
+                                uint32_t **block_sizes,
+                                uint32_t *n_blocks,
+                                SeafileCrypt *crypt,
+                                int chunker);
+
+/*
+ * Index a file whose content arrives piece by piece, e.g. an upload,
+ * without writing it to a temp file first. Blocks are written as soon
+ * as they're cut. @size_hint is the expected file size, which the
+ * chunking policy goes by; the actual size may be smaller.
+ */
+typedef struct _SeafIndexStream SeafIndexStream;
+
+SeafIndexStream *
+seaf_fs_manager_index_stream_new (SeafFSManager *mgr,
+                                  const char *file_name,
+                                  uint64_t size_hint,
+                                  SeafileCrypt *crypt,
+                                  int chunker);
+
+int
+seaf_fs_manager_index_stream_feed (SeafIndexStream *is,
+                                   const char *data,
+                                   int len);
+
+/* Write the seafile object, its id is returned in @sha1. */
+int
+seaf_fs_manager_index_stream_finish (SeafIndexStream *is,
+                                     unsigned char sha1[]);
+
+void
+seaf_fs_manager_index_stream_free (SeafIndexStream *is);
+
+#ifdef SEAFILE_SERVER
+/*
+ * Write the seafile object of a file made of the stored, unencrypted
+ * blocks @blk_ids, in order. Its id is returned in @sha1.
+ */
+int
+seaf_fs_manager_index_existing_blocks (SeafFSManager *mgr,
+                                       const char **blk_ids,
+                                       int n_blocks,
+                                       unsigned char sha1[]);
+#endif
 
 uint32_t
 seaf_fs_manager_get_type (SeafFSManager *mgr, const char *id);
@@ -164,11 +322,53 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id);
 SeafDir *
 seaf_fs_manager_get_seafdir (SeafFSManager *mgr, const char *dir_id);
 
+/* Views are not added to the object cache, so walking a big tree
+ * doesn't evict the objects in use. */
+SeafDirView *
+seaf_fs_manager_get_dir_view (SeafFSManager *mgr, const char *dir_id);
+
+typedef struct SeafFSCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint   n_objects;
+    gsize   size;
+    gsize   capacity;
+} SeafFSCacheStats;
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, SeafFSCacheStats *stats);
+
 /* Make sure entries in the returned dir is sorted in descending order.
  */
 SeafDir *
 seaf_fs_manager_get_seafdir_sorted (SeafFSManager *mgr, const char *dir_id);
 
+/*
+ * Dirents in a GPtrArray, in the same descending order by name as the
+ * entries of a sorted dir, for code that looks up, inserts or removes
+ * many names. Lookups are binary searches. The array doesn't own the
+ * dirents.
+ */
+GPtrArray *
+seaf_dirent_array_new (const GList *sorted_entries);
+
+/* Returns the index of @name, or -1. @pos, if not NULL, is set to the
+ * index of @name or to where it would be inserted. */
+int
+seaf_dirent_array_find (GPtrArray *array, const char *name, guint *pos);
+
+void
+seaf_dirent_array_insert_sorted (GPtrArray *array, SeafDirent *dent);
+
+/* Returns the dirent removed, or NULL. */
+SeafDirent *
+seaf_dirent_array_remove (GPtrArray *array, const char *name);
+
+/* For APIs taking a list of entries, e.g. seaf_dir_new(). Only the list
+ * is to be freed. */
+GList *
+seaf_dirent_array_to_list (GPtrArray *array);
+
 int
 seaf_fs_manager_populate_blocklist (SeafFSManager *mgr,
                                     const char *root_id,
@@ -189,12 +389,37 @@ seaf_fs_manager_traverse_tree (SeafFSManager *mgr,
                                TraverseFSTreeCallback callback,
                                void *user_data);
 
+/*
+ * Like seaf_fs_manager_traverse_tree(), with @n_workers threads loading
+ * dirs at the same time. @callback is called from the worker threads
+ * concurrently, so it must be thread-safe. Dirs are visited in no
+ * particular order, and a dir that appears several times in the tree is
+ * only visited once.
+ */
+int
+seaf_fs_manager_traverse_tree_parallel (SeafFSManager *mgr,
+                                        const char *root_id,
+                                        TraverseFSTreeCallback callback,
+                                        void *user_data,
+                                        int n_workers);
+
 gboolean
 seaf_fs_manager_object_exists (SeafFSManager *mgr, const char *id);
 
+/*
+ * For ids sent by clients, which may be objects written by httpserver.
+ * See seaf_obj_store_obj_exists_unfiltered().
+ */
+gboolean
+seaf_fs_manager_object_exists_unfiltered (SeafFSManager *mgr, const char *id);
+
 gint64
 seaf_fs_manager_get_fs_size (SeafFSManager *mgr, const char *root_id);
 
+/* Reads only the file object, not the blocks. */
+gint64
+seaf_fs_manager_get_file_size (SeafFSManager *mgr, const char *file_id);
+
 #ifndef SEAFILE_SERVER
 int
 seafile_write_chunk (CDCDescriptor *chunk,
@@ -206,9 +431,61 @@ seafile_write_chunk (CDCDescriptor *chunk,
 uint32_t
 calculate_chunk_size (uint64_t total_size);
 
+/*
+ * A repo's chunker: its CDC_ALGO_* in the low bits, and the chunking
+ * policy recorded in its commits above them. Commits only store the
+ * algorithm in their chunker field, and the policy separately.
+ */
+#define CHUNKER_ALGO_MASK    0xff
+#define CHUNKER_POLICY_SHIFT 8
+#define CHUNKER_ALGO(chunker) ((chunker) & CHUNKER_ALGO_MASK)
+
+/* @policy is a commit's chunk_policy, may be NULL. */
+int
+chunker_with_policy (int algo, const char *policy);
+
+/* The policy string of @chunker, NULL if it has none. */
+const char *
+chunker_get_policy (int chunker);
+
+/* The policy of this node's config, for new repos. NULL if none is set. */
+const char *
+local_chunk_policy ();
+
+/*
+ * Set up block sizes and fingerprint engine in @cdc for chunking a file
+ * of @file_size bytes. @chunker is the repo's chunker, its algorithm may
+ * be overridden by its chunking policy for @file_name (may be NULL).
+ * Other fields of @cdc are zeroed.
+ */
+void
+prepare_cdc_file_descriptor (CDCFileDescriptor *cdc,
+                             const char *file_name,
+                             uint64_t file_size,
+                             int chunker);
+
 int
 seaf_fs_manager_count_fs_files (SeafFSManager *mgr, const char *root_id);
 
+/* Converts dir object data in any format to the plain format, which
+ * is the only one clients understand. */
+void *
+seaf_fs_manager_dir_data_to_plain (SeafFSManager *mgr,
+                                   const char *dir_id,
+                                   const uint8_t *data, int len,
+                                   int *plain_len);
+
+/*
+ * Looks up @name in dir @dir_id and copies its dirent to @dent. Indexed
+ * dirs are binary searched without being parsed.
+ * Returns 1 if found, 0 if not found and -1 if the dir can't be read.
+ */
+int
+seaf_fs_manager_lookup_dirent (SeafFSManager *mgr,
+                               const char *dir_id,
+                               const char *name,
+                               SeafDirent *dent);
+
 SeafDir *
 seaf_fs_manager_get_seafdir_by_path(SeafFSManager *mgr,
                                     const char *root_id,
@@ -233,4 +510,41 @@ seaf_fs_manager_get_seafdir_id_by_path (SeafFSManager *mgr,
                                         const char *path,
                                         GError **error);
 
+enum {
+    SEAF_DIR_SORT_NAME,
+    SEAF_DIR_SORT_NAME_DESC,
+    /* Dirs before files, each by name. */
+    SEAF_DIR_SORT_DIRS_FIRST,
+};
+
+/*
+ * The entries of a dir sorted for display. The entries point into @dir,
+ * so don't modify them.
+ */
+typedef struct SeafDirListing {
+    SeafDir     *dir;
+    SeafDirent  **entries;
+    guint       n_entries;
+    guint       n_dirs;
+    int         sort;
+    gint        ref_count;
+} SeafDirListing;
+
+/*
+ * Returns the entries of @dir_id sorted by @sort. Listings of large dirs
+ * are cached, so paging through them only sorts once.
+ */
+SeafDirListing *
+seaf_fs_manager_get_dir_listing (SeafFSManager *mgr,
+                                 const char *dir_id,
+                                 int sort);
+
+void
+seaf_dir_listing_unref (SeafDirListing *listing);
+
+/* Index of the first entry after the entry named @name, for paging with
+ * the name of the last entry of the previous page. */
+guint
+seaf_dir_listing_find_after (SeafDirListing *listing, const char *name);
+
 #endif
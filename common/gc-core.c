@@ -2,16 +2,46 @@
 
 #include "common.h"
 
+#include <pthread.h>
+#include <glib/gstdio.h>
+
 #include "seafile-session.h"
 #include "bloom-filter.h"
+#include "sorted-id-set.h"
+#include "obj-id-set.h"
+#include "rate-limiter.h"
 #include "gc-core.h"
+#include "utils.h"
+#ifdef SEAFILE_SERVER
+#include "history-compact.h"
+#endif
 
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
 /* Total number of blocks to be scanned. */
 static guint64 total_blocks;
-static guint64 removed_blocks;
+
+/* Counters are updated atomically by the GC threads. */
+static GCProgress progress;
+
+static RateLimiter *traverse_limiter;
+static RateLimiter *sweep_limiter;
+static RateLimiter *sweep_bw_limiter;
+
+/* Wall-clock time to stop at, or 0. */
+static gint64 deadline;
+static volatile gboolean out_of_time;
+
+static gboolean
+gc_out_of_time ()
+{
+    if (deadline > 0 && !out_of_time && (gint64)time(NULL) >= deadline) {
+        g_message ("GC: Time limit reached, stopping.\n");
+        out_of_time = TRUE;
+    }
+    return out_of_time;
+}
 
 /*
  * The number of bits in the bloom filter is 4 times the number of all blocks.
@@ -22,6 +52,7 @@ static guint64 removed_blocks;
  *     p = (1 - e^(-kn/m))^k = 0.15
  *
  * Because m = 4 * total_blocks >= 4 * (live blocks) = 4n, we should have p <= 0.15.
+ * Keeping the bits of a block in one cache line raises it a bit, to about 0.16.
  * Put it another way, we'll clean up at least 85% dead blocks in each gc operation.
  * See http://en.wikipedia.org/wiki/Bloom_filter.
  *
@@ -36,14 +67,57 @@ alloc_gc_index ()
 {
     size_t size = (size_t) MAX(total_blocks << 2, 1 << 13);
 
-    g_message ("GC index size is %u Byte.\n", (int)size >> 3);
+    g_message ("GC index size is %"G_GUINT64_FORMAT" Byte.\n",
+               (guint64)size >> 3);
 
-    return bloom_create (size, 3, 0);
+    /* Block ids are SHA-1, so the blocked filter can use their bits. */
+    return bloom_create_blocked (size, 3);
+}
+
+/*
+ * In exact mode, live block ids are collected in a sorted set spilled to
+ * disk and merge-joined with a sorted listing of all blocks, so every dead
+ * block is removed. Memory used by each set is bounded by this.
+ */
+#define SORT_MEMORY_LIMIT (256 << 20)
+
+/*
+ * Live blocks are added to a bloom filter, or to a sorted set in exact mode.
+ * In candidates mode, only the candidates found live are recorded, in a
+ * table shared by all threads.
+ */
+typedef struct LiveIndex {
+    Bloom       *bloom;
+    SortedIdSet *ids;
+    GHashTable  *candidates;
+    GHashTable  *live;
+    pthread_mutex_t *live_lock;
+} LiveIndex;
+
+static void
+mark_live_candidate (LiveIndex *index, const char *block_id)
+{
+    gpointer key;
+
+    /* The candidates table is not modified while populating. */
+    key = g_hash_table_lookup (index->candidates, block_id);
+    if (!key)
+        return;
+
+    pthread_mutex_lock (index->live_lock);
+    g_hash_table_insert (index->live, key, key);
+    pthread_mutex_unlock (index->live_lock);
 }
 
 typedef struct {
-    Bloom *index;
-    GHashTable *visited;
+    LiveIndex *index;
+    /* Fs objects already traversed in this run, shared by all repos and
+     * threads. Libraries that share history (forks, copies, virtual
+     * repos) then walk each subtree only once. */
+    ObjIdSet *visited;
+    /* Set when an object was skipped because it was in @visited. Its
+     * subtree may still be walked by another repo then. */
+    gboolean skipped_visited;
 #ifndef SEAFILE_SERVER
     gboolean no_history;
     char end_commit[41];
@@ -56,14 +130,18 @@ typedef struct {
      */
     gint64 truncate_time;
     gboolean traversed_head;
+    /* Picks the commits whose trees are kept in compacted history. */
+    HistoryCompactor compactor;
+    /* Commits already traversed by the last GC, for incremental GC. */
+    GHashTable *covered;
 #endif
 } GCData;
 
 static int
-add_blocks_to_index (SeafFSManager *mgr, Bloom *index, const char *file_id)
+add_blocks_to_index (SeafFSManager *mgr, LiveIndex *index, const char *file_id)
 {
     Seafile *seafile;
-    int i;
+    int i, ret = 0;
 
     seafile = seaf_fs_manager_get_seafile (mgr, file_id);
     if (!seafile) {
@@ -71,12 +149,21 @@ add_blocks_to_index (SeafFSManager *mgr, Bloom *index, const char *file_id)
         return -1;
     }
 
-    for (i = 0; i < seafile->n_blocks; ++i)
-        bloom_add (index, seafile->blk_sha1s[i]);
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        if (index->ids) {
+            if (sorted_id_set_add (index->ids, seafile->blk_sha1s[i]) < 0) {
+                ret = -1;
+                break;
+            }
+        } else if (index->candidates)
+            mark_live_candidate (index, seafile->blk_sha1s[i]);
+        else
+            bloom_add (index->bloom, seafile->blk_sha1s[i]);
+    }
 
     seafile_unref (seafile);
 
-    return 0;
+    return ret;
 }
 
 static gboolean
@@ -88,16 +175,19 @@ fs_callback (SeafFSManager *mgr,
 {
     GCData *data = user_data;
 
-    if (data->visited != NULL) {
-        if (g_hash_table_lookup (data->visited, obj_id) != NULL) {
-            *stop = TRUE;
-            return TRUE;
-        }
-
-        char *key = g_strdup(obj_id);
-        g_hash_table_insert (data->visited, key, key);
+    /* The blocks under a visited object are already in some index. */
+    if (data->visited != NULL && !obj_id_set_add (data->visited, obj_id)) {
+        data->skipped_visited = TRUE;
+        *stop = TRUE;
+        return TRUE;
     }
 
+    /* The traversal is aborted, the repo will be traversed again. */
+    if (gc_out_of_time ())
+        return FALSE;
+    rate_limiter_acquire (traverse_limiter, 1);
+    __sync_fetch_and_add (&progress.objects_visited, 1);
+
     if (type == SEAF_METADATA_TYPE_FILE &&
         add_blocks_to_index (mgr, data->index, obj_id) < 0)
         return FALSE;
@@ -120,6 +210,12 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
 #endif
 
 #ifdef SEAFILE_SERVER
+    if (data->covered &&
+        g_hash_table_lookup (data->covered, commit->commit_id) != NULL) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
     if (data->truncate_time == 0)
     {
         *stop = TRUE;
@@ -133,10 +229,20 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
         return TRUE;
     }
 
+    /* Commits between checkpoints are walked through, but the data only
+     * used by them is removed. */
+    if (!history_compactor_keep (&data->compactor, commit->ctime) &&
+        data->traversed_head)
+        return TRUE;
+
     if (!data->traversed_head)
         data->traversed_head = TRUE;
 #endif
 
+    if (gc_out_of_time ())
+        return FALSE;
+    rate_limiter_acquire (traverse_limiter, 1);
+
     seaf_debug ("[GC] traversed commit %s.\n", commit->commit_id);
 
     ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
@@ -149,13 +255,374 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
     return TRUE;
 }
 
+#ifdef SEAFILE_SERVER
+/*
+ * Checkpoint for incremental GC, saved by every GC run in incremental mode.
+ * It holds the branch heads of every repo traversed and the bloom filter
+ * of live blocks. The next incremental run starts from that filter and
+ * skips the commits already reachable from the saved heads. Blocks that
+ * died since the checkpoint are kept until the next full GC, which is run
+ * in place of an incremental one every FULL_GC_INTERVAL.
+ *
+ * A run stopped by its time limit saves the same state in RESUME_DIR,
+ * covering only the repos it finished. The next run of any mode but exact
+ * starts from it like an incremental GC.
+ */
+#define CHECKPOINT_DIR "gc-checkpoint"
+#define RESUME_DIR "gc-resume"
+#define CHECKPOINT_HEADS "heads"
+#define CHECKPOINT_INDEX "live-index"
+#define FULL_GC_INTERVAL (7 * 24 * 3600)
+
+typedef struct GCCheckpoint {
+    gint64      full_gc_time;
+    /* A longer history needs a full traversal. */
+    int         keep_history_days;
+    int         compact_after_days;
+    int         compact_hourly_days;
+    /* repo id -> GList of head commit ids */
+    GHashTable  *heads;
+    Bloom       *index;
+} GCCheckpoint;
+
+static void
+free_head_list (gpointer list)
+{
+    string_list_free ((GList *)list);
+}
+
+static GHashTable *
+checkpoint_heads_new ()
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, free_head_list);
+}
+
+static void
+gc_checkpoint_free (GCCheckpoint *cp)
+{
+    if (cp->heads)
+        g_hash_table_destroy (cp->heads);
+    if (cp->index)
+        bloom_destroy (cp->index);
+    g_free (cp);
+}
+
+static GCCheckpoint *
+load_gc_checkpoint (const char *dir_name)
+{
+    GCCheckpoint *cp = NULL;
+    GKeyFile *key_file = g_key_file_new ();
+    char *dir, *path = NULL;
+    char **repo_ids = NULL, **commit_ids, *time_str = NULL;
+    gsize n_repos, n_commits, i, j;
+    GList *list;
+    FILE *fp;
+
+    dir = g_build_filename (seaf->seaf_dir, dir_name, NULL);
+
+    path = g_build_filename (dir, CHECKPOINT_HEADS, NULL);
+    if (!g_key_file_load_from_file (key_file, path, 0, NULL))
+        goto out;
+    time_str = g_key_file_get_string (key_file, "checkpoint", "full_gc_time", NULL);
+    if (!time_str)
+        goto out;
+
+    cp = g_new0 (GCCheckpoint, 1);
+    cp->full_gc_time = strtoll (time_str, NULL, 10);
+    cp->keep_history_days = g_key_file_get_integer (key_file, "checkpoint",
+                                                    "keep_history_days", NULL);
+    cp->compact_after_days = g_key_file_get_integer (key_file, "checkpoint",
+                                                     "compact_after_days", NULL);
+    cp->compact_hourly_days = g_key_file_get_integer (key_file, "checkpoint",
+                                                      "compact_hourly_days", NULL);
+    cp->heads = checkpoint_heads_new ();
+
+    repo_ids = g_key_file_get_keys (key_file, "heads", &n_repos, NULL);
+    for (i = 0; repo_ids && i < n_repos; ++i) {
+        commit_ids = g_key_file_get_string_list (key_file, "heads", repo_ids[i],
+                                                 &n_commits, NULL);
+        list = NULL;
+        for (j = 0; commit_ids && j < n_commits; ++j)
+            list = g_list_prepend (list, g_strdup (commit_ids[j]));
+        g_strfreev (commit_ids);
+        g_hash_table_insert (cp->heads, g_strdup (repo_ids[i]), list);
+    }
+
+    g_free (path);
+    path = g_build_filename (dir, CHECKPOINT_INDEX, NULL);
+    fp = g_fopen (path, "rb");
+    if (fp) {
+        cp->index = bloom_load (fp);
+        fclose (fp);
+    }
+    if (!cp->index) {
+        seaf_warning ("GC: Failed to load live index from %s.\n", path);
+        gc_checkpoint_free (cp);
+        cp = NULL;
+    }
+
+out:
+    g_strfreev (repo_ids);
+    g_free (time_str);
+    g_free (path);
+    g_free (dir);
+    g_key_file_free (key_file);
+    return cp;
+}
+
+static int
+write_file_atomic (const char *path, const void *data, gsize len, Bloom *index)
+{
+    char *tmp_path = g_strconcat (path, ".tmp", NULL);
+    FILE *fp;
+    int ret = -1;
+
+    fp = g_fopen (tmp_path, "wb");
+    if (!fp) {
+        seaf_warning ("GC: Failed to create %s: %s.\n", tmp_path, strerror(errno));
+        goto out;
+    }
+
+    if (index)
+        ret = bloom_save (index, fp);
+    else
+        ret = (fwrite (data, len, 1, fp) == 1) ? 0 : -1;
+    if (fflush (fp) != 0 || fsync (fileno (fp)) < 0)
+        ret = -1;
+    fclose (fp);
+
+    if (ret < 0) {
+        seaf_warning ("GC: Failed to write %s.\n", tmp_path);
+        g_unlink (tmp_path);
+        goto out;
+    }
+
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("GC: Failed to rename %s: %s.\n", tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        ret = -1;
+    }
+
+out:
+    g_free (tmp_path);
+    return ret;
+}
+
+/*
+ * The heads file is removed first and written last, so a checkpoint is
+ * never loaded with an index that doesn't match.
+ */
+static int
+save_gc_checkpoint (const char *dir_name, gint64 full_gc_time,
+                    GHashTable *heads, Bloom *index)
+{
+    GKeyFile *key_file = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ptr;
+    const char **commit_ids;
+    char *dir, *heads_path, *index_path, *data = NULL, *time_str;
+    gsize len, n;
+    int ret = -1;
+
+    dir = g_build_filename (seaf->seaf_dir, dir_name, NULL);
+    heads_path = g_build_filename (dir, CHECKPOINT_HEADS, NULL);
+    index_path = g_build_filename (dir, CHECKPOINT_INDEX, NULL);
+
+    if (g_mkdir_with_parents (dir, 0777) < 0) {
+        seaf_warning ("GC: Failed to create %s: %s.\n", dir, strerror(errno));
+        goto out;
+    }
+
+    if (g_unlink (heads_path) < 0 && errno != ENOENT) {
+        seaf_warning ("GC: Failed to remove %s: %s.\n", heads_path, strerror(errno));
+        goto out;
+    }
+
+    if (write_file_atomic (index_path, NULL, 0, index) < 0)
+        goto out;
+
+    key_file = g_key_file_new ();
+    time_str = g_strdup_printf ("%"G_GINT64_FORMAT, full_gc_time);
+    g_key_file_set_string (key_file, "checkpoint", "full_gc_time", time_str);
+    g_free (time_str);
+    g_key_file_set_integer (key_file, "checkpoint", "keep_history_days",
+                            seaf->keep_history_days);
+    g_key_file_set_integer (key_file, "checkpoint", "compact_after_days",
+                            seaf->compact_after_days);
+    g_key_file_set_integer (key_file, "checkpoint", "compact_hourly_days",
+                            seaf->compact_hourly_days);
+
+    g_hash_table_iter_init (&iter, heads);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        n = 0;
+        commit_ids = g_new0 (const char *, g_list_length (value) + 1);
+        for (ptr = value; ptr != NULL; ptr = ptr->next)
+            commit_ids[n++] = ptr->data;
+        g_key_file_set_string_list (key_file, "heads", key, commit_ids, n);
+        g_free (commit_ids);
+    }
+
+    data = g_key_file_to_data (key_file, &len, NULL);
+    ret = write_file_atomic (heads_path, data, len, NULL);
+
+out:
+    if (key_file)
+        g_key_file_free (key_file);
+    g_free (data);
+    g_free (index_path);
+    g_free (heads_path);
+    g_free (dir);
+    return ret;
+}
+
+static void
+remove_gc_checkpoint (const char *dir_name)
+{
+    char *dir = g_build_filename (seaf->seaf_dir, dir_name, NULL);
+    char *path;
+
+    path = g_build_filename (dir, CHECKPOINT_HEADS, NULL);
+    g_unlink (path);
+    g_free (path);
+    path = g_build_filename (dir, CHECKPOINT_INDEX, NULL);
+    g_unlink (path);
+    g_free (path);
+    g_rmdir (dir);
+    g_free (dir);
+}
+
+/*
+ * Repos not reached by a stopped run keep their heads from the checkpoint
+ * it started from, whose index they are still covered by.
+ */
+static void
+carry_over_heads (GHashTable *new_heads, GHashTable *old_heads)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ptr, *heads;
+
+    g_hash_table_iter_init (&iter, old_heads);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (g_hash_table_lookup (new_heads, key) != NULL)
+            continue;
+        heads = NULL;
+        for (ptr = value; ptr != NULL; ptr = ptr->next)
+            heads = g_list_prepend (heads, g_strdup (ptr->data));
+        g_hash_table_insert (new_heads, g_strdup (key), heads);
+    }
+}
+
+typedef struct CoverData {
+    GHashTable  *commits;
+    gint64      truncate_time;
+    gboolean    traversed_head;
+} CoverData;
+
+/* Same stop rules as traverse_commit. */
+static gboolean
+collect_covered_commit (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    CoverData *data = vdata;
+
+    if (data->truncate_time == 0) {
+        *stop = TRUE;
+    } else if (data->truncate_time > 0 &&
+               commit->ctime < data->truncate_time &&
+               data->traversed_head) {
+        *stop = TRUE;
+        return TRUE;
+    }
+    data->traversed_head = TRUE;
+
+    g_hash_table_insert (data->commits, g_strdup (commit->commit_id),
+                         GINT_TO_POINTER(1));
+    return TRUE;
+}
+
+/*
+ * Collect the commits reachable from the heads saved in the checkpoint,
+ * which had been traversed by the last GC. Returns NULL on error, in which
+ * case the repo is traversed in full.
+ */
+static GHashTable *
+collect_covered_commits (SeafRepo *repo, GList *old_heads, gint64 truncate_time)
+{
+    CoverData data;
+    GList *ptr;
+
+    memset (&data, 0, sizeof(data));
+    data.commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data.truncate_time = truncate_time;
+
+    for (ptr = old_heads; ptr != NULL; ptr = ptr->next) {
+        data.traversed_head = FALSE;
+        if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                       ptr->data,
+                                                       collect_covered_commit,
+                                                       &data)) {
+            seaf_warning ("[GC] Failed to traverse checkpoint of repo %s, "
+                          "doing full traversal.\n", repo->id);
+            g_hash_table_destroy (data.commits);
+            return NULL;
+        }
+    }
+
+    return data.commits;
+}
+
+static gboolean
+heads_unchanged (GList *old_heads, GList *branches)
+{
+    GList *ptr, *p;
+    SeafBranch *branch;
+
+    for (ptr = branches; ptr != NULL; ptr = ptr->next) {
+        branch = ptr->data;
+        for (p = old_heads; p != NULL; p = p->next)
+            if (strcmp (p->data, branch->commit_id) == 0)
+                break;
+        if (!p)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+#endif  /* SEAFILE_SERVER */
+
+/*
+ * State shared by the threads populating the index.
+ */
+typedef struct PopulateData {
+    pthread_mutex_t lock;
+    GList           *next_repo;
+    ObjIdSet        *visited;
+    gboolean        error;
+#ifdef SEAFILE_SERVER
+    /* Heads of the last checkpoint, NULL in full GC. */
+    GHashTable      *old_heads;
+    /* Heads of the repos traversed in this run, for the next checkpoint. */
+    GHashTable      *new_heads;
+    /* Heads of the repos that skipped objects first reached by another
+     * walk. They're only covered by the index if every walk finished,
+     * so they're moved to @new_heads after that. */
+    GHashTable      *shared_heads;
+#endif
+} PopulateData;
+
 static int
-populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
+populate_gc_index_for_repo (SeafRepo *repo, LiveIndex *index,
+                            PopulateData *shared)
 {
     GList *branches, *ptr;
     SeafBranch *branch;
     GCData *data;
     int ret = 0;
+#ifdef SEAFILE_SERVER
+    GList *heads = NULL;
+#endif
 
     branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo->id);
     if (branches == NULL) {
@@ -165,7 +632,7 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
 
     data = g_new0(GCData, 1);
     data->index = index;
-    data->visited = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data->visited = shared->visited;
 #ifndef SEAFILE_SERVER
     data->no_history = TRUE;
     if (data->no_history) {
@@ -185,10 +652,34 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
     } else if (seaf->keep_history_days < 0) {
         data->truncate_time = -1;
     }
+
+    for (ptr = branches; ptr != NULL; ptr = ptr->next) {
+        branch = ptr->data;
+        heads = g_list_prepend (heads, g_strdup (branch->commit_id));
+    }
+
+    if (shared->old_heads) {
+        /* Only read by the populate threads. */
+        GList *old_heads = g_hash_table_lookup (shared->old_heads, repo->id);
+
+        if (old_heads && heads_unchanged (old_heads, branches)) {
+            seaf_debug ("[GC] Repo %s unchanged since checkpoint.\n", repo->id);
+            for (ptr = branches; ptr != NULL; ptr = ptr->next)
+                seaf_branch_unref (ptr->data);
+            goto out;
+        }
+        if (old_heads)
+            data->covered = collect_covered_commits (repo, old_heads,
+                                                     data->truncate_time);
+    }
 #endif
 
     for (ptr = branches; ptr != NULL; ptr = ptr->next) {
         branch = ptr->data;
+#ifdef SEAFILE_SERVER
+        /* Each walk goes back in time from its head. */
+        history_compactor_init (&data->compactor);
+#endif
         gboolean res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
                                                                  branch->commit_id,
                                                                  traverse_commit,
@@ -200,8 +691,24 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
         }
     }
 
+#ifdef SEAFILE_SERVER
+out:
+    /* Only repos traversed in full are recorded. */
+    if (ret == 0 && shared->new_heads) {
+        pthread_mutex_lock (&shared->lock);
+        g_hash_table_replace (data->skipped_visited ?
+                              shared->shared_heads : shared->new_heads,
+                              g_strdup (repo->id), heads);
+        pthread_mutex_unlock (&shared->lock);
+        heads = NULL;
+    }
+    string_list_free (heads);
+    if (data->covered)
+        g_hash_table_destroy (data->covered);
+#endif
+    if (ret == 0)
+        __sync_fetch_and_add (&progress.repos_done, 1);
     g_list_free (branches);
-    g_hash_table_destroy (data->visited);
     g_free (data);
 
     return ret;
@@ -209,7 +716,7 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
 
 #ifndef SEAFILE_SERVER
 static int
-populate_gc_index_for_head (const char *head_id, Bloom *index)
+populate_gc_index_for_head (const char *head_id, LiveIndex *index)
 {
     SeafCommit *head;
     GCData *data;
@@ -236,28 +743,440 @@ populate_gc_index_for_head (const char *head_id, Bloom *index)
 }
 #endif
 
+/*
+ * Repos are traversed by several threads, each adding to its own bloom
+ * filter. The filters are merged before the sweep. The sorted set of the
+ * exact mode is shared.
+ */
+
+typedef struct PopulateWorker {
+    PopulateData    *data;
+    LiveIndex       index;
+    pthread_t       thread;
+} PopulateWorker;
+
+static void *
+populate_worker (void *vworker)
+{
+    PopulateWorker *worker = vworker;
+    PopulateData *data = worker->data;
+    SeafRepo *repo;
+
+    while (1) {
+        pthread_mutex_lock (&data->lock);
+        repo = NULL;
+        if (data->next_repo && !data->error && !gc_out_of_time ()) {
+            repo = data->next_repo->data;
+            data->next_repo = data->next_repo->next;
+        }
+        pthread_mutex_unlock (&data->lock);
+        if (!repo)
+            break;
+
+        if (populate_gc_index_for_repo (repo, &worker->index, data) < 0) {
+            pthread_mutex_lock (&data->lock);
+            data->error = TRUE;
+            pthread_mutex_unlock (&data->lock);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* The fs objects traversed are returned in @live_objs if it's not NULL. */
+static int
+populate_gc_index_for_repos (GList *repos, LiveIndex *index, int n_threads,
+                             GHashTable *old_heads, GHashTable *new_heads,
+                             ObjIdSet **live_objs)
+{
+    PopulateData data;
+    PopulateWorker *workers;
+    int i, n_started;
+
+    memset (&data, 0, sizeof(data));
+    pthread_mutex_init (&data.lock, NULL);
+    data.next_repo = repos;
+    data.visited = obj_id_set_new ();
+#ifdef SEAFILE_SERVER
+    data.old_heads = old_heads;
+    data.new_heads = new_heads;
+    if (new_heads)
+        data.shared_heads = checkpoint_heads_new ();
+#endif
+
+    n_threads = MAX (1, MIN (n_threads, (int)g_list_length (repos)));
+    workers = g_new0 (PopulateWorker, n_threads);
+
+    /* The first worker adds to @index directly. */
+    workers[0].data = &data;
+    workers[0].index = *index;
+    for (i = 1; i < n_threads; ++i) {
+        workers[i].data = &data;
+        workers[i].index = *index;
+        if (!index->bloom)
+            continue;
+        if (index->bloom->blocked)
+            workers[i].index.bloom = bloom_create_blocked (index->bloom->asize,
+                                                           index->bloom->k);
+        else
+            workers[i].index.bloom = bloom_create (index->bloom->asize,
+                                                   index->bloom->k, 0);
+        if (!workers[i].index.bloom) {
+            seaf_warning ("GC: Failed to allocate index, "
+                          "using %d threads.\n", i);
+            break;
+        }
+    }
+    n_threads = i;
+
+    n_started = 0;
+    for (i = 1; i < n_threads; ++i) {
+        if (pthread_create (&workers[i].thread, NULL,
+                            populate_worker, &workers[i]) != 0)
+            break;
+        ++n_started;
+    }
+
+    populate_worker (&workers[0]);
+
+    for (i = 1; i <= n_started; ++i) {
+        pthread_join (workers[i].thread, NULL);
+        if (index->bloom)
+            bloom_merge (index->bloom, workers[i].index.bloom);
+    }
+    for (i = 1; i < n_threads && index->bloom; ++i)
+        bloom_destroy (workers[i].index.bloom);
+
+#ifdef WIN32
+    g_message ("Traversed %I64u fs objects.\n", obj_id_set_size (data.visited));
+#else
+    g_message ("Traversed %"G_GUINT64_FORMAT" fs objects.\n",
+               obj_id_set_size (data.visited));
+#endif
+
+#ifdef SEAFILE_SERVER
+    if (data.shared_heads) {
+        /* A walk stopped in time may have been the only one to reach
+         * objects these repos skipped. They're traversed again then. */
+        if (!data.error) {
+            GHashTableIter iter;
+            gpointer key, value;
+
+            g_hash_table_iter_init (&iter, data.shared_heads);
+            while (g_hash_table_iter_next (&iter, &key, &value)) {
+                g_hash_table_replace (new_heads, key, value);
+                g_hash_table_iter_steal (&iter);
+            }
+        }
+        g_hash_table_destroy (data.shared_heads);
+    }
+#endif
+
+    g_free (workers);
+    if (live_objs && !data.error)
+        *live_objs = data.visited;
+    else
+        obj_id_set_free (data.visited);
+    pthread_mutex_destroy (&data.lock);
+
+    return data.error ? -1 : 0;
+}
+
+/* Within the sweep limits. */
+static void
+remove_dead_block (const char *block_id)
+{
+    BlockMetadata *md;
+    guint64 size = 0;
+
+    rate_limiter_acquire (sweep_limiter, 2);
+    md = seaf_block_manager_stat_block (seaf->block_mgr, block_id);
+    if (md) {
+        size = md->size;
+        g_free (md);
+    }
+    rate_limiter_acquire (sweep_bw_limiter, size);
+
+    __sync_fetch_and_add (&progress.blocks_removed, 1);
+    if (seaf_block_manager_remove_block (seaf->block_mgr, block_id) == 0)
+        __sync_fetch_and_add (&progress.bytes_freed, size);
+}
+
 static gboolean
 check_block_liveness (const char *block_id, void *vindex)
 {
     Bloom *index = vindex;
 
-    if (!bloom_test (index, block_id)) {
-        ++removed_blocks;
-        seaf_block_manager_remove_block (seaf->block_mgr, block_id);
+    if (gc_out_of_time ())
+        return FALSE;
+
+    /* May be called from several threads. */
+    if (!bloom_test (index, block_id))
+        remove_dead_block (block_id);
+
+    return TRUE;
+}
+
+static gboolean
+add_stored_block (const char *block_id, void *vids)
+{
+    if (gc_out_of_time ())
+        return FALSE;
+    return sorted_id_set_add ((SortedIdSet *)vids, block_id) == 0;
+}
+
+static gboolean
+remove_dead_candidate (gpointer key, gpointer value, gpointer vindex)
+{
+    LiveIndex *index = vindex;
+    const char *block_id = key;
+
+    if (gc_out_of_time () || g_hash_table_lookup (index->live, block_id))
+        return FALSE;
+
+    if (seaf_block_manager_block_exists (seaf->block_mgr, block_id))
+        remove_dead_block (block_id);
+    return TRUE;
+}
+
+/*
+ * Both sets are in ascending order: a stored block not found while
+ * advancing through the live set is dead.
+ */
+static int
+remove_dead_blocks_exact (SortedIdSet *live, int n_threads)
+{
+    SortedIdSet *stored;
+    char stored_id[41], live_id[41];
+    int rc, live_rc, ret = 0;
+
+    stored = sorted_id_set_new (seaf->tmp_file_dir, SORT_MEMORY_LIMIT);
+
+    if (seaf_block_manager_foreach_block_parallel (seaf->block_mgr,
+                                                   n_threads,
+                                                   add_stored_block,
+                                                   stored) < 0 ||
+        sorted_id_set_finish (stored) < 0) {
+        seaf_warning ("GC: Failed to list blocks.\n");
+        ret = -1;
+        goto out;
     }
 
+    live_rc = sorted_id_set_next (live, live_id);
+    while (!gc_out_of_time () &&
+           (rc = sorted_id_set_next (stored, stored_id)) > 0) {
+        while (live_rc > 0 && strcmp (live_id, stored_id) < 0)
+            live_rc = sorted_id_set_next (live, live_id);
+        if (live_rc < 0)
+            break;
+        if (live_rc > 0 && strcmp (live_id, stored_id) == 0)
+            continue;
+
+        remove_dead_block (stored_id);
+    }
+    if (rc < 0 || live_rc < 0)
+        ret = -1;
+
+out:
+    sorted_id_set_free (stored);
+    return ret;
+}
+
+#ifdef SEAFILE_SERVER
+/*
+ * Commits are kept as long as they can be reached from a branch, even
+ * past the history kept, so that the history of a repo can still be
+ * listed. Fs objects are kept if traversed by the GC, the blocks of the
+ * others are already removed.
+ *
+ * The dead objects are listed first and removed after, since the backend
+ * may be busy while listing. Objects written meanwhile are not in the
+ * live sets, so this must be run with the server stopped.
+ */
+
+typedef struct DeadObjects {
+    ObjIdSet    *live;
+    GPtrArray   *dead;
+} DeadObjects;
+
+static gboolean
+add_live_commit (SeafCommit *commit, void *vlive, gboolean *stop)
+{
+    /* Shared history is walked once. */
+    if (!obj_id_set_add ((ObjIdSet *)vlive, commit->commit_id))
+        *stop = TRUE;
+    return !gc_out_of_time ();
+}
+
+static ObjIdSet *
+collect_live_commits (GList *repos)
+{
+    ObjIdSet *live = obj_id_set_new ();
+    GList *ptr, *branches, *bptr;
+    SeafRepo *repo;
+    SeafBranch *branch;
+    gboolean ok = TRUE;
+
+    for (ptr = repos; ptr && ok; ptr = ptr->next) {
+        repo = ptr->data;
+        branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr,
+                                                        repo->id);
+        if (!branches) {
+            seaf_warning ("[GC] Failed to get branch list of repo %s.\n",
+                          repo->id);
+            ok = FALSE;
+        }
+
+        for (bptr = branches; bptr; bptr = bptr->next) {
+            branch = bptr->data;
+            if (ok && !seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                                 branch->commit_id,
+                                                                 add_live_commit,
+                                                                 live))
+                ok = FALSE;
+            seaf_branch_unref (branch);
+        }
+        g_list_free (branches);
+    }
+
+    if (!ok) {
+        obj_id_set_free (live);
+        return NULL;
+    }
+    return live;
+}
+
+static gboolean
+add_dead_object (const char *obj_id, void *vdata)
+{
+    DeadObjects *data = vdata;
+
+    if (gc_out_of_time ())
+        return FALSE;
+    if (!obj_id_set_contains (data->live, obj_id))
+        g_ptr_array_add (data->dead, g_strdup (obj_id));
     return TRUE;
 }
 
+static int
+remove_dead_objects_in (struct SeafObjStore *obj_store, ObjIdSet *live,
+                        const char *type)
+{
+    DeadObjects data;
+    guint i;
+    int ret = 0;
+
+    data.live = live;
+    data.dead = g_ptr_array_new ();
+
+    if (seaf_obj_store_foreach_obj (obj_store, add_dead_object, &data) < 0) {
+        seaf_warning ("GC: Failed to list %s.\n", type);
+        ret = -1;
+        goto out;
+    }
+    if (gc_out_of_time ())
+        goto out;
+
+    g_message ("Removing %u unused %s.\n", data.dead->len, type);
+    for (i = 0; i < data.dead->len && !gc_out_of_time (); ++i) {
+        rate_limiter_acquire (sweep_limiter, 1);
+        seaf_obj_store_delete_obj (obj_store, g_ptr_array_index (data.dead, i));
+        __sync_fetch_and_add (&progress.objects_removed, 1);
+    }
+
+out:
+    for (i = 0; i < data.dead->len; ++i)
+        g_free (g_ptr_array_index (data.dead, i));
+    g_ptr_array_free (data.dead, TRUE);
+    return ret;
+}
+
+static int
+remove_dead_objects (GList *repos, ObjIdSet *live_fs)
+{
+    ObjIdSet *live_commits;
+    int ret;
+
+    live_commits = collect_live_commits (repos);
+    if (!live_commits)
+        return -1;
+
+    ret = remove_dead_objects_in (seaf->commit_mgr->obj_store,
+                                  live_commits, "commits");
+    if (ret == 0)
+        ret = remove_dead_objects_in (seaf->fs_mgr->obj_store,
+                                      live_fs, "fs objects");
+
+    obj_id_set_free (live_commits);
+    return ret;
+}
+#endif
+
+void
+gc_core_get_progress (GCProgress *p)
+{
+    __sync_synchronize ();
+    *p = progress;
+}
+
+char *
+gc_core_format_progress (const GCProgress *p)
+{
+    static const char *phases[] = {
+        "idle", "traverse", "sweep", "done", "stopped", "failed",
+    };
+
+    return g_strdup_printf ("phase\t%s\n"
+                            "start_time\t%"G_GINT64_FORMAT"\n"
+                            "total_blocks\t%"G_GUINT64_FORMAT"\n"
+                            "repos_total\t%u\n"
+                            "repos_done\t%u\n"
+                            "objects_visited\t%"G_GUINT64_FORMAT"\n"
+                            "blocks_removed\t%"G_GUINT64_FORMAT"\n"
+                            "bytes_freed\t%"G_GUINT64_FORMAT"\n"
+                            "objects_removed\t%"G_GUINT64_FORMAT"\n",
+                            phases[p->phase], p->start_time, p->total_blocks,
+                            p->repos_total, p->repos_done, p->objects_visited,
+                            p->blocks_removed, p->bytes_freed,
+                            p->objects_removed);
+}
+
 int
-gc_core_run ()
+gc_core_run (const GCOptions *options)
 {
-    Bloom *index;
+    LiveIndex index;
     GList *repos = NULL, *clone_heads = NULL, *ptr;
+    GHashTable *old_heads = NULL, *new_heads = NULL;
+    GCMode mode = options->mode;
+    gboolean exact = (mode == GC_MODE_EXACT);
+    pthread_mutex_t live_lock;
     int ret;
+#ifdef SEAFILE_SERVER
+    ObjIdSet *live_objs = NULL;
+    GCCheckpoint *checkpoint = NULL;
+    gint64 full_gc_time = (gint64)time(NULL);
+#endif
 
-    total_blocks = seaf_block_manager_get_block_number (seaf->block_mgr);
-    removed_blocks = 0;
+    memset (&progress, 0, sizeof(progress));
+    progress.start_time = (gint64)time(NULL);
+    progress.phase = GC_PHASE_TRAVERSE;
+
+    out_of_time = FALSE;
+    deadline = 0;
+    if (options->max_run_time > 0)
+        deadline = progress.start_time + options->max_run_time;
+    traverse_limiter = rate_limiter_new (options->traverse_iops);
+    sweep_limiter = rate_limiter_new (options->sweep_iops);
+    sweep_bw_limiter = rate_limiter_new (options->sweep_bandwidth);
+
+    /* Counting the blocks lists the whole store, which is what the
+     * candidates mode avoids. */
+    if (mode == GC_MODE_CANDIDATES)
+        total_blocks = g_hash_table_size (options->candidates);
+    else
+        total_blocks = seaf_block_manager_get_block_number (seaf->block_mgr);
+    progress.total_blocks = total_blocks;
 
 #ifdef WIN32
     g_message ("GC started. Total block number is %I64u.\n", total_blocks);
@@ -271,10 +1190,48 @@ gc_core_run ()
      * may skip some garbage blocks, but we won't delete
      * blocks that are still alive.
      */
-    index = alloc_gc_index ();
-    if (!index) {
-        seaf_warning ("GC: Failed to allocate index.\n");
-        return -1;
+    memset (&index, 0, sizeof(index));
+    pthread_mutex_init (&live_lock, NULL);
+#ifdef SEAFILE_SERVER
+    /* Candidates runs leave the state of a stopped GC alone. */
+    if (!exact && mode != GC_MODE_CANDIDATES)
+        checkpoint = load_gc_checkpoint (RESUME_DIR);
+    if (checkpoint)
+        g_message ("Resuming stopped GC.\n");
+    else if (mode == GC_MODE_INCREMENTAL)
+        checkpoint = load_gc_checkpoint (CHECKPOINT_DIR);
+
+    if (checkpoint &&
+        (gint64)time(NULL) - checkpoint->full_gc_time < FULL_GC_INTERVAL &&
+        checkpoint->keep_history_days == seaf->keep_history_days &&
+        checkpoint->compact_after_days == seaf->compact_after_days &&
+        checkpoint->compact_hourly_days == seaf->compact_hourly_days) {
+        g_message ("Running GC from checkpoint.\n");
+        full_gc_time = checkpoint->full_gc_time;
+        old_heads = checkpoint->heads;
+        index.bloom = checkpoint->index;
+        checkpoint->index = NULL;
+    } else if (mode == GC_MODE_INCREMENTAL) {
+        g_message ("No valid GC checkpoint, running full GC.\n");
+    }
+    new_heads = checkpoint_heads_new ();
+#endif
+
+    if (index.bloom) {
+        /* Loaded from the checkpoint. */
+    } else if (mode == GC_MODE_CANDIDATES) {
+        index.candidates = options->candidates;
+        index.live = g_hash_table_new (g_str_hash, g_str_equal);
+        index.live_lock = &live_lock;
+    } else if (exact) {
+        index.ids = sorted_id_set_new (seaf->tmp_file_dir, SORT_MEMORY_LIMIT);
+    } else {
+        index.bloom = alloc_gc_index ();
+        if (!index.bloom) {
+            seaf_warning ("GC: Failed to allocate index.\n");
+            ret = -1;
+            goto out;
+        }
     }
 
     g_message ("Pupulating index.\n");
@@ -282,14 +1239,22 @@ gc_core_run ()
     /* If we meet any error when filling in the index, we should bail out.
      */
     repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
-    for (ptr = repos; ptr != NULL; ptr = ptr->next) {
-        ret = populate_gc_index_for_repo ((SeafRepo *)ptr->data, index);
+    progress.repos_total = g_list_length (repos);
 #ifdef SEAFILE_SERVER
-        seaf_repo_unref ((SeafRepo *)ptr->data);
+    /* Dead objects can only be told after traversing every repo in full. */
+    if (options->remove_objects && (old_heads || index.candidates))
+        seaf_warning ("GC: Objects are only removed by a full GC.\n");
+    ret = populate_gc_index_for_repos (repos, &index, options->n_threads,
+                                       old_heads, new_heads,
+                                       (options->remove_objects &&
+                                        !old_heads && !index.candidates) ?
+                                       &live_objs : NULL);
+#else
+    ret = populate_gc_index_for_repos (repos, &index, options->n_threads,
+                                       old_heads, new_heads, NULL);
 #endif
-        if (ret < 0)
-            goto out;
-    }
+    if (ret < 0)
+        goto out;
 
 #ifndef SEAFILE_SERVER
     /* If seaf-daemon exits while downloading a new repo, the downloaded new
@@ -299,7 +1264,7 @@ gc_core_run ()
      */
     clone_heads = seaf_transfer_manager_get_clone_heads (seaf->transfer_mgr);
     for (ptr = clone_heads; ptr != NULL; ptr = ptr->next) {
-        ret = populate_gc_index_for_head ((char *)ptr->data, index);
+        ret = populate_gc_index_for_head ((char *)ptr->data, &index);
         g_free (ptr->data);
         if (ret < 0)
             goto out;
@@ -307,24 +1272,103 @@ gc_core_run ()
 #endif
 
     g_message ("Scanning and deleting unused blocks.\n");
+    progress.phase = GC_PHASE_SWEEP;
 
-    ret = seaf_block_manager_foreach_block (seaf->block_mgr,
-                                            check_block_liveness,
-                                            index);
-    if (ret < 0) {
+    if (exact) {
+        ret = sorted_id_set_finish (index.ids);
+        if (ret == 0)
+            ret = remove_dead_blocks_exact (index.ids, options->n_threads);
+    } else if (index.candidates) {
+        g_hash_table_foreach_remove (index.candidates,
+                                     remove_dead_candidate, &index);
+        if (out_of_time)
+            ret = -1;
+    } else {
+        ret = seaf_block_manager_foreach_block_parallel (seaf->block_mgr,
+                                                         options->n_threads,
+                                                         check_block_liveness,
+                                                         index.bloom);
+    }
+    if (ret < 0 && !out_of_time) {
         seaf_warning ("GC: Failed to clean dead blocks.\n");
         goto out;
     }
+    ret = 0;
+
+    if (out_of_time)
+        goto out;
+
+    /* Compaction is left to the full GC, it can rewrite much of the store. */
+    if (!index.candidates &&
+        seaf_block_manager_compact (seaf->block_mgr) < 0)
+        seaf_warning ("GC: Failed to compact blocks.\n");
+
+#ifdef SEAFILE_SERVER
+    if (live_objs) {
+        g_message ("Removing unused commits and fs objects.\n");
+        if (remove_dead_objects (repos, live_objs) < 0)
+            seaf_warning ("GC: Failed to remove unused objects.\n");
+        /* The blocks are done. Objects left by a sweep stopped in time
+         * are removed by the next full GC. */
+        out_of_time = FALSE;
+    }
+
+    if (!index.candidates)
+        remove_gc_checkpoint (RESUME_DIR);
+    if (mode == GC_MODE_INCREMENTAL &&
+        save_gc_checkpoint (CHECKPOINT_DIR, full_gc_time,
+                            new_heads, index.bloom) < 0)
+        seaf_warning ("GC: Failed to save checkpoint.\n");
+#endif
 
 #ifdef WIN32
-    g_message ("GC finished. %I64u blocks are removed.\n", removed_blocks);
+    g_message ("GC finished. %I64u blocks are removed.\n", progress.blocks_removed);
 #else
-    g_message ("GC finished. %"G_GUINT64_FORMAT" blocks are removed.\n", removed_blocks);
+    g_message ("GC finished. %"G_GUINT64_FORMAT" blocks are removed.\n",
+               progress.blocks_removed);
 #endif
 
 out:
-    bloom_destroy (index);
+    /* A GC stopped in time keeps what it has done for the next run. */
+    if (out_of_time) {
+        ret = 0;
+#ifdef SEAFILE_SERVER
+        if (old_heads)
+            carry_over_heads (new_heads, old_heads);
+        if (index.bloom &&
+            save_gc_checkpoint (RESUME_DIR, full_gc_time,
+                                new_heads, index.bloom) < 0)
+            seaf_warning ("GC: Failed to save resume state.\n");
+#endif
+        progress.phase = GC_PHASE_STOPPED;
+    } else {
+        progress.phase = (ret < 0) ? GC_PHASE_FAILED : GC_PHASE_DONE;
+    }
+
+    if (index.bloom)
+        bloom_destroy (index.bloom);
+    if (index.ids)
+        sorted_id_set_free (index.ids);
+    if (index.live)
+        g_hash_table_destroy (index.live);
+    pthread_mutex_destroy (&live_lock);
+#ifdef SEAFILE_SERVER
+    for (ptr = repos; ptr != NULL; ptr = ptr->next)
+        seaf_repo_unref ((SeafRepo *)ptr->data);
+#endif
     g_list_free (repos);
     g_list_free (clone_heads);
+#ifdef SEAFILE_SERVER
+    if (live_objs)
+        obj_id_set_free (live_objs);
+    if (checkpoint)
+        gc_checkpoint_free (checkpoint);
+    if (new_heads)
+        g_hash_table_destroy (new_heads);
+#endif
+    rate_limiter_free (traverse_limiter);
+    rate_limiter_free (sweep_limiter);
+    rate_limiter_free (sweep_bw_limiter);
+    traverse_limiter = sweep_limiter = sweep_bw_limiter = NULL;
     return ret;
 }
@@ -1,6 +1,70 @@
 #ifndef GC_CORE_H
 #define GC_CORE_H
 
-int gc_core_run ();
+typedef enum {
+    GC_MODE_NORMAL,
+    /* Track live blocks in a sorted set on disk instead of a bloom
+     * filter, and remove all dead blocks. */
+    GC_MODE_EXACT,
+    /* Only traverse commits newer than the last checkpoint, with a
+     * periodic full GC. Server only. */
+    GC_MODE_INCREMENTAL,
+    /* Only check the blocks in the candidates table instead of scanning
+     * the block store. Used by the client, and on the server for the
+     * blocks of deleted repos. */
+    GC_MODE_CANDIDATES,
+} GCMode;
+
+typedef struct GCOptions {
+    /* Repos are traversed and blocks are swept by @n_threads threads. */
+    int         n_threads;
+    GCMode      mode;
+    /* Limits of the two phases, <= 0 means unlimited. Traversal counts
+     * one operation per commit or fs object, sweep one per stat or
+     * removal of a block, and the size of the removed blocks. */
+    int         traverse_iops;
+    int         sweep_iops;
+    gint64      sweep_bandwidth;
+    /* Stop after this many seconds if > 0. On the server, the next run
+     * resumes from where this one stopped, except in exact mode. */
+    int         max_run_time;
+    /* Block ids in candidates mode, as keys freed by the table. On
+     * return, the ids of the blocks still referenced are left, and those
+     * not checked before the time limit. */
+    GHashTable *candidates;
+    /* Server only. After a full sweep, also remove the commits not
+     * reachable from any branch and the fs objects not in the history
+     * kept. Needs a backend that can list its objects. */
+    gboolean    remove_objects;
+} GCOptions;
+
+typedef enum {
+    GC_PHASE_IDLE,
+    GC_PHASE_TRAVERSE,
+    GC_PHASE_SWEEP,
+    GC_PHASE_DONE,
+    GC_PHASE_STOPPED,
+    GC_PHASE_FAILED,
+} GCPhase;
+
+typedef struct GCProgress {
+    GCPhase     phase;
+    gint64      start_time;
+    guint64     total_blocks;
+    guint       repos_total;
+    guint       repos_done;
+    guint64     objects_visited;
+    guint64     blocks_removed;
+    guint64     bytes_freed;
+    guint64     objects_removed;
+} GCProgress;
+
+int gc_core_run (const GCOptions *options);
+
+/* Progress of the running or last GC. Can be called from any thread. */
+void gc_core_get_progress (GCProgress *progress);
+
+/* "name\tvalue" lines, freed by the caller. */
+char *gc_core_format_progress (const GCProgress *progress);
 
 #endif
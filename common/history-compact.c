@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "history-compact.h"
+
+#define HOUR (3600)
+#define DAY (24 * 3600)
+
+void
+history_compactor_init (HistoryCompactor *compactor)
+{
+    gint64 now = (gint64)time(NULL);
+    int hourly_days;
+
+    memset (compactor, 0, sizeof(HistoryCompactor));
+    compactor->last_period = -1;
+
+    if (seaf->compact_after_days <= 0)
+        return;
+
+    /* The hourly window can't start before compaction does. */
+    hourly_days = MAX (seaf->compact_hourly_days, seaf->compact_after_days);
+
+    compactor->hourly_before = now - (gint64)seaf->compact_after_days * DAY;
+    compactor->daily_before = now - (gint64)hourly_days * DAY;
+}
+
+gboolean
+history_compactor_keep (HistoryCompactor *compactor, gint64 ctime)
+{
+    gint64 period;
+
+    if (compactor->hourly_before == 0 || ctime >= compactor->hourly_before)
+        return TRUE;
+
+    /* Hours and days are both identified by their start. A day whose
+     * first hour is still compacted hourly already has its checkpoint. */
+    if (ctime >= compactor->daily_before)
+        period = ctime - ctime % HOUR;
+    else
+        period = ctime - ctime % DAY;
+
+    if (period == compactor->last_period)
+        return FALSE;
+
+    compactor->last_period = period;
+    return TRUE;
+}
@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HISTORY_COMPACT_H
+#define HISTORY_COMPACT_H
+
+#include <glib.h>
+
+/*
+ * Compaction of old history on the server, set in the [history] section
+ * of seafile.conf:
+ *
+ *   compact_after_days    history older than this is compacted, 0 (the
+ *                         default) disables compaction
+ *   compact_hourly_days   up to this age, one commit is kept per hour,
+ *                         then one per day; defaults to 7
+ *
+ * The kept commit of an hour or a day is its latest one, the checkpoint.
+ * Commits are not rewritten, so heads, parents and merges stay as they
+ * are and clients are not affected. But GC doesn't keep the trees of the
+ * other commits, which are left out of the history lists.
+ *
+ * Commits must be passed latest first, as the history walks do. State is
+ * kept per walk.
+ */
+
+typedef struct HistoryCompactor {
+    gint64 hourly_before;       /* 0 if compaction is disabled */
+    gint64 daily_before;
+    gint64 last_period;         /* start of the last checkpoint's period */
+} HistoryCompactor;
+
+#define DEFAULT_COMPACT_HOURLY_DAYS 7
+
+void
+history_compactor_init (HistoryCompactor *compactor);
+
+/* Returns TRUE if the tree of the commit made at @ctime is kept. */
+gboolean
+history_compactor_keep (HistoryCompactor *compactor, gint64 ctime);
+
+#endif
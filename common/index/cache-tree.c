@@ -111,7 +111,6 @@ inline struct cache_tree_sub *cache_tree_find_subtree(struct cache_tree *it,
     return find_subtree(it, path, pathlen, create);
 }
 
-#if 0
 struct cache_tree_sub *cache_tree_sub(struct cache_tree *it, const char *path)
 {
     int pathlen = strlen(path);
@@ -164,7 +163,6 @@ void cache_tree_invalidate_path(struct cache_tree *it, const char *path)
     if (down)
         cache_tree_invalidate_path(down->cache_tree, slash + 1);
 }
-#endif
 
 static int verify_cache(struct cache_entry **cache,
                         int entries)
@@ -255,6 +253,30 @@ int cache_tree_fully_valid(struct cache_tree *it)
 }
 #endif
 
+static int in_dir(struct cache_entry *ce, const char *base, int baselen)
+{
+    return ce_namelen(ce) > baselen && !memcmp(ce->name, base, baselen);
+}
+
+/*
+ * A valid tree read from the index must still cover exactly the entries
+ * under @base, otherwise it's rebuilt.
+ */
+static int covers_entries(struct cache_tree *it,
+                          struct cache_entry **cache,
+                          int entries,
+                          const char *base,
+                          int baselen)
+{
+    int n = it->entry_count;
+
+    if (!baselen)
+        return n == entries;
+    if (n <= 0 || n > entries || !in_dir(cache[n - 1], base, baselen))
+        return 0;
+    return n == entries || !in_dir(cache[n], base, baselen);
+}
+
 static int update_one(struct cache_tree *it,
                       struct cache_entry **cache,
                       int entries,
@@ -266,8 +288,11 @@ static int update_one(struct cache_tree *it,
 {
     int i;
 
-    if (0 <= it->entry_count)
-        return it->entry_count;
+    if (0 <= it->entry_count) {
+        if (covers_entries(it, cache, entries, base, baselen))
+            return it->entry_count;
+        it->entry_count = -1;
+    }
 
     /*
      * We first scan for subtrees and update them; we start by
@@ -344,11 +369,25 @@ int cache_tree_update(struct cache_tree *it,
     return 0;
 }
 
-#if 0
-static void write_one(struct strbuf *buffer, struct cache_tree *it,
+struct tree_buf {
+    char *buf;
+    size_t len, alloc;
+};
+
+static void tree_buf_add(struct tree_buf *sb, const void *data, size_t len)
+{
+    if (!len)
+        return;
+    ALLOC_GROW(sb->buf, sb->len + len, sb->alloc);
+    memcpy(sb->buf + sb->len, data, len);
+    sb->len += len;
+}
+
+static void write_one(struct tree_buf *buffer, struct cache_tree *it,
                       const char *path, int pathlen)
 {
-    int i;
+    char counts[32];
+    int i, n;
 
     /* One "cache-tree" entry consists of the following:
      * path (NUL terminated)
@@ -356,38 +395,28 @@ static void write_one(struct strbuf *buffer, struct cache_tree *it,
      * tree-sha1 (missing if invalid)
      * subtree_nr "cache-tree" entries for subtrees.
      */
-    strbuf_grow(buffer, pathlen + 100);
-    strbuf_add(buffer, path, pathlen);
-    strbuf_addf(buffer, "%c%d %d\n", 0, it->entry_count, it->subtree_nr);
+    tree_buf_add(buffer, path, pathlen);
+    n = snprintf(counts, sizeof(counts), "%c%d %d\n", 0,
+                 it->entry_count, it->subtree_nr);
+    tree_buf_add(buffer, counts, n);
 
-#if DEBUG
     if (0 <= it->entry_count)
-        fprintf(stderr, "cache-tree <%.*s> (%d ent, %d subtree) %s\n",
-                pathlen, path, it->entry_count, it->subtree_nr,
-                sha1_to_hex(it->sha1));
-    else
-        fprintf(stderr, "cache-tree <%.*s> (%d subtree) invalid\n",
-                pathlen, path, it->subtree_nr);
-#endif
+        tree_buf_add(buffer, it->sha1, 20);
 
-    if (0 <= it->entry_count) {
-        strbuf_add(buffer, it->sha1, 20);
-    }
     for (i = 0; i < it->subtree_nr; i++) {
         struct cache_tree_sub *down = it->down[i];
-        if (i) {
-            struct cache_tree_sub *prev = it->down[i-1];
-            if (subtree_name_cmp(down->name, down->namelen,
-                                 prev->name, prev->namelen) <= 0)
-                die("fatal - unsorted cache subtree");
-        }
         write_one(buffer, down->cache_tree, down->name, down->namelen);
     }
 }
 
-void cache_tree_write(struct strbuf *sb, struct cache_tree *root)
+void *cache_tree_write(struct cache_tree *root, size_t *size)
 {
-    write_one(sb, root, "", 0);
+    struct tree_buf sb;
+
+    memset(&sb, 0, sizeof(sb));
+    write_one(&sb, root, "", 0);
+    *size = sb.len;
+    return sb.buf;
 }
 
 static struct cache_tree *read_one(const char **buffer, unsigned long *size_p)
@@ -410,13 +439,16 @@ static struct cache_tree *read_one(const char **buffer, unsigned long *size_p)
     buf++; size--;
     it = cache_tree();
 
+    /* The counts end with a newline, which stops strtol(). */
+    if (!memchr(buf, '\n', size))
+        goto free_return;
     cp = buf;
     it->entry_count = strtol(cp, &ep, 10);
     if (cp == ep)
         goto free_return;
     cp = ep;
     subtree_nr = strtol(cp, &ep, 10);
-    if (cp == ep)
+    if (cp == ep || subtree_nr < 0)
         goto free_return;
     while (size && *buf && *buf != '\n') {
         size--;
@@ -433,23 +465,6 @@ static struct cache_tree *read_one(const char **buffer, unsigned long *size_p)
         size -= 20;
     }
 
-#if DEBUG
-    if (0 <= it->entry_count)
-        fprintf(stderr, "cache-tree <%s> (%d ent, %d subtree) %s\n",
-                *buffer, it->entry_count, subtree_nr,
-                sha1_to_hex(it->sha1));
-    else
-        fprintf(stderr, "cache-tree <%s> (%d subtrees) invalid\n",
-                *buffer, subtree_nr);
-#endif
-
-    /*
-     * Just a heuristic -- we do not add directories that often but
-     * we do not want to have to extend it immediately when we do,
-     * hence +2.
-     */
-    it->subtree_alloc = subtree_nr + 2;
-    it->down = xcalloc(it->subtree_alloc, sizeof(struct cache_tree_sub *));
     for (i = 0; i < subtree_nr; i++) {
         /* read each subtree */
         struct cache_tree *sub;
@@ -460,10 +475,13 @@ static struct cache_tree *read_one(const char **buffer, unsigned long *size_p)
         if (!sub)
             goto free_return;
         subtree = cache_tree_sub(it, name);
+        if (subtree->cache_tree) {
+            /* Duplicate name. */
+            cache_tree_free(&sub);
+            goto free_return;
+        }
         subtree->cache_tree = sub;
     }
-    if (subtree_nr != it->subtree_nr)
-        die("cache-tree: internal error");
     *buffer = buf;
     *size_p = size;
     return it;
@@ -475,11 +493,12 @@ free_return:
 
 struct cache_tree *cache_tree_read(const char *buffer, unsigned long size)
 {
-    if (buffer[0])
+    if (!size || buffer[0])
         return NULL; /* not the whole tree */
     return read_one(&buffer, &size);
 }
 
+#if 0
 static struct cache_tree *cache_tree_find(struct cache_tree *it, const char *path)
 {
     if (!it)
@@ -29,8 +29,12 @@ void cache_tree_free(struct cache_tree **);
 void cache_tree_invalidate_path(struct cache_tree *, const char *);
 struct cache_tree_sub *cache_tree_sub(struct cache_tree *, const char *);
 
-/* void cache_tree_write(struct strbuf *, struct cache_tree *root); */
-/* struct cache_tree *cache_tree_read(const char *buffer, unsigned long size); */
+/*
+ * The cache-tree is kept in the "TREE" index extension, in the format
+ * git uses. Returns a malloc'ed buffer of *@size bytes.
+ */
+void *cache_tree_write(struct cache_tree *root, size_t *size);
+struct cache_tree *cache_tree_read(const char *buffer, unsigned long size);
 
 int cache_tree_fully_valid(struct cache_tree *);
 int cache_tree_update(struct cache_tree *, struct cache_entry **, int, int, int, CommitCB);
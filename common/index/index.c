@@ -11,6 +11,7 @@
 #endif
 
 #include "index.h"
+#include "cache-tree.h"
 #include "../seafile-crypt.h"
 /* #include "../vc-utils.h" */
 /* #include "cache-tree.h" */
@@ -18,6 +19,7 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <openssl/sha.h>
+#include "../cdc/seaf-sha1.h"
 
 #ifdef WIN32
 
@@ -157,28 +159,36 @@ static void replace_index_entry(struct index_state *istate, int nr, struct cache
 {
     struct cache_entry *old = istate->cache[nr];
 
+    if (old->ce_mode != ce->ce_mode || hashcmp(old->sha1, ce->sha1))
+        cache_tree_invalidate_path(istate->cache_tree, ce->name);
     remove_name_hash(old);
     set_index_entry(istate, nr, ce);
     istate->cache_changed = 1;
 }
 
-static int verify_hdr(struct cache_header *hdr, unsigned long size)
+static int verify_sha1_trailer(void *data, unsigned long size)
 {
-    SHA_CTX c;
+    SeafSHA1Ctx c;
     unsigned char sha1[20];
 
+    seaf_sha1_init(&c);
+    seaf_sha1_update(&c, data, size - 20);
+    seaf_sha1_final(sha1, &c);
+    return hashcmp(sha1, (unsigned char *)data + size - 20) ? -1 : 0;
+}
+
+static int verify_hdr(struct cache_header *hdr, unsigned long size)
+{
     if (hdr->hdr_signature != htonl(CACHE_SIGNATURE)) {
         g_critical("bad signature");
         return -1;
     }
-    if (hdr->hdr_version != htonl(2) && hdr->hdr_version != htonl(3)) {
+    if (ntohl(hdr->hdr_version) < INDEX_FORMAT_LB ||
+        ntohl(hdr->hdr_version) > INDEX_FORMAT_UB) {
         g_critical("bad index version");
         return -1;
     }
-    SHA1_Init(&c);
-    SHA1_Update(&c, hdr, size - 20);
-    SHA1_Final(sha1, &c);
-    if (hashcmp(sha1, (unsigned char *)hdr + size - 20)) {
+    if (verify_sha1_trailer(hdr, size) < 0) {
         g_critical("bad index file sha1 signature");
         return -1;
     }
@@ -199,16 +209,115 @@ static inline size_t estimate_cache_size(size_t ondisk_size, unsigned int entrie
     return ondisk_size + entries*per_entry;
 }
 
-static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_entry **ce)
+static int encode_varint(uint64_t value, unsigned char *buf)
 {
-    size_t len;
-    const char *name;
-    unsigned int flags = 0;
-    struct cache_entry *ret;
+    unsigned char varint[16];
+    unsigned pos = sizeof(varint) - 1;
+
+    varint[pos] = value & 127;
+    while (value >>= 7)
+        varint[--pos] = 128 | (--value & 127);
+    memcpy(buf, varint + pos, sizeof(varint) - pos);
+    return sizeof(varint) - pos;
+}
+
+static int decode_varint(const unsigned char **bufp, const unsigned char *end,
+                         uint64_t *ret)
+{
+    const unsigned char *buf = *bufp;
+    unsigned char c;
+    uint64_t val;
+    int n = 0;
+
+    if (buf >= end)
+        return -1;
+    c = *buf++;
+    val = c & 127;
+    while (c & 128) {
+        if (buf >= end || ++n > 9)
+            return -1;
+        val += 1;
+        c = *buf++;
+        val = (val << 7) + (c & 127);
+    }
+    *bufp = buf;
+    *ret = val;
+    return 0;
+}
+
+static inline size_t ondisk_fixed_size(unsigned int flags)
+{
+    return (flags & CE_EXTENDED) ?
+        offsetof(struct ondisk_cache_entry_extended, name) :
+        offsetof(struct ondisk_cache_entry, name);
+}
+
+/* Where the name of an on-disk entry is and how long it is. */
+typedef struct {
+    size_t ondisk_size;
+    size_t len;             /* full name length */
+    const char *suffix;     /* name bytes stored in this entry */
+    size_t suffix_len;
+} OndiskName;
+
+static int parse_ondisk_entry(unsigned int version, const char *buf,
+                              size_t avail, size_t prev_len, OndiskName *n)
+{
+    struct ondisk_cache_entry *ondisk = (struct ondisk_cache_entry *)buf;
+    unsigned int flags;
+    size_t fixed;
+    const char *nul;
 
+    if (avail < offsetof(struct ondisk_cache_entry, name))
+        return -1;
     flags = ntohs(ondisk->flags);
+    fixed = ondisk_fixed_size(flags);
+    if (avail <= fixed)
+        return -1;
+
+    if (version < 4) {
+        nul = memchr(buf + fixed, 0, avail - fixed);
+        if (!nul)
+            return -1;
+        n->suffix = buf + fixed;
+        n->suffix_len = nul - n->suffix;
+        n->len = n->suffix_len;
+        n->ondisk_size = (flags & CE_EXTENDED) ?
+            ondisk_cache_entry_extended_size(n->len) :
+            ondisk_cache_entry_size(n->len);
+        if (n->ondisk_size > avail)
+            return -1;
+    } else {
+        const unsigned char *p = (const unsigned char *)buf + fixed;
+        uint64_t strip;
+
+        if (decode_varint(&p, (const unsigned char *)buf + avail, &strip) < 0 ||
+            strip > prev_len)
+            return -1;
+        nul = memchr(p, 0, buf + avail - (const char *)p);
+        if (!nul)
+            return -1;
+        n->suffix = (const char *)p;
+        n->suffix_len = nul - n->suffix;
+        n->len = prev_len - strip + n->suffix_len;
+        n->ondisk_size = nul + 1 - buf;
+    }
 
-    len = flags & CE_NAMEMASK;
+    if ((flags & CE_NAMEMASK) != MIN(n->len, CE_NAMEMASK))
+        return -1;
+
+    return 0;
+}
+
+static int convert_from_disk(struct ondisk_cache_entry *ondisk,
+                             const OndiskName *n,
+                             const struct cache_entry *prev,
+                             struct cache_entry *ret)
+{
+    unsigned int flags = 0;
+    size_t keep;
+
+    flags = ntohs(ondisk->flags);
 
     if (flags & CE_EXTENDED) {
         struct ondisk_cache_entry_extended *ondisk2;
@@ -221,15 +330,7 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
             return -1;
         }
         flags |= extended_flags;
-        name = ondisk2->name;
     }
-    else
-        name = ondisk->name;
-
-    if (len == CE_NAMEMASK)
-        len = strlen(name);
-
-    ret = calloc(1, cache_entry_size(len));
 
     ret->ce_ctime.sec = ntohl(ondisk->ctime.sec);
     ret->ce_mtime.sec = ntohl(ondisk->mtime.sec);
@@ -246,39 +347,555 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
 
     hashcpy(ret->sha1, ondisk->sha1);
 
-    /*
-     * NEEDSWORK: If the original index is crafted, this copy could
-     * go unchecked.
-     */
-    memcpy(ret->name, name, len + 1);
-
-    *ce = ret;
+    /* In version 4 the name starts with a prefix of the previous one. */
+    keep = n->len - n->suffix_len;
+    if (keep)
+        memcpy(ret->name, prev->name, keep);
+    memcpy(ret->name + keep, n->suffix, n->suffix_len + 1);
 
     return 0;
 }
 
-#if 0
-static int read_index_extension(struct index_state *istate,
-                                const char *ext, void *data, unsigned long sz)
+const void *index_get_extension(const struct index_state *istate,
+                                unsigned int sig, size_t *len)
 {
-    switch (CACHE_EXT(ext)) {
-    case CACHE_EXT_TREE:
-        istate->cache_tree = cache_tree_read(data, sz);
-        break;
-    case CACHE_EXT_RESOLVE_UNDO:
-        /* istate->resolve_undo = resolve_undo_read(data, sz); */
-        break;
-    default:
-        /* if (*ext < 'A' || 'Z' < *ext) */
-        /*     return error("index uses %.4s extension, which we do not understand", */
-        /*              ext); */
-        /* fprintf(stderr, "ignoring %.4s extension\n", ext); */
-        g_critical("unknown extension.");
-        break;
+    unsigned int i;
+
+    for (i = 0; i < istate->extensions_nr; i++) {
+        if (istate->extensions[i].sig == sig) {
+            *len = istate->extensions[i].len;
+            return istate->extensions[i].data;
+        }
+    }
+    return NULL;
+}
+
+static void store_index_extension(struct index_state *istate, unsigned int sig,
+                                  void *data, size_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < istate->extensions_nr; i++) {
+        if (istate->extensions[i].sig != sig)
+            continue;
+        free(istate->extensions[i].data);
+        if (data) {
+            istate->extensions[i].data = data;
+            istate->extensions[i].len = len;
+        } else {
+            istate->extensions_nr--;
+            memmove(istate->extensions + i, istate->extensions + i + 1,
+                    (istate->extensions_nr - i) * sizeof(struct index_extension));
+        }
+        return;
+    }
+
+    if (!data)
+        return;
+    istate->extensions = realloc(istate->extensions,
+                                 (istate->extensions_nr + 1) *
+                                 sizeof(struct index_extension));
+    istate->extensions[istate->extensions_nr].sig = sig;
+    istate->extensions[istate->extensions_nr].data = data;
+    istate->extensions[istate->extensions_nr].len = len;
+    istate->extensions_nr++;
+}
+
+void index_set_extension(struct index_state *istate, unsigned int sig,
+                         void *data, size_t len)
+{
+    store_index_extension(istate, sig, data, len);
+    istate->extensions_changed = 1;
+}
+
+static void free_index_extensions(struct index_state *istate)
+{
+    unsigned int i;
+
+    for (i = 0; i < istate->extensions_nr; i++)
+        free(istate->extensions[i].data);
+    free(istate->extensions);
+    istate->extensions = NULL;
+    istate->extensions_nr = 0;
+}
+
+/* Load the extensions in @mm between @offset and @end. */
+static int read_index_extensions(struct index_state *istate, const char *mm,
+                                 size_t offset, size_t end)
+{
+    while (offset < end) {
+        uint32_t sig, extsize;
+        void *data;
+
+        if (end - offset < 8)
+            return -1;
+        memcpy(&sig, mm + offset, 4);
+        memcpy(&extsize, mm + offset + 4, 4);
+        sig = ntohl(sig);
+        extsize = ntohl(extsize);
+        offset += 8;
+        if (extsize > end - offset)
+            return -1;
+
+        data = malloc(extsize ? extsize : 1);
+        memcpy(data, mm + offset, extsize);
+        store_index_extension(istate, sig, data, extsize);
+        offset += extsize;
     }
     return 0;
 }
-#endif
+
+/*
+ * The "BLKS" extension is a version and a count, then for every file
+ * its NUL-terminated name, its id, the number of blocks and their
+ * sizes, all 4-byte numbers in network order. It's parsed on first use.
+ * Rows that no longer match an entry are dropped when writing.
+ */
+#define BLOCKS_EXT_VERSION 1
+
+static void free_blocks(struct index_state *istate)
+{
+    unsigned int i;
+
+    for (i = 0; i < istate->blocks_nr; i++)
+        free(istate->blocks[i]);
+    free(istate->blocks);
+    istate->blocks = NULL;
+    istate->blocks_nr = istate->blocks_alloc = 0;
+    istate->blocks_loaded = 0;
+    istate->blocks_changed = 0;
+}
+
+/* The name and sizes are stored in the same allocation. */
+static struct ce_blocks *new_ce_blocks(const char *name, int namelen,
+                                       const unsigned char *sha1,
+                                       uint32_t n_blocks)
+{
+    struct ce_blocks *b;
+
+    b = malloc(sizeof(*b) + n_blocks * sizeof(uint32_t) + namelen + 1);
+    b->sizes = (uint32_t *)(b + 1);
+    b->name = (char *)(b->sizes + n_blocks);
+    memcpy(b->name, name, namelen);
+    b->name[namelen] = 0;
+    hashcpy(b->sha1, sha1);
+    b->n_blocks = n_blocks;
+    return b;
+}
+
+/* Returns the position of @name, or -pos-1 where it would be inserted. */
+static int blocks_pos(struct index_state *istate, const char *name)
+{
+    int first = 0, last = istate->blocks_nr;
+
+    while (last > first) {
+        int next = (last + first) >> 1;
+        int cmp = strcmp(name, istate->blocks[next]->name);
+        if (!cmp)
+            return next;
+        if (cmp < 0) {
+            last = next;
+            continue;
+        }
+        first = next + 1;
+    }
+    return -first - 1;
+}
+
+static void load_blocks(struct index_state *istate)
+{
+    const unsigned char *p, *end, *nul;
+    size_t len;
+    uint32_t version, count, i, j, n_blocks;
+    struct ce_blocks *b;
+
+    if (istate->blocks_loaded)
+        return;
+    istate->blocks_loaded = 1;
+
+    p = index_get_extension(istate, CACHE_EXT_BLOCKS, &len);
+    if (!p)
+        return;
+    end = p + len;
+
+    if (len < 8)
+        goto bad;
+    memcpy(&version, p, 4);
+    memcpy(&count, p + 4, 4);
+    if (ntohl(version) != BLOCKS_EXT_VERSION)
+        goto bad;
+    count = ntohl(count);
+    p += 8;
+
+    for (i = 0; i < count; i++) {
+        nul = memchr(p, 0, end - p);
+        if (!nul || end - (nul + 1) < 24)
+            goto bad;
+        memcpy(&n_blocks, nul + 21, 4);
+        n_blocks = ntohl(n_blocks);
+        if ((end - (nul + 25)) / 4 < n_blocks)
+            goto bad;
+
+        b = new_ce_blocks((const char *)p, nul - p, nul + 1, n_blocks);
+        p = nul + 25;
+        for (j = 0; j < n_blocks; j++, p += 4) {
+            memcpy(&b->sizes[j], p, 4);
+            b->sizes[j] = ntohl(b->sizes[j]);
+        }
+
+        /* Written in name order. */
+        if (istate->blocks_nr &&
+            strcmp(istate->blocks[istate->blocks_nr - 1]->name, b->name) >= 0) {
+            free(b);
+            goto bad;
+        }
+        ALLOC_GROW(istate->blocks, istate->blocks_nr + 1, istate->blocks_alloc);
+        istate->blocks[istate->blocks_nr++] = b;
+    }
+    return;
+
+bad:
+    g_warning("Bad block sizes extension in index, ignored.\n");
+    free_blocks(istate);
+    istate->blocks_loaded = 1;
+}
+
+const struct ce_blocks *index_get_blocks(struct index_state *istate,
+                                         const struct cache_entry *ce)
+{
+    int pos;
+
+    load_blocks(istate);
+    pos = blocks_pos(istate, ce->name);
+    if (pos < 0 || hashcmp(istate->blocks[pos]->sha1, ce->sha1) != 0)
+        return NULL;
+    return istate->blocks[pos];
+}
+
+void index_set_blocks(struct index_state *istate, const char *name,
+                      const unsigned char *sha1,
+                      const uint32_t *sizes, uint32_t n_blocks)
+{
+    struct ce_blocks *b = NULL;
+    int pos;
+
+    load_blocks(istate);
+    if (n_blocks > 1) {
+        b = new_ce_blocks(name, strlen(name), sha1, n_blocks);
+        memcpy(b->sizes, sizes, n_blocks * sizeof(uint32_t));
+    }
+
+    pos = blocks_pos(istate, name);
+    if (pos >= 0) {
+        free(istate->blocks[pos]);
+        if (b)
+            istate->blocks[pos] = b;
+        else {
+            istate->blocks_nr--;
+            memmove(istate->blocks + pos, istate->blocks + pos + 1,
+                    (istate->blocks_nr - pos) * sizeof(struct ce_blocks *));
+        }
+    } else if (b) {
+        pos = -pos - 1;
+        ALLOC_GROW(istate->blocks, istate->blocks_nr + 1, istate->blocks_alloc);
+        memmove(istate->blocks + pos + 1, istate->blocks + pos,
+                (istate->blocks_nr - pos) * sizeof(struct ce_blocks *));
+        istate->blocks[pos] = b;
+        istate->blocks_nr++;
+    } else
+        return;
+
+    istate->blocks_changed = 1;
+    istate->extensions_changed = 1;
+}
+
+static void append_be32(unsigned char **p, uint32_t val)
+{
+    val = htonl(val);
+    memcpy(*p, &val, 4);
+    *p += 4;
+}
+
+/* Turn the changed block sizes back into the extension. */
+static void store_blocks(struct index_state *istate)
+{
+    unsigned char *data, *p;
+    struct cache_entry *ce;
+    struct ce_blocks *b;
+    size_t size = 8;
+    uint32_t count = 0, i, j;
+
+    if (!istate->blocks_changed)
+        return;
+
+    /* Drop the sizes of removed or changed files. */
+    for (i = 0, j = 0; i < istate->blocks_nr; i++) {
+        b = istate->blocks[i];
+        ce = index_name_exists(istate, b->name, strlen(b->name), 0);
+        if (!ce || ce_stage(ce) || (ce->ce_flags & CE_REMOVE) ||
+            hashcmp(ce->sha1, b->sha1) != 0) {
+            free(b);
+            continue;
+        }
+        istate->blocks[j++] = b;
+        size += strlen(b->name) + 1 + 24 + b->n_blocks * 4;
+        count++;
+    }
+    istate->blocks_nr = j;
+    istate->blocks_changed = 0;
+
+    if (!count) {
+        store_index_extension(istate, CACHE_EXT_BLOCKS, NULL, 0);
+        return;
+    }
+
+    p = data = malloc(size);
+    append_be32(&p, BLOCKS_EXT_VERSION);
+    append_be32(&p, count);
+    for (i = 0; i < istate->blocks_nr; i++) {
+        b = istate->blocks[i];
+        memcpy(p, b->name, strlen(b->name) + 1);
+        p += strlen(b->name) + 1;
+        memcpy(p, b->sha1, 20);
+        p += 20;
+        append_be32(&p, b->n_blocks);
+        for (j = 0; j < b->n_blocks; j++)
+            append_be32(&p, b->sizes[j]);
+    }
+    store_index_extension(istate, CACHE_EXT_BLOCKS, data, size);
+}
+
+static void load_cache_tree(struct index_state *istate)
+{
+    const void *data;
+    size_t len;
+
+    data = index_get_extension(istate, CACHE_EXT_TREE, &len);
+    if (!data)
+        return;
+    istate->cache_tree = cache_tree_read(data, len);
+    if (!istate->cache_tree)
+        g_warning("Bad cache tree in index, ignored.\n");
+    store_index_extension(istate, CACHE_EXT_TREE, NULL, 0);
+}
+
+static void store_cache_tree(struct index_state *istate)
+{
+    void *data;
+    size_t len;
+    int i;
+
+    if (!istate->cache_tree) {
+        store_index_extension(istate, CACHE_EXT_TREE, NULL, 0);
+        return;
+    }
+
+    /* Removed entries are still counted by the dirs they were in. */
+    for (i = 0; i < istate->cache_nr; i++) {
+        if (istate->cache[i]->ce_flags & CE_REMOVE)
+            cache_tree_invalidate_path(istate->cache_tree,
+                                       istate->cache[i]->name);
+    }
+
+    data = cache_tree_write(istate->cache_tree, &len);
+    store_index_extension(istate, CACHE_EXT_TREE, data, len);
+}
+
+/* The cache-tree isn't copied, it doesn't match the new entries. */
+void copy_index_extensions(struct index_state *dst, struct index_state *src)
+{
+    unsigned int i;
+    void *data;
+
+    store_blocks(src);
+    for (i = 0; i < src->extensions_nr; i++) {
+        struct index_extension *ext = &src->extensions[i];
+
+        if (ext->sig == CACHE_EXT_TREE)
+            continue;
+
+        data = malloc(ext->len ? ext->len : 1);
+        memcpy(data, ext->data, ext->len);
+        store_index_extension(dst, ext->sig, data, ext->len);
+    }
+}
+
+typedef struct {
+    unsigned int flags;
+    const char *name;
+} RemovedName;
+
+/*
+ * Merge the delta file of the index at @path into @istate, whose entries
+ * haven't been hashed yet. A delta written for another base is ignored.
+ */
+static int read_index_delta(struct index_state *istate, const char *path,
+                            const unsigned char *base_sha1)
+{
+    char delta_path[PATH_MAX];
+    int fd;
+    struct stat st;
+    struct delta_header *hdr;
+    void *mm;
+    size_t mmap_size, offset, end, prev_len = 0;
+    unsigned int version, nr, n_removed, i, j, k, m, n_entries = 0;
+    struct cache_entry **entries = NULL, **merged, *prev = NULL;
+    RemovedName *removed = NULL;
+    OndiskName n;
+    int cmp, ret = -1;
+
+    snprintf(delta_path, PATH_MAX, "%s%s", path, INDEX_DELTA_SUFFIX);
+    fd = g_open(delta_path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        g_critical("index delta open failed");
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        g_critical("cannot stat the open index delta");
+        close(fd);
+        return -1;
+    }
+
+    mmap_size = (size_t)st.st_size;
+    if (mmap_size < sizeof(struct delta_header) + 20) {
+        g_critical("index delta smaller than expected");
+        close(fd);
+        return -1;
+    }
+
+    mm = mmap(NULL, mmap_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mm == MAP_FAILED) {
+        g_critical("unable to map index delta");
+        return -1;
+    }
+
+    hdr = mm;
+    version = ntohl(hdr->hdr_version);
+    if (hdr->hdr_signature != htonl(DELTA_SIGNATURE) ||
+        version < INDEX_FORMAT_LB || version > INDEX_FORMAT_UB ||
+        verify_sha1_trailer(mm, mmap_size) < 0) {
+        g_critical("bad index delta");
+        goto out;
+    }
+
+    /* Left behind when the base was rewritten. */
+    if (hashcmp(hdr->base_sha1, base_sha1) != 0) {
+        ret = 0;
+        goto out;
+    }
+
+    nr = ntohl(hdr->hdr_entries);
+    n_removed = ntohl(hdr->hdr_removed);
+    end = mmap_size - 20;
+    offset = sizeof(*hdr);
+
+    /* Each entry or name takes at least 3 bytes. */
+    if ((uint64_t)nr + n_removed > end / 3)
+        goto corrupt;
+
+    entries = calloc(nr + 1, sizeof(struct cache_entry *));
+    for (i = 0; i < nr; i++) {
+        struct ondisk_cache_entry *disk_ce;
+        struct cache_entry *ce;
+
+        disk_ce = (struct ondisk_cache_entry *)((char *)mm + offset);
+        if (offset >= end ||
+            parse_ondisk_entry(version, (char *)disk_ce, end - offset,
+                               prev_len, &n) < 0)
+            goto corrupt;
+
+        ce = calloc(1, cache_entry_size(n.len));
+        entries[n_entries++] = ce;
+        if (convert_from_disk(disk_ce, &n, prev, ce) < 0)
+            goto corrupt;
+
+        offset += n.ondisk_size;
+        prev_len = n.len;
+        prev = ce;
+    }
+
+    removed = calloc(n_removed + 1, sizeof(RemovedName));
+    for (k = 0; k < n_removed; k++) {
+        unsigned short flags;
+        const char *nul;
+
+        if (end - offset < 3)
+            goto corrupt;
+        memcpy(&flags, (char *)mm + offset, 2);
+        removed[k].flags = ntohs(flags);
+        removed[k].name = (char *)mm + offset + 2;
+        nul = memchr(removed[k].name, 0, end - offset - 2);
+        if (!nul)
+            goto corrupt;
+        offset = nul + 1 - (char *)mm;
+    }
+
+    free_index_extensions(istate);
+    if (read_index_extensions(istate, mm, offset, end) < 0)
+        goto corrupt;
+
+    merged = calloc(alloc_nr(istate->cache_nr + nr),
+                    sizeof(struct cache_entry *));
+    for (i = j = k = m = 0; i < istate->cache_nr; i++) {
+        struct cache_entry *ce = istate->cache[i];
+
+        cmp = 1;
+        while (j < nr) {
+            cmp = cache_name_compare(entries[j]->name, entries[j]->ce_flags,
+                                     ce->name, ce->ce_flags);
+            if (cmp >= 0)
+                break;
+            merged[m++] = entries[j++];
+        }
+        /* Changed entries replace the base ones. */
+        if (j < nr && cmp == 0) {
+            merged[m++] = entries[j++];
+            continue;
+        }
+
+        cmp = 1;
+        while (k < n_removed) {
+            cmp = cache_name_compare(removed[k].name, removed[k].flags,
+                                     ce->name, ce->ce_flags);
+            if (cmp >= 0)
+                break;
+            k++;
+        }
+        if (k < n_removed && cmp == 0) {
+            k++;
+            continue;
+        }
+
+        merged[m++] = ce;
+    }
+    while (j < nr)
+        merged[m++] = entries[j++];
+
+    free(istate->cache);
+    istate->cache = merged;
+    istate->cache_nr = m;
+    istate->cache_alloc = alloc_nr(istate->cache_nr + nr);
+    if (st.st_mtime > istate->timestamp.sec)
+        istate->timestamp.sec = st.st_mtime;
+
+    n_entries = 0;
+    ret = 0;
+    goto out;
+
+corrupt:
+    g_critical("index delta corrupt");
+out:
+    for (i = 0; i < n_entries; i++)
+        free(entries[i]);
+    free(entries);
+    free(removed);
+    munmap(mm, mmap_size);
+    return ret;
+}
 
 /* remember to discard_cache() before reading a different cache! */
 int read_index_from(struct index_state *istate, const char *path)
@@ -288,7 +905,10 @@ int read_index_from(struct index_state *istate, const char *path)
     unsigned long src_offset, dst_offset;
     struct cache_header *hdr;
     void *mm;
-    size_t mmap_size;
+    size_t mmap_size, entries_end, prev_len;
+    unsigned int version, nr;
+    OndiskName n;
+    struct cache_entry *prev;
 
     if (istate->initialized)
         return istate->cache_nr;
@@ -325,61 +945,72 @@ int read_index_from(struct index_state *istate, const char *path)
     if (verify_hdr(hdr, mmap_size) < 0)
         goto unmap;
 
-    istate->cache_nr = ntohl(hdr->hdr_entries);
-    istate->cache_alloc = alloc_nr(istate->cache_nr);
-    istate->cache = calloc(istate->cache_alloc, sizeof(struct cache_entry *));
+    version = ntohl(hdr->hdr_version);
+    nr = ntohl(hdr->hdr_entries);
+    entries_end = mmap_size - 20;
 
     /*
-     * The disk format is actually larger than the in-memory format,
-     * due to space for nsec etc, so even though the in-memory one
-     * has room for a few  more flags, we can allocate using the same
-     * index size
+     * Check all the entries and size the in-memory block first, so
+     * that the entries can be loaded into a single allocation.
      */
-    /* istate->alloc = malloc(estimate_cache_size(mmap_size, istate->cache_nr)); */
+    src_offset = sizeof(*hdr);
+    dst_offset = 0;
+    prev_len = 0;
+    for (i = 0; i < nr; i++) {
+        if (src_offset >= entries_end ||
+            parse_ondisk_entry(version, (char *)mm + src_offset,
+                               entries_end - src_offset, prev_len, &n) < 0)
+            goto unmap;
+        src_offset += n.ondisk_size;
+        dst_offset += cache_entry_size(n.len);
+        prev_len = n.len;
+    }
+
+    istate->cache_nr = nr;
+    istate->cache_alloc = alloc_nr(istate->cache_nr);
+    istate->cache = calloc(istate->cache_alloc, sizeof(struct cache_entry *));
+    if (dst_offset > 0)
+        istate->alloc = calloc(1, dst_offset);
+    istate->alloc_size = dst_offset;
     istate->initialized = 1;
 
     src_offset = sizeof(*hdr);
     dst_offset = 0;
+    prev_len = 0;
+    prev = NULL;
     for (i = 0; i < istate->cache_nr; i++) {
         struct ondisk_cache_entry *disk_ce;
         struct cache_entry *ce;
 
         disk_ce = (struct ondisk_cache_entry *)((char *)mm + src_offset);
-        /* ce = (struct cache_entry *)((char *)istate->alloc + dst_offset); */
+        ce = (struct cache_entry *)((char *)istate->alloc + dst_offset);
 
-        /* allocate each ce separately so that we can free new
-         * entries added by add_index_entry() later.
-         */
-        if (convert_from_disk(disk_ce, &ce) < 0)
-            return -1;
-        set_index_entry(istate, i, ce);
+        parse_ondisk_entry(version, (char *)disk_ce,
+                           entries_end - src_offset, prev_len, &n);
+        if (convert_from_disk(disk_ce, &n, prev, ce) < 0) {
+            istate->cache_nr = i;
+            goto unmap;
+        }
+        istate->cache[i] = ce;
 
-        src_offset += ondisk_ce_size(ce);
-        dst_offset += ce_size(ce);
+        src_offset += n.ondisk_size;
+        dst_offset += cache_entry_size(n.len);
+        prev_len = n.len;
+        prev = ce;
     }
     istate->timestamp.sec = st.st_mtime;
     istate->timestamp.nsec = 0;
 
-#if 0
-    while (src_offset <= mmap_size - 20 - 8) {
-        /* After an array of active_nr index entries,
-         * there can be arbitrary number of extended
-         * sections, each of which is prefixed with
-         * extension name (4-byte) and section length
-         * in 4-byte network byte order.
-         */
-        uint32_t extsize;
-        memcpy(&extsize, (char *)mm + src_offset + 4, 4);
-        extsize = ntohl(extsize);
-        if (read_index_extension(istate,
-                                 (const char *) mm + src_offset,
-                                 (char *) mm + src_offset + 8,
-                                 extsize) < 0)
-            goto unmap;
-        src_offset += 8;
-        src_offset += extsize;
-    }
-#endif
+    if (read_index_extensions(istate, mm, src_offset, entries_end) < 0 ||
+        read_index_delta(istate, path,
+                         (unsigned char *)mm + mmap_size - 20) < 0)
+        goto unmap;
+
+    for (i = 0; i < istate->cache_nr; i++)
+        add_name_hash(istate, istate->cache[i]);
+
+    load_cache_tree(istate);
+
     munmap(mm, mmap_size);
     return istate->cache_nr;
 
@@ -591,6 +1222,11 @@ static int ce_modified_check_fs(struct cache_entry *ce, struct stat *st)
 }
 #endif
 
+int ie_racy_timestamp(const struct index_state *istate, struct cache_entry *ce)
+{
+    return is_racy_timestamp(istate, ce);
+}
+
 int ie_match_stat(const struct index_state *istate,
                   struct cache_entry *ce, struct stat *st,
                   unsigned int options)
@@ -706,12 +1342,25 @@ int index_name_pos(const struct index_state *istate, const char *name, int namel
     return -first-1;
 }
 
+/* Entries loaded by read_index_from() are freed with the whole index. */
+static void free_cache_entry(struct index_state *istate, struct cache_entry *ce)
+{
+    char *p = (char *)ce;
+
+    if (istate->alloc &&
+        p >= (char *)istate->alloc &&
+        p < (char *)istate->alloc + istate->alloc_size)
+        return;
+    free(ce);
+}
+
 /* Remove entry, return true if there are more entries to go.. */
 int remove_index_entry_at(struct index_state *istate, int pos)
 {
     struct cache_entry *ce = istate->cache[pos];
 
     /* record_resolve_undo(istate, ce); */
+    cache_tree_invalidate_path(istate->cache_tree, ce->name);
     remove_name_hash(ce);
     istate->cache_changed = 1;
     istate->cache_nr--;
@@ -735,8 +1384,9 @@ void remove_marked_cache_entries(struct index_state *istate)
 
     for (i = j = 0; i < istate->cache_nr; i++) {
         if (ce_array[i]->ce_flags & CE_REMOVE) {
+            cache_tree_invalidate_path(istate->cache_tree, ce_array[i]->name);
             remove_name_hash(ce_array[i]);
-            free (ce_array[i]);
+            free_cache_entry (istate, ce_array[i]);
         } else {
             ce_array[j++] = ce_array[i];
         }
@@ -750,7 +1400,7 @@ int remove_file_from_index(struct index_state *istate, const char *path)
     int pos = index_name_pos(istate, path, strlen(path));
     if (pos < 0)
         pos = -pos-1;
-    /* cache_tree_invalidate_path(istate->cache_tree, path); */
+    cache_tree_invalidate_path(istate->cache_tree, path);
     while (pos < istate->cache_nr && !strcmp(istate->cache[pos]->name, path))
         remove_index_entry_at(istate, pos);
     return 0;
@@ -922,6 +1572,7 @@ int add_index_entry(struct index_state *istate, struct cache_entry *ce, int opti
     }
 
     /* Add it in.. */
+    cache_tree_invalidate_path(istate->cache_tree, ce->name);
     istate->cache_nr++;
     if (istate->cache_nr > pos + 1)
         memmove(istate->cache + pos + 1,
@@ -938,12 +1589,15 @@ int add_to_index(struct index_state *istate,
                  struct stat *st,
                  int flags,
                  SeafileCrypt *crypt,
+                 int chunker,
                  IndexCB index_cb)
 {
     int size, namelen, was_same;
     mode_t st_mode = st->st_mode;
     struct cache_entry *ce, *alias;
     unsigned char sha1[20];
+    const unsigned char *old_sha1 = NULL;
+    uint32_t *block_sizes = NULL, n_blocks = 0;
     unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
     int add_option = (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE);
 
@@ -965,7 +1619,7 @@ int add_to_index(struct index_state *istate,
 
     ce->ce_mode = create_ce_mode(st_mode);
 
-    alias = index_name_exists(istate, ce->name, ce_namelen(ce), 0);
+    alias = index_name_exists(istate, ce->name, ce_namelen(ce), IGNORE_CASE);
     if (alias && !ce_stage(alias) && !ie_match_stat(istate, alias, st, ce_option)) {
         /* Nothing changed, really */
         free(ce);
@@ -974,8 +1628,33 @@ int add_to_index(struct index_state *istate,
         alias->ce_flags |= CE_ADDED;
         return 0;
     }
-    if (index_cb (full_path, sha1, crypt) < 0)
+    /*
+     * The content of a placeholder is not in the worktree until it's
+     * hydrated. Whatever was written to it is kept aside when it is,
+     * the file's content must not be replaced with it.
+     */
+    if (alias && !ce_stage(alias) && ce_placeholder(alias)) {
+        g_warning("%s was changed before it was hydrated, not adding it\n",
+                  path);
+        free(ce);
+        alias->ce_flags |= CE_ADDED;
+        return 0;
+    }
+    /*
+     * The file was found under a name differing only in case. It's
+     * the same file on this file system, keep the name in the index
+     * instead of adding a second entry.
+     */
+    if (alias && memcmp(alias->name, ce->name, namelen) != 0)
+        memcpy(ce->name, alias->name, namelen);
+    if (alias && !ce_stage(alias) && S_ISREG(alias->ce_mode))
+        old_sha1 = alias->sha1;
+    if (index_cb (full_path, old_sha1,
+                  old_sha1 ? index_get_blocks(istate, alias) : NULL,
+                  sha1, &block_sizes, &n_blocks, crypt, chunker) < 0) {
+        free(ce);
         return -1;
+    }
     memcpy (ce->sha1, sha1, 20);
 
     ce->ce_flags |= CE_ADDED;
@@ -988,8 +1667,11 @@ int add_to_index(struct index_state *istate,
 
     if (add_index_entry(istate, ce, add_option)) {
         g_warning("unable to add %s to index\n",path);
+        free(block_sizes);
         return -1;
     }
+    index_set_blocks(istate, ce->name, sha1, block_sizes, n_blocks);
+    free(block_sizes);
     /* if (!was_same) */
     /*     g_debug("add '%s'\n", path); */
     return 0;
@@ -1154,12 +1836,12 @@ static int type_from_string(const char *str)
 static void hash_sha1_file(const void *buf, unsigned long len,
                            const char *type, unsigned char *sha1)
 {
-    SHA_CTX c;
+    SeafSHA1Ctx c;
 
     /* Sha1.. */
-    SHA1_Init(&c);
-    SHA1_Update(&c, buf, len);
-    SHA1_Final(sha1, &c);
+    seaf_sha1_init(&c);
+    seaf_sha1_update(&c, buf, len);
+    seaf_sha1_final(sha1, &c);
 }
 
 static int index_mem(unsigned char *sha1, void *buf, uint64_t size,
@@ -1243,16 +1925,20 @@ static unsigned long write_buffer_len;
 #define WRITE_BUFFER_SIZE 8192
 
 typedef struct {
-    SHA_CTX context;
+    SeafSHA1Ctx context;
     unsigned char write_buffer[WRITE_BUFFER_SIZE];
     unsigned long write_buffer_len;
+    unsigned int version;
+    /* The last name written, for version 4 prefix compression. */
+    const char *prev_name;
+    size_t prev_len;
 } WriteIndexInfo;
 
 static int ce_write_flush(WriteIndexInfo *info, int fd)
 {
     unsigned int buffered = info->write_buffer_len;
     if (buffered) {
-        SHA1_Update(&info->context, info->write_buffer, buffered);
+        seaf_sha1_update(&info->context, info->write_buffer, buffered);
         if (writen(fd, info->write_buffer, buffered) != buffered)
             return -1;
         info->write_buffer_len = 0;
@@ -1282,16 +1968,29 @@ static int ce_write(WriteIndexInfo *info, int fd, void *data, unsigned int len)
     return 0;
 }
 
-#if 0
-static int write_index_ext_header(SHA_CTX *context, int fd,
+static int write_index_ext_header(WriteIndexInfo *info, int fd,
                                   unsigned int ext, unsigned int sz)
 {
     ext = htonl(ext);
     sz = htonl(sz);
-    return ((ce_write(context, fd, &ext, 4) < 0) ||
-            (ce_write(context, fd, &sz, 4) < 0)) ? -1 : 0;
+    return ((ce_write(info, fd, &ext, 4) < 0) ||
+            (ce_write(info, fd, &sz, 4) < 0)) ? -1 : 0;
+}
+
+static int write_index_extensions(WriteIndexInfo *info, int fd,
+                                  struct index_state *istate)
+{
+    unsigned int i;
+
+    for (i = 0; i < istate->extensions_nr; i++) {
+        struct index_extension *ext = &istate->extensions[i];
+
+        if (write_index_ext_header(info, fd, ext->sig, ext->len) < 0 ||
+            ce_write(info, fd, ext->data, ext->len) < 0)
+            return -1;
+    }
+    return 0;
 }
-#endif
 
 static int ce_flush(WriteIndexInfo *info, int fd)
 {
@@ -1299,7 +1998,7 @@ static int ce_flush(WriteIndexInfo *info, int fd)
 
     if (left) {
         info->write_buffer_len = 0;
-        SHA1_Update(&info->context, info->write_buffer, left);
+        seaf_sha1_update(&info->context, info->write_buffer, left);
     }
 
     /* Flush first if not enough space for SHA1 signature */
@@ -1310,7 +2009,7 @@ static int ce_flush(WriteIndexInfo *info, int fd)
     }
 
     /* Append the SHA1 signature at the end */
-    SHA1_Final(info->write_buffer + left, &info->context);
+    seaf_sha1_final(info->write_buffer + left, &info->context);
     left += 20;
     return (writen(fd, info->write_buffer, left) != left) ? -1 : 0;
 }
@@ -1363,13 +2062,10 @@ static void ce_smudge_racily_clean_entry(struct cache_entry *ce)
     ce->ce_size = 0;
 }
 
-static int ce_write_entry(WriteIndexInfo *info, int fd, struct cache_entry *ce)
+/* Fill the fixed part of @ondisk, return where the name goes. */
+static char *fill_ondisk_entry(struct ondisk_cache_entry *ondisk,
+                               struct cache_entry *ce)
 {
-    int size = ondisk_ce_size(ce);
-    struct ondisk_cache_entry *ondisk = calloc(1, size);
-    char *name;
-    int result;
-
     ondisk->ctime.sec = htonl(ce->ce_ctime.sec);
     ondisk->mtime.sec = htonl(ce->ce_mtime.sec);
     ondisk->ctime.nsec = htonl(ce->ce_ctime.nsec);
@@ -1386,17 +2082,62 @@ static int ce_write_entry(WriteIndexInfo *info, int fd, struct cache_entry *ce)
         struct ondisk_cache_entry_extended *ondisk2;
         ondisk2 = (struct ondisk_cache_entry_extended *)ondisk;
         ondisk2->flags2 = htons((ce->ce_flags & CE_EXTENDED_FLAGS) >> 16);
-        name = ondisk2->name;
+        return ondisk2->name;
     }
-    else
-        name = ondisk->name;
-    memcpy(name, ce->name, ce_namelen(ce));
+    return ondisk->name;
+}
+
+static int ce_write_entry(WriteIndexInfo *info, int fd, struct cache_entry *ce)
+{
+    size_t len = ce_namelen(ce);
+    size_t fixed = ondisk_fixed_size(ce->ce_flags);
+    size_t common = 0, size;
+    struct ondisk_cache_entry *ondisk;
+    char *name;
+    int result;
+
+    if (info->version >= 4) {
+        while (common < len && common < info->prev_len &&
+               ce->name[common] == info->prev_name[common])
+            common++;
+        size = fixed + 16 + (len - common) + 1;
+    } else
+        size = ondisk_ce_size(ce);
+
+    ondisk = calloc(1, size);
+    name = fill_ondisk_entry(ondisk, ce);
+
+    if (info->version >= 4) {
+        int n = encode_varint(info->prev_len - common, (unsigned char *)name);
+        memcpy(name + n, ce->name + common, len - common);
+        size = fixed + n + (len - common) + 1;
+        info->prev_name = ce->name;
+        info->prev_len = len;
+    } else
+        memcpy(name, ce->name, len);
 
     result = ce_write(info, fd, ondisk, size);
     free(ondisk);
     return result;
 }
 
+/* Only entries with on-disk extended flags use the extended format. */
+static int mark_extended_entries(struct index_state *istate)
+{
+    int i, extended = 0;
+
+    for (i = 0; i < istate->cache_nr; i++) {
+        struct cache_entry *ce = istate->cache[i];
+
+        ce->ce_flags &= ~CE_EXTENDED;
+        if (ce->ce_flags & CE_EXTENDED_FLAGS) {
+            extended++;
+            ce->ce_flags |= CE_EXTENDED;
+        }
+    }
+    return extended;
+}
+
 int write_index(struct index_state *istate, int newfd)
 {
     WriteIndexInfo info;
@@ -1408,24 +2149,21 @@ int write_index(struct index_state *istate, int newfd)
 
     memset (&info, 0, sizeof(info));
 
-    for (i = removed = extended = 0; i < entries; i++) {
+    for (i = removed = 0; i < entries; i++) {
         if (cache[i]->ce_flags & CE_REMOVE)
             removed++;
-
-        /* reduce extended entries if possible */
-        /* cache[i]->ce_flags &= ~CE_EXTENDED; */
-        /* if (cache[i]->ce_flags & CE_EXTENDED_FLAGS) { */
-        /*     extended++; */
-        /*     cache[i]->ce_flags |= CE_EXTENDED; */
-        /* } */
     }
+    extended = mark_extended_entries(istate);
 
     hdr.hdr_signature = htonl(CACHE_SIGNATURE);
     /* for extended format, increase version so older git won't try to read it */
-    hdr.hdr_version = htonl(extended ? 3 : 2);
+    info.version = INDEX_FORMAT_DEFAULT;
+    if (info.version < 3 && extended)
+        info.version = 3;
+    hdr.hdr_version = htonl(info.version);
     hdr.hdr_entries = htonl(entries - removed);
 
-    SHA1_Init(&info.context);
+    seaf_sha1_init(&info.context);
     if (ce_write(&info, newfd, &hdr, sizeof(hdr)) < 0)
         return -1;
 
@@ -1439,43 +2177,194 @@ int write_index(struct index_state *istate, int newfd)
             return -1;
     }
 
-#if 0
-    /* Write extension data here */
-    if (istate->cache_tree) {
-        struct strbuf sb = STRBUF_INIT;
-
-        cache_tree_write(&sb, istate->cache_tree);
-        err = write_index_ext_header(&c, newfd, CACHE_EXT_TREE, sb.len) < 0
-            || ce_write(&c, newfd, sb.buf, sb.len) < 0;
-        strbuf_release(&sb);
-        if (err)
-            return -1;
+    store_blocks(istate);
+    store_cache_tree(istate);
+    if (write_index_extensions(&info, newfd, istate) < 0)
+        return -1;
+
+    if (ce_flush(&info, newfd) || fstat(newfd, &st))
+        return -1;
+    istate->timestamp.sec = (unsigned int)st.st_mtime;
+    istate->timestamp.nsec = 0;
+    istate->extensions_changed = 0;
+    return 0;
+}
+
+/* Only split indexes with at least this many entries. */
+#define SPLIT_INDEX_MIN_ENTRIES 10000
+/* Rewrite the base once the delta holds more than 1/N of its entries. */
+#define SPLIT_INDEX_MAX_DELTA_RATIO 10
+
+static int ce_same_as_ondisk(struct cache_entry *ce,
+                             struct ondisk_cache_entry *disk_ce)
+{
+    struct ondisk_cache_entry_extended buf;
+
+    memset(&buf, 0, sizeof(buf));
+    fill_ondisk_entry((struct ondisk_cache_entry *)&buf, ce);
+    return memcmp(&buf, disk_ce, ondisk_fixed_size(ce->ce_flags)) == 0;
+}
+
+int write_index_delta(struct index_state *istate, const char *base_path, int newfd)
+{
+    WriteIndexInfo info;
+    struct delta_header hdr;
+    struct cache_header *base_hdr;
+    int fd;
+    struct stat st;
+    void *mm;
+    size_t mmap_size, offset, end, prev_len = 0, name_alloc = 0;
+    unsigned int version, base_nr, b, i, k, max_delta;
+    unsigned int n_changed = 0, n_removed = 0;
+    struct cache_entry **changed = NULL;
+    RemovedName *removed = NULL;
+    char *name = NULL;
+    OndiskName n;
+    int cmp, ret = 1;
+
+    fd = g_open(base_path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) ||
+        (size_t)st.st_size < sizeof(struct cache_header) + 20) {
+        close(fd);
+        return 1;
     }
-    if (istate->resolve_undo) {
-        struct strbuf sb = STRBUF_INIT;
 
-        resolve_undo_write(&sb, istate->resolve_undo);
-        err = write_index_ext_header(&c, newfd, CACHE_EXT_RESOLVE_UNDO,
-                                     sb.len) < 0
-            || ce_write(&c, newfd, sb.buf, sb.len) < 0;
-        strbuf_release(&sb);
-        if (err)
-            return -1;
+    mmap_size = (size_t)st.st_size;
+    mm = mmap(NULL, mmap_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mm == MAP_FAILED)
+        return 1;
+
+    /* The base was verified when it was read, don't hash it again. */
+    base_hdr = mm;
+    version = ntohl(base_hdr->hdr_version);
+    base_nr = ntohl(base_hdr->hdr_entries);
+    if (base_hdr->hdr_signature != htonl(CACHE_SIGNATURE) ||
+        version < INDEX_FORMAT_LB || version > INDEX_FORMAT_UB ||
+        base_nr < SPLIT_INDEX_MIN_ENTRIES)
+        goto out;
+
+    mark_extended_entries(istate);
+
+    max_delta = base_nr / SPLIT_INDEX_MAX_DELTA_RATIO;
+    changed = malloc((max_delta + 1) * sizeof(struct cache_entry *));
+    removed = calloc(max_delta + 1, sizeof(RemovedName));
+
+    end = mmap_size - 20;
+    offset = sizeof(*base_hdr);
+    for (b = 0, i = 0; b < base_nr; b++) {
+        struct ondisk_cache_entry *disk_ce;
+        unsigned int flags;
+        int matched = 0;
+
+        disk_ce = (struct ondisk_cache_entry *)((char *)mm + offset);
+        if (offset >= end ||
+            parse_ondisk_entry(version, (char *)disk_ce, end - offset,
+                               prev_len, &n) < 0)
+            goto out;
+        if (n.len + 1 > name_alloc) {
+            name_alloc = alloc_nr(n.len + 1);
+            name = realloc(name, name_alloc);
+        }
+        /* The shared prefix is still in the buffer. */
+        memcpy(name + n.len - n.suffix_len, n.suffix, n.suffix_len + 1);
+        flags = ntohs(disk_ce->flags);
+
+        while (i < istate->cache_nr) {
+            struct cache_entry *ce = istate->cache[i];
+
+            if (ce->ce_flags & CE_REMOVE) {
+                i++;
+                continue;
+            }
+            cmp = cache_name_compare(ce->name, ce->ce_flags, name, flags);
+            if (cmp > 0)
+                break;
+            if (cmp < 0 || !ce_same_as_ondisk(ce, disk_ce)) {
+                if (n_changed + n_removed == max_delta)
+                    goto out;
+                changed[n_changed++] = ce;
+            }
+            i++;
+            if (cmp == 0) {
+                matched = 1;
+                break;
+            }
+        }
+
+        if (!matched) {
+            if (n_changed + n_removed == max_delta)
+                goto out;
+            removed[n_removed].flags = flags & (CE_NAMEMASK | CE_STAGEMASK);
+            removed[n_removed++].name = strdup(name);
+        }
+
+        offset += n.ondisk_size;
+        prev_len = n.len;
+    }
+
+    for (; i < istate->cache_nr; i++) {
+        if (istate->cache[i]->ce_flags & CE_REMOVE)
+            continue;
+        if (n_changed + n_removed == max_delta)
+            goto out;
+        changed[n_changed++] = istate->cache[i];
     }
-#endif
 
+    memset(&info, 0, sizeof(info));
+    info.version = INDEX_FORMAT_DEFAULT;
+
+    hdr.hdr_signature = htonl(DELTA_SIGNATURE);
+    hdr.hdr_version = htonl(info.version);
+    hdr.hdr_entries = htonl(n_changed);
+    hdr.hdr_removed = htonl(n_removed);
+    hashcpy(hdr.base_sha1, (unsigned char *)mm + mmap_size - 20);
+
+    ret = -1;
+    seaf_sha1_init(&info.context);
+    if (ce_write(&info, newfd, &hdr, sizeof(hdr)) < 0)
+        goto out;
+    for (k = 0; k < n_changed; k++) {
+        if (ce_write_entry(&info, newfd, changed[k]) < 0)
+            goto out;
+    }
+    for (k = 0; k < n_removed; k++) {
+        unsigned short flags = htons(removed[k].flags);
+
+        if (ce_write(&info, newfd, &flags, 2) < 0 ||
+            ce_write(&info, newfd, (void *)removed[k].name,
+                     strlen(removed[k].name) + 1) < 0)
+            goto out;
+    }
+    store_blocks(istate);
+    store_cache_tree(istate);
+    if (write_index_extensions(&info, newfd, istate) < 0)
+        goto out;
     if (ce_flush(&info, newfd) || fstat(newfd, &st))
-        return -1;
+        goto out;
+
     istate->timestamp.sec = (unsigned int)st.st_mtime;
     istate->timestamp.nsec = 0;
-    return 0;
+    istate->extensions_changed = 0;
+    ret = 0;
+
+out:
+    for (k = 0; k < n_removed; k++)
+        free((char *)removed[k].name);
+    free(removed);
+    free(changed);
+    free(name);
+    munmap(mm, mmap_size);
+    return ret;
 }
 
 int discard_index(struct index_state *istate)
 {
     int i;
     for (i = 0; i < istate->cache_nr; ++i)
-        free (istate->cache[i]);
+        free_cache_entry (istate, istate->cache[i]);
 
     istate->cache_nr = 0;
     istate->cache_changed = 0;
@@ -1483,10 +2372,14 @@ int discard_index(struct index_state *istate)
     istate->timestamp.nsec = 0;
     istate->name_hash_initialized = 0;
     free_hash(&istate->name_hash);
-    /* cache_tree_free(&(istate->cache_tree)); */
-    /* free(istate->alloc); */
+    cache_tree_free(&(istate->cache_tree));
+    free(istate->alloc);
     free(istate->cache);
     istate->alloc = NULL;
+    istate->alloc_size = 0;
+    free_index_extensions(istate);
+    istate->extensions_changed = 0;
+    free_blocks(istate);
     istate->initialized = 0;
 
     /* no need to throw away allocated active_cache */
@@ -102,12 +102,70 @@ struct SeafileCrypt;
  */
 
 #define CACHE_SIGNATURE 0x44495243    /* "DIRC" */
+
+/*
+ * Version 4 stores each path as the number of bytes to strip from the
+ * end of the previous path (a varint), followed by the NUL-terminated
+ * suffix to append. Its entries are not padded.
+ */
+#define INDEX_FORMAT_LB 2
+#define INDEX_FORMAT_UB 4
+#define INDEX_FORMAT_DEFAULT 4
 struct cache_header {
     unsigned int hdr_signature;
     unsigned int hdr_version;
     unsigned int hdr_entries;
 };
 
+/*
+ * A large index can be split into the base index file and a small delta
+ * file next to it. The delta holds the entries added or changed since the
+ * base was written, followed by the names removed from it, each as a
+ * 16-bit flags field and the NUL-terminated name. It only applies to the
+ * base whose trailing SHA1 matches @base_sha1.
+ */
+#define DELTA_SIGNATURE 0x44495244    /* "DIRD" */
+#define INDEX_DELTA_SUFFIX ".delta"
+struct delta_header {
+    unsigned int hdr_signature;
+    unsigned int hdr_version;
+    unsigned int hdr_entries;
+    unsigned int hdr_removed;
+    unsigned char base_sha1[20];
+};
+
+/*
+ * Extensions follow the entries (and the removed names of a delta), each
+ * as a 4-byte signature, a 4-byte length and the data. The extensions of
+ * a delta replace all those of its base. The index keeps unknown ones.
+ */
+#define CACHE_EXT(s) ( (s[0]<<24)|(s[1]<<16)|(s[2]<<8)|(s[3]) )
+
+struct index_extension {
+    unsigned int sig;
+    size_t len;
+    void *data;
+};
+
+/*
+ * Block sizes of the files in the index, in file order, kept in the
+ * "BLKS" extension. Only files of more than one block are recorded.
+ */
+#define CACHE_EXT_BLOCKS 0x424C4B53    /* "BLKS" */
+
+/*
+ * The cache-tree, saved so that unchanged dirs needn't be rebuilt on
+ * commit. Changing an entry invalidates the dirs on its path.
+ */
+#define CACHE_EXT_TREE 0x54524545      /* "TREE" */
+
+struct ce_blocks {
+    char *name;
+    unsigned char sha1[20];     /* the file the sizes belong to */
+    uint32_t n_blocks;
+    uint32_t *sizes;
+};
+
 /*
  * The "cache_time" is just the low 32 bits of the
  * time. It doesn't matter if it overflows - we only
@@ -206,12 +264,14 @@ struct cache_entry {
 /*
  * Extended on-disk flags
  */
+/* The worktree file only has the size, its content is fetched on demand. */
+#define CE_PLACEHOLDER       (1 << 28)
 #define CE_INTENT_TO_ADD     (1 << 29)
 #define CE_SKIP_WORKTREE     (1 << 30)
 /* CE_EXTENDED2 is for future extension */
 #define CE_EXTENDED2         (1 << 31)
 
-#define CE_EXTENDED_FLAGS (CE_INTENT_TO_ADD | CE_SKIP_WORKTREE)
+#define CE_EXTENDED_FLAGS (CE_PLACEHOLDER | CE_INTENT_TO_ADD | CE_SKIP_WORKTREE)
 
 /*
  * Safeguard to avoid saving wrong flags:
@@ -262,6 +322,7 @@ static inline size_t ce_namelen(const struct cache_entry *ce)
 #define ce_stage(ce) ((CE_STAGEMASK & (ce)->ce_flags) >> CE_STAGESHIFT)
 #define ce_uptodate(ce) ((ce)->ce_flags & CE_UPTODATE)
 #define ce_skip_worktree(ce) ((ce)->ce_flags & CE_SKIP_WORKTREE)
+#define ce_placeholder(ce) ((ce)->ce_flags & CE_PLACEHOLDER)
 #define ce_mark_uptodate(ce) ((ce)->ce_flags |= CE_UPTODATE)
 
 #define ce_permissions(mode) (((mode) & 0100) ? 0755 : 0644)
@@ -308,9 +369,20 @@ static inline unsigned int canon_mode(unsigned int mode)
 struct index_state {
     struct cache_entry **cache;
     unsigned int cache_nr, cache_alloc, cache_changed;
-    /* struct cache_tree *cache_tree; */
+    struct cache_tree *cache_tree;
     struct cache_time timestamp;
+    /* Entries loaded from disk live in this single block. */
     void *alloc;
+    size_t alloc_size;
+    struct index_extension *extensions;
+    unsigned int extensions_nr;
+    /* An extension was set since the index was read. */
+    unsigned int extensions_changed;
+    /* Parsed "BLKS" extension, sorted by name. */
+    struct ce_blocks **blocks;
+    unsigned int blocks_nr, blocks_alloc;
+    unsigned blocks_loaded : 1,
+         blocks_changed : 1;
     unsigned name_hash_initialized : 1,
          initialized : 1;
     struct hash_table name_hash;
@@ -383,9 +455,44 @@ extern int read_index_from(struct index_state *, const char *path);
 extern int is_index_unborn(struct index_state *);
 extern int read_index_unmerged(struct index_state *);
 extern int write_index(struct index_state *, int newfd);
+/*
+ * Write the entries that differ from the index file at @base_path to
+ * @newfd as a delta. Returns 1 if writing the whole index is better,
+ * because the base is small or the delta grew too large.
+ */
+extern int write_index_delta(struct index_state *, const char *base_path, int newfd);
 extern int discard_index(struct index_state *);
+/* Returns the data of the extension with @sig, or NULL. */
+extern const void *index_get_extension(const struct index_state *,
+                                       unsigned int sig, size_t *len);
+/* Takes over the malloc'ed @data. A NULL @data removes the extension. */
+extern void index_set_extension(struct index_state *, unsigned int sig,
+                                void *data, size_t len);
+/*
+ * Copy the extensions of @src, for an index built from it by
+ * unpack_trees() that will replace it.
+ */
+extern void copy_index_extensions(struct index_state *dst,
+                                  struct index_state *src);
+/* Returns the block sizes recorded for @ce, or NULL if unknown. */
+extern const struct ce_blocks *index_get_blocks(struct index_state *,
+                                                const struct cache_entry *ce);
+/* Record the sizes of the @n_blocks blocks of file @sha1 at @name. */
+extern void index_set_blocks(struct index_state *, const char *name,
+                             const unsigned char *sha1,
+                             const uint32_t *sizes, uint32_t n_blocks);
 extern int unmerged_index(const struct index_state *);
 extern int verify_path(const char *path);
+/*
+ * Worktree file names are case insensitive on these platforms, so
+ * lookups of on-disk names should match index entries ignoring case.
+ */
+#if defined(WIN32) || defined(__APPLE__)
+#define IGNORE_CASE 1
+#else
+#define IGNORE_CASE 0
+#endif
+
 extern struct cache_entry *index_name_exists(struct index_state *istate, const char *name, int namelen, int igncase);
 extern int index_name_pos(const struct index_state *, const char *name, int namelen);
 #define ADD_CACHE_OK_TO_ADD 1        /* Ok to add */
@@ -405,9 +512,20 @@ extern int remove_file_from_index(struct index_state *, const char *path);
 #define ADD_CACHE_IGNORE_REMOVAL 8
 #define ADD_CACHE_INTENT 16
 
+/*
+ * @old_sha1 is the id of the file in the index before, or NULL.
+ * @old_blocks has the block sizes of that version if known.
+ * The block sizes of the new version may be returned in @block_sizes,
+ * to be released with free().
+ */
 typedef int (*IndexCB) (const char *path,
+                        const unsigned char *old_sha1,
+                        const struct ce_blocks *old_blocks,
                         unsigned char sha1[],
-                        struct SeafileCrypt *crypt);
+                        uint32_t **block_sizes,
+                        uint32_t *n_blocks,
+                        struct SeafileCrypt *crypt,
+                        int chunker);
 
 int add_to_index(struct index_state *istate,
                  const char *path,
@@ -415,6 +533,7 @@ int add_to_index(struct index_state *istate,
                  struct stat *st,
                  int flags,
                  struct SeafileCrypt *crypt,
+                 int chunker,
                  IndexCB index_cb);
 
 int
@@ -433,6 +552,9 @@ extern int index_name_is_other(const struct index_state *, const char *, int);
 /* do stat comparison even if CE_SKIP_WORKTREE is true */
 #define CE_MATCH_IGNORE_SKIP_WORKTREE    04
 extern int ie_match_stat(const struct index_state *, struct cache_entry *, struct stat *, unsigned int);
+/* The entry was written in the same second as the index, so a change made
+ * right after it may not show in its stat data. */
+extern int ie_racy_timestamp(const struct index_state *, struct cache_entry *);
 extern int ie_modified(const struct index_state *, struct cache_entry *, struct stat *, unsigned int);
 
 extern int ce_path_match(const struct cache_entry *ce, const char **pathspec);
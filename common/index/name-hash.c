@@ -108,7 +108,10 @@ void add_name_hash(struct index_state *istate, struct cache_entry *ce)
         hash_index_entry(istate, ce);
 }
 
-#if 0
+/*
+ * Only folds US-ASCII, the same way as icase_hash(), so names that
+ * compare equal here always land in the same hash bucket.
+ */
 static int slow_same_name(const char *name1, int len1, const char *name2, int len2)
 {
     if (len1 != len2)
@@ -119,15 +122,16 @@ static int slow_same_name(const char *name1, int len1, const char *name2, int le
         unsigned char c2 = *name2++;
         len1--;
         if (c1 != c2) {
-            c1 = toupper(c1);
-            c2 = toupper(c2);
+            if (c1 >= 'a' && c1 <= 'z')
+                c1 -= 'a' - 'A';
+            if (c2 >= 'a' && c2 <= 'z')
+                c2 -= 'a' - 'A';
             if (c1 != c2)
                 return 0;
         }
     }
     return 1;
 }
-#endif
 
 static int same_name(const struct cache_entry *ce, const char *name, int namelen, int icase)
 {
@@ -139,18 +143,15 @@ static int same_name(const struct cache_entry *ce, const char *name, int namelen
      */
     if (len == namelen && !cache_name_compare(name, namelen, ce->name, len))
         return 1;
-    else
-        return 0;
 
-    /* if (!icase) */
-    /*  return 0; */
+    if (!icase)
+        return 0;
 
     /*
-     * If the entry we're comparing is a filename (no trailing slash), then compare
-     * the lengths exactly.
+     * Directories are not hashed, so the name is always a filename
+     * and the lengths must be exactly the same.
      */
-    /* if (name[namelen - 1] != '/') */
-    /*  return slow_same_name(name, namelen, ce->name, len); */
+    return slow_same_name(name, namelen, ce->name, len);
 
     /*
      * For a directory, we point to an arbitrary cache_entry filename.  Just
@@ -162,18 +163,27 @@ static int same_name(const struct cache_entry *ce, const char *name, int namelen
 struct cache_entry *index_name_exists(struct index_state *istate, const char *name, int namelen, int icase)
 {
     unsigned int hash = hash_name(name, namelen);
-    struct cache_entry *ce;
+    struct cache_entry *ce, *alias = NULL;
 
     lazy_init_name_hash(istate);
     ce = lookup_hash(hash, &istate->name_hash);
 
     while (ce) {
         if (!(ce->ce_flags & CE_UNHASHED)) {
-            if (same_name(ce, name, namelen, icase))
+            /*
+             * The index may hold names differing only in case (e.g.
+             * committed on a case sensitive system). Prefer the exact
+             * match over the first case-insensitive one.
+             */
+            if (same_name(ce, name, namelen, 0))
                 return ce;
+            if (icase && !alias && same_name(ce, name, namelen, 1))
+                alias = ce;
         }
         ce = ce->next;
     }
+    if (alias)
+        return alias;
 
     /*
      * Might be a submodule.  Despite submodules being directories,
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "seafile-session.h"
 #include "merge-new.h"
 #include "vc-common.h"
@@ -5,6 +7,19 @@
 #define DEBUG_FLAG SEAFILE_DEBUG_MERGE
 #include "log.h"
 
+/* Names of a level are merged in batches. The subdirs to be merged in a
+ * batch are loaded concurrently before the batch is merged in order.
+ */
+#define MERGE_BATCH_SIZE        64
+#define MERGE_PREFETCH_WORKERS  4
+
+/* Dirents with the same name in the trees being merged. */
+typedef struct MergeGroup {
+    SeafDirent *dents[3];
+    int n_files;
+    int n_dirs;
+} MergeGroup;
+
 static int
 merge_trees_recursive (int n, SeafDir *trees[],
                        const char *basedir,
@@ -288,10 +303,149 @@ merge_entries (int n, SeafDirent *dents[],
     return 0;
 }
 
+/* Whether merge_directories() needs to load and merge the dirs in @dents. */
+static gboolean
+dirs_need_merge (int n, SeafDirent *dents[], MergeOptions *opt)
+{
+    int dir_mask = 0, i;
+
+    for (i = 0; i < n; ++i) {
+        if (dents[i] && S_ISDIR(dents[i]->mode))
+            dir_mask |= 1 << i;
+    }
+
+    if (dir_mask == 0)
+        return FALSE;
+    if (n == 2 || !opt->do_merge)
+        return TRUE;
+
+    switch (dir_mask) {
+    case 3:
+        return strcmp (dents[0]->id, dents[1]->id) != 0;
+    case 5:
+        return strcmp (dents[0]->id, dents[2]->id) != 0;
+    case 6:
+    case 7:
+        if (strcmp (dents[1]->id, dents[2]->id) == 0)
+            return FALSE;
+        if (dents[0] && (strcmp (dents[0]->id, dents[1]->id) == 0 ||
+                         strcmp (dents[0]->id, dents[2]->id) == 0))
+            return FALSE;
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+typedef struct DirPrefetch {
+    char            **ids;
+    SeafDir         **dirs;
+    int             n;
+    int             next;
+    pthread_mutex_t lock;
+} DirPrefetch;
+
+static void *
+prefetch_worker (void *vpf)
+{
+    DirPrefetch *pf = vpf;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock (&pf->lock);
+        i = pf->next++;
+        pthread_mutex_unlock (&pf->lock);
+        if (i >= pf->n)
+            break;
+
+        /* Failures are reported when merge_directories() loads the
+         * dir again.
+         */
+        pf->dirs[i] = seaf_fs_manager_get_seafdir (seaf->fs_mgr, pf->ids[i]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Loads the dirs to be merged in @groups concurrently.
+ * Returns a table from dir id to SeafDir, or NULL if there is no more
+ * than one dir to load.
+ */
+static GHashTable *
+prefetch_dirs (int n, MergeGroup *groups, int n_groups, MergeOptions *opt)
+{
+    GHashTable *ids, *dirs;
+    GHashTableIter iter;
+    gpointer key;
+    DirPrefetch pf;
+    pthread_t threads[MERGE_PREFETCH_WORKERS];
+    int g, i, n_started;
+
+    ids = g_hash_table_new (g_str_hash, g_str_equal);
+    for (g = 0; g < n_groups; ++g) {
+        if (!dirs_need_merge (n, groups[g].dents, opt))
+            continue;
+        for (i = 0; i < n; ++i) {
+            SeafDirent *dent = groups[g].dents[i];
+            if (dent && S_ISDIR(dent->mode))
+                g_hash_table_insert (ids, dent->id, dent->id);
+        }
+    }
+
+    if (g_hash_table_size (ids) <= 1) {
+        g_hash_table_destroy (ids);
+        return NULL;
+    }
+
+    memset (&pf, 0, sizeof(pf));
+    pf.n = g_hash_table_size (ids);
+    pf.ids = g_new0 (char *, pf.n);
+    pf.dirs = g_new0 (SeafDir *, pf.n);
+    pthread_mutex_init (&pf.lock, NULL);
+
+    i = 0;
+    g_hash_table_iter_init (&iter, ids);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        pf.ids[i++] = key;
+
+    for (n_started = 0;
+         n_started < MERGE_PREFETCH_WORKERS && n_started < pf.n;
+         ++n_started) {
+        if (pthread_create (&threads[n_started], NULL,
+                            prefetch_worker, &pf) != 0) {
+            seaf_warning ("Failed to create prefetch worker.\n");
+            break;
+        }
+    }
+
+    /* Load in this thread if no worker could be started. */
+    if (n_started == 0)
+        prefetch_worker (&pf);
+
+    for (i = 0; i < n_started; ++i)
+        pthread_join (threads[i], NULL);
+
+    dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, (GDestroyNotify)seaf_dir_free);
+    for (i = 0; i < pf.n; ++i) {
+        if (pf.dirs[i])
+            g_hash_table_insert (dirs, g_strdup(pf.ids[i]), pf.dirs[i]);
+    }
+
+    pthread_mutex_destroy (&pf.lock);
+    g_free (pf.ids);
+    g_free (pf.dirs);
+    g_hash_table_destroy (ids);
+
+    return dirs;
+}
+
 static int
 merge_directories (int n, SeafDirent *dents[],
                    const char *basedir,
                    GList **dents_out,
+                   GHashTable *prefetched,
                    MergeOptions *opt)
 {
     SeafDir *dir;
@@ -376,7 +530,11 @@ merge_directories (int n, SeafDirent *dents[],
     memset (sub_dirs, 0, sizeof(sub_dirs[0])*n);
     for (i = 0; i < n; ++i) {
         if (dents[i] != NULL && S_ISDIR(dents[i]->mode)) {
-            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dents[i]->id);
+            dir = prefetched ? g_hash_table_lookup (prefetched, dents[i]->id) : NULL;
+            if (dir)
+                seaf_dir_ref (dir);
+            else
+                dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dents[i]->id);
             if (!dir) {
                 seaf_warning ("Failed to find dir %s.\n", dents[i]->id);
                 ret = -1;
@@ -427,14 +585,16 @@ merge_trees_recursive (int n, SeafDir *trees[],
                        MergeOptions *opt)
 {
     GList *ptrs[3];
-    SeafDirent *dents[3];
+    MergeGroup groups[MERGE_BATCH_SIZE], *group;
+    int n_groups, g;
+    GHashTable *prefetched;
     int i;
     SeafDirent *dent;
     char *first_name;
-    gboolean done;
+    gboolean done = FALSE;
     int ret = 0;
     SeafDir *merged_tree;
-    GList *merged_dents = NULL;
+    GList *merged_dents = NULL, *ptr;
 
     for (i = 0; i < n; ++i) {
         if (trees[i])
@@ -443,57 +603,78 @@ merge_trees_recursive (int n, SeafDir *trees[],
             ptrs[i] = NULL;
     }
 
-    while (1) {
-        first_name = NULL;
-        memset (dents, 0, sizeof(dents[0])*n);
-        done = TRUE;
-
-        /* Find the "largest" name, assuming dirents are sorted. */
-        for (i = 0; i < n; ++i) {
-            if (ptrs[i] != NULL) {
-                done = FALSE;
-                dent = ptrs[i]->data;
-                if (!first_name)
-                    first_name = dent->name;
-                else if (strcmp(dent->name, first_name) > 0)
-                    first_name = dent->name;
+    while (!done) {
+        n_groups = 0;
+        while (n_groups < MERGE_BATCH_SIZE) {
+            first_name = NULL;
+            done = TRUE;
+
+            /* Find the "largest" name, assuming dirents are sorted. */
+            for (i = 0; i < n; ++i) {
+                if (ptrs[i] != NULL) {
+                    done = FALSE;
+                    dent = ptrs[i]->data;
+                    if (!first_name)
+                        first_name = dent->name;
+                    else if (strcmp(dent->name, first_name) > 0)
+                        first_name = dent->name;
+                }
             }
-        }
 
-        if (done)
-            break;
+            if (done)
+                break;
 
-        /*
-         * Setup dir entries for all names that equal to first_name
-         */
-        int n_files = 0, n_dirs = 0;
-        for (i = 0; i < n; ++i) {
-            if (ptrs[i] != NULL) {
-                dent = ptrs[i]->data;
-                if (strcmp(first_name, dent->name) == 0) {
-                    if (S_ISREG(dent->mode))
-                        ++n_files;
-                    else if (S_ISDIR(dent->mode))
-                        ++n_dirs;
-
-                    dents[i] = dent;
-                    ptrs[i] = ptrs[i]->next;
+            /*
+             * Setup dir entries for all names that equal to first_name.
+             * Conflicting entries are renamed in place while merging,
+             * so work on copies. The trees may be shared with the fs cache.
+             */
+            group = &groups[n_groups++];
+            memset (group, 0, sizeof(*group));
+            for (i = 0; i < n; ++i) {
+                if (ptrs[i] != NULL) {
+                    dent = ptrs[i]->data;
+                    if (strcmp(first_name, dent->name) == 0) {
+                        if (S_ISREG(dent->mode))
+                            ++group->n_files;
+                        else if (S_ISDIR(dent->mode))
+                            ++group->n_dirs;
+
+                        group->dents[i] = seaf_dirent_dup (dent);
+                        ptrs[i] = ptrs[i]->next;
+                    }
                 }
             }
         }
 
-        /* Merge entries of this level. */
-        if (n_files > 0) {
-            ret = merge_entries (n, dents, basedir, &merged_dents, opt);
-            if (ret < 0)
-                return ret;
+        prefetched = prefetch_dirs (n, groups, n_groups, opt);
+
+        for (g = 0; g < n_groups && ret == 0; ++g) {
+            group = &groups[g];
+
+            /* Merge entries of this level. */
+            if (group->n_files > 0)
+                ret = merge_entries (n, group->dents, basedir,
+                                     &merged_dents, opt);
+
+            /* Recurse into sub level. */
+            if (ret == 0 && group->n_dirs > 0)
+                ret = merge_directories (n, group->dents, basedir,
+                                         &merged_dents, prefetched, opt);
+        }
+
+        if (prefetched)
+            g_hash_table_destroy (prefetched);
+        for (g = 0; g < n_groups; ++g) {
+            for (i = 0; i < n; ++i)
+                g_free (groups[g].dents[i]);
         }
 
-        /* Recurse into sub level. */
-        if (n_dirs > 0) {
-            ret = merge_directories (n, dents, basedir, &merged_dents, opt);
-            if (ret < 0)
-                return ret;
+        if (ret < 0) {
+            for (ptr = merged_dents; ptr; ptr = ptr->next)
+                g_free (ptr->data);
+            g_list_free (merged_dents);
+            return ret;
         }
     }
 
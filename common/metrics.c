@@ -0,0 +1,347 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "metrics.h"
+
+/*
+ * Counters and histograms are split into shards, and each thread updates
+ * the shard it was given on its first update. Threads rarely share a
+ * shard, so the cache lines of a metric don't bounce between CPUs on
+ * every update. The shards are summed when the metrics are formatted.
+ */
+#define N_SHARDS 16
+/* guint64s in a cache line. Shards are padded to whole cache lines. */
+#define LINE_WORDS 8
+
+enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+};
+
+static const char *type_names[] = { "counter", "gauge", "histogram" };
+
+typedef struct MetricFamily {
+    char       *name;
+    char       *help;
+    int         type;
+    GPtrArray  *metrics;
+} MetricFamily;
+
+struct Metric {
+    MetricFamily *family;
+    char         *labels;
+    gint64        gauge;
+
+    /* Histograms only. */
+    gint64       *bounds;
+    int           n_bounds;
+    double        scale;
+
+    /* A counter has its value in each shard. A histogram has the counts
+     * of its n_bounds + 1 buckets, then the sum of the values. */
+    int           stride;
+    guint64      *shards;
+};
+
+typedef struct Collector {
+    MetricsCollectFunc func;
+    void              *data;
+} Collector;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *families;    /* name -> MetricFamily */
+static GPtrArray *family_list;  /* in registration order */
+static GList *collectors;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static int n_threads;
+
+const gint64 metrics_latency_bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 60000000,
+};
+const int metrics_n_latency_bounds = G_N_ELEMENTS(metrics_latency_bounds);
+
+static void
+create_shard_key ()
+{
+    pthread_key_create (&shard_key, NULL);
+}
+
+static inline guint64 *
+thread_shard (Metric *metric)
+{
+    int i;
+
+    pthread_once (&key_once, create_shard_key);
+
+    /* Stored plus one, as NULL means not set. */
+    i = GPOINTER_TO_INT (pthread_getspecific (shard_key));
+    if (i == 0) {
+        i = __sync_fetch_and_add (&n_threads, 1) % N_SHARDS + 1;
+        pthread_setspecific (shard_key, GINT_TO_POINTER(i));
+    }
+
+    return metric->shards + (i - 1) * metric->stride;
+}
+
+static guint64 *
+alloc_shards (int n_words, int *stride)
+{
+    guint64 *p;
+
+    *stride = (n_words + LINE_WORDS - 1) / LINE_WORDS * LINE_WORDS;
+
+    /* Metrics are never freed. Align the shards to cache lines. */
+    p = g_malloc0 ((N_SHARDS * *stride + LINE_WORDS) * sizeof(guint64));
+    while (((unsigned long)p) % (LINE_WORDS * sizeof(guint64)) != 0)
+        ++p;
+
+    return p;
+}
+
+static Metric *
+register_metric (const char *name, const char *labels, const char *help,
+                 int type, const gint64 *bounds, int n_bounds, double scale)
+{
+    MetricFamily *family;
+    Metric *metric = NULL;
+    guint i;
+
+    if (!labels)
+        labels = "";
+
+    pthread_mutex_lock (&registry_lock);
+
+    if (!families) {
+        families = g_hash_table_new (g_str_hash, g_str_equal);
+        family_list = g_ptr_array_new ();
+    }
+
+    family = g_hash_table_lookup (families, name);
+    if (!family) {
+        family = g_new0 (MetricFamily, 1);
+        family->name = g_strdup (name);
+        family->help = g_strdup (help);
+        family->type = type;
+        family->metrics = g_ptr_array_new ();
+        g_hash_table_insert (families, family->name, family);
+        g_ptr_array_add (family_list, family);
+    } else if (family->type != type) {
+        g_warning ("Metric %s registered with another type.\n", name);
+        goto out;
+    }
+
+    for (i = 0; i < family->metrics->len; ++i) {
+        metric = g_ptr_array_index (family->metrics, i);
+        if (strcmp (metric->labels, labels) == 0)
+            goto out;
+    }
+
+    metric = g_new0 (Metric, 1);
+    metric->family = family;
+    metric->labels = g_strdup (labels);
+    if (type == METRIC_COUNTER) {
+        metric->shards = alloc_shards (1, &metric->stride);
+    } else if (type == METRIC_HISTOGRAM) {
+        metric->bounds = g_memdup (bounds, n_bounds * sizeof(gint64));
+        metric->n_bounds = n_bounds;
+        metric->scale = scale;
+        metric->shards = alloc_shards (n_bounds + 2, &metric->stride);
+    }
+    g_ptr_array_add (family->metrics, metric);
+
+out:
+    pthread_mutex_unlock (&registry_lock);
+    return metric;
+}
+
+Metric *
+metrics_counter (const char *name, const char *labels, const char *help)
+{
+    return register_metric (name, labels, help, METRIC_COUNTER, NULL, 0, 1);
+}
+
+Metric *
+metrics_gauge (const char *name, const char *labels, const char *help)
+{
+    return register_metric (name, labels, help, METRIC_GAUGE, NULL, 0, 1);
+}
+
+Metric *
+metrics_histogram (const char *name, const char *labels, const char *help,
+                   const gint64 *bounds, int n_bounds, double scale)
+{
+    return register_metric (name, labels, help, METRIC_HISTOGRAM,
+                            bounds, n_bounds, scale);
+}
+
+void
+metrics_counter_add (Metric *metric, guint64 n)
+{
+    if (!metric)
+        return;
+    __sync_fetch_and_add (thread_shard (metric), n);
+}
+
+void
+metrics_gauge_set (Metric *metric, gint64 value)
+{
+    if (!metric)
+        return;
+    __sync_lock_test_and_set (&metric->gauge, value);
+}
+
+void
+metrics_gauge_add (Metric *metric, gint64 n)
+{
+    if (!metric)
+        return;
+    __sync_fetch_and_add (&metric->gauge, n);
+}
+
+void
+metrics_histogram_observe (Metric *metric, gint64 value)
+{
+    guint64 *shard;
+    int i;
+
+    if (!metric)
+        return;
+
+    if (value < 0)
+        value = 0;
+
+    /* There are few buckets, a linear search is as fast as any. */
+    for (i = 0; i < metric->n_bounds; ++i)
+        if (value <= metric->bounds[i])
+            break;
+
+    shard = thread_shard (metric);
+    __sync_fetch_and_add (&shard[i], 1);
+    __sync_fetch_and_add (&shard[metric->n_bounds + 1], (guint64)value);
+}
+
+void
+metrics_add_collector (MetricsCollectFunc func, void *data)
+{
+    Collector *c = g_new0 (Collector, 1);
+
+    c->func = func;
+    c->data = data;
+
+    pthread_mutex_lock (&registry_lock);
+    collectors = g_list_append (collectors, c);
+    pthread_mutex_unlock (&registry_lock);
+}
+
+void
+metrics_format_family (GString *buf, const char *name,
+                       const char *type, const char *help)
+{
+    g_string_append_printf (buf, "# HELP %s %s\n# TYPE %s %s\n",
+                            name, help, name, type);
+}
+
+static guint64
+sum_shards (Metric *metric, int idx)
+{
+    guint64 sum = 0;
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i)
+        sum += *(volatile guint64 *)&metric->shards[i * metric->stride + idx];
+
+    return sum;
+}
+
+/* name + suffix, and the labels in braces if there are any. */
+static void
+append_sample_name (GString *buf, Metric *metric, const char *suffix)
+{
+    g_string_append (buf, metric->family->name);
+    g_string_append (buf, suffix);
+    if (metric->labels[0])
+        g_string_append_printf (buf, "{%s}", metric->labels);
+    g_string_append_c (buf, ' ');
+}
+
+static void
+append_double (GString *buf, double v)
+{
+    char str[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_string_append (buf, g_ascii_formatd (str, sizeof(str), "%.6g", v));
+}
+
+static void
+format_histogram (GString *buf, Metric *metric)
+{
+    const char *name = metric->family->name;
+    const char *sep = metric->labels[0] ? "," : "";
+    guint64 count = 0;
+    int i;
+
+    for (i = 0; i <= metric->n_bounds; ++i) {
+        count += sum_shards (metric, i);
+        g_string_append_printf (buf, "%s_bucket{%s%sle=\"", name,
+                                metric->labels, sep);
+        if (i < metric->n_bounds)
+            append_double (buf, metric->bounds[i] * metric->scale);
+        else
+            g_string_append (buf, "+Inf");
+        g_string_append_printf (buf, "\"} %"G_GUINT64_FORMAT"\n", count);
+    }
+
+    append_sample_name (buf, metric, "_sum");
+    append_double (buf, sum_shards (metric, metric->n_bounds + 1) *
+                   metric->scale);
+    g_string_append_c (buf, '\n');
+    append_sample_name (buf, metric, "_count");
+    g_string_append_printf (buf, "%"G_GUINT64_FORMAT"\n", count);
+}
+
+void
+metrics_format (GString *buf)
+{
+    MetricFamily *family;
+    Metric *metric;
+    GList *ptr;
+    guint i, j;
+
+    pthread_mutex_lock (&registry_lock);
+
+    for (i = 0; family_list && i < family_list->len; ++i) {
+        family = g_ptr_array_index (family_list, i);
+        metrics_format_family (buf, family->name, type_names[family->type],
+                               family->help);
+
+        for (j = 0; j < family->metrics->len; ++j) {
+            metric = g_ptr_array_index (family->metrics, j);
+            if (family->type == METRIC_HISTOGRAM) {
+                format_histogram (buf, metric);
+                continue;
+            }
+
+            append_sample_name (buf, metric, "");
+            if (family->type == METRIC_COUNTER)
+                g_string_append_printf (buf, "%"G_GUINT64_FORMAT"\n",
+                                        sum_shards (metric, 0));
+            else
+                g_string_append_printf (buf, "%"G_GINT64_FORMAT"\n",
+                                        *(volatile gint64 *)&metric->gauge);
+        }
+    }
+
+    for (ptr = collectors; ptr; ptr = ptr->next) {
+        Collector *c = ptr->data;
+        c->func (buf, c->data);
+    }
+
+    pthread_mutex_unlock (&registry_lock);
+}
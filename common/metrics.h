@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <glib.h>
+
+/*
+ * Registry of runtime metrics, formatted in the Prometheus text format.
+ *
+ * A metric is registered once, by name and labels, and updated from any
+ * thread without taking a lock. Registering the same name and labels
+ * again returns the same metric, so callers may register lazily and
+ * keep the pointer in a static variable.
+ *
+ * @labels is the part between the braces, e.g. "store=\"fs\"", or NULL.
+ * Metrics of a name share its help text and type.
+ *
+ * Statistics already kept elsewhere, e.g. in BackendStats, are exported
+ * by collectors, which are called when the metrics are formatted.
+ */
+
+typedef struct Metric Metric;
+
+Metric *
+metrics_counter (const char *name, const char *labels, const char *help);
+
+Metric *
+metrics_gauge (const char *name, const char *labels, const char *help);
+
+/*
+ * Values are observed as integers, e.g. usec, and multiplied by @scale
+ * when formatted, e.g. 1e-6 to export seconds. @bounds are the upper
+ * bounds of the buckets, in increasing order and in the observed unit.
+ * A +Inf bucket is added.
+ */
+Metric *
+metrics_histogram (const char *name, const char *labels, const char *help,
+                   const gint64 *bounds, int n_bounds, double scale);
+
+void
+metrics_counter_add (Metric *metric, guint64 n);
+
+void
+metrics_gauge_set (Metric *metric, gint64 value);
+
+void
+metrics_gauge_add (Metric *metric, gint64 n);
+
+void
+metrics_histogram_observe (Metric *metric, gint64 value);
+
+/* Latency buckets from 1ms to 60s, in usec, for metrics_histogram(). */
+extern const gint64 metrics_latency_bounds[];
+extern const int metrics_n_latency_bounds;
+
+/* Appends samples to @buf. Use metrics_format_family() for each name. */
+typedef void (*MetricsCollectFunc) (GString *buf, void *data);
+
+void
+metrics_add_collector (MetricsCollectFunc func, void *data);
+
+/* Append the HELP and TYPE lines of a metric name. */
+void
+metrics_format_family (GString *buf, const char *name,
+                       const char *type, const char *help);
+
+/* Append all metrics and the output of the collectors. */
+void
+metrics_format (GString *buf);
+
+#endif
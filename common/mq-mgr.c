@@ -1,10 +1,12 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <ccnet.h>
+#include <ccnet/timer.h>
 
 #include "mq-mgr.h"
 
 #include "seafile-session.h"
+#include "utils.h"
 #include "log.h"
 
 typedef struct _SeafMqManagerPriv SeafMqManagerPriv;
@@ -14,11 +16,60 @@ struct _SeafMqManagerPriv {
     CcnetTimer *timer; 
     /* keep it in memory since we always use the same message */
     CcnetMessage *heartbeat_msg;
+
+    CcnetMqclientProc *event_proc;
+    SeafMqEventFunc event_func;
+    SeafMqEventBatchFunc event_batch_func;
+    void *event_data;
+
+    /* Messages waiting for the next flush, in publishing order. */
+    GQueue *pending;
+    /* coalescing key -> PendingMessage in pending */
+    GHashTable *pending_keys;
+    CcnetTimer *flush_timer;
+    gboolean batch_events;
+
+    /* key -> value last sent on seafile.task_state */
+    GHashTable *states;
+    /* key -> value published since */
+    GHashTable *changed_states;
+    CcnetTimer *state_timer;
 };
 
+typedef struct {
+    char *app;
+    char *body;
+    char *key;
+} PendingMessage;
+
+#define SERVER_EVENT_APP "seaf_server.event"
+#define SERVER_EVENT_BATCH_APP "seaf_server.event_batch"
+#define NOTIFICATION_APP "seafile.notification"
+#define TASK_STATE_APP "seafile.task_state"
+
 #define HEARTBEAT_INTERVAL 2    /* 2s */
+
+#define FLUSH_INTERVAL 100      /* msec */
+/* Flush at once when so many messages are waiting. */
+#define MAX_PENDING_MESSAGES 1000
+/* Split batches larger than this. */
+#define MAX_BATCH_SIZE (64 * 1024)
+
+/* At most one seafile.task_state message in this time. */
+#define STATE_INTERVAL 1000     /* msec */
     
 static int heartbeat_pulse (void *vmanager);
+static int flush_pending (void *vmanager);
+static int flush_states (void *vmanager);
+
+static void
+pending_message_free (PendingMessage *pm)
+{
+    g_free (pm->app);
+    g_free (pm->body);
+    g_free (pm->key);
+    g_free (pm);
+}
 
 SeafMqManager *
 seaf_mq_manager_new (SeafileSession *seaf)
@@ -34,12 +85,23 @@ seaf_mq_manager_new (SeafileSession *seaf)
     mgr->seaf = seaf;
     mgr->priv = priv;
 
+    priv->pending = g_queue_new ();
+    priv->pending_keys = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->states = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_free);
+    priv->changed_states = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+
     priv->mqclient_proc = (CcnetMqclientProc *)
         ccnet_proc_factory_create_master_processor (client->proc_factory,
                                                     "mq-client");
 
     if (!priv->mqclient_proc) {
         seaf_warning ("Failed to create mqclient proc.\n");
+        g_queue_free (priv->pending);
+        g_hash_table_destroy (priv->pending_keys);
+        g_hash_table_destroy (priv->states);
+        g_hash_table_destroy (priv->changed_states);
         g_free (mgr);
         g_free(priv);
         return NULL;
@@ -93,6 +155,12 @@ create_message (SeafMqManager *mgr, const char *app, const char *body, int flags
     return msg;
 }
 
+void
+seaf_mq_manager_set_batch_events (SeafMqManager *mgr, gboolean batch)
+{
+    mgr->priv->batch_events = batch;
+}
+
 void
 seaf_mq_manager_set_heartbeat_name (SeafMqManager *mgr, const char *app)
 {
@@ -135,32 +203,280 @@ seaf_mq_manager_publish_message_full (SeafMqManager *mgr,
     ccnet_message_free (msg);
 }
 
+/*
+ * Queue a message for the next flush. A message with the same @key in
+ * the queue is replaced, keeping its place.
+ */
+static void
+queue_message (SeafMqManager *mgr,
+               const char *app, const char *body, const char *key)
+{
+    SeafMqManagerPriv *priv = mgr->priv;
+    PendingMessage *pm;
+    char *full_key = NULL;
+
+    if (key) {
+        full_key = g_strconcat (app, "\n", key, NULL);
+        pm = g_hash_table_lookup (priv->pending_keys, full_key);
+        if (pm) {
+            g_free (pm->body);
+            pm->body = g_strdup (body);
+            g_free (full_key);
+            return;
+        }
+    }
+
+    pm = g_new0 (PendingMessage, 1);
+    pm->app = g_strdup (app);
+    pm->body = g_strdup (body);
+    pm->key = full_key;
+    g_queue_push_tail (priv->pending, pm);
+    if (full_key)
+        g_hash_table_insert (priv->pending_keys, full_key, pm);
+
+    if (g_queue_get_length (priv->pending) >= MAX_PENDING_MESSAGES) {
+        if (priv->flush_timer)
+            ccnet_timer_free (&priv->flush_timer);
+        flush_pending (mgr);
+        return;
+    }
+
+    if (!priv->flush_timer)
+        priv->flush_timer = ccnet_timer_new (flush_pending, mgr,
+                                             FLUSH_INTERVAL);
+}
+
+static void
+send_batch (SeafMqManager *mgr, GString *batch)
+{
+    if (batch->len == 0)
+        return;
+
+    seaf_mq_manager_publish_message_full (mgr, SERVER_EVENT_BATCH_APP,
+                                          batch->str, 0);
+    g_string_truncate (batch, 0);
+}
+
+/*
+ * With batch_events set, the events are sent in seaf_server.event_batch
+ * messages, each event framed as "<length>\n<content>". Everything else
+ * is sent one message at a time.
+ */
+static int
+flush_pending (void *vmanager)
+{
+    SeafMqManager *mgr = vmanager;
+    SeafMqManagerPriv *priv = mgr->priv;
+    PendingMessage *pm;
+    GString *batch = g_string_new (NULL);
+
+    g_hash_table_remove_all (priv->pending_keys);
+
+    while ((pm = g_queue_pop_head (priv->pending)) != NULL) {
+        if (priv->batch_events && strcmp (pm->app, SERVER_EVENT_APP) == 0) {
+            g_string_append_printf (batch, "%zu\n%s",
+                                    strlen(pm->body), pm->body);
+            if (batch->len >= MAX_BATCH_SIZE)
+                send_batch (mgr, batch);
+        } else {
+            seaf_mq_manager_publish_message_full (mgr, pm->app, pm->body, 0);
+        }
+        pending_message_free (pm);
+    }
+
+    send_batch (mgr, batch);
+    g_string_free (batch, TRUE);
+
+    /* Freed by returning FALSE. */
+    priv->flush_timer = NULL;
+    return FALSE;
+}
+
 void
 seaf_mq_manager_publish_notification (SeafMqManager *mgr,
                                       const char *type,
                                       const char *content)
 {
-    static const char *app = "seafile.notification";
-    
-    GString *buf = g_string_new(NULL);
-    g_string_append_printf (buf, "%s\n%s", type, content);
-    
-    CcnetMessage *msg = create_message (mgr, app, buf->str, 0);
-    _send_message (mgr, msg);
-    
-    g_string_free (buf, TRUE);
-    ccnet_message_free (msg);
+    char *body = g_strdup_printf ("%s\n%s", type, content);
+
+    /* The same notification twice in a flush only tells the same. */
+    queue_message (mgr, NOTIFICATION_APP, body, body);
+
+    g_free (body);
 }
 
 void
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *content)
 {
-    static const char *app = "seaf_server.event";
+    queue_message (mgr, SERVER_EVENT_APP, content, NULL);
+}
 
-    CcnetMessage *msg = create_message (mgr, app, content, 0);
-    _send_message (mgr, msg);
+void
+seaf_mq_manager_publish_event_coalesced (SeafMqManager *mgr,
+                                         const char *key,
+                                         const char *content)
+{
+    queue_message (mgr, SERVER_EVENT_APP, content, key);
+}
 
-    ccnet_message_free (msg);
+void
+seaf_mq_manager_publish_state (SeafMqManager *mgr,
+                               const char *key,
+                               const char *value)
+{
+    SeafMqManagerPriv *priv = mgr->priv;
+
+    g_hash_table_replace (priv->changed_states,
+                          g_strdup (key), g_strdup (value));
+
+    /* Nothing runs while no state changes. */
+    if (!priv->state_timer)
+        priv->state_timer = ccnet_timer_new (flush_states, mgr,
+                                             STATE_INTERVAL);
+}
+
+/*
+ * Send the states changed in the last interval as "<key>\t<value>\n"
+ * lines. States set back to the value last sent are left out.
+ */
+static int
+flush_states (void *vmanager)
+{
+    SeafMqManager *mgr = vmanager;
+    SeafMqManagerPriv *priv = mgr->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    const char *old;
+    GString *buf = g_string_new (NULL);
+
+    g_hash_table_iter_init (&iter, priv->changed_states);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        old = g_hash_table_lookup (priv->states, key);
+        if (g_strcmp0 (old, value) == 0 || (!old && *(char *)value == '\0'))
+            continue;
+
+        g_string_append_printf (buf, "%s\t%s\n",
+                                (char *)key, (char *)value);
+        if (*(char *)value == '\0')
+            g_hash_table_remove (priv->states, key);
+        else
+            g_hash_table_replace (priv->states,
+                                  g_strdup (key), g_strdup (value));
+    }
+    g_hash_table_remove_all (priv->changed_states);
+
+    if (buf->len > 0)
+        seaf_mq_manager_publish_message_full (mgr, TASK_STATE_APP,
+                                              buf->str, 0);
+    g_string_free (buf, TRUE);
+
+    /* Freed by returning FALSE. */
+    priv->state_timer = NULL;
+    return FALSE;
+}
+
+/* Split a seaf_server.event_batch body into the contents of the events. */
+static GList *
+parse_event_batch (const char *body)
+{
+    GList *events = NULL;
+    const char *p = body, *end = body + strlen(body);
+    char *len_end;
+    unsigned long len;
+
+    while (p < end) {
+        len = strtoul (p, &len_end, 10);
+        if (len_end == p || *len_end != '\n' ||
+            len > (unsigned long)(end - len_end - 1)) {
+            seaf_warning ("Bad event batch, the rest is dropped.\n");
+            break;
+        }
+        p = len_end + 1;
+        events = g_list_prepend (events, g_strndup (p, len));
+        p += len;
+    }
+
+    return g_list_reverse (events);
+}
+
+static void
+event_got_cb (CcnetMessage *msg, void *vmgr)
+{
+    SeafMqManager *mgr = vmgr;
+    SeafMqManagerPriv *priv = mgr->priv;
+    GList *events, *ptr;
+
+    if (IS_APP_MSG(msg, SERVER_EVENT_APP)) {
+        if (priv->event_func) {
+            priv->event_func (msg->body, priv->event_data);
+        } else {
+            events = g_list_prepend (NULL, msg->body);
+            priv->event_batch_func (events, priv->event_data);
+            g_list_free (events);
+        }
+    } else if (IS_APP_MSG(msg, SERVER_EVENT_BATCH_APP)) {
+        events = parse_event_batch (msg->body);
+        if (priv->event_func) {
+            for (ptr = events; ptr; ptr = ptr->next)
+                priv->event_func (ptr->data, priv->event_data);
+        } else if (events) {
+            priv->event_batch_func (events, priv->event_data);
+        }
+        string_list_free (events);
+    }
+}
+
+static int
+subscribe_events (SeafMqManager *mgr,
+                  SeafMqEventFunc func,
+                  SeafMqEventBatchFunc batch_func,
+                  void *data)
+{
+    SeafMqManagerPriv *priv = mgr->priv;
+    CcnetClient *client = mgr->seaf->session;
+    static char *topics[] = { SERVER_EVENT_APP, SERVER_EVENT_BATCH_APP };
+
+    if (priv->event_proc)
+        return -1;
+
+    priv->event_proc = (CcnetMqclientProc *)
+        ccnet_proc_factory_create_master_processor (client->proc_factory,
+                                                    "mq-client");
+    if (!priv->event_proc) {
+        seaf_warning ("Failed to create mqclient proc.\n");
+        return -1;
+    }
+
+    priv->event_func = func;
+    priv->event_batch_func = batch_func;
+    priv->event_data = data;
+    ccnet_mqclient_proc_set_message_got_cb (priv->event_proc,
+                                            event_got_cb, mgr);
+
+    if (ccnet_processor_start ((CcnetProcessor *)priv->event_proc,
+                               G_N_ELEMENTS(topics), topics) < 0) {
+        seaf_warning ("Failed to subscribe to %s.\n", SERVER_EVENT_APP);
+        priv->event_proc = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seaf_mq_manager_subscribe_event (SeafMqManager *mgr,
+                                 SeafMqEventFunc func,
+                                 void *data)
+{
+    return subscribe_events (mgr, func, NULL, data);
+}
+
+int
+seaf_mq_manager_subscribe_event_batch (SeafMqManager *mgr,
+                                       SeafMqEventBatchFunc func,
+                                       void *data)
+{
+    return subscribe_events (mgr, NULL, func, data);
 }
 
 static int
@@ -16,8 +16,16 @@
  *  - seafile.repo_sync_done <repo-name>
  *  - seafile.promt_create_repo <worktree>
  *  - seafile.repo_created <repo-name>
+ *  - seafile.task_state <key>\t<value> lines
  *
- * And subscribe to no messages. 
+ * Processes other than seaf-server can subscribe to the events published
+ * by seaf-server with seaf_mq_manager_subscribe_event().
+ *
+ * Notifications and events are queued and sent by a timer in the main
+ * loop, so the publish functions must be called there. Events published
+ * with the same coalescing key in a flush are sent once, with the last
+ * content. With batch events on, the events of a flush are sent in a few
+ * seaf_server.event_batch messages instead of one message each.
  */
 
 #ifndef SEAF_MQ_MANAGER_H
@@ -34,6 +42,10 @@ struct _SeafMqManager {
 
 SeafMqManager *seaf_mq_manager_new (struct _SeafileSession *seaf);   
 
+/* Subscribers in this tree handle both forms. Others may only know
+ * seaf_server.event, so it's off by default. */
+void seaf_mq_manager_set_batch_events (SeafMqManager *mgr, gboolean batch);
+
 void seaf_mq_manager_set_heartbeat_name (SeafMqManager *mgr, const char *app);
 
 int seaf_mq_manager_init (SeafMqManager *mgr);
@@ -58,4 +70,41 @@ seaf_mq_manager_publish_notification (SeafMqManager *mgr,
 void
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *content);
 
+/*
+ * For events that only tell the latest state, e.g. the new head of a
+ * repo. An earlier event with the same @key not sent yet is replaced.
+ */
+void
+seaf_mq_manager_publish_event_coalesced (SeafMqManager *mgr,
+                                         const char *key,
+                                         const char *content);
+
+/*
+ * Set the state of a task for the UIs, e.g. "sync\t<repo-id>" to
+ * "uploading". Only the states changed since the last seafile.task_state
+ * message are sent, at most once a second, so the UIs don't have to poll.
+ * An empty @value removes the task.
+ */
+void
+seaf_mq_manager_publish_state (SeafMqManager *mgr,
+                               const char *key,
+                               const char *value);
+
+typedef void (*SeafMqEventFunc) (const char *content, void *data);
+
+/* @events is a list of the contents, in publishing order. */
+typedef void (*SeafMqEventBatchFunc) (GList *events, void *data);
+
+/* @func is called in the main loop for every event, batched or not. */
+int
+seaf_mq_manager_subscribe_event (SeafMqManager *mgr,
+                                 SeafMqEventFunc func,
+                                 void *data);
+
+/* @func is called in the main loop once for every received message. */
+int
+seaf_mq_manager_subscribe_event_batch (SeafMqManager *mgr,
+                                       SeafMqEventBatchFunc func,
+                                       void *data);
+
 #endif
@@ -0,0 +1,320 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Object backend that compresses objects before handing them to another
+ * backend.
+ *
+ * A compressed object starts with a CompressHeader: the magic, the codec
+ * and the uncompressed length. Objects without the magic are returned as
+ * they are, so objects written before compression was enabled, or with
+ * it disabled, are still readable. None of the fs object types or a JSON
+ * commit can start with the magic. An object that doesn't shrink is
+ * stored uncompressed, with a CODEC_NONE header only if its data happens
+ * to start with the magic.
+ */
+
+#include "common.h"
+
+#include <zlib.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "log.h"
+#include "obj-backend.h"
+
+#define COMPRESS_MAGIC "SEAZ"
+
+/* Don't bother with objects smaller than this. */
+#define MIN_COMPRESS_SIZE 128
+
+/* Sanity limit on the uncompressed length in a header. */
+#define MAX_OBJECT_SIZE (256 << 20)
+
+enum {
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,
+};
+
+typedef struct CompressHeader {
+    char    magic[4];
+    guint8  codec;
+    guint32 len;
+} __attribute__((gcc_struct, __packed__)) CompressHeader;
+
+typedef struct CompressPriv {
+    ObjBackend  *inner;
+    int         codec;
+    int         level;
+} CompressPriv;
+
+/*
+ * Encode @data for storage. Returns a newly allocated buffer, or NULL if
+ * @data should be stored as it is.
+ */
+static void *
+encode (CompressPriv *priv, const void *data, int len, int *out_len)
+{
+    CompressHeader *hdr;
+    uLongf dest_len;
+    char *buf;
+    gboolean has_magic;
+
+    has_magic = (len >= sizeof(CompressHeader) &&
+                 memcmp (data, COMPRESS_MAGIC, 4) == 0);
+
+    if (priv->codec == CODEC_ZLIB && len >= MIN_COMPRESS_SIZE) {
+        dest_len = compressBound (len);
+        buf = g_malloc (sizeof(CompressHeader) + dest_len);
+        if (compress2 ((Bytef *)buf + sizeof(CompressHeader), &dest_len,
+                       data, len, priv->level) == Z_OK &&
+            sizeof(CompressHeader) + dest_len < len) {
+            hdr = (CompressHeader *)buf;
+            memcpy (hdr->magic, COMPRESS_MAGIC, 4);
+            hdr->codec = CODEC_ZLIB;
+            hdr->len = htonl (len);
+            *out_len = sizeof(CompressHeader) + dest_len;
+            return buf;
+        }
+        g_free (buf);
+    }
+
+    if (!has_magic)
+        return NULL;
+
+    buf = g_malloc (sizeof(CompressHeader) + len);
+    hdr = (CompressHeader *)buf;
+    memcpy (hdr->magic, COMPRESS_MAGIC, 4);
+    hdr->codec = CODEC_NONE;
+    hdr->len = htonl (len);
+    memcpy (buf + sizeof(CompressHeader), data, len);
+    *out_len = sizeof(CompressHeader) + len;
+    return buf;
+}
+
+/*
+ * Decode a stored object in place of @data. Returns -1 if the object is
+ * corrupt.
+ */
+static int
+decode (const char *obj_id, void **data, int *len)
+{
+    CompressHeader *hdr = *data;
+    guint32 orig_len;
+    uLongf dest_len;
+    char *buf;
+
+    if (*len < sizeof(CompressHeader) ||
+        memcmp (hdr->magic, COMPRESS_MAGIC, 4) != 0)
+        return 0;
+
+    orig_len = ntohl (hdr->len);
+    if (orig_len > MAX_OBJECT_SIZE)
+        goto bad;
+
+    switch (hdr->codec) {
+    case CODEC_NONE:
+        if (orig_len != *len - sizeof(CompressHeader))
+            goto bad;
+        buf = g_malloc (orig_len);
+        memcpy (buf, hdr + 1, orig_len);
+        break;
+    case CODEC_ZLIB:
+        buf = g_malloc (orig_len);
+        dest_len = orig_len;
+        if (uncompress ((Bytef *)buf, &dest_len, (Bytef *)(hdr + 1),
+                        *len - sizeof(CompressHeader)) != Z_OK ||
+            dest_len != orig_len) {
+            g_free (buf);
+            goto bad;
+        }
+        break;
+    default:
+        seaf_warning ("[compress] Unknown codec %d in object %s.\n",
+                      hdr->codec, obj_id);
+        goto error;
+    }
+
+    g_free (*data);
+    *data = buf;
+    *len = orig_len;
+    return 0;
+
+bad:
+    seaf_warning ("[compress] Object %s is corrupt.\n", obj_id);
+error:
+    g_free (*data);
+    *data = NULL;
+    return -1;
+}
+
+static int
+obj_backend_compress_read (ObjBackend *bend,
+                           const char *obj_id,
+                           void **data,
+                           int *len)
+{
+    CompressPriv *priv = bend->priv;
+
+    if (priv->inner->read (priv->inner, obj_id, data, len) < 0)
+        return -1;
+
+    return decode (obj_id, data, len);
+}
+
+static int
+obj_backend_compress_write (ObjBackend *bend,
+                            const char *obj_id,
+                            void *data,
+                            int len)
+{
+    CompressPriv *priv = bend->priv;
+    void *buf;
+    int buf_len;
+    int ret;
+
+    buf = encode (priv, data, len, &buf_len);
+    if (!buf)
+        return priv->inner->write (priv->inner, obj_id, data, len);
+
+    ret = priv->inner->write (priv->inner, obj_id, buf, buf_len);
+    g_free (buf);
+    return ret;
+}
+
+static gboolean
+obj_backend_compress_exists (ObjBackend *bend,
+                             const char *obj_id)
+{
+    CompressPriv *priv = bend->priv;
+
+    return priv->inner->exists (priv->inner, obj_id);
+}
+
+static void
+obj_backend_compress_delete (ObjBackend *bend,
+                             const char *obj_id)
+{
+    CompressPriv *priv = bend->priv;
+
+    priv->inner->delete (priv->inner, obj_id);
+}
+
+static void
+obj_backend_compress_read_batch (ObjBackend *bend,
+                                 ObjBatchItem *items,
+                                 int n_items)
+{
+    CompressPriv *priv = bend->priv;
+    int i;
+
+    priv->inner->read_batch (priv->inner, items, n_items);
+
+    for (i = 0; i < n_items; ++i) {
+        if (items[i].success &&
+            decode (items[i].obj_id, &items[i].data, &items[i].len) < 0)
+            items[i].success = FALSE;
+    }
+}
+
+static void
+obj_backend_compress_write_batch (ObjBackend *bend,
+                                  ObjBatchItem *items,
+                                  int n_items)
+{
+    CompressPriv *priv = bend->priv;
+    void **orig_data;
+    int *orig_len;
+    void *buf;
+    int buf_len;
+    int i;
+
+    orig_data = g_new (void *, n_items);
+    orig_len = g_new (int, n_items);
+
+    for (i = 0; i < n_items; ++i) {
+        orig_data[i] = items[i].data;
+        orig_len[i] = items[i].len;
+        buf = encode (priv, items[i].data, items[i].len, &buf_len);
+        if (buf) {
+            items[i].data = buf;
+            items[i].len = buf_len;
+        }
+    }
+
+    priv->inner->write_batch (priv->inner, items, n_items);
+
+    /* The caller owns the original buffers. */
+    for (i = 0; i < n_items; ++i) {
+        if (items[i].data != orig_data[i])
+            g_free (items[i].data);
+        items[i].data = orig_data[i];
+        items[i].len = orig_len[i];
+    }
+
+    g_free (orig_data);
+    g_free (orig_len);
+}
+
+static void
+obj_backend_compress_exists_batch (ObjBackend *bend,
+                                   ObjBatchItem *items,
+                                   int n_items)
+{
+    CompressPriv *priv = bend->priv;
+
+    priv->inner->exists_batch (priv->inner, items, n_items);
+}
+
+static int
+obj_backend_compress_foreach_obj (ObjBackend *bend,
+                                  ObjBackendFunc process,
+                                  void *user_data)
+{
+    CompressPriv *priv = bend->priv;
+
+    return priv->inner->foreach_obj (priv->inner, process, user_data);
+}
+
+/*
+ * Wrap @inner so that objects are compressed with @codec ("zlib" or
+ * "none") at @level. Returns NULL on an unknown codec.
+ */
+ObjBackend *
+obj_backend_compress_new (ObjBackend *inner, const char *codec, int level)
+{
+    ObjBackend *bend;
+    CompressPriv *priv;
+
+    priv = g_new0 (CompressPriv, 1);
+    priv->inner = inner;
+
+    if (g_ascii_strcasecmp (codec, "zlib") == 0) {
+        priv->codec = CODEC_ZLIB;
+        priv->level = (level >= 1 && level <= 9) ?
+            level : Z_DEFAULT_COMPRESSION;
+    } else if (g_ascii_strcasecmp (codec, "none") == 0) {
+        priv->codec = CODEC_NONE;
+    } else {
+        seaf_warning ("[compress] Unknown codec %s.\n", codec);
+        g_free (priv);
+        return NULL;
+    }
+
+    bend = g_new0 (ObjBackend, 1);
+    bend->priv = priv;
+
+    bend->read = obj_backend_compress_read;
+    bend->write = obj_backend_compress_write;
+    bend->exists = obj_backend_compress_exists;
+    bend->delete = obj_backend_compress_delete;
+    if (inner->read_batch)
+        bend->read_batch = obj_backend_compress_read_batch;
+    if (inner->write_batch)
+        bend->write_batch = obj_backend_compress_write_batch;
+    if (inner->exists_batch)
+        bend->exists_batch = obj_backend_compress_exists_batch;
+    if (inner->foreach_obj)
+        bend->foreach_obj = obj_backend_compress_foreach_obj;
+
+    return bend;
+}
@@ -1,4 +1,8 @@
 #include "common.h"
+
+#include <fcntl.h>
+
+#include "utils.h"
 #include "obj-backend.h"
 
 typedef struct FsPriv {
@@ -44,6 +48,58 @@ obj_backend_fs_read (ObjBackend *bend,
     return 0;
 }
 
+/*
+ * Open all the objects first and ask the kernel to read them ahead, so
+ * that the disk can serve the whole batch in one go.
+ */
+static void
+obj_backend_fs_read_batch (ObjBackend *bend,
+                           ObjBatchItem *items,
+                           int n_items)
+{
+    char path[PATH_MAX];
+    int *fds;
+    struct stat st;
+    ObjBatchItem *item;
+    int i, n;
+
+    fds = g_new (int, n_items);
+
+    for (i = 0; i < n_items; ++i) {
+        id_to_path (bend->priv, items[i].obj_id, path);
+        fds[i] = g_open (path, O_RDONLY | O_BINARY, 0);
+#ifdef POSIX_FADV_WILLNEED
+        if (fds[i] >= 0)
+            posix_fadvise (fds[i], 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    for (i = 0; i < n_items; ++i) {
+        item = &items[i];
+        item->success = FALSE;
+        if (fds[i] < 0)
+            continue;
+
+        if (fstat (fds[i], &st) < 0)
+            goto next;
+
+        item->data = g_malloc (st.st_size);
+        n = readn (fds[i], item->data, st.st_size);
+        if (n != st.st_size) {
+            g_free (item->data);
+            item->data = NULL;
+            goto next;
+        }
+        item->len = n;
+        item->success = TRUE;
+
+    next:
+        close (fds[i]);
+    }
+
+    g_free (fds);
+}
+
 static int
 obj_backend_fs_write (ObjBackend *bend,
                       const char *obj_id,
@@ -96,6 +152,40 @@ obj_backend_fs_delete (ObjBackend *bend,
     g_unlink (path);
 }
 
+static int
+obj_backend_fs_foreach_obj (ObjBackend *bend,
+                            ObjBackendFunc process,
+                            void *user_data)
+{
+    FsPriv *priv = bend->priv;
+    char path[PATH_MAX];
+    char obj_id[41];
+    GDir *dir;
+    const char *dname;
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        snprintf (path, sizeof(path), "%s/%02x", priv->obj_dir, i);
+        dir = g_dir_open (path, 0, NULL);
+        if (!dir)
+            continue;
+
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            /* Skip temp files left by g_file_set_contents(). */
+            if (strlen (dname) != 38)
+                continue;
+            snprintf (obj_id, sizeof(obj_id), "%02x%s", i, dname);
+            if (!process (obj_id, user_data)) {
+                g_dir_close (dir);
+                return 0;
+            }
+        }
+        g_dir_close (dir);
+    }
+
+    return 0;
+}
+
 static void
 init_obj_dir (ObjBackend *bend)
 {
@@ -143,6 +233,8 @@ obj_backend_fs_new (const char *obj_dir)
     bend->write = obj_backend_fs_write;
     bend->exists = obj_backend_fs_exists;
     bend->delete = obj_backend_fs_delete;
+    bend->read_batch = obj_backend_fs_read_batch;
+    bend->foreach_obj = obj_backend_fs_foreach_obj;
 
     return bend;
 
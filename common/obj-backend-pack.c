@@ -0,0 +1,1592 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Object backend that stores objects in pack files.
+ *
+ * Objects are appended to the active pack. Each record is the raw
+ * object id, the data length and the data. A deleted object gets a
+ * record with DELETED_LEN and no data. The index of the active pack is
+ * kept in memory and rebuilt by scanning the pack at start up.
+ *
+ * When the active pack reaches pack_size it is sealed: a sorted index
+ * of (id, length, offset) is written next to it and mmapped, and a new
+ * active pack is started. Sealed packs are never modified.
+ *
+ * Lookups go from the newest pack to the oldest, so a later record of an
+ * id shadows the earlier ones. Sealed packs are merged by size tier: a
+ * pack is in tier t if it's smaller than pack_size * repack_threshold^(t+1).
+ * Once repack_threshold packs of one tier are next to each other in
+ * lookup order, a background thread merges them into one pack of about
+ * the next tier, dropping shadowed objects. So each object is rewritten
+ * about once per tier, and writers never wait for a merge. Deleted
+ * objects are dropped only when the oldest pack is merged, before that
+ * their records still shadow older packs. The merge reads the sorted
+ * indexes in parallel, so it doesn't need memory for every object id.
+ *
+ * Several processes (seaf-server, httpserver, gc) use the same packs.
+ * Writers hold an exclusive flock on the LOCK file, which also stores a
+ * change counter, bumped when packs are created, sealed or removed, and
+ * the next pack id. A lookup that misses takes a shared lock, picks up
+ * records other processes appended to the active pack and, if the
+ * counter changed, re-reads the list of packs.
+ *
+ * Files in the pack dir:
+ *   LOCK             change counter and next pack id
+ *   REPACK           held while a process repacks
+ *   pack-<id>.pack   records
+ *   pack-<id>.idx    index of a sealed pack
+ */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <arpa/inet.h>
+#endif
+
+#include "utils.h"
+#include "log.h"
+#include "obj-backend.h"
+
+#ifndef WIN32
+
+#define PACK_MAGIC "SEAFPACK"
+#define IDX_MAGIC  "SEAFPIDX"
+#define PACK_VERSION 1
+
+#define DELETED_LEN 0xFFFFFFFF
+
+#define DEFAULT_PACK_SIZE (64 << 20)
+#define DEFAULT_REPACK_THRESHOLD 16
+
+typedef struct PackHeader {
+    char    magic[8];
+    guint32 version;
+} __attribute__((gcc_struct, __packed__)) PackHeader;
+
+typedef struct RecordHeader {
+    unsigned char id[20];
+    guint32 len;
+} __attribute__((gcc_struct, __packed__)) RecordHeader;
+
+typedef struct IdxHeader {
+    char    magic[8];
+    guint32 version;
+    guint32 count;
+    guint64 generation;
+} __attribute__((gcc_struct, __packed__)) IdxHeader;
+
+typedef struct LockState {
+    guint64 change_seq;
+    guint32 next_id;
+} __attribute__((gcc_struct, __packed__)) LockState;
+
+typedef struct IdxEntry {
+    unsigned char id[20];
+    guint32 len;
+    guint64 offset;             /* of the data, in the pack file */
+} __attribute__((gcc_struct, __packed__)) IdxEntry;
+
+typedef struct Pack {
+    int       ref;
+    guint32   id;
+    /* Lookup order. The id of a repacked pack is newer than its
+     * generation.
+     */
+    guint64   generation;
+    int       fd;
+    char      *pack_path;
+    char      *idx_path;
+
+    /* Sealed packs only. */
+    guint64   size;             /* of the pack file */
+    void      *idx_map;
+    gsize     idx_map_len;
+    IdxEntry  *entries;
+    guint32   count;
+} Pack;
+
+typedef struct PackLoc {
+    guint64 offset;
+    guint32 len;
+} PackLoc;
+
+typedef struct PackPriv {
+    char        *pack_dir;
+    guint64     pack_size;
+    int         repack_threshold;
+
+    /* Threads of this process. Taken before the flock. */
+    pthread_mutex_t lock;
+    int         lock_fd;
+    int         repack_fd;
+    guint64     change_seq;     /* last seen */
+
+    Pack        *active;
+    guint64     active_size;
+    GHashTable  *active_index;   /* hex id -> PackLoc */
+
+    GList       *sealed;        /* newest generation first */
+    int         n_sealed;
+    gboolean    repacking;
+
+    /* Merges run in this thread. A merge is queued when packs are
+     * sealed, the thread then merges as long as a tier is full. */
+    GThreadPool *repack_pool;
+    gboolean    repack_queued;
+    gboolean    sealed_changed;
+} PackPriv;
+
+static guint64
+hton64_ (guint64 v)
+{
+    return ((guint64)htonl ((guint32)(v & 0xFFFFFFFF)) << 32) |
+        htonl ((guint32)(v >> 32));
+}
+
+#define ntoh64_ hton64_
+
+static char *
+pack_file_path (PackPriv *priv, guint32 id, const char *ext)
+{
+    char name[32];
+
+    snprintf (name, sizeof(name), "pack-%08x.%s", id, ext);
+    return g_build_filename (priv->pack_dir, name, NULL);
+}
+
+static void
+pack_ref (Pack *pack)
+{
+    ++pack->ref;
+}
+
+/* Called with priv->lock held. */
+static void
+pack_unref (Pack *pack)
+{
+    if (--pack->ref > 0)
+        return;
+
+    if (pack->idx_map)
+        munmap (pack->idx_map, pack->idx_map_len);
+    if (pack->fd >= 0)
+        close (pack->fd);
+    g_free (pack->pack_path);
+    g_free (pack->idx_path);
+    g_free (pack);
+}
+
+static Pack *
+pack_new (PackPriv *priv, guint32 id)
+{
+    Pack *pack = g_new0 (Pack, 1);
+
+    pack->ref = 1;
+    pack->id = id;
+    pack->generation = id;
+    pack->fd = -1;
+    pack->pack_path = pack_file_path (priv, id, "pack");
+    pack->idx_path = pack_file_path (priv, id, "idx");
+
+    return pack;
+}
+
+static int
+map_index (Pack *pack)
+{
+    struct stat st;
+    IdxHeader *hdr;
+    int fd;
+
+    fd = g_open (pack->idx_path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("[pack] Failed to open %s: %s.\n",
+                      pack->idx_path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat (fd, &st) < 0 || st.st_size < sizeof(IdxHeader)) {
+        seaf_warning ("[pack] Bad index %s.\n", pack->idx_path);
+        close (fd);
+        return -1;
+    }
+
+    pack->idx_map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (pack->idx_map == MAP_FAILED) {
+        pack->idx_map = NULL;
+        seaf_warning ("[pack] Failed to map %s: %s.\n",
+                      pack->idx_path, strerror(errno));
+        return -1;
+    }
+    pack->idx_map_len = st.st_size;
+
+    hdr = pack->idx_map;
+    if (memcmp (hdr->magic, IDX_MAGIC, 8) != 0 ||
+        ntohl (hdr->version) != PACK_VERSION ||
+        sizeof(IdxHeader) + (guint64)ntohl (hdr->count) * sizeof(IdxEntry)
+        != st.st_size) {
+        seaf_warning ("[pack] Bad index %s.\n", pack->idx_path);
+        return -1;
+    }
+
+    pack->count = ntohl (hdr->count);
+    pack->generation = ntoh64_ (hdr->generation);
+    pack->entries = (IdxEntry *)(hdr + 1);
+
+    if (pack->fd >= 0 && fstat (pack->fd, &st) == 0)
+        pack->size = st.st_size;
+
+    return 0;
+}
+
+static IdxEntry *
+pack_lookup (Pack *pack, const unsigned char *id)
+{
+    guint32 lo = 0, hi = pack->count, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = memcmp (pack->entries[mid].id, id, 20);
+        if (cmp == 0)
+            return &pack->entries[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+static gint
+compare_idx_entry (gconstpointer a, gconstpointer b)
+{
+    return memcmp (((const IdxEntry *)a)->id, ((const IdxEntry *)b)->id, 20);
+}
+
+/*
+ * Write a sorted index of @entries to @pack->idx_path. @entries are in
+ * host byte order and are sorted in place.
+ */
+static int
+write_index (Pack *pack, IdxEntry *entries, guint32 count)
+{
+    char *tmp_path;
+    IdxHeader hdr;
+    guint32 i;
+    int fd;
+    int ret = -1;
+
+    qsort (entries, count, sizeof(IdxEntry), compare_idx_entry);
+    for (i = 0; i < count; ++i) {
+        entries[i].len = htonl (entries[i].len);
+        entries[i].offset = hton64_ (entries[i].offset);
+    }
+
+    memcpy (hdr.magic, IDX_MAGIC, 8);
+    hdr.version = htonl (PACK_VERSION);
+    hdr.count = htonl (count);
+    hdr.generation = hton64_ (pack->generation);
+
+    tmp_path = g_strconcat (pack->idx_path, ".tmp", NULL);
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[pack] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        goto out;
+    }
+
+    if (writen (fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        writen (fd, entries, (gsize)count * sizeof(IdxEntry)) !=
+        (gsize)count * sizeof(IdxEntry) ||
+        fsync (fd) < 0) {
+        seaf_warning ("[pack] Failed to write %s: %s.\n",
+                      tmp_path, strerror(errno));
+        close (fd);
+        g_unlink (tmp_path);
+        goto out;
+    }
+    close (fd);
+
+    if (g_rename (tmp_path, pack->idx_path) < 0) {
+        seaf_warning ("[pack] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    g_free (tmp_path);
+    return ret;
+}
+
+
+static int
+lock_packs (PackPriv *priv, int op)
+{
+    while (flock (priv->lock_fd, op) < 0) {
+        if (errno != EINTR) {
+            seaf_warning ("[pack] Failed to lock %s: %s.\n",
+                          priv->pack_dir, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+unlock_packs (PackPriv *priv)
+{
+    flock (priv->lock_fd, LOCK_UN);
+}
+
+/* Called with the flock held. A new LOCK file reads as all zeros. */
+static void
+read_lock_state (PackPriv *priv, LockState *state)
+{
+    if (pread (priv->lock_fd, state, sizeof(*state), 0) != sizeof(*state)) {
+        memset (state, 0, sizeof(*state));
+        return;
+    }
+    state->change_seq = ntoh64_ (state->change_seq);
+    state->next_id = ntohl (state->next_id);
+}
+
+/* Called with the exclusive flock held. */
+static int
+write_lock_state (PackPriv *priv, const LockState *state)
+{
+    LockState buf;
+
+    buf.change_seq = hton64_ (state->change_seq);
+    buf.next_id = htonl (state->next_id);
+    if (pwrite (priv->lock_fd, &buf, sizeof(buf), 0) != sizeof(buf)) {
+        seaf_warning ("[pack] Failed to update lock file in %s: %s.\n",
+                      priv->pack_dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Tell the other processes that the set of packs changed. Called with
+ * the exclusive flock held, after refresh_packs(), so no change from
+ * other processes is skipped.
+ */
+static void
+bump_change_seq (PackPriv *priv)
+{
+    LockState state;
+
+    read_lock_state (priv, &state);
+    state.change_seq++;
+    if (write_lock_state (priv, &state) == 0)
+        priv->change_seq = state.change_seq;
+}
+
+/* Called with the exclusive flock held. */
+static gint64
+alloc_pack_id (PackPriv *priv)
+{
+    LockState state;
+    guint32 id;
+
+    read_lock_state (priv, &state);
+    id = state.next_id++;
+    if (write_lock_state (priv, &state) < 0)
+        return -1;
+    return id;
+}
+
+/*
+ * Scan the records of an unsealed pack between @start and @end into
+ * @index. Returns the end of the last complete record, or -1.
+ */
+static gint64
+scan_records (Pack *pack, GHashTable *index, guint64 start, guint64 end)
+{
+    RecordHeader rhdr;
+    guint64 offset = start;
+    guint32 len;
+    char hex[41];
+    PackLoc *loc;
+
+    while (offset + sizeof(rhdr) <= end) {
+        if (pread (pack->fd, &rhdr, sizeof(rhdr), offset) != sizeof(rhdr))
+            break;
+
+        len = ntohl (rhdr.len);
+        if (len != DELETED_LEN &&
+            offset + sizeof(rhdr) + len > end)
+            break;
+
+        rawdata_to_hex (rhdr.id, hex, 20);
+        loc = g_new0 (PackLoc, 1);
+        loc->offset = offset + sizeof(rhdr);
+        loc->len = len;
+        g_hash_table_replace (index, g_strdup(hex), loc);
+
+        offset += sizeof(rhdr) + (len == DELETED_LEN ? 0 : len);
+    }
+
+    return offset;
+}
+
+/*
+ * Scan a whole unsealed pack. A partly written record at the end, from
+ * a crash, is cut off if @truncate is set. Returns the size of the valid
+ * part of the pack, or -1.
+ */
+static gint64
+scan_pack (Pack *pack, GHashTable *index, gboolean truncate)
+{
+    PackHeader phdr;
+    struct stat st;
+    gint64 offset;
+
+    if (fstat (pack->fd, &st) < 0)
+        return -1;
+
+    if (pread (pack->fd, &phdr, sizeof(phdr), 0) != sizeof(phdr) ||
+        memcmp (phdr.magic, PACK_MAGIC, 8) != 0) {
+        seaf_warning ("[pack] Bad pack %s.\n", pack->pack_path);
+        return -1;
+    }
+
+    offset = scan_records (pack, index, sizeof(phdr), st.st_size);
+
+    if (truncate && offset < st.st_size) {
+        seaf_warning ("[pack] Truncating %s from %"G_GINT64_FORMAT
+                      " to %"G_GINT64_FORMAT" bytes.\n",
+                      pack->pack_path, (gint64)st.st_size, offset);
+        if (ftruncate (pack->fd, offset) < 0)
+            return -1;
+    }
+
+    return offset;
+}
+
+static int
+index_to_entries (GHashTable *index, IdxEntry **entries, guint32 *count)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    IdxEntry *e;
+    PackLoc *loc;
+
+    *count = g_hash_table_size (index);
+    *entries = g_new0 (IdxEntry, *count ? *count : 1);
+
+    e = *entries;
+    g_hash_table_iter_init (&iter, index);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        loc = value;
+        hex_to_rawdata (key, e->id, 20);
+        e->len = loc->len;
+        e->offset = loc->offset;
+        ++e;
+    }
+
+    return 0;
+}
+
+/* Add @pack to the sealed list, keeping it sorted by generation. */
+static void
+insert_sealed (PackPriv *priv, Pack *pack)
+{
+    GList *ptr;
+
+    for (ptr = priv->sealed; ptr; ptr = ptr->next) {
+        if (((Pack *)ptr->data)->generation < pack->generation)
+            break;
+    }
+    priv->sealed = g_list_insert_before (priv->sealed, ptr, pack);
+    priv->n_sealed++;
+    priv->sealed_changed = TRUE;
+}
+
+static void
+remove_sealed (PackPriv *priv, GList *link)
+{
+    pack_unref (link->data);
+    priv->sealed = g_list_delete_link (priv->sealed, link);
+    priv->n_sealed--;
+}
+
+static void
+set_active_pack (PackPriv *priv, Pack *pack, guint64 size, GHashTable *index)
+{
+    if (priv->active)
+        pack_unref (priv->active);
+    if (priv->active_index)
+        g_hash_table_destroy (priv->active_index);
+
+    priv->active = pack;
+    priv->active_size = size;
+    priv->active_index = index;
+}
+
+/* Called with the exclusive flock held. */
+static int
+open_active_pack (PackPriv *priv)
+{
+    Pack *pack;
+    PackHeader hdr;
+    gint64 id;
+
+    id = alloc_pack_id (priv);
+    if (id < 0)
+        return -1;
+
+    pack = pack_new (priv, (guint32)id);
+    pack->fd = g_open (pack->pack_path,
+                       O_RDWR | O_CREAT | O_EXCL | O_BINARY, 0666);
+    if (pack->fd < 0) {
+        seaf_warning ("[pack] Failed to create %s: %s.\n",
+                      pack->pack_path, strerror(errno));
+        pack_unref (pack);
+        return -1;
+    }
+
+    memcpy (hdr.magic, PACK_MAGIC, 8);
+    hdr.version = htonl (PACK_VERSION);
+    if (writen (pack->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        seaf_warning ("[pack] Failed to write %s.\n", pack->pack_path);
+        g_unlink (pack->pack_path);
+        pack_unref (pack);
+        return -1;
+    }
+
+    set_active_pack (priv, pack, sizeof(hdr),
+                     g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free));
+    bump_change_seq (priv);
+    return 0;
+}
+
+/* Write the index of an unsealed pack and add it to the sealed list. */
+static int
+seal_pack (PackPriv *priv, Pack *pack, GHashTable *index)
+{
+    IdxEntry *entries;
+    guint32 count;
+    int ret;
+
+    if (fsync (pack->fd) < 0) {
+        seaf_warning ("[pack] Failed to sync %s.\n", pack->pack_path);
+        return -1;
+    }
+
+    index_to_entries (index, &entries, &count);
+    ret = write_index (pack, entries, count);
+    g_free (entries);
+    if (ret < 0)
+        return -1;
+
+    if (map_index (pack) < 0)
+        return -1;
+
+    insert_sealed (priv, pack);
+    return 0;
+}
+
+/* Called with priv->lock and the exclusive flock held. */
+static int
+seal_active_pack (PackPriv *priv)
+{
+    Pack *pack = priv->active;
+
+    if (seal_pack (priv, pack, priv->active_index) < 0)
+        return -1;
+
+    /* The sealed list owns the reference now. */
+    priv->active = NULL;
+    set_active_pack (priv, NULL, 0, NULL);
+
+    return open_active_pack (priv);
+}
+
+static Pack *
+open_sealed_pack (PackPriv *priv, guint32 id)
+{
+    Pack *pack = pack_new (priv, id);
+
+    pack->fd = g_open (pack->pack_path, O_RDONLY | O_BINARY, 0);
+    if (pack->fd < 0 || map_index (pack) < 0) {
+        seaf_warning ("[pack] Failed to open %s.\n", pack->pack_path);
+        pack_unref (pack);
+        return NULL;
+    }
+
+    return pack;
+}
+
+static gint
+compare_pack_id (gconstpointer a, gconstpointer b)
+{
+    guint32 ia = GPOINTER_TO_UINT(a), ib = GPOINTER_TO_UINT(b);
+
+    return (ia < ib) ? -1 : (ia > ib);
+}
+
+/* Match "pack-<8 hex digits>.pack" and nothing else. */
+static gboolean
+parse_pack_name (const char *name, guint32 *id)
+{
+    char *end;
+
+    if (strlen (name) != 18 || strncmp (name, "pack-", 5) != 0 ||
+        strcmp (name + 13, ".pack") != 0)
+        return FALSE;
+
+    *id = (guint32)strtoul (name + 5, &end, 16);
+    return end == name + 13;
+}
+
+static Pack *
+find_sealed_by_id (PackPriv *priv, guint32 id, GList **link)
+{
+    GList *ptr;
+
+    for (ptr = priv->sealed; ptr; ptr = ptr->next) {
+        if (((Pack *)ptr->data)->id == id) {
+            *link = ptr;
+            return ptr->data;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Bring the list of packs in line with the pack dir. New sealed packs
+ * are mapped, packs removed by a repack are dropped, and the newest pack
+ * without an index becomes the active pack. Other packs without an
+ * index are left over from a crash while sealing; they are sealed if
+ * @exclusive. Called with priv->lock and the flock held.
+ */
+static int
+reload_pack_list (PackPriv *priv, gboolean exclusive)
+{
+    GDir *dir;
+    const char *name;
+    GList *ids = NULL, *unsealed = NULL, *ptr, *link, *next;
+    GHashTable *index;
+    guint32 id, active_id = 0;
+    gboolean changed = FALSE;
+    char *idx_path;
+    Pack *pack;
+    gint64 size;
+    LockState state;
+    int ret = 0;
+
+    dir = g_dir_open (priv->pack_dir, 0, NULL);
+    if (!dir) {
+        seaf_warning ("[pack] Failed to open dir %s.\n", priv->pack_dir);
+        return -1;
+    }
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (parse_pack_name (name, &id))
+            ids = g_list_insert_sorted (ids, GUINT_TO_POINTER(id),
+                                        compare_pack_id);
+    }
+    g_dir_close (dir);
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        id = GPOINTER_TO_UINT(ptr->data);
+
+        if (find_sealed_by_id (priv, id, &link))
+            continue;
+
+        idx_path = pack_file_path (priv, id, "idx");
+        if (!g_file_test (idx_path, G_FILE_TEST_EXISTS)) {
+            unsealed = g_list_append (unsealed, ptr->data);
+            g_free (idx_path);
+            continue;
+        }
+        g_free (idx_path);
+
+        if (priv->active && priv->active->id == id) {
+            /* Sealed by another process. */
+            pack = priv->active;
+            pack_ref (pack);
+            if (map_index (pack) < 0) {
+                pack_unref (pack);
+                ret = -1;
+                continue;
+            }
+            insert_sealed (priv, pack);
+            set_active_pack (priv, NULL, 0, NULL);
+            continue;
+        }
+
+        pack = open_sealed_pack (priv, id);
+        if (!pack) {
+            ret = -1;
+            continue;
+        }
+        insert_sealed (priv, pack);
+    }
+
+    for (ptr = unsealed; ptr; ptr = ptr->next) {
+        id = GPOINTER_TO_UINT(ptr->data);
+        if (ptr->next == NULL) {
+            active_id = id;
+            break;
+        }
+        if (!exclusive)
+            continue;
+
+        pack = pack_new (priv, id);
+        pack->fd = g_open (pack->pack_path, O_RDWR | O_BINARY, 0);
+        index = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, g_free);
+        if (pack->fd < 0 || scan_pack (pack, index, TRUE) < 0 ||
+            seal_pack (priv, pack, index) < 0) {
+            seaf_warning ("[pack] Failed to seal %s.\n", pack->pack_path);
+            pack_unref (pack);
+            ret = -1;
+        } else
+            changed = TRUE;
+        g_hash_table_destroy (index);
+    }
+
+    /* Drop the packs that were merged by a repack. */
+    for (link = priv->sealed; link; link = next) {
+        next = link->next;
+        pack = link->data;
+        if (!g_list_find (ids, GUINT_TO_POINTER(pack->id)))
+            remove_sealed (priv, link);
+    }
+
+    if (unsealed && (!priv->active || priv->active->id != active_id)) {
+        pack = pack_new (priv, active_id);
+        pack->fd = g_open (pack->pack_path, O_RDWR | O_BINARY, 0);
+        index = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, g_free);
+        if (pack->fd < 0 || (size = scan_pack (pack, index, exclusive)) < 0) {
+            seaf_warning ("[pack] Failed to open %s.\n", pack->pack_path);
+            g_hash_table_destroy (index);
+            pack_unref (pack);
+            ret = -1;
+        } else
+            set_active_pack (priv, pack, size, index);
+    }
+
+    /* Keep the id counter ahead of the packs, e.g. for a new LOCK file. */
+    if (exclusive && ids) {
+        id = GPOINTER_TO_UINT(g_list_last(ids)->data);
+        read_lock_state (priv, &state);
+        if (state.next_id <= id) {
+            state.next_id = id + 1;
+            write_lock_state (priv, &state);
+        }
+    }
+
+    g_list_free (ids);
+    g_list_free (unsealed);
+
+    if (changed)
+        bump_change_seq (priv);
+
+    return ret;
+}
+
+/*
+ * Catch up with the other processes: reload the pack list if it changed
+ * and index the records appended to the active pack. Called with
+ * priv->lock and the flock held.
+ */
+static int
+refresh_packs (PackPriv *priv, gboolean exclusive)
+{
+    LockState state;
+    struct stat st;
+    gint64 offset;
+
+    read_lock_state (priv, &state);
+    if (state.change_seq != priv->change_seq) {
+        priv->change_seq = state.change_seq;
+        if (reload_pack_list (priv, exclusive) < 0)
+            return -1;
+    }
+
+    if (!priv->active)
+        return 0;
+
+    if (fstat (priv->active->fd, &st) < 0)
+        return -1;
+    if (st.st_size <= priv->active_size)
+        return 0;
+
+    offset = scan_records (priv->active, priv->active_index,
+                           priv->active_size, st.st_size);
+    priv->active_size = offset;
+
+    /* Writers hold the exclusive lock, so a partial record is from a
+     * crash.
+     */
+    if (exclusive && offset < st.st_size) {
+        seaf_warning ("[pack] Truncating %s from %"G_GINT64_FORMAT
+                      " to %"G_GINT64_FORMAT" bytes.\n",
+                      priv->active->pack_path, (gint64)st.st_size, offset);
+        if (ftruncate (priv->active->fd, offset) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Merge sealed packs into @tmp_path. @packs are sorted by generation,
+ * newest first. For each id only the record from the newest pack is
+ * kept. Deleted objects are dropped if @drop_deleted, i.e. if there is
+ * no older pack their records could shadow. The index is written under
+ * the final name of the pack.
+ */
+static Pack *
+merge_packs (PackPriv *priv, Pack **packs, int n_packs, guint32 id,
+             const char *tmp_path, gboolean drop_deleted)
+{
+    Pack *out;
+    PackHeader hdr;
+    guint32 *pos;
+    IdxEntry *entries = NULL;
+    guint32 n_entries = 0, max_entries = 0;
+    guint64 offset;
+    RecordHeader rhdr;
+    char *buf = NULL;
+    guint32 buf_size = 0;
+    int i, best;
+    guint32 len;
+    int cmp;
+
+    out = pack_new (priv, id);
+    out->generation = packs[0]->generation;
+
+    out->fd = g_open (tmp_path,
+                      O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (out->fd < 0) {
+        seaf_warning ("[pack] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        pack_unref (out);
+        return NULL;
+    }
+
+    memcpy (hdr.magic, PACK_MAGIC, 8);
+    hdr.version = htonl (PACK_VERSION);
+    if (writen (out->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto error;
+    offset = sizeof(hdr);
+
+    pos = g_new0 (guint32, n_packs);
+
+    while (1) {
+        /* Pick the smallest id; on a tie the newest pack wins. */
+        best = -1;
+        for (i = 0; i < n_packs; ++i) {
+            if (pos[i] >= packs[i]->count)
+                continue;
+            if (best < 0) {
+                best = i;
+                continue;
+            }
+            cmp = memcmp (packs[i]->entries[pos[i]].id,
+                          packs[best]->entries[pos[best]].id, 20);
+            if (cmp < 0)
+                best = i;
+        }
+        if (best < 0)
+            break;
+
+        IdxEntry *e = &packs[best]->entries[pos[best]];
+        for (i = 0; i < n_packs; ++i) {
+            if (i != best && pos[i] < packs[i]->count &&
+                memcmp (packs[i]->entries[pos[i]].id, e->id, 20) == 0)
+                pos[i]++;
+        }
+        pos[best]++;
+
+        len = ntohl (e->len);
+        if (len == DELETED_LEN && drop_deleted)
+            continue;
+
+        if (len == DELETED_LEN) {
+            memcpy (rhdr.id, e->id, 20);
+            rhdr.len = htonl (DELETED_LEN);
+            if (writen (out->fd, &rhdr, sizeof(rhdr)) != sizeof(rhdr)) {
+                seaf_warning ("[pack] Failed to write %s.\n", tmp_path);
+                goto error_pos;
+            }
+        } else {
+            if (len > buf_size) {
+                buf = g_realloc (buf, len);
+                buf_size = len;
+            }
+            if (pread (packs[best]->fd, buf, len,
+                       ntoh64_ (e->offset)) != (ssize_t)len) {
+                seaf_warning ("[pack] Failed to read %s.\n",
+                              packs[best]->pack_path);
+                goto error_pos;
+            }
+
+            memcpy (rhdr.id, e->id, 20);
+            rhdr.len = htonl (len);
+            if (writen (out->fd, &rhdr, sizeof(rhdr)) != sizeof(rhdr) ||
+                writen (out->fd, buf, len) != (ssize_t)len) {
+                seaf_warning ("[pack] Failed to write %s.\n", tmp_path);
+                goto error_pos;
+            }
+        }
+
+        if (n_entries == max_entries) {
+            max_entries = max_entries ? max_entries * 2 : 1024;
+            entries = g_renew (IdxEntry, entries, max_entries);
+        }
+        memcpy (entries[n_entries].id, e->id, 20);
+        entries[n_entries].len = len;
+        entries[n_entries].offset = offset + sizeof(rhdr);
+        ++n_entries;
+
+        offset += sizeof(rhdr) + (len == DELETED_LEN ? 0 : len);
+    }
+
+    g_free (pos);
+    g_free (buf);
+
+    if (fsync (out->fd) < 0 || write_index (out, entries, n_entries) < 0) {
+        g_free (entries);
+        goto error;
+    }
+    g_free (entries);
+
+    if (map_index (out) < 0) {
+        g_unlink (out->idx_path);
+        goto error;
+    }
+
+    return out;
+
+error_pos:
+    g_free (pos);
+    g_free (buf);
+    g_free (entries);
+error:
+    g_unlink (tmp_path);
+    pack_unref (out);
+    return NULL;
+}
+
+static int
+pack_tier (PackPriv *priv, guint64 size)
+{
+    guint64 limit = priv->pack_size * priv->repack_threshold;
+    int tier = 0;
+
+    while (size >= limit && limit < G_MAXUINT64 / priv->repack_threshold) {
+        limit *= priv->repack_threshold;
+        ++tier;
+    }
+
+    return tier;
+}
+
+/*
+ * Find repack_threshold packs of the same tier next to each other in the
+ * sealed list, the newest tier first. Only packs next to each other can
+ * be merged, the merged pack takes the place of all of them in lookup
+ * order. Returns the link of the newest of them, or NULL. Called with
+ * priv->lock held.
+ */
+static GList *
+pick_packs_to_merge (PackPriv *priv)
+{
+    GList *ptr, *run = NULL;
+    int tier, run_tier = -1, run_len = 0;
+
+    for (ptr = priv->sealed; ptr; ptr = ptr->next) {
+        tier = pack_tier (priv, ((Pack *)ptr->data)->size);
+        if (tier != run_tier) {
+            run = ptr;
+            run_tier = tier;
+            run_len = 0;
+        }
+        if (++run_len == priv->repack_threshold)
+            return run;
+    }
+
+    return NULL;
+}
+
+/*
+ * Merge one set of packs picked by pick_packs_to_merge(). At most one
+ * process repacks at a time, and the merge runs without any lock; sealed
+ * packs don't change and packs sealed meanwhile are newer than the
+ * merged one. Returns TRUE if packs were merged.
+ */
+static gboolean
+repack_once (PackPriv *priv)
+{
+    Pack **packs = NULL;
+    Pack *merged;
+    GList *ptr, *link;
+    int n = 0, i;
+    gint64 id = -1;
+    gboolean drop_deleted = FALSE, done = FALSE;
+    char *tmp_path;
+
+    if (flock (priv->repack_fd, LOCK_EX | LOCK_NB) < 0)
+        return FALSE;
+
+    pthread_mutex_lock (&priv->lock);
+    if (priv->repacking || lock_packs (priv, LOCK_EX) < 0) {
+        pthread_mutex_unlock (&priv->lock);
+        flock (priv->repack_fd, LOCK_UN);
+        return FALSE;
+    }
+
+    refresh_packs (priv, TRUE);
+    priv->sealed_changed = FALSE;
+    link = pick_packs_to_merge (priv);
+    if (link)
+        id = alloc_pack_id (priv);
+    if (id >= 0) {
+        priv->repacking = TRUE;
+        n = priv->repack_threshold;
+        packs = g_new (Pack *, n);
+        for (ptr = link, i = 0; i < n; ptr = ptr->next, ++i) {
+            packs[i] = ptr->data;
+            pack_ref (packs[i]);
+        }
+        drop_deleted = (ptr == NULL);
+    }
+    unlock_packs (priv);
+    pthread_mutex_unlock (&priv->lock);
+
+    if (id < 0) {
+        flock (priv->repack_fd, LOCK_UN);
+        return FALSE;
+    }
+
+    seaf_message ("[pack] Merging %d packs in %s.\n", n, priv->pack_dir);
+
+    tmp_path = pack_file_path (priv, (guint32)id, "pack.tmp");
+    merged = merge_packs (priv, packs, n, (guint32)id, tmp_path,
+                          drop_deleted);
+
+    pthread_mutex_lock (&priv->lock);
+    if (merged && lock_packs (priv, LOCK_EX) == 0) {
+        refresh_packs (priv, TRUE);
+        if (g_rename (tmp_path, merged->pack_path) == 0) {
+            for (i = 0; i < n; ++i) {
+                g_unlink (packs[i]->pack_path);
+                g_unlink (packs[i]->idx_path);
+                if (find_sealed_by_id (priv, packs[i]->id, &link))
+                    remove_sealed (priv, link);
+            }
+            insert_sealed (priv, merged);
+            merged = NULL;
+            bump_change_seq (priv);
+            done = TRUE;
+        } else
+            seaf_warning ("[pack] Failed to rename %s: %s.\n",
+                          tmp_path, strerror(errno));
+        unlock_packs (priv);
+    }
+    if (merged) {
+        seaf_warning ("[pack] Failed to repack %s.\n", priv->pack_dir);
+        g_unlink (tmp_path);
+        g_unlink (merged->idx_path);
+        pack_unref (merged);
+    }
+
+    for (i = 0; i < n; ++i)
+        pack_unref (packs[i]);
+    priv->repacking = FALSE;
+    pthread_mutex_unlock (&priv->lock);
+
+    flock (priv->repack_fd, LOCK_UN);
+    g_free (tmp_path);
+    g_free (packs);
+
+    return done;
+}
+
+static void
+repack_worker (gpointer data, gpointer vpriv)
+{
+    PackPriv *priv = vpriv;
+
+    /* Seals from now on need another run. */
+    pthread_mutex_lock (&priv->lock);
+    priv->repack_queued = FALSE;
+    pthread_mutex_unlock (&priv->lock);
+
+    /* A merged pack may fill the next tier. */
+    while (repack_once (priv))
+        ;
+}
+
+/* Called with priv->lock held. */
+static void
+queue_repack (PackPriv *priv)
+{
+    if (priv->repack_queued || !priv->repack_pool)
+        return;
+
+    priv->repack_queued = TRUE;
+    g_thread_pool_push (priv->repack_pool, GINT_TO_POINTER(1), NULL);
+}
+
+/*
+ * Find the newest record of @obj_id. Returns a reference to the pack
+ * holding it, or NULL. Called with priv->lock held.
+ */
+static Pack *
+find_object (PackPriv *priv, const char *obj_id, PackLoc *loc)
+{
+    unsigned char id[20];
+    PackLoc *aloc;
+    IdxEntry *e;
+    GList *ptr;
+    Pack *pack;
+
+    aloc = priv->active_index ?
+        g_hash_table_lookup (priv->active_index, obj_id) : NULL;
+    if (aloc) {
+        *loc = *aloc;
+        pack_ref (priv->active);
+        return priv->active;
+    }
+
+    if (hex_to_rawdata (obj_id, id, 20) < 0)
+        return NULL;
+
+    for (ptr = priv->sealed; ptr; ptr = ptr->next) {
+        pack = ptr->data;
+        e = pack_lookup (pack, id);
+        if (e) {
+            loc->offset = ntoh64_ (e->offset);
+            loc->len = ntohl (e->len);
+            pack_ref (pack);
+            return pack;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Like find_object(), but on a miss look again after picking up the
+ * changes made by other processes. Called with priv->lock held.
+ */
+static Pack *
+find_object_shared (PackPriv *priv, const char *obj_id, PackLoc *loc)
+{
+    Pack *pack;
+
+    pack = find_object (priv, obj_id, loc);
+    if (pack)
+        return pack;
+
+    if (lock_packs (priv, LOCK_SH) < 0)
+        return NULL;
+    refresh_packs (priv, FALSE);
+    pack = find_object (priv, obj_id, loc);
+    unlock_packs (priv);
+
+    return pack;
+}
+
+static int
+obj_backend_pack_read (ObjBackend *bend,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    PackPriv *priv = bend->priv;
+    Pack *pack;
+    PackLoc loc;
+    void *buf;
+    int ret = -1;
+
+    pthread_mutex_lock (&priv->lock);
+    pack = find_object_shared (priv, obj_id, &loc);
+    pthread_mutex_unlock (&priv->lock);
+
+    if (!pack)
+        return -1;
+    if (loc.len == DELETED_LEN)
+        goto out;
+
+    buf = g_malloc (loc.len);
+    if (pread (pack->fd, buf, loc.len, loc.offset) != (ssize_t)loc.len) {
+        seaf_warning ("[pack] Failed to read object %s from %s.\n",
+                      obj_id, pack->pack_path);
+        g_free (buf);
+        goto out;
+    }
+
+    *data = buf;
+    *len = loc.len;
+    ret = 0;
+
+out:
+    pthread_mutex_lock (&priv->lock);
+    pack_unref (pack);
+    pthread_mutex_unlock (&priv->lock);
+    return ret;
+}
+
+static gboolean
+obj_backend_pack_exists (ObjBackend *bend,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    Pack *pack;
+    PackLoc loc;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&priv->lock);
+    pack = find_object_shared (priv, obj_id, &loc);
+    if (pack) {
+        ret = (loc.len != DELETED_LEN);
+        pack_unref (pack);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return ret;
+}
+
+/*
+ * Append a record to the active pack and seal the pack once it is full.
+ * Called with priv->lock and the exclusive flock held.
+ */
+static int
+append_record (PackPriv *priv, const char *obj_id, void *data, guint32 len)
+{
+    RecordHeader rhdr;
+    guint32 data_len = (len == DELETED_LEN) ? 0 : len;
+    PackLoc *loc;
+
+    /* The active pack may be missing if starting a new one failed. */
+    if (!priv->active && open_active_pack (priv) < 0)
+        return -1;
+
+    if (hex_to_rawdata (obj_id, rhdr.id, 20) < 0)
+        return -1;
+    rhdr.len = htonl (len);
+
+    if (pwrite (priv->active->fd, &rhdr, sizeof(rhdr),
+                priv->active_size) != sizeof(rhdr) ||
+        (data_len > 0 &&
+         pwrite (priv->active->fd, data, data_len,
+                 priv->active_size + sizeof(rhdr)) != (ssize_t)data_len)) {
+        seaf_warning ("[pack] Failed to write object %s to %s: %s.\n",
+                      obj_id, priv->active->pack_path, strerror(errno));
+        /* Cut off the partial record. */
+        if (ftruncate (priv->active->fd, priv->active_size) < 0)
+            seaf_warning ("[pack] Failed to truncate %s.\n",
+                          priv->active->pack_path);
+        return -1;
+    }
+
+    loc = g_new0 (PackLoc, 1);
+    loc->offset = priv->active_size + sizeof(rhdr);
+    loc->len = len;
+    g_hash_table_replace (priv->active_index, g_strdup(obj_id), loc);
+    priv->active_size += sizeof(rhdr) + data_len;
+
+    if (priv->active_size >= priv->pack_size &&
+        seal_active_pack (priv) < 0)
+        seaf_warning ("[pack] Failed to seal pack in %s.\n", priv->pack_dir);
+
+    return 0;
+}
+
+static int
+obj_backend_pack_write (ObjBackend *bend,
+                        const char *obj_id,
+                        void *data,
+                        int len)
+{
+    PackPriv *priv = bend->priv;
+    Pack *pack;
+    PackLoc loc;
+    int ret = 0;
+
+    pthread_mutex_lock (&priv->lock);
+    if (lock_packs (priv, LOCK_EX) < 0) {
+        pthread_mutex_unlock (&priv->lock);
+        return -1;
+    }
+    refresh_packs (priv, TRUE);
+
+    /* Don't overwrite existing objects. */
+    pack = find_object (priv, obj_id, &loc);
+    if (pack) {
+        pack_unref (pack);
+        if (loc.len != DELETED_LEN)
+            goto out;
+    }
+
+    ret = append_record (priv, obj_id, data, (guint32)len);
+
+out:
+    if (priv->sealed_changed)
+        queue_repack (priv);
+    unlock_packs (priv);
+    pthread_mutex_unlock (&priv->lock);
+
+    return ret;
+}
+
+static void
+obj_backend_pack_delete (ObjBackend *bend,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    Pack *pack;
+    PackLoc loc;
+
+    pthread_mutex_lock (&priv->lock);
+    if (lock_packs (priv, LOCK_EX) < 0) {
+        pthread_mutex_unlock (&priv->lock);
+        return;
+    }
+    refresh_packs (priv, TRUE);
+
+    pack = find_object (priv, obj_id, &loc);
+    if (pack) {
+        pack_unref (pack);
+        if (loc.len != DELETED_LEN)
+            append_record (priv, obj_id, NULL, DELETED_LEN);
+    }
+
+    if (priv->sealed_changed)
+        queue_repack (priv);
+    unlock_packs (priv);
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static int
+obj_backend_pack_foreach_obj (ObjBackend *bend,
+                              ObjBackendFunc process,
+                              void *user_data)
+{
+    PackPriv *priv = bend->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ids = NULL, *ptr;
+    Pack **packs;
+    int n, i;
+    guint32 j;
+    char hex[41];
+    gboolean stop = FALSE;
+
+    /* Copy the active index; the sealed packs don't change. */
+    pthread_mutex_lock (&priv->lock);
+    if (lock_packs (priv, LOCK_SH) == 0) {
+        refresh_packs (priv, FALSE);
+        unlock_packs (priv);
+    }
+    if (priv->active_index) {
+        g_hash_table_iter_init (&iter, priv->active_index);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            if (((PackLoc *)value)->len != DELETED_LEN)
+                ids = g_list_prepend (ids, g_strdup (key));
+        }
+    }
+    n = priv->n_sealed;
+    packs = g_new (Pack *, n ? n : 1);
+    for (ptr = priv->sealed, i = 0; ptr; ptr = ptr->next, ++i) {
+        packs[i] = ptr->data;
+        pack_ref (packs[i]);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    for (ptr = ids; ptr && !stop; ptr = ptr->next)
+        stop = !process (ptr->data, user_data);
+
+    /* Deleted and shadowed records may be listed too. */
+    for (i = 0; i < n && !stop; ++i) {
+        for (j = 0; j < packs[i]->count && !stop; ++j) {
+            if (ntohl (packs[i]->entries[j].len) == DELETED_LEN)
+                continue;
+            rawdata_to_hex (packs[i]->entries[j].id, hex, 20);
+            stop = !process (hex, user_data);
+        }
+    }
+
+    pthread_mutex_lock (&priv->lock);
+    for (i = 0; i < n; ++i)
+        pack_unref (packs[i]);
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (packs);
+    g_list_foreach (ids, (GFunc)g_free, NULL);
+    g_list_free (ids);
+    return 0;
+}
+
+/*
+ * Remove what a crashed repack left behind: a "pack.tmp" file and an
+ * index without a pack. Called holding the REPACK lock.
+ */
+static void
+remove_repack_leftovers (PackPriv *priv)
+{
+    GDir *dir;
+    const char *name;
+    char *path, *pack_path;
+
+    dir = g_dir_open (priv->pack_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (strncmp (name, "pack-", 5) != 0)
+            continue;
+
+        path = g_build_filename (priv->pack_dir, name, NULL);
+        if (g_str_has_suffix (name, ".pack.tmp")) {
+            g_unlink (path);
+        } else if (g_str_has_suffix (name, ".idx")) {
+            pack_path = g_strdup_printf ("%.*s.pack",
+                                         (int)(strlen(path) - 4), path);
+            if (!g_file_test (pack_path, G_FILE_TEST_EXISTS))
+                g_unlink (path);
+            g_free (pack_path);
+        }
+        g_free (path);
+    }
+    g_dir_close (dir);
+}
+
+static int
+open_lock_file (PackPriv *priv, const char *name)
+{
+    char *path = g_build_filename (priv->pack_dir, name, NULL);
+    int fd;
+
+    fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0)
+        seaf_warning ("[pack] Failed to open %s: %s.\n", path, strerror(errno));
+    g_free (path);
+    return fd;
+}
+
+static int
+load_packs (PackPriv *priv)
+{
+    int ret = 0;
+
+    if (flock (priv->repack_fd, LOCK_EX | LOCK_NB) == 0) {
+        remove_repack_leftovers (priv);
+        flock (priv->repack_fd, LOCK_UN);
+    }
+
+    if (lock_packs (priv, LOCK_EX) < 0)
+        return -1;
+
+    if (reload_pack_list (priv, TRUE) < 0)
+        ret = -1;
+    else if (!priv->active && open_active_pack (priv) < 0)
+        ret = -1;
+
+    if (ret == 0) {
+        LockState state;
+
+        read_lock_state (priv, &state);
+        priv->change_seq = state.change_seq;
+    }
+
+    unlock_packs (priv);
+    return ret;
+}
+
+ObjBackend *
+obj_backend_pack_new (const char *pack_dir,
+                      guint64 pack_size,
+                      int repack_threshold)
+{
+    ObjBackend *bend;
+    PackPriv *priv;
+
+    bend = g_new0 (ObjBackend, 1);
+    priv = g_new0 (PackPriv, 1);
+    bend->priv = priv;
+
+    priv->pack_dir = g_strdup (pack_dir);
+    priv->pack_size = pack_size > 0 ? pack_size : DEFAULT_PACK_SIZE;
+    priv->repack_threshold = repack_threshold > 1 ? repack_threshold :
+        DEFAULT_REPACK_THRESHOLD;
+    priv->lock_fd = -1;
+    priv->repack_fd = -1;
+    pthread_mutex_init (&priv->lock, NULL);
+
+    if (g_mkdir_with_parents (pack_dir, 0777) < 0) {
+        seaf_warning ("[pack] Pack dir %s does not exist and"
+                      " is unable to create\n", pack_dir);
+        goto onerror;
+    }
+
+    priv->lock_fd = open_lock_file (priv, "LOCK");
+    priv->repack_fd = open_lock_file (priv, "REPACK");
+    if (priv->lock_fd < 0 || priv->repack_fd < 0)
+        goto onerror;
+
+    if (load_packs (priv) < 0)
+        goto onerror;
+
+    bend->read = obj_backend_pack_read;
+    bend->write = obj_backend_pack_write;
+    bend->exists = obj_backend_pack_exists;
+    bend->delete = obj_backend_pack_delete;
+    bend->foreach_obj = obj_backend_pack_foreach_obj;
+
+    priv->repack_pool = g_thread_pool_new (repack_worker, priv,
+                                           1, FALSE, NULL);
+    if (!priv->repack_pool)
+        seaf_warning ("[pack] Failed to start repack thread for %s.\n",
+                      pack_dir);
+
+    /* Merge the packs left by a repack that didn't get to run. */
+    pthread_mutex_lock (&priv->lock);
+    queue_repack (priv);
+    pthread_mutex_unlock (&priv->lock);
+
+    return bend;
+
+onerror:
+    if (priv->lock_fd >= 0)
+        close (priv->lock_fd);
+    if (priv->repack_fd >= 0)
+        close (priv->repack_fd);
+    g_free (priv->pack_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
+
+#else
+
+ObjBackend *
+obj_backend_pack_new (const char *pack_dir,
+                      guint64 pack_size,
+                      int repack_threshold)
+{
+    seaf_warning ("Pack backend is not supported on this platform.\n");
+    return NULL;
+}
+
+#endif  /* WIN32 */
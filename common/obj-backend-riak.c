@@ -8,14 +8,28 @@
 
 #include <pthread.h>
 
+#define DEFAULT_MAX_CONNECTIONS 32
+#define DEFAULT_BATCH_PARALLEL 8
+
 typedef struct RiakPriv {
     const char *host;
     const char *port;
     const char *bucket;
     int n_write;
 
+    /*
+     * Idle clients. Each one keeps its keep-alive connections, so they
+     * are reused rather than freed. At most max_connections clients
+     * exist; callers wait for one beyond that.
+     */
     GQueue *conn_pool;
+    int n_conns;
+    int max_conns;
+    int batch_parallel;
+    /* List the objects by $key index queries instead of key streaming. */
+    gboolean list_with_2i;
     pthread_mutex_t lock;
+    pthread_cond_t cond;
 } RiakPriv;
 
 static SeafRiakClient *
@@ -25,9 +39,14 @@ get_connection (RiakPriv *priv)
 
     pthread_mutex_lock (&priv->lock);
 
-    connection = g_queue_pop_head (priv->conn_pool);
-    if (!connection)
+    while ((connection = g_queue_pop_head (priv->conn_pool)) == NULL &&
+           priv->n_conns >= priv->max_conns)
+        pthread_cond_wait (&priv->cond, &priv->lock);
+
+    if (!connection) {
         connection = seaf_riak_client_new (priv->host, priv->port);
+        priv->n_conns++;
+    }
     pthread_mutex_unlock (&priv->lock);
     return connection;
 }
@@ -36,10 +55,26 @@ static void
 return_connection (RiakPriv *priv, SeafRiakClient *connection)
 {
     pthread_mutex_lock (&priv->lock);
-    g_queue_push_tail (priv->conn_pool, connection);
+    /* Most recently used first, its connection is least likely closed. */
+    g_queue_push_head (priv->conn_pool, connection);
+    pthread_cond_signal (&priv->cond);
     pthread_mutex_unlock (&priv->lock);
 }
 
+static SeafRiakBatchItem *
+to_riak_items (ObjBatchItem *items, int n_items)
+{
+    SeafRiakBatchItem *ritems = g_new0 (SeafRiakBatchItem, n_items);
+    int i;
+
+    for (i = 0; i < n_items; ++i) {
+        ritems[i].key = items[i].obj_id;
+        ritems[i].value = items[i].data;
+        ritems[i].size = items[i].len;
+    }
+    return ritems;
+}
+
 static int
 obj_backend_riak_read (ObjBackend *bend,
                        const char *obj_id,
@@ -87,6 +122,72 @@ obj_backend_riak_exists (ObjBackend *bend,
     return ret;
 }
 
+/*
+ * Riak's HTTP interface has no multi-get. Batches are instead sent as
+ * batch_parallel concurrent requests on keep-alive connections.
+ */
+static void
+obj_backend_riak_read_batch (ObjBackend *bend,
+                             ObjBatchItem *items,
+                             int n_items)
+{
+    SeafRiakClient *conn = get_connection (bend->priv);
+    RiakPriv *priv = bend->priv;
+    SeafRiakBatchItem *ritems = to_riak_items (items, n_items);
+    int i;
+
+    seaf_riak_client_get_batch (conn, priv->bucket, ritems, n_items,
+                                priv->batch_parallel);
+    for (i = 0; i < n_items; ++i) {
+        items[i].success = ritems[i].success;
+        if (ritems[i].success) {
+            items[i].data = ritems[i].value;
+            items[i].len = ritems[i].size;
+        }
+    }
+
+    g_free (ritems);
+    return_connection (priv, conn);
+}
+
+static void
+obj_backend_riak_write_batch (ObjBackend *bend,
+                              ObjBatchItem *items,
+                              int n_items)
+{
+    SeafRiakClient *conn = get_connection (bend->priv);
+    RiakPriv *priv = bend->priv;
+    SeafRiakBatchItem *ritems = to_riak_items (items, n_items);
+    int i;
+
+    seaf_riak_client_put_batch (conn, priv->bucket, ritems, n_items,
+                                priv->n_write, priv->batch_parallel);
+    for (i = 0; i < n_items; ++i)
+        items[i].success = ritems[i].success;
+
+    g_free (ritems);
+    return_connection (priv, conn);
+}
+
+static void
+obj_backend_riak_exists_batch (ObjBackend *bend,
+                               ObjBatchItem *items,
+                               int n_items)
+{
+    SeafRiakClient *conn = get_connection (bend->priv);
+    RiakPriv *priv = bend->priv;
+    SeafRiakBatchItem *ritems = to_riak_items (items, n_items);
+    int i;
+
+    seaf_riak_client_query_batch (conn, priv->bucket, ritems, n_items,
+                                  priv->batch_parallel);
+    for (i = 0; i < n_items; ++i)
+        items[i].success = ritems[i].success;
+
+    g_free (ritems);
+    return_connection (priv, conn);
+}
+
 static void
 obj_backend_riak_delete (ObjBackend *bend,
                          const char *obj_id)
@@ -99,11 +200,49 @@ obj_backend_riak_delete (ObjBackend *bend,
     return_connection (priv, conn);
 }
 
+typedef struct ListData {
+    ObjBackendFunc process;
+    void *user_data;
+} ListData;
+
+static gboolean
+list_key (const char *key, void *vdata)
+{
+    ListData *data = vdata;
+
+    /* Not an object of ours. */
+    if (strlen (key) != 40)
+        return TRUE;
+    return data->process (key, data->user_data);
+}
+
+static int
+obj_backend_riak_foreach_obj (ObjBackend *bend,
+                              ObjBackendFunc process,
+                              void *user_data)
+{
+    SeafRiakClient *conn = get_connection (bend->priv);
+    RiakPriv *priv = bend->priv;
+    ListData data;
+    int ret;
+
+    data.process = process;
+    data.user_data = user_data;
+    ret = seaf_riak_client_list_keys (conn, priv->bucket, priv->list_with_2i,
+                                      priv->batch_parallel, list_key, &data);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
 ObjBackend *
 obj_backend_riak_new (const char *host,
                       const char *port,
                       const char *bucket,
-                      const char *write_policy)
+                      const char *write_policy,
+                      int max_connections,
+                      int batch_parallel,
+                      gboolean list_with_2i)
 {
     ObjBackend *bend;
     RiakPriv *priv;
@@ -123,12 +262,22 @@ obj_backend_riak_new (const char *host,
         g_assert (0);
 
     priv->conn_pool = g_queue_new ();
+    priv->max_conns = max_connections > 0 ? max_connections :
+        DEFAULT_MAX_CONNECTIONS;
+    priv->batch_parallel = batch_parallel > 0 ? batch_parallel :
+        DEFAULT_BATCH_PARALLEL;
+    priv->list_with_2i = list_with_2i;
     pthread_mutex_init (&priv->lock, NULL);
+    pthread_cond_init (&priv->cond, NULL);
 
     bend->read = obj_backend_riak_read;
     bend->write = obj_backend_riak_write;
     bend->exists = obj_backend_riak_exists;
     bend->delete = obj_backend_riak_delete;
+    bend->read_batch = obj_backend_riak_read_batch;
+    bend->write_batch = obj_backend_riak_write_batch;
+    bend->exists_batch = obj_backend_riak_exists_batch;
+    bend->foreach_obj = obj_backend_riak_foreach_obj;
 
     return bend;
 }
@@ -139,7 +288,10 @@ ObjBackend *
 obj_backend_riak_new (const char *host,
                       const char *port,
                       const char *bucket,
-                      const char *write_policy)
+                      const char *write_policy,
+                      int max_connections,
+                      int batch_parallel,
+                      gboolean list_with_2i)
 {
     seaf_warning ("Riak backend is not enabled.\n");
     return NULL;
@@ -0,0 +1,177 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Object backend that records the latency of every call into another
+ * backend. A batch call is recorded as one call per object, each taking
+ * an equal share of the time.
+ */
+
+#include "common.h"
+
+#include "obj-backend.h"
+#include "backend-stats.h"
+
+typedef struct StatsPriv {
+    ObjBackend   *inner;
+    BackendStats *stats;
+} StatsPriv;
+
+static int
+obj_backend_stats_read (ObjBackend *bend,
+                        const char *obj_id,
+                        void **data,
+                        int *len)
+{
+    StatsPriv *priv = bend->priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->read (priv->inner, obj_id, data, len);
+
+    backend_stats_record (priv->stats, BACKEND_OP_READ,
+                          backend_stats_now () - start,
+                          ret < 0 ? 0 : *len, ret >= 0);
+    return ret;
+}
+
+static int
+obj_backend_stats_write (ObjBackend *bend,
+                         const char *obj_id,
+                         void *data,
+                         int len)
+{
+    StatsPriv *priv = bend->priv;
+    gint64 start = backend_stats_now ();
+    int ret;
+
+    ret = priv->inner->write (priv->inner, obj_id, data, len);
+
+    backend_stats_record (priv->stats, BACKEND_OP_WRITE,
+                          backend_stats_now () - start, len, ret >= 0);
+    return ret;
+}
+
+static gboolean
+obj_backend_stats_exists (ObjBackend *bend,
+                          const char *obj_id)
+{
+    StatsPriv *priv = bend->priv;
+    gint64 start = backend_stats_now ();
+    gboolean ret;
+
+    ret = priv->inner->exists (priv->inner, obj_id);
+
+    backend_stats_record (priv->stats, BACKEND_OP_EXISTS,
+                          backend_stats_now () - start, 0, TRUE);
+    return ret;
+}
+
+static void
+obj_backend_stats_delete (ObjBackend *bend,
+                          const char *obj_id)
+{
+    StatsPriv *priv = bend->priv;
+    gint64 start = backend_stats_now ();
+
+    priv->inner->delete (priv->inner, obj_id);
+
+    backend_stats_record (priv->stats, BACKEND_OP_DELETE,
+                          backend_stats_now () - start, 0, TRUE);
+}
+
+static void
+record_batch (StatsPriv *priv, int op, gint64 start,
+              ObjBatchItem *items, int n_items)
+{
+    gint64 usec;
+    int i;
+
+    if (n_items == 0)
+        return;
+
+    usec = (backend_stats_now () - start) / n_items;
+    for (i = 0; i < n_items; ++i) {
+        backend_stats_record (priv->stats, op, usec,
+                              (op == BACKEND_OP_EXISTS || !items[i].success) ?
+                              0 : items[i].len,
+                              op == BACKEND_OP_EXISTS || items[i].success);
+    }
+}
+
+static void
+obj_backend_stats_read_batch (ObjBackend *bend,
+                              ObjBatchItem *items,
+                              int n_items)
+{
+    StatsPriv *priv = bend->priv;
+    gint64 start = backend_stats_now ();
+
+    priv->inner->read_batch (priv->inner, items, n_items);
+
+    record_batch (priv, BACKEND_OP_READ, start, items, n_items);
+}
+
+static void
+obj_backend_stats_write_batch (ObjBackend *bend,
+                               ObjBatchItem *items,
+                               int n_items)
+{
+    StatsPriv *priv = bend->priv;
+    gint64 start = backend_stats_now ();
+
+    priv->inner->write_batch (priv->inner, items, n_items);
+
+    record_batch (priv, BACKEND_OP_WRITE, start, items, n_items);
+}
+
+static void
+obj_backend_stats_exists_batch (ObjBackend *bend,
+                                ObjBatchItem *items,
+                                int n_items)
+{
+    StatsPriv *priv = bend->priv;
+    gint64 start = backend_stats_now ();
+
+    priv->inner->exists_batch (priv->inner, items, n_items);
+
+    record_batch (priv, BACKEND_OP_EXISTS, start, items, n_items);
+}
+
+static int
+obj_backend_stats_foreach_obj (ObjBackend *bend,
+                               ObjBackendFunc process,
+                               void *user_data)
+{
+    StatsPriv *priv = bend->priv;
+
+    return priv->inner->foreach_obj (priv->inner, process, user_data);
+}
+
+ObjBackend *
+obj_backend_stats_new (ObjBackend *inner, BackendStats *stats)
+{
+    ObjBackend *bend;
+    StatsPriv *priv;
+
+    priv = g_new0 (StatsPriv, 1);
+    priv->inner = inner;
+    priv->stats = stats;
+
+    bend = g_new0 (ObjBackend, 1);
+    bend->priv = priv;
+
+    bend->read = obj_backend_stats_read;
+    bend->write = obj_backend_stats_write;
+    bend->exists = obj_backend_stats_exists;
+    bend->delete = obj_backend_stats_delete;
+    if (inner->read_batch)
+        bend->read_batch = obj_backend_stats_read_batch;
+    if (inner->write_batch)
+        bend->write_batch = obj_backend_stats_write_batch;
+    if (inner->exists_batch)
+        bend->exists_batch = obj_backend_stats_exists_batch;
+    if (inner->foreach_obj)
+        bend->foreach_obj = obj_backend_stats_foreach_obj;
+
+    return bend;
+}
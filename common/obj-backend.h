@@ -5,6 +5,16 @@
 
 typedef struct ObjBackend ObjBackend;
 
+typedef gboolean (*ObjBackendFunc) (const char *obj_id, void *user_data);
+
+/* One object of a batch operation. */
+typedef struct ObjBatchItem {
+    char     obj_id[41];
+    void     *data;
+    int      len;
+    gboolean success;
+} ObjBatchItem;
+
 struct ObjBackend {
     int         (*read) (ObjBackend *bend,
                          const char *obj_id,
@@ -22,6 +32,32 @@ struct ObjBackend {
     void        (*delete) (ObjBackend *bend,
                            const char *obj_id);
 
+    /*
+     * Optional batch operations, for backends that can service several
+     * objects at once more cheaply than one by one. They set @success
+     * (and @data, @len for read) of every item. If not implemented, the
+     * single object operations are used.
+     */
+    void        (*read_batch) (ObjBackend *bend,
+                               ObjBatchItem *items,
+                               int n_items);
+
+    void        (*write_batch) (ObjBackend *bend,
+                                ObjBatchItem *items,
+                                int n_items);
+
+    void        (*exists_batch) (ObjBackend *bend,
+                                 ObjBatchItem *items,
+                                 int n_items);
+
+    /*
+     * Optional. Call @process for every object, until it returns FALSE.
+     * Objects written meanwhile may or may not be included.
+     */
+    int         (*foreach_obj) (ObjBackend *bend,
+                                ObjBackendFunc process,
+                                void *user_data);
+
     void *priv;
 };
 
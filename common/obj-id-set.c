@@ -0,0 +1,153 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "obj-id-set.h"
+
+#define ID_SET_SHARDS 256
+#define ID_SET_INIT_SLOTS 256
+
+typedef struct IdSetShard {
+    pthread_mutex_t lock;
+    unsigned char   *ids;           /* an all-zero slot is empty */
+    guint32         n_slots;
+    guint32         n_used;
+    gboolean        has_zero_id;
+} IdSetShard;
+
+struct ObjIdSet {
+    IdSetShard      shards[ID_SET_SHARDS];
+    guint64         n_ids;
+};
+
+ObjIdSet *
+obj_id_set_new ()
+{
+    ObjIdSet *set = g_new0 (ObjIdSet, 1);
+    int i;
+
+    for (i = 0; i < ID_SET_SHARDS; ++i) {
+        pthread_mutex_init (&set->shards[i].lock, NULL);
+        set->shards[i].n_slots = ID_SET_INIT_SLOTS;
+        set->shards[i].ids = g_malloc0 (ID_SET_INIT_SLOTS * 20);
+    }
+
+    return set;
+}
+
+void
+obj_id_set_free (ObjIdSet *set)
+{
+    int i;
+
+    for (i = 0; i < ID_SET_SHARDS; ++i) {
+        pthread_mutex_destroy (&set->shards[i].lock);
+        g_free (set->shards[i].ids);
+    }
+    g_free (set);
+}
+
+static const unsigned char zero_id[20];
+
+/* n_slots is a power of 2. Sha1s are uniform, so any 4 bytes do as hash. */
+static unsigned char *
+shard_find_slot (unsigned char *ids, guint32 n_slots, const unsigned char *id)
+{
+    guint32 i;
+
+    i = ((guint32)id[1] << 24 | (guint32)id[2] << 16 |
+         (guint32)id[3] << 8 | (guint32)id[4]) & (n_slots - 1);
+    while (1) {
+        unsigned char *slot = ids + (gsize)i * 20;
+        if (memcmp (slot, id, 20) == 0 || memcmp (slot, zero_id, 20) == 0)
+            return slot;
+        i = (i + 1) & (n_slots - 1);
+    }
+}
+
+static void
+shard_grow (IdSetShard *shard)
+{
+    guint32 n_slots = shard->n_slots << 1;
+    unsigned char *ids = g_malloc0 ((gsize)n_slots * 20);
+    guint32 i;
+
+    for (i = 0; i < shard->n_slots; ++i) {
+        unsigned char *old = shard->ids + (gsize)i * 20;
+        if (memcmp (old, zero_id, 20) != 0)
+            memcpy (shard_find_slot (ids, n_slots, old), old, 20);
+    }
+
+    g_free (shard->ids);
+    shard->ids = ids;
+    shard->n_slots = n_slots;
+}
+
+gboolean
+obj_id_set_add (ObjIdSet *set, const char *obj_id)
+{
+    unsigned char id[20];
+    IdSetShard *shard;
+    unsigned char *slot;
+    gboolean added = TRUE;
+
+    if (hex_to_sha1 (obj_id, id) < 0)
+        return TRUE;
+
+    shard = &set->shards[id[0]];
+    pthread_mutex_lock (&shard->lock);
+
+    if (memcmp (id, zero_id, 20) == 0) {
+        added = !shard->has_zero_id;
+        shard->has_zero_id = TRUE;
+        goto out;
+    }
+
+    slot = shard_find_slot (shard->ids, shard->n_slots, id);
+    if (memcmp (slot, id, 20) == 0) {
+        added = FALSE;
+        goto out;
+    }
+
+    memcpy (slot, id, 20);
+    /* Keep the load factor below 3/4. */
+    if (++shard->n_used * 4 > shard->n_slots * 3)
+        shard_grow (shard);
+
+out:
+    pthread_mutex_unlock (&shard->lock);
+    if (added)
+        __sync_fetch_and_add (&set->n_ids, 1);
+    return added;
+}
+
+gboolean
+obj_id_set_contains (ObjIdSet *set, const char *obj_id)
+{
+    unsigned char id[20];
+    IdSetShard *shard;
+    gboolean found;
+
+    if (hex_to_sha1 (obj_id, id) < 0)
+        return TRUE;
+
+    shard = &set->shards[id[0]];
+    pthread_mutex_lock (&shard->lock);
+    if (memcmp (id, zero_id, 20) == 0)
+        found = shard->has_zero_id;
+    else
+        found = (memcmp (shard_find_slot (shard->ids, shard->n_slots, id),
+                         id, 20) == 0);
+    pthread_mutex_unlock (&shard->lock);
+
+    return found;
+}
+
+guint64
+obj_id_set_size (ObjIdSet *set)
+{
+    return __sync_fetch_and_add (&set->n_ids, 0);
+}
@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef OBJ_ID_SET_H
+#define OBJ_ID_SET_H
+
+#include <glib.h>
+
+/*
+ * Exact set of 40-character object ids that can be shared by several
+ * threads. Ids are kept as 20-byte binary sha1s in open-addressing
+ * tables, one per value of the first byte, so threads rarely contend on
+ * the same lock. Each id takes about 27 bytes.
+ */
+
+typedef struct ObjIdSet ObjIdSet;
+
+ObjIdSet *
+obj_id_set_new ();
+
+void
+obj_id_set_free (ObjIdSet *set);
+
+/* Returns TRUE if @obj_id was not in the set before. Invalid ids are
+ * never added, so always return TRUE. */
+gboolean
+obj_id_set_add (ObjIdSet *set, const char *obj_id);
+
+/* Invalid ids are reported as in the set, the same as for add. */
+gboolean
+obj_id_set_contains (ObjIdSet *set, const char *obj_id);
+
+guint64
+obj_id_set_size (ObjIdSet *set);
+
+#endif
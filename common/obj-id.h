@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef OBJ_ID_H
+#define OBJ_ID_H
+
+#include <string.h>
+#include <glib.h>
+
+#include "utils.h"
+
+/*
+ * Binary form of a 40-character object or block id, for in-memory
+ * tables holding many ids. Hex ids are kept at storage and protocol
+ * boundaries.
+ */
+typedef struct SeafObjId {
+    unsigned char bytes[20];
+} SeafObjId;
+
+/* Returns -1 if @hex is not a 40-character hex id. */
+static inline int
+seaf_obj_id_from_hex (SeafObjId *id, const char *hex)
+{
+    return hex_to_sha1 (hex, id->bytes);
+}
+
+/* @hex must hold 41 bytes. */
+static inline void
+seaf_obj_id_to_hex (const SeafObjId *id, char *hex)
+{
+    sha1_to_hex (id->bytes, hex);
+}
+
+/* Ids are sha1s, so any 4 bytes are a good hash. */
+static inline guint
+seaf_obj_id_hash (gconstpointer v)
+{
+    const unsigned char *b = ((const SeafObjId *)v)->bytes;
+
+    return (guint)b[0] << 24 | (guint)b[1] << 16 | (guint)b[2] << 8 | b[3];
+}
+
+static inline gboolean
+seaf_obj_id_equal (gconstpointer v1, gconstpointer v2)
+{
+    return memcmp (v1, v2, sizeof(SeafObjId)) == 0;
+}
+
+#endif
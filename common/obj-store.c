@@ -1,21 +1,58 @@
 #include "common.h"
 
+#include <pthread.h>
 #include <ccnet/cevent.h>
 #include "seafile-session.h"
 
 #include "obj-backend.h"
 #include "obj-store.h"
+#include "backend-stats.h"
+#include "seaf-probes.h"
 
+/* Default number of threads of each async pool. */
 #define MAX_READER_THREADS 2
 #define MAX_WRITER_THREADS 2
 #define MAX_STAT_THREADS 2
 
+/* Upper bound of an adaptive pool, unless configured. */
+#define DEFAULT_ADAPTIVE_MAX_THREADS 32
+
+/* Backends slower than this get their pools grown faster. */
+#define SLOW_BACKEND_USEC 20000
+
+#define DEFAULT_FILTER_CAPACITY 10000000
+
+/* Idle threads exit after this long, in ms. */
+#define THREAD_MAX_IDLE_TIME 10000
+
+/*
+ * A thread pool for one kind of async operation. In adaptive mode the
+ * number of threads grows while tasks are queued up, faster when the
+ * backend is slow, and shrinks again when the pool is mostly idle.
+ */
+typedef struct AsyncPool {
+    GThreadPool *tpool;
+    int          min_threads;
+    int          max_threads;
+    gboolean     adaptive;
+
+    /* Pushed but not done yet. Only touched in the main thread. */
+    int          pending;
+
+    /* Updated by the worker threads. */
+    pthread_mutex_t lock;
+    gint64       avg_latency;   /* moving average, in usec */
+    guint64      n_done;
+} AsyncPool;
+
+/*
+ * One async operation on one or more objects. All objects of a task are
+ * handled by one worker thread and completed with one event.
+ */
 typedef struct AsyncTask {
-    guint32 rw_id;
-    char    obj_id[41];
-    void    *data;
-    int     len;
-    gboolean success;
+    guint32      rw_id;
+    int          n_items;
+    ObjBatchItem *items;
 } AsyncTask;
 
 typedef struct OSCallbackStruct {
@@ -28,27 +65,38 @@ struct SeafObjStore {
 
     CEventManager *ev_mgr;
 
+    char         *obj_type;
+
+    /* Optional negative lookup filter. */
+    ExistsFilter *filter;
+
+    /* Calls into the backend, server only. */
+    BackendStats *bstats;
+
     /* For async read. */
     guint32      next_rd_id;
-    GThreadPool *read_tpool;
+    AsyncPool    read_pool;
     GHashTable  *readers;
     guint32      read_ev_id;
 
     /* For async write. */
     guint32      next_wr_id;
-    GThreadPool *write_tpool;
+    AsyncPool    write_pool;
     GHashTable  *writers;
     guint32      write_ev_id;
 
     /* For async stat. */
     guint32      next_st_id;
-    GThreadPool *stat_tpool;
+    AsyncPool    stat_pool;
     GHashTable  *stats;
     guint32      stat_ev_id;
 };
 typedef struct SeafObjStore SeafObjStore;
 
 #ifdef SEAFILE_SERVER
+static const char *
+get_backend_group (const char *obj_type);
+
 static ObjBackend*
 load_obj_backend (GKeyFile *config, const char *obj_type);
 
@@ -59,7 +107,22 @@ extern ObjBackend *
 obj_backend_riak_new (const char *host,
                       const char *port,
                       const char *bucket,
-                      const char *write_policy);
+                      const char *write_policy,
+                      int max_connections,
+                      int batch_parallel,
+                      gboolean list_with_2i);
+
+extern ObjBackend *
+obj_backend_pack_new (const char *pack_dir,
+                      guint64 pack_size,
+                      int repack_threshold);
+
+extern ObjBackend *
+obj_backend_compress_new (ObjBackend *inner, const char *codec, int level);
+
+static ObjBackend *
+wrap_compress_backend (GKeyFile *config, const char *obj_type,
+                       ObjBackend *bend);
 #endif
 
 static void
@@ -87,6 +150,8 @@ seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
     if (!store)
         return NULL;
 
+    store->obj_type = g_strdup (obj_type);
+
 #ifdef SEAFILE_SERVER
     store->bend = load_obj_backend (seaf->config, obj_type);
 #endif
@@ -97,48 +162,192 @@ seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
         g_free (obj_dir);
         if (!store->bend) {
             g_warning ("[Object store] Failed to load backend.\n");
+            g_free (store->obj_type);
             g_free (store);
             return NULL;
         }
     }
 
+#ifdef SEAFILE_SERVER
+    /* Time the backend itself, not the compression. */
+    store->bstats = backend_stats_new ();
+    store->bend = obj_backend_stats_new (store->bend, store->bstats);
+
+    store->bend = wrap_compress_backend (seaf->config, obj_type, store->bend);
+#endif
+
     return store;
 }
 
+/*
+ * Pool sizes are set in the object backend group of seafile.conf, e.g.
+ *
+ * [fs_object_backend]
+ * read_threads = 4
+ * stat_threads = 8
+ * adaptive_threads = true
+ * max_stat_threads = 64
+ *
+ * <op>_threads is the number of threads, or the minimum in adaptive mode.
+ * max_<op>_threads is the upper bound in adaptive mode.
+ */
+static void
+load_pool_config (SeafObjStore *obj_store, AsyncPool *pool,
+                  const char *op, int default_threads)
+{
+    pool->min_threads = default_threads;
+    pool->max_threads = default_threads;
+    pool->adaptive = FALSE;
+
+#ifdef SEAFILE_SERVER
+    const char *group = get_backend_group (obj_store->obj_type);
+    char *key;
+    int n;
+
+    key = g_strdup_printf ("%s_threads", op);
+    n = g_key_file_get_integer (seaf->config, group, key, NULL);
+    if (n > 0)
+        pool->min_threads = pool->max_threads = n;
+    g_free (key);
+
+    if (!g_key_file_get_boolean (seaf->config, group, "adaptive_threads", NULL))
+        return;
+
+    pool->adaptive = TRUE;
+    key = g_strdup_printf ("max_%s_threads", op);
+    n = g_key_file_get_integer (seaf->config, group, key, NULL);
+    pool->max_threads = (n > 0) ? n : DEFAULT_ADAPTIVE_MAX_THREADS;
+    if (pool->max_threads < pool->min_threads)
+        pool->max_threads = pool->min_threads;
+    g_free (key);
+#endif
+}
+
 static int
-async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
+async_pool_init (SeafObjStore *obj_store, AsyncPool *pool, const char *op,
+                 int default_threads, GFunc func)
 {
     GError *error = NULL;
 
-    obj_store->ev_mgr = ev_mgr;
+    load_pool_config (obj_store, pool, op, default_threads);
+    pthread_mutex_init (&pool->lock, NULL);
+
+    pool->tpool = g_thread_pool_new (func,
+                                     obj_store,
+                                     pool->min_threads,
+                                     FALSE,
+                                     &error);
+    if (error) {
+        g_warning ("Failed to start %s thread pool: %s.\n", op, error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Called in the main thread whenever a task is pushed or done. */
+static void
+async_pool_adjust (AsyncPool *pool)
+{
+    int cur, target, step;
+    guint queued;
+    gint64 latency;
+
+    if (!pool->adaptive)
+        return;
+
+    cur = g_thread_pool_get_max_threads (pool->tpool);
+    queued = g_thread_pool_unprocessed (pool->tpool);
+    target = cur;
+
+    if (queued > 0 && cur < pool->max_threads) {
+        pthread_mutex_lock (&pool->lock);
+        latency = pool->avg_latency;
+        pthread_mutex_unlock (&pool->lock);
+
+        /* With a high latency backend most threads just wait, so many
+         * more of them are needed to keep the queue short.
+         */
+        step = (latency >= SLOW_BACKEND_USEC) ? cur : 1;
+        if (step > (int)queued)
+            step = queued;
+        target = MIN (cur + step, pool->max_threads);
+    } else if (queued == 0 && pool->pending <= cur / 4 &&
+               cur > pool->min_threads) {
+        target = cur - 1;
+    }
+
+    if (target != cur)
+        g_thread_pool_set_max_threads (pool->tpool, target, NULL);
+}
 
-    obj_store->read_tpool = g_thread_pool_new (reader_thread,
-                                               obj_store,
-                                               MAX_READER_THREADS,
-                                               FALSE,
-                                               &error);
+static int
+async_pool_push (AsyncPool *pool, AsyncTask *task)
+{
+    GError *error = NULL;
+
+    g_thread_pool_push (pool->tpool, task, &error);
     if (error) {
-        g_warning ("Failed to start reader thread pool: %s.\n", error->message);
         g_clear_error (&error);
         return -1;
     }
 
+    pool->pending++;
+    async_pool_adjust (pool);
+    return 0;
+}
+
+static void
+async_pool_task_done (AsyncPool *pool)
+{
+    pool->pending--;
+    async_pool_adjust (pool);
+}
+
+/* Record how long a backend operation on @n_objs objects took,
+ * in a worker thread.
+ */
+static void
+async_pool_record_latency (AsyncPool *pool, GTimeVal *start, int n_objs)
+{
+    GTimeVal now;
+    gint64 usec;
+
+    g_get_current_time (&now);
+    usec = (gint64)(now.tv_sec - start->tv_sec) * G_USEC_PER_SEC +
+        (now.tv_usec - start->tv_usec);
+    usec /= n_objs;
+
+    pthread_mutex_lock (&pool->lock);
+    if (pool->n_done == 0)
+        pool->avg_latency = usec;
+    else
+        pool->avg_latency = (pool->avg_latency * 7 + usec) / 8;
+    pool->n_done += n_objs;
+    pthread_mutex_unlock (&pool->lock);
+}
+
+static int
+async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
+{
+    obj_store->ev_mgr = ev_mgr;
+
+    g_thread_pool_set_max_idle_time (THREAD_MAX_IDLE_TIME);
+
+    if (async_pool_init (obj_store, &obj_store->read_pool, "read",
+                         MAX_READER_THREADS, reader_thread) < 0)
+        return -1;
+
     obj_store->readers = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                 NULL, g_free);
     obj_store->read_ev_id = cevent_manager_register (ev_mgr,
                                                      on_read_done,
                                                      obj_store);
 
-    obj_store->write_tpool = g_thread_pool_new (writer_thread,
-                                                obj_store,
-                                                MAX_WRITER_THREADS,
-                                                FALSE,
-                                                &error);
-    if (error) {
-        g_warning ("Failed to start writer thread pool: %s.\n", error->message);
-        g_clear_error (&error);
+    if (async_pool_init (obj_store, &obj_store->write_pool, "write",
+                         MAX_WRITER_THREADS, writer_thread) < 0)
         return -1;
-    }
 
     obj_store->writers = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                 NULL, g_free);
@@ -146,16 +355,9 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
                                                       on_write_done,
                                                       obj_store);
 
-    obj_store->stat_tpool = g_thread_pool_new (stat_thread,
-                                               obj_store,
-                                               MAX_STAT_THREADS,
-                                               FALSE,
-                                               &error);
-    if (error) {
-        g_warning ("Failed to start statr thread pool: %s.\n", error->message);
-        g_clear_error (&error);
+    if (async_pool_init (obj_store, &obj_store->stat_pool, "stat",
+                         MAX_STAT_THREADS, stat_thread) < 0)
         return -1;
-    }
 
     obj_store->stats = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                               NULL, g_free);
@@ -184,8 +386,13 @@ seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
                          int *len)
 {
     ObjBackend *bend = obj_store->bend;
+    int ret;
+
+    SEAF_PROBE2 (obj_read_start, obj_store->obj_type, obj_id);
+    ret = bend->read (bend, obj_id, data, len);
+    SEAF_PROBE4 (obj_read_done, obj_store->obj_type, obj_id, ret, *len);
 
-    return bend->read (bend, obj_id, data, len);
+    return ret;
 }
 
 int
@@ -195,8 +402,16 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           int len)
 {
     ObjBackend *bend = obj_store->bend;
+    int ret;
+
+    if (obj_store->filter)
+        exists_filter_add (obj_store->filter, obj_id);
+
+    SEAF_PROBE3 (obj_write_start, obj_store->obj_type, obj_id, len);
+    ret = bend->write (bend, obj_id, data, len);
+    SEAF_PROBE3 (obj_write_done, obj_store->obj_type, obj_id, ret);
 
-    return bend->write (bend, obj_id, data, len);
+    return ret;
 }
 
 gboolean
@@ -205,6 +420,18 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
 {
     ObjBackend *bend = obj_store->bend;
 
+    if (obj_store->filter && !exists_filter_test (obj_store->filter, obj_id))
+        return FALSE;
+
+    return bend->exists (bend, obj_id);
+}
+
+gboolean
+seaf_obj_store_obj_exists_unfiltered (struct SeafObjStore *obj_store,
+                                      const char *obj_id)
+{
+    ObjBackend *bend = obj_store->bend;
+
     return bend->exists (bend, obj_id);
 }
 
@@ -242,6 +469,9 @@ load_riak_obj_backend(GKeyFile *config, const char *bend_group)
 {
     ObjBackend *bend;
     char *host, *port, *bucket, *write_policy;
+    int max_conns, batch_parallel;
+    char *list_keys;
+    gboolean list_with_2i;
     
     host = g_key_file_get_string (config, bend_group, "host", NULL);
     if (!host) {
@@ -271,7 +501,20 @@ load_riak_obj_backend(GKeyFile *config, const char *bend_group)
         return NULL;
     }
 
-    bend = obj_backend_riak_new (host, port, bucket, write_policy);
+    /* Optional: max_connections and batch_parallel requests per batch. */
+    max_conns = g_key_file_get_integer (config, bend_group,
+                                        "max_connections", NULL);
+    batch_parallel = g_key_file_get_integer (config, bend_group,
+                                             "batch_parallel", NULL);
+
+    /* Optional: list_keys = 2i, for buckets on a backend with secondary
+     * indexes. Defaults to key streaming. */
+    list_keys = g_key_file_get_string (config, bend_group, "list_keys", NULL);
+    list_with_2i = (g_strcmp0 (list_keys, "2i") == 0);
+    g_free (list_keys);
+
+    bend = obj_backend_riak_new (host, port, bucket, write_policy,
+                                 max_conns, batch_parallel, list_with_2i);
 
     g_free (host);
     g_free (port);
@@ -280,19 +523,60 @@ load_riak_obj_backend(GKeyFile *config, const char *bend_group)
     return bend;
 }
 
+/*
+ * [fs_object_backend]
+ * name = pack
+ * pack_dir = /data/seafile-data/fs-packs
+ * pack_size = 64          (MB, optional)
+ * repack_threshold = 16   (optional, packs merged at once, see
+ *                           obj-backend-pack.c)
+ */
 static ObjBackend*
-load_obj_backend (GKeyFile *config, const char *obj_type)
+load_pack_obj_backend(GKeyFile *config, const char *bend_group)
 {
-    char *bend_group;
-    char *backend;
     ObjBackend *bend;
+    char *pack_dir;
+    int pack_size, repack_threshold;
+
+    pack_dir = g_key_file_get_string (config, bend_group, "pack_dir", NULL);
+    if (!pack_dir) {
+        g_warning ("[Object store] Pack dir not set in config for %s.\n",
+                   bend_group);
+        return NULL;
+    }
+
+    pack_size = g_key_file_get_integer (config, bend_group, "pack_size", NULL);
+    repack_threshold = g_key_file_get_integer (config, bend_group,
+                                               "repack_threshold", NULL);
+
+    bend = obj_backend_pack_new (pack_dir,
+                                 pack_size > 0 ? (guint64)pack_size << 20 : 0,
+                                 repack_threshold);
 
+    g_free (pack_dir);
+    return bend;
+}
+
+static const char *
+get_backend_group (const char *obj_type)
+{
     if (strcmp (obj_type, "commits") == 0)
-        bend_group = "commit_object_backend";
+        return "commit_object_backend";
     else if (strcmp (obj_type, "fs") == 0)
-        bend_group = "fs_object_backend";
-    else
-        g_assert (0);
+        return "fs_object_backend";
+
+    g_assert (0);
+    return NULL;
+}
+
+static ObjBackend*
+load_obj_backend (GKeyFile *config, const char *obj_type)
+{
+    const char *bend_group;
+    char *backend;
+    ObjBackend *bend;
+
+    bend_group = get_backend_group (obj_type);
 
     backend = g_key_file_get_string (config, bend_group, "name", NULL);
     if (!backend) {
@@ -307,24 +591,174 @@ load_obj_backend (GKeyFile *config, const char *obj_type)
         bend = load_riak_obj_backend (config, bend_group);
         g_free (backend);
         return bend;
+    } else if (strcmp (backend, "pack") == 0) {
+        bend = load_pack_obj_backend (config, bend_group);
+        g_free (backend);
+        return bend;
     }
 
     g_warning ("Unknown backend\n");
     return NULL;
 }
+
+/*
+ * Objects can be compressed before they reach the backend:
+ *
+ * [fs_object_backend]
+ * compress = zlib
+ * compress_level = 6      (1-9, optional)
+ *
+ * Objects stored before compression was enabled stay readable, and so do
+ * compressed ones after it is set back to "none".
+ */
+static ObjBackend *
+wrap_compress_backend (GKeyFile *config, const char *obj_type,
+                       ObjBackend *bend)
+{
+    const char *bend_group = get_backend_group (obj_type);
+    ObjBackend *wrapped;
+    char *codec;
+    int level;
+
+    codec = g_key_file_get_string (config, bend_group, "compress", NULL);
+    if (!codec)
+        return bend;
+
+    level = g_key_file_get_integer (config, bend_group, "compress_level", NULL);
+
+    wrapped = obj_backend_compress_new (bend, codec, level);
+    g_free (codec);
+    if (!wrapped) {
+        g_warning ("[Object store] Compression disabled for %s.\n", obj_type);
+        return bend;
+    }
+
+    return wrapped;
+}
+
+static gboolean
+add_to_filter (const char *obj_id, void *user_data)
+{
+    exists_filter_add (user_data, obj_id);
+    return TRUE;
+}
+
+static int
+load_filter (ExistsFilter *filter, void *user_data)
+{
+    ObjBackend *bend = user_data;
+
+    return bend->foreach_obj (bend, add_to_filter, filter);
+}
+
+/*
+ * [fs_object_backend]
+ * exists_filter = true
+ * exists_filter_capacity = 10000000   (number of objects, optional)
+ */
+int
+seaf_obj_store_load_exists_filter (struct SeafObjStore *obj_store,
+                                   GKeyFile *config)
+{
+    const char *bend_group = get_backend_group (obj_store->obj_type);
+    gint64 capacity;
+
+    if (!g_key_file_get_boolean (config, bend_group, "exists_filter", NULL))
+        return 0;
+
+    if (!obj_store->bend->foreach_obj) {
+        g_warning ("[Object store] Exists filter is not supported by the"
+                   " backend of %s.\n", obj_store->obj_type);
+        return -1;
+    }
+
+    capacity = g_key_file_get_integer (config, bend_group,
+                                       "exists_filter_capacity", NULL);
+    if (capacity <= 0)
+        capacity = DEFAULT_FILTER_CAPACITY;
+
+    obj_store->filter = exists_filter_new ((guint64)capacity);
+    return exists_filter_load (obj_store->filter, load_filter, obj_store->bend);
+}
+
+int
+seaf_obj_store_foreach_obj (struct SeafObjStore *obj_store,
+                            SeafObjStoreFunc process,
+                            void *user_data)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->foreach_obj) {
+        g_warning ("[Object store] The backend of %s can't list objects.\n",
+                   obj_store->obj_type);
+        return -1;
+    }
+
+    return bend->foreach_obj (bend, process, user_data);
+}
+
+int
+seaf_obj_store_get_filter_stats (struct SeafObjStore *obj_store,
+                                 ExistsFilterStats *stats)
+{
+    if (!obj_store->filter)
+        return -1;
+
+    exists_filter_get_stats (obj_store->filter, stats);
+    return 0;
+}
+
+struct BackendStats *
+seaf_obj_store_get_backend_stats (struct SeafObjStore *obj_store)
+{
+    return obj_store->bstats;
+}
 #endif
 
+static AsyncTask *
+async_task_new (guint32 rw_id, int n_items)
+{
+    AsyncTask *task = g_new0 (AsyncTask, 1);
+
+    task->rw_id = rw_id;
+    task->n_items = n_items;
+    task->items = g_new0 (ObjBatchItem, n_items);
+
+    return task;
+}
+
+static void
+async_task_free (AsyncTask *task)
+{
+    int i;
+
+    for (i = 0; i < task->n_items; ++i)
+        g_free (task->items[i].data);
+    g_free (task->items);
+    g_free (task);
+}
+
 static void
 reader_thread (void *data, void *user_data)
 {
     AsyncTask *task = data;
     SeafObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
-
-    task->success = TRUE;
-
-    if (bend->read (bend, task->obj_id, &task->data, &task->len) < 0)
-        task->success = FALSE;
+    ObjBatchItem *item;
+    GTimeVal start;
+    int i;
+
+    g_get_current_time (&start);
+    if (task->n_items > 1 && bend->read_batch) {
+        bend->read_batch (bend, task->items, task->n_items);
+    } else {
+        for (i = 0; i < task->n_items; ++i) {
+            item = &task->items[i];
+            item->success = (bend->read (bend, item->obj_id,
+                                         &item->data, &item->len) >= 0);
+        }
+    }
+    async_pool_record_latency (&obj_store->read_pool, &start, task->n_items);
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->read_ev_id,
                               task);
@@ -336,11 +770,43 @@ stat_thread (void *data, void *user_data)
     AsyncTask *task = data;
     SeafObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
+    ObjBatchItem *item, *items = task->items;
+    int n_items = task->n_items;
+    int *index = NULL;
+    GTimeVal start;
+    int i;
+
+    /* Only ask the backend about the objects the filter doesn't rule out. */
+    if (obj_store->filter) {
+        items = g_new (ObjBatchItem, task->n_items);
+        index = g_new (int, task->n_items);
+        for (i = 0, n_items = 0; i < task->n_items; ++i) {
+            task->items[i].success = FALSE;
+            if (exists_filter_test (obj_store->filter, task->items[i].obj_id)) {
+                index[n_items] = i;
+                items[n_items++] = task->items[i];
+            }
+        }
+    }
 
-    task->success = TRUE;
-
-    if (!bend->exists (bend, task->obj_id))
-        task->success = FALSE;
+    g_get_current_time (&start);
+    if (n_items > 1 && bend->exists_batch) {
+        bend->exists_batch (bend, items, n_items);
+    } else {
+        for (i = 0; i < n_items; ++i) {
+            item = &items[i];
+            item->success = bend->exists (bend, item->obj_id);
+        }
+    }
+    if (n_items > 0)
+        async_pool_record_latency (&obj_store->stat_pool, &start, n_items);
+
+    if (index) {
+        for (i = 0; i < n_items; ++i)
+            task->items[index[i]].success = items[i].success;
+        g_free (items);
+        g_free (index);
+    }
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->stat_ev_id,
                               task);
@@ -352,38 +818,70 @@ writer_thread (void *data, void *user_data)
     AsyncTask *task = data;
     SeafObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
+    ObjBatchItem *item;
+    GTimeVal start;
+    int i;
 
-    task->success = TRUE;
+    if (obj_store->filter) {
+        for (i = 0; i < task->n_items; ++i)
+            exists_filter_add (obj_store->filter, task->items[i].obj_id);
+    }
 
-    if (bend->write (bend, task->obj_id, task->data, task->len) < 0)
-        task->success = FALSE;
+    g_get_current_time (&start);
+    if (task->n_items > 1 && bend->write_batch) {
+        bend->write_batch (bend, task->items, task->n_items);
+    } else {
+        for (i = 0; i < task->n_items; ++i) {
+            item = &task->items[i];
+            item->success = (bend->write (bend, item->obj_id,
+                                          item->data, item->len) >= 0);
+        }
+    }
+    async_pool_record_latency (&obj_store->write_pool, &start, task->n_items);
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->write_ev_id,
                               task);
 }
 
+/* Run the callback once for each object of a done task. */
 static void
-on_read_done (CEvent *event, void *user_data)
+complete_task (AsyncTask *task, GHashTable *callbacks, gboolean with_data)
 {
-    AsyncTask *task = event->data;
-    SeafObjStore *obj_store = user_data;
     OSCallbackStruct *callback;
     OSAsyncResult res;
-
-    callback = g_hash_table_lookup (obj_store->readers,
-                                    (gpointer)(long)(task->rw_id));
-    if (callback) {
+    ObjBatchItem *item;
+    int i;
+
+    for (i = 0; i < task->n_items; ++i) {
+        /* The callback may unregister itself, e.g. when the processor
+         * is done, so look it up for every object.
+         */
+        callback = g_hash_table_lookup (callbacks,
+                                        (gpointer)(long)(task->rw_id));
+        if (!callback)
+            break;
+
+        item = &task->items[i];
         res.rw_id = task->rw_id;
-        memcpy (res.obj_id, task->obj_id, 41);
-        res.data = task->data;
-        res.len = task->len;
-        res.success = task->success;
+        memcpy (res.obj_id, item->obj_id, 41);
+        res.data = with_data ? item->data : NULL;
+        res.len = item->len;
+        res.success = item->success;
 
         callback->cb (&res, callback->cb_data);
     }
+}
 
-    g_free (task->data);
-    g_free (task);
+static void
+on_read_done (CEvent *event, void *user_data)
+{
+    AsyncTask *task = event->data;
+    SeafObjStore *obj_store = user_data;
+
+    complete_task (task, obj_store->readers, TRUE);
+    async_task_free (task);
+
+    async_pool_task_done (&obj_store->read_pool);
 }
 
 static void
@@ -391,23 +889,11 @@ on_stat_done (CEvent *event, void *user_data)
 {
     AsyncTask *task = event->data;
     SeafObjStore *obj_store = user_data;
-    OSCallbackStruct *callback;
-    OSAsyncResult res;
-
-    callback = g_hash_table_lookup (obj_store->stats,
-                                    (gpointer)(long)(task->rw_id));
-    if (callback) {
-        res.rw_id = task->rw_id;
-        memcpy (res.obj_id, task->obj_id, 41);
-        res.data = NULL;
-        res.len = task->len;
-        res.success = task->success;
 
-        callback->cb (&res, callback->cb_data);
-    }
+    complete_task (task, obj_store->stats, FALSE);
+    async_task_free (task);
 
-    g_free (task->data);
-    g_free (task);
+    async_pool_task_done (&obj_store->stat_pool);
 }
 
 static void
@@ -415,23 +901,11 @@ on_write_done (CEvent *event, void *user_data)
 {
     AsyncTask *task = event->data;
     SeafObjStore *obj_store = user_data;
-    OSCallbackStruct *callback;
-    OSAsyncResult res;
 
-    callback = g_hash_table_lookup (obj_store->writers,
-                                    (gpointer)(long)(task->rw_id));
-    if (callback) {
-        res.rw_id = task->rw_id;
-        memcpy (res.obj_id, task->obj_id, 41);
-        res.data = task->data;
-        res.len = task->len;
-        res.success = task->success;
+    complete_task (task, obj_store->writers, TRUE);
+    async_task_free (task);
 
-        callback->cb (&res, callback->cb_data);
-    }
-
-    g_free (task->data);
-    g_free (task);
+    async_pool_task_done (&obj_store->write_pool);
 }
 
 guint32
@@ -462,15 +936,24 @@ seaf_obj_store_async_read (struct SeafObjStore *obj_store,
                            guint32 reader_id,
                            const char *obj_id)
 {
-    AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
+    return seaf_obj_store_async_read_batch (obj_store, reader_id, &obj_id, 1);
+}
+
+int
+seaf_obj_store_async_read_batch (struct SeafObjStore *obj_store,
+                                 guint32 reader_id,
+                                 const char **obj_ids,
+                                 int n_objs)
+{
+    AsyncTask *task = async_task_new (reader_id, n_objs);
+    int i;
 
-    task->rw_id = reader_id;
-    memcpy (task->obj_id, obj_id, 41);
+    for (i = 0; i < n_objs; ++i)
+        memcpy (task->items[i].obj_id, obj_ids[i], 41);
 
-    g_thread_pool_push (obj_store->read_tpool, task, &error);
-    if (error) {
-        g_warning ("Failed to start aysnc read of %s.\n", obj_id);
+    if (async_pool_push (&obj_store->read_pool, task) < 0) {
+        g_warning ("Failed to start aysnc read of %s.\n", obj_ids[0]);
+        async_task_free (task);
         return -1;
     }
 
@@ -505,15 +988,24 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
                            guint32 stat_id,
                            const char *obj_id)
 {
-    AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
+    return seaf_obj_store_async_stat_batch (obj_store, stat_id, &obj_id, 1);
+}
 
-    task->rw_id = stat_id;
-    memcpy (task->obj_id, obj_id, 41);
+int
+seaf_obj_store_async_stat_batch (struct SeafObjStore *obj_store,
+                                 guint32 stat_id,
+                                 const char **obj_ids,
+                                 int n_objs)
+{
+    AsyncTask *task = async_task_new (stat_id, n_objs);
+    int i;
 
-    g_thread_pool_push (obj_store->stat_tpool, task, &error);
-    if (error) {
-        g_warning ("Failed to start aysnc stat of %s.\n", obj_id);
+    for (i = 0; i < n_objs; ++i)
+        memcpy (task->items[i].obj_id, obj_ids[i], 41);
+
+    if (async_pool_push (&obj_store->stat_pool, task) < 0) {
+        g_warning ("Failed to start aysnc stat of %s.\n", obj_ids[0]);
+        async_task_free (task);
         return -1;
     }
 
@@ -550,19 +1042,65 @@ seaf_obj_store_async_write (struct SeafObjStore *obj_store,
                             const void *obj_data,
                             int data_len)
 {
-    AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
+    return seaf_obj_store_async_write_batch (obj_store, writer_id,
+                                             &obj_id, &obj_data, &data_len, 1);
+}
+
+int
+seaf_obj_store_async_write_batch (struct SeafObjStore *obj_store,
+                                  guint32 writer_id,
+                                  const char **obj_ids,
+                                  const void **obj_data,
+                                  const int *data_lens,
+                                  int n_objs)
+{
+    AsyncTask *task = async_task_new (writer_id, n_objs);
+    int i;
 
-    task->rw_id = writer_id;
-    memcpy (task->obj_id, obj_id, 41);
-    task->data = g_memdup (obj_data, data_len);
-    task->len = data_len;
+    for (i = 0; i < n_objs; ++i) {
+        memcpy (task->items[i].obj_id, obj_ids[i], 41);
+        task->items[i].data = g_memdup (obj_data[i], data_lens[i]);
+        task->items[i].len = data_lens[i];
+    }
 
-    g_thread_pool_push (obj_store->write_tpool, task, &error);
-    if (error) {
-        g_warning ("Failed to start aysnc write of %s.\n", obj_id);
+    if (async_pool_push (&obj_store->write_pool, task) < 0) {
+        g_warning ("Failed to start aysnc write of %s.\n", obj_ids[0]);
+        async_task_free (task);
         return -1;
     }
 
     return 0;
 }
+
+int
+seaf_obj_store_get_async_stats (struct SeafObjStore *obj_store,
+                                const char *op,
+                                OSAsyncStats *stats)
+{
+    AsyncPool *pool;
+
+    if (strcmp (op, "read") == 0)
+        pool = &obj_store->read_pool;
+    else if (strcmp (op, "write") == 0)
+        pool = &obj_store->write_pool;
+    else if (strcmp (op, "stat") == 0)
+        pool = &obj_store->stat_pool;
+    else
+        return -1;
+
+    if (!pool->tpool)
+        return -1;
+
+    stats->threads = g_thread_pool_get_max_threads (pool->tpool);
+    stats->max_threads = pool->max_threads;
+    stats->adaptive = pool->adaptive;
+    stats->queued = g_thread_pool_unprocessed (pool->tpool);
+    stats->pending = pool->pending;
+
+    pthread_mutex_lock (&pool->lock);
+    stats->avg_latency = pool->avg_latency;
+    stats->n_done = pool->n_done;
+    pthread_mutex_unlock (&pool->lock);
+
+    return 0;
+}
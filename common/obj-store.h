@@ -4,9 +4,12 @@
 #include <glib.h>
 #include <sys/types.h>
 
+#include "exists-filter.h"
+
 struct _SeafileSession;
 struct SeafObjStore;
 struct CEventManager;
+struct BackendStats;
 
 struct SeafObjStore *
 seaf_obj_store_new (struct _SeafileSession *seaf, const char *obj_type);
@@ -34,10 +37,49 @@ gboolean
 seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            const char *obj_id);
 
+/*
+ * Always asks the backend, for objects that another process may have
+ * written, which the exists filter doesn't see.
+ */
+gboolean
+seaf_obj_store_obj_exists_unfiltered (struct SeafObjStore *obj_store,
+                                      const char *obj_id);
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *obj_id);
 
+#ifdef SEAFILE_SERVER
+/*
+ * Put a negative lookup filter in front of the exists checks, if enabled
+ * in @config. Only for the process that writes the objects, see
+ * exists-filter.h.
+ */
+int
+seaf_obj_store_load_exists_filter (struct SeafObjStore *obj_store,
+                                   GKeyFile *config);
+
+/* Returns -1 if no filter is loaded. */
+int
+seaf_obj_store_get_filter_stats (struct SeafObjStore *obj_store,
+                                 ExistsFilterStats *stats);
+
+typedef gboolean (*SeafObjStoreFunc) (const char *obj_id, void *user_data);
+
+/*
+ * Call @process for every stored object, until it returns FALSE.
+ * Returns -1 if the backend can't list its objects.
+ */
+int
+seaf_obj_store_foreach_obj (struct SeafObjStore *obj_store,
+                            SeafObjStoreFunc process,
+                            void *user_data);
+
+/* Latency statistics of the calls into the backend, see backend-stats.h. */
+struct BackendStats *
+seaf_obj_store_get_backend_stats (struct SeafObjStore *obj_store);
+#endif
+
 /* Asynchronous I/O interface. */
 
 typedef struct OSAsyncResult {
@@ -66,6 +108,16 @@ seaf_obj_store_async_read (struct SeafObjStore *obj_store,
                            guint32 reader_id,
                            const char *obj_id);
 
+/*
+ * Read @n_objs objects in one task. The callback is still called once
+ * for each object, but all of them are handled in one event.
+ */
+int
+seaf_obj_store_async_read_batch (struct SeafObjStore *obj_store,
+                                 guint32 reader_id,
+                                 const char **obj_ids,
+                                 int n_objs);
+
 /* Async write */
 guint32
 seaf_obj_store_register_async_write (struct SeafObjStore *obj_store,
@@ -83,6 +135,14 @@ seaf_obj_store_async_write (struct SeafObjStore *obj_store,
                             const void *obj_data,
                             int data_len);
 
+int
+seaf_obj_store_async_write_batch (struct SeafObjStore *obj_store,
+                                  guint32 writer_id,
+                                  const char **obj_ids,
+                                  const void **obj_data,
+                                  const int *data_lens,
+                                  int n_objs);
+
 /* Async stat */
 guint32
 seaf_obj_store_register_async_stat (struct SeafObjStore *obj_store,
@@ -98,4 +158,31 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
                            guint32 stat_id,
                            const char *obj_id);
 
+int
+seaf_obj_store_async_stat_batch (struct SeafObjStore *obj_store,
+                                 guint32 stat_id,
+                                 const char **obj_ids,
+                                 int n_objs);
+
+/* Statistics of the thread pool for read, write or stat operations. */
+typedef struct OSAsyncStats {
+    int     threads;            /* current thread limit */
+    int     max_threads;        /* upper bound in adaptive mode */
+    gboolean adaptive;
+    int     queued;             /* tasks waiting for a thread */
+    int     pending;            /* tasks pushed but not done */
+    gint64  avg_latency;        /* backend latency, in usec */
+    guint64 n_done;
+} OSAsyncStats;
+
+/*
+ * @op is "read", "write" or "stat".
+ * Returns -1 if async I/O is not enabled for @obj_store.
+ * Must be called in the main thread.
+ */
+int
+seaf_obj_store_get_async_stats (struct SeafObjStore *obj_store,
+                                const char *op,
+                                OSAsyncStats *stats);
+
 #endif
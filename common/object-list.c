@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include "object-list.h"
+#include "obj-id.h"
 
 
 ObjectList *
@@ -10,7 +11,8 @@ object_list_new ()
 {
     ObjectList *ol = g_new0 (ObjectList, 1);
 
-    ol->obj_hash = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
+    ol->obj_hash = g_hash_table_new_full (seaf_obj_id_hash, seaf_obj_id_equal,
+                                          g_free, NULL);
     ol->obj_ids = g_ptr_array_new_with_free_func (g_free);
 
     return ol;
@@ -46,10 +48,14 @@ object_list_serialize (ObjectList *ol, uint8_t **buffer, uint32_t *len)
 gboolean
 object_list_insert (ObjectList *ol, const char *object_id)
 {
-    if (g_hash_table_lookup (ol->obj_hash, object_id))
-        return FALSE;
-    char *id = g_strdup(object_id);
-    g_hash_table_insert (ol->obj_hash, id, NULL);
-    g_ptr_array_add (ol->obj_ids, id);
+    SeafObjId id;
+
+    /* Ids that are not sha1s are kept, but not deduplicated. */
+    if (seaf_obj_id_from_hex (&id, object_id) == 0) {
+        if (g_hash_table_lookup_extended (ol->obj_hash, &id, NULL, NULL))
+            return FALSE;
+        g_hash_table_insert (ol->obj_hash, g_memdup (&id, sizeof(id)), NULL);
+    }
+    g_ptr_array_add (ol->obj_ids, g_strdup(object_id));
     return TRUE;
 }
@@ -7,7 +7,7 @@
 #include "bitfield.h"
 
 typedef struct {
-    GHashTable  *obj_hash;
+    GHashTable  *obj_hash;          /* binary ids, see obj-id.h */
     GPtrArray   *obj_ids;
 } ObjectList;
 
@@ -1,11 +1,42 @@
 #ifndef BLOCKTX_COMMON_IMPL_V2_H
 #define BLOCKTX_COMMON_IMPL_V2_H
 
+#include <openssl/rand.h>
+#include <zlib.h>
+
 #include "utils.h"
+#include "cdc/seaf-sha1.h"
+#include "exists-filter.h"
+#include "buf-pool.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
 #include "log.h"
 
+#ifdef SEAFILE_SERVER
+#include "metrics.h"
+
+/* Count a block moved by the block processors, with its bytes on the wire. */
+static void
+count_block_tx (gboolean sent, guint32 bytes)
+{
+    static Metric *blocks[2], *block_bytes[2];
+    int i = sent ? 1 : 0;
+
+    if (!blocks[i]) {
+        const char *labels = sent ? "direction=\"sent\"" :
+            "direction=\"received\"";
+        block_bytes[i] = metrics_counter ("seaf_block_tx_bytes_total", labels,
+                                          "Block data moved by the block processors.");
+        blocks[i] = metrics_counter ("seaf_block_tx_blocks_total", labels,
+                                     "Blocks moved by the block processors.");
+    }
+
+    metrics_counter_add (blocks[i], 1);
+    metrics_counter_add (block_bytes[i], bytes);
+    seaf_cs_manager_add_tx_bytes (seaf->cs_mgr, bytes);
+}
+#endif
+
 #define SC_SEND_PORT    "301"
 #define SS_SEND_PORT    "PORT"
 #define SC_GET_PORT     "302"
@@ -18,6 +49,14 @@
 #define SS_ACK          "BLOCK OK"
 #define SC_BLOCKLIST    "306"
 #define SS_BLOCKLIST    "BLOCK LIST"
+#define SC_PARTIAL      "307"
+#define SS_PARTIAL      "PARTIAL BLOCKS"
+#define SC_GET_FILTER   "308"
+#define SS_GET_FILTER   "GET HAVE FILTER"
+#define SC_FILTER       "309"
+#define SS_FILTER       "HAVE FILTER"
+#define SC_FILTER_END   "310"
+#define SS_FILTER_END   "HAVE FILTER END"
 
 #define SC_BAD_BLK_REQ      "405"
 #define SS_BAD_BLK_REQ      "BAD BLOCK REQUEST"
@@ -31,23 +70,110 @@
 #define IO_BUF_LEN 1024
 #define ENC_BLOCK_SIZE 16
 
+/*
+ * Block data is read, encrypted and sent in pieces of this size, and
+ * received the same way. It's only a local choice, the wire format
+ * doesn't depend on it.
+ */
+#define DATA_BUF_LEN (64 * 1024)
+
+/*
+ * The receiver reads up to this much at once, so that a block is
+ * decrypted and written in few calls. Plain data on Linux is spliced
+ * from the socket into the block file instead, see splice_block_data().
+ */
+#define RECV_BUF_LEN (256 * 1024)
+
+/*
+ * Protocol options: the slave offers them as a space separated list
+ * with its "200 OK", the master accepts the ones it wants by sending
+ * them back with "302 GET PORT". Old peers ignore the offer.
+ *
+ * "resume": block packets carry the offset their data starts at,
+ * getblock requests ask for an offset, and the recvblock slave tells
+ * the partial blocks it has with "307 PARTIAL BLOCKS" before sending
+ * the port.
+ *
+ * "aes-gcm": on encrypted channels, block data is sent with AES-256-GCM
+ * instead of CBC. Each block is sent as a random nonce, the cipher text
+ * and the tag, so a block is authenticated before it's committed.
+ *
+ * "zlib": block packets carry a codec, and block data may be zlib
+ * compressed before it's encrypted. The sender decides per block.
+ *
+ * "have-filter": only offered by recvblock. Before sending a long block
+ * list the master may ask with "308 GET HAVE FILTER <n blocks>" for a
+ * bloom filter of the blocks the slave has for the repo. The slave sends
+ * its bits in "309 HAVE FILTER" pieces, then "310 HAVE FILTER END
+ * <n bits>", with 0 bits if it has no filter. The master then only lists
+ * the blocks that test as present, the others are missing for sure.
+ *
+ * "reuse": the data connection is kept open for a while after a clean
+ * transfer, by both peers. The master may then send "reuse:<token>"
+ * with the token of an idle connection to the peer. If the slave still
+ * has it, it sends port 0 and the token back, and both continue on the
+ * old connection. Otherwise the slave sends a new port as usual, and
+ * the master drops the idle connection.
+ */
+#define RESUME_TOKEN "resume"
+#define GCM_TOKEN "aes-gcm"
+#define COMPRESS_TOKEN "zlib"
+#define FILTER_TOKEN "have-filter"
+#define REUSE_TOKEN "reuse"
+#define REUSE_PREFIX REUSE_TOKEN ":"
+#define SLAVE_OPTIONS RESUME_TOKEN " " GCM_TOKEN " " COMPRESS_TOKEN " " REUSE_TOKEN
+#define RECV_SLAVE_OPTIONS SLAVE_OPTIONS " " FILTER_TOKEN
+
+/* The filter is sent in pieces of this size. */
+#define FILTER_PIECE_LEN (32 * 1024)
+
+#define GCM_NONCE_LEN 12
+#define GCM_TAG_LEN 16
+
+/* A partial block list is sent in pieces of about this size. */
+#define MAX_PARTIAL_LEN 4096
+
+/*
+ * Idle data connections are kept for this many seconds. The slave
+ * keeps them longer, so that the master doesn't offer one the slave
+ * dropped already.
+ */
+#define MASTER_IDLE_CONN_TIMEOUT 30
+#define SLAVE_IDLE_CONN_TIMEOUT 60
+#define MAX_IDLE_CONNS 16
+#define IDLE_CONN_CHECK_INTERVAL 10000 /* 10s */
+
 typedef struct {
-    int     block_idx;
-    char    block_id[41];
+    int      block_idx;
+    char     block_id[41];
+    uint32_t offset;
 } BlockRequest;
 
 typedef struct {
     int      block_idx;
     int      tx_bytes;
     int      tx_time;
+    char     block_id[41];      /* only set for received blocks */
 } BlockResponse;
 
+enum {
+    BLOCK_CODEC_NONE = 0,
+    BLOCK_CODEC_ZLIB = 1,
+};
+
 typedef struct {
     uint32_t block_size;
     uint32_t block_idx;
     char     block_id[41];
+    uint32_t offset;            /* only sent if resuming or compression is on */
+    uint8_t  codec;             /* only sent if compression is on */
 } __attribute__((__packed__)) BlockPacket;
 
+#define block_packet_len(tdata)                                 \
+    ((tdata)->compress ? sizeof(BlockPacket) :                  \
+     (tdata)->resume ? offsetof(BlockPacket, codec) :           \
+     offsetof(BlockPacket, offset))
+
 typedef struct ThreadData ThreadData;
 
 /* function called when receiving event from transfer thread via pipe. */
@@ -58,6 +184,9 @@ struct ThreadData {
     CcnetPeer           *peer;
     /* Never dereference this processor in the worker thread */
     CcnetProcessor      *processor;
+    char                 peer_id[41];
+    /* Repo of the received blocks, if known, for their storage class. */
+    char                 repo_id[37];
 #if defined SENDBLOCK_PROC || defined GETBLOCK_PROC
     TransferTask        *task;
 #endif
@@ -69,19 +198,182 @@ struct ThreadData {
     gboolean             encrypt_channel;
     unsigned char        key[ENC_BLOCK_SIZE];
     unsigned char        iv[ENC_BLOCK_SIZE];
+    gboolean             gcm;
+    unsigned char        gcm_key[32];
+    gboolean             compress;
 
     gboolean             processor_done;
+    gboolean             resume;
     char                *token;
     TransferFunc         transfer_func;
     int                  thread_ret;
+
+    /* The idle connection offered to, or asked by, the master. */
+    char                *reuse_token;
+    evutil_socket_t      reuse_fd;
+    /* Set by the worker if it stopped between two blocks. */
+    gboolean             conn_clean;
+    /* Set in release_resource() if the connection may be kept. */
+    gboolean             keep_conn;
 };
 
 typedef struct {
     ThreadData      *tdata;
     int              bm_offset;
     GHashTable      *block_hash;
+    /* sendblock: block index -> bytes the receiver already has */
+    GHashTable      *partials;
+    /* recvblock: the partial block list, not sent yet */
+    GList           *partial_lists;
+    GString         *partial_buf;
+    int              n_listed;
+    /* sendblock: the have filter offer and the filter being received */
+    gboolean         filter_offered;
+    GByteArray      *filter_buf;
+    /* sendblock: block indexes of the filtered list sent, and their bitmap */
+    GArray          *queried;
+    Bitfield         query_bitmap;
+    /* master: the slave keeps idle connections */
+    gboolean         reuse_offered;
 } BlockProcPriv;
 
+/*
+ * Idle data connections, by the token they were opened with. The pool
+ * is per processor type, so a sendblock connection is only reused by
+ * sendblock, and on the other end by recvblock. Only used in the main
+ * thread.
+ */
+
+typedef struct {
+    char            *token;
+    char             peer_id[41];
+    evutil_socket_t  fd;
+    gint64           idle_since;
+} IdleConn;
+
+static GList *idle_conns;
+static CcnetTimer *idle_conn_timer;
+
+#if defined SENDBLOCK_PROC || defined GETBLOCK_PROC
+#define IDLE_CONN_TIMEOUT MASTER_IDLE_CONN_TIMEOUT
+#else
+#define IDLE_CONN_TIMEOUT SLAVE_IDLE_CONN_TIMEOUT
+#endif
+
+static void
+idle_conn_free (IdleConn *conn)
+{
+    evutil_closesocket (conn->fd);
+    g_free (conn->token);
+    g_free (conn);
+}
+
+/*
+ * An idle connection must have nothing to read. Data or EOF means the
+ * other end dropped it or didn't stop cleanly.
+ */
+static gboolean
+conn_is_idle (evutil_socket_t fd)
+{
+#ifndef WIN32
+    char c;
+    int n;
+
+    n = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+#else
+    return FALSE;
+#endif
+}
+
+static int
+idle_conn_pulse (void *vdata)
+{
+    gint64 now = (gint64)time(NULL);
+    GList *ptr, *next;
+    IdleConn *conn;
+
+    for (ptr = idle_conns; ptr; ptr = next) {
+        next = ptr->next;
+        conn = ptr->data;
+        if (now - conn->idle_since < IDLE_CONN_TIMEOUT &&
+            conn_is_idle (conn->fd))
+            continue;
+        idle_conns = g_list_delete_link (idle_conns, ptr);
+        idle_conn_free (conn);
+    }
+
+    if (!idle_conns) {
+        /* Freed by returning FALSE. */
+        idle_conn_timer = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+park_idle_conn (const char *token, const char *peer_id, evutil_socket_t fd)
+{
+    IdleConn *conn;
+
+    if (!token || !conn_is_idle (fd)) {
+        evutil_closesocket (fd);
+        return;
+    }
+
+    if (g_list_length (idle_conns) >= MAX_IDLE_CONNS) {
+        /* Drop the oldest one, at the head. */
+        idle_conn_free (idle_conns->data);
+        idle_conns = g_list_delete_link (idle_conns, idle_conns);
+    }
+
+    conn = g_new0 (IdleConn, 1);
+    conn->token = g_strdup (token);
+    g_strlcpy (conn->peer_id, peer_id, sizeof(conn->peer_id));
+    conn->fd = fd;
+    conn->idle_since = (gint64)time(NULL);
+    idle_conns = g_list_append (idle_conns, conn);
+
+    seaf_debug ("Keep idle data connection to %.8s.\n", peer_id);
+
+    if (!idle_conn_timer)
+        idle_conn_timer = ccnet_timer_new (idle_conn_pulse, NULL,
+                                           IDLE_CONN_CHECK_INTERVAL);
+}
+
+/*
+ * Take an idle connection to @peer_id, the one with @token if it's not
+ * NULL, the latest one otherwise. Returns -1 if there's none.
+ */
+static evutil_socket_t
+take_idle_conn (const char *peer_id, const char *token, char **ret_token)
+{
+    GList *ptr;
+    IdleConn *conn;
+    evutil_socket_t fd = -1;
+
+    for (ptr = g_list_last (idle_conns); ptr; ptr = ptr->prev) {
+        conn = ptr->data;
+        if (strcmp (conn->peer_id, peer_id) != 0 ||
+            (token && strcmp (conn->token, token) != 0))
+            continue;
+
+        idle_conns = g_list_delete_link (idle_conns, ptr);
+        if (conn_is_idle (conn->fd)) {
+            fd = conn->fd;
+            if (ret_token)
+                *ret_token = conn->token;
+            else
+                g_free (conn->token);
+            g_free (conn);
+        } else
+            idle_conn_free (conn);
+        break;
+    }
+
+    return fd;
+}
+
 /*
  * Common code for processor start and release_resource functions.
  */
@@ -96,12 +388,19 @@ prepare_thread_data (CcnetProcessor *processor,
     priv->tdata = g_new0 (ThreadData, 1);
     priv->tdata->task_pipe[0] = -1;
     priv->tdata->task_pipe[1] = -1;
+    priv->tdata->data_fd = -1;
+    priv->tdata->reuse_fd = -1;
     priv->tdata->transfer_func = tranfer_func;
     priv->tdata->processor = processor;
+    g_strlcpy (priv->tdata->peer_id, processor->peer_id,
+               sizeof(priv->tdata->peer_id));
 
     priv->tdata->cevent_id = cevent_manager_register (seaf->ev_mgr,
                                                       handler,
                                                       processor);
+#ifdef SEAFILE_SERVER
+    seaf_cs_manager_transfer_started (seaf->cs_mgr);
+#endif
 }
 
 static void
@@ -114,8 +413,30 @@ release_thread (CcnetProcessor *processor)
         if (priv->tdata->task_pipe[1] >= 0)
             pipeclose (priv->tdata->task_pipe[1]);
 
+        /* An idle connection taken but not used. */
+        if (priv->tdata->reuse_fd >= 0) {
+            evutil_closesocket (priv->tdata->reuse_fd);
+            priv->tdata->reuse_fd = -1;
+        }
+
         priv->tdata->processor_done = TRUE;
         cevent_manager_unregister (seaf->ev_mgr, priv->tdata->cevent_id);
+#ifdef SEAFILE_SERVER
+        seaf_cs_manager_transfer_done (seaf->cs_mgr,
+                                       processor->failure == PROC_DONE);
+#endif
+    }
+
+    if (priv->partials)
+        g_hash_table_destroy (priv->partials);
+    string_list_free (priv->partial_lists);
+    if (priv->partial_buf)
+        g_string_free (priv->partial_buf, TRUE);
+    if (priv->filter_buf)
+        g_byte_array_free (priv->filter_buf, TRUE);
+    if (priv->queried) {
+        g_array_free (priv->queried, TRUE);
+        BitfieldDestruct (&priv->query_bitmap);
     }
 }
 
@@ -143,7 +464,16 @@ thread_done (void *vtdata)
             ccnet_processor_done (tdata->processor, FALSE);
     }
 
+    /* The worker leaves a clean connection open for us. */
+    if (tdata->conn_clean) {
+        if (tdata->keep_conn)
+            park_idle_conn (tdata->token, tdata->peer_id, tdata->data_fd);
+        else
+            evutil_closesocket (tdata->data_fd);
+    }
+
     g_free (tdata->token);
+    g_free (tdata->reuse_token);
     g_free (tdata);
 }
 
@@ -153,12 +483,15 @@ thread_done (void *vtdata)
  */
 
 static void
-send_block_rsp (int cevent_id, int block_idx, int tx_bytes, int tx_time)
+send_block_rsp (int cevent_id, int block_idx, int tx_bytes, int tx_time,
+                const char *block_id)
 {
     BlockResponse *blk_rsp = g_new0 (BlockResponse, 1);
     blk_rsp->block_idx = block_idx;
     blk_rsp->tx_bytes = tx_bytes;
     blk_rsp->tx_time = tx_time;
+    if (block_id)
+        memcpy (blk_rsp->block_id, block_id, 41);
     cevent_manager_add_event (seaf->ev_mgr, 
                               cevent_id,
                               (void *)blk_rsp);
@@ -178,9 +511,66 @@ generate_encrypt_key (ThreadData *tdata, CcnetPeer *peer)
                     tdata->key, /* the derived key */
                     tdata->iv); /* IV, initial vector */
 
+    /* Don't share the CBC key with the other mode. */
+    EVP_BytesToKey (EVP_aes_256_gcm(),
+                    EVP_sha1(),
+                    (unsigned char *)"seafgcm1",
+                    (unsigned char*)peer->session_key,
+                    strlen(peer->session_key),
+                    3,
+                    tdata->gcm_key,
+                    NULL);
+
     tdata->encrypt_channel = TRUE;
 }
 
+/* Whether the space separated @content has @token. */
+static gboolean
+has_option (const char *content, int clen, const char *token)
+{
+    char **tokens, **ptr;
+    gboolean ret = FALSE;
+
+    if (clen == 0 || content[clen-1] != '\0')
+        return FALSE;
+
+    tokens = g_strsplit (content, " ", 0);
+    for (ptr = tokens; *ptr; ++ptr) {
+        if (strcmp (*ptr, token) == 0) {
+            ret = TRUE;
+            break;
+        }
+    }
+    g_strfreev (tokens);
+
+    return ret;
+}
+
+#if defined RECVBLOCK_PROC || defined PUTBLOCK_PROC
+/* The value of the "<prefix><value>" option in @content, or NULL. */
+static char *
+get_option_value (const char *content, int clen, const char *prefix)
+{
+    char **tokens, **ptr;
+    char *ret = NULL;
+    int len = strlen(prefix);
+
+    if (clen == 0 || content[clen-1] != '\0')
+        return NULL;
+
+    tokens = g_strsplit (content, " ", 0);
+    for (ptr = tokens; *ptr; ++ptr) {
+        if (strncmp (*ptr, prefix, len) == 0 && (*ptr)[len] != '\0') {
+            ret = g_strdup (*ptr + len);
+            break;
+        }
+    }
+    g_strfreev (tokens);
+
+    return ret;
+}
+#endif
+
 #if defined SENDBLOCK_PROC || defined PUTBLOCK_PROC
 
 static int
@@ -204,11 +594,29 @@ encrypt_init (EVP_CIPHER_CTX *ctx,
     return 0;
 }
 
+static int
+gcm_encrypt_init (EVP_CIPHER_CTX *ctx,
+                  const unsigned char *key,
+                  unsigned char *nonce)
+{
+    EVP_CIPHER_CTX_init (ctx);
+
+    if (RAND_bytes (nonce, GCM_NONCE_LEN) != 1)
+        return -1;
+
+    /* The default IV length of GCM is GCM_NONCE_LEN. */
+    if (EVP_EncryptInit_ex (ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 0)
+        return -1;
+
+    return 0;
+}
+
+/* @out_buf must have room for @len + ENC_BLOCK_SIZE bytes. */
 static int
 send_encrypted_data (EVP_CIPHER_CTX *ctx, int sockfd,
-                     const char *buf, int len, uint32_t remain)
+                     const char *buf, int len, uint32_t remain,
+                     char *out_buf)
 {
-    char out_buf[IO_BUF_LEN + ENC_BLOCK_SIZE];
     int out_len;
 
     if (EVP_EncryptUpdate (ctx,
@@ -239,10 +647,117 @@ send_encrypted_data (EVP_CIPHER_CTX *ctx, int sockfd,
     return 0;
 }
 
+/* Read past the first @offset bytes of the block. */
+static int
+skip_block_data (BlockHandle *handle, uint32_t offset)
+{
+    char buf[IO_BUF_LEN];
+    int n;
+
+    while (offset > 0) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, handle, buf,
+                                           MIN (offset, IO_BUF_LEN));
+        if (n <= 0)
+            return -1;
+        offset -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the header with MSG_MORE where there is one, so that the kernel
+ * puts it in the same segment as the start of the block data instead of
+ * sending a tiny segment for it.
+ */
+static int
+send_block_header (evutil_socket_t sockfd, const BlockPacket *pkt,
+                   int len, gboolean more)
+{
+#ifdef MSG_MORE
+    const char *ptr = (const char *)pkt;
+    int n;
+
+    if (more) {
+        while (len > 0) {
+            n = send (sockfd, ptr, len, MSG_MORE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            ptr += n;
+            len -= n;
+        }
+        return 0;
+    }
+#endif
+    if (sendn (sockfd, pkt, len) < 0)
+        return -1;
+    return 0;
+}
+
+/* Blocks smaller than this are sent as they are. */
+#define MIN_COMPRESS_SIZE 512
+#define COMPRESS_SAMPLE_LEN (64 * 1024)
+
+/*
+ * Read the rest of the block, @len bytes, and compress it if that pays.
+ * If its first COMPRESS_SAMPLE_LEN bytes don't shrink by a tenth, the
+ * block is taken as incompressible (media, archives) and sent as it is.
+ * Returns the data to send, to be freed with buf_pool_free(), or NULL if
+ * the block can't be read.
+ */
+static char *
+read_block_data (BlockHandle *handle, uint32_t len,
+                 uint32_t *data_len, uint8_t *codec)
+{
+    char *raw, *zbuf;
+    uLongf zlen;
+    uint32_t sample, pos = 0;
+    int n;
+
+    raw = buf_pool_alloc (len);
+    while (pos < len) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           raw + pos, len - pos);
+        if (n <= 0) {
+            buf_pool_free (raw);
+            return NULL;
+        }
+        pos += n;
+    }
+
+    *data_len = len;
+    *codec = BLOCK_CODEC_NONE;
+
+    zlen = compressBound (len);
+    zbuf = buf_pool_alloc (zlen);
+
+    sample = MIN (len, COMPRESS_SAMPLE_LEN);
+    if (compress2 ((Bytef *)zbuf, &zlen, (Bytef *)raw, sample,
+                   Z_BEST_SPEED) != Z_OK || zlen > sample / 10 * 9)
+        goto raw;
+
+    zlen = compressBound (len);
+    if (compress2 ((Bytef *)zbuf, &zlen, (Bytef *)raw, len,
+                   Z_BEST_SPEED) != Z_OK || zlen >= len)
+        goto raw;
+
+    buf_pool_free (raw);
+    *data_len = zlen;
+    *codec = BLOCK_CODEC_ZLIB;
+    return zbuf;
+
+raw:
+    buf_pool_free (zbuf);
+    return raw;
+}
+
 static int
 send_block_packet (ThreadData *tdata,
                    int block_idx,
                    const char *block_id,
+                   uint32_t offset,
                    BlockHandle *handle, 
                    evutil_socket_t sockfd)
 {
@@ -250,7 +765,13 @@ send_block_packet (ThreadData *tdata,
     BlockMetadata *md;
     uint32_t size, remain;
     BlockPacket pkt;
-    char buf[IO_BUF_LEN];
+    char *buf = NULL, *out_buf = NULL;
+    char *data = NULL;
+    uint32_t data_len = 0, pos = 0;
+    uint8_t codec = BLOCK_CODEC_NONE;
+    const char *piece;
+    unsigned char nonce[GCM_NONCE_LEN], tag[GCM_TAG_LEN];
+    gboolean gcm = (tdata->encrypt_channel && tdata->gcm);
     int n;
     int ret = 0;
     EVP_CIPHER_CTX ctx;
@@ -263,11 +784,36 @@ send_block_packet (ThreadData *tdata,
     size = md->size;
     g_free (md);
 
+    /* The receiver may have a stale partial block, send all of it then. */
+    if (!tdata->resume || offset >= size)
+        offset = 0;
+    if (offset > 0 && skip_block_data (handle, offset) < 0) {
+        seaf_warning ("Failed to read block %s.\n", block_id);
+        return -1;
+    }
+
+    size -= offset;
+    if (tdata->compress && size >= MIN_COMPRESS_SIZE) {
+        data = read_block_data (handle, size, &data_len, &codec);
+        if (!data) {
+            seaf_warning ("Failed to read block %s.\n", block_id);
+            return -1;
+        }
+        size = data_len;
+    }
     remain = size;
     /* Compute data size after encryption.
      * Block size is 16 bytes and AES always add one padding block.
      */
-    if (tdata->encrypt_channel) {
+    if (gcm) {
+        size += GCM_NONCE_LEN + GCM_TAG_LEN;
+        if (gcm_encrypt_init (&ctx, tdata->gcm_key, nonce) < 0) {
+            seaf_warning ("Failed to init encryption.\n");
+            EVP_CIPHER_CTX_cleanup (&ctx);
+            buf_pool_free (data);
+            return -1;
+        }
+    } else if (tdata->encrypt_channel) {
         size = ((size >> 4) + 1) << 4;
         encrypt_init (&ctx, tdata->key, tdata->iv);
     }
@@ -275,23 +821,40 @@ send_block_packet (ThreadData *tdata,
     pkt.block_size = htonl (size);
     pkt.block_idx = htonl ((uint32_t) block_idx);
     memcpy (pkt.block_id, block_id, 41);
-    if (sendn (sockfd, &pkt, sizeof(pkt)) < 0) {
+    pkt.offset = htonl (offset);
+    pkt.codec = codec;
+    if (send_block_header (sockfd, &pkt, block_packet_len(tdata),
+                           size > 0) < 0 ||
+        (gcm && sendn (sockfd, nonce, GCM_NONCE_LEN) < 0)) {
         seaf_warning ("Failed to write socket: %s.\n", 
                    evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
         ret = -1;
         goto out;
     }
 
+    buf = buf_pool_alloc (DATA_BUF_LEN);
+    if (tdata->encrypt_channel)
+        out_buf = buf_pool_alloc (DATA_BUF_LEN + ENC_BLOCK_SIZE);
+
     while (1) {
-        n = seaf_block_manager_read_block (block_mgr, handle, buf, IO_BUF_LEN);
+        if (data) {
+            n = MIN (data_len - pos, DATA_BUF_LEN);
+            piece = data + pos;
+            pos += n;
+        } else {
+            n = seaf_block_manager_read_block (block_mgr, handle, buf,
+                                               DATA_BUF_LEN);
+            piece = buf;
+        }
         if (n <= 0)
             break;
         remain -= n;
 
         if (tdata->encrypt_channel)
-            ret = send_encrypted_data (&ctx, sockfd, buf, n, remain);
+            ret = send_encrypted_data (&ctx, sockfd, piece, n, remain,
+                                       out_buf);
         else
-            ret = sendn (sockfd, buf, n);
+            ret = sendn (sockfd, piece, n);
 
         if (ret < 0) {
             seaf_warning ("Failed to write block %s\n", block_id);
@@ -300,6 +863,7 @@ send_block_packet (ThreadData *tdata,
 #ifdef SENDBLOCK_PROC
         /* Update global transferred bytes. */
         g_atomic_int_add (&(tdata->task->tx_bytes), n);
+        transfer_task_throttle (tdata->task, n);
 #endif
     }
     if (n < 0) {
@@ -308,13 +872,33 @@ send_block_packet (ThreadData *tdata,
         goto out;
     }
 
+    if (gcm) {
+        int out_len;
+        /* Not finalized in the loop for an empty block. */
+        if (size == GCM_NONCE_LEN + GCM_TAG_LEN)
+            EVP_EncryptFinal_ex (&ctx, (unsigned char *)out_buf, &out_len);
+        if (EVP_CIPHER_CTX_ctrl (&ctx, EVP_CTRL_GCM_GET_TAG,
+                                 GCM_TAG_LEN, tag) == 0 ||
+            sendn (sockfd, tag, GCM_TAG_LEN) < 0) {
+            seaf_warning ("Failed to write block %s\n", block_id);
+            ret = -1;
+            goto out;
+        }
+    }
+
 #if defined SENDBLOCK_PROC
-    send_block_rsp (tdata->cevent_id, block_idx, 0, 0);
+    send_block_rsp (tdata->cevent_id, block_idx, size, 0, NULL);
+#endif
+#ifdef SEAFILE_SERVER
+    count_block_tx (TRUE, size);
 #endif
 
 out:
     if (tdata->encrypt_channel)
         EVP_CIPHER_CTX_cleanup (&ctx);
+    buf_pool_free (buf);
+    buf_pool_free (out_buf);
+    buf_pool_free (data);
 
     return ret;
 }
@@ -332,6 +916,7 @@ send_blocks (ThreadData *tdata)
         n = pipereadn (tdata->task_pipe[0], &blk_req, sizeof(blk_req));
         if (n == 0) {
             seaf_debug ("Processor exited. Worker thread exits now.\n");
+            tdata->conn_clean = TRUE;
             return -1;
         }
         if (n != sizeof(blk_req)) {
@@ -347,8 +932,8 @@ send_blocks (ThreadData *tdata)
             return -1;
         }
 
-        ret = send_block_packet (tdata, blk_req.block_idx, blk_req.block_id, 
-                                 handle, tdata->data_fd);
+        ret = send_block_packet (tdata, blk_req.block_idx, blk_req.block_id,
+                                 blk_req.offset, handle, tdata->data_fd);
         if (ret < 0)
             return -1;
 
@@ -376,6 +961,25 @@ typedef struct {
     BlockHandle *handle;
     uint32_t cevent_id;
     EVP_CIPHER_CTX ctx;
+    /* Resumed blocks are checked against their id before commit. */
+    gboolean resumed;
+    SeafSHA1Ctx sha1;
+    char *buf;                  /* RECV_BUF_LEN */
+    char *out_buf;              /* RECV_BUF_LEN + ENC_BLOCK_SIZE */
+    /* GCM mode: bytes of the block data received, out of gcm_len. */
+    uint32_t gcm_pos;
+    uint32_t gcm_len;
+    unsigned char nonce[GCM_NONCE_LEN];
+    unsigned char tag[GCM_TAG_LEN];
+    /* The block data is zlib compressed. */
+    gboolean inflating;
+    gboolean inflate_done;
+    z_stream zs;
+    char *zbuf;                 /* DATA_BUF_LEN */
+    /* Plain data is moved to the file of the block through a pipe. */
+    int block_fd;
+    int pipe_fds[2];
+    gboolean no_splice;
 } RecvFSM;
 
 static int
@@ -399,11 +1003,69 @@ decrypt_init (EVP_CIPHER_CTX *ctx,
     return 0;
 }
 
+static int
+store_block_data (RecvFSM *fsm, const char *buf, int len)
+{
+    if (fsm->resumed)
+        seaf_sha1_update (&fsm->sha1, buf, len);
+
+    return seaf_block_manager_write_block (seaf->block_mgr, fsm->handle,
+                                           buf, len);
+}
+
+/* Write plain block data, decompressing it first if needed. */
+static int
+write_block_data (RecvFSM *fsm, const char *buf, int len)
+{
+    int rc, n;
+
+    if (!fsm->inflating)
+        return store_block_data (fsm, buf, len);
+
+    if (fsm->inflate_done) {
+        seaf_warning ("Trailing data in block %s.\n", fsm->hdr.block_id);
+        return -1;
+    }
+
+    fsm->zs.next_in = (Bytef *)buf;
+    fsm->zs.avail_in = len;
+    do {
+        fsm->zs.next_out = (Bytef *)fsm->zbuf;
+        fsm->zs.avail_out = DATA_BUF_LEN;
+        rc = inflate (&fsm->zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            seaf_warning ("Failed to decompress block %s.\n",
+                          fsm->hdr.block_id);
+            return -1;
+        }
+
+        n = DATA_BUF_LEN - fsm->zs.avail_out;
+        if (n > 0 && store_block_data (fsm, fsm->zbuf, n) < 0)
+            return -1;
+
+        if (rc == Z_STREAM_END) {
+            fsm->inflate_done = TRUE;
+            break;
+        }
+    } while (fsm->zs.avail_out == 0);
+
+    return 0;
+}
+
+static void
+end_inflate (RecvFSM *fsm)
+{
+    if (fsm->inflating) {
+        inflateEnd (&fsm->zs);
+        fsm->inflating = FALSE;
+    }
+}
+
 static int
 write_decrypted_data (const char *buf, int len,
                       RecvFSM *fsm)
 {
-    char out_buf[IO_BUF_LEN + ENC_BLOCK_SIZE];
+    char *out_buf = fsm->out_buf;
     int out_len;
 
     if (EVP_DecryptUpdate (&fsm->ctx,
@@ -413,8 +1075,7 @@ write_decrypted_data (const char *buf, int len,
         return -1;
     }
 
-    if (seaf_block_manager_write_block (seaf->block_mgr, fsm->handle,
-                                        out_buf, out_len) < 0) {
+    if (write_block_data (fsm, out_buf, out_len) < 0) {
         seaf_warning ("Failed to write block %s.\n", fsm->hdr.block_id);
         return -1;
     }
@@ -426,8 +1087,7 @@ write_decrypted_data (const char *buf, int len,
             return -1;
         }
 
-        if (seaf_block_manager_write_block (seaf->block_mgr, fsm->handle,
-                                            out_buf, out_len) < 0) {
+        if (write_block_data (fsm, out_buf, out_len) < 0) {
             seaf_warning ("Failed to write block %s.\n", fsm->hdr.block_id);
             return -1;
         }
@@ -436,6 +1096,177 @@ write_decrypted_data (const char *buf, int len,
     return 0;
 }
 
+/*
+ * In GCM mode block data is the nonce, the cipher text and the tag.
+ * @buf is the next @len bytes of it.
+ */
+static int
+write_gcm_data (const char *buf, int len, RecvFSM *fsm)
+{
+    uint32_t data_end = fsm->gcm_len - GCM_TAG_LEN;
+    int n, out_len;
+
+    while (len > 0) {
+        if (fsm->gcm_pos < GCM_NONCE_LEN) {
+            n = MIN (len, GCM_NONCE_LEN - fsm->gcm_pos);
+            memcpy (fsm->nonce + fsm->gcm_pos, buf, n);
+            if (fsm->gcm_pos + n == GCM_NONCE_LEN &&
+                EVP_DecryptInit_ex (&fsm->ctx, NULL, NULL,
+                                    fsm->tdata->gcm_key, fsm->nonce) == 0) {
+                seaf_warning ("Failed to init decryption.\n");
+                return -1;
+            }
+        } else if (fsm->gcm_pos < data_end) {
+            n = MIN (len, data_end - fsm->gcm_pos);
+            if (EVP_DecryptUpdate (&fsm->ctx,
+                                   (unsigned char *)fsm->out_buf, &out_len,
+                                   (unsigned char *)buf, n) == 0) {
+                seaf_warning ("Failed to decrypt data.\n");
+                return -1;
+            }
+            if (write_block_data (fsm, fsm->out_buf, out_len) < 0) {
+                seaf_warning ("Failed to write block %s.\n",
+                              fsm->hdr.block_id);
+                return -1;
+            }
+        } else {
+            n = MIN (len, fsm->gcm_len - fsm->gcm_pos);
+            memcpy (fsm->tag + fsm->gcm_pos - data_end, buf, n);
+        }
+
+        fsm->gcm_pos += n;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static gboolean
+gcm_block_is_valid (RecvFSM *fsm)
+{
+    int out_len;
+
+    if (EVP_CIPHER_CTX_ctrl (&fsm->ctx, EVP_CTRL_GCM_SET_TAG,
+                             GCM_TAG_LEN, fsm->tag) == 0)
+        return FALSE;
+
+    return (EVP_DecryptFinal_ex (&fsm->ctx, (unsigned char *)fsm->out_buf,
+                                 &out_len) > 0);
+}
+
+/*
+ * Reopen the partial block of the packet in @fsm. The kept bytes are
+ * hashed, so that the whole block can be checked at the end.
+ */
+static BlockHandle *
+open_partial_block (RecvFSM *fsm, uint32_t offset)
+{
+    SeafBlockManager *block_mgr = seaf->block_mgr;
+    BlockHandle *handle;
+    char buf[IO_BUF_LEN];
+    uint32_t remain = offset;
+    int n;
+
+    handle = seaf_block_manager_open_partial_block (block_mgr,
+                                                    fsm->hdr.block_id,
+                                                    offset);
+    if (!handle) {
+        seaf_warning ("Partial block %s is gone.\n", fsm->hdr.block_id);
+        return NULL;
+    }
+
+    seaf_sha1_init (&fsm->sha1);
+    while (remain > 0) {
+        n = seaf_block_manager_read_block (block_mgr, handle, buf,
+                                           MIN (remain, IO_BUF_LEN));
+        if (n <= 0) {
+            seaf_warning ("Failed to read partial block %s.\n",
+                          fsm->hdr.block_id);
+            seaf_block_manager_block_handle_free (block_mgr, handle);
+            return NULL;
+        }
+        seaf_sha1_update (&fsm->sha1, buf, n);
+        remain -= n;
+    }
+
+    seaf_debug ("Resume block %.8s at %u.\n", fsm->hdr.block_id, offset);
+    fsm->resumed = TRUE;
+    return handle;
+}
+
+#define SPLICE_UNSUPPORTED -2
+
+/*
+ * Move up to @len bytes of plain block data from the socket to the
+ * block file, without copying them to user space. Returns the bytes
+ * moved, 0 if the connection is closed, -1 on error, or
+ * SPLICE_UNSUPPORTED if nothing was read and data must be received
+ * the usual way.
+ */
+static int
+splice_block_data (RecvFSM *fsm, evutil_socket_t sockfd, int len)
+{
+#ifdef __linux__
+    ssize_t n, m;
+    ssize_t done = 0;
+
+    if (fsm->pipe_fds[0] < 0 && pipe (fsm->pipe_fds) < 0)
+        goto unsupported;
+
+    do {
+        n = splice_fd (sockfd, fsm->pipe_fds[1], len);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+        goto unsupported;
+    if (n <= 0)
+        return (int)n;
+
+    while (done < n) {
+        if (fsm->block_fd >= 0) {
+            m = splice_fd (fsm->pipe_fds[0], fsm->block_fd, n - done);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && errno == EINVAL) {
+                /* The file system doesn't take spliced data. */
+                fsm->no_splice = TRUE;
+                fsm->block_fd = -1;
+                continue;
+            }
+        } else {
+            m = read (fsm->pipe_fds[0], fsm->buf, n - done);
+            if (m > 0 && store_block_data (fsm, fsm->buf, m) < 0)
+                return -1;
+        }
+        if (m <= 0) {
+            seaf_warning ("Failed to write block %s: %s.\n",
+                          fsm->hdr.block_id, strerror(errno));
+            return -1;
+        }
+        done += m;
+    }
+
+    return (int)n;
+
+unsupported:
+    fsm->no_splice = TRUE;
+    fsm->block_fd = -1;
+#endif
+    return SPLICE_UNSUPPORTED;
+}
+
+static gboolean
+resumed_block_is_valid (RecvFSM *fsm)
+{
+    unsigned char sha1[20];
+    char hex[41];
+
+    seaf_sha1_final (sha1, &fsm->sha1);
+    rawdata_to_hex (sha1, hex, 20);
+
+    return (memcmp (hex, fsm->hdr.block_id, 40) == 0);
+}
+
 static int
 recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
 {
@@ -443,12 +1274,13 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
     char *block_id;
     BlockHandle *handle;
     int n, round;
-    char buf[IO_BUF_LEN];
+    char *buf = fsm->buf;
+    gboolean spliced;
 
     switch (fsm->state) {
     case RECV_STATE_HEADER:
         n = recv (sockfd, 
-                  (char *)&fsm->hdr + sizeof(BlockPacket) - fsm->remain, 
+                  (char *)&fsm->hdr + block_packet_len(fsm->tdata) - fsm->remain,
                   fsm->remain, 0);
         if (n < 0) {
             seaf_warning ("Failed to read block pkt: %s.\n",
@@ -465,8 +1297,14 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
             block_id = fsm->hdr.block_id;
             block_id[40] = 0;
 
-            handle = seaf_block_manager_open_block (block_mgr, 
-                                                    block_id, BLOCK_WRITE);
+            fsm->resumed = FALSE;
+            if (fsm->tdata->resume && fsm->hdr.offset != 0)
+                handle = open_partial_block (fsm, ntohl (fsm->hdr.offset));
+            else
+                handle = seaf_block_manager_open_repo_block (
+                    block_mgr,
+                    fsm->tdata->repo_id[0] ? fsm->tdata->repo_id : NULL,
+                    block_id, BLOCK_WRITE);
             if (!handle) {
                 seaf_warning ("failed to open block %s.\n", block_id);
                 return -1;
@@ -474,16 +1312,60 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
             fsm->handle = handle; 
             fsm->state = RECV_STATE_BLOCK;
 
-            if (fsm->tdata->encrypt_channel)
+            if (fsm->tdata->compress &&
+                fsm->hdr.codec != BLOCK_CODEC_NONE) {
+                memset (&fsm->zs, 0, sizeof(fsm->zs));
+                if (fsm->hdr.codec != BLOCK_CODEC_ZLIB ||
+                    inflateInit (&fsm->zs) != Z_OK) {
+                    seaf_warning ("Bad codec %d for block %s.\n",
+                                  fsm->hdr.codec, block_id);
+                    seaf_block_manager_block_handle_free (block_mgr, handle);
+                    fsm->handle = NULL;
+                    return -1;
+                }
+                fsm->inflating = TRUE;
+                fsm->inflate_done = FALSE;
+            }
+
+            if (fsm->tdata->encrypt_channel && fsm->tdata->gcm) {
+                if (fsm->remain < GCM_NONCE_LEN + GCM_TAG_LEN) {
+                    seaf_warning ("Bad block packet size %d.\n", fsm->remain);
+                    end_inflate (fsm);
+                    seaf_block_manager_block_handle_free (block_mgr, handle);
+                    fsm->handle = NULL;
+                    return -1;
+                }
+                fsm->gcm_pos = 0;
+                fsm->gcm_len = fsm->remain;
+                /* The key and nonce are set after the nonce is received. */
+                EVP_CIPHER_CTX_init (&fsm->ctx);
+                EVP_DecryptInit_ex (&fsm->ctx, EVP_aes_256_gcm(),
+                                    NULL, NULL, NULL);
+            } else if (fsm->tdata->encrypt_channel)
                 decrypt_init (&fsm->ctx, fsm->tdata->key, fsm->tdata->iv);
+
+            /* Resumed blocks are hashed, so they're read as usual. */
+            fsm->block_fd = -1;
+            if (!fsm->tdata->encrypt_channel && !fsm->inflating &&
+                !fsm->resumed && !fsm->no_splice)
+                fsm->block_fd = seaf_block_manager_get_handle_fd (block_mgr,
+                                                                  handle);
         }
         break;
     case RECV_STATE_BLOCK:
         handle = fsm->handle;
         block_id = fsm->hdr.block_id;
 
-        round = MIN (fsm->remain, IO_BUF_LEN);
-        n = recv (sockfd, buf, round, 0);
+        n = SPLICE_UNSUPPORTED;
+        if (fsm->block_fd >= 0)
+            n = splice_block_data (fsm, sockfd,
+                                   MIN (fsm->remain, DATA_BUF_LEN));
+        spliced = (n != SPLICE_UNSUPPORTED);
+
+        if (!spliced) {
+            round = MIN (fsm->remain, RECV_BUF_LEN);
+            n = recv (sockfd, buf, round, 0);
+        }
         if (n < 0) {
             seaf_warning ("failed to read data: %s.\n",
                        evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
@@ -495,10 +1377,14 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
         fsm->remain -= n;
 
         int ret;
-        if (fsm->tdata->encrypt_channel)
+        if (spliced)
+            ret = 0;            /* already in the block file */
+        else if (fsm->tdata->encrypt_channel && fsm->tdata->gcm)
+            ret = write_gcm_data (buf, n, fsm);
+        else if (fsm->tdata->encrypt_channel)
             ret = write_decrypted_data (buf, n, fsm);
         else
-            ret = seaf_block_manager_write_block (block_mgr, handle, buf, n);
+            ret = write_block_data (fsm, buf, n);
 
         if (ret < 0) {
             seaf_warning ("Failed to write block %s.\n", fsm->hdr.block_id);
@@ -508,11 +1394,29 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
 #ifdef GETBLOCK_PROC
         /* Update global transferred bytes. */
         g_atomic_int_add (&(fsm->tdata->task->tx_bytes), n);
+        transfer_task_throttle (fsm->tdata->task, n);
 #endif
 
         if (fsm->remain == 0) {
+            gboolean valid = TRUE;
+
+            if (fsm->tdata->encrypt_channel && fsm->tdata->gcm)
+                valid = gcm_block_is_valid (fsm);
             if (fsm->tdata->encrypt_channel)
                 EVP_CIPHER_CTX_cleanup (&fsm->ctx);
+            if (fsm->inflating && !fsm->inflate_done)
+                valid = FALSE;
+            end_inflate (fsm);
+
+            if (!valid || (fsm->resumed && !resumed_block_is_valid (fsm))) {
+                seaf_warning ("Received block %s is corrupted.\n",
+                              fsm->hdr.block_id);
+                seaf_block_manager_block_handle_free (block_mgr, handle);
+                fsm->handle = NULL;
+                seaf_block_manager_remove_partial_block (block_mgr,
+                                                         fsm->hdr.block_id);
+                return -1;
+            }
 
             if (seaf_block_manager_close_block (block_mgr, handle) < 0) {
                 seaf_warning ("Failed to close block %s.\n", fsm->hdr.block_id);
@@ -528,14 +1432,20 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
             /* Set this handle to invalid. */
             fsm->handle = NULL;
 
-            /* Notify finish receiving this block. */
+#ifdef SEAFILE_SERVER
+            count_block_tx (FALSE, ntohl (fsm->hdr.block_size));
+#endif
+
+            /* Notify finish receiving this block, with the bytes
+             * received for it. */
             send_block_rsp (fsm->cevent_id,
                             (int)ntohl (fsm->hdr.block_idx),
-                            0, 0);
+                            (int)ntohl (fsm->hdr.block_size), 0,
+                            fsm->hdr.block_id);
 
             /* Prepare for the next packet. */
             fsm->state = RECV_STATE_HEADER;
-            fsm->remain = sizeof(BlockPacket);
+            fsm->remain = block_packet_len(fsm->tdata);
         }
         break;
     }
@@ -545,11 +1455,21 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
 data_error:
     if (fsm->tdata->encrypt_channel)
         EVP_CIPHER_CTX_cleanup (&fsm->ctx);
+    end_inflate (fsm);
     seaf_block_manager_close_block (seaf->block_mgr, fsm->handle);
     seaf_block_manager_block_handle_free (seaf->block_mgr, fsm->handle);
     return -1;
 }
 
+static void
+close_splice_pipe (RecvFSM *fsm)
+{
+    if (fsm->pipe_fds[0] >= 0) {
+        close (fsm->pipe_fds[0]);
+        close (fsm->pipe_fds[1]);
+    }
+}
+
 static int
 recv_blocks (ThreadData *tdata)
 {
@@ -558,9 +1478,14 @@ recv_blocks (ThreadData *tdata)
     int rc;
 
     RecvFSM *fsm = g_new0 (RecvFSM, 1);
-    fsm->remain = sizeof (BlockPacket);
+    fsm->remain = block_packet_len(tdata);
     fsm->cevent_id = tdata->cevent_id;
     fsm->tdata = tdata;
+    fsm->buf = buf_pool_alloc (RECV_BUF_LEN);
+    fsm->out_buf = buf_pool_alloc (RECV_BUF_LEN + ENC_BLOCK_SIZE);
+    fsm->zbuf = buf_pool_alloc (DATA_BUF_LEN);
+    fsm->block_fd = -1;
+    fsm->pipe_fds[0] = fsm->pipe_fds[1] = -1;
 
     while (1) {
         FD_ZERO (&fds);
@@ -590,14 +1515,25 @@ recv_blocks (ThreadData *tdata)
             int n = piperead (tdata->task_pipe[0], buf, sizeof(buf));
             g_assert (n == 0);
             seaf_debug ("Task pipe closed. Worker thread exits now.\n");
+            if (fsm->state == RECV_STATE_HEADER &&
+                fsm->remain == block_packet_len(tdata))
+                tdata->conn_clean = TRUE;
             goto error;
         }
     }
 
+    close_splice_pipe (fsm);
+    buf_pool_free (fsm->buf);
+    buf_pool_free (fsm->out_buf);
+    buf_pool_free (fsm->zbuf);
     g_free (fsm);
     return 0;
 
 error:
+    close_splice_pipe (fsm);
+    buf_pool_free (fsm->buf);
+    buf_pool_free (fsm->out_buf);
+    buf_pool_free (fsm->zbuf);
     g_free (fsm);
     return -1;
 }
@@ -650,10 +1586,9 @@ descruct_bitfield (Bitfield *block_bitmap,
     BitfieldDestruct (active);
 }
 
-static void* do_transfer(void *vtdata)
+static evutil_socket_t
+connect_data_fd (ThreadData *tdata)
 {
-    ThreadData *tdata = vtdata;
-
     struct sockaddr_storage addr;
     struct sockaddr *sa  = (struct sockaddr*) &addr;
     socklen_t sa_len = sizeof (addr);
@@ -663,20 +1598,17 @@ static void* do_transfer(void *vtdata)
 
     if (peer->addr_str == NULL) {
         seaf_warning ("peer address is NULL\n");
-        tdata->thread_ret = -1;
-        goto out;
+        return -1;
     }
 
     if (sock_pton(peer->addr_str, tdata->port, &addr) < 0) {
         seaf_warning ("wrong address format %s\n", peer->addr_str);
-        tdata->thread_ret = -1;
-        goto out;
+        return -1;
     }
 
     if ((data_fd = socket(sa->sa_family, SOCK_STREAM, 0)) < 0) {
         seaf_warning ("socket error: %s\n", strerror(errno));
-        tdata->thread_ret = -1;
-        goto out;
+        return -1;
     }
 
 #ifdef __APPLE__
@@ -689,24 +1621,38 @@ static void* do_transfer(void *vtdata)
     if (connect(data_fd, sa, sa_len) < 0) {
         seaf_warning ("connect error: %s\n", strerror(errno));
         evutil_closesocket (data_fd);
-        tdata->thread_ret = -1;
-        goto out;
+        return -1;
     }
 
     int token_len = strlen(tdata->token) + 1;
     if (sendn (data_fd, tdata->token, token_len) != token_len) {
         seaf_warning ("send connection token error: %s\n", strerror(errno));
         evutil_closesocket (data_fd);
+        return -1;
+    }
+
+    return data_fd;
+}
+
+static void* do_transfer(void *vtdata)
+{
+    ThreadData *tdata = vtdata;
+
+    CcnetPeer *peer = tdata->peer;
+
+    /* data_fd is already set if an idle connection is reused. */
+    if (tdata->data_fd < 0 &&
+        (tdata->data_fd = connect_data_fd (tdata)) < 0) {
         tdata->thread_ret = -1;
         goto out;
     }
 
-    tdata->data_fd = data_fd;
     tdata->processor->state = ESTABLISHED;
 
     tdata->thread_ret = tdata->transfer_func(tdata);
 
-    evutil_closesocket (tdata->data_fd);
+    if (!tdata->conn_clean)
+        evutil_closesocket (tdata->data_fd);
 
 out:
     pipeclose (tdata->task_pipe[0]);
@@ -738,6 +1684,20 @@ get_port (CcnetProcessor *processor, char *content, int clen)
     *p = '\0';
     port_str = content; token = p + 1;
 
+    /* Port 0: the slave agreed to reuse the idle connection we offered. */
+    if (atoi (port_str) == 0) {
+        if (tdata->reuse_fd < 0 || g_strcmp0 (token, tdata->reuse_token) != 0) {
+            seaf_warning ("Bad port and token\n");
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
+        tdata->data_fd = tdata->reuse_fd;
+        seaf_debug ("Reuse idle data connection to %.8s.\n",
+                    processor->peer_id);
+    } else if (tdata->reuse_fd >= 0)
+        evutil_closesocket (tdata->reuse_fd);
+    tdata->reuse_fd = -1;
+
     CcnetPeer *peer = ccnet_get_peer (seaf->ccnetrpc_client, processor->peer_id);
     if (!peer) {
         seaf_warning ("Invalid peer %s.\n", processor->peer_id);
@@ -768,7 +1728,7 @@ get_port (CcnetProcessor *processor, char *content, int clen)
                                     tdata);
 }
 
-static void
+static int
 send_block_list (CcnetProcessor *processor)
 {
 #ifdef SENDBLOCK_PROC
@@ -776,13 +1736,21 @@ send_block_list (CcnetProcessor *processor)
 #else
     SeafileGetblockV2Proc *proc = (SeafileGetblockV2Proc *)processor;
 #endif
+    USE_PRIV;
     BlockList *bl = proc->tx_task->block_list;
     int i, n = 0;
     char buf[MAX_BL_LEN * 41];
     int len = 0;
+    int n_ids;
 
-    for (i = 0; i < bl->n_blocks; ++i) {
-        memcpy (&buf[len], g_ptr_array_index(bl->block_ids, i), 41);
+    /* Only the blocks left by the have filter, if there is one. */
+    n_ids = priv->queried ? priv->queried->len : bl->n_blocks;
+
+    for (i = 0; i < n_ids; ++i) {
+        block_list_get_id (bl,
+                           priv->queried ?
+                           g_array_index (priv->queried, int, i) : i,
+                           &buf[len]);
         len += 41;
 
         if (++n == MAX_BL_LEN) {
@@ -796,6 +1764,65 @@ send_block_list (CcnetProcessor *processor)
     if (n != 0)
         ccnet_processor_send_update (processor, SC_BLOCKLIST, SS_BLOCKLIST,
                                      (char *)buf, len);
+
+    return n_ids;
+}
+
+/* Accept the options the slave offered. */
+static void
+send_get_port (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    GString *opts = g_string_new (NULL);
+
+    if (priv->reuse_offered)
+        priv->tdata->reuse_fd = take_idle_conn (processor->peer_id, NULL,
+                                                &priv->tdata->reuse_token);
+
+    if (priv->tdata->resume)
+        g_string_append (opts, RESUME_TOKEN);
+    if (priv->tdata->gcm)
+        g_string_append_printf (opts, "%s%s",
+                                opts->len > 0 ? " " : "", GCM_TOKEN);
+    if (priv->tdata->compress)
+        g_string_append_printf (opts, "%s%s",
+                                opts->len > 0 ? " " : "", COMPRESS_TOKEN);
+    if (priv->tdata->reuse_fd >= 0)
+        g_string_append_printf (opts, "%s%s%s",
+                                opts->len > 0 ? " " : "", REUSE_PREFIX,
+                                priv->tdata->reuse_token);
+
+    if (opts->len > 0)
+        ccnet_processor_send_update (processor, SC_GET_PORT, SS_GET_PORT,
+                                     opts->str, opts->len + 1);
+    else
+        ccnet_processor_send_update (processor, SC_GET_PORT, SS_GET_PORT,
+                                     NULL, 0);
+    g_string_free (opts, TRUE);
+}
+
+/* Called when the slave told about all the blocks listed. */
+static void
+block_bitmap_done (CcnetProcessor *processor)
+{
+#ifdef SENDBLOCK_PROC
+    SeafileSendblockV2Proc *proc = (SeafileSendblockV2Proc *)processor;
+    USE_PRIV;
+    guint i;
+
+    if (priv->queried) {
+        for (i = 0; i < priv->queried->len; ++i)
+            if (BitfieldHas (&priv->query_bitmap, i))
+                BitfieldAdd (&proc->block_bitmap,
+                             g_array_index (priv->queried, int, i));
+    }
+
+    /* Update global uploaded bitmap. */
+    BitfieldOr (&proc->tx_task->uploaded, &proc->block_bitmap);
+    proc->tx_task->n_uploaded = BitfieldCountTrueBits (&proc->tx_task->uploaded);
+#endif
+    send_get_port (processor);
+    processor->state = GET_PORT;
 }
 
 static int
@@ -807,35 +1834,192 @@ process_block_bitmap (CcnetProcessor *processor, char *content, int clen)
     SeafileGetblockV2Proc *proc = (SeafileGetblockV2Proc *)processor;
 #endif
     USE_PRIV;
+    Bitfield *bitmap;
+
+    bitmap = priv->queried ? &priv->query_bitmap : &proc->block_bitmap;
 
-    if (proc->block_bitmap.byteCount < priv->bm_offset + clen) {
+    if (bitmap->byteCount < priv->bm_offset + clen) {
         seaf_warning ("Received block bitmap is too large.\n");
         ccnet_processor_done (processor, FALSE);
         return -1;
     }
-    memcpy (proc->block_bitmap.bits + priv->bm_offset, content, clen);
+    memcpy (bitmap->bits + priv->bm_offset, content, clen);
 
     priv->bm_offset += clen;
-    if (priv->bm_offset == proc->block_bitmap.byteCount) {
+    if (priv->bm_offset == bitmap->byteCount)
+        block_bitmap_done (processor);
+
+    return 0;
+}
+
+/*
+ * Compression costs CPU for little on fast links, it can be turned off
+ * by setting this to 0.
+ */
+#define KEY_COMPRESS_BLOCKS "compress_blocks"
+
+/* Called with the "200 OK" of the slave, which may offer options. */
+static void
+check_options_offer (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+    gboolean exists;
+    int compress;
+
+    priv->tdata->resume = has_option (content, clen, RESUME_TOKEN);
+    priv->tdata->gcm = has_option (content, clen, GCM_TOKEN);
+
+    compress = seafile_session_config_get_int (seaf, KEY_COMPRESS_BLOCKS,
+                                               &exists);
+    if (!exists || compress != 0)
+        priv->tdata->compress = has_option (content, clen, COMPRESS_TOKEN);
+
+    priv->filter_offered = has_option (content, clen, FILTER_TOKEN);
+
+    priv->reuse_offered = has_option (content, clen, REUSE_TOKEN);
+}
+
 #ifdef SENDBLOCK_PROC
-        /* Update global uploaded bitmap. */
-        BitfieldOr (&proc->tx_task->uploaded, &proc->block_bitmap);
-        proc->tx_task->n_uploaded = BitfieldCountTrueBits (&proc->tx_task->uploaded);
-#endif
-        ccnet_processor_send_update (processor, SC_GET_PORT, SS_GET_PORT,
-                                     NULL, 0);
-        processor->state = GET_PORT;
+/* Lines of "<block index> <bytes the slave has>". */
+static void
+process_partial_blocks (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+    char **lines, **ptr;
+    int block_idx;
+    unsigned int offset;
+
+    if (clen == 0 || content[clen-1] != '\0') {
+        seaf_warning ("Bad partial block list.\n");
+        ccnet_processor_done (processor, FALSE);
+        return;
     }
 
+    if (!priv->partials)
+        priv->partials = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    lines = g_strsplit (content, "\n", -1);
+    for (ptr = lines; *ptr != NULL; ++ptr) {
+        if (sscanf (*ptr, "%d %u", &block_idx, &offset) != 2 ||
+            block_idx < 0 || offset == 0)
+            continue;
+        /* Indexes are in the list sent, which may be filtered. */
+        if (priv->queried) {
+            if ((guint)block_idx >= priv->queried->len)
+                continue;
+            block_idx = g_array_index (priv->queried, int, block_idx);
+        }
+        g_hash_table_insert (priv->partials,
+                             GINT_TO_POINTER(block_idx),
+                             GUINT_TO_POINTER(offset));
+    }
+    g_strfreev (lines);
+}
+
+/* Shorter block lists are sent as they are. */
+#define HAVE_FILTER_MIN_BLOCKS (4 * MAX_BL_LEN)
+#define MAX_HAVE_FILTER_LEN (16 << 20)
+
+/* Returns TRUE if the have filter was asked for. */
+static gboolean
+request_have_filter (CcnetProcessor *processor)
+{
+    SeafileSendblockV2Proc *proc = (SeafileSendblockV2Proc *)processor;
+    USE_PRIV;
+    int n_blocks = proc->tx_task->block_list->n_blocks;
+    char buf[32];
+    int len;
+
+    if (!priv->filter_offered || n_blocks < HAVE_FILTER_MIN_BLOCKS)
+        return FALSE;
+
+    len = snprintf (buf, sizeof(buf), "%d", n_blocks);
+    ccnet_processor_send_update (processor, SC_GET_FILTER, SS_GET_FILTER,
+                                 buf, len + 1);
+    priv->filter_buf = g_byte_array_new ();
+
+    return TRUE;
+}
+
+static int
+process_have_filter (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+
+    if (priv->filter_buf->len + clen > MAX_HAVE_FILTER_LEN) {
+        seaf_warning ("Received have filter is too large.\n");
+        ccnet_processor_done (processor, FALSE);
+        return -1;
+    }
+    g_byte_array_append (priv->filter_buf, (guint8 *)content, clen);
+
     return 0;
 }
 
+/*
+ * Called with "310 HAVE FILTER END". Only the blocks the filter may have
+ * are listed, the others stay unset in the block bitmap. Without a
+ * usable filter the whole list is sent.
+ */
+static void
+filter_block_list (CcnetProcessor *processor, char *content, int clen)
+{
+    SeafileSendblockV2Proc *proc = (SeafileSendblockV2Proc *)processor;
+    USE_PRIV;
+    BlockList *bl = proc->tx_task->block_list;
+    ExistsFilter *filter = NULL;
+    guint64 n_bits = 0;
+    guint32 *bits;
+    char block_id[41];
+    guint64 i;
+
+    if (clen > 0 && content[clen-1] == '\0')
+        n_bits = g_ascii_strtoull (content, NULL, 10);
+    if (n_bits == 0)
+        goto out;
+
+    if (n_bits != (guint64)priv->filter_buf->len * 8) {
+        seaf_warning ("Bad have filter length.\n");
+        goto out;
+    }
+
+    bits = (guint32 *)priv->filter_buf->data;
+    for (i = 0; i < n_bits / 32; ++i)
+        bits[i] = GUINT32_FROM_LE (bits[i]);
+
+    filter = exists_filter_new_from_bits (bits, n_bits);
+    if (!filter) {
+        seaf_warning ("Bad have filter.\n");
+        goto out;
+    }
+
+    priv->queried = g_array_new (FALSE, FALSE, sizeof(int));
+    for (i = 0; i < bl->n_blocks; ++i) {
+        block_list_get_id (bl, i, block_id);
+        if (exists_filter_test (filter, block_id)) {
+            int idx = (int)i;
+            g_array_append_val (priv->queried, idx);
+        }
+    }
+    BitfieldConstruct (&priv->query_bitmap, priv->queried->len);
+
+    seaf_debug ("Have filter leaves %u of %u blocks to check.\n",
+                priv->queried->len, bl->n_blocks);
+
+out:
+    exists_filter_free (filter);
+    g_byte_array_free (priv->filter_buf, TRUE);
+    priv->filter_buf = NULL;
+}
+#endif
+
 #endif  /* defined SENDBLOCK_PROC || GETBLOCK_PROC */
 
 #if defined RECVBLOCK_PROC || defined PUTBLOCK_PROC
 
 static int
-verify_session_token (CcnetProcessor *processor, int argc, char **argv)
+verify_session_token (CcnetProcessor *processor, int argc, char **argv,
+                      char *ret_repo_id)
 {
     if (argc != 1) {
         return -1;
@@ -844,7 +2028,7 @@ verify_session_token (CcnetProcessor *processor, int argc, char **argv)
     char *session_token = argv[0];
     if (seaf_token_manager_verify_token (seaf->token_mgr,
                                          processor->peer_id,
-                                         session_token, NULL) < 0) {
+                                         session_token, ret_repo_id) < 0) {
         return -1;
     }
 
@@ -859,7 +2043,8 @@ static void* do_passive_transfer(void *vtdata)
     tdata->thread_ret = tdata->transfer_func (tdata);
     
     pipeclose (tdata->task_pipe[0]);
-    evutil_closesocket (tdata->data_fd);
+    if (!tdata->conn_clean)
+        evutil_closesocket (tdata->data_fd);
     
     return vtdata;
 }
@@ -911,32 +2096,120 @@ static void
 send_port (CcnetProcessor *processor)
 {
     USE_PRIV;
+    ThreadData *tdata = priv->tdata;
     char buf[256];
     char *token = NULL;
+    evutil_socket_t fd = -1;
     int len;
 
+    if (tdata->reuse_token)
+        fd = take_idle_conn (processor->peer_id, tdata->reuse_token, NULL);
+    if (fd >= 0) {
+        tdata->token = g_strdup (tdata->reuse_token);
+        len = snprintf (buf, sizeof(buf), "0\t%s", tdata->token);
+        ccnet_processor_send_response (processor,
+                                       SC_SEND_PORT, SS_SEND_PORT,
+                                       buf, len+1);
+        accept_connection (fd, tdata);
+        return;
+    }
+
     token = seaf_listen_manager_generate_token (seaf->listen_mgr);
     if (seaf_listen_manager_register_token (seaf->listen_mgr, token,
                         (ConnAcceptedCB)accept_connection,
-                        priv->tdata, 10) < 0) {
+                        tdata, 10) < 0) {
         seaf_warning ("failed to register token\n");
         g_free (token);
         ccnet_processor_done (processor, FALSE);
+        return;
     }
+    /* Idle connections are found by the token later. */
+    tdata->token = token;
 
     len = snprintf (buf, sizeof(buf), "%d\t%s", seaf->listen_mgr->port, token);
     ccnet_processor_send_response (processor,
                                    SC_SEND_PORT, SS_SEND_PORT,
                                    buf, len+1);
+}
+
+
+#ifdef RECVBLOCK_PROC
+/*
+ * Note the partial blocks among the ones we don't have. They're sent
+ * to the master if it accepts to resume.
+ */
+static void
+list_partial_blocks (CcnetProcessor *processor, const char **block_ids,
+                     gboolean *exists, int n_blocks)
+{
+    USE_PRIV;
+    guint32 size;
+    int i;
+
+    for (i = 0; i < n_blocks; ++i) {
+        if (exists[i])
+            continue;
+
+        size = seaf_block_manager_partial_block_size (seaf->block_mgr,
+                                                      block_ids[i]);
+        if (size == 0)
+            continue;
 
-    g_free (token);
+        if (!priv->partial_buf)
+            priv->partial_buf = g_string_new (NULL);
+        g_string_append_printf (priv->partial_buf, "%d %u\n",
+                                priv->n_listed + i, size);
+        if (priv->partial_buf->len >= MAX_PARTIAL_LEN) {
+            priv->partial_lists = g_list_append (
+                priv->partial_lists, g_string_free (priv->partial_buf, FALSE));
+            priv->partial_buf = NULL;
+        }
+    }
 }
+#endif
 
+/* Called with "302 GET PORT", the master may accept some options. */
+static void
+accept_options (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+#ifdef RECVBLOCK_PROC
+    GList *ptr;
+    char *list;
+#endif
+
+    priv->tdata->gcm = has_option (content, clen, GCM_TOKEN);
+    priv->tdata->compress = has_option (content, clen, COMPRESS_TOKEN);
+    priv->tdata->reuse_token = get_option_value (content, clen, REUSE_PREFIX);
+    if (!has_option (content, clen, RESUME_TOKEN))
+        return;
+
+    priv->tdata->resume = TRUE;
+
+#ifdef RECVBLOCK_PROC
+    if (priv->partial_buf) {
+        priv->partial_lists = g_list_append (
+            priv->partial_lists, g_string_free (priv->partial_buf, FALSE));
+        priv->partial_buf = NULL;
+    }
+
+    for (ptr = priv->partial_lists; ptr; ptr = ptr->next) {
+        list = ptr->data;
+        ccnet_processor_send_response (processor, SC_PARTIAL, SS_PARTIAL,
+                                       list, strlen(list) + 1);
+    }
+    string_list_free (priv->partial_lists);
+    priv->partial_lists = NULL;
+#endif
+}
 
 static void
 process_block_list (CcnetProcessor *processor, char *content, int clen)
 {
+    USE_PRIV;
     char *block_id;
+    const char **block_ids;
+    gboolean *exists;
     int n_blocks;
     Bitfield bitmap;
     int i;
@@ -951,14 +2224,30 @@ process_block_list (CcnetProcessor *processor, char *content, int clen)
     n_blocks = clen/41;
     BitfieldConstruct (&bitmap, n_blocks);
 
+    block_ids = g_new (const char *, n_blocks);
+    exists = g_new (gboolean, n_blocks);
+
     block_id = content;
     for (i = 0; i < n_blocks; ++i) {
         block_id[40] = '\0';
-        if (seaf_block_manager_block_exists(seaf->block_mgr, block_id))
-            BitfieldAdd (&bitmap, i);
+        block_ids[i] = block_id;
         block_id += 41;
     }
 
+    seaf_block_manager_blocks_exist (seaf->block_mgr, block_ids, n_blocks, exists);
+    for (i = 0; i < n_blocks; ++i) {
+        if (exists[i])
+            BitfieldAdd (&bitmap, i);
+    }
+
+#ifdef RECVBLOCK_PROC
+    list_partial_blocks (processor, block_ids, exists, n_blocks);
+#endif
+    priv->n_listed += n_blocks;
+
+    g_free (block_ids);
+    g_free (exists);
+
     ccnet_processor_send_response (processor, SC_BBITMAP, SS_BBITMAP,
                                    (char *)(bitmap.bits), bitmap.byteCount);
     BitfieldDestruct (&bitmap);
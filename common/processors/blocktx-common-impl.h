@@ -741,7 +741,7 @@ send_block_list (CcnetProcessor *processor)
     int len = 0;
 
     for (i = 0; i < bl->n_blocks; ++i) {
-        memcpy (&buf[len], g_ptr_array_index(bl->block_ids, i), 41);
+        block_list_get_id (bl, i, &buf[len]);
         len += 41;
 
         if (++n == MAX_BL_LEN) {
@@ -38,10 +38,41 @@
 /* max fs object segment size */
 #define MAX_OBJ_SEG_SIZE 64000
 
+/*
+ * fs pack transfer. putfs offers it by sending PACK_TOKEN with its OK.
+ * getfs then sends "<root> <base root>" lines ("-" for no base) with
+ * SC_PACK_ROOTS and starts the pack with SC_PACK_START. The pack is a
+ * stream of PackedObject frames, cut into SC_PACK responses of up to
+ * MAX_OBJ_SEG_SIZE bytes and ended by SC_PACK_END. getfs acks the
+ * number of segments it has processed with SC_PACK_ACK.
+ */
+#define PACK_TOKEN      "pack"
+
+#define SC_PACK_ROOTS   "308"
+#define SS_PACK_ROOTS   "Pack Roots"
+#define SC_PACK_START   "309"
+#define SS_PACK_START   "Pack Start"
+#define SC_PACK         "310"
+#define SS_PACK         "Pack"
+#define SC_PACK_ACK     "311"
+#define SS_PACK_ACK     "Pack Ack"
+#define SC_PACK_END     "312"
+#define SS_PACK_END     "Pack End"
+
+/* Max number of pack segments sent and not acked. */
+#define PACK_WINDOW 64
+#define PACK_ACK_INTERVAL 16
+
 
 typedef struct {
     char    id[41];
     uint8_t object[0];
 } __attribute__((__packed__)) ObjectPack;
 
+typedef struct {
+    uint32_t len;               /* of object, network order */
+    char     id[41];
+    uint8_t  object[0];
+} __attribute__((__packed__)) PackedObject;
+
 #endif
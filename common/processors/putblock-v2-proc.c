@@ -17,6 +17,7 @@
 #include "seafile-session.h"
 #include "fs-mgr.h"
 #include "block-mgr.h"
+#include "seaf-probes.h"
 #include "putblock-v2-proc.h"
 
 enum {
@@ -64,6 +65,8 @@ seafile_putblock_v2_proc_init (SeafilePutblockV2Proc *processor)
 static int
 block_proc_start (CcnetProcessor *processor, int argc, char **argv)
 {
+    SEAF_PROBE_PROC_START (processor);
+
     if (verify_session_token (processor, argc, argv) < 0) {
         ccnet_processor_send_response (processor, 
                                        SC_ACCESS_DENIED, SS_ACCESS_DENIED,
@@ -73,7 +76,8 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
     }
     
     prepare_thread_data(processor, send_blocks, put_block_cb);
-    ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
+    ccnet_processor_send_response (processor, "200", "OK",
+                                   SLAVE_OPTIONS, sizeof(SLAVE_OPTIONS));
 
     return 0;
 }
@@ -81,15 +85,24 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
 static void
 release_resource (CcnetProcessor *processor)
 {
+    USE_PRIV;
+
+    /* The master only reuses the connection if it was clean too. */
+    if (priv->tdata)
+        priv->tdata->keep_conn = (processor->state == ESTABLISHED);
     release_thread (processor);
 
+    SEAF_PROBE_PROC_DONE (processor);
+
     CCNET_PROCESSOR_CLASS(seafile_putblock_v2_proc_parent_class)->release_resource (processor);
 }
 
+/* "<block index> <block id>", then " <offset>" if resuming. */
 static void
 process_get_block (CcnetProcessor *processor, char *content, int clen)
 {
     char *space, *block_id;
+    uint32_t offset = 0;
     USE_PRIV;
 
     if (content[clen-1] != '\0') {
@@ -109,9 +122,23 @@ process_get_block (CcnetProcessor *processor, char *content, int clen)
     *space = '\0';
     block_id = space + 1;
 
+    space = strchr (block_id, ' ');
+    if (space) {
+        *space = '\0';
+        offset = (uint32_t) strtoul (space + 1, NULL, 10);
+    }
+
+    if (strlen (block_id) != 40) {
+        ccnet_processor_send_response (processor, SC_BAD_BLK_REQ, SS_BAD_BLK_REQ,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
     BlockRequest req;
     req.block_idx = atoi(content);
     memcpy (req.block_id, block_id, 41);
+    req.offset = offset;
     if (pipewriten (priv->tdata->task_pipe[1], &req, sizeof(BlockRequest)) < 0) {
         g_warning ("[put block] failed to write task pipe.\n");
         ccnet_processor_done (processor, FALSE);
@@ -128,6 +155,7 @@ static void handle_update (CcnetProcessor *processor,
             process_block_list (processor, content, clen);
             return;
         } else if (memcmp (code, SC_GET_PORT, 3) == 0) {
+            accept_options (processor, content, clen);
             send_port (processor);
             return;
         }
@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "rate-limiter.h"
+
+struct RateLimiter {
+    pthread_mutex_t lock;
+    gint64          rate;
+    /* May go negative: the debt is paid by sleeping. */
+    gint64          tokens;
+    gint64          last_refill;
+};
+
+static gint64
+now_usec ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+RateLimiter *
+rate_limiter_new (gint64 rate)
+{
+    RateLimiter *limiter;
+
+    if (rate <= 0)
+        return NULL;
+
+    limiter = g_new0 (RateLimiter, 1);
+    pthread_mutex_init (&limiter->lock, NULL);
+    limiter->rate = rate;
+    limiter->tokens = rate;
+    limiter->last_refill = now_usec ();
+
+    return limiter;
+}
+
+void
+rate_limiter_free (RateLimiter *limiter)
+{
+    if (!limiter)
+        return;
+
+    pthread_mutex_destroy (&limiter->lock);
+    g_free (limiter);
+}
+
+void
+rate_limiter_acquire (RateLimiter *limiter, gint64 n)
+{
+    gint64 now, elapsed, added, wait = 0;
+
+    if (!limiter || n <= 0)
+        return;
+
+    pthread_mutex_lock (&limiter->lock);
+
+    now = now_usec ();
+    elapsed = now - limiter->last_refill;
+    added = MIN (elapsed, G_USEC_PER_SEC) * limiter->rate / G_USEC_PER_SEC;
+    if (limiter->tokens + added >= limiter->rate) {
+        limiter->tokens = limiter->rate;
+        limiter->last_refill = now;
+    } else if (added > 0) {
+        limiter->tokens += added;
+        /* Only count the time the added tokens stand for. */
+        limiter->last_refill += added * G_USEC_PER_SEC / limiter->rate;
+    }
+
+    limiter->tokens -= n;
+    if (limiter->tokens < 0)
+        wait = -limiter->tokens * G_USEC_PER_SEC / limiter->rate;
+
+    pthread_mutex_unlock (&limiter->lock);
+
+    if (wait > 0)
+        g_usleep (wait);
+}
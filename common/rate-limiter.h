@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <glib.h>
+
+/*
+ * Token bucket limiting a rate of operations or bytes per second.
+ * Up to one second worth of units can be used in a burst. It can be
+ * shared by several threads.
+ */
+
+typedef struct RateLimiter RateLimiter;
+
+/* Returns NULL if @rate <= 0, meaning unlimited. */
+RateLimiter *
+rate_limiter_new (gint64 rate);
+
+void
+rate_limiter_free (RateLimiter *limiter);
+
+/*
+ * Take @n units, sleeping until they are available. Does nothing if
+ * @limiter is NULL.
+ */
+void
+rate_limiter_acquire (RateLimiter *limiter, gint64 n);
+
+#endif
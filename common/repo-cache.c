@@ -0,0 +1,122 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "branch-mgr.h"
+#include "repo-cache.h"
+
+#define MAX_CACHED_REPOS    10000
+
+typedef struct {
+    void       *repo;
+    SeafRepoRefFunc unref;
+    char       *branch_name;
+    char        commit_id[41];
+} CachedRepo;
+
+struct _SeafRepoCache {
+    SeafRepoRefFunc ref;
+    SeafRepoRefFunc unref;
+
+    /* repo_id -> CachedRepo */
+    GHashTable     *repos;
+    pthread_mutex_t lock;
+};
+
+static void
+cached_repo_free (CachedRepo *cr)
+{
+    cr->unref (cr->repo);
+    g_free (cr->branch_name);
+    g_free (cr);
+}
+
+SeafRepoCache *
+seaf_repo_cache_new (SeafRepoRefFunc ref, SeafRepoRefFunc unref)
+{
+    SeafRepoCache *cache = g_new0 (SeafRepoCache, 1);
+
+    cache->ref = ref;
+    cache->unref = unref;
+    cache->repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify)cached_repo_free);
+    pthread_mutex_init (&cache->lock, NULL);
+
+    return cache;
+}
+
+void *
+seaf_repo_cache_lookup (SeafRepoCache *cache, const char *repo_id)
+{
+    CachedRepo *cr;
+    void *repo;
+    char *branch_name;
+    char commit_id[41];
+    SeafBranch *branch;
+
+    pthread_mutex_lock (&cache->lock);
+    cr = g_hash_table_lookup (cache->repos, repo_id);
+    if (!cr) {
+        pthread_mutex_unlock (&cache->lock);
+        return NULL;
+    }
+    repo = cr->repo;
+    cache->ref (repo);
+    branch_name = g_strdup (cr->branch_name);
+    memcpy (commit_id, cr->commit_id, 41);
+    pthread_mutex_unlock (&cache->lock);
+
+    /* The head may have been updated, or the repo deleted. */
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             repo_id, branch_name);
+    g_free (branch_name);
+    if (branch && strcmp (branch->commit_id, commit_id) == 0) {
+        seaf_branch_unref (branch);
+        return repo;
+    }
+    if (branch)
+        seaf_branch_unref (branch);
+
+    pthread_mutex_lock (&cache->lock);
+    cr = g_hash_table_lookup (cache->repos, repo_id);
+    if (cr && cr->repo == repo)
+        g_hash_table_remove (cache->repos, repo_id);
+    pthread_mutex_unlock (&cache->lock);
+
+    cache->unref (repo);
+    return NULL;
+}
+
+void
+seaf_repo_cache_insert (SeafRepoCache *cache,
+                        const char *repo_id,
+                        const char *branch_name,
+                        const char *commit_id,
+                        void *repo)
+{
+    CachedRepo *cr = g_new0 (CachedRepo, 1);
+
+    cache->ref (repo);
+    cr->repo = repo;
+    cr->unref = cache->unref;
+    cr->branch_name = g_strdup (branch_name);
+    memcpy (cr->commit_id, commit_id, 41);
+
+    pthread_mutex_lock (&cache->lock);
+    if (g_hash_table_size (cache->repos) >= MAX_CACHED_REPOS)
+        g_hash_table_remove_all (cache->repos);
+    g_hash_table_replace (cache->repos, g_strdup (repo_id), cr);
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+seaf_repo_cache_remove (SeafRepoCache *cache, const char *repo_id)
+{
+    pthread_mutex_lock (&cache->lock);
+    g_hash_table_remove (cache->repos, repo_id);
+    pthread_mutex_unlock (&cache->lock);
+}
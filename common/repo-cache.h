@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_REPO_CACHE_H
+#define SEAF_REPO_CACHE_H
+
+#include <glib.h>
+
+/**
+ * Cache of loaded repo objects for the server side repo managers.
+ *
+ * A repo object only depends on its head branch, so every lookup checks
+ * the cached head against the branch manager, whose own cache is
+ * invalidated by branch updates. A hit costs no DB query in seaf-server,
+ * and at most the branch query elsewhere.
+ *
+ * The cached objects are shared by all threads, callers must not modify
+ * them. Thread safe.
+ */
+
+typedef struct _SeafRepoCache SeafRepoCache;
+
+typedef void (*SeafRepoRefFunc) (void *repo);
+
+SeafRepoCache *
+seaf_repo_cache_new (SeafRepoRefFunc ref, SeafRepoRefFunc unref);
+
+/* Returns a new reference of the cached repo, or NULL. */
+void *
+seaf_repo_cache_lookup (SeafRepoCache *cache, const char *repo_id);
+
+/* @repo is referenced by the cache, its head is @branch_name/@commit_id. */
+void
+seaf_repo_cache_insert (SeafRepoCache *cache,
+                        const char *repo_id,
+                        const char *branch_name,
+                        const char *commit_id,
+                        void *repo);
+
+void
+seaf_repo_cache_remove (SeafRepoCache *cache, const char *repo_id);
+
+#endif
@@ -9,6 +9,14 @@
 struct SeafRiakClient;
 typedef struct SeafRiakClient SeafRiakClient;
 
+/* One key of a batch request. */
+typedef struct SeafRiakBatchItem {
+    const char *key;
+    void       *value;          /* set by get, read by put */
+    int        size;
+    gboolean   success;
+} SeafRiakBatchItem;
+
 SeafRiakClient *
 seaf_riak_client_new (const char *host, const char *port);
 
@@ -41,4 +49,53 @@ seaf_riak_client_delete (SeafRiakClient *client,
                          const char *key,
                          int n_w);
 
+/*
+ * The batch functions run up to @max_parallel requests at a time, each
+ * on its own keep-alive connection. The connections are kept open for
+ * the next batch. They set @success (and @value, @size for get) of every
+ * item.
+ */
+void
+seaf_riak_client_get_batch (SeafRiakClient *client,
+                            const char *bucket,
+                            SeafRiakBatchItem *items,
+                            int n_items,
+                            int max_parallel);
+
+void
+seaf_riak_client_put_batch (SeafRiakClient *client,
+                            const char *bucket,
+                            SeafRiakBatchItem *items,
+                            int n_items,
+                            int n_w,
+                            int max_parallel);
+
+void
+seaf_riak_client_query_batch (SeafRiakClient *client,
+                              const char *bucket,
+                              SeafRiakBatchItem *items,
+                              int n_items,
+                              int max_parallel);
+
+typedef gboolean (*SeafRiakKeyFunc) (const char *key, void *data);
+
+/*
+ * Call @func for every key in @bucket, until it returns FALSE.
+ *
+ * With @use_2i, the keys are listed by $key index queries on 16 ranges
+ * of the first hex digit, up to @max_parallel at a time. This needs a
+ * Riak backend with secondary indexes, e.g. leveldb, and keys in lower
+ * case hex. Otherwise they are streamed by one bucket key listing, which
+ * works on any backend but folds over every key of the cluster.
+ *
+ * Keys may be listed more than once. Returns -1 if a request failed.
+ */
+int
+seaf_riak_client_list_keys (SeafRiakClient *client,
+                            const char *bucket,
+                            gboolean use_2i,
+                            int max_parallel,
+                            SeafRiakKeyFunc func,
+                            void *data);
+
 #endif
@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <curl/curl.h>
 #include <glib.h>
 
@@ -19,6 +20,11 @@ struct SeafRiakClient {
     CURL *curl;
     char *host;
     char *port;
+
+    /* For batches. Connections stay in the multi handle's cache. */
+    CURLM *multi;
+    CURL **handles;
+    int n_handles;
 };
 
 typedef struct RiakObject {
@@ -41,6 +47,13 @@ seaf_riak_client_new (const char *host, const char *port)
 void
 seaf_riak_client_free (SeafRiakClient *client)
 {
+    int i;
+
+    for (i = 0; i < client->n_handles; ++i)
+        curl_easy_cleanup (client->handles[i]);
+    g_free (client->handles);
+    if (client->multi)
+        curl_multi_cleanup (client->multi);
     curl_easy_cleanup (client->curl);
     g_free (client->host);
     g_free (client->port);
@@ -66,6 +79,33 @@ recv_object (void *contents, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
+static void
+setup_common (CURL *curl, GString *url)
+{
+    curl_easy_setopt (curl, CURLOPT_URL, url->str);
+    curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
+#ifdef CURLOPT_TCP_KEEPALIVE
+    curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+#ifdef RIAK_TEST
+    curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
+#endif
+}
+
+static void
+setup_get (SeafRiakClient *client, CURL *curl,
+           const char *bucket, const char *key,
+           GString *url, RiakObject *object)
+{
+    g_string_printf (url, "http://%s:%s/riak/%s/%s?r=1",
+                     client->host, client->port, bucket, key);
+    setup_common (curl, url);
+
+    /* Setup callback for receiving http message body. */
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_object);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, object);
+}
+
 int
 seaf_riak_client_get (SeafRiakClient *client,
                       const char *bucket,
@@ -78,17 +118,7 @@ seaf_riak_client_get (SeafRiakClient *client,
     RiakObject *object = g_new0 (RiakObject, 1);
     int rc, ret = 0;
 
-    g_string_append_printf (url, "http://%s:%s/riak/%s/%s?r=1",
-                            client->host, client->port, bucket, key);
-    curl_easy_setopt (curl, CURLOPT_URL, url->str);
-
-    /* Setup callback for receiving http message body. */
-    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_object);
-    curl_easy_setopt (curl, CURLOPT_WRITEDATA, object);
-    curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
-#ifdef RIAK_TEST
-    curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
-#endif
+    setup_get (client, curl, bucket, key, url, object);
 
     rc = curl_easy_perform (curl);
     if (rc != 0) {
@@ -126,22 +156,16 @@ send_object (void *ptr, size_t size, size_t nmemb, void *userp)
     return copy_size;
 }
 
-int
-seaf_riak_client_put (SeafRiakClient *client,
-                      const char *bucket,
-                      const char *key,
-                      void *value,
-                      int size,
-                      int n_w)
+/* Returns the headers, to be freed after the request. */
+static struct curl_slist *
+setup_put (SeafRiakClient *client, CURL *curl,
+           const char *bucket, const char *key, int n_w,
+           GString *url, RiakObject *object)
 {
-    CURL *curl = client->curl;
-    GString *url = g_string_new (NULL);
-    RiakObject *object = g_new0 (RiakObject, 1);
-    int rc, ret = 0;
     struct curl_slist *headers = NULL;
 
-    g_string_append_printf (url, "http://%s:%s/riak/%s/%s",
-                            client->host, client->port, bucket, key);
+    g_string_printf (url, "http://%s:%s/riak/%s/%s",
+                     client->host, client->port, bucket, key);
     switch (n_w) {
     case RIAK_QUORUM:
         g_string_append (url, "?w=quorum&dw=quorum");
@@ -153,22 +177,38 @@ seaf_riak_client_put (SeafRiakClient *client,
         g_string_append_printf (url, "?w=%d&dw=%d", n_w, n_w);
     }
 
-    curl_easy_setopt (curl, CURLOPT_URL, url->str);
+    setup_common (curl, url);
     /* Ask libcurl to send a PUT request. */
     curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
-    curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
-#ifdef RIAK_TEST
-    curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
-#endif
+    curl_easy_setopt (curl, CURLOPT_INFILESIZE, (long)object->size);
 
     headers = curl_slist_append (headers, "Content-type: application/binary");
     curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
 
-    object->data = value;
-    object->size = (size_t)size;
     curl_easy_setopt (curl, CURLOPT_READFUNCTION, send_object);
     curl_easy_setopt (curl, CURLOPT_READDATA, object);
 
+    return headers;
+}
+
+int
+seaf_riak_client_put (SeafRiakClient *client,
+                      const char *bucket,
+                      const char *key,
+                      void *value,
+                      int size,
+                      int n_w)
+{
+    CURL *curl = client->curl;
+    GString *url = g_string_new (NULL);
+    RiakObject *object = g_new0 (RiakObject, 1);
+    int rc, ret = 0;
+    struct curl_slist *headers;
+
+    object->data = value;
+    object->size = (size_t)size;
+    headers = setup_put (client, curl, bucket, key, n_w, url, object);
+
     rc = curl_easy_perform (curl);
     if (rc != 0) {
         seaf_warning ("[riak http] Failed to put object [%s:%s]: %s.\n",
@@ -184,6 +224,18 @@ seaf_riak_client_put (SeafRiakClient *client,
     return ret;
 }
 
+static void
+setup_query (SeafRiakClient *client, CURL *curl,
+             const char *bucket, const char *key, GString *url)
+{
+    g_string_printf (url, "http://%s:%s/riak/%s/%s?r=1",
+                     client->host, client->port, bucket, key);
+    setup_common (curl, url);
+
+    /* Ask libcurl to send a HEAD request. */
+    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+}
+
 gboolean
 seaf_riak_client_query (SeafRiakClient *client,
                         const char *bucket,
@@ -194,16 +246,7 @@ seaf_riak_client_query (SeafRiakClient *client,
     int rc;
     gboolean ret;
 
-    g_string_append_printf (url, "http://%s:%s/riak/%s/%s?r=1",
-                            client->host, client->port, bucket, key);
-    curl_easy_setopt (curl, CURLOPT_URL, url->str);
-    curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
-#ifdef RIAK_TEST
-    curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
-#endif
-
-    /* Ask libcurl to send a HEAD request. */
-    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+    setup_query (client, curl, bucket, key, url);
 
     rc = curl_easy_perform (curl);
     if (rc != 0)
@@ -241,13 +284,9 @@ seaf_riak_client_delete (SeafRiakClient *client,
         g_string_append_printf (url, "?rw=%d&dw=%d", n_w, n_w);
     }
 
-    curl_easy_setopt (curl, CURLOPT_URL, url->str);
+    setup_common (curl, url);
     /* Ask libcurl to send a DELETE request. */
     curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
-#ifdef RIAK_TEST
-    curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
-#endif
 
     rc = curl_easy_perform (curl);
     status = curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status);
@@ -263,4 +302,404 @@ seaf_riak_client_delete (SeafRiakClient *client,
     return ret;
 }
 
+enum {
+    BATCH_GET,
+    BATCH_PUT,
+    BATCH_QUERY,
+};
+
+typedef struct BatchRequest {
+    CURL *curl;
+    GString *url;
+    RiakObject object;
+    struct curl_slist *headers;
+    SeafRiakBatchItem *item;
+} BatchRequest;
+
+static void
+start_request (SeafRiakClient *client, BatchRequest *req, int op,
+               const char *bucket, int n_w, SeafRiakBatchItem *item)
+{
+    req->item = item;
+    memset (&req->object, 0, sizeof(req->object));
+    req->headers = NULL;
+
+    switch (op) {
+    case BATCH_GET:
+        setup_get (client, req->curl, bucket, item->key, req->url, &req->object);
+        break;
+    case BATCH_PUT:
+        req->object.data = item->value;
+        req->object.size = (size_t)item->size;
+        req->headers = setup_put (client, req->curl, bucket, item->key, n_w,
+                                  req->url, &req->object);
+        break;
+    case BATCH_QUERY:
+        setup_query (client, req->curl, bucket, item->key, req->url);
+        break;
+    }
+    curl_easy_setopt (req->curl, CURLOPT_PRIVATE, req);
+
+    curl_multi_add_handle (client->multi, req->curl);
+}
+
+static void
+finish_request (SeafRiakClient *client, BatchRequest *req, int op, CURLcode rc)
+{
+    SeafRiakBatchItem *item = req->item;
+
+    item->success = (rc == CURLE_OK);
+    if (op == BATCH_GET) {
+        if (item->success) {
+            item->value = req->object.data;
+            item->size = (int)req->object.size;
+        } else
+            g_free (req->object.data);
+    } else if (op == BATCH_PUT && !item->success) {
+        seaf_warning ("[riak http] Failed to put object %s: %s.\n",
+                      item->key, curl_easy_strerror(rc));
+    }
+
+    curl_multi_remove_handle (client->multi, req->curl);
+    curl_slist_free_all (req->headers);
+    curl_easy_reset (req->curl);
+}
+
+/* Wait until one of the transfers can make progress. */
+static void
+wait_multi (CURLM *multi)
+{
+    fd_set rfds, wfds, efds;
+    int max_fd = -1;
+    long timeout_ms = -1;
+    struct timeval tv;
+
+    FD_ZERO (&rfds);
+    FD_ZERO (&wfds);
+    FD_ZERO (&efds);
+
+    curl_multi_timeout (multi, &timeout_ms);
+    if (timeout_ms < 0 || timeout_ms > 1000)
+        timeout_ms = 1000;
+    if (timeout_ms == 0)
+        return;
+
+    curl_multi_fdset (multi, &rfds, &wfds, &efds, &max_fd);
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    if (max_fd < 0) {
+        /* No socket yet, e.g. while resolving. */
+        tv.tv_sec = 0;
+        tv.tv_usec = 10000;
+    }
+    select (max_fd + 1, &rfds, &wfds, &efds, &tv);
+}
+
+static void
+run_batch (SeafRiakClient *client, int op, const char *bucket, int n_w,
+           SeafRiakBatchItem *items, int n_items, int max_parallel)
+{
+    BatchRequest *reqs;
+    CURLMsg *msg;
+    BatchRequest *req;
+    int n_slots, next = 0, in_flight = 0, running, left, i;
+
+    if (n_items <= 0)
+        return;
+
+    n_slots = MAX (1, MIN (max_parallel, n_items));
+
+    if (!client->multi)
+        client->multi = curl_multi_init ();
+    if (client->n_handles < n_slots) {
+        client->handles = g_renew (CURL *, client->handles, n_slots);
+        for (i = client->n_handles; i < n_slots; ++i)
+            client->handles[i] = curl_easy_init ();
+        client->n_handles = n_slots;
+    }
+
+    reqs = g_new0 (BatchRequest, n_slots);
+    for (i = 0; i < n_slots; ++i) {
+        reqs[i].curl = client->handles[i];
+        reqs[i].url = g_string_new (NULL);
+        start_request (client, &reqs[i], op, bucket, n_w, &items[next++]);
+        ++in_flight;
+    }
+
+    while (in_flight > 0) {
+        while (curl_multi_perform (client->multi, &running) ==
+               CURLM_CALL_MULTI_PERFORM)
+            ;
+
+        while ((msg = curl_multi_info_read (client->multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+            finish_request (client, req, op, msg->data.result);
+            --in_flight;
+
+            /* Reuse the handle, and its connection, for the next key. */
+            if (next < n_items) {
+                start_request (client, req, op, bucket, n_w, &items[next++]);
+                ++in_flight;
+            }
+        }
+
+        if (in_flight > 0 && running > 0)
+            wait_multi (client->multi);
+    }
+
+    for (i = 0; i < n_slots; ++i)
+        g_string_free (reqs[i].url, TRUE);
+    g_free (reqs);
+}
+
+void
+seaf_riak_client_get_batch (SeafRiakClient *client,
+                            const char *bucket,
+                            SeafRiakBatchItem *items,
+                            int n_items,
+                            int max_parallel)
+{
+    run_batch (client, BATCH_GET, bucket, 0, items, n_items, max_parallel);
+}
+
+void
+seaf_riak_client_put_batch (SeafRiakClient *client,
+                            const char *bucket,
+                            SeafRiakBatchItem *items,
+                            int n_items,
+                            int n_w,
+                            int max_parallel)
+{
+    run_batch (client, BATCH_PUT, bucket, n_w, items, n_items, max_parallel);
+}
+
+void
+seaf_riak_client_query_batch (SeafRiakClient *client,
+                              const char *bucket,
+                              SeafRiakBatchItem *items,
+                              int n_items,
+                              int max_parallel)
+{
+    run_batch (client, BATCH_QUERY, bucket, 0, items, n_items, max_parallel);
+}
+
+/*
+ * Key listings come as JSON, {"keys":["k1","k2"]} chunks when streamed.
+ * Object keys have no escapes, so every quoted string but the field
+ * names is a key.
+ */
+typedef struct KeyParser {
+    SeafRiakKeyFunc func;
+    void *data;
+    /* Shared by the parsers of a listing. */
+    gboolean *stop;
+    gboolean in_string;
+    GString *token;
+} KeyParser;
+
+static inline gboolean
+is_field_name (const char *token)
+{
+    return (strcmp (token, "keys") == 0 ||
+            strcmp (token, "continuation") == 0 ||
+            strcmp (token, "error") == 0);
+}
+
+static size_t
+recv_keys (void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb, i;
+    KeyParser *parser = userp;
+    const char *p = contents;
+
+    for (i = 0; i < realsize; ++i) {
+        if (*parser->stop)
+            /* Abort the transfer. */
+            return 0;
+
+        if (p[i] == '"') {
+            if (parser->in_string && !is_field_name (parser->token->str) &&
+                !parser->func (parser->token->str, parser->data))
+                *parser->stop = TRUE;
+            parser->in_string = !parser->in_string;
+            g_string_truncate (parser->token, 0);
+        } else if (parser->in_string) {
+            g_string_append_c (parser->token, p[i]);
+        }
+    }
+
+    return realsize;
+}
+
+static void
+key_parser_init (KeyParser *parser, SeafRiakKeyFunc func, void *data,
+                 gboolean *stop)
+{
+    parser->func = func;
+    parser->data = data;
+    parser->stop = stop;
+    parser->in_string = FALSE;
+    parser->token = g_string_new (NULL);
+}
+
+static void
+setup_list (CURL *curl, GString *url, KeyParser *parser)
+{
+    setup_common (curl, url);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_keys);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, parser);
+}
+
+/* A listing stopped by the callback ends with a write error. */
+static inline gboolean
+list_failed (CURLcode rc, gboolean stop)
+{
+    return rc != CURLE_OK && !(rc == CURLE_WRITE_ERROR && stop);
+}
+
+static int
+stream_keys (SeafRiakClient *client, const char *bucket,
+             SeafRiakKeyFunc func, void *data)
+{
+    CURL *curl = client->curl;
+    GString *url = g_string_new (NULL);
+    KeyParser parser;
+    gboolean stop = FALSE;
+    CURLcode rc;
+    int ret = 0;
+
+    key_parser_init (&parser, func, data, &stop);
+    g_string_printf (url, "http://%s:%s/buckets/%s/keys?keys=stream",
+                     client->host, client->port, bucket);
+    setup_list (curl, url, &parser);
+
+    rc = curl_easy_perform (curl);
+    if (list_failed (rc, stop)) {
+        seaf_warning ("[riak http] Failed to list keys of %s: %s.\n",
+                      bucket, curl_easy_strerror(rc));
+        ret = -1;
+    }
+
+    curl_easy_reset (curl);
+    g_string_free (parser.token, TRUE);
+    g_string_free (url, TRUE);
+    return ret;
+}
+
+#define N_KEY_RANGES 16
+
+static void
+setup_range_query (SeafRiakClient *client, CURL *curl, const char *bucket,
+                   int range, GString *url, KeyParser *parser)
+{
+    static const char *digits = "0123456789abcdef";
+    char start[41], end[41];
+
+    /* Object keys are 40 hex digits, the bounds are inclusive. */
+    memset (start, '0', 40);
+    memset (end, 'f', 40);
+    start[0] = end[0] = digits[range];
+    start[40] = end[40] = '\0';
+
+    g_string_printf (url, "http://%s:%s/buckets/%s/index/%%24key/%s/%s"
+                     "?stream=true",
+                     client->host, client->port, bucket, start, end);
+    setup_list (curl, url, parser);
+
+    curl_multi_add_handle (client->multi, curl);
+}
+
+static int
+query_key_ranges (SeafRiakClient *client, const char *bucket,
+                  int max_parallel, SeafRiakKeyFunc func, void *data)
+{
+    KeyParser parsers[N_KEY_RANGES];
+    GString *urls[N_KEY_RANGES];
+    CURLMsg *msg;
+    gboolean stop = FALSE;
+    int n_slots, next = 0, in_flight = 0, running, left, i, slot;
+    int ret = 0;
+
+    n_slots = MAX (1, MIN (max_parallel, N_KEY_RANGES));
+
+    if (!client->multi)
+        client->multi = curl_multi_init ();
+    if (client->n_handles < n_slots) {
+        client->handles = g_renew (CURL *, client->handles, n_slots);
+        for (i = client->n_handles; i < n_slots; ++i)
+            client->handles[i] = curl_easy_init ();
+        client->n_handles = n_slots;
+    }
+
+    for (i = 0; i < N_KEY_RANGES; ++i) {
+        key_parser_init (&parsers[i], func, data, &stop);
+        urls[i] = g_string_new (NULL);
+    }
+
+    /* The callbacks all run in this thread, in curl_multi_perform(). */
+    for (slot = 0; slot < n_slots; ++slot) {
+        setup_range_query (client, client->handles[slot], bucket, next,
+                           urls[next], &parsers[next]);
+        ++next;
+        ++in_flight;
+    }
+
+    while (in_flight > 0) {
+        while (curl_multi_perform (client->multi, &running) ==
+               CURLM_CALL_MULTI_PERFORM)
+            ;
+
+        while ((msg = curl_multi_info_read (client->multi, &left)) != NULL) {
+            CURL *curl;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl = msg->easy_handle;
+            if (list_failed (msg->data.result, stop)) {
+                seaf_warning ("[riak http] Failed to list keys of %s: %s.\n",
+                              bucket, curl_easy_strerror(msg->data.result));
+                ret = -1;
+                stop = TRUE;
+            }
+            curl_multi_remove_handle (client->multi, curl);
+            curl_easy_reset (curl);
+            --in_flight;
+
+            if (next < N_KEY_RANGES && !stop) {
+                setup_range_query (client, curl, bucket, next,
+                                   urls[next], &parsers[next]);
+                ++next;
+                ++in_flight;
+            }
+        }
+
+        if (in_flight > 0 && running > 0)
+            wait_multi (client->multi);
+    }
+
+    for (i = 0; i < N_KEY_RANGES; ++i) {
+        g_string_free (parsers[i].token, TRUE);
+        g_string_free (urls[i], TRUE);
+    }
+    return ret;
+}
+
+int
+seaf_riak_client_list_keys (SeafRiakClient *client,
+                            const char *bucket,
+                            gboolean use_2i,
+                            int max_parallel,
+                            SeafRiakKeyFunc func,
+                            void *data)
+{
+    if (use_2i)
+        return query_key_ranges (client, bucket, max_parallel, func, data);
+    return stream_keys (client, bucket, func, data);
+}
+
 #endif  /* RIAK_BACKEND */
@@ -11,14 +11,21 @@
 
 #include "seafile-session.h"
 #include "fs-mgr.h"
+#include "obj-store.h"
 #include "repo-mgr.h"
 #include "seafile-error.h"
 #include "seafile-rpc.h"
 #include "seafile-config.h"
 
 #ifdef SEAFILE_SERVER
+#include <json-glib/json-glib.h>
+#include <searpc-server.h>
 #include "monitor-rpc-wrappers.h"
 #include "web-accesstoken-mgr.h"
+#include "backend-stats.h"
+#include "metrics.h"
+#include "commit-graph.h"
+#include "history-compact.h"
 #endif
 
 #ifndef SEAFILE_SERVER
@@ -163,6 +170,98 @@ seafile_list_dir_by_path(const char *commit_id, const char *path, GError **error
     return res;
 }
 
+GList *
+seafile_list_dir_by_path_paged (const char *commit_id,
+                                const char *path,
+                                const char *sort,
+                                const char *cursor,
+                                int offset,
+                                int limit,
+                                GError **error)
+{
+    SeafCommit *commit;
+    SeafDirListing *listing = NULL;
+    SeafDirent *dent;
+    SeafileDirent *d;
+    char *dir_id = NULL;
+    guint32 mode = 0;
+    int sort_type;
+    guint i, end;
+    GList *res = NULL;
+
+    if (!commit_id || !path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Args can't be NULL");
+        return NULL;
+    }
+
+    if (!sort || sort[0] == '\0' || strcmp (sort, "name") == 0)
+        sort_type = SEAF_DIR_SORT_NAME;
+    else if (strcmp (sort, "name_desc") == 0)
+        sort_type = SEAF_DIR_SORT_NAME_DESC;
+    else if (strcmp (sort, "dirs_first") == 0)
+        sort_type = SEAF_DIR_SORT_DIRS_FIRST;
+    else {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Unknown sort key %s", sort);
+        return NULL;
+    }
+
+    commit = seaf_commit_manager_get_commit(seaf->commit_mgr, commit_id);
+    if (!commit) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_COMMIT, "No such commit");
+        return NULL;
+    }
+
+    if (path[strspn (path, "/")] == '\0') {
+        dir_id = g_strdup (commit->root_id);
+        mode = S_IFDIR;
+    } else
+        dir_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, commit->root_id,
+                                                 path, &mode, error);
+    if (!dir_id || !S_ISDIR(mode)) {
+        if (!*error)
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                         "Path does not exists %s", path);
+        goto out;
+    }
+
+    listing = seaf_fs_manager_get_dir_listing (seaf->fs_mgr, dir_id, sort_type);
+    if (!listing) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                     "directory is missing");
+        goto out;
+    }
+
+    /* @offset counts from the entry after @cursor. */
+    i = 0;
+    if (cursor && cursor[0] != '\0')
+        i = seaf_dir_listing_find_after (listing, cursor);
+    if (offset > 0)
+        i = MIN (i + offset, listing->n_entries);
+
+    end = listing->n_entries;
+    if (limit >= 0 && (guint)limit < end - i)
+        end = i + limit;
+
+    for ( ; i < end; ++i) {
+        dent = listing->entries[i];
+        d = g_object_new (SEAFILE_TYPE_DIRENT,
+                          "obj_id", dent->id,
+                          "obj_name", dent->name,
+                          "mode", dent->mode,
+                          NULL);
+        res = g_list_prepend (res, d);
+    }
+    res = g_list_reverse (res);
+
+out:
+    seaf_dir_listing_unref (listing);
+    g_free (dir_id);
+    seaf_commit_unref (commit);
+    return res;
+}
+
 char *
 seafile_get_dirid_by_path(const char *commit_id, const char *path, GError **error)
 {
@@ -1018,6 +1117,47 @@ seafile_get_sync_task_list (GError **error)
     return task_list;
 }
 
+char *
+seafile_get_sync_traces (GError **error)
+{
+    GString *buf = g_string_new (NULL);
+
+    seaf_sync_manager_format_traces (seaf->sync_mgr, buf);
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+seafile_get_transfer_stats (GError **error)
+{
+    GString *buf = g_string_new (NULL);
+
+    seaf_transfer_manager_format_stats (seaf->transfer_mgr, buf);
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+seafile_get_transfer_history (const char *id, GError **error)
+{
+    GString *buf;
+
+    if (!id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    buf = g_string_new (NULL);
+    if (seaf_transfer_manager_format_history (seaf->transfer_mgr, id, buf) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "No transfer history for %s", id);
+        g_string_free (buf, TRUE);
+        return NULL;
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
 
 int
 seafile_set_repo_property (const char *repo_id,
@@ -1032,15 +1172,22 @@ seafile_set_repo_property (const char *repo_id,
         return -1;
     }
 
+    if (!is_repo_id_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    /* Placeholders and sparse paths can be set before the repo is cloned. */
     SeafRepo *repo;
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-    if (!repo) {
+    if (!repo && strcmp (key, REPO_PLACEHOLDERS) != 0 &&
+        strcmp (key, REPO_SPARSE_PATHS) != 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_REPO, "Can't find Repo %s", repo_id);
         return -1;
     }
 
     ret = seaf_repo_manager_set_repo_property (seaf->repo_mgr,
-                                               repo->id, key, value);
+                                               repo_id, key, value);
     if (ret < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
                      "Failed to set key for repo %s", repo_id);
@@ -1073,6 +1220,46 @@ seafile_get_repo_property (const char *repo_id,
     return value;
 }
 
+int
+seafile_set_repo_sparse_paths (const char *repo_id,
+                               const char *paths,
+                               GError **error)
+{
+    if (!repo_id || !is_repo_id_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    return seaf_repo_manager_set_sparse_paths (seaf->repo_mgr, repo_id, paths);
+}
+
+int
+seafile_hydrate_file (const char *repo_id,
+                      const char *path,
+                      GError **error)
+{
+    SeafRepo *repo;
+
+    if (!repo_id || !path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_REPO, "No such repository");
+        return -1;
+    }
+
+    if (seaf_repo_hydrate_file (repo, path) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to hydrate %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 seafile_calc_dir_size (const char *path, GError **error)
 {
@@ -1363,17 +1550,18 @@ struct CollectParam {
     int limit;
     int count;
     GList *commits;
+    GList *commit_ids;          /* when walking the commit graph */
 #ifdef SEAFILE_SERVER
     gint64 truncate_time;
     gboolean traversed_head;
+    HistoryCompactor compactor;
 #endif
 };
 
+/* Returns TRUE if the next commit in the history is in the page. */
 static gboolean
-get_commit (SeafCommit *c, void *data, gboolean *stop)
+collect_commit (struct CollectParam *cp, guint64 ctime, gboolean *stop)
 {
-    struct CollectParam *cp = data;
-
 #ifdef SEAFILE_SERVER
     if (cp->truncate_time == 0)
     {
@@ -1381,13 +1569,17 @@ get_commit (SeafCommit *c, void *data, gboolean *stop)
         /* Stop after traversing the head commit. */
     }
     else if (cp->truncate_time > 0 &&
-             c->ctime < cp->truncate_time &&
+             ctime < cp->truncate_time &&
              cp->traversed_head)
     {
         *stop = TRUE;
-        return TRUE;
+        return FALSE;
     }
 
+    /* Commits between the checkpoints of compacted history are gone. */
+    if (!history_compactor_keep (&cp->compactor, ctime) && cp->traversed_head)
+        return FALSE;
+
     /* Always traverse the head commit. */
     if (!cp->traversed_head)
         cp->traversed_head = TRUE;
@@ -1396,18 +1588,72 @@ get_commit (SeafCommit *c, void *data, gboolean *stop)
     /* if offset = 1, limit = 1, we should stop when the count = 2 */
     if (cp->limit > 0 && cp->count >= cp->offset + cp->limit) {
         *stop = TRUE;
-        return TRUE;  /* TRUE to indicate no error */
+        return FALSE;
     }
 
-    if (cp->count >= cp->offset) {
+    return (cp->count++ >= cp->offset);
+}
+
+static gboolean
+get_commit (SeafCommit *c, void *data, gboolean *stop)
+{
+    struct CollectParam *cp = data;
+
+    if (collect_commit (cp, c->ctime, stop)) {
         SeafileCommit *commit = convert_to_seafile_commit (c);
         cp->commits = g_list_prepend (cp->commits, commit);
     }
 
-    ++cp->count;
     return TRUE;                /* TRUE to indicate no error */
 }
 
+/* Only the commits in the page are loaded. */
+static gboolean
+get_commit_id (const CommitGraphEntry *entry, void *data, gboolean *stop)
+{
+    struct CollectParam *cp = data;
+
+    if (collect_commit (cp, entry->ctime, stop))
+        cp->commit_ids = g_list_prepend (cp->commit_ids,
+                                         g_strdup (entry->commit_id));
+
+    return TRUE;
+}
+
+static gboolean
+get_commits_from_graph (const char *repo_id, const char *head,
+                        struct CollectParam *cp)
+{
+    CommitGraph *graph;
+    SeafCommit *c;
+    GList *ptr;
+    gboolean ret = TRUE;
+
+    graph = seaf_commit_manager_get_graph (seaf->commit_mgr, repo_id);
+    if (!graph || !commit_graph_traverse (graph, head, get_commit_id, cp)) {
+        string_list_free (cp->commit_ids);
+        cp->commit_ids = NULL;
+        return FALSE;
+    }
+
+    for (ptr = cp->commit_ids; ptr; ptr = ptr->next) {
+        c = seaf_commit_manager_get_commit (seaf->commit_mgr, ptr->data);
+        if (!c) {
+            ret = FALSE;
+            break;
+        }
+        cp->commits = g_list_prepend (cp->commits,
+                                      convert_to_seafile_commit (c));
+        seaf_commit_unref (c);
+    }
+    /* Same order as get_commit() leaves them in. */
+    cp->commits = g_list_reverse (cp->commits);
+
+    string_list_free (cp->commit_ids);
+    cp->commit_ids = NULL;
+    return ret;
+}
+
 
 GList*
 seafile_get_commit_list (const char *repo_id,
@@ -1418,7 +1664,7 @@ seafile_get_commit_list (const char *repo_id,
     SeafRepo *repo;
     GList *commits = NULL;
     gboolean ret;
-    struct CollectParam cp;
+    struct CollectParam cp, init_cp;
     char *commit_id;
 
     /* correct parameter */
@@ -1473,10 +1719,18 @@ seafile_get_commit_list (const char *repo_id,
     } else if (seaf->keep_history_days < 0) {
         cp.truncate_time = -1;
     }
+    history_compactor_init (&cp.compactor);
 #endif
 
-    ret = seaf_commit_manager_traverse_commit_tree (
-        seaf->commit_mgr, commit_id, get_commit, &cp);
+    init_cp = cp;
+    ret = get_commits_from_graph (repo_id, commit_id, &cp);
+    if (!ret) {
+        /* Start over without the graph. */
+        free_commit_list (cp.commits);
+        cp = init_cp;
+        ret = seaf_commit_manager_traverse_commit_tree (
+            seaf->commit_mgr, commit_id, get_commit, &cp);
+    }
     g_free (commit_id);
 
     if (!ret) {
@@ -1726,6 +1980,176 @@ seafile_get_monitor (GError **error)
     return g_strdup (seaf->monitor_id);
 }
 
+static void
+format_obj_store_stats (GString *buf, const char *name,
+                        struct SeafObjStore *obj_store)
+{
+    static const char *ops[] = { "read", "write", "stat", NULL };
+    OSAsyncStats st;
+    int i;
+
+    for (i = 0; ops[i] != NULL; ++i) {
+        if (seaf_obj_store_get_async_stats (obj_store, ops[i], &st) < 0)
+            continue;
+        g_string_append_printf (buf, "%s\t%s\t%d\t%d\t%d\t%d\t%d\t%"
+                                G_GINT64_FORMAT"\t%"G_GUINT64_FORMAT"\n",
+                                name, ops[i], st.threads, st.max_threads,
+                                st.adaptive, st.queued, st.pending,
+                                st.avg_latency, st.n_done);
+    }
+}
+
+char *
+seafile_get_obj_store_stats (GError **error)
+{
+    GString *buf = g_string_new ("");
+
+    format_obj_store_stats (buf, "fs", seaf->fs_mgr->obj_store);
+    format_obj_store_stats (buf, "commits", seaf->commit_mgr->obj_store);
+
+    return (g_string_free (buf, FALSE));
+}
+
+char *
+seafile_get_fs_cache_stats (GError **error)
+{
+    SeafFSCacheStats st;
+
+    seaf_fs_manager_get_cache_stats (seaf->fs_mgr, &st);
+
+    return g_strdup_printf ("%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT
+                            "\t%u\t%lu\t%lu",
+                            st.hits, st.misses, st.n_objects,
+                            (unsigned long)st.size,
+                            (unsigned long)st.capacity);
+}
+
+char *
+seafile_get_commit_cache_stats (GError **error)
+{
+    SeafCommitCacheStats st;
+
+    seaf_commit_manager_get_cache_stats (seaf->commit_mgr, &st);
+
+    return g_strdup_printf ("%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT
+                            "\t%u\t%lu\t%lu",
+                            st.hits, st.misses, st.n_commits,
+                            (unsigned long)st.size,
+                            (unsigned long)st.capacity);
+}
+
+static void
+append_filter_stats (GString *buf, const char *store,
+                     const ExistsFilterStats *st)
+{
+    g_string_append_printf (buf, "%s\t%d\t%"G_GUINT64_FORMAT
+                            "\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT
+                            "\t%"G_GUINT64_FORMAT"\n",
+                            store, st->ready, st->n_bits, st->n_added,
+                            st->n_tests, st->n_absent);
+}
+
+char *
+seafile_get_exists_filter_stats (GError **error)
+{
+    GString *buf = g_string_new (NULL);
+    ExistsFilterStats st;
+
+    if (seaf_obj_store_get_filter_stats (seaf->fs_mgr->obj_store, &st) == 0)
+        append_filter_stats (buf, "fs", &st);
+    if (seaf_obj_store_get_filter_stats (seaf->commit_mgr->obj_store, &st) == 0)
+        append_filter_stats (buf, "commits", &st);
+    if (seaf->block_mgr->filter) {
+        exists_filter_get_stats (seaf->block_mgr->filter, &st);
+        append_filter_stats (buf, "blocks", &st);
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+seafile_get_backend_stats (int reset, GError **error)
+{
+    GString *buf = g_string_new (NULL);
+
+    backend_stats_format (buf, "fs",
+                          seaf_obj_store_get_backend_stats (seaf->fs_mgr->obj_store),
+                          reset);
+    backend_stats_format (buf, "commits",
+                          seaf_obj_store_get_backend_stats (seaf->commit_mgr->obj_store),
+                          reset);
+    backend_stats_format (buf, "blocks", seaf->block_mgr->stats, reset);
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+seafile_get_db_stats (int reset, GError **error)
+{
+    SeafDBStats st;
+    static const char *buckets[SEAF_DB_WAIT_BUCKETS] = {
+        "wait_1ms", "wait_10ms", "wait_100ms", "wait_1s", "wait_inf",
+    };
+    GString *buf = g_string_new (NULL);
+    int i;
+
+    seaf_db_get_stats (seaf->db, &st, reset);
+
+    g_string_append_printf (buf, "max_conns\t%d\nin_use\t%d\nidle\t%d\n"
+                            "waiters\t%d\n", st.max_conns, st.in_use,
+                            st.idle, st.waiters);
+    g_string_append_printf (buf, "acquired\t%"G_GUINT64_FORMAT"\n"
+                            "waited\t%"G_GUINT64_FORMAT"\n"
+                            "timeouts\t%"G_GUINT64_FORMAT"\n",
+                            st.n_acquired, st.n_waited, st.n_timeouts);
+    for (i = 0; i < SEAF_DB_WAIT_BUCKETS; ++i)
+        g_string_append_printf (buf, "%s\t%"G_GUINT64_FORMAT"\n",
+                                buckets[i], st.wait_hist[i]);
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+seafile_get_db_query_stats (int reset, GError **error)
+{
+    GString *buf = g_string_new (NULL);
+
+    seaf_db_format_query_stats (buf, reset);
+
+    return g_string_free (buf, FALSE);
+}
+
+/* Written by seafserv-gc while it runs. */
+char *
+seafile_get_gc_stats (GError **error)
+{
+    char *path, *contents = NULL;
+
+    path = g_build_filename (seaf->seaf_dir, "gc-status", NULL);
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GC_NOT_STARTED,
+                     "GC has not been run");
+    g_free (path);
+
+    return contents;
+}
+
+char *
+seafile_get_rpc_stats (GError **error)
+{
+    return seaf_rpc_dispatcher_get_stats (seaf->rpc_dispatcher);
+}
+
+char *
+seafile_get_metrics (GError **error)
+{
+    GString *buf = g_string_new (NULL);
+
+    metrics_format (buf);
+
+    return g_string_free (buf, FALSE);
+}
+
 gint64
 seafile_get_user_quota_usage (const char *email, GError **error)
 {
@@ -1797,6 +2221,75 @@ seafile_server_repo_size(const char *repo_id, GError **error)
     return ret;
 }
 
+gint64
+seafile_get_repo_unique_size (const char *repo_id, GError **error)
+{
+    gint64 unique_size;
+
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad repo id");
+        return -1;
+    }
+
+    if (seaf_block_ref_manager_get_repo_sizes (seaf->block_ref_mgr, repo_id,
+                                               NULL, &unique_size) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Repo unique size is not available");
+        return -1;
+    }
+
+    return unique_size;
+}
+
+int
+seafile_set_repo_storage_class (const char *repo_id, const char *class_name,
+                                GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id) || !class_name) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad arguments");
+        return -1;
+    }
+
+    if (seaf_storage_class_manager_set_repo_class (seaf->storage_class_mgr,
+                                                   repo_id, class_name) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to set storage class");
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_set_org_storage_class (int org_id, const char *class_name,
+                               GError **error)
+{
+    if (org_id < 0 || !class_name) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad arguments");
+        return -1;
+    }
+
+    if (seaf_storage_class_manager_set_org_class (seaf->storage_class_mgr,
+                                                  org_id, class_name) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to set storage class");
+        return -1;
+    }
+
+    return 0;
+}
+
+char *
+seafile_get_repo_storage_class (const char *repo_id, GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad repo id");
+        return NULL;
+    }
+
+    return seaf_block_manager_get_repo_class (seaf->block_mgr, repo_id);
+}
+
 int
 seafile_repo_set_access_property (const char *repo_id, const char *ap, GError **error)
 {
@@ -1865,6 +2358,67 @@ seafile_web_get_access_token (const char *repo_id,
     return token;
 }
 
+char *
+seafile_web_get_access_tokens (const char *repo_id,
+                               const char *obj_ids_json,
+                               const char *op,
+                               const char *username,
+                               GError **error)
+{
+    JsonParser *parser;
+    JsonNode *root, *node;
+    JsonArray *array;
+    GList *obj_ids = NULL, *tokens = NULL, *ptr;
+    GString *buf = NULL;
+    guint i;
+
+    if (!repo_id || !obj_ids_json || !op || !username) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Missing args");
+        return NULL;
+    }
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_data (parser, obj_ids_json, -1, NULL) ||
+        !(root = json_parser_get_root (parser)) ||
+        !JSON_NODE_HOLDS_ARRAY (root)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid object id list");
+        goto out;
+    }
+
+    array = json_node_get_array (root);
+    for (i = 0; i < json_array_get_length (array); ++i) {
+        node = json_array_get_element (array, i);
+        if (json_node_get_value_type (node) != G_TYPE_STRING ||
+            strlen (json_node_get_string (node)) != 40) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid object id");
+            goto out;
+        }
+        obj_ids = g_list_prepend (obj_ids, (char *)json_node_get_string (node));
+    }
+    obj_ids = g_list_reverse (obj_ids);
+
+    tokens = seaf_web_at_manager_get_access_tokens (seaf->web_at_mgr,
+                                                    repo_id, obj_ids,
+                                                    op, username);
+
+    /* Tokens are hex, no escaping needed. */
+    buf = g_string_new ("[");
+    for (ptr = tokens; ptr; ptr = ptr->next) {
+        g_string_append_printf (buf, "\"%s\"%s", (char *)ptr->data,
+                                ptr->next ? "," : "");
+        g_free (ptr->data);
+    }
+    g_string_append_c (buf, ']');
+
+out:
+    g_list_free (obj_ids);
+    g_list_free (tokens);
+    g_object_unref (parser);
+    return buf ? g_string_free (buf, FALSE) : NULL;
+}
+
 GObject *
 seafile_web_query_access_token (const char *token, GError **error)
 {
@@ -1939,6 +2493,36 @@ seafile_list_org_share_repos (int org_id, const char *email, const char *type,
                                                     start, limit);
 }
 
+int
+seafile_count_share_repos (const char *email, const char *type,
+                           GError **error)
+{
+    if (g_strcmp0 (type, "from_email") != 0 &&
+        g_strcmp0 (type, "to_email") != 0 ) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Wrong type argument");
+        return -1;
+    }
+
+    return seaf_share_manager_count_share_repos (seaf->share_mgr,
+                                                 email, type);
+}
+
+int
+seafile_count_org_share_repos (int org_id, const char *email,
+                               const char *type, GError **error)
+{
+    if (g_strcmp0 (type, "from_email") != 0 &&
+        g_strcmp0 (type, "to_email") != 0 ) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Wrong type argument");
+        return -1;
+    }
+
+    return seaf_share_manager_count_org_share_repos (seaf->share_mgr,
+                                                     org_id, email, type);
+}
+
 int
 seafile_remove_share (const char *repo_id, const char *from_email,
                       const char *to_email, GError **error)
@@ -2406,6 +2990,95 @@ seafile_list_org_inner_pub_repos_by_owner (int org_id,
                                                                 org_id, user);
 }
 
+GList *
+seafile_list_group_repos (int group_id, int start, int limit, GError **error)
+{
+    if (group_id <= 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Wrong group id argument");
+        return NULL;
+    }
+
+    return seaf_repo_manager_list_group_repos (seaf->repo_mgr,
+                                               group_id, start, limit);
+}
+
+GList *
+seafile_list_group_repos_by_owner (const char *user, int start, int limit,
+                                   GError **error)
+{
+    if (!user) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "user name can not be NULL");
+        return NULL;
+    }
+
+    return seaf_repo_manager_list_group_repos_by_owner (seaf->repo_mgr,
+                                                        user, start, limit);
+}
+
+GList *
+seafile_list_inner_pub_repos_paged (int start, int limit, GError **error)
+{
+    return seaf_repo_manager_list_inner_pub_repos_paged (seaf->repo_mgr,
+                                                         start, limit);
+}
+
+GList *
+seafile_list_repo_summaries (const char *last_repo_id, int limit,
+                             GError **error)
+{
+    if (last_repo_id && *last_repo_id && !is_uuid_valid (last_repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid repo id");
+        return NULL;
+    }
+
+    return seaf_repo_manager_list_repo_summaries (seaf->repo_mgr,
+                                                  last_repo_id, limit);
+}
+
+GList *
+seafile_list_org_group_repos (int org_id, int group_id, int start, int limit,
+                              GError **error)
+{
+    if (org_id < 0 || group_id <= 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad arguments");
+        return NULL;
+    }
+
+    return seaf_repo_manager_list_org_group_repos (seaf->repo_mgr, org_id,
+                                                   group_id, start, limit);
+}
+
+GList *
+seafile_list_org_group_repos_by_owner (int org_id, const char *user,
+                                       int start, int limit, GError **error)
+{
+    if (org_id < 0 || !user) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad arguments");
+        return NULL;
+    }
+
+    return seaf_repo_manager_list_org_group_repos_by_owner (seaf->repo_mgr,
+                                                            org_id, user,
+                                                            start, limit);
+}
+
+GList *
+seafile_list_org_inner_pub_repos_paged (int org_id, int start, int limit,
+                                        GError **error)
+{
+    if (org_id < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad arguments");
+        return NULL;
+    }
+
+    return seaf_repo_manager_list_org_inner_pub_repos_paged (seaf->repo_mgr,
+                                                             org_id,
+                                                             start, limit);
+}
+
 gint64
 seafile_get_file_size (const char *file_id, GError **error)
 {
@@ -2578,6 +3251,33 @@ seafile_post_multi_files (const char *repo_id,
     return 0;
 }
 
+int
+seafile_post_indexed_files (const char *repo_id,
+                            const char *parent_dir,
+                            const char *filenames_json,
+                            const char *file_ids_json,
+                            const char *user,
+                            GError **error)
+{
+    if (!repo_id || !filenames_json || !parent_dir || !file_ids_json || !user) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Argument should not be null");
+        return -1;
+    }
+
+    if (seaf_repo_manager_post_indexed_files (seaf->repo_mgr,
+                                              repo_id,
+                                              parent_dir,
+                                              filenames_json,
+                                              file_ids_json,
+                                              user,
+                                              error) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 seafile_put_file (const char *repo_id, const char *temp_file_path,
                   const char *parent_dir, const char *file_name,
@@ -2657,6 +3357,19 @@ seafile_del_file (const char *repo_id, const char *parent_dir,
     return 0;
 }
 
+int
+seafile_batch_edit (const char *repo_id, const char *ops_json,
+                    const char *user, GError **error)
+{
+    if (!repo_id || !ops_json || !user) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    return seaf_repo_manager_batch_edit (seaf->repo_mgr, repo_id,
+                                         ops_json, user, error);
+}
+
 int
 seafile_copy_file (const char *src_repo_id,
                    const char *src_dir,
@@ -2709,6 +3422,180 @@ seafile_move_file (const char *src_repo_id,
     return 0;
 }
 
+char *
+seafile_copy_file_async (const char *src_repo_id,
+                         const char *src_dir,
+                         const char *src_filename,
+                         const char *dst_repo_id,
+                         const char *dst_dir,
+                         const char *dst_filename,
+                         const char *user,
+                         int is_move,
+                         GError **error)
+{
+    if (!src_repo_id || !src_dir || !src_filename ||
+        !dst_repo_id || !dst_dir || !dst_filename || !user) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    return seaf_copy_manager_add_task (seaf->copy_mgr,
+                                       src_repo_id, src_dir, src_filename,
+                                       dst_repo_id, dst_dir, dst_filename,
+                                       user, is_move, error);
+}
+
+GObject *
+seafile_get_copy_task (const char *task_id, GError **error)
+{
+    if (!task_id) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    return seaf_copy_manager_get_task (seaf->copy_mgr, task_id);
+}
+
+char *
+seafile_restore_entries_async (const char *repo_id,
+                               const char *items_json,
+                               const char *user,
+                               GError **error)
+{
+    if (!repo_id || !items_json || !user) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    return seaf_restore_manager_add_task (seaf->restore_mgr,
+                                          repo_id, items_json, user, error);
+}
+
+GObject *
+seafile_get_restore_task (const char *task_id, GError **error)
+{
+    if (!task_id) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    return seaf_restore_manager_get_task (seaf->restore_mgr, task_id);
+}
+
+int
+seafile_cancel_restore_task (const char *task_id, GError **error)
+{
+    if (!task_id) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    if (seaf_restore_manager_cancel_task (seaf->restore_mgr, task_id) < 0) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "No running task %s", task_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+#define MAX_BATCH_CALLS 100
+#define BATCH_SERVICE "seafserv-threaded-rpcserver"
+
+static void
+append_call_error (GString *buf, const char *msg)
+{
+    JsonGenerator *gen = json_generator_new ();
+    JsonNode *root = json_node_new (JSON_NODE_OBJECT);
+    JsonObject *object = json_object_new ();
+    char *data;
+
+    json_object_set_int_member (object, "err_code", SEAF_ERR_BAD_ARGS);
+    json_object_set_string_member (object, "err_msg", msg);
+    json_node_take_object (root, object);
+    json_generator_set_root (gen, root);
+    data = json_generator_to_data (gen, NULL);
+    g_string_append (buf, data);
+
+    g_free (data);
+    json_node_free (root);
+    g_object_unref (gen);
+}
+
+char *
+seafile_batch_call (const char *calls_json, GError **error)
+{
+    JsonParser *parser = NULL;
+    JsonNode *root, *node;
+    JsonArray *calls, *call;
+    JsonGenerator *gen = NULL;
+    GString *buf = NULL;
+    char *fcall, *ret;
+    gsize len, ret_len;
+    guint n_calls, i;
+
+    if (!calls_json) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_data (parser, calls_json, -1, NULL) ||
+        !(root = json_parser_get_root (parser)) ||
+        !JSON_NODE_HOLDS_ARRAY (root)) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Invalid calls");
+        goto out;
+    }
+
+    calls = json_node_get_array (root);
+    n_calls = json_array_get_length (calls);
+    if (n_calls > MAX_BATCH_CALLS) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS,
+                     "Too many calls, at most %d", MAX_BATCH_CALLS);
+        goto out;
+    }
+
+    gen = json_generator_new ();
+    buf = g_string_new ("[");
+    for (i = 0; i < n_calls; ++i) {
+        if (i > 0)
+            g_string_append_c (buf, ',');
+
+        /* Every call is a searpc fcall, ["name", arg, ...]. */
+        node = json_array_get_element (calls, i);
+        if (!JSON_NODE_HOLDS_ARRAY (node) ||
+            !(call = json_node_get_array (node)) ||
+            json_array_get_length (call) == 0 ||
+            json_node_get_value_type (json_array_get_element (call, 0)) != G_TYPE_STRING) {
+            append_call_error (buf, "Invalid call");
+            continue;
+        }
+
+        /* Don't let a batch run batches. */
+        if (g_strcmp0 (json_array_get_string_element (call, 0),
+                       "seafile_batch_call") == 0) {
+            append_call_error (buf, "Nested batch call");
+            continue;
+        }
+
+        json_generator_set_root (gen, node);
+        fcall = json_generator_to_data (gen, &len);
+        ret = searpc_server_call_function (BATCH_SERVICE, fcall, len, &ret_len);
+        if (ret)
+            g_string_append_len (buf, ret, ret_len);
+        else
+            append_call_error (buf, "Failed to invoke the function");
+        g_free (fcall);
+        g_free (ret);
+    }
+    g_string_append_c (buf, ']');
+
+out:
+    if (gen)
+        g_object_unref (gen);
+    g_object_unref (parser);
+    return buf ? g_string_free (buf, FALSE) : NULL;
+}
+
 int
 seafile_rename_file (const char *repo_id,
                      const char *parent_dir,
@@ -3034,7 +3921,23 @@ seafile_get_deleted (const char *repo_id, GError **error)
         return NULL;
     }
 
-    return seaf_repo_manager_get_deleted_entries (seaf->repo_mgr, repo_id, error);
+    return seaf_repo_manager_get_deleted_entries (seaf->repo_mgr, repo_id,
+                                                  0, 0, -1, error);
+}
+
+GList *
+seafile_get_deleted_entries (const char *repo_id, int show_days,
+                             int start, int limit, GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Bad arguments");
+        return NULL;
+    }
+
+    return seaf_repo_manager_get_deleted_entries (seaf->repo_mgr, repo_id,
+                                                  show_days, start, limit,
+                                                  error);
 }
 
 int
@@ -0,0 +1,105 @@
+#ifndef SEAF_S3_CLIENT_H
+#define SEAF_S3_CLIENT_H
+
+#include <glib.h>
+
+struct SeafS3Client;
+typedef struct SeafS3Client SeafS3Client;
+
+typedef struct SeafS3Config {
+    char        *host;          /* endpoint, host[:port] */
+    char        *bucket;
+    char        *access_key;
+    char        *secret_key;
+    char        *region;
+    gboolean    use_https;
+    /* host/bucket/key rather than bucket.host/key */
+    gboolean    path_style;
+} SeafS3Config;
+
+/* One object of a batch request. */
+typedef struct SeafS3BatchItem {
+    const char  *key;
+    guint64     offset;         /* range to get */
+    int         len;
+    void        *value;         /* set by get */
+    int         size;
+    gboolean    success;
+} SeafS3BatchItem;
+
+/* Returns FALSE to stop listing. */
+typedef gboolean (*SeafS3ListFunc) (const char *key, gint64 size,
+                                    void *user_data);
+
+SeafS3Client *
+seaf_s3_client_new (const SeafS3Config *config);
+
+void
+seaf_s3_client_free (SeafS3Client *client);
+
+/*
+ * Get @len bytes of an object at @offset, or the whole object if @len
+ * is 0. The size of the whole object is returned in @total if not NULL.
+ */
+int
+seaf_s3_client_get (SeafS3Client *client,
+                    const char *key,
+                    guint64 offset,
+                    int len,
+                    void **value,
+                    int *size,
+                    gint64 *total);
+
+int
+seaf_s3_client_put (SeafS3Client *client,
+                    const char *key,
+                    const void *value,
+                    int size);
+
+/*
+ * Upload an object in parts of @part_size bytes, up to @max_parallel
+ * parts at a time. The upload is aborted on error.
+ */
+int
+seaf_s3_client_put_multipart (SeafS3Client *client,
+                              const char *key,
+                              const void *value,
+                              gint64 size,
+                              int part_size,
+                              int max_parallel);
+
+/* Returns 1 if the object exists, 0 if not, -1 on error. */
+int
+seaf_s3_client_head (SeafS3Client *client,
+                     const char *key,
+                     gint64 *size);
+
+int
+seaf_s3_client_delete (SeafS3Client *client,
+                       const char *key);
+
+/* List the objects whose keys start with @prefix, page by page. */
+int
+seaf_s3_client_list (SeafS3Client *client,
+                     const char *prefix,
+                     SeafS3ListFunc process,
+                     void *user_data);
+
+/*
+ * The batch functions run up to @max_parallel requests at a time, each
+ * on its own keep-alive connection, and set @success of every item.
+ * Get sets @value and @size, head sets @size.
+ */
+void
+seaf_s3_client_get_batch (SeafS3Client *client,
+                          SeafS3BatchItem *items,
+                          int n_items,
+                          int max_parallel);
+
+void
+seaf_s3_client_head_batch (SeafS3Client *client,
+                           SeafS3BatchItem *items,
+                           int n_items,
+                           int max_parallel);
+
+#endif
@@ -0,0 +1,884 @@
+#include "common.h"
+
+#ifdef S3_BACKEND
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/select.h>
+#include <curl/curl.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <glib.h>
+
+#include "utils.h"
+#include "log.h"
+#include "s3-client.h"
+
+/* Keys per page when listing, the most S3 returns. */
+#define LIST_PAGE_SIZE 1000
+
+/* A request fails if it's stalled for this long, in seconds. */
+#define CONNECT_TIMEOUT 30
+#define STALL_TIMEOUT 60
+
+struct SeafS3Client {
+    SeafS3Config conf;
+    CURL *curl;
+
+    /* For batches. Connections stay in the multi handle's cache. */
+    CURLM *multi;
+    CURL **handles;
+    int n_handles;
+};
+
+typedef struct S3Request {
+    const char *method;
+    char *key;                  /* NULL for the bucket */
+    char *query;                /* canonical query string */
+    const char *body;
+    size_t body_len;
+    size_t body_pos;
+    guint64 range_start;
+    int range_len;              /* 0 for no range, -1 to the end */
+
+    /* Response */
+    char *data;
+    size_t size;
+    char *etag;
+    gint64 total;
+    long status;
+    CURLcode rc;
+
+    GString *url;
+    struct curl_slist *headers;
+} S3Request;
+
+SeafS3Client *
+seaf_s3_client_new (const SeafS3Config *config)
+{
+    SeafS3Client *client = g_new0 (SeafS3Client, 1);
+
+    client->conf.host = g_strdup (config->host);
+    client->conf.bucket = g_strdup (config->bucket);
+    client->conf.access_key = g_strdup (config->access_key);
+    client->conf.secret_key = g_strdup (config->secret_key);
+    client->conf.region = g_strdup (config->region);
+    client->conf.use_https = config->use_https;
+    client->conf.path_style = config->path_style;
+    client->curl = curl_easy_init ();
+
+    return client;
+}
+
+void
+seaf_s3_client_free (SeafS3Client *client)
+{
+    int i;
+
+    for (i = 0; i < client->n_handles; ++i)
+        curl_easy_cleanup (client->handles[i]);
+    g_free (client->handles);
+    if (client->multi)
+        curl_multi_cleanup (client->multi);
+    curl_easy_cleanup (client->curl);
+    g_free (client->conf.host);
+    g_free (client->conf.bucket);
+    g_free (client->conf.access_key);
+    g_free (client->conf.secret_key);
+    g_free (client->conf.region);
+    g_free (client);
+}
+
+static S3Request *
+request_new (const char *method, const char *key, char *query)
+{
+    S3Request *req = g_new0 (S3Request, 1);
+
+    req->method = method;
+    req->key = g_strdup (key);
+    req->query = query;
+    req->total = -1;
+    req->url = g_string_new (NULL);
+
+    return req;
+}
+
+static void
+request_free (S3Request *req)
+{
+    g_free (req->key);
+    g_free (req->query);
+    g_free (req->data);
+    g_free (req->etag);
+    g_string_free (req->url, TRUE);
+    curl_slist_free_all (req->headers);
+    g_free (req);
+}
+
+static gboolean
+request_succeeded (S3Request *req)
+{
+    return (req->rc == CURLE_OK && req->status / 100 == 2);
+}
+
+static void
+uri_encode (GString *buf, const char *s, gboolean keep_slash)
+{
+    const char *p;
+
+    for (p = s; *p; ++p) {
+        if (g_ascii_isalnum (*p) || *p == '-' || *p == '_' ||
+            *p == '.' || *p == '~' || (keep_slash && *p == '/'))
+            g_string_append_c (buf, *p);
+        else
+            g_string_append_printf (buf, "%%%02X", (guchar)*p);
+    }
+}
+
+static char *
+encode_value (const char *s)
+{
+    GString *buf = g_string_new (NULL);
+
+    uri_encode (buf, s, FALSE);
+    return g_string_free (buf, FALSE);
+}
+
+static void
+sha256_hex (const void *data, size_t len, char *hex)
+{
+    unsigned char md[SHA256_DIGEST_LENGTH];
+
+    SHA256 (data, len, md);
+    rawdata_to_hex (md, hex, SHA256_DIGEST_LENGTH);
+}
+
+static void
+hmac_sha256 (const void *key, int key_len, const char *msg, unsigned char *md)
+{
+    unsigned int md_len = SHA256_DIGEST_LENGTH;
+
+    HMAC (EVP_sha256 (), key, key_len,
+          (const unsigned char *)msg, strlen(msg), md, &md_len);
+}
+
+/*
+ * Add the headers of an AWS signature version 4 to @req. Only host and
+ * the x-amz headers are signed.
+ */
+static void
+sign_request (SeafS3Client *client, S3Request *req,
+              const char *host, const char *path)
+{
+    SeafS3Config *conf = &client->conf;
+    char amz_date[32], date[16];
+    char payload_hash[65], request_hash[65], signature[65];
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    time_t now = time (NULL);
+    struct tm tm;
+    char *secret, *scope, *canonical, *to_sign, *header;
+
+    gmtime_r (&now, &tm);
+    strftime (amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+    strftime (date, sizeof(date), "%Y%m%d", &tm);
+
+    sha256_hex (req->body ? req->body + req->body_pos : "",
+                req->body ? req->body_len : 0, payload_hash);
+
+    canonical = g_strdup_printf ("%s\n%s\n%s\n"
+                                 "host:%s\nx-amz-content-sha256:%s\n"
+                                 "x-amz-date:%s\n\n"
+                                 "host;x-amz-content-sha256;x-amz-date\n%s",
+                                 req->method, path,
+                                 req->query ? req->query : "",
+                                 host, payload_hash, amz_date, payload_hash);
+    sha256_hex (canonical, strlen(canonical), request_hash);
+
+    scope = g_strdup_printf ("%s/%s/s3/aws4_request", date, conf->region);
+    to_sign = g_strdup_printf ("AWS4-HMAC-SHA256\n%s\n%s\n%s",
+                               amz_date, scope, request_hash);
+
+    secret = g_strdup_printf ("AWS4%s", conf->secret_key);
+    hmac_sha256 (secret, strlen(secret), date, key);
+    hmac_sha256 (key, sizeof(key), conf->region, key);
+    hmac_sha256 (key, sizeof(key), "s3", key);
+    hmac_sha256 (key, sizeof(key), "aws4_request", key);
+    hmac_sha256 (key, sizeof(key), to_sign, key);
+    rawdata_to_hex (key, signature, SHA256_DIGEST_LENGTH);
+
+    header = g_strdup_printf ("Host: %s", host);
+    req->headers = curl_slist_append (req->headers, header);
+    g_free (header);
+    header = g_strdup_printf ("x-amz-content-sha256: %s", payload_hash);
+    req->headers = curl_slist_append (req->headers, header);
+    g_free (header);
+    header = g_strdup_printf ("x-amz-date: %s", amz_date);
+    req->headers = curl_slist_append (req->headers, header);
+    g_free (header);
+    header = g_strdup_printf ("Authorization: AWS4-HMAC-SHA256 "
+                              "Credential=%s/%s, "
+                              "SignedHeaders=host;x-amz-content-sha256;"
+                              "x-amz-date, Signature=%s",
+                              conf->access_key, scope, signature);
+    req->headers = curl_slist_append (req->headers, header);
+    g_free (header);
+
+    g_free (canonical);
+    g_free (scope);
+    g_free (to_sign);
+    g_free (secret);
+}
+
+static size_t
+recv_data (void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    S3Request *req = userp;
+
+    req->data = g_realloc (req->data, req->size + realsize + 1);
+    memcpy (req->data + req->size, contents, realsize);
+    req->size += realsize;
+    /* Responses are parsed as strings. */
+    req->data[req->size] = '\0';
+
+    return realsize;
+}
+
+static size_t
+recv_header (char *buffer, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    S3Request *req = userp;
+    char *line, *value, *slash;
+
+    line = g_strndup (buffer, realsize);
+    g_strchomp (line);
+
+    value = strchr (line, ':');
+    if (!value)
+        goto out;
+    *value++ = '\0';
+    while (*value == ' ')
+        ++value;
+
+    if (g_ascii_strcasecmp (line, "ETag") == 0) {
+        g_free (req->etag);
+        req->etag = g_strdup (value);
+    } else if (g_ascii_strcasecmp (line, "Content-Range") == 0) {
+        /* bytes <first>-<last>/<total> */
+        slash = strrchr (value, '/');
+        if (slash && slash[1] != '*')
+            req->total = g_ascii_strtoll (slash + 1, NULL, 10);
+    } else if (g_ascii_strcasecmp (line, "Content-Length") == 0 &&
+               req->range_len == 0) {
+        req->total = g_ascii_strtoll (value, NULL, 10);
+    }
+
+out:
+    g_free (line);
+    return realsize;
+}
+
+static size_t
+send_data (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    S3Request *req = userp;
+    size_t copy_size;
+
+    copy_size = MIN (req->body_len, realsize);
+    memcpy (ptr, req->body + req->body_pos, copy_size);
+    req->body_pos += copy_size;
+    req->body_len -= copy_size;
+
+    return copy_size;
+}
+
+static void
+setup_request (SeafS3Client *client, CURL *curl, S3Request *req)
+{
+    SeafS3Config *conf = &client->conf;
+    GString *path = g_string_new (NULL);
+    char *host;
+    char range[64];
+
+    if (conf->path_style) {
+        host = g_strdup (conf->host);
+        g_string_append_printf (path, "/%s", conf->bucket);
+    } else {
+        host = g_strdup_printf ("%s.%s", conf->bucket, conf->host);
+    }
+    g_string_append_c (path, '/');
+    if (req->key)
+        uri_encode (path, req->key, TRUE);
+    else if (conf->path_style)
+        g_string_truncate (path, path->len - 1);
+
+    g_string_printf (req->url, "%s://%s%s%s%s",
+                     conf->use_https ? "https" : "http", host, path->str,
+                     req->query ? "?" : "", req->query ? req->query : "");
+
+    sign_request (client, req, host, path->str);
+
+    if (req->range_len != 0) {
+        if (req->range_len > 0)
+            snprintf (range, sizeof(range),
+                      "Range: bytes=%"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT,
+                      req->range_start,
+                      req->range_start + req->range_len - 1);
+        else
+            snprintf (range, sizeof(range),
+                      "Range: bytes=%"G_GUINT64_FORMAT"-", req->range_start);
+        req->headers = curl_slist_append (req->headers, range);
+    }
+    /* Don't wait for 100 Continue, it costs a round trip. */
+    req->headers = curl_slist_append (req->headers, "Expect:");
+
+    curl_easy_setopt (curl, CURLOPT_URL, req->url->str);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT);
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, (long)STALL_TIMEOUT);
+#ifdef CURLOPT_TCP_KEEPALIVE
+    curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_data);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, req);
+    curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, recv_header);
+    curl_easy_setopt (curl, CURLOPT_HEADERDATA, req);
+
+    if (strcmp (req->method, "HEAD") == 0) {
+        curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+    } else if (strcmp (req->method, "PUT") == 0) {
+        curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt (curl, CURLOPT_INFILESIZE_LARGE,
+                          (curl_off_t)req->body_len);
+        curl_easy_setopt (curl, CURLOPT_READFUNCTION, send_data);
+        curl_easy_setopt (curl, CURLOPT_READDATA, req);
+    } else if (strcmp (req->method, "POST") == 0) {
+        curl_easy_setopt (curl, CURLOPT_POST, 1L);
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDS,
+                          req->body ? req->body : "");
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
+    } else if (strcmp (req->method, "DELETE") == 0) {
+        curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    }
+
+    g_free (host);
+    g_string_free (path, TRUE);
+}
+
+static void
+finish_request (CURL *curl, S3Request *req, CURLcode rc)
+{
+    req->rc = rc;
+    curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &req->status);
+    if (req->total < 0 && request_succeeded (req) && req->range_len == 0)
+        req->total = (gint64)req->size;
+}
+
+static void
+log_error (S3Request *req)
+{
+    if (req->rc != CURLE_OK)
+        seaf_warning ("[s3 http] %s %s failed: %s.\n", req->method,
+                      req->key ? req->key : "", curl_easy_strerror(req->rc));
+    else
+        seaf_warning ("[s3 http] %s %s failed with status %ld: %s.\n",
+                      req->method, req->key ? req->key : "", req->status,
+                      req->data ? req->data : "");
+}
+
+static void
+perform_request (SeafS3Client *client, S3Request *req)
+{
+    CURL *curl = client->curl;
+    CURLcode rc;
+
+    setup_request (client, curl, req);
+    rc = curl_easy_perform (curl);
+    finish_request (curl, req, rc);
+
+    /* Clear options for future use. */
+    curl_easy_reset (curl);
+}
+
+/* Wait until one of the transfers can make progress. */
+static void
+wait_multi (CURLM *multi)
+{
+    fd_set rfds, wfds, efds;
+    int max_fd = -1;
+    long timeout_ms = -1;
+    struct timeval tv;
+
+    FD_ZERO (&rfds);
+    FD_ZERO (&wfds);
+    FD_ZERO (&efds);
+
+    curl_multi_timeout (multi, &timeout_ms);
+    if (timeout_ms < 0 || timeout_ms > 1000)
+        timeout_ms = 1000;
+    if (timeout_ms == 0)
+        return;
+
+    curl_multi_fdset (multi, &rfds, &wfds, &efds, &max_fd);
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    if (max_fd < 0) {
+        /* No socket yet, e.g. while resolving. */
+        tv.tv_sec = 0;
+        tv.tv_usec = 10000;
+    }
+    select (max_fd + 1, &rfds, &wfds, &efds, &tv);
+}
+
+static void
+start_request (SeafS3Client *client, CURL *curl, S3Request *req)
+{
+    setup_request (client, curl, req);
+    curl_easy_setopt (curl, CURLOPT_PRIVATE, req);
+    curl_multi_add_handle (client->multi, curl);
+}
+
+/* Run @reqs, up to @max_parallel at a time. */
+static void
+run_requests (SeafS3Client *client, S3Request **reqs, int n_reqs,
+              int max_parallel)
+{
+    CURLMsg *msg;
+    CURL *curl;
+    S3Request *req;
+    int n_slots, next = 0, in_flight = 0, running, left, i;
+
+    if (n_reqs <= 0)
+        return;
+
+    if (n_reqs == 1) {
+        perform_request (client, reqs[0]);
+        return;
+    }
+
+    n_slots = MAX (1, MIN (max_parallel, n_reqs));
+
+    if (!client->multi)
+        client->multi = curl_multi_init ();
+    if (client->n_handles < n_slots) {
+        client->handles = g_renew (CURL *, client->handles, n_slots);
+        for (i = client->n_handles; i < n_slots; ++i)
+            client->handles[i] = curl_easy_init ();
+        client->n_handles = n_slots;
+    }
+
+    for (i = 0; i < n_slots; ++i) {
+        start_request (client, client->handles[i], reqs[next++]);
+        ++in_flight;
+    }
+
+    while (in_flight > 0) {
+        while (curl_multi_perform (client->multi, &running) ==
+               CURLM_CALL_MULTI_PERFORM)
+            ;
+
+        while ((msg = curl_multi_info_read (client->multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl = msg->easy_handle;
+            curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **)&req);
+            finish_request (curl, req, msg->data.result);
+            curl_multi_remove_handle (client->multi, curl);
+            curl_easy_reset (curl);
+            --in_flight;
+
+            /* Reuse the handle, and its connection, for the next request. */
+            if (next < n_reqs) {
+                start_request (client, curl, reqs[next++]);
+                ++in_flight;
+            }
+        }
+
+        if (in_flight > 0 && running > 0)
+            wait_multi (client->multi);
+    }
+}
+
+int
+seaf_s3_client_get (SeafS3Client *client,
+                    const char *key,
+                    guint64 offset,
+                    int len,
+                    void **value,
+                    int *size,
+                    gint64 *total)
+{
+    S3Request *req = request_new ("GET", key, NULL);
+    int ret = 0;
+
+    req->range_start = offset;
+    if (len > 0)
+        req->range_len = len;
+    else if (offset > 0)
+        req->range_len = -1;
+
+    perform_request (client, req);
+
+    /* A range past the end of the object is empty. */
+    if (req->status == 416) {
+        *value = NULL;
+        *size = 0;
+        goto out;
+    }
+
+    if (!request_succeeded (req)) {
+        if (req->status != 404)
+            log_error (req);
+        ret = -1;
+        goto out;
+    }
+
+    *value = req->data;
+    *size = (int)req->size;
+    if (total)
+        *total = req->total;
+    req->data = NULL;
+
+out:
+    request_free (req);
+    return ret;
+}
+
+int
+seaf_s3_client_put (SeafS3Client *client,
+                    const char *key,
+                    const void *value,
+                    int size)
+{
+    S3Request *req = request_new ("PUT", key, NULL);
+    int ret = 0;
+
+    req->body = value;
+    req->body_len = (size_t)size;
+
+    perform_request (client, req);
+    if (!request_succeeded (req)) {
+        log_error (req);
+        ret = -1;
+    }
+
+    request_free (req);
+    return ret;
+}
+
+/* Text of the first <@tag> element after @start, or NULL. The end of the
+ * element is returned in @end. */
+static char *
+xml_element (const char *start, const char *tag, const char **end)
+{
+    char *open, *close;
+    const char *p, *q;
+    GString *value;
+
+    open = g_strdup_printf ("<%s>", tag);
+    close = g_strdup_printf ("</%s>", tag);
+
+    p = strstr (start, open);
+    q = p ? strstr (p, close) : NULL;
+    if (!q) {
+        g_free (open);
+        g_free (close);
+        return NULL;
+    }
+    p += strlen(open);
+    if (end)
+        *end = q + strlen(close);
+
+    value = g_string_new (NULL);
+    while (p < q) {
+        if (g_str_has_prefix (p, "&amp;")) {
+            g_string_append_c (value, '&');
+            p += 5;
+        } else if (g_str_has_prefix (p, "&lt;")) {
+            g_string_append_c (value, '<');
+            p += 4;
+        } else if (g_str_has_prefix (p, "&gt;")) {
+            g_string_append_c (value, '>');
+            p += 4;
+        } else if (g_str_has_prefix (p, "&quot;")) {
+            g_string_append_c (value, '"');
+            p += 6;
+        } else if (g_str_has_prefix (p, "&apos;")) {
+            g_string_append_c (value, '\'');
+            p += 6;
+        } else {
+            g_string_append_c (value, *p++);
+        }
+    }
+
+    g_free (open);
+    g_free (close);
+    return g_string_free (value, FALSE);
+}
+
+static void
+abort_multipart (SeafS3Client *client, const char *key, const char *upload_id)
+{
+    S3Request *req;
+    char *encoded = encode_value (upload_id);
+
+    req = request_new ("DELETE", key, g_strdup_printf ("uploadId=%s", encoded));
+    perform_request (client, req);
+    if (!request_succeeded (req) && req->status != 404)
+        log_error (req);
+
+    request_free (req);
+    g_free (encoded);
+}
+
+int
+seaf_s3_client_put_multipart (SeafS3Client *client,
+                              const char *key,
+                              const void *value,
+                              gint64 size,
+                              int part_size,
+                              int max_parallel)
+{
+    S3Request *req, **parts = NULL;
+    char *upload_id = NULL, *encoded = NULL;
+    GString *complete = NULL;
+    int n_parts = 0, i;
+    int ret = 0;
+
+    req = request_new ("POST", key, g_strdup ("uploads="));
+    perform_request (client, req);
+    if (request_succeeded (req) && req->data)
+        upload_id = xml_element (req->data, "UploadId", NULL);
+    if (!upload_id) {
+        log_error (req);
+        request_free (req);
+        return -1;
+    }
+    request_free (req);
+    encoded = encode_value (upload_id);
+
+    n_parts = (int)((size + part_size - 1) / part_size);
+    parts = g_new0 (S3Request *, n_parts);
+    for (i = 0; i < n_parts; ++i) {
+        parts[i] = request_new ("PUT", key,
+                                g_strdup_printf ("partNumber=%d&uploadId=%s",
+                                                 i + 1, encoded));
+        parts[i]->body = (const char *)value + (gint64)i * part_size;
+        parts[i]->body_len = (size_t)MIN (part_size,
+                                          size - (gint64)i * part_size);
+    }
+
+    run_requests (client, parts, n_parts, max_parallel);
+
+    complete = g_string_new ("<CompleteMultipartUpload>");
+    for (i = 0; i < n_parts; ++i) {
+        if (!request_succeeded (parts[i]) || !parts[i]->etag) {
+            log_error (parts[i]);
+            ret = -1;
+            goto out;
+        }
+        g_string_append_printf (complete, "<Part><PartNumber>%d</PartNumber>"
+                                "<ETag>%s</ETag></Part>",
+                                i + 1, parts[i]->etag);
+    }
+    g_string_append (complete, "</CompleteMultipartUpload>");
+
+    req = request_new ("POST", key, g_strdup_printf ("uploadId=%s", encoded));
+    req->body = complete->str;
+    req->body_len = complete->len;
+    perform_request (client, req);
+    /* Completing can fail after the status is sent. */
+    if (!request_succeeded (req) ||
+        (req->data && strstr (req->data, "<Error>") != NULL)) {
+        log_error (req);
+        ret = -1;
+    }
+    request_free (req);
+
+out:
+    if (ret < 0)
+        abort_multipart (client, key, upload_id);
+
+    for (i = 0; i < n_parts; ++i)
+        request_free (parts[i]);
+    g_free (parts);
+    if (complete)
+        g_string_free (complete, TRUE);
+    g_free (upload_id);
+    g_free (encoded);
+    return ret;
+}
+
+int
+seaf_s3_client_head (SeafS3Client *client,
+                     const char *key,
+                     gint64 *size)
+{
+    S3Request *req = request_new ("HEAD", key, NULL);
+    int ret;
+
+    perform_request (client, req);
+    if (request_succeeded (req)) {
+        if (size)
+            *size = req->total;
+        ret = 1;
+    } else if (req->status == 404) {
+        ret = 0;
+    } else {
+        log_error (req);
+        ret = -1;
+    }
+
+    request_free (req);
+    return ret;
+}
+
+int
+seaf_s3_client_delete (SeafS3Client *client,
+                       const char *key)
+{
+    S3Request *req = request_new ("DELETE", key, NULL);
+    int ret = 0;
+
+    perform_request (client, req);
+    if (!request_succeeded (req) && req->status != 404) {
+        log_error (req);
+        ret = -1;
+    }
+
+    request_free (req);
+    return ret;
+}
+
+int
+seaf_s3_client_list (SeafS3Client *client,
+                     const char *prefix,
+                     SeafS3ListFunc process,
+                     void *user_data)
+{
+    S3Request *req;
+    GString *query = g_string_new (NULL);
+    char *token = NULL, *key, *size, *truncated, *contents, *tmp;
+    const char *p, *end;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    do {
+        /* Parameters are sorted, as the signature requires. */
+        g_string_truncate (query, 0);
+        if (token) {
+            g_string_append (query, "continuation-token=");
+            uri_encode (query, token, FALSE);
+            g_string_append_c (query, '&');
+        }
+        g_string_append_printf (query, "list-type=2&max-keys=%d&prefix=",
+                                LIST_PAGE_SIZE);
+        uri_encode (query, prefix, FALSE);
+
+        req = request_new ("GET", NULL, g_strdup (query->str));
+        perform_request (client, req);
+        if (!request_succeeded (req) || !req->data) {
+            log_error (req);
+            request_free (req);
+            ret = -1;
+            break;
+        }
+
+        p = req->data;
+        while (!stop &&
+               (contents = xml_element (p, "Contents", &end)) != NULL) {
+            p = end;
+            key = xml_element (contents, "Key", NULL);
+            size = xml_element (contents, "Size", NULL);
+            if (key)
+                stop = !process (key, size ? g_ascii_strtoll (size, NULL, 10)
+                                 : -1, user_data);
+            g_free (key);
+            g_free (size);
+            g_free (contents);
+        }
+
+        truncated = xml_element (req->data, "IsTruncated", NULL);
+        tmp = token;
+        token = NULL;
+        if (truncated && strcmp (truncated, "true") == 0)
+            token = xml_element (req->data, "NextContinuationToken", NULL);
+        g_free (tmp);
+        g_free (truncated);
+        request_free (req);
+    } while (token && !stop);
+
+    g_free (token);
+    g_string_free (query, TRUE);
+    return ret;
+}
+
+static void
+run_batch (SeafS3Client *client, const char *method,
+           SeafS3BatchItem *items, int n_items, int max_parallel)
+{
+    S3Request **reqs;
+    S3Request *req;
+    int i;
+
+    if (n_items <= 0)
+        return;
+
+    reqs = g_new0 (S3Request *, n_items);
+    for (i = 0; i < n_items; ++i) {
+        req = request_new (method, items[i].key, NULL);
+        req->range_start = items[i].offset;
+        if (items[i].len > 0)
+            req->range_len = items[i].len;
+        else if (items[i].offset > 0)
+            req->range_len = -1;
+        reqs[i] = req;
+    }
+
+    run_requests (client, reqs, n_items, max_parallel);
+
+    for (i = 0; i < n_items; ++i) {
+        req = reqs[i];
+        items[i].success = request_succeeded (req);
+        if (!items[i].success) {
+            if (req->status != 404)
+                log_error (req);
+        } else if (strcmp (method, "GET") == 0) {
+            items[i].value = req->data;
+            items[i].size = (int)req->size;
+            req->data = NULL;
+        } else {
+            items[i].size = (int)req->total;
+        }
+        request_free (req);
+    }
+    g_free (reqs);
+}
+
+void
+seaf_s3_client_get_batch (SeafS3Client *client,
+                          SeafS3BatchItem *items,
+                          int n_items,
+                          int max_parallel)
+{
+    run_batch (client, "GET", items, n_items, max_parallel);
+}
+
+void
+seaf_s3_client_head_batch (SeafS3Client *client,
+                           SeafS3BatchItem *items,
+                           int n_items,
+                           int max_parallel)
+{
+    run_batch (client, "HEAD", items, n_items, max_parallel);
+}
+
+#endif  /* S3_BACKEND */
@@ -1,30 +1,115 @@
 
 #include "common.h"
 
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <zdb.h>
+/* The functions are defined here, not their caller wrappers. */
+#define SEAF_DB_NO_CALLER
 #include "seaf-db.h"
+#include "seaf-probes.h"
 
-#define MAX_GET_CONNECTION_RETRIES 3
+#define MAX_ROWS_PER_INSERT 500
+#define MAX_INSERT_LEN      (64 * 1024)
+
+#define REPLICA_CHECK_INTERVAL  5       /* 5s */
+
+#define DEFAULT_MAX_CONNECTIONS     100
+#define DEFAULT_CONN_WAIT_TIMEOUT   3000    /* 3s */
+
+/* Statements counted separately, the others are counted together. */
+#define MAX_QUERY_STATS     1000
+#define OTHER_QUERIES       "(other)"
+#define MAX_LOGGED_SQL_LEN  512
+
+#define MAX_CACHED_CONNS    8
+#define MAX_CACHED_STMTS    64
+#define CONN_PING_INTERVAL  30      /* 30s */
+#define MAX_CONN_IDLE_TIME  300     /* 5min */
+
+/* A connection with its prepared statements. */
+typedef struct DBConn {
+    Connection_T conn;
+    GHashTable  *stmts;     /* sql -> PreparedStatement_T */
+    gint64       last_used;
+} DBConn;
 
 struct SeafDB {
     int type;
     ConnectionPool_T pool;
+    /* Returning a connection to the pool frees its prepared statements,
+     * so the connections used by statements are kept here when idle. */
+    GQueue *idle_conns;
+    pthread_mutex_t lock;
+
+    /* Connections taken from the pool, including the idle ones. Callers
+     * wait on conn_freed when max_conns are taken, at most wait_timeout
+     * msecs. */
+    int max_conns;
+    int wait_timeout;
+    int n_taken;
+    int n_waiters;
+    pthread_cond_t conn_freed;
+
+    guint64 n_acquired;
+    guint64 n_waited;
+    guint64 n_timeouts;
+    guint64 wait_hist[SEAF_DB_WAIT_BUCKETS];
+
+    /* Read replicas, NULL if there is none. */
+    GPtrArray *replicas;
+    guint next_replica;
 };
 
+typedef struct Replica {
+    SeafDB  *db;
+    int      max_lag;
+    gboolean usable;
+    gboolean checking;
+    gint64   last_check;
+} Replica;
+
+/* When this thread last wrote to the primary. Reads within the lag limit
+ * after that go to the primary too, so that the thread sees its writes. */
+static __thread gint64 last_write_time;
+
 struct SeafDBRow {
     ResultSet_T res;
 };
 
 struct SeafDBTrans {
-    Connection_T conn;
+    SeafDB *db;
+    DBConn *conn;
 };
 
+static void
+init_conn_cache (SeafDB *db, int max_connections, int wait_timeout)
+{
+    db->idle_conns = g_queue_new ();
+    pthread_mutex_init (&db->lock, NULL);
+    pthread_cond_init (&db->conn_freed, NULL);
+
+    db->max_conns = max_connections;
+    db->wait_timeout = wait_timeout > 0 ? wait_timeout : DEFAULT_CONN_WAIT_TIMEOUT;
+}
+
+static void
+set_pool_size (ConnectionPool_T pool, int max_connections)
+{
+    ConnectionPool_setMaxConnections (pool, max_connections);
+    if (ConnectionPool_getInitialConnections (pool) > max_connections)
+        ConnectionPool_setInitialConnections (pool, max_connections);
+}
+
 SeafDB *
 seaf_db_new_mysql (const char *host, 
                    const char *user, 
                    const char *passwd,
                    const char *db_name,
-                   const char *unix_socket)
+                   const char *unix_socket,
+                   int max_connections,
+                   int wait_timeout)
 {
     SeafDB *db;
     GString *url;
@@ -52,14 +137,19 @@ seaf_db_new_mysql (const char *host,
         return NULL;
     }
 
+    if (max_connections <= 0)
+        max_connections = DEFAULT_MAX_CONNECTIONS;
+    set_pool_size (db->pool, max_connections);
+
     ConnectionPool_start (db->pool);
     db->type = SEAF_DB_TYPE_MYSQL;
+    init_conn_cache (db, max_connections, wait_timeout);
 
     return db;
 }
 
 SeafDB *
-seaf_db_new_sqlite (const char *db_path)
+seaf_db_new_sqlite (const char *db_path, int max_connections, int wait_timeout)
 {
     SeafDB *db;
     GString *url;
@@ -83,15 +173,41 @@ seaf_db_new_sqlite (const char *db_path)
         return NULL;
     }
 
+    if (max_connections <= 0)
+        max_connections = DEFAULT_MAX_CONNECTIONS;
+    set_pool_size (db->pool, max_connections);
+
     ConnectionPool_start (db->pool);
     db->type = SEAF_DB_TYPE_SQLITE;
+    init_conn_cache (db, max_connections, wait_timeout);
 
     return db;
 }
 
+static void close_cached_connection (SeafDB *db, DBConn *dbconn);
+
 void
 seaf_db_free (SeafDB *db)
 {
+    DBConn *dbconn;
+
+    while ((dbconn = g_queue_pop_head (db->idle_conns)) != NULL)
+        close_cached_connection (db, dbconn);
+    g_queue_free (db->idle_conns);
+    pthread_cond_destroy (&db->conn_freed);
+    pthread_mutex_destroy (&db->lock);
+
+    if (db->replicas) {
+        guint i;
+        Replica *r;
+        for (i = 0; i < db->replicas->len; ++i) {
+            r = g_ptr_array_index (db->replicas, i);
+            seaf_db_free (r->db);
+            g_free (r);
+        }
+        g_ptr_array_free (db->replicas, TRUE);
+    }
+
     ConnectionPool_stop (db->pool);
     ConnectionPool_free (&db->pool);
     g_free (db);
@@ -103,108 +219,567 @@ seaf_db_type (SeafDB *db)
     return db->type;
 }
 
+void
+seaf_db_add_replica (SeafDB *db, SeafDB *replica, int max_lag)
+{
+    Replica *r = g_new0 (Replica, 1);
+
+    r->db = replica;
+    r->max_lag = max_lag;
+
+    if (!db->replicas)
+        db->replicas = g_ptr_array_new ();
+    g_ptr_array_add (db->replicas, r);
+}
+
+static gint64
+now_usec ()
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+/* Waits below 1ms, 10ms, 100ms, 1s and above. */
+static int
+wait_bucket (gint64 usec)
+{
+    int i = 0;
+    gint64 bound = 1000;
+
+    while (i < SEAF_DB_WAIT_BUCKETS - 1 && usec >= bound) {
+        bound *= 10;
+        ++i;
+    }
+    return i;
+}
+
+/* Called with db->lock held. */
+static void
+free_slot (SeafDB *db)
+{
+    --db->n_taken;
+    if (db->n_waiters > 0)
+        pthread_cond_signal (&db->conn_freed);
+}
+
 static Connection_T
 get_db_connection (SeafDB *db)
 {
     Connection_T conn;
-    int retries = 0;
-
-    conn = ConnectionPool_getConnection (db->pool);
-    /* If max_connections of the pool has been reached, retry 3 times
-     * and then return NULL.
-     */
-    while (!conn) {
-        if (retries++ == MAX_GET_CONNECTION_RETRIES)
+    DBConn *idle;
+    struct timespec deadline;
+    gint64 start = 0, end;
+    gboolean timed_out = FALSE;
+    int rc;
+
+    pthread_mutex_lock (&db->lock);
+
+    while (db->n_taken >= db->max_conns) {
+        /* Idle connections hold their slots, give one back. */
+        idle = g_queue_pop_tail (db->idle_conns);
+        if (idle) {
+            pthread_mutex_unlock (&db->lock);
+            close_cached_connection (db, idle);
+            pthread_mutex_lock (&db->lock);
+            continue;
+        }
+
+        if (start == 0) {
+            start = now_usec ();
+            end = start + (gint64)db->wait_timeout * 1000;
+            deadline.tv_sec = end / G_USEC_PER_SEC;
+            deadline.tv_nsec = (end % G_USEC_PER_SEC) * 1000;
+        }
+
+        ++db->n_waiters;
+        rc = pthread_cond_timedwait (&db->conn_freed, &db->lock, &deadline);
+        --db->n_waiters;
+
+        if (rc == ETIMEDOUT && db->n_taken >= db->max_conns) {
+            timed_out = TRUE;
             break;
-        sleep (1);
-        conn = ConnectionPool_getConnection (db->pool);
+        }
     }
 
-    if (!conn)
-        g_warning ("Too many concurrent connections. Failed to create new connection.\n");
+    if (start != 0) {
+        ++db->n_waited;
+        ++db->wait_hist[wait_bucket (now_usec() - start)];
+    }
+    if (timed_out) {
+        ++db->n_timeouts;
+    } else {
+        ++db->n_taken;
+        ++db->n_acquired;
+    }
+
+    pthread_mutex_unlock (&db->lock);
+
+    if (timed_out) {
+        g_warning ("Too many concurrent connections. "
+                   "Timed out waiting for a connection.\n");
+        return NULL;
+    }
+
+    conn = ConnectionPool_getConnection (db->pool);
+    if (!conn) {
+        g_warning ("Failed to get connection from the pool.\n");
+        pthread_mutex_lock (&db->lock);
+        free_slot (db);
+        pthread_mutex_unlock (&db->lock);
+    }
 
     return conn;
 }
 
-int
-seaf_db_query (SeafDB *db, const char *sql)
+static void
+put_db_connection (SeafDB *db, Connection_T conn)
 {
-    Connection_T conn = get_db_connection (db);
+    Connection_close (conn);
+
+    pthread_mutex_lock (&db->lock);
+    free_slot (db);
+    pthread_mutex_unlock (&db->lock);
+}
+
+/* Replicas */
+
+static inline void
+mark_write (SeafDB *db)
+{
+    if (db->replicas)
+        last_write_time = (gint64)time(NULL);
+}
+
+/* Seconds the replica is behind, or -1 if it doesn't replicate. */
+static int
+get_replica_lag (SeafDB *db)
+{
+    Connection_T conn;
+    ResultSet_T result;
+    const char *lag;
+    volatile int ret = -1;
+
+    conn = get_db_connection (db);
     if (!conn)
         return -1;
 
+    TRY
+        result = Connection_executeQuery (conn, "SHOW SLAVE STATUS");
+        if (ResultSet_next (result)) {
+            /* NULL if replication is stopped. */
+            lag = ResultSet_getStringByName (result, "Seconds_Behind_Master");
+            if (lag)
+                ret = atoi (lag);
+        }
+    CATCH (SQLException)
+        g_warning ("Error checking replica lag: %s.\n", Exception_frame.message);
+    END_TRY;
+
+    put_db_connection (db, conn);
+
+    return ret;
+}
+
+static gboolean
+replica_usable (SeafDB *db, Replica *r)
+{
+    gint64 now = (gint64)time(NULL);
+    gboolean usable;
+    int lag;
+
+    pthread_mutex_lock (&db->lock);
+    if (r->checking || now - r->last_check < REPLICA_CHECK_INTERVAL) {
+        usable = r->usable;
+        pthread_mutex_unlock (&db->lock);
+        return usable;
+    }
+    r->checking = TRUE;
+    pthread_mutex_unlock (&db->lock);
+
+    lag = get_replica_lag (r->db);
+    usable = (lag >= 0 && lag <= r->max_lag);
+
+    pthread_mutex_lock (&db->lock);
+    if (usable != r->usable)
+        g_message ("Read replica %s, lag %ds.\n",
+                   usable ? "in use" : "not in use", lag);
+    r->usable = usable;
+    r->last_check = now;
+    r->checking = FALSE;
+    pthread_mutex_unlock (&db->lock);
+
+    return usable;
+}
+
+/* The db to send a read to: a replica that has caught up, or the primary. */
+static SeafDB *
+read_db (SeafDB *db)
+{
+    Replica *r;
+    guint i, n, start;
+
+    if (!db->replicas)
+        return db;
+
+    n = db->replicas->len;
+    start = (guint)g_atomic_int_add ((gint *)&db->next_replica, 1);
+    for (i = 0; i < n; ++i) {
+        r = g_ptr_array_index (db->replicas, (start + i) % n);
+        if (time(NULL) - last_write_time <= r->max_lag)
+            continue;
+        if (replica_usable (db, r))
+            return r->db;
+    }
+
+    return db;
+}
+
+/* Query stats and the slow query log */
+
+typedef struct QueryStats {
+    guint64 calls;
+    guint64 errors;
+    guint64 rows;
+    gint64  total_usec;
+    gint64  max_usec;
+} QueryStats;
+
+typedef struct QueryTrace {
+    const char *sql;
+    gint64      start;
+} QueryTrace;
+
+/* Normalized sql -> QueryStats, for all dbs. */
+static GHashTable *query_stats;
+static pthread_mutex_t query_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static gint64 slow_query_usec;
+
+/* Set by the caller wrappers in seaf-db.h. */
+static __thread const char *query_caller;
+
+void
+seaf_db_set_caller (const char *func)
+{
+    query_caller = func;
+}
+
+void
+seaf_db_set_slow_query_threshold (int msec)
+{
+    slow_query_usec = (gint64)msec * 1000;
+}
+
+/* "?, ?" and "??", from quotes in a string, become one "?". */
+static void
+append_placeholder (GString *buf)
+{
+    gsize len = buf->len;
+
+    while (len > 0 && buf->str[len - 1] == ' ')
+        --len;
+    if (len > 0 && buf->str[len - 1] == ',') {
+        --len;
+        while (len > 0 && buf->str[len - 1] == ' ')
+            --len;
+    }
+    if (len > 0 && buf->str[len - 1] == '?') {
+        g_string_truncate (buf, len);
+        return;
+    }
+
+    g_string_append_c (buf, '?');
+}
+
+static gboolean
+is_ident_char (char c)
+{
+    return g_ascii_isalnum (c) || c == '_';
+}
+
+/*
+ * @sql with its string and number literals replaced by "?", lists of
+ * them by one "?", and the rows of a multi-row INSERT by one row, so
+ * that queries that only differ in their values are counted together.
+ */
+static char *
+normalize_sql (const char *sql)
+{
+    GString *buf = g_string_sized_new (strlen(sql));
+    const char *p = sql;
+    char *row;
+    char quote;
+
+    while (*p) {
+        if (*p == '\'' || *p == '"') {
+            quote = *p++;
+            while (*p && *p != quote) {
+                if (*p == '\\' && p[1])
+                    ++p;
+                ++p;
+            }
+            if (*p)
+                ++p;
+            append_placeholder (buf);
+        } else if (g_ascii_isdigit (*p) &&
+                   (buf->len == 0 || !is_ident_char (buf->str[buf->len - 1]))) {
+            while (is_ident_char (*p) || *p == '.')
+                ++p;
+            append_placeholder (buf);
+        } else
+            g_string_append_c (buf, *p++);
+    }
+
+    while ((row = strstr (buf->str, "(?), (?)")) != NULL)
+        g_string_erase (buf, row - buf->str, 5);
+    while ((row = strstr (buf->str, "(?),(?)")) != NULL)
+        g_string_erase (buf, row - buf->str, 4);
+
+    return g_string_free (buf, FALSE);
+}
+
+static void
+query_start (QueryTrace *qt, const char *sql)
+{
+    SEAF_PROBE1 (db_query_start, sql);
+
+    qt->sql = sql;
+    qt->start = now_usec ();
+}
+
+/* @ret is the number of rows, or -1 on error. */
+static void
+query_done (QueryTrace *qt, int ret)
+{
+    gint64 usec = now_usec () - qt->start;
+    char *key = normalize_sql (qt->sql);
+    QueryStats *st;
+
+    SEAF_PROBE2 (db_query_done, qt->sql, ret);
+
+    pthread_mutex_lock (&query_stats_lock);
+
+    if (!query_stats)
+        query_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+    st = g_hash_table_lookup (query_stats, key);
+    if (!st) {
+        if (g_hash_table_size (query_stats) >= MAX_QUERY_STATS) {
+            g_free (key);
+            key = g_strdup (OTHER_QUERIES);
+            st = g_hash_table_lookup (query_stats, key);
+        }
+        if (!st) {
+            st = g_new0 (QueryStats, 1);
+            g_hash_table_insert (query_stats, key, st);
+            key = NULL;
+        }
+    }
+
+    ++st->calls;
+    if (ret < 0)
+        ++st->errors;
+    else
+        st->rows += ret;
+    st->total_usec += usec;
+    if (usec > st->max_usec)
+        st->max_usec = usec;
+
+    pthread_mutex_unlock (&query_stats_lock);
+
+    g_free (key);
+
+    if (slow_query_usec > 0 && usec >= slow_query_usec)
+        g_warning ("Slow query in %s, %.1f ms, %d rows: %.*s\n",
+                   query_caller ? query_caller : "unknown",
+                   usec / 1000.0, ret, MAX_LOGGED_SQL_LEN, qt->sql);
+}
+
+typedef struct QueryStatsEntry {
+    const char *sql;
+    QueryStats  st;
+} QueryStatsEntry;
+
+static gint
+cmp_total_time (gconstpointer a, gconstpointer b)
+{
+    const QueryStatsEntry *ea = a, *eb = b;
+
+    if (ea->st.total_usec != eb->st.total_usec)
+        return ea->st.total_usec > eb->st.total_usec ? -1 : 1;
+    return 0;
+}
+
+void
+seaf_db_format_query_stats (GString *buf, gboolean reset)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GArray *entries = g_array_new (FALSE, FALSE, sizeof(QueryStatsEntry));
+    QueryStatsEntry e;
+    GHashTable *old = NULL;
+    guint i;
+
+    pthread_mutex_lock (&query_stats_lock);
+    if (query_stats) {
+        g_hash_table_iter_init (&iter, query_stats);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            e.sql = key;
+            e.st = *(QueryStats *)value;
+            g_array_append_val (entries, e);
+        }
+        /* The keys are still used below. */
+        if (reset) {
+            old = query_stats;
+            query_stats = NULL;
+        }
+    }
+    pthread_mutex_unlock (&query_stats_lock);
+
+    g_array_sort (entries, cmp_total_time);
+
+    for (i = 0; i < entries->len; ++i) {
+        e = g_array_index (entries, QueryStatsEntry, i);
+        g_string_append_printf (buf, "%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT
+                                "\t%"G_GUINT64_FORMAT"\t%.1f\t%.3f\t%.1f\t%s\n",
+                                e.st.calls, e.st.errors, e.st.rows,
+                                e.st.total_usec / 1000.0,
+                                e.st.total_usec / 1000.0 / e.st.calls,
+                                e.st.max_usec / 1000.0, e.sql);
+    }
+
+    g_array_free (entries, TRUE);
+    if (old)
+        g_hash_table_destroy (old);
+}
+
+/*
+ * Execute the plain, unprepared @sql on @conn. If @res is not NULL, @sql
+ * is a query and its result is returned in @res.
+ */
+static int
+exec_query (Connection_T conn, const char *sql, ResultSet_T *res)
+{
+    volatile int ret = 0;
+
     /* Handle zdb "exception"s. */
     TRY
-        Connection_execute (conn, "%s", sql);
-        Connection_close (conn);
-        RETURN (0);
+        if (res)
+            *res = Connection_executeQuery (conn, "%s", sql);
+        else
+            Connection_execute (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
-        return -1;
+        ret = -1;
     END_TRY;
 
-    /* Should not be reached. */
-    return 0;
+    return ret;
+}
+
+static int
+foreach_row (ResultSet_T res, SeafDBRowFunc callback, void *data)
+{
+    SeafDBRow seaf_row;
+    int n_rows = 0;
+
+    seaf_row.res = res;
+    while (ResultSet_next (res)) {
+        n_rows++;
+        if (!callback (&seaf_row, data))
+            break;
+    }
+
+    return n_rows;
+}
+
+int
+seaf_db_query (SeafDB *db, const char *sql)
+{
+    QueryTrace qt;
+    Connection_T conn;
+    int ret = -1;
+
+    query_start (&qt, sql);
+
+    conn = get_db_connection (db);
+    if (!conn)
+        goto out;
+
+    ret = exec_query (conn, sql, NULL);
+    if (ret == 0)
+        mark_write (db);
+    put_db_connection (db, conn);
+
+out:
+    query_done (&qt, ret);
+    return ret;
 }
 
 gboolean
 seaf_db_check_for_existence (SeafDB *db, const char *sql)
 {
+    QueryTrace qt;
     Connection_T conn;
     ResultSet_T result;
-    gboolean ret = TRUE;
+    gboolean ret = FALSE;
+    int rc = -1;
+
+    query_start (&qt, sql);
 
     conn = get_db_connection (db);
     if (!conn)
-        return FALSE;
+        goto out;
 
-    TRY
-        result = Connection_executeQuery (conn, "%s", sql);
-    CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
-        return FALSE;
-    END_TRY;
-
-    if (!ResultSet_next (result))
-        ret = FALSE;
+    rc = exec_query (conn, sql, &result);
+    if (rc == 0)
+        ret = ResultSet_next (result);
 
-    Connection_close (conn);
+    put_db_connection (db, conn);
 
+out:
+    query_done (&qt, rc < 0 ? -1 : ret);
     return ret;
 }
 
-int
-seaf_db_foreach_selected_row (SeafDB *db, const char *sql, 
-                              SeafDBRowFunc callback, void *data)
+static int
+selected_foreach_row (SeafDB *db, const char *sql,
+                      SeafDBRowFunc callback, void *data)
 {
+    QueryTrace qt;
     Connection_T conn;
     ResultSet_T result;
-    SeafDBRow seaf_row;
-    int n_rows = 0;
+    int ret = -1;
+
+    query_start (&qt, sql);
 
     conn = get_db_connection (db);
     if (!conn)
-        return -1;
+        goto out;
 
-    TRY
-        result = Connection_executeQuery (conn, "%s", sql);
-    CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
-        return -1;
-    END_TRY;
+    if (exec_query (conn, sql, &result) == 0)
+        ret = foreach_row (result, callback, data);
 
-    seaf_row.res = result;
-    while (ResultSet_next (result)) {
-        n_rows++;
-        if (!callback (&seaf_row, data))
-            break;
-    }
+    put_db_connection (db, conn);
 
-    Connection_close (conn);
-    return n_rows;
+out:
+    query_done (&qt, ret);
+    return ret;
+}
+
+int
+seaf_db_foreach_selected_row (SeafDB *db, const char *sql, 
+                              SeafDBRowFunc callback, void *data)
+{
+    return selected_foreach_row (db, sql, callback, data);
+}
+
+int
+seaf_db_foreach_selected_row_replica (SeafDB *db, const char *sql,
+                                      SeafDBRowFunc callback, void *data)
+{
+    return selected_foreach_row (read_db (db), sql, callback, data);
 }
 
 const char *
@@ -231,114 +806,395 @@ seaf_db_row_get_column_int64 (SeafDBRow *row, guint32 idx)
     return ResultSet_getLLong (row->res, idx+1);
 }
 
+static gboolean
+get_int_cb (SeafDBRow *row, void *data)
+{
+    *(gint64 *)data = seaf_db_row_get_column_int64 (row, 0);
+    return FALSE;
+}
+
+static gboolean
+get_string_cb (SeafDBRow *row, void *data)
+{
+    *(char **)data = g_strdup (seaf_db_row_get_column_text (row, 0));
+    return FALSE;
+}
+
 int
 seaf_db_get_int (SeafDB *db, const char *sql)
 {
-    int ret = -1;
+    gint64 ret = -1;
+
+    seaf_db_foreach_selected_row (db, sql, get_int_cb, &ret);
+    return (int)ret;
+}
+
+gint64
+seaf_db_get_int64 (SeafDB *db, const char *sql)
+{
+    gint64 ret = -1;
+
+    seaf_db_foreach_selected_row (db, sql, get_int_cb, &ret);
+    return ret;
+}
+
+char *
+seaf_db_get_string (SeafDB *db, const char *sql)
+{
+    char *ret = NULL;
+
+    seaf_db_foreach_selected_row (db, sql, get_string_cb, &ret);
+    return ret;
+}
+
+/* Prepared statements */
+
+static void
+close_cached_connection (SeafDB *db, DBConn *dbconn)
+{
+    g_hash_table_destroy (dbconn->stmts);
+    /* Also frees the prepared statements. */
+    put_db_connection (db, dbconn->conn);
+    g_free (dbconn);
+}
+
+static DBConn *
+get_cached_connection (SeafDB *db)
+{
+    DBConn *dbconn;
     Connection_T conn;
-    ResultSet_T result;
-    SeafDBRow seaf_row;
+    gint64 now = (gint64)time(NULL);
+
+    while (1) {
+        pthread_mutex_lock (&db->lock);
+        dbconn = g_queue_pop_head (db->idle_conns);
+        pthread_mutex_unlock (&db->lock);
+        if (!dbconn)
+            break;
+
+        /* The server may have closed a connection idle for long. */
+        if (now - dbconn->last_used < CONN_PING_INTERVAL)
+            return dbconn;
+        if (now - dbconn->last_used < MAX_CONN_IDLE_TIME &&
+            Connection_ping (dbconn->conn))
+            return dbconn;
+        close_cached_connection (db, dbconn);
+    }
 
     conn = get_db_connection (db);
     if (!conn)
-        return -1;
+        return NULL;
+
+    dbconn = g_new0 (DBConn, 1);
+    dbconn->conn = conn;
+    dbconn->stmts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    return dbconn;
+}
+
+static void
+release_cached_connection (SeafDB *db, DBConn *dbconn, gboolean broken)
+{
+    DBConn *stale = NULL;
+    gint64 now = (gint64)time(NULL);
+
+    if (broken) {
+        close_cached_connection (db, dbconn);
+        return;
+    }
+
+    dbconn->last_used = now;
+
+    pthread_mutex_lock (&db->lock);
+    if (g_queue_get_length (db->idle_conns) < MAX_CACHED_CONNS) {
+        /* Most recently used first, so that unused ones age out. */
+        g_queue_push_head (db->idle_conns, dbconn);
+        dbconn = NULL;
+        /* Waiters can take over its slot. */
+        if (db->n_waiters > 0)
+            pthread_cond_signal (&db->conn_freed);
+    }
+    stale = g_queue_peek_tail (db->idle_conns);
+    if (stale && now - stale->last_used >= MAX_CONN_IDLE_TIME)
+        g_queue_pop_tail (db->idle_conns);
+    else
+        stale = NULL;
+    pthread_mutex_unlock (&db->lock);
+
+    if (dbconn)
+        close_cached_connection (db, dbconn);
+    if (stale)
+        close_cached_connection (db, stale);
+}
+
+/* May throw SQLException. */
+static PreparedStatement_T
+get_statement (DBConn *dbconn, const char *sql)
+{
+    PreparedStatement_T stmt;
+
+    stmt = g_hash_table_lookup (dbconn->stmts, sql);
+    if (stmt)
+        return stmt;
+
+    /* Statements can't be freed one by one. */
+    if (g_hash_table_size (dbconn->stmts) >= MAX_CACHED_STMTS) {
+        Connection_clear (dbconn->conn);
+        g_hash_table_remove_all (dbconn->stmts);
+    }
+
+    stmt = Connection_prepareStatement (dbconn->conn, "%s", sql);
+    g_hash_table_insert (dbconn->stmts, g_strdup (sql), stmt);
+    return stmt;
+}
+
+/* May throw SQLException. */
+static void
+bind_params (PreparedStatement_T stmt, int n, va_list args)
+{
+    const char *type;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        type = va_arg (args, const char *);
+        if (strcmp (type, "int") == 0)
+            PreparedStatement_setInt (stmt, i + 1, va_arg (args, int));
+        else if (strcmp (type, "int64") == 0)
+            PreparedStatement_setLLong (stmt, i + 1, va_arg (args, gint64));
+        else if (strcmp (type, "string") == 0)
+            PreparedStatement_setString (stmt, i + 1,
+                                         va_arg (args, const char *));
+        else
+            THROW (SQLException, "Invalid parameter type %s", type);
+    }
+}
+
+/*
+ * Execute @sql with the @n parameters in @args. If @res is not NULL,
+ * @sql is a query and its result is returned in @res.
+ */
+static int
+exec_statement (DBConn *dbconn, const char *sql, ResultSet_T *res,
+                int n, va_list args)
+{
+    PreparedStatement_T stmt;
+    volatile int ret = 0;
 
     TRY
-        result = Connection_executeQuery (conn, "%s", sql);
+        stmt = get_statement (dbconn, sql);
+        bind_params (stmt, n, args);
+        if (res)
+            *res = PreparedStatement_executeQuery (stmt);
+        else
+            PreparedStatement_execute (stmt);
     CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
-        return -1;
+        g_warning ("Error exec statement %s: %s.\n",
+                   sql, Exception_frame.message);
+        ret = -1;
     END_TRY;
 
-    seaf_row.res = result;
-    
-    if (ResultSet_next (result))
-        ret = seaf_db_row_get_column_int (&seaf_row, 0);
+    return ret;
+}
 
-    Connection_close (conn);
+int
+seaf_db_statement_query (SeafDB *db, const char *sql, int n, ...)
+{
+    QueryTrace qt;
+    DBConn *dbconn;
+    va_list args;
+    int ret = -1;
+
+    query_start (&qt, sql);
+
+    dbconn = get_cached_connection (db);
+    if (!dbconn)
+        goto out;
+
+    va_start (args, n);
+    ret = exec_statement (dbconn, sql, NULL, n, args);
+    va_end (args);
+
+    mark_write (db);
+
+    release_cached_connection (db, dbconn, ret < 0);
+
+out:
+    query_done (&qt, ret);
     return ret;
 }
 
-gint64
-seaf_db_get_int64 (SeafDB *db, const char *sql)
+gboolean
+seaf_db_statement_exists (SeafDB *db, const char *sql, int n, ...)
+{
+    QueryTrace qt;
+    DBConn *dbconn;
+    ResultSet_T res;
+    va_list args;
+    gboolean ret = FALSE;
+    int rc = -1;
+
+    query_start (&qt, sql);
+
+    dbconn = get_cached_connection (db);
+    if (!dbconn)
+        goto out;
+
+    va_start (args, n);
+    rc = exec_statement (dbconn, sql, &res, n, args);
+    va_end (args);
+
+    if (rc == 0)
+        ret = ResultSet_next (res);
+
+    release_cached_connection (db, dbconn, rc < 0);
+
+out:
+    query_done (&qt, rc < 0 ? -1 : ret);
+    return ret;
+}
+
+static int
+statement_foreach_row (SeafDB *db, const char *sql,
+                       SeafDBRowFunc callback, void *data,
+                       int n, va_list args)
+{
+    QueryTrace qt;
+    DBConn *dbconn;
+    ResultSet_T res;
+    int ret = -1;
+
+    query_start (&qt, sql);
+
+    dbconn = get_cached_connection (db);
+    if (!dbconn)
+        goto out;
+
+    ret = exec_statement (dbconn, sql, &res, n, args);
+    if (ret == 0)
+        ret = foreach_row (res, callback, data);
+
+    release_cached_connection (db, dbconn, ret < 0);
+
+out:
+    query_done (&qt, ret);
+    return ret;
+}
+
+int
+seaf_db_statement_foreach_row (SeafDB *db, const char *sql,
+                               SeafDBRowFunc callback, void *data,
+                               int n, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = statement_foreach_row (db, sql, callback, data, n, args);
+    va_end (args);
+
+    return ret;
+}
+
+int
+seaf_db_statement_foreach_row_replica (SeafDB *db, const char *sql,
+                                       SeafDBRowFunc callback, void *data,
+                                       int n, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = statement_foreach_row (read_db (db), sql, callback, data, n, args);
+    va_end (args);
+
+    return ret;
+}
+
+int
+seaf_db_statement_get_int (SeafDB *db, const char *sql, int n, ...)
 {
     gint64 ret = -1;
-    Connection_T conn;
-    ResultSet_T result;
-    SeafDBRow seaf_row;
+    va_list args;
 
-    conn = get_db_connection (db);
-    if (!conn)
-        return -1;
+    va_start (args, n);
+    statement_foreach_row (db, sql, get_int_cb, &ret, n, args);
+    va_end (args);
 
-    TRY
-        result = Connection_executeQuery (conn, "%s", sql);
-    CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
-        return -1;
-    END_TRY;
+    return (int)ret;
+}
+
+gint64
+seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...)
+{
+    gint64 ret = -1;
+    va_list args;
 
-    seaf_row.res = result;
-    
-    if (ResultSet_next (result))
-        ret = seaf_db_row_get_column_int64 (&seaf_row, 0);
+    va_start (args, n);
+    statement_foreach_row (db, sql, get_int_cb, &ret, n, args);
+    va_end (args);
 
-    Connection_close (conn);
     return ret;
 }
 
 char *
-seaf_db_get_string (SeafDB *db, const char *sql)
+seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...)
 {
     char *ret = NULL;
-    const char *s;
-    Connection_T conn;
-    ResultSet_T result;
-    SeafDBRow seaf_row;
+    va_list args;
 
-    conn = get_db_connection (db);
-    if (!conn)
-        return NULL;
+    va_start (args, n);
+    statement_foreach_row (db, sql, get_string_cb, &ret, n, args);
+    va_end (args);
 
-    TRY
-        result = Connection_executeQuery (conn, "%s", sql);
-    CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
-        return NULL;
-    END_TRY;
+    return ret;
+}
 
-    seaf_row.res = result;
-    
-    if (ResultSet_next (result)) {
-        s = seaf_db_row_get_column_text (&seaf_row, 0);
-        ret = g_strdup(s);
+void
+seaf_db_get_stats (SeafDB *db, SeafDBStats *st, gboolean reset)
+{
+    int i;
+
+    pthread_mutex_lock (&db->lock);
+
+    st->max_conns = db->max_conns;
+    st->idle = g_queue_get_length (db->idle_conns);
+    st->in_use = db->n_taken - st->idle;
+    st->waiters = db->n_waiters;
+    st->n_acquired = db->n_acquired;
+    st->n_waited = db->n_waited;
+    st->n_timeouts = db->n_timeouts;
+    for (i = 0; i < SEAF_DB_WAIT_BUCKETS; ++i)
+        st->wait_hist[i] = db->wait_hist[i];
+
+    if (reset) {
+        db->n_acquired = db->n_waited = db->n_timeouts = 0;
+        memset (db->wait_hist, 0, sizeof(db->wait_hist));
     }
 
-    Connection_close (conn);
-    return ret;
+    pthread_mutex_unlock (&db->lock);
 }
 
+/* Transaction related */
+
 SeafDBTrans *
 seaf_db_begin_transaction (SeafDB *db)
 {
-    Connection_T conn;
+    DBConn *conn;
     SeafDBTrans *trans;
 
     trans = g_new0 (SeafDBTrans, 1);
     if (!trans)
         return NULL;
 
-    conn = get_db_connection (db);
+    conn = get_cached_connection (db);
     if (!conn) {
         g_free (trans);
         return NULL;
     }
 
+    trans->db = db;
     trans->conn = conn;
-    Connection_beginTransaction (trans->conn);
+    Connection_beginTransaction (trans->conn->conn);
 
     return trans;
 }
@@ -346,48 +1202,86 @@ seaf_db_begin_transaction (SeafDB *db)
 void
 seaf_db_commit (SeafDBTrans *trans)
 {
-    Connection_commit (trans->conn);
-    Connection_close (trans->conn);
+    Connection_commit (trans->conn->conn);
+    mark_write (trans->db);
+    release_cached_connection (trans->db, trans->conn, FALSE);
+    g_free (trans);
 }
 
 void
 seaf_db_rollback (SeafDBTrans *trans)
 {
-    Connection_rollback (trans->conn);
-    Connection_close (trans->conn);
+    Connection_rollback (trans->conn->conn);
+    release_cached_connection (trans->db, trans->conn, FALSE);
+    g_free (trans);
+}
+
+int
+seaf_db_trans_statement_query (SeafDBTrans *trans, const char *sql, int n, ...)
+{
+    QueryTrace qt;
+    va_list args;
+    int ret;
+
+    query_start (&qt, sql);
+
+    va_start (args, n);
+    ret = exec_statement (trans->conn, sql, NULL, n, args);
+    va_end (args);
+
+    query_done (&qt, ret);
+    return ret;
+}
+
+int
+seaf_db_trans_statement_foreach_row (SeafDBTrans *trans, const char *sql,
+                                     SeafDBRowFunc callback, void *data,
+                                     int n, ...)
+{
+    QueryTrace qt;
+    ResultSet_T res;
+    va_list args;
+    int ret;
+
+    query_start (&qt, sql);
+
+    va_start (args, n);
+    ret = exec_statement (trans->conn, sql, &res, n, args);
+    va_end (args);
+
+    if (ret == 0)
+        ret = foreach_row (res, callback, data);
+
+    query_done (&qt, ret);
+    return ret;
 }
 
 int
 seaf_db_trans_query (SeafDBTrans *trans, const char *sql)
 {
-    /* Handle zdb "exception"s. */
-    TRY
-        Connection_execute (trans->conn, "%s", sql);
-        RETURN (0);
-    CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        return -1;
-    END_TRY;
+    QueryTrace qt;
+    int ret;
 
-    /* Should not be reached. */
-    return 0;
+    query_start (&qt, sql);
+    ret = exec_query (trans->conn->conn, sql, NULL);
+    query_done (&qt, ret);
+
+    return ret;
 }
 
 gboolean
 seaf_db_trans_check_for_existence (SeafDBTrans *trans, const char *sql)
 {
+    QueryTrace qt;
     ResultSet_T result;
-    gboolean ret = TRUE;
-
-    TRY
-        result = Connection_executeQuery (trans->conn, "%s", sql);
-    CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        return FALSE;
-    END_TRY;
+    gboolean ret = FALSE;
+    int rc;
 
-    if (!ResultSet_next (result))
-        ret = FALSE;
+    query_start (&qt, sql);
+    rc = exec_query (trans->conn->conn, sql, &result);
+    if (rc == 0)
+        ret = ResultSet_next (result);
+    query_done (&qt, rc < 0 ? -1 : ret);
 
     return ret;
 }
@@ -396,23 +1290,143 @@ int
 seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql, 
                               SeafDBRowFunc callback, void *data)
 {
+    QueryTrace qt;
     ResultSet_T result;
-    SeafDBRow seaf_row;
-    int n_rows = 0;
+    int ret;
 
-    TRY
-        result = Connection_executeQuery (trans->conn, "%s", sql);
-    CATCH (SQLException)
-        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        return -1;
-    END_TRY;
+    query_start (&qt, sql);
+    ret = exec_query (trans->conn->conn, sql, &result);
+    if (ret == 0)
+        ret = foreach_row (result, callback, data);
+    query_done (&qt, ret);
 
-    seaf_row.res = result;
-    while (ResultSet_next (result)) {
-        n_rows++;
-        if (!callback (&seaf_row, data))
+    return ret;
+}
+
+/* Batches */
+
+struct SeafDBBatch {
+    GPtrArray *stmts;
+    /* The multi-row INSERT being built. */
+    char *head;
+    GString *insert;
+    int n_rows;
+};
+
+SeafDBBatch *
+seaf_db_batch_new ()
+{
+    SeafDBBatch *batch = g_new0 (SeafDBBatch, 1);
+
+    batch->stmts = g_ptr_array_new_with_free_func (g_free);
+    return batch;
+}
+
+void
+seaf_db_batch_free (SeafDBBatch *batch)
+{
+    if (!batch)
+        return;
+
+    g_ptr_array_free (batch->stmts, TRUE);
+    g_free (batch->head);
+    if (batch->insert)
+        g_string_free (batch->insert, TRUE);
+    g_free (batch);
+}
+
+static void
+finish_insert (SeafDBBatch *batch)
+{
+    if (!batch->insert)
+        return;
+
+    g_ptr_array_add (batch->stmts, g_string_free (batch->insert, FALSE));
+    batch->insert = NULL;
+    g_free (batch->head);
+    batch->head = NULL;
+    batch->n_rows = 0;
+}
+
+void
+seaf_db_batch_add (SeafDBBatch *batch, const char *fmt, ...)
+{
+    va_list args;
+
+    finish_insert (batch);
+
+    va_start (args, fmt);
+    g_ptr_array_add (batch->stmts, g_strdup_vprintf (fmt, args));
+    va_end (args);
+}
+
+void
+seaf_db_batch_add_row (SeafDBBatch *batch, const char *head,
+                       const char *fmt, ...)
+{
+    va_list args;
+
+    if (batch->insert && strcmp (batch->head, head) != 0)
+        finish_insert (batch);
+
+    if (!batch->insert) {
+        batch->head = g_strdup (head);
+        batch->insert = g_string_new (head);
+        g_string_append_c (batch->insert, ' ');
+    } else
+        g_string_append (batch->insert, ", ");
+
+    va_start (args, fmt);
+    g_string_append_vprintf (batch->insert, fmt, args);
+    va_end (args);
+
+    if (++batch->n_rows >= MAX_ROWS_PER_INSERT ||
+        batch->insert->len >= MAX_INSERT_LEN)
+        finish_insert (batch);
+}
+
+gboolean
+seaf_db_batch_is_empty (SeafDBBatch *batch)
+{
+    return (batch->stmts->len == 0 && !batch->insert);
+}
+
+int
+seaf_db_trans_batch_exec (SeafDBTrans *trans, SeafDBBatch *batch)
+{
+    guint i;
+    int ret = 0;
+
+    finish_insert (batch);
+
+    for (i = 0; i < batch->stmts->len; ++i) {
+        if (seaf_db_trans_query (trans, g_ptr_array_index (batch->stmts, i)) < 0) {
+            ret = -1;
             break;
+        }
     }
 
-    return n_rows;
+    g_ptr_array_set_size (batch->stmts, 0);
+    return ret;
+}
+
+int
+seaf_db_batch_exec (SeafDB *db, SeafDBBatch *batch)
+{
+    SeafDBTrans *trans;
+
+    if (seaf_db_batch_is_empty (batch))
+        return 0;
+
+    trans = seaf_db_begin_transaction (db);
+    if (!trans)
+        return -1;
+
+    if (seaf_db_trans_batch_exec (trans, batch) < 0) {
+        seaf_db_rollback (trans);
+        return -1;
+    }
+
+    seaf_db_commit (trans);
+    return 0;
 }
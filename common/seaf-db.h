@@ -12,15 +12,22 @@ typedef struct SeafDBTrans SeafDBTrans;
 
 typedef gboolean (*SeafDBRowFunc) (SeafDBRow *, void *);
 
+/*
+ * At most @max_connections are opened. When they are all in use, callers
+ * wait up to @wait_timeout msecs for one to be released, and fail after
+ * that. Pass 0 for the defaults.
+ */
 SeafDB *
 seaf_db_new_mysql (const char *host, 
                    const char *user, 
                    const char *passwd,
                    const char *db,
-                   const char *unix_socket);
+                   const char *unix_socket,
+                   int max_connections,
+                   int wait_timeout);
 
 SeafDB *
-seaf_db_new_sqlite (const char *db_path);
+seaf_db_new_sqlite (const char *db_path, int max_connections, int wait_timeout);
 
 void
 seaf_db_free (SeafDB *db);
@@ -28,6 +35,51 @@ seaf_db_free (SeafDB *db);
 int
 seaf_db_type (SeafDB *db);
 
+/*
+ * Let the *_replica reads below go to @replica, a MySQL replica of @db,
+ * while it is at most @max_lag seconds behind. All other queries always
+ * go to @db. After a thread writes, its replica reads go to @db for
+ * @max_lag seconds. @replica is freed with @db.
+ */
+void
+seaf_db_add_replica (SeafDB *db, SeafDB *replica, int max_lag);
+
+/* Waits below 1ms, 10ms, 100ms, 1s and above. */
+#define SEAF_DB_WAIT_BUCKETS 5
+
+typedef struct SeafDBStats {
+    int max_conns;
+    int in_use;
+    int idle;
+    int waiters;
+    /* Since the start or the last reset. */
+    guint64 n_acquired;
+    guint64 n_waited;
+    guint64 n_timeouts;
+    guint64 wait_hist[SEAF_DB_WAIT_BUCKETS];
+} SeafDBStats;
+
+/* If @reset is TRUE the counters start over. */
+void
+seaf_db_get_stats (SeafDB *db, SeafDBStats *st, gboolean reset);
+
+/*
+ * Every query is timed and counted by its statement, with the values
+ * in it replaced by "?". Queries that take at least @msec are logged
+ * with the function that made them. 0 turns the log off, the default.
+ */
+void
+seaf_db_set_slow_query_threshold (int msec);
+
+/*
+ * One line per statement, the most time consuming first:
+ * calls \t errors \t rows \t total_ms \t avg_ms \t max_ms \t sql
+ * rows are the rows returned by queries. If @reset is TRUE the counts
+ * start over.
+ */
+void
+seaf_db_format_query_stats (GString *buf, gboolean reset);
+
 int
 seaf_db_query (SeafDB *db, const char *sql);
 
@@ -38,6 +90,16 @@ int
 seaf_db_foreach_selected_row (SeafDB *db, const char *sql, 
                               SeafDBRowFunc callback, void *data);
 
+/*
+ * Like seaf_db_foreach_selected_row(), but may be sent to a replica, see
+ * seaf_db_add_replica(). The rows can miss recent writes, even writes of
+ * the calling thread. Only for reads that can be stale, such as listings
+ * and statistics, never for reads that fill a cache.
+ */
+int
+seaf_db_foreach_selected_row_replica (SeafDB *db, const char *sql,
+                                      SeafDBRowFunc callback, void *data);
+
 const char *
 seaf_db_row_get_column_text (SeafDBRow *row, guint32 idx);
 
@@ -56,6 +118,46 @@ seaf_db_get_int64 (SeafDB *db, const char *sql);
 char *
 seaf_db_get_string (SeafDB *db, const char *sql);
 
+/*
+ * Prepared statements.
+ *
+ * The statements are prepared once per connection and cached. @n is the
+ * number of parameters, which follow as (type, value) pairs, with type in
+ * "int", "int64" and "string", e.g.
+ *
+ *     seaf_db_statement_query (db, "DELETE FROM Repo WHERE repo_id=?",
+ *                              1, "string", repo_id);
+ *
+ * Use them for frequent queries, with "?" placeholders instead of
+ * printing the values into the sql, which also saves escaping them.
+ */
+
+int
+seaf_db_statement_query (SeafDB *db, const char *sql, int n, ...);
+
+gboolean
+seaf_db_statement_exists (SeafDB *db, const char *sql, int n, ...);
+
+int
+seaf_db_statement_foreach_row (SeafDB *db, const char *sql,
+                               SeafDBRowFunc callback, void *data,
+                               int n, ...);
+
+/* See seaf_db_foreach_selected_row_replica(). */
+int
+seaf_db_statement_foreach_row_replica (SeafDB *db, const char *sql,
+                                       SeafDBRowFunc callback, void *data,
+                                       int n, ...);
+
+int
+seaf_db_statement_get_int (SeafDB *db, const char *sql, int n, ...);
+
+gint64
+seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...);
+
+char *
+seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...);
+
 /* Transaction related */
 
 SeafDBTrans *
@@ -77,4 +179,102 @@ int
 seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql,
                                     SeafDBRowFunc callback, void *data);
 
+int
+seaf_db_trans_statement_query (SeafDBTrans *trans, const char *sql, int n, ...);
+
+int
+seaf_db_trans_statement_foreach_row (SeafDBTrans *trans, const char *sql,
+                                     SeafDBRowFunc callback, void *data,
+                                     int n, ...);
+
+/*
+ * Batches of statements, run in one transaction with a single commit.
+ *
+ * Consecutive rows added with seaf_db_batch_add_row() and the same @head
+ * are sent as one multi-row INSERT:
+ *
+ *     seaf_db_batch_add_row (batch, "INSERT INTO RepoOwner VALUES",
+ *                            "('%s', '%s')", repo_id, email);
+ *
+ * Like the text queries above, the values must be escaped by the caller.
+ */
+
+typedef struct SeafDBBatch SeafDBBatch;
+
+SeafDBBatch *
+seaf_db_batch_new ();
+
+void
+seaf_db_batch_free (SeafDBBatch *batch);
+
+void
+seaf_db_batch_add (SeafDBBatch *batch, const char *fmt, ...);
+
+void
+seaf_db_batch_add_row (SeafDBBatch *batch, const char *head,
+                       const char *fmt, ...);
+
+gboolean
+seaf_db_batch_is_empty (SeafDBBatch *batch);
+
+/* Runs the batch in a new transaction. Rolled back on error. */
+int
+seaf_db_batch_exec (SeafDB *db, SeafDBBatch *batch);
+
+/* Runs the batch in @trans, the batch is empty afterwards. */
+int
+seaf_db_trans_batch_exec (SeafDBTrans *trans, SeafDBBatch *batch);
+
+/*
+ * The calling function of a query, for the slow query log. The wrappers
+ * below record it before each call.
+ */
+void
+seaf_db_set_caller (const char *func);
+
+#ifndef SEAF_DB_NO_CALLER
+
+#define SEAF_DB_CALL(func, ...) \
+    (seaf_db_set_caller (G_STRFUNC), func (__VA_ARGS__))
+
+#define seaf_db_query(...) SEAF_DB_CALL (seaf_db_query, __VA_ARGS__)
+#define seaf_db_check_for_existence(...) \
+    SEAF_DB_CALL (seaf_db_check_for_existence, __VA_ARGS__)
+#define seaf_db_foreach_selected_row(...) \
+    SEAF_DB_CALL (seaf_db_foreach_selected_row, __VA_ARGS__)
+#define seaf_db_foreach_selected_row_replica(...) \
+    SEAF_DB_CALL (seaf_db_foreach_selected_row_replica, __VA_ARGS__)
+#define seaf_db_get_int(...) SEAF_DB_CALL (seaf_db_get_int, __VA_ARGS__)
+#define seaf_db_get_int64(...) SEAF_DB_CALL (seaf_db_get_int64, __VA_ARGS__)
+#define seaf_db_get_string(...) SEAF_DB_CALL (seaf_db_get_string, __VA_ARGS__)
+#define seaf_db_statement_query(...) \
+    SEAF_DB_CALL (seaf_db_statement_query, __VA_ARGS__)
+#define seaf_db_statement_exists(...) \
+    SEAF_DB_CALL (seaf_db_statement_exists, __VA_ARGS__)
+#define seaf_db_statement_foreach_row(...) \
+    SEAF_DB_CALL (seaf_db_statement_foreach_row, __VA_ARGS__)
+#define seaf_db_statement_foreach_row_replica(...) \
+    SEAF_DB_CALL (seaf_db_statement_foreach_row_replica, __VA_ARGS__)
+#define seaf_db_statement_get_int(...) \
+    SEAF_DB_CALL (seaf_db_statement_get_int, __VA_ARGS__)
+#define seaf_db_statement_get_int64(...) \
+    SEAF_DB_CALL (seaf_db_statement_get_int64, __VA_ARGS__)
+#define seaf_db_statement_get_string(...) \
+    SEAF_DB_CALL (seaf_db_statement_get_string, __VA_ARGS__)
+#define seaf_db_trans_query(...) \
+    SEAF_DB_CALL (seaf_db_trans_query, __VA_ARGS__)
+#define seaf_db_trans_check_for_existence(...) \
+    SEAF_DB_CALL (seaf_db_trans_check_for_existence, __VA_ARGS__)
+#define seaf_db_trans_foreach_selected_row(...) \
+    SEAF_DB_CALL (seaf_db_trans_foreach_selected_row, __VA_ARGS__)
+#define seaf_db_trans_statement_query(...) \
+    SEAF_DB_CALL (seaf_db_trans_statement_query, __VA_ARGS__)
+#define seaf_db_trans_statement_foreach_row(...) \
+    SEAF_DB_CALL (seaf_db_trans_statement_foreach_row, __VA_ARGS__)
+#define seaf_db_batch_exec(...) SEAF_DB_CALL (seaf_db_batch_exec, __VA_ARGS__)
+#define seaf_db_trans_batch_exec(...) \
+    SEAF_DB_CALL (seaf_db_trans_batch_exec, __VA_ARGS__)
+
+#endif
+
 #endif
@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_PROBES_H
+#define SEAF_PROBES_H
+
+/*
+ * Static tracepoints (USDT) on the hot paths, built with
+ * --enable-usdt. A probe is a nop in the code until a tracer attaches
+ * to it, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/bin/seaf-server:seafile:db_query_start
+ *                { @start[tid] = nsecs; }
+ *                usdt:/usr/bin/seaf-server:seafile:db_query_done
+ *                /@start[tid]/
+ *                { @us = hist((nsecs - @start[tid]) / 1000);
+ *                  delete(@start[tid]); }'
+ *
+ * Every *_start probe has a matching *_done probe fired by the same
+ * thread, except for the processors, which are matched by the
+ * processor pointer. The probes are:
+ *
+ *   block_open        (block_id, rw_type, handle)
+ *   block_read_start  (handle, len)
+ *   block_read_done   (handle, ret)
+ *   block_write_start (handle, len)
+ *   block_write_done  (handle, ret)
+ *   block_commit_start (handle)
+ *   block_commit_done (handle, ret)
+ *   obj_read_start    (obj_type, obj_id)
+ *   obj_read_done     (obj_type, obj_id, ret, len)
+ *   obj_write_start   (obj_type, obj_id, len)
+ *   obj_write_done    (obj_type, obj_id, ret)
+ *   db_query_start    (sql)
+ *   db_query_done     (sql, ret)
+ *   proc_start        (processor, name, peer_id)
+ *   proc_done         (processor, name, failure)
+ *   http_request_start (request, method, path)
+ *   http_request_done (request, status)
+ *
+ * Arguments are ints, pointers or C strings; obj_type is "fs" or
+ * "commits", failure is the processor's failure code, PROC_DONE if it
+ * succeeded, method is an htp_method and status the HTTP status.
+ */
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define SEAF_PROBE1(name, a) \
+    DTRACE_PROBE1 (seafile, name, a)
+#define SEAF_PROBE2(name, a, b) \
+    DTRACE_PROBE2 (seafile, name, a, b)
+#define SEAF_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3 (seafile, name, a, b, c)
+#define SEAF_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4 (seafile, name, a, b, c, d)
+
+#else
+
+#define SEAF_PROBE1(name, a) do {} while (0)
+#define SEAF_PROBE2(name, a, b) do {} while (0)
+#define SEAF_PROBE3(name, a, b, c) do {} while (0)
+#define SEAF_PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif
+
+/* In the start and release_resource of a processor. */
+#define SEAF_PROBE_PROC_START(processor)                        \
+    SEAF_PROBE3 (proc_start, processor, GET_PNAME(processor),   \
+                 (processor)->peer_id)
+#define SEAF_PROBE_PROC_DONE(processor)                         \
+    SEAF_PROBE3 (proc_done, processor, GET_PNAME(processor),    \
+                 (processor)->failure)
+
+#endif
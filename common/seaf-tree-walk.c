@@ -50,11 +50,35 @@ char *make_traverse_path(char *path, const struct traverse_info *info, const str
 	return path;
 }
 
+/*
+ * All trees have the same subtree at this name, and the walk asked not
+ * to descend into those.
+ */
+static gboolean
+is_same_subtree (int n, unsigned long mask, unsigned long dirmask,
+                 struct name_entry *entries)
+{
+    unsigned long all = (1UL << n) - 1;
+    int i;
+
+    if (n < 2 || mask != all || dirmask != all)
+        return FALSE;
+
+    for (i = 1; i < n; ++i) {
+        if (entries[i].mode != entries[0].mode ||
+            memcmp (entries[i].sha1, entries[0].sha1, 20) != 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
 int
 traverse_trees(int n, struct tree_desc *t, struct traverse_info *info)
 {
-    struct name_entry *entries = g_new0 (struct name_entry, n);
-    GList **ptrs = g_new0 (GList *, n);
+    /* Called once for every dir of the walk, keep it off the heap. */
+    struct name_entry entries[MAX_TRAVERSE_TREES];
+    GList *ptrs[MAX_TRAVERSE_TREES];
     int i;
     SeafDirent *dent;
     char *first_name;
@@ -62,6 +86,11 @@ traverse_trees(int n, struct tree_desc *t, struct traverse_info *info)
     unsigned long mask = 0, dirmask = 0;
     int error = 0, ret;
 
+    if (n > MAX_TRAVERSE_TREES) {
+        g_warning ("Too many trees to traverse: %d.\n", n);
+        return -1;
+    }
+
     for (i = 0; i < n; ++i) {
         if (t[i].tree)
             ptrs[i] = t[i].tree->entries;
@@ -113,13 +142,15 @@ traverse_trees(int n, struct tree_desc *t, struct traverse_info *info)
             }
         }
 
+        if (info->prune_same_trees &&
+            is_same_subtree (n, mask, dirmask, entries))
+            continue;
+
         ret = info->fn (n, mask, dirmask, entries, info);
         if (ret < 0) {
             error = ret;
         }
     }
 
-    g_free (entries);
-    g_free (ptrs);
     return error;
 }
@@ -10,6 +10,8 @@ struct name_entry {
 	unsigned int mode;
 };
 
+#define MAX_TRAVERSE_TREES 8
+
 struct tree_desc {
 	SeafDir *tree;
 };
@@ -33,6 +35,11 @@ struct traverse_info {
 	traverse_callback_t fn;
 	void *data;
 	int show_all_errors;
+	/*
+	 * Don't call fn for a dir that is the same subtree in all the
+	 * trees. Only for walks that have nothing to do in such dirs.
+	 */
+	int prune_same_trees;
 };
 
 void fill_tree_descriptor(struct tree_desc *desc, const char *root_id);
@@ -3,9 +3,15 @@
 #include "seafile-session.h"
 #include "seaf-utils.h"
 #include "seaf-db.h"
+#ifdef SEAFILE_SERVER
+#include "backend-stats.h"
+#include "metrics.h"
+#endif
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 char *
 seafile_session_get_tmp_file_path (SeafileSession *session,
@@ -26,13 +32,27 @@ seafile_session_get_tmp_file_path (SeafileSession *session,
 
 #define SQLITE_DB_NAME "seafile.db"
 
+static void
+get_pool_config (SeafileSession *session, int *max_connections,
+                 int *wait_timeout)
+{
+    /* 0 if not set, the db uses the defaults then. */
+    *max_connections = g_key_file_get_integer (session->config, "database",
+                                               "max_connections", NULL);
+    *wait_timeout = g_key_file_get_integer (session->config, "database",
+                                            "connection_wait_timeout", NULL);
+}
+
 static int
 sqlite_db_start (SeafileSession *session)
 {
     char *db_path;
+    int max_connections, wait_timeout;
+
+    get_pool_config (session, &max_connections, &wait_timeout);
 
     db_path = g_build_filename (session->seaf_dir, SQLITE_DB_NAME, NULL);
-    session->db = seaf_db_new_sqlite (db_path);
+    session->db = seaf_db_new_sqlite (db_path, max_connections, wait_timeout);
     if (!session->db) {
         g_warning ("Failed to start sqlite db.\n");
         return -1;
@@ -41,10 +61,56 @@ sqlite_db_start (SeafileSession *session)
     return 0;
 }
 
+#define DEFAULT_MAX_REPLICA_LAG 5
+
+/* "replicas" is a comma separated list of hosts, with the same user and
+ * database as the primary. */
+static void
+add_replicas (SeafileSession *session, const char *user, const char *passwd,
+              const char *db_name, int max_connections, int wait_timeout)
+{
+    char *value, **hosts, **ptr;
+    int max_lag;
+    SeafDB *replica;
+    GError *error = NULL;
+
+    value = g_key_file_get_string (session->config,
+                                   "database", "replicas", NULL);
+    if (!value)
+        return;
+
+    max_lag = g_key_file_get_integer (session->config,
+                                      "database", "max_replica_lag", &error);
+    if (error) {
+        max_lag = DEFAULT_MAX_REPLICA_LAG;
+        g_clear_error (&error);
+    }
+
+    hosts = g_strsplit (value, ",", -1);
+    for (ptr = hosts; *ptr; ++ptr) {
+        g_strstrip (*ptr);
+        if (**ptr == '\0')
+            continue;
+
+        replica = seaf_db_new_mysql (*ptr, user, passwd, db_name, NULL,
+                                     max_connections, wait_timeout);
+        if (!replica) {
+            g_warning ("Failed to start mysql replica %s.\n", *ptr);
+            continue;
+        }
+        seaf_db_add_replica (session->db, replica, max_lag);
+        g_message ("Added mysql read replica %s.\n", *ptr);
+    }
+
+    g_strfreev (hosts);
+    g_free (value);
+}
+
 static int
 mysql_db_start (SeafileSession *session)
 {
     char *host, *user, *passwd, *db, *unix_socket;
+    int max_connections, wait_timeout;
     GError *error = NULL;
 
     host = g_key_file_get_string (session->config, "database", "host", &error);
@@ -77,12 +143,17 @@ mysql_db_start (SeafileSession *session)
         g_warning ("Unix socket path not set in config.\n");
     }
 
-    session->db = seaf_db_new_mysql (host, user, passwd, db, unix_socket);
+    get_pool_config (session, &max_connections, &wait_timeout);
+
+    session->db = seaf_db_new_mysql (host, user, passwd, db, unix_socket,
+                                     max_connections, wait_timeout);
     if (!session->db) {
         g_warning ("Failed to start mysql db.\n");
         return -1;
     }
 
+    add_replicas (session, user, passwd, db, max_connections, wait_timeout);
+
     g_free (host);
     g_free (user);
     g_free (passwd);
@@ -96,6 +167,7 @@ int
 load_database_config (SeafileSession *session)
 {
     char *type;
+    int ret;
     GError *error = NULL;
 
     type = g_key_file_get_string (session->config, "database", "type", &error);
@@ -104,15 +176,176 @@ load_database_config (SeafileSession *session)
         type = "sqlite";
 
     if (strcasecmp (type, "sqlite") == 0) {
-        return sqlite_db_start (session);
+        ret = sqlite_db_start (session);
     } else if (strcasecmp (type, "mysql") == 0) {
-        return mysql_db_start (session);
+        ret = mysql_db_start (session);
     } else {
         g_warning ("Unsupported db type %s.\n", type);
         return -1;
     }
 
-    return 0;
+    /* In msecs, off if not set. */
+    seaf_db_set_slow_query_threshold (
+        g_key_file_get_integer (session->config, "database",
+                                "slow_query_threshold", NULL));
+
+    return ret;
+}
+
+#define N_STORES 3
+
+static const char *store_names[N_STORES] = { "fs", "commits", "blocks" };
+
+static void
+append_backend_counter (GString *buf, const char *name, const char *help,
+                        BackendOpStats st[][N_BACKEND_OPS], gsize offset)
+{
+    int i, op;
+
+    metrics_format_family (buf, name, "counter", help);
+    for (i = 0; i < N_STORES; ++i)
+        for (op = 0; op < N_BACKEND_OPS; ++op)
+            if (st[i][op].n_ops > 0)
+                g_string_append_printf (buf, "%s{store=\"%s\",op=\"%s\"} %"
+                                        G_GUINT64_FORMAT"\n", name,
+                                        store_names[i],
+                                        backend_stats_op_name (op),
+                                        G_STRUCT_MEMBER (guint64, &st[i][op],
+                                                         offset));
+}
+
+static void
+collect_backend_metrics (GString *buf, SeafileSession *session)
+{
+    BackendStats *stats[N_STORES];
+    BackendOpStats st[N_STORES][N_BACKEND_OPS];
+    static const char *quantiles[] = { "0.5", "0.99", "0.999" };
+    guint64 values[3];
+    int i, op, q;
+
+    stats[0] = seaf_obj_store_get_backend_stats (session->fs_mgr->obj_store);
+    stats[1] = seaf_obj_store_get_backend_stats (session->commit_mgr->obj_store);
+    stats[2] = session->block_mgr->stats;
+
+    memset (st, 0, sizeof(st));
+    for (i = 0; i < N_STORES; ++i)
+        for (op = 0; stats[i] && op < N_BACKEND_OPS; ++op)
+            backend_stats_get (stats[i], op, &st[i][op], FALSE);
+
+    append_backend_counter (buf, "seaf_backend_ops_total",
+                            "Calls into the storage backends.",
+                            st, G_STRUCT_OFFSET (BackendOpStats, n_ops));
+    append_backend_counter (buf, "seaf_backend_errors_total",
+                            "Failed calls into the storage backends.",
+                            st, G_STRUCT_OFFSET (BackendOpStats, n_errors));
+    append_backend_counter (buf, "seaf_backend_bytes_total",
+                            "Bytes read from and written to the storage backends.",
+                            st, G_STRUCT_OFFSET (BackendOpStats, bytes));
+
+    metrics_format_family (buf, "seaf_backend_latency_seconds", "summary",
+                           "Latency of the storage backend calls.");
+    for (i = 0; i < N_STORES; ++i) {
+        for (op = 0; op < N_BACKEND_OPS; ++op) {
+            const char *op_name = backend_stats_op_name (op);
+
+            if (st[i][op].n_ops == 0)
+                continue;
+            values[0] = st[i][op].p50;
+            values[1] = st[i][op].p99;
+            values[2] = st[i][op].p999;
+            for (q = 0; q < 3; ++q)
+                g_string_append_printf (buf, "seaf_backend_latency_seconds"
+                                        "{store=\"%s\",op=\"%s\",quantile=\"%s\"} "
+                                        "%.6f\n", store_names[i], op_name,
+                                        quantiles[q], values[q] / 1e6);
+            g_string_append_printf (buf, "seaf_backend_latency_seconds_sum"
+                                    "{store=\"%s\",op=\"%s\"} %.6f\n"
+                                    "seaf_backend_latency_seconds_count"
+                                    "{store=\"%s\",op=\"%s\"} %"
+                                    G_GUINT64_FORMAT"\n",
+                                    store_names[i], op_name,
+                                    st[i][op].total_usec / 1e6,
+                                    store_names[i], op_name, st[i][op].n_ops);
+        }
+    }
+}
+
+static void
+collect_db_metrics (GString *buf, SeafDB *db)
+{
+    static const char *bounds[SEAF_DB_WAIT_BUCKETS] = {
+        "0.001", "0.01", "0.1", "1", "+Inf",
+    };
+    SeafDBStats st;
+    guint64 n = 0;
+    int i;
+
+    seaf_db_get_stats (db, &st, FALSE);
+
+    metrics_format_family (buf, "seaf_db_connections", "gauge",
+                           "Database connections by state.");
+    g_string_append_printf (buf, "seaf_db_connections{state=\"in_use\"} %d\n"
+                            "seaf_db_connections{state=\"idle\"} %d\n",
+                            st.in_use, st.idle);
+    metrics_format_family (buf, "seaf_db_max_connections", "gauge",
+                           "Size of the database connection pool.");
+    g_string_append_printf (buf, "seaf_db_max_connections %d\n", st.max_conns);
+    metrics_format_family (buf, "seaf_db_waiters", "gauge",
+                           "Threads waiting for a database connection.");
+    g_string_append_printf (buf, "seaf_db_waiters %d\n", st.waiters);
+    metrics_format_family (buf, "seaf_db_acquired_total", "counter",
+                           "Database connections taken from the pool.");
+    g_string_append_printf (buf, "seaf_db_acquired_total %"G_GUINT64_FORMAT"\n",
+                            st.n_acquired);
+    metrics_format_family (buf, "seaf_db_timeouts_total", "counter",
+                           "Waits for a database connection that timed out.");
+    g_string_append_printf (buf, "seaf_db_timeouts_total %"G_GUINT64_FORMAT"\n",
+                            st.n_timeouts);
+
+    /* The pool doesn't keep the sum of the waits. */
+    metrics_format_family (buf, "seaf_db_waits_total", "counter",
+                           "Waits for a database connection not longer than le seconds.");
+    for (i = 0; i < SEAF_DB_WAIT_BUCKETS; ++i) {
+        n += st.wait_hist[i];
+        g_string_append_printf (buf, "seaf_db_waits_total{le=\"%s\"} %"
+                                G_GUINT64_FORMAT"\n", bounds[i], n);
+    }
+}
+
+static void
+collect_session_metrics (GString *buf, void *data)
+{
+    SeafileSession *session = data;
+
+    collect_backend_metrics (buf, session);
+    if (session->db)
+        collect_db_metrics (buf, session->db);
+}
+
+void
+seaf_add_session_metrics (SeafileSession *session)
+{
+    metrics_add_collector (collect_session_metrics, session);
+}
+
+void
+seaf_notify_ready ()
+{
+    const char *env = g_getenv (SEAF_READY_FD_ENV);
+    int fd;
+
+    if (!env)
+        return;
+
+    fd = atoi (env);
+    if (fd > 2) {
+        if (write (fd, "READY\n", 6) != 6)
+            seaf_warning ("Failed to notify readiness: %s.\n", strerror(errno));
+        close (fd);
+    }
+
+    /* Not for the processes we spawn. */
+    g_unsetenv (SEAF_READY_FD_ENV);
 }
 
 #endif
@@ -3,6 +3,10 @@
 
 struct _SeafileSession;
 
+/* Names the write end of a pipe, on which a child of seafile-controller
+ * reports that it finished starting up. */
+#define SEAF_READY_FD_ENV "SEAFILE_READY_FD"
+
 
 char *
 seafile_session_get_tmp_file_path (struct _SeafileSession *session,
@@ -12,6 +16,15 @@ seafile_session_get_tmp_file_path (struct _SeafileSession *session,
 #ifdef SEAFILE_SERVER
 int
 load_database_config (struct _SeafileSession *session);
+
+/* Export the statistics of the backends and the database of @session
+ * in the metrics. */
+void
+seaf_add_session_metrics (struct _SeafileSession *session);
+
+/* Notify the controller, if any, that the service is ready. */
+void
+seaf_notify_ready ();
 #endif
 
 #endif
@@ -12,6 +12,11 @@
 #define KEY_DB_USER "db_user"
 #define KEY_DB_PASSWD "db_passwd"
 #define KEY_DB_NAME "db_name"
+#define KEY_LOW_MEMORY "low_memory"
+/* "true" once an open hook that calls seafile_hydrate_file() is installed. */
+#define KEY_HYDRATE_HOOK "hydrate_hook"
+/* History fetched by clones: "all", "head", <N> commits or <N>d days. */
+#define KEY_CLONE_HISTORY "clone_history"
 
 /*
  * Returns: config value in string. The string should be freed by caller. 
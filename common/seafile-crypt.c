@@ -52,6 +52,92 @@ seafile_generate_enc_key (const char *data_in, int in_len, int version,
                                iv); /* IV, initial vector */
 }
 
+int
+seafile_cipher_init (SeafileCipher *cipher, SeafileCrypt *crypt, int encrypt)
+{
+    const EVP_CIPHER *type;
+    int ret;
+
+    if (crypt->version >= 1)
+        type = EVP_aes_128_cbc();
+    else
+        type = EVP_aes_128_ecb();
+
+    EVP_CIPHER_CTX_init (&cipher->ctx);
+    memcpy (cipher->iv, crypt->iv, sizeof(cipher->iv));
+
+    /* The key schedule is only computed here. */
+    ret = EVP_CipherInit_ex (&cipher->ctx, type, NULL,
+                             crypt->key, crypt->iv, encrypt ? 1 : 0);
+    if (ret == ENC_FAILURE) {
+        EVP_CIPHER_CTX_cleanup (&cipher->ctx);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+seafile_cipher_cleanup (SeafileCipher *cipher)
+{
+    EVP_CIPHER_CTX_cleanup (&cipher->ctx);
+}
+
+int
+seafile_cipher_begin (SeafileCipher *cipher)
+{
+    /* Keep the cipher, key and direction, only reset the IV and the
+     * buffered partial block. */
+    if (EVP_CipherInit_ex (&cipher->ctx, NULL, NULL, NULL,
+                           cipher->iv, -1) == ENC_FAILURE)
+        return -1;
+    return 0;
+}
+
+int
+seafile_cipher_update (SeafileCipher *cipher,
+                       const char *in, int in_len,
+                       char *out, int *out_len)
+{
+    if (EVP_CipherUpdate (&cipher->ctx,
+                          (unsigned char *)out, out_len,
+                          (const unsigned char *)in, in_len) == ENC_FAILURE)
+        return -1;
+    return 0;
+}
+
+int
+seafile_cipher_final (SeafileCipher *cipher, char *out, int *out_len)
+{
+    if (EVP_CipherFinal_ex (&cipher->ctx,
+                            (unsigned char *)out, out_len) == ENC_FAILURE)
+        return -1;
+    return 0;
+}
+
+int
+seafile_cipher_block (SeafileCipher *cipher,
+                      const char *in, int in_len,
+                      char *out, int *out_len)
+{
+    int update_len, final_len;
+
+    *out_len = -1;
+
+    if (seafile_cipher_begin (cipher) < 0)
+        return -1;
+
+    if (seafile_cipher_update (cipher, in, in_len, out, &update_len) < 0)
+        return -1;
+
+    /* Finish the possible partial block. */
+    if (seafile_cipher_final (cipher, out + update_len, &final_len) < 0)
+        return -1;
+
+    *out_len = update_len + final_len;
+    return 0;
+}
+
 int
 seafile_encrypt (char **data_out,
                  int *out_len,
@@ -59,6 +145,9 @@ seafile_encrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt)
 {
+    SeafileCipher cipher;
+    int blks;
+
     *data_out = NULL;
     *out_len = -1;
 
@@ -68,91 +157,33 @@ seafile_encrypt (char **data_out,
         return -1;
     }
 
-    EVP_CIPHER_CTX ctx;
-    int ret;
-    int blks;
-
-    /* Prepare CTX for encryption. */
-    EVP_CIPHER_CTX_init (&ctx);
-
-    if (crypt->version >= 1)
-        ret = EVP_EncryptInit_ex (&ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_EncryptInit_ex (&ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == ENC_FAILURE)
+    if (seafile_cipher_init (&cipher, crypt, 1) < 0)
         return -1;
 
-    /* Allocating output buffer. */
-    
     /*
       For EVP symmetric encryption, padding is always used __even if__
       data size is a multiple of block size, in which case the padding
       length is the block size. so we have the following:
     */
-    
     blks = (in_len / BLK_SIZE) + 1;
 
     *data_out = (char *)g_malloc (blks * BLK_SIZE);
 
-    if (*data_out == NULL) {
-        g_warning ("failed to allocate the ouput buffer.\n");
-        goto enc_error;
-    }                
-
-    int update_len, final_len;
-
-    /* Do the encryption. */
-    ret = EVP_EncryptUpdate (&ctx,
-                             (unsigned char*)*data_out,
-                             &update_len,
-                             (unsigned char*)data_in,
-                             in_len);
-
-    if (ret == ENC_FAILURE)
-        goto enc_error;
-
-
-    /* Finish the possible partial block. */
-    ret = EVP_EncryptFinal_ex (&ctx,
-                               (unsigned char*)*data_out + update_len,
-                               &final_len);
-
-    *out_len = update_len + final_len;
-
     /* out_len should be equal to the allocated buffer size. */
-    if (ret == ENC_FAILURE || *out_len != (blks * BLK_SIZE))
-        goto enc_error;
-    
-    EVP_CIPHER_CTX_cleanup (&ctx);
-
-    return 0;
-
-enc_error:
-
-    EVP_CIPHER_CTX_cleanup (&ctx);
-
-    *out_len = -1;
-
-    if (*data_out != NULL)
+    if (seafile_cipher_block (&cipher, data_in, in_len,
+                              *data_out, out_len) < 0 ||
+        *out_len != (blks * BLK_SIZE)) {
+        seafile_cipher_cleanup (&cipher);
         g_free (*data_out);
+        *data_out = NULL;
+        *out_len = -1;
+        return -1;
+    }
 
-    *data_out = NULL;
+    seafile_cipher_cleanup (&cipher);
 
-    return -1;
-    
+    return 0;
 }
-                               
-
-    
 
 int
 seafile_decrypt (char **data_out,
@@ -161,6 +192,8 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt)
 {
+    SeafileCipher cipher;
+
     *data_out = NULL;
     *out_len = -1;
 
@@ -173,105 +206,21 @@ seafile_decrypt (char **data_out,
         return -1;
     }
 
-    EVP_CIPHER_CTX ctx;
-    int ret;
-
-    /* Prepare CTX for decryption. */
-    EVP_CIPHER_CTX_init (&ctx);
-
-    if (crypt->version >= 1)
-        ret = EVP_DecryptInit_ex (&ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_DecryptInit_ex (&ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == DEC_FAILURE)
+    if (seafile_cipher_init (&cipher, crypt, 0) < 0)
         return -1;
 
-    /* Allocating output buffer. */
-    
     *data_out = (char *)g_malloc (in_len);
 
-    if (*data_out == NULL) {
-        g_warning ("failed to allocate the ouput buffer.\n");
-        goto dec_error;
-    }                
-
-    int update_len, final_len;
-
-    /* Do the decryption. */
-    ret = EVP_DecryptUpdate (&ctx,
-                             (unsigned char*)*data_out,
-                             &update_len,
-                             (unsigned char*)data_in,
-                             in_len);
-
-    if (ret == DEC_FAILURE)
-        goto dec_error;
-
-
-    /* Finish the possible partial block. */
-    ret = EVP_DecryptFinal_ex (&ctx,
-                               (unsigned char*)*data_out + update_len,
-                               &final_len);
-
-    *out_len = update_len + final_len;
-
-    /* out_len should be smaller than in_len. */
-    if (ret == DEC_FAILURE || *out_len > in_len)
-        goto dec_error;
-
-    EVP_CIPHER_CTX_cleanup (&ctx);
-    
-    return 0;
-
-dec_error:
-
-    EVP_CIPHER_CTX_cleanup (&ctx);
-
-    *out_len = -1;
-    if (*data_out != NULL)
+    if (seafile_cipher_block (&cipher, data_in, in_len,
+                              *data_out, out_len) < 0) {
+        seafile_cipher_cleanup (&cipher);
         g_free (*data_out);
-
-    *data_out = NULL;
-
-    return -1;
-    
-}
-
-int
-seafile_decrypt_init (EVP_CIPHER_CTX *ctx,
-                      int version,
-                      const unsigned char *key,
-                      const unsigned char *iv)
-{
-    int ret;
-
-    /* Prepare CTX for decryption. */
-    EVP_CIPHER_CTX_init (ctx);
-
-    if (version >= 1)
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  key,  /* derived key */
-                                  iv);  /* initial vector */
-    else
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  key,  /* derived key */
-                                  iv);  /* initial vector */
-
-    if (ret == DEC_FAILURE)
+        *data_out = NULL;
+        *out_len = -1;
         return -1;
+    }
+
+    seafile_cipher_cleanup (&cipher);
 
     return 0;
 }
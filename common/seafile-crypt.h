@@ -75,10 +75,50 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt);
 
+/*
+  A cipher context that encrypts or decrypts many blocks with the same
+  key. The key is set up once in seafile_cipher_init(), and every block
+  starts again from the repo IV, so the output is the same as that of
+  seafile_encrypt()/seafile_decrypt(). A context must not be shared by
+  threads.
+
+  A block can be processed at once with seafile_cipher_block(), or
+  piece by piece with seafile_cipher_begin(), any number of
+  seafile_cipher_update() and a seafile_cipher_final().
+
+  The output buffer of seafile_cipher_update() must hold @in_len +
+  BLK_SIZE bytes, and that of seafile_cipher_final() BLK_SIZE bytes.
+  For seafile_cipher_block() it must hold @in_len + BLK_SIZE bytes when
+  encrypting, and @in_len bytes when decrypting.
+
+  All return 0 on success, -1 on failure.
+*/
+
+typedef struct SeafileCipher {
+    EVP_CIPHER_CTX ctx;
+    unsigned char iv[16];
+} SeafileCipher;
+
+int
+seafile_cipher_init (SeafileCipher *cipher, SeafileCrypt *crypt, int encrypt);
+
+void
+seafile_cipher_cleanup (SeafileCipher *cipher);
+
+int
+seafile_cipher_begin (SeafileCipher *cipher);
+
+int
+seafile_cipher_update (SeafileCipher *cipher,
+                       const char *in, int in_len,
+                       char *out, int *out_len);
+
+int
+seafile_cipher_final (SeafileCipher *cipher, char *out, int *out_len);
+
 int
-seafile_decrypt_init (EVP_CIPHER_CTX *ctx,
-                      int version,
-                      const unsigned char *key,
-                      const unsigned char *iv);
+seafile_cipher_block (SeafileCipher *cipher,
+                      const char *in, int in_len,
+                      char *out, int *out_len);
 
 #endif  /* _SEAFILE_CRYPT_H */
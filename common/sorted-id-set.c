@@ -0,0 +1,386 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+#include "sorted-id-set.h"
+#include "log.h"
+
+/* Ids are kept as 20-byte binary sha1s, both in memory and in the runs. */
+#define ID_SIZE 20
+
+/* Runs are merged into one when there are this many, to bound open files. */
+#define MAX_RUNS 64
+
+#define RUN_BUFFER_SIZE (1 << 16)
+
+typedef struct Run {
+    char            *path;
+    FILE            *fp;
+    unsigned char   cur[ID_SIZE];
+} Run;
+
+/* K-way merge of runs, dropping duplicates. */
+typedef struct RunMerger {
+    Run             **heap;
+    int             n;
+    unsigned char   last[ID_SIZE];
+    gboolean        has_last;
+} RunMerger;
+
+struct SortedIdSet {
+    char            *tmp_dir;
+    pthread_mutex_t lock;
+
+    unsigned char   *buf;
+    guint32         n_buf;
+    guint32         max_buf;
+
+    GPtrArray       *runs;
+    gboolean        error;
+
+    /* For reading. */
+    gboolean        finished;
+    RunMerger       merger;
+    guint32         buf_pos;    /* if all ids fit in memory */
+};
+
+static int
+compare_id (const void *a, const void *b)
+{
+    return memcmp (a, b, ID_SIZE);
+}
+
+static int
+run_read (Run *run)
+{
+    if (fread (run->cur, ID_SIZE, 1, run->fp) == 1)
+        return 1;
+    if (ferror (run->fp)) {
+        seaf_warning ("Failed to read %s: %s.\n", run->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+run_free (Run *run)
+{
+    if (run->fp)
+        fclose (run->fp);
+    g_unlink (run->path);
+    g_free (run->path);
+    g_free (run);
+}
+
+static Run *
+run_new (SortedIdSet *set)
+{
+    Run *run;
+    int fd;
+
+    run = g_new0 (Run, 1);
+    run->path = g_build_filename (set->tmp_dir, "ids-XXXXXX", NULL);
+
+    fd = g_mkstemp (run->path);
+    if (fd < 0) {
+        seaf_warning ("Failed to create temp file %s: %s.\n",
+                      run->path, strerror(errno));
+        g_free (run->path);
+        g_free (run);
+        return NULL;
+    }
+
+    run->fp = fdopen (fd, "w+b");
+    if (!run->fp) {
+        seaf_warning ("Failed to open %s: %s.\n", run->path, strerror(errno));
+        close (fd);
+        run_free (run);
+        return NULL;
+    }
+    setvbuf (run->fp, NULL, _IOFBF, RUN_BUFFER_SIZE);
+
+    return run;
+}
+
+static int
+run_write (Run *run, const unsigned char *id)
+{
+    if (fwrite (id, ID_SIZE, 1, run->fp) != 1) {
+        seaf_warning ("Failed to write %s: %s.\n", run->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+merger_sift_down (RunMerger *merger, int i)
+{
+    Run *tmp;
+    int child;
+
+    while ((child = 2 * i + 1) < merger->n) {
+        if (child + 1 < merger->n &&
+            memcmp (merger->heap[child + 1]->cur,
+                    merger->heap[child]->cur, ID_SIZE) < 0)
+            ++child;
+        if (memcmp (merger->heap[i]->cur, merger->heap[child]->cur, ID_SIZE) <= 0)
+            break;
+        tmp = merger->heap[i];
+        merger->heap[i] = merger->heap[child];
+        merger->heap[child] = tmp;
+        i = child;
+    }
+}
+
+static int
+merger_init (RunMerger *merger, GPtrArray *runs)
+{
+    Run *run;
+    int i, rc;
+
+    memset (merger, 0, sizeof(*merger));
+    merger->heap = g_new0 (Run *, runs->len);
+
+    for (i = 0; i < runs->len; ++i) {
+        run = g_ptr_array_index (runs, i);
+        if (fflush (run->fp) != 0 || fseek (run->fp, 0, SEEK_SET) != 0) {
+            seaf_warning ("Failed to rewind %s: %s.\n",
+                          run->path, strerror(errno));
+            return -1;
+        }
+        rc = run_read (run);
+        if (rc < 0)
+            return -1;
+        if (rc > 0)
+            merger->heap[merger->n++] = run;
+    }
+
+    for (i = merger->n / 2 - 1; i >= 0; --i)
+        merger_sift_down (merger, i);
+
+    return 0;
+}
+
+static int
+merger_next (RunMerger *merger, unsigned char *id)
+{
+    Run *top;
+    int rc;
+
+    while (merger->n > 0) {
+        top = merger->heap[0];
+        memcpy (id, top->cur, ID_SIZE);
+
+        rc = run_read (top);
+        if (rc < 0)
+            return -1;
+        if (rc == 0)
+            merger->heap[0] = merger->heap[--merger->n];
+        merger_sift_down (merger, 0);
+
+        if (merger->has_last && memcmp (id, merger->last, ID_SIZE) == 0)
+            continue;
+        memcpy (merger->last, id, ID_SIZE);
+        merger->has_last = TRUE;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Replace all runs with a single merged one. */
+static int
+merge_runs (SortedIdSet *set)
+{
+    RunMerger merger;
+    unsigned char id[ID_SIZE];
+    Run *out;
+    int rc, i;
+
+    out = run_new (set);
+    if (!out)
+        return -1;
+
+    rc = merger_init (&merger, set->runs);
+    if (rc == 0) {
+        while ((rc = merger_next (&merger, id)) > 0) {
+            if (run_write (out, id) < 0) {
+                rc = -1;
+                break;
+            }
+        }
+    }
+    g_free (merger.heap);
+
+    if (rc < 0) {
+        run_free (out);
+        return -1;
+    }
+
+    for (i = 0; i < set->runs->len; ++i)
+        run_free (g_ptr_array_index (set->runs, i));
+    g_ptr_array_set_size (set->runs, 0);
+    g_ptr_array_add (set->runs, out);
+
+    return 0;
+}
+
+static int
+flush_buffer (SortedIdSet *set)
+{
+    Run *run;
+    guint32 i;
+
+    if (set->n_buf == 0)
+        return 0;
+
+    qsort (set->buf, set->n_buf, ID_SIZE, compare_id);
+
+    run = run_new (set);
+    if (!run)
+        return -1;
+
+    for (i = 0; i < set->n_buf; ++i) {
+        unsigned char *id = set->buf + (gsize)i * ID_SIZE;
+        if (i > 0 && memcmp (id, id - ID_SIZE, ID_SIZE) == 0)
+            continue;
+        if (run_write (run, id) < 0) {
+            run_free (run);
+            return -1;
+        }
+    }
+    set->n_buf = 0;
+
+    g_ptr_array_add (set->runs, run);
+    if (set->runs->len >= MAX_RUNS)
+        return merge_runs (set);
+
+    return 0;
+}
+
+SortedIdSet *
+sorted_id_set_new (const char *tmp_dir, gsize mem_limit)
+{
+    SortedIdSet *set;
+
+    set = g_new0 (SortedIdSet, 1);
+    set->tmp_dir = g_strdup (tmp_dir);
+    pthread_mutex_init (&set->lock, NULL);
+
+    set->max_buf = (guint32) MIN (MAX (mem_limit / ID_SIZE, 1024), G_MAXUINT32);
+    set->buf = g_malloc ((gsize)set->max_buf * ID_SIZE);
+    set->runs = g_ptr_array_new ();
+
+    return set;
+}
+
+void
+sorted_id_set_free (SortedIdSet *set)
+{
+    int i;
+
+    for (i = 0; i < set->runs->len; ++i)
+        run_free (g_ptr_array_index (set->runs, i));
+    g_ptr_array_free (set->runs, TRUE);
+
+    g_free (set->merger.heap);
+    g_free (set->buf);
+    pthread_mutex_destroy (&set->lock);
+    g_free (set->tmp_dir);
+    g_free (set);
+}
+
+int
+sorted_id_set_add (SortedIdSet *set, const char *id)
+{
+    unsigned char raw[ID_SIZE];
+    int ret = 0;
+
+    if (hex_to_sha1 (id, raw) < 0) {
+        seaf_warning ("Invalid object id %s.\n", id);
+        return -1;
+    }
+
+    pthread_mutex_lock (&set->lock);
+
+    if (set->error || set->finished) {
+        ret = -1;
+        goto out;
+    }
+
+    memcpy (set->buf + (gsize)set->n_buf * ID_SIZE, raw, ID_SIZE);
+    if (++set->n_buf == set->max_buf && flush_buffer (set) < 0) {
+        set->error = TRUE;
+        ret = -1;
+    }
+
+out:
+    pthread_mutex_unlock (&set->lock);
+    return ret;
+}
+
+int
+sorted_id_set_finish (SortedIdSet *set)
+{
+    if (set->error)
+        return -1;
+    set->finished = TRUE;
+
+    /* Everything fit in memory, no need to touch the disk. */
+    if (set->runs->len == 0) {
+        qsort (set->buf, set->n_buf, ID_SIZE, compare_id);
+        return 0;
+    }
+
+    if (flush_buffer (set) < 0) {
+        set->error = TRUE;
+        return -1;
+    }
+    g_free (set->buf);
+    set->buf = NULL;
+
+    if (merger_init (&set->merger, set->runs) < 0) {
+        set->error = TRUE;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+sorted_id_set_next (SortedIdSet *set, char *id)
+{
+    unsigned char raw[ID_SIZE];
+    int rc;
+
+    if (set->error || !set->finished)
+        return -1;
+
+    if (set->buf) {
+        unsigned char *cur;
+
+        while (set->buf_pos < set->n_buf) {
+            cur = set->buf + (gsize)set->buf_pos * ID_SIZE;
+            ++set->buf_pos;
+            if (set->buf_pos > 1 && memcmp (cur, cur - ID_SIZE, ID_SIZE) == 0)
+                continue;
+            rawdata_to_hex (cur, id, ID_SIZE);
+            return 1;
+        }
+        return 0;
+    }
+
+    rc = merger_next (&set->merger, raw);
+    if (rc < 0) {
+        set->error = TRUE;
+        return -1;
+    }
+    if (rc > 0)
+        rawdata_to_hex (raw, id, ID_SIZE);
+
+    return rc;
+}
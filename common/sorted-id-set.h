@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SORTED_ID_SET_H
+#define SORTED_ID_SET_H
+
+/*
+ * A set of 40-character object ids that may not fit in memory.
+ *
+ * Ids are collected in a buffer of bounded size. Full buffers are sorted,
+ * deduplicated and written to temporary files as runs, which are merged
+ * when the set is read. After sorted_id_set_finish() the ids are returned
+ * in ascending order, each only once.
+ */
+
+struct SortedIdSet;
+typedef struct SortedIdSet SortedIdSet;
+
+/* Temporary files are created in @tmp_dir. */
+SortedIdSet *
+sorted_id_set_new (const char *tmp_dir, gsize mem_limit);
+
+/* Removes the temporary files. */
+void
+sorted_id_set_free (SortedIdSet *set);
+
+/* Can be called from several threads. */
+int
+sorted_id_set_add (SortedIdSet *set, const char *id);
+
+/* Stop adding and start reading. */
+int
+sorted_id_set_finish (SortedIdSet *set);
+
+/* Returns 1 and fills @id (41 bytes), 0 at the end, or -1 on error. */
+int
+sorted_id_set_next (SortedIdSet *set, char *id);
+
+#endif
@@ -241,9 +241,23 @@ static int switch_cache_bottom(struct traverse_info *info)
     return ret;
 }
 
+/* Index of an earlier tree with the same subtree as tree @i, or -1. */
+static int find_same_subtree(int i, unsigned long dirmask,
+                             const struct name_entry *names)
+{
+    int j;
+
+    for (j = 0; j < i; j++) {
+        if ((dirmask & (1UL << j)) &&
+            memcmp(names[j].sha1, names[i].sha1, 20) == 0)
+            return j;
+    }
+    return -1;
+}
+
 static int traverse_trees_recursive(int n, unsigned long dirmask, unsigned long df_conflicts, struct name_entry *names, struct traverse_info *info)
 {
-    int i, ret, bottom;
+    int i, j, ret, bottom;
     struct tree_desc t[MAX_UNPACK_TREES];
     struct traverse_info newinfo;
     struct name_entry *p;
@@ -258,13 +272,22 @@ static int traverse_trees_recursive(int n, unsigned long dirmask, unsigned long
     newinfo.pathlen += p->pathlen + 1;
     newinfo.conflicts |= df_conflicts;
 
-    for (i = 0; i < n; i++, dirmask >>= 1) {
+    /*
+     * The subtree is usually the same in most of the trees, e.g. the
+     * base and one side of a merge. Load it once and share it.
+     */
+    for (i = 0; i < n; i++) {
         char root_id[41];
-        if (dirmask & 1) {
+        if (!(dirmask & (1UL << i))) {
+            fill_tree_descriptor(t+i, NULL);
+            continue;
+        }
+        j = find_same_subtree(i, dirmask, names);
+        if (j >= 0) {
+            t[i].tree = t[j].tree;
+        } else {
             rawdata_to_hex(names[i].sha1, root_id, 20);
             fill_tree_descriptor(t+i, root_id);
-        } else {
-            fill_tree_descriptor(t+i, NULL);
         }
     }
 
@@ -273,6 +296,9 @@ static int traverse_trees_recursive(int n, unsigned long dirmask, unsigned long
     restore_cache_bottom(&newinfo, bottom);
 
     for (i = 0; i < n; ++i) {
+        if ((dirmask & (1UL << i)) &&
+            find_same_subtree(i, dirmask, names) >= 0)
+            continue;
         tree_desc_free (&t[i]);
     }
 
@@ -666,6 +692,7 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
         info.fn = unpack_callback;
         info.data = o;
         info.show_all_errors = o->show_all_errors;
+        info.prune_same_trees = o->skip_same_trees;
 
         if (traverse_trees(len, t, &info) < 0)
             goto return_failed;
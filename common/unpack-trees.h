@@ -6,7 +6,7 @@
 #include "index/index.h"
 #include "seafile-crypt.h"
 
-#define MAX_UNPACK_TREES 8
+#define MAX_UNPACK_TREES MAX_TRAVERSE_TREES
 
 struct unpack_trees_options;
 
@@ -37,7 +37,10 @@ struct unpack_trees_options {
         debug_unpack,
         skip_sparse_checkout,
         gently,
-        show_all_errors;
+        show_all_errors,
+        /* Skip dirs with the same id in all trees. The index must
+         * have no entries under them. */
+        skip_same_trees;
     const char *prefix;
     const char *base;
     int cache_bottom;
@@ -60,6 +63,9 @@ struct unpack_trees_options {
     struct index_state result;
 
     SeafileCrypt *crypt;
+    int chunker;
+    /* Files already written by an interrupted checkout, see vc-utils.h. */
+    struct CheckoutJournal *journal;
 };
 
 extern int unpack_trees(unsigned n, struct tree_desc *t,
@@ -2,6 +2,7 @@
 
 #include "seafile-session.h"
 #include "vc-common.h"
+#include "commit-graph.h"
 
 #include "log.h"
 #include "seafile-error.h"
@@ -212,6 +213,20 @@ get_merge_base (SeafCommit *head, SeafCommit *remote)
     SeafCommit *one, **twos;
     int n, i;
     SeafCommit *ret = NULL;
+    CommitGraph *graph;
+    char *base_id;
+
+    /* Only the merge base itself needs to be loaded. */
+    graph = seaf_commit_manager_get_graph (seaf->commit_mgr, head->repo_id);
+    if (graph) {
+        base_id = commit_graph_merge_base (graph, head->commit_id,
+                                           remote->commit_id);
+        if (base_id) {
+            ret = seaf_commit_manager_get_commit (seaf->commit_mgr, base_id);
+            g_free (base_id);
+            return ret;
+        }
+    }
 
     one = head;
     twos = (SeafCommit **) calloc (1, sizeof(SeafCommit *));
@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef WATCH_REPOS_COMMON
+#define WATCH_REPOS_COMMON
+
+/*
+    Master                              Slave
+
+            seafile-watch-repos-slave
+       ----------------------------------->
+                     200 OK
+      <-----------------------------------
+
+         301 WATCH "<repo_id>\n..."
+       ----------------------------------->
+         302 UNWATCH "<repo_id>\n..."
+       ----------------------------------->
+                     ...
+
+         300 REPO UPDATES "<repo_id> <commit_id>\n..."
+      <-----------------------------------
+                     ...
+
+   The processor lasts as long as the connection to the server. The
+   master sends the repos it syncs, then the changes to that set, in
+   pieces of at most WATCH_PIECE_LEN bytes. The slave sends the new
+   heads of the watched repos, in batches.
+ */
+
+#define SC_REPO_UPDATES     "300"
+#define SS_REPO_UPDATES     "REPO UPDATES"
+#define SC_WATCH            "301"
+#define SS_WATCH            "WATCH"
+#define SC_UNWATCH          "302"
+#define SS_UNWATCH          "UNWATCH"
+
+#define SC_TOO_MANY_REPOS   "403"
+#define SS_TOO_MANY_REPOS   "Too many repos"
+
+#define WATCH_PIECE_LEN     (32 * 1024)
+
+/* The slave refuses to watch more repos for a peer. */
+#define MAX_WATCHED_REPOS   10000
+
+#endif
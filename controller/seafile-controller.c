@@ -4,6 +4,7 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 
@@ -14,10 +15,13 @@
 #include <getopt.h>
 
 #include "log.h"
+#include "seaf-utils.h"
 #include "seafile-controller.h"
 
 #define CHECK_HEARTBEAT_INTERVAL 2        /* every 2 seconds */
 #define MAX_HEARTBEAT_LIMIT 4
+#define MAX_STARTUP_TIME 120              /* seconds */
+#define CONNECT_CCNET_INTERVAL 100        /* msec */
 
 SeafileController *ctl;
 
@@ -46,9 +50,97 @@ controller_exit (int code)
     exit(code);
 }
 
+static const char *
+pid_name (int which)
+{
+    return which == PID_SERVER ? "seaf-server" : "seaf-mon";
+}
+
+static void
+stop_ready_watch (int which)
+{
+    if (ctl->ready_io_id[which] != 0) {
+        g_source_remove (ctl->ready_io_id[which]);
+        ctl->ready_io_id[which] = 0;
+    }
+    if (ctl->ready_fd[which] >= 0) {
+        close (ctl->ready_fd[which]);
+        ctl->ready_fd[which] = -1;
+    }
+}
+
+static void
+set_ready (int which)
+{
+    if (ctl->ready[which])
+        return;
+
+    ctl->ready[which] = TRUE;
+    seaf_message ("%s is ready, started in %d seconds.\n", pid_name(which),
+                  (int)(time(NULL) - ctl->start_time[which]));
+}
+
+static gboolean
+ready_io_cb (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    int which = (int)(long)data;
+    char buf[16];
+    int n;
+
+    n = read (ctl->ready_fd[which], buf, sizeof(buf) - 1);
+    if (n < 0 && errno == EINTR)
+        return TRUE;
+    if (n > 0) {
+        buf[n] = 0;
+        if (strncmp (buf, "READY", 5) == 0)
+            set_ready (which);
+    }
+
+    /* Written once. On EOF the process exited, the heartbeat check
+     * restarts it.
+     */
+    ctl->ready_io_id[which] = 0;
+    close (ctl->ready_fd[which]);
+    ctl->ready_fd[which] = -1;
+    return FALSE;
+}
+
+/*
+ * Pass a pipe to the process to be started through SEAF_READY_FD_ENV,
+ * it writes "READY" to it when its startup is done. Returns the fd for
+ * the child, or -1.
+ */
+static int
+prepare_ready_watch (int which)
+{
+    int fds[2];
+    GIOChannel *channel;
+
+    stop_ready_watch (which);
+    ctl->ready[which] = FALSE;
+    ctl->start_time[which] = time(NULL);
+
+    if (pipe (fds) < 0) {
+        seaf_warning ("Failed to create ready pipe: %s.\n", strerror(errno));
+        return -1;
+    }
+    /* Not inherited by the other services. */
+    fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+
+    ctl->ready_fd[which] = fds[0];
+    channel = g_io_channel_unix_new (fds[0]);
+    ctl->ready_io_id[which] = g_io_add_watch (channel,
+                                              G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                              ready_io_cb,
+                                              (gpointer)(long)which);
+    g_io_channel_unref (channel);
+
+    return fds[1];
+}
+
 /* returns the pid of the newly created process */
 static int
-spawn_process (char *argv[])
+spawn_process (char *argv[], int ready_fd)
 {
     char **ptr = argv;
     GString *buf = g_string_new(argv[0]);
@@ -62,11 +154,18 @@ spawn_process (char *argv[])
 
     if (pid == 0) {
         /* child process */
+        if (ready_fd >= 0) {
+            char fd_str[16];
+            snprintf (fd_str, sizeof(fd_str), "%d", ready_fd);
+            g_setenv (SEAF_READY_FD_ENV, fd_str, TRUE);
+        }
         execvp (argv[0], argv);
         seaf_warning ("failed to execvp %s\n", argv[0]);
         exit(-1);
     } else {
         /* controller */
+        if (ready_fd >= 0)
+            close (ready_fd);
         if (pid == -1)
             seaf_warning ("error when fork %s: %s\n", argv[0], strerror(errno));
         else
@@ -111,7 +210,7 @@ start_ccnet_server ()
         "-P", ctl->pidfile[PID_CCNET],
         NULL};
     
-    int pid = spawn_process (argv);
+    int pid = spawn_process (argv, -1);
     if (pid <= 0) {
         seaf_warning ("Failed to spawn ccnet-server\n");
         return -1;
@@ -140,7 +239,7 @@ start_seaf_server ()
         argv[7] = NULL;
     }
     
-    int pid = spawn_process (argv);
+    int pid = spawn_process (argv, prepare_ready_watch (PID_SERVER));
     if (pid <= 0) {
         seaf_warning ("Failed to spawn seaf-server\n");
         return -1;
@@ -164,7 +263,7 @@ start_seaf_monitor ()
         "-P", ctl->pidfile[PID_MONITOR],
         NULL};
     
-    int pid = spawn_process (argv);
+    int pid = spawn_process (argv, prepare_ready_watch (PID_MONITOR));
     if (pid <= 0) {
         seaf_warning ("Failed to spawn seaf-mon\n");
         return -1;
@@ -179,13 +278,17 @@ static void mq_cb (CcnetMessage *msg, void *data)
 {
     time_t now = time (NULL);
 
+    /* A heartbeat also means the process is up, in case it doesn't
+     * notify readiness. */
     if (IS_APP_MSG(msg, "seaf_server.heartbeat")) {
         
         ctl->last_hb[HB_SEAFILE_SERVER] = now;
+        set_ready (PID_SERVER);
         
     } else if (IS_APP_MSG(msg, "seaf_mon.heartbeat")) {
 
         ctl->last_hb[HB_SEAFILE_MONITOR] = now;
+        set_ready (PID_MONITOR);
     }
 }
 
@@ -273,6 +376,21 @@ try_kill_process(int which)
         kill((pid_t)pid, SIGTERM);
 }
 
+/* A process that is still starting up sends no heartbeat yet. */
+static gboolean
+need_restart (int which, int hb, time_t now)
+{
+    if (!ctl->ready[which]) {
+        if (now - ctl->start_time[which] <= MAX_STARTUP_TIME)
+            return FALSE;
+        seaf_warning ("%s not ready in %d seconds.\n",
+                      pid_name(which), MAX_STARTUP_TIME);
+        return TRUE;
+    }
+
+    return (now - ctl->last_hb[hb] > MAX_HEARTBEAT_LIMIT);
+}
+
 static gboolean
 check_heartbeat (void *data)
 {
@@ -284,7 +402,7 @@ check_heartbeat (void *data)
             ctl->last_hb[i] = now;
     }
 
-    if (now - ctl->last_hb[HB_SEAFILE_SERVER] > MAX_HEARTBEAT_LIMIT) {
+    if (need_restart (PID_SERVER, HB_SEAFILE_SERVER, now)) {
 
         try_kill_process(PID_SERVER);
         seaf_message ("seaf-server need restart...\n");
@@ -293,7 +411,7 @@ check_heartbeat (void *data)
 
     }
 
-    if (now - ctl->last_hb[HB_SEAFILE_MONITOR] > MAX_HEARTBEAT_LIMIT) {
+    if (need_restart (PID_MONITOR, HB_SEAFILE_MONITOR, now)) {
 
         try_kill_process(PID_MONITOR);
         seaf_message ("seaf-mon need restart...\n");
@@ -509,6 +627,8 @@ seaf_controller_init (SeafileController *ctl, char *bin_dir,
     ctl->bin_dir = bin_dir;
     ctl->seafile_dir = seafile_dir;
     ctl->cloud_mode = cloud_mode;
+    ctl->ready_fd[PID_SERVER] = -1;
+    ctl->ready_fd[PID_MONITOR] = -1;
 
     init_pidfile_path(ctl);
 
@@ -523,7 +643,8 @@ seaf_controller_start ()
         return -1;
     }
 
-    g_timeout_add (1000 * 1, do_connect_ccnet, NULL);
+    /* ccnet-server is ready once it accepts connections. */
+    g_timeout_add (CONNECT_CCNET_INTERVAL, do_connect_ccnet, NULL);
 
     return 0;
 }
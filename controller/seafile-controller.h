@@ -9,13 +9,19 @@
  *       - seaf-server
  *       - seaf-mon
  *
+ *       ccnet-server is ready when the controller can connect to it.
+ *       seaf-server and seaf-mon only need ccnet, so they're started
+ *       together once it's connected, and each reports on a pipe
+ *       (see SEAF_READY_FD_ENV) when its own startup is done.
+ *
  *    2. Repair:
  *
  *       - ensure ccnet process availability by watching client->connfd
  *       - ensure server processes availablity by receiving heartbeat
  *         messages.
  *         If heartbeat messages for some process is not received for a given
- *         time, try to restart it.
+ *         time, try to restart it. A process still starting up is only
+ *         restarted if it isn't ready in MAX_STARTUP_TIME.
  *      
  */
 
@@ -54,5 +60,11 @@ struct _SeafileController {
     time_t              last_hb[N_HEARTBEAT];
     int                 pid[N_PID];
     char                *pidfile[N_PID];
+
+    /* Startup of seaf-server and seaf-mon, indexed by PID_*. */
+    time_t              start_time[N_PID];
+    gboolean            ready[N_PID];
+    int                 ready_fd[N_PID];
+    guint               ready_io_id[N_PID];
 };
 #endif
@@ -11,6 +11,7 @@
 #include "merge-recursive.h"
 #include "unpack-trees.h"
 #include "vc-utils.h"
+#include "commit-graph.h"
 
 #include "utils.h"
 
@@ -136,6 +137,7 @@ seaf_clone_manager_new (SeafileSession *session)
         g_free (mgr);
         return NULL;
     }
+    sqlite_set_write_batch (mgr->db, DB_WRITE_BATCH_INTERVAL);
 
     mgr->seaf = session;
     mgr->tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
@@ -297,6 +299,16 @@ remove_task_from_db (SeafCloneManager *mgr, const char *repo_id)
     return 0;
 }
 
+/* "clone\t<repo-id>" -> "<state>", or "error\t<error>" */
+static void
+publish_clone_state (CloneTask *task, const char *value)
+{
+    char *key = g_strconcat ("clone\t", task->repo_id, NULL);
+
+    seaf_mq_manager_publish_state (seaf->mq_mgr, key, value);
+    g_free (key);
+}
+
 static void
 transition_state (CloneTask *task, int new_state)
 {
@@ -312,11 +324,14 @@ transition_state (CloneTask *task, int new_state)
     }
 
     task->state = new_state;
+    publish_clone_state (task, state_str[new_state]);
 }
 
 static void
 transition_to_error (CloneTask *task, int error)
 {
+    char *value;
+
     seaf_message ("Transition clone state for %.8s from [%s] to [error]: %s.\n",
                   task->repo_id,
                   state_str[task->state], 
@@ -327,6 +342,11 @@ transition_to_error (CloneTask *task, int error)
 
     task->state = CLONE_STATE_ERROR;
     task->error = error;
+
+    value = g_strconcat (state_str[CLONE_STATE_ERROR], "\t",
+                         error_str[error], NULL);
+    publish_clone_state (task, value);
+    g_free (value);
 }
 
 static int
@@ -357,8 +377,12 @@ index_files_job (void *data)
     IndexAux *aux = data;
     CloneTask *task = aux->task;
 
+    /* The repo's chunker is not known until its commits are downloaded,
+     * so assume the default one, without a chunking policy. merge_job() re-indexes on mismatch.
+     */
     if (seaf_repo_index_worktree_files (task->repo_id, task->worktree,
-                                        task->passwd, task->root_id) == 0)
+                                        task->passwd, CDC_ALGO_RABIN,
+                                        task->root_id) == 0)
         aux->success = TRUE;
 
     return data;
@@ -947,6 +971,7 @@ seaf_clone_manager_remove_task (SeafCloneManager *mgr,
 
     /* On-disk task should have been removed. */
 
+    publish_clone_state (task, "");
     g_hash_table_remove (mgr->tasks, repo_id);
 
     return 0;
@@ -965,6 +990,26 @@ seaf_clone_manager_get_tasks (SeafCloneManager *mgr)
     return g_hash_table_get_values (mgr->tasks);
 }
 
+gboolean
+seaf_clone_manager_has_running_tasks (SeafCloneManager *mgr)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    CloneTask *task;
+
+    g_hash_table_iter_init (&iter, mgr->tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        if (task->state == CLONE_STATE_INDEX ||
+            task->state == CLONE_STATE_FETCH ||
+            task->state == CLONE_STATE_CHECKOUT ||
+            task->state == CLONE_STATE_MERGE)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
 typedef struct {
     CloneTask *task;
     SeafRepo *repo;
@@ -995,13 +1040,43 @@ compare_root (SeafCommit *commit, void *data, gboolean *stop)
     return TRUE;
 }
 
+static gboolean
+compare_root_entry (const CommitGraphEntry *entry, void *data, gboolean *stop)
+{
+    CompareAux *aux = data;
+
+    if (aux->fast_forward) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    if (strcmp (entry->root_id, aux->root_id) == 0) {
+        aux->fast_forward = TRUE;
+        *stop = TRUE;
+    }
+
+    return TRUE;
+}
+
 static gboolean
 check_fast_forward (SeafCommit *head, const char *root_id)
 {
     CompareAux *aux = g_new0 (CompareAux, 1);
+    CommitGraph *graph;
     gboolean ret;
 
     memcpy (aux->root_id, root_id, 41);
+
+    /* The graph has the root ids, no need to load the commits. */
+    graph = seaf_commit_manager_get_graph (seaf->commit_mgr, head->repo_id);
+    if (graph && commit_graph_traverse (graph, head->commit_id,
+                                        compare_root_entry, aux)) {
+        ret = aux->fast_forward;
+        g_free (aux);
+        return ret;
+    }
+    aux->fast_forward = FALSE;
+
     if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
                                                    head->commit_id,
                                                    compare_root,
@@ -1040,6 +1115,7 @@ real_merge (SeafRepo *repo, SeafCommit *head, CloneTask *task)
     opts.remote_head = head->commit_id;
     /* Don't need to check locked files on windows. */
     opts.force_merge = TRUE;
+    opts.chunker = repo->chunker;
     if (repo->encrypted) {
         opts.crypt = seafile_crypt_new (repo->enc_version, 
                                         repo->enc_key, 
@@ -1101,6 +1177,7 @@ fast_forward_checkout (SeafRepo *repo, SeafCommit *head, CloneTask *task)
     topts.update = 1;
     topts.merge = 1;
     topts.fn = twoway_merge;
+    topts.chunker = repo->chunker;
     if (repo->encrypted) {
         topts.crypt = seafile_crypt_new (repo->enc_version, 
                                          repo->enc_key, 
@@ -1112,6 +1189,7 @@ fast_forward_checkout (SeafRepo *repo, SeafCommit *head, CloneTask *task)
         ret = -1;
         goto out;
     }
+    copy_index_extensions (&topts.result, &istate);
 
     if (update_worktree (&topts, FALSE,
                          head->commit_id,
@@ -1149,11 +1227,28 @@ merge_job (void *data)
     SeafBranch *local = NULL;
     SeafCommit *head = NULL;
 
+    /* Files indexed before the repo was downloaded were chunked with the
+     * default algorithm, and encrypted with a version 1 key. Their ids
+     * can't be compared with the repo's if it uses another chunker,
+     * chunking policy or key, so drop the index and start over.
+     */
+    if (task->root_id[0] != 0 &&
+        (repo->chunker != CDC_ALGO_RABIN ||
+         (repo->encrypted && repo->enc_version != 1))) {
+        char index_path[PATH_MAX];
+
+        snprintf (index_path, PATH_MAX, "%s/%s",
+                  seaf->repo_mgr->index_dir, task->repo_id);
+        g_unlink (index_path);
+        task->root_id[0] = 0;
+    }
+
     /* If we haven't indexed files in the worktree, index them now. */
     if (task->root_id[0] == 0) {
         if (seaf_repo_index_worktree_files (task->repo_id,
                                             task->worktree,
                                             task->passwd,
+                                            repo->chunker,
                                             task->root_id) < 0)
             return aux;
     }
@@ -1211,10 +1306,9 @@ merge_job_done (void *data)
         transition_state (task, CLONE_STATE_CANCELED);
     else if (task->state == CLONE_STATE_MERGE) {
         /* Save repo head if for GC. */
-        seaf_repo_manager_set_repo_property (seaf->repo_mgr,
-                                             repo->id,
-                                             REPO_REMOTE_HEAD,
-                                             repo->head->commit_id);
+        seaf_repo_manager_set_remote_head (seaf->repo_mgr,
+                                           repo->id,
+                                           repo->head->commit_id);
         transition_state (task, CLONE_STATE_DONE);
     } else
         g_assert (0);
@@ -1312,6 +1406,15 @@ on_repo_fetched (SeafileSession *seaf,
     seaf_repo_manager_set_repo_relay_info (seaf->repo_mgr, repo->id,
                                            task->peer_addr, task->peer_port);
 
+    /* Older commits of a shallow clone have no fs objects. */
+    if (tx_task->history_boundary > 0) {
+        char since[32];
+        snprintf (since, sizeof(since), "%"G_GINT64_FORMAT,
+                  tx_task->history_boundary);
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, repo->id,
+                                             REPO_HISTORY_SINCE, since);
+    }
+
     start_checkout (repo, task);
 }
 
@@ -1331,10 +1434,9 @@ on_checkout_done (CheckoutTask *ctask, SeafRepo *repo, void *data)
         transition_state (task, CLONE_STATE_CANCELED);
     else if (task->state == CLONE_STATE_CHECKOUT) {
         /* Save repo head if for GC. */
-        seaf_repo_manager_set_repo_property (seaf->repo_mgr,
-                                             repo->id,
-                                             REPO_REMOTE_HEAD,
-                                             repo->head->commit_id);
+        seaf_repo_manager_set_remote_head (seaf->repo_mgr,
+                                           repo->id,
+                                           repo->head->commit_id);
         transition_state (task, CLONE_STATE_DONE);
     } else
         g_assert (0);
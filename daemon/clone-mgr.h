@@ -127,4 +127,12 @@ seaf_clone_manager_get_task (SeafCloneManager *mgr,
 GList *
 seaf_clone_manager_get_tasks (SeafCloneManager *mgr);
 
+/*
+ * TRUE while a clone is indexing, fetching or checking out. The blocks
+ * of the files indexed in a non-empty worktree are not referenced by
+ * any repo until the clone is done.
+ */
+gboolean
+seaf_clone_manager_has_running_tasks (SeafCloneManager *mgr);
+
 #endif
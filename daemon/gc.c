@@ -1,30 +1,89 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include "common.h"
+
+#include <pthread.h>
+#include <glib/gstdio.h>
+#include <ccnet/timer.h>
+
 #include "log.h"
+#include "utils.h"
 
 #include "seafile-session.h"
+#include "seafile-config.h"
+#include "diff-simple.h"
 #include "gc.h"
 #include "gc-core.h"
 
+/*
+ * Blocks only have to be kept until the commits using them are synced
+ * and checked out. Moves of the heads are appended to CANDIDATES_FILE,
+ * one per line:
+ *
+ *   H <old head> <new head>     versions in old head replaced in new head
+ *   R <old head|-> <new head>   versions new in the remote head saved for GC
+ *   B <block id>                a candidate still referenced by the last GC
+ *
+ * An incremental GC moves the records to RUNNING_FILE, turns them into
+ * block ids, and only checks those. The candidates still referenced are
+ * written back to RUNNING_FILE for the next run.
+ *
+ * A full GC, scanning the whole block store, still runs at start-up once
+ * every FULL_GC_INTERVAL, and cleans up what the candidates miss.
+ */
+
+#define CANDIDATES_FILE "gc-candidates"
+#define RUNNING_FILE "gc-candidates.run"
+#define KEY_LAST_FULL_GC "last_full_gc"
+
+#define FULL_GC_INTERVAL (7 * 24 * 3600)
+#define GC_CHECK_INTERVAL (10 * 60 * 1000) /* msec */
+
 static gboolean gc_started = FALSE;
 
+static pthread_mutex_t candidates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct GCRun {
+    gboolean full;
+    int ret;
+} GCRun;
+
 static void *gc_thread_func (void *data);
 static void gc_thread_done (void *data);
 
+static gboolean
+full_gc_due ()
+{
+    gboolean exists;
+    int last;
+
+    last = seafile_session_config_get_int (seaf, KEY_LAST_FULL_GC, &exists);
+    return !exists || (gint64)time(NULL) - last >= FULL_GC_INTERVAL;
+}
+
 int
 gc_start ()
 {
+    GCRun *run;
     int ret;
 
+    if (gc_started)
+        return -1;
+
+    run = g_new0 (GCRun, 1);
+    run->full = full_gc_due ();
+
     gc_started = TRUE;
 
     ret = ccnet_job_manager_schedule_job (seaf->job_mgr,
                                           gc_thread_func,
                                           gc_thread_done,
-                                          NULL);
-    if (ret < 0)
+                                          run);
+    if (ret < 0) {
+        gc_started = FALSE;
+        g_free (run);
         return ret;
+    }
 
     return 0;
 }
@@ -35,15 +94,362 @@ gc_is_started ()
     return gc_started;
 }
 
+static void
+append_record (const char *type, const char *old_id, const char *new_id)
+{
+    char *path;
+    FILE *fp;
+
+    path = g_build_filename (seaf->seaf_dir, CANDIDATES_FILE, NULL);
+
+    pthread_mutex_lock (&candidates_lock);
+    fp = g_fopen (path, "a");
+    if (fp) {
+        fprintf (fp, "%s %s %s\n", type, old_id ? old_id : "-", new_id);
+        fclose (fp);
+    } else {
+        seaf_warning ("[GC] Failed to open %s: %s.\n", path, strerror(errno));
+    }
+    pthread_mutex_unlock (&candidates_lock);
+
+    g_free (path);
+}
+
+void
+gc_head_moved (const char *old_head, const char *new_head)
+{
+    append_record ("H", old_head, new_head);
+}
+
+void
+gc_remote_head_moved (const char *old_head, const char *new_head)
+{
+    append_record ("R", old_head, new_head);
+}
+
+static gboolean
+has_new_candidates ()
+{
+    char *path;
+    gboolean ret;
+
+    path = g_build_filename (seaf->seaf_dir, CANDIDATES_FILE, NULL);
+    ret = g_file_test (path, G_FILE_TEST_EXISTS);
+    g_free (path);
+
+    return ret;
+}
+
+/* Blocks being downloaded or committed may be candidates again. The
+ * blocks of local files reused by a clone are not referenced yet.
+ */
+static gboolean
+sync_is_idle ()
+{
+    GList *tasks, *ptr;
+    TransferTask *task;
+    gboolean idle = TRUE;
+
+    if (seaf->sync_mgr->n_running_tasks > 0)
+        return FALSE;
+
+    if (seaf_clone_manager_has_running_tasks (seaf->clone_mgr))
+        return FALSE;
+
+    tasks = seaf_transfer_manager_get_download_tasks (seaf->transfer_mgr);
+    for (ptr = tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        if (task->state == TASK_STATE_NORMAL &&
+            task->runtime_state != TASK_RT_STATE_INIT) {
+            idle = FALSE;
+            break;
+        }
+    }
+    g_list_free (tasks);
+
+    return idle;
+}
+
+static int
+gc_pulse (void *vdata)
+{
+    if (!gc_started && (has_new_candidates () || full_gc_due ()) &&
+        sync_is_idle ()) {
+        if (gc_start () < 0)
+            seaf_warning ("[GC] Failed to start gc.\n");
+    }
+
+    return TRUE;
+}
+
+void
+gc_start_timer ()
+{
+    ccnet_timer_new (gc_pulse, NULL, GC_CHECK_INTERVAL);
+}
+
+/*
+ * Move the new records to RUNNING_FILE, after those left by the last run.
+ */
+static int
+take_new_records (const char *running_path)
+{
+    char *path, *contents = NULL;
+    gsize len;
+    FILE *fp;
+    int ret = 0;
+
+    path = g_build_filename (seaf->seaf_dir, CANDIDATES_FILE, NULL);
+
+    pthread_mutex_lock (&candidates_lock);
+    if (!g_file_test (path, G_FILE_TEST_EXISTS))
+        goto out;
+
+    if (!g_file_get_contents (path, &contents, &len, NULL)) {
+        seaf_warning ("[GC] Failed to read %s.\n", path);
+        ret = -1;
+        goto out;
+    }
+
+    fp = g_fopen (running_path, "a");
+    if (!fp || fwrite (contents, 1, len, fp) != len) {
+        seaf_warning ("[GC] Failed to write %s.\n", running_path);
+        if (fp)
+            fclose (fp);
+        ret = -1;
+        goto out;
+    }
+    if (fclose (fp) != 0) {
+        ret = -1;
+        goto out;
+    }
+
+    g_unlink (path);
+
+out:
+    pthread_mutex_unlock (&candidates_lock);
+    g_free (contents);
+    g_free (path);
+    return ret;
+}
+
+static int
+add_file_blocks (GHashTable *candidates, const char *file_id)
+{
+    Seafile *file;
+    int i;
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!file) {
+        seaf_warning ("[GC] Failed to find file %s.\n", file_id);
+        return -1;
+    }
+
+    for (i = 0; i < file->n_blocks; ++i)
+        g_hash_table_insert (candidates, g_strdup (file->blk_sha1s[i]),
+                             GINT_TO_POINTER(1));
+
+    seafile_unref (file);
+    return 0;
+}
+
+static gboolean
+add_tree_blocks (SeafFSManager *mgr, const char *obj_id, int type,
+                 void *vcandidates, gboolean *stop)
+{
+    if (type == SEAF_METADATA_TYPE_FILE &&
+        add_file_blocks (vcandidates, obj_id) < 0)
+        return FALSE;
+    return TRUE;
+}
+
+/*
+ * Add the blocks of the versions in @to_id that are not in @from_id.
+ * Renamed files keep their content, so they are left out.
+ */
+static int
+add_changed_blocks (GHashTable *candidates,
+                    const char *from_id, const char *to_id)
+{
+    SeafCommit *from = NULL, *to = NULL;
+    GList *results = NULL, *ptr;
+    DiffEntry *de;
+    char file_id[41];
+    int ret = 0;
+
+    to = seaf_commit_manager_get_commit (seaf->commit_mgr, to_id);
+    if (!to) {
+        seaf_warning ("[GC] Failed to find commit %s.\n", to_id);
+        return -1;
+    }
+
+    if (!from_id) {
+        ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr, to->root_id,
+                                             add_tree_blocks, candidates);
+        goto out;
+    }
+
+    from = seaf_commit_manager_get_commit (seaf->commit_mgr, from_id);
+    if (!from) {
+        seaf_warning ("[GC] Failed to find commit %s.\n", from_id);
+        ret = -1;
+        goto out;
+    }
+
+    if (diff_commits (from, to, &results) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    for (ptr = results; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (ret == 0 &&
+            (de->status == DIFF_STATUS_ADDED ||
+             de->status == DIFF_STATUS_MODIFIED)) {
+            rawdata_to_hex (de->sha1, file_id, 20);
+            ret = add_file_blocks (candidates, file_id);
+        }
+        diff_entry_free (de);
+    }
+    g_list_free (results);
+
+out:
+    if (from)
+        seaf_commit_unref (from);
+    seaf_commit_unref (to);
+    return ret;
+}
+
+static GHashTable *
+load_candidates (const char *running_path)
+{
+    GHashTable *candidates;
+    char *contents = NULL;
+    char **lines, **tokens, *old_id;
+    int i;
+
+    candidates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free, NULL);
+
+    if (!g_file_test (running_path, G_FILE_TEST_EXISTS))
+        return candidates;
+    if (!g_file_get_contents (running_path, &contents, NULL, NULL)) {
+        seaf_warning ("[GC] Failed to read %s.\n", running_path);
+        g_hash_table_destroy (candidates);
+        return NULL;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; ++i) {
+        if (lines[i][0] == '\0')
+            continue;
+
+        tokens = g_strsplit (lines[i], " ", 3);
+        if (g_strv_length (tokens) == 2 && strcmp (tokens[0], "B") == 0) {
+            g_hash_table_insert (candidates, g_strdup (tokens[1]),
+                                 GINT_TO_POINTER(1));
+        } else if (g_strv_length (tokens) == 3) {
+            old_id = (strcmp (tokens[1], "-") == 0) ? NULL : tokens[1];
+            /* The full GC will clean up after a record that fails. */
+            if (strcmp (tokens[0], "H") == 0 && old_id)
+                add_changed_blocks (candidates, tokens[2], old_id);
+            else if (strcmp (tokens[0], "R") == 0)
+                add_changed_blocks (candidates, old_id, tokens[2]);
+        } else {
+            seaf_warning ("[GC] Bad candidates record: %s.\n", lines[i]);
+        }
+        g_strfreev (tokens);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+
+    return candidates;
+}
+
+static void
+save_live_candidates (GHashTable *candidates, const char *running_path)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GString *buf;
+
+    if (g_hash_table_size (candidates) == 0) {
+        g_unlink (running_path);
+        return;
+    }
+
+    buf = g_string_new (NULL);
+    g_hash_table_iter_init (&iter, candidates);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_string_append_printf (buf, "B %s\n", (char *)key);
+
+    if (!g_file_set_contents (running_path, buf->str, buf->len, NULL))
+        seaf_warning ("[GC] Failed to write %s.\n", running_path);
+    g_string_free (buf, TRUE);
+}
+
+static int
+run_incremental_gc ()
+{
+    GCOptions options;
+    GHashTable *candidates;
+    char *running_path;
+    int ret = 0;
+
+    running_path = g_build_filename (seaf->seaf_dir, RUNNING_FILE, NULL);
+
+    /* Old records are still in the running file after a failure. */
+    take_new_records (running_path);
+    candidates = load_candidates (running_path);
+    if (!candidates) {
+        ret = -1;
+        goto out;
+    }
+    if (g_hash_table_size (candidates) == 0)
+        goto out;
+
+    memset (&options, 0, sizeof(options));
+    options.n_threads = 1;
+    options.mode = GC_MODE_CANDIDATES;
+    options.candidates = candidates;
+    ret = gc_core_run (&options);
+    if (ret == 0)
+        save_live_candidates (candidates, running_path);
+
+out:
+    if (candidates)
+        g_hash_table_destroy (candidates);
+    g_free (running_path);
+    return ret;
+}
+
 static void *
 gc_thread_func (void *data)
 {
-    gc_core_run ();
-    return NULL;
+    GCRun *run = data;
+    GCOptions options;
+
+    if (!run->full) {
+        run->ret = run_incremental_gc ();
+        return data;
+    }
+
+    memset (&options, 0, sizeof(options));
+    options.n_threads = 1;
+    options.mode = GC_MODE_NORMAL;
+    run->ret = gc_core_run (&options);
+    return data;
 }
 
 static void
 gc_thread_done (void *data)
 {
+    GCRun *run = data;
+
     gc_started = FALSE;
+
+    if (run->full && run->ret == 0)
+        seafile_session_config_set_int (seaf, KEY_LAST_FULL_GC,
+                                        (int)time(NULL));
+    g_free (run);
 }
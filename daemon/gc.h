@@ -2,7 +2,9 @@
 #define SEAF_GC_H
 
 /*
- * Start GC. If another GC has been started, returns -1.
+ * Start GC. A full GC is run if the last one is more than a week old,
+ * otherwise only the candidates recorded below are checked. If another
+ * GC has been started, returns -1.
  */
 int
 gc_start ();
@@ -10,4 +12,24 @@ gc_start ();
 gboolean
 gc_is_started ();
 
+/* Start GC from time to time, when there are new candidates and nothing
+ * is being synced. */
+void
+gc_start_timer ();
+
+/*
+ * Record that the local head moved from @old_head to @new_head. The
+ * blocks of the versions replaced become candidates.
+ */
+void
+gc_head_moved (const char *old_head, const char *new_head);
+
+/*
+ * Record that the remote head saved for GC moved from @old_head, NULL
+ * for a new clone, to @new_head. The new versions are checked out, so
+ * their blocks become candidates.
+ */
+void
+gc_remote_head_moved (const char *old_head, const char *new_head);
+
 #endif
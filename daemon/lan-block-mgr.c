@@ -0,0 +1,710 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <event2/listener.h>
+#include <ccnet/timer.h>
+#include <ccnet/job-mgr.h>
+
+#include "net.h"
+#include "utils.h"
+#include "cdc/seaf-sha1.h"
+
+#include "seafile-session.h"
+#include "lan-block-mgr.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
+#include "log.h"
+
+#define LAN_MCAST_ADDR      "239.255.42.99"
+#define LAN_MCAST_PORT      "10011"
+#define ANNOUNCE_MAGIC      "seaf-lan-1"
+
+#define ANNOUNCE_INTERVAL   30      /* 30s */
+#define PEER_TIMEOUT        (3 * ANNOUNCE_INTERVAL + 5)
+#define RECV_INTERVAL       1000    /* 1s */
+#define MAX_DATAGRAM        1400
+
+#define MAX_LAN_CLIENTS     4
+#define LAN_IO_TIMEOUT      10      /* 10s */
+#define MAX_LAN_BLOCK_SIZE  (32 << 20)
+
+typedef struct {
+    char        peer_id[41];
+    char        addr[64];
+    int         port;
+    GHashTable *repos;          /* repo_id -> last announced time */
+    int         last_seen;
+} LanPeer;
+
+struct _SeafLanBlockManagerPriv {
+    evutil_socket_t        send_fd;
+    evutil_socket_t        recv_fd;
+    struct sockaddr       *mcast_addr;
+    socklen_t              mcast_len;
+    struct evconnlistener *listener;
+    int                    port;
+
+    /* peer_id -> LanPeer, only used in the main thread */
+    GHashTable            *peers;
+    CcnetTimer            *announce_timer;
+    CcnetTimer            *recv_timer;
+
+    /* Protects the fields below, which are used by the serving threads. */
+    pthread_mutex_t        lock;
+    GHashTable            *shared_repos;
+    int                    n_clients;
+};
+
+typedef struct {
+    char        addr[64];
+    int         port;
+} LanSource;
+
+typedef struct {
+    SeafLanBlockManager *mgr;
+    char                 repo_id[37];
+    GList               *sources;
+    GList               *block_ids;
+    GList               *fetched;
+    LanFetchDoneFunc     func;
+    void                *data;
+} FetchData;
+
+typedef struct {
+    SeafLanBlockManager *mgr;
+    evutil_socket_t      fd;
+} ServeData;
+
+static int announce_pulse (void *vmgr);
+static int recv_pulse (void *vmgr);
+static void accept_connection (struct evconnlistener *listener,
+                               evutil_socket_t connfd,
+                               struct sockaddr *saddr, int socklen,
+                               void *vmgr);
+
+static void
+lan_peer_free (LanPeer *peer)
+{
+    g_hash_table_destroy (peer->repos);
+    g_free (peer);
+}
+
+SeafLanBlockManager *
+seaf_lan_block_manager_new (SeafileSession *seaf)
+{
+    SeafLanBlockManager *mgr = g_new0 (SeafLanBlockManager, 1);
+    SeafLanBlockManagerPriv *priv = g_new0 (SeafLanBlockManagerPriv, 1);
+
+    mgr->seaf = seaf;
+    mgr->priv = priv;
+
+    priv->send_fd = -1;
+    priv->recv_fd = -1;
+    priv->peers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, (GDestroyNotify)lan_peer_free);
+    priv->shared_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    pthread_mutex_init (&priv->lock, NULL);
+
+    return mgr;
+}
+
+static int
+start_block_server (SeafLanBlockManager *mgr)
+{
+    SeafLanBlockManagerPriv *priv = mgr->priv;
+    evutil_socket_t listenfd;
+    gboolean exists;
+    int port;
+
+    port = seafile_session_config_get_int (mgr->seaf, KEY_LAN_BLOCK_PORT,
+                                           &exists);
+    if (!exists || port < 0)
+        port = 0;
+
+    /* A random port is chosen if port is 0. */
+    listenfd = ccnet_net_bind_v4 ("0.0.0.0", &port);
+    if (listenfd < 0) {
+        seaf_warning ("[lan] Failed to bind port %d.\n", port);
+        return -1;
+    }
+
+    priv->listener = evconnlistener_new (NULL, accept_connection, mgr,
+                                         LEV_OPT_REUSEABLE |
+                                         LEV_OPT_CLOSE_ON_EXEC |
+                                         LEV_OPT_LEAVE_SOCKETS_BLOCKING,
+                                         -1, listenfd);
+    if (!priv->listener) {
+        seaf_warning ("[lan] Failed to listen on port %d.\n", port);
+        evutil_closesocket (listenfd);
+        return -1;
+    }
+    priv->port = port;
+
+    return 0;
+}
+
+int
+seaf_lan_block_manager_start (SeafLanBlockManager *mgr)
+{
+    SeafLanBlockManagerPriv *priv = mgr->priv;
+    char *value;
+
+    value = seafile_session_config_get_string (mgr->seaf, KEY_LAN_BLOCK_SHARE);
+    mgr->enabled = (g_strcmp0 (value, "on") == 0);
+    g_free (value);
+
+    if (!mgr->enabled)
+        return 0;
+
+    priv->send_fd = udp_client (LAN_MCAST_ADDR, LAN_MCAST_PORT,
+                                &priv->mcast_addr, &priv->mcast_len);
+    if (priv->send_fd < 0)
+        goto error;
+
+    priv->recv_fd = create_multicast_sock (priv->mcast_addr, priv->mcast_len);
+    if (priv->recv_fd < 0)
+        goto error;
+    evutil_make_socket_nonblocking (priv->recv_fd);
+    mcast_set_loop (priv->send_fd, 0);
+
+    if (start_block_server (mgr) < 0)
+        goto error;
+
+    priv->announce_timer = ccnet_timer_new (announce_pulse, mgr,
+                                            ANNOUNCE_INTERVAL * 1000);
+    priv->recv_timer = ccnet_timer_new (recv_pulse, mgr, RECV_INTERVAL);
+    announce_pulse (mgr);
+
+    seaf_message ("Share blocks with LAN peers on port %d.\n", priv->port);
+    return 0;
+
+error:
+    /* Don't fail the daemon, just download from the server. */
+    seaf_warning ("[lan] Failed to start, LAN block sharing is disabled.\n");
+    if (priv->send_fd >= 0)
+        evutil_closesocket (priv->send_fd);
+    if (priv->recv_fd >= 0)
+        evutil_closesocket (priv->recv_fd);
+    priv->send_fd = priv->recv_fd = -1;
+    mgr->enabled = FALSE;
+    return 0;
+}
+
+/* Announce */
+
+static void
+send_announce (SeafLanBlockManager *mgr, GString *buf)
+{
+    SeafLanBlockManagerPriv *priv = mgr->priv;
+
+    if (sendto (priv->send_fd, buf->str, buf->len, 0,
+                priv->mcast_addr, priv->mcast_len) < 0)
+        seaf_debug ("[lan] Failed to send announce: %s.\n",
+                    strerror(sockerrno));
+}
+
+static int
+announce_pulse (void *vmgr)
+{
+    SeafLanBlockManager *mgr = vmgr;
+    SeafLanBlockManagerPriv *priv = mgr->priv;
+    GList *repos, *ptr;
+    SeafRepo *repo;
+    GString *buf;
+    int hdr_len;
+
+    buf = g_string_new (NULL);
+    g_string_printf (buf, "%s %s %d\n", ANNOUNCE_MAGIC,
+                     mgr->seaf->session->base.id, priv->port);
+    hdr_len = buf->len;
+
+    pthread_mutex_lock (&priv->lock);
+    g_hash_table_remove_all (priv->shared_repos);
+
+    repos = seaf_repo_manager_get_repo_list (mgr->seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        if (!repo->head || repo->delete_pending || repo->is_corrupted)
+            continue;
+
+        g_hash_table_insert (priv->shared_repos, g_strdup(repo->id),
+                             (gpointer)1);
+
+        if (buf->len + 37 > MAX_DATAGRAM) {
+            send_announce (mgr, buf);
+            g_string_truncate (buf, hdr_len);
+        }
+        g_string_append_printf (buf, "%s\n", repo->id);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    if (buf->len > hdr_len)
+        send_announce (mgr, buf);
+
+    g_list_free (repos);
+    g_string_free (buf, TRUE);
+
+    return TRUE;
+}
+
+/* "seaf-lan-1 <peer_id> <port>\n<repo_id>\n..." */
+static void
+handle_announce (SeafLanBlockManager *mgr, char *msg,
+                 struct sockaddr_storage *from, socklen_t fromlen)
+{
+    SeafLanBlockManagerPriv *priv = mgr->priv;
+    char **lines, **hdr = NULL, **ptr;
+    const char *addr;
+    LanPeer *peer;
+    int port, now = (int)time(NULL);
+
+    lines = g_strsplit (msg, "\n", -1);
+    if (!lines[0])
+        goto out;
+
+    hdr = g_strsplit (lines[0], " ", 3);
+    if (g_strv_length (hdr) != 3 || strcmp (hdr[0], ANNOUNCE_MAGIC) != 0 ||
+        strlen(hdr[1]) != 40)
+        goto out;
+
+    if (strcmp (hdr[1], mgr->seaf->session->base.id) == 0)
+        goto out;
+
+    port = atoi (hdr[2]);
+    addr = sock_ntop ((struct sockaddr *)from, fromlen);
+    if (port <= 0 || port > 65535 || !addr)
+        goto out;
+
+    peer = g_hash_table_lookup (priv->peers, hdr[1]);
+    if (!peer) {
+        peer = g_new0 (LanPeer, 1);
+        memcpy (peer->peer_id, hdr[1], 40);
+        peer->repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+        g_hash_table_insert (priv->peers, peer->peer_id, peer);
+        seaf_debug ("[lan] Found peer %.8s at %s:%d.\n", hdr[1], addr, port);
+    }
+    g_strlcpy (peer->addr, addr, sizeof(peer->addr));
+    peer->port = port;
+    peer->last_seen = now;
+
+    for (ptr = lines + 1; *ptr; ++ptr) {
+        if (!is_uuid_valid (*ptr))
+            continue;
+        g_hash_table_replace (peer->repos, g_strdup(*ptr),
+                              GINT_TO_POINTER(now));
+    }
+
+out:
+    g_strfreev (hdr);
+    g_strfreev (lines);
+}
+
+static void
+expire_peers (SeafLanBlockManager *mgr)
+{
+    GHashTableIter iter, repo_iter;
+    gpointer value, repo_time;
+    LanPeer *peer;
+    int now = (int)time(NULL);
+
+    g_hash_table_iter_init (&iter, mgr->priv->peers);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        peer = value;
+        if (now - peer->last_seen > PEER_TIMEOUT) {
+            seaf_debug ("[lan] Peer %.8s is gone.\n", peer->peer_id);
+            g_hash_table_iter_remove (&iter);
+            continue;
+        }
+
+        g_hash_table_iter_init (&repo_iter, peer->repos);
+        while (g_hash_table_iter_next (&repo_iter, NULL, &repo_time)) {
+            if (now - GPOINTER_TO_INT(repo_time) > PEER_TIMEOUT)
+                g_hash_table_iter_remove (&repo_iter);
+        }
+    }
+}
+
+static int
+recv_pulse (void *vmgr)
+{
+    SeafLanBlockManager *mgr = vmgr;
+    char buf[MAX_DATAGRAM + 1];
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    int n;
+
+    while (1) {
+        fromlen = sizeof(from);
+        n = recvfrom (mgr->priv->recv_fd, buf, MAX_DATAGRAM, 0,
+                      (struct sockaddr *)&from, &fromlen);
+        if (n <= 0)
+            break;
+        buf[n] = '\0';
+        handle_announce (mgr, buf, &from, fromlen);
+    }
+
+    expire_peers (mgr);
+
+    return TRUE;
+}
+
+gboolean
+seaf_lan_block_manager_has_source (SeafLanBlockManager *mgr,
+                                   const char *repo_id)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!mgr->enabled)
+        return FALSE;
+
+    g_hash_table_iter_init (&iter, mgr->priv->peers);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        if (g_hash_table_lookup (((LanPeer *)value)->repos, repo_id))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Common IO */
+
+static void
+set_socket_timeout (evutil_socket_t fd)
+{
+#ifdef WIN32
+    DWORD tv = LAN_IO_TIMEOUT * 1000;
+#else
+    struct timeval tv = { LAN_IO_TIMEOUT, 0 };
+#endif
+
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv));
+    setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+}
+
+/* Read a line of at most @len - 1 bytes, without the trailing '\n'. */
+static int
+read_line (evutil_socket_t fd, char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len - 1; ++i) {
+        if (recvn (fd, buf + i, 1) != 1)
+            return -1;
+        if (buf[i] == '\n') {
+            buf[i] = '\0';
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Block server */
+
+static gboolean
+repo_is_shared (SeafLanBlockManager *mgr, const char *repo_id)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    ret = (g_hash_table_lookup (mgr->priv->shared_repos, repo_id) != NULL);
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    return ret;
+}
+
+static int
+send_block (evutil_socket_t fd, const char *block_id)
+{
+    SeafBlockManager *block_mgr = seaf->block_mgr;
+    BlockHandle *handle;
+    BlockMetadata *md;
+    char buf[32];
+    char data[8192];
+    int n, remain, ret = -1;
+
+    handle = seaf_block_manager_open_block (block_mgr, block_id, BLOCK_READ);
+    if (!handle) {
+        n = snprintf (buf, sizeof(buf), "-1\n");
+        return (sendn (fd, buf, n) == n) ? 0 : -1;
+    }
+
+    md = seaf_block_manager_stat_block_by_handle (block_mgr, handle);
+    if (!md)
+        goto out;
+    remain = md->size;
+    g_free (md);
+
+    n = snprintf (buf, sizeof(buf), "%d\n", remain);
+    if (sendn (fd, buf, n) != n)
+        goto out;
+
+    while (remain > 0) {
+        n = seaf_block_manager_read_block (block_mgr, handle, data,
+                                           MIN (remain, sizeof(data)));
+        if (n <= 0)
+            goto out;
+        if (sendn (fd, data, n) != n)
+            goto out;
+        remain -= n;
+    }
+    ret = 0;
+
+out:
+    seaf_block_manager_close_block (block_mgr, handle);
+    seaf_block_manager_block_handle_free (block_mgr, handle);
+    return ret;
+}
+
+/* Requests are "<repo_id> <block_id>\n", one block at a time. */
+static void *
+serve_client (void *vdata)
+{
+    ServeData *sd = vdata;
+    char line[128];
+    char *repo_id, *block_id;
+    int n;
+
+    set_socket_timeout (sd->fd);
+
+    while (read_line (sd->fd, line, sizeof(line)) > 0) {
+        repo_id = line;
+        block_id = strchr (line, ' ');
+        if (!block_id)
+            break;
+        *block_id++ = '\0';
+
+        if (!is_uuid_valid (repo_id) || strlen(block_id) != 40)
+            break;
+
+        if (!repo_is_shared (sd->mgr, repo_id)) {
+            n = snprintf (line, sizeof(line), "-1\n");
+            if (sendn (sd->fd, line, n) != n)
+                break;
+            continue;
+        }
+
+        if (send_block (sd->fd, block_id) < 0)
+            break;
+    }
+
+    return vdata;
+}
+
+static void
+serve_client_done (void *vdata)
+{
+    ServeData *sd = vdata;
+
+    evutil_closesocket (sd->fd);
+
+    pthread_mutex_lock (&sd->mgr->priv->lock);
+    --sd->mgr->priv->n_clients;
+    pthread_mutex_unlock (&sd->mgr->priv->lock);
+
+    g_free (sd);
+}
+
+static void
+accept_connection (struct evconnlistener *listener,
+                   evutil_socket_t connfd,
+                   struct sockaddr *saddr, int socklen,
+                   void *vmgr)
+{
+    SeafLanBlockManager *mgr = vmgr;
+    SeafLanBlockManagerPriv *priv = mgr->priv;
+    ServeData *sd;
+
+    pthread_mutex_lock (&priv->lock);
+    if (priv->n_clients >= MAX_LAN_CLIENTS) {
+        pthread_mutex_unlock (&priv->lock);
+        evutil_closesocket (connfd);
+        return;
+    }
+    ++priv->n_clients;
+    pthread_mutex_unlock (&priv->lock);
+
+    sd = g_new0 (ServeData, 1);
+    sd->mgr = mgr;
+    sd->fd = connfd;
+    ccnet_job_manager_schedule_job (mgr->seaf->job_mgr,
+                                    serve_client, serve_client_done, sd);
+}
+
+/* Fetch */
+
+static int
+write_block (const char *block_id, const char *data, int len)
+{
+    SeafBlockManager *block_mgr = seaf->block_mgr;
+    BlockHandle *handle;
+    int ret = -1;
+
+    handle = seaf_block_manager_open_block (block_mgr, block_id, BLOCK_WRITE);
+    if (!handle)
+        return -1;
+
+    if (seaf_block_manager_write_block (block_mgr, handle, data, len) != len)
+        goto out;
+    if (seaf_block_manager_close_block (block_mgr, handle) < 0)
+        goto out;
+    if (seaf_block_manager_commit_block (block_mgr, handle) < 0)
+        goto out;
+    ret = 0;
+
+out:
+    seaf_block_manager_block_handle_free (block_mgr, handle);
+    return ret;
+}
+
+/*
+ * Returns 1 if the block is fetched, 0 if the peer doesn't have it,
+ * -1 if the connection is broken.
+ */
+static int
+fetch_block (evutil_socket_t fd, const char *repo_id, const char *block_id)
+{
+    char line[128];
+    unsigned char sha1[20];
+    char hex[41];
+    char *data;
+    int n, size, ret = -1;
+
+    n = snprintf (line, sizeof(line), "%s %s\n", repo_id, block_id);
+    if (sendn (fd, line, n) != n)
+        return -1;
+
+    if (read_line (fd, line, sizeof(line)) <= 0)
+        return -1;
+    size = atoi (line);
+    if (size < 0)
+        return 0;
+    if (size > MAX_LAN_BLOCK_SIZE)
+        return -1;
+
+    data = g_malloc (size + 1);
+    if (recvn (fd, data, size) != size)
+        goto out;
+
+    seaf_sha1 (data, size, sha1);
+    rawdata_to_hex (sha1, hex, 20);
+    if (strcmp (hex, block_id) != 0) {
+        seaf_warning ("[lan] Got corrupted block %.8s from LAN peer.\n",
+                      block_id);
+        goto out;
+    }
+
+    ret = (write_block (block_id, data, size) == 0) ? 1 : 0;
+
+out:
+    g_free (data);
+    return ret;
+}
+
+static void
+fetch_from_source (FetchData *fd_data, LanSource *src)
+{
+    struct sockaddr_storage sa;
+    evutil_socket_t fd;
+    GList *ptr, *next;
+    int ret;
+
+    if (sock_pton (src->addr, (uint16_t)src->port, &sa) < 0)
+        return;
+
+    fd = ccnet_net_open_tcp ((struct sockaddr *)&sa, 0);
+    if (fd < 0)
+        return;
+    set_socket_timeout (fd);
+
+    for (ptr = fd_data->block_ids; ptr; ptr = next) {
+        next = ptr->next;
+
+        ret = fetch_block (fd, fd_data->repo_id, ptr->data);
+        if (ret < 0)
+            break;
+        if (ret == 1) {
+            fd_data->block_ids = g_list_remove_link (fd_data->block_ids, ptr);
+            fd_data->fetched = g_list_concat (ptr, fd_data->fetched);
+        }
+    }
+
+    evutil_closesocket (fd);
+}
+
+static void *
+fetch_blocks_thread (void *vdata)
+{
+    FetchData *fd_data = vdata;
+    GList *ptr;
+
+    for (ptr = fd_data->sources; ptr && fd_data->block_ids; ptr = ptr->next)
+        fetch_from_source (fd_data, ptr->data);
+
+    return vdata;
+}
+
+static void
+fetch_blocks_done (void *vdata)
+{
+    FetchData *fd_data = vdata;
+
+    seaf_debug ("[lan] Fetched %u blocks of repo %.8s from LAN peers.\n",
+                g_list_length (fd_data->fetched), fd_data->repo_id);
+
+    fd_data->func (fd_data->fetched, fd_data->data);
+
+    string_list_free (fd_data->fetched);
+    string_list_free (fd_data->block_ids);
+    g_list_free_full (fd_data->sources, g_free);
+    g_free (fd_data);
+}
+
+int
+seaf_lan_block_manager_fetch_blocks (SeafLanBlockManager *mgr,
+                                     const char *repo_id,
+                                     GList *block_ids,
+                                     LanFetchDoneFunc func,
+                                     void *data)
+{
+    FetchData *fd_data;
+    GHashTableIter iter;
+    gpointer value;
+    LanPeer *peer;
+    LanSource *src;
+    GList *sources = NULL;
+
+    if (mgr->enabled) {
+        g_hash_table_iter_init (&iter, mgr->priv->peers);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            peer = value;
+            if (!g_hash_table_lookup (peer->repos, repo_id))
+                continue;
+            src = g_new0 (LanSource, 1);
+            memcpy (src->addr, peer->addr, sizeof(src->addr));
+            src->port = peer->port;
+            sources = g_list_prepend (sources, src);
+        }
+    }
+
+    if (!sources) {
+        string_list_free (block_ids);
+        return -1;
+    }
+
+    fd_data = g_new0 (FetchData, 1);
+    fd_data->mgr = mgr;
+    memcpy (fd_data->repo_id, repo_id, 36);
+    fd_data->sources = sources;
+    fd_data->block_ids = block_ids;
+    fd_data->func = func;
+    fd_data->data = data;
+
+    ccnet_job_manager_schedule_job (mgr->seaf->job_mgr,
+                                    fetch_blocks_thread, fetch_blocks_done,
+                                    fd_data);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_LAN_BLOCK_MGR_H
+#define SEAF_LAN_BLOCK_MGR_H
+
+#include <glib.h>
+
+/**
+ * Fetches blocks from other clients on the same LAN.
+ *
+ * Every client that enables "lan_block_share" multicasts the ids of the
+ * repos it holds every ANNOUNCE_INTERVAL seconds and serves their blocks
+ * on a TCP port. When downloading a repo, the transfer manager fetches
+ * missing blocks from the LAN peers holding the same repo before asking
+ * the server, so that many clients cloning the same library in one office
+ * only fetch it once over WAN.
+ *
+ * Blocks are content addressed: a peer only serves a block whose id is
+ * asked for, and every fetched block is verified against its id before
+ * it is written. So a peer cannot learn anything it doesn't already know,
+ * nor feed us corrupted data.
+ */
+
+#define KEY_LAN_BLOCK_SHARE     "lan_block_share"
+#define KEY_LAN_BLOCK_PORT      "lan_block_port"
+
+typedef struct _SeafLanBlockManager        SeafLanBlockManager;
+typedef struct _SeafLanBlockManagerPriv    SeafLanBlockManagerPriv;
+
+struct _SeafileSession;
+
+struct _SeafLanBlockManager {
+    struct _SeafileSession *seaf;
+    gboolean                enabled;
+
+    SeafLanBlockManagerPriv *priv;
+};
+
+/*
+ * Called in the main thread with the ids of the blocks written.
+ * The list is freed after return.
+ */
+typedef void (*LanFetchDoneFunc) (GList *fetched, void *data);
+
+SeafLanBlockManager *
+seaf_lan_block_manager_new (struct _SeafileSession *seaf);
+
+int
+seaf_lan_block_manager_start (SeafLanBlockManager *mgr);
+
+/* Whether some LAN peer announced @repo_id recently. */
+gboolean
+seaf_lan_block_manager_has_source (SeafLanBlockManager *mgr,
+                                   const char *repo_id);
+
+/*
+ * Fetch @block_ids of @repo_id from LAN peers in a worker thread.
+ * @block_ids are taken over by the manager.
+ *
+ * Returns -1 if no LAN peer holds the repo, @func is not called then.
+ */
+int
+seaf_lan_block_manager_fetch_blocks (SeafLanBlockManager *mgr,
+                                     const char *repo_id,
+                                     GList *block_ids,
+                                     LanFetchDoneFunc func,
+                                     void *data);
+
+#endif
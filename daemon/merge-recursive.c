@@ -87,6 +87,7 @@ static int seafile_merge_trees(struct merge_options *o,
     opts->dst_index = o->index;
     if (o->crypt)
         opts->crypt = o->crypt;
+    opts->chunker = o->chunker;
 
     fill_tree_descriptor(t+0, common->dir_id);
     fill_tree_descriptor(t+1, head->dir_id);
@@ -95,9 +96,15 @@ static int seafile_merge_trees(struct merge_options *o,
     rc = unpack_trees(3, t, opts);
 
     if (rc == 0) {
+        if (o->placeholders && !o->call_depth)
+            mark_placeholders (&opts->result, o->index);
+        copy_index_extensions(&opts->result, o->index);
         discard_index(o->index);
         *(o->index) = opts->result;
 
+        if (!o->call_depth)
+            apply_sparse_paths (o->index, o->sparse_paths, TRUE);
+
         if (o->collect_blocks_only)
             collect_new_blocks_from_index (o->index, o->bl);
     }
@@ -354,7 +361,8 @@ static int remove_file(struct merge_options *o, int clean,
                        unsigned int ctime, unsigned int mtime)
 {
     int update_cache = o->call_depth || clean;
-    int update_working_directory = !o->call_depth && !no_wd;
+    int update_working_directory = !o->call_depth && !no_wd &&
+        sparse_path_included (o->sparse_paths, path, FALSE);
 
     if (o->collect_blocks_only)
         return 0;
@@ -512,6 +520,9 @@ static int update_file_flags(struct merge_options *o,
 
     g_assert(S_ISREG(mode));
 
+    if (!sparse_path_included (o->sparse_paths, path, FALSE))
+        update_wd = 0;
+
     if (update_wd && o->collect_blocks_only) {
         fill_seafile_blocks (sha, o->bl);
         return clean;
@@ -549,7 +560,7 @@ static int update_file_flags(struct merge_options *o,
         if (update_cache && o->recover_merge && 
             g_lstat(new_path, &st) == 0 && S_ISREG(st.st_mode)) {
             if (compare_file_content (new_path, &st, sha, 
-                                      o->crypt) == 0) {
+                                      o->crypt, o->chunker) == 0) {
                 real_path = new_path;
                 goto update_cache;
             }
@@ -571,7 +582,8 @@ static int update_file_flags(struct merge_options *o,
                                           new_path,
                                           mode,
                                           o->crypt,
-                                          conflict_suffix) < 0) {
+                                          conflict_suffix,
+                                          NULL, NULL) < 0) {
             g_warning("Failed to checkout file %s.\n", file_id);
             g_free(new_path);
             g_free (conflict_suffix);
@@ -958,4 +970,5 @@ void clear_merge_options(struct merge_options *o)
     g_string_free (o->obuf, TRUE);
     g_hash_table_destroy (o->current_file_set);
     g_hash_table_destroy (o->current_directory_set);
+    g_strfreev (o->sparse_paths);
 }
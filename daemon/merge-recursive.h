@@ -23,6 +23,9 @@ struct merge_options {
     gboolean recover_merge;
     gboolean force_merge;
     SeafileCrypt *crypt;
+    int chunker;
+    char **sparse_paths;    /* freed by clear_merge_options() */
+    gboolean placeholders;  /* check out new files as placeholders */
 
     /* True if we only want to know the files that would be
      * updated in this merge, but don't want to update them in the
@@ -4,14 +4,348 @@
 
 #include <ccnet.h>
 
+#include <glib/gstdio.h>
+
 #include "index/index.h"
 #include "unpack-trees.h"
 #include "merge-recursive.h"
+#include "merge-new.h"
+#include "diff-simple.h"
 #include "merge.h"
 
 #include "seafile-session.h"
 #include "vc-utils.h"
 #include "vc-common.h"
+#include "gc.h"
+
+/*
+ * Merge on the trees, without the index: seaf_merge_trees() builds the
+ * merged tree from the dirs, giving conflicting files a conflict name in
+ * it, so the merge is always clean. Only the paths that differ between
+ * the head tree and the merged tree are then checked out, and only their
+ * index entries are changed.
+ *
+ * Interrupted merges, placeholders, and worktrees with changes the merge
+ * would overwrite go through merge_recursive() instead.
+ */
+#define MERGE_NEEDS_INDEX 1
+
+typedef struct TreeMerge {
+    const char *worktree;
+    struct index_state *istate;
+    char **sparse_paths;
+    SeafileCrypt *crypt;
+    char merged_root[41];
+    GList *changes;             /* from the head tree to the merged tree */
+} TreeMerge;
+
+static gboolean
+is_removal (DiffEntry *de)
+{
+    return (de->status == DIFF_STATUS_DELETED ||
+            de->status == DIFF_STATUS_DIR_DELETED);
+}
+
+/*
+ * Whether the worktree file of @path is still the one in the index.
+ * Racily clean entries aren't trusted, the index merge checks those.
+ */
+static gboolean
+worktree_file_unchanged (TreeMerge *tm, const char *path, gboolean may_be_missing)
+{
+    struct cache_entry *ce;
+    struct stat st;
+    char *real_path;
+    gboolean ret;
+
+    ce = index_name_exists (tm->istate, path, strlen(path), 0);
+    if (!ce || ce_stage (ce) || ce_placeholder (ce))
+        return FALSE;
+
+    real_path = g_build_path (PATH_SEPERATOR, tm->worktree, path, NULL);
+    if (g_lstat (real_path, &st) < 0)
+        ret = may_be_missing;
+    else
+        ret = (S_ISREG(st.st_mode) &&
+               !ie_match_stat (tm->istate, ce, &st, 0) &&
+               !ie_racy_timestamp (tm->istate, ce));
+    g_free (real_path);
+
+    return ret;
+}
+
+static gboolean
+worktree_path_free (TreeMerge *tm, const char *path, gboolean dir_ok)
+{
+    struct stat st;
+    char *real_path;
+    gboolean ret;
+
+    real_path = g_build_path (PATH_SEPERATOR, tm->worktree, path, NULL);
+    ret = (g_lstat (real_path, &st) < 0 || (dir_ok && S_ISDIR(st.st_mode)));
+    g_free (real_path);
+
+    return ret;
+}
+
+/*
+ * Check all the changes before touching anything. Returns
+ * MERGE_NEEDS_INDEX if a file to be replaced or removed was changed in
+ * the worktree, or an untracked file is in the way, and -1 if a file is
+ * locked.
+ */
+static int
+check_tree_merge (TreeMerge *tm)
+{
+    GList *ptr;
+    DiffEntry *de;
+    gboolean ok;
+
+    for (ptr = tm->changes; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (!sparse_path_included (tm->sparse_paths, de->name, FALSE))
+            continue;
+
+        switch (de->status) {
+        case DIFF_STATUS_DELETED:
+            ok = worktree_file_unchanged (tm, de->name, TRUE);
+            break;
+        case DIFF_STATUS_MODIFIED:
+            ok = worktree_file_unchanged (tm, de->name, FALSE);
+            break;
+        case DIFF_STATUS_ADDED:
+            ok = worktree_path_free (tm, de->name, FALSE);
+            break;
+        case DIFF_STATUS_DIR_ADDED:
+            ok = worktree_path_free (tm, de->name, TRUE);
+            break;
+        default:
+            ok = TRUE;
+            break;
+        }
+        if (!ok) {
+            g_debug ("[merge] %s is changed in worktree, use index.\n",
+                     de->name);
+            return MERGE_NEEDS_INDEX;
+        }
+
+#ifdef WIN32
+        if ((de->status == DIFF_STATUS_DELETED ||
+             de->status == DIFF_STATUS_MODIFIED) &&
+            file_locked_on_windows (de->name, tm->worktree)) {
+            g_debug ("[merge] %s is locked, quit merge now.\n", de->name);
+            return -1;
+        }
+#endif
+    }
+
+    return 0;
+}
+
+/* Remove @real_path and the dirs left empty above it. */
+static void
+remove_worktree_path (const char *worktree, char *real_path, gboolean is_dir)
+{
+    char *slash;
+
+    if (is_dir)
+        g_rmdir (real_path);
+    else if (g_unlink (real_path) < 0 && errno != ENOENT)
+        g_warning ("Failed to remove %s: %s.\n", real_path, strerror(errno));
+
+    while ((slash = strrchr (real_path, '/')) != NULL) {
+        *slash = '\0';
+        if (strcmp (real_path, worktree) == 0 || g_rmdir (real_path) < 0)
+            break;
+    }
+}
+
+static int
+apply_removal (TreeMerge *tm, DiffEntry *de)
+{
+    char *real_path;
+
+    if (sparse_path_included (tm->sparse_paths, de->name, FALSE)) {
+        real_path = g_build_path (PATH_SEPERATOR, tm->worktree, de->name, NULL);
+        remove_worktree_path (tm->worktree, real_path,
+                              de->status == DIFF_STATUS_DIR_DELETED);
+        g_free (real_path);
+    }
+
+    return remove_file_from_index (tm->istate, de->name);
+}
+
+static int
+apply_update (TreeMerge *tm, DiffEntry *de)
+{
+    gboolean included;
+    char *real_path = NULL, *dir = NULL, *obj_id;
+    guint32 mode = 0;
+    uint32_t *block_sizes = NULL, n_blocks = 0;
+    struct cache_entry *ce;
+    int ret = 0;
+
+    obj_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, tm->merged_root,
+                                             de->name, &mode, NULL);
+    if (!obj_id) {
+        g_warning ("Failed to find %s in merged tree.\n", de->name);
+        return -1;
+    }
+
+    included = sparse_path_included (tm->sparse_paths, de->name, FALSE);
+    real_path = g_build_path (PATH_SEPERATOR, tm->worktree, de->name, NULL);
+
+    if (included) {
+        dir = g_path_get_dirname (real_path);
+        if (checkdir_with_mkdir (dir) < 0) {
+            g_warning ("Failed to create directory %s.\n", dir);
+            ret = -1;
+            goto out;
+        }
+
+        if (S_ISDIR(mode)) {
+            if (g_mkdir (real_path, 0777) < 0 && errno != EEXIST) {
+                g_warning ("Failed to create empty dir %s.\n", real_path);
+                ret = -1;
+                goto out;
+            }
+        } else if (seaf_fs_manager_checkout_file (seaf->fs_mgr, obj_id,
+                                                  real_path, mode, tm->crypt,
+                                                  NULL, &block_sizes,
+                                                  &n_blocks) < 0) {
+            g_warning ("Failed to checkout file %s.\n", real_path);
+            ret = -1;
+            goto out;
+        }
+    }
+
+    ce = make_cache_entry (mode, de->sha1, de->name, real_path, 0, included);
+    if (!ce) {
+        ret = -1;
+        goto out;
+    }
+    if (!included)
+        ce->ce_flags |= CE_SKIP_WORKTREE;
+    if (add_index_entry (tm->istate, ce,
+                         ADD_CACHE_OK_TO_ADD | ADD_CACHE_OK_TO_REPLACE) < 0) {
+        ret = -1;
+        goto out;
+    }
+    if (n_blocks > 0)
+        index_set_blocks (tm->istate, de->name, de->sha1,
+                          block_sizes, n_blocks);
+
+out:
+    free (block_sizes);
+    g_free (dir);
+    g_free (real_path);
+    g_free (obj_id);
+    return ret;
+}
+
+static int
+apply_tree_merge (TreeMerge *tm)
+{
+    GList *ptr;
+    DiffEntry *de;
+    int ret = 0;
+
+    /* Removals first, they may make room for new files. */
+    for (ptr = tm->changes; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (is_removal (de) && apply_removal (tm, de) < 0)
+            ret = -1;
+    }
+
+    for (ptr = tm->changes; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (!is_removal (de) && apply_update (tm, de) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+/* Merge the trees and list the changes to the head tree. */
+static int
+prepare_tree_merge (TreeMerge *tm, SeafRepo *repo,
+                    SeafCommit *head, SeafCommit *remote, SeafCommit *common)
+{
+    MergeOptions mopt;
+    const char *roots[3];
+
+    memset (&mopt, 0, sizeof(mopt));
+    mopt.n_ways = 3;
+    mopt.do_merge = TRUE;
+    memcpy (mopt.remote_head, remote->commit_id, 40);
+
+    roots[0] = common->root_id;
+    roots[1] = head->root_id;
+    roots[2] = remote->root_id;
+    if (seaf_merge_trees (3, roots, &mopt) < 0) {
+        g_warning ("Failed to merge trees of repo %s.\n", repo->id);
+        return -1;
+    }
+
+    memset (tm, 0, sizeof(TreeMerge));
+    tm->worktree = repo->worktree;
+    memcpy (tm->merged_root, mopt.merged_tree_root, 40);
+    tm->sparse_paths = seaf_repo_manager_get_sparse_paths (repo->manager,
+                                                           repo->id);
+
+    if (diff_roots (head->root_id, tm->merged_root, &tm->changes) < 0) {
+        g_strfreev (tm->sparse_paths);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+clear_tree_merge (TreeMerge *tm)
+{
+    GList *ptr;
+
+    for (ptr = tm->changes; ptr; ptr = ptr->next)
+        diff_entry_free ((DiffEntry *)ptr->data);
+    g_list_free (tm->changes);
+    g_strfreev (tm->sparse_paths);
+    g_free (tm->crypt);
+}
+
+/*
+ * Returns 0 with the merged root in @root_id, MERGE_NEEDS_INDEX if
+ * nothing was done and the index based merge has to be used, or -1.
+ */
+static int
+merge_on_trees (SeafRepo *repo, struct index_state *istate,
+                SeafCommit *head, SeafCommit *remote, SeafCommit *common,
+                char **root_id)
+{
+    TreeMerge tm;
+    int ret;
+
+    if (prepare_tree_merge (&tm, repo, head, remote, common) < 0)
+        return -1;
+    tm.istate = istate;
+
+    ret = check_tree_merge (&tm);
+    if (ret != 0)
+        goto out;
+
+    if (repo->encrypted)
+        tm.crypt = seafile_crypt_new (repo->enc_version,
+                                      repo->enc_key,
+                                      repo->enc_iv);
+
+    ret = apply_tree_merge (&tm);
+    if (ret == 0)
+        *root_id = g_strdup (tm.merged_root);
+
+out:
+    clear_tree_merge (&tm);
+    return ret;
+}
 
 static int
 do_real_merge (SeafRepo *repo, 
@@ -39,6 +373,21 @@ do_real_merge (SeafRepo *repo,
     }
 
     init_merge_options (&opts);
+
+    if (!recover_merge && !repo->placeholders) {
+        ret = merge_on_trees (repo, &istate, head, remote, common, &root_id);
+        if (ret == 0) {
+            clean = 1;
+            goto write_index;
+        }
+        if (ret < 0) {
+            /* Keep the entries of the files already updated. */
+            update_index (&istate, index_path);
+            goto out;
+        }
+        ret = 0;
+    }
+
     opts.index = &istate;
     opts.worktree = repo->worktree;
     opts.ancestor = "common ancestor";
@@ -46,6 +395,10 @@ do_real_merge (SeafRepo *repo,
     opts.branch2 = remote->creator_name;
     opts.remote_head = remote->commit_id;
     opts.recover_merge = recover_merge;
+    opts.chunker = repo->chunker;
+    opts.sparse_paths = seaf_repo_manager_get_sparse_paths (repo->manager,
+                                                            repo->id);
+    opts.placeholders = repo->placeholders;
     if (repo->encrypted) {
         opts.crypt = seafile_crypt_new (repo->enc_version, 
                                         repo->enc_key, 
@@ -58,6 +411,7 @@ do_real_merge (SeafRepo *repo,
     if (ret < 0)
         goto out;
 
+write_index:
     if (update_index (&istate, index_path) < 0) {
         *error = g_strdup ("Internal error.\n");
         ret = -1;
@@ -85,6 +439,7 @@ do_real_merge (SeafRepo *repo,
             ret = -1;
             goto out;
         }
+        gc_head_moved (head->commit_id, merged->commit_id);
         seaf_branch_set_commit (head_branch, merged->commit_id);
         seaf_branch_manager_update_branch (seaf->branch_mgr, head_branch);
         g_debug ("Auto merged.\n");
@@ -215,6 +570,7 @@ get_new_blocks_ff (SeafRepo *repo,
     struct tree_desc trees[2];
     struct unpack_trees_options topts;
     struct index_state istate;
+    char **sparse_paths;
     int ret = 0;
 
     memset (&istate, 0, sizeof(istate));
@@ -242,6 +598,13 @@ get_new_blocks_ff (SeafRepo *repo,
         goto out;
     }
 
+    /* Only the blocks of the synced folders are downloaded. */
+    sparse_paths = seaf_repo_manager_get_sparse_paths (mgr, repo->id);
+    apply_sparse_paths (&topts.result, sparse_paths, TRUE);
+    g_strfreev (sparse_paths);
+    if (repo->placeholders)
+        mark_placeholders (&topts.result, &istate);
+
     *bl = block_list_new ();
     collect_new_blocks_from_index (&topts.result, *bl);
 
@@ -266,8 +629,29 @@ get_new_blocks_merge (SeafRepo *repo,
     struct merge_options opts;
     char index_path[PATH_MAX];
     struct index_state istate;
+    TreeMerge tm;
+    GList *ptr;
+    DiffEntry *de;
     int ret, clean;
 
+    /* The blocks of the files the merge on trees would check out. */
+    if (!repo->placeholders) {
+        if (prepare_tree_merge (&tm, repo, head, remote, common) < 0)
+            return -1;
+
+        *bl = block_list_new ();
+        for (ptr = tm.changes; ptr; ptr = ptr->next) {
+            de = ptr->data;
+            if ((de->status == DIFF_STATUS_ADDED ||
+                 de->status == DIFF_STATUS_MODIFIED) &&
+                sparse_path_included (tm.sparse_paths, de->name, FALSE))
+                fill_seafile_blocks (de->sha1, *bl);
+        }
+
+        clear_tree_merge (&tm);
+        return 0;
+    }
+
     memset (&istate, 0, sizeof(istate));
     snprintf (index_path, PATH_MAX, "%s/%s", repo->manager->index_dir, repo->id);
     if (read_index_from (&istate, index_path) < 0) {
@@ -282,6 +666,9 @@ get_new_blocks_merge (SeafRepo *repo,
     opts.branch1 = seaf->session->base.user_name;
     opts.branch2 = remote->creator_name;
     opts.collect_blocks_only = TRUE;
+    opts.sparse_paths = seaf_repo_manager_get_sparse_paths (repo->manager,
+                                                            repo->id);
+    opts.placeholders = repo->placeholders;
 
     *bl = block_list_new();
     opts.bl = *bl;
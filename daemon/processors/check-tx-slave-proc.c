@@ -74,7 +74,8 @@ start (CcnetProcessor *processor, int argc, char **argv)
     from_branch = argv[3];
     token = argv[4];
 
-    if (atoi (version) != CURRENT_PROTO_VERSION) {
+    /* Version 4 only changed commit upload, which LAN sync doesn't use. */
+    if (atoi (version) < 3 || atoi (version) > CURRENT_PROTO_VERSION) {
         ccnet_processor_send_response (processor, 
                                        SC_VERSION_MISMATCH, SS_VERSION_MISMATCH,
                                        NULL, 0);
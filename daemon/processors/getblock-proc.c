@@ -82,7 +82,7 @@ seafile_getblock_proc_get_block (SeafileGetblockProc *proc,
                                  int block_idx)
 {
     CcnetProcessor *processor = (CcnetProcessor *)proc;
-    char *block_id;
+    char block_id[41];
     char buf[128];
     int len;
 
@@ -92,7 +92,7 @@ seafile_getblock_proc_get_block (SeafileGetblockProc *proc,
     ++(proc->pending_blocks);
     BitfieldAdd (&proc->active, block_idx);
 
-    block_id = g_ptr_array_index (proc->tx_task->block_list->block_ids, block_idx);
+    block_list_get_id (proc->tx_task->block_list, block_idx, block_id);
     len = snprintf (buf, 128, "%d %s", block_idx, block_id);
     ccnet_processor_send_update (processor,
                                  SC_GET_BLOCK, SS_GET_BLOCK,
@@ -32,6 +32,7 @@
 #include "utils.h"
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 #include "fs-mgr.h"
 #include "block-mgr.h"
 #include "getblock-v2-proc.h"
@@ -77,6 +78,7 @@ seafile_getblock_v2_proc_class_init (SeafileGetblockV2ProcClass *klass)
 static void
 seafile_getblock_v2_proc_init (SeafileGetblockV2Proc *processor)
 {
+    block_window_init (&processor->window);
 }
 
 static int
@@ -103,7 +105,12 @@ static void
 release_resource (CcnetProcessor *processor)
 {
     SeafileGetblockV2Proc *proc = (SeafileGetblockV2Proc *)processor;
+    USE_PRIV;
 
+    /* Keep the connection if no block is in flight on it. */
+    if (priv->tdata)
+        priv->tdata->keep_conn = (processor->state == ESTABLISHED &&
+                                  BitfieldIsEmpty (&proc->active));
     release_thread (processor);
     descruct_bitfield (&proc->block_bitmap, &proc->active, proc->tx_task);
 
@@ -115,9 +122,11 @@ seafile_getblock_v2_proc_get_block (SeafileGetblockV2Proc *proc,
                                  int block_idx)
 {
     CcnetProcessor *processor = (CcnetProcessor *)proc;
-    char *block_id;
+    char block_id[41];
     char buf[128];
+    guint32 offset;
     int len;
+    USE_PRIV;
 
     if (processor->state != ESTABLISHED)
         return -1;
@@ -125,8 +134,14 @@ seafile_getblock_v2_proc_get_block (SeafileGetblockV2Proc *proc,
     ++(proc->pending_blocks);
     BitfieldAdd (&proc->active, block_idx);
 
-    block_id = g_ptr_array_index (proc->tx_task->block_list->block_ids, block_idx);
-    len = snprintf (buf, 128, "%d %s", block_idx, block_id);
+    block_list_get_id (proc->tx_task->block_list, block_idx, block_id);
+    if (priv->tdata->resume) {
+        /* Continue after what we got before the connection dropped. */
+        offset = seaf_block_manager_partial_block_size (seaf->block_mgr,
+                                                        block_id);
+        len = snprintf (buf, 128, "%d %s %u", block_idx, block_id, offset);
+    } else
+        len = snprintf (buf, 128, "%d %s", block_idx, block_id);
     ccnet_processor_send_update (processor,
                                  SC_GET_BLOCK, SS_GET_BLOCK,
                                  buf, len + 1);
@@ -147,11 +162,14 @@ got_block_cb (CEvent *event, void *vprocessor)
     BlockResponse *blk_rsp = event->data;
 
     if (blk_rsp->block_idx >= 0) {
+        transfer_task_block_fetched (proc->tx_task, blk_rsp->block_idx);
         BitfieldAdd (&proc->tx_task->block_list->block_map, blk_rsp->block_idx);
         BitfieldRem (&proc->active, blk_rsp->block_idx);
         BitfieldRem (&proc->tx_task->active, blk_rsp->block_idx);
         ++(proc->tx_task->block_list->n_valid_blocks);
         --(proc->pending_blocks);
+        transfer_task_block_done (proc->tx_task, (CcnetProcessor *)proc,
+                                  proc->pending_blocks, blk_rsp->tx_bytes);
     }
 
     g_free (blk_rsp);
@@ -172,6 +190,7 @@ static void handle_response (CcnetProcessor *processor,
     switch (processor->state) {
     case REQUEST_SENT:
         if (memcmp (code, SC_OK, 3) == 0) {
+            check_options_offer (processor, content, clen);
             send_block_list (processor);
             processor->state = BLOCKLIST_SENT;
             return;
@@ -87,14 +87,15 @@ add_chunk_server (CcnetProcessor *processor, TransferTask *task, char *cs_str)
             g_object_unref (peer);
             goto out;
         }
-        task->chunk_servers = g_list_prepend (task->chunk_servers,
-                                              g_strdup(cs_id));
+        task->chunk_servers = g_list_append (task->chunk_servers,
+                                             g_strdup(cs_id));
         g_object_unref (peer);
         goto out;
     }
 
     ccnet_add_peer (processor->session, tokens[0], tokens[1]);
-    task->chunk_servers = g_list_prepend (task->chunk_servers, g_strdup(cs_id));
+    /* Keep the relay's order, least loaded first. */
+    task->chunk_servers = g_list_append (task->chunk_servers, g_strdup(cs_id));
 
 out:
     free (tokens);
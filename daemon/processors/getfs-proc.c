@@ -24,9 +24,13 @@
 #define MAX_NUM_BATCH  64
 #define MAX_NUM_UNREVD     256
 
+/* Sanity limit on the size of an object in a pack. */
+#define MAX_PACKED_OBJ_SIZE (256 << 20)
+
 enum {
     REQUEST_SENT,
-    FETCH_OBJECT
+    FETCH_OBJECT,
+    FETCH_PACK,
 };
 
 typedef struct  {
@@ -40,6 +44,10 @@ typedef struct  {
 
     char *obj_seg;
     int  obj_seg_len;
+
+    /* Pack mode: the part of the pack not processed yet. */
+    GByteArray *pack_buf;
+    int  n_segs;
 } SeafileGetfsProcPriv;
 
 #define GET_PRIV(o)  \
@@ -63,6 +71,8 @@ release_resource(CcnetProcessor *processor)
     g_queue_free (priv->inspect_queue);
     g_hash_table_destroy (priv->fs_objects);
     g_free (priv->obj_seg);
+    if (priv->pack_buf)
+        g_byte_array_free (priv->pack_buf, TRUE);
 
     CCNET_PROCESSOR_CLASS (seafile_getfs_proc_parent_class)->release_resource (processor);
 }
@@ -326,6 +336,156 @@ load_fsroot_list (CcnetProcessor *processor)
     }
 }
 
+/* The root of the local head. All the objects under it are here. */
+static char *
+get_local_root (TransferTask *task)
+{
+    SeafRepo *repo;
+    SeafCommit *head;
+    char *root_id = NULL;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, task->repo_id);
+    if (!repo || !repo->head)
+        return NULL;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo->head->commit_id);
+    if (head) {
+        root_id = g_strdup (head->root_id);
+        seaf_commit_unref (head);
+    }
+
+    return root_id;
+}
+
+/*
+ * Ask for a pack of the fs roots. Each root is diffed against the one
+ * before it, the first one against the local head. They'll all be here
+ * at the end of the pack.
+ */
+static void
+start_pack_fetch (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    SeafileGetfsProc *proc = (SeafileGetfsProc *) processor;
+    ObjectList *ol = proc->tx_task->fs_roots;
+    GString *buf = g_string_new (NULL);
+    char *local_root, *root_id;
+    const char *base;
+    int i;
+
+    local_root = get_local_root (proc->tx_task);
+    base = local_root ? local_root : "-";
+
+    for (i = 0; i < object_list_length (ol); i++) {
+        root_id = g_ptr_array_index (ol->obj_ids, i);
+        g_string_append_printf (buf, "%s %s\n", root_id, base);
+        base = root_id;
+
+        if (buf->len > MAX_OBJ_SEG_SIZE - 100) {
+            ccnet_processor_send_update (processor, SC_PACK_ROOTS,
+                                         SS_PACK_ROOTS,
+                                         buf->str, buf->len + 1);
+            g_string_truncate (buf, 0);
+        }
+    }
+    if (buf->len > 0)
+        ccnet_processor_send_update (processor, SC_PACK_ROOTS, SS_PACK_ROOTS,
+                                     buf->str, buf->len + 1);
+    ccnet_processor_send_update (processor, SC_PACK_START, SS_PACK_START,
+                                 NULL, 0);
+
+    g_string_free (buf, TRUE);
+    g_free (local_root);
+
+    priv->pack_buf = g_byte_array_new ();
+    processor->state = FETCH_PACK;
+}
+
+static gboolean
+packed_object_is_valid (PackedObject *obj, guint32 len)
+{
+    SeafDir *dir;
+    int type;
+
+    type = seaf_metadata_type_from_data (obj->object, len);
+    if (type == SEAF_METADATA_TYPE_DIR) {
+        dir = seaf_dir_from_data (obj->id, obj->object, len);
+        if (!dir)
+            return FALSE;
+        seaf_dir_free (dir);
+        return TRUE;
+    }
+
+    return (type == SEAF_METADATA_TYPE_FILE);
+}
+
+static int
+recv_pack (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+    PackedObject *obj;
+    guint32 len, pos = 0;
+    char ack[16];
+
+    g_byte_array_append (priv->pack_buf, (guint8 *)content, clen);
+
+    while (priv->pack_buf->len - pos >= sizeof(PackedObject)) {
+        obj = (PackedObject *)(priv->pack_buf->data + pos);
+        len = ntohl (obj->len);
+        if (len > MAX_PACKED_OBJ_SIZE) {
+            g_warning ("[getfs] Bad object length %u in pack.\n", len);
+            goto bad;
+        }
+        if (priv->pack_buf->len - pos < sizeof(PackedObject) + len)
+            break;
+
+        obj->id[40] = '\0';
+        if (!packed_object_is_valid (obj, len)) {
+            g_warning ("[getfs] Bad fs object %s in pack.\n", obj->id);
+            goto bad;
+        }
+        if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store, obj->id,
+                                      obj->object, len) < 0) {
+            g_warning ("[getfs] Failed to save fs object %s.\n", obj->id);
+            goto bad;
+        }
+        pos += sizeof(PackedObject) + len;
+    }
+    g_byte_array_remove_range (priv->pack_buf, 0, pos);
+
+    if (++priv->n_segs % PACK_ACK_INTERVAL == 0) {
+        snprintf (ack, sizeof(ack), "%d", PACK_ACK_INTERVAL);
+        ccnet_processor_send_update (processor, SC_PACK_ACK, SS_PACK_ACK,
+                                     ack, strlen(ack) + 1);
+    }
+    return 0;
+
+bad:
+    transfer_task_set_error (((SeafileGetfsProc *)processor)->tx_task,
+                             TASK_ERR_DOWNLOAD_FS);
+    ccnet_processor_done (processor, FALSE);
+    return -1;
+}
+
+static void
+end_pack (CcnetProcessor *processor)
+{
+    USE_PRIV;
+
+    if (priv->pack_buf->len != 0) {
+        g_warning ("[getfs] Pack ends in the middle of an object.\n");
+        transfer_task_set_error (((SeafileGetfsProc *)processor)->tx_task,
+                                 TASK_ERR_DOWNLOAD_FS);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    seaf_debug ("[getfs] Received pack in %d segments.\n", priv->n_segs);
+    ccnet_processor_send_update (processor, SC_END, SS_END, NULL, 0);
+    ccnet_processor_done (processor, TRUE);
+}
+
 static void
 handle_response (CcnetProcessor *processor,
                  char *code, char *code_msg,
@@ -337,6 +497,12 @@ handle_response (CcnetProcessor *processor,
     switch (processor->state) {
     case REQUEST_SENT:
         if (strncmp(code, SC_OK, 3) == 0) {
+            /* Old servers don't offer packs. */
+            if (clen > 0 && content[clen-1] == '\0' &&
+                strcmp (content, PACK_TOKEN) == 0) {
+                start_pack_fetch (processor);
+                return;
+            }
             load_fsroot_list (processor);
             processor->timer = ccnet_timer_new (
                 (TimerCB)check_object, processor, CHECK_INTERVAL);
@@ -359,6 +525,15 @@ handle_response (CcnetProcessor *processor,
             return;
         }
         break;
+    case FETCH_PACK:
+        if (strncmp(code, SC_PACK, 3) == 0) {
+            recv_pack (processor, content, clen);
+            return;
+        } else if (strncmp(code, SC_PACK_END, 3) == 0) {
+            end_pack (processor);
+            return;
+        }
+        break;
     default:
         g_assert (0);
     }
@@ -85,7 +85,6 @@ seafile_sendblock_proc_send_block (SeafileSendblockProc *proc,
 {
     CcnetProcessor *processor = (CcnetProcessor *)proc;
     BlockList *bl = proc->tx_task->block_list;
-    char *block_id;
     USE_PRIV;
 
     if (processor->state != ESTABLISHED)
@@ -93,10 +92,9 @@ seafile_sendblock_proc_send_block (SeafileSendblockProc *proc,
 
     if (block_idx < 0 || block_idx >= bl->n_blocks)
         return -1;
-    block_id = g_ptr_array_index (bl->block_ids, block_idx);
 
     BlockRequest blk_req;
-    memcpy (blk_req.block_id, block_id, 41);
+    block_list_get_id (bl, block_idx, blk_req.block_id);
     blk_req.block_idx = block_idx;
     if (pipewriten (priv->tdata->task_pipe[1], 
                     &blk_req, sizeof(blk_req)) < 0) {
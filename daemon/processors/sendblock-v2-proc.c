@@ -33,6 +33,7 @@
 #include "utils.h"
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 #include "fs-mgr.h"
 #include "block-mgr.h"
 #include "sendcommit-proc.h"
@@ -40,6 +41,7 @@
 
 enum {
     REQUEST_SENT,
+    GET_FILTER,
     BLOCKLIST_SENT,
     GET_PORT,
     ESTABLISHED,
@@ -79,6 +81,7 @@ seafile_sendblock_v2_proc_class_init (SeafileSendblockV2ProcClass *klass)
 static void
 seafile_sendblock_v2_proc_init (SeafileSendblockV2Proc *processor)
 {
+    block_window_init (&processor->window);
 }
 
 
@@ -106,7 +109,12 @@ static void
 release_resource (CcnetProcessor *processor)
 {
     SeafileSendblockV2Proc *proc = (SeafileSendblockV2Proc *)processor;
+    USE_PRIV;
 
+    /* Keep the connection if no block is in flight on it. */
+    if (priv->tdata)
+        priv->tdata->keep_conn = (processor->state == ESTABLISHED &&
+                                  BitfieldIsEmpty (&proc->active));
     release_thread (processor);
     descruct_bitfield (&proc->block_bitmap, &proc->active, proc->tx_task);
 
@@ -119,7 +127,6 @@ seafile_sendblock_v2_proc_send_block (SeafileSendblockV2Proc *proc,
 {
     CcnetProcessor *processor = (CcnetProcessor *)proc;
     BlockList *bl = proc->tx_task->block_list;
-    char *block_id;
     USE_PRIV;
 
     if (processor->state != ESTABLISHED)
@@ -127,11 +134,16 @@ seafile_sendblock_v2_proc_send_block (SeafileSendblockV2Proc *proc,
 
     if (block_idx < 0 || block_idx >= bl->n_blocks)
         return -1;
-    block_id = g_ptr_array_index (bl->block_ids, block_idx);
 
     BlockRequest blk_req;
-    memcpy (blk_req.block_id, block_id, 41);
+    block_list_get_id (bl, block_idx, blk_req.block_id);
     blk_req.block_idx = block_idx;
+    blk_req.offset = 0;
+    if (priv->partials) {
+        blk_req.offset = GPOINTER_TO_UINT (
+            g_hash_table_lookup (priv->partials, GINT_TO_POINTER(block_idx)));
+        g_hash_table_remove (priv->partials, GINT_TO_POINTER(block_idx));
+    }
     if (pipewriten (priv->tdata->task_pipe[1], 
                     &blk_req, sizeof(blk_req)) < 0) {
         g_warning ("failed to write task pipe.\n");
@@ -156,8 +168,11 @@ sent_block_cb (CEvent *event, void *vprocessor)
     SeafileSendblockV2Proc *proc = vprocessor;
     BlockResponse *blk_rsp = event->data;
 
-    if (blk_rsp->block_idx >= 0)
+    if (blk_rsp->block_idx >= 0) {
         --(proc->pending_blocks);
+        transfer_task_block_done (proc->tx_task, (CcnetProcessor *)proc,
+                                  proc->pending_blocks, blk_rsp->tx_bytes);
+    }
 
     g_free (blk_rsp);
 }
@@ -203,11 +218,30 @@ static void handle_response (CcnetProcessor *processor,
     switch (processor->state) {
     case REQUEST_SENT:
         if (memcmp (code, SC_OK, 3) == 0) {
+            check_options_offer (processor, content, clen);
+            if (request_have_filter (processor)) {
+                processor->state = GET_FILTER;
+                return;
+            }
             send_block_list (processor);
             processor->state = BLOCKLIST_SENT;
             return;
         }
         break;
+    case GET_FILTER:
+        if (memcmp (code, SC_FILTER, 3) == 0) {
+            process_have_filter (processor, content, clen);
+            return;
+        }
+        if (memcmp (code, SC_FILTER_END, 3) == 0) {
+            filter_block_list (processor, content, clen);
+            if (send_block_list (processor) > 0)
+                processor->state = BLOCKLIST_SENT;
+            else
+                block_bitmap_done (processor);
+            return;
+        }
+        break;
     case BLOCKLIST_SENT:
         if (memcmp (code, SC_BBITMAP, 3) == 0) {
             process_block_bitmap (processor, content, clen);
@@ -219,6 +253,10 @@ static void handle_response (CcnetProcessor *processor,
             get_port (processor, content, clen);
             return;
         }
+        if (memcmp (code, SC_PARTIAL, 3) == 0) {
+            process_partial_blocks (processor, content, clen);
+            return;
+        }
         break;
     case ESTABLISHED:
         if (memcmp (code, SC_ACK, 3) == 0) {
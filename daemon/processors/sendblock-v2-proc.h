@@ -27,6 +27,7 @@ struct _SeafileSendblockV2Proc {
     int            tx_time;
     double         avg_tx_rate;
     int            pending_blocks;
+    BlockWindow    window;
 };
 
 struct _SeafileSendblockV2ProcClass {
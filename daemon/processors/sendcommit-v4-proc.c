@@ -0,0 +1,402 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
+#include "log.h"
+
+#include <fcntl.h>
+
+#include <ccnet.h>
+#include "net.h"
+#include "utils.h"
+
+#include "seafile-session.h"
+#include "sendcommit-v4-proc.h"
+#include "processors/objecttx-common.h"
+#include "vc-common.h"
+
+/*
+              seafile-recvcommit-v4
+  INIT      --------------------->
+                 200 OK
+  INIT     <---------------------
+
+                  Pack
+  SEND_PACK ----------------------->
+                  ...
+                  Pack Ack
+           <---------------------
+                  ...
+                  Pack End
+           ----------------------->
+                  Ack
+           <---------------------
+
+ The commits to send are packed into one stream of PackedObject frames,
+ oldest first, and cut into segments of up to MAX_OBJ_SEG_SIZE bytes.
+ At most PACK_WINDOW segments are sent before they are acked. The final
+ Ack is sent once all the commits are written.
+ */
+
+enum {
+    INIT,
+    SEND_PACK
+};
+
+typedef struct  {
+    char        remote_id[41];
+    GList       *id_list;
+    GHashTable  *commit_hash;
+    gboolean    fast_forward;
+
+    GByteArray  *seg;
+    int         in_flight;
+    int         n_commits;
+    gboolean    end_sent;
+} SeafileSendcommitProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), SEAFILE_TYPE_SENDCOMMIT_V4_PROC, SeafileSendcommitProcPriv))
+
+#define USE_PRIV \
+    SeafileSendcommitProcPriv *priv = GET_PRIV(processor);
+
+static int send_commit_start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_response (CcnetProcessor *processor,
+                             char *code, char *code_msg,
+                             char *content, int clen);
+
+
+G_DEFINE_TYPE (SeafileSendcommitV4Proc, seafile_sendcommit_v4_proc, CCNET_TYPE_PROCESSOR)
+
+static void
+release_resource (CcnetProcessor *processor)
+{
+    USE_PRIV;
+
+    if (priv->id_list != NULL)
+        string_list_free (priv->id_list);
+    if (priv->commit_hash)
+        g_hash_table_destroy (priv->commit_hash);
+    if (priv->seg)
+        g_byte_array_free (priv->seg, TRUE);
+}
+
+static void
+seafile_sendcommit_v4_proc_class_init (SeafileSendcommitV4ProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "sendcommit-v4-proc";
+    proc_class->start = send_commit_start;
+    proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (SeafileSendcommitProcPriv));
+}
+
+static void
+seafile_sendcommit_v4_proc_init (SeafileSendcommitV4Proc *processor)
+{
+}
+
+static int
+send_commit_start (CcnetProcessor *processor, int argc, char **argv)
+{
+    USE_PRIV;
+    GString *buf;
+    TransferTask *task = ((SeafileSendcommitV4Proc *)processor)->tx_task;
+
+    memcpy (priv->remote_id, task->remote_head, 41);
+
+    /* fs_roots can be non-NULL if transfer is resumed from NET_DOWN. */
+    if (task->fs_roots != NULL)
+        object_list_free (task->fs_roots);
+    task->fs_roots = object_list_new ();
+
+    priv->seg = g_byte_array_new ();
+
+    buf = g_string_new (NULL);
+    g_string_printf (buf, "remote %s seafile-recvcommit-v4 %s %s",
+                     processor->peer_id, task->to_branch, task->session_token);
+    ccnet_processor_send_request (processor, buf->str);
+    g_string_free (buf, TRUE);
+
+    return 0;
+}
+
+static int
+pack_commit (CcnetProcessor *processor, const char *object_id)
+{
+    USE_PRIV;
+    char *data;
+    int len;
+    PackedObject hdr;
+
+    if (seaf_obj_store_read_obj (seaf->commit_mgr->obj_store,
+                                 object_id, (void**)&data, &len) < 0) {
+        g_warning ("Failed to read commit %s.\n", object_id);
+        return -1;
+    }
+
+    hdr.len = htonl ((guint32)len);
+    memcpy (hdr.id, object_id, 41);
+    g_byte_array_append (priv->seg, (guint8 *)&hdr, sizeof(hdr));
+    g_byte_array_append (priv->seg, (guint8 *)data, len);
+    ++priv->n_commits;
+
+    g_free (data);
+    return 0;
+}
+
+/* Send segments until the window is full or all commits are sent. */
+static void
+send_pack (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    char *commit_id;
+    int len;
+
+    while (priv->in_flight < PACK_WINDOW) {
+        while (priv->seg->len < MAX_OBJ_SEG_SIZE && priv->id_list) {
+            commit_id = priv->id_list->data;
+            priv->id_list = g_list_delete_link (priv->id_list, priv->id_list);
+
+            if (pack_commit (processor, commit_id) < 0) {
+                ccnet_processor_send_update (processor,
+                                             SC_NOT_FOUND, SS_NOT_FOUND,
+                                             commit_id, 41);
+                g_free (commit_id);
+                ccnet_processor_done (processor, FALSE);
+                return;
+            }
+            g_free (commit_id);
+        }
+
+        if (priv->seg->len == 0)
+            break;
+
+        len = MIN (priv->seg->len, MAX_OBJ_SEG_SIZE);
+        ccnet_processor_send_update (processor, SC_PACK, SS_PACK,
+                                     (char *)priv->seg->data, len);
+        g_byte_array_remove_range (priv->seg, 0, len);
+        ++priv->in_flight;
+    }
+
+    if (!priv->id_list && priv->seg->len == 0 && !priv->end_sent) {
+        seaf_debug ("[sendcommit] Sent %d commits in a pack.\n",
+                    priv->n_commits);
+        ccnet_processor_send_update (processor, SC_PACK_END, SS_PACK_END,
+                                     NULL, 0);
+        priv->end_sent = TRUE;
+    }
+}
+
+static void
+process_pack_ack (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+    int n;
+
+    if (clen == 0 || content[clen-1] != '\0') {
+        g_warning ("[sendcommit] Bad pack ack.\n");
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    n = atoi (content);
+    if (n <= 0 || n > priv->in_flight) {
+        g_warning ("[sendcommit] Bad pack ack %d.\n", n);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+    priv->in_flight -= n;
+
+    send_pack (processor);
+}
+
+/* Traverse the commit graph until remote_id is met or a merged commit
+ * (commit with two parents) is met.
+ *
+ * If a merged commit is met before remote_id, that implies that
+ * we did a real merge when merged with the branch headed by remote_id.
+ * In this case we'll need more computation to find out the "delta" commits
+ * between these two branches. Otherwise, if the merge was a fast-forward
+ * one, it's enough to just send all the commits between our head commit
+ * and remote_id.
+ */
+static gboolean
+traverse_commit_fast_forward (SeafCommit *commit, void *data, gboolean *stop)
+{
+    CcnetProcessor *processor = data;
+    TransferTask *task = ((SeafileSendcommitV4Proc *)processor)->tx_task;
+    USE_PRIV;
+
+    if (priv->remote_id[0] != 0 &&
+        strcmp (priv->remote_id, commit->commit_id) == 0) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    if (commit->second_parent_id != NULL) {
+        *stop = TRUE;
+        priv->fast_forward = FALSE;
+        return TRUE;
+    }
+
+    priv->id_list = g_list_prepend (priv->id_list, g_strdup(commit->commit_id));
+
+    /* We don't need to send the contents under an empty dir. */
+    if (strcmp (commit->root_id, EMPTY_SHA1) != 0)
+        object_list_insert (task->fs_roots, commit->root_id);
+
+    return TRUE;
+}
+
+static gboolean
+traverse_commit_remote (SeafCommit *commit, void *data, gboolean *stop)
+{
+    CcnetProcessor *processor = data;
+    USE_PRIV;
+    char *key;
+
+    if (g_hash_table_lookup (priv->commit_hash, commit->commit_id))
+        return TRUE;
+
+    key = g_strdup(commit->commit_id);
+    g_hash_table_insert (priv->commit_hash, key, key);
+    return TRUE;
+}
+
+static gboolean
+compute_delta (SeafCommit *commit, void *data, gboolean *stop)
+{
+    CcnetProcessor *processor = data;
+    TransferTask *task = ((SeafileSendcommitV4Proc *)processor)->tx_task;
+    USE_PRIV;
+
+    if (!g_hash_table_lookup (priv->commit_hash, commit->commit_id)) {
+        priv->id_list = g_list_prepend (priv->id_list,
+                                        g_strdup(commit->commit_id));
+
+        if (strcmp (commit->root_id, EMPTY_SHA1) != 0)
+            object_list_insert (task->fs_roots, commit->root_id);
+    } else {
+        /* Stop traversing down from this commit if it already exists
+         * in the remote branch.
+         */
+        *stop = TRUE;
+    }
+
+    return TRUE;
+}
+
+static int
+compute_delta_commits (CcnetProcessor *processor, const char *head)
+{
+    gboolean ret;
+    TransferTask *task = ((SeafileSendcommitV4Proc *)processor)->tx_task;
+    USE_PRIV;
+
+    string_list_free (priv->id_list);
+    priv->id_list = NULL;
+
+    object_list_free (task->fs_roots);
+    task->fs_roots = object_list_new ();
+
+    priv->commit_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+
+    ret = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                    priv->remote_id,
+                                                    traverse_commit_remote,
+                                                    processor);
+    if (!ret) {
+        ccnet_processor_send_update (processor, SC_NOT_FOUND, SS_NOT_FOUND,
+                                     NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return -1;
+    }
+
+    ret = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                    head,
+                                                    compute_delta,
+                                                    processor);
+    if (!ret) {
+        ccnet_processor_send_update (processor, SC_NOT_FOUND, SS_NOT_FOUND,
+                                     NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+send_commits (CcnetProcessor *processor, const char *head)
+{
+    gboolean ret;
+    USE_PRIV;
+
+    priv->fast_forward = TRUE;
+    ret = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                    head,
+                                                    traverse_commit_fast_forward,
+                                                    processor);
+    if (!ret) {
+        ccnet_processor_send_update (processor, SC_NOT_FOUND, SS_NOT_FOUND,
+                                     NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    if (!priv->fast_forward) {
+        seaf_debug ("[sendcommit] Send commit after a real merge.\n");
+        if (compute_delta_commits (processor, head) < 0)
+            return;
+    }
+
+    send_pack (processor);
+}
+
+static void handle_response (CcnetProcessor *processor,
+                             char *code, char *code_msg,
+                             char *content, int clen)
+{
+    SeafileSendcommitV4Proc *proc = (SeafileSendcommitV4Proc *)processor;
+    TransferTask *task = proc->tx_task;
+    USE_PRIV;
+
+    if (task->state != TASK_STATE_NORMAL) {
+        ccnet_processor_done (processor, TRUE);
+        return;
+    }
+
+    switch (processor->state) {
+    case INIT:
+        if (memcmp (code, SC_OK, 3) == 0) {
+            processor->state = SEND_PACK;
+            send_commits (processor, task->head);
+            return;
+        }
+        break;
+    case SEND_PACK:
+        if (memcmp (code, SC_PACK_ACK, 3) == 0) {
+            process_pack_ack (processor, content, clen);
+            return;
+        }
+        if (memcmp (code, SC_ACK, 3) == 0 && priv->end_sent) {
+            ccnet_processor_done (processor, TRUE);
+            return;
+        }
+        break;
+    default:
+        g_assert (0);
+    }
+
+    g_warning ("Bad response: %s %s.\n", code, code_msg);
+    if (memcmp (code, SC_ACCESS_DENIED, 3) == 0)
+        transfer_task_set_error (task, TASK_ERR_ACCESS_DENIED);
+    ccnet_processor_done (processor, FALSE);
+}
@@ -17,6 +17,11 @@
  *                                     FS Root, FS Root End
  * S(SEND_ROOT -> SEND_OBJECT) ---------------------------->  T
  *
+ * When the server offers "push" in its first OK and it has the repo, the
+ * objects that differ from the remote head are sent before the first
+ * FS_ROOT, children before their parent dirs. The server then only asks
+ * for what it still misses.
+ *
  *                      Get Object
  * S(SEND_OBJECT) <----------------------------  T
  *                       Object
@@ -187,6 +192,116 @@ send_fs_objects (CcnetProcessor *processor, char *content, int clen)
     }
 }
 
+static int
+diff_push_objects (const char *new_id, const char *old_id,
+                   GHashTable *seen, GList **objects)
+{
+    SeafDir *new_dir = NULL, *old_dir = NULL;
+    GHashTable *old_dents = NULL;
+    GList *ptr;
+    SeafDirent *dent, *old_dent;
+    int ret = 0;
+
+    if (strcmp (new_id, EMPTY_SHA1) == 0 ||
+        (old_id && strcmp (new_id, old_id) == 0) ||
+        g_hash_table_lookup (seen, new_id))
+        return 0;
+    g_hash_table_insert (seen, g_strdup (new_id), (gpointer)1);
+
+    new_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, new_id);
+    if (!new_dir) {
+        g_warning ("Failed to find dir %s.\n", new_id);
+        return -1;
+    }
+
+    /* A missing old dir only makes the diff larger. */
+    if (old_id && strcmp (old_id, EMPTY_SHA1) != 0)
+        old_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, old_id);
+    old_dents = g_hash_table_new (g_str_hash, g_str_equal);
+    if (old_dir) {
+        for (ptr = old_dir->entries; ptr != NULL; ptr = ptr->next) {
+            dent = ptr->data;
+            g_hash_table_insert (old_dents, dent->name, dent);
+        }
+    }
+
+    for (ptr = new_dir->entries; ptr != NULL; ptr = ptr->next) {
+        dent = ptr->data;
+        old_dent = g_hash_table_lookup (old_dents, dent->name);
+
+        if (S_ISDIR(dent->mode)) {
+            if (old_dent && !S_ISDIR(old_dent->mode))
+                old_dent = NULL;
+            if (diff_push_objects (dent->id, old_dent ? old_dent->id : NULL,
+                                   seen, objects) < 0) {
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp (dent->id, EMPTY_SHA1) != 0 &&
+                   (!old_dent || strcmp (dent->id, old_dent->id) != 0) &&
+                   !g_hash_table_lookup (seen, dent->id)) {
+            g_hash_table_insert (seen, g_strdup (dent->id), (gpointer)1);
+            *objects = g_list_prepend (*objects, g_strdup (dent->id));
+        }
+    }
+
+    *objects = g_list_prepend (*objects, g_strdup (new_id));
+
+out:
+    g_hash_table_destroy (old_dents);
+    seaf_dir_free (new_dir);
+    if (old_dir)
+        seaf_dir_free (old_dir);
+    return ret;
+}
+
+/*
+ * Send the objects of the new roots that are not in the remote head.
+ * Falls back to the full walk by the server when the diff can't be
+ * computed.
+ */
+static gboolean
+push_fs_objects (CcnetProcessor *processor)
+{
+    SeafileSendfsProc *proc = (SeafileSendfsProc *)processor;
+    TransferTask *task = proc->tx_task;
+    ObjectList *ol = task->fs_roots;
+    SeafCommit *base;
+    GHashTable *seen;
+    GList *objects = NULL, *ptr;
+    int i;
+
+    base = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           task->remote_head);
+    if (!base)
+        return TRUE;
+
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < object_list_length (ol); ++i) {
+        if (diff_push_objects (g_ptr_array_index (ol->obj_ids, i),
+                               base->root_id, seen, &objects) < 0) {
+            string_list_free (objects);
+            objects = NULL;
+            break;
+        }
+    }
+    g_hash_table_destroy (seen);
+    seaf_commit_unref (base);
+
+    objects = g_list_reverse (objects);
+    seaf_debug ("Push %u fs objects.\n", g_list_length (objects));
+
+    for (ptr = objects; ptr != NULL; ptr = ptr->next) {
+        if (send_fs_object (processor, ptr->data) == FALSE) {
+            string_list_free (objects);
+            return FALSE;
+        }
+    }
+    string_list_free (objects);
+
+    return TRUE;
+}
+
 static void
 send_fs_roots (CcnetProcessor *processor)
 {
@@ -229,6 +344,11 @@ handle_response (CcnetProcessor *processor,
     switch (processor->state) {
     case SEND_ROOT:
         if (strncmp(code, SC_OK, 3) == 0) {
+            if (proc->last_idx == 0 && clen > 0 &&
+                content[clen-1] == '\0' && strcmp (content, "push") == 0 &&
+                task->remote_head[0] != 0 &&
+                !push_fs_objects (processor))
+                return;
             send_fs_roots (processor);
             return;
         }
@@ -0,0 +1,209 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <ccnet.h>
+
+#include "seafile-session.h"
+#include "sync-mgr.h"
+#include "utils.h"
+
+#include "watch-repos-proc.h"
+#include "watch-repos-common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_SYNC
+#include "log.h"
+
+enum {
+    REQUEST_SENT,
+    READY,
+};
+
+typedef struct {
+    /* repo ids sent to the server */
+    GHashTable *watched;
+} SeafileWatchReposProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), SEAFILE_TYPE_WATCH_REPOS_PROC, SeafileWatchReposProcPriv))
+
+#define USE_PRIV \
+    SeafileWatchReposProcPriv *priv = GET_PRIV(processor);
+
+G_DEFINE_TYPE (SeafileWatchReposProc, seafile_watch_repos_proc, CCNET_TYPE_PROCESSOR)
+
+static int start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_response (CcnetProcessor *processor,
+                             char *code, char *code_msg,
+                             char *content, int clen);
+
+static void
+release_resource (CcnetProcessor *processor)
+{
+    USE_PRIV;
+
+    g_hash_table_destroy (priv->watched);
+
+    CCNET_PROCESSOR_CLASS (seafile_watch_repos_proc_parent_class)->release_resource (processor);
+}
+
+static void
+seafile_watch_repos_proc_class_init (SeafileWatchReposProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "seafile-watch-repos";
+    proc_class->start = start;
+    proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (SeafileWatchReposProcPriv));
+}
+
+static void
+seafile_watch_repos_proc_init (SeafileWatchReposProc *processor)
+{
+}
+
+static int
+start (CcnetProcessor *processor, int argc, char **argv)
+{
+    USE_PRIV;
+    char buf[256];
+
+    priv->watched = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+
+    snprintf (buf, sizeof(buf), "remote %s seafile-watch-repos-slave",
+              processor->peer_id);
+    ccnet_processor_send_request (processor, buf);
+
+    return 0;
+}
+
+static void
+send_repo_list (CcnetProcessor *processor, GList *repo_ids,
+                const char *code, const char *code_msg)
+{
+    GString *buf = g_string_new (NULL);
+    GList *ptr;
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        g_string_append_printf (buf, "%s\n", (char *)ptr->data);
+        if (buf->len + 38 > WATCH_PIECE_LEN || !ptr->next) {
+            ccnet_processor_send_update (processor, code, code_msg,
+                                         buf->str, buf->len + 1);
+            g_string_truncate (buf, 0);
+        }
+    }
+
+    g_string_free (buf, TRUE);
+}
+
+void
+seafile_watch_repos_proc_set_repos (SeafileWatchReposProc *proc,
+                                    GList *repo_ids)
+{
+    CcnetProcessor *processor = (CcnetProcessor *)proc;
+    USE_PRIV;
+    GHashTable *wanted;
+    GHashTableIter iter;
+    gpointer key;
+    GList *added = NULL, *removed = NULL, *ptr;
+
+    if (processor->state != READY)
+        return;
+
+    wanted = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        g_hash_table_insert (wanted, ptr->data, ptr->data);
+        if (!g_hash_table_lookup (priv->watched, ptr->data))
+            added = g_list_prepend (added, ptr->data);
+    }
+
+    g_hash_table_iter_init (&iter, priv->watched);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        if (!g_hash_table_lookup (wanted, key))
+            removed = g_list_prepend (removed, key);
+    }
+
+    if (removed) {
+        send_repo_list (processor, removed, SC_UNWATCH, SS_UNWATCH);
+        for (ptr = removed; ptr; ptr = ptr->next)
+            g_hash_table_remove (priv->watched, ptr->data);
+    }
+    if (added) {
+        send_repo_list (processor, added, SC_WATCH, SS_WATCH);
+        for (ptr = added; ptr; ptr = ptr->next)
+            g_hash_table_insert (priv->watched, g_strdup(ptr->data),
+                                 (gpointer)1);
+    }
+
+    g_list_free (added);
+    g_list_free (removed);
+    g_hash_table_destroy (wanted);
+}
+
+gboolean
+seafile_watch_repos_proc_is_watching (SeafileWatchReposProc *proc,
+                                      const char *repo_id)
+{
+    CcnetProcessor *processor = (CcnetProcessor *)proc;
+    USE_PRIV;
+
+    return (processor->state == READY &&
+            g_hash_table_lookup (priv->watched, repo_id) != NULL);
+}
+
+/* "<repo_id> <commit_id>\n..." */
+static void
+process_repo_updates (CcnetProcessor *processor, char *content, int clen)
+{
+    char **lines, **ptr;
+    char *sep;
+
+    if (clen == 0 || content[clen-1] != '\0') {
+        seaf_warning ("[watch-repos] Bad repo updates.\n");
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    lines = g_strsplit (content, "\n", -1);
+    for (ptr = lines; *ptr; ++ptr) {
+        sep = strchr (*ptr, ' ');
+        if (!sep)
+            continue;
+        *sep = '\0';
+        if (!is_uuid_valid (*ptr) || strlen(sep + 1) != 40)
+            continue;
+
+        seaf_sync_manager_repo_updated_on_relay (seaf->sync_mgr,
+                                                 processor->peer_id,
+                                                 *ptr, sep + 1);
+    }
+    g_strfreev (lines);
+}
+
+static void
+handle_response (CcnetProcessor *processor,
+                 char *code, char *code_msg,
+                 char *content, int clen)
+{
+    switch (processor->state) {
+    case REQUEST_SENT:
+        if (memcmp (code, SC_OK, 3) == 0) {
+            processor->state = READY;
+            return;
+        }
+        break;
+    case READY:
+        if (memcmp (code, SC_REPO_UPDATES, 3) == 0) {
+            process_repo_updates (processor, content, clen);
+            return;
+        }
+        break;
+    }
+
+    seaf_debug ("[watch-repos] Bad response: %s %s.\n", code, code_msg);
+    ccnet_processor_done (processor, FALSE);
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAFILE_WATCH_REPOS_PROC_H
+#define SEAFILE_WATCH_REPOS_PROC_H
+
+#include <glib-object.h>
+
+
+#define SEAFILE_TYPE_WATCH_REPOS_PROC                  (seafile_watch_repos_proc_get_type ())
+#define SEAFILE_WATCH_REPOS_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), SEAFILE_TYPE_WATCH_REPOS_PROC, SeafileWatchReposProc))
+#define SEAFILE_IS_WATCH_REPOS_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SEAFILE_TYPE_WATCH_REPOS_PROC))
+#define SEAFILE_WATCH_REPOS_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), SEAFILE_TYPE_WATCH_REPOS_PROC, SeafileWatchReposProcClass))
+#define IS_SEAFILE_WATCH_REPOS_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), SEAFILE_TYPE_WATCH_REPOS_PROC))
+#define SEAFILE_WATCH_REPOS_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), SEAFILE_TYPE_WATCH_REPOS_PROC, SeafileWatchReposProcClass))
+
+typedef struct _SeafileWatchReposProc SeafileWatchReposProc;
+typedef struct _SeafileWatchReposProcClass SeafileWatchReposProcClass;
+
+struct _SeafileWatchReposProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _SeafileWatchReposProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType seafile_watch_repos_proc_get_type ();
+
+/*
+ * Make the repos watched on the server @repo_ids, a list of repo ids.
+ * Only the changes to the current set are sent.
+ */
+void
+seafile_watch_repos_proc_set_repos (SeafileWatchReposProc *proc,
+                                    GList *repo_ids);
+
+/* Whether the server notifies the updates of @repo_id. */
+gboolean
+seafile_watch_repos_proc_is_watching (SeafileWatchReposProc *proc,
+                                      const char *repo_id);
+
+#endif
+
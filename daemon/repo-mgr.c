@@ -14,6 +14,7 @@
 
 #include "status.h"
 #include "vc-utils.h"
+#include "vc-common.h"
 #include "merge.h"
 
 #include "seafile-session.h"
@@ -40,6 +41,10 @@ struct _SeafRepoManagerPriv {
     pthread_mutex_t db_lock;
     GHashTable *checkout_tasks_hash;
     pthread_rwlock_t lock;
+    pthread_mutex_t load_lock;  /* for load_repo_head() */
+    pthread_mutex_t sparse_lock; /* for repo->sparse_paths */
+    GList *watch_queue;         /* repo ids not watched yet after start */
+    GHashTable *hydrate_waiting; /* repo id -> placeholders waiting for blocks */
 };
 
 static const char *ignore_table[] = {
@@ -67,14 +72,19 @@ static const char *ignore_table[] = {
 
 static GPatternSpec** ignore_patterns;
 
-static SeafRepo *
-load_repo (SeafRepoManager *manager, const char *repo_id);
+static void
+load_repo_head (SeafRepoManager *manager, SeafRepo *repo);
 
 static void load_repos (SeafRepoManager *manager, const char *seaf_dir);
 static void seaf_repo_manager_del_repo_property (SeafRepoManager *manager,
                                                  const char *repo_id);
 
 static int save_branch_repo_map (SeafRepoManager *manager, SeafBranch *branch);
+static char *load_repo_property (SeafRepoManager *manager,
+                                 const char *repo_id,
+                                 const char *key);
+static char **parse_sparse_paths (const char *value);
+static gboolean placeholders_enabled (const char *value);
 
 gboolean
 is_repo_id_valid (const char *id)
@@ -104,6 +114,7 @@ seaf_repo_new (const char *id, const char *name, const char *desc)
     repo->worktree_invalid = TRUE;
     repo->auto_sync = 1;
     repo->net_browsable = 0;
+    repo->head_loaded = TRUE;
     pthread_mutex_init (&repo->lock, NULL);
 
     return repo;
@@ -174,6 +185,7 @@ seaf_repo_free (SeafRepo *repo)
     g_free (repo->passwd);
     g_free (repo->email);
     g_free (repo->token);
+    g_strfreev (repo->sparse_paths);
     g_free (repo);
 }
 
@@ -207,6 +219,8 @@ seaf_repo_from_commit (SeafRepo *repo, SeafCommit *commit)
             memcpy (repo->magic, commit->magic, 33);
     }
     repo->no_local_history = commit->no_local_history;
+    repo->chunker = chunker_with_policy (commit->chunker,
+                                         commit->chunk_policy);
 }
 
 void
@@ -221,6 +235,8 @@ seaf_repo_to_commit (SeafRepo *repo, SeafCommit *commit)
             commit->magic = g_strdup (repo->magic);
     }
     commit->no_local_history = repo->no_local_history;
+    commit->chunker = CHUNKER_ALGO (repo->chunker);
+    commit->chunk_policy = g_strdup (chunker_get_policy (repo->chunker));
 }
 
 static gboolean
@@ -335,11 +351,31 @@ should_ignore(const char *filename, void *data)
 
 static int
 index_cb (const char *path,
+          const unsigned char *old_sha1,
+          const struct ce_blocks *old_blocks,
           unsigned char sha1[],
-          SeafileCrypt *crypt)
+          uint32_t **block_sizes,
+          uint32_t *n_blocks,
+          SeafileCrypt *crypt,
+          int chunker)
 {
+    char old_id[41];
+    int ret;
+
     /* Check in blocks and get object ID. */
-    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, path, sha1, crypt) < 0) {
+    if (old_sha1 && !is_null_sha1 (old_sha1)) {
+        rawdata_to_hex (old_sha1, old_id, 20);
+        ret = seaf_fs_manager_reindex_blocks (seaf->fs_mgr, path, old_id,
+                                              old_blocks ? old_blocks->sizes : NULL,
+                                              old_blocks ? old_blocks->n_blocks : 0,
+                                              sha1, block_sizes, n_blocks,
+                                              crypt, chunker);
+    } else
+        ret = seaf_fs_manager_reindex_blocks (seaf->fs_mgr, path, NULL,
+                                              NULL, 0,
+                                              sha1, block_sizes, n_blocks,
+                                              crypt, chunker);
+    if (ret < 0) {
         g_warning ("Failed to index file %s.\n", path);
         return -1;
     }
@@ -357,18 +393,28 @@ has_trailing_space (const char *path)
     return FALSE;
 }
 
+struct IndexCounts {
+    int scanned;
+    int added;
+};
+
 static int
 add_recursive (struct index_state *istate, 
                const char *worktree,
                const char *path,
                SeafileCrypt *crypt,
-               gboolean ignore_empty_dir)
+               int chunker,
+               gboolean ignore_empty_dir,
+               char **sparse_paths,
+               struct IndexCounts *counts)
 {
     char *full_path;
     GDir *dir;
     const char *dname;
     char *subpath;
     struct stat st;
+    struct cache_entry *alias;
+    GList *names = NULL, *ptr;
     int n;
 
     if (has_trailing_space (path)) {
@@ -378,6 +424,15 @@ add_recursive (struct index_state *istate,
         return 0;
     }
 
+    /* Files found unchanged by wt_status_refresh_index(). */
+    alias = index_name_exists (istate, path, strlen(path), IGNORE_CASE);
+    if (alias && ce_uptodate (alias) && !ce_stage (alias) &&
+        S_ISREG (alias->ce_mode)) {
+        alias->ce_flags |= CE_ADDED;
+        ++(counts->scanned);
+        return 0;
+    }
+
     full_path = g_build_path (PATH_SEPERATOR, worktree, path, NULL);
     if (g_lstat (full_path, &st) < 0) {
         g_warning ("Failed to stat %s.\n", full_path);
@@ -385,9 +440,17 @@ add_recursive (struct index_state *istate,
         return 1;
     }
 
+    /* Folders not synced are not scanned, their entries are kept. */
+    if (!sparse_path_included (sparse_paths, path, S_ISDIR(st.st_mode))) {
+        g_free (full_path);
+        return 0;
+    }
+
     if (S_ISREG(st.st_mode)) {
+        ++(counts->scanned);
+        ++(counts->added);
         int ret = add_to_index (istate, path, full_path,
-                                &st, 0, crypt, index_cb);
+                                &st, 0, crypt, chunker, index_cb);
         g_free (full_path);
         return ret;
     }
@@ -406,17 +469,28 @@ add_recursive (struct index_state *istate,
                 continue;
 
             ++n;
-
-            subpath = g_build_path (PATH_SEPERATOR, path, dname, NULL);
-            add_recursive (istate, worktree, subpath, crypt, ignore_empty_dir);
-            g_free (subpath);
+            names = g_list_prepend (names, g_strdup(dname));
         }
         g_dir_close (dir);
         if (errno != 0) {
             g_warning ("Failed to read dir %s: %s.\n", path, strerror(errno));
+            string_list_free (names);
             goto bad;
         }
 
+        /* New entries are inserted into the sorted index array. Adding
+         * them in name order appends most of them instead of moving
+         * the tail of the array for each file.
+         */
+        names = g_list_sort (names, (GCompareFunc)strcmp);
+        for (ptr = names; ptr; ptr = ptr->next) {
+            subpath = g_build_path (PATH_SEPERATOR, path, ptr->data, NULL);
+            add_recursive (istate, worktree, subpath, crypt,
+                           chunker, ignore_empty_dir, sparse_paths, counts);
+            g_free (subpath);
+        }
+        string_list_free (names);
+
         if (n == 0 && !ignore_empty_dir) {
             g_debug ("Adding empty dir %s\n", path);
             add_empty_dir_to_index (istate, path);
@@ -454,50 +528,110 @@ is_empty_dir (const char *path)
     return (n == 0);
 }
 
+/* Mark @ce to be removed if it no longer exists in the worktree. */
+static void
+mark_deleted_entry (struct cache_entry *ce, const char *worktree)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int ret;
+
+    /* Known to exist since the index was refreshed. */
+    if (ce_uptodate (ce) && S_ISREG (ce->ce_mode))
+        return;
+    /* Not in the synced folders. */
+    if (ce_skip_worktree (ce))
+        return;
+    snprintf (path, PATH_MAX, "%s/%s", worktree, ce->name);
+    ret = g_lstat (path, &st);
+
+    if (S_ISDIR (ce->ce_mode)) {
+        if (ret < 0 || !S_ISDIR (st.st_mode) || !is_empty_dir (path))
+            ce->ce_flags |= CE_REMOVE;
+    } else {
+        if (ret < 0 || !S_ISREG (st.st_mode))
+            ce->ce_flags |= CE_REMOVE;
+    }
+}
+
 static void
 remove_deleted (struct index_state *istate, const char *worktree, const char *prefix)
 {
     struct cache_entry **ce_array = istate->cache;
-    struct cache_entry *ce;
-    char path[PATH_MAX];
     unsigned int i;
     int len = strlen(prefix);
-    struct stat st;
-    int ret;
 
     for (i = 0; i < istate->cache_nr; ++i) {
-        ce = ce_array[i];
         /* Only check entries under 'prefix'. */
-        if (strncmp (ce->name, prefix, len) != 0)
+        if (strncmp (ce_array[i]->name, prefix, len) != 0)
             continue;
-        snprintf (path, PATH_MAX, "%s/%s", worktree, ce->name);
-        ret = g_lstat (path, &st);
+        mark_deleted_entry (ce_array[i], worktree);
+    }
 
-        if (S_ISDIR (ce->ce_mode)) {
-            if (ret < 0 || !S_ISDIR (st.st_mode) || !is_empty_dir (path))
-                ce->ce_flags |= CE_REMOVE;
-        } else {
-            if (ret < 0 || !S_ISREG (st.st_mode))
-                ce_array[i]->ce_flags |= CE_REMOVE;
-        }
+    remove_marked_cache_entries (istate);
+}
+
+/* Whether @name or one of its parent dirs is in @paths. */
+static gboolean
+path_in_set (GHashTable *paths, const char *name)
+{
+    char buf[PATH_MAX];
+    char *slash;
+
+    g_strlcpy (buf, name, sizeof(buf));
+    while (1) {
+        if (g_hash_table_lookup (paths, buf))
+            return TRUE;
+        slash = strrchr (buf, '/');
+        if (!slash)
+            return FALSE;
+        *slash = 0;
+    }
+}
+
+/* Like remove_deleted(), for the entries at or under any of @paths. */
+static void
+remove_deleted_paths (struct index_state *istate, const char *worktree,
+                      GHashTable *paths)
+{
+    unsigned int i;
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        if (path_in_set (paths, istate->cache[i]->name))
+            mark_deleted_entry (istate->cache[i], worktree);
     }
 
     remove_marked_cache_entries (istate);
 }
 
-int
-seaf_repo_index_add (SeafRepo *repo, const char *path)
+/* Whether any component of @path is ignored when scanning the worktree. */
+static gboolean
+is_ignored_path (const char *path)
 {
-    SeafRepoManager *mgr = repo->manager;
-    char index_path[PATH_MAX];
-    struct index_state istate;
-    SeafileCrypt *crypt = NULL;
+    char **names = g_strsplit (path, "/", 0);
+    gboolean ret = FALSE;
+    int i;
 
-    /* We cannot write any new block when GC is running.
-     * Poll for GC to finish. This can only happen in a short
-     * period after restart, so it should do no harm to general
-     * user experience.
-     */
+    for (i = 0; names[i] != NULL; i++) {
+        if (names[i][0] != 0 && should_ignore (names[i], NULL)) {
+            ret = TRUE;
+            break;
+        }
+    }
+
+    g_strfreev (names);
+    return ret;
+}
+
+/*
+ * We cannot write any new block when GC is running.
+ * Poll for GC to finish. This can only happen in a short
+ * period after restart, so it should do no harm to general
+ * user experience.
+ */
+static void
+wait_for_gc ()
+{
     while (gc_is_started ()) {
         /* g_debug ("GC is running, hold up index_add.\n"); */
 #ifdef WIN32
@@ -507,6 +641,19 @@ seaf_repo_index_add (SeafRepo *repo, const char *path)
         sleep (1);
 #endif
     }
+}
+
+int
+seaf_repo_index_add (SeafRepo *repo, const char *path)
+{
+    SeafRepoManager *mgr = repo->manager;
+    char index_path[PATH_MAX];
+    struct index_state istate;
+    SeafileCrypt *crypt = NULL;
+    char **sparse_paths;
+    struct IndexCounts counts = { 0, 0 };
+
+    wait_for_gc ();
 
     if (!check_worktree_common (repo))
         return -1;
@@ -518,6 +665,9 @@ seaf_repo_index_add (SeafRepo *repo, const char *path)
         return -1;
     }
 
+    sparse_paths = seaf_repo_manager_get_sparse_paths (mgr, repo->id);
+    apply_sparse_paths (&istate, sparse_paths, FALSE);
+
     /* Skip any leading '/'. */
     while (path[0] == '/')
         path = &path[1];
@@ -526,8 +676,13 @@ seaf_repo_index_add (SeafRepo *repo, const char *path)
         crypt = seafile_crypt_new (repo->enc_version, repo->enc_key, repo->enc_iv);
     }
 
-    if (add_recursive (&istate, repo->worktree, path, crypt, TRUE) < 0)
+    wt_status_refresh_index (&istate, repo->worktree);
+
+    if (add_recursive (&istate, repo->worktree, path,
+                       crypt, repo->chunker, TRUE, sparse_paths, &counts) < 0)
         goto error;
+    repo->n_index_scanned = counts.scanned;
+    repo->n_index_added = counts.added;
 
     remove_deleted (&istate, repo->worktree, path);
 
@@ -536,15 +691,87 @@ seaf_repo_index_add (SeafRepo *repo, const char *path)
 
     discard_index (&istate);
     g_free (crypt);
+    g_strfreev (sparse_paths);
 
     return 0;
 
 error:
     discard_index (&istate);
     g_free (crypt);
+    g_strfreev (sparse_paths);
     return -1;
 }
 
+int
+seaf_repo_index_add_paths (SeafRepo *repo, GList *paths)
+{
+    SeafRepoManager *mgr = repo->manager;
+    char index_path[PATH_MAX];
+    char full_path[PATH_MAX];
+    struct index_state istate;
+    SeafileCrypt *crypt = NULL;
+    GHashTable *path_set;
+    GList *ptr;
+    struct stat st;
+    char **sparse_paths;
+    struct IndexCounts counts = { 0, 0 };
+    int ret = 0;
+
+    wait_for_gc ();
+
+    if (!check_worktree_common (repo))
+        return -1;
+
+    memset (&istate, 0, sizeof(istate));
+    snprintf (index_path, PATH_MAX, "%s/%s", mgr->index_dir, repo->id);
+    if (read_index_from (&istate, index_path) < 0) {
+        g_warning ("Failed to load index.\n");
+        return -1;
+    }
+
+    if (repo->encrypted) {
+        crypt = seafile_crypt_new (repo->enc_version, repo->enc_key, repo->enc_iv);
+    }
+
+    sparse_paths = seaf_repo_manager_get_sparse_paths (mgr, repo->id);
+    apply_sparse_paths (&istate, sparse_paths, FALSE);
+
+    path_set = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (ptr = paths; ptr; ptr = ptr->next) {
+        const char *path = ptr->data;
+
+        if (path[0] == 0 || is_ignored_path (path))
+            continue;
+        g_hash_table_insert (path_set, (gpointer)path, (gpointer)path);
+
+        /* Deleted paths are handled by remove_deleted_paths(). */
+        snprintf (full_path, PATH_MAX, "%s/%s", repo->worktree, path);
+        if (g_lstat (full_path, &st) < 0)
+            continue;
+
+        if (add_recursive (&istate, repo->worktree, path, crypt,
+                           repo->chunker, TRUE, sparse_paths, &counts) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+    repo->n_index_scanned = counts.scanned;
+    repo->n_index_added = counts.added;
+
+    remove_deleted_paths (&istate, repo->worktree, path_set);
+
+    if (update_index (&istate, index_path) < 0)
+        ret = -1;
+
+out:
+    g_hash_table_destroy (path_set);
+    discard_index (&istate);
+    g_free (crypt);
+    g_strfreev (sparse_paths);
+    return ret;
+}
+
 /*
  * Add the files in @worktree to index and return the corresponding
  * @root_id. The repo doesn't have to exist.
@@ -553,13 +780,15 @@ int
 seaf_repo_index_worktree_files (const char *repo_id,
                                 const char *worktree,
                                 const char *passwd,
+                                int chunker,
                                 char *root_id)
 {
     char index_path[PATH_MAX];
     struct index_state istate;
     unsigned char key[16], iv[16];
     SeafileCrypt *crypt = NULL;
-    struct cache_tree *it = NULL;
+    struct cache_tree *it;
+    struct IndexCounts counts = { 0, 0 };
 
     memset (&istate, 0, sizeof(istate));
     snprintf (index_path, PATH_MAX, "%s/%s", seaf->repo_mgr->index_dir, repo_id);
@@ -584,12 +813,17 @@ seaf_repo_index_worktree_files (const char *repo_id,
     /* Add empty dir to index. Otherwise if the repo on relay contains an empty
      * dir, we'll fail to detect fast-forward relationship later.
      */
-    if (add_recursive (&istate, worktree, "", crypt, FALSE) < 0)
+    wt_status_refresh_index (&istate, worktree);
+
+    if (add_recursive (&istate, worktree, "", crypt, chunker, FALSE,
+                       NULL, &counts) < 0)
         goto error;
 
     remove_deleted (&istate, worktree, "");
 
-    it = cache_tree ();
+    if (!istate.cache_tree)
+        istate.cache_tree = cache_tree ();
+    it = istate.cache_tree;
     if (cache_tree_update (it, istate.cache, istate.cache_nr,
                            0, 0, commit_trees_cb) < 0) {
         g_warning ("Failed to build cache tree");
@@ -603,15 +837,11 @@ seaf_repo_index_worktree_files (const char *repo_id,
 
     discard_index (&istate);
     g_free (crypt);
-    if (it)
-        cache_tree_free (&it);
     return 0;
 
 error:
     discard_index (&istate);
     g_free (crypt);
-    if (it)
-        cache_tree_free (&it);
     return -1;
 }
 
@@ -826,6 +1056,9 @@ seaf_repo_is_worktree_changed (SeafRepo *repo)
     if (res != NULL)
         goto changed;
 
+    /* Save the refreshed untracked cache for the next check. */
+    if (istate.extensions_changed)
+        update_index (&istate, index_path);
     discard_index (&istate);
 
     repo->wt_changed = FALSE;
@@ -834,6 +1067,8 @@ seaf_repo_is_worktree_changed (SeafRepo *repo)
     return FALSE;
 
 changed:
+    if (istate.extensions_changed)
+        update_index (&istate, index_path);
     discard_index (&istate);
     for (p = res; p; p = p->next) {
         DiffEntry *de = p->data;
@@ -1053,6 +1288,8 @@ commit_tree (SeafRepo *repo, struct cache_tree *it,
     if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0)
         return -1;
 
+    if (commit->parent_id)
+        gc_head_moved (commit->parent_id, commit->commit_id);
     seaf_branch_set_commit (repo->head, commit->commit_id);
     seaf_branch_manager_update_branch (seaf->branch_mgr, repo->head);
 
@@ -1097,23 +1334,27 @@ seaf_repo_index_commit (SeafRepo *repo, const char *desc,
         my_desc = gen_desc;
     }
 
-    it = cache_tree ();
+    /* Only the dirs on the paths of changed entries are rebuilt. */
+    if (!istate.cache_tree)
+        istate.cache_tree = cache_tree ();
+    it = istate.cache_tree;
     if (cache_tree_update (it, istate.cache,
                 istate.cache_nr, 0, 0, commit_trees_cb) < 0) {
         g_warning ("Failed to build cache tree");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal data structure error");
-        cache_tree_free (&it);
         goto error;
     }
 
     if (commit_tree (repo, it, my_desc, commit_id, unmerged, remote_name) < 0) {
         g_warning ("Failed to save commit file");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal error");
-        cache_tree_free (&it);
         goto error;
     }
     g_free (my_desc);
-    cache_tree_free (&it);
+
+    /* Not being able to save the cache tree only costs time next commit. */
+    if (update_index (&istate, index_path) < 0)
+        g_warning ("Failed to save cache tree to index.\n");
 
     discard_index (&istate);
 
@@ -1171,10 +1412,12 @@ seaf_repo_checkout_commit (SeafRepo *repo, SeafCommit *commit, gboolean recover_
 {
     SeafRepoManager *mgr = repo->manager;
     char index_path[PATH_MAX];
+    char journal_path[PATH_MAX];
     struct tree_desc trees[2];
     struct unpack_trees_options topts;
     struct index_state istate;
     gboolean initial_checkout;
+    char **sparse_paths;
     GString *err_msgs;
     int ret = 0;
 
@@ -1216,6 +1459,7 @@ seaf_repo_checkout_commit (SeafRepo *repo, SeafCommit *commit, gboolean recover_
     topts.verbose_update = 0;
     /* topts.debug_unpack = 1; */
     topts.fn = twoway_merge;
+    topts.chunker = repo->chunker;
     if (repo->encrypted) {
         topts.crypt = seafile_crypt_new (repo->enc_version, 
                                          repo->enc_key, 
@@ -1227,6 +1471,13 @@ seaf_repo_checkout_commit (SeafRepo *repo, SeafCommit *commit, gboolean recover_
         ret = -1;
         goto out;
     }
+    copy_index_extensions (&topts.result, &istate);
+
+    sparse_paths = seaf_repo_manager_get_sparse_paths (mgr, repo->id);
+    apply_sparse_paths (&topts.result, sparse_paths, TRUE);
+    g_strfreev (sparse_paths);
+    if (repo->placeholders)
+        mark_placeholders (&topts.result, &istate);
 
 #ifdef WIN32
     if (!initial_checkout && !recover_merge &&
@@ -1237,6 +1488,10 @@ seaf_repo_checkout_commit (SeafRepo *repo, SeafCommit *commit, gboolean recover_
     }
 #endif
 
+    snprintf (journal_path, PATH_MAX, "%s/%s%s",
+              mgr->index_dir, repo->id, CHECKOUT_JOURNAL_SUFFIX);
+    topts.journal = checkout_journal_open (journal_path, commit->root_id);
+
     int *finished_entries = NULL;
     CheckoutTask *c_task = seaf_repo_manager_get_checkout_task (repo->manager, repo->id);
     if (c_task) {
@@ -1259,7 +1514,13 @@ seaf_repo_checkout_commit (SeafRepo *repo, SeafCommit *commit, gboolean recover_
         goto out;
     }
 
+    /* The index has all the files now. */
+    if (topts.journal)
+        g_unlink (journal_path);
+
 out:
+    checkout_journal_close (topts.journal);
+
     err_msgs = g_string_new ("");
     get_unpack_trees_error_msgs (&topts, err_msgs, OPR_CHECKOUT);
     *error = g_string_free (err_msgs, FALSE);
@@ -1360,6 +1621,7 @@ reset_common (SeafRepo *repo, struct index_state *istate, SeafCommit *commit, ch
 {
     struct tree_desc tree;
     struct unpack_trees_options topts;
+    char **sparse_paths;
     GString *err_msgs;
     int ret = 0;
 
@@ -1375,6 +1637,7 @@ reset_common (SeafRepo *repo, struct index_state *istate, SeafCommit *commit, ch
     topts.reset = 1;
     /* topts.debug_unpack = 1; */
     topts.fn = oneway_merge;
+    topts.chunker = repo->chunker;
     if (repo->encrypted) {
         topts.crypt = seafile_crypt_new (repo->enc_version, 
                                          repo->enc_key, 
@@ -1386,6 +1649,13 @@ reset_common (SeafRepo *repo, struct index_state *istate, SeafCommit *commit, ch
         ret = -1;
         goto out;
     }
+    copy_index_extensions (&topts.result, istate);
+
+    sparse_paths = seaf_repo_manager_get_sparse_paths (repo->manager, repo->id);
+    apply_sparse_paths (&topts.result, sparse_paths, TRUE);
+    g_strfreev (sparse_paths);
+    if (repo->placeholders)
+        mark_placeholders (&topts.result, istate);
 
     if (update_worktree (&topts, FALSE, NULL, NULL, NULL) < 0) {
         g_warning ("Failed to update worktree.\n");
@@ -1735,9 +2005,13 @@ seaf_repo_manager_new (SeafileSession *seaf)
     mgr->index_dir = g_build_path (PATH_SEPERATOR, seaf->seaf_dir, INDEX_DIR, NULL);
 
     pthread_mutex_init (&mgr->priv->db_lock, NULL);
+    pthread_mutex_init (&mgr->priv->load_lock, NULL);
+    pthread_mutex_init (&mgr->priv->sparse_lock, NULL);
 
     mgr->priv->checkout_tasks_hash = g_hash_table_new_full
         (g_str_hash, g_str_equal, g_free, g_free);
+    mgr->priv->hydrate_waiting = g_hash_table_new_full
+        (g_str_hash, g_str_equal, g_free, NULL);
 
     ignore_patterns = g_new0 (GPatternSpec*, G_N_ELEMENTS(ignore_table));
     int i;
@@ -1768,15 +2042,29 @@ seaf_repo_manager_init (SeafRepoManager *mgr)
     return 0;
 }
 
-static void
-watch_repos (SeafRepoManager *mgr)
+/*
+ * Each watch command waits for the monitor thread, so the repos are
+ * watched a few at a time from a timer, letting the daemon serve
+ * requests in between.
+ */
+#define WATCH_REPOS_BATCH 5
+#define WATCH_REPOS_INTERVAL 100 /* msec */
+
+static int
+watch_repos_pulse (void *vmgr)
 {
-    avl_node_t *node;
+    SeafRepoManager *mgr = vmgr;
     SeafRepo *repo;
+    char *repo_id;
+    int i;
 
-    for (node = mgr->priv->repo_tree->head; node; node = node->next) {
-        repo = node->item;
-        if (repo->auto_sync && !repo->worktree_invalid) {
+    for (i = 0; i < WATCH_REPOS_BATCH && mgr->priv->watch_queue; ++i) {
+        repo_id = mgr->priv->watch_queue->data;
+        mgr->priv->watch_queue = g_list_delete_link (mgr->priv->watch_queue,
+                                                     mgr->priv->watch_queue);
+
+        repo = seaf_repo_manager_get_repo (mgr, repo_id);
+        if (repo && repo->auto_sync && !repo->worktree_invalid) {
             if (seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id) < 0) {
                 g_warning ("failed to watch repo %s.\n", repo->id);
                 /* If we fail to add watch at the beginning, sync manager
@@ -1784,7 +2072,28 @@ watch_repos (SeafRepoManager *mgr)
                  */
             }
         }
+        g_free (repo_id);
+    }
+
+    return (mgr->priv->watch_queue != NULL);
+}
+
+static void
+watch_repos (SeafRepoManager *mgr)
+{
+    avl_node_t *node;
+    SeafRepo *repo;
+
+    for (node = mgr->priv->repo_tree->head; node; node = node->next) {
+        repo = node->item;
+        if (repo->auto_sync && !repo->worktree_invalid)
+            mgr->priv->watch_queue = g_list_prepend (mgr->priv->watch_queue,
+                                                     g_strdup(repo->id));
     }
+    mgr->priv->watch_queue = g_list_reverse (mgr->priv->watch_queue);
+
+    if (mgr->priv->watch_queue)
+        ccnet_timer_new (watch_repos_pulse, mgr, WATCH_REPOS_INTERVAL);
 }
 
 static void *
@@ -1825,6 +2134,9 @@ recover_interrupted_merges (SeafRepoManager *mgr)
         }
 
         if (info.in_merge) {
+            load_repo_head (mgr, repo);
+            if (repo->delete_pending)
+                continue;
             ccnet_job_manager_schedule_job (seaf->job_mgr, 
                                             recover_merge_job, 
                                             merge_job_done,
@@ -1833,83 +2145,422 @@ recover_interrupted_merges (SeafRepoManager *mgr)
     }
 }
 
-int
-seaf_repo_manager_start (SeafRepoManager *mgr)
-{
-    recover_interrupted_merges (mgr);
-    watch_repos (mgr);
+/*
+ * Hydrating placeholders.
+ *
+ * The content of a placeholder is checked out in a worker thread, holding
+ * repo->lock like a merge does. If some of its blocks are not local, they
+ * are fetched by a blocks-only transfer task and the file is checked out
+ * again when the task finishes.
+ */
 
-    return 0;
+enum {
+    HYDRATE_DONE,
+    HYDRATE_NEED_BLOCKS,
+    HYDRATE_ERROR,
+};
+
+/* Fetch the blocks at most once for a file. */
+#define HYDRATE_MAX_FETCHES 1
+
+typedef struct {
+    SeafRepoManager *mgr;
+    char repo_id[37];
+    char *path;
+    char file_id[41];
+    int n_fetches;
+    int result;
+} HydrateData;
+
+static void
+hydrate_data_free (HydrateData *data)
+{
+    g_free (data->path);
+    g_free (data);
 }
 
-SeafRepo*
-seaf_repo_manager_create_new_repo (SeafRepoManager *mgr,
-                                   const char *name,
-                                   const char *desc)
+static gboolean
+file_blocks_exist (const char *file_id)
 {
-    SeafRepo *repo;
-    char *repo_id;
-    
-    repo_id = gen_uuid ();
-    repo = seaf_repo_new (repo_id, name, desc);
-    if (!repo) {
-        g_free (repo_id);
-        return NULL;
-    }
-    g_free (repo_id);
+    Seafile *file;
+    int i;
+    gboolean ret = TRUE;
 
-    /* we directly create dir because it shouldn't exist */
-    /* if (seaf_repo_mkdir (repo, base) < 0) { */
-    /*     seaf_repo_free (repo); */
-    /*     goto out; */
-    /* } */
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!file)
+        return FALSE;
 
-    seaf_repo_manager_add_repo (mgr, repo);
-    return repo;
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                              file->blk_sha1s[i])) {
+            ret = FALSE;
+            break;
+        }
+    }
+    seafile_unref (file);
+
+    return ret;
 }
 
-int
-seaf_repo_manager_add_repo (SeafRepoManager *manager,
-                            SeafRepo *repo)
+static int
+hydrate_entry (SeafRepo *repo, struct index_state *istate,
+               struct cache_entry *ce, const char *path, HydrateData *data)
 {
-    char sql[256];
-    sqlite3 *db = manager->priv->db;
-
-    pthread_mutex_lock (&manager->priv->db_lock);
+    struct stat st;
+    SeafileCrypt *crypt = NULL;
+    uint32_t *block_sizes = NULL, n_blocks = 0;
+    int ret;
 
-    snprintf (sql, sizeof(sql), "INSERT INTO Repo VALUES ('%s');", repo->id);
-    sqlite_query_exec (db, sql);
+    if (g_lstat (path, &st) < 0) {
+        g_warning ("Failed to stat placeholder %s: %s.\n",
+                   path, strerror(errno));
+        return HYDRATE_ERROR;
+    }
 
-    pthread_mutex_unlock (&manager->priv->db_lock);
+    rawdata_to_hex (ce->sha1, data->file_id, 20);
+    if (!file_blocks_exist (data->file_id))
+        return HYDRATE_NEED_BLOCKS;
 
-    repo->manager = manager;
+    if (ie_match_stat (istate, ce, &st, 0)) {
+        /* Written to before it had its content, e.g. appended to. That's
+         * not the file's content, keep it as a conflict file. */
+        char *conflict_path = gen_conflict_path (path, "placeholder");
 
-    if (pthread_rwlock_wrlock (&manager->priv->lock) < 0) {
-        g_warning ("[repo mgr] failed to lock repo cache.\n");
-        return -1;
+        g_warning ("Placeholder %s was changed, moving it to %s.\n",
+                   path, conflict_path);
+        if (ccnet_rename (path, conflict_path) < 0) {
+            g_warning ("Failed to rename %s: %s.\n", path, strerror(errno));
+            g_free (conflict_path);
+            return HYDRATE_ERROR;
+        }
+        g_free (conflict_path);
+    } else {
+        /* Placeholders are read-only, which would stop the rename on
+         * Windows. */
+        g_chmod (path, ce_permissions (ce->ce_mode));
+    }
+
+    if (repo->encrypted)
+        crypt = seafile_crypt_new (repo->enc_version,
+                                   repo->enc_key,
+                                   repo->enc_iv);
+    ret = seaf_fs_manager_checkout_file (seaf->fs_mgr, data->file_id,
+                                         path, ce->ce_mode, crypt, NULL,
+                                         &block_sizes, &n_blocks);
+    g_free (crypt);
+    if (ret < 0) {
+        g_warning ("Failed to checkout file %s.\n", path);
+        return HYDRATE_ERROR;
     }
 
-    avl_insert (manager->priv->repo_tree, repo);
+    index_set_blocks (istate, ce->name, ce->sha1, block_sizes, n_blocks);
+    free (block_sizes);
 
-    pthread_rwlock_unlock (&manager->priv->lock);
-    send_wktree_notification (repo, TRUE);
+    g_lstat (path, &st);
+    fill_stat_cache_info (ce, &st);
+    ce->ce_flags &= ~CE_PLACEHOLDER;
+    istate->cache_changed = 1;
 
-    return 0;
+    return HYDRATE_DONE;
 }
 
-int
-seaf_repo_manager_mark_repo_deleted (SeafRepoManager *mgr, SeafRepo *repo)
+static void *
+hydrate_file_job (void *vdata)
 {
-    char sql[256];
+    HydrateData *data = vdata;
+    SeafRepo *repo;
+    char index_path[PATH_MAX];
+    struct index_state istate;
+    char *path;
+    int pos;
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    data->result = HYDRATE_ERROR;
 
-    snprintf (sql, sizeof(sql), "INSERT INTO DeletedRepo VALUES ('%s')",
-              repo->id);
-    if (sqlite_query_exec (mgr->priv->db, sql) < 0) {
-        pthread_mutex_unlock (&mgr->priv->db_lock);
-        return -1;
-    }
+    repo = seaf_repo_manager_get_repo (data->mgr, data->repo_id);
+    if (!repo)
+        return data;
+
+    pthread_mutex_lock (&repo->lock);
+
+    memset (&istate, 0, sizeof(istate));
+    snprintf (index_path, PATH_MAX, "%s/%s", data->mgr->index_dir, repo->id);
+    if (read_index_from (&istate, index_path) < 0) {
+        g_warning ("Failed to load index.\n");
+        goto out;
+    }
+
+    pos = index_name_pos (&istate, data->path, strlen(data->path));
+    if (pos < 0) {
+        g_warning ("%s is not in the index of repo %s.\n",
+                   data->path, repo->id);
+        discard_index (&istate);
+        goto out;
+    }
+
+    if (!ce_placeholder (istate.cache[pos])) {
+        data->result = HYDRATE_DONE;
+        discard_index (&istate);
+        goto out;
+    }
+
+    path = g_build_filename (repo->worktree, data->path, NULL);
+    data->result = hydrate_entry (repo, &istate, istate.cache[pos],
+                                  path, data);
+    g_free (path);
+
+    if (istate.cache_changed && update_index (&istate, index_path) < 0) {
+        g_warning ("Failed to update index.\n");
+        data->result = HYDRATE_ERROR;
+    }
+    discard_index (&istate);
+
+out:
+    pthread_mutex_unlock (&repo->lock);
+    return data;
+}
+
+static void
+notify_hydrate_result (HydrateData *data, gboolean success)
+{
+    char *msg = g_strdup_printf ("%s\t%s", data->repo_id, data->path);
+
+    seaf_mq_manager_publish_notification (seaf->mq_mgr,
+                                          success ? "repo.hydrated" :
+                                          "repo.hydrate_failed",
+                                          msg);
+    g_free (msg);
+}
+
+static void
+start_block_fetch (SeafRepoManager *mgr, const char *repo_id)
+{
+    SeafRepo *repo;
+    GList *waiting, *ptr, *file_ids = NULL;
+    char *tx_id;
+    GError *error = NULL;
+
+    repo = seaf_repo_manager_get_repo (mgr, repo_id);
+    waiting = g_hash_table_lookup (mgr->priv->hydrate_waiting, repo_id);
+    if (!waiting)
+        return;
+
+    /* Nowhere to fetch the blocks from. */
+    if (!repo || !repo->relay_id || !repo->token) {
+        for (ptr = waiting; ptr; ptr = ptr->next) {
+            notify_hydrate_result (ptr->data, FALSE);
+            hydrate_data_free (ptr->data);
+        }
+        g_list_free (waiting);
+        g_hash_table_remove (mgr->priv->hydrate_waiting, repo_id);
+        return;
+    }
+
+    for (ptr = waiting; ptr; ptr = ptr->next) {
+        HydrateData *data = ptr->data;
+        file_ids = g_list_prepend (file_ids, data->file_id);
+    }
+
+    tx_id = seaf_transfer_manager_add_block_fetch (seaf->transfer_mgr,
+                                                   repo->id,
+                                                   repo->relay_id,
+                                                   repo->token,
+                                                   file_ids,
+                                                   &error);
+    g_list_free (file_ids);
+
+    /* If another task of the repo is running, try again when it's done. */
+    if (!tx_id) {
+        g_debug ("Failed to fetch blocks of repo %s: %s.\n",
+                 repo->id, error ? error->message : "");
+        g_clear_error (&error);
+    }
+    g_free (tx_id);
+}
+
+static void
+hydrate_file_done (void *vdata)
+{
+    HydrateData *data = vdata;
+    SeafRepoManager *mgr = data->mgr;
+    GList *waiting;
+
+    if (data->result == HYDRATE_NEED_BLOCKS &&
+        data->n_fetches < HYDRATE_MAX_FETCHES) {
+        waiting = g_hash_table_lookup (mgr->priv->hydrate_waiting,
+                                       data->repo_id);
+        waiting = g_list_prepend (waiting, data);
+        g_hash_table_replace (mgr->priv->hydrate_waiting,
+                              g_strdup(data->repo_id), waiting);
+        start_block_fetch (mgr, data->repo_id);
+        return;
+    }
+
+    if (data->result == HYDRATE_NEED_BLOCKS)
+        g_warning ("Failed to fetch blocks of %s in repo %s.\n",
+                   data->path, data->repo_id);
+
+    notify_hydrate_result (data, data->result == HYDRATE_DONE);
+    hydrate_data_free (data);
+}
+
+static void
+schedule_hydrate (HydrateData *data)
+{
+    ccnet_job_manager_schedule_job (seaf->job_mgr,
+                                    hydrate_file_job,
+                                    hydrate_file_done,
+                                    data);
+}
+
+int
+seaf_repo_hydrate_file (SeafRepo *repo, const char *path)
+{
+    HydrateData *data;
+
+    if (!repo->worktree || repo->delete_pending)
+        return -1;
+
+    /* Skip any leading '/'. */
+    while (path[0] == '/')
+        path = &path[1];
+    if (path[0] == '\0')
+        return -1;
+
+    data = g_new0 (HydrateData, 1);
+    data->mgr = repo->manager;
+    memcpy (data->repo_id, repo->id, 37);
+    data->path = g_strdup (path);
+    schedule_hydrate (data);
+
+    return 0;
+}
+
+static void
+on_repo_fetched (SeafileSession *seaf,
+                 TransferTask *tx_task,
+                 SeafRepoManager *mgr)
+{
+    GList *waiting, *ptr;
+
+    waiting = g_hash_table_lookup (mgr->priv->hydrate_waiting,
+                                   tx_task->repo_id);
+    if (!waiting)
+        return;
+    g_hash_table_remove (mgr->priv->hydrate_waiting, tx_task->repo_id);
+
+    /* Any download of the repo may have brought the blocks, but only a
+     * fetch of the file itself counts as an attempt.
+     */
+    for (ptr = waiting; ptr; ptr = ptr->next) {
+        HydrateData *data = ptr->data;
+        gboolean fetched = (g_list_find_custom (tx_task->fetch_files,
+                                                data->file_id,
+                                                (GCompareFunc)strcmp) != NULL);
+
+        if (fetched && tx_task->state != TASK_STATE_FINISHED) {
+            notify_hydrate_result (data, FALSE);
+            hydrate_data_free (data);
+            continue;
+        }
+        if (fetched)
+            ++data->n_fetches;
+        schedule_hydrate (data);
+    }
+    g_list_free (waiting);
+}
+
+int
+seaf_repo_manager_start (SeafRepoManager *mgr)
+{
+    recover_interrupted_merges (mgr);
+    watch_repos (mgr);
+
+    g_signal_connect (seaf, "repo-fetched",
+                      (GCallback)on_repo_fetched, mgr);
+
+    return 0;
+}
+
+SeafRepo*
+seaf_repo_manager_create_new_repo (SeafRepoManager *mgr,
+                                   const char *name,
+                                   const char *desc)
+{
+    SeafRepo *repo;
+    char *repo_id;
+    
+    repo_id = gen_uuid ();
+    repo = seaf_repo_new (repo_id, name, desc);
+    if (!repo) {
+        g_free (repo_id);
+        return NULL;
+    }
+    g_free (repo_id);
+    repo->chunker = chunker_with_policy (CDC_ALGO_RABIN,
+                                         local_chunk_policy ());
+
+    /* we directly create dir because it shouldn't exist */
+    /* if (seaf_repo_mkdir (repo, base) < 0) { */
+    /*     seaf_repo_free (repo); */
+    /*     goto out; */
+    /* } */
+
+    seaf_repo_manager_add_repo (mgr, repo);
+    return repo;
+}
+
+int
+seaf_repo_manager_add_repo (SeafRepoManager *manager,
+                            SeafRepo *repo)
+{
+    char sql[256];
+    sqlite3 *db = manager->priv->db;
+    char *value;
+
+    pthread_mutex_lock (&manager->priv->db_lock);
+
+    snprintf (sql, sizeof(sql), "INSERT INTO Repo VALUES ('%s');", repo->id);
+    sqlite_query_exec (db, sql);
+
+    pthread_mutex_unlock (&manager->priv->db_lock);
+
+    repo->manager = manager;
+
+    /* Settings made before the repo was cloned. */
+    value = load_repo_property (manager, repo->id, REPO_SPARSE_PATHS);
+    repo->sparse_paths = parse_sparse_paths (value);
+    g_free (value);
+    value = load_repo_property (manager, repo->id, REPO_PLACEHOLDERS);
+    if (placeholders_enabled (value))
+        repo->placeholders = 1;
+    g_free (value);
+
+    if (pthread_rwlock_wrlock (&manager->priv->lock) < 0) {
+        g_warning ("[repo mgr] failed to lock repo cache.\n");
+        return -1;
+    }
+
+    avl_insert (manager->priv->repo_tree, repo);
+
+    pthread_rwlock_unlock (&manager->priv->lock);
+    send_wktree_notification (repo, TRUE);
+
+    return 0;
+}
+
+int
+seaf_repo_manager_mark_repo_deleted (SeafRepoManager *mgr, SeafRepo *repo)
+{
+    char sql[256];
+
+    pthread_mutex_lock (&mgr->priv->db_lock);
+
+    snprintf (sql, sizeof(sql), "INSERT INTO DeletedRepo VALUES ('%s')",
+              repo->id);
+    if (sqlite_query_exec (mgr->priv->db, sql) < 0) {
+        pthread_mutex_unlock (&mgr->priv->db_lock);
+        return -1;
+    }
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
@@ -1934,6 +2585,7 @@ remove_repo_ondisk (SeafRepoManager *mgr, const char *repo_id)
     snprintf (sql, sizeof(sql), "DELETE FROM Repo WHERE repo_id = '%s'", repo_id);
     if (sqlite_query_exec (mgr->priv->db, sql) < 0)
         goto out;
+    sqlite_flush_write_batch (mgr->priv->db);
 
     snprintf (sql, sizeof(sql), 
               "DELETE FROM DeletedRepo WHERE repo_id = '%s'", repo_id);
@@ -1947,6 +2599,12 @@ remove_repo_ondisk (SeafRepoManager *mgr, const char *repo_id)
             g_warning("Cannot delete index file: %s", strerror(errno));
         }
     }
+    snprintf (path, PATH_MAX, "%s/%s%s", mgr->index_dir, repo_id,
+              INDEX_DELTA_SUFFIX);
+    g_unlink (path);
+    snprintf (path, PATH_MAX, "%s/%s%s", mgr->index_dir, repo_id,
+              CHECKOUT_JOURNAL_SUFFIX);
+    g_unlink (path);
 
     /* remove branch */
     GList *p;
@@ -2023,6 +2681,7 @@ seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
 
     if (res) {
         SeafRepo *ret = (SeafRepo *)res->item;
+        load_repo_head (manager, ret);
         if (!ret->delete_pending)
             return ret;
     }
@@ -2044,8 +2703,10 @@ seaf_repo_manager_get_repo_prefix (SeafRepoManager *manager, const gchar *id)
     avl_search_closest (manager->priv->repo_tree, &repo, &node);
     if (node != NULL) {
         result = node->item;
-        if (strncmp (id, result->id, len) == 0)
+        if (strncmp (id, result->id, len) == 0) {
+            load_repo_head (manager, result);
             return node->item;
+        }
     }
     return NULL;
 }
@@ -2281,32 +2942,6 @@ load_repo_commit (SeafRepoManager *manager,
     seaf_commit_unref (commit);
 }
 
-static gboolean
-load_passwd_cb (sqlite3_stmt *stmt, void *vrepo)
-{
-    SeafRepo *repo = vrepo;
-
-    repo->encrypted = TRUE;
-    repo->passwd = g_strdup ((const char *)sqlite3_column_text(stmt, 0));
-
-    return FALSE;
-}
-
-static gboolean
-load_keys_cb (sqlite3_stmt *stmt, void *vrepo)
-{
-    SeafRepo *repo = vrepo;
-    const char *key, *iv;
-
-    key = (const char *)sqlite3_column_text(stmt, 0);
-    iv = (const char *)sqlite3_column_text(stmt, 1);
-
-    hex_to_rawdata (key, repo->enc_key, 16);
-    hex_to_rawdata (iv, repo->enc_iv, 16);
-
-    return FALSE;
-}
-
 static void
 recover_repo_enc_keys (SeafRepoManager *manager, SeafRepo *repo)
 {
@@ -2329,40 +2964,6 @@ recover_repo_enc_keys (SeafRepoManager *manager, SeafRepo *repo)
     sqlite_query_exec (db, sql);
 }
 
-static int
-load_repo_passwd (SeafRepoManager *manager, SeafRepo *repo)
-{
-    sqlite3 *db = manager->priv->db;
-    char sql[256];
-    int n;
-
-    pthread_mutex_lock (&manager->priv->db_lock);
-    
-    snprintf (sql, sizeof(sql), 
-              "SELECT passwd FROM RepoPasswd WHERE repo_id='%s'",
-              repo->id);
-    if (sqlite_foreach_selected_row (db, sql, load_passwd_cb, repo) < 0)
-        return -1;
-
-    snprintf (sql, sizeof(sql), 
-              "SELECT key, iv FROM RepoKeys WHERE repo_id='%s'",
-              repo->id);
-    n = sqlite_foreach_selected_row (db, sql, load_keys_cb, repo);
-    if (n < 0)
-        return -1;
-
-    /* Case 1: upgrade from encryption version 0 to version 1.
-     * Case 2: Database lost.
-     */
-    if (n == 0 && repo->passwd != NULL)
-        recover_repo_enc_keys (manager, repo);
-
-    pthread_mutex_unlock (&manager->priv->db_lock);
-
-    return 0;
-    
-}
-
 static gboolean
 load_property_cb (sqlite3_stmt *stmt, void *pvalue)
 {
@@ -2375,6 +2976,54 @@ load_property_cb (sqlite3_stmt *stmt, void *pvalue)
     return FALSE;
 }
 
+/*
+ * Placeholders read as zeros, they're only checked out if something
+ * hydrates them when they're opened.
+ */
+static gboolean
+placeholders_enabled (const char *value)
+{
+    if (g_strcmp0 (value, "true") != 0)
+        return FALSE;
+    if (!seaf->hydrate_hook) {
+        g_warning ("[repo mgr] No hydrate hook is installed, "
+                   "not checking out placeholders.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Folders are kept without leading or trailing slashes. */
+static char **
+parse_sparse_paths (const char *value)
+{
+    char **lines, **paths;
+    char *path;
+    int i, n = 0;
+
+    if (!value)
+        return NULL;
+
+    lines = g_strsplit (value, "\n", 0);
+    paths = g_new0 (char *, g_strv_length (lines) + 1);
+    for (i = 0; lines[i] != NULL; ++i) {
+        path = g_strstrip (lines[i]);
+        while (*path == '/')
+            ++path;
+        while (*path && path[strlen(path) - 1] == '/')
+            path[strlen(path) - 1] = 0;
+        if (*path)
+            paths[n++] = g_strdup (path);
+    }
+    g_strfreev (lines);
+
+    if (n == 0) {
+        g_free (paths);
+        return NULL;
+    }
+    return paths;
+}
+
 static char *
 load_repo_property (SeafRepoManager *manager,
                     const char *repo_id,
@@ -2399,127 +3048,109 @@ load_repo_property (SeafRepoManager *manager,
     return value;
 }
 
-static gboolean
-load_branch_cb (sqlite3_stmt *stmt, void *vrepo)
+/* Repo head may be not set if it's just cloned but not checked out yet. */
+static void
+load_repo_master (SeafRepoManager *manager, SeafRepo *repo)
 {
-    SeafRepo *repo = vrepo;
-    SeafRepoManager *manager = repo->manager;
-
-    char *branch_name = (char *) sqlite3_column_text (stmt, 0);
-    SeafBranch *branch =
-        seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
-                                        repo->id, branch_name);
-    if (branch == NULL) {
-        g_warning ("Broken branch name for repo %s\n", repo->id); 
+    SeafBranch *branch;
+    SeafCommit *commit;
+
+    /* the repo do not have a head branch, try to load 'master' branch */
+    branch = seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
+                                             repo->id, "master");
+    if (!branch) {
+        g_warning ("[repo-mgr] Failed to get branch master");
         repo->is_corrupted = TRUE;
-        return FALSE;
+        return;
     }
-    load_repo_commit (manager, repo, branch);
-    seaf_branch_unref (branch);
 
-    /* Only one result. */
-    return FALSE;
+    commit = seaf_commit_manager_get_commit (manager->seaf->commit_mgr,
+                                             branch->commit_id);
+    if (commit) {
+        seaf_repo_from_commit (repo, commit);
+        seaf_commit_unref (commit);
+    } else {
+        g_warning ("[repo-mgr] Can not find commit %s\n",
+                   branch->commit_id);
+        repo->is_corrupted = TRUE;
+    }
+
+    seaf_branch_unref (branch);
 }
 
-static SeafRepo *
-load_repo (SeafRepoManager *manager, const char *repo_id)
+/*
+ * Repos loaded at startup only have the metadata in repo.db. Their
+ * head branch and commit are read on first use, so that the daemon
+ * doesn't parse the head commits of all repos before it starts. A repo
+ * whose branch or commit is missing is marked deleted and removed on
+ * disk on the next start.
+ */
+static void
+load_repo_head (SeafRepoManager *manager, SeafRepo *repo)
 {
     char sql[256];
+    char *branch_name = NULL;
+    SeafBranch *branch;
 
-    SeafRepo *repo = seaf_repo_new(repo_id, NULL, NULL);
-    if (!repo) {
-        g_warning ("[repo mgr] failed to alloc repo.\n");
-        return NULL;
-    }
+    if (repo->head_loaded)
+        return;
 
-    repo->manager = manager;
+    pthread_mutex_lock (&manager->priv->load_lock);
 
-    snprintf(sql, 256, "SELECT branch_name FROM RepoBranch WHERE repo_id='%s'",
-             repo->id);
-    if (sqlite_foreach_selected_row (manager->priv->db, sql, 
-                                     load_branch_cb, repo) < 0) {
-        g_warning ("Error read branch for repo %s.\n", repo->id);
-        seaf_repo_free (repo);
-        return NULL;
-    }
+    if (repo->head_loaded)
+        goto out;
 
-    /* If repo head is set but failed to load branch or commit. */
-    if (repo->is_corrupted) {
-        seaf_repo_free (repo);
-        remove_repo_ondisk (manager, repo_id);
-        return NULL;
+    pthread_mutex_lock (&manager->priv->db_lock);
+    snprintf (sql, sizeof(sql),
+              "SELECT branch_name FROM RepoBranch WHERE repo_id='%s'",
+              repo->id);
+    if (sqlite_foreach_selected_row (manager->priv->db, sql,
+                                     load_property_cb, &branch_name) < 0) {
+        g_warning ("Error read branch for repo %s.\n", repo->id);
+        pthread_mutex_unlock (&manager->priv->db_lock);
+        /* Try again on next use. */
+        goto out;
     }
+    pthread_mutex_unlock (&manager->priv->db_lock);
 
-    /* Repo head may be not set if it's just cloned but not checked out yet. */
-    if (repo->head == NULL) {
-        /* the repo do not have a head branch, try to load 'master' branch */
-        SeafBranch *branch =
-            seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
-                                            repo->id, "master");
-        if (branch != NULL) {
-             SeafCommit *commit;
-
-             commit = seaf_commit_manager_get_commit (manager->seaf->commit_mgr,
-                                                      branch->commit_id);
-             if (commit) {
-                 seaf_repo_from_commit (repo, commit);
-                 seaf_commit_unref (commit);
-             } else {
-                 g_warning ("[repo-mgr] Can not find commit %s\n",
-                            branch->commit_id);
-                 repo->is_corrupted = TRUE;
-             }
-
-             seaf_branch_unref (branch);
+    if (branch_name) {
+        branch = seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
+                                                 repo->id, branch_name);
+        if (branch) {
+            load_repo_commit (manager, repo, branch);
+            seaf_branch_unref (branch);
         } else {
-            g_warning ("[repo-mgr] Failed to get branch master");
+            g_warning ("Broken branch name for repo %s\n", repo->id); 
             repo->is_corrupted = TRUE;
         }
+    } else {
+        load_repo_master (manager, repo);
     }
 
     if (repo->is_corrupted) {
-        seaf_repo_free (repo);
-        remove_repo_ondisk (manager, repo_id);
-        return NULL;
-    }
-
-    load_repo_passwd (manager, repo);
-
-    char *value;
-
-    value = load_repo_property (manager, repo->id, REPO_AUTO_SYNC);
-    if (g_strcmp0(value, "false") == 0) {
-        repo->auto_sync = 0;
-    }
-    g_free (value);
-
-    repo->worktree = load_repo_property (manager, repo->id, "worktree");
-    if (repo->worktree)
-        repo->worktree_invalid = FALSE;
-
-    repo->relay_id = load_repo_property (manager, repo->id, REPO_RELAY_ID);
-    if (repo->relay_id && strlen(repo->relay_id) != 40) {
-        g_free (repo->relay_id);
-        repo->relay_id = NULL;
-    }
+        seaf_repo_manager_mark_repo_deleted (manager, repo);
+    } else {
+        /* Case 1: upgrade from encryption version 0 to version 1.
+         * Case 2: Database lost.
+         */
+        if (repo->enc_keys_missing) {
+            pthread_mutex_lock (&manager->priv->db_lock);
+            recover_repo_enc_keys (manager, repo);
+            pthread_mutex_unlock (&manager->priv->db_lock);
+            repo->enc_keys_missing = FALSE;
+        }
 
-    value = load_repo_property (manager, repo->id, REPO_NET_BROWSABLE);
-    if (g_strcmp0(value, "true") == 0) {
-        repo->net_browsable = 1;
+        /* TODO: check worktree valid, for example, if worktree was deleted,
+         * the corresponding index should be deleted too.
+         */
+        send_wktree_notification (repo, TRUE);
     }
-    g_free (value);
-
-    repo->email = load_repo_property (manager, repo->id, REPO_PROP_EMAIL);
-    repo->token = load_repo_property (manager, repo->id, REPO_PROP_TOKEN);
-    
-    /* TODO: check worktree valid, for example, if worktree was deleted,
-     * the corresponding index should be deleted too.
-     */
 
-    avl_insert (manager->priv->repo_tree, repo);
-    send_wktree_notification (repo, TRUE);
+    repo->head_loaded = TRUE;
 
-    return repo;
+out:
+    pthread_mutex_unlock (&manager->priv->load_lock);
+    g_free (branch_name);
 }
 
 static sqlite3*
@@ -2533,6 +3164,7 @@ open_db (SeafRepoManager *manager, const char *seaf_dir)
         return NULL;
     g_free (db_path);
     manager->priv->db = db;
+    sqlite_set_write_batch (db, DB_WRITE_BATCH_INTERVAL);
 
     char *sql = "CREATE TABLE IF NOT EXISTS Repo (repo_id TEXT PRIMARY KEY);";
     sqlite_query_exec (db, sql);
@@ -2579,11 +3211,91 @@ static gboolean
 load_repo_cb (sqlite3_stmt *stmt, void *vmanager)
 {
     SeafRepoManager *manager = vmanager;
-    const char *repo_id;
+    const char *repo_id, *passwd, *key, *iv;
+    SeafRepo *repo;
+
+    repo_id = (const char *) sqlite3_column_text (stmt, 0);
+    passwd = (const char *) sqlite3_column_text (stmt, 1);
+    key = (const char *) sqlite3_column_text (stmt, 2);
+    iv = (const char *) sqlite3_column_text (stmt, 3);
+
+    repo = seaf_repo_new (repo_id, NULL, NULL);
+    if (!repo) {
+        g_warning ("[repo mgr] failed to alloc repo.\n");
+        return TRUE;
+    }
+
+    repo->manager = manager;
+    repo->head_loaded = FALSE;
+
+    if (passwd) {
+        repo->encrypted = TRUE;
+        repo->passwd = g_strdup (passwd);
+    }
+    if (key && iv) {
+        hex_to_rawdata (key, repo->enc_key, 16);
+        hex_to_rawdata (iv, repo->enc_iv, 16);
+    } else if (passwd) {
+        /* Regenerated when the head commit gives the enc version. */
+        repo->enc_keys_missing = TRUE;
+    }
+
+    avl_insert (manager->priv->repo_tree, repo);
+
+    return TRUE;
+}
+
+static gboolean
+load_property_row_cb (sqlite3_stmt *stmt, void *vmanager)
+{
+    SeafRepoManager *manager = vmanager;
+    const char *repo_id, *key, *value;
+    SeafRepo tmp, *repo;
+    avl_node_t *node;
 
     repo_id = (const char *) sqlite3_column_text (stmt, 0);
+    key = (const char *) sqlite3_column_text (stmt, 1);
+    value = (const char *) sqlite3_column_text (stmt, 2);
+
+    if (!repo_id || !key || strlen(repo_id) != 36)
+        return TRUE;
+
+    memcpy (tmp.id, repo_id, 37);
+    node = avl_search (manager->priv->repo_tree, &tmp);
+    if (!node)
+        return TRUE;
+    repo = node->item;
 
-    load_repo (manager, repo_id);
+    if (strcmp (key, REPO_AUTO_SYNC) == 0) {
+        if (g_strcmp0(value, "false") == 0)
+            repo->auto_sync = 0;
+    } else if (strcmp (key, "worktree") == 0) {
+        if (value && !repo->worktree) {
+            repo->worktree = g_strdup (value);
+            repo->worktree_invalid = FALSE;
+        }
+    } else if (strcmp (key, REPO_RELAY_ID) == 0) {
+        if (value && strlen(value) == 40 && !repo->relay_id)
+            repo->relay_id = g_strdup (value);
+    } else if (strcmp (key, REPO_NET_BROWSABLE) == 0) {
+        if (g_strcmp0(value, "true") == 0)
+            repo->net_browsable = 1;
+    } else if (strcmp (key, REPO_SYNC_PRIORITY) == 0) {
+        if (value)
+            repo->sync_priority = atoi (value);
+    } else if (strcmp (key, REPO_PROP_EMAIL) == 0) {
+        if (!repo->email)
+            repo->email = g_strdup (value);
+    } else if (strcmp (key, REPO_PROP_TOKEN) == 0) {
+        if (!repo->token)
+            repo->token = g_strdup (value);
+    } else if (strcmp (key, REPO_SPARSE_PATHS) == 0) {
+        if (!repo->sparse_paths)
+            repo->sparse_paths = parse_sparse_paths (value);
+    } else if (strcmp (key, REPO_PLACEHOLDERS) == 0) {
+        if (placeholders_enabled (value))
+            repo->placeholders = 1;
+    }
 
     return TRUE;
 }
@@ -2615,11 +3327,20 @@ load_repos (SeafRepoManager *manager, const char *seaf_dir)
         return;
     }
 
-    sql = "SELECT repo_id FROM Repo;";
+    /* The metadata of all repos is read in two queries. Head commits
+     * are loaded on first use, see load_repo_head().
+     */
+    sql = "SELECT Repo.repo_id, RepoPasswd.passwd, RepoKeys.key, RepoKeys.iv "
+        "FROM Repo LEFT JOIN RepoPasswd ON Repo.repo_id = RepoPasswd.repo_id "
+        "LEFT JOIN RepoKeys ON Repo.repo_id = RepoKeys.repo_id";
     if (sqlite_foreach_selected_row (db, sql, load_repo_cb, manager) < 0) {
         g_warning ("Error read repo db.\n");
         return;
     }
+
+    sql = "SELECT repo_id, key, value FROM RepoProperty";
+    if (sqlite_foreach_selected_row (db, sql, load_property_row_cb, manager) < 0)
+        g_warning ("Error read repo properties.\n");
 }
 
 static void
@@ -2685,6 +3406,25 @@ seaf_repo_manager_set_repo_relay_id (SeafRepoManager *mgr,
     return 0;
 }
 
+int
+seaf_repo_manager_set_remote_head (SeafRepoManager *manager,
+                                   const char *repo_id,
+                                   const char *commit_id)
+{
+    char *old_head;
+    int ret;
+
+    old_head = seaf_repo_manager_get_repo_property (manager, repo_id,
+                                                    REPO_REMOTE_HEAD);
+    ret = seaf_repo_manager_set_repo_property (manager, repo_id,
+                                               REPO_REMOTE_HEAD, commit_id);
+    if (ret == 0 && g_strcmp0 (old_head, commit_id) != 0)
+        gc_remote_head_moved (old_head, commit_id);
+    g_free (old_head);
+
+    return ret;
+}
+
 int
 seaf_repo_manager_set_repo_property (SeafRepoManager *manager, 
                                      const char *repo_id,
@@ -2693,9 +3433,17 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
 {
     SeafRepo *repo;
 
+    /* These can be set before the repo is cloned. */
+    if (strcmp(key, REPO_SPARSE_PATHS) == 0)
+        return seaf_repo_manager_set_sparse_paths (manager, repo_id, value);
+
     repo = seaf_repo_manager_get_repo (manager, repo_id);
-    if (!repo)
-        return -1;
+    if (!repo) {
+        if (strcmp(key, REPO_PLACEHOLDERS) != 0)
+            return -1;
+        save_repo_property (manager, repo_id, key, value);
+        return 0;
+    }
 
     if (strcmp(key, REPO_AUTO_SYNC) == 0) {
         if (g_strcmp0(value, "true") == 0) {
@@ -2714,14 +3462,88 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
         else
             repo->net_browsable = 0;
     }
+    if (strcmp(key, REPO_SYNC_PRIORITY) == 0)
+        repo->sync_priority = value ? atoi (value) : 0;
 
     if (strcmp(key, REPO_RELAY_ID) == 0)
         return seaf_repo_manager_set_repo_relay_id (manager, repo, value);
 
+    if (strcmp(key, REPO_PLACEHOLDERS) == 0)
+        repo->placeholders = placeholders_enabled (value);
+
     save_repo_property (manager, repo_id, key, value);
     return 0;
 }
 
+/* Like seaf_repo_manager_get_repo(), without loading the head. */
+static SeafRepo *
+lookup_repo_noload (SeafRepoManager *manager, const char *repo_id)
+{
+    SeafRepo tmp;
+    avl_node_t *node;
+
+    g_strlcpy (tmp.id, repo_id, sizeof(tmp.id));
+    pthread_rwlock_rdlock (&manager->priv->lock);
+    node = avl_search (manager->priv->repo_tree, &tmp);
+    pthread_rwlock_unlock (&manager->priv->lock);
+
+    return node ? node->item : NULL;
+}
+
+int
+seaf_repo_manager_set_sparse_paths (SeafRepoManager *manager,
+                                    const char *repo_id,
+                                    const char *paths)
+{
+    SeafRepo *repo;
+    char **parsed = parse_sparse_paths (paths);
+    char *value = parsed ? g_strjoinv ("\n", parsed) : NULL;
+
+    save_repo_property (manager, repo_id, REPO_SPARSE_PATHS, value);
+    g_free (value);
+
+    repo = lookup_repo_noload (manager, repo_id);
+
+    pthread_mutex_lock (&manager->priv->sparse_lock);
+    if (repo) {
+        g_strfreev (repo->sparse_paths);
+        repo->sparse_paths = parsed;
+    } else
+        g_strfreev (parsed);
+    pthread_mutex_unlock (&manager->priv->sparse_lock);
+
+    /* Watch the new set of folders. */
+    if (repo && repo->auto_sync && repo->worktree && !repo->worktree_invalid) {
+        seaf_wt_monitor_unwatch_repo (seaf->wt_monitor, repo->id);
+        seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id);
+    }
+
+    return 0;
+}
+
+char **
+seaf_repo_manager_get_sparse_paths (SeafRepoManager *manager,
+                                    const char *repo_id)
+{
+    SeafRepo *repo;
+    char **paths;
+    char *value;
+
+    repo = lookup_repo_noload (manager, repo_id);
+    if (repo) {
+        pthread_mutex_lock (&manager->priv->sparse_lock);
+        paths = g_strdupv (repo->sparse_paths);
+        pthread_mutex_unlock (&manager->priv->sparse_lock);
+        return paths;
+    }
+
+    /* Not cloned yet. */
+    value = load_repo_property (manager, repo_id, REPO_SPARSE_PATHS);
+    paths = parse_sparse_paths (value);
+    g_free (value);
+    return paths;
+}
+
 char *
 seaf_repo_manager_get_repo_property (SeafRepoManager *manager, 
                                      const char *repo_id,
@@ -2912,6 +3734,16 @@ seaf_repo_manager_get_repo_list (SeafRepoManager *manager, int start, int limit)
 
     pthread_rwlock_unlock (&manager->priv->lock);
 
+    /* Loaded outside the lock, a repo may turn out corrupted. */
+    GList *ptr, *next;
+    for (ptr = repo_list; ptr; ptr = next) {
+        next = ptr->next;
+        repo = ptr->data;
+        load_repo_head (manager, repo);
+        if (repo->delete_pending)
+            repo_list = g_list_delete_link (repo_list, ptr);
+    }
+
     return repo_list;
 }
 
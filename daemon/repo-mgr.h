@@ -18,10 +18,22 @@
 #define REPO_NET_BROWSABLE    "net-browsable"
 #define REPO_DOUBLE_SYNC      "double-sync"
 #define REPO_REMOTE_HEAD      "remote-head"
+/* Set by shallow clones: only commits since this time have their fs. */
+#define REPO_HISTORY_SINCE    "history-since"
+/* Folders to sync, one per line. All of the tree if not set. */
+#define REPO_SPARSE_PATHS     "sparse-paths"
+/* "true" to check out new files as placeholders, see seaf_repo_hydrate_file().
+ * Only honoured with the "hydrate_hook" config set. */
+#define REPO_PLACEHOLDERS     "placeholders"
+/* "<device uuid> <event id> <worktree>" of the last FSEvents event indexed. */
+#define REPO_FSEVENTS_ID      "fsevents-id"
 #define REPO_PROP_EMAIL       "email"
 #define REPO_PROP_TOKEN       "token"
 #define REPO_PROP_RELAY_ADDR  "relay-address"
 #define REPO_PROP_RELAY_PORT  "relay-port"
+#define REPO_SYNC_PRIORITY    "sync-priority"
+#define REPO_UPLOAD_LIMIT     "upload-limit"    /* KB/s */
+#define REPO_DOWNLOAD_LIMIT   "download-limit"  /* KB/s */
 #define REPO_ENCRYPTED 0x1
 
 struct _SeafRepoManager;
@@ -38,8 +50,11 @@ struct _SeafRepo {
     int         enc_version;
     gchar       magic[33];       /* hash(repo_id + passwd), key stretched. */
     gboolean    no_local_history;
+    int         chunker;         /* CDC_ALGO_*, recorded in commits */
 
     SeafBranch *head;
+    gboolean    head_loaded;     /* FALSE until first use after startup */
+    gboolean    enc_keys_missing;
 
     gboolean    is_corrupted;
     gboolean    delete_pending;
@@ -49,11 +64,14 @@ struct _SeafRepo {
     gboolean    wt_changed;
     int         wt_check_time;
     int         last_sync_time;
+    int         sync_priority;  /* higher is synced first */
 
     gchar      *passwd;         /* if the repo is encrypted */
     unsigned char enc_key[16];   /* 128-bit encryption key */
     unsigned char enc_iv[16];
 
+    char      **sparse_paths;   /* NULL to sync the whole tree */
+
     gchar      *email;          /* email of the user on the relay */
     gchar      *token;          /* token for access this repo on server */
 
@@ -62,8 +80,14 @@ struct _SeafRepo {
     gboolean      worktree_invalid; /* true if worktree moved or deleted */
     gboolean      index_corrupted;
 
+    /* Regular files visited by the last index add, and those of them
+     * not found unchanged by the index refresh. */
+    int           n_index_scanned;
+    int           n_index_added;
+
     unsigned int  auto_sync : 1;
     unsigned int  net_browsable : 1;
+    unsigned int  placeholders : 1;
     unsigned int  quota_full_notified : 1;
     unsigned int  access_denied_notified : 1;
 };
@@ -106,10 +130,28 @@ seaf_repo_verify_passwd (SeafRepo *repo, const char *passwd);
 int
 seaf_repo_index_add (SeafRepo *repo, const char *path);
 
+/*
+ * Check out the content of placeholder @path (relative to the worktree)
+ * in the background, fetching its blocks from the relay if they're not
+ * local. "repo.hydrated" or "repo.hydrate_failed" is published with
+ * "<repo_id>\t<path>" when it's done.
+ */
+int
+seaf_repo_hydrate_file (SeafRepo *repo, const char *path);
+
+/*
+ * Update the index for changes at or under @paths only (relative to the
+ * worktree), instead of scanning the whole worktree. Deleted paths are
+ * removed from the index.
+ */
+int
+seaf_repo_index_add_paths (SeafRepo *repo, GList *paths);
+
 int
 seaf_repo_index_worktree_files (const char *repo_id,
                                 const char *worktree,
                                 const char *passwd,
+                                int chunker,
                                 char *root_id);
 
 int
@@ -263,6 +305,32 @@ seaf_repo_manager_get_repo_property (SeafRepoManager *manager,
                                      const char *repo_id,
                                      const char *key);
 
+/*
+ * Save @commit_id as REPO_REMOTE_HEAD, the commit up to which blocks are
+ * checked out, and record the move for the incremental GC.
+ */
+int
+seaf_repo_manager_set_remote_head (SeafRepoManager *manager,
+                                   const char *repo_id,
+                                   const char *commit_id);
+
+/*
+ * Set the folders synced for the repo, separated by newlines, NULL or
+ * empty for all of it. The repo doesn't have to exist yet, so that the
+ * folders can be set before it is cloned. They apply from the next
+ * checkout or merge; folders added later come back with the next
+ * commit downloaded.
+ */
+int
+seaf_repo_manager_set_sparse_paths (SeafRepoManager *manager,
+                                    const char *repo_id,
+                                    const char *paths);
+
+/* Returns a copy of the synced folders of the repo, or NULL for all. */
+char **
+seaf_repo_manager_get_sparse_paths (SeafRepoManager *manager,
+                                    const char *repo_id);
+
 void
 seaf_repo_mamager_del_repo_property (SeafRepoManager *manager, SeafRepo *repo);
 
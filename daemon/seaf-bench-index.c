@@ -0,0 +1,700 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Benchmark for the index and the worktree status code.
+ *
+ * A worktree of the given number of files is generated in a fresh
+ * seafile data dir and added to a new repo. Then the operations that the
+ * sync manager runs on every check of a repo are timed on it: reading
+ * and writing the index, collecting the changed and untracked files,
+ * and index add and commit, first on the clean worktree and then after
+ * changing some of the files.
+ *
+ * Every operation is run once after the page cache was dropped (-C,
+ * root only), and then repeated with warm caches. Without -C, only the
+ * index file is evicted before the first read of it. Besides the time,
+ * the syscalls (from /proc/self/io), page faults, blocks read, and the
+ * current and peak RSS of each run are printed, as JSON objects with -j.
+ *
+ * The repo is created with the ccnet identity in the config dir, which
+ * only has to exist; no daemon is connected to.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <ccnet.h>
+
+#include "utils.h"
+#include "seafile-session.h"
+#include "status.h"
+#include "index/index.h"
+
+/* Dirs of files are grouped under top level dirs of this many. */
+#define DIRS_PER_TOP 64
+
+SeafileSession *seaf;
+
+static struct {
+    int n_files;
+    int files_per_dir;
+    int file_size;
+    int n_changes;
+    int iterations;
+    gboolean drop_caches;
+    gboolean json;
+} opts = { 100000, 1000, 64, 100, 3, FALSE, FALSE };
+
+typedef struct ProcStats {
+    gint64  time;
+    guint64 syscr;
+    guint64 syscw;
+    long    minflt;
+    long    majflt;
+    long    inblock;
+    long    rss_kb;
+    long    peak_rss_kb;
+} ProcStats;
+
+typedef struct BenchRepo {
+    SeafRepo *repo;
+    char index_path[PATH_MAX];
+    int round;
+} BenchRepo;
+
+static guint32 rand_state = 1;
+
+static guint32
+next_rand ()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+/* Stats */
+
+static guint64
+read_proc_value (const char *file, const char *key)
+{
+    char line[256];
+    guint64 value = 0;
+    int len = strlen (key);
+    FILE *fp;
+
+    fp = fopen (file, "r");
+    if (!fp)
+        return 0;
+
+    while (fgets (line, sizeof(line), fp)) {
+        if (strncmp (line, key, len) == 0 && line[len] == ':') {
+            value = g_ascii_strtoull (line + len + 1, NULL, 10);
+            break;
+        }
+    }
+
+    fclose (fp);
+    return value;
+}
+
+static void
+read_proc_stats (ProcStats *s)
+{
+    struct rusage ru;
+
+    s->time = get_current_time ();
+    s->syscr = read_proc_value ("/proc/self/io", "syscr");
+    s->syscw = read_proc_value ("/proc/self/io", "syscw");
+    s->rss_kb = read_proc_value ("/proc/self/status", "VmRSS");
+    s->peak_rss_kb = read_proc_value ("/proc/self/status", "VmHWM");
+
+    /* Includes the threads of wt_status_refresh_index(). */
+    memset (&ru, 0, sizeof(ru));
+    getrusage (RUSAGE_SELF, &ru);
+    s->minflt = ru.ru_minflt;
+    s->majflt = ru.ru_majflt;
+    s->inblock = ru.ru_inblock;
+}
+
+static gboolean
+write_proc_file (const char *path, const char *value)
+{
+    int fd, ret;
+
+    fd = open (path, O_WRONLY);
+    if (fd < 0)
+        return FALSE;
+    ret = write (fd, value, strlen(value));
+    close (fd);
+
+    return ret == (int)strlen(value);
+}
+
+/* So that VmHWM is the peak of the next run only. Needs Linux 4.0. */
+static void
+reset_peak_rss ()
+{
+    write_proc_file ("/proc/self/clear_refs", "5");
+}
+
+/*
+ * Returns TRUE if the caches are cold: the whole page cache was dropped,
+ * or, with @path, at least the pages of that file were.
+ */
+static gboolean
+evict_caches (const char *path)
+{
+    int fd, ret;
+
+    if (opts.drop_caches) {
+        sync ();
+        if (write_proc_file ("/proc/sys/vm/drop_caches", "3"))
+            return TRUE;
+        fprintf (stderr, "Failed to drop caches, running as root?\n");
+        opts.drop_caches = FALSE;
+    }
+
+    if (!path)
+        return FALSE;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return FALSE;
+    fdatasync (fd);
+    ret = posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+    close (fd);
+
+    return ret == 0;
+}
+
+static void
+print_result (const char *bench, const char *cache, int entries, int results,
+              const ProcStats *a, const ProcStats *b)
+{
+    double secs = (b->time - a->time) / 1e6;
+    guint64 syscalls = (b->syscr - a->syscr) + (b->syscw - a->syscw);
+
+    if (opts.json) {
+        printf ("{\"bench\": \"%s\", \"cache\": \"%s\", \"entries\": %d, "
+                "\"results\": %d, \"seconds\": %.6f, "
+                "\"syscr\": %"G_GUINT64_FORMAT", \"syscw\": %"G_GUINT64_FORMAT", "
+                "\"minflt\": %ld, \"majflt\": %ld, \"inblock\": %ld, "
+                "\"rss_kb\": %ld, \"peak_rss_kb\": %ld}\n",
+                bench, cache, entries, results, secs,
+                b->syscr - a->syscr, b->syscw - a->syscw,
+                b->minflt - a->minflt, b->majflt - a->majflt,
+                b->inblock - a->inblock, b->rss_kb, b->peak_rss_kb);
+        return;
+    }
+
+    printf ("%-24s %-5s %8d entries %7d results: %9.6fs, "
+            "%9"G_GUINT64_FORMAT" syscalls, %7ld majflt, %8ld inblock, "
+            "rss %ld kB, peak %ld kB\n",
+            bench, cache, entries, results, secs, syscalls,
+            b->majflt - a->majflt, b->inblock - a->inblock,
+            b->rss_kb, b->peak_rss_kb);
+}
+
+/* Worktree */
+
+static void
+file_path (int i, char *path, int len)
+{
+    int dir = i / opts.files_per_dir;
+
+    snprintf (path, len, "d-%03d/d-%06d/f-%08d.txt",
+              dir / DIRS_PER_TOP, dir, i);
+}
+
+static int
+write_file (const char *worktree, int i, int round, char *buf)
+{
+    char path[PATH_MAX], rel[128];
+    int fd, n, k;
+
+    file_path (i, rel, sizeof(rel));
+    snprintf (path, sizeof(path), "%s/%s", worktree, rel);
+
+    n = snprintf (buf, opts.file_size, "file %d round %d\n", i, round);
+    for (k = MIN (n, opts.file_size - 1); k < opts.file_size; ++k)
+        buf[k] = 'a' + next_rand () % 26;
+
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        char *dir = g_path_get_dirname (path);
+        g_mkdir_with_parents (dir, 0755);
+        g_free (dir);
+        fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        fprintf (stderr, "Failed to create %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (writen (fd, buf, opts.file_size) != opts.file_size) {
+        fprintf (stderr, "Failed to write %s: %s.\n", path, strerror(errno));
+        close (fd);
+        return -1;
+    }
+
+    close (fd);
+    return 0;
+}
+
+static int
+generate_worktree (const char *worktree)
+{
+    char *buf = g_malloc (opts.file_size);
+    int i, ret = 0;
+
+    for (i = 0; i < opts.n_files; ++i) {
+        if (write_file (worktree, i, 0, buf) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    g_free (buf);
+    return ret;
+}
+
+static int
+change_files (BenchRepo *br)
+{
+    char *buf = g_malloc (opts.file_size);
+    int i, ret = 0;
+
+    ++br->round;
+    for (i = 0; i < opts.n_changes; ++i) {
+        if (write_file (br->repo->worktree, next_rand () % opts.n_files,
+                        br->round, buf) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    g_free (buf);
+    return ret;
+}
+
+/* Operations */
+
+static gboolean
+ignore_nothing (const char *filename, void *data)
+{
+    return FALSE;
+}
+
+static int
+load_index (BenchRepo *br, struct index_state *istate)
+{
+    memset (istate, 0, sizeof(*istate));
+    if (read_index_from (istate, br->index_path) < 0) {
+        fprintf (stderr, "Failed to read index %s.\n", br->index_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+free_results (GList *results)
+{
+    GList *ptr;
+    int n = 0;
+
+    for (ptr = results; ptr; ptr = ptr->next, ++n)
+        diff_entry_free (ptr->data);
+    g_list_free (results);
+
+    return n;
+}
+
+/*
+ * An operation is given the index that it runs on, loaded beforehand
+ * and not timed, or NULL if it reads the index itself. It returns the
+ * number of results, or -1 on error.
+ */
+typedef int (*BenchOp) (BenchRepo *br, struct index_state *istate);
+
+static int
+op_read_index (BenchRepo *br, struct index_state *istate)
+{
+    struct index_state is;
+    int n;
+
+    if (load_index (br, &is) < 0)
+        return -1;
+    n = is.cache_nr;
+    discard_index (&is);
+
+    return n;
+}
+
+static int
+op_write_index (BenchRepo *br, struct index_state *istate)
+{
+    char path[PATH_MAX];
+    int fd, ret;
+
+    snprintf (path, sizeof(path), "%s.bench", br->index_path);
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        fprintf (stderr, "Failed to create %s.\n", path);
+        return -1;
+    }
+
+    ret = write_index (istate, fd);
+    close (fd);
+    g_unlink (path);
+
+    return ret < 0 ? -1 : istate->cache_nr;
+}
+
+static int
+op_status_worktree (BenchRepo *br, struct index_state *istate)
+{
+    GList *results = NULL;
+
+    wt_status_collect_changes_worktree (istate, &results, br->repo->worktree,
+                                        ignore_nothing);
+    return free_results (results);
+}
+
+static int
+op_status_untracked (BenchRepo *br, struct index_state *istate)
+{
+    GList *results = NULL;
+
+    wt_status_collect_untracked (istate, &results, br->repo->worktree,
+                                 ignore_nothing);
+    return free_results (results);
+}
+
+static int
+op_index_add (BenchRepo *br, struct index_state *istate)
+{
+    if (seaf_repo_index_add (br->repo, "") < 0) {
+        fprintf (stderr, "Failed to add worktree to index.\n");
+        return -1;
+    }
+    return br->repo->n_index_added;
+}
+
+static int
+op_commit (BenchRepo *br, struct index_state *istate)
+{
+    GError *error = NULL;
+    char *commit_id;
+
+    /* An empty description is generated from the changes, as it is for
+     * the commits of the sync manager. */
+    commit_id = seaf_repo_index_commit (br->repo, "", FALSE, NULL, &error);
+    if (!commit_id) {
+        /* Nothing to commit. */
+        if (!error)
+            return 0;
+        fprintf (stderr, "Failed to commit: %s.\n", error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    g_free (commit_id);
+    return 1;
+}
+
+/* Run @op once and print the result as @cache, or as "cold" if @cold
+ * and the caches could be evicted before. */
+static int
+run_op_once (BenchRepo *br, const char *name, BenchOp op,
+             gboolean needs_index, gboolean cold, const char *cache)
+{
+    struct index_state istate;
+    ProcStats a, b;
+    int entries = 0, n;
+
+    memset (&istate, 0, sizeof(istate));
+    if (needs_index) {
+        if (load_index (br, &istate) < 0)
+            return -1;
+        entries = istate.cache_nr;
+    }
+
+    /* Evicting only the index doesn't make the worktree scans cold. */
+    if (cold && evict_caches (op == op_read_index ? br->index_path : NULL))
+        cache = "cold";
+
+    reset_peak_rss ();
+    read_proc_stats (&a);
+    n = op (br, needs_index ? &istate : NULL);
+    read_proc_stats (&b);
+
+    if (needs_index)
+        discard_index (&istate);
+
+    if (n < 0) {
+        fprintf (stderr, "%s failed.\n", name);
+        return -1;
+    }
+
+    if (!needs_index)
+        entries = opts.n_files;
+    print_result (name, cache, entries, n, &a, &b);
+    return 0;
+}
+
+/* First run with cold caches, then the warm repeats. */
+static int
+run_op (BenchRepo *br, const char *name, BenchOp op, gboolean needs_index)
+{
+    int i;
+
+    if (run_op_once (br, name, op, needs_index, TRUE, "first") < 0)
+        return -1;
+    for (i = 0; i < opts.iterations; ++i)
+        if (run_op_once (br, name, op, needs_index, FALSE, "warm") < 0)
+            return -1;
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    BenchOp op;
+    gboolean needs_index;
+} clean_ops[] = {
+    { "read-index", op_read_index, FALSE },
+    { "write-index", op_write_index, TRUE },
+    { "status-worktree", op_status_worktree, TRUE },
+    { "status-untracked", op_status_untracked, TRUE },
+    { "index-add", op_index_add, FALSE },
+};
+
+/*
+ * Each round changes files and times the checks that find them and the
+ * commit of them, with the caches as they are after changing them.
+ */
+static int
+run_changed_rounds (BenchRepo *br)
+{
+    int i;
+
+    for (i = 0; i < MAX (opts.iterations, 1); ++i) {
+        if (change_files (br) < 0)
+            return -1;
+        if (run_op_once (br, "status-worktree-changed", op_status_worktree,
+                         TRUE, FALSE, "warm") < 0 ||
+            run_op_once (br, "index-add-changed", op_index_add,
+                         FALSE, FALSE, "warm") < 0 ||
+            run_op_once (br, "commit-changed", op_commit,
+                         FALSE, FALSE, "warm") < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Setup */
+
+static SeafRepo *
+create_repo (const char *worktree)
+{
+    SeafRepo *repo;
+    SeafBranch *branch;
+    SeafCommit *commit;
+
+    repo = seaf_repo_manager_create_new_repo (seaf->repo_mgr, "bench-index",
+                                              "Index benchmark");
+    if (!repo)
+        return NULL;
+    seaf_repo_manager_set_repo_worktree (seaf->repo_mgr, repo, worktree);
+
+    commit = seaf_commit_new (NULL, repo->id, EMPTY_SHA1,
+                              seaf->session->base.user_name,
+                              seaf->session->base.id,
+                              "Created", 0);
+    commit->repo_name = g_strdup (repo->name);
+    commit->repo_desc = g_strdup (repo->desc);
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+        seaf_commit_unref (commit);
+        return NULL;
+    }
+
+    branch = seaf_branch_new ("local", repo->id, commit->commit_id);
+    seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+    seaf_repo_set_head (repo, branch, commit);
+
+    seaf_commit_unref (commit);
+    seaf_branch_unref (branch);
+
+    return repo;
+}
+
+/* Only the managers that index and commit need. */
+static int
+create_session (const char *config_dir, const char *dir)
+{
+    CcnetClient *client;
+    char *seafile_dir, *worktree_dir;
+
+    client = ccnet_client_new ();
+    if (ccnet_client_load_confdir (client, config_dir) < 0) {
+        fprintf (stderr, "Failed to read config dir %s.\n", config_dir);
+        return -1;
+    }
+
+    seafile_dir = g_build_filename (dir, "seafile-data", NULL);
+    worktree_dir = g_build_filename (dir, "worktree", NULL);
+    seaf = seafile_session_new (seafile_dir, worktree_dir, client);
+    g_free (seafile_dir);
+    g_free (worktree_dir);
+    if (!seaf) {
+        fprintf (stderr, "Failed to create seafile session.\n");
+        return -1;
+    }
+
+    if (seaf_commit_manager_init (seaf->commit_mgr) < 0 ||
+        seaf_fs_manager_init (seaf->fs_mgr) < 0 ||
+        seaf_branch_manager_init (seaf->branch_mgr) < 0 ||
+        seaf_repo_manager_init (seaf->repo_mgr) < 0) {
+        fprintf (stderr, "Failed to init seafile session.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-bench-index [-c config_dir] [-d tmpdir] [-N files] "
+             "[-f files_per_dir]\n"
+             "    [-s file_size] [-m changed_files] [-n iterations] [-C] [-j]\n"
+             "  -C  drop the page cache before the first runs (root only);\n"
+             "      otherwise only the index is evicted\n"
+             "  -j  print results as JSON, one object per line\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    char *config_dir = DEFAULT_CONFIG_DIR;
+    const char *tmp_dir = g_get_tmp_dir ();
+    char *dir, *worktree;
+    BenchRepo br;
+    GTimer *timer;
+    int c, i, ret = 0;
+
+    while ((c = getopt (argc, argv, "hc:d:N:f:s:m:n:Cj")) != EOF) {
+        switch (c) {
+        case 'c':
+            config_dir = optarg;
+            break;
+        case 'd':
+            tmp_dir = optarg;
+            break;
+        case 'N':
+            opts.n_files = atoi (optarg);
+            break;
+        case 'f':
+            opts.files_per_dir = atoi (optarg);
+            break;
+        case 's':
+            opts.file_size = atoi (optarg);
+            break;
+        case 'm':
+            opts.n_changes = atoi (optarg);
+            break;
+        case 'n':
+            opts.iterations = atoi (optarg);
+            break;
+        case 'C':
+            opts.drop_caches = TRUE;
+            break;
+        case 'j':
+            opts.json = TRUE;
+            break;
+        default:
+            usage ();
+            exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    if (opts.n_files <= 0 || opts.files_per_dir <= 0 ||
+        opts.file_size <= 0 || opts.n_changes < 0 || opts.iterations < 0) {
+        usage ();
+        exit (1);
+    }
+
+    g_type_init ();
+#if !GLIB_CHECK_VERSION(2,32,0)
+    g_thread_init (NULL);
+#endif
+
+    config_dir = ccnet_expand_path (config_dir);
+
+    dir = g_strdup_printf ("%s/bench-index-XXXXXX", tmp_dir);
+    if (!mkdtemp (dir)) {
+        fprintf (stderr, "Failed to create temp dir in %s.\n", tmp_dir);
+        exit (1);
+    }
+
+    if (create_session (config_dir, dir) < 0)
+        exit (1);
+
+    worktree = g_build_filename (dir, "worktree", NULL);
+    if (checkdir_with_mkdir (worktree) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", worktree);
+        exit (1);
+    }
+
+    memset (&br, 0, sizeof(br));
+    br.repo = create_repo (worktree);
+    if (!br.repo) {
+        fprintf (stderr, "Failed to create repo.\n");
+        exit (1);
+    }
+    snprintf (br.index_path, sizeof(br.index_path), "%s/%s",
+              seaf->repo_mgr->index_dir, br.repo->id);
+
+    timer = g_timer_new ();
+    if (generate_worktree (worktree) < 0)
+        exit (1);
+    if (!opts.json)
+        printf ("generated %d files in %.3fs\n",
+                opts.n_files, g_timer_elapsed (timer, NULL));
+    g_timer_destroy (timer);
+
+    /* The initial add and commit of the whole worktree. */
+    if (run_op_once (&br, "index-add-initial", op_index_add,
+                     FALSE, TRUE, "first") < 0 ||
+        run_op_once (&br, "commit-initial", op_commit,
+                     FALSE, FALSE, "first") < 0) {
+        ret = 1;
+        goto out;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(clean_ops); ++i) {
+        if (run_op (&br, clean_ops[i].name, clean_ops[i].op,
+                    clean_ops[i].needs_index) < 0) {
+            ret = 1;
+            goto out;
+        }
+    }
+
+    if (opts.n_changes > 0 && run_changed_rounds (&br) < 0)
+        ret = 1;
+
+out:
+    if (!opts.json)
+        printf ("data left in %s\n", dir);
+    g_free (worktree);
+    g_free (dir);
+
+    return ret;
+}
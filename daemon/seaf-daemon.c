@@ -127,6 +127,14 @@ start_rpc_service (CcnetClient *client)
                                      seafile_get_repo_property,
                                      "seafile_get_repo_property",
                                      searpc_signature_string__string_string());
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_set_repo_sparse_paths,
+                                     "seafile_set_repo_sparse_paths",
+                                     searpc_signature_int__string_string());
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_hydrate_file,
+                                     "seafile_hydrate_file",
+                                     searpc_signature_int__string_string());
 
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_disable_auto_sync,
@@ -193,6 +201,21 @@ start_rpc_service (CcnetClient *client)
                                      "seafile_get_sync_task_list",
                                      searpc_signature_objlist__void());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_sync_traces,
+                                     "seafile_get_sync_traces",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_transfer_stats,
+                                     "seafile_get_transfer_stats",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_transfer_history,
+                                     "seafile_get_transfer_history",
+                                     searpc_signature_string__string());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_get_repo_sync_task,
                                      "seafile_get_repo_sync_task",
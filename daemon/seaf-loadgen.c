@@ -0,0 +1,727 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Load generator for sizing servers.
+ *
+ * Every line of the repos file, "<repo_id> <token>", is one simulated
+ * client. A client clones its repo from the server, commits a synthetic
+ * tree of the given shape on top of the server's head and uploads it,
+ * then keeps changing files and uploading new commits at the given
+ * rate. All clients run at the same time, through the transfer manager
+ * and the same processors as seaf-daemon (check-tx, sendcommit, sendfs,
+ * sendblock and sendbranch, and the get* ones for the clone).
+ *
+ * The time spent in each phase of each transfer is taken from the
+ * runtime state changes of the transfer task. At the end, the count,
+ * rate and latency percentiles of every phase are printed, as JSON
+ * objects with -j.
+ *
+ * The clients share one ccnet peer, so the server sees them as one
+ * peer with many concurrent transfers.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <ccnet.h>
+#include <ccnet/timer.h>
+
+#define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
+#include "log.h"
+
+#include "utils.h"
+#include "seafile-session.h"
+
+#define PULSE_INTERVAL 100      /* ms */
+
+SeafileSession *seaf;
+SearpcClient *ccnetrpc_client;
+
+enum {
+    CLIENT_FETCH = 0,
+    CLIENT_FETCHING,
+    CLIENT_IDLE,
+    CLIENT_UPLOADING,
+    CLIENT_DONE,
+    CLIENT_FAILED,
+};
+
+/*
+ * The tree of a client is a complete fanout-ary tree of dirs, numbered
+ * breadth first from the root, with n_files files in each dir. Only
+ * the dirs above changed files are written again.
+ */
+typedef struct Client {
+    char        repo_id[37];
+    char       *token;
+    int         state;
+    int         round;
+    gint64      next_time;      /* when to start the next upload */
+    gint64      round_bytes;    /* of the blocks written for the upload */
+
+    char      (*dir_ids)[41];
+    gboolean   *dirty;
+    guint32    *versions;       /* of each file */
+    char      (*file_ids)[41];  /* empty if the file is to be written */
+} Client;
+
+static struct {
+    const char *peer_id;
+    int depth;
+    int fanout;
+    int n_files;
+    int file_size;
+    int n_changes;              /* files changed per round */
+    int interval;               /* ms between the rounds of a client */
+    int rounds;
+    gboolean json;
+} opts = { NULL, 2, 8, 16, 4096, 10, 1000, 10, FALSE };
+
+static GPtrArray *clients;
+static GHashTable *client_by_repo;
+static int n_dirs, n_inner_dirs;
+static gint64 start_time;
+
+static int n_uploads, n_downloads, n_errors;
+static gint64 upload_bytes;
+
+/* Phase latencies in usec, by task type and runtime state. INIT is the
+ * wait for the task to start, FINISHED the whole transfer. */
+static GArray *samples[2][N_TASK_RT_STATE];
+
+static const char *phase_names[2][N_TASK_RT_STATE] = {
+    { "queue", "check-tx", "getcommit", "getfs", "getblock", NULL, "total" },
+    { "queue", "check-tx", "sendcommit", "sendfs", "sendblock",
+      "update-branch", "total" },
+};
+
+static guint32 rand_state = 1;
+
+static inline guint32
+next_rand ()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+/* Phase timing */
+
+static void
+record_phases (TransferTask *task)
+{
+    gint64 *t = task->rt_state_time;
+    int s, next;
+    gint64 usec;
+
+    for (s = TASK_RT_STATE_INIT; s < TASK_RT_STATE_FINISHED; ++s) {
+        if (t[s] == 0)
+            continue;
+        /* States are entered in order, some may be skipped. */
+        for (next = s + 1; next < TASK_RT_STATE_FINISHED; ++next)
+            if (t[next] != 0)
+                break;
+        usec = t[next] - t[s];
+        g_array_append_val (samples[task->type][s], usec);
+    }
+
+    usec = t[TASK_RT_STATE_FINISHED] - t[TASK_RT_STATE_INIT];
+    g_array_append_val (samples[task->type][TASK_RT_STATE_FINISHED], usec);
+}
+
+static int
+compare_usec (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Nearest rank. */
+static double
+percentile_ms (GArray *a, double p)
+{
+    int i = (int)(p * a->len + 0.999999) - 1;
+
+    i = CLAMP (i, 0, (int)a->len - 1);
+    return g_array_index (a, gint64, i) / 1000.0;
+}
+
+static void
+print_report ()
+{
+    double wall = (get_current_time () - start_time) / 1e6;
+    GArray *a;
+    gint64 sum;
+    int type, s;
+    guint i;
+
+    for (type = TASK_TYPE_DOWNLOAD; type <= TASK_TYPE_UPLOAD; ++type) {
+        for (s = 0; s < N_TASK_RT_STATE; ++s) {
+            a = samples[type][s];
+            if (!phase_names[type][s] || a->len == 0)
+                continue;
+
+            qsort (a->data, a->len, sizeof(gint64), compare_usec);
+            for (sum = 0, i = 0; i < a->len; ++i)
+                sum += g_array_index (a, gint64, i);
+
+            if (opts.json)
+                printf ("{\"direction\": \"%s\", \"phase\": \"%s\", "
+                        "\"count\": %u, \"per_sec\": %.2f, "
+                        "\"mean_ms\": %.2f, \"p50_ms\": %.2f, "
+                        "\"p90_ms\": %.2f, \"p99_ms\": %.2f, "
+                        "\"max_ms\": %.2f}\n",
+                        type == TASK_TYPE_UPLOAD ? "upload" : "download",
+                        phase_names[type][s], a->len, a->len / wall,
+                        sum / 1000.0 / a->len, percentile_ms (a, 0.5),
+                        percentile_ms (a, 0.9), percentile_ms (a, 0.99),
+                        percentile_ms (a, 1));
+            else
+                printf ("%-8s %-13s %6u, %8.2f/s: mean %9.2f, p50 %9.2f, "
+                        "p90 %9.2f, p99 %9.2f, max %9.2f ms\n",
+                        type == TASK_TYPE_UPLOAD ? "upload" : "download",
+                        phase_names[type][s], a->len, a->len / wall,
+                        sum / 1000.0 / a->len, percentile_ms (a, 0.5),
+                        percentile_ms (a, 0.9), percentile_ms (a, 0.99),
+                        percentile_ms (a, 1));
+        }
+    }
+
+    if (opts.json)
+        printf ("{\"clients\": %u, \"seconds\": %.2f, \"downloads\": %d, "
+                "\"uploads\": %d, \"errors\": %d, "
+                "\"upload_bytes\": %"G_GINT64_FORMAT", "
+                "\"upload_mb_per_sec\": %.2f}\n",
+                clients->len, wall, n_downloads, n_uploads, n_errors,
+                upload_bytes, upload_bytes / 1048576.0 / wall);
+    else
+        printf ("%u clients in %.2fs: %d downloads, %d uploads, %d errors, "
+                "%"G_GINT64_FORMAT" bytes uploaded, %.2f MB/s\n",
+                clients->len, wall, n_downloads, n_uploads, n_errors,
+                upload_bytes, upload_bytes / 1048576.0 / wall);
+}
+
+/* Synthetic trees */
+
+static int
+write_file (Client *client, int dir, int file, char *buf)
+{
+    SeafIndexStream *is;
+    unsigned char sha1[20];
+    int idx = dir * opts.n_files + file;
+    int i, n, ret = -1;
+
+    /* Unique for every version, so each version has new blocks. */
+    n = snprintf (buf, opts.file_size, "%s %d %d %u\n", client->repo_id,
+                  dir, file, client->versions[idx]);
+    n = MIN (n, opts.file_size);
+    rand_state = g_str_hash (buf) | 1;
+    for (i = n; i < opts.file_size; ++i)
+        buf[i] = next_rand () & 0xff;
+
+    is = seaf_fs_manager_index_stream_new (seaf->fs_mgr, NULL,
+                                           opts.file_size, NULL, 0);
+    if (!is)
+        return -1;
+
+    if (seaf_fs_manager_index_stream_feed (is, buf, opts.file_size) < 0 ||
+        seaf_fs_manager_index_stream_finish (is, sha1) < 0)
+        goto out;
+
+    rawdata_to_hex (sha1, client->file_ids[idx], 20);
+    client->round_bytes += opts.file_size;
+    ret = 0;
+
+out:
+    seaf_fs_manager_index_stream_free (is);
+    return ret;
+}
+
+static int
+write_dir (Client *client, int dir, char *buf)
+{
+    GList *entries = NULL;
+    SeafDir *seafdir;
+    char name[64];
+    int i, child, idx, ret;
+
+    if (!client->dirty[dir])
+        return 0;
+
+    /* Names are generated in ascending order and prepended, so the
+     * entries end up in descending order. */
+    for (i = 0; dir < n_inner_dirs && i < opts.fanout; ++i) {
+        child = dir * opts.fanout + 1 + i;
+        if (write_dir (client, child, buf) < 0)
+            goto error;
+        snprintf (name, sizeof(name), "d-%04d", i);
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (client->dir_ids[child],
+                                                   S_IFDIR, name));
+    }
+
+    for (i = 0; i < opts.n_files; ++i) {
+        idx = dir * opts.n_files + i;
+        if (client->file_ids[idx][0] == '\0' &&
+            write_file (client, dir, i, buf) < 0)
+            goto error;
+        snprintf (name, sizeof(name), "f-%06d", i);
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (client->file_ids[idx],
+                                                   S_IFREG | 0644, name));
+    }
+
+    seafdir = seaf_dir_new (NULL, entries, 0);
+    ret = seaf_dir_save (seaf->fs_mgr, seafdir);
+    memcpy (client->dir_ids[dir], seafdir->dir_id, 41);
+    seaf_dir_free (seafdir);
+    if (ret < 0)
+        return -1;
+
+    client->dirty[dir] = FALSE;
+    return 0;
+
+error:
+    g_list_foreach (entries, (GFunc)g_free, NULL);
+    g_list_free (entries);
+    return -1;
+}
+
+static void
+change_files (Client *client)
+{
+    int i, dir, file;
+
+    if (client->round == 0) {
+        for (i = 0; i < n_dirs; ++i)
+            client->dirty[i] = TRUE;
+        return;
+    }
+
+    rand_state = g_str_hash (client->repo_id) + client->round;
+    for (i = 0; i < opts.n_changes; ++i) {
+        dir = next_rand () % n_dirs;
+        file = next_rand () % opts.n_files;
+        ++client->versions[dir * opts.n_files + file];
+        client->file_ids[dir * opts.n_files + file][0] = '\0';
+        for (;; dir = (dir - 1) / opts.fanout) {
+            client->dirty[dir] = TRUE;
+            if (dir == 0)
+                break;
+        }
+    }
+}
+
+/* Write the changes of this round and commit them to the local branch. */
+static int
+commit_round (Client *client)
+{
+    SeafRepo *repo;
+    SeafBranch *branch;
+    SeafCommit *commit;
+    char *buf, *desc;
+    int ret = -1;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, client->repo_id);
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             client->repo_id, "local");
+    if (!repo || !branch) {
+        seaf_warning ("Repo %.8s has no local branch.\n", client->repo_id);
+        goto out;
+    }
+
+    client->round_bytes = 0;
+    change_files (client);
+
+    buf = g_malloc (opts.file_size);
+    ret = write_dir (client, 0, buf);
+    g_free (buf);
+    if (ret < 0)
+        goto out;
+
+    desc = g_strdup_printf ("Load test round %d", client->round);
+    commit = seaf_commit_new (NULL, client->repo_id, client->dir_ids[0],
+                              seaf->session->base.user_name,
+                              seaf->session->base.id, desc, 0);
+    g_free (desc);
+    commit->parent_id = g_strdup (branch->commit_id);
+    seaf_repo_to_commit (repo, commit);
+
+    ret = seaf_commit_manager_add_commit (seaf->commit_mgr, commit);
+    if (ret == 0) {
+        seaf_branch_set_commit (branch, commit->commit_id);
+        ret = seaf_branch_manager_update_branch (seaf->branch_mgr, branch);
+    }
+    seaf_commit_unref (commit);
+
+out:
+    if (branch)
+        seaf_branch_unref (branch);
+    return ret;
+}
+
+/* Clients */
+
+static Client *
+client_new (const char *repo_id, const char *token)
+{
+    Client *client = g_new0 (Client, 1);
+
+    memcpy (client->repo_id, repo_id, 36);
+    client->token = g_strdup (token);
+    client->dir_ids = g_new0 (char[41], n_dirs);
+    client->dirty = g_new0 (gboolean, n_dirs);
+    client->versions = g_new0 (guint32, n_dirs * opts.n_files);
+    client->file_ids = g_new0 (char[41], n_dirs * opts.n_files);
+
+    /* Left by an earlier run, continue from its local branch. */
+    if (seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id))
+        client->state = CLIENT_IDLE;
+
+    return client;
+}
+
+static int
+load_clients (const char *path, int max_clients)
+{
+    char *contents = NULL;
+    char **lines, **fields;
+    GError *error = NULL;
+    int i;
+
+    if (!g_file_get_contents (path, &contents, NULL, &error)) {
+        fprintf (stderr, "Failed to read %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    clients = g_ptr_array_new ();
+    client_by_repo = g_hash_table_new (g_str_hash, g_str_equal);
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i] && (max_clients <= 0 ||
+                             (int)clients->len < max_clients); ++i) {
+        g_strstrip (lines[i]);
+        if (lines[i][0] == '\0' || lines[i][0] == '#')
+            continue;
+
+        fields = g_strsplit_set (lines[i], " \t", 2);
+        if (g_strv_length (fields) != 2 || !is_uuid_valid (fields[0])) {
+            fprintf (stderr, "Bad line in %s: %s\n", path, lines[i]);
+            g_strfreev (fields);
+            continue;
+        }
+
+        if (!g_hash_table_lookup (client_by_repo, fields[0])) {
+            Client *client = client_new (fields[0], g_strstrip (fields[1]));
+            g_ptr_array_add (clients, client);
+            g_hash_table_insert (client_by_repo, client->repo_id, client);
+        }
+        g_strfreev (fields);
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+    return clients->len > 0 ? 0 : -1;
+}
+
+static void
+start_transfer (Client *client)
+{
+    GError *error = NULL;
+    char *tx_id;
+
+    if (client->state == CLIENT_FETCH)
+        tx_id = seaf_transfer_manager_add_download (seaf->transfer_mgr,
+                                                    client->repo_id,
+                                                    opts.peer_id,
+                                                    "fetch_head", "master",
+                                                    client->token, &error);
+    else
+        tx_id = seaf_transfer_manager_add_upload (seaf->transfer_mgr,
+                                                  client->repo_id,
+                                                  opts.peer_id,
+                                                  "local", "master",
+                                                  client->token, &error);
+    if (!tx_id) {
+        seaf_warning ("Failed to start transfer for repo %.8s: %s.\n",
+                      client->repo_id, error ? error->message : "");
+        g_clear_error (&error);
+        ++n_errors;
+        client->state = CLIENT_FAILED;
+        return;
+    }
+    g_free (tx_id);
+
+    client->state = (client->state == CLIENT_FETCH) ?
+        CLIENT_FETCHING : CLIENT_UPLOADING;
+}
+
+static int
+loadgen_pulse (void *data)
+{
+    gint64 now = get_current_time ();
+    Client *client;
+    int n_running = 0;
+    guint i;
+
+    for (i = 0; i < clients->len; ++i) {
+        client = g_ptr_array_index (clients, i);
+
+        if (client->state == CLIENT_IDLE && client->next_time <= now) {
+            if (client->round >= opts.rounds) {
+                client->state = CLIENT_DONE;
+            } else if (commit_round (client) < 0) {
+                ++n_errors;
+                client->state = CLIENT_FAILED;
+            } else {
+                start_transfer (client);
+            }
+        } else if (client->state == CLIENT_FETCH) {
+            start_transfer (client);
+        }
+
+        if (client->state != CLIENT_DONE && client->state != CLIENT_FAILED)
+            ++n_running;
+    }
+
+    if (n_running == 0) {
+        print_report ();
+        exit (n_errors ? 1 : 0);
+    }
+
+    return TRUE;
+}
+
+static void
+on_repo_fetched (SeafileSession *session, TransferTask *task, void *data)
+{
+    Client *client = g_hash_table_lookup (client_by_repo, task->repo_id);
+
+    if (!client || client->state != CLIENT_FETCHING)
+        return;
+
+    if (task->state != TASK_STATE_FINISHED) {
+        seaf_warning ("Failed to clone repo %.8s: %s.\n", task->repo_id,
+                      task_error_str (task->error));
+        ++n_errors;
+        client->state = CLIENT_FAILED;
+        return;
+    }
+
+    record_phases (task);
+    ++n_downloads;
+    client->state = CLIENT_IDLE;
+    client->next_time = get_current_time ();
+}
+
+static void
+on_repo_uploaded (SeafileSession *session, TransferTask *task, void *data)
+{
+    Client *client = g_hash_table_lookup (client_by_repo, task->repo_id);
+
+    if (!client || client->state != CLIENT_UPLOADING)
+        return;
+
+    if (task->state == TASK_STATE_FINISHED) {
+        record_phases (task);
+        ++n_uploads;
+        upload_bytes += client->round_bytes;
+    } else {
+        /* The next round uploads this round's commit too. */
+        seaf_warning ("Failed to upload repo %.8s: %s.\n", task->repo_id,
+                      task_error_str (task->error));
+        ++n_errors;
+    }
+
+    ++client->round;
+    client->state = CLIENT_IDLE;
+    client->next_time = get_current_time () + (gint64)opts.interval * 1000;
+}
+
+/* Setup */
+
+static void
+create_sync_rpc_client (const char *config_dir)
+{
+    CcnetClient *sync_client;
+
+    sync_client = ccnet_client_new ();
+    if ((ccnet_client_load_confdir (sync_client, config_dir)) < 0) {
+        fprintf (stderr, "Read config dir error\n");
+        exit (1);
+    }
+
+    if (ccnet_client_connect_daemon (sync_client, CCNET_CLIENT_SYNC) < 0) {
+        fprintf (stderr, "Connect to server fail: %s\n", strerror(errno));
+        exit (1);
+    }
+
+    ccnetrpc_client = ccnet_create_rpc_client (sync_client, NULL,
+                                               "ccnet-rpcserver");
+}
+
+/* Like seafile_session_prepare() and seafile_session_start(), without
+ * the clone and sync managers, which would act on the test repos. */
+static void
+start_session ()
+{
+    seaf_mq_manager_init (seaf->mq_mgr);
+    seaf_commit_manager_init (seaf->commit_mgr);
+    seaf_fs_manager_init (seaf->fs_mgr);
+    seaf_branch_manager_init (seaf->branch_mgr);
+    seaf_repo_manager_init (seaf->repo_mgr);
+
+    if (cevent_manager_start (seaf->ev_mgr) < 0) {
+        fprintf (stderr, "Failed to start event manager.\n");
+        exit (1);
+    }
+
+    if (seaf_transfer_manager_start (seaf->transfer_mgr) < 0) {
+        fprintf (stderr, "Failed to start transfer manager.\n");
+        exit (1);
+    }
+
+    g_signal_connect (seaf, "repo-fetched", (GCallback)on_repo_fetched, NULL);
+    g_signal_connect (seaf, "repo-uploaded", (GCallback)on_repo_uploaded, NULL);
+}
+
+static void
+usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-loadgen -p server_peer_id -r repos_file "
+             "[-c config_dir] [-d seafile_dir] [-n clients]\n"
+             "    [-D depth] [-F fanout] [-f files_per_dir] [-s file_size]\n"
+             "    [-m changes_per_round] [-i interval_ms] [-R rounds] [-j]\n"
+             "  repos_file has one \"<repo_id> <token>\" line per client\n"
+             "  -j  print results as JSON, one object per line\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    char *config_dir = DEFAULT_CONFIG_DIR;
+    char *seafile_dir = NULL, *worktree_dir, *logfile;
+    const char *repos_file = NULL;
+    CcnetClient *client;
+    int max_clients = 0;
+    int type, s, c;
+
+    while ((c = getopt (argc, argv, "hc:d:p:r:n:D:F:f:s:m:i:R:j")) != EOF) {
+        switch (c) {
+        case 'c':
+            config_dir = optarg;
+            break;
+        case 'd':
+            seafile_dir = g_strdup (optarg);
+            break;
+        case 'p':
+            opts.peer_id = optarg;
+            break;
+        case 'r':
+            repos_file = optarg;
+            break;
+        case 'n':
+            max_clients = atoi (optarg);
+            break;
+        case 'D':
+            opts.depth = atoi (optarg);
+            break;
+        case 'F':
+            opts.fanout = atoi (optarg);
+            break;
+        case 'f':
+            opts.n_files = atoi (optarg);
+            break;
+        case 's':
+            opts.file_size = atoi (optarg);
+            break;
+        case 'm':
+            opts.n_changes = atoi (optarg);
+            break;
+        case 'i':
+            opts.interval = atoi (optarg);
+            break;
+        case 'R':
+            opts.rounds = atoi (optarg);
+            break;
+        case 'j':
+            opts.json = TRUE;
+            break;
+        default:
+            usage ();
+            exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    if (!opts.peer_id || !repos_file || opts.depth < 0 ||
+        opts.fanout <= 0 || opts.n_files <= 0 || opts.file_size <= 0 ||
+        opts.n_changes < 0 || opts.interval < 0 || opts.rounds <= 0) {
+        usage ();
+        exit (1);
+    }
+
+#ifndef WIN32
+    signal (SIGPIPE, SIG_IGN);
+#endif
+
+    g_type_init ();
+#if !GLIB_CHECK_VERSION(2,32,0)
+    g_thread_init (NULL);
+#endif
+
+    for (n_dirs = 1, n_inner_dirs = 0, s = 0; s < opts.depth; ++s) {
+        n_inner_dirs = n_dirs;
+        n_dirs = n_dirs * opts.fanout + 1;
+    }
+
+    for (type = 0; type < 2; ++type)
+        for (s = 0; s < N_TASK_RT_STATE; ++s)
+            samples[type][s] = g_array_new (FALSE, FALSE, sizeof(gint64));
+
+    client = ccnet_init (config_dir);
+    if (!client)
+        exit (1);
+    create_sync_rpc_client (config_dir);
+
+    if (seafile_dir == NULL)
+        seafile_dir = g_build_filename (config_dir, "loadgen-data", NULL);
+    worktree_dir = g_build_filename (seafile_dir, "worktree", NULL);
+    logfile = g_build_filename (config_dir, "logs", "seaf-loadgen.log", NULL);
+
+    seaf = seafile_session_new (seafile_dir, worktree_dir, client);
+    if (!seaf) {
+        fprintf (stderr, "Failed to create seafile session.\n");
+        exit (1);
+    }
+    seaf->ccnetrpc_client = ccnetrpc_client;
+
+    if (seafile_log_init (logfile, "info", "info") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        exit (1);
+    }
+
+    g_free (seafile_dir);
+    g_free (worktree_dir);
+    g_free (logfile);
+
+    start_session ();
+
+    if (load_clients (repos_file, max_clients) < 0) {
+        fprintf (stderr, "No clients in %s.\n", repos_file);
+        exit (1);
+    }
+
+    start_time = get_current_time ();
+    ccnet_timer_new (loadgen_pulse, NULL, PULSE_INTERVAL);
+
+    ccnet_main (client);
+
+    return 0;
+}
@@ -82,6 +82,7 @@ seafile_session_new(const char *seafile_dir,
     char *tmp_file_dir;
     char *db_path;
     sqlite3 *config_db;
+    char *value;
     SeafileSession *session = NULL;
 
 #ifndef SEAF_TOOL
@@ -125,6 +126,16 @@ seafile_session_new(const char *seafile_dir,
     session->session = ccnet_session;
     session->config_db = config_db;
 
+    value = seafile_session_config_get_string (session, KEY_LOW_MEMORY);
+    session->low_memory = (g_strcmp0 (value, "true") == 0);
+    g_free (value);
+    if (session->low_memory)
+        g_message ("Running in low memory mode.\n");
+
+    value = seafile_session_config_get_string (session, KEY_HYDRATE_HOOK);
+    session->hydrate_hook = (g_strcmp0 (value, "true") == 0);
+    g_free (value);
+
     session->fs_mgr = seaf_fs_manager_new (session, abs_seafile_dir);
     if (!session->fs_mgr)
         goto onerror;
@@ -163,6 +174,8 @@ seafile_session_new(const char *seafile_dir,
     session->mq_mgr = seaf_mq_manager_new (session);
     if (!session->mq_mgr)
         goto onerror;
+
+    session->lan_block_mgr = seaf_lan_block_manager_new (session);
 #endif    
 
     return session;
@@ -201,6 +214,13 @@ seafile_session_prepare (SeafileSession *session)
 }
 
 
+static int
+flush_db_pulse (void *vsession)
+{
+    sqlite_flush_write_batches ();
+    return TRUE;
+}
+
 void
 seafile_session_start (SeafileSession *session)
 {
@@ -240,6 +260,13 @@ seafile_session_start (SeafileSession *session)
         return;
     }
 
+    if (seaf_lan_block_manager_start (session->lan_block_mgr) < 0) {
+        g_error ("Failed to start LAN block manager.\n");
+        return;
+    }
+
+    ccnet_timer_new (flush_db_pulse, session, DB_WRITE_BATCH_INTERVAL);
+
     /* Clean up unused blocks on restart.
      * This would set a flag to tell other threads and download tasks
      * to wait until GC completes.
@@ -247,6 +274,7 @@ seafile_session_start (SeafileSession *session)
     if (gc_start () < 0) {
         g_warning ("Failed to start gc.\n");
     }
+    gc_start_timer ();
 }
 
 #if 0
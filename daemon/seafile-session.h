@@ -22,8 +22,12 @@
 #include "sync-mgr.h"
 #include "wt-monitor.h"
 #include "mq-mgr.h"
+#include "lan-block-mgr.h"
 #include <searpc-client.h>
 
+/* Metadata writes to the local databases are committed in batches. */
+#define DB_WRITE_BATCH_INTERVAL 1000 /* msec */
+
 struct _CcnetClient;
 
 
@@ -51,6 +55,13 @@ struct _SeafileSession {
     char                *worktree_dir; /* the default directory for
                                         * storing worktrees  */
     sqlite3             *config_db;
+    /* Use less memory at some cost in speed, for machines that have
+     * little. Set with "low_memory" = "true" in the config db, read at
+     * start-up. */
+    gboolean             low_memory;
+    /* Set by the OS integration that hydrates placeholders when they're
+     * opened. The "placeholders" repo property is ignored without it. */
+    gboolean             hydrate_hook;
 
     SeafBlockManager    *block_mgr;
     SeafFSManager       *fs_mgr;
@@ -62,6 +73,7 @@ struct _SeafileSession {
     SeafSyncManager     *sync_mgr;
     SeafWTMonitor       *wt_monitor;
     SeafMqManager       *mq_mgr;
+    SeafLanBlockManager *lan_block_mgr;
 
     CEventManager       *ev_mgr;
     CcnetJobManager     *job_mgr;
@@ -4,6 +4,7 @@
 
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <pthread.h>
 
 #include "seafile-session.h"
 #include "status.h"
@@ -49,7 +50,7 @@ static struct dir_entry *
 dir_add_name(struct dir_struct *dir, const char *pathname, 
              int len, struct index_state *index)
 {
-    if (index_name_exists(index, pathname, len, 0))
+    if (index_name_exists(index, pathname, len, IGNORE_CASE))
         return NULL;
 
     ALLOC_GROW(dir->entries, dir->nr+1, dir->alloc);
@@ -82,20 +83,336 @@ get_dtype(const char *dname, const char *path)
     return dtype;
 }
 
+/*
+ * Untracked cache, kept in the "UNTR" index extension.
+ *
+ * For every directory it records the directory's stat data, a hash of
+ * the names tracked directly in it, its untracked files and its subdirs.
+ * If neither the stat data nor the tracked names changed, the directory
+ * is not read again. Timestamps only have seconds, so a directory
+ * modified in the second of the scan is not cached.
+ */
+#define CACHE_EXT_UNTRACKED 0x554E5452    /* "UNTR" */
+#define UNTRACKED_CACHE_VERSION 1
+
+typedef struct UntrackedDir {
+    guint32 mtime;
+    guint32 ctime;
+    guint32 ino;
+    guint64 tracked_hash;
+    GPtrArray *files;
+    GPtrArray *subdirs;
+} UntrackedDir;
+
+typedef struct UntrackedCache {
+    GHashTable *old_dirs;       /* read from the index */
+    GHashTable *new_dirs;       /* found by this scan */
+    GHashTable *tracked;        /* dir -> guint64 hash of tracked names */
+    time_t scan_time;
+    gboolean changed;
+} UntrackedCache;
+
+static UntrackedDir *
+untracked_dir_new ()
+{
+    UntrackedDir *ud = g_new0 (UntrackedDir, 1);
+
+    ud->files = g_ptr_array_new_with_free_func (g_free);
+    ud->subdirs = g_ptr_array_new_with_free_func (g_free);
+    return ud;
+}
+
+static void
+untracked_dir_free (UntrackedDir *ud)
+{
+    g_ptr_array_free (ud->files, TRUE);
+    g_ptr_array_free (ud->subdirs, TRUE);
+    g_free (ud);
+}
+
+static guint64
+name_hash64 (const char *name, int len)
+{
+    guint64 h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    /* Mix the bits, the hashes of a dir's names are added up. */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void
+compute_tracked_hashes (UntrackedCache *uc, struct index_state *index)
+{
+    int i;
+
+    for (i = 0; i < index->cache_nr; i++) {
+        struct cache_entry *ce = index->cache[i];
+        const char *slash;
+        char *dir;
+        int dirlen, len = ce_namelen (ce);
+        guint64 *hash;
+
+        if (ce->ce_flags & CE_REMOVE)
+            continue;
+
+        slash = strrchr (ce->name, '/');
+        dirlen = slash ? slash - ce->name + 1 : 0;
+        dir = g_strndup (ce->name, dirlen);
+        hash = g_hash_table_lookup (uc->tracked, dir);
+        if (!hash) {
+            hash = g_new0 (guint64, 1);
+            g_hash_table_insert (uc->tracked, dir, hash);
+        } else
+            g_free (dir);
+        *hash += name_hash64 (ce->name + dirlen, len - dirlen) + ce_stage (ce);
+    }
+}
+
+static guint64
+get_tracked_hash (UntrackedCache *uc, const char *base)
+{
+    guint64 *hash = g_hash_table_lookup (uc->tracked, base);
+
+    return hash ? *hash : 0;
+}
+
+static gboolean
+read_u32 (const guint8 **p, const guint8 *end, guint32 *val)
+{
+    if (end - *p < 4)
+        return FALSE;
+    memcpy (val, *p, 4);
+    *val = g_ntohl (*val);
+    *p += 4;
+    return TRUE;
+}
+
+static gboolean
+read_name (const guint8 **p, const guint8 *end, char **name)
+{
+    const guint8 *nul = memchr (*p, 0, end - *p);
+
+    if (!nul)
+        return FALSE;
+    *name = g_strdup ((const char *)*p);
+    *p = nul + 1;
+    return TRUE;
+}
+
+static gboolean
+read_names (const guint8 **p, const guint8 *end, guint32 n, GPtrArray *names)
+{
+    char *name;
+    guint32 i;
+
+    for (i = 0; i < n; i++) {
+        if (!read_name (p, end, &name))
+            return FALSE;
+        g_ptr_array_add (names, name);
+    }
+    return TRUE;
+}
+
+static void
+load_untracked_cache (UntrackedCache *uc, struct index_state *index)
+{
+    const guint8 *p, *end;
+    size_t len;
+    guint32 version, n_dirs, i, hash_hi, hash_lo, n_files, n_subdirs;
+    char *base;
+    UntrackedDir *ud;
+
+    p = index_get_extension (index, CACHE_EXT_UNTRACKED, &len);
+    if (!p)
+        return;
+    end = p + len;
+
+    if (!read_u32 (&p, end, &version) || version != UNTRACKED_CACHE_VERSION ||
+        !read_u32 (&p, end, &n_dirs))
+        goto bad;
+
+    for (i = 0; i < n_dirs; i++) {
+        if (!read_name (&p, end, &base))
+            goto bad;
+        ud = untracked_dir_new ();
+        g_hash_table_replace (uc->old_dirs, base, ud);
+        if (!read_u32 (&p, end, &ud->mtime) ||
+            !read_u32 (&p, end, &ud->ctime) ||
+            !read_u32 (&p, end, &ud->ino) ||
+            !read_u32 (&p, end, &hash_hi) ||
+            !read_u32 (&p, end, &hash_lo) ||
+            !read_u32 (&p, end, &n_files) ||
+            !read_u32 (&p, end, &n_subdirs) ||
+            !read_names (&p, end, n_files, ud->files) ||
+            !read_names (&p, end, n_subdirs, ud->subdirs))
+            goto bad;
+        ud->tracked_hash = ((guint64)hash_hi << 32) | hash_lo;
+    }
+    return;
+
+bad:
+    g_warning ("Bad untracked cache in index, ignored.\n");
+    g_hash_table_remove_all (uc->old_dirs);
+    uc->changed = TRUE;
+}
+
+static void
+append_u32 (GByteArray *buf, guint32 val)
+{
+    val = g_htonl (val);
+    g_byte_array_append (buf, (guint8 *)&val, 4);
+}
+
+static void
+append_name (GByteArray *buf, const char *name)
+{
+    g_byte_array_append (buf, (guint8 *)name, strlen(name) + 1);
+}
+
+static void
+save_untracked_cache (UntrackedCache *uc, struct index_state *index)
+{
+    GByteArray *buf = g_byte_array_new ();
+    GHashTableIter iter;
+    gpointer key, value;
+    void *data;
+    guint i;
+
+    append_u32 (buf, UNTRACKED_CACHE_VERSION);
+    append_u32 (buf, g_hash_table_size (uc->new_dirs));
+
+    g_hash_table_iter_init (&iter, uc->new_dirs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        UntrackedDir *ud = value;
+
+        append_name (buf, key);
+        append_u32 (buf, ud->mtime);
+        append_u32 (buf, ud->ctime);
+        append_u32 (buf, ud->ino);
+        append_u32 (buf, (guint32)(ud->tracked_hash >> 32));
+        append_u32 (buf, (guint32)ud->tracked_hash);
+        append_u32 (buf, ud->files->len);
+        append_u32 (buf, ud->subdirs->len);
+        for (i = 0; i < ud->files->len; i++)
+            append_name (buf, g_ptr_array_index (ud->files, i));
+        for (i = 0; i < ud->subdirs->len; i++)
+            append_name (buf, g_ptr_array_index (ud->subdirs, i));
+    }
+
+    /* The index frees extension data with free(). */
+    data = malloc (buf->len);
+    memcpy (data, buf->data, buf->len);
+    index_set_extension (index, CACHE_EXT_UNTRACKED, data, buf->len);
+    g_byte_array_free (buf, TRUE);
+}
+
 static int 
 read_directory_recursive(struct dir_struct *dir,
                          const char *base, int baselen,
                          int check_only,
                          struct index_state *index,
                          const char *worktree,
-                         IgnoreFunc ignore_func)
+                         IgnoreFunc ignore_func,
+                         UntrackedCache *uc);
+
+/* Use the cached listing of @base if it's still valid. */
+static gboolean
+read_directory_cached (struct dir_struct *dir,
+                       const char *base, int baselen,
+                       struct stat *st,
+                       struct index_state *index,
+                       const char *worktree,
+                       IgnoreFunc ignore_func,
+                       UntrackedCache *uc)
+{
+    UntrackedDir *ud;
+    gpointer key;
+    char path[PATH_MAX + 1];
+    const char *name;
+    int len;
+    guint i;
+
+    if (!g_hash_table_lookup_extended (uc->old_dirs, base, &key, (gpointer *)&ud))
+        return FALSE;
+
+    if (ud->mtime != (guint32)st->st_mtime ||
+        ud->ctime != (guint32)st->st_ctime ||
+        ud->ino != (guint32)st->st_ino ||
+        ud->tracked_hash != get_tracked_hash (uc, base))
+        return FALSE;
+
+    g_hash_table_steal (uc->old_dirs, base);
+    g_hash_table_insert (uc->new_dirs, key, ud);
+
+    memcpy(path, base, baselen);
+    for (i = 0; i < ud->files->len; i++) {
+        name = g_ptr_array_index (ud->files, i);
+        len = strlen(name);
+        if (baselen + len > PATH_MAX)
+            continue;
+        memcpy(path + baselen, name, len + 1);
+        dir_add_name(dir, path, baselen + len, index);
+    }
+    for (i = 0; i < ud->subdirs->len; i++) {
+        name = g_ptr_array_index (ud->subdirs, i);
+        len = strlen(name);
+        if (baselen + len + 1 > PATH_MAX)
+            continue;
+        memcpy(path + baselen, name, len);
+        memcpy(path + baselen + len, "/", 2);
+        read_directory_recursive(dir, path, baselen + len + 1, 0,
+                                 index, worktree, ignore_func, uc);
+    }
+    return TRUE;
+}
+
+static int 
+read_directory_recursive(struct dir_struct *dir,
+                         const char *base, int baselen,
+                         int check_only,
+                         struct index_state *index,
+                         const char *worktree,
+                         IgnoreFunc ignore_func,
+                         UntrackedCache *uc)
 {
     char *realpath = g_build_path (PATH_SEPERATOR, worktree, base, NULL);
-    GDir *fdir = g_dir_open (realpath, 0, NULL);
+    GDir *fdir;
     const char *dname;
     int contents = 0;
     int dtype;
+    struct stat st;
+    UntrackedDir *ud = NULL;
+
+    /* The worktree itself may be a symlink. */
+    if (g_stat (realpath, &st) < 0) {
+        g_free (realpath);
+        return contents;
+    }
+
+    if (read_directory_cached (dir, base, baselen, &st,
+                               index, worktree, ignore_func, uc)) {
+        g_free (realpath);
+        return contents;
+    }
 
+    uc->changed = TRUE;
+    if (st.st_mtime < uc->scan_time && st.st_ctime < uc->scan_time) {
+        ud = untracked_dir_new ();
+        ud->mtime = st.st_mtime;
+        ud->ctime = st.st_ctime;
+        ud->ino = st.st_ino;
+        ud->tracked_hash = get_tracked_hash (uc, base);
+        g_hash_table_replace (uc->new_dirs, g_strdup(base), ud);
+    }
+
+    fdir = g_dir_open (realpath, 0, NULL);
     if (fdir) {
         char path[PATH_MAX + 1];
         memcpy(path, base, baselen);
@@ -120,17 +437,21 @@ read_directory_recursive(struct dir_struct *dir,
                 memcpy(path + baselen, dname, len + 1);
                 memcpy(path + baselen + len, "/", 2);
                 len = strlen(path);
+                if (ud)
+                    g_ptr_array_add (ud->subdirs, g_strdup(dname));
                 read_directory_recursive(dir, path, len, 0,
-                                         index, worktree, ignore_func);
+                                         index, worktree, ignore_func, uc);
                 continue;
             default: /* DT_UNKNOWN */
                 len = 0;
                 break;
             }
-            if(len > 0)
-                dir_add_name(dir, path, len, index);
+            if(len > 0 && dir_add_name(dir, path, len, index) && ud)
+                g_ptr_array_add (ud->files, g_strdup(dname));
         }
         g_dir_close(fdir);
+    } else if (ud) {
+        g_hash_table_remove (uc->new_dirs, base);
     }
 
     g_free(realpath);
@@ -153,7 +474,29 @@ read_directory(struct dir_struct *dir,
                struct index_state *index,
                IgnoreFunc ignore_func)
 {
-    read_directory_recursive(dir, "", 0, 0, index, worktree, ignore_func);
+    UntrackedCache uc;
+
+    memset (&uc, 0, sizeof(uc));
+    uc.old_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)untracked_dir_free);
+    uc.new_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)untracked_dir_free);
+    uc.tracked = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    uc.scan_time = time(NULL);
+
+    load_untracked_cache (&uc, index);
+    compute_tracked_hashes (&uc, index);
+
+    read_directory_recursive(dir, "", 0, 0, index, worktree, ignore_func, &uc);
+
+    /* Directories not seen any more are dropped. */
+    if (uc.changed || g_hash_table_size (uc.old_dirs) > 0)
+        save_untracked_cache (&uc, index);
+
+    g_hash_table_destroy (uc.old_dirs);
+    g_hash_table_destroy (uc.new_dirs);
+    g_hash_table_destroy (uc.tracked);
+
     qsort(dir->entries, dir->nr, sizeof(struct dir_entry *), cmp_name);
     return dir->nr;
 }
@@ -206,6 +549,94 @@ is_empty_dir (const char *path, IgnoreFunc should_ignore)
     return (n == 0);
 }
 
+/*
+ * Like git's preload-index: stat is slow on network or Windows worktrees
+ * but parallelizes well, so each thread checks a range of the index.
+ * The threads only record which entries are clean; they are marked up to
+ * date afterwards, in index order.
+ */
+#define MAX_REFRESH_THREADS 16
+#define ENTRIES_PER_REFRESH_THREAD 500
+
+typedef struct RefreshRange {
+    struct index_state *index;
+    const char *worktree;
+    int start;
+    int end;
+    unsigned char *clean;
+} RefreshRange;
+
+static void *
+refresh_range (void *vdata)
+{
+    RefreshRange *range = vdata;
+    struct index_state *index = range->index;
+    char *realpath;
+    struct stat st;
+    int i;
+
+    for (i = range->start; i < range->end; i++) {
+        struct cache_entry *ce = index->cache[i];
+
+        if (ce_stage(ce) || ce_uptodate(ce) || ce_skip_worktree(ce) ||
+            S_ISDIR(ce->ce_mode) || (ce->ce_flags & CE_REMOVE))
+            continue;
+
+        realpath = g_build_path (PATH_SEPERATOR, range->worktree, ce->name, NULL);
+        if (g_lstat (realpath, &st) == 0 && S_ISREG(st.st_mode) &&
+            !ie_match_stat (index, ce, &st, 0))
+            range->clean[i] = 1;
+        g_free (realpath);
+    }
+
+    return NULL;
+}
+
+void
+wt_status_refresh_index (struct index_state *index, const char *worktree)
+{
+    RefreshRange ranges[MAX_REFRESH_THREADS];
+    pthread_t threads[MAX_REFRESH_THREADS];
+    unsigned char *clean;
+    int n_threads, per_thread, i, n = 0;
+
+    n_threads = index->cache_nr / ENTRIES_PER_REFRESH_THREAD;
+    if (n_threads > MAX_REFRESH_THREADS)
+        n_threads = MAX_REFRESH_THREADS;
+    /* Not worth it, the callers stat the entries anyway. */
+    if (n_threads < 2)
+        return;
+
+    clean = g_new0 (unsigned char, index->cache_nr);
+    per_thread = (index->cache_nr + n_threads - 1) / n_threads;
+
+    for (i = 0; i < n_threads; i++) {
+        RefreshRange *range = &ranges[i];
+
+        range->index = index;
+        range->worktree = worktree;
+        range->start = i * per_thread;
+        range->end = MIN (range->start + per_thread, index->cache_nr);
+        range->clean = clean;
+        if (pthread_create (&threads[i], NULL, refresh_range, range) != 0) {
+            g_warning ("Failed to start index refresh thread.\n");
+            break;
+        }
+        ++n;
+    }
+
+    for (i = 0; i < n; i++)
+        pthread_join (threads[i], NULL);
+
+    /* Ranges whose thread failed to start are simply not refreshed. */
+    for (i = 0; i < n * per_thread && i < index->cache_nr; i++) {
+        if (clean[i])
+            ce_mark_uptodate (index->cache[i]);
+    }
+
+    g_free (clean);
+}
+
 void wt_status_collect_changes_worktree(struct index_state *index,
                                         GList **results,
                                         const char *worktree,
@@ -214,6 +645,8 @@ void wt_status_collect_changes_worktree(struct index_state *index,
     DiffEntry *de;
     int entries, i;
 
+    wt_status_refresh_index (index, worktree);
+
     entries = index->cache_nr;
     for (i = 0; i < entries; i++) {
         char *realpath;
@@ -9,6 +9,13 @@
 
 typedef gboolean (*IgnoreFunc) (const char *filename, void *data);
 
+/*
+ * Stat the index entries with a pool of threads and mark the unchanged
+ * ones up to date, so that later worktree scans can skip them.
+ */
+void
+wt_status_refresh_index (struct index_state *index, const char *worktree);
+
 void 
 wt_status_collect_changes_worktree(struct index_state *index,
                                    GList **results,
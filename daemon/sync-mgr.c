@@ -13,6 +13,7 @@
 #include "processors/sync-repo-proc.h"
 #include "processors/notifysync-proc.h"
 #include "processors/getrepoemailtoken-proc.h"
+#include "processors/watch-repos-proc.h"
 #include "vc-common.h"
 #include "seafile-error.h"
 #include "status.h"
@@ -29,20 +30,90 @@
 #define DEFAULT_SYNC_INTERVAL 30 /* 30s */
 #define CHECK_SYNC_INTERVAL  1000 /* 1s */
 #define MAX_RUNNING_SYNC_TASKS 5
+/* Large tasks can't take all the slots, so small repos are not blocked
+ * behind a big upload.
+ */
+#define MAX_SYNC_TRACES 32
+
+#define MAX_RUNNING_LARGE_TASKS 2
+#define LARGE_TASK_SIZE (100 << 20) /* 100MB */
+
+/* Auto sync tasks that are due are ordered by their waiting time in
+ * seconds, plus these bonuses.
+ */
+#define SYNC_PRIORITY_WEIGHT 60     /* per level of repo sync priority */
+#define LARGE_TASK_PENALTY   120
+
+/* Preempted tasks resume after this time even if tasks are waiting. */
+#define MAX_PREEMPT_TIME 300
 
 #define DEFAULT_WORKTREE_INTERVAL 600 /* 10 minutes */
 
 #define CHECK_COMMIT_INTERVAL   1000 /* 1s */
 
+#define COMMIT_DEBOUNCE     2   /* commit after 2s without changes, */
+#define COMMIT_MAX_DELAY    30  /* but don't postpone it longer than 30s. */
+#define SYNC_RETRY_DELAY    5   /* relay not connected */
+
+/* Repos watched on the relay are only polled now and then, in case a
+ * notification is lost. The watched sets are updated every
+ * UPDATE_WATCH_INTERVAL pulses. Relays that don't notify are asked again
+ * after WATCH_RETRY_INTERVAL.
+ */
+#define WATCHED_SYNC_INTERVAL   300 /* 5 minutes */
+#define UPDATE_WATCH_INTERVAL   30
+#define WATCH_RETRY_INTERVAL    600
+
+/* Auto sync jobs, ordered by priority when due at the same time. */
+enum {
+    SCHED_COMMIT,
+    SCHED_SYNC,
+};
+
+/*
+ * Every auto-synced repo has a commit and a sync schedule, queued in
+ * priv->sched_queue by due time. Only the schedules that are due are run,
+ * instead of sorting and checking every repo on each pulse.
+ */
+typedef struct SyncSchedule {
+    char            repo_id[41];
+    int             kind;
+    gint64          due;
+    GSequenceIter  *iter;       /* NULL if not queued */
+
+    /* SCHED_COMMIT */
+    gint            last_changed;   /* last worktree change seen */
+    gint64          first_change;   /* first change not committed yet */
+
+    /* SCHED_SYNC */
+    gboolean        notified;   /* sync requested while the repo was syncing */
+} SyncSchedule;
+
 struct _SeafSyncManagerPriv {
     struct CcnetTimer *check_sync_timer;
     int    pulse_count;
 
+    GSequence  *sched_queue;
+    GHashTable *commit_scheds;  /* repo_id -> SyncSchedule */
+    GHashTable *sync_scheds;    /* repo_id -> SyncSchedule */
+
+    int         n_running_large;
+    int         n_waiting;      /* due sync tasks that have no slot */
+    GList      *preempted_tasks;
+
     /* When FALSE, auto sync is globally disabled */
     gboolean   auto_sync_enabled;
 
     struct CcnetTimer *check_commit_timer;
     GHashTable *get_email_token_hash; /* repo_id -> failed */
+
+    GHashTable *watch_procs;    /* relay_id -> SeafileWatchReposProc */
+    GHashTable *watch_retry;    /* relay_id -> time to try again */
+
+    /* Ring of the traces of the last finished tasks. */
+    SyncTrace   traces[MAX_SYNC_TRACES];
+    int         trace_head;     /* next slot to write */
+    int         n_traces;
 };
 
 static int
@@ -53,6 +124,10 @@ static int
 perform_sync_task (SeafSyncManager *manager, SyncTask *task);
 static int check_sync_pulse (void *vmanager);
 static int auto_commit_pulse (void *vmanager);
+static void notify_sync_later (SeafSyncManager *mgr, const char *repo_id);
+static void enqueue_sync_task (SeafSyncManager *manager, SeafRepo *repo,
+                               gboolean quiet);
+static void unpreempt_task (SyncTask *task);
 static void on_repo_fetched (SeafileSession *seaf,
                              TransferTask *tx_task,
                              SeafSyncManager *manager);
@@ -79,6 +154,11 @@ seaf_sync_manager_new (SeafileSession *seaf)
 
     mgr->wt_interval = DEFAULT_WORKTREE_INTERVAL;
 
+    mgr->priv->watch_procs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+    mgr->priv->watch_retry = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+
     return mgr;
 }
 
@@ -107,6 +187,12 @@ seaf_sync_manager_init (SeafSyncManager *mgr)
     mgr->priv->get_email_token_hash = g_hash_table_new_full (
         g_str_hash, g_str_equal, NULL, NULL);
 
+    mgr->priv->sched_queue = g_sequence_new (NULL);
+    mgr->priv->commit_scheds = g_hash_table_new_full (
+        g_str_hash, g_str_equal, NULL, g_free);
+    mgr->priv->sync_scheds = g_hash_table_new_full (
+        g_str_hash, g_str_equal, NULL, g_free);
+
     return 0;
 }
 
@@ -198,6 +284,9 @@ seaf_sync_manager_start (SeafSyncManager *mgr)
     ccnet_proc_factory_register_processor (mgr->seaf->session->proc_factory,
                                            "seafile-get-repo-email-token",
                                            SEAFILE_TYPE_GETREPOEMAILTOKEN_PROC);
+    ccnet_proc_factory_register_processor (mgr->seaf->session->proc_factory,
+                                           "seafile-watch-repos",
+                                           SEAFILE_TYPE_WATCH_REPOS_PROC);
     g_signal_connect (seaf, "repo-fetched",
                       (GCallback)on_repo_fetched, mgr);
     g_signal_connect (seaf, "repo-uploaded",
@@ -254,8 +343,11 @@ seaf_sync_manager_add_sync_task (SeafSyncManager *mgr,
         return -1;
     }
 
-    if (info->in_sync)
+    if (info->in_sync) {
+        /* Don't lose the request, sync again after the current task. */
+        notify_sync_later (mgr, repo_id);
         return 0;
+    }
 
     /* Run the sync task immediately, without adding to the queue. */
     SyncTask *task = g_new0 (SyncTask, 1);
@@ -311,6 +403,13 @@ seaf_sync_manager_cancel_sync_task (SeafSyncManager *mgr,
     g_assert (info->current_task != NULL);
     task = info->current_task;
 
+    /* No callback will come for a preempted task. */
+    if (task->preempted) {
+        unpreempt_task (task);
+        transition_sync_state (task, SYNC_STATE_CANCELED);
+        return;
+    }
+
     switch (task->state) {
     case SYNC_STATE_FETCH:
         seaf_transfer_manager_cancel_task (seaf->transfer_mgr,
@@ -399,12 +498,162 @@ static const char *sync_state_str[] = {
     "cancel pending"
 };
 
+static void
+set_task_large (SyncTask *task)
+{
+    if (task->large)
+        return;
+    task->large = TRUE;
+    ++(task->mgr->priv->n_running_large);
+}
+
+static void
+release_sync_slot (SyncTask *task)
+{
+    --(task->mgr->n_running_tasks);
+    if (task->large)
+        --(task->mgr->priv->n_running_large);
+}
+
+/* Estimate whether the next sync of @info transfers a lot of data. */
+static gboolean
+sync_info_is_large (SyncInfo *info)
+{
+    return info->last_tx_size >= LARGE_TASK_SIZE;
+}
+
+static gint64
+trace_now ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static void
+trace_transfer (SyncTask *task, TransferTask *tx_task)
+{
+    SyncTrace *trace = &task->trace;
+    int n_blocks = 0;
+
+    if (tx_task->type == TASK_TYPE_DOWNLOAD) {
+        trace->bytes_down = MAX (trace->bytes_down, tx_task->dsize);
+        if (tx_task->block_list)
+            n_blocks = tx_task->block_list->n_valid_blocks;
+        trace->blocks_down = MAX (trace->blocks_down, n_blocks);
+    } else {
+        trace->bytes_up = MAX (trace->bytes_up, tx_task->dsize);
+        trace->blocks_up = MAX (trace->blocks_up, tx_task->n_uploaded);
+    }
+
+    /* The lists are filled while checking what to transfer. */
+    if (tx_task->commits)
+        trace->n_commits = MAX (trace->n_commits,
+                                object_list_length (tx_task->commits));
+    if (tx_task->fs_roots)
+        trace->n_fs_roots = MAX (trace->n_fs_roots,
+                                 object_list_length (tx_task->fs_roots));
+}
+
+/*
+ * Close the current phase of @task and open @new_state. Tasks that end
+ * without getting past the commit, e.g. auto commits finding no change,
+ * are not kept, or they would push the real syncs out of the ring.
+ */
+static void
+trace_transition (SyncTask *task, int new_state)
+{
+    SeafSyncManagerPriv *priv = task->mgr->priv;
+    SyncTrace *trace = &task->trace;
+    gint64 now = trace_now ();
+
+    if (trace->start_time == 0) {
+        memcpy (trace->repo_id, task->info->repo_id, 41);
+        trace->start_time = now;
+    } else
+        trace->phase_end[task->state] = now;
+
+    if (trace->phase_start[new_state] == 0)
+        trace->phase_start[new_state] = now;
+
+    if (new_state != SYNC_STATE_DONE &&
+        new_state != SYNC_STATE_CANCELED &&
+        new_state != SYNC_STATE_ERROR)
+        return;
+
+    trace->phase_end[new_state] = now;
+    trace->end_time = now;
+    trace->state = new_state;
+    trace->error = task->error;
+
+    if (new_state != SYNC_STATE_ERROR &&
+        trace->phase_start[SYNC_STATE_INIT] == 0)
+        return;
+
+    priv->traces[priv->trace_head] = *trace;
+    priv->trace_head = (priv->trace_head + 1) % MAX_SYNC_TRACES;
+    if (priv->n_traces < MAX_SYNC_TRACES)
+        ++(priv->n_traces);
+}
+
+static void
+record_tx_size (SyncTask *task, TransferTask *tx_task)
+{
+    gint64 size = tx_task->dsize + MAX (tx_task->rsize, 0);
+
+    trace_transfer (task, tx_task);
+
+    if (size > task->tx_size)
+        task->tx_size = size;
+    if (task->tx_size >= LARGE_TASK_SIZE)
+        set_task_large (task);
+}
+
+static const char *sync_error_str[] = {
+    "Success",
+    "relay not connected",
+    "failed to upgrade old repo",
+    "Server has been removed",
+    "You have not login to the server",
+    "Remote service is not available",
+    "You do not have permission to access this repo",
+    "The storage space of the repo owner has been used up",
+    "Access denied to service. Please check your registration on relay.",
+    "Internal data corrupted.",
+    "Failed to start upload.",
+    "Error occured in upload.",
+    "Failed to start download.",
+    "Error occured in download.",
+    "No such repo on relay.",
+    "Unknown error.",
+};
+
+/* "sync\t<repo-id>" -> "<state>", or "error\t<error>" */
+static void
+publish_sync_state (SyncTask *task)
+{
+    char *key, *value;
+
+    key = g_strconcat ("sync\t", task->repo->id, NULL);
+    if (task->state == SYNC_STATE_ERROR)
+        value = g_strconcat (sync_state_str[task->state], "\t",
+                             sync_error_str[task->error], NULL);
+    else
+        value = g_strdup (sync_state_str[task->state]);
+    seaf_mq_manager_publish_state (seaf->mq_mgr, key, value);
+    g_free (key);
+    g_free (value);
+}
+
 static inline void
 transition_sync_state (SyncTask *task, int new_state)
 {
     g_assert (new_state >= 0 && new_state < SYNC_STATE_NUM);
 
     if (task->state != new_state) {
+        trace_transition (task, new_state);
+
         if (!task->quiet &&
             !(task->state == SYNC_STATE_DONE && new_state == SYNC_STATE_INIT) &&
             !(task->state == SYNC_STATE_INIT && new_state == SYNC_STATE_DONE)) {
@@ -428,11 +677,14 @@ transition_sync_state (SyncTask *task, int new_state)
         }
 
         task->state = new_state;
+        publish_sync_state (task);
         if (new_state == SYNC_STATE_DONE || 
             new_state == SYNC_STATE_CANCELED ||
             new_state == SYNC_STATE_ERROR) {
             task->info->in_sync = FALSE;
-            --(task->mgr->n_running_tasks);
+            release_sync_slot (task);
+            if (new_state == SYNC_STATE_DONE || task->tx_size > 0)
+                task->info->last_tx_size = task->tx_size;
             if (new_state == SYNC_STATE_ERROR)
                 task->info->err_cnt++;
             else
@@ -441,25 +693,6 @@ transition_sync_state (SyncTask *task, int new_state)
     }
 }
 
-static const char *sync_error_str[] = {
-    "Success",
-    "relay not connected",
-    "failed to upgrade old repo",
-    "Server has been removed",
-    "You have not login to the server",
-    "Remote service is not available",
-    "You do not have permission to access this repo",
-    "The storage space of the repo owner has been used up",
-    "Access denied to service. Please check your registration on relay.",
-    "Internal data corrupted.",
-    "Failed to start upload.",
-    "Error occured in upload.",
-    "Failed to start download.",
-    "Error occured in download.",
-    "No such repo on relay.",
-    "Unknown error.",
-};
-
 void
 seaf_sync_manager_set_task_error (SyncTask *task, int error)
 {
@@ -471,11 +704,15 @@ seaf_sync_manager_set_task_error (SyncTask *task, int error)
                       sync_state_str[task->state],
                       sync_state_str[SYNC_STATE_ERROR],
                       sync_error_str[error]);
-        task->state = SYNC_STATE_ERROR;
         task->error = error;
+        trace_transition (task, SYNC_STATE_ERROR);
+        task->state = SYNC_STATE_ERROR;
+        publish_sync_state (task);
         task->info->in_sync = FALSE;
         task->info->err_cnt++;
-        --(task->mgr->n_running_tasks);
+        release_sync_slot (task);
+        if (task->tx_size > 0)
+            task->info->last_tx_size = task->tx_size;
 
 #if 0
         if (task->repo && error != SYNC_ERROR_RELAY_OFFLINE
@@ -501,12 +738,54 @@ sync_task_free (SyncTask *task)
     g_free (task);
 }
 
+/*
+ * Between transfer phases, a large task gives its slot to the tasks
+ * waiting for one. It's resumed by resume_preempted_tasks(). A task is
+ * only preempted once, so it can't be starved.
+ */
+static gboolean
+preempt_if_necessary (SyncTask *task, void (*resume) (SyncTask *))
+{
+    SeafSyncManager *mgr = task->mgr;
+
+    if (!task->large || task->preempt_time != 0 ||
+        mgr->priv->n_waiting == 0 ||
+        mgr->n_running_tasks < MAX_RUNNING_SYNC_TASKS)
+        return FALSE;
+
+    seaf_debug ("Preempt sync task for repo '%s'.\n", task->repo->name);
+
+    release_sync_slot (task);
+    task->preempted = TRUE;
+    task->preempt_time = (gint64)time(NULL);
+    task->resume = resume;
+    mgr->priv->preempted_tasks = g_list_append (mgr->priv->preempted_tasks,
+                                                task);
+    return TRUE;
+}
+
+static void
+unpreempt_task (SyncTask *task)
+{
+    SeafSyncManager *mgr = task->mgr;
+
+    mgr->priv->preempted_tasks = g_list_remove (mgr->priv->preempted_tasks,
+                                                task);
+    task->preempted = FALSE;
+    ++(mgr->n_running_tasks);
+    if (task->large)
+        ++(mgr->priv->n_running_large);
+}
+
 static void
 start_upload_if_necessary (SyncTask *task)
 {
     GError *error = NULL;
     const char *repo_id = task->repo->id;
 
+    if (preempt_if_necessary (task, start_upload_if_necessary))
+        return;
+
     char *tx_id = seaf_transfer_manager_add_upload (seaf->transfer_mgr,
                                                     repo_id,
                                                     task->dest_id,
@@ -530,6 +809,9 @@ start_fetch_if_necessary (SyncTask *task)
     char *tx_id;
     const char *repo_id = task->repo->id;
 
+    if (preempt_if_necessary (task, start_fetch_if_necessary))
+        return;
+
     tx_id = seaf_transfer_manager_add_download (seaf->transfer_mgr,
                                                 repo_id,
                                                 task->dest_id,
@@ -637,10 +919,9 @@ merge_job_done (void *vresult)
         /* Save head commit id of master branch for GC, since we've
          * checked out the blocks on the master branch.
          */
-        seaf_repo_manager_set_repo_property (seaf->repo_mgr,
-                                             repo->id,
-                                             REPO_REMOTE_HEAD,
-                                             master->commit_id);
+        seaf_repo_manager_set_remote_head (seaf->repo_mgr,
+                                           repo->id,
+                                           master->commit_id);
         seaf_branch_unref (master);
     }
 
@@ -692,8 +973,10 @@ update_sync_status (SyncTask *task)
 
     if (info->deleted_on_relay) {
         /* First upload. */
-        if (!master)
+        if (!master) {
+            set_task_large (task);
             start_upload_if_necessary (task);
+        }
         /* If repo doesn't exist on relay and we have "master",
          * it was deleted on relay. In this case we remove this repo.
          */
@@ -889,11 +1172,31 @@ commit_job (void *vtask)
         }
     }
 
-    if (seaf_repo_index_add (repo, "") < 0) {
+    /* Syncs triggered by worktree changes only index the changed
+     * paths. Periodic syncs still scan the whole worktree in case
+     * any change was missed.
+     */
+    GList *paths = NULL;
+    int add_ret;
+
+    if (!task->quiet &&
+        seaf_wt_monitor_take_changed_paths (seaf->wt_monitor, repo->id, &paths)) {
+        add_ret = seaf_repo_index_add_paths (repo, paths);
+        if (add_ret < 0)
+            seaf_wt_monitor_invalidate_changed_paths (seaf->wt_monitor, repo->id);
+        string_list_free (paths);
+    } else {
+        add_ret = seaf_repo_index_add (repo, "");
+    }
+
+    if (add_ret < 0) {
         seaf_warning ("[Sync mgr] Failed to add in repo %s(%.8s).\n",
                       repo->name, repo->id);
         goto out;
     }
+    seaf_wt_monitor_paths_indexed (seaf->wt_monitor, repo->id);
+    task->trace.n_index_scanned = repo->n_index_scanned;
+    task->trace.n_index_added = repo->n_index_added;
 
     char *commit_id = seaf_repo_index_commit (repo, "", 
                                               unmerged, remote_name, &error);
@@ -1093,6 +1396,8 @@ start_sync (SeafSyncManager *manager, SeafRepo *repo, SyncTask *task)
     task->info->current_task = task;
     task->info->in_sync = TRUE;
     task->repo = repo;
+    if (sync_info_is_large (task->info))
+        set_task_large (task);
 
     if (task->need_commit)
         commit_repo (task);
@@ -1159,76 +1464,481 @@ create_sync_task (SeafSyncManager *manager,
     return task;
 }
 
-gint
-cmp_repos_by_sync_time (gconstpointer a, gconstpointer b, gpointer user_data)
+static gint
+compare_schedule (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const SyncSchedule *sa = a;
+    const SyncSchedule *sb = b;
+
+    if (sa->due != sb->due)
+        return (sa->due < sb->due) ? -1 : 1;
+    if (sa->kind != sb->kind)
+        return sa->kind - sb->kind;
+    return strcmp (sa->repo_id, sb->repo_id);
+}
+
+static void
+schedule_at (SeafSyncManager *mgr, SyncSchedule *sched, gint64 due)
+{
+    if (sched->iter) {
+        if (sched->due == due)
+            return;
+        g_sequence_remove (sched->iter);
+    }
+
+    sched->due = due;
+    sched->iter = g_sequence_insert_sorted (mgr->priv->sched_queue, sched,
+                                            compare_schedule, NULL);
+}
+
+static GHashTable *
+get_schedule_table (SeafSyncManager *mgr, int kind)
+{
+    if (kind == SCHED_COMMIT)
+        return mgr->priv->commit_scheds;
+    return mgr->priv->sync_scheds;
+}
+
+/*
+ * New schedules are due at once, so that a repo is committed and synced
+ * when it's first seen, e.g. on start up.
+ */
+static SyncSchedule *
+get_schedule (SeafSyncManager *mgr, const char *repo_id, int kind)
+{
+    GHashTable *table = get_schedule_table (mgr, kind);
+    SyncSchedule *sched;
+
+    sched = g_hash_table_lookup (table, repo_id);
+    if (sched)
+        return sched;
+
+    sched = g_new0 (SyncSchedule, 1);
+    g_strlcpy (sched->repo_id, repo_id, sizeof(sched->repo_id));
+    sched->kind = kind;
+    g_hash_table_insert (table, sched->repo_id, sched);
+
+    schedule_at (mgr, sched, (gint64)time(NULL));
+
+    return sched;
+}
+
+static void
+remove_schedule (SeafSyncManager *mgr, SyncSchedule *sched)
 {
-    const SeafRepo *repo_a = a;
-    const SeafRepo *repo_b = b;
+    if (sched->iter)
+        g_sequence_remove (sched->iter);
+    /* Frees sched. */
+    g_hash_table_remove (get_schedule_table (mgr, sched->kind), sched->repo_id);
+}
+
+static void
+notify_sync_later (SeafSyncManager *mgr, const char *repo_id)
+{
+    SyncSchedule *sched = get_schedule (mgr, repo_id, SCHED_SYNC);
+    gint64 due = (gint64)time(NULL) + 1;
+
+    sched->notified = TRUE;
+    if (sched->due > due)
+        schedule_at (mgr, sched, due);
+}
+
+/*
+ * Called when the worktree of @repo has changed. The commit is postponed
+ * until the worktree has been quiet for a while, to collect changes made
+ * in a burst.
+ */
+static void
+update_commit_schedule (SeafSyncManager *mgr, SeafRepo *repo, WTStatus *status)
+{
+    SyncSchedule *sched;
+    gint last_changed = g_atomic_int_get (&status->last_changed);
+
+    if (last_changed == 0 || status->last_check > last_changed)
+        return;
+
+    sched = get_schedule (mgr, repo->id, SCHED_COMMIT);
+    if (sched->last_changed == last_changed)
+        return;
 
-    return (repo_a->last_sync_time - repo_b->last_sync_time);
+    sched->last_changed = last_changed;
+    if (sched->first_change == 0)
+        sched->first_change = last_changed;
+
+    schedule_at (mgr, sched, MIN (last_changed + COMMIT_DEBOUNCE,
+                                  sched->first_change + COMMIT_MAX_DELAY));
 }
 
+static void
+run_commit_schedule (SeafSyncManager *mgr, SyncSchedule *sched,
+                     SeafRepo *repo, gint64 now)
+{
+    WTStatus *status;
+    gint last_changed;
+
+    status = seaf_wt_monitor_get_worktree_status (mgr->seaf->wt_monitor,
+                                                  repo->id);
+    if (!repo->auto_sync || !status) {
+        schedule_at (mgr, sched, now + mgr->wt_interval);
+        return;
+    }
+
+    last_changed = g_atomic_int_get (&status->last_changed);
+    if (last_changed != 0 && status->last_check <= last_changed) {
+        if (sched->first_change == 0)
+            sched->first_change = last_changed;
+        if (now - last_changed < COMMIT_DEBOUNCE &&
+            now - sched->first_change < COMMIT_MAX_DELAY) {
+            schedule_at (mgr, sched, MIN (last_changed + COMMIT_DEBOUNCE,
+                                          sched->first_change + COMMIT_MAX_DELAY));
+            return;
+        }
+        enqueue_sync_task (mgr, repo, FALSE);
+    } else {
+        /* Try to commit if no change has been detected in 10 mins. */
+        enqueue_sync_task (mgr, repo, TRUE);
+    }
+
+    status->last_check = now;
+    sched->last_changed = 0;
+    sched->first_change = 0;
+    schedule_at (mgr, sched, now + mgr->wt_interval);
+}
+
+/* Repos watched on the relay don't need to be polled often. */
 static int
-add_auto_sync_tasks (SeafSyncManager *manager)
+get_sync_interval (SeafSyncManager *mgr, SeafRepo *repo)
+{
+    SeafileWatchReposProc *proc = NULL;
+
+    if (repo->relay_id)
+        proc = g_hash_table_lookup (mgr->priv->watch_procs, repo->relay_id);
+    if (proc && seafile_watch_repos_proc_is_watching (proc, repo->id))
+        return MAX (mgr->sync_interval, WATCHED_SYNC_INTERVAL);
+    return mgr->sync_interval;
+}
+
+static void
+run_sync_schedule (SeafSyncManager *mgr, SyncSchedule *sched,
+                   SeafRepo *repo, gint64 now)
 {
-    int timeline;
-    GList *repos, *ptr;
-    SeafRepo *repo;
     SyncInfo *info;
+    int interval = get_sync_interval (mgr, repo);
+    gint64 next = now + interval;
 
-    timeline = (int) (time(NULL) - manager->sync_interval);
+    /* The repo may have been synced by a commit or manual task. */
+    if (!sched->notified && repo->last_sync_time + interval > now) {
+        schedule_at (mgr, sched, repo->last_sync_time + interval);
+        return;
+    }
 
-    repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
+    if (repo->delete_pending)
+        goto out;
 
-    /* Sort repos by last_sync_time, so that we don't "starve" any repo. */
-    repos = g_list_sort_with_data (repos, cmp_repos_by_sync_time, NULL);
+    if (!repo->auto_sync)
+        goto out;
 
-    for (ptr = repos; ptr; ptr = ptr->next) {
-        repo = ptr->data;
+    /* Don't sync if worktree doesn't exist. */
+    if (seaf_repo_check_worktree (repo) < 0)
+        goto out;
 
-        if (manager->n_running_tasks >= MAX_RUNNING_SYNC_TASKS)
-            break;
+    /* Don't sync repos without a relay-id */
+    if (!repo->relay_id) 
+        goto out;
 
-        if (repo->last_sync_time > timeline)
-            continue;
+    info = get_sync_info (mgr, repo->id);
 
-        if (repo->delete_pending)
-            continue;
+    if (info->in_sync) {
+        if (sched->notified)
+            next = now + 1;
+        else
+            next = MAX (now + 1, repo->last_sync_time + interval);
+        goto out;
+    }
 
-        if (!repo->auto_sync)
-            continue;
+    const char *dest_id = get_dest_id (repo);
+    if (!dest_id) {
+        next = now + SYNC_RETRY_DELAY;
+        goto out;
+    }
 
-        /* Don't sync if worktree doesn't exist. */
-        if (seaf_repo_check_worktree (repo) < 0)
-            continue;
+    CcnetPeer *peer = ccnet_get_peer (seaf->ccnetrpc_client, dest_id);
+    if (!peer || !peer->session_key) {
+        if (peer)
+            g_object_unref (peer);
+        next = now + SYNC_RETRY_DELAY;
+        goto out;
+    }
+    g_object_unref (peer);
 
-        /* Don't sync repos without a relay-id */
-        if (!repo->relay_id) 
-            continue;
+    SyncTask *task = create_sync_task (mgr, info, repo, FALSE, FALSE, FALSE);
+    perform_sync_task (mgr, task);
+    sched->notified = FALSE;
+
+out:
+    schedule_at (mgr, sched, next);
+}
 
-        info = get_sync_info (manager, repo->id);
+typedef struct SyncCandidate {
+    SyncSchedule *sched;
+    SeafRepo     *repo;
+    gboolean      large;
+    gint64        score;
+} SyncCandidate;
 
-        if (info->in_sync)
+static gint
+compare_candidates (gconstpointer a, gconstpointer b)
+{
+    const SyncCandidate *ca = a;
+    const SyncCandidate *cb = b;
+
+    if (ca->score != cb->score)
+        return (ca->score > cb->score) ? -1 : 1;
+    return compare_schedule (ca->sched, cb->sched, NULL);
+}
+
+/*
+ * Transfers that turn out to be large take the large task slots, so that
+ * no more large tasks are started.
+ */
+static void
+update_running_task_sizes (SeafSyncManager *manager)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    SyncInfo *info;
+    TransferTask *tx_task;
+
+    g_hash_table_iter_init (&iter, manager->sync_infos);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        if (!info->in_sync || !info->current_task ||
+            info->current_task->large)
+            continue;
+        if (info->current_task->state != SYNC_STATE_FETCH &&
+            info->current_task->state != SYNC_STATE_UPLOAD)
             continue;
 
-        const char *dest_id = get_dest_id (repo);
-        if (!dest_id)
+        tx_task = seaf_transfer_manager_find_transfer_by_repo (
+            seaf->transfer_mgr, info->repo_id);
+        if (tx_task)
+            record_tx_size (info->current_task, tx_task);
+    }
+}
+
+/*
+ * Start the due sync tasks in the order of their scores, as long as
+ * there are free slots.
+ */
+static void
+run_sync_candidates (SeafSyncManager *manager, GList *candidates, gint64 now)
+{
+    SeafSyncManagerPriv *priv = manager->priv;
+    SyncCandidate *cand;
+    GList *ptr;
+    int n_waiting = 0;
+
+    for (ptr = candidates; ptr; ptr = ptr->next) {
+        cand = ptr->data;
+        cand->large = sync_info_is_large (get_sync_info (manager,
+                                                         cand->repo->id));
+        cand->score = now - cand->sched->due +
+            (gint64)cand->repo->sync_priority * SYNC_PRIORITY_WEIGHT;
+        if (cand->large)
+            cand->score -= LARGE_TASK_PENALTY;
+    }
+    candidates = g_list_sort (candidates, compare_candidates);
+
+    for (ptr = candidates; ptr; ptr = ptr->next) {
+        cand = ptr->data;
+
+        if (manager->n_running_tasks >= MAX_RUNNING_SYNC_TASKS ||
+            (cand->large && priv->n_running_large >= MAX_RUNNING_LARGE_TASKS)) {
+            ++n_waiting;
             continue;
+        }
 
-        CcnetPeer *peer = ccnet_get_peer (seaf->ccnetrpc_client, dest_id);
-        if (!peer->session_key) {
-            g_object_unref (peer);
+        run_sync_schedule (manager, cand->sched, cand->repo, now);
+    }
+
+    priv->n_waiting = n_waiting;
+    if (n_waiting > 0)
+        update_running_task_sizes (manager);
+
+    for (ptr = candidates; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (candidates);
+}
+
+static void
+resume_preempted_tasks (SeafSyncManager *manager, gint64 now)
+{
+    SeafSyncManagerPriv *priv = manager->priv;
+    SyncTask *task;
+
+    while (priv->preempted_tasks) {
+        task = priv->preempted_tasks->data;
+
+        if (manager->n_running_tasks >= MAX_RUNNING_SYNC_TASKS ||
+            priv->n_running_large >= MAX_RUNNING_LARGE_TASKS)
+            break;
+        if (priv->n_waiting > 0 && now - task->preempt_time < MAX_PREEMPT_TIME)
+            break;
+
+        unpreempt_task (task);
+
+        if (task->repo->delete_pending) {
+            seaf_repo_manager_del_repo (seaf->repo_mgr, task->repo);
+            transition_sync_state (task, SYNC_STATE_CANCELED);
             continue;
         }
-        g_object_unref (peer);
-        
-        SyncTask *task = create_sync_task (manager, info, repo, FALSE, FALSE, FALSE);
-        perform_sync_task (manager, task);
+        if (task->state == SYNC_STATE_CANCEL_PENDING) {
+            transition_sync_state (task, SYNC_STATE_CANCELED);
+            continue;
+        }
+
+        seaf_debug ("Resume sync task for repo '%s'.\n", task->repo->name);
+        task->resume (task);
     }
+}
 
-    g_list_free (repos);
+/*
+ * Run the schedules that are due. Commits are cheap and always run,
+ * sync tasks compete for the slots.
+ */
+static void
+run_due_schedules (SeafSyncManager *manager)
+{
+    GSequenceIter *iter, *next;
+    SyncSchedule *sched;
+    SeafRepo *repo;
+    SyncCandidate *cand;
+    GList *candidates = NULL;
+    gint64 now = (gint64)time(NULL);
+
+    iter = g_sequence_get_begin_iter (manager->priv->sched_queue);
+    while (!g_sequence_iter_is_end (iter)) {
+        sched = g_sequence_get (iter);
+        if (sched->due > now)
+            break;
 
-    return 0;
+        /* Rescheduled entries are due later than now, so they are
+         * always inserted after this point.
+         */
+        next = g_sequence_iter_next (iter);
+
+        repo = seaf_repo_manager_get_repo (manager->seaf->repo_mgr,
+                                           sched->repo_id);
+        if (!repo) {
+            remove_schedule (manager, sched);
+        } else if (sched->kind == SCHED_COMMIT) {
+            run_commit_schedule (manager, sched, repo, now);
+        } else {
+            cand = g_new0 (SyncCandidate, 1);
+            cand->sched = sched;
+            cand->repo = repo;
+            candidates = g_list_prepend (candidates, cand);
+        }
+
+        iter = next;
+    }
+
+    run_sync_candidates (manager, candidates, now);
+    resume_preempted_tasks (manager, now);
+}
+
+static void
+watch_done_cb (CcnetProcessor *processor, gboolean success, void *vmanager)
+{
+    SeafSyncManager *mgr = vmanager;
+    gint64 *retry;
+
+    g_hash_table_remove (mgr->priv->watch_procs, processor->peer_id);
+
+    /* An old relay, or the connection dropped. Polling still works. */
+    retry = g_new (gint64, 1);
+    *retry = (gint64)time(NULL) + WATCH_RETRY_INTERVAL;
+    g_hash_table_replace (mgr->priv->watch_retry,
+                          g_strdup(processor->peer_id), retry);
+}
+
+static void
+start_watch_proc (SeafSyncManager *mgr, const char *relay_id)
+{
+    CcnetProcessor *processor;
+    gint64 *retry;
+
+    retry = g_hash_table_lookup (mgr->priv->watch_retry, relay_id);
+    if (retry && *retry > (gint64)time(NULL))
+        return;
+
+    if (!ccnet_peer_is_ready (seaf->ccnetrpc_client, relay_id))
+        return;
+
+    processor = ccnet_proc_factory_create_remote_master_processor (
+        seaf->session->proc_factory, "seafile-watch-repos", relay_id);
+    if (!processor) {
+        seaf_warning ("[sync-mgr] failed to create seafile-watch-repos proc.\n");
+        return;
+    }
+
+    if (ccnet_processor_startl (processor, NULL) < 0) {
+        seaf_warning ("[sync-mgr] failed to start seafile-watch-repos proc.\n");
+        return;
+    }
+
+    g_hash_table_insert (mgr->priv->watch_procs, g_strdup(relay_id), processor);
+    g_signal_connect (processor, "done", (GCallback)watch_done_cb, mgr);
+}
+
+static void
+free_repo_id_list (gpointer list)
+{
+    g_list_free ((GList *)list);
+}
+
+/*
+ * Ask every relay to notify the updates of the auto-synced repos on it,
+ * instead of polling them.
+ */
+static void
+update_repo_watches (SeafSyncManager *mgr)
+{
+    GHashTable *relays;         /* relay_id -> list of repo ids */
+    GList *repos, *ptr, *ids;
+    SeafRepo *repo;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    relays = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                    NULL, free_repo_id_list);
+
+    repos = seaf_repo_manager_get_repo_list (mgr->seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr != NULL; ptr = ptr->next) {
+        repo = ptr->data;
+        if (!repo->auto_sync || !repo->relay_id || !repo->head)
+            continue;
+        ids = g_hash_table_lookup (relays, repo->relay_id);
+        g_hash_table_steal (relays, repo->relay_id);
+        g_hash_table_insert (relays, repo->relay_id,
+                             g_list_prepend (ids, repo->id));
+    }
+
+    g_hash_table_iter_init (&iter, relays);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (!g_hash_table_lookup (mgr->priv->watch_procs, key))
+            start_watch_proc (mgr, key);
+    }
+
+    /* New procs get their repos on the next update, when they're ready. */
+    g_hash_table_iter_init (&iter, mgr->priv->watch_procs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        seafile_watch_repos_proc_set_repos (value,
+                                            g_hash_table_lookup (relays, key));
+    }
+
+    g_list_free (repos);
+    g_hash_table_destroy (relays);
 }
 
 static int
@@ -1240,22 +1950,29 @@ check_sync_pulse (void *vmanager)
         return TRUE;
     }
 
-    add_auto_sync_tasks (manager);
+    if (++(manager->priv->pulse_count) % UPDATE_WATCH_INTERVAL == 0)
+        update_repo_watches (manager);
+
+    run_due_schedules (manager);
     
     /* Here we perform tasks queued by auto-commit.
      * These tasks should be performed as soon as possible.
+     * Tasks of repos that are syncing stay in the queue, without
+     * blocking the tasks behind them.
      */
-    while (1) {
-        SyncTask *task;
-
-        task = (SyncTask *)g_queue_pop_head (manager->sync_tasks);
-        if (!task)
-            break;
+    GList *link = manager->sync_tasks->head, *next_link;
+    while (link) {
+        SyncTask *task = link->data;
 
+        next_link = link->next;
+        g_queue_delete_link (manager->sync_tasks, link);
         if (perform_sync_task (manager, task) < 0) {
-            g_queue_push_tail (manager->sync_tasks, task);
-            break;
+            if (next_link)
+                g_queue_insert_before (manager->sync_tasks, next_link, task);
+            else
+                g_queue_push_tail (manager->sync_tasks, task);
         }
+        link = next_link;
     }
 
 
@@ -1322,8 +2039,6 @@ auto_commit_pulse (void *vmanager)
     GList *repos, *ptr;
     SeafRepo *repo;
     WTStatus *status;
-    gint now = (gint)time(NULL);
-    gint last_changed;
 
     repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
 
@@ -1348,25 +2063,15 @@ auto_commit_pulse (void *vmanager)
         }
         repo->worktree_invalid = FALSE;
 
+        /* Make sure new repos are scheduled. */
+        get_schedule (manager, repo->id, SCHED_COMMIT);
+        get_schedule (manager, repo->id, SCHED_SYNC);
+
         if (manager->priv->auto_sync_enabled && repo->auto_sync) {
             status = seaf_wt_monitor_get_worktree_status (manager->seaf->wt_monitor,
                                                           repo->id);
-            if (status) {
-                last_changed = g_atomic_int_get (&status->last_changed);
-                if (last_changed != 0 && status->last_check <= last_changed) {
-                    /* Do not set the wt_changed variable since we will
-                       commit it soon. */
-                    /* repo->wt_changed = TRUE; */
-                    if (now - last_changed >= 2) {
-                        enqueue_sync_task (manager, repo, FALSE);
-                        status->last_check = now;
-                    }
-                } else if (now - status->last_check >= manager->wt_interval) {
-                    /* Try to commit if no change has been detected in 10 mins. */
-                    enqueue_sync_task (manager, repo, TRUE);
-                    status->last_check = now;
-                }
-            }
+            if (status)
+                update_commit_schedule (manager, repo, status);
         }
     }
 
@@ -1393,10 +2098,14 @@ on_repo_fetched (SeafileSession *seaf,
     SyncInfo *info = get_sync_info (manager, tx_task->repo_id);
     SyncTask *task = info->current_task;
 
-    /* Clone tasks are handled by clone manager. */
-    if (tx_task->is_clone)
+    /* Clone tasks are handled by clone manager, and block fetches for
+     * placeholders by repo manager.
+     */
+    if (tx_task->is_clone || tx_task->fetch_files)
         return;
 
+    record_tx_size (task, tx_task);
+
     if (task->repo->delete_pending) {
         seaf_repo_manager_del_repo (seaf->repo_mgr, task->repo);
         transition_sync_state (task, SYNC_STATE_CANCELED);
@@ -1430,6 +2139,8 @@ on_repo_uploaded (SeafileSession *seaf,
 
     g_assert (task != NULL && info->in_sync);
 
+    record_tx_size (task, tx_task);
+
     if (task->repo->delete_pending) {
         seaf_repo_manager_del_repo (seaf->repo_mgr, task->repo);
         transition_sync_state (task, SYNC_STATE_CANCELED);
@@ -1440,10 +2151,9 @@ on_repo_uploaded (SeafileSession *seaf,
         memcpy (info->head_commit, tx_task->head, 41);
 
         /* Save current head commit id for GC. */
-        seaf_repo_manager_set_repo_property (seaf->repo_mgr,
-                                             task->repo->id,
-                                             REPO_REMOTE_HEAD,
-                                             task->repo->head->commit_id);
+        seaf_repo_manager_set_remote_head (seaf->repo_mgr,
+                                           task->repo->id,
+                                           task->repo->head->commit_id);
 
         transition_sync_state (task, SYNC_STATE_DONE);
     } else if (tx_task->state == TASK_STATE_CANCELED) {
@@ -1553,3 +2263,64 @@ seaf_sync_manager_is_auto_sync_enabled (SeafSyncManager *mgr)
     else
         return 0;
 }
+
+void
+seaf_sync_manager_repo_updated_on_relay (SeafSyncManager *mgr,
+                                         const char *peer_id,
+                                         const char *repo_id,
+                                         const char *commit_id)
+{
+    SeafRepo *repo;
+    SyncInfo *info;
+
+    repo = seaf_repo_manager_get_repo (mgr->seaf->repo_mgr, repo_id);
+    if (!repo || !repo->auto_sync || g_strcmp0 (repo->relay_id, peer_id) != 0)
+        return;
+
+    /* Usually our own upload. */
+    info = g_hash_table_lookup (mgr->sync_infos, repo_id);
+    if (info && strcmp (info->head_commit, commit_id) == 0)
+        return;
+
+    seaf_debug ("[sync-mgr] Repo %s updated on relay, sync now.\n",
+                repo->name);
+    notify_sync_later (mgr, repo_id);
+}
+
+void
+seaf_sync_manager_format_traces (SeafSyncManager *mgr, GString *buf)
+{
+    SeafSyncManagerPriv *priv = mgr->priv;
+    SyncTrace *trace;
+    int i, j, n_phases;
+
+    for (i = 0; i < priv->n_traces; ++i) {
+        j = (priv->trace_head - priv->n_traces + i + MAX_SYNC_TRACES) %
+            MAX_SYNC_TRACES;
+        trace = &priv->traces[j];
+
+        g_string_append_printf (buf, "%s\t%"G_GINT64_FORMAT"\t%"G_GINT64_FORMAT
+                                "\t%s\t%s\t%d\t%d"
+                                "\t%"G_GINT64_FORMAT"\t%"G_GINT64_FORMAT
+                                "\t%d\t%d\t%d\t%d\t",
+                                trace->repo_id, trace->start_time,
+                                trace->end_time,
+                                sync_state_str[trace->state],
+                                sync_error_str[trace->error],
+                                trace->n_index_scanned, trace->n_index_added,
+                                trace->bytes_down, trace->bytes_up,
+                                trace->blocks_down, trace->blocks_up,
+                                trace->n_commits, trace->n_fs_roots);
+
+        n_phases = 0;
+        for (j = 0; j < SYNC_STATE_NUM; ++j) {
+            if (trace->phase_start[j] == 0 || j == SYNC_STATE_DONE ||
+                j == SYNC_STATE_CANCELED || j == SYNC_STATE_ERROR)
+                continue;
+            g_string_append_printf (buf, "%s%s:%"G_GINT64_FORMAT":%"G_GINT64_FORMAT,
+                                    n_phases++ ? "," : "", sync_state_str[j],
+                                    trace->phase_start[j], trace->phase_end[j]);
+        }
+        g_string_append_c (buf, '\n');
+    }
+}
@@ -25,6 +25,8 @@ struct _SyncInfo {
     gboolean   need_fetch;
     gboolean   need_upload;
     gboolean   need_merge;
+
+    gint64     last_tx_size;    /* size of the largest transfer in the last sync */
 };
 
 enum {
@@ -60,6 +62,30 @@ enum {
     SYNC_ERROR_NUM,
 };
 
+/*
+ * Timing and counters of one sync task. Times are in usec since the
+ * epoch, 0 if the phase was not entered. A phase entered twice keeps
+ * its first start and its last end.
+ */
+typedef struct SyncTrace {
+    char       repo_id[41];
+    gint64     start_time;
+    gint64     end_time;
+    int        state;           /* DONE, CANCELED or ERROR at the end */
+    int        error;
+    gint64     phase_start[SYNC_STATE_NUM];
+    gint64     phase_end[SYNC_STATE_NUM];
+
+    int        n_index_scanned;
+    int        n_index_added;
+    gint64     bytes_down;
+    gint64     bytes_up;
+    int        blocks_down;
+    int        blocks_up;
+    int        n_commits;       /* in the fetch and upload */
+    int        n_fs_roots;
+} SyncTrace;
+
 struct _SyncTask {
     SeafSyncManager *mgr;
     SyncInfo        *info;
@@ -75,6 +101,18 @@ struct _SyncTask {
     struct CcnetTimer *conn_timer;
 
     SeafRepo        *repo;  /* for convenience, only valid when in_sync. */
+
+    gboolean         large;     /* counted in the large task slots */
+    gint64           tx_size;
+
+    /* A large task waits between transfer phases while other tasks
+     * need its slot. @resume starts the next phase.
+     */
+    gboolean         preempted;
+    gint64           preempt_time;
+    void           (*resume) (SyncTask *task);
+
+    SyncTrace        trace;
 };
 
 struct _SeafileSession;
@@ -123,6 +161,28 @@ seaf_sync_manager_enable_auto_sync (SeafSyncManager *mgr);
 int
 seaf_sync_manager_is_auto_sync_enabled (SeafSyncManager *mgr);
 
+/* The relay @peer_id notified that the head of @repo_id is @commit_id. */
+void
+seaf_sync_manager_repo_updated_on_relay (SeafSyncManager *mgr,
+                                         const char *peer_id,
+                                         const char *repo_id,
+                                         const char *commit_id);
+
+/*
+ * Append the traces of the last finished sync tasks, oldest first, one
+ * line per task:
+ *
+ * repo_id \t start_time \t end_time \t state \t error \t index_scanned
+ *         \t index_added \t bytes_down \t bytes_up \t blocks_down
+ *         \t blocks_up \t commits \t fs_roots \t phases
+ *
+ * state and error are the strings shown for sync tasks. phases is a
+ * comma separated list of "state:start:end" of the phases entered. Times
+ * are in usec since the epoch.
+ */
+void
+seaf_sync_manager_format_traces (SeafSyncManager *mgr, GString *buf);
+
 const char *
 sync_error_to_str (int error);
 
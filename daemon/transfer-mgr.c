@@ -14,6 +14,7 @@
 #include "db.h"
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 #include "transfer-mgr.h"
 #include "commit-mgr.h"
 #include "fs-mgr.h"
@@ -27,6 +28,7 @@
 #include "vc-utils.h"
 #include "gc.h"
 #include "mq-mgr.h"
+#include "lan-block-mgr.h"
 
 #include "processors/check-tx-v2-proc.h"
 #include "processors/getcommit-proc.h"
@@ -42,17 +44,40 @@
 #include "processors/getcommit-v2-proc.h"
 #include "processors/sendcommit-v2-proc.h"
 #include "processors/sendcommit-v3-proc.h"
+#include "processors/sendcommit-v4-proc.h"
 
 #define TRANSFER_DB "transfer.db"
 
 #define SCHEDULE_INTERVAL   1   /* 1s */
-#define MAX_QUEUED_BLOCKS   50
+
+/* Blocks dispatched to a new block processor before any are measured. */
+#define INIT_BLOCK_WINDOW   4
+#define MIN_BLOCK_WINDOW    2
+
+/* A chunk server that failed is retried after 2^n seconds, up to 5 minutes. */
+#define MAX_SOURCE_BACKOFF  300
 
 #define DEFAULT_BLOCK_SIZE  (1 << 20)
 
+/* Blocks asked from LAN peers at a time. */
+#define LAN_FETCH_BATCH     256
+
+/* Global rate limits in KB/s, unset or 0 for no limit. */
+#define KEY_UPLOAD_LIMIT    "upload_limit"
+#define KEY_DOWNLOAD_LIMIT  "download_limit"
+/* If set, limits only apply in these hours, e.g. "08:00-18:00,22:00-06:00". */
+#define KEY_LIMIT_HOURS     "limit_hours"
+
+#define RATE_LIMIT_CHECK_INTERVAL 10    /* reload limits every 10s */
+
 static int schedule_task_pulse (void *vmanager);
 static void free_task_resources (TransferTask *task);
 static void state_machine_tick (TransferTask *task);
+static void rate_limiter_init (RateLimiter *limiter);
+static void update_task_rate_limit (TransferTask *task, gboolean active);
+static void download_dispatch_blocks (TransferTask *task);
+static void upload_dispatch_blocks (TransferTask *task);
+static void publish_transfer_finished (TransferTask *task);
 
 /**
  * transfer task states:
@@ -185,11 +210,14 @@ seaf_transfer_task_new (SeafTransferManager *manager,
     task->repo_id[36] = '\0';
     task->type = task_type;
     task->runtime_state = TASK_RT_STATE_INIT;
+    task->rt_state_time[TASK_RT_STATE_INIT] = get_current_time ();
     task->from_branch = g_strdup(from_branch);
     task->to_branch = g_strdup(to_branch);
     task->token = g_strdup(token);
     task->processors = g_hash_table_new_full (g_str_hash, g_str_equal,
                                               g_free, NULL);
+    task->sources = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
     if (!tx_id) {
         uuid = gen_uuid();
         memcpy (task->tx_id, uuid, 37);
@@ -203,6 +231,12 @@ seaf_transfer_task_new (SeafTransferManager *manager,
 
     task->rsize = -1;
     task->dsize = 0;
+
+    rate_limiter_init (&task->limiter);
+    update_task_rate_limit (task, manager->limits_active);
+
+    task->history = g_new0 (TxHistory, 1);
+
     return task;
 }
 
@@ -214,12 +248,16 @@ seaf_transfer_task_free (TransferTask *task)
     g_free (task->from_branch);
     g_free (task->to_branch);
     g_free (task->token);
+    string_list_free (task->fetch_files);
 
     if (task->fs_roots)
         object_list_free (task->fs_roots);
 
     g_hash_table_destroy (task->processors);
+    g_hash_table_destroy (task->sources);
+    pthread_mutex_destroy (&task->limiter.lock);
 
+    g_free (task->history);
     g_free (task);
 }
 
@@ -229,6 +267,371 @@ transfer_task_get_rate (TransferTask *task)
     return (double) g_atomic_int_get (&task->tx_bytes);
 }
 
+/* Transfer history */
+
+static void
+tx_sample_add (TxSample *dst, const TxSample *src)
+{
+    dst->bytes += src->bytes;
+    dst->blocks += src->blocks;
+    dst->retransmits += src->retransmits;
+    dst->failures += src->failures;
+    if (src->min_rtt > 0 && (dst->min_rtt == 0 || src->min_rtt < dst->min_rtt))
+        dst->min_rtt = src->min_rtt;
+}
+
+static void
+tx_history_add_block (TxHistory *h, int bytes, gint64 rtt)
+{
+    h->cur.bytes += bytes;
+    ++h->cur.blocks;
+    if (h->cur.min_rtt == 0 || rtt < h->cur.min_rtt)
+        h->cur.min_rtt = rtt;
+}
+
+/* Called every second, closes the current sample. */
+static void
+tx_history_tick (TxHistory *h, gint64 now)
+{
+    TxSample *sample;
+
+    if (h->cur.bytes > 0 || h->cur.blocks > 0 || h->cur.failures > 0)
+        h->last_active = now;
+    /* Idle for the whole history, nothing to add. */
+    else if (now - h->last_active > TX_HISTORY_LEN)
+        return;
+
+    if (h->n_samples < TX_HISTORY_LEN) {
+        sample = &h->samples[(h->head + h->n_samples) % TX_HISTORY_LEN];
+        ++h->n_samples;
+    } else {
+        sample = &h->samples[h->head];
+        h->head = (h->head + 1) % TX_HISTORY_LEN;
+    }
+
+    *sample = h->cur;
+    sample->time = now;
+    tx_sample_add (&h->total, &h->cur);
+    memset (&h->cur, 0, sizeof(h->cur));
+}
+
+/* Average bytes per second over the last @secs seconds. */
+static gint64
+tx_history_rate (TxHistory *h, int secs)
+{
+    gint64 bytes = 0;
+    int i, n = MIN (secs, h->n_samples);
+
+    if (n == 0)
+        return 0;
+    for (i = h->n_samples - n; i < h->n_samples; ++i)
+        bytes += h->samples[(h->head + i) % TX_HISTORY_LEN].bytes;
+    return bytes / secs;
+}
+
+static TxHistory *
+get_peer_history (SeafTransferManager *mgr, const char *peer_id)
+{
+    TxHistory *h = g_hash_table_lookup (mgr->peer_history, peer_id);
+
+    if (!h) {
+        h = g_new0 (TxHistory, 1);
+        g_hash_table_insert (mgr->peer_history, g_strdup(peer_id), h);
+    }
+    return h;
+}
+
+static void
+format_history_stats (GString *buf, const char *type, const char *id,
+                      TxHistory *h)
+{
+    g_string_append_printf (buf, "%s\t%s\t%"G_GINT64_FORMAT"\t%d\t%d\t%d"
+                            "\t%"G_GINT64_FORMAT"\t%"G_GINT64_FORMAT
+                            "\t%"G_GINT64_FORMAT"\n",
+                            type, id, h->total.bytes + h->cur.bytes,
+                            h->total.blocks + h->cur.blocks,
+                            h->total.retransmits + h->cur.retransmits,
+                            h->total.failures + h->cur.failures,
+                            h->total.min_rtt,
+                            tx_history_rate (h, 10), tx_history_rate (h, 60));
+}
+
+static void
+format_tasks_stats (GHashTable *tasks, GString *buf)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    TransferTask *task;
+
+    g_hash_table_iter_init (&iter, tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        if (task->state == TASK_STATE_NORMAL)
+            format_history_stats (buf, "task", task->repo_id, task->history);
+    }
+}
+
+void
+seaf_transfer_manager_format_stats (SeafTransferManager *mgr, GString *buf)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    format_tasks_stats (mgr->download_tasks, buf);
+    format_tasks_stats (mgr->upload_tasks, buf);
+
+    g_hash_table_iter_init (&iter, mgr->peer_history);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        format_history_stats (buf, "peer", key, value);
+}
+
+int
+seaf_transfer_manager_format_history (SeafTransferManager *mgr,
+                                      const char *id, GString *buf)
+{
+    TransferTask *task;
+    TxHistory *h;
+    TxSample *s;
+    int i;
+
+    task = seaf_transfer_manager_find_transfer_by_repo (mgr, id);
+    if (task)
+        h = task->history;
+    else
+        h = g_hash_table_lookup (mgr->peer_history, id);
+    if (!h)
+        return -1;
+
+    for (i = 0; i < h->n_samples; ++i) {
+        s = &h->samples[(h->head + i) % TX_HISTORY_LEN];
+        g_string_append_printf (buf, "%"G_GINT64_FORMAT"\t%"G_GINT64_FORMAT
+                                "\t%d\t%"G_GINT64_FORMAT"\t%d\t%d\n",
+                                s->time, s->bytes, s->blocks, s->min_rtt,
+                                s->retransmits, s->failures);
+    }
+
+    return 0;
+}
+
+static void
+tick_histories (SeafTransferManager *mgr)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    TransferTask *task;
+    gint64 now = (gint64)time(NULL);
+
+    /* Task bytes include partly transferred blocks. */
+    g_hash_table_iter_init (&iter, mgr->download_tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        task->history->cur.bytes = g_atomic_int_get (&task->tx_bytes);
+        tx_history_tick (task->history, now);
+    }
+
+    g_hash_table_iter_init (&iter, mgr->upload_tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        task->history->cur.bytes = g_atomic_int_get (&task->tx_bytes);
+        tx_history_tick (task->history, now);
+    }
+
+    g_hash_table_iter_init (&iter, mgr->peer_history);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        tx_history_tick (value, now);
+}
+
+static void
+rate_limiter_init (RateLimiter *limiter)
+{
+    pthread_mutex_init (&limiter->lock, NULL);
+    limiter->rate = 0;
+    limiter->tokens = 0;
+    limiter->last_refill = 0;
+}
+
+static void
+rate_limiter_set_rate (RateLimiter *limiter, gint64 rate)
+{
+    pthread_mutex_lock (&limiter->lock);
+    if (limiter->rate != rate) {
+        limiter->rate = rate;
+        limiter->tokens = 0;
+        limiter->last_refill = get_current_time ();
+    }
+    pthread_mutex_unlock (&limiter->lock);
+}
+
+/*
+ * Take @n bytes from the bucket. The bucket may go into debt, the caller
+ * then has to wait for the returned time in microseconds. Later callers
+ * wait for the debt of the earlier ones too, so the rate holds no matter
+ * how many threads share the bucket.
+ */
+static gint64
+rate_limiter_consume (RateLimiter *limiter, int n)
+{
+    gint64 now, elapsed, added, wait = 0;
+
+    pthread_mutex_lock (&limiter->lock);
+
+    if (limiter->rate <= 0)
+        goto out;
+
+    now = get_current_time ();
+    elapsed = now - limiter->last_refill;
+    if (elapsed < 0) {
+        /* Clock went backwards. */
+        elapsed = 0;
+        limiter->last_refill = now;
+    } else if (elapsed > 10 * G_USEC_PER_SEC) {
+        elapsed = 10 * G_USEC_PER_SEC;
+        limiter->last_refill = now - elapsed;
+    }
+
+    /* Only advance the refill time by the tokens actually added, so that
+     * rounding doesn't lose tokens when called often.
+     */
+    added = elapsed * limiter->rate / G_USEC_PER_SEC;
+    limiter->tokens += added;
+    limiter->last_refill += added * G_USEC_PER_SEC / limiter->rate;
+
+    /* Allow bursts of one second. */
+    if (limiter->tokens >= limiter->rate) {
+        limiter->tokens = limiter->rate;
+        limiter->last_refill = now;
+    }
+
+    limiter->tokens -= n;
+    if (limiter->tokens < 0)
+        wait = -limiter->tokens * G_USEC_PER_SEC / limiter->rate;
+
+out:
+    pthread_mutex_unlock (&limiter->lock);
+    return wait;
+}
+
+void
+transfer_task_throttle (TransferTask *task, int n)
+{
+    SeafTransferManager *mgr = task->manager;
+    RateLimiter *global;
+    gint64 wait, global_wait;
+
+    if (task->type == TASK_TYPE_UPLOAD)
+        global = &mgr->upload_limiter;
+    else
+        global = &mgr->download_limiter;
+
+    wait = rate_limiter_consume (&task->limiter, n);
+    global_wait = rate_limiter_consume (global, n);
+
+    wait = MAX (wait, global_wait);
+    if (wait > 0)
+        g_usleep ((gulong)wait);
+}
+
+/* Whether the local time is in one of the ranges in @hours. */
+static gboolean
+in_limit_hours (const char *hours)
+{
+    char **ranges, **ptr;
+    int h1, m1, h2, m2, start, end, now;
+    time_t t = time(NULL);
+    struct tm *tm = localtime (&t);
+    gboolean ret = FALSE;
+
+    if (!tm)
+        return TRUE;
+    now = tm->tm_hour * 60 + tm->tm_min;
+
+    ranges = g_strsplit (hours, ",", 0);
+    for (ptr = ranges; *ptr; ++ptr) {
+        if (sscanf (*ptr, "%d:%d-%d:%d", &h1, &m1, &h2, &m2) != 4) {
+            seaf_warning ("Bad limit hours: %s.\n", *ptr);
+            continue;
+        }
+        start = h1 * 60 + m1;
+        end = h2 * 60 + m2;
+
+        /* Ranges like 22:00-06:00 span midnight. */
+        if ((start <= end && now >= start && now < end) ||
+            (start > end && (now >= start || now < end))) {
+            ret = TRUE;
+            break;
+        }
+    }
+    g_strfreev (ranges);
+
+    return ret;
+}
+
+static gint64
+limit_to_rate (int limit, gboolean active)
+{
+    if (!active || limit <= 0)
+        return 0;
+    return (gint64)limit << 10;
+}
+
+static void
+update_task_rate_limit (TransferTask *task, gboolean active)
+{
+    const char *key;
+    char *value;
+
+    if (task->type == TASK_TYPE_UPLOAD)
+        key = REPO_UPLOAD_LIMIT;
+    else
+        key = REPO_DOWNLOAD_LIMIT;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr,
+                                                 task->repo_id, key);
+    rate_limiter_set_rate (&task->limiter,
+                           limit_to_rate (value ? atoi (value) : 0, active));
+    g_free (value);
+}
+
+static void
+update_rate_limits (SeafTransferManager *mgr)
+{
+    char *hours;
+    int upload, download;
+    gboolean exists;
+    GHashTableIter iter;
+    gpointer key, value;
+    TransferTask *task;
+
+    hours = seafile_session_config_get_string (seaf, KEY_LIMIT_HOURS);
+    if (hours && *hours != '\0')
+        mgr->limits_active = in_limit_hours (hours);
+    else
+        mgr->limits_active = TRUE;
+    g_free (hours);
+
+    upload = seafile_session_config_get_int (seaf, KEY_UPLOAD_LIMIT, &exists);
+    download = seafile_session_config_get_int (seaf, KEY_DOWNLOAD_LIMIT, &exists);
+
+    rate_limiter_set_rate (&mgr->upload_limiter,
+                           limit_to_rate (upload, mgr->limits_active));
+    rate_limiter_set_rate (&mgr->download_limiter,
+                           limit_to_rate (download, mgr->limits_active));
+
+    g_hash_table_iter_init (&iter, mgr->upload_tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        if (task->state == TASK_STATE_NORMAL)
+            update_task_rate_limit (task, mgr->limits_active);
+    }
+
+    g_hash_table_iter_init (&iter, mgr->download_tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        if (task->state == TASK_STATE_NORMAL)
+            update_task_rate_limit (task, mgr->limits_active);
+    }
+}
+
 static BlockList *
 load_blocklist_with_local_history (TransferTask *task)
 {
@@ -279,6 +682,95 @@ load_blocklist_with_local_history (TransferTask *task)
     return bl;
 }
 
+static int
+add_file_blocks (const char *file_id, BlockList *bl)
+{
+    Seafile *seafile;
+    int i;
+
+    if (memcmp (file_id, EMPTY_SHA1, 40) == 0)
+        return 0;
+
+    seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!seafile) {
+        seaf_warning ("[tr-mgr] Failed to find file %s.\n", file_id);
+        return -1;
+    }
+    for (i = 0; i < seafile->n_blocks; ++i)
+        block_list_insert (bl, seafile->blk_sha1s[i]);
+    seafile_unref (seafile);
+
+    return 0;
+}
+
+/*
+ * Blocks checked out by a clone limited to @paths: the files directly
+ * under the root and everything under the folders.
+ */
+static int
+populate_sparse_blocklist (const char *root_id, char **paths, BlockList *bl)
+{
+    SeafDir *root;
+    SeafDirent *dent;
+    GList *ptr;
+    char *obj_id;
+    guint32 mode;
+    GError *error = NULL;
+    int i, ret = 0;
+
+    root = seaf_fs_manager_get_seafdir (seaf->fs_mgr, root_id);
+    if (!root)
+        return -1;
+
+    for (ptr = root->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (S_ISREG(dent->mode) && add_file_blocks (dent->id, bl) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    for (i = 0; paths[i] != NULL; ++i) {
+        obj_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, root_id,
+                                                 paths[i], &mode, &error);
+        if (error) {
+            g_clear_error (&error);
+            ret = -1;
+            goto out;
+        }
+        /* Not in this commit. */
+        if (!obj_id)
+            continue;
+
+        if (S_ISDIR(mode))
+            ret = seaf_fs_manager_populate_blocklist (seaf->fs_mgr, obj_id, bl);
+        else
+            ret = add_file_blocks (obj_id, bl);
+        g_free (obj_id);
+        if (ret < 0)
+            goto out;
+    }
+
+    block_list_sort (bl);
+
+out:
+    seaf_dir_free (root);
+    return ret;
+}
+
+static gboolean
+load_placeholders_config (const char *repo_id)
+{
+    char *value;
+    gboolean ret;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo_id,
+                                                 REPO_PLACEHOLDERS);
+    ret = (seaf->hydrate_hook && g_strcmp0 (value, "true") == 0);
+    g_free (value);
+    return ret;
+}
+
 static int
 seaf_transfer_task_load_blocklist (TransferTask *task)
 {
@@ -289,7 +781,18 @@ seaf_transfer_task_load_blocklist (TransferTask *task)
     if (!repo && !task->is_clone)
         return -1;
 
-    if (task->type == TASK_TYPE_UPLOAD) {
+    if (task->fetch_files) {
+        GList *ptr;
+
+        bl = block_list_new ();
+        for (ptr = task->fetch_files; ptr; ptr = ptr->next) {
+            if (add_file_blocks (ptr->data, bl) < 0) {
+                block_list_free (bl);
+                return -1;
+            }
+        }
+        block_list_sort (bl);
+    } else if (task->type == TASK_TYPE_UPLOAD) {
         bl = load_blocklist_with_local_history (task);
         if (!bl) {
             seaf_warning ("[tr-mgr]Failed to populate blocklist.\n");
@@ -314,14 +817,28 @@ seaf_transfer_task_load_blocklist (TransferTask *task)
                 return -1;
             }
         } else {
-            /* If we're cloning, only get blocks pointed by the lastest commit.
+            /* If we're cloning, only get blocks pointed by the lastest commit,
+             * and only of the synced folders if they're set.
              */
+            char **sparse_paths;
+            int rc;
+
+            sparse_paths = seaf_repo_manager_get_sparse_paths (seaf->repo_mgr,
+                                                               task->repo_id);
             bl = block_list_new ();
-            if (seaf_fs_manager_populate_blocklist (seaf->fs_mgr,
-                                                    remote->root_id,
-                                                    bl) < 0) {
+            if (load_placeholders_config (task->repo_id))
+                /* Nothing is checked out but placeholders. */
+                rc = 0;
+            else if (sparse_paths)
+                rc = populate_sparse_blocklist (remote->root_id, sparse_paths, bl);
+            else
+                rc = seaf_fs_manager_populate_blocklist (seaf->fs_mgr,
+                                                         remote->root_id, bl);
+            g_strfreev (sparse_paths);
+            if (rc < 0) {
                 seaf_warning ("[tr-mgr] Failed to get blocks of commit %s.\n",
                            remote->commit_id);
+                block_list_free (bl);
                 seaf_commit_unref (remote);
                 return -1;
             }
@@ -336,8 +853,18 @@ seaf_transfer_task_load_blocklist (TransferTask *task)
 
     block_list_generate_bitmap (bl);
 
+    /* Blocks of the local files indexed by a clone into a non-empty
+     * folder are found here, and never requested.
+     */
+    if (task->is_clone && bl->n_valid_blocks > 0)
+        seaf_message ("Repo %.8s: %u of %u blocks are already present.\n",
+                      task->repo_id, bl->n_valid_blocks, bl->n_blocks);
+
     task->block_list = bl;
     BitfieldConstruct (&task->active, bl->n_blocks);
+    task->lan_fetching = FALSE;
+    task->lan_done = FALSE;
+    task->lan_next = 0;
 
     if (task->type == TASK_TYPE_UPLOAD)
         BitfieldConstruct (&task->uploaded, bl->n_blocks);
@@ -415,12 +942,15 @@ transition_state (TransferTask *task, int state, int rt_state)
                   task_rt_state_to_str(rt_state));
 
     task->last_runtime_state = task->runtime_state;
+    task->rt_state_time[rt_state] = get_current_time ();
 
     if (rt_state == TASK_RT_STATE_FINISHED) {
         remove_task_state (task);
         task->state = state;
         task->runtime_state = rt_state;
 
+        publish_transfer_finished (task);
+
         emit_transfer_done_signal (task);
 
         return;
@@ -443,6 +973,7 @@ transition_state_to_error (TransferTask *task, int task_errno)
                   task_error_str(task_errno));
 
     task->last_runtime_state = task->runtime_state;
+    task->rt_state_time[TASK_RT_STATE_FINISHED] = get_current_time ();
 
     remove_task_state (task);
 
@@ -451,6 +982,7 @@ transition_state_to_error (TransferTask *task, int task_errno)
     task->runtime_state = TASK_RT_STATE_FINISHED;
     task->error = task_errno;
 
+    publish_transfer_finished (task);
     emit_transfer_done_signal (task);
 }
 
@@ -523,12 +1055,19 @@ seaf_transfer_manager_new (struct _SeafileSession *seaf)
     SeafTransferManager *mgr = g_new0 (SeafTransferManager, 1);
 
     mgr->seaf = seaf;
+    rate_limiter_init (&mgr->upload_limiter);
+    rate_limiter_init (&mgr->download_limiter);
+    mgr->limits_active = TRUE;
     mgr->download_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                  (GDestroyNotify) g_free,
                                                  (GDestroyNotify) seaf_transfer_task_free);
     mgr->upload_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                (GDestroyNotify) g_free,
                                                (GDestroyNotify) seaf_transfer_task_free);
+    mgr->peer_history = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    mgr->fetching_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
 
     char *db_path = g_build_path (PATH_SEPERATOR, seaf->seaf_dir, TRANSFER_DB, NULL);
     if (sqlite_open_db (db_path, &mgr->db) < 0) {
@@ -537,6 +1076,7 @@ seaf_transfer_manager_new (struct _SeafileSession *seaf)
         g_free (mgr);
         return NULL;
     }
+    sqlite_set_write_batch (mgr->db, DB_WRITE_BATCH_INTERVAL);
 
     return mgr;
 }
@@ -597,6 +1137,9 @@ static void register_processors (CcnetClient *client)
     ccnet_proc_factory_register_processor (client->proc_factory,
                                            "seafile-sendcommit-v3",
                                            SEAFILE_TYPE_SENDCOMMIT_V3_PROC);
+    ccnet_proc_factory_register_processor (client->proc_factory,
+                                           "seafile-sendcommit-v4",
+                                           SEAFILE_TYPE_SENDCOMMIT_V4_PROC);
 }
 
 int
@@ -611,6 +1154,8 @@ seaf_transfer_manager_start (SeafTransferManager *manager)
 
     register_processors (seaf->session);
 
+    update_rate_limits (manager);
+
     manager->schedule_timer = ccnet_timer_new (schedule_task_pulse, manager,
                                                SCHEDULE_INTERVAL * 1000);
 
@@ -703,8 +1248,47 @@ seaf_transfer_manager_add_download (SeafTransferManager *manager,
     task->state = TASK_STATE_NORMAL;
 
     /* Mark task "clone" if it's a new repo. */
-    if (!seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id))
+    if (!seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id)) {
         task->is_clone = TRUE;
+        load_clone_history_config (task);
+    }
+
+    g_hash_table_insert (manager->download_tasks,
+                         g_strdup(task->tx_id),
+                         task);
+
+    return g_strdup(task->tx_id);
+}
+
+char *
+seaf_transfer_manager_add_block_fetch (SeafTransferManager *manager,
+                                       const char *repo_id,
+                                       const char *peer_id,
+                                       const char *token,
+                                       GList *file_ids,
+                                       GError **error)
+{
+    TransferTask *task;
+    GList *ptr;
+
+    if (!repo_id || !peer_id || !token || !file_ids) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(s)");
+        return NULL;
+    }
+
+    if (is_duplicate_task (manager, repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Task is already in progress");
+        return NULL;
+    }
+    clean_tasks_for_repo (manager, repo_id);
+
+    task = seaf_transfer_task_new (manager, NULL, repo_id, peer_id,
+                                   "fetch_head", "master", token,
+                                   TASK_TYPE_DOWNLOAD);
+    task->state = TASK_STATE_NORMAL;
+    for (ptr = file_ids; ptr; ptr = ptr->next)
+        task->fetch_files = g_list_prepend (task->fetch_files,
+                                            g_strdup(ptr->data));
 
     g_hash_table_insert (manager->download_tasks,
                          g_strdup(task->tx_id),
@@ -899,6 +1483,71 @@ get_chunk_server_list (TransferTask *task)
 }
 
 
+typedef struct {
+    int     n_failures;
+    gint64  retry_time;
+} TxSource;
+
+static BlockWindow *
+get_proc_window (TransferTask *task, CcnetProcessor *processor)
+{
+    if (task->type == TASK_TYPE_DOWNLOAD)
+        return &((SeafileGetblockV2Proc *)processor)->window;
+    else
+        return &((SeafileSendblockV2Proc *)processor)->window;
+}
+
+static int
+get_proc_pending (TransferTask *task, CcnetProcessor *processor)
+{
+    if (task->type == TASK_TYPE_DOWNLOAD)
+        return ((SeafileGetblockV2Proc *)processor)->pending_blocks;
+    else
+        return ((SeafileSendblockV2Proc *)processor)->pending_blocks;
+}
+
+static void
+record_source_failure (TransferTask *task, CcnetProcessor *processor)
+{
+    TxSource *src;
+    BlockWindow *win = get_proc_window (task, processor);
+    TxHistory *peer_h = get_peer_history (task->manager, processor->peer_id);
+    int pending = get_proc_pending (task, processor);
+    int backoff;
+
+    ++task->history->cur.failures;
+    task->history->cur.retransmits += pending;
+    ++peer_h->cur.failures;
+    peer_h->cur.retransmits += pending;
+
+    src = g_hash_table_lookup (task->sources, processor->peer_id);
+    if (!src) {
+        src = g_new0 (TxSource, 1);
+        g_hash_table_insert (task->sources, g_strdup(processor->peer_id), src);
+    }
+
+    /* The source worked for a while before failing, start over. */
+    if (win->last_done != 0)
+        src->n_failures = 0;
+    ++src->n_failures;
+
+    backoff = 1 << MIN (src->n_failures, 9);
+    backoff = MIN (backoff, MAX_SOURCE_BACKOFF);
+    src->retry_time = get_current_time () + (gint64)backoff * G_USEC_PER_SEC;
+
+    seaf_message ("Transfer repo %.8s: block transfer with %.8s failed, "
+                  "retry in %d seconds.\n",
+                  task->repo_id, processor->peer_id, backoff);
+}
+
+static gboolean
+source_is_usable (TransferTask *task, const char *peer_id)
+{
+    TxSource *src = g_hash_table_lookup (task->sources, peer_id);
+
+    return (!src || src->retry_time <= get_current_time ());
+}
+
 static void
 tx_done_cb (CcnetProcessor *processor, gboolean success, void *data)
 {
@@ -911,12 +1560,33 @@ tx_done_cb (CcnetProcessor *processor, gboolean success, void *data)
         free_task_resources (task);
     } else {
         /* Otherwise processs exits successfully, or the error is
-         * recoverable, restart processor later. 
+         * recoverable, restart processor later. Its queued blocks are
+         * released when it's freed and go to the other chunk servers.
          */
+        if (!success)
+            record_source_failure (task, processor);
         g_hash_table_remove (task->processors, processor->peer_id);
     }
 }
 
+/*
+ * A new processor with a chunk server that was used before starts with
+ * half the window it had and its time per block, so that the dispatch
+ * ranks it right away, instead of after a slow start.
+ */
+static void
+seed_block_window (TransferTask *task, BlockWindow *win, const char *peer_id)
+{
+    TxHistory *h = g_hash_table_lookup (task->manager->peer_history, peer_id);
+
+    if (!h || h->window == 0)
+        return;
+
+    win->size = MAX (h->window / 2, INIT_BLOCK_WINDOW);
+    win->slow_start = FALSE;
+    win->interval = h->interval;
+}
+
 static CcnetProcessor *
 start_sendblock_proc (TransferTask *task, const char *peer_id)
 {
@@ -933,6 +1603,8 @@ start_sendblock_proc (TransferTask *task, const char *peer_id)
     }
 
     ((SeafileSendblockV2Proc *)processor)->tx_task = task;
+    seed_block_window (task, &((SeafileSendblockV2Proc *)processor)->window,
+                       peer_id);
     if (ccnet_processor_start (processor, 0, NULL) < 0) {
         seaf_warning ("failed to start sendblock proc.\n");
         return NULL;
@@ -948,6 +1620,9 @@ start_getblock_proc (TransferTask *task, const char *peer_id)
 {
     CcnetProcessor *processor;
 
+    if (!ccnet_peer_is_ready (seaf->ccnetrpc_client, peer_id))
+        return NULL;
+
     processor = ccnet_proc_factory_create_remote_master_processor (
         seaf->session->proc_factory, "seafile-getblock-v2", peer_id);
     if (!processor) {
@@ -956,6 +1631,8 @@ start_getblock_proc (TransferTask *task, const char *peer_id)
     }
 
     ((SeafileGetblockV2Proc *)processor)->tx_task = task;
+    seed_block_window (task, &((SeafileGetblockV2Proc *)processor)->window,
+                       peer_id);
     if (ccnet_processor_start (processor, 0, NULL) < 0) {
         seaf_warning ("failed to start getblock proc.\n");
         return NULL;
@@ -977,6 +1654,90 @@ fs_root_collector (SeafCommit *commit, void *data, gboolean *stop)
     return TRUE;
 }
 
+/* Shallow clones */
+
+static void
+load_clone_history_config (TransferTask *task)
+{
+    char *value, *end;
+    long n;
+
+    value = seafile_session_config_get_string (seaf, KEY_CLONE_HISTORY);
+    if (!value)
+        return;
+
+    n = strtol (value, &end, 10);
+    if (strcmp (value, "head") == 0)
+        task->history_depth = 1;
+    else if (n > 0 && *end == '\0')
+        task->history_depth = (int)n;
+    else if (n > 0 && strcmp (end, "d") == 0)
+        task->history_since = (gint64)time(NULL) - (gint64)n * 24 * 3600;
+    else if (strcmp (value, "all") != 0)
+        seaf_warning ("Bad value for %s: %s.\n", KEY_CLONE_HISTORY, value);
+
+    g_free (value);
+}
+
+typedef struct {
+    ObjectList *fs_roots;
+    gint64 since;
+    gint64 boundary;
+} ShallowRoots;
+
+/* Commits are visited from the newest. */
+static gboolean
+shallow_root_collector (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    ShallowRoots *data = vdata;
+
+    /* The head is always fetched. */
+    if (data->boundary != 0 && commit->ctime < data->since) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    if (strcmp(commit->root_id, EMPTY_SHA1) != 0)
+        object_list_insert (data->fs_roots, commit->root_id);
+    if (data->boundary == 0 || commit->ctime < data->boundary)
+        data->boundary = commit->ctime;
+
+    return TRUE;
+}
+
+/*
+ * All commits are downloaded, the history is short of fs objects only.
+ * Replaces the fs roots of the whole history with those in the window.
+ */
+static int
+collect_shallow_fs_roots (TransferTask *task)
+{
+    ShallowRoots data;
+    gboolean ret;
+
+    data.fs_roots = object_list_new ();
+    data.since = task->history_since;
+    data.boundary = 0;
+
+    ret = seaf_commit_manager_traverse_commit_tree_with_limit (
+        seaf->commit_mgr, task->head, shallow_root_collector,
+        task->history_depth > 0 ? task->history_depth : -1, &data);
+    if (!ret) {
+        object_list_free (data.fs_roots);
+        return -1;
+    }
+
+    if (task->fs_roots)
+        object_list_free (task->fs_roots);
+    task->fs_roots = data.fs_roots;
+    task->history_boundary = data.boundary;
+
+    seaf_message ("Shallow clone of repo %.8s, fetching %d fs roots.\n",
+                  task->repo_id, object_list_length (task->fs_roots));
+
+    return 0;
+}
+
 /* -------- download -------- */
 
 static int
@@ -1044,24 +1805,270 @@ start_getfs_proc (TransferTask *task, const char *peer_id, GCallback done_cb)
  * tolerated. We'll continuously retry.
  */
 
+void
+block_window_init (BlockWindow *win)
+{
+    memset (win, 0, sizeof(BlockWindow));
+    win->size = INIT_BLOCK_WINDOW;
+    win->slow_start = TRUE;
+}
+
+static void
+block_window_queued (BlockWindow *win)
+{
+    if (win->n_sent == MAX_BLOCK_WINDOW)
+        return;
+    win->sent[(win->head + win->n_sent) % MAX_BLOCK_WINDOW] = get_current_time ();
+    ++win->n_sent;
+}
+
+/*
+ * Blocks are done in the order they're dispatched, so the oldest
+ * dispatch time belongs to the block just done. Returns its latency,
+ * or 0 if it wasn't queued.
+ */
+static gint64
+block_window_done (BlockWindow *win)
+{
+    gint64 now = get_current_time ();
+    gint64 sent, rtt, interval;
+
+    if (win->n_sent == 0)
+        return 0;
+    sent = win->sent[win->head];
+    win->head = (win->head + 1) % MAX_BLOCK_WINDOW;
+    --win->n_sent;
+
+    rtt = MAX (now - sent, 1);
+    if (win->min_rtt == 0 || rtt < win->min_rtt)
+        win->min_rtt = rtt;
+    if (win->round_min_rtt == 0 || rtt < win->round_min_rtt)
+        win->round_min_rtt = rtt;
+
+    /* Don't count the time the processor was idle. */
+    interval = MAX (now - MAX (sent, win->last_done), 1);
+    if (win->interval == 0)
+        win->interval = interval;
+    else
+        win->interval = (7 * win->interval + interval) / 8;
+    win->last_done = now;
+
+    if (++win->acked < win->size)
+        return rtt;
+
+    /* Once per window of blocks: additive increase, or multiplicative
+     * decrease if even the fastest block of the round waited as long
+     * again as the lowest latency, i.e. the window is larger than what
+     * the link holds and blocks only sit in the queues.
+     */
+    if (win->round_min_rtt > 2 * win->min_rtt) {
+        win->size = MAX (win->size / 2, MIN_BLOCK_WINDOW);
+        win->slow_start = FALSE;
+    } else if (win->slow_start) {
+        win->size *= 2;
+    } else {
+        ++win->size;
+    }
+    win->size = MIN (win->size, MAX_BLOCK_WINDOW);
+
+    win->acked = 0;
+    win->round_min_rtt = 0;
+
+    return rtt;
+}
+
+/* Estimated time until a block given to the processor now is done. */
+static gint64
+block_window_eta (BlockWindow *win, int pending)
+{
+    return (gint64)(pending + 1) * win->interval;
+}
+
+void
+transfer_task_block_done (TransferTask *task, CcnetProcessor *processor,
+                          int pending, int bytes)
+{
+    BlockWindow *win = get_proc_window (task, processor);
+    TxHistory *peer_h;
+    gint64 rtt;
+
+    rtt = block_window_done (win);
+    if (rtt > 0) {
+        peer_h = get_peer_history (task->manager, processor->peer_id);
+        tx_history_add_block (task->history, 0, rtt);
+        tx_history_add_block (peer_h, bytes, rtt);
+        peer_h->window = win->size;
+        peer_h->interval = win->interval;
+    }
+
+    if (task->state != TASK_STATE_NORMAL ||
+        task->runtime_state != TASK_RT_STATE_DATA)
+        return;
+
+    /* Refill in batches instead of scanning the block list for every
+     * block, but before the queue runs dry.
+     */
+    if (pending > win->size / 2)
+        return;
+
+    if (task->type == TASK_TYPE_DOWNLOAD)
+        download_dispatch_blocks (task);
+    else
+        upload_dispatch_blocks (task);
+}
+
+/* Returns FALSE if another download is fetching the block. */
+static gboolean
+claim_block (TransferTask *task, const char *block_id)
+{
+    GHashTable *fetching = task->manager->fetching_blocks;
+    const char *owner;
+
+    owner = g_hash_table_lookup (fetching, block_id);
+    if (owner)
+        return (strcmp (owner, task->tx_id) == 0);
+
+    g_hash_table_insert (fetching, g_strdup(block_id), g_strdup(task->tx_id));
+    return TRUE;
+}
+
+static gboolean
+is_claimed_by (gpointer key, gpointer value, gpointer tx_id)
+{
+    return (strcmp ((char *)value, (char *)tx_id) == 0);
+}
+
+/* The blocks left are requested again by the other downloads that need
+ * them.
+ */
+static void
+release_claimed_blocks (TransferTask *task)
+{
+    g_hash_table_foreach_remove (task->manager->fetching_blocks,
+                                 is_claimed_by, task->tx_id);
+}
+
+void
+transfer_task_block_fetched (TransferTask *task, int idx)
+{
+    GHashTableIter iter;
+    gpointer value;
+    TransferTask *other;
+    BlockList *bl;
+    char block_id[41];
+    int i;
+
+    block_list_get_id (task->block_list, idx, block_id);
+    g_hash_table_remove (task->manager->fetching_blocks, block_id);
+
+    g_hash_table_iter_init (&iter, task->manager->download_tasks);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        other = value;
+        bl = other->block_list;
+        if (other == task || other->runtime_state != TASK_RT_STATE_DATA || !bl)
+            continue;
+
+        i = block_list_find (bl, block_id);
+        if (i < 0 || BitfieldHasFast (&bl->block_map, i) ||
+            BitfieldHasFast (&other->active, i))
+            continue;
+
+        BitfieldAdd (&bl->block_map, i);
+        ++(bl->n_valid_blocks);
+    }
+}
+
+typedef struct {
+    int     n_unassigned;   /* blocks neither done nor queued */
+    int     room;           /* free slots in all windows */
+    gint64  best_eta;
+    gboolean best_busy;     /* the fastest processor has blocks queued */
+} DispatchInfo;
+
+static void
+dispatch_info_add (DispatchInfo *info, BlockWindow *win, int pending)
+{
+    gint64 eta = block_window_eta (win, pending);
+
+    if (pending < win->size)
+        info->room += win->size - pending;
+    if (win->interval > 0 && (info->best_eta < 0 || eta < info->best_eta)) {
+        info->best_eta = eta;
+        info->best_busy = (pending > 0);
+    }
+}
+
+/*
+ * Number of blocks to give the processor. Once the remaining blocks no
+ * longer fill all the windows, a processor that would take more than
+ * twice as long as the fastest one gets no more blocks, the faster ones
+ * take them as their windows free up. Otherwise the task waits for the
+ * last blocks on the slowest link.
+ */
+static int
+dispatch_room (DispatchInfo *info, BlockWindow *win, int pending)
+{
+    int room = win->size - pending;
+
+    if (room <= 0 || info->n_unassigned <= 0)
+        return 0;
+
+    /* Processors not measured yet still get blocks. If the fastest one
+     * is idle, it may not have the remaining blocks at all.
+     */
+    if (info->n_unassigned < info->room && info->best_busy &&
+        win->interval > 0 && info->best_eta >= 0 &&
+        block_window_eta (win, pending) > 2 * info->best_eta)
+        return 0;
+
+    return MIN (room, info->n_unassigned);
+}
+
+static gint
+compare_proc_speed (gconstpointer a, gconstpointer b, gpointer data)
+{
+    TransferTask *task = data;
+    BlockWindow *wa = get_proc_window (task, (CcnetProcessor *)a);
+    BlockWindow *wb = get_proc_window (task, (CcnetProcessor *)b);
+
+    /* Unmeasured processors come last. */
+    if (wa->interval == 0 || wb->interval == 0)
+        return (wa->interval == 0) - (wb->interval == 0);
+    if (wa->interval != wb->interval)
+        return (wa->interval < wb->interval) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Processors of the task, fastest first, so that the chunk servers with
+ * the highest throughput get the blocks when there are few left.
+ */
+static GList *
+get_procs_by_speed (TransferTask *task)
+{
+    GList *procs = g_hash_table_get_values (task->processors);
+
+    return g_list_sort_with_data (procs, compare_proc_speed, task);
+}
+
 static void
 download_dispatch_blocks_to_processor (TransferTask *task,
                                        SeafileGetblockV2Proc *proc,
-                                       guint n_procs)
+                                       DispatchInfo *info)
 {
     CcnetProcessor *processor = (CcnetProcessor *)proc;
-    int expected, n_blocks, n_scheduled = 0;
+    int n_blocks, n_scheduled = 0;
     int i;
 
     if (!seafile_getblock_v2_proc_is_ready (proc))
         return;
 
-    expected = MIN (proc->block_bitmap.bitCount/n_procs, MAX_QUEUED_BLOCKS);
-    n_blocks = expected - proc->pending_blocks;
+    n_blocks = dispatch_room (info, &proc->window, proc->pending_blocks);
     if (n_blocks <= 0)
         return;
 
-    seaf_debug ("expected: %d, pending: %d.\n", expected, proc->pending_blocks);
+    seaf_debug ("window: %d, pending: %d.\n",
+                proc->window.size, proc->pending_blocks);
 
     for (i = 0; i < proc->block_bitmap.bitCount; ++i) {
         if (n_scheduled == n_blocks)
@@ -1071,15 +2078,21 @@ download_dispatch_blocks_to_processor (TransferTask *task,
             !BitfieldHasFast (&task->block_list->block_map, i) &&
             !BitfieldHasFast (&task->active, i))
         {
-            const char *block_id;
-            block_id = g_ptr_array_index (task->block_list->block_ids, i);
+            char block_id[41];
+            block_list_get_id (task->block_list, i, block_id);
+            if (!claim_block (task, block_id))
+                continue;
             seaf_debug ("Transfer repo %.8s: schedule block %.8s to %.8s.\n",
                         task->repo_id, block_id, processor->peer_id);
-            seafile_getblock_v2_proc_get_block (proc, i);
+            if (seafile_getblock_v2_proc_get_block (proc, i) < 0)
+                break;
+            block_window_queued (&proc->window);
             BitfieldAdd (&task->active, i);
             ++n_scheduled;
         }
     }
+
+    info->n_unassigned -= n_scheduled;
 }
 
 static void
@@ -1088,13 +2101,139 @@ download_dispatch_blocks (TransferTask *task)
     GHashTableIter iter;
     gpointer key, value;
     SeafileGetblockV2Proc *proc;
-    guint n_procs = g_hash_table_size (task->processors);
+    GList *procs, *ptr;
+    BlockList *bl = task->block_list;
+    DispatchInfo info;
+
+    info.n_unassigned = bl->n_blocks - bl->n_valid_blocks -
+        (int)BitfieldCountTrueBits (&task->active);
+    if (info.n_unassigned <= 0)
+        return;
+    info.room = 0;
+    info.best_eta = -1;
+    info.best_busy = FALSE;
 
     g_hash_table_iter_init (&iter, task->processors);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         proc = value;
-        download_dispatch_blocks_to_processor (task, proc, n_procs);
+        if (seafile_getblock_v2_proc_is_ready (proc))
+            dispatch_info_add (&info, &proc->window, proc->pending_blocks);
+    }
+
+    procs = get_procs_by_speed (task);
+    for (ptr = procs; ptr; ptr = ptr->next) {
+        proc = ptr->data;
+        download_dispatch_blocks_to_processor (task, proc, &info);
+    }
+    g_list_free (procs);
+}
+
+typedef struct {
+    char        tx_id[37];
+    BlockList  *block_list;
+    GHashTable *indices;        /* block_id -> index + 1 */
+} LanBatch;
+
+static void
+lan_fetch_done (GList *fetched, void *vbatch)
+{
+    LanBatch *batch = vbatch;
+    TransferTask *task;
+    BlockList *bl;
+    GHashTableIter iter;
+    gpointer value;
+    GList *ptr;
+    int idx;
+
+    task = g_hash_table_lookup (seaf->transfer_mgr->download_tasks,
+                                batch->tx_id);
+    /* The task is gone or has reloaded its block list. */
+    if (!task || task->block_list != batch->block_list)
+        goto out;
+    bl = task->block_list;
+
+    for (ptr = fetched; ptr; ptr = ptr->next) {
+        value = g_hash_table_lookup (batch->indices, ptr->data);
+        if (!value)
+            continue;
+        idx = GPOINTER_TO_INT(value) - 1;
+        if (!BitfieldHasFast (&bl->block_map, idx)) {
+            transfer_task_block_fetched (task, idx);
+            BitfieldAdd (&bl->block_map, idx);
+            ++(bl->n_valid_blocks);
+        }
     }
+
+    /* Blocks the peers don't have are left to the chunk servers. */
+    g_hash_table_iter_init (&iter, batch->indices);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        BitfieldRem (&task->active, GPOINTER_TO_INT(value) - 1);
+
+    task->lan_fetching = FALSE;
+    if (!fetched || task->lan_next >= bl->n_blocks)
+        task->lan_done = TRUE;
+
+out:
+    g_hash_table_destroy (batch->indices);
+    g_free (batch);
+}
+
+/*
+ * Ask LAN peers holding the repo for the next batch of missing blocks.
+ * Returns FALSE if there is no LAN source.
+ */
+static gboolean
+start_lan_fetch (TransferTask *task)
+{
+    BlockList *bl = task->block_list;
+    LanBatch *batch;
+    GList *block_ids = NULL;
+    char block_id[41];
+    int i, n = 0;
+
+    if (!seaf_lan_block_manager_has_source (seaf->lan_block_mgr,
+                                            task->repo_id))
+        return FALSE;
+
+    batch = g_new0 (LanBatch, 1);
+    memcpy (batch->tx_id, task->tx_id, 36);
+    batch->block_list = bl;
+    batch->indices = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+
+    for (i = task->lan_next; i < bl->n_blocks && n < LAN_FETCH_BATCH; ++i) {
+        if (BitfieldHasFast (&bl->block_map, i) ||
+            BitfieldHasFast (&task->active, i))
+            continue;
+
+        block_list_get_id (bl, i, block_id);
+        if (!claim_block (task, block_id))
+            continue;
+        block_ids = g_list_prepend (block_ids, g_strdup(block_id));
+        g_hash_table_insert (batch->indices, g_strdup(block_id),
+                             GINT_TO_POINTER(i + 1));
+        BitfieldAdd (&task->active, i);
+        ++n;
+    }
+    task->lan_next = i;
+
+    if (n == 0) {
+        g_hash_table_destroy (batch->indices);
+        g_free (batch);
+        task->lan_done = TRUE;
+        return FALSE;
+    }
+
+    if (seaf_lan_block_manager_fetch_blocks (seaf->lan_block_mgr,
+                                             task->repo_id,
+                                             g_list_reverse (block_ids),
+                                             lan_fetch_done, batch) < 0) {
+        lan_fetch_done (NULL, batch);
+        return FALSE;
+    }
+
+    task->lan_fetching = TRUE;
+    return TRUE;
 }
 
 static void
@@ -1106,7 +2245,8 @@ start_chunk_server_download (TransferTask *task)
 
     while (ptr) {
         cs_id = ptr->data;
-        if (!g_hash_table_lookup (task->processors, cs_id)) {
+        if (!g_hash_table_lookup (task->processors, cs_id) &&
+            source_is_usable (task, cs_id)) {
             processor = start_getblock_proc (task, cs_id);
             if (processor != NULL) {
                 g_hash_table_insert (task->processors, g_strdup(cs_id), processor);
@@ -1157,7 +2297,13 @@ start_fs_download (TransferTask *task, const char *peer_id)
     int ret;
     ObjectList *ol;
 
-    if (task->protocol_version == 1) {
+    if (task->is_clone &&
+        (task->history_depth > 0 || task->history_since > 0)) {
+        if (collect_shallow_fs_roots (task) < 0) {
+            transition_state_to_error (task, TASK_ERR_LOAD_FS);
+            return;
+        }
+    } else if (task->protocol_version == 1) {
         ol = object_list_new ();
         ret = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
                                                         task->head,
@@ -1250,7 +2396,11 @@ check_download_cb (CcnetProcessor *processor, gboolean success, void *data)
         if (task->is_clone)
             save_clone_head (task, task->head);
 
-        start_commit_download (task);
+        /* Commits and fs of the files to hydrate are already local. */
+        if (task->fetch_files)
+            start_block_download (task);
+        else
+            start_commit_download (task);
     } else if (task->state != TASK_STATE_ERROR
                && task->runtime_state == TASK_RT_STATE_CHECK) {
         transfer_task_with_proc_failure (
@@ -1371,7 +2521,7 @@ schedule_download_task (TransferTask *task)
 {
     /* We cannot write any new block when GC is running.
      * This should only be effective for a short period
-     * after restart.
+     * after restart, or while an incremental GC runs.
      */
     if (gc_is_started ()) {
         seaf_debug ("[tr mgr] GC is running, hold up download.\n");
@@ -1397,12 +2547,21 @@ schedule_download_task (TransferTask *task)
         break;
     case TASK_RT_STATE_DATA:
         if (task->block_list->n_valid_blocks == task->block_list->n_blocks) {
-            update_local_repo (task);
+            if (!task->fetch_files)
+                update_local_repo (task);
             free_task_resources (task);
             transition_state (task, TASK_STATE_FINISHED, TASK_RT_STATE_FINISHED);
             break;
         }
 
+        /* Prefer LAN peers, and only fall back to the chunk servers for
+         * the blocks they don't have.
+         */
+        if (task->lan_fetching)
+            break;
+        if (!task->lan_done && start_lan_fetch (task))
+            break;
+
         if (task->chunk_servers == NULL) {
             if (is_peer_relay (dest_id))
                 get_chunk_server_list (task);
@@ -1458,10 +2617,14 @@ start_sendcommit_proc (TransferTask *task, const char *peer_id, GCallback done_c
         processor = ccnet_proc_factory_create_remote_master_processor (
                     seaf->session->proc_factory, "seafile-sendcommit-v2", peer_id);
         break;
-    default:
+    case 3:
         processor = ccnet_proc_factory_create_remote_master_processor (
                     seaf->session->proc_factory, "seafile-sendcommit-v3", peer_id);
         break;
+    default:
+        processor = ccnet_proc_factory_create_remote_master_processor (
+                    seaf->session->proc_factory, "seafile-sendcommit-v4", peer_id);
+        break;
     }
     if (!processor) {
         seaf_warning ("failed to create sendcommit proc.\n");
@@ -1663,7 +2826,8 @@ start_chunk_server_upload (TransferTask *task)
 
     while (ptr) {
         cs_id = ptr->data;
-        if (!g_hash_table_lookup (task->processors, cs_id)) {
+        if (!g_hash_table_lookup (task->processors, cs_id) &&
+            source_is_usable (task, cs_id)) {
             processor = start_sendblock_proc (task, cs_id);
             if (processor != NULL) {
                 g_hash_table_insert (task->processors, g_strdup(cs_id), processor);
@@ -1676,21 +2840,21 @@ start_chunk_server_upload (TransferTask *task)
 static void
 upload_dispatch_blocks_to_processor (TransferTask *task,
                                      SeafileSendblockV2Proc *proc,
-                                     guint n_procs)
+                                     DispatchInfo *info)
 {
     CcnetProcessor *processor = (CcnetProcessor *)proc;
-    int expected, n_blocks, n_scheduled = 0;
+    int n_blocks, n_scheduled = 0;
     int i;
 
     if (!seafile_sendblock_v2_proc_is_ready (proc))
         return;
 
-    expected = MIN (task->uploaded.bitCount/n_procs, MAX_QUEUED_BLOCKS);
-    n_blocks = expected - proc->pending_blocks;
+    n_blocks = dispatch_room (info, &proc->window, proc->pending_blocks);
     if (n_blocks <= 0)
         return;
 
-    seaf_debug ("expected: %d, pending: %d.\n", expected, proc->pending_blocks);
+    seaf_debug ("window: %d, pending: %d.\n",
+                proc->window.size, proc->pending_blocks);
 
     for (i = 0; i < task->uploaded.bitCount; ++i) {
         if (n_scheduled == n_blocks)
@@ -1700,15 +2864,19 @@ upload_dispatch_blocks_to_processor (TransferTask *task,
             BitfieldHasFast (&task->block_list->block_map, i) &&
             !BitfieldHasFast (&task->active, i))
         {
-            const char *block_id;
-            block_id = g_ptr_array_index (task->block_list->block_ids, i);
+            char block_id[41];
+            block_list_get_id (task->block_list, i, block_id);
             seaf_debug ("Transfer repo %.8s: schedule block %.8s to %.8s.\n",
                      task->repo_id, block_id, processor->peer_id);
-            seafile_sendblock_v2_proc_send_block (proc, i);
+            if (seafile_sendblock_v2_proc_send_block (proc, i) < 0)
+                break;
+            block_window_queued (&proc->window);
             BitfieldAdd (&task->active, i);
             ++n_scheduled;
         }
     }
+
+    info->n_unassigned -= n_scheduled;
 }
 
 static void
@@ -1717,13 +2885,31 @@ upload_dispatch_blocks (TransferTask *task)
     GHashTableIter iter;
     gpointer key, value;
     SeafileSendblockV2Proc *proc;
-    guint n_procs = g_hash_table_size (task->processors);
+    GList *procs, *ptr;
+    DispatchInfo info;
+
+    info.n_unassigned = task->block_list->n_blocks -
+        (int)BitfieldCountTrueBits (&task->uploaded) -
+        (int)BitfieldCountTrueBits (&task->active);
+    if (info.n_unassigned <= 0)
+        return;
+    info.room = 0;
+    info.best_eta = -1;
+    info.best_busy = FALSE;
 
     g_hash_table_iter_init (&iter, task->processors);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         proc = value;
-        upload_dispatch_blocks_to_processor (task, proc, n_procs);
+        if (seafile_sendblock_v2_proc_is_ready (proc))
+            dispatch_info_add (&info, &proc->window, proc->pending_blocks);
     }
+
+    procs = get_procs_by_speed (task);
+    for (ptr = procs; ptr; ptr = ptr->next) {
+        proc = ptr->data;
+        upload_dispatch_blocks_to_processor (task, proc, &info);
+    }
+    g_list_free (procs);
 }
 
 static void
@@ -1850,6 +3036,9 @@ free_task_resources (TransferTask *task)
         ptr = g_list_delete_link (ptr, ptr);
     }
 
+    if (task->type == TASK_TYPE_DOWNLOAD)
+        release_claimed_blocks (task);
+
     block_list_free (task->block_list);
     task->block_list = NULL;
     BitfieldDestruct (&task->active);
@@ -1954,53 +3143,49 @@ state_machine_tick (TransferTask *task)
 }
 
 
-static inline void 
-format_transfer_task_detail (TransferTask *task, GString *buf)
+/*
+ * Publish the state of a task in transfer:
+ *
+ *      transfer\t<tx-id>  [upload/download]\t[transfer-rate]\t[repo-name]
+ */
+static void
+publish_transfer_state (TransferTask *task)
 {
     SeafRepo *repo = seaf_repo_manager_get_repo (seaf->repo_mgr,
                                                  task->repo_id);
+    CloneTask *ctask;
     char *repo_name;
     char *type;
-    
+    char *key, *value;
+
     if (repo) {
         repo_name = repo->name;
         type = (task->type == TASK_TYPE_UPLOAD) ? "upload" : "download";
-        
     } else if (task->is_clone) {
-        CloneTask *ctask;
         ctask = seaf_clone_manager_get_task (seaf->clone_mgr, task->repo_id);
+        if (!ctask)
+            return;
         repo_name = ctask->repo_name;
         type = "download";
-        
     } else {
         return;
     }
-    int rate = (int)transfer_task_get_rate(task);
 
-    g_string_append_printf (buf, "%s\t%d %s\n", type, rate, repo_name);
+    key = g_strconcat ("transfer\t", task->tx_id, NULL);
+    value = g_strdup_printf ("%s\t%d\t%s", type,
+                             (int)transfer_task_get_rate(task), repo_name);
+    seaf_mq_manager_publish_state (seaf->mq_mgr, key, value);
+    g_free (key);
+    g_free (value);
 }
 
-/*
- * Publish a notification message to report :
- *
- *      [uploading/downloading]\t[transfer-rate] [repo-name]\n
- */
 static void
-send_transfer_message (GList *tasks)
+publish_transfer_finished (TransferTask *task)
 {
-    GList *ptr;
-    TransferTask *task;
-    GString *buf = g_string_new (NULL);
+    char *key = g_strconcat ("transfer\t", task->tx_id, NULL);
 
-    for (ptr = tasks; ptr; ptr = ptr->next) {
-        task = ptr->data;
-        format_transfer_task_detail(task, buf);
-    }
-        
-    seaf_mq_manager_publish_notification (seaf->mq_mgr, "transfer",
-                                          buf->str);
-
-    g_string_free (buf, TRUE);
+    seaf_mq_manager_publish_state (seaf->mq_mgr, key, "");
+    g_free (key);
 }
 
 static int
@@ -2011,8 +3196,6 @@ schedule_task_pulse (void *vmanager)
     gpointer key, value;
     TransferTask *task;
 
-    GList *tasks_in_transfer = NULL;
-
     g_hash_table_iter_init (&iter, mgr->download_tasks);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         task = value;
@@ -2021,7 +3204,7 @@ schedule_task_pulse (void *vmanager)
             && (task->runtime_state == TASK_RT_STATE_COMMIT ||
                 task->runtime_state == TASK_RT_STATE_FS ||
                 task->runtime_state == TASK_RT_STATE_DATA)) {
-            tasks_in_transfer = g_list_prepend (tasks_in_transfer, task);
+            publish_transfer_state (task);
         }
     }
 
@@ -2033,15 +3216,17 @@ schedule_task_pulse (void *vmanager)
             && (task->runtime_state == TASK_RT_STATE_COMMIT ||
                 task->runtime_state == TASK_RT_STATE_FS ||
                 task->runtime_state == TASK_RT_STATE_DATA)) {
-            tasks_in_transfer = g_list_prepend (tasks_in_transfer, task);
+            publish_transfer_state (task);
         }
     }
 
-    if (tasks_in_transfer) {
-        send_transfer_message (tasks_in_transfer);
-        g_list_free (tasks_in_transfer);
+    if (++mgr->limit_check_count >= RATE_LIMIT_CHECK_INTERVAL) {
+        mgr->limit_check_count = 0;
+        update_rate_limits (mgr);
     }
 
+    tick_histories (mgr);
+
     /* reset tx_bytes to 0 every second */
     g_hash_table_iter_init (&iter, mgr->download_tasks);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
@@ -4,8 +4,10 @@
 #define TRANSFER_MGR_H
 
 #include <glib.h>
+#include <pthread.h>
 #include <ccnet/timer.h>
 #include <ccnet/peer.h>
+#include <ccnet/processor.h>
 
 #include "bitfield.h"
 #include "object-list.h"
@@ -77,6 +79,67 @@ enum TaskError {
     N_TASK_ERROR,
 };
 
+/*
+ * Token bucket, shared by the block transfer threads of a task, or of
+ * all tasks.
+ */
+typedef struct RateLimiter {
+    pthread_mutex_t lock;
+    gint64          rate;       /* bytes per second, 0 for no limit */
+    gint64          tokens;
+    gint64          last_refill;
+} RateLimiter;
+
+#define MAX_BLOCK_WINDOW    256
+
+/*
+ * Number of blocks a block processor may have queued. It's adjusted
+ * from the measured block latency: grown while blocks come back about
+ * as fast as the lowest latency seen, halved when they start to queue up.
+ */
+typedef struct BlockWindow {
+    int          size;
+    int          acked;         /* blocks done in the current round */
+    gboolean     slow_start;
+    gint64       min_rtt;       /* lowest block latency, in us */
+    gint64       round_min_rtt; /* lowest latency in the current round */
+    gint64       interval;      /* smoothed time per block, in us */
+    gint64       last_done;
+    gint64       sent[MAX_BLOCK_WINDOW];   /* dispatch time of queued blocks */
+    int          head;
+    int          n_sent;
+} BlockWindow;
+
+#define TX_HISTORY_LEN      300     /* seconds */
+
+/* Block transfer counters of one second, or totals. */
+typedef struct TxSample {
+    gint64       time;          /* in seconds */
+    gint64       bytes;
+    gint64       min_rtt;       /* lowest block latency in us, 0 if none */
+    int          blocks;
+    int          retransmits;   /* queued blocks moved to other sources */
+    int          failures;      /* block processors that failed */
+} TxSample;
+
+/*
+ * Throughput history of a task or of a chunk server, one sample per
+ * second for the last TX_HISTORY_LEN seconds.
+ */
+typedef struct TxHistory {
+    TxSample     samples[TX_HISTORY_LEN];
+    int          head;          /* oldest sample */
+    int          n_samples;
+    TxSample     cur;           /* the current second */
+    TxSample     total;
+    gint64       last_active;   /* in seconds */
+
+    /* Last block window of a chunk server, so that the next processor
+     * starts from where the last one got to. */
+    int          window;
+    gint64       interval;
+} TxHistory;
+
 struct _SeafTransferManager;
 
 typedef struct {
@@ -97,6 +160,19 @@ typedef struct {
     gboolean     is_clone;      /* TRUE when fetching a new repo. */
     int          error;
 
+    /* Ids of the files whose blocks are fetched to hydrate placeholders.
+     * Such a task only downloads blocks and doesn't update any branch.
+     */
+    GList       *fetch_files;
+
+    /* Shallow clone, see KEY_CLONE_HISTORY. Only the fs of the last
+     * @history_depth commits, or of those since @history_since, is
+     * fetched. @history_boundary is the ctime of the oldest of them.
+     */
+    int          history_depth;
+    gint64       history_since;
+    gint64       history_boundary;
+
     char        *dest_id;
 
     ObjectList  *commits;       /* commits need to be sent/get */
@@ -104,16 +180,30 @@ typedef struct {
 
     GList       *chunk_servers;
     GHashTable  *processors;
+    GHashTable  *sources;       /* chunk server id -> failure history */
     BlockList   *block_list;
     Bitfield     active;
     gint         tx_bytes;      /* bytes transferred in the last second. */
 
+    /* Fields only used by download task. */
+    gboolean     lan_fetching;  /* a batch is being fetched from LAN peers */
+    gboolean     lan_done;      /* LAN peers have nothing more to offer */
+    int          lan_next;      /* next block index to ask LAN peers */
+
     /* Fields only used by upload task. */
     Bitfield     uploaded;
     int          n_uploaded;
 
     gint64       rsize;            /* size remain   */
     gint64       dsize;            /* size done     */
+
+    /* When the task entered each runtime state, in usec, or 0. The
+     * protocol phases are timed from these. */
+    gint64       rt_state_time[N_TASK_RT_STATE];
+
+    RateLimiter  limiter;       /* per repo limit */
+
+    TxHistory   *history;
 } TransferTask;
 
 const char *
@@ -128,6 +218,33 @@ task_error_str (int task_errno);
 double
 transfer_task_get_rate (TransferTask *task);
 
+/*
+ * Called by the block transfer threads after @n bytes are sent or
+ * received. Sleeps if the task or the global rate limit is exceeded.
+ */
+void
+transfer_task_throttle (TransferTask *task, int n);
+
+void
+block_window_init (BlockWindow *win);
+
+/*
+ * Called by a block processor when a queued block of @bytes is done,
+ * @pending is the number of blocks still queued on it. Updates the
+ * window and the history, and hands out more blocks if there is room.
+ */
+void
+transfer_task_block_done (TransferTask *task, CcnetProcessor *processor,
+                          int pending, int bytes);
+
+/*
+ * Called when block @idx of a download has been stored, before it's
+ * marked in the block map. The other downloads that need the block
+ * take it too.
+ */
+void
+transfer_task_block_fetched (TransferTask *task, int idx);
+
 void
 transfer_task_set_error (TransferTask *task, int error);
 
@@ -151,6 +268,19 @@ struct _SeafTransferManager {
     GHashTable      *upload_tasks;
 
     CcnetTimer      *schedule_timer;
+
+    RateLimiter      upload_limiter;
+    RateLimiter      download_limiter;
+    gboolean         limits_active;     /* in the configured limit hours */
+    int              limit_check_count;
+
+    GHashTable      *peer_history;      /* chunk server id -> TxHistory */
+
+    /* Blocks are stored once for all repos. A block being downloaded by
+     * one task is not requested by the others, which get it when it
+     * arrives. block id -> tx id of the task fetching it.
+     */
+    GHashTable      *fetching_blocks;
 };
 
 typedef struct _SeafTransferManager SeafTransferManager;
@@ -168,6 +298,18 @@ seaf_transfer_manager_add_download (SeafTransferManager *manager,
                                     const char *token,
                                     GError **error);
 
+/*
+ * Only fetch the blocks of @file_ids, whose fs objects are already local.
+ * Used to hydrate placeholder files.
+ */
+char *
+seaf_transfer_manager_add_block_fetch (SeafTransferManager *manager,
+                                       const char *repo_id,
+                                       const char *peer_id,
+                                       const char *token,
+                                       GList *file_ids,
+                                       GError **error);
+
 char *
 seaf_transfer_manager_add_upload (SeafTransferManager *manager,
                                   const char *repo_id,
@@ -201,4 +343,24 @@ seaf_transfer_manager_cancel_task (SeafTransferManager *manager,
 GList *
 seaf_transfer_manager_get_clone_heads (SeafTransferManager *mgr);
 
+/*
+ * One line per running task and per chunk server:
+ * task|peer \t repo or peer id \t bytes \t blocks \t retransmits
+ * \t failures \t min_rtt_us \t rate_10s \t rate_60s
+ * with totals since the task started, or the daemon for chunk servers,
+ * and the average rates in bytes per second.
+ */
+void
+seaf_transfer_manager_format_stats (SeafTransferManager *mgr, GString *buf);
+
+/*
+ * Per second history of the task of repo @id, or of chunk server @id,
+ * oldest first:
+ * time \t bytes \t blocks \t min_rtt_us \t retransmits \t failures
+ * Returns -1 if there is neither.
+ */
+int
+seaf_transfer_manager_format_history (SeafTransferManager *mgr,
+                                      const char *id, GString *buf);
+
 #endif
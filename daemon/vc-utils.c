@@ -6,9 +6,11 @@
 
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <glib/gstdio.h>
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 
 #include "utils.h"
 #include "fs-mgr.h"
@@ -106,13 +108,55 @@ commit_trees_cb (struct cache_tree *it, struct cache_entry **cache,
     return 0;
 }
 
+/*
+ * Write only the changed entries to the delta file if we can, since
+ * rewriting a large index on every change is slow.
+ */
+static int
+update_index_delta (struct index_state *istate, const char *index_path)
+{
+    char delta_path[PATH_MAX];
+    char delta_shadow[PATH_MAX];
+    int delta_fd;
+    int ret;
+
+    snprintf (delta_path, PATH_MAX, "%s%s", index_path, INDEX_DELTA_SUFFIX);
+    snprintf (delta_shadow, PATH_MAX, "%s.shadow", delta_path);
+    delta_fd = g_open (delta_shadow, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (delta_fd < 0) {
+        g_warning ("Failed to open shadow index delta: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    ret = write_index_delta (istate, index_path, delta_fd);
+    close (delta_fd);
+    if (ret != 0) {
+        if (ret < 0)
+            g_warning ("Failed to write shadow index delta: %s.\n",
+                       strerror(errno));
+        g_unlink (delta_shadow);
+        return ret;
+    }
+
+    if (ccnet_rename (delta_shadow, delta_path) < 0) {
+        g_warning ("Failed to update index delta errno=%d %s\n",
+                   errno, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 int
 update_index (struct index_state *istate, const char *index_path)
 {
     char index_shadow[PATH_MAX];
+    char delta_path[PATH_MAX];
     int index_fd;
     int ret = 0;
 
+    if (update_index_delta (istate, index_path) == 0)
+        return 0;
+
     snprintf (index_shadow, PATH_MAX, "%s.shadow", index_path);
     index_fd = g_open (index_shadow, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
     if (index_fd < 0) {
@@ -131,6 +175,10 @@ update_index (struct index_state *istate, const char *index_path)
         g_warning ("Failed to update index errno=%d %s\n", errno, strerror(errno));
         return -1;
     }
+
+    /* The delta doesn't match the new base any more. */
+    snprintf (delta_path, PATH_MAX, "%s%s", index_path, INDEX_DELTA_SUFFIX);
+    g_unlink (delta_path);
     return 0;
 }
 
@@ -198,15 +246,12 @@ unlink_entry (struct cache_entry *ce, struct unpack_trees_options *o)
 
 int
 compare_file_content (const char *path, struct stat *st, const unsigned char *ce_sha1,
-                      SeafileCrypt *crypt)
+                      SeafileCrypt *crypt, int chunker)
 {
     CDCFileDescriptor cdc;
     unsigned char sha1[20];
 
-    memset (&cdc, 0, sizeof(cdc));
-    cdc.block_sz = calculate_chunk_size (st->st_size);
-    cdc.block_min_sz = cdc.block_sz >> 2;
-    cdc.block_max_sz = cdc.block_sz << 2;
+    prepare_cdc_file_descriptor (&cdc, path, st->st_size, chunker);
     cdc.write_block = seafile_write_chunk;
     if (filename_chunk_cdc (path, &cdc, crypt, FALSE) < 0) {
         g_warning ("Failed to chunk file.\n");
@@ -222,19 +267,168 @@ compare_file_content (const char *path, struct stat *st, const unsigned char *ce
     return hashcmp (sha1, ce_sha1);
 }
 
+/*
+ * Files are written by this many threads during checkout, 1 to write
+ * them one by one.
+ */
+#define KEY_CHECKOUT_THREADS        "checkout_threads"
+#define DEFAULT_CHECKOUT_THREADS    4
+#define MAX_CHECKOUT_THREADS        32
+
+struct CheckoutJournal {
+    FILE *fp;
+    pthread_mutex_t lock;
+    /* path -> JournalEntry, files written before the interruption. */
+    GHashTable *done;
+};
+
+typedef struct {
+    char file_id[41];
+    gint64 mtime;
+    gint64 size;
+} JournalEntry;
+
+static void
+journal_load (CheckoutJournal *journal, FILE *fp, const char *root_id)
+{
+    char line[PATH_MAX + 128];
+    char *name;
+    JournalEntry *entry;
+    gint64 mtime, size;
+    char file_id[41];
+    int len, n;
+
+    if (!fgets (line, sizeof(line), fp) ||
+        strncmp (line, root_id, 40) != 0 || line[40] != '\n')
+        return;
+
+    while (fgets (line, sizeof(line), fp)) {
+        len = strlen (line);
+        /* A line cut by the interruption is ignored. */
+        if (len == 0 || line[len-1] != '\n')
+            break;
+        line[len-1] = '\0';
+
+        if (sscanf (line, "%40s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %n",
+                    file_id, &mtime, &size, &n) != 3)
+            break;
+        name = line + n;
+
+        entry = g_new0 (JournalEntry, 1);
+        memcpy (entry->file_id, file_id, 41);
+        entry->mtime = mtime;
+        entry->size = size;
+        g_hash_table_replace (journal->done, g_strdup (name), entry);
+    }
+}
+
+CheckoutJournal *
+checkout_journal_open (const char *path, const char *root_id)
+{
+    CheckoutJournal *journal;
+    FILE *fp;
+
+    journal = g_new0 (CheckoutJournal, 1);
+    journal->done = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+
+    fp = g_fopen (path, "rb");
+    if (fp) {
+        journal_load (journal, fp, root_id);
+        fclose (fp);
+    }
+
+    /* A journal of another root is of no use, start over. */
+    if (g_hash_table_size (journal->done) > 0)
+        journal->fp = g_fopen (path, "ab");
+    else {
+        journal->fp = g_fopen (path, "wb");
+        if (journal->fp)
+            fprintf (journal->fp, "%s\n", root_id);
+    }
+    if (!journal->fp) {
+        g_warning ("Failed to open checkout journal %s: %s.\n",
+                   path, strerror(errno));
+        g_hash_table_destroy (journal->done);
+        g_free (journal);
+        return NULL;
+    }
+
+    if (g_hash_table_size (journal->done) > 0)
+        seaf_message ("Resume checkout, %u files are already written.\n",
+                      g_hash_table_size (journal->done));
+
+    pthread_mutex_init (&journal->lock, NULL);
+    return journal;
+}
+
+void
+checkout_journal_close (CheckoutJournal *journal)
+{
+    if (!journal)
+        return;
+
+    fclose (journal->fp);
+    pthread_mutex_destroy (&journal->lock);
+    g_hash_table_destroy (journal->done);
+    g_free (journal);
+}
+
+/* Whether the file of @ce at @st was written by the interrupted checkout. */
+static gboolean
+journal_file_done (CheckoutJournal *journal, struct cache_entry *ce,
+                   struct stat *st)
+{
+    JournalEntry *entry;
+    char file_id[41];
+
+    entry = g_hash_table_lookup (journal->done, ce->name);
+    if (!entry)
+        return FALSE;
+
+    rawdata_to_hex (ce->sha1, file_id, 20);
+    return (strcmp (entry->file_id, file_id) == 0 &&
+            entry->mtime == (gint64)st->st_mtime &&
+            entry->size == (gint64)st->st_size);
+}
+
+static void
+journal_add_file (CheckoutJournal *journal, struct cache_entry *ce,
+                  struct stat *st)
+{
+    char file_id[41];
+
+    rawdata_to_hex (ce->sha1, file_id, 20);
+
+    pthread_mutex_lock (&journal->lock);
+    fprintf (journal->fp, "%s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %s\n",
+             file_id, (gint64)st->st_mtime, (gint64)st->st_size, ce->name);
+    fflush (journal->fp);
+    pthread_mutex_unlock (&journal->lock);
+}
+
+enum {
+    CHECKOUT_DONE = 0,
+    CHECKOUT_FILE,
+};
+
+/*
+ * Everything of checking out @ce but writing the file: create the
+ * leading directories and check that the file in the worktree can be
+ * replaced. Returns CHECKOUT_FILE if the file has to be written to
+ * @path, CHECKOUT_DONE if nothing is left to do, or -1.
+ */
 static int
-checkout_entry (struct cache_entry *ce,
-                struct unpack_trees_options *o,
-                gboolean recover_merge,
-                const char *conflict_suffix)
+prepare_checkout (struct cache_entry *ce,
+                  struct unpack_trees_options *o,
+                  gboolean recover_merge,
+                  char *path)
 {
     int base_len = strlen(o->base);
     int len = ce_namelen(ce);
     int full_len;
-    char path[PATH_MAX];
     int offset;
     struct stat st;
-    char file_id[41];
 
     if (!len) {
         g_warning ("entry name should not be empty.\n");
@@ -284,7 +478,13 @@ checkout_entry (struct cache_entry *ce,
         if (g_mkdir (path, 0777) < 0) {
             g_warning ("Failed to create empty dir %s.\n", path);
         }
-        return 0;
+        return CHECKOUT_DONE;
+    }
+
+    if (o->journal && g_lstat (path, &st) == 0 && S_ISREG(st.st_mode) &&
+        journal_file_done (o->journal, ce, &st)) {
+        fill_stat_cache_info (ce, &st);
+        return CHECKOUT_DONE;
     }
 
     if (!o->reset && g_lstat (path, &st) == 0 && S_ISREG(st.st_mode) &&
@@ -296,7 +496,8 @@ checkout_entry (struct cache_entry *ce,
          * cache entry.
          */
         if (!recover_merge || 
-            compare_file_content (path, &st, ce->sha1, o->crypt) != 0) {
+            compare_file_content (path, &st, ce->sha1,
+                                  o->crypt, o->chunker) != 0) {
             g_warning ("File %s is changed. Skip checking out.\n", path);
             return -1;
         }
@@ -305,26 +506,150 @@ checkout_entry (struct cache_entry *ce,
          * We were interrupted before updating the index, update index
          * entry timestamp now.
          */
-        goto update_cache;
+        g_lstat (path, &st);
+        fill_stat_cache_info (ce, &st);
+        return CHECKOUT_DONE;
+    }
+
+    return CHECKOUT_FILE;
+}
+
+/*
+ * Create @path with the size of the file of @ce, but none of its blocks.
+ * Placeholders are read-only until they're hydrated, so that programs
+ * can't change the zeros in place and have them taken for the content.
+ */
+static int
+checkout_placeholder (struct cache_entry *ce, const char *path)
+{
+    char file_id[41];
+    gint64 size;
+    int fd;
+
+    rawdata_to_hex (ce->sha1, file_id, 20);
+    size = seaf_fs_manager_get_file_size (seaf->fs_mgr, file_id);
+    if (size < 0)
+        return -1;
+
+    /* An older placeholder can't be opened for writing. */
+    g_unlink (path);
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                 ce_permissions (ce->ce_mode) & ~0222);
+    if (fd < 0) {
+        g_warning ("Failed to create placeholder %s: %s.\n",
+                   path, strerror(errno));
+        return -1;
+    }
+    if (ftruncate (fd, size) < 0) {
+        g_warning ("Failed to resize placeholder %s: %s.\n",
+                   path, strerror(errno));
+        close (fd);
+        return -1;
+    }
+    close (fd);
+
+    return 0;
+}
+
+/*
+ * Write the file of @ce to @path and update its index entry. The index
+ * is shared by the checkout threads, @index_lock protects it if not NULL.
+ */
+static int
+checkout_file (struct cache_entry *ce,
+               struct unpack_trees_options *o,
+               const char *path,
+               const char *conflict_suffix,
+               pthread_mutex_t *index_lock)
+{
+    struct stat st;
+    char file_id[41];
+    uint32_t *block_sizes = NULL, n_blocks = 0;
+
+    if (ce_placeholder (ce)) {
+        if (checkout_placeholder (ce, path) < 0)
+            return -1;
+        g_lstat (path, &st);
+        fill_stat_cache_info (ce, &st);
+        if (o->journal)
+            journal_add_file (o->journal, ce, &st);
+        return 0;
     }
 
-    /* then checkout the file. */
     rawdata_to_hex (ce->sha1, file_id, 20);
     if (seaf_fs_manager_checkout_file (seaf->fs_mgr, file_id,
                                        path, ce->ce_mode,
-                                       o->crypt, conflict_suffix) < 0) {
+                                       o->crypt, conflict_suffix,
+                                       &block_sizes, &n_blocks) < 0) {
         g_warning ("Failed to checkout file %s.\n", path);
         return -1;
     }
 
-update_cache:
+    /* Saves reading the blocks when the file is changed and indexed. */
+    if (index_lock)
+        pthread_mutex_lock (index_lock);
+    index_set_blocks (&o->result, ce->name, ce->sha1, block_sizes, n_blocks);
+    if (index_lock)
+        pthread_mutex_unlock (index_lock);
+    free (block_sizes);
+
     /* finally fill cache_entry info */
     g_lstat (path, &st);
     fill_stat_cache_info (ce, &st);
+    if (o->journal)
+        journal_add_file (o->journal, ce, &st);
 
     return 0;
 }
 
+typedef struct {
+    struct unpack_trees_options *o;
+    pthread_mutex_t lock;
+    int errs;
+    int *finished_entries;
+} CheckoutData;
+
+typedef struct {
+    struct cache_entry *ce;
+    char *conflict_suffix;
+    char path[PATH_MAX];
+} CheckoutJob;
+
+static void
+checkout_job (gpointer vjob, gpointer vdata)
+{
+    CheckoutJob *job = vjob;
+    CheckoutData *data = vdata;
+    int ret;
+
+    ret = checkout_file (job->ce, data->o, job->path, job->conflict_suffix,
+                         &data->lock);
+    if (ret < 0) {
+        pthread_mutex_lock (&data->lock);
+        data->errs = 1;
+        pthread_mutex_unlock (&data->lock);
+    }
+
+    if (data->finished_entries)
+        g_atomic_int_inc (data->finished_entries);
+
+    g_free (job->conflict_suffix);
+    g_free (job);
+}
+
+static int
+get_checkout_threads ()
+{
+    gboolean exists;
+    int n;
+
+    n = seafile_session_config_get_int (seaf, KEY_CHECKOUT_THREADS, &exists);
+    if (!exists || n <= 0)
+        return DEFAULT_CHECKOUT_THREADS;
+
+    return MIN (n, MAX_CHECKOUT_THREADS);
+}
+
 int
 update_worktree (struct unpack_trees_options *o,
                  gboolean recover_merge,
@@ -333,9 +658,13 @@ update_worktree (struct unpack_trees_options *o,
                  int *finished_entries)
 {
     struct index_state *result = &o->result;
-    int i;
+    int i, ret;
     struct cache_entry *ce;
     char *conflict_suffix = NULL;
+    CheckoutData data;
+    CheckoutJob *job;
+    GThreadPool *pool = NULL;
+    int n_threads;
     int errs = 0;
 
     for (i = 0; i < result->cache_nr; ++i) {
@@ -344,29 +673,67 @@ update_worktree (struct unpack_trees_options *o,
             errs |= unlink_entry (ce, o);
     }
 
+    memset (&data, 0, sizeof(data));
+    data.o = o;
+    data.finished_entries = finished_entries;
+    pthread_mutex_init (&data.lock, NULL);
+
+    /* Directories are created and worktree files checked here, in index
+     * order. Only writing the files is done by the pool, which finishes
+     * all of them before we return.
+     */
+    n_threads = get_checkout_threads ();
+    if (n_threads > 1)
+        pool = g_thread_pool_new (checkout_job, &data, n_threads, FALSE, NULL);
+
     for (i = 0; i < result->cache_nr; ++i) {
         ce = result->cache[i];
-        if (ce->ce_flags & CE_UPDATE) {
-            if (conflict_head_id) {
-                conflict_suffix = get_last_changer_of_file (conflict_head_id,
-                                                            ce->name);
-                if (!conflict_suffix)
-                    conflict_suffix = g_strdup(default_conflict_suffix);
-            }
-            errs |= checkout_entry (ce, o, recover_merge, conflict_suffix);
-            g_free (conflict_suffix);
+        if (!(ce->ce_flags & CE_UPDATE)) {
+            if (finished_entries)
+                g_atomic_int_inc (finished_entries);
+            continue;
+        }
+
+        job = g_new0 (CheckoutJob, 1);
+        job->ce = ce;
+
+        ret = prepare_checkout (ce, o, recover_merge, job->path);
+        if (ret != CHECKOUT_FILE) {
+            if (ret < 0)
+                errs = 1;
+            if (finished_entries)
+                g_atomic_int_inc (finished_entries);
+            g_free (job);
+            continue;
         }
-        if (finished_entries)
-            *finished_entries = *finished_entries + 1;
+
+        if (conflict_head_id) {
+            conflict_suffix = get_last_changer_of_file (conflict_head_id,
+                                                        ce->name);
+            if (!conflict_suffix)
+                conflict_suffix = g_strdup(default_conflict_suffix);
+        }
+        job->conflict_suffix = conflict_suffix;
+        conflict_suffix = NULL;
+
+        if (pool)
+            g_thread_pool_push (pool, job, NULL);
+        else
+            checkout_job (job, &data);
     }
 
+    if (pool)
+        g_thread_pool_free (pool, FALSE, TRUE);
+    pthread_mutex_destroy (&data.lock);
+
+    errs |= data.errs;
     return errs != 0;
 }
 
 #ifdef WIN32
 
-static gboolean
-do_check_file_locked (const char *path, const char *worktree)
+gboolean
+file_locked_on_windows (const char *path, const char *worktree)
 {
     char *real_path;
     HANDLE handle;
@@ -425,13 +792,13 @@ files_locked_on_windows (struct index_state *index, const char *worktree)
                 mask == 6 ||    /* both added */
                 mask == 3)      /* others removed */
             {
-                if (do_check_file_locked (ce->name, worktree))
+                if (file_locked_on_windows (ce->name, worktree))
                     ret = TRUE;
                     break;
             }
         } else if (ce->ce_flags & CE_UPDATE ||
                    ce->ce_flags & CE_WT_REMOVE) {
-            if (do_check_file_locked (ce->name, worktree)) {
+            if (file_locked_on_windows (ce->name, worktree)) {
                 ret = TRUE;
                 break;
             }
@@ -463,6 +830,75 @@ fill_seafile_blocks (const unsigned char *sha1, BlockList *bl)
     seafile_unref (seafile);
 }
 
+gboolean
+sparse_path_included (char **paths, const char *path, gboolean is_dir)
+{
+    int len, plen, i;
+
+    if (!paths || path[0] == 0)
+        return TRUE;
+
+    /* Entries directly under the root are always synced. */
+    if (!is_dir && !strchr (path, '/'))
+        return TRUE;
+
+    len = strlen (path);
+    for (i = 0; paths[i] != NULL; ++i) {
+        plen = strlen (paths[i]);
+        /* At or under the folder. */
+        if (len >= plen && strncmp (path, paths[i], plen) == 0 &&
+            (path[plen] == 0 || path[plen] == '/'))
+            return TRUE;
+        /* A parent dir of the folder, which has to be walked into. */
+        if (is_dir && plen > len && strncmp (paths[i], path, len) == 0 &&
+            paths[i][len] == '/')
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+void
+apply_sparse_paths (struct index_state *istate, char **paths,
+                    gboolean checkout)
+{
+    struct cache_entry *ce;
+    int i;
+
+    if (!paths && !checkout)
+        return;
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = istate->cache[i];
+        if (!sparse_path_included (paths, ce->name, FALSE)) {
+            ce->ce_flags &= ~(CE_UPDATE | CE_WT_REMOVE);
+            ce->ce_flags |= CE_SKIP_WORKTREE;
+        } else if (checkout && ce_skip_worktree (ce)) {
+            ce->ce_flags &= ~CE_SKIP_WORKTREE;
+            if (!(ce->ce_flags & CE_REMOVE) && !ce_stage (ce))
+                ce->ce_flags |= CE_UPDATE;
+        }
+    }
+}
+
+void
+mark_placeholders (struct index_state *result, struct index_state *src)
+{
+    struct cache_entry *ce, *old;
+    int i;
+
+    for (i = 0; i < result->cache_nr; ++i) {
+        ce = result->cache[i];
+        if (!(ce->ce_flags & CE_UPDATE) || !S_ISREG(ce->ce_mode) ||
+            ce_stage (ce))
+            continue;
+
+        old = index_name_exists (src, ce->name, ce_namelen(ce), 0);
+        if (!old || ce_placeholder (old))
+            ce->ce_flags |= CE_PLACEHOLDER;
+    }
+}
+
 void
 collect_new_blocks_from_index (struct index_state *index, BlockList *bl)
 {
@@ -471,7 +907,7 @@ collect_new_blocks_from_index (struct index_state *index, BlockList *bl)
 
     for (i = 0; i < index->cache_nr; ++i) {
         ce = index->cache[i];
-        if (ce->ce_flags & CE_UPDATE)
+        if ((ce->ce_flags & CE_UPDATE) && !ce_placeholder (ce))
             fill_seafile_blocks (ce->sha1, bl);
     }
 }
@@ -26,6 +26,23 @@ commit_trees_cb (struct cache_tree *it, struct cache_entry **cache,
 int
 update_index (struct index_state *istate, const char *index_path);
 
+/*
+ * The files written by a checkout are appended to a journal next to the
+ * index, with their ids, mtimes and sizes. When the checkout of the same
+ * root is started again after an interruption, files whose stat still
+ * matches the journal are not written again. The journal is removed
+ * once the index is updated.
+ */
+#define CHECKOUT_JOURNAL_SUFFIX ".checkout"
+
+typedef struct CheckoutJournal CheckoutJournal;
+
+CheckoutJournal *
+checkout_journal_open (const char *path, const char *root_id);
+
+void
+checkout_journal_close (CheckoutJournal *journal);
+
 int
 update_worktree (struct unpack_trees_options *o,
                  gboolean recover_merge,
@@ -36,15 +53,47 @@ update_worktree (struct unpack_trees_options *o,
 gboolean
 files_locked_on_windows (struct index_state *index, const char *worktree);
 
+/* Whether @path in @worktree is opened without sharing by a program. */
+gboolean
+file_locked_on_windows (const char *path, const char *worktree);
+
 int
 compare_file_content (const char *path, struct stat *st, 
                       const unsigned char *ce_sha1,
-                      struct SeafileCrypt *crypt);
+                      struct SeafileCrypt *crypt,
+                      int chunker);
 
 void
 fill_seafile_blocks (const unsigned char *sha1, BlockList *bl);
 
+/*
+ * Check out the new files in @result, and the updated ones that are
+ * placeholders in @src, as placeholders: files of the right size whose
+ * content is only fetched by seaf_repo_hydrate_file().
+ */
+void
+mark_placeholders (struct index_state *result, struct index_state *src);
+
+/* Blocks of the entries to be checked out, except placeholders. */
 void
 collect_new_blocks_from_index (struct index_state *index, BlockList *bl);
 
+/*
+ * Sparse sync. @paths are folders relative to the worktree, NULL means
+ * the whole tree. Whether @path is synced; a dir is also walked into
+ * if it is a parent of one of the folders.
+ */
+gboolean
+sparse_path_included (char **paths, const char *path, gboolean is_dir);
+
+/*
+ * Mark the entries of @istate outside @paths skip-worktree. They stay
+ * in the index, so commits keep them, but they are neither checked out
+ * nor scanned. With @checkout, entries that are in @paths again lose
+ * the flag and are marked to be checked out.
+ */
+void
+apply_sparse_paths (struct index_state *istate, char **paths,
+                    gboolean checkout);
+
 #endif
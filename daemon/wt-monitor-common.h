@@ -3,6 +3,90 @@
 #ifndef WT_MONITOR_COMMON_H
 #define WT_MONITOR_COMMON_H
 
+static WTStatus *
+wt_status_new (const char *repo_id)
+{
+    WTStatus *status = g_new0 (WTStatus, 1);
+
+    memcpy (status->repo_id, repo_id, 37);
+    pthread_mutex_init (&status->journal_lock, NULL);
+    /* Changes made before the repo is watched are unknown. */
+    status->journal_overflow = TRUE;
+
+    return status;
+}
+
+static void
+wt_status_free (WTStatus *status)
+{
+    if (status->changed_paths)
+        g_hash_table_destroy (status->changed_paths);
+    pthread_mutex_destroy (&status->journal_lock);
+    g_free (status);
+}
+
+/* Whether @path or one of its parent dirs is in @paths. */
+static gboolean
+journal_covers_path (GHashTable *paths, const char *path)
+{
+    char buf[PATH_MAX];
+    char *slash;
+
+    g_strlcpy (buf, path, sizeof(buf));
+    while (1) {
+        if (g_hash_table_lookup (paths, buf))
+            return TRUE;
+        slash = strrchr (buf, '/');
+        if (!slash)
+            return FALSE;
+        *slash = 0;
+    }
+}
+
+void
+wt_status_add_changed_path (WTStatus *status, const char *path)
+{
+    char *key;
+
+    pthread_mutex_lock (&status->journal_lock);
+
+    if (status->journal_overflow)
+        goto out;
+
+    if (!status->changed_paths)
+        status->changed_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free, NULL);
+
+    /* Dirs are indexed recursively, paths under them are covered. */
+    if (journal_covers_path (status->changed_paths, path))
+        goto out;
+
+    if (g_hash_table_size (status->changed_paths) >= WT_JOURNAL_MAX_PATHS) {
+        g_hash_table_destroy (status->changed_paths);
+        status->changed_paths = NULL;
+        status->journal_overflow = TRUE;
+        goto out;
+    }
+
+    key = g_strdup (path);
+    g_hash_table_insert (status->changed_paths, key, key);
+
+out:
+    pthread_mutex_unlock (&status->journal_lock);
+}
+
+void
+wt_status_set_journal_overflow (WTStatus *status)
+{
+    pthread_mutex_lock (&status->journal_lock);
+    if (status->changed_paths) {
+        g_hash_table_destroy (status->changed_paths);
+        status->changed_paths = NULL;
+    }
+    status->journal_overflow = TRUE;
+    pthread_mutex_unlock (&status->journal_lock);
+}
+
 SeafWTMonitor *
 seaf_wt_monitor_new (SeafileSession *seaf)
 {
@@ -13,7 +97,7 @@ seaf_wt_monitor_new (SeafileSession *seaf)
         (g_str_hash, g_str_equal, g_free, NULL);
 
     priv->status_hash = g_hash_table_new_full
-        (g_direct_hash, g_direct_equal, NULL, g_free);
+        (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)wt_status_free);
 
 #ifdef WIN32
     priv->buf_hash = g_hash_table_new_full
@@ -149,6 +233,78 @@ seaf_wt_monitor_get_worktree_status (SeafWTMonitor *monitor,
     return (WTStatus *)g_hash_table_lookup(monitor->priv->status_hash, value);
 }
 
+gboolean
+seaf_wt_monitor_take_changed_paths (SeafWTMonitor *monitor,
+                                    const char *repo_id,
+                                    GList **paths)
+{
+    WTStatus *status;
+    gboolean ret;
+
+    *paths = NULL;
+
+    status = seaf_wt_monitor_get_worktree_status (monitor, repo_id);
+    if (!status)
+        return FALSE;
+
+    pthread_mutex_lock (&status->journal_lock);
+
+    ret = !status->journal_overflow;
+    if (status->changed_paths) {
+        GHashTableIter iter;
+        gpointer key;
+
+        g_hash_table_iter_init (&iter, status->changed_paths);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+            *paths = g_list_prepend (*paths, key);
+            g_hash_table_iter_steal (&iter);
+        }
+    }
+    /* Record again from now on. */
+    status->journal_overflow = FALSE;
+    status->taken_event_id = status->last_event_id;
+
+    pthread_mutex_unlock (&status->journal_lock);
+
+    if (!ret) {
+        string_list_free (*paths);
+        *paths = NULL;
+    }
+    return ret;
+}
+
+void
+seaf_wt_monitor_invalidate_changed_paths (SeafWTMonitor *monitor,
+                                          const char *repo_id)
+{
+    WTStatus *status;
+
+    status = seaf_wt_monitor_get_worktree_status (monitor, repo_id);
+    if (status)
+        wt_status_set_journal_overflow (status);
+}
+
+void
+seaf_wt_monitor_paths_indexed (SeafWTMonitor *monitor, const char *repo_id)
+{
+    WTStatus *status;
+    guint64 event_id;
+
+    status = seaf_wt_monitor_get_worktree_status (monitor, repo_id);
+    if (!status)
+        return;
+
+    pthread_mutex_lock (&status->journal_lock);
+    event_id = status->taken_event_id;
+    status->taken_event_id = 0;
+    pthread_mutex_unlock (&status->journal_lock);
+
+#ifdef __APPLE__
+    if (event_id != 0)
+        save_indexed_event_id (repo_id, event_id);
+#endif
+}
+
 static void
 reply_watch_command (SeafWTMonitorPriv *priv, int result)
 {
@@ -171,15 +327,15 @@ handle_watch_command (SeafWTMonitorPriv *priv, WatchCommand *cmd)
             return;
         }
 
-        if (handle_add_repo(priv, cmd->repo_id, &inotify_fd) < 0) {
+        status = wt_status_new (cmd->repo_id);
+        if (handle_add_repo(priv, cmd->repo_id, status, &inotify_fd) < 0) {
             seaf_warning ("[wt mon] failed to watch worktree of repo %s.\n", cmd->repo_id);
+            wt_status_free (status);
             reply_watch_command (priv, -1);
             return;
         }
 
         g_hash_table_insert (priv->handle_hash, g_strdup(cmd->repo_id), (gpointer)(long)inotify_fd);
-        status = g_new0 (WTStatus, 1);
-        memcpy (status->repo_id, cmd->repo_id, 37);
         g_hash_table_insert (priv->status_hash, (gpointer)(long)inotify_fd, status);
 
         seaf_debug ("[wt mon] add watch for repo %s\n", cmd->repo_id);
@@ -192,8 +348,9 @@ handle_watch_command (SeafWTMonitorPriv *priv, WatchCommand *cmd)
         }
 
         g_hash_table_remove (priv->handle_hash, cmd->repo_id);
-        g_hash_table_remove (priv->status_hash, value);
+        /* Stop the watch before its status is freed. */
         handle_rm_repo (priv, value);
+        g_hash_table_remove (priv->status_hash, value);
         reply_watch_command (priv, 0);
     } else if (cmd->type ==  CMD_REFRESH_WATCH) {
         if (handle_refresh_repo (priv, cmd->repo_id) < 0) {
@@ -13,6 +13,7 @@
 #include "seafile-session.h"
 #include "utils.h"
 #include "wt-monitor.h"
+#include "vc-utils.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_WATCH
 #include "log.h"
 
@@ -28,12 +29,37 @@ typedef struct WatchCommand {
     char repo_id[37];
 } WatchCommand;
 
-#define DIR_WATCH_MASK IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
-#define FILE_WATCH_MASK IN_MODIFY | IN_ATTRIB
+/*
+ * Only directories are watched. A directory watch also reports changes to
+ * the files in it, so there is no need to spend one watch on every file.
+ */
+#define DIR_WATCH_MASK IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_ONLYDIR
+
+/*
+ * Maps inotify watch descriptors back to the paths they watch.
+ * The watches of a new repo are registered by a background thread,
+ * so @wd_paths is protected by @lock.
+ */
+typedef struct RepoWatchInfo {
+    char *worktree;
+    int wt_len;
+    int inotify_fd;
+    WTStatus *status;
+    GHashTable *wd_paths;   /* wd -> path relative to worktree */
+    char **sparse_paths;    /* folders not synced are not watched */
+    pthread_mutex_t lock;
+
+    pthread_t reg_thread;
+    gboolean reg_started;
+    volatile gint registering;
+    volatile gint cancelled;
+} RepoWatchInfo;
 
 struct SeafWTMonitorPriv {
     GHashTable *handle_hash;        /* repo_id -> inotify_fd (or handle) */
     GHashTable *status_hash;    /* inotify_df (or handle) -> wt status */
+    GHashTable *info_hash;      /* inotify_fd -> RepoWatchInfo */
     ccnet_pipe_t cmd_pipe[2];
     ccnet_pipe_t res_pipe[2];
     fd_set read_fds;
@@ -42,65 +68,153 @@ struct SeafWTMonitorPriv {
 
 static void handle_watch_command (SeafWTMonitorPriv *priv, WatchCommand *cmd);
 
+static void
+repo_watch_info_free (RepoWatchInfo *info)
+{
+    g_free (info->worktree);
+    g_hash_table_destroy (info->wd_paths);
+    g_strfreev (info->sparse_paths);
+    pthread_mutex_destroy (&info->lock);
+    g_free (info);
+}
+
+static void
+record_watch (RepoWatchInfo *info, int wd, const char *path)
+{
+    const char *rel = path + info->wt_len;
+
+    while (*rel == '/')
+        ++rel;
+    pthread_mutex_lock (&info->lock);
+    g_hash_table_replace (info->wd_paths, (gpointer)(long)wd, g_strdup(rel));
+    pthread_mutex_unlock (&info->lock);
+}
+
+/* Returns a copy of the path watched by @wd, or NULL. */
+static char *
+lookup_watch (RepoWatchInfo *info, int wd)
+{
+    char *path;
+
+    pthread_mutex_lock (&info->lock);
+    path = g_strdup (g_hash_table_lookup (info->wd_paths, (gpointer)(long)wd));
+    pthread_mutex_unlock (&info->lock);
+
+    return path;
+}
+
+static void
+remove_watch (RepoWatchInfo *info, int wd)
+{
+    pthread_mutex_lock (&info->lock);
+    g_hash_table_remove (info->wd_paths, (gpointer)(long)wd);
+    pthread_mutex_unlock (&info->lock);
+}
+
+/*
+ * Add watches to @path and all dirs under it. Files are skipped, their
+ * changes are reported by the watch on the parent dir.
+ */
 static int
-add_watch_recursive (int in_fd, char *path, int pathlen)
+add_watch_recursive (RepoWatchInfo *info, int in_fd, char *path, int pathlen)
 {
-    struct stat st;
+    int wd;
     DIR *dir;
     struct dirent *dent;
+    struct stat st;
+    int ret = 0;
+
+    wd = inotify_add_watch (in_fd, path, (uint32_t)(DIR_WATCH_MASK));
+    if (wd < 0) {
+        /* Not a dir or removed in the mean time. */
+        if (errno == ENOTDIR || errno == ENOENT)
+            return 0;
+        seaf_warning ("[wt mon] fail to add watch to %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+    record_watch (info, wd, path);
 
-    if (stat (path, &st) < 0) {
-        seaf_warning ("[wt mon] fail to stat %s: %s\n", path, strerror(errno));
+    dir = opendir (path);
+    if (!dir) {
+        if (errno == ENOENT || errno == ENOTDIR)
+            return 0;
+        seaf_warning ("[wt mon] fail to open dir %s: %s.\n", path, strerror(errno));
         return -1;
     }
 
-    if (S_ISREG (st.st_mode)) {
-        if (inotify_add_watch (in_fd, path, (uint32_t)FILE_WATCH_MASK) < 0) {
-            seaf_warning ("[wt mon] fail to add watch to %s: %s.\n", path, strerror(errno));
-            return -1;
-        }
-    } else if (S_ISDIR (st.st_mode)) {
-        if (inotify_add_watch (in_fd, path, (uint32_t)DIR_WATCH_MASK) < 0) {
-            seaf_warning ("[wt mon] fail to add watch to %s: %s.\n", path, strerror(errno));
-            return -1;
-        }
+    errno = 0;
+    while (1) {
+        dent = readdir (dir);
+        if (!dent)
+            break;
+        if (strcmp (dent->d_name, ".") == 0 ||
+            strcmp (dent->d_name, "..") == 0)
+            continue;
+        if (g_atomic_int_get (&info->cancelled))
+            break;
 
-        dir = opendir (path);
-        if (!dir) {
-            seaf_warning ("[wt mon] fail to open dir %s: %s.\n", path, strerror(errno));
-            return -1;
-        }
+        int len = snprintf (path + pathlen, PATH_MAX - pathlen, "/%s", dent->d_name);
+        if (len >= PATH_MAX - pathlen)
+            continue;
 
-        errno = 0;
-        while (1) {
-            dent = readdir (dir);
-            if (!dent)
-                break;
-            if (strcmp (dent->d_name, ".") == 0 ||
-                strcmp (dent->d_name, "..") == 0)
+        /* Symlinks are not synced, don't follow them. */
+        if (dent->d_type == DT_UNKNOWN) {
+            if (lstat (path, &st) < 0 || !S_ISDIR(st.st_mode))
                 continue;
-
-            int len = snprintf (path + pathlen, PATH_MAX, "/%s", dent->d_name);
-            if (add_watch_recursive (in_fd, path, pathlen + len) < 0)
-                return -1;
-        }
-        if (errno != 0) {
-            seaf_warning ("[wt mon] fail to read dir: %s.\n", strerror(errno));
-            return -1;
+        } else if (dent->d_type != DT_DIR) {
+            continue;
         }
 
-        closedir (dir);
+        if (!sparse_path_included (info->sparse_paths,
+                                   path + info->wt_len + 1, TRUE))
+            continue;
+
+        if (add_watch_recursive (info, in_fd, path, pathlen + len) < 0) {
+            ret = -1;
+            break;
+        }
+        errno = 0;
+    }
+    if (ret == 0 && errno != 0) {
+        seaf_warning ("[wt mon] fail to read dir: %s.\n", strerror(errno));
+        ret = -1;
     }
 
-    return 0;
+    path[pathlen] = 0;
+    closedir (dir);
+    return ret;
 }
 
+static void *
+register_watches (void *vinfo)
+{
+    RepoWatchInfo *info = vinfo;
+    char path[PATH_MAX];
+
+    g_strlcpy (path, info->worktree, PATH_MAX);
+    if (add_watch_recursive (info, info->inotify_fd, path, strlen(path)) < 0)
+        seaf_warning ("[wt mon] failed to watch all dirs of %s.\n", info->worktree);
+
+    /* Changes in dirs that were not watched yet have been missed. A commit
+     * taken from the journal during registration may also miss them.
+     */
+    wt_status_set_journal_overflow (info->status);
+    g_atomic_int_set (&info->registering, 0);
+
+    return NULL;
+}
+
+/*
+ * Watches are registered in the background, so that watching a large
+ * worktree doesn't block the caller. Several repos can be registered in
+ * parallel.
+ */
 static int
-add_watch (const char *repo_id)
+add_watch (SeafWTMonitorPriv *priv, const char *repo_id, WTStatus *status)
 {
     SeafRepo *repo;
     int inotify_fd;
-    char path[PATH_MAX];
+    RepoWatchInfo *info;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
@@ -114,12 +228,32 @@ add_watch (const char *repo_id)
         return -1;
     }
 
-    g_strlcpy (path, repo->worktree, PATH_MAX);
-    if (add_watch_recursive (inotify_fd, path, strlen(path)) < 0) {
-        close (inotify_fd);
-        return -1;
+    info = g_new0 (RepoWatchInfo, 1);
+    info->worktree = g_strdup (repo->worktree);
+    info->wt_len = strlen (repo->worktree);
+    info->inotify_fd = inotify_fd;
+    info->status = status;
+    info->sparse_paths = seaf_repo_manager_get_sparse_paths (seaf->repo_mgr,
+                                                             repo->id);
+    info->wd_paths = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    pthread_mutex_init (&info->lock, NULL);
+
+    info->registering = 1;
+    if (pthread_create (&info->reg_thread, NULL, register_watches, info) == 0) {
+        info->reg_started = TRUE;
+    } else {
+        seaf_warning ("[wt mon] failed to start thread, "
+                      "registering watches synchronously.\n");
+        register_watches (info);
     }
 
+    if (!priv->info_hash)
+        priv->info_hash = g_hash_table_new_full
+            (g_direct_hash, g_direct_equal, NULL,
+             (GDestroyNotify)repo_watch_info_free);
+    g_hash_table_insert (priv->info_hash, (gpointer)(long)inotify_fd, info);
+
     return inotify_fd;
 }
 
@@ -141,25 +275,94 @@ update_maxfd (SeafWTMonitorPriv *priv)
 }
 
 static int
-refresh_watch (int inotify_fd, const char *repo_id)
+refresh_watch (SeafWTMonitorPriv *priv, int inotify_fd, const char *repo_id)
 {
-    SeafRepo *repo;
+    RepoWatchInfo *info;
     char path[PATH_MAX];
 
-    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("[wt mon] cannot find repo %s.\n", repo_id);
+    info = g_hash_table_lookup (priv->info_hash, (gpointer)(long)inotify_fd);
+    if (!info) {
+        seaf_warning ("[wt mon] cannot find watch of repo %s.\n", repo_id);
         return -1;
     }
 
-    g_strlcpy (path, repo->worktree, PATH_MAX);
-    if (add_watch_recursive (inotify_fd, path, strlen(path)) < 0) {
+    /* Still being registered. */
+    if (g_atomic_int_get (&info->registering))
+        return 0;
+
+    g_strlcpy (path, info->worktree, PATH_MAX);
+    if (add_watch_recursive (info, inotify_fd, path, strlen(path)) < 0) {
         return -1;
     }
 
     return 0;
 }
 
+/*
+ * Record the paths of the events in the journal. New files and dirs get
+ * watches right away, so that changes to them are seen before the next
+ * refresh.
+ */
+static void
+handle_inotify_events (RepoWatchInfo *info, int inotify_fd, WTStatus *status,
+                       char *buf, int len)
+{
+    struct inotify_event *event;
+    char *dir;
+    char *path;
+    char full_path[PATH_MAX];
+    struct stat st;
+    int pos;
+
+    for (pos = 0; pos + (int)sizeof(*event) <= len;
+         pos += sizeof(*event) + event->len) {
+        event = (struct inotify_event *)(buf + pos);
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            wt_status_set_journal_overflow (status);
+            continue;
+        }
+
+        dir = info ? lookup_watch (info, event->wd) : NULL;
+        if (!dir) {
+            /* Don't know where the change is. */
+            wt_status_set_journal_overflow (status);
+            continue;
+        }
+
+        if (event->mask & IN_IGNORED) {
+            remove_watch (info, event->wd);
+            g_free (dir);
+            continue;
+        }
+
+        if (event->len == 0)
+            path = g_strdup (dir);
+        else if (dir[0] == 0)
+            path = g_strdup (event->name);
+        else
+            path = g_strconcat (dir, "/", event->name, NULL);
+        g_free (dir);
+
+        if (path[0] == 0) {
+            /* The worktree itself. */
+            g_free (path);
+            continue;
+        }
+
+        wt_status_add_changed_path (status, path);
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            int n = snprintf (full_path, PATH_MAX, "%s/%s", info->worktree, path);
+            if (n < PATH_MAX && lstat (full_path, &st) == 0 && S_ISDIR(st.st_mode) &&
+                sparse_path_included (info->sparse_paths, path, TRUE))
+                add_watch_recursive (info, inotify_fd, full_path, n);
+        }
+
+        g_free (path);
+    }
+}
+
 static void *
 wt_monitor_job (void *vmonitor)
 {
@@ -173,7 +376,9 @@ wt_monitor_job (void *vmonitor)
     int rc;
     fd_set fds;
     int inotify_fd;
-    char event_buf[(sizeof(struct inotify_event) << 1) + 256];
+    /* Large enough for the biggest event, so only whole events are read. */
+    char event_buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
     gpointer key, value;
     GHashTableIter iter;
 
@@ -204,10 +409,6 @@ wt_monitor_job (void *vmonitor)
         while (g_hash_table_iter_next (&iter, &key, &value)) {
             inotify_fd = (int)(long)key;
             if (FD_ISSET (inotify_fd, &fds)) {
-                /* We don't care about the details of the event now.
-                 * So we just read out the data but don't parse it.
-                 * We may read partial event structure.
-                 */
                 n = read (inotify_fd, event_buf, sizeof(event_buf));
                 if (n <= 0) {
                     seaf_warning ("[wt mon] failed to read inotify event.\n");
@@ -215,6 +416,8 @@ wt_monitor_job (void *vmonitor)
                 }
                 status = value;
                 if (status) {
+                    handle_inotify_events (g_hash_table_lookup (priv->info_hash, key),
+                                           inotify_fd, status, event_buf, n);
                     g_atomic_int_set (&status->last_changed, (gint)time(NULL));
                 }
             }
@@ -224,11 +427,12 @@ wt_monitor_job (void *vmonitor)
     return NULL;
 }
 
-static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id, long *handle) 
+static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id,
+                            WTStatus *status, long *handle)
 {
     int inotify_fd;
     g_assert (handle != NULL);
-    inotify_fd = add_watch (repo_id);
+    inotify_fd = add_watch (priv, repo_id, status);
 
     if (inotify_fd < 0)
         return -1;
@@ -242,6 +446,14 @@ static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id, long *
 static int handle_rm_repo (SeafWTMonitorPriv *priv, gpointer handle)
 {
     int inotify_fd = (int)(long)handle;
+    RepoWatchInfo *info;
+
+    info = g_hash_table_lookup (priv->info_hash, handle);
+    if (info && info->reg_started) {
+        g_atomic_int_set (&info->cancelled, 1);
+        pthread_join (info->reg_thread, NULL);
+    }
+    g_hash_table_remove (priv->info_hash, handle);
     close (inotify_fd);
     FD_CLR (inotify_fd, &priv->read_fds);
     update_maxfd (priv);
@@ -255,7 +467,7 @@ static int handle_refresh_repo (SeafWTMonitorPriv *priv, const char *repo_id)
         return -1;
 
     int inotify_fd = (int)(long)value;
-    if (refresh_watch (inotify_fd, repo_id) < 0)
+    if (refresh_watch (priv, inotify_fd, repo_id) < 0)
         return -1;
 
     return 0;
@@ -4,6 +4,7 @@
 #include <CoreServices/CoreServices.h>
 #include <sys/event.h>
 
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -36,6 +37,60 @@ struct SeafWTMonitorPriv {
 
 static void handle_watch_command (SeafWTMonitorPriv *priv, WatchCommand *cmd);
 
+#define JOURNAL_RESCAN_FLAGS (kFSEventStreamEventFlagMustScanSubDirs |  \
+                              kFSEventStreamEventFlagUserDropped |      \
+                              kFSEventStreamEventFlagKernelDropped |    \
+                              kFSEventStreamEventFlagRootChanged |      \
+                              kFSEventStreamEventFlagEventIdsWrapped)
+
+/*
+ * Events are reported per file and per dir. Both are recorded in the
+ * journal, and only dirs have their subtrees scanned.
+ */
+static void
+record_event_paths (WTStatus *status, size_t numEvents, char **paths,
+                    const FSEventStreamEventFlags eventFlags[])
+{
+    SeafRepo *repo;
+    int wt_len, len;
+    size_t i;
+    char *path;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, status->repo_id);
+    if (!repo) {
+        wt_status_set_journal_overflow (status);
+        return;
+    }
+    wt_len = strlen (repo->worktree);
+
+    for (i = 0; i < numEvents; i++) {
+        /* Marks the end of the replayed events. */
+        if (eventFlags[i] & kFSEventStreamEventFlagHistoryDone)
+            continue;
+
+        if ((eventFlags[i] & JOURNAL_RESCAN_FLAGS) ||
+            strncmp (paths[i], repo->worktree, wt_len) != 0 ||
+            (paths[i][wt_len] != '/' && paths[i][wt_len] != 0)) {
+            wt_status_set_journal_overflow (status);
+            return;
+        }
+
+        path = g_strdup (paths[i] + wt_len);
+        len = strlen (path);
+        while (len > 0 && path[len - 1] == '/')
+            path[--len] = 0;
+
+        if (path[0] == 0) {
+            /* The entries of the top dir have their own events. */
+            g_free (path);
+            continue;
+        }
+
+        wt_status_add_changed_path (status, path[0] == '/' ? path + 1 : path);
+        g_free (path);
+    }
+}
+
 static void stream_callback (ConstFSEventStreamRef streamRef,
                       void *clientCallBackInfo,
                       size_t numEvents,
@@ -48,6 +103,12 @@ static void stream_callback (ConstFSEventStreamRef streamRef,
 
     status = g_hash_table_lookup (priv->status_hash, streamRef);
     if (status) {
+        record_event_paths (status, numEvents, eventPaths, eventFlags);
+
+        pthread_mutex_lock (&status->journal_lock);
+        status->last_event_id = eventIds[numEvents - 1];
+        pthread_mutex_unlock (&status->journal_lock);
+
         g_atomic_int_set (&status->last_changed, (gint)time(NULL));
     }
 
@@ -62,7 +123,88 @@ static void stream_callback (ConstFSEventStreamRef streamRef,
 #endif
 }
 
-static FSEventStreamRef add_watch (SeafWTMonitorPriv *priv, const char* repo_id)
+/* Event ids are only valid in the event database of the same device. */
+static char *
+get_device_uuid (const char *worktree)
+{
+    struct stat st;
+    CFUUIDRef uuid;
+    CFStringRef str;
+    char buf[64];
+    char *ret = NULL;
+
+    if (stat (worktree, &st) < 0)
+        return NULL;
+
+    uuid = FSEventsCopyUUIDForDevice (st.st_dev);
+    if (!uuid)
+        return NULL;
+
+    str = CFUUIDCreateString (kCFAllocatorDefault, uuid);
+    if (str && CFStringGetCString (str, buf, sizeof(buf), kCFStringEncodingUTF8))
+        ret = g_strdup (buf);
+
+    if (str)
+        CFRelease (str);
+    CFRelease (uuid);
+    return ret;
+}
+
+/* Called from the sync threads, see seaf_wt_monitor_paths_indexed(). */
+static void
+save_indexed_event_id (const char *repo_id, guint64 event_id)
+{
+    SeafRepo *repo;
+    char *uuid, *value;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return;
+
+    uuid = get_device_uuid (repo->worktree);
+    if (!uuid)
+        return;
+
+    value = g_strdup_printf ("%s %"G_GUINT64_FORMAT" %s",
+                             uuid, event_id, repo->worktree);
+    seaf_repo_manager_set_repo_property (seaf->repo_mgr, repo_id,
+                                         REPO_FSEVENTS_ID, value);
+    g_free (value);
+    g_free (uuid);
+}
+
+/* The event after which to replay the changes, if they were indexed in
+ * the same worktree on the same device. */
+static FSEventStreamEventId
+load_indexed_event_id (SeafRepo *repo)
+{
+    char *value, *uuid = NULL;
+    char **tokens;
+    FSEventStreamEventId event_id = kFSEventStreamEventIdSinceNow;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo->id,
+                                                 REPO_FSEVENTS_ID);
+    if (!value)
+        return event_id;
+
+    tokens = g_strsplit (value, " ", 3);
+    if (g_strv_length (tokens) == 3 &&
+        strcmp (tokens[2], repo->worktree) == 0) {
+        uuid = get_device_uuid (repo->worktree);
+        if (g_strcmp0 (tokens[0], uuid) == 0)
+            event_id = g_ascii_strtoull (tokens[1], NULL, 10);
+    }
+    if (event_id == 0)
+        event_id = kFSEventStreamEventIdSinceNow;
+
+    g_strfreev (tokens);
+    g_free (uuid);
+    g_free (value);
+    return event_id;
+}
+
+static FSEventStreamRef add_watch (SeafWTMonitorPriv *priv, const char* repo_id,
+                                   WTStatus *status)
 {
     SeafRepo *repo = NULL;
     const char *path = NULL;
@@ -78,6 +220,17 @@ static FSEventStreamRef add_watch (SeafWTMonitorPriv *priv, const char* repo_id)
                                                     path, kCFStringEncodingUTF8);
     CFArrayRef pathsToWatch = CFArrayCreate(NULL, (const void **)&mypath, 1, NULL);
     FSEventStreamRef stream;
+    FSEventStreamEventId since;
+
+    /* Replay the changes made since the last index, e.g. while the daemon
+     * was not running. The journal is complete once they are recorded, so
+     * no worktree scan is needed.
+     */
+    since = load_indexed_event_id (repo);
+    if (since != kFSEventStreamEventIdSinceNow) {
+        status->last_event_id = since;
+        status->journal_overflow = FALSE;
+    }
 
     /* Create the stream, passing in a callback */
     struct FSEventStreamContext ctx = {0, priv, NULL, NULL, NULL};
@@ -85,9 +238,10 @@ static FSEventStreamRef add_watch (SeafWTMonitorPriv *priv, const char* repo_id)
                                  stream_callback,
                                  &ctx,
                                  pathsToWatch,
-                                 kFSEventStreamEventIdSinceNow,
+                                 since,
                                  1.0,
-                                 kFSEventStreamCreateFlagWatchRoot
+                                 kFSEventStreamCreateFlagWatchRoot |
+                                 kFSEventStreamCreateFlagFileEvents
         );
 
     CFRelease (mypath);
@@ -158,10 +312,11 @@ wt_monitor_job (void *vmonitor)
     return NULL;
 }
 
-static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id, long *handle)
+static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id,
+                            WTStatus *status, long *handle)
 {
     g_assert (handle);
-    FSEventStreamRef stream = add_watch (priv, repo_id);
+    FSEventStreamRef stream = add_watch (priv, repo_id, status);
     if (!stream)
         return -1;
     *handle = (long)stream;
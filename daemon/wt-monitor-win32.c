@@ -30,7 +30,14 @@ typedef struct WatchCommand {
     FILE_NOTIFY_CHANGE_FILE_NAME |  FILE_NOTIFY_CHANGE_LAST_WRITE \
     | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE 
 
-#define DIR_WATCH_BUFSIZE (sizeof(FILE_NOTIFY_INFORMATION) + MAX_PATH * 2)
+/* Room for a burst of changes, such as unpacking an archive. If the buffer
+ * overflows, no change is reported and the whole worktree is scanned.
+ * ReadDirectoryChangesW() fails with larger buffers on network shares.
+ */
+#define DIR_WATCH_BUFSIZE (64 * 1024)
+
+/* Max completions taken from the IOCP before the changes are recorded. */
+#define MAX_BATCH_EVENTS 64
 
 /* Hold the OVERLAPPED struct for asynchronous ReadDirectoryChangesW(), and
    the buf to receive dir change info. */
@@ -40,6 +47,14 @@ typedef struct DirWatchAux {
     gboolean unused;
 } DirWatchAux;
 
+/* Changes taken from a DirWatchAux buf, so that the dir can be watched
+ * again before they are recorded. */
+typedef struct DirChanges {
+    HANDLE dir_handle;
+    char *buf;
+    DWORD len;
+} DirChanges;
+
 struct SeafWTMonitorPriv {
     GHashTable *handle_hash;    /* repo_id -> dir handle */
     GHashTable *status_hash;    /* handle -> status  */
@@ -93,8 +108,7 @@ start_watch_dir_change(SeafWTMonitorPriv *priv, HANDLE dir_handle)
 
     /* The ending W of this function indicates that the info recevied about
        the change would be in Unicode(specifically, the name of the file that
-       is changed would be encoded in wide char), but we don't care it right
-       now. Maybe in the future.
+       is changed would be encoded in wide char).
     */
     BOOL ret = ReadDirectoryChangesW
         (dir_handle,            /* dir handle */
@@ -315,14 +329,114 @@ static HANDLE add_watch (const char* repo_id)
     return dir_handle;
 }
 
+/* Record the changed files in @buf, relative to the worktree, in the
+ * journal of @status.
+ */
+static void
+record_dir_changes (WTStatus *status, const char *buf, DWORD len)
+{
+    const FILE_NOTIFY_INFORMATION *info;
+    DWORD offset = 0;
+    char *path, *p;
+
+    if (len == 0) {
+        /* The buffer overflowed, changes were lost. */
+        wt_status_set_journal_overflow (status);
+        return;
+    }
+
+    while (offset < len) {
+        info = (const FILE_NOTIFY_INFORMATION *)(buf + offset);
+
+        path = g_utf16_to_utf8 ((const gunichar2 *)info->FileName,
+                                info->FileNameLength / sizeof(WCHAR),
+                                NULL, NULL, NULL);
+        if (!path) {
+            wt_status_set_journal_overflow (status);
+            return;
+        }
+        for (p = path; *p; ++p) {
+            if (*p == '\\')
+                *p = '/';
+        }
+        if (path[0] != 0)
+            wt_status_add_changed_path (status, path);
+        g_free (path);
+
+        if (info->NextEntryOffset == 0)
+            break;
+        offset += info->NextEntryOffset;
+    }
+}
+
+/* Record the changes in @batch. The dir handles are looked up again, since
+ * a repo may have been unwatched in the meantime.
+ */
+static void
+flush_dir_changes (SeafWTMonitorPriv *priv, GList *batch)
+{
+    GList *ptr;
+    DirChanges *changes;
+    WTStatus *status;
+
+    for (ptr = batch; ptr; ptr = ptr->next) {
+        changes = ptr->data;
+
+        status = g_hash_table_lookup (priv->status_hash,
+                                      (gconstpointer)changes->dir_handle);
+        if (status) {
+            if (changes->buf)
+                record_dir_changes (status, changes->buf, changes->len);
+            else
+                wt_status_set_journal_overflow (status);
+            g_atomic_int_set (&status->last_changed, (gint)time(NULL));
+
+            seaf_debug ("worktree change detected, repo %s\n",
+                        status->repo_id);
+        }
+
+        g_free (changes->buf);
+        g_free (changes);
+    }
+    g_list_free (batch);
+}
+
+/* Take the changes out of @aux and watch the dir again right away, so that
+ * few changes are missed while the last ones are recorded. A NULL buf means
+ * the changes are lost.
+ */
+static GList *
+take_dir_changes (SeafWTMonitorPriv *priv, GList *batch, HANDLE dir_handle,
+                  DirWatchAux *aux, DWORD bytes, BOOL io_ok)
+{
+    DirChanges *changes = g_new0 (DirChanges, 1);
+    DWORD error = io_ok ? 0 : GetLastError();
+
+    changes->dir_handle = dir_handle;
+    if (io_ok && bytes > 0) {
+        changes->buf = g_memdup (aux->buf, bytes);
+        changes->len = bytes;
+    } else if (error != 0 && error != ERROR_NOTIFY_ENUM_DIR) {
+        seaf_warning ("ReadDirectoryChangesW failed on dir handle %p, "
+                      "error code %u\n", dir_handle, (uint32_t)error);
+    }
+
+    reset_overlapped (&aux->ol);
+    if (!start_watch_dir_change (priv, dir_handle))
+        seaf_warning ("start_watch_dir_change failed on dir handle %p, "
+                      "error code %u\n", dir_handle, (uint32_t)GetLastError());
+
+    return g_list_prepend (batch, changes);
+}
+
 static void *
 wt_monitor_job (void *vmonitor)
 {
     SeafWTMonitor *monitor = vmonitor;
     SeafWTMonitorPriv *priv = monitor->priv;
-    /* 2 * sizeof(inotify_event) + 256, should be large enough for one event.*/
-    WTStatus *status;
-
+    GList *batch = NULL;
+    int n_events = 0;
+    int retry = 0;
 
     DWORD bytesRead = 0;
     ULONG_PTR key = 0;
@@ -341,17 +455,28 @@ wt_monitor_job (void *vmonitor)
     }
     
     while (1) {
+        /* Wait for the first event, then take the queued ones without
+         * waiting. They are recorded together when the queue is empty.
+         */
+        DWORD timeout = (batch != NULL) ? 0 : INFINITE;
 
+        ol = NULL;
         BOOL ret = GetQueuedCompletionStatus
             (priv->iocp_handle,           /* iocp handle */
              &bytesRead,                  /* length of info */
              &key,                        /* completion key */
              &ol,                         /* OVERLAPPED */
-             INFINITE);                   /* timeout */
-
-        static int retry;
+             timeout);                    /* timeout */
+
+        if (!ret && !ol) {
+            /* Nothing was dequeued. */
+            if (GetLastError() == WAIT_TIMEOUT) {
+                flush_dir_changes (priv, batch);
+                batch = NULL;
+                n_events = 0;
+                continue;
+            }
 
-        if (!ret) {
             seaf_warning ("GetQueuedCompletionStatus failed, "
                           "error code %u", (uint32_t)GetLastError());
 
@@ -367,7 +492,7 @@ wt_monitor_job (void *vmonitor)
         if (key == (ULONG_PTR)priv->cmd_pipe[0]) {     
             /* Triggered by a cmd pipe event */
 
-            if (bytesRead != sizeof(WatchCommand)) {
+            if (!ret || bytesRead != sizeof(WatchCommand)) {
                 seaf_warning ("broken cmd from pipe: get"
                               " %d(expected: %d) bytes\n",
                               (int)bytesRead, sizeof(WatchCommand));
@@ -377,50 +502,44 @@ wt_monitor_job (void *vmonitor)
             seaf_debug ("recevied a pipe cmd, type %d for repo %s\n",
                         priv->cmd.type, priv->cmd.repo_id);
 
+            /* The command may unwatch a repo in the batch. */
+            flush_dir_changes (priv, batch);
+            batch = NULL;
+            n_events = 0;
+
             handle_watch_command (priv, &priv->cmd);
 
             reset_overlapped(ol);
             start_watch_cmd_pipe (priv, ol);
 
         } else {
-            /* Trigger by one of the dir watch handles */
-
-            HANDLE hTriggered = (HANDLE)key;
-            status = (WTStatus *)g_hash_table_lookup
-                (priv->status_hash, (gconstpointer)hTriggered); 
-
-            char *repo_id = NULL;
-
-            if (status && status->repo_id)
-                repo_id = status->repo_id;
-            else
-                repo_id = "Unknown-repo-id";
-
-            if (status) {
-                g_atomic_int_set (&status->last_changed, (gint)time(NULL));
+            /* Trigger by one of the dir watch handles. The OVERLAPPED is
+             * the first member of its DirWatchAux. */
+            DirWatchAux *aux = (DirWatchAux *)ol;
 
-                seaf_debug("worktree change detected, repo %s\n", repo_id);
-
-                reset_overlapped(ol);
-                if (!start_watch_dir_change(priv, hTriggered)) {
-
-                    seaf_warning ("start_watch_dir_change failed"
-                                  "for repo %s, error code %u\n",
-                                  repo_id, (uint32_t)GetLastError());
-                }
-            } else {
+            if (aux->unused) {
                 /* A previously unwatched dir_handle's DirWatchAux buf was
                    scheduled to be freed. */
-                DirWatchAux *aux = g_hash_table_lookup (priv->buf_hash, (gconstpointer)hTriggered);
-                if (aux && aux->unused)
-                    g_free (aux);
+                g_free (aux);
+                continue;
+            }
+
+            batch = take_dir_changes (priv, batch, (HANDLE)key,
+                                      aux, bytesRead, ret);
+            if (++n_events >= MAX_BATCH_EVENTS) {
+                flush_dir_changes (priv, batch);
+                batch = NULL;
+                n_events = 0;
             }
         }
     }
+
+    flush_dir_changes (priv, batch);
     return NULL;
 }
 
-static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id, long *handle)
+static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id,
+                            WTStatus *status, long *handle)
 {
     HANDLE inotify_fd;
 
@@ -1,10 +1,30 @@
 #ifndef SEAF_WT_MONITOR_H
 #define SEAF_WT_MONITOR_H
 
+#include <pthread.h>
+
+/* More changed paths than this are not worth tracking, scan the
+ * whole worktree instead.
+ */
+#define WT_JOURNAL_MAX_PATHS 4096
+
 typedef struct WTStatus {
     char        repo_id[37];
     gint        last_check;
     gint        last_changed;
+
+    /* Journal of paths changed since it was last taken, relative to the
+     * worktree. Filled by the monitor thread, protected by @journal_lock.
+     */
+    pthread_mutex_t journal_lock;
+    GHashTable  *changed_paths;
+    gboolean    journal_overflow;
+
+    /* Monitors that can replay events after a restart record the id of
+     * the last event in the journal, and of the last one taken.
+     */
+    guint64     last_event_id;
+    guint64     taken_event_id;
 } WTStatus;
 
 typedef struct SeafWTMonitorPriv SeafWTMonitorPriv;
@@ -35,4 +55,36 @@ WTStatus *
 seaf_wt_monitor_get_worktree_status (SeafWTMonitor *monitor,
                                      const char *repo_id);
 
+/*
+ * Takes the paths changed in the worktree of @repo_id since the last
+ * call, relative to the worktree. Returns FALSE if the changes are not
+ * fully known, e.g. the journal overflowed or the repo was only just
+ * watched. The whole worktree has to be scanned then.
+ */
+gboolean
+seaf_wt_monitor_take_changed_paths (SeafWTMonitor *monitor,
+                                    const char *repo_id,
+                                    GList **paths);
+
+/* Forget the journal, e.g. when indexing the taken paths failed. The
+ * next seaf_wt_monitor_take_changed_paths() will return FALSE.
+ */
+void
+seaf_wt_monitor_invalidate_changed_paths (SeafWTMonitor *monitor,
+                                          const char *repo_id);
+
+/* Called once the changes taken last are in the index. Monitors that can
+ * replay events save how far they got, so that only later changes are
+ * replayed after a restart instead of scanning the worktree.
+ */
+void
+seaf_wt_monitor_paths_indexed (SeafWTMonitor *monitor, const char *repo_id);
+
+/* Used by the platform monitors to record changes. */
+void
+wt_status_add_changed_path (WTStatus *status, const char *path);
+
+void
+wt_status_set_journal_overflow (WTStatus *status);
+
 #endif
@@ -145,22 +145,74 @@ init_seafile ()
     g_setenv("SEAFILE_WORKTREE", applet->seafile_worktree, 1);
 }
 
+/* tx id -> "<upload|download>\t<rate>\t<repo name>" */
+static GHashTable *transfers;
+
 static void
-collect_transfer_info (GString *msg, const char *info, char *repo_name)
+collect_transfer_info (gpointer key, gpointer value, gpointer data)
 {
-    char *p;
-    if (! (p = strchr (info, '\t')))
+    GString *msg = data;
+    char **tokens;
+
+    tokens = g_strsplit ((char *)value, "\t", 3);
+    if (g_strv_length (tokens) != 3) {
+        g_strfreev (tokens);
         return;
-    *p = '\0';
+    }
 
-    int rate = atoi(p + 1) / 1024;
+    int rate = atoi(tokens[1]) / 1024;
     
-    gboolean is_upload = (strcmp(info, "upload") == 0);
+    gboolean is_upload = (strcmp(tokens[0], "upload") == 0);
     char buf[4096];
     snprintf (buf, sizeof(buf) , "%s %s, %s %d KB/s\n",
               is_upload ? _("Uploading") : _("Downloading"),
-              repo_name, _("Speed"), rate);
+              tokens[2], _("Speed"), rate);
     g_string_append (msg, buf);
+
+    g_strfreev (tokens);
+}
+
+/*
+ * The daemon only sends the states changed in the last second, as
+ * "<kind>\t<id>\t<value>" lines. An empty value means the task is gone.
+ */
+static void
+handle_task_states (char *body)
+{
+    char **lines, **tokens;
+    int i;
+
+    if (!transfers)
+        transfers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+
+    lines = g_strsplit (body, "\n", -1);
+    for (i = 0; lines[i] != NULL; ++i) {
+        tokens = g_strsplit (lines[i], "\t", 3);
+        if (g_strv_length (tokens) == 3 &&
+            strcmp (tokens[0], "transfer") == 0) {
+            if (tokens[2][0] == '\0')
+                g_hash_table_remove (transfers, tokens[1]);
+            else
+                g_hash_table_replace (transfers, g_strdup (tokens[1]),
+                                      g_strdup (tokens[2]));
+        }
+        g_strfreev (tokens);
+    }
+    g_strfreev (lines);
+
+    if (g_hash_table_size (transfers) == 0) {
+        trayicon_rotate (FALSE);
+        trayicon_set_tip ("Seafile");
+        return;
+    }
+
+    trayicon_rotate (TRUE);
+
+    GString *str = g_string_new (NULL);
+    g_hash_table_foreach (transfers, collect_transfer_info, str);
+    trayicon_set_tip (str->str);
+    g_string_free (str, TRUE);
 }
 
 
@@ -169,22 +221,7 @@ handle_seafile_notification (char *type, char *content)
 {
     char buf[1024];
 
-    if (strcmp(type, "transfer") == 0) {
-        trayicon_rotate (TRUE);
-
-        if (content == NULL) {
-            applet_debug ("handle empty notification\n");
-            return;
-        }
-        GString *str = g_string_new (NULL);
-        parse_key_value_pairs (content,
-                               (KeyValueFunc)collect_transfer_info, str);
-        trayicon_set_tip (str->str);
-        g_string_free (str, TRUE);
-
-        return;
-        
-    } else if (strcmp(type, "repo.deleted_on_relay") == 0) {
+    if (strcmp(type, "repo.deleted_on_relay") == 0) {
         snprintf (buf, sizeof(buf), "\"%s\" %s", content, _("is unsynced. \nReason: Deleted on server"));
         trayicon_notify ("Seafile", buf);
         
@@ -270,6 +307,8 @@ static void mq_cb (CcnetMessage *msg, void *data)
             return;
 
         handle_seafile_notification (type, content);
+    } else if (IS_APP_MSG(msg, "seafile.task_state")) {
+        handle_task_states (msg->body);
     }
 }
 
@@ -292,6 +331,7 @@ start_mq_client ()
     static char *topics[] = {
         "seafile.heartbeat",
         "seafile.notification",
+        "seafile.task_state",
     };
     
     /* Subscribe to messages. */
@@ -26,6 +26,18 @@
 #define CONTENT_TYPE_FILENAME "content-type.txt"
 #define FILE_TYPE_MAP_DEFAULT_LEN 1
 
+/* Data written to the connection per write callback. */
+#define SEND_CHUNK_SIZE (64 * 1024)
+
+/* Files behind a token never change, see access_cb(). */
+#define FILE_CACHE_CONTROL "max-age=31536000, immutable"
+
+/* Single-block files up to this size are sent in one reply. */
+#define INLINE_FILE_SIZE (64 * 1024)
+
+/* How often to check a cached archive being built. */
+#define CACHE_POLL_MSEC 100
+
 struct file_type_map {
     char *suffix;
     char *type;
@@ -35,12 +47,20 @@ typedef struct SendfileData {
     evhtp_request_t *req;
     Seafile *file;
     SeafileCrypt *crypt;
-    gboolean enc_init;
-    EVP_CIPHER_CTX ctx;
-    BlockHandle *handle;
-    size_t remain;
+    SeafBlockPrefetcher *prefetcher;
+    struct event *wakeup;       /* activated when a block has been read */
+    char *blk_data;             /* block being sent */
+    int blk_len;
+    int blk_off;
     int idx;
 
+    /* For range requests. Offsets are in the plain file. */
+    gint64 start;
+    gint64 remain;              /* bytes left to send */
+    gint64 pos;                 /* offset of the block at idx, while seeking
+                                 * to start in an encrypted file */
+    int blk_skip;               /* where to start in the first block sent */
+
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
     bufferevent_event_cb saved_event_cb;
@@ -49,10 +69,14 @@ typedef struct SendfileData {
 
 typedef struct SendDirData {
     evhtp_request_t *req;
-    size_t remain;
+    PackDirStream *stream;
+    struct evbuffer *buf;
 
-    int zipfd;
-    char *zipfile;
+    /* Or an archive from the zip cache. */
+    ZipCacheEntry *entry;
+    int fd;
+    gint64 off;
+    struct event *timer;        /* to wait for the archive to grow */
 
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
@@ -77,13 +101,12 @@ static struct file_type_map ftmap[] = {
 static void
 free_sendfile_data (SendfileData *data)
 {
-    if (data->handle) {
-        seaf_block_manager_close_block(seaf->block_mgr, data->handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, data->handle);
-    }
-
-    if (data->enc_init)
-        EVP_CIPHER_CTX_cleanup (&data->ctx);
+    /* No wakeup can be activated once the prefetcher is freed. */
+    if (data->prefetcher)
+        seaf_block_prefetcher_free (data->prefetcher);
+    if (data->wakeup)
+        event_free (data->wakeup);
+    g_free (data->blk_data);
 
     seafile_unref (data->file);
     g_free (data->crypt);
@@ -93,128 +116,213 @@ free_sendfile_data (SendfileData *data)
 static void
 free_senddir_data (SendDirData *data)
 {
-    close (data->zipfd);
-    unlink (data->zipfile);
-    
-    g_free (data->zipfile);
+    if (data->stream)
+        pack_dir_stream_free (data->stream);
+    if (data->entry)
+        zip_cache_entry_unref (data->entry);
+    if (data->fd >= 0)
+        close (data->fd);
+    if (data->timer)
+        event_free (data->timer);
+    evbuffer_free (data->buf);
     g_free (data);
 }
 
 static void
-write_data_cb (struct bufferevent *bev, void *ctx)
+finish_sendfile (SendfileData *data)
+{
+    /* Recover evhtp's callbacks */
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_end (data->req);
+
+    free_sendfile_data (data);
+}
+
+/*
+ * For unencrypted files on a backend with block files: each block file
+ * is handed to the output buffer as a whole, and libevent sends it with
+ * sendfile, without copying it through user space.
+ */
+static void
+write_block_file_cb (struct bufferevent *bev, void *ctx)
 {
     SendfileData *data = ctx;
     char *blk_id;
-    BlockHandle *handle;
-    char buf[1024 * 64];
-    int n;
+    gint64 size, len;
+    int fd;
+
+    if (data->remain == 0 || data->idx == data->file->n_blocks) {
+        finish_sendfile (data);
+        return;
+    }
 
-next:
     blk_id = data->file->blk_sha1s[data->idx];
+    fd = seaf_block_manager_open_block_fd (seaf->block_mgr, blk_id, &size);
+    if (fd < 0) {
+        seaf_warning ("Failed to open block %s\n", blk_id);
+        goto err;
+    }
 
-    if (!data->handle) {
-        data->handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                                     blk_id, BLOCK_READ);
-        if (!data->handle) {
-            seaf_warning ("Failed to open block %s\n", blk_id);
-            goto err;
-        }
+    len = MIN (size - data->blk_skip, data->remain);
+    if (len <= 0) {
+        seaf_warning ("Block %s is shorter than expected.\n", blk_id);
+        close (fd);
+        goto err;
+    }
 
-        BlockMetadata *bmd;
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       data->handle);
-        data->remain = bmd->size;
-        g_free (bmd);
+    /* The buffer closes @fd once it's sent. */
+    if (evbuffer_add_file (bufferevent_get_output (bev), fd,
+                           data->blk_skip, len) < 0) {
+        seaf_warning ("Failed to send block %s\n", blk_id);
+        close (fd);
+        goto err;
+    }
+    data->blk_skip = 0;
+    data->remain -= len;
+    ++(data->idx);
 
-        if (data->crypt) {
-            if (seafile_decrypt_init (&data->ctx,
-                                      data->crypt->version,
-                                      (unsigned char *)data->crypt->key,
-                                      (unsigned char *)data->crypt->iv) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
-                goto err;
-            }
-            data->enc_init = TRUE;
-        }
+    return;
+
+err:
+    evhtp_connection_free (evhtp_request_get_connection (data->req));
+    free_sendfile_data (data);
+}
+
+/* Drop the data after the range end. */
+static void
+send_range_data (SendfileData *data, struct bufferevent *bev,
+                 char *buf, int len)
+{
+    if (len > data->remain)
+        len = (int)data->remain;
+    if (len > 0) {
+        bufferevent_write (bev, buf, len);
+        data->remain -= len;
     }
-    handle = data->handle;
+}
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
-    data->remain -= n;
-    if (n < 0) {
-        seaf_warning ("Error when reading from block %s.\n", blk_id);
-        goto err;
-    } else if (n == 0) {
-        /* We've read up the data of this block, finish or try next block. */
-        if (data->idx == data->file->n_blocks - 1) {
-            /* Recover evhtp's callbacks */
-            struct bufferevent *bev = evhtp_request_get_bev (data->req);
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
+/*
+ * Called in a prefetch thread, so that encrypted blocks are decrypted in
+ * parallel and off the event loop.
+ */
+static int
+decrypt_block (char **blk, int *len, void *vcrypt)
+{
+    SeafileCrypt *crypt = vcrypt;
+    char *out = NULL;
+    int outlen;
 
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
+    if (seafile_decrypt (&out, &outlen, *blk, *len, crypt) < 0)
+        return -1;
 
-            evhtp_send_reply_end (data->req);
+    g_free (*blk);
+    *blk = out;
+    *len = outlen;
+    return 0;
+}
 
-            free_sendfile_data (data);
-            return;
-        }
+static void write_data_cb (struct bufferevent *bev, void *ctx);
 
-        ++(data->idx);
-        data->handle = NULL;
-        if (data->crypt != NULL) {
-            EVP_CIPHER_CTX_cleanup (&data->ctx);
-            data->enc_init = FALSE;
-        }
-        goto next;
+/* Called in a prefetch thread. */
+static void
+notify_block_read (void *vdata)
+{
+    SendfileData *data = vdata;
+
+    event_active (data->wakeup, EV_WRITE, 0);
+}
+
+static void
+wakeup_cb (evutil_socket_t fd, short what, void *vdata)
+{
+    SendfileData *data = vdata;
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+
+    /* Otherwise the write callback comes anyway. */
+    if (evbuffer_get_length (bufferevent_get_output (bev)) == 0)
+        write_data_cb (bev, data);
+}
+
+static void
+write_data_cb (struct bufferevent *bev, void *ctx)
+{
+    SendfileData *data = ctx;
+    char *blk_id;
+    char *buf;
+    int n, rc;
+
+    if (data->remain == 0) {
+        finish_sendfile (data);
+        return;
     }
 
-    /* OK, we've got some data to send. */
-    if (data->crypt != NULL) {
-        char *dec_out;
-        int dec_out_len = -1;
+next:
+    blk_id = data->file->blk_sha1s[data->idx];
 
-        dec_out = g_new (char, n + 16);
-        if (!dec_out) {
-            seaf_warning ("Failed to alloc memory.\n");
+    if (!data->blk_data) {
+        /* Don't block the event loop on disk or network I/O. We're
+         * called again by the wakeup event when the block is read.
+         */
+        rc = seaf_block_prefetcher_try_next (data->prefetcher,
+                                             &data->blk_data, &data->blk_len);
+        if (rc == 2)
+            return;
+        if (rc != 0) {
+            seaf_warning ("Failed to read block %s\n", blk_id);
             goto err;
         }
-
-        int ret = EVP_DecryptUpdate (&data->ctx,
-                                     (unsigned char *)dec_out,
-                                     &dec_out_len,
-                                     (unsigned char *)buf,
-                                     n);
-        if (ret == 0) {
-            seaf_warning ("Decrypt block %s failed.\n", blk_id);
-            g_free (dec_out);
-            goto err;
+        data->blk_off = 0;
+
+        /* Blocks are already decrypted, but their plain sizes are only
+         * known now. */
+        if (data->crypt && data->pos < data->start) {
+            if (data->pos + data->blk_len <= data->start) {
+                data->pos += data->blk_len;
+                g_free (data->blk_data);
+                data->blk_data = NULL;
+                if (++(data->idx) == data->file->n_blocks) {
+                    seaf_warning ("Range start beyond the blocks.\n");
+                    goto err;
+                }
+                goto next;
+            }
+            data->blk_off = (int)(data->start - data->pos);
+            data->pos = data->start;
+        } else if (!data->crypt) {
+            data->blk_off = data->blk_skip;
+            data->blk_skip = 0;
         }
+    }
 
-        bufferevent_write (bev, dec_out, dec_out_len);
-
-        /* If it's the last piece of a block, call decrypt_final()
-         * to decrypt the possible partial block. */
-        if (data->remain == 0) {
-            ret = EVP_DecryptFinal (&data->ctx,
-                                    (unsigned char *)dec_out,
-                                    &dec_out_len);
-            if (ret == 0) {
-                seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                g_free (dec_out);
-                goto err;
-            }
-            bufferevent_write (bev, dec_out, dec_out_len);
+    n = MIN (data->blk_len - data->blk_off, SEND_CHUNK_SIZE);
+    buf = data->blk_data + data->blk_off;
+    data->blk_off += n;
+
+    if (n == 0) {
+        /* We've sent all the data of this block, finish or try next block. */
+        g_free (data->blk_data);
+        data->blk_data = NULL;
+
+        if (data->idx == data->file->n_blocks - 1) {
+            finish_sendfile (data);
+            return;
         }
 
-        g_free (dec_out);
-    } else {
-        bufferevent_write (bev, buf, n);
+        ++(data->idx);
+        goto next;
     }
 
+    /* OK, we've got some data to send. */
+    send_range_data (data, bev, buf, n);
+
     return;
 
 err:
@@ -223,41 +331,105 @@ err:
     return;
 }
 
+static void
+finish_senddir (SendDirData *data)
+{
+    /* Recover evhtp's callbacks */
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_chunk_end (data->req);
+
+    free_senddir_data (data);
+}
+
+/*
+ * The archive is generated as it's sent, one piece per write callback, so
+ * it's only generated as fast as the client receives it.
+ */
 static void
 write_dir_data_cb (struct bufferevent *bev, void *ctx)
 {
     SendDirData *data = ctx;
-    char buf[64 * 1024];
-    int n;
+    int rc;
 
-    n = readn (data->zipfd, buf, sizeof(buf));
-    if (n <= 0) {
-        seaf_warning ("failed to read zipfile %s\n", data->zipfile);
+    rc = pack_dir_stream_next (data->stream, data->buf);
+    if (rc < 0) {
+        seaf_warning ("failed to pack dir\n");
         evhtp_connection_free (evhtp_request_get_connection (data->req));
         free_senddir_data (data);
         return;
-        
-    } else {
-        bufferevent_write (bev, buf, n);
-        data->remain -= n;
+    }
 
-        if (data->remain == 0) {
-            /* Recover evhtp's callbacks */
-            struct bufferevent *bev = evhtp_request_get_bev (data->req);
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
+    evhtp_send_reply_chunk (data->req, data->buf);
 
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
+    if (rc == 0)
+        finish_senddir (data);
+}
 
-            evhtp_send_reply_end (data->req);
+static void write_cached_dir_cb (struct bufferevent *bev, void *ctx);
 
-            free_senddir_data (data);
-            return;
+static void
+cache_poll_cb (evutil_socket_t fd, short what, void *ctx)
+{
+    SendDirData *data = ctx;
+
+    write_cached_dir_cb (evhtp_request_get_bev (data->req), data);
+}
+
+/* Send a cached archive, following it while it's being built. */
+static void
+write_cached_dir_cb (struct bufferevent *bev, void *ctx)
+{
+    SendDirData *data = ctx;
+    char buf[SEND_CHUNK_SIZE];
+    struct timeval tv;
+    gboolean done;
+    gint64 size;
+    ssize_t n;
+
+    size = zip_cache_entry_get_size (data->entry, &done);
+    if (size < 0) {
+        seaf_warning ("failed to pack dir\n");
+        goto err;
+    }
+
+    if (data->off < size) {
+        n = pread (data->fd, buf, MIN (size - data->off, sizeof(buf)),
+                   data->off);
+        if (n <= 0) {
+            seaf_warning ("failed to read cached zip: %s\n", strerror(errno));
+            goto err;
         }
+        data->off += n;
+        evbuffer_add (data->buf, buf, n);
+        evhtp_send_reply_chunk (data->req, data->buf);
+        return;
+    }
+
+    if (done) {
+        finish_senddir (data);
+        return;
     }
+
+    /* Wait for the builder to write more. */
+    if (!data->timer)
+        data->timer = evtimer_new (bufferevent_get_base (bev),
+                                   cache_poll_cb, data);
+    tv.tv_sec = 0;
+    tv.tv_usec = CACHE_POLL_MSEC * 1000;
+    evtimer_add (data->timer, &tv);
+    return;
+
+err:
+    evhtp_connection_free (evhtp_request_get_connection (data->req));
+    free_senddir_data (data);
 }
 
 static void
@@ -336,6 +508,131 @@ test_firefox (evhtp_request_t *req)
     }
 }
 
+/*
+ * Parse a single "bytes=" range of a file of @size bytes into @start and
+ * @end (inclusive). Returns 1 for a valid range, 0 if the whole file
+ * should be sent, and -1 if the range can't be satisfied.
+ */
+static int
+parse_range (const char *value, gint64 size, gint64 *start, gint64 *end)
+{
+    const char *p;
+    char *endptr;
+    gint64 n;
+
+    if (strncmp (value, "bytes=", 6) != 0)
+        return 0;
+    p = value + 6;
+
+    /* Multiple ranges are not supported, send the whole file. */
+    if (strchr (p, ',') != NULL)
+        return 0;
+
+    if (*p == '-') {
+        /* The last n bytes. */
+        n = g_ascii_strtoll (p + 1, &endptr, 10);
+        if (endptr == p + 1 || *endptr != '\0' || n < 0)
+            return 0;
+        if (n == 0 || size == 0)
+            return -1;
+        *start = MAX (size - n, 0);
+        *end = size - 1;
+        return 1;
+    }
+
+    *start = g_ascii_strtoll (p, &endptr, 10);
+    if (endptr == p || *endptr != '-' || *start < 0)
+        return 0;
+    p = endptr + 1;
+
+    if (*p == '\0') {
+        *end = size - 1;
+    } else {
+        *end = g_ascii_strtoll (p, &endptr, 10);
+        if (*endptr != '\0' || *end < *start)
+            return 0;
+        *end = MIN (*end, size - 1);
+    }
+
+    if (*start >= size)
+        return -1;
+
+    return 1;
+}
+
+/*
+ * Find the block containing @start in an unencrypted file, from the block
+ * sizes. Returns the block index, with the offset of @start in it in
+ * @intra.
+ */
+static int
+seek_plain_file (Seafile *file, gint64 start, int *intra)
+{
+    BlockMetadata *bmd;
+    gint64 pos = 0;
+    int i;
+
+    for (i = 0; i < file->n_blocks; ++i) {
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             file->blk_sha1s[i]);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s.\n", file->blk_sha1s[i]);
+            return -1;
+        }
+        if (pos + bmd->size > start) {
+            *intra = (int)(start - pos);
+            g_free (bmd);
+            return i;
+        }
+        pos += bmd->size;
+        g_free (bmd);
+    }
+
+    return -1;
+}
+
+/*
+ * For small files, setting up the block prefetcher and the bufferevent
+ * callbacks costs more than reading the block right away.
+ */
+static int
+send_inline_file (evhtp_request_t *req, Seafile *file, SeafileCrypt *crypt,
+                  gint64 start, gint64 end, int is_range)
+{
+    char *blk_id = file->blk_sha1s[0];
+    char *data = NULL, *plain;
+    int len, plain_len;
+
+    if (seaf_block_manager_read_whole_block (seaf->block_mgr, blk_id,
+                                             &data, &len) < 0) {
+        seaf_warning ("Failed to read block %s\n", blk_id);
+        return -1;
+    }
+
+    if (crypt) {
+        if (seafile_decrypt (&plain, &plain_len, data, len, crypt) < 0) {
+            seaf_warning ("Failed to decrypt block %s.\n", blk_id);
+            g_free (data);
+            return -1;
+        }
+        g_free (data);
+        data = plain;
+        len = plain_len;
+    }
+
+    if (len != file->file_size) {
+        seaf_warning ("Block %s doesn't match the file size.\n", blk_id);
+        g_free (data);
+        return -1;
+    }
+
+    evbuffer_add (req->buffer_out, data + start, end - start + 1);
+    send_http_reply (req, is_range ? EVHTP_RES_PARTIAL : EVHTP_RES_OK);
+
+    g_free (data);
+    return 0;
+}
+
 static int
 do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         const char *filename, const char *operation,
@@ -350,6 +647,13 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     unsigned char enc_key[16], enc_iv[16];
     SeafileCrypt *crypt = NULL;
     SendfileData *data;
+    bufferevent_data_cb write_cb;
+    const char *range, *if_range;
+    char etag[64], content_range[255];
+    gint64 start = 0, end;
+    int is_range = 0, idx = 0, intra = 0;
+    gboolean inline_file;
+    int ret;
 
     file = seaf_fs_manager_get_seafile(seaf->fs_mgr, file_id);
     if (file == NULL)
@@ -386,7 +690,59 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         g_free (content_type);
     }
 
-    snprintf(file_size, sizeof(file_size), "%"G_GINT64_FORMAT"", file->file_size);
+    /* The content of a file id never changes, so it's a strong ETag. */
+    snprintf (etag, sizeof(etag), "\"%s\"", file_id);
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new("ETag", etag, 1, 1));
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new("Accept-Ranges", "bytes", 1, 1));
+
+    inline_file = (file->n_blocks == 1 &&
+                   file->file_size <= INLINE_FILE_SIZE);
+
+    end = file->file_size - 1;
+    range = evhtp_header_find (req->headers_in, "Range");
+    if_range = evhtp_header_find (req->headers_in, "If-Range");
+    /* A date in If-Range always matches, for the same reason. */
+    if (range && (!if_range || if_range[0] != '"' ||
+                  strcmp (if_range, etag) == 0))
+        is_range = parse_range (range, file->file_size, &start, &end);
+
+    if (is_range < 0) {
+        snprintf (content_range, sizeof(content_range),
+                  "bytes */%"G_GINT64_FORMAT, file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Range",
+                                                   content_range, 1, 1));
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Length", "0", 1, 1));
+        send_http_reply (req, EVHTP_RES_RANGENOTSC);
+        seafile_unref (file);
+        g_free (crypt);
+        return 0;
+    }
+
+    if (is_range) {
+        snprintf (content_range, sizeof(content_range),
+                  "bytes %"G_GINT64_FORMAT"-%"G_GINT64_FORMAT"/%"G_GINT64_FORMAT,
+                  start, end, file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Range",
+                                                   content_range, 1, 1));
+
+        /* Encrypted files are seeked while the blocks are read, since the
+         * plain block sizes are only known after decryption. */
+        if (!crypt && !inline_file && start > 0) {
+            idx = seek_plain_file (file, start, &intra);
+            if (idx < 0) {
+                seafile_unref (file);
+                return -1;
+            }
+        }
+    }
+
+    snprintf(file_size, sizeof(file_size), "%"G_GINT64_FORMAT"",
+             end - start + 1);
     evhtp_headers_add_header (req->headers_out,
                               evhtp_header_new("Content-Length", file_size, 1, 1));
 
@@ -413,27 +769,63 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
 
     /* If it's an empty file, send an empty reply. */
     if (file->n_blocks == 0) {
-        evhtp_send_reply (req, EVHTP_RES_OK);
+        send_http_reply (req, EVHTP_RES_OK);
         seafile_unref (file);
         return 0;
     }
 
+    if (inline_file) {
+        ret = send_inline_file (req, file, crypt, start, end, is_range);
+        seafile_unref (file);
+        g_free (crypt);
+        return ret;
+    }
+
     data = g_new0 (SendfileData, 1);
     data->req = req;
     data->file = file;
     data->crypt = crypt;
+    data->start = start;
+    data->remain = end - start + 1;
+    data->idx = idx;
+    data->blk_skip = intra;
+
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+
+    if (!crypt && seaf_block_manager_has_block_fds (seaf->block_mgr)) {
+        write_cb = write_block_file_cb;
+    } else {
+        /* Blocks are fetched, and decrypted, ahead while earlier ones are
+         * being sent. */
+        if (crypt)
+            data->prefetcher = seaf_block_manager_prefetch_blocks_full (
+                seaf->block_mgr, file->blk_sha1s + idx, file->n_blocks - idx,
+                decrypt_block, g_memdup (crypt, sizeof(SeafileCrypt)), g_free);
+        else
+            data->prefetcher = seaf_block_manager_prefetch_blocks (seaf->block_mgr,
+                                                                   file->blk_sha1s + idx,
+                                                                   file->n_blocks - idx);
+        if (!data->prefetcher) {
+            free_sendfile_data (data);
+            return -1;
+        }
+        data->wakeup = event_new (bufferevent_get_base (bev), -1, 0,
+                                  wakeup_cb, data);
+        seaf_block_prefetcher_set_notify (data->prefetcher,
+                                          notify_block_read, data);
+        write_cb = write_data_cb;
+    }
 
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
-    struct bufferevent *bev = evhtp_request_get_bev (req);
     data->saved_read_cb = bev->readcb;
     data->saved_write_cb = bev->writecb;
     data->saved_event_cb = bev->errorcb;
     data->saved_cb_arg = bev->cbarg;
     bufferevent_setcb (bev,
                        NULL,
-                       write_data_cb,
+                       write_cb,
                        my_event_cb,
                        data);
     /* Block any new request from this connection before finish
@@ -442,7 +834,7 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     evhtp_request_pause (req);
 
     /* Kick start data transfer by sending out http headers. */
-    evhtp_send_reply_start(req, EVHTP_RES_OK);
+    send_http_reply_start (req, is_range ? EVHTP_RES_PARTIAL : EVHTP_RES_OK);
 
     return 0;
 }
@@ -452,18 +844,16 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         const char *filename, const char *operation,
         SeafileCryptKey *crypt_key)
 {
-    char *zipfile = NULL;
+    PackDirStream *stream = NULL;
+    ZipCacheEntry *entry = NULL;
+    int fd = -1;
     char *filename_escaped = NULL;
     char cont_filename[PATH_MAX];
-    char file_size[255];
-    struct stat st;
     char *key_hex, *iv_hex;
     unsigned char enc_key[16], enc_iv[16];
     SeafileCrypt *crypt = NULL;
-    int zipfd = 0;
     int ret = 0;
 
-    /* Let's zip the directory first */
     filename_escaped = g_uri_unescape_string (filename, NULL);
     if (!filename_escaped) {
         seaf_warning ("failed to unescape string %s\n", filename);
@@ -483,24 +873,29 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         g_free (iv_hex);
     }
 
-    zipfile = pack_dir (filename_escaped, file_id, crypt, test_windows(req));
-    if (!zipfile) {
-        ret = -1;
-        goto out;
+    /* Decrypted archives are never cached. */
+    if (!crypt && seaf->zip_cache) {
+        entry = zip_cache_get (seaf->zip_cache, filename_escaped, file_id,
+                               test_windows(req));
+        if (entry && (fd = zip_cache_entry_open (entry)) < 0) {
+            zip_cache_entry_unref (entry);
+            entry = NULL;
+        }
     }
-    
-    /* OK, the dir is zipped */
-    evhtp_headers_add_header(req->headers_out,
-                evhtp_header_new("Content-Type", "application/zip", 1, 1));
-    
-    if (stat(zipfile, &st) < 0) {
-        ret = -1;
-        goto out;
+
+    if (!entry) {
+        stream = pack_dir_stream_new (filename_escaped, file_id, crypt,
+                                      test_windows(req));
+        if (!stream) {
+            ret = -1;
+            goto out;
+        }
     }
 
-    snprintf (file_size, sizeof(file_size), "%"G_GUINT64_FORMAT"", st.st_size);
-    evhtp_headers_add_header (req->headers_out,
-            evhtp_header_new("Content-Length", file_size, 1, 1));
+    /* The size isn't known before the archive is generated, so it's sent
+     * in chunked encoding. */
+    evhtp_headers_add_header(req->headers_out,
+                evhtp_header_new("Content-Type", "application/zip", 1, 1));
 
     if (test_firefox (req)) {
         snprintf(cont_filename, PATH_MAX,
@@ -513,19 +908,13 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     evhtp_headers_add_header(req->headers_out,
             evhtp_header_new("Content-Disposition", cont_filename, 1, 1));
 
-    zipfd = open (zipfile, O_RDONLY);
-    if (zipfd < 0) {
-        seaf_warning ("failed to open zipfile %s\n", zipfile);
-        ret = -1;
-        goto out;
-    }
-
     SendDirData *data;
     data = g_new0 (SendDirData, 1);
     data->req = req;
-    data->zipfd = zipfd;
-    data->zipfile = zipfile;
-    data->remain = st.st_size;
+    data->stream = stream;
+    data->entry = entry;
+    data->fd = fd;
+    data->buf = evbuffer_new ();
 
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
@@ -537,7 +926,7 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     data->saved_cb_arg = bev->cbarg;
     bufferevent_setcb (bev,
                        NULL,
-                       write_dir_data_cb,
+                       entry ? write_cached_dir_cb : write_dir_data_cb,
                        my_dir_event_cb,
                        data);
     /* Block any new request from this connection before finish
@@ -546,20 +935,35 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     evhtp_request_pause (req);
 
     /* Kick start data transfer by sending out http headers. */
-    evhtp_send_reply_start(req, EVHTP_RES_OK);
+    send_http_reply_chunk_start (req, EVHTP_RES_OK);
 
 out:
     g_free (filename_escaped);
-    if (ret < 0) {
-        if (zipfile != NULL) {
-            unlink (zipfile);
-            g_free (zipfile);
-        }
 
-        if (zipfd > 0) {
-            close (zipfd);
+    return ret;
+}
+
+/*
+ * Whether an If-None-Match value matches @etag. It's "*" or a list of
+ * entity tags, compared weakly.
+ */
+static gboolean
+etag_list_matches (const char *value, const char *etag)
+{
+    char **tags, **p, *tag;
+    gboolean ret = FALSE;
+
+    tags = g_strsplit (value, ",", 0);
+    for (p = tags; *p != NULL; ++p) {
+        tag = g_strstrip (*p);
+        if (strncmp (tag, "W/", 2) == 0)
+            tag += 2;
+        if (strcmp (tag, "*") == 0 || strcmp (tag, etag) == 0) {
+            ret = TRUE;
+            break;
         }
     }
+    g_strfreev (tags);
 
     return ret;
 }
@@ -582,6 +986,8 @@ access_cb(evhtp_request_t *req, void *arg)
     SeafileCryptKey *key = NULL;
     SeafileWebAccess *webaccess = NULL;
 
+    http_request_start (req);
+
     /* Skip the first '/'. */
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     if (!parts || g_strv_length (parts) < 3 ||
@@ -593,24 +999,63 @@ access_cb(evhtp_request_t *req, void *arg)
     token = parts[1];
     filename = parts[2];
 
+    /* Queried in a worker thread of the server, not its main loop. */
     rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
                                                  NULL,
-                                                 "seafserv-rpcserver");
+                                                 "seafserv-threaded-rpcserver");
 
     webaccess = (SeafileWebAccess *) searpc_client_call__object (
         rpc_client, "seafile_web_query_access_token", SEAFILE_TYPE_WEB_ACCESS,
         NULL, 1, "string", token);
+    ccnet_rpc_client_free (rpc_client);
+    rpc_client = NULL;
     if (!webaccess) {
         error = "Bad access token";
         goto bad_req;
     }
 
-    if (evhtp_kv_find (req->headers_in, "If-Modified-Since") != NULL) {
-        evhtp_send_reply (req, EVHTP_RES_NOTMOD);
+    repo_id = seafile_web_access_get_repo_id (webaccess);
+    id = seafile_web_access_get_obj_id (webaccess);
+    operation = seafile_web_access_get_op (webaccess);
+    user = seafile_web_access_get_username (webaccess);
+
+    /* A token always refers to the same file id, and the content of a
+     * file id never changes. So a cached copy is valid for good, and
+     * can be validated before anything is read. Archives of dirs are
+     * generated, their bytes aren't fixed by the dir id.
+     */
+    if (strcmp (operation, "download-dir") != 0) {
+        const char *if_none_match;
+        char etag[64];
+
+        snprintf (etag, sizeof(etag), "\"%s\"", id);
+        evhtp_kvs_add_kv (req->headers_out,
+                          evhtp_kv_new ("Cache-Control",
+                                        FILE_CACHE_CONTROL, 1, 1));
+
+        /* Takes precedence over If-Modified-Since. */
+        if_none_match = evhtp_kv_find (req->headers_in, "If-None-Match");
+        if (if_none_match) {
+            if (etag_list_matches (if_none_match, etag)) {
+                evhtp_kvs_add_kv (req->headers_out,
+                                  evhtp_kv_new ("ETag", etag, 1, 1));
+                send_http_reply (req, EVHTP_RES_NOTMOD);
+                goto success;
+            }
+        } else if (evhtp_kv_find (req->headers_in, "If-Modified-Since")) {
+            send_http_reply (req, EVHTP_RES_NOTMOD);
+            goto success;
+        }
+    } else if (evhtp_kv_find (req->headers_in, "If-Modified-Since") != NULL) {
+        send_http_reply (req, EVHTP_RES_NOTMOD);
         goto success;
     } else {
+        evhtp_kvs_add_kv (req->headers_out,
+                          evhtp_kv_new ("Cache-Control", "max-age=3600", 1, 1));
+    }
+
+    if (!evhtp_kv_find (req->headers_in, "If-Modified-Since")) {
         char http_date[256];
-        evhtp_kv_t *kv;
         time_t now = time(NULL);
 
         /* Set Last-Modified header if the client gets this file
@@ -620,18 +1065,10 @@ access_cb(evhtp_request_t *req, void *arg)
          */
         strftime (http_date, sizeof(http_date), "%a, %d %b %Y %T GMT",
                   gmtime(&now));
-        kv = evhtp_kv_new ("Last-Modified", http_date, 1, 1);
-        evhtp_kvs_add_kv (req->headers_out, kv);
-
-        kv = evhtp_kv_new ("Cache-Control", "max-age=3600", 1, 1);
-        evhtp_kvs_add_kv (req->headers_out, kv);
+        evhtp_kvs_add_kv (req->headers_out,
+                          evhtp_kv_new ("Last-Modified", http_date, 1, 1));
     }
 
-    repo_id = seafile_web_access_get_repo_id (webaccess);
-    id = seafile_web_access_get_obj_id (webaccess);
-    operation = seafile_web_access_get_op (webaccess);
-    user = seafile_web_access_get_username (webaccess);
-
     repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
     if (!repo) {
         error = "Bad repo id\n";
@@ -639,6 +1076,9 @@ access_cb(evhtp_request_t *req, void *arg)
     }
 
     if (repo->encrypted) {
+        rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                     NULL,
+                                                     "seafserv-rpcserver");
         err = NULL;
         key = (SeafileCryptKey *) seafile_get_decrypt_key (rpc_client,
                                                            repo_id, user, &err);
@@ -665,7 +1105,8 @@ access_cb(evhtp_request_t *req, void *arg)
     }
 
 success:
-    ccnet_rpc_client_free (rpc_client);
+    if (rpc_client)
+        ccnet_rpc_client_free (rpc_client);
 
     g_strfreev (parts);
     if (repo != NULL)
@@ -692,7 +1133,7 @@ bad_req:
 
     seaf_warning ("fetch failed: %s\n", error);
     evbuffer_add_printf(req->buffer_out, "%s\n", error);
-    evhtp_send_reply(req, EVHTP_RES_BADREQ);
+    send_http_reply (req, EVHTP_RES_BADREQ);
 }
 
 int
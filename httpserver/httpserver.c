@@ -6,14 +6,20 @@
 #include <getopt.h>
 
 #include <event.h>
+#include <event2/thread.h>
 #include <evhtp.h>
 
 #include <ccnet.h>
 
 #include "seafile-session.h"
 #include "httpserver.h"
+#include "backend-stats.h"
+#include "metrics.h"
+#include "seaf-probes.h"
+#include "seaf-utils.h"
 #include "access-file.h"
 #include "upload-file.h"
+#include "upload-session.h"
 
 static char *config_dir = NULL;
 static char *seafile_dir = NULL;
@@ -58,7 +64,163 @@ static void
 default_cb(evhtp_request_t *req, void *arg)
 {
     /* Return empty page. */
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    send_http_reply (req, EVHTP_RES_OK);
+}
+
+/* Handlers are told apart by the prefix of the path. */
+static const struct {
+    const char *prefix;
+    const char *name;
+} handlers[] = {
+    { "/files/", "files" },
+    { "/upload/", "upload" },
+    { "/update/", "update" },
+    { "/upload_progress", "upload_progress" },
+    { "/upload-session/", "upload_session" },
+    { "/upload-chunk/", "upload_chunk" },
+    { "/upload-finish/", "upload_finish" },
+    { "/metrics", "metrics" },
+    { "", "other" },
+};
+
+#define N_HANDLERS G_N_ELEMENTS(handlers)
+#define N_CODE_CLASSES 5        /* 1xx to 5xx */
+
+static Metric *requests_in_flight[N_HANDLERS];
+static Metric *request_duration[N_HANDLERS];
+static Metric *responses[N_HANDLERS][N_CODE_CLASSES];
+
+struct HttpRequestTimer {
+    evhtp_request_t *req;
+    int    handler;
+    gint64 start;
+};
+
+static void
+http_metrics_init ()
+{
+    char labels[64];
+    int i, c;
+
+    for (i = 0; i < N_HANDLERS; ++i) {
+        snprintf (labels, sizeof(labels), "handler=\"%s\"", handlers[i].name);
+        requests_in_flight[i] = metrics_gauge ("seaf_http_requests_in_flight",
+                                               labels,
+                                               "HTTP requests being served.");
+        request_duration[i] = metrics_histogram (
+            "seaf_http_request_duration_seconds", labels,
+            "Time from the handler until the request is done.",
+            metrics_latency_bounds, metrics_n_latency_bounds, 1e-6);
+
+        for (c = 0; c < N_CODE_CLASSES; ++c) {
+            snprintf (labels, sizeof(labels), "handler=\"%s\",code=\"%dxx\"",
+                      handlers[i].name, c + 1);
+            responses[i][c] = metrics_counter ("seaf_http_responses_total",
+                                               labels,
+                                               "HTTP replies by status class.");
+        }
+    }
+}
+
+static int
+request_handler (evhtp_request_t *req)
+{
+    const char *path = req->uri->path->full;
+    int i;
+
+    for (i = 0; i < N_HANDLERS - 1; ++i)
+        if (strncmp (path, handlers[i].prefix,
+                     strlen(handlers[i].prefix)) == 0)
+            break;
+    return i;
+}
+
+static evhtp_res
+request_timer_fini_cb (evhtp_request_t *req, void *arg)
+{
+    http_request_timer_done (arg);
+    return EVHTP_RES_OK;
+}
+
+HttpRequestTimer *
+http_request_start (evhtp_request_t *req)
+{
+    HttpRequestTimer *timer = g_new0 (HttpRequestTimer, 1);
+
+    SEAF_PROBE3 (http_request_start, req, evhtp_request_get_method (req),
+                 req->uri->path->full);
+
+    timer->req = req;
+    timer->handler = request_handler (req);
+    timer->start = backend_stats_now ();
+    metrics_gauge_add (requests_in_flight[timer->handler], 1);
+
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini,
+                    request_timer_fini_cb, timer);
+
+    return timer;
+}
+
+void
+http_request_timer_done (HttpRequestTimer *timer)
+{
+    if (!timer)
+        return;
+
+    SEAF_PROBE2 (http_request_done, timer->req, timer->req->status);
+
+    metrics_histogram_observe (request_duration[timer->handler],
+                               backend_stats_now () - timer->start);
+    metrics_gauge_add (requests_in_flight[timer->handler], -1);
+    g_free (timer);
+}
+
+static void
+count_reply (evhtp_request_t *req, evhtp_res code)
+{
+    int c = code / 100 - 1;
+
+    if (c >= 0 && c < N_CODE_CLASSES)
+        metrics_counter_add (responses[request_handler (req)][c], 1);
+}
+
+void
+send_http_reply (evhtp_request_t *req, evhtp_res code)
+{
+    count_reply (req, code);
+    evhtp_send_reply (req, code);
+}
+
+void
+send_http_reply_start (evhtp_request_t *req, evhtp_res code)
+{
+    count_reply (req, code);
+    evhtp_send_reply_start (req, code);
+}
+
+void
+send_http_reply_chunk_start (evhtp_request_t *req, evhtp_res code)
+{
+    count_reply (req, code);
+    evhtp_send_reply_chunk_start (req, code);
+}
+
+static void
+metrics_cb (evhtp_request_t *req, void *arg)
+{
+    GString *buf = g_string_new (NULL);
+
+    http_request_start (req);
+
+    metrics_format (buf);
+    evbuffer_add (req->buffer_out, buf->str, buf->len);
+    g_string_free (buf, TRUE);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Type",
+                                                "text/plain; version=0.0.4",
+                                                1, 1));
+    send_http_reply (req, EVHTP_RES_OK);
 }
 
 int
@@ -145,6 +307,8 @@ main(int argc, char *argv[])
 #endif    
 
     g_type_init();
+    if (!g_thread_supported ())
+        g_thread_init (NULL);
 
     ccnet_client = ccnet_client_new();
     if ((ccnet_client_load_confdir(ccnet_client, config_dir)) < 0) {
@@ -176,6 +340,12 @@ main(int argc, char *argv[])
         exit (1);
     }
 
+    /* Prefetch threads wake up the event loops of the evhtp threads. */
+    if (evthread_use_pthreads () < 0) {
+        g_warning ("Failed to enable libevent threading.\n");
+        exit (1);
+    }
+
     evbase = event_base_new();
     htp = evhtp_new(evbase, NULL);
 
@@ -194,12 +364,26 @@ main(int argc, char *argv[])
         bind_port = https_port;
     }
 
+    http_metrics_init ();
+    seaf_add_session_metrics (seaf);
+
     if (access_file_init (htp) < 0)
         exit (1);
 
     if (upload_file_init (htp) < 0)
         exit (1);
+
+    if (upload_session_init (htp) < 0)
+        exit (1);
     
+    /*
+     * [httpserver]
+     * enable_metrics = true    (serve the metrics at /metrics)
+     */
+    if (g_key_file_get_boolean (seaf->config, "httpserver",
+                                "enable_metrics", NULL))
+        evhtp_set_cb (htp, "/metrics", metrics_cb, NULL);
+
     evhtp_set_gencb(htp, default_cb, NULL);
 
     evhtp_use_threads(htp, NULL, num_threads, NULL);
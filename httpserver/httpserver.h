@@ -1,6 +1,31 @@
 #ifndef HTTPSERVER_H
 #define HTTPSERVER_H
 
+#include <evhtp.h>
+
 extern SeafileSession *seaf;
 
+/*
+ * Request metrics, by handler. A request is timed from its handler
+ * until it's freed. Handlers that set a request fini hook of their own
+ * after http_request_start() call http_request_timer_done() from it.
+ */
+typedef struct HttpRequestTimer HttpRequestTimer;
+
+HttpRequestTimer *
+http_request_start (evhtp_request_t *req);
+
+void
+http_request_timer_done (HttpRequestTimer *timer);
+
+/* evhtp_send_reply*() that also count the status of the reply. */
+void
+send_http_reply (evhtp_request_t *req, evhtp_res code);
+
+void
+send_http_reply_start (evhtp_request_t *req, evhtp_res code);
+
+void
+send_http_reply_chunk_start (evhtp_request_t *req, evhtp_res code);
+
 #endif /* HTTPSERVER_H */
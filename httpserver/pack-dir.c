@@ -3,6 +3,8 @@
 #define DEBUG_FLAG SEAFILE_DEBUG_HTTP
 #include "log.h"
 
+#include <event.h>
+
 #include <ccnet.h>
 
 #include "seafile-object.h"
@@ -13,19 +15,48 @@
 
 #include "seafile-session.h"
 #include "httpserver.h"
+#include "pack-dir.h"
 
 #include <archive.h>
 #include <archive_entry.h>
 #include <iconv.h>
 
+/* Data passed to libarchive at a time. */
+#define WRITE_CHUNK_SIZE (64 * 1024)
+
+/* A dir being archived. */
 typedef struct {
+    SeafDir *dir;
+    GList *ptr;                 /* next entry */
+    char *path;                 /* relative to the top dir */
+} DirIter;
+
+struct _PackDirStream {
     struct archive *a;
     SeafileCrypt *crypt;
-    const char *top_dir_name;
+    char *top_dir_name;
     gboolean is_windows;
     time_t mtime;
 
-} PackDirData;
+    /* Where libarchive's output goes, during pack_dir_stream_next(). */
+    struct evbuffer *out;
+
+    GList *dirs;                /* stack of DirIter, innermost first */
+    gboolean finished;
+
+    /* The file being archived. */
+    Seafile *file;
+    SeafBlockPrefetcher *pf;
+    int idx;
+    char *blk_data;
+    int blk_len;
+    int blk_off;
+
+    /* Set up once for the whole archive if the repo is encrypted. */
+    SeafileCipher cipher;
+    gboolean cipher_init;
+    char *dec_buf;              /* WRITE_CHUNK_SIZE + BLK_SIZE bytes */
+};
 
 static char *
 do_iconv (char *fromcode, char *tocode, char *in)
@@ -56,34 +87,74 @@ do_iconv (char *fromcode, char *tocode, char *in)
     return g_strndup(out, outlen);
 }
 
+static ssize_t
+write_cb (struct archive *a, void *vstream, const void *buf, size_t len)
+{
+    PackDirStream *stream = vstream;
+
+    if (evbuffer_add (stream->out, buf, len) < 0) {
+        archive_set_error (a, ENOMEM, "Failed to buffer data");
+        return -1;
+    }
+    return len;
+}
+
+static void
+dir_iter_free (DirIter *iter)
+{
+    seaf_dir_free (iter->dir);
+    g_free (iter->path);
+    g_free (iter);
+}
+
 static int
-add_file_to_archive (PackDirData *data,
-                     const char *parent_dir,
-                     SeafDirent *dent)
+push_dir (PackDirStream *stream, const char *dir_id, const char *path)
 {
-    struct archive *a = data->a;
-    struct SeafileCrypt *crypt = data->crypt;
-    gboolean is_windows = data->is_windows;
-    const char *top_dir_name = data->top_dir_name;
-    
+    DirIter *iter;
+    SeafDir *dir;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        seaf_warning ("failed to get dir %s\n", dir_id);
+        return -1;
+    }
+
+    iter = g_new0 (DirIter, 1);
+    iter->dir = dir;
+    iter->ptr = dir->entries;
+    iter->path = g_strdup (path);
+    stream->dirs = g_list_prepend (stream->dirs, iter);
+
+    return 0;
+}
+
+static void
+close_file (PackDirStream *stream)
+{
+    if (stream->pf) {
+        seaf_block_prefetcher_free (stream->pf);
+        stream->pf = NULL;
+    }
+    g_free (stream->blk_data);
+    stream->blk_data = NULL;
+    if (stream->file) {
+        seafile_unref (stream->file);
+        stream->file = NULL;
+    }
+}
+
+/* Write the header of a file, and start fetching its blocks. */
+static int
+open_file (PackDirStream *stream, const char *parent_dir, SeafDirent *dent)
+{
+    struct archive *a = stream->a;
     struct archive_entry *entry = NULL;
     Seafile *file = NULL;
     char *pathname = NULL;
-    char buf[64 * 1024];
-    int len = 0;
-    int n = 0;
-    int idx = 0;
-    BlockHandle *handle = NULL;
-    BlockMetadata *bmd = NULL;
-    char *blk_id = NULL;
-    uint32_t remain = 0;
-    EVP_CIPHER_CTX ctx;
-    gboolean enc_init = FALSE;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
     int ret = 0;
 
-    pathname = g_build_filename (top_dir_name, parent_dir, dent->name, NULL);
+    pathname = g_build_filename (stream->top_dir_name, parent_dir,
+                                 dent->name, NULL);
 
     file = seaf_fs_manager_get_seafile (seaf->fs_mgr, dent->id);
     if (!file) {
@@ -94,7 +165,7 @@ add_file_to_archive (PackDirData *data,
     entry = archive_entry_new ();
 
     /* File name fixup for WinRAR */
-    if (is_windows && seaf->windows_encoding) {
+    if (stream->is_windows && seaf->windows_encoding) {
         char *win_file_name = do_iconv ("UTF-8", seaf->windows_encoding, pathname);
         if (!win_file_name) {
             seaf_warning ("Failed to convert file name to %s\n", seaf->windows_encoding);
@@ -111,242 +182,259 @@ add_file_to_archive (PackDirData *data,
     /* FIXME: 0644 should be set when upload files in repo-mgr.c */
     archive_entry_set_mode (entry, dent->mode | 0644);
     archive_entry_set_size (entry, file->file_size);
-    archive_entry_set_mtime (entry, data->mtime, 0);
+    archive_entry_set_mtime (entry, stream->mtime, 0);
 
-    n = archive_write_header (a, entry);
-    if (n != ARCHIVE_OK) {
+    if (archive_write_header (a, entry) != ARCHIVE_OK) {
         seaf_warning ("archive_write_header  error: %s\n", archive_error_string(a));
         ret = -1;
         goto out;
     }
 
-    /* Read data of this entry block by block */
-    while (idx < file->n_blocks) {
-        blk_id = file->blk_sha1s[idx];
-        handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                blk_id, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("Failed to open block %s\n", blk_id);
-            ret = -1;
-            goto out;
-        }
+    if (file->n_blocks == 0)
+        goto out;
 
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       handle);
-        if (!bmd) {
-            seaf_warning ("Failed to stat block %s\n", blk_id);
-            ret = -1;
-            goto out;
+    /* The next blocks are fetched ahead while earlier ones are sent. */
+    stream->pf = seaf_block_manager_prefetch_blocks (seaf->block_mgr,
+                                                     file->blk_sha1s,
+                                                     file->n_blocks);
+    if (!stream->pf) {
+        ret = -1;
+        goto out;
+    }
+    stream->file = file;
+    stream->idx = 0;
+    file = NULL;
+
+out:
+    g_free (pathname);
+    if (entry)
+        archive_entry_free (entry);
+    if (file)
+        seafile_unref (file);
+
+    return ret;
+}
+
+static int
+archive_write (struct archive *a, const char *buf, int len)
+{
+    int n;
+
+    if (len == 0)
+        return 0;
+
+    n = archive_write_data (a, buf, len);
+    if (n <= 0) {
+        seaf_warning ("archive_write_data returned %d\n", n);
+        return -1;
+    }
+    return 0;
+}
+
+/* Write the next piece of the current file. */
+static int
+write_file_piece (PackDirStream *stream)
+{
+    SeafileCrypt *crypt = stream->crypt;
+    char *blk_id = stream->file->blk_sha1s[stream->idx];
+    char *buf;
+    int n, dec_out_len = -1;
+
+    if (!stream->blk_data) {
+        if (seaf_block_prefetcher_next (stream->pf, &stream->blk_data,
+                                        &stream->blk_len) != 0) {
+            seaf_warning ("Failed to read block %s\n", blk_id);
+            return -1;
         }
-        remain = bmd->size;
-        g_free (bmd);
+        stream->blk_off = 0;
 
-        if (crypt) {
-            if (seafile_decrypt_init (&ctx, crypt->version,
-                                      crypt->key, crypt->iv) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
-                ret = -1;
-                goto out;
-            }
-            enc_init = TRUE;
+        if (crypt && seafile_cipher_begin (&stream->cipher) < 0) {
+            seaf_warning ("Failed to init decrypt.\n");
+            return -1;
         }
+    }
 
-        while (remain != 0) {
-            n = seaf_block_manager_read_block (seaf->block_mgr, handle,
-                                               buf, sizeof(buf));
-            if (n <= 0) {
-                seaf_warning ("failed to read block %s\n", blk_id);
-                ret = -1;
-                goto out;
-            }
-            remain -= n;
-
-            /* OK, We're read some data of this block  */
-            if (crypt == NULL) {
-                /* not encrypted */
-                len = archive_write_data (a, buf, n);
-                if (len <= 0) {
-                    seaf_warning ("archive_write_data returned %d\n", len);
-                    ret = -1;
-                    goto out;
-                }
+    n = MIN (stream->blk_len - stream->blk_off, WRITE_CHUNK_SIZE);
+    buf = stream->blk_data + stream->blk_off;
+    stream->blk_off += n;
 
-            } else {
-                /* an encrypted block */
-                dec_out = g_new (char, n + 16);
-                if (!dec_out) {
-                    seaf_warning ("Failed to alloc memory.\n");
-                    ret = -1;
-                    goto out;
-                }
-
-                int r = EVP_DecryptUpdate (&ctx,
-                                           (unsigned char *)dec_out,
-                                           &dec_out_len,
-                                           (unsigned char *)buf,
-                                           n);
-                if (r != 0) {
-                    seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                    ret = -1;
-                    goto out;
-                }
-
-                if (dec_out_len > 0) {
-                    len = archive_write_data (a, dec_out, dec_out_len);
-                    if (len <= 0) {
-                        seaf_warning ("archive_write_data returned %d\n", len);
-                        ret = -1;
-                        goto out;
-                    }
-                }
-
-                /* If it's the last piece of a block, call decrypt_final()
-                 * to decrypt the possible partial block. */
-                if (remain == 0) {
-                    r = EVP_DecryptFinal (&ctx,
-                                          (unsigned char *)dec_out,
-                                          &dec_out_len);
-                    if (r != 0) {
-                        seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                        ret = -1;
-                        goto out;
-                    }
-
-                    if (dec_out_len != 0) {
-                        len = archive_write_data (a, dec_out, dec_out_len);
-                        if (len <= 0) {
-                            seaf_warning ("archive_write_data returned %d\n", len);
-                            ret = -1;
-                            goto out;
-                        }
-                    }
-                }
-
-                g_free (dec_out);
-                dec_out = NULL;
+    if (crypt == NULL) {
+        if (archive_write (stream->a, buf, n) < 0)
+            return -1;
+    } else {
+        if (seafile_cipher_update (&stream->cipher, buf, n,
+                                   stream->dec_buf, &dec_out_len) < 0) {
+            seaf_warning ("Decrypt block %s failed.\n", blk_id);
+            return -1;
+        }
+        if (archive_write (stream->a, stream->dec_buf, dec_out_len) < 0)
+            return -1;
+
+        /* If it's the last piece of a block, decrypt the possible
+         * partial block. */
+        if (stream->blk_off == stream->blk_len) {
+            if (seafile_cipher_final (&stream->cipher, stream->dec_buf,
+                                      &dec_out_len) < 0) {
+                seaf_warning ("Decrypt block %s failed.\n", blk_id);
+                return -1;
             }
+            if (archive_write (stream->a, stream->dec_buf, dec_out_len) < 0)
+                return -1;
         }
-
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        handle = NULL;
-
-        /* turn to next block */
-        idx++;
     }
 
-out:
-    g_free (pathname);
-    if (entry)
-        archive_entry_free (entry);
-    if (file)
-        seafile_unref (file);
-    if (handle) {
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, handle);
+    if (stream->blk_off == stream->blk_len) {
+        g_free (stream->blk_data);
+        stream->blk_data = NULL;
+
+        if (++(stream->idx) == stream->file->n_blocks)
+            close_file (stream);
     }
-    if (crypt != NULL && enc_init)
-        EVP_CIPHER_CTX_cleanup (&ctx);
-    g_free (dec_out);
 
-    return ret;
+    return 0;
 }
 
+/* Write the header of the next file in the tree, 1 if there's none left. */
 static int
-archive_dir (PackDirData *data,
-             const char *root_id,
-             const char *dirpath)
-             
+write_next_header (PackDirStream *stream)
 {
-    SeafDir *dir = NULL;
+    DirIter *iter;
     SeafDirent *dent;
-    GList *ptr;
-    char *subpath = NULL;
-    int ret = 0;
+    char *subpath;
+    int ret;
+
+    while (stream->dirs) {
+        iter = stream->dirs->data;
+        if (!iter->ptr) {
+            stream->dirs = g_list_delete_link (stream->dirs, stream->dirs);
+            dir_iter_free (iter);
+            continue;
+        }
 
-    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, root_id);
-    if (!dir) {
-        seaf_warning ("failed to get dir %s\n", root_id);
-        goto out;
-    }
+        dent = iter->ptr->data;
+        iter->ptr = iter->ptr->next;
 
-    for (ptr = dir->entries; ptr; ptr = ptr->next) {
-        dent = ptr->data;
         if (S_ISREG(dent->mode)) {
-            ret = add_file_to_archive (data, dirpath, dent);
+            return open_file (stream, iter->path, dent);
 
         } else if (S_ISLNK(dent->mode)) {
-            if (archive_version_number() >= 3000001) {
-                /* Symlink in zip arhive is not supported in earlier version
-                 * of libarchive */
-                ret = add_file_to_archive (data, dirpath, dent);
-            }
+            /* Symlink in zip arhive is not supported in earlier version
+             * of libarchive */
+            if (archive_version_number() >= 3000001)
+                return open_file (stream, iter->path, dent);
 
         } else if (S_ISDIR(dent->mode)) {
-            subpath = g_build_filename (dirpath, dent->name, NULL);
-            ret = archive_dir (data, dent->id, subpath);
+            subpath = g_build_filename (iter->path, dent->name, NULL);
+            ret = push_dir (stream, dent->id, subpath);
             g_free (subpath);
-        }
-
-        if (ret < 0) {
-            goto out;
+            if (ret < 0)
+                return -1;
         }
     }
 
-out:
-    if (dir)
-        seaf_dir_free (dir);
-
-    return ret;
+    return 1;
 }
 
-char *pack_dir (const char *dirname,
-                const char *root_id,
-                SeafileCrypt *crypt,
-                gboolean is_windows)
+PackDirStream *
+pack_dir_stream_new (const char *dirname,
+                     const char *root_id,
+                     SeafileCrypt *crypt,
+                     gboolean is_windows)
 {
-    struct archive *a = NULL;
-    char *tmpfile_name = NULL ;
-    char *ret = NULL;
-    int fd = -1;
+    PackDirStream *stream = g_new0 (PackDirStream, 1);
+
+    stream->crypt = crypt;
+    stream->top_dir_name = g_strdup (dirname);
+    stream->is_windows = is_windows;
+    stream->mtime = time(NULL);
+
+    if (crypt) {
+        if (seafile_cipher_init (&stream->cipher, crypt, 0) < 0) {
+            seaf_warning ("Failed to init decrypt.\n");
+            pack_dir_stream_free (stream);
+            return NULL;
+        }
+        stream->cipher_init = TRUE;
+        stream->dec_buf = g_malloc (WRITE_CHUNK_SIZE + BLK_SIZE);
+    }
 
-    fd = g_file_open_tmp ("seafile-XXXXXX.zip", &tmpfile_name, NULL);
-    if (fd < 0) {
-        goto out;
+    if (push_dir (stream, root_id, "") < 0) {
+        pack_dir_stream_free (stream);
+        return NULL;
     }
 
-    a = archive_write_new ();
-    archive_write_set_compression_none (a);
-    archive_write_set_format_zip (a);
-    archive_write_open_fd (a, fd);
+    stream->a = archive_write_new ();
+    archive_write_set_compression_none (stream->a);
+    archive_write_set_format_zip (stream->a);
+    /* The output can't be seeked back, so entries are followed by data
+     * descriptors. Zip64 lets files and archives exceed 4GB, older
+     * libarchive ignores the option. */
+    archive_write_set_options (stream->a, "zip:zip64");
+    /* Pass data to write_cb as soon as it's written, without padding the
+     * last block. */
+    archive_write_set_bytes_per_block (stream->a, 0);
+
+    if (archive_write_open (stream->a, stream, NULL, write_cb, NULL) != ARCHIVE_OK) {
+        seaf_warning ("Failed to open archive: %s\n",
+                      archive_error_string (stream->a));
+        pack_dir_stream_free (stream);
+        return NULL;
+    }
 
-    PackDirData *data = g_new0 (PackDirData, 1);
-    data->crypt = crypt;
-    data->is_windows = is_windows;
-    data->a = a;
-    data->top_dir_name = dirname;
-    data->mtime = time(NULL);
+    return stream;
+}
 
-    if (archive_dir (data, root_id, "") < 0) {
-        g_debug ("failed to archive_dir\n");
-        goto out;
-    }
+int
+pack_dir_stream_next (PackDirStream *stream, struct evbuffer *out)
+{
+    size_t len = evbuffer_get_length (out);
+    int rc, ret = 1;
 
-    if (archive_write_finish(a) < 0) {
-        goto out;
-    }
+    if (stream->finished)
+        return 0;
 
-    ret = g_strdup (tmpfile_name);
+    stream->out = out;
 
-out:
-    if (data) g_free (data);
-    if (fd > 0) close (fd);
-    
-    if (!ret && tmpfile_name) {
-        /* zip failed: remove tmp file */
-        unlink (tmpfile_name);
+    /* Until some data is produced, since some entries may be skipped. */
+    while (ret == 1 && evbuffer_get_length (out) == len) {
+        if (stream->file) {
+            if (write_file_piece (stream) < 0)
+                ret = -1;
+            continue;
+        }
+
+        rc = write_next_header (stream);
+        if (rc < 0) {
+            ret = -1;
+        } else if (rc == 1) {
+            /* All files are written, add the central directory. */
+            if (archive_write_close (stream->a) != ARCHIVE_OK) {
+                seaf_warning ("Failed to close archive: %s\n",
+                              archive_error_string (stream->a));
+                ret = -1;
+            } else {
+                stream->finished = TRUE;
+                ret = 0;
+            }
+        }
     }
-    g_free (tmpfile_name);
 
+    stream->out = NULL;
     return ret;
 }
+
+void
+pack_dir_stream_free (PackDirStream *stream)
+{
+    close_file (stream);
+    g_list_foreach (stream->dirs, (GFunc)dir_iter_free, NULL);
+    g_list_free (stream->dirs);
+    if (stream->a)
+        archive_write_finish (stream->a);
+    g_free (stream->top_dir_name);
+    if (stream->cipher_init)
+        seafile_cipher_cleanup (&stream->cipher);
+    g_free (stream->dec_buf);
+    g_free (stream->crypt);
+    g_free (stream);
+}
@@ -1,11 +1,23 @@
 #ifndef PACK_DIR_H
 #define PACK_DIR_H
 
-/* Pack a seafile directory to a zipped archive, saved in a temporary file.
-   Return the path of this temporary file.
+struct evbuffer;
+
+/* Zip archive of a seafile directory, generated piece by piece while it's
+   sent, without a temporary file.
  */
-char *pack_dir (const char *dirname,
-                const char *root_id,
-                SeafileCrypt *crypt,
-                gboolean is_windows);
+typedef struct _PackDirStream PackDirStream;
+
+/* @crypt is taken over, even on failure. */
+PackDirStream *pack_dir_stream_new (const char *dirname,
+                                    const char *root_id,
+                                    SeafileCrypt *crypt,
+                                    gboolean is_windows);
+
+/* Append the next piece of the archive to @out.
+   Return 1 if there's more to come, 0 after the last piece, -1 on error.
+ */
+int pack_dir_stream_next (PackDirStream *stream, struct evbuffer *out);
+
+void pack_dir_stream_free (PackDirStream *stream);
 #endif
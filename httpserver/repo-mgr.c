@@ -13,6 +13,7 @@
 #include "commit-mgr.h"
 #include "branch-mgr.h"
 #include "repo-mgr.h"
+#include "repo-cache.h"
 #include "fs-mgr.h"
 #include "seafile-error.h"
 
@@ -23,6 +24,7 @@
 struct _SeafRepoManagerPriv {
     avl_tree_t *repo_tree;
     pthread_rwlock_t lock;
+    SeafRepoCache *repo_cache;
 };
 
 static SeafRepo *
@@ -104,6 +106,8 @@ seaf_repo_from_commit (SeafRepo *repo, SeafCommit *commit)
             memcpy (repo->magic, commit->magic, 33);
     }
     repo->no_local_history = commit->no_local_history;
+    repo->chunker = chunker_with_policy (commit->chunker,
+                                         commit->chunk_policy);
 }
 
 void
@@ -118,6 +122,8 @@ seaf_repo_to_commit (SeafRepo *repo, SeafCommit *commit)
             commit->magic = g_strdup (repo->magic);
     }
     commit->no_local_history = repo->no_local_history;
+    commit->chunker = CHUNKER_ALGO (repo->chunker);
+    commit->chunk_policy = g_strdup (chunker_get_policy (repo->chunker));
 }
 
 static gboolean
@@ -187,6 +193,8 @@ seaf_repo_manager_new (SeafileSession *seaf)
                                            NULL);
 
     pthread_rwlock_init (&mgr->priv->lock, NULL);
+    mgr->priv->repo_cache = seaf_repo_cache_new ((SeafRepoRefFunc)seaf_repo_ref,
+                                                 (SeafRepoRefFunc)seaf_repo_unref);
 
     return mgr;
 }
@@ -216,7 +224,7 @@ repo_exists_in_db (SeafDB *db, const char *id)
 SeafRepo*
 seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
 {
-    SeafRepo repo;
+    SeafRepo repo, *cached;
     int len = strlen(id);
 
     if (len >= 37)
@@ -239,11 +247,16 @@ seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
     }
 #endif
 
+    cached = seaf_repo_cache_lookup (manager->priv->repo_cache, id);
+    if (cached)
+        return cached;
+
     if (repo_exists_in_db (manager->seaf->db, id)) {
         SeafRepo *ret = load_repo (manager, id);
         if (!ret)
             return NULL;
-        /* seaf_repo_ref (ret); */
+        seaf_repo_cache_insert (manager->priv->repo_cache, id,
+                                ret->head->name, ret->head->commit_id, ret);
         return ret;
     }
 
@@ -34,6 +34,7 @@ struct _SeafRepo {
     int         enc_version;
     gchar       magic[33];       /* hash(repo_id + passwd), key stretched. */
     gboolean    no_local_history;
+    int         chunker;         /* CDC_ALGO_*, recorded in commits */
 
     SeafBranch *head;
 
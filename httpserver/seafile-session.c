@@ -36,6 +36,27 @@ load_zip_encoding_config (SeafileSession *session)
     }
 }
 
+#define DEFAULT_ZIP_CACHE_TTL 86400   /* 1 day */
+
+static void
+load_zip_cache_config (SeafileSession *session)
+{
+    int size_mb, ttl;
+    char *dir;
+
+    size_mb = g_key_file_get_integer (session->config, "zip", "cache_size", NULL);
+    if (size_mb <= 0)
+        return;
+
+    ttl = g_key_file_get_integer (session->config, "zip", "cache_ttl", NULL);
+    if (ttl <= 0)
+        ttl = DEFAULT_ZIP_CACHE_TTL;
+
+    dir = g_build_filename (session->seaf_dir, "zip-cache", NULL);
+    session->zip_cache = zip_cache_new (dir, (gint64)size_mb << 20, ttl);
+    g_free (dir);
+}
+
 SeafileSession *
 seafile_session_new(const char *seafile_dir,
                     CcnetClient *ccnet_session)
@@ -86,6 +107,7 @@ seafile_session_new(const char *seafile_dir,
         goto onerror;
     }
     load_zip_encoding_config (session);
+    load_zip_cache_config (session);
 
     session->fs_mgr = seaf_fs_manager_new (session, abs_seafile_dir);
     if (!session->fs_mgr)
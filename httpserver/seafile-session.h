@@ -11,6 +11,7 @@
 #include "repo-mgr.h"
 #include "db.h"
 #include "seaf-db.h"
+#include "zip-cache.h"
 
 struct _CcnetClient;
 
@@ -27,6 +28,7 @@ struct _SeafileSession {
     GKeyFile            *config;
     SeafDB              *db;
     char                *windows_encoding;
+    ZipCache            *zip_cache;     /* NULL if disabled */
 
     struct CcnetClientPool     *client_pool;
 
@@ -20,8 +20,10 @@
 #include "utils.h"
 
 #include "seafile-session.h"
+#include "cdc/seaf-sha1.h"
 #include "httpserver.h"
 #include "upload-file.h"
+#include "upload-progress.h"
 
 enum RecvState {
     RECV_INIT,
@@ -30,6 +32,13 @@ enum RecvState {
     RECV_ERROR,
 };
 
+/* Kinds of upload, the arg of upload_headers_cb(). */
+enum UploadKind {
+    UPLOAD_UPDATE = 0,
+    UPLOAD_NEW,
+    UPLOAD_BLOCKS,
+};
+
 enum UploadError {
     ERROR_FILENAME,
     ERROR_EXISTS,
@@ -40,17 +49,13 @@ enum UploadError {
     ERROR_INTERNAL,
 };
 
-typedef struct Progress {
-    gint64 uploaded;
-    gint64 size;
-} Progress;
-
 typedef struct RecvFSM {
     int state;
 
     char *repo_id;
     char *user;
     char *boundary;        /* boundary of multipart form-data. */
+    char *delimiter;       /* "\r\n--<boundary>", ends file data */
     char *input_name;      /* input name of the current form field. */
     evbuf_t *line;          /* buffer for a line */
 
@@ -58,22 +63,37 @@ typedef struct RecvFSM {
     GList *uploaded_files;      /* uploaded file names */
     GList *tmp_files;           /* tmp files for each uploaded file */
 
-    gboolean recved_crlf; /* Did we recv a CRLF when write out the last line? */
+    /* If set, files are chunked into blocks as they arrive, instead of
+     * being written to temp files. Only done for new files in
+     * unencrypted repos, since we don't have the repo passwords.
+     */
+    gboolean index_on_recv;
+    int chunker;
+    GList *file_ids;            /* seafile ids for each uploaded file */
+    SeafIndexStream *indexer;
+
+    /* The uploaded files are blocks named by their ids, see
+     * upload_blks_cb(). */
+    gboolean upload_blocks;
+
+    gint64 recved_size;         /* file data received so far */
+    gboolean too_large;
     char *file_name;
     char *tmp_file;
     int fd;
 
-    /* For upload progress. */
-    char *progress_id;
-    Progress *progress;
+    gint64 content_len;
+    UploadProgress *progress;
+    HttpRequestTimer *timer;
 } RecvFSM;
 
-#define MAX_CONTENT_LINE 10240
 #define TEMP_FILE_DIR "/tmp/seafhttp"
 #define MAX_UPLOAD_FILE_SIZE 100 * ((gint64)1 << 20) /* 100MB */
 
-static GHashTable *upload_progress;
-static pthread_mutex_t pg_lock;
+#define DEFAULT_PROGRESS_SLOTS 4096
+
+/* Most block ids checked in one upload-blks-check request. */
+#define MAX_CHECK_BLOCKS 10000
 
 /* IE8 will set filename to the full path of the uploaded file.
  * So we need to strip out the basename from it.
@@ -124,7 +144,7 @@ redirect_to_upload_error (evhtp_request_t *req,
     evhtp_headers_add_header(req->headers_out,
                              evhtp_header_new("Content-Length",
                                               "0", 1, 1));
-    evhtp_send_reply(req, EVHTP_RES_SEEOTHER);
+    send_http_reply (req, EVHTP_RES_SEEOTHER);
 }
 
 static void
@@ -148,7 +168,7 @@ redirect_to_update_error (evhtp_request_t *req,
     evhtp_headers_add_header(req->headers_out,
                              evhtp_header_new("Content-Length",
                                               "0", 1, 1));
-    evhtp_send_reply(req, EVHTP_RES_SEEOTHER);
+    send_http_reply (req, EVHTP_RES_SEEOTHER);
 }
 
 static void
@@ -171,7 +191,7 @@ redirect_to_success_page (evhtp_request_t *req,
     evhtp_headers_add_header(req->headers_out,
                              evhtp_header_new("Content-Length",
                                               "0", 1, 1));
-    evhtp_send_reply(req, EVHTP_RES_SEEOTHER);
+    send_http_reply (req, EVHTP_RES_SEEOTHER);
 }
 
 static gboolean
@@ -250,9 +270,9 @@ upload_cb(evhtp_request_t *req, void *arg)
     if (!fsm || fsm->state == RECV_ERROR)
         return;
 
-    if (!fsm->tmp_files) {
+    if (!fsm->tmp_files && !fsm->file_ids) {
         seaf_warning ("[upload] No file uploaded.\n");
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
         return;
     }
 
@@ -260,10 +280,16 @@ upload_cb(evhtp_request_t *req, void *arg)
     if (!parent_dir) {
         seaf_warning ("[upload] No parent dir given.\n");
         evbuffer_add_printf(req->buffer_out, "Invalid URL.\n");
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
         return;
     }
 
+    if (fsm->too_large) {
+        seaf_warning ("[upload] File size is too large.\n");
+        error_code = ERROR_SIZE;
+        goto error;
+    }
+
     if (!check_tmp_file_list (fsm->tmp_files, &error_code))
         goto error;
 
@@ -278,15 +304,25 @@ upload_cb(evhtp_request_t *req, void *arg)
     }
 
     filenames_json = file_list_to_json (fsm->uploaded_files);
-    tmp_files_json = file_list_to_json (fsm->tmp_files);
-
-    seafile_post_multi_files (rpc_client,
-                              fsm->repo_id,
-                              parent_dir,
-                              filenames_json,
-                              tmp_files_json,
-                              fsm->user,
-                              &error);
+    if (fsm->index_on_recv) {
+        tmp_files_json = file_list_to_json (fsm->file_ids);
+        seafile_post_indexed_files (rpc_client,
+                                    fsm->repo_id,
+                                    parent_dir,
+                                    filenames_json,
+                                    tmp_files_json,
+                                    fsm->user,
+                                    &error);
+    } else {
+        tmp_files_json = file_list_to_json (fsm->tmp_files);
+        seafile_post_multi_files (rpc_client,
+                                  fsm->repo_id,
+                                  parent_dir,
+                                  filenames_json,
+                                  tmp_files_json,
+                                  fsm->user,
+                                  &error);
+    }
     g_free (filenames_json);
     g_free (tmp_files_json);
     if (error) {
@@ -328,7 +364,7 @@ update_cb(evhtp_request_t *req, void *arg)
 
     if (!fsm->tmp_files) {
         seaf_warning ("[update] No file uploaded.\n");
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
         return;
     }
 
@@ -336,13 +372,19 @@ update_cb(evhtp_request_t *req, void *arg)
     if (!target_file) {
         seaf_warning ("[Update] No target file given.\n");
         evbuffer_add_printf(req->buffer_out, "Invalid URL.\n");
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
         return;
     }
 
     parent_dir = g_path_get_dirname (target_file);
     filename = g_path_get_basename (target_file);
 
+    if (fsm->too_large) {
+        seaf_warning ("[update] File size is too large.\n");
+        error_code = ERROR_SIZE;
+        goto error;
+    }
+
     if (!check_tmp_file_list (fsm->tmp_files, &error_code))
         goto error;
 
@@ -393,6 +435,228 @@ error:
     g_free (filename);
 }
 
+static gboolean
+is_block_id (const char *id)
+{
+    return (id && strlen (id) == 40 &&
+            strspn (id, "0123456789abcdef") == 40);
+}
+
+/* Parse a JSON list of block ids. Returns NULL if it's not one. */
+static char **
+parse_block_list (const char *data, gsize len, int *n_blocks)
+{
+    JsonParser *parser;
+    JsonNode *root;
+    JsonArray *array;
+    const char *id;
+    char **blk_ids = NULL;
+    int i, n;
+
+    if (!data || len == 0)
+        return NULL;
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_data (parser, data, len, NULL))
+        goto out;
+
+    root = json_parser_get_root (parser);
+    if (!root || !JSON_NODE_HOLDS_ARRAY (root))
+        goto out;
+    array = json_node_get_array (root);
+    n = json_array_get_length (array);
+
+    blk_ids = g_new0 (char *, n + 1);
+    for (i = 0; i < n; ++i) {
+        id = json_array_get_string_element (array, i);
+        if (!is_block_id (id)) {
+            g_strfreev (blk_ids);
+            blk_ids = NULL;
+            goto out;
+        }
+        blk_ids[i] = g_strdup (id);
+    }
+    *n_blocks = n;
+
+out:
+    g_object_unref (parser);
+    return blk_ids;
+}
+
+/* Store a received block, after checking that its content matches its id. */
+static int
+check_in_block (const char *repo_id, const char *blk_id,
+                const char *tmp_file)
+{
+    char *data = NULL;
+    gsize len;
+    SeafSHA1Ctx ctx;
+    unsigned char sha1[20];
+    char id[41];
+    BlockHandle *handle = NULL;
+    int ret = 0;
+
+    if (!g_file_get_contents (tmp_file, &data, &len, NULL)) {
+        seaf_warning ("[upload] Failed to read temp file %s.\n", tmp_file);
+        return -1;
+    }
+
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, data, len);
+    seaf_sha1_final (sha1, &ctx);
+    rawdata_to_hex (sha1, id, 20);
+    if (strcmp (id, blk_id) != 0) {
+        seaf_warning ("[upload] Content of block %s doesn't match.\n", blk_id);
+        ret = -1;
+        goto out;
+    }
+
+    if (seaf_block_manager_block_exists (seaf->block_mgr, blk_id))
+        goto out;
+
+    handle = seaf_block_manager_open_repo_block (seaf->block_mgr, repo_id,
+                                                 blk_id, BLOCK_WRITE);
+    if (!handle ||
+        seaf_block_manager_write_block (seaf->block_mgr,
+                                        handle, data, len) != len ||
+        seaf_block_manager_close_block (seaf->block_mgr, handle) < 0 ||
+        seaf_block_manager_commit_block (seaf->block_mgr, handle) < 0) {
+        seaf_warning ("[upload] Failed to write block %s.\n", blk_id);
+        ret = -1;
+    }
+
+out:
+    if (handle)
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    g_free (data);
+    return ret;
+}
+
+/*
+ * Upload of a file whose blocks were checked with upload-blks-check.
+ * The form has "parent_dir", "file_name" and "blockids", the JSON list
+ * of all the blocks of the file in order. Only the blocks the server
+ * misses are sent, as files named by their block ids. The file object
+ * is made of the block list, nothing is chunked again.
+ */
+static void
+upload_blks_cb (evhtp_request_t *req, void *arg)
+{
+    RecvFSM *fsm = arg;
+    SearpcClient *rpc_client = NULL;
+    char *parent_dir, *file_name, *blockids_json;
+    char **blk_ids = NULL;
+    gboolean *exists = NULL;
+    int n_blocks = 0, i;
+    GList *ptr, *name;
+    unsigned char sha1[20];
+    char file_id[41];
+    GList *names = NULL, *ids = NULL;
+    char *filenames_json, *file_ids_json;
+    GError *error = NULL;
+    evhtp_res code = EVHTP_RES_BADREQ;
+
+    if (!fsm || fsm->state == RECV_ERROR)
+        return;
+
+    parent_dir = g_hash_table_lookup (fsm->form_kvs, "parent_dir");
+    file_name = g_hash_table_lookup (fsm->form_kvs, "file_name");
+    blockids_json = g_hash_table_lookup (fsm->form_kvs, "blockids");
+    if (!parent_dir || !file_name || !blockids_json) {
+        seaf_warning ("[upload-blks] Invalid form.\n");
+        evbuffer_add_printf (req->buffer_out, "Invalid form.\n");
+        goto out;
+    }
+
+    if (fsm->too_large) {
+        seaf_warning ("[upload-blks] File size is too large.\n");
+        evbuffer_add_printf (req->buffer_out, "File size is too large.\n");
+        goto out;
+    }
+
+    blk_ids = parse_block_list (blockids_json, strlen(blockids_json),
+                                &n_blocks);
+    if (!blk_ids) {
+        seaf_warning ("[upload-blks] Invalid block list.\n");
+        evbuffer_add_printf (req->buffer_out, "Invalid block list.\n");
+        goto out;
+    }
+
+    for (ptr = fsm->tmp_files, name = fsm->uploaded_files;
+         ptr && name; ptr = ptr->next, name = name->next) {
+        if (check_in_block (fsm->repo_id, name->data, ptr->data) < 0) {
+            evbuffer_add_printf (req->buffer_out, "Bad block %s.\n",
+                                 (char *)name->data);
+            goto out;
+        }
+    }
+
+    exists = g_new0 (gboolean, n_blocks);
+    seaf_block_manager_blocks_exist (seaf->block_mgr, (const char **)blk_ids,
+                                     n_blocks, exists);
+    for (i = 0; i < n_blocks; ++i) {
+        if (!exists[i]) {
+            seaf_warning ("[upload-blks] Block %s is missing.\n", blk_ids[i]);
+            evbuffer_add_printf (req->buffer_out, "Block %s is missing.\n",
+                                 blk_ids[i]);
+            goto out;
+        }
+    }
+
+    code = EVHTP_RES_SERVERR;
+    if (seaf_fs_manager_index_existing_blocks (seaf->fs_mgr,
+                                               (const char **)blk_ids,
+                                               n_blocks, sha1) < 0) {
+        evbuffer_add_printf (req->buffer_out, "Internal server error\n");
+        goto out;
+    }
+    rawdata_to_hex (sha1, file_id, 20);
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-threaded-rpcserver");
+
+    if (seafile_check_quota (rpc_client, fsm->repo_id, NULL) < 0) {
+        seaf_warning ("[upload-blks] Out of quota.\n");
+        evbuffer_add_printf (req->buffer_out, "Out of quota.\n");
+        code = EVHTP_RES_FORBIDDEN;
+        goto out;
+    }
+
+    names = g_list_prepend (NULL, file_name);
+    ids = g_list_prepend (NULL, file_id);
+    filenames_json = file_list_to_json (names);
+    file_ids_json = file_list_to_json (ids);
+    seafile_post_indexed_files (rpc_client,
+                                fsm->repo_id,
+                                parent_dir,
+                                filenames_json,
+                                file_ids_json,
+                                fsm->user,
+                                &error);
+    g_free (filenames_json);
+    g_free (file_ids_json);
+    g_list_free (names);
+    g_list_free (ids);
+    if (error) {
+        if (error->code == POST_FILE_ERR_FILENAME)
+            code = EVHTP_RES_BADREQ;
+        evbuffer_add_printf (req->buffer_out, "%s\n", error->message);
+        g_clear_error (&error);
+        goto out;
+    }
+
+    evbuffer_add_printf (req->buffer_out, "%s\n", file_id);
+    code = EVHTP_RES_OK;
+
+out:
+    if (rpc_client)
+        ccnet_rpc_client_free (rpc_client);
+    g_strfreev (blk_ids);
+    g_free (exists);
+    send_http_reply (req, code);
+}
+
 static evhtp_res
 upload_finish_cb (evhtp_request_t *req, void *arg)
 {
@@ -402,11 +666,14 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
     if (!fsm)
         return EVHTP_RES_OK;
 
+    http_request_timer_done (fsm->timer);
+
     /* Clean up FSM struct no matter upload succeed or not. */
 
     g_free (fsm->repo_id);
     g_free (fsm->user);
     g_free (fsm->boundary);
+    g_free (fsm->delimiter);
     g_free (fsm->input_name);
 
     g_hash_table_destroy (fsm->form_kvs);
@@ -416,6 +683,8 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
         close (fsm->fd);
     }
     g_free (fsm->tmp_file);
+    seaf_fs_manager_index_stream_free (fsm->indexer);
+    string_list_free (fsm->file_ids);
 
     for (ptr = fsm->tmp_files; ptr; ptr = ptr->next)
         g_unlink ((char *)(ptr->data));
@@ -424,12 +693,7 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
 
     evbuffer_free (fsm->line);
 
-    pthread_mutex_lock (&pg_lock);
-    g_hash_table_remove (upload_progress, fsm->progress_id);
-    pthread_mutex_unlock (&pg_lock);
-
-    /* fsm->progress has been free'd by g_hash_table_remove(). */
-    g_free (fsm->progress_id);
+    upload_progress_finish (fsm->progress);
 
     g_free (fsm);
 
@@ -562,81 +826,156 @@ recv_form_field (RecvFSM *fsm, gboolean *no_line)
     return EVHTP_RES_OK;
 }
 
-static void
+static int
+open_file_indexer (RecvFSM *fsm)
+{
+    /* The request size is the best guess of the file size we have. */
+    fsm->indexer = seaf_fs_manager_index_stream_new (seaf->fs_mgr,
+                                                     fsm->file_name,
+                                                     fsm->content_len,
+                                                     NULL,
+                                                     fsm->chunker);
+    return fsm->indexer ? 0 : -1;
+}
+
+static int
 add_uploaded_file (RecvFSM *fsm)
 {
+    unsigned char sha1[20];
+    char file_id[41];
+
+    if (fsm->indexer) {
+        /* The upload is rejected if too large, the id doesn't matter. */
+        memset (sha1, 0, 20);
+        if (!fsm->too_large &&
+            seaf_fs_manager_index_stream_finish (fsm->indexer, sha1) < 0) {
+            seaf_warning ("[upload] Failed to index %s.\n", fsm->file_name);
+            return -1;
+        }
+        rawdata_to_hex (sha1, file_id, 20);
+        fsm->file_ids = g_list_prepend (fsm->file_ids, g_strdup(file_id));
+
+        seaf_fs_manager_index_stream_free (fsm->indexer);
+        fsm->indexer = NULL;
+    } else {
+        fsm->tmp_files = g_list_prepend (fsm->tmp_files,
+                                         g_strdup(fsm->tmp_file));
+        g_free (fsm->tmp_file);
+        close (fsm->fd);
+        fsm->tmp_file = NULL;
+    }
+
     fsm->uploaded_files = g_list_prepend (fsm->uploaded_files,
                                           get_basename(fsm->file_name));
-    fsm->tmp_files = g_list_prepend (fsm->tmp_files, g_strdup(fsm->tmp_file));
-
     g_free (fsm->file_name);
-    g_free (fsm->tmp_file);
-    close (fsm->fd);
     fsm->file_name = NULL;
-    fsm->tmp_file = NULL;
+
+    return 0;
 }
 
-static evhtp_res
-recv_file_data (RecvFSM *fsm, gboolean *no_line)
+/* Pass the first @len bytes of the buffer on to the indexer or temp file. */
+static int
+write_file_data (RecvFSM *fsm, size_t len)
 {
-    char *line;
-    size_t len;
-
-    *no_line = FALSE;
+    struct evbuffer_iovec vec[16];
+    int i, n_vec, written;
+    size_t n, done;
+
+    fsm->recved_size += (gint64)len;
+    if (fsm->recved_size > MAX_UPLOAD_FILE_SIZE)
+        fsm->too_large = TRUE;
+
+    /* Don't store data that will be rejected anyway. */
+    if (fsm->too_large) {
+        evbuffer_drain (fsm->line, len);
+        return 0;
+    }
 
-    line = evbuffer_readln (fsm->line, &len, EVBUFFER_EOL_CRLF_STRICT);
-    if (!line) {
-        /* If we haven't read an entire line, but the line
-         * buffer gets too long, flush the content to file.
-         * It should be safe to assume the boundary line is
-         * no longer than 10240 bytes.
-         */
-        if (evbuffer_get_length (fsm->line) >= MAX_CONTENT_LINE) {
-            seaf_debug ("[upload] recv file data %d bytes.\n",
-                     evbuffer_get_length(fsm->line));
-            if (fsm->recved_crlf) {
-                if (writen (fsm->fd, "\r\n", 2) < 0) {
-                    seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                               strerror(errno));
-                    return EVHTP_RES_SERVERR;
-                }
-            }
-            if (evbuffer_write (fsm->line, fsm->fd) < 0) {
+    if (!fsm->indexer) {
+        while (len > 0) {
+            written = evbuffer_write_atmost (fsm->line, fsm->fd, len);
+            if (written <= 0) {
                 seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                           strerror(errno));
-                return EVHTP_RES_SERVERR;
+                              strerror(errno));
+                return -1;
             }
-            fsm->recved_crlf = FALSE;
+            len -= written;
         }
-        *no_line = TRUE;
-    } else if (strstr (line, fsm->boundary) != NULL) {
-        seaf_debug ("[upload] file data ends.\n");
-
-        add_uploaded_file (fsm);
+        return 0;
+    }
 
-        g_free (fsm->input_name);
-        fsm->input_name = NULL;
-        fsm->state = RECV_HEADERS;
-        free (line);
-    } else {
-        seaf_debug ("[upload] recv file data %d bytes.\n", len + 2);
-        if (fsm->recved_crlf) {
-            if (writen (fsm->fd, "\r\n", 2) < 0) {
-                seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                           strerror(errno));
-                return EVHTP_RES_SERVERR;
+    while (len > 0) {
+        n_vec = evbuffer_peek (fsm->line, len, NULL, vec, 16);
+        if (n_vec > 16)
+            n_vec = 16;
+
+        done = 0;
+        for (i = 0; i < n_vec && done < len; ++i) {
+            n = vec[i].iov_len;
+            if (n > len - done)
+                n = len - done;
+            if (seaf_fs_manager_index_stream_feed (fsm->indexer,
+                                                   vec[i].iov_base, n) < 0) {
+                seaf_warning ("[upload] Failed to index file data.\n");
+                return -1;
             }
+            done += n;
         }
-        if (writen (fsm->fd, line, len) < 0) {
-            seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                       strerror(errno));
-            free (line);
+
+        evbuffer_drain (fsm->line, done);
+        len -= done;
+    }
+
+    return 0;
+}
+
+/*
+ * File data ends at the delimiter "\r\n--<boundary>". Instead of
+ * splitting the data into lines, search the buffer for the delimiter.
+ * Bytes that may be the start of a delimiter cut by the end of the
+ * buffer are kept until more data arrives, the rest is passed on.
+ */
+static evhtp_res
+recv_file_data (RecvFSM *fsm, gboolean *no_line)
+{
+    size_t delim_len = strlen (fsm->delimiter);
+    size_t avail = evbuffer_get_length (fsm->line);
+    struct evbuffer_ptr pos;
+    size_t len;
+
+    *no_line = FALSE;
+
+    pos = evbuffer_search (fsm->line, fsm->delimiter, delim_len, NULL);
+    if (pos.pos >= 0)
+        len = pos.pos;
+    else if (avail >= delim_len)
+        len = avail - delim_len + 1;
+    else
+        len = 0;
+
+    if (len > 0) {
+        seaf_debug ("[upload] recv file data %d bytes.\n", (int)len);
+        if (write_file_data (fsm, len) < 0)
             return EVHTP_RES_SERVERR;
-        }
-        free (line);
-        fsm->recved_crlf = TRUE;
     }
 
+    if (pos.pos < 0) {
+        *no_line = TRUE;
+        return EVHTP_RES_OK;
+    }
+
+    seaf_debug ("[upload] file data ends.\n");
+
+    if (add_uploaded_file (fsm) < 0)
+        return EVHTP_RES_SERVERR;
+
+    /* Drop the CRLF, and read the boundary line like the first one. */
+    evbuffer_drain (fsm->line, 2);
+
+    g_free (fsm->input_name);
+    fsm->input_name = NULL;
+    fsm->state = RECV_INIT;
+
     return EVHTP_RES_OK;
 }
 
@@ -667,10 +1006,7 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
         return EVHTP_RES_OK;
 
     /* Update upload progress. */
-    fsm->progress->uploaded += (gint64)evbuffer_get_length(buf);
-
-    seaf_debug ("progress: %lld/%lld\n",
-                fsm->progress->uploaded, fsm->progress->size);
+    upload_progress_add (fsm->progress, (gint64)evbuffer_get_length(buf));
 
     evbuffer_add_buffer (fsm->line, buf);
     /* Drain the buffer so that evhtp don't copy it to another buffer
@@ -705,7 +1041,19 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
                     /* Read an blank line, headers end. */
                     free (line);
                     if (g_strcmp0 (fsm->input_name, "file") == 0) {
-                        if (open_temp_file (fsm) < 0) {
+                        if (fsm->upload_blocks &&
+                            !is_block_id (fsm->file_name)) {
+                            seaf_warning ("[upload] Invalid block id.\n");
+                            res = EVHTP_RES_BADREQ;
+                            goto out;
+                        }
+                        if (fsm->index_on_recv) {
+                            if (open_file_indexer (fsm) < 0) {
+                                seaf_warning ("[upload] Failed to start indexing.\n");
+                                res = EVHTP_RES_SERVERR;
+                                goto out;
+                            }
+                        } else if (open_temp_file (fsm) < 0) {
                             seaf_warning ("[upload] Failed open temp file.\n");
                             res = EVHTP_RES_SERVERR;
                             goto out;
@@ -751,10 +1099,10 @@ out:
     }
 
     if (res == EVHTP_RES_BADREQ) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
     } else if (res == EVHTP_RES_SERVERR) {
         evbuffer_add_printf (req->buffer_out, "Internal server error\n");
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        send_http_reply (req, EVHTP_RES_SERVERR);
     }
     return EVHTP_RES_OK;
 }
@@ -838,6 +1186,85 @@ check_access_token (SearpcClient *rpc,
     return 0;
 }
 
+/*
+ * POST /upload-blks-check/<token> with a JSON list of block ids.
+ * Replies with the JSON list of the ones the server doesn't have, to be
+ * sent to /upload-blks/<token>.
+ */
+static void
+upload_blks_check_cb (evhtp_request_t *req, void *arg)
+{
+    SearpcClient *rpc_client = NULL;
+    char *token, *repo_id = NULL, *user = NULL;
+    SeafRepo *repo;
+    char **blk_ids = NULL;
+    gboolean *exists = NULL;
+    int n_blocks = 0, i;
+    GList *missing = NULL;
+    char *json;
+    size_t len;
+    evhtp_res code = EVHTP_RES_BADREQ;
+
+    http_request_start (req);
+
+    token = req->uri->path->file;
+    if (!token) {
+        seaf_warning ("[upload-blks-check] No token in url.\n");
+        evbuffer_add_printf (req->buffer_out, "Invalid URL\n");
+        goto out;
+    }
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-threaded-rpcserver");
+    if (check_access_token (rpc_client, token, &repo_id, &user) < 0) {
+        evbuffer_add_printf (req->buffer_out, "Access denied\n");
+        code = EVHTP_RES_FORBIDDEN;
+        goto out;
+    }
+
+    /* Blocks of encrypted repos are encrypted by the client. */
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo || repo->encrypted) {
+        if (repo)
+            seaf_repo_unref (repo);
+        evbuffer_add_printf (req->buffer_out, "Invalid repo\n");
+        goto out;
+    }
+    seaf_repo_unref (repo);
+
+    len = evbuffer_get_length (req->buffer_in);
+    blk_ids = parse_block_list ((char *)evbuffer_pullup (req->buffer_in, -1),
+                                len, &n_blocks);
+    if (!blk_ids || n_blocks > MAX_CHECK_BLOCKS) {
+        evbuffer_add_printf (req->buffer_out, "Invalid block list\n");
+        goto out;
+    }
+
+    exists = g_new0 (gboolean, n_blocks);
+    seaf_block_manager_blocks_exist (seaf->block_mgr, (const char **)blk_ids,
+                                     n_blocks, exists);
+    for (i = n_blocks - 1; i >= 0; --i) {
+        if (!exists[i])
+            missing = g_list_prepend (missing, blk_ids[i]);
+    }
+
+    json = file_list_to_json (missing);
+    evbuffer_add (req->buffer_out, json, strlen(json));
+    g_free (json);
+    code = EVHTP_RES_OK;
+
+out:
+    if (rpc_client)
+        ccnet_rpc_client_free (rpc_client);
+    g_free (repo_id);
+    g_free (user);
+    g_strfreev (blk_ids);
+    g_free (exists);
+    g_list_free (missing);
+    send_http_reply (req, code);
+}
+
 static int
 get_progress_info (evhtp_request_t *req,
                    evhtp_headers_t *hdr,
@@ -874,7 +1301,11 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     char *progress_id = NULL;
     char *err_msg = NULL;
     RecvFSM *fsm = NULL;
-    Progress *progress = NULL;
+    SeafRepo *repo = NULL;
+    int kind = GPOINTER_TO_INT (arg);
+    HttpRequestTimer *timer;
+
+    timer = http_request_start (req);
 
     /* URL format: http://host:port/[upload|update]/<token>?X-Progress-ID=<uuid> */
     token = req->uri->path->file;
@@ -886,7 +1317,7 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
 
     rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
                                                  NULL,
-                                                 "seafserv-rpcserver");
+                                                 "seafserv-threaded-rpcserver");
 
     if (check_access_token (rpc_client, token, &repo_id, &user) < 0) {
         seaf_warning ("[upload] Invalid token.\n");
@@ -894,6 +1325,15 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
         goto err;
     }
 
+    if (kind != UPLOAD_UPDATE)
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (kind == UPLOAD_BLOCKS && (!repo || repo->encrypted)) {
+        seaf_warning ("[upload] Blocks can't be uploaded to repo %.8s.\n",
+                      repo_id);
+        err_msg = "Invalid repo";
+        goto err;
+    }
+
     boundary = get_boundary (hdr);
     if (!boundary) {
         goto err;
@@ -902,22 +1342,27 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     if (get_progress_info (req, hdr, &content_len, &progress_id) < 0)
         goto err;
 
-    progress = g_new0 (Progress, 1);
-    progress->size = content_len;
-
     fsm = g_new0 (RecvFSM, 1);
+
+    if (kind == UPLOAD_NEW && repo && !repo->encrypted) {
+        fsm->index_on_recv = TRUE;
+        fsm->chunker = repo->chunker;
+    }
+    fsm->upload_blocks = (kind == UPLOAD_BLOCKS);
+    if (repo)
+        seaf_repo_unref (repo);
+
     fsm->boundary = boundary;
+    fsm->delimiter = g_strconcat ("\r\n--", boundary, NULL);
     fsm->repo_id = repo_id;
     fsm->user = user;
     fsm->line = evbuffer_new ();
     fsm->form_kvs = g_hash_table_new_full (g_str_hash, g_str_equal,
                                            g_free, g_free);
-    fsm->progress_id = progress_id;
-    fsm->progress = progress;
-
-    pthread_mutex_lock (&pg_lock);
-    g_hash_table_insert (upload_progress, g_strdup(progress_id), progress);
-    pthread_mutex_unlock (&pg_lock);
+    fsm->content_len = content_len;
+    fsm->progress = upload_progress_start (progress_id, content_len);
+    fsm->timer = timer;
+    g_free (progress_id);
 
     /* Set up per-request hooks, so that we can read file data piece by piece. */
     evhtp_set_hook (&req->hooks, evhtp_hook_on_read, upload_read_cb, fsm);
@@ -939,10 +1384,12 @@ err:
     req->keepalive = 0;
     if (err_msg)
         evbuffer_add_printf (req->buffer_out, "%s\n", err_msg);
-    evhtp_send_reply (req, EVHTP_RES_BADREQ);
+    send_http_reply (req, EVHTP_RES_BADREQ);
 
     if (rpc_client)
         ccnet_rpc_client_free (rpc_client);
+    if (repo)
+        seaf_repo_unref (repo);
 
     g_free (repo_id);
     g_free (user);
@@ -955,30 +1402,28 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
 {
     const char *progress_id;
     const char *callback;
-    Progress *progress;
+    gint64 uploaded, size;
     GString *buf;
 
+    http_request_start (req);
+
     progress_id = evhtp_kv_find (req->uri->query, "X-Progress-ID");
     if (!progress_id) {
         seaf_warning ("[get pg] Progress id not found in url.\n");
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
         return;
     }
 
     callback = evhtp_kv_find (req->uri->query, "callback");
     if (!callback) {
         seaf_warning ("[get pg] callback not found in url.\n");
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
         return;
     }
 
-    pthread_mutex_lock (&pg_lock);
-    progress = g_hash_table_lookup (upload_progress, progress_id);
-    pthread_mutex_unlock (&pg_lock);
-
-    if (!progress) {
+    if (upload_progress_lookup (progress_id, &uploaded, &size) < 0) {
         /* seaf_warning ("[get pg] No progress found for %s.\n", progress_id); */
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        send_http_reply (req, EVHTP_RES_BADREQ);
         return;
     }
 
@@ -986,12 +1431,12 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
     buf = g_string_new (NULL);
     g_string_append_printf (buf,
                             "%s({\"uploaded\": %lld, \"length\": %lld});",
-                            callback, progress->uploaded, progress->size);
+                            callback, uploaded, size);
     evbuffer_add (req->buffer_out, buf->str, buf->len);
 
     seaf_debug ("JSONP: %s\n", buf->str);
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    send_http_reply (req, EVHTP_RES_OK);
     g_string_free (buf, TRUE);
 }
 
@@ -999,6 +1444,8 @@ int
 upload_file_init (evhtp_t *htp)
 {
     evhtp_callback_t *cb;
+    char *progress_file;
+    int n_slots;
 
     if (g_mkdir_with_parents (TEMP_FILE_DIR, 0777) < 0) {
         seaf_warning ("Failed to create temp file dir %s.\n", TEMP_FILE_DIR);
@@ -1007,16 +1454,39 @@ upload_file_init (evhtp_t *htp)
 
     cb = evhtp_set_regex_cb (htp, "^/upload/.*", upload_cb, NULL);
     /* upload_headers_cb() will be called after evhtp parsed all http headers. */
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb,
+                   GINT_TO_POINTER(UPLOAD_NEW));
 
     cb = evhtp_set_regex_cb (htp, "^/update/.*", update_cb, NULL);
-    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb,
+                   GINT_TO_POINTER(UPLOAD_UPDATE));
+
+    evhtp_set_regex_cb (htp, "^/upload-blks-check/.*",
+                        upload_blks_check_cb, NULL);
+
+    cb = evhtp_set_regex_cb (htp, "^/upload-blks/.*", upload_blks_cb, NULL);
+    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb,
+                   GINT_TO_POINTER(UPLOAD_BLOCKS));
 
     evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
 
-    upload_progress = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                             g_free, g_free);
-    pthread_mutex_init (&pg_lock, NULL);
+    /*
+     * [httpserver]
+     * progress_file = <path>   (share progress with other httpservers on
+     *                           the host, which set the same file)
+     * progress_slots = 4096    (uploads tracked at the same time)
+     */
+    progress_file = g_key_file_get_string (seaf->config, "httpserver",
+                                           "progress_file", NULL);
+    n_slots = g_key_file_get_integer (seaf->config, "httpserver",
+                                      "progress_slots", NULL);
+    if (n_slots <= 0)
+        n_slots = DEFAULT_PROGRESS_SLOTS;
+    if (upload_progress_init (progress_file, n_slots) < 0) {
+        g_free (progress_file);
+        return -1;
+    }
+    g_free (progress_file);
 
     return 0;
 }
@@ -0,0 +1,228 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+#include "log.h"
+
+#include <sys/mman.h>
+
+#include "upload-progress.h"
+
+#define PROGRESS_MAGIC 0x53465047       /* "SFPG" */
+#define PROGRESS_ID_LEN 64
+#define MAX_PROBE 32
+/* Slots of uploads not updated for so long, e.g. left by a crashed
+ * process, are reused. */
+#define STALE_SECS 86400
+
+/*
+ * The low 2 bits of a slot's state are its status, the other bits are
+ * bumped on every reuse, so that an old owner can't touch the slot of a
+ * new upload.
+ */
+enum {
+    SLOT_FREE,
+    SLOT_BUSY,                  /* being set up */
+    SLOT_ACTIVE,
+};
+
+#define SLOT_STATUS(s) ((s) & 3)
+#define SLOT_NEXT(s, status) ((int)(((guint)(s) + 4) & ~3u) | (status))
+
+typedef struct ProgressSlot {
+    int state;
+    int seq;                    /* odd while the counters are written */
+    gint64 uploaded;
+    gint64 size;
+    gint64 mtime;
+    char id[PROGRESS_ID_LEN + 1];
+} ProgressSlot;
+
+typedef struct ProgressTable {
+    int magic;
+    int n_slots;
+    ProgressSlot slots[0];
+} ProgressTable;
+
+struct UploadProgress {
+    ProgressSlot *slot;         /* NULL if the table was full */
+    int state;
+};
+
+static ProgressTable *table;
+
+static size_t
+table_size (int n_slots)
+{
+    return sizeof(ProgressTable) + (size_t)n_slots * sizeof(ProgressSlot);
+}
+
+static void *
+map_table_file (const char *path, int *n_slots)
+{
+    ProgressTable hdr;
+    struct stat st;
+    void *p = NULL;
+    int fd;
+
+    fd = g_open (path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat (fd, &st) < 0) {
+        seaf_warning ("Failed to stat %s: %s.\n", path, strerror(errno));
+        goto out;
+    }
+
+    /* Use the size of a table already created by another process. */
+    if (st.st_size > 0) {
+        if (pread (fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            hdr.magic != PROGRESS_MAGIC || hdr.n_slots <= 0 ||
+            (size_t)st.st_size < table_size (hdr.n_slots)) {
+            seaf_warning ("Bad progress file %s.\n", path);
+            goto out;
+        }
+        *n_slots = hdr.n_slots;
+    } else if (ftruncate (fd, table_size (*n_slots)) < 0) {
+        seaf_warning ("Failed to resize %s: %s.\n", path, strerror(errno));
+        goto out;
+    }
+
+    p = mmap (NULL, table_size (*n_slots), PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        seaf_warning ("Failed to map %s: %s.\n", path, strerror(errno));
+        p = NULL;
+    }
+
+out:
+    close (fd);
+    return p;
+}
+
+int
+upload_progress_init (const char *path, int n_slots)
+{
+    void *p;
+
+    if (path) {
+        p = map_table_file (path, &n_slots);
+        if (!p)
+            return -1;
+    } else {
+        p = mmap (NULL, table_size (n_slots), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            seaf_warning ("Failed to map progress table: %s.\n",
+                          strerror(errno));
+            return -1;
+        }
+    }
+
+    table = p;
+    table->n_slots = n_slots;
+    table->magic = PROGRESS_MAGIC;
+
+    return 0;
+}
+
+static inline ProgressSlot *
+probe_slot (const char *progress_id, int i)
+{
+    return &table->slots[(g_str_hash (progress_id) + i) % table->n_slots];
+}
+
+UploadProgress *
+upload_progress_start (const char *progress_id, gint64 size)
+{
+    UploadProgress *progress = g_new0 (UploadProgress, 1);
+    ProgressSlot *slot;
+    gint64 now = (gint64)time(NULL);
+    int i, s, busy;
+
+    if (strlen(progress_id) > PROGRESS_ID_LEN)
+        return progress;
+
+    for (i = 0; i < MAX_PROBE && i < table->n_slots; ++i) {
+        slot = probe_slot (progress_id, i);
+        s = g_atomic_int_get (&slot->state);
+        if (SLOT_STATUS(s) != SLOT_FREE &&
+            !(SLOT_STATUS(s) == SLOT_ACTIVE && slot->mtime < now - STALE_SECS))
+            continue;
+
+        busy = SLOT_NEXT(s, SLOT_BUSY);
+        if (!g_atomic_int_compare_and_exchange (&slot->state, s, busy))
+            continue;
+
+        g_strlcpy (slot->id, progress_id, sizeof(slot->id));
+        slot->uploaded = 0;
+        slot->size = size;
+        slot->mtime = now;
+        /* A crashed owner may have left it odd. */
+        g_atomic_int_set (&slot->seq, 0);
+
+        progress->slot = slot;
+        progress->state = (busy & ~3) | SLOT_ACTIVE;
+        g_atomic_int_set (&slot->state, progress->state);
+        return progress;
+    }
+
+    seaf_debug ("No free slot for upload progress %s.\n", progress_id);
+    return progress;
+}
+
+void
+upload_progress_add (UploadProgress *progress, gint64 n)
+{
+    ProgressSlot *slot = progress->slot;
+
+    if (!slot || g_atomic_int_get (&slot->state) != progress->state)
+        return;
+
+    g_atomic_int_inc (&slot->seq);
+    slot->uploaded += n;
+    slot->mtime = (gint64)time(NULL);
+    g_atomic_int_inc (&slot->seq);
+}
+
+void
+upload_progress_finish (UploadProgress *progress)
+{
+    if (!progress)
+        return;
+
+    if (progress->slot)
+        g_atomic_int_compare_and_exchange (&progress->slot->state,
+                                           progress->state,
+                                           (progress->state & ~3) | SLOT_FREE);
+    g_free (progress);
+}
+
+int
+upload_progress_lookup (const char *progress_id,
+                        gint64 *uploaded, gint64 *size)
+{
+    ProgressSlot *slot;
+    int i, s, seq;
+
+    for (i = 0; i < MAX_PROBE && i < table->n_slots; ++i) {
+        slot = probe_slot (progress_id, i);
+        s = g_atomic_int_get (&slot->state);
+        if (SLOT_STATUS(s) != SLOT_ACTIVE ||
+            strncmp (slot->id, progress_id, sizeof(slot->id)) != 0)
+            continue;
+
+        do {
+            seq = g_atomic_int_get (&slot->seq);
+            *uploaded = slot->uploaded;
+            *size = slot->size;
+        } while ((seq & 1) || g_atomic_int_get (&slot->seq) != seq);
+
+        /* The slot may have been reused while we read it. */
+        if (g_atomic_int_get (&slot->state) == s)
+            return 0;
+    }
+
+    return -1;
+}
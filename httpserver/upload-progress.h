@@ -0,0 +1,36 @@
+#ifndef UPLOAD_PROGRESS_H
+#define UPLOAD_PROGRESS_H
+
+/*
+ * Registry of upload progress, keyed by the X-Progress-ID of the upload.
+ *
+ * Progress is kept in a fixed table of slots updated with atomic
+ * operations, so the receive path and the progress polls never take a
+ * lock. If [httpserver] progress_file is set in seafile.conf, the table
+ * is a shared mapping of that file, so all httpserver processes on the
+ * host using the same file see each other's uploads.
+ */
+
+typedef struct UploadProgress UploadProgress;
+
+int
+upload_progress_init (const char *path, int n_slots);
+
+/* Always returns a handle. Progress is not visible to polls if the table
+ * is full. */
+UploadProgress *
+upload_progress_start (const char *progress_id, gint64 size);
+
+/* Only called by the thread receiving the upload. */
+void
+upload_progress_add (UploadProgress *progress, gint64 n);
+
+void
+upload_progress_finish (UploadProgress *progress);
+
+/* Returns -1 if no upload with @progress_id is in progress. */
+int
+upload_progress_lookup (const char *progress_id,
+                        gint64 *uploaded, gint64 *size);
+
+#endif
@@ -0,0 +1,711 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+#include "log.h"
+
+#include <event.h>
+#include <evhtp.h>
+
+#include <pthread.h>
+
+#include <ccnet.h>
+
+#include "seafile-object.h"
+#include "seafile.h"
+
+#include "utils.h"
+
+#include "seafile-session.h"
+#include "httpserver.h"
+#include "upload-session.h"
+
+/*
+ * Resumable uploads of a single file, for clients on unreliable links.
+ *
+ *   POST /upload-session/<token>?parent_dir=<dir>&filename=<name>&size=<n>
+ *       Start a session with an upload access token.
+ *       Returns {"session_id": "<id>", "received": 0}.
+ *
+ *   PUT /upload-chunk/<id>
+ *   Content-Range: bytes <start>-<end>/<n>
+ *       Append a range of the file. <start> must be the number of bytes
+ *       received so far. Returns {"received": <bytes>}.
+ *
+ *   GET /upload-chunk/<id>
+ *       Returns {"received": <bytes>, "size": <n>}, to resume from.
+ *
+ *   DELETE /upload-chunk/<id>
+ *       Abort the session.
+ *
+ *   POST /upload-finish/<id>
+ *       Add the file to the repo once all bytes are received.
+ *
+ * The data of a session is written to disk as it arrives, so a broken
+ * request only loses what the server hasn't received, and sessions
+ * survive server restarts. The session id is the credential for the
+ * later requests, since the access token may expire meanwhile.
+ * Sessions left idle for SESSION_TTL are removed.
+ */
+
+#define SESSION_DIR_NAME "upload-sessions"
+#define SESSION_TTL (24 * 3600)
+
+typedef struct UploadSession {
+    char id[37];
+    char *repo_id;
+    char *user;
+    char *parent_dir;
+    char *file_name;
+    gint64 size;
+} UploadSession;
+
+typedef struct ChunkRecv {
+    UploadSession *session;
+    int fd;
+    gint64 offset;          /* file offset of the next byte */
+    gint64 end;             /* last byte of the range */
+    gboolean error;
+    HttpRequestTimer *timer;
+} ChunkRecv;
+
+static char *session_dir;
+
+/* Ids of sessions being written or finished. */
+static GHashTable *busy_sessions;
+static pthread_mutex_t busy_lock;
+
+static char *
+session_path (const char *id, const char *ext)
+{
+    char *name = g_strconcat (id, ext, NULL);
+    char *path = g_build_filename (session_dir, name, NULL);
+
+    g_free (name);
+    return path;
+}
+
+static void
+session_free (UploadSession *session)
+{
+    if (!session)
+        return;
+
+    g_free (session->repo_id);
+    g_free (session->user);
+    g_free (session->parent_dir);
+    g_free (session->file_name);
+    g_free (session);
+}
+
+static int
+save_session (UploadSession *session)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    char *path, *data, size_str[32];
+    gsize len;
+    int ret = 0;
+
+    g_key_file_set_string (key_file, "session", "repo_id", session->repo_id);
+    g_key_file_set_string (key_file, "session", "user", session->user);
+    g_key_file_set_string (key_file, "session", "parent_dir",
+                           session->parent_dir);
+    g_key_file_set_string (key_file, "session", "file_name",
+                           session->file_name);
+    snprintf (size_str, sizeof(size_str), "%"G_GINT64_FORMAT, session->size);
+    g_key_file_set_string (key_file, "session", "size", size_str);
+
+    data = g_key_file_to_data (key_file, &len, NULL);
+    path = session_path (session->id, ".meta");
+    if (!g_file_set_contents (path, data, len, NULL)) {
+        seaf_warning ("[upload session] Failed to write %s.\n", path);
+        ret = -1;
+    }
+
+    g_free (path);
+    g_free (data);
+    g_key_file_free (key_file);
+    return ret;
+}
+
+static UploadSession *
+load_session (const char *id)
+{
+    GKeyFile *key_file;
+    UploadSession *session = NULL;
+    char *path, *size_str = NULL;
+
+    if (!id || !is_uuid_valid (id))
+        return NULL;
+
+    path = session_path (id, ".meta");
+    key_file = g_key_file_new ();
+    if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL))
+        goto out;
+
+    session = g_new0 (UploadSession, 1);
+    memcpy (session->id, id, 37);
+    session->repo_id = g_key_file_get_string (key_file, "session",
+                                              "repo_id", NULL);
+    session->user = g_key_file_get_string (key_file, "session", "user", NULL);
+    session->parent_dir = g_key_file_get_string (key_file, "session",
+                                                 "parent_dir", NULL);
+    session->file_name = g_key_file_get_string (key_file, "session",
+                                                "file_name", NULL);
+    size_str = g_key_file_get_string (key_file, "session", "size", NULL);
+    if (!session->repo_id || !session->user || !session->parent_dir ||
+        !session->file_name || !size_str) {
+        seaf_warning ("[upload session] Bad session file %s.\n", path);
+        session_free (session);
+        session = NULL;
+        goto out;
+    }
+    session->size = strtoll (size_str, NULL, 10);
+
+out:
+    g_free (size_str);
+    g_free (path);
+    g_key_file_free (key_file);
+    return session;
+}
+
+static void
+remove_session (const char *id)
+{
+    char *path;
+
+    path = session_path (id, ".meta");
+    g_unlink (path);
+    g_free (path);
+
+    path = session_path (id, ".data");
+    g_unlink (path);
+    g_free (path);
+}
+
+/* Returns -1 if the data file is missing. */
+static gint64
+get_received_size (UploadSession *session)
+{
+    char *path = session_path (session->id, ".data");
+    struct stat st;
+    int ret;
+
+    ret = g_stat (path, &st);
+    g_free (path);
+
+    return ret < 0 ? -1 : (gint64)st.st_size;
+}
+
+static gboolean
+lock_session (const char *id)
+{
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&busy_lock);
+    if (!g_hash_table_lookup (busy_sessions, id)) {
+        g_hash_table_insert (busy_sessions, g_strdup(id), (gpointer)1);
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&busy_lock);
+
+    return ret;
+}
+
+static void
+unlock_session (const char *id)
+{
+    pthread_mutex_lock (&busy_lock);
+    g_hash_table_remove (busy_sessions, id);
+    pthread_mutex_unlock (&busy_lock);
+}
+
+static void
+clean_stale_sessions ()
+{
+    GDir *dir;
+    const char *name;
+    char *id, *path;
+    struct stat st;
+    time_t now = time(NULL);
+
+    dir = g_dir_open (session_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (!g_str_has_suffix (name, ".meta"))
+            continue;
+        id = g_strndup (name, strlen(name) - strlen(".meta"));
+
+        /* The data file is touched by every write. */
+        path = session_path (id, ".data");
+        if ((g_stat (path, &st) < 0 || now - st.st_mtime > SESSION_TTL) &&
+            lock_session (id)) {
+            seaf_debug ("[upload session] Remove stale session %s.\n", id);
+            remove_session (id);
+            unlock_session (id);
+        }
+
+        g_free (path);
+        g_free (id);
+    }
+
+    g_dir_close (dir);
+}
+
+static void
+send_json_reply (evhtp_request_t *req, int code, const char *json)
+{
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new("Content-Type",
+                                               "application/json; charset=utf-8",
+                                               1, 1));
+    evbuffer_add_printf (req->buffer_out, "%s\n", json);
+    send_http_reply (req, code);
+}
+
+static void
+send_received_reply (evhtp_request_t *req, int code, UploadSession *session)
+{
+    char buf[128];
+
+    snprintf (buf, sizeof(buf),
+              "{\"received\": %"G_GINT64_FORMAT", \"size\": %"G_GINT64_FORMAT"}",
+              get_received_size (session), session->size);
+    send_json_reply (req, code, buf);
+}
+
+static char *
+get_query_param (evhtp_request_t *req, const char *key)
+{
+    const char *value = evhtp_kv_find (req->uri->query, key);
+
+    if (!value)
+        return NULL;
+    return g_uri_unescape_string (value, NULL);
+}
+
+static void
+create_session_cb (evhtp_request_t *req, void *arg)
+{
+    SearpcClient *rpc_client = NULL;
+    SeafileWebAccess *webaccess = NULL;
+    UploadSession *session = NULL;
+    char *token, *size_str = NULL, *path, *base, buf[128];
+    int fd;
+
+    http_request_start (req);
+
+    if (evhtp_request_get_method (req) != htp_method_POST) {
+        send_http_reply (req, EVHTP_RES_METHNALLOWED);
+        return;
+    }
+
+    token = req->uri->path->file;
+    if (!token) {
+        seaf_warning ("[upload session] No token in url.\n");
+        evbuffer_add_printf (req->buffer_out, "Invalid URL\n");
+        send_http_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-threaded-rpcserver");
+
+    webaccess = (SeafileWebAccess *)
+        seafile_web_query_access_token (rpc_client, token, NULL);
+    if (!webaccess) {
+        evbuffer_add_printf (req->buffer_out, "Access denied\n");
+        send_http_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    session = g_new0 (UploadSession, 1);
+    session->repo_id = g_strdup (seafile_web_access_get_repo_id (webaccess));
+    session->user = g_strdup (seafile_web_access_get_username (webaccess));
+    session->parent_dir = get_query_param (req, "parent_dir");
+    session->file_name = get_query_param (req, "filename");
+    size_str = get_query_param (req, "size");
+    if (!session->parent_dir || !session->file_name || !size_str) {
+        evbuffer_add_printf (req->buffer_out, "Invalid arguments\n");
+        send_http_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+    session->size = strtoll (size_str, NULL, 10);
+
+    /* Strip out directories like the web upload does. */
+    base = g_path_get_basename (session->file_name);
+    g_free (session->file_name);
+    session->file_name = base;
+
+    if (session->size < 0 || strcmp (session->file_name, "/") == 0 ||
+        strcmp (session->file_name, ".") == 0) {
+        evbuffer_add_printf (req->buffer_out, "Invalid arguments\n");
+        send_http_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    if (seafile_check_quota (rpc_client, session->repo_id, NULL) < 0) {
+        seaf_warning ("[upload session] Out of quota.\n");
+        evbuffer_add_printf (req->buffer_out, "Out of quota\n");
+        send_http_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    clean_stale_sessions ();
+
+    gen_uuid_inplace (session->id);
+
+    path = session_path (session->id, ".data");
+    fd = g_open (path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600);
+    g_free (path);
+    if (fd < 0 || save_session (session) < 0) {
+        seaf_warning ("[upload session] Failed to create session: %s.\n",
+                      strerror(errno));
+        if (fd >= 0)
+            close (fd);
+        remove_session (session->id);
+        evbuffer_add_printf (req->buffer_out, "Internal server error\n");
+        send_http_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+    close (fd);
+
+    seaf_debug ("[upload session] Created %s for %s in repo %.8s.\n",
+                session->id, session->file_name, session->repo_id);
+
+    snprintf (buf, sizeof(buf), "{\"session_id\": \"%s\", \"received\": 0}",
+              session->id);
+    send_json_reply (req, EVHTP_RES_OK, buf);
+
+out:
+    if (webaccess)
+        g_object_unref (webaccess);
+    ccnet_rpc_client_free (rpc_client);
+    session_free (session);
+    g_free (size_str);
+}
+
+/* "bytes <start>-<end>/<total>" */
+static int
+parse_content_range (const char *value, gint64 *start, gint64 *end,
+                     gint64 *total)
+{
+    char *p;
+
+    if (!value || strncmp (value, "bytes ", 6) != 0)
+        return -1;
+    value += 6;
+
+    *start = strtoll (value, &p, 10);
+    if (p == value || *p != '-')
+        return -1;
+    value = p + 1;
+
+    *end = strtoll (value, &p, 10);
+    if (p == value || *p != '/')
+        return -1;
+    value = p + 1;
+
+    *total = strtoll (value, &p, 10);
+    if (p == value || *p != '\0')
+        return -1;
+
+    if (*start < 0 || *end < *start || *end >= *total)
+        return -1;
+
+    return 0;
+}
+
+static evhtp_res
+chunk_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    ChunkRecv *recv = arg;
+    size_t len = evbuffer_get_length (buf);
+    int n;
+
+    if (recv->error) {
+        evbuffer_drain (buf, len);
+        return EVHTP_RES_OK;
+    }
+
+    if (recv->offset + (gint64)len > recv->end + 1) {
+        seaf_warning ("[upload session] More data than the range of %s.\n",
+                      recv->session->id);
+        goto error;
+    }
+
+    /* Write out right away, so that a broken request keeps what it sent. */
+    while (evbuffer_get_length (buf) > 0) {
+        n = evbuffer_write (buf, recv->fd);
+        if (n <= 0) {
+            seaf_warning ("[upload session] Failed to write data of %s: %s.\n",
+                          recv->session->id, strerror(errno));
+            goto error;
+        }
+        recv->offset += n;
+    }
+
+    return EVHTP_RES_OK;
+
+error:
+    recv->error = TRUE;
+    evbuffer_drain (buf, evbuffer_get_length (buf));
+
+    evhtp_request_pause (req);
+    req->keepalive = 0;
+    evbuffer_add_printf (req->buffer_out, "Bad request\n");
+    send_http_reply (req, EVHTP_RES_BADREQ);
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+chunk_finish_cb (evhtp_request_t *req, void *arg)
+{
+    ChunkRecv *recv = arg;
+
+    http_request_timer_done (recv->timer);
+    close (recv->fd);
+    unlock_session (recv->session->id);
+    session_free (recv->session);
+    g_free (recv);
+
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+chunk_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
+{
+    UploadSession *session = NULL;
+    ChunkRecv *recv;
+    gint64 start, end, total, received;
+    char *path, *err_msg = "Bad request\n";
+    int code = EVHTP_RES_BADREQ;
+    gboolean locked = FALSE;
+    int fd;
+    HttpRequestTimer *timer;
+
+    /* Other methods don't have a body, they're handled in chunk_cb(). */
+    if (evhtp_request_get_method (req) != htp_method_PUT)
+        return EVHTP_RES_OK;
+
+    timer = http_request_start (req);
+
+    session = load_session (req->uri->path->file);
+    if (!session) {
+        err_msg = "Upload session not found\n";
+        code = EVHTP_RES_NOTFOUND;
+        goto err;
+    }
+
+    if (parse_content_range (evhtp_kv_find (hdr, "Content-Range"),
+                             &start, &end, &total) < 0 ||
+        total != session->size) {
+        seaf_warning ("[upload session] Bad Content-Range for %s.\n",
+                      session->id);
+        goto err;
+    }
+
+    if (!lock_session (session->id)) {
+        err_msg = "Session is busy\n";
+        code = EVHTP_RES_CONFLICT;
+        goto err;
+    }
+    locked = TRUE;
+
+    received = get_received_size (session);
+    if (received < 0) {
+        err_msg = "Upload session not found\n";
+        code = EVHTP_RES_NOTFOUND;
+        goto err;
+    }
+    /* Ranges must be sent in order, resuming at what was received. */
+    if (start != received) {
+        evhtp_request_pause (req);
+        req->keepalive = 0;
+        send_received_reply (req, EVHTP_RES_CONFLICT, session);
+        unlock_session (session->id);
+        session_free (session);
+        return EVHTP_RES_OK;
+    }
+
+    path = session_path (session->id, ".data");
+    fd = g_open (path, O_WRONLY | O_APPEND | O_BINARY, 0);
+    g_free (path);
+    if (fd < 0) {
+        seaf_warning ("[upload session] Failed to open data of %s: %s.\n",
+                      session->id, strerror(errno));
+        err_msg = "Internal server error\n";
+        code = EVHTP_RES_SERVERR;
+        goto err;
+    }
+
+    recv = g_new0 (ChunkRecv, 1);
+    recv->session = session;
+    recv->fd = fd;
+    recv->offset = start;
+    recv->end = end;
+    recv->timer = timer;
+
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_read, chunk_read_cb, recv);
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini,
+                    chunk_finish_cb, recv);
+    req->cbarg = recv;
+
+    return EVHTP_RES_OK;
+
+err:
+    evhtp_request_pause (req);
+    req->keepalive = 0;
+    evbuffer_add_printf (req->buffer_out, "%s", err_msg);
+    send_http_reply (req, code);
+
+    if (locked)
+        unlock_session (session->id);
+    session_free (session);
+    return EVHTP_RES_OK;
+}
+
+static void
+chunk_cb (evhtp_request_t *req, void *arg)
+{
+    ChunkRecv *recv = arg;
+    UploadSession *session;
+    htp_method method = evhtp_request_get_method (req);
+
+    if (method == htp_method_PUT) {
+        /* Replied in chunk_headers_cb() or chunk_read_cb() on errors. */
+        if (!recv || recv->error)
+            return;
+        if (recv->offset != recv->end + 1) {
+            evbuffer_add_printf (req->buffer_out, "Incomplete range\n");
+            send_http_reply (req, EVHTP_RES_BADREQ);
+            return;
+        }
+        send_received_reply (req, EVHTP_RES_OK, recv->session);
+        return;
+    }
+
+    http_request_start (req);
+
+    if (method != htp_method_GET && method != htp_method_DELETE) {
+        send_http_reply (req, EVHTP_RES_METHNALLOWED);
+        return;
+    }
+
+    session = load_session (req->uri->path->file);
+    if (!session) {
+        evbuffer_add_printf (req->buffer_out, "Upload session not found\n");
+        send_http_reply (req, EVHTP_RES_NOTFOUND);
+        return;
+    }
+
+    if (method == htp_method_GET) {
+        send_received_reply (req, EVHTP_RES_OK, session);
+    } else if (!lock_session (session->id)) {
+        evbuffer_add_printf (req->buffer_out, "Session is busy\n");
+        send_http_reply (req, EVHTP_RES_CONFLICT);
+    } else {
+        remove_session (session->id);
+        unlock_session (session->id);
+        send_http_reply (req, EVHTP_RES_OK);
+    }
+
+    session_free (session);
+}
+
+static void
+finish_session_cb (evhtp_request_t *req, void *arg)
+{
+    SearpcClient *rpc_client = NULL;
+    UploadSession *session;
+    GError *error = NULL;
+    char *path = NULL;
+
+    http_request_start (req);
+
+    if (evhtp_request_get_method (req) != htp_method_POST) {
+        send_http_reply (req, EVHTP_RES_METHNALLOWED);
+        return;
+    }
+
+    session = load_session (req->uri->path->file);
+    if (!session) {
+        evbuffer_add_printf (req->buffer_out, "Upload session not found\n");
+        send_http_reply (req, EVHTP_RES_NOTFOUND);
+        return;
+    }
+
+    if (!lock_session (session->id)) {
+        evbuffer_add_printf (req->buffer_out, "Session is busy\n");
+        send_http_reply (req, EVHTP_RES_CONFLICT);
+        session_free (session);
+        return;
+    }
+
+    if (get_received_size (session) != session->size) {
+        send_received_reply (req, EVHTP_RES_BADREQ, session);
+        goto out;
+    }
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-threaded-rpcserver");
+
+    if (seafile_check_quota (rpc_client, session->repo_id, NULL) < 0) {
+        seaf_warning ("[upload session] Out of quota.\n");
+        evbuffer_add_printf (req->buffer_out, "Out of quota\n");
+        send_http_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    path = session_path (session->id, ".data");
+    seafile_post_file (rpc_client, session->repo_id, path,
+                       session->parent_dir, session->file_name,
+                       session->user, &error);
+    if (error) {
+        seaf_warning ("[upload session] Failed to add %s: %s.\n",
+                      session->file_name, error->message);
+        /* Kept, so that the client can retry. */
+        evbuffer_add_printf (req->buffer_out, "%s\n", error->message);
+        send_http_reply (req, EVHTP_RES_BADREQ);
+        g_clear_error (&error);
+        goto out;
+    }
+
+    remove_session (session->id);
+    send_json_reply (req, EVHTP_RES_OK, "{\"success\": true}");
+
+out:
+    if (rpc_client)
+        ccnet_rpc_client_free (rpc_client);
+    unlock_session (session->id);
+    session_free (session);
+    g_free (path);
+}
+
+int
+upload_session_init (evhtp_t *htp)
+{
+    evhtp_callback_t *cb;
+
+    session_dir = g_build_filename (seaf->tmp_file_dir, SESSION_DIR_NAME, NULL);
+    if (g_mkdir_with_parents (session_dir, 0700) < 0) {
+        seaf_warning ("Failed to create upload session dir %s.\n", session_dir);
+        return -1;
+    }
+
+    busy_sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    pthread_mutex_init (&busy_lock, NULL);
+
+    evhtp_set_regex_cb (htp, "^/upload-session/.*", create_session_cb, NULL);
+
+    cb = evhtp_set_regex_cb (htp, "^/upload-chunk/.*", chunk_cb, NULL);
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_headers, chunk_headers_cb, NULL);
+
+    evhtp_set_regex_cb (htp, "^/upload-finish/.*", finish_session_cb, NULL);
+
+    return 0;
+}
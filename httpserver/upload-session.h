@@ -0,0 +1,7 @@
+#ifndef UPLOAD_SESSION_H
+#define UPLOAD_SESSION_H
+
+int
+upload_session_init (evhtp_t *htp);
+
+#endif
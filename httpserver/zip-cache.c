@@ -0,0 +1,315 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+#include "log.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <event.h>
+
+#include "seafile-crypt.h"
+#include "seafile-session.h"
+#include "pack-dir.h"
+#include "zip-cache.h"
+
+/* Archives built at the same time. */
+#define MAX_BUILDS 4
+
+enum {
+    ENTRY_BUILDING,
+    ENTRY_DONE,
+    ENTRY_FAILED,
+};
+
+struct _ZipCacheEntry {
+    ZipCache *cache;
+    char *key;
+    char *path;
+
+    char *dirname;
+    char *root_id;
+    gboolean is_windows;
+    int fd;                     /* written by the builder */
+
+    /* Protected by the cache lock. */
+    int state;
+    gint64 size;
+    gint64 build_time;
+    gint64 last_access;
+    int ref_count;
+};
+
+struct _ZipCache {
+    char *dir;
+    gint64 max_size;
+    int ttl;
+
+    pthread_mutex_t lock;
+    GHashTable *entries;        /* key -> entry */
+    gint64 total_size;
+
+    GThreadPool *builders;
+};
+
+static void build_archive (gpointer data, gpointer user_data);
+
+static void
+remove_cache_files (const char *dir)
+{
+    GDir *d;
+    const char *name;
+    char *path;
+
+    d = g_dir_open (dir, 0, NULL);
+    if (!d)
+        return;
+
+    while ((name = g_dir_read_name (d)) != NULL) {
+        path = g_build_filename (dir, name, NULL);
+        g_unlink (path);
+        g_free (path);
+    }
+    g_dir_close (d);
+}
+
+ZipCache *
+zip_cache_new (const char *cache_dir, gint64 max_size, int ttl)
+{
+    ZipCache *cache;
+
+    if (g_mkdir_with_parents (cache_dir, 0777) < 0) {
+        seaf_warning ("Failed to create zip cache dir %s.\n", cache_dir);
+        return NULL;
+    }
+    /* Entries are not kept across restarts. */
+    remove_cache_files (cache_dir);
+
+    cache = g_new0 (ZipCache, 1);
+    cache->dir = g_strdup (cache_dir);
+    cache->max_size = max_size;
+    cache->ttl = ttl;
+    pthread_mutex_init (&cache->lock, NULL);
+    cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->builders = g_thread_pool_new (build_archive, cache,
+                                         MAX_BUILDS, FALSE, NULL);
+
+    return cache;
+}
+
+static void
+entry_free (ZipCacheEntry *entry)
+{
+    g_free (entry->key);
+    g_free (entry->path);
+    g_free (entry->dirname);
+    g_free (entry->root_id);
+    g_free (entry);
+}
+
+/* The caller holds the lock. */
+static void
+unref_locked (ZipCacheEntry *entry)
+{
+    if (--(entry->ref_count) == 0)
+        entry_free (entry);
+}
+
+void
+zip_cache_entry_unref (ZipCacheEntry *entry)
+{
+    ZipCache *cache = entry->cache;
+
+    pthread_mutex_lock (&cache->lock);
+    unref_locked (entry);
+    pthread_mutex_unlock (&cache->lock);
+}
+
+/* Readers that opened the file can still read it. The caller holds the
+ * lock. */
+static void
+remove_entry_locked (ZipCache *cache, ZipCacheEntry *entry)
+{
+    g_hash_table_remove (cache->entries, entry->key);
+    g_unlink (entry->path);
+    cache->total_size -= entry->size;
+    unref_locked (entry);
+}
+
+static void
+evict_entries_locked (ZipCache *cache)
+{
+    GHashTableIter iter;
+    gpointer value;
+    ZipCacheEntry *entry, *lru;
+
+    while (cache->total_size > cache->max_size) {
+        lru = NULL;
+        g_hash_table_iter_init (&iter, cache->entries);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            entry = value;
+            if (entry->state == ENTRY_DONE &&
+                (!lru || entry->last_access < lru->last_access))
+                lru = entry;
+        }
+        if (!lru)
+            break;
+        seaf_debug ("Remove zip cache %s.\n", lru->key);
+        remove_entry_locked (cache, lru);
+    }
+}
+
+static char *
+make_key (const char *dirname, const char *root_id, gboolean is_windows)
+{
+    char *s, *key;
+
+    s = g_strdup_printf ("%s\n%s\n%s", root_id, dirname,
+                         (is_windows && seaf->windows_encoding) ?
+                         seaf->windows_encoding : "utf-8");
+    key = g_compute_checksum_for_string (G_CHECKSUM_SHA1, s, -1);
+    g_free (s);
+
+    return key;
+}
+
+ZipCacheEntry *
+zip_cache_get (ZipCache *cache,
+               const char *dirname,
+               const char *root_id,
+               gboolean is_windows)
+{
+    ZipCacheEntry *entry;
+    char *key;
+    gint64 now = (gint64)time(NULL);
+    char name[64];
+
+    key = make_key (dirname, root_id, is_windows);
+
+    pthread_mutex_lock (&cache->lock);
+
+    entry = g_hash_table_lookup (cache->entries, key);
+    if (entry && entry->state == ENTRY_DONE &&
+        now - entry->build_time > cache->ttl) {
+        remove_entry_locked (cache, entry);
+        entry = NULL;
+    }
+
+    if (entry) {
+        entry->last_access = now;
+        ++(entry->ref_count);
+        pthread_mutex_unlock (&cache->lock);
+        g_free (key);
+        return entry;
+    }
+
+    entry = g_new0 (ZipCacheEntry, 1);
+    entry->cache = cache;
+    entry->key = key;
+    snprintf (name, sizeof(name), "%s.zip", key);
+    entry->path = g_build_filename (cache->dir, name, NULL);
+    entry->dirname = g_strdup (dirname);
+    entry->root_id = g_strdup (root_id);
+    entry->is_windows = is_windows;
+    entry->state = ENTRY_BUILDING;
+    entry->build_time = now;
+    entry->last_access = now;
+
+    /* Created before it's published, so that readers can open it. */
+    entry->fd = g_open (entry->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (entry->fd < 0) {
+        seaf_warning ("Failed to create %s: %s.\n",
+                      entry->path, strerror(errno));
+        pthread_mutex_unlock (&cache->lock);
+        entry_free (entry);
+        return NULL;
+    }
+
+    /* One reference for the cache, one for the builder, one for the
+     * caller. */
+    entry->ref_count = 3;
+    g_hash_table_insert (cache->entries, entry->key, entry);
+
+    pthread_mutex_unlock (&cache->lock);
+
+    g_thread_pool_push (cache->builders, entry, NULL);
+
+    return entry;
+}
+
+int
+zip_cache_entry_open (ZipCacheEntry *entry)
+{
+    return g_open (entry->path, O_RDONLY, 0);
+}
+
+gint64
+zip_cache_entry_get_size (ZipCacheEntry *entry, gboolean *done)
+{
+    ZipCache *cache = entry->cache;
+    gint64 size;
+
+    pthread_mutex_lock (&cache->lock);
+    size = (entry->state == ENTRY_FAILED) ? -1 : entry->size;
+    *done = (entry->state == ENTRY_DONE);
+    pthread_mutex_unlock (&cache->lock);
+
+    return size;
+}
+
+static void
+build_archive (gpointer data, gpointer user_data)
+{
+    ZipCacheEntry *entry = data;
+    ZipCache *cache = user_data;
+    PackDirStream *stream;
+    struct evbuffer *buf = evbuffer_new ();
+    int n, len, rc = -1;
+
+    stream = pack_dir_stream_new (entry->dirname, entry->root_id, NULL,
+                                  entry->is_windows);
+    if (!stream)
+        goto out;
+
+    do {
+        rc = pack_dir_stream_next (stream, buf);
+        if (rc < 0)
+            break;
+
+        len = 0;
+        while (evbuffer_get_length (buf) > 0) {
+            n = evbuffer_write (buf, entry->fd);
+            if (n < 0) {
+                seaf_warning ("Failed to write %s: %s.\n",
+                              entry->path, strerror(errno));
+                rc = -1;
+                break;
+            }
+            len += n;
+        }
+
+        pthread_mutex_lock (&cache->lock);
+        entry->size += len;
+        cache->total_size += len;
+        pthread_mutex_unlock (&cache->lock);
+    } while (rc == 1);
+
+    pack_dir_stream_free (stream);
+
+out:
+    close (entry->fd);
+    evbuffer_free (buf);
+
+    pthread_mutex_lock (&cache->lock);
+    if (rc == 0) {
+        entry->state = ENTRY_DONE;
+        evict_entries_locked (cache);
+    } else {
+        seaf_warning ("Failed to build zip of dir %s.\n", entry->root_id);
+        entry->state = ENTRY_FAILED;
+        remove_entry_locked (cache, entry);
+    }
+    unref_locked (entry);
+    pthread_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ZIP_CACHE_H
+#define ZIP_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Cache of the zip archives of unencrypted dirs, keyed by the dir id, the
+ * top dir name and the file name encoding.
+ *
+ * An archive is built once, in a worker thread, into a file in the cache
+ * dir. Requests for it while it's being built read the file as it grows,
+ * so concurrent downloads of the same dir share one build. Archives older
+ * than the TTL are rebuilt; the least recently used ones are removed once
+ * the cache exceeds its size limit.
+ *
+ * Enabled by "cache_size" (in MB) under [zip] in seafile.conf:
+ *
+ * [zip]
+ * cache_size = 10240
+ * cache_ttl = 86400
+ */
+
+typedef struct _ZipCache ZipCache;
+typedef struct _ZipCacheEntry ZipCacheEntry;
+
+ZipCache *
+zip_cache_new (const char *cache_dir, gint64 max_size, int ttl);
+
+/*
+ * Returns the archive of @root_id, and starts building it if it's not
+ * cached yet. Returns NULL on error.
+ */
+ZipCacheEntry *
+zip_cache_get (ZipCache *cache,
+               const char *dirname,
+               const char *root_id,
+               gboolean is_windows);
+
+void
+zip_cache_entry_unref (ZipCacheEntry *entry);
+
+/* Returns a fd to read the archive, which may still be growing. */
+int
+zip_cache_entry_open (ZipCacheEntry *entry);
+
+/*
+ * Returns the number of bytes of the archive written so far, and sets
+ * @done if the archive is complete. Returns -1 if the build failed.
+ */
+gint64
+zip_cache_entry_get_size (ZipCacheEntry *entry, gboolean *done);
+
+#endif
@@ -10,4 +10,34 @@
 int
 monitor_compute_repo_size (const char *repo_id, GError **error);
 
+/**
+ * monitor_get_backend_stats:
+ * @reset: start the counters over if non-zero
+ *
+ * Returns the backend latency statistics of the monitor's stores, in the
+ * format of seafile_get_backend_stats().
+ */
+char *
+monitor_get_backend_stats (int reset, GError **error);
+
+/**
+ * monitor_get_scheduler_stats:
+ *
+ * Returns the state of the repo size computations, one "name \t value"
+ * per line: queue_depth, running, workers, oldest_age, avg_lag, max_lag
+ * (in usec), and the numbers of requests scheduled, coalesced into a
+ * queued or running computation, and computations done.
+ */
+char *
+monitor_get_scheduler_stats (GError **error);
+
+/**
+ * monitor_get_metrics:
+ *
+ * Returns the metrics of the monitor in the format of
+ * seafile_get_metrics().
+ */
+char *
+monitor_get_metrics (GError **error);
+
 #endif
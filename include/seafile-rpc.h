@@ -19,6 +19,16 @@ seafile_get_session_info (GError **error);
  */
 GList* seafile_get_repo_list (int start, int limit, GError **error);
 
+/**
+ * seafile_list_repo_summaries:
+ *
+ * Returns up to @limit repos with ids after @last_repo_id, as
+ * SeafileRepoSummary objects. Pass "" for the first page.
+ */
+GList *
+seafile_list_repo_summaries (const char *last_repo_id, int limit,
+                             GError **error);
+
 /**
  * seafile_get_commit_list:
  *
@@ -124,6 +134,26 @@ seafile_get_repo_property (const char *repo_id,
                            const char *key,
                            GError **error);
 
+/**
+ * Only sync the folders in @paths, separated by newlines, and the files
+ * directly under the root. NULL or empty syncs all of the repo. Can be
+ * set before the repo is cloned.
+ */
+int
+seafile_set_repo_sparse_paths (const char *repo_id,
+                               const char *paths,
+                               GError **error);
+
+/**
+ * Fetch the content of placeholder @path in the background. Returns 0
+ * if it's queued, "repo.hydrated" or "repo.hydrate_failed" is
+ * published when it's done.
+ */
+int
+seafile_hydrate_file (const char *repo_id,
+                      const char *path,
+                      GError **error);
+
 int seafile_disable_auto_sync (GError **error);
 
 int seafile_enable_auto_sync (GError **error);
@@ -218,6 +248,23 @@ GList * seafile_list_dir (const char *dir_id, GError **error);
  */
 GList * seafile_list_dir_by_path (const char *commit_id, const char *path, GError **error);
 
+/**
+ * seafile_list_dir_by_path_paged:
+ * @sort: "name" (default), "name_desc" or "dirs_first".
+ * @cursor: name of the last entry of the previous page, or NULL.
+ *
+ * Like seafile_list_dir_by_path, @limit entries from @offset after
+ * @cursor. @limit < 0 means all entries.
+ */
+GList *
+seafile_list_dir_by_path_paged (const char *commit_id,
+                                const char *path,
+                                const char *sort,
+                                const char *cursor,
+                                int offset,
+                                int limit,
+                                GError **error);
+
 /**
  * seafile_get_dirid_by_path:
  * Get the dir_id of the path
@@ -479,6 +526,83 @@ int seafile_set_monitor (const char *monitor, GError **error);
 
 char *seafile_get_monitor (GError **error);
 
+/**
+ * Return the state of the async thread pools of the object stores,
+ * one line per pool:
+ *
+ * store \t op \t threads \t max_threads \t adaptive \t queued \t pending
+ *       \t avg_latency_usec \t done
+ */
+char *seafile_get_obj_store_stats (GError **error);
+
+/**
+ * Return the counters of the fs object cache:
+ *
+ * hits \t misses \t objects \t size \t capacity
+ */
+char *seafile_get_fs_cache_stats (GError **error);
+
+/**
+ * Return the counters of the commit cache, in the same format as
+ * seafile_get_fs_cache_stats().
+ */
+char *seafile_get_commit_cache_stats (GError **error);
+
+/**
+ * Return one line for each store with an exists filter loaded:
+ *
+ * store \t ready \t bits \t added \t tests \t answered_absent
+ */
+char *seafile_get_exists_filter_stats (GError **error);
+
+/**
+ * Return one line for each store ("fs", "commits" or "blocks") and
+ * backend operation that was called:
+ *
+ * store \t op \t count \t errors \t bytes \t avg \t p50 \t p99 \t p999 \t max
+ *
+ * Latencies are in usec. If @reset is non-zero the counters start over,
+ * so that polling with reset gives the numbers of each interval.
+ */
+char *seafile_get_backend_stats (int reset, GError **error);
+
+/**
+ * Database connection pool usage, one "name \t value" per line:
+ * max_conns, in_use, idle, waiters, acquired, waited, timeouts, and the
+ * number of waits below 1ms, 10ms, 100ms, 1s and above (wait_1ms,
+ * wait_10ms, wait_100ms, wait_1s, wait_inf). If @reset is non-zero the
+ * counters start over.
+ */
+char *seafile_get_db_stats (int reset, GError **error);
+
+/**
+ * Time spent by statement, one line per statement with the values in it
+ * replaced by "?", the most time consuming first:
+ * calls \t errors \t rows \t total_ms \t avg_ms \t max_ms \t sql
+ * If @reset is non-zero the counters start over.
+ */
+char *seafile_get_db_query_stats (int reset, GError **error);
+
+/**
+ * Progress of the running or last seafserv-gc, one "name \t value" per
+ * line: phase, start_time, total_blocks, repos_total, repos_done,
+ * objects_visited, blocks_removed, bytes_freed.
+ */
+char *seafile_get_gc_stats (GError **error);
+
+/**
+ * Threaded rpc calls by method, one line per method:
+ * method \t calls \t running \t queued \t avg_queue_ms \t max_queue_ms
+ * \t avg_run_ms
+ */
+char *seafile_get_rpc_stats (GError **error);
+
+/**
+ * Return all metrics of the server in the Prometheus text format, the
+ * same as the /metrics page of the httpserver.
+ */
+char *seafile_get_metrics (GError **error);
+
 gint64 seafile_get_user_quota_usage (const char *email, GError **error);
 
 gint64 seafile_get_org_quota_usage (int org_id, GError **error);
@@ -489,6 +613,32 @@ seafile_get_org_user_quota_usage (int org_id, const char *user, GError **error);
 gint64
 seafile_server_repo_size(const char *repo_id, GError **error);
 
+/**
+ * seafile_get_repo_unique_size:
+ *
+ * Bytes that deleting the repo would free, from the block ref index.
+ * Fails if the index is off or the repo isn't indexed yet.
+ */
+gint64
+seafile_get_repo_unique_size (const char *repo_id, GError **error);
+
+/**
+ * seafile_set_repo_storage_class:
+ *
+ * Put the blocks of the repo in the storage class @class_name. Blocks
+ * already stored are moved in the background.
+ */
+int
+seafile_set_repo_storage_class (const char *repo_id, const char *class_name,
+                                GError **error);
+
+int
+seafile_set_org_storage_class (int org_id, const char *class_name,
+                               GError **error);
+
+char *
+seafile_get_repo_storage_class (const char *repo_id, GError **error);
+
 int
 seafile_repo_set_access_property (const char *repo_id, const char *ap,
                                   GError **error);
@@ -503,6 +653,18 @@ seafile_web_get_access_token (const char *repo_id,
                               const char *username,
                               GError **error);
 
+/**
+ * Returns a json list of the access tokens for the objects in
+ * @obj_ids_json, a json list of object ids of @repo_id, in the same
+ * order.
+ */
+char *
+seafile_web_get_access_tokens (const char *repo_id,
+                               const char *obj_ids_json,
+                               const char *op,
+                               const char *username,
+                               GError **error);
+
 GObject *
 seafile_web_query_access_token (const char *token, GError **error);
 
@@ -512,6 +674,28 @@ seafile_get_checkout_task (const char *repo_id, GError **error);
 GList *
 seafile_get_sync_task_list (GError **error);
 
+/**
+ * Return the phase timings and counters of the last finished sync
+ * tasks, in the format of seaf_sync_manager_format_traces().
+ */
+char *
+seafile_get_sync_traces (GError **error);
+
+/**
+ * Return the transferred bytes, blocks, failures and rates of the
+ * running transfer tasks and of the peers, in the format of
+ * seaf_transfer_manager_format_stats().
+ */
+char *
+seafile_get_transfer_stats (GError **error);
+
+/**
+ * Return the per second samples of the last 5 minutes for a transfer
+ * task (by repo id) or a peer (by peer id).
+ */
+char *
+seafile_get_transfer_history (const char *id, GError **error);
+
 int
 seafile_add_share (const char *repo_id, const char *from_email,
                    const char *to_email, const char *permission,
@@ -525,6 +709,15 @@ GList *
 seafile_list_org_share_repos (int org_id, const char *email, const char *type,
                               int start, int limit, GError **error);
 
+/* Total number of repos of seafile_list_share_repos(), for paging. */
+int
+seafile_count_share_repos (const char *email, const char *type,
+                           GError **error);
+
+int
+seafile_count_org_share_repos (int org_id, const char *email,
+                               const char *type, GError **error);
+
 int
 seafile_remove_share (const char *repo_id, const char *from_email,
                       const char *to_email, GError **error);
@@ -620,6 +813,20 @@ seafile_post_multi_files (const char *repo_id,
                           const char *user,
                           GError **error);
 
+/**
+ * Add multiple files whose blocks and seafile objects are already
+ * written, e.g. by httpserver chunking uploads as they arrive.
+ *
+ * @file_ids_json: json array of the seafile ids
+ */
+int
+seafile_post_indexed_files (const char *repo_id,
+                            const char *parent_dir,
+                            const char *filenames_json,
+                            const char *file_ids_json,
+                            const char *user,
+                            GError **error);
+
 int
 seafile_post_empty_file (const char *repo_id, const char *parent_dir,
                          const char *new_file_name, const char *user,
@@ -655,6 +862,14 @@ seafile_del_file (const char *repo_id,
                   const char *user,
                   GError **error);
 
+/**
+ * Apply a json list of del/add/move/rename operations in one commit.
+ * See seaf_repo_manager_batch_edit() for the format.
+ */
+int
+seafile_batch_edit (const char *repo_id, const char *ops_json,
+                    const char *user, GError **error);
+
 /**
  * copy a file/directory from a repo to another on server.
  */
@@ -679,6 +894,55 @@ seafile_move_file (const char *src_repo_id,
                    const char *user,
                    GError **error);
 
+/**
+ * Copy or move (@is_move) a file or dir in a background task.
+ * Returns the task id, pass it to seafile_get_copy_task() for the progress.
+ */
+char *
+seafile_copy_file_async (const char *src_repo_id,
+                         const char *src_dir,
+                         const char *src_filename,
+                         const char *dst_repo_id,
+                         const char *dst_dir,
+                         const char *dst_filename,
+                         const char *user,
+                         int is_move,
+                         GError **error);
+
+GObject *
+seafile_get_copy_task (const char *task_id, GError **error);
+
+/**
+ * Restore files and dirs from history in a background task, in one
+ * commit. @items_json is a list of {"path": ..., "commit_id": ...}.
+ * Returns the task id, pass it to seafile_get_restore_task() for the
+ * progress.
+ */
+char *
+seafile_restore_entries_async (const char *repo_id,
+                               const char *items_json,
+                               const char *user,
+                               GError **error);
+
+GObject *
+seafile_get_restore_task (const char *task_id, GError **error);
+
+/* Nothing is committed if the task is canceled before it's done. */
+int
+seafile_cancel_restore_task (const char *task_id, GError **error);
+
+/**
+ * Run several threaded rpc calls in one round trip.
+ *
+ * @calls_json is a list of at most 100 searpc calls, each one in the
+ * format sent by searpc clients: ["seafile_get_repo", "<repo_id>"].
+ * Returns the list of their results in the same order, each one as a
+ * searpc client would receive it: {"ret": ...} or {"err_code": ...,
+ * "err_msg": ...}. A failed call doesn't stop the following ones.
+ */
+char *
+seafile_batch_call (const char *calls_json, GError **error);
+
 int
 seafile_rename_file (const char *repo_id,
                      const char *parent_dir,
@@ -748,6 +1012,16 @@ seafile_revert_dir (const char *repo_id,
 GList *
 seafile_get_deleted (const char *repo_id, GError **error);
 
+/**
+ * seafile_get_deleted_entries:
+ *
+ * Like seafile_get_deleted, but only the entries deleted in the last
+ * @show_days days, @limit of them from @start, latest first.
+ */
+GList *
+seafile_get_deleted_entries (const char *repo_id, int show_days,
+                             int start, int limit, GError **error);
+
 int seafile_set_repo_token (const char *repo_id,
                             const char *email,
                             const char *token,
@@ -848,6 +1122,33 @@ seafile_list_org_inner_pub_repos_by_owner (int org_id,
                                            const char *user,
                                            GError **error);
 
+/*
+ * Paginated listings of shared repos, with owner, head commit id and size
+ * of every repo, fetched in one query. Pass -1 as @start and @limit
+ * to list all.
+ */
+GList *
+seafile_list_group_repos (int group_id, int start, int limit, GError **error);
+
+GList *
+seafile_list_group_repos_by_owner (const char *user, int start, int limit,
+                                   GError **error);
+
+GList *
+seafile_list_inner_pub_repos_paged (int start, int limit, GError **error);
+
+GList *
+seafile_list_org_group_repos (int org_id, int group_id, int start, int limit,
+                              GError **error);
+
+GList *
+seafile_list_org_group_repos_by_owner (int org_id, const char *user,
+                                       int start, int limit, GError **error);
+
+GList *
+seafile_list_org_inner_pub_repos_paged (int org_id, int start, int limit,
+                                        GError **error);
+
 int
 seafile_set_share_permission (const char *repo_id,
                               const char *from_email,
@@ -12,6 +12,11 @@
 #define CLEARBIT(a, n) (a[n/CHAR_BIT] &= ~(1<<(n%CHAR_BIT)))
 #define GETBIT(a, n) (a[n/CHAR_BIT] & (1<<(n%CHAR_BIT)))
 
+/* Bits in each block of a blocked filter, a cache line. */
+#define BLOCK_BITS 512
+#define BLOCK_WORDS (BLOCK_BITS / 64)
+#define MAX_BLOCKED_K 7         /* 9 bits of the id per probe */
+
 Bloom* bloom_create(size_t size, int k, int counting)
 {
     Bloom *bloom;
@@ -25,10 +30,12 @@ Bloom* bloom_create(size_t size, int k, int counting)
         free (bloom);
         return NULL;
     }
+    bloom->mem = bloom->a;
     if (counting) {
         csize = size*4;
         bloom->counters = calloc((csize+CHAR_BIT-1)/CHAR_BIT, sizeof(char));
         if (!bloom->counters) {
+            free (bloom->a);
             free (bloom);
             return NULL;
         }
@@ -38,13 +45,39 @@ Bloom* bloom_create(size_t size, int k, int counting)
     bloom->csize = csize;
     bloom->k = k;
     bloom->counting = counting;
+    bloom->blocked = 0;
+
+    return bloom;
+}
+
+Bloom* bloom_create_blocked(size_t size, int k)
+{
+    Bloom *bloom;
+    size_t n_blocks = (size + BLOCK_BITS - 1) / BLOCK_BITS;
+    uintptr_t p;
+
+    if (k <= 0 || k > MAX_BLOCKED_K || n_blocks == 0) return NULL;
+
+    if ( !(bloom = calloc(1, sizeof(Bloom))) ) return NULL;
+    /* Align the blocks to cache lines. */
+    if ( !(bloom->mem = calloc(n_blocks * (BLOCK_BITS/CHAR_BIT) + 63, 1)) )
+    {
+        free (bloom);
+        return NULL;
+    }
+    p = ((uintptr_t)bloom->mem + 63) & ~(uintptr_t)63;
+    bloom->a = (unsigned char *)p;
+
+    bloom->asize = n_blocks * BLOCK_BITS;
+    bloom->k = k;
+    bloom->blocked = 1;
 
     return bloom;
 }
 
 int bloom_destroy(Bloom *bloom)
 {
-    free (bloom->a);
+    free (bloom->mem);
     if (bloom->counting) free (bloom->counters);
     free (bloom);
 
@@ -121,6 +154,71 @@ decr_bit (Bloom *bf, unsigned int bit_idx)
     bf->counters[char_idx] = value;
 }
 
+static inline uint64_t
+hex_to_u64 (const char *s)
+{
+    uint64_t v = 0;
+    int i;
+
+    /* Maps '0'-'9', 'a'-'f' and 'A'-'F' to their values. */
+    for (i = 0; i < 16; ++i)
+        v = (v << 4) | ((s[i] & 0xF) + 9 * (s[i] >> 6));
+
+    return v;
+}
+
+/*
+ * The first 64 bits of the id select the block, the next k * 9 bits the
+ * bits in it, which go to @mask.
+ */
+static uint64_t *
+get_block (Bloom *bloom, const char *id, uint64_t mask[BLOCK_WORDS])
+{
+    uint64_t h1, h2;
+    unsigned int bit;
+    int i;
+
+    assert (strlen(id) == 40);
+
+    h1 = hex_to_u64 (id);
+    h2 = hex_to_u64 (id + 16);
+
+    memset (mask, 0, BLOCK_WORDS * sizeof(uint64_t));
+    for (i = 0; i < bloom->k; ++i) {
+        bit = (unsigned int)(h2 >> (9 * i)) & (BLOCK_BITS - 1);
+        mask[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+
+    return (uint64_t *)bloom->a +
+        (h1 % (bloom->asize / BLOCK_BITS)) * BLOCK_WORDS;
+}
+
+static void
+blocked_add (Bloom *bloom, const char *id)
+{
+    uint64_t mask[BLOCK_WORDS];
+    uint64_t *block = get_block (bloom, id, mask);
+    int i;
+
+    for (i = 0; i < BLOCK_WORDS; ++i)
+        block[i] |= mask[i];
+}
+
+static int
+blocked_test (Bloom *bloom, const char *id)
+{
+    uint64_t mask[BLOCK_WORDS];
+    uint64_t *block = get_block (bloom, id, mask);
+    uint64_t missing = 0;
+    int i;
+
+    /* No early exit, so that the compiler can vectorize it. */
+    for (i = 0; i < BLOCK_WORDS; ++i)
+        missing |= mask[i] & ~block[i];
+
+    return missing == 0;
+}
+
 int bloom_add(Bloom *bloom, const char *s)
 {
     int i;
@@ -130,6 +228,11 @@ int bloom_add(Bloom *bloom, const char *s)
     
     assert (s && *s);
 
+    if (bloom->blocked) {
+        blocked_add (bloom, s);
+        return 0;
+    }
+
     SHA1_Init(&c);
     SHA1_Update(&c, s, strlen(s));
     SHA1_Final (sha1, &c);
@@ -171,6 +274,9 @@ int bloom_test(Bloom *bloom, const char *s)
     
     assert (s && *s);
 
+    if (bloom->blocked)
+        return blocked_test (bloom, s);
+
     SHA1_Init(&c);
     SHA1_Update(&c, s, strlen(s));
     SHA1_Final (sha1, &c);
@@ -180,3 +286,69 @@ int bloom_test(Bloom *bloom, const char *s)
 
     return 1;
 }
+
+int bloom_merge(Bloom *dst, Bloom *src)
+{
+    size_t i, n;
+
+    if (dst->asize != src->asize || dst->k != src->k ||
+        dst->blocked != src->blocked ||
+        dst->counting || src->counting)
+        return -1;
+
+    n = (dst->asize+CHAR_BIT-1)/CHAR_BIT;
+    for (i = 0; i < n; ++i)
+        dst->a[i] |= src->a[i];
+
+    return 0;
+}
+
+typedef struct {
+    uint64_t asize;
+    uint32_t k;
+    uint32_t flags;             /* was padding, 0 in old files */
+} BloomFileHeader;
+
+#define BLOOM_FLAG_BLOCKED 1
+
+int bloom_save(Bloom *bloom, FILE *fp)
+{
+    BloomFileHeader hdr;
+    size_t n = (bloom->asize+CHAR_BIT-1)/CHAR_BIT;
+
+    if (bloom->counting) return -1;
+
+    memset (&hdr, 0, sizeof(hdr));
+    hdr.asize = bloom->asize;
+    hdr.k = bloom->k;
+    if (bloom->blocked)
+        hdr.flags |= BLOOM_FLAG_BLOCKED;
+
+    if (fwrite (&hdr, sizeof(hdr), 1, fp) != 1) return -1;
+    if (n > 0 && fwrite (bloom->a, n, 1, fp) != 1) return -1;
+
+    return 0;
+}
+
+Bloom *bloom_load(FILE *fp)
+{
+    BloomFileHeader hdr;
+    Bloom *bloom;
+    size_t n;
+
+    if (fread (&hdr, sizeof(hdr), 1, fp) != 1) return NULL;
+
+    if (hdr.flags & BLOOM_FLAG_BLOCKED)
+        bloom = bloom_create_blocked (hdr.asize, hdr.k);
+    else
+        bloom = bloom_create (hdr.asize, hdr.k, 0);
+    if (!bloom) return NULL;
+
+    n = (bloom->asize+CHAR_BIT-1)/CHAR_BIT;
+    if (n > 0 && fread (bloom->a, n, 1, fp) != 1) {
+        bloom_destroy (bloom);
+        return NULL;
+    }
+
+    return bloom;
+}
@@ -4,6 +4,7 @@
 #define __BLOOM_H__
 
 #include <stdlib.h>
+#include <stdio.h>
 
 typedef struct {
     size_t          asize;
@@ -12,12 +13,27 @@ typedef struct {
     unsigned char  *counters;
     int             k;
     char            counting:1;
+    char            blocked:1;
+    void           *mem;            /* allocation holding a */
 } Bloom;
 
 Bloom *bloom_create (size_t size, int k, int counting);
+/*
+ * A filter whose k bits for an item all lie in one 64-byte cache line,
+ * so each add/test touches one line. Items must be 40-char hex SHA-1
+ * ids: their own bits select the line and bits, nothing is hashed.
+ * @k is at most 7, and counting is not supported.
+ */
+Bloom *bloom_create_blocked (size_t size, int k);
 int bloom_destroy (Bloom *bloom);
 int bloom_add (Bloom *bloom, const char *s);
 int bloom_remove (Bloom *bloom, const char *s);
 int bloom_test (Bloom *bloom, const char *s);
+/* Add all items of @src to @dst. They must have the same size, k and
+ * kind, and not be counting. */
+int bloom_merge (Bloom *dst, Bloom *src);
+/* Only non-counting filters can be saved. Bits are stored in host order. */
+int bloom_save (Bloom *bloom, FILE *fp);
+Bloom *bloom_load (FILE *fp);
 
 #endif
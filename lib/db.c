@@ -1,9 +1,174 @@
 
 #include <glib.h>
 #include <unistd.h>
+#include <string.h>
 
+#include "utils.h"
 #include "db.h"
 
+/*
+ * Per connection state: a cache of prepared statements and the write
+ * batch. Statements are taken out of the cache while they're used, so
+ * that two threads running the same SQL on one connection don't share
+ * a statement.
+ */
+
+#define STMT_CACHE_SIZE 32
+
+typedef struct DBState {
+    sqlite3 *db;
+    GQueue  *stmts;          /* most recently used first */
+    int      batch_interval; /* msec, 0 if writes are not batched */
+    gint64   batch_start;    /* usec, 0 if no batch is open */
+    gboolean in_txn;         /* in sqlite_begin_transaction() */
+} DBState;
+
+static GStaticMutex states_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *db_states;
+
+/* Called with states_lock held. */
+static DBState *
+get_db_state (sqlite3 *db)
+{
+    DBState *st;
+
+    if (!db_states)
+        db_states = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    st = g_hash_table_lookup (db_states, db);
+    if (!st) {
+        st = g_new0 (DBState, 1);
+        st->db = db;
+        st->stmts = g_queue_new ();
+        g_hash_table_insert (db_states, db, st);
+    }
+    return st;
+}
+
+static sqlite3_stmt *
+prepare_cached (sqlite3 *db, const char *sql)
+{
+    DBState *st;
+    GList *ptr;
+    sqlite3_stmt *stmt = NULL;
+
+    g_static_mutex_lock (&states_lock);
+    st = get_db_state (db);
+    for (ptr = st->stmts->head; ptr; ptr = ptr->next) {
+        if (strcmp (sqlite3_sql (ptr->data), sql) == 0) {
+            stmt = ptr->data;
+            g_queue_delete_link (st->stmts, ptr);
+            break;
+        }
+    }
+    g_static_mutex_unlock (&states_lock);
+
+    if (stmt)
+        return stmt;
+    return sqlite_query_prepare (db, sql);
+}
+
+/* Return a statement from prepare_cached() to the cache. */
+static void
+release_cached (sqlite3 *db, sqlite3_stmt *stmt)
+{
+    DBState *st;
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    g_static_mutex_lock (&states_lock);
+    st = get_db_state (db);
+    g_queue_push_head (st->stmts, stmt);
+    if (g_queue_get_length (st->stmts) > STMT_CACHE_SIZE)
+        sqlite3_finalize (g_queue_pop_tail (st->stmts));
+    g_static_mutex_unlock (&states_lock);
+}
+
+/* Called with states_lock held. */
+static void
+commit_batch (DBState *st)
+{
+    char *errmsg = NULL;
+
+    if (st->batch_start == 0)
+        return;
+
+    /* Fails if a write is still running, retried later. */
+    if (sqlite3_exec (st->db, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK) {
+        g_warning ("Failed to commit write batch: %s\n",
+                   errmsg ? errmsg : "no error given");
+        sqlite3_free (errmsg);
+    }
+
+    if (sqlite3_get_autocommit (st->db))
+        st->batch_start = 0;
+}
+
+/* Open a batch before a write, or commit one that is old enough. */
+static void
+batch_before_write (sqlite3 *db)
+{
+    DBState *st;
+    gint64 now;
+
+    g_static_mutex_lock (&states_lock);
+
+    st = get_db_state (db);
+    if (st->batch_interval == 0 || st->in_txn)
+        goto out;
+
+    now = get_current_time ();
+    if (st->batch_start != 0 &&
+        now - st->batch_start >= (gint64)st->batch_interval * 1000)
+        commit_batch (st);
+
+    if (st->batch_start == 0 && sqlite3_get_autocommit (db) &&
+        sqlite3_exec (db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK)
+        st->batch_start = now;
+
+out:
+    g_static_mutex_unlock (&states_lock);
+}
+
+int
+sqlite_set_write_batch (sqlite3 *db, int interval)
+{
+    DBState *st;
+
+    g_static_mutex_lock (&states_lock);
+    st = get_db_state (db);
+    if (interval == 0)
+        commit_batch (st);
+    st->batch_interval = interval;
+    g_static_mutex_unlock (&states_lock);
+
+    return 0;
+}
+
+void
+sqlite_flush_write_batch (sqlite3 *db)
+{
+    g_static_mutex_lock (&states_lock);
+    commit_batch (get_db_state (db));
+    g_static_mutex_unlock (&states_lock);
+}
+
+void
+sqlite_flush_write_batches ()
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_static_mutex_lock (&states_lock);
+    if (db_states) {
+        g_hash_table_iter_init (&iter, db_states);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            commit_batch (value);
+    }
+    g_static_mutex_unlock (&states_lock);
+}
+
 int
 sqlite_open_db (const char *db_path, sqlite3 **db)
 {
@@ -21,11 +186,31 @@ sqlite_open_db (const char *db_path, sqlite3 **db)
         return -1;
     }
 
+    /* Readers don't block the writer in WAL mode, and only checkpoints
+     * are synced to disk with synchronous=NORMAL.
+     */
+    sqlite3_exec (*db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    sqlite3_exec (*db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+
     return 0;
 }
 
 int sqlite_close_db (sqlite3 *db)
 {
+    DBState *st;
+
+    g_static_mutex_lock (&states_lock);
+    st = db_states ? g_hash_table_lookup (db_states, db) : NULL;
+    if (st) {
+        commit_batch (st);
+        while (!g_queue_is_empty (st->stmts))
+            sqlite3_finalize (g_queue_pop_head (st->stmts));
+        g_queue_free (st->stmts);
+        g_hash_table_remove (db_states, db);
+        g_free (st);
+    }
+    g_static_mutex_unlock (&states_lock);
+
     return sqlite3_close (db);
 }
 
@@ -49,8 +234,8 @@ sqlite_query_prepare (sqlite3 *db, const char *sql)
     return stmt;
 }
 
-int
-sqlite_query_exec (sqlite3 *db, const char *sql)
+static int
+exec_multi (sqlite3 *db, const char *sql)
 {
     char *errmsg = NULL;
     int result;
@@ -68,18 +253,78 @@ sqlite_query_exec (sqlite3 *db, const char *sql)
     return 0;
 }
 
+static gboolean
+is_single_statement (sqlite3_stmt *stmt, const char *sql)
+{
+    const char *tail = sql + strlen (sqlite3_sql (stmt));
+
+    while (*tail == ' ' || *tail == '\t' || *tail == '\n' || *tail == ';')
+        ++tail;
+    return (*tail == '\0');
+}
+
+int
+sqlite_query_exec (sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt;
+    int result;
+
+    stmt = prepare_cached (db, sql);
+    if (!stmt)
+        return -1;
+
+    if (!is_single_statement (stmt, sql)) {
+        sqlite3_finalize (stmt);
+        batch_before_write (db);
+        return exec_multi (db, sql);
+    }
+
+    if (!sqlite3_stmt_readonly (stmt))
+        batch_before_write (db);
+
+    result = sqlite3_step (stmt);
+    if (result != SQLITE_DONE && result != SQLITE_ROW) {
+        const gchar *str = sqlite3_errmsg (db);
+
+        g_warning ("SQL error: %d - %s\n:\t%s\n",
+                   result, str ? str : "no error given", sql);
+        release_cached (db, stmt);
+        return -1;
+    }
+
+    release_cached (db, stmt);
+    return 0;
+}
+
 int
 sqlite_begin_transaction (sqlite3 *db)
 {
+    DBState *st;
+
+    /* The write batch is committed first, it can't be nested. */
+    g_static_mutex_lock (&states_lock);
+    st = get_db_state (db);
+    commit_batch (st);
+    st->in_txn = TRUE;
+    g_static_mutex_unlock (&states_lock);
+
     char *sql = "BEGIN TRANSACTION;";
-    return sqlite_query_exec (db, sql);
+    return exec_multi (db, sql);
 }
 
 int
 sqlite_end_transaction (sqlite3 *db)
 {
+    DBState *st;
     char *sql = "END TRANSACTION;";
-    return sqlite_query_exec (db, sql);
+    int ret = exec_multi (db, sql);
+
+    g_static_mutex_lock (&states_lock);
+    st = get_db_state (db);
+    st->in_txn = FALSE;
+    g_static_mutex_unlock (&states_lock);
+
+    return ret;
 }
 
 
@@ -89,7 +334,7 @@ sqlite_check_for_existence (sqlite3 *db, const char *sql)
     sqlite3_stmt *stmt;
     int result;
 
-    stmt = sqlite_query_prepare (db, sql);
+    stmt = prepare_cached (db, sql);
     if (!stmt)
         return FALSE;
 
@@ -99,10 +344,10 @@ sqlite_check_for_existence (sqlite3 *db, const char *sql)
 
         g_warning ("Couldn't execute query, error: %d->'%s'\n", 
                    result, str ? str : "no error given");
-        sqlite3_finalize (stmt);
+        release_cached (db, stmt);
         return FALSE;
     }
-    sqlite3_finalize (stmt);
+    release_cached (db, stmt);
 
     if (result == SQLITE_ROW)
         return TRUE;
@@ -117,7 +362,7 @@ sqlite_foreach_selected_row (sqlite3 *db, const char *sql,
     int result;
     int n_rows = 0;
 
-    stmt = sqlite_query_prepare (db, sql);
+    stmt = prepare_cached (db, sql);
     if (!stmt) {
         return -1;
     }
@@ -136,11 +381,11 @@ sqlite_foreach_selected_row (sqlite3 *db, const char *sql,
 
         g_warning ("Couldn't execute query, error: %d->'%s'\n",
                    result, s ? s : "no error given");
-        sqlite3_finalize (stmt);
+        release_cached (db, stmt);
         return -1;
     }
 
-    sqlite3_finalize (stmt);
+    release_cached (db, stmt);
     return n_rows;
 }
 
@@ -150,13 +395,13 @@ int sqlite_get_int (sqlite3 *db, const char *sql)
     int result;
     sqlite3_stmt *stmt;
 
-    if ( !(stmt = sqlite_query_prepare(db, sql)) )
+    if ( !(stmt = prepare_cached(db, sql)) )
         return 0;
 
     result = sqlite3_step (stmt);
     if (result == SQLITE_ROW) {
         ret = sqlite3_column_int (stmt, 0);
-        sqlite3_finalize (stmt);
+        release_cached (db, stmt);
         return ret;
     }
 
@@ -164,9 +409,10 @@ int sqlite_get_int (sqlite3 *db, const char *sql)
         const gchar *str = sqlite3_errmsg (db);
         g_warning ("Couldn't prepare query, error: %d->'%s'\n",
                    result, str ? str : "no error given");
-        sqlite3_finalize (stmt);
+        release_cached (db, stmt);
         return 0;
     }
+    release_cached (db, stmt);
     return ret;
 }
 
@@ -176,13 +422,13 @@ gint64 sqlite_get_int64 (sqlite3 *db, const char *sql)
     int result;
     sqlite3_stmt *stmt;
 
-    if ( !(stmt = sqlite_query_prepare(db, sql)) )
+    if ( !(stmt = prepare_cached(db, sql)) )
         return 0;
 
     result = sqlite3_step (stmt);
     if (result == SQLITE_ROW) {
         ret = sqlite3_column_int64 (stmt, 0);
-        sqlite3_finalize (stmt);
+        release_cached (db, stmt);
         return ret;
     }
 
@@ -190,34 +436,38 @@ gint64 sqlite_get_int64 (sqlite3 *db, const char *sql)
         const gchar *str = sqlite3_errmsg (db);
         g_warning ("Couldn't prepare query, error: %d->'%s'\n",
                    result, str ? str : "no error given");
-        sqlite3_finalize (stmt);
+        release_cached (db, stmt);
         return 0;
     }
+    release_cached (db, stmt);
     return ret;
 }
 
 char *sqlite_get_string (sqlite3 *db, const char *sql)
 {
     const char *res = NULL;
+    char *ret;
     int result;
     sqlite3_stmt *stmt;
 
-    if ( !(stmt = sqlite_query_prepare(db, sql)) )
+    if ( !(stmt = prepare_cached(db, sql)) )
         return NULL;
 
     result = sqlite3_step (stmt);
     if (result == SQLITE_ROW) {
         res = (const char *)sqlite3_column_text (stmt, 0);
-        sqlite3_finalize (stmt);
-        return g_strdup(res);
+        ret = g_strdup(res);
+        release_cached (db, stmt);
+        return ret;
     }
 
     if (result == SQLITE_ERROR) {
         const gchar *str = sqlite3_errmsg (db);
         g_warning ("Couldn't prepare query, error: %d->'%s'\n",
                    result, str ? str : "no error given");
-        sqlite3_finalize (stmt);
+        release_cached (db, stmt);
         return NULL;
     }
+    release_cached (db, stmt);
     return NULL;
 }
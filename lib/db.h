@@ -29,5 +29,19 @@ gint64 sqlite_get_int64 (sqlite3 *db, const char *sql);
 
 char *sqlite_get_string (sqlite3 *db, const char *sql);
 
+/*
+ * Batch the writes done through sqlite_query_exec() on @db into
+ * transactions committed every @interval msec, or not if @interval is
+ * 0. The batch is also committed by the next write after the
+ * interval, by sqlite_flush_write_batches(), which the owner should
+ * call periodically, and before sqlite_begin_transaction().
+ */
+int sqlite_set_write_batch (sqlite3 *db, int interval);
+
+/* Commit the pending writes of @db now, e.g. at a commit point. */
+void sqlite_flush_write_batch (sqlite3 *db);
+
+void sqlite_flush_write_batches ();
+
 
 #endif
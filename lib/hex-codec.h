@@ -0,0 +1,219 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HEX_CODEC_H
+#define HEX_CODEC_H
+
+/*
+ * Hex encoding and decoding of binary ids, 16 bytes at a time with SSE2
+ * or NEON when the target has them. It's all inline, so that libraries
+ * which can't link to libseafile (e.g. libcdc) share the same code.
+ *
+ * Use rawdata_to_hex() and hex_to_rawdata() from utils.h elsewhere.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HEX_CODEC_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HEX_CODEC_NEON
+#endif
+
+static inline char *
+hex_encode_scalar (const unsigned char *in, char *out, int n)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < n; i++) {
+        *out++ = hex[in[i] >> 4];
+        *out++ = hex[in[i] & 0xf];
+    }
+    return out;
+}
+
+static inline unsigned int
+hex_char_value (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return ~0u;
+}
+
+static inline int
+hex_decode_scalar (const char *in, unsigned char *out, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        unsigned int val = (hex_char_value (in[0]) << 4) |
+            hex_char_value (in[1]);
+        if (val & ~0xff)
+            return -1;
+        *out++ = val;
+        in += 2;
+    }
+    return 0;
+}
+
+/*
+ * A nibble n is encoded as '0' + n, plus 39 more for 'a'-'f'. A char is
+ * decoded to c - '0' if that is <= 9, or to (c | 0x20) - 'a' + 10 if
+ * (c | 0x20) - 'a' is <= 5. Other chars are invalid.
+ */
+
+#if defined(HEX_CODEC_SSE2)
+
+static inline __m128i
+hex_nibbles_to_ascii (__m128i n)
+{
+    __m128i alpha = _mm_and_si128 (_mm_cmpgt_epi8 (n, _mm_set1_epi8 (9)),
+                                   _mm_set1_epi8 (39));
+    return _mm_add_epi8 (_mm_add_epi8 (n, _mm_set1_epi8 ('0')), alpha);
+}
+
+/* 16 bytes to 32 chars. */
+static inline void
+hex_encode_16 (const unsigned char *in, char *out)
+{
+    __m128i mask = _mm_set1_epi8 (0x0f);
+    __m128i x = _mm_loadu_si128 ((const __m128i *)in);
+    __m128i hi = _mm_and_si128 (_mm_srli_epi16 (x, 4), mask);
+    __m128i lo = _mm_and_si128 (x, mask);
+
+    _mm_storeu_si128 ((__m128i *)out,
+                      hex_nibbles_to_ascii (_mm_unpacklo_epi8 (hi, lo)));
+    _mm_storeu_si128 ((__m128i *)(out + 16),
+                      hex_nibbles_to_ascii (_mm_unpackhi_epi8 (hi, lo)));
+}
+
+static inline __m128i
+hex_ascii_to_nibbles (__m128i c, __m128i *bad)
+{
+    __m128i d = _mm_sub_epi8 (c, _mm_set1_epi8 ('0'));
+    __m128i l = _mm_sub_epi8 (_mm_or_si128 (c, _mm_set1_epi8 (0x20)),
+                              _mm_set1_epi8 ('a'));
+    __m128i is_d = _mm_cmpeq_epi8 (_mm_min_epu8 (d, _mm_set1_epi8 (9)), d);
+    __m128i is_l = _mm_cmpeq_epi8 (_mm_min_epu8 (l, _mm_set1_epi8 (5)), l);
+
+    *bad = _mm_or_si128 (*bad, _mm_andnot_si128 (_mm_or_si128 (is_d, is_l),
+                                                 _mm_set1_epi8 (-1)));
+    return _mm_or_si128 (_mm_and_si128 (is_d, d),
+                         _mm_and_si128 (is_l,
+                                        _mm_add_epi8 (l, _mm_set1_epi8 (10))));
+}
+
+/* In each 16-bit lane, the first char of a pair is the low byte. */
+static inline __m128i
+hex_pack_pairs (__m128i v)
+{
+    return _mm_or_si128 (_mm_slli_epi16 (_mm_and_si128 (v, _mm_set1_epi16 (0xff)),
+                                         4),
+                         _mm_srli_epi16 (v, 8));
+}
+
+/* 32 chars to 16 bytes. */
+static inline int
+hex_decode_32 (const char *in, unsigned char *out)
+{
+    __m128i bad = _mm_setzero_si128 ();
+    __m128i a, b;
+
+    a = hex_ascii_to_nibbles (_mm_loadu_si128 ((const __m128i *)in), &bad);
+    b = hex_ascii_to_nibbles (_mm_loadu_si128 ((const __m128i *)(in + 16)),
+                              &bad);
+    _mm_storeu_si128 ((__m128i *)out,
+                      _mm_packus_epi16 (hex_pack_pairs (a), hex_pack_pairs (b)));
+
+    return _mm_movemask_epi8 (bad) ? -1 : 0;
+}
+
+#elif defined(HEX_CODEC_NEON)
+
+static inline uint8x16_t
+hex_nibbles_to_ascii (uint8x16_t n)
+{
+    uint8x16_t alpha = vandq_u8 (vcgtq_u8 (n, vdupq_n_u8 (9)),
+                                 vdupq_n_u8 (39));
+    return vaddq_u8 (vaddq_u8 (n, vdupq_n_u8 ('0')), alpha);
+}
+
+static inline void
+hex_encode_16 (const unsigned char *in, char *out)
+{
+    uint8x16_t x = vld1q_u8 (in);
+    uint8x16x2_t z = vzipq_u8 (vshrq_n_u8 (x, 4),
+                               vandq_u8 (x, vdupq_n_u8 (0x0f)));
+
+    vst1q_u8 ((uint8_t *)out, hex_nibbles_to_ascii (z.val[0]));
+    vst1q_u8 ((uint8_t *)out + 16, hex_nibbles_to_ascii (z.val[1]));
+}
+
+static inline uint8x16_t
+hex_ascii_to_nibbles (uint8x16_t c, uint8x16_t *bad)
+{
+    uint8x16_t d = vsubq_u8 (c, vdupq_n_u8 ('0'));
+    uint8x16_t l = vsubq_u8 (vorrq_u8 (c, vdupq_n_u8 (0x20)),
+                             vdupq_n_u8 ('a'));
+    uint8x16_t is_d = vcleq_u8 (d, vdupq_n_u8 (9));
+    uint8x16_t is_l = vcleq_u8 (l, vdupq_n_u8 (5));
+
+    *bad = vorrq_u8 (*bad, vmvnq_u8 (vorrq_u8 (is_d, is_l)));
+    return vbslq_u8 (is_d, d, vaddq_u8 (l, vdupq_n_u8 (10)));
+}
+
+static inline int
+hex_decode_32 (const char *in, unsigned char *out)
+{
+    uint8x16_t bad = vdupq_n_u8 (0);
+    /* Separate the first and second chars of the pairs. */
+    uint8x16x2_t u = vuzpq_u8 (vld1q_u8 ((const uint8_t *)in),
+                               vld1q_u8 ((const uint8_t *)in + 16));
+    uint8x16_t hi = hex_ascii_to_nibbles (u.val[0], &bad);
+    uint8x16_t lo = hex_ascii_to_nibbles (u.val[1], &bad);
+    uint64x2_t bad64;
+
+    vst1q_u8 (out, vorrq_u8 (vshlq_n_u8 (hi, 4), lo));
+
+    bad64 = vreinterpretq_u64_u8 (bad);
+    return (vgetq_lane_u64 (bad64, 0) | vgetq_lane_u64 (bad64, 1)) ? -1 : 0;
+}
+
+#endif
+
+/* Writes 2 * @n chars and a '\0' to @out. */
+static inline void
+hex_codec_encode (const unsigned char *in, char *out, int n)
+{
+#if defined(HEX_CODEC_SSE2) || defined(HEX_CODEC_NEON)
+    for (; n >= 16; n -= 16, in += 16, out += 32)
+        hex_encode_16 (in, out);
+#endif
+    out = hex_encode_scalar (in, out, n);
+    *out = '\0';
+}
+
+/* Decodes 2 * @n chars of @in. Returns -1 if any of them is not hex. */
+static inline int
+hex_codec_decode (const char *in, unsigned char *out, int n)
+{
+#if defined(HEX_CODEC_SSE2) || defined(HEX_CODEC_NEON)
+    for (; n >= 16; n -= 16, in += 32, out += 16) {
+        /* Don't read past the end of a string that's too short. */
+        if (memchr (in, '\0', 32) != NULL)
+            return -1;
+        if (hex_decode_32 (in, out) < 0)
+            return -1;
+    }
+#endif
+    return hex_decode_scalar (in, out, n);
+}
+
+#endif
@@ -114,6 +114,20 @@ public class SharedRepo : Object {
     public int group_id { get; set; } // used when shared to group
 
     public int last_modified { get; set; }
+
+    // only set by the list_*_repos_paged style listings
+    public string owner { get; set; }
+    public string head_cmmt_id { get; set; }
+    public int64 size { get; set; }
+}
+
+// Returned by list_repo_summaries, without loading the head commits.
+public class RepoSummary : Object {
+
+    public string repo_id { get; set; }
+    public string head_cmmt_id { get; set; }
+    public int64 size { get; set; }
+    public string owner { get; set; }
 }
 
 public class DiffEntry : Object {
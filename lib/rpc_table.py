@@ -46,19 +46,24 @@ func_table = [
     [ "string", ["string", "string", "string", "string", "string"] ],
     [ "string", ["string", "string", "string", "string", "string", "string"] ],
     [ "string", ["string", "string", "string", "string", "string", "int"] ],
+    [ "string", ["string", "string", "string", "string", "string", "string", "string", "int"] ],
     [ "string", ["string", "string", "string", "string", "string", "string", "string", "string", "string"] ],
     [ "objlist", [] ],
     [ "objlist", ["int"] ],
     [ "objlist", ["int", "int"] ],
     [ "objlist", ["int", "string"] ],
     [ "objlist", ["int", "int", "int"] ],
+    [ "objlist", ["int", "int", "int", "int"] ],
+    [ "objlist", ["int", "string", "int", "int"] ],
     [ "objlist", ["string"] ],        
     [ "objlist", ["string", "int"] ],
     [ "objlist", ["string", "int", "int"] ],
+    [ "objlist", ["string", "int", "int", "int"] ],
     [ "objlist", ["string", "string"] ],        
     [ "objlist", ["string", "string", "string"] ],
     [ "objlist", ["string", "string", "int"] ],
     [ "objlist", ["string", "string", "int", "int"] ],
+    [ "objlist", ["string", "string", "string", "string", "int", "int"] ],
     [ "objlist", ["int", "string", "string", "int", "int"] ],
     [ "object", [] ],
     [ "object", ["int"] ],
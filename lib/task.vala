@@ -42,6 +42,27 @@ public class Task : Object {
 
 }
 
+public class CopyTask : Object {
+       public string task_id { get; set; }
+       public bool is_move { get; set; }
+       public int64 files { get; set; } // files linked so far
+       public int64 size { get; set; }
+       public bool finished { get; set; }
+       public bool successful { get; set; }
+       public string error_str { get; set; }
+}
+
+public class RestoreTask : Object {
+       public string task_id { get; set; }
+       public string repo_id { get; set; }
+       public int total { get; set; }
+       public int done { get; set; } // items applied so far
+       public bool canceled { get; set; }
+       public bool finished { get; set; }
+       public bool successful { get; set; }
+       public string error_str { get; set; }
+}
+
 public class CloneTask : Object {
        public string state { get; set; }
        public string error_str { get; set; }
@@ -3,6 +3,7 @@
 #include <config.h>
 
 #include "utils.h"
+#include "hex-codec.h"
 
 #ifdef WIN32
     #include <winsock2.h>
@@ -19,6 +20,16 @@
 #include <uuid/uuid.h>
 #endif
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -58,40 +69,13 @@ timeval_from_msec (uint64_t milliseconds)
 void
 rawdata_to_hex (const unsigned char *rawdata, char *hex_str, int n_bytes)
 {
-    static const char hex[] = "0123456789abcdef";
-    int i;
-
-    for (i = 0; i < n_bytes; i++) {
-        unsigned int val = *rawdata++;
-        *hex_str++ = hex[val >> 4];
-        *hex_str++ = hex[val & 0xf];
-    }
-    *hex_str = '\0';
-}
-
-static unsigned hexval(char c)
-{
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    return ~0;
+    hex_codec_encode (rawdata, hex_str, n_bytes);
 }
 
 int
 hex_to_rawdata (const char *hex_str, unsigned char *rawdata, int n_bytes)
 {
-    int i;
-    for (i = 0; i < n_bytes; i++) {
-        unsigned int val = (hexval(hex_str[0]) << 4) | hexval(hex_str[1]);
-        if (val & ~0xff)
-            return -1;
-        *rawdata++ = val;
-        hex_str += 2;
-    }
-    return 0;
+    return hex_codec_decode (hex_str, rawdata, n_bytes);
 }
 
 size_t
@@ -337,6 +321,101 @@ int copy_file (const char *dst, const char *src, int mode)
     return status;
 }
 
+/*
+ * Copy one file to another in the kernel, so that file systems that
+ * support it (btrfs, xfs, nfs 4.2) share the data extents.
+ */
+#if defined __linux__ && defined __NR_copy_file_range
+static int
+copy_file_range_fd (int ifd, int ofd)
+{
+    ssize_t n;
+
+    while (1) {
+        n = syscall (__NR_copy_file_range, ifd, NULL, ofd, NULL,
+                     1 << 30, 0);
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+    }
+}
+#endif
+
+ssize_t
+splice_fd (int in_fd, int out_fd, size_t len)
+{
+#if defined __linux__ && defined __NR_splice
+    /* 1 is SPLICE_F_MOVE, which is only a hint. */
+    return syscall (__NR_splice, in_fd, NULL, out_fd, NULL, len, 1);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+clone_file (const char *dst, const char *src, int mode)
+{
+    int ifd = -1, ofd = -1;
+    char buf[8192];
+    ssize_t n;
+
+#ifdef __APPLE__
+    /* clonefile() creates @dst itself, with the mode of @src. */
+    g_unlink (dst);
+    if (clonefile (src, dst, 0) == 0)
+        return chmod (dst, mode);
+#endif
+
+    ifd = g_open (src, O_RDONLY | O_BINARY, 0);
+    if (ifd < 0)
+        return -1;
+
+    ofd = g_open (dst, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode);
+    if (ofd < 0)
+        goto error;
+
+#ifdef __linux__
+#ifdef FICLONE
+    if (ioctl (ofd, FICLONE, ifd) == 0)
+        goto out;
+#endif
+#ifdef __NR_copy_file_range
+    if (copy_file_range_fd (ifd, ofd) == 0)
+        goto out;
+    /* Not supported across these file systems, start over. */
+    if (lseek (ifd, 0, SEEK_SET) < 0 || lseek (ofd, 0, SEEK_SET) < 0 ||
+        ftruncate (ofd, 0) < 0)
+        goto error;
+#endif
+#endif
+
+    while ((n = readn (ifd, buf, sizeof(buf))) > 0) {
+        if (writen (ofd, buf, n) != n)
+            goto error;
+    }
+    if (n < 0)
+        goto error;
+
+#if defined __linux__ && (defined FICLONE || defined __NR_copy_file_range)
+out:
+#endif
+    close (ifd);
+    if (close (ofd) < 0)
+        return -1;
+    return 0;
+
+error:
+    close (ifd);
+    if (ofd >= 0)
+        close (ofd);
+    return -1;
+}
+
 char*
 ccnet_expand_path (const char *src)
 {
@@ -136,6 +136,12 @@ ssize_t sendn(evutil_socket_t fd, const void *vptr, size_t n);
 
 int copy_fd (int ifd, int ofd);
 int copy_file (const char *dst, const char *src, int mode);
+/* Like copy_file(), but replaces @dst and shares the data with @src
+ * (reflink/clonefile) when the file system supports it. */
+int clone_file (const char *dst, const char *src, int mode);
+/* splice(2): move up to @len bytes between @in_fd and @out_fd, one of
+ * them a pipe, inside the kernel. Fails with ENOSYS where unsupported. */
+ssize_t splice_fd (int in_fd, int out_fd, size_t len);
 
 
 /* string utilities */
@@ -2,6 +2,9 @@
 
 #include "seafile-session.h"
 #include "seafile-error.h"
+#include "obj-store.h"
+#include "backend-stats.h"
+#include "metrics.h"
 
 #define SEAFILE_DOMAIN g_quark_from_string("MONITOR")
 
@@ -17,3 +20,48 @@ monitor_compute_repo_size (const char *repo_id, GError **error)
 
     return 0;
 }
+
+char *
+monitor_get_scheduler_stats (GError **error)
+{
+    SchedulerStats st;
+
+    scheduler_get_stats (seaf->scheduler, &st);
+
+    return g_strdup_printf ("queue_depth\t%d\nrunning\t%d\nworkers\t%d\n"
+                            "oldest_age\t%"G_GINT64_FORMAT"\n"
+                            "avg_lag\t%"G_GINT64_FORMAT"\n"
+                            "max_lag\t%"G_GINT64_FORMAT"\n"
+                            "scheduled\t%"G_GUINT64_FORMAT"\n"
+                            "coalesced\t%"G_GUINT64_FORMAT"\n"
+                            "done\t%"G_GUINT64_FORMAT"\n",
+                            st.queue_depth, st.running, st.workers,
+                            st.oldest_age, st.avg_lag, st.max_lag,
+                            st.n_scheduled, st.n_coalesced, st.n_done);
+}
+
+char *
+monitor_get_backend_stats (int reset, GError **error)
+{
+    GString *buf = g_string_new (NULL);
+
+    backend_stats_format (buf, "fs",
+                          seaf_obj_store_get_backend_stats (seaf->fs_mgr->obj_store),
+                          reset);
+    backend_stats_format (buf, "commits",
+                          seaf_obj_store_get_backend_stats (seaf->commit_mgr->obj_store),
+                          reset);
+    backend_stats_format (buf, "blocks", seaf->block_mgr->stats, reset);
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+monitor_get_metrics (GError **error)
+{
+    GString *buf = g_string_new (NULL);
+
+    metrics_format (buf);
+
+    return g_string_free (buf, FALSE);
+}
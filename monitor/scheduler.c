@@ -1,5 +1,7 @@
 #include "common.h"
 
+#include <sys/stat.h>
+#include <time.h>
 #include <ccnet/timer.h>
 
 #include "seafile-session.h"
@@ -7,7 +9,25 @@
 
 typedef struct SchedulerPriv {
     GQueue *repo_size_job_queue;
+    /* repo_id -> queued job, so that a repo is queued only once. */
+    GHashTable *queued_jobs;
+    /* repo_id -> running job. */
+    GHashTable *running_jobs;
     int n_running_repo_size_jobs;
+    /* Jobs allowed to run at a time, between min_jobs and max_jobs. */
+    int n_workers;
+    int min_jobs;
+    int max_jobs;
+    /* repo_id -> number of incremental updates since the last full
+     * computation. Only used in the main thread. */
+    GHashTable *n_incremental;
+
+    /* Statistics. */
+    guint64 n_scheduled;
+    guint64 n_coalesced;
+    guint64 n_done;
+    gint64 avg_lag;             /* usec */
+    gint64 max_lag;
 
     CcnetTimer *sched_timer;
 } SchedulerPriv;
@@ -15,10 +35,34 @@ typedef struct SchedulerPriv {
 typedef struct RepoSizeJob {
     Scheduler *sched;
     char repo_id[37];
+    gint64 queued_time;
+    /* Another computation was requested while this one was running. */
+    gboolean rerun;
+    /* Compute the full size. Also set by the worker if it had to. */
+    gboolean full;
+    /* Set by the worker if it computed the size from the last one. */
+    gboolean incremental;
 } RepoSizeJob;
 
-#define SCHEDULER_INTV 10000    /* 10s */
-#define CONCURRENT_JOBS 5
+#define SCHEDULER_INTV 2000     /* 2s */
+#define DEFAULT_MIN_JOBS 2
+#define DEFAULT_MAX_JOBS 16
+/* More workers are started while the oldest queued job waited longer
+ * than this, and stopped while it waited less than the low mark. */
+#define QUEUE_AGE_HIGH (10 * G_USEC_PER_SEC)
+#define QUEUE_AGE_LOW  (2 * G_USEC_PER_SEC)
+
+/* Errors of the incremental updates can't add up longer than this. */
+#define MAX_INCREMENTAL_UPDATES 100
+
+static gint64
+now_usec ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
 
 static int
 schedule_pulse (void *vscheduler);
@@ -61,59 +105,169 @@ create_repo_stat_tables (SeafileSession *session)
     return 0;
 }
 
+static int
+get_config_int (GKeyFile *config, const char *key, int default_value)
+{
+    GError *error = NULL;
+    int value;
+
+    value = g_key_file_get_integer (config, "monitor", key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return default_value;
+    }
+    return value;
+}
+
 int
 scheduler_init (Scheduler *scheduler)
 {
+    SchedulerPriv *priv = scheduler->priv;
+
     if (create_repo_stat_tables (scheduler->seaf) < 0) {
         g_warning ("[scheduler] failed to create stat tables.\n");
         return -1;
     }
 
-    scheduler->priv->repo_size_job_queue = g_queue_new ();
-    scheduler->priv->sched_timer = ccnet_timer_new (schedule_pulse,
-                                              scheduler,
-                                              SCHEDULER_INTV);
+    priv->min_jobs = get_config_int (scheduler->seaf->config,
+                                     "min_size_jobs", DEFAULT_MIN_JOBS);
+    priv->max_jobs = get_config_int (scheduler->seaf->config,
+                                     "max_size_jobs", DEFAULT_MAX_JOBS);
+    if (priv->min_jobs < 1)
+        priv->min_jobs = 1;
+    if (priv->max_jobs < priv->min_jobs)
+        priv->max_jobs = priv->min_jobs;
+    priv->n_workers = priv->min_jobs;
+
+    priv->repo_size_job_queue = g_queue_new ();
+    priv->queued_jobs = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->running_jobs = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->n_incremental = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+    priv->sched_timer = ccnet_timer_new (schedule_pulse,
+                                         scheduler,
+                                         SCHEDULER_INTV);
 
     return 0;
 }
 
-void
-schedule_repo_size_computation (Scheduler *scheduler, const char *repo_id)
-{
-    RepoSizeJob *job = g_new0(RepoSizeJob, 1);
-
-    job->sched = scheduler;
-    memcpy (job->repo_id, repo_id, 37);
-
-    g_queue_push_tail (scheduler->priv->repo_size_job_queue, job);
-}
-
-static int
-schedule_pulse (void *vscheduler)
+static void
+start_jobs (Scheduler *sched)
 {
-    Scheduler *sched = vscheduler;
+    SchedulerPriv *priv = sched->priv;
     RepoSizeJob *job;
+    int n;
 
-    while (sched->priv->n_running_repo_size_jobs < CONCURRENT_JOBS) {
-        job = (RepoSizeJob *)g_queue_pop_head (sched->priv->repo_size_job_queue);
+    while (priv->n_running_repo_size_jobs < priv->n_workers) {
+        job = (RepoSizeJob *)g_queue_pop_head (priv->repo_size_job_queue);
         if (!job)
             break;
 
+        n = GPOINTER_TO_INT (g_hash_table_lookup (priv->n_incremental,
+                                                  job->repo_id));
+        job->full = (n >= MAX_INCREMENTAL_UPDATES);
+
         int ret = ccnet_job_manager_schedule_job (sched->seaf->job_mgr,
                                         compute_repo_size,
                                         compute_repo_size_done,
                                         job);
         if (ret < 0) {
             g_warning ("[scheduler] failed to start compute job.\n");
-            g_queue_push_head (sched->priv->repo_size_job_queue, job);
+            g_queue_push_head (priv->repo_size_job_queue, job);
             break;
         }
-        ++(sched->priv->n_running_repo_size_jobs);
+        g_hash_table_remove (priv->queued_jobs, job->repo_id);
+        g_hash_table_insert (priv->running_jobs, job->repo_id, job);
+        ++(priv->n_running_repo_size_jobs);
+    }
+}
+
+static void
+queue_job (Scheduler *sched, const char *repo_id)
+{
+    SchedulerPriv *priv = sched->priv;
+    RepoSizeJob *job = g_new0(RepoSizeJob, 1);
+
+    job->sched = sched;
+    memcpy (job->repo_id, repo_id, 37);
+    job->queued_time = now_usec ();
+
+    g_queue_push_tail (priv->repo_size_job_queue, job);
+    g_hash_table_insert (priv->queued_jobs, job->repo_id, job);
+}
+
+void
+schedule_repo_size_computation (Scheduler *scheduler, const char *repo_id)
+{
+    SchedulerPriv *priv = scheduler->priv;
+    RepoSizeJob *running;
+
+    ++priv->n_scheduled;
+
+    /* A job reads the head when it runs, so a queued job covers all the
+     * commits before it starts. A running one may have read an older
+     * head, it's run again when it's done. */
+    if (g_hash_table_lookup (priv->queued_jobs, repo_id)) {
+        ++priv->n_coalesced;
+        return;
+    }
+    running = g_hash_table_lookup (priv->running_jobs, repo_id);
+    if (running) {
+        if (running->rerun)
+            ++priv->n_coalesced;
+        running->rerun = TRUE;
+        return;
     }
 
+    queue_job (scheduler, repo_id);
+    start_jobs (scheduler);
+}
+
+static gint64
+oldest_queue_age (SchedulerPriv *priv)
+{
+    RepoSizeJob *job = g_queue_peek_head (priv->repo_size_job_queue);
+
+    if (!job)
+        return 0;
+    return now_usec () - job->queued_time;
+}
+
+static int
+schedule_pulse (void *vscheduler)
+{
+    Scheduler *sched = vscheduler;
+    SchedulerPriv *priv = sched->priv;
+    gint64 age = oldest_queue_age (priv);
+
+    /* Add workers while the queue falls behind, drop them when it's
+     * drained. Running jobs are never stopped. */
+    if (age > QUEUE_AGE_HIGH && priv->n_workers < priv->max_jobs)
+        ++priv->n_workers;
+    else if (age < QUEUE_AGE_LOW && priv->n_workers > priv->min_jobs)
+        --priv->n_workers;
+
+    start_jobs (sched);
+
     return 1;
 }
 
+void
+scheduler_get_stats (Scheduler *scheduler, SchedulerStats *st)
+{
+    SchedulerPriv *priv = scheduler->priv;
+
+    st->queue_depth = g_queue_get_length (priv->repo_size_job_queue);
+    st->running = priv->n_running_repo_size_jobs;
+    st->workers = priv->n_workers;
+    st->oldest_age = oldest_queue_age (priv);
+    st->avg_lag = priv->avg_lag;
+    st->max_lag = priv->max_lag;
+    st->n_scheduled = priv->n_scheduled;
+    st->n_coalesced = priv->n_coalesced;
+    st->n_done = priv->n_done;
+}
+
 static int
 set_repo_size (SeafDB *db, const char *repo_id, const char *head_id, guint64 size)
 {
@@ -129,14 +283,153 @@ set_repo_size (SeafDB *db, const char *repo_id, const char *head_id, guint64 siz
     return 0;
 }
 
-static char *
-get_cached_head_id (SeafDB *db, const char *repo_id)
+typedef struct CachedSize {
+    char *head_id;
+    gint64 size;
+} CachedSize;
+
+static gboolean
+get_cached_size_cb (SeafDBRow *row, void *data)
+{
+    CachedSize *cached = data;
+    const char *head_id = seaf_db_row_get_column_text (row, 0);
+
+    if (head_id)
+        cached->head_id = g_strdup (head_id);
+    cached->size = seaf_db_row_get_column_int64 (row, 1);
+
+    return FALSE;
+}
+
+static void
+get_cached_size (SeafDB *db, const char *repo_id, CachedSize *cached)
 {
     char sql[256];
 
-    snprintf (sql, sizeof(sql), "SELECT head_id FROM RepoSize WHERE repo_id='%s'",
+    snprintf (sql, sizeof(sql),
+              "SELECT head_id, size FROM RepoSize WHERE repo_id='%s'",
               repo_id);
-    return g_strdup(seaf_db_get_string (db, sql));
+    seaf_db_foreach_selected_row (db, sql, get_cached_size_cb, cached);
+}
+
+static gint64
+dirent_size (SeafFSManager *mgr, SeafDirent *dent)
+{
+    if (S_ISREG(dent->mode))
+        return seaf_fs_manager_get_file_size (mgr, dent->id);
+    if (S_ISDIR(dent->mode))
+        return seaf_fs_manager_get_fs_size (mgr, dent->id);
+    return 0;
+}
+
+/*
+ * Add the size of the tree @new_id minus the size of @old_id to @delta.
+ * Only the subtrees that differ are walked. Added and removed dirs
+ * use the memoized dir sizes.
+ */
+static int
+diff_tree_size (SeafFSManager *mgr, const char *old_id, const char *new_id,
+                gint64 *delta)
+{
+    SeafDir *old_dir = NULL, *new_dir = NULL;
+    GList *po, *pn;
+    SeafDirent *od, *nd;
+    gint64 size;
+    int cmp, ret = 0;
+
+    if (strcmp (old_id, new_id) == 0)
+        return 0;
+
+    old_dir = seaf_fs_manager_get_seafdir_sorted (mgr, old_id);
+    new_dir = seaf_fs_manager_get_seafdir_sorted (mgr, new_id);
+    if (!old_dir || !new_dir) {
+        ret = -1;
+        goto out;
+    }
+
+    /* Both entry lists are sorted by name in descending order. */
+    po = old_dir->entries;
+    pn = new_dir->entries;
+    while (po || pn) {
+        od = po ? po->data : NULL;
+        nd = pn ? pn->data : NULL;
+        if (!od)
+            cmp = -1;
+        else if (!nd)
+            cmp = 1;
+        else
+            cmp = strcmp (nd->name, od->name);
+
+        if (cmp > 0) {
+            /* Added. */
+            if ((size = dirent_size (mgr, nd)) < 0) {
+                ret = -1;
+                goto out;
+            }
+            *delta += size;
+            pn = pn->next;
+        } else if (cmp < 0) {
+            /* Removed. */
+            if ((size = dirent_size (mgr, od)) < 0) {
+                ret = -1;
+                goto out;
+            }
+            *delta -= size;
+            po = po->next;
+        } else {
+            if (strcmp (od->id, nd->id) == 0) {
+                /* Unchanged. */
+            } else if (S_ISDIR(od->mode) && S_ISDIR(nd->mode)) {
+                if (diff_tree_size (mgr, od->id, nd->id, delta) < 0) {
+                    ret = -1;
+                    goto out;
+                }
+            } else {
+                if ((size = dirent_size (mgr, nd)) < 0) {
+                    ret = -1;
+                    goto out;
+                }
+                *delta += size;
+                if ((size = dirent_size (mgr, od)) < 0) {
+                    ret = -1;
+                    goto out;
+                }
+                *delta -= size;
+            }
+            po = po->next;
+            pn = pn->next;
+        }
+    }
+
+out:
+    if (old_dir)
+        seaf_dir_free (old_dir);
+    if (new_dir)
+        seaf_dir_free (new_dir);
+    return ret;
+}
+
+/* Size of @head computed from the size of the cached head, -1 on error. */
+static gint64
+compute_size_incrementally (SeafileSession *seaf, CachedSize *cached,
+                            SeafCommit *head)
+{
+    SeafCommit *old_head;
+    gint64 delta = 0;
+    int ret;
+
+    old_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                               cached->head_id);
+    if (!old_head)
+        return -1;
+
+    ret = diff_tree_size (seaf->fs_mgr, old_head->root_id, head->root_id,
+                          &delta);
+    seaf_commit_unref (old_head);
+
+    if (ret < 0 || cached->size + delta < 0)
+        return -1;
+    return cached->size + delta;
 }
 
 static void*
@@ -146,11 +439,8 @@ compute_repo_size (void *vjob)
     Scheduler *sched = job->sched;
     SeafRepo *repo = NULL;
     SeafCommit *head = NULL;
-    char *cached_head_id = NULL;
-    BlockList *bl;
-    char *block_id;
-    BlockMetadata *bmd;
-    guint64 size = 0;
+    CachedSize cached = { NULL, 0 };
+    gint64 size = -1;
 
     repo = seaf_repo_manager_get_repo (sched->seaf->repo_mgr, job->repo_id);
     if (!repo) {
@@ -158,8 +448,8 @@ compute_repo_size (void *vjob)
         return vjob;
     }
 
-    cached_head_id = get_cached_head_id (sched->seaf->db, job->repo_id);
-    if (g_strcmp0 (cached_head_id, repo->head->commit_id) == 0)
+    get_cached_size (sched->seaf->db, job->repo_id, &cached);
+    if (g_strcmp0 (cached.head_id, repo->head->commit_id) == 0)
         goto out;
 
     head = seaf_commit_manager_get_commit (sched->seaf->commit_mgr,
@@ -170,27 +460,29 @@ compute_repo_size (void *vjob)
         goto out;
     }
 
-    /* Load block list first so that we don't need to count duplicate blocks.
-     * We only calculate the size of the head commit.
+    /* Diff against the head the stored size was computed for. Fall back
+     * to a full computation if there is none, or periodically to drop
+     * the errors that may have added up.
      */
-    bl = block_list_new ();
-    if (seaf_fs_manager_populate_blocklist (seaf->fs_mgr,
-                                            head->root_id,
-                                            bl) < 0) {
-        block_list_free (bl);
-        goto out;
+    if (cached.head_id && !job->full) {
+        size = compute_size_incrementally (sched->seaf, &cached, head);
+        if (size >= 0)
+            job->incremental = TRUE;
     }
 
-    int i;
-    for (i = 0; i < bl->n_blocks; ++i) {
-        block_id = g_ptr_array_index (bl->block_ids, i);
-        bmd = seaf_block_manager_stat_block (sched->seaf->block_mgr, block_id);
-        if (bmd) {
-            size += bmd->size;
-            g_free (bmd);
-        }
+    /* We only calculate the size of the head commit. The sizes of the
+     * dirs are memoized, so only the dirs changed since the last
+     * computation are walked.
+     */
+    if (size < 0) {
+        size = seaf_fs_manager_get_fs_size (sched->seaf->fs_mgr, head->root_id);
+        job->full = TRUE;
+    }
+    if (size < 0) {
+        g_warning ("[scheduler] failed to compute size of repo %s.\n",
+                   job->repo_id);
+        goto out;
     }
-    block_list_free (bl);
 
     if (set_repo_size (sched->seaf->db,
                        job->repo_id,
@@ -201,7 +493,7 @@ compute_repo_size (void *vjob)
 out:
     seaf_repo_unref (repo);
     seaf_commit_unref (head);
-    g_free (cached_head_id);
+    g_free (cached.head_id);
 
     return vjob;
 }
@@ -210,6 +502,31 @@ static void
 compute_repo_size_done (void *vjob)
 {
     RepoSizeJob *job = vjob;
-    --(job->sched->priv->n_running_repo_size_jobs);
+    Scheduler *sched = job->sched;
+    SchedulerPriv *priv = sched->priv;
+    gint64 lag;
+    int n;
+
+    if (job->incremental) {
+        n = GPOINTER_TO_INT (g_hash_table_lookup (priv->n_incremental,
+                                                  job->repo_id));
+        g_hash_table_replace (priv->n_incremental, g_strdup (job->repo_id),
+                              GINT_TO_POINTER (n + 1));
+    } else if (job->full)
+        g_hash_table_remove (priv->n_incremental, job->repo_id);
+
+    /* Time from the request to the stored size. */
+    lag = now_usec () - job->queued_time;
+    priv->avg_lag = priv->n_done ? (priv->avg_lag * 7 + lag) / 8 : lag;
+    priv->max_lag = MAX (priv->max_lag, lag);
+    ++priv->n_done;
+
+    g_hash_table_remove (priv->running_jobs, job->repo_id);
+    --(priv->n_running_repo_size_jobs);
+
+    if (job->rerun)
+        queue_job (sched, job->repo_id);
     g_free (job);
+
+    start_jobs (sched);
 }
@@ -17,7 +17,28 @@ scheduler_new (struct _SeafileSession *session);
 int
 scheduler_init (Scheduler *scheduler);
 
+/*
+ * Requests to compute the size of a repo are coalesced: a repo is queued
+ * at most once, and its size is computed for the head at the time the
+ * job runs.
+ */
 void
 schedule_repo_size_computation (Scheduler *scheduler, const char *repo_id);
 
+typedef struct SchedulerStats {
+    int queue_depth;
+    int running;
+    int workers;
+    /* In usec. */
+    gint64 oldest_age;
+    gint64 avg_lag;
+    gint64 max_lag;
+    guint64 n_scheduled;
+    guint64 n_coalesced;
+    guint64 n_done;
+} SchedulerStats;
+
+void
+scheduler_get_stats (Scheduler *scheduler, SchedulerStats *st);
+
 #endif
@@ -20,6 +20,7 @@
 #include <ccnet/rpcserver-proc.h>
 #include "log.h"
 #include "utils.h"
+#include "seaf-utils.h"
 
 /* #include "processors/heartbeat-proc.h" */
 /* #include "processors/repostat-proc.h" */
@@ -68,6 +69,18 @@ static void start_rpc_service (CcnetClient *client)
                                      monitor_compute_repo_size,
                                      "compute_repo_size",
                                      searpc_signature_int__string());
+    searpc_server_register_function ("monitor-rpcserver",
+                                     monitor_get_backend_stats,
+                                     "monitor_get_backend_stats",
+                                     searpc_signature_string__int());
+    searpc_server_register_function ("monitor-rpcserver",
+                                     monitor_get_scheduler_stats,
+                                     "monitor_get_scheduler_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("monitor-rpcserver",
+                                     monitor_get_metrics,
+                                     "monitor_get_metrics",
+                                     searpc_signature_string__void());
 }
 
 static void
@@ -202,6 +215,7 @@ main (int argc, char **argv)
         fprintf (stderr, "Failed to init seafile monitor.\n");
         exit (1);
     }
+    seaf_add_session_metrics (seaf);
 
     if (seafile_log_init (logfile, ccnet_debug_level_str,
                           monitor_debug_level_str) < 0) {
@@ -224,6 +238,8 @@ main (int argc, char **argv)
     }
     atexit (on_seaf_mon_exit);
 
+    seaf_notify_ready ();
+
     ccnet_main (client);
 
     return 0;
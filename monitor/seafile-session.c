@@ -118,6 +118,23 @@ seafile_session_init (SeafileSession *session)
     return 0;
 }
 
+static void
+on_server_event (const char *content, void *vsession)
+{
+    SeafileSession *session = vsession;
+    char **parts;
+
+    /* "repo-update\t<repo_id>\t<commit_id>" */
+    parts = g_strsplit (content, "\t", 3);
+    if (g_strv_length (parts) == 3 && strcmp (parts[0], "repo-update") == 0) {
+        seaf_branch_manager_invalidate_cache (session->branch_mgr, parts[1]);
+        /* The scheduler coalesces the updates of a repo. seaf-server
+         * doesn't call compute_repo_size for a local monitor. */
+        schedule_repo_size_computation (session->scheduler, parts[1]);
+    }
+    g_strfreev (parts);
+}
+
 int
 seafile_session_start (SeafileSession *session)
 {
@@ -126,6 +143,12 @@ seafile_session_start (SeafileSession *session)
         return -1;
     }
 
+    /* Cached branch heads are invalidated by the updates of seaf-server,
+     * and don't need to expire. */
+    if (seaf_mq_manager_subscribe_event (session->mq_mgr,
+                                         on_server_event, session) == 0)
+        seaf_branch_manager_set_cache_ttl (session->branch_mgr, 0);
+
     /* refresh on restart. */
     refresh_all_repo_sizes (session);
 
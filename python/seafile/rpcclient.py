@@ -1,5 +1,6 @@
 
 import ccnet
+import json
 from pysearpc import searpc_func, SearpcError
 
 class SeafileRpcClient(ccnet.RpcClientBase):
@@ -150,6 +151,21 @@ class SeafileRpcClient(ccnet.RpcClientBase):
         pass
     get_repo_sync_info = seafile_get_repo_sync_info
 
+    @searpc_func("string", [])
+    def seafile_get_sync_traces():
+        pass
+    get_sync_traces = seafile_get_sync_traces
+
+    @searpc_func("string", [])
+    def seafile_get_transfer_stats():
+        pass
+    get_transfer_stats = seafile_get_transfer_stats
+
+    @searpc_func("string", ["string"])
+    def seafile_get_transfer_history(id):
+        pass
+    get_transfer_history = seafile_get_transfer_history
+
 
     ###### Property Management #########
 
@@ -168,6 +184,16 @@ class SeafileRpcClient(ccnet.RpcClientBase):
         pass
     get_repo_property = seafile_get_repo_property
 
+    @searpc_func("int", ["string", "string"])
+    def seafile_set_repo_sparse_paths(repo_id, paths):
+        pass
+    set_repo_sparse_paths = seafile_set_repo_sparse_paths
+
+    @searpc_func("int", ["string", "string"])
+    def seafile_hydrate_file(repo_id, path):
+        pass
+    hydrate_file = seafile_hydrate_file
+
     @searpc_func("int", ["string", "string"])
     def seafile_set_repo_token(repo_id, token):
         pass
@@ -227,6 +253,21 @@ class MonitorRpcClient(ccnet.RpcClientBase):
         pass
     get_repos_size = monitor_get_repos_size
 
+    @searpc_func("string", ["int"])
+    def monitor_get_backend_stats(reset):
+        pass
+    get_backend_stats = monitor_get_backend_stats
+
+    @searpc_func("string", [])
+    def monitor_get_scheduler_stats():
+        pass
+    get_scheduler_stats = monitor_get_scheduler_stats
+
+    @searpc_func("string", [])
+    def monitor_get_metrics():
+        pass
+    get_metrics = monitor_get_metrics
+
 
 class SeafServerRpcClient(ccnet.RpcClientBase):
 
@@ -256,6 +297,56 @@ class SeafServerRpcClient(ccnet.RpcClientBase):
         pass
     gc_get_progress = seafile_gc_get_progress
 
+    @searpc_func("string", [])
+    def seafile_get_obj_store_stats():
+        pass
+    get_obj_store_stats = seafile_get_obj_store_stats
+
+    @searpc_func("string", [])
+    def seafile_get_fs_cache_stats():
+        pass
+    get_fs_cache_stats = seafile_get_fs_cache_stats
+
+    @searpc_func("string", [])
+    def seafile_get_commit_cache_stats():
+        pass
+    get_commit_cache_stats = seafile_get_commit_cache_stats
+
+    @searpc_func("string", [])
+    def seafile_get_exists_filter_stats():
+        pass
+    get_exists_filter_stats = seafile_get_exists_filter_stats
+
+    @searpc_func("string", ["int"])
+    def seafile_get_backend_stats(reset):
+        pass
+    get_backend_stats = seafile_get_backend_stats
+
+    @searpc_func("string", ["int"])
+    def seafile_get_db_stats(reset):
+        pass
+    get_db_stats = seafile_get_db_stats
+
+    @searpc_func("string", ["int"])
+    def seafile_get_db_query_stats(reset):
+        pass
+    get_db_query_stats = seafile_get_db_query_stats
+
+    @searpc_func("string", [])
+    def seafile_get_gc_stats():
+        pass
+    get_gc_stats = seafile_get_gc_stats
+
+    @searpc_func("string", [])
+    def seafile_get_rpc_stats():
+        pass
+    get_rpc_stats = seafile_get_rpc_stats
+
+    @searpc_func("string", [])
+    def seafile_get_metrics():
+        pass
+    get_metrics = seafile_get_metrics
+
     # password management
     @searpc_func("int", ["string", "string"])
     def seafile_is_passwd_set(repo_id, user):
@@ -289,6 +380,11 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def seafile_get_repo_list(start, limit):
         pass
     get_repo_list = seafile_get_repo_list
+
+    @searpc_func("objlist", ["string", "int"])
+    def seafile_list_repo_summaries(last_repo_id, limit):
+        pass
+    list_repo_summaries = seafile_list_repo_summaries
     
     @searpc_func("int", ["string", "string"])
     def seafile_is_repo_owner(user_id, repo_id):
@@ -309,6 +405,26 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def seafile_server_repo_size(repo_id):
         pass
     server_repo_size = seafile_server_repo_size
+
+    @searpc_func("int64", ["string"])
+    def seafile_get_repo_unique_size(repo_id):
+        pass
+    get_repo_unique_size = seafile_get_repo_unique_size
+
+    @searpc_func("int", ["string", "string"])
+    def seafile_set_repo_storage_class(repo_id, class_name):
+        pass
+    set_repo_storage_class = seafile_set_repo_storage_class
+
+    @searpc_func("int", ["int", "string"])
+    def seafile_set_org_storage_class(org_id, class_name):
+        pass
+    set_org_storage_class = seafile_set_org_storage_class
+
+    @searpc_func("string", ["string"])
+    def seafile_get_repo_storage_class(repo_id):
+        pass
+    get_repo_storage_class = seafile_get_repo_storage_class
     
     @searpc_func("int", ["string", "string"])
     def seafile_repo_set_access_property(repo_id, role):
@@ -355,6 +471,11 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
         pass
     del_file = seafile_del_file 
 
+    @searpc_func("int", ["string", "string", "string"])
+    def seafile_batch_edit(repo_id, ops_json, user):
+        pass
+    batch_edit = seafile_batch_edit
+
     @searpc_func("int", ["string", "string", "string", "string", "string", "string", "string"])
     def seafile_copy_file(src_repo, src_dir, src_filename, dst_repo, dst_dir, dst_filename, user):
         pass
@@ -365,6 +486,72 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
         pass
     move_file = seafile_move_file
 
+    @searpc_func("string", ["string", "string", "string", "string", "string", "string", "string", "int"])
+    def seafile_copy_file_async(src_repo, src_dir, src_filename, dst_repo, dst_dir, dst_filename, user, is_move):
+        pass
+    copy_file_async = seafile_copy_file_async
+
+    @searpc_func("object", ["string"])
+    def seafile_get_copy_task(task_id):
+        pass
+    get_copy_task = seafile_get_copy_task
+
+    @searpc_func("string", ["string", "string", "string"])
+    def seafile_restore_entries_async(repo_id, items_json, user):
+        pass
+    restore_entries_async = seafile_restore_entries_async
+
+    @searpc_func("object", ["string"])
+    def seafile_get_restore_task(task_id):
+        pass
+    get_restore_task = seafile_get_restore_task
+
+    @searpc_func("int", ["string"])
+    def seafile_cancel_restore_task(task_id):
+        pass
+    cancel_restore_task = seafile_cancel_restore_task
+
+    # web access tokens
+    @searpc_func("string", ["string", "string", "string", "string"])
+    def seafile_web_get_access_token(repo_id, obj_id, op, username):
+        pass
+    web_get_access_token = seafile_web_get_access_token
+
+    @searpc_func("string", ["string", "string", "string", "string"])
+    def seafile_web_get_access_tokens(repo_id, obj_ids_json, op, username):
+        pass
+
+    def web_get_access_tokens(self, repo_id, obj_ids, op, username):
+        """Returns the tokens of @obj_ids in the same order."""
+        return json.loads(self.seafile_web_get_access_tokens(
+            repo_id, json.dumps(obj_ids), op, username))
+
+    @searpc_func("object", ["string"])
+    def seafile_web_query_access_token(token):
+        pass
+    web_query_access_token = seafile_web_query_access_token
+
+    @searpc_func("string", ["string"])
+    def seafile_batch_call(calls_json):
+        pass
+
+    def batch_call(self, calls):
+        """Run several calls in one round trip.
+
+        @calls is a list of (function name, arg, ...) tuples, e.g.
+        [("seafile_get_repo", repo_id), ("get_repo_owner", repo_id)].
+        Returns their results in order. Objects are returned as dicts, and
+        a failed call as a SearpcError instead of raising it.
+        """
+        fcalls = [list(call) for call in calls]
+        results = []
+        for ret in json.loads(self.seafile_batch_call(json.dumps(fcalls))):
+            if 'err_code' in ret:
+                results.append(SearpcError(ret['err_msg']))
+            else:
+                results.append(ret.get('ret'))
+        return results
+
     @searpc_func("int", ["string", "string", "string", "string", "string"])
     def seafile_rename_file(repo_id, parent_dir, oldname, newname, user):
         pass
@@ -395,6 +582,11 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
         pass
     list_dir_by_path = seafile_list_dir_by_path
 
+    @searpc_func("objlist", ["string", "string", "string", "string", "int", "int"])
+    def seafile_list_dir_by_path_paged(commit_id, path, sort, cursor, offset, limit):
+        pass
+    list_dir_by_path_paged = seafile_list_dir_by_path_paged
+
     @searpc_func("string", ["string", "string"])
     def seafile_get_dirid_by_path(commit_id, path):
         pass
@@ -429,6 +621,10 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def get_deleted(repo_id):
         pass
 
+    @searpc_func("objlist", ["string", "int", "int", "int"])
+    def get_deleted_entries(repo_id, show_days, start, limit):
+        pass
+
     # share repo to user
     @searpc_func("string", ["string", "string", "string", "string"])
     def seafile_add_share(repo_id, from_email, to_email, permission):
@@ -445,6 +641,16 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
         pass
     list_org_share_repos = seafile_list_org_share_repos
 
+    @searpc_func("int", ["string", "string"])
+    def seafile_count_share_repos(email, query_col):
+        pass
+    count_share_repos = seafile_count_share_repos
+
+    @searpc_func("int", ["int", "string", "string"])
+    def seafile_count_org_share_repos(org_id, email, query_col):
+        pass
+    count_org_share_repos = seafile_count_org_share_repos
+
     @searpc_func("int", ["string", "string", "string"])
     def seafile_remove_share(repo_id, from_email, to_email):
         pass
@@ -479,6 +685,14 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def get_group_repos_by_owner(user_name):
         pass
 
+    @searpc_func("objlist", ["int", "int", "int"])
+    def list_group_repos(group_id, start, limit):
+        pass
+
+    @searpc_func("objlist", ["string", "int", "int"])
+    def list_group_repos_by_owner(user_name, start, limit):
+        pass
+
     @searpc_func("string", ["string"])
     def get_group_repo_owner(repo_id):
         pass
@@ -637,6 +851,14 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def get_org_group_repos_by_owner(org_id, user):
         pass
 
+    @searpc_func("objlist", ["int", "int", "int", "int"])
+    def list_org_group_repos(org_id, group_id, start, limit):
+        pass
+
+    @searpc_func("objlist", ["int", "string", "int", "int"])
+    def list_org_group_repos_by_owner(org_id, user, start, limit):
+        pass
+
     @searpc_func("string", ["int", "string"])
     def get_org_groups_by_repo(org_id, repo_id):
         pass
@@ -662,6 +884,10 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def list_inner_pub_repos_by_owner(user):
         pass
 
+    @searpc_func("objlist", ["int", "int"])
+    def list_inner_pub_repos_paged(start, limit):
+        pass
+
     @searpc_func("int", ["string"])
     def is_inner_pub_repo(repo_id):
         pass
@@ -682,3 +908,7 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     @searpc_func("objlist", ["int", "string"])
     def list_org_inner_pub_repos_by_owner(org_id, user):
         pass
+
+    @searpc_func("objlist", ["int", "int", "int"])
+    def list_org_inner_pub_repos_paged(org_id, start, limit):
+        pass
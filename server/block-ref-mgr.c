@@ -0,0 +1,786 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+#include "log.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "seaf-db.h"
+#include "block-ref-mgr.h"
+
+#include "utils.h"
+
+struct _SeafBlockRefManagerPriv {
+    /* Index updates are serialized, a repo's counts depend on the
+     * counts of the other repos. */
+    pthread_mutex_t update_lock;
+
+    GThreadPool     *update_pool;
+    pthread_mutex_t queue_lock;
+    GHashTable      *queued_repos;
+};
+
+static void update_worker (gpointer vrepo_id, gpointer vmgr);
+
+SeafBlockRefManager *
+seaf_block_ref_manager_new (struct _SeafileSession *session)
+{
+    SeafBlockRefManager *mgr = g_new0 (SeafBlockRefManager, 1);
+
+    mgr->session = session;
+    mgr->enabled = g_key_file_get_boolean (session->config,
+                                           "block_ref", "enabled", NULL);
+    mgr->priv = g_new0 (struct _SeafBlockRefManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->update_lock, NULL);
+    pthread_mutex_init (&mgr->priv->queue_lock, NULL);
+    mgr->priv->queued_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+
+    return mgr;
+}
+
+int
+seaf_block_ref_manager_init (SeafBlockRefManager *mgr)
+{
+    SeafDB *db = mgr->session->db;
+    const char *sql;
+
+    if (!mgr->enabled)
+        return 0;
+
+    /* The root each repo is indexed at, and its sizes. */
+    sql = "CREATE TABLE IF NOT EXISTS RepoBlockRefHead ("
+        "repo_id CHAR(37) PRIMARY KEY, root_id CHAR(41), "
+        "logical_size BIGINT, unique_size BIGINT)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    /* ref_count is the number of repos whose head uses the block.
+     * zero_time is when it last dropped to 0. */
+    if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL) {
+        sql = "CREATE TABLE IF NOT EXISTS BlockRef ("
+            "block_id CHAR(41) PRIMARY KEY, ref_count INTEGER, "
+            "size BIGINT, zero_time BIGINT, INDEX (ref_count, zero_time))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS RepoBlockRef ("
+            "repo_id CHAR(37), block_id CHAR(41), ref_count INTEGER, "
+            "PRIMARY KEY (repo_id, block_id), INDEX (block_id))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    } else {
+        sql = "CREATE TABLE IF NOT EXISTS BlockRef ("
+            "block_id CHAR(41) PRIMARY KEY, ref_count INTEGER, "
+            "size BIGINT, zero_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE INDEX IF NOT EXISTS blockref_zero_index ON "
+            "BlockRef (ref_count, zero_time)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS RepoBlockRef ("
+            "repo_id CHAR(37), block_id CHAR(41), ref_count INTEGER, "
+            "PRIMARY KEY (repo_id, block_id))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE INDEX IF NOT EXISTS repoblockref_block_index ON "
+            "RepoBlockRef (block_id)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static gboolean
+collect_id (SeafDBRow *row, void *data)
+{
+    GList **ids = data;
+
+    *ids = g_list_prepend (*ids,
+                           g_strdup (seaf_db_row_get_column_text (row, 0)));
+    return TRUE;
+}
+
+int
+seaf_block_ref_manager_start (SeafBlockRefManager *mgr)
+{
+    GList *ids = NULL, *ptr;
+
+    if (!mgr->enabled)
+        return 0;
+
+    mgr->priv->update_pool = g_thread_pool_new (update_worker, mgr,
+                                                1, FALSE, NULL);
+    if (!mgr->priv->update_pool) {
+        g_warning ("Failed to start block ref update thread.\n");
+        return -1;
+    }
+
+    /* Repos that are not indexed yet, and repos deleted while the index
+     * was off. */
+    if (seaf_db_foreach_selected_row (mgr->session->db,
+                                      "SELECT r.repo_id FROM Repo r "
+                                      "LEFT JOIN RepoBlockRefHead h "
+                                      "ON r.repo_id = h.repo_id "
+                                      "WHERE h.repo_id IS NULL",
+                                      collect_id, &ids) < 0 ||
+        seaf_db_foreach_selected_row (mgr->session->db,
+                                      "SELECT h.repo_id FROM RepoBlockRefHead h "
+                                      "LEFT JOIN Repo r "
+                                      "ON h.repo_id = r.repo_id "
+                                      "WHERE r.repo_id IS NULL",
+                                      collect_id, &ids) < 0) {
+        seaf_warning ("Failed to list repos to index block refs.\n");
+    }
+
+    for (ptr = ids; ptr; ptr = ptr->next)
+        seaf_block_ref_manager_repo_changed (mgr, ptr->data);
+    string_list_free (ids);
+
+    return 0;
+}
+
+/*
+ * Diff.
+ *
+ * The changes between two roots are collected as block id -> number of
+ * references added, negative if removed.
+ */
+
+static void
+add_delta (GHashTable *deltas, const char *block_id, int delta)
+{
+    int old = GPOINTER_TO_INT (g_hash_table_lookup (deltas, block_id));
+
+    g_hash_table_replace (deltas, g_strdup (block_id),
+                          GINT_TO_POINTER (old + delta));
+}
+
+static int
+count_file (const char *file_id, int sign, GHashTable *deltas)
+{
+    Seafile *file;
+    int i;
+
+    if (strcmp (file_id, EMPTY_SHA1) == 0)
+        return 0;
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!file) {
+        seaf_warning ("Failed to find file %s.\n", file_id);
+        return -1;
+    }
+
+    for (i = 0; i < file->n_blocks; ++i)
+        add_delta (deltas, file->blk_sha1s[i], sign);
+    seafile_unref (file);
+
+    return 0;
+}
+
+static int
+count_dent (SeafDirent *dent, int sign, GHashTable *deltas);
+
+/*
+ * Count the files of @new_id that are not in @old_id up, and the files of
+ * @old_id that are not in @new_id down. Either id can be NULL for an
+ * empty dir. Subdirs with the same id are skipped.
+ */
+static int
+diff_dirs (const char *old_id, const char *new_id, GHashTable *deltas)
+{
+    SeafDir *old_dir = NULL, *new_dir = NULL;
+    GHashTable *old_entries;
+    GHashTableIter iter;
+    gpointer value;
+    SeafDirent *dent, *odent;
+    GList *ptr;
+    int ret = 0;
+
+    if (old_id && strcmp (old_id, EMPTY_SHA1) == 0)
+        old_id = NULL;
+    if (new_id && strcmp (new_id, EMPTY_SHA1) == 0)
+        new_id = NULL;
+    if (g_strcmp0 (old_id, new_id) == 0)
+        return 0;
+
+    if (old_id) {
+        old_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, old_id);
+        if (!old_dir) {
+            seaf_warning ("Failed to find dir %s.\n", old_id);
+            return -1;
+        }
+    }
+    if (new_id) {
+        new_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, new_id);
+        if (!new_dir) {
+            seaf_warning ("Failed to find dir %s.\n", new_id);
+            ret = -1;
+            goto out;
+        }
+    }
+
+    old_entries = g_hash_table_new (g_str_hash, g_str_equal);
+    if (old_dir) {
+        for (ptr = old_dir->entries; ptr != NULL; ptr = ptr->next) {
+            odent = ptr->data;
+            g_hash_table_insert (old_entries, odent->name, odent);
+        }
+    }
+
+    for (ptr = new_dir ? new_dir->entries : NULL; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        odent = g_hash_table_lookup (old_entries, dent->name);
+        if (odent)
+            g_hash_table_remove (old_entries, dent->name);
+
+        if (odent && S_ISDIR(dent->mode) && S_ISDIR(odent->mode)) {
+            ret = diff_dirs (odent->id, dent->id, deltas);
+        } else if (odent && !S_ISDIR(dent->mode) && !S_ISDIR(odent->mode)) {
+            if (strcmp (odent->id, dent->id) == 0)
+                continue;
+            ret = count_file (odent->id, -1, deltas);
+            if (ret == 0)
+                ret = count_file (dent->id, 1, deltas);
+        } else {
+            if (odent)
+                ret = count_dent (odent, -1, deltas);
+            if (ret == 0)
+                ret = count_dent (dent, 1, deltas);
+        }
+        if (ret < 0)
+            goto done;
+    }
+
+    g_hash_table_iter_init (&iter, old_entries);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        if (count_dent (value, -1, deltas) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+done:
+    g_hash_table_destroy (old_entries);
+out:
+    if (old_dir)
+        seaf_dir_free (old_dir);
+    if (new_dir)
+        seaf_dir_free (new_dir);
+    return ret;
+}
+
+static int
+count_dent (SeafDirent *dent, int sign, GHashTable *deltas)
+{
+    if (!S_ISDIR(dent->mode))
+        return count_file (dent->id, sign, deltas);
+    if (sign > 0)
+        return diff_dirs (NULL, dent->id, deltas);
+    return diff_dirs (dent->id, NULL, deltas);
+}
+
+/*
+ * Counting.
+ */
+
+typedef struct {
+    gboolean found;
+    int ref_count;
+    gint64 size;
+} BlockRefRow;
+
+static gboolean
+get_block_ref_row (SeafDBRow *row, void *vdata)
+{
+    BlockRefRow *data = vdata;
+
+    data->found = TRUE;
+    data->ref_count = seaf_db_row_get_column_int (row, 0);
+    data->size = seaf_db_row_get_column_int64 (row, 1);
+    return FALSE;
+}
+
+static gboolean
+get_row_string (SeafDBRow *row, void *vdata)
+{
+    char **str = vdata;
+
+    *str = g_strdup (seaf_db_row_get_column_text (row, 0));
+    return FALSE;
+}
+
+/* Add @delta to the unique size of the other repo that uses @block_id. */
+static int
+update_other_holder (SeafDBTrans *trans,
+                     const char *repo_id,
+                     const char *block_id,
+                     gint64 delta)
+{
+    char *other = NULL;
+    int ret;
+
+    if (seaf_db_trans_statement_foreach_row (trans,
+                                             "SELECT repo_id FROM RepoBlockRef "
+                                             "WHERE block_id=? AND repo_id<>?",
+                                             get_row_string, &other,
+                                             2, "string", block_id,
+                                             "string", repo_id) < 0)
+        return -1;
+    if (!other)
+        return 0;
+
+    ret = seaf_db_trans_statement_query (trans,
+                                         "UPDATE RepoBlockRefHead SET "
+                                         "unique_size=unique_size+? "
+                                         "WHERE repo_id=?",
+                                         2, "int64", delta, "string", other);
+    g_free (other);
+    return ret;
+}
+
+static gint64
+get_block_size (const char *block_id)
+{
+    BlockMetadata *bmd;
+    gint64 size;
+
+    bmd = seaf_block_manager_stat_block (seaf->block_mgr, block_id);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s.\n", block_id);
+        return 0;
+    }
+    size = bmd->size;
+    g_free (bmd);
+
+    return size;
+}
+
+/* The head of @repo_id now uses @block_id. */
+static int
+add_repo_block (SeafDBTrans *trans,
+                const char *repo_id,
+                const char *block_id,
+                gint64 *logical_size,
+                gint64 *unique_size)
+{
+    BlockRefRow ref;
+
+    memset (&ref, 0, sizeof(ref));
+    if (seaf_db_trans_statement_foreach_row (trans,
+                                             "SELECT ref_count, size FROM "
+                                             "BlockRef WHERE block_id=?",
+                                             get_block_ref_row, &ref,
+                                             1, "string", block_id) < 0)
+        return -1;
+
+    if (!ref.found) {
+        ref.size = get_block_size (block_id);
+        if (seaf_db_trans_statement_query (trans,
+                                           "INSERT INTO BlockRef VALUES "
+                                           "(?, 1, ?, 0)",
+                                           2, "string", block_id,
+                                           "int64", ref.size) < 0)
+            return -1;
+    } else if (seaf_db_trans_statement_query (trans,
+                                              "UPDATE BlockRef SET "
+                                              "ref_count=ref_count+1 "
+                                              "WHERE block_id=?",
+                                              1, "string", block_id) < 0)
+        return -1;
+
+    *logical_size += ref.size;
+    if (ref.ref_count == 0)
+        *unique_size += ref.size;
+    else if (ref.ref_count == 1 &&
+             update_other_holder (trans, repo_id, block_id, -ref.size) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* The head of @repo_id no longer uses @block_id. */
+static int
+remove_repo_block (SeafDBTrans *trans,
+                   const char *repo_id,
+                   const char *block_id,
+                   gint64 *logical_size,
+                   gint64 *unique_size)
+{
+    BlockRefRow ref;
+
+    memset (&ref, 0, sizeof(ref));
+    if (seaf_db_trans_statement_foreach_row (trans,
+                                             "SELECT ref_count, size FROM "
+                                             "BlockRef WHERE block_id=?",
+                                             get_block_ref_row, &ref,
+                                             1, "string", block_id) < 0)
+        return -1;
+    if (!ref.found || ref.ref_count <= 0) {
+        seaf_warning ("Block %s of repo %.8s is not counted.\n",
+                      block_id, repo_id);
+        return 0;
+    }
+
+    *logical_size -= ref.size;
+    if (ref.ref_count == 1) {
+        *unique_size -= ref.size;
+        return seaf_db_trans_statement_query (trans,
+                                              "UPDATE BlockRef SET "
+                                              "ref_count=0, zero_time=? "
+                                              "WHERE block_id=?",
+                                              2, "int64", (gint64)time(NULL),
+                                              "string", block_id);
+    }
+
+    if (seaf_db_trans_statement_query (trans,
+                                       "UPDATE BlockRef SET "
+                                       "ref_count=ref_count-1 "
+                                       "WHERE block_id=?",
+                                       1, "string", block_id) < 0)
+        return -1;
+    if (ref.ref_count == 2)
+        return update_other_holder (trans, repo_id, block_id, ref.size);
+
+    return 0;
+}
+
+static gboolean
+get_int_column (SeafDBRow *row, void *vdata)
+{
+    int *value = vdata;
+
+    *value = seaf_db_row_get_column_int (row, 0);
+    return FALSE;
+}
+
+static int
+apply_deltas (SeafDBTrans *trans,
+              const char *repo_id,
+              GHashTable *deltas,
+              gint64 *logical_size,
+              gint64 *unique_size)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    const char *block_id;
+    int delta, count, new_count;
+
+    g_hash_table_iter_init (&iter, deltas);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        block_id = key;
+        delta = GPOINTER_TO_INT (value);
+        if (delta == 0)
+            continue;
+
+        count = 0;
+        if (seaf_db_trans_statement_foreach_row (trans,
+                                                 "SELECT ref_count FROM "
+                                                 "RepoBlockRef WHERE "
+                                                 "repo_id=? AND block_id=?",
+                                                 get_int_column, &count,
+                                                 2, "string", repo_id,
+                                                 "string", block_id) < 0)
+            return -1;
+
+        new_count = MAX (count + delta, 0);
+        if (new_count == count)
+            continue;
+
+        if (new_count == 0) {
+            if (seaf_db_trans_statement_query (trans,
+                                               "DELETE FROM RepoBlockRef WHERE "
+                                               "repo_id=? AND block_id=?",
+                                               2, "string", repo_id,
+                                               "string", block_id) < 0)
+                return -1;
+        } else if (seaf_db_trans_statement_query (trans,
+                                                  "REPLACE INTO RepoBlockRef "
+                                                  "VALUES (?, ?, ?)",
+                                                  3, "string", repo_id,
+                                                  "string", block_id,
+                                                  "int", new_count) < 0)
+            return -1;
+
+        if (count == 0 &&
+            add_repo_block (trans, repo_id, block_id,
+                            logical_size, unique_size) < 0)
+            return -1;
+        if (new_count == 0 &&
+            remove_repo_block (trans, repo_id, block_id,
+                               logical_size, unique_size) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Index update.
+ */
+
+typedef struct {
+    char *root_id;
+    gint64 logical_size;
+    gint64 unique_size;
+} IndexedHead;
+
+static gboolean
+get_indexed_head (SeafDBRow *row, void *vdata)
+{
+    IndexedHead *head = vdata;
+
+    head->root_id = g_strdup (seaf_db_row_get_column_text (row, 0));
+    head->logical_size = seaf_db_row_get_column_int64 (row, 1);
+    head->unique_size = seaf_db_row_get_column_int64 (row, 2);
+    return FALSE;
+}
+
+/* The root of the master branch, NULL if the repo is gone. */
+static int
+get_head_root (const char *repo_id, char **root_id)
+{
+    SeafBranch *branch;
+    SeafCommit *commit;
+
+    *root_id = NULL;
+
+    if (!seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id))
+        return 0;
+
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             repo_id, "master");
+    if (!branch)
+        return -1;
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             branch->commit_id);
+    seaf_branch_unref (branch);
+    if (!commit)
+        return -1;
+
+    *root_id = g_strdup (commit->root_id);
+    seaf_commit_unref (commit);
+    return 0;
+}
+
+static int
+update_index (SeafBlockRefManager *mgr, const char *repo_id)
+{
+    SeafDB *db = mgr->session->db;
+    IndexedHead head;
+    char *root_id = NULL;
+    GHashTable *deltas = NULL;
+    SeafDBTrans *trans;
+    int ret = 0;
+
+    memset (&head, 0, sizeof(head));
+
+    pthread_mutex_lock (&mgr->priv->update_lock);
+
+    if (seaf_db_statement_foreach_row (db,
+                                       "SELECT root_id, logical_size, "
+                                       "unique_size FROM RepoBlockRefHead "
+                                       "WHERE repo_id=?",
+                                       get_indexed_head, &head,
+                                       1, "string", repo_id) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (get_head_root (repo_id, &root_id) < 0) {
+        seaf_warning ("Failed to get head of repo %.8s.\n", repo_id);
+        ret = -1;
+        goto out;
+    }
+
+    if (!root_id && !head.root_id)
+        goto out;
+    if (root_id && g_strcmp0 (root_id, head.root_id) == 0)
+        goto out;
+
+    deltas = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    if (diff_dirs (head.root_id, root_id, deltas) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    trans = seaf_db_begin_transaction (db);
+    if (!trans) {
+        ret = -1;
+        goto out;
+    }
+
+    if (apply_deltas (trans, repo_id, deltas,
+                      &head.logical_size, &head.unique_size) < 0) {
+        seaf_db_rollback (trans);
+        ret = -1;
+        goto out;
+    }
+
+    if (root_id)
+        ret = seaf_db_trans_statement_query (trans,
+                                             "REPLACE INTO RepoBlockRefHead "
+                                             "VALUES (?, ?, ?, ?)",
+                                             4, "string", repo_id,
+                                             "string", root_id,
+                                             "int64", head.logical_size,
+                                             "int64", head.unique_size);
+    else
+        ret = seaf_db_trans_statement_query (trans,
+                                             "DELETE FROM RepoBlockRefHead "
+                                             "WHERE repo_id=?",
+                                             1, "string", repo_id);
+    if (ret < 0) {
+        seaf_db_rollback (trans);
+        goto out;
+    }
+    seaf_db_commit (trans);
+
+out:
+    pthread_mutex_unlock (&mgr->priv->update_lock);
+    if (ret < 0)
+        seaf_warning ("Failed to update block refs of repo %.8s.\n", repo_id);
+    if (deltas)
+        g_hash_table_destroy (deltas);
+    g_free (head.root_id);
+    g_free (root_id);
+    return ret;
+}
+
+static void
+update_worker (gpointer vrepo_id, gpointer vmgr)
+{
+    SeafBlockRefManager *mgr = vmgr;
+    char *repo_id = vrepo_id;
+
+    /* Later updates of the repo need another run. */
+    pthread_mutex_lock (&mgr->priv->queue_lock);
+    g_hash_table_remove (mgr->priv->queued_repos, repo_id);
+    pthread_mutex_unlock (&mgr->priv->queue_lock);
+
+    update_index (mgr, repo_id);
+
+    g_free (repo_id);
+}
+
+void
+seaf_block_ref_manager_repo_changed (SeafBlockRefManager *mgr,
+                                     const char *repo_id)
+{
+    gboolean queued;
+
+    if (!mgr->priv->update_pool)
+        return;
+
+    pthread_mutex_lock (&mgr->priv->queue_lock);
+    queued = (g_hash_table_lookup (mgr->priv->queued_repos, repo_id) != NULL);
+    if (!queued)
+        g_hash_table_insert (mgr->priv->queued_repos,
+                             g_strdup (repo_id), GINT_TO_POINTER(1));
+    pthread_mutex_unlock (&mgr->priv->queue_lock);
+
+    if (!queued)
+        g_thread_pool_push (mgr->priv->update_pool, g_strdup (repo_id), NULL);
+}
+
+/*
+ * Lookup.
+ */
+
+int
+seaf_block_ref_manager_get_repo_sizes (SeafBlockRefManager *mgr,
+                                       const char *repo_id,
+                                       gint64 *logical_size,
+                                       gint64 *unique_size)
+{
+    IndexedHead head;
+    int n;
+
+    if (!mgr->enabled)
+        return -1;
+
+    memset (&head, 0, sizeof(head));
+    n = seaf_db_statement_foreach_row (mgr->session->db,
+                                       "SELECT root_id, logical_size, "
+                                       "unique_size FROM RepoBlockRefHead "
+                                       "WHERE repo_id=?",
+                                       get_indexed_head, &head,
+                                       1, "string", repo_id);
+    g_free (head.root_id);
+    if (n <= 0)
+        return -1;
+
+    if (logical_size)
+        *logical_size = head.logical_size;
+    if (unique_size)
+        *unique_size = head.unique_size;
+    return 0;
+}
+
+int
+seaf_block_ref_manager_get_dedup_stats (SeafBlockRefManager *mgr,
+                                        gint64 *logical_size,
+                                        gint64 *stored_size)
+{
+    gint64 logical, stored;
+
+    if (!mgr->enabled)
+        return -1;
+
+    logical = seaf_db_get_int64 (mgr->session->db,
+                                 "SELECT SUM(logical_size) "
+                                 "FROM RepoBlockRefHead");
+    stored = seaf_db_get_int64 (mgr->session->db,
+                                "SELECT SUM(size) FROM BlockRef "
+                                "WHERE ref_count > 0");
+    if (logical < 0 || stored < 0)
+        return -1;
+
+    *logical_size = logical;
+    *stored_size = stored;
+    return 0;
+}
+
+GList *
+seaf_block_ref_manager_list_unreferenced (SeafBlockRefManager *mgr,
+                                          gint64 before,
+                                          int limit)
+{
+    GList *ids = NULL;
+
+    if (!mgr->enabled)
+        return NULL;
+
+    if (seaf_db_statement_foreach_row (mgr->session->db,
+                                       "SELECT block_id FROM BlockRef "
+                                       "WHERE ref_count=0 AND zero_time<? "
+                                       "ORDER BY zero_time LIMIT ?",
+                                       collect_id, &ids,
+                                       2, "int64", before,
+                                       "int", limit) < 0) {
+        string_list_free (ids);
+        return NULL;
+    }
+
+    return g_list_reverse (ids);
+}
+
+int
+seaf_block_ref_manager_forget_block (SeafBlockRefManager *mgr,
+                                     const char *block_id)
+{
+    if (!mgr->enabled)
+        return 0;
+
+    /* The block may be used by a head again since it was listed. */
+    return seaf_db_statement_query (mgr->session->db,
+                                    "DELETE FROM BlockRef "
+                                    "WHERE block_id=? AND ref_count=0",
+                                    1, "string", block_id);
+}
@@ -0,0 +1,93 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCK_REF_MGR_H
+#define BLOCK_REF_MGR_H
+
+#include <glib.h>
+
+/*
+ * Optional index of how many repo heads reference each block, enabled with
+ * "enabled = true" in the [block_ref] section of seafile.conf.
+ *
+ * For every repo the index keeps the blocks of its head and how many
+ * files of the head use each of them. When a branch is updated, the old
+ * and new head are diffed in a background thread and only the blocks of
+ * the changed files are counted up or down. From the counts it keeps:
+ *
+ * - the logical size of a repo, the bytes of the distinct blocks of its
+ *   head;
+ * - the unique size of a repo, the bytes of the blocks no other head
+ *   uses, i.e. what deleting the repo would free;
+ * - the stored size, the bytes of all blocks used by any head.
+ *
+ * Only heads are counted. Blocks that are only in the history of a repo
+ * are not in the index, so a block whose count dropped to 0 may still
+ * be used by an older commit. Those blocks are listed as candidates for
+ * seafserv-gc, they are never removed here.
+ *
+ * Repos that were never indexed are indexed in the background when the
+ * manager starts.
+ */
+
+struct _SeafileSession;
+struct _SeafBlockRefManagerPriv;
+
+struct _SeafBlockRefManager {
+    struct _SeafileSession *session;
+    gboolean enabled;
+    struct _SeafBlockRefManagerPriv *priv;
+};
+typedef struct _SeafBlockRefManager SeafBlockRefManager;
+
+SeafBlockRefManager *
+seaf_block_ref_manager_new (struct _SeafileSession *session);
+
+int
+seaf_block_ref_manager_init (SeafBlockRefManager *mgr);
+
+int
+seaf_block_ref_manager_start (SeafBlockRefManager *mgr);
+
+/*
+ * Count the blocks of the current head of @repo_id in the background.
+ * If the repo is gone, its blocks are counted down and its rows removed.
+ * Can be called from any thread.
+ */
+void
+seaf_block_ref_manager_repo_changed (SeafBlockRefManager *mgr,
+                                     const char *repo_id);
+
+/*
+ * Sizes of the head of @repo_id as of the last indexed head. Returns -1
+ * if the index is disabled or the repo isn't indexed yet.
+ */
+int
+seaf_block_ref_manager_get_repo_sizes (SeafBlockRefManager *mgr,
+                                       const char *repo_id,
+                                       gint64 *logical_size,
+                                       gint64 *unique_size);
+
+/*
+ * Sum of the logical sizes of all repos, and the bytes of the blocks
+ * they use. logical / stored is the dedup ratio.
+ */
+int
+seaf_block_ref_manager_get_dedup_stats (SeafBlockRefManager *mgr,
+                                        gint64 *logical_size,
+                                        gint64 *stored_size);
+
+/*
+ * Ids of up to @limit blocks that no head has used since before
+ * @before, oldest first.
+ */
+GList *
+seaf_block_ref_manager_list_unreferenced (SeafBlockRefManager *mgr,
+                                          gint64 before,
+                                          int limit);
+
+/* Drop the rows of blocks that seafserv-gc removed. */
+int
+seaf_block_ref_manager_forget_block (SeafBlockRefManager *mgr,
+                                     const char *block_id);
+
+#endif
@@ -4,12 +4,26 @@
 #include <string.h>
 
 #include <ccnet.h>
+#include <ccnet/timer.h>
 #include "seafile-session.h"
 #include "chunkserv-mgr.h"
 #include "processors/putcs-proc.h"
+#include "processors/getcsload-proc.h"
+#include "processors/putcsload-proc.h"
 
 #define CHUNKSERVER_DB "chunkserver.db"
 
+#define LOAD_INTERVAL 10        /* seconds */
+
+/* A chunk server is ejected after this many load requests failed in a
+ * row, or if most of its last transfers failed. */
+#define MAX_POLL_FAILURES 3
+#define MIN_DONE_FOR_ERRORS 5
+
+/* Servers with more than twice the transfers of the least loaded one,
+ * plus this, get no new clients until their load drops. */
+#define LOAD_SLACK 4
+
 SeafCSManager *
 seaf_cs_manager_new (SeafileSession *seaf)
 {
@@ -25,7 +39,7 @@ seaf_cs_manager_new (SeafileSession *seaf)
 
     mgr->seaf = seaf;
     mgr->chunk_servers = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                g_free, NULL);
+                                                g_free, g_free);
 
     return mgr;
 }
@@ -46,7 +60,8 @@ load_chunk_servers (SeafCSManager *mgr)
 
     while ((result = sqlite3_step (stmt)) == SQLITE_ROW) {
         cs_id = (char *) sqlite3_column_text (stmt, 0);
-        g_hash_table_insert (mgr->chunk_servers, g_strdup(cs_id), NULL);
+        g_hash_table_insert (mgr->chunk_servers, g_strdup(cs_id),
+                             g_new0 (ChunkServerLoad, 1));
     }
 
     if (result == SQLITE_ERROR) {
@@ -63,7 +78,7 @@ load_chunk_servers (SeafCSManager *mgr)
     /* Add myself as chunk server by default. */
     g_hash_table_insert (mgr->chunk_servers, 
                          g_strdup(mgr->seaf->session->base.id),
-                         NULL);
+                         g_new0 (ChunkServerLoad, 1));
 
     return 0;
 }
@@ -75,6 +90,87 @@ register_processors (SeafCSManager *mgr)
 
     ccnet_register_service (client, "seafile-putcs", "basic",
                             SEAFILE_TYPE_PUTCS_PROC, NULL);
+    ccnet_register_service (client, "seafile-putcsload", "basic",
+                            SEAFILE_TYPE_PUTCSLOAD_PROC, NULL);
+    ccnet_proc_factory_register_processor (client->proc_factory,
+                                           "seafile-getcsload",
+                                           SEAFILE_TYPE_GETCSLOAD_PROC);
+}
+
+static void
+load_done_cb (CcnetProcessor *processor, gboolean success, void *vmgr)
+{
+    SeafCSManager *mgr = vmgr;
+    ChunkServerLoad *load;
+
+    /* The server may have been deleted in the meantime. */
+    load = g_hash_table_lookup (mgr->chunk_servers, processor->peer_id);
+    if (!load)
+        return;
+
+    load->polling = FALSE;
+    if (!success)
+        ++load->n_poll_failures;
+}
+
+static void
+poll_load (SeafCSManager *mgr, const char *cs_id, ChunkServerLoad *load)
+{
+    CcnetProcessor *processor;
+
+    if (load->polling)
+        return;
+
+    if (!ccnet_peer_is_ready (mgr->seaf->ccnetrpc_client, cs_id)) {
+        ++load->n_poll_failures;
+        return;
+    }
+
+    processor = ccnet_proc_factory_create_remote_master_processor (
+        mgr->seaf->session->proc_factory, "seafile-getcsload", cs_id);
+    if (!processor) {
+        g_warning ("[cs mgr] failed to create getcsload proc.\n");
+        return;
+    }
+
+    if (ccnet_processor_startl (processor, NULL) < 0) {
+        g_warning ("[cs mgr] failed to start getcsload proc.\n");
+        return;
+    }
+
+    load->polling = TRUE;
+    g_signal_connect (processor, "done", (GCallback)load_done_cb, mgr);
+}
+
+/* Take my counters for the last interval, and ask the others theirs. */
+static int
+load_pulse (void *vmgr)
+{
+    SeafCSManager *mgr = vmgr;
+    const char *my_id = mgr->seaf->session->base.id;
+    GHashTableIter iter;
+    gpointer key, value;
+    ChunkServerLoad *load;
+    int n;
+
+    load = g_hash_table_lookup (mgr->chunk_servers, my_id);
+    if (load) {
+        n = g_atomic_int_get (&mgr->tx_kbytes);
+        g_atomic_int_add (&mgr->tx_kbytes, -n);
+        load->rate = n / LOAD_INTERVAL;
+        load->n_transfers = mgr->n_transfers;
+        load->n_done = mgr->n_done;
+        load->n_errors = mgr->n_errors;
+        mgr->n_done = mgr->n_errors = 0;
+    }
+
+    g_hash_table_iter_init (&iter, mgr->chunk_servers);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (strcmp ((char *)key, my_id) != 0)
+            poll_load (mgr, key, value);
+    }
+
+    return TRUE;
 }
 
 int
@@ -89,7 +185,12 @@ seaf_cs_manager_start (SeafCSManager *mgr)
     if (sqlite_query_exec (mgr->db, sql) < 0)
         return -1;
 
-    return (load_chunk_servers (mgr));
+    if (load_chunk_servers (mgr) < 0)
+        return -1;
+
+    mgr->load_timer = ccnet_timer_new (load_pulse, mgr, LOAD_INTERVAL * 1000);
+
+    return 0;
 }
 
 int
@@ -101,7 +202,8 @@ seaf_cs_manager_add_chunk_server (SeafCSManager *mgr, const char *cs_id)
     if (sqlite_query_exec (mgr->db, sql) < 0)
         return -1;
 
-    g_hash_table_insert (mgr->chunk_servers, g_strdup(cs_id), NULL);
+    g_hash_table_insert (mgr->chunk_servers, g_strdup(cs_id),
+                         g_new0 (ChunkServerLoad, 1));
 
     return 0;
 }
@@ -125,3 +227,111 @@ seaf_cs_manager_get_chunk_servers (SeafCSManager *mgr)
 {
     return (g_hash_table_get_keys(mgr->chunk_servers));
 }
+
+static gboolean
+cs_is_healthy (const ChunkServerLoad *load)
+{
+    if (load->n_poll_failures >= MAX_POLL_FAILURES)
+        return FALSE;
+    if (load->n_done >= MIN_DONE_FOR_ERRORS && load->n_errors * 2 > load->n_done)
+        return FALSE;
+    return TRUE;
+}
+
+static gint
+compare_cs_load (gconstpointer a, gconstpointer b, gpointer vmgr)
+{
+    SeafCSManager *mgr = vmgr;
+    const ChunkServerLoad *la = g_hash_table_lookup (mgr->chunk_servers, a);
+    const ChunkServerLoad *lb = g_hash_table_lookup (mgr->chunk_servers, b);
+
+    if (la->n_transfers != lb->n_transfers)
+        return la->n_transfers - lb->n_transfers;
+    return la->rate - lb->rate;
+}
+
+GList*
+seaf_cs_manager_get_usable_chunk_servers (SeafCSManager *mgr)
+{
+    GList *servers = NULL, *ptr, *next;
+    GHashTableIter iter;
+    gpointer key, value;
+    ChunkServerLoad *load;
+    int max_transfers;
+
+    g_hash_table_iter_init (&iter, mgr->chunk_servers);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (cs_is_healthy (value))
+            servers = g_list_prepend (servers, key);
+    }
+
+    if (!servers)
+        return g_list_prepend (NULL, mgr->seaf->session->base.id);
+
+    servers = g_list_sort_with_data (servers, compare_cs_load, mgr);
+
+    load = g_hash_table_lookup (mgr->chunk_servers, servers->data);
+    max_transfers = load->n_transfers * 2 + LOAD_SLACK;
+    for (ptr = servers->next; ptr; ptr = next) {
+        next = ptr->next;
+        load = g_hash_table_lookup (mgr->chunk_servers, ptr->data);
+        if (load->n_transfers > max_transfers)
+            servers = g_list_delete_link (servers, ptr);
+    }
+
+    return servers;
+}
+
+void
+seaf_cs_manager_transfer_started (SeafCSManager *mgr)
+{
+    ++mgr->n_transfers;
+}
+
+void
+seaf_cs_manager_transfer_done (SeafCSManager *mgr, gboolean success)
+{
+    --mgr->n_transfers;
+    ++mgr->n_done;
+    if (!success)
+        ++mgr->n_errors;
+}
+
+/* Called from the transfer threads too. Counted in KB, so that a busy
+ * interval doesn't overflow. */
+void
+seaf_cs_manager_add_tx_bytes (SeafCSManager *mgr, guint32 bytes)
+{
+    g_atomic_int_add (&mgr->tx_kbytes, (gint)((bytes + 512) >> 10));
+}
+
+void
+seaf_cs_manager_get_my_load (SeafCSManager *mgr, ChunkServerLoad *load)
+{
+    ChunkServerLoad *mine;
+
+    memset (load, 0, sizeof(ChunkServerLoad));
+
+    mine = g_hash_table_lookup (mgr->chunk_servers, mgr->seaf->session->base.id);
+    if (mine)
+        *load = *mine;
+    load->n_transfers = mgr->n_transfers;
+}
+
+void
+seaf_cs_manager_update_load (SeafCSManager *mgr,
+                             const char *cs_id,
+                             const ChunkServerLoad *load)
+{
+    ChunkServerLoad *old;
+
+    old = g_hash_table_lookup (mgr->chunk_servers, cs_id);
+    if (!old)
+        return;
+
+    old->n_transfers = load->n_transfers;
+    old->rate = load->rate;
+    old->n_done = load->n_done;
+    old->n_errors = load->n_errors;
+    old->n_poll_failures = 0;
+}
@@ -5,11 +5,30 @@
 #include <db.h>
 
 struct _SeafileSession;
+struct _CcnetTimer;
+
+/* Load of a chunk server, reported every few seconds. */
+typedef struct ChunkServerLoad {
+    int         n_transfers;    /* block transfers running */
+    int         rate;           /* KB/s over the last interval */
+    int         n_done;         /* transfers ended in the last interval */
+    int         n_errors;       /* of which failed */
+
+    int         n_poll_failures; /* load requests failed in a row */
+    gboolean    polling;
+} ChunkServerLoad;
 
 struct _SeafCSManager {
     struct _SeafileSession      *seaf;
-    GHashTable          *chunk_servers;
+    GHashTable          *chunk_servers; /* cs_id -> ChunkServerLoad */
     sqlite3             *db;
+
+    /* Transfers served by myself, since the last interval. */
+    gint                n_transfers;
+    gint                tx_kbytes;
+    gint                n_done;
+    gint                n_errors;
+    struct _CcnetTimer  *load_timer;
 };
 typedef struct _SeafCSManager SeafCSManager;
 
@@ -20,4 +39,25 @@ int             seaf_cs_manager_add_chunk_server (SeafCSManager *mgr, const char
 int             seaf_cs_manager_del_chunk_server (SeafCSManager *mgr, const char *cs_id);
 GList*          seaf_cs_manager_get_chunk_servers (SeafCSManager *mgr);
 
+/*
+ * The chunk servers to hand out to clients, least loaded first. Servers
+ * that stopped answering load requests or fail most of their transfers
+ * are left out, and so are those much busier than the least loaded one.
+ * Myself is returned if no server is left.
+ */
+GList*          seaf_cs_manager_get_usable_chunk_servers (SeafCSManager *mgr);
+
+/* Called by the block processors, to account my own load. */
+void            seaf_cs_manager_transfer_started (SeafCSManager *mgr);
+void            seaf_cs_manager_transfer_done (SeafCSManager *mgr, gboolean success);
+void            seaf_cs_manager_add_tx_bytes (SeafCSManager *mgr, guint32 bytes);
+
+/* My load over the last interval, with the transfers running now. */
+void            seaf_cs_manager_get_my_load (SeafCSManager *mgr,
+                                             ChunkServerLoad *load);
+
+void            seaf_cs_manager_update_load (SeafCSManager *mgr,
+                                             const char *cs_id,
+                                             const ChunkServerLoad *load);
+
 #endif
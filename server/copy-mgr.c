@@ -0,0 +1,348 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+#include "log.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "seafile-object.h"
+#include "seafile-error.h"
+#include "copy-mgr.h"
+
+#include "utils.h"
+
+#define COPY_WORKERS 4
+#define FINISHED_TASK_TTL 3600
+
+typedef struct CopyTask {
+    char        task_id[37];
+    char       *src_repo_id;
+    char       *src_path;
+    char       *src_filename;
+    char       *dst_repo_id;
+    char       *dst_path;
+    char       *dst_filename;
+    char       *user;
+    gboolean    is_move;
+
+    /* Progress, protected by the manager lock. */
+    gint64      files;
+    gint64      size;
+    gboolean    finished;
+    gboolean    successful;
+    char       *error_str;
+    gint64      finish_time;
+} CopyTask;
+
+struct _SeafCopyManagerPriv {
+    GThreadPool     *workers;
+
+    pthread_mutex_t lock;
+    GHashTable      *tasks;
+};
+
+static void copy_worker (gpointer vtask, gpointer vmgr);
+
+static void
+copy_task_free (CopyTask *task)
+{
+    g_free (task->src_repo_id);
+    g_free (task->src_path);
+    g_free (task->src_filename);
+    g_free (task->dst_repo_id);
+    g_free (task->dst_path);
+    g_free (task->dst_filename);
+    g_free (task->user);
+    g_free (task->error_str);
+    g_free (task);
+}
+
+SeafCopyManager *
+seaf_copy_manager_new (struct _SeafileSession *session)
+{
+    SeafCopyManager *mgr = g_new0 (SeafCopyManager, 1);
+
+    mgr->session = session;
+    mgr->priv = g_new0 (SeafCopyManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->lock, NULL);
+    mgr->priv->tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify)copy_task_free);
+
+    return mgr;
+}
+
+int
+seaf_copy_manager_start (SeafCopyManager *mgr)
+{
+    mgr->priv->workers = g_thread_pool_new (copy_worker, mgr,
+                                            COPY_WORKERS, FALSE, NULL);
+    if (!mgr->priv->workers) {
+        g_warning ("Failed to start copy threads.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static gboolean
+is_expired (gpointer key, gpointer value, gpointer now)
+{
+    CopyTask *task = value;
+
+    return (task->finished &&
+            *(gint64 *)now - task->finish_time > FINISHED_TASK_TTL);
+}
+
+char *
+seaf_copy_manager_add_task (SeafCopyManager *mgr,
+                            const char *src_repo_id,
+                            const char *src_path,
+                            const char *src_filename,
+                            const char *dst_repo_id,
+                            const char *dst_path,
+                            const char *dst_filename,
+                            const char *user,
+                            gboolean is_move,
+                            GError **error)
+{
+    SeafRepo *src_repo = NULL, *dst_repo = NULL;
+    CopyTask *task;
+    char *uuid;
+    gint64 now;
+
+    src_repo = seaf_repo_manager_get_repo (seaf->repo_mgr, src_repo_id);
+    dst_repo = seaf_repo_manager_get_repo (seaf->repo_mgr, dst_repo_id);
+    if (!src_repo || !dst_repo) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo");
+        goto error;
+    }
+
+    /* Fail early instead of in the worker. */
+    if (!seaf_repo_manager_can_share_objects (seaf->repo_mgr,
+                                              src_repo, dst_repo, user)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Can't copy files between repos with different keys");
+        goto error;
+    }
+
+    seaf_repo_unref (src_repo);
+    seaf_repo_unref (dst_repo);
+
+    task = g_new0 (CopyTask, 1);
+    uuid = gen_uuid ();
+    memcpy (task->task_id, uuid, 36);
+    g_free (uuid);
+    task->src_repo_id = g_strdup (src_repo_id);
+    task->src_path = g_strdup (src_path);
+    task->src_filename = g_strdup (src_filename);
+    task->dst_repo_id = g_strdup (dst_repo_id);
+    task->dst_path = g_strdup (dst_path);
+    task->dst_filename = g_strdup (dst_filename);
+    task->user = g_strdup (user);
+    task->is_move = is_move;
+
+    now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    g_hash_table_foreach_remove (mgr->priv->tasks, is_expired, &now);
+    g_hash_table_insert (mgr->priv->tasks, task->task_id, task);
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    g_thread_pool_push (mgr->priv->workers, task, NULL);
+
+    return g_strdup (task->task_id);
+
+error:
+    if (src_repo)
+        seaf_repo_unref (src_repo);
+    if (dst_repo)
+        seaf_repo_unref (dst_repo);
+    return NULL;
+}
+
+GObject *
+seaf_copy_manager_get_task (SeafCopyManager *mgr, const char *task_id)
+{
+    CopyTask *task;
+    GObject *ret = NULL;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    task = g_hash_table_lookup (mgr->priv->tasks, task_id);
+    if (task)
+        ret = g_object_new (SEAFILE_TYPE_COPY_TASK,
+                            "task_id", task->task_id,
+                            "is_move", task->is_move,
+                            "files", task->files,
+                            "size", task->size,
+                            "finished", task->finished,
+                            "successful", task->successful,
+                            "error_str", task->error_str,
+                            NULL);
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    return ret;
+}
+
+typedef struct {
+    SeafCopyManager *mgr;
+    CopyTask *task;
+} CountData;
+
+static gboolean
+count_file (SeafFSManager *fs_mgr, const char *obj_id, int type,
+            void *vdata, gboolean *stop)
+{
+    CountData *data = vdata;
+    gint64 size;
+
+    if (type != SEAF_METADATA_TYPE_FILE)
+        return TRUE;
+
+    size = seaf_fs_manager_get_file_size (fs_mgr, obj_id);
+    if (size < 0)
+        return FALSE;
+
+    pthread_mutex_lock (&data->mgr->priv->lock);
+    data->task->files++;
+    data->task->size += size;
+    pthread_mutex_unlock (&data->mgr->priv->lock);
+
+    return TRUE;
+}
+
+static char *
+get_canonical_path (const char *path)
+{
+    char *ret = g_strdup (path);
+    char *p;
+
+    for (p = ret; *p != 0; ++p) {
+        if (*p == '\\')
+            *p = '/';
+    }
+
+    return ret;
+}
+
+/* Count the files and bytes under the source, which are linked. */
+static int
+count_source (SeafCopyManager *mgr, CopyTask *task)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head = NULL;
+    SeafDir *dir = NULL;
+    SeafDirent *dent = NULL;
+    char *path;
+    GList *ptr;
+    CountData data;
+    int ret = -1;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, task->src_repo_id);
+    if (!repo)
+        goto out;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo->head->commit_id);
+    if (!head)
+        goto out;
+
+    path = get_canonical_path (task->src_path);
+    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, head->root_id,
+                                               path, NULL);
+    g_free (path);
+    if (!dir)
+        goto out;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        if (strcmp (((SeafDirent *)ptr->data)->name, task->src_filename) == 0) {
+            dent = ptr->data;
+            break;
+        }
+    }
+    if (!dent)
+        goto out;
+
+    data.mgr = mgr;
+    data.task = task;
+    if (S_ISDIR(dent->mode))
+        ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr, dent->id,
+                                             count_file, &data);
+    else
+        ret = count_file (seaf->fs_mgr, dent->id, SEAF_METADATA_TYPE_FILE,
+                          &data, NULL) ? 0 : -1;
+
+out:
+    if (repo)
+        seaf_repo_unref (repo);
+    if (head)
+        seaf_commit_unref (head);
+    if (dir)
+        seaf_dir_free (dir);
+    return ret;
+}
+
+static void
+finish_task (SeafCopyManager *mgr, CopyTask *task, const char *error_str)
+{
+    pthread_mutex_lock (&mgr->priv->lock);
+    task->finished = TRUE;
+    task->successful = (error_str == NULL);
+    task->error_str = g_strdup (error_str);
+    task->finish_time = (gint64)time(NULL);
+    pthread_mutex_unlock (&mgr->priv->lock);
+}
+
+static void
+copy_worker (gpointer vtask, gpointer vmgr)
+{
+    SeafCopyManager *mgr = vmgr;
+    CopyTask *task = vtask;
+    gboolean same_repo = (strcmp (task->src_repo_id, task->dst_repo_id) == 0);
+    GError *error = NULL;
+    int rc;
+
+    if (count_source (mgr, task) < 0) {
+        finish_task (mgr, task, "Source file does not exist");
+        return;
+    }
+
+    if (!same_repo &&
+        seaf_quota_manager_check_quota (seaf->quota_mgr,
+                                        task->dst_repo_id) < 0) {
+        finish_task (mgr, task, "Out of quota");
+        return;
+    }
+
+    if (task->is_move)
+        rc = seaf_repo_manager_move_file (seaf->repo_mgr,
+                                          task->src_repo_id, task->src_path,
+                                          task->src_filename,
+                                          task->dst_repo_id, task->dst_path,
+                                          task->dst_filename,
+                                          task->user, &error);
+    else
+        rc = seaf_repo_manager_copy_file (seaf->repo_mgr,
+                                          task->src_repo_id, task->src_path,
+                                          task->src_filename,
+                                          task->dst_repo_id, task->dst_path,
+                                          task->dst_filename,
+                                          task->user, &error);
+    if (rc < 0) {
+        finish_task (mgr, task, error ? error->message : "Internal error");
+        g_clear_error (&error);
+        return;
+    }
+
+    /* Until the monitor recomputes the repo sizes. */
+    if (!same_repo) {
+        seaf_quota_manager_add_usage (seaf->quota_mgr,
+                                      task->dst_repo_id, task->size);
+        if (task->is_move)
+            seaf_quota_manager_add_usage (seaf->quota_mgr,
+                                          task->src_repo_id, -task->size);
+    }
+
+    finish_task (mgr, task, NULL);
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_COPY_MGR_H
+#define SEAF_COPY_MGR_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+/*
+ * Copies and moves files and dirs between repos in the background.
+ *
+ * All repos keep their fs objects and blocks in the same stores, so a copy
+ * links the source dirent into the destination by id, without touching
+ * any data, however large the tree is. Encrypted repos can only share
+ * objects with repos encrypted with the same key, see
+ * seaf_repo_manager_can_share_objects().
+ *
+ * What still takes time for large trees is walking them to check the
+ * quota of the destination, so that runs in a worker thread. The caller
+ * gets a task id and polls the progress.
+ */
+
+typedef struct _SeafCopyManager        SeafCopyManager;
+typedef struct _SeafCopyManagerPriv    SeafCopyManagerPriv;
+
+struct _SeafileSession;
+
+struct _SeafCopyManager {
+    struct _SeafileSession *session;
+    SeafCopyManagerPriv    *priv;
+};
+
+SeafCopyManager *
+seaf_copy_manager_new (struct _SeafileSession *session);
+
+int
+seaf_copy_manager_start (SeafCopyManager *mgr);
+
+/* Returns the id of the new task, or NULL with @error set. */
+char *
+seaf_copy_manager_add_task (SeafCopyManager *mgr,
+                            const char *src_repo_id,
+                            const char *src_path,
+                            const char *src_filename,
+                            const char *dst_repo_id,
+                            const char *dst_path,
+                            const char *dst_filename,
+                            const char *user,
+                            gboolean is_move,
+                            GError **error);
+
+/*
+ * Returns a SeafileCopyTask, or NULL if @task_id is unknown. Finished
+ * tasks are kept for FINISHED_TASK_TTL seconds.
+ */
+GObject *
+seaf_copy_manager_get_task (SeafCopyManager *mgr, const char *task_id);
+
+#endif
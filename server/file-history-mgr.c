@@ -0,0 +1,843 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+#include "log.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "seaf-db.h"
+#include "commit-graph.h"
+#include "file-history-mgr.h"
+
+#include "utils.h"
+
+/* New rows are committed every this many commits, so that building the
+ * index of a long history doesn't hold a transaction for too long. */
+#define COMMITS_PER_TRANS 64
+
+struct _SeafFileHistoryManagerPriv {
+    /* Index updates are serialized. */
+    pthread_mutex_t update_lock;
+
+    GThreadPool     *update_pool;
+    pthread_mutex_t queue_lock;
+    GHashTable      *queued_repos;
+};
+
+static void update_worker (gpointer vrepo_id, gpointer vmgr);
+
+SeafFileHistoryManager *
+seaf_file_history_manager_new (struct _SeafileSession *session)
+{
+    SeafFileHistoryManager *mgr = g_new0 (SeafFileHistoryManager, 1);
+
+    mgr->session = session;
+    mgr->priv = g_new0 (struct _SeafFileHistoryManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->update_lock, NULL);
+    pthread_mutex_init (&mgr->priv->queue_lock, NULL);
+    mgr->priv->queued_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+
+    return mgr;
+}
+
+int
+seaf_file_history_manager_init (SeafFileHistoryManager *mgr)
+{
+    SeafDB *db = mgr->session->db;
+    const char *sql;
+    gboolean existed;
+
+    /* The commit each repo is indexed up to. */
+    sql = "CREATE TABLE IF NOT EXISTS FileHistoryHead ("
+        "repo_id CHAR(37) PRIMARY KEY, commit_id CHAR(41))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    /* Paths are stored as their sha1, so they don't need escaping. */
+    if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL) {
+        sql = "CREATE TABLE IF NOT EXISTS FileHistory ("
+            "repo_id CHAR(37), path_id CHAR(41), commit_id CHAR(41), "
+            "ctime BIGINT, INDEX (repo_id, path_id))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    } else {
+        sql = "CREATE TABLE IF NOT EXISTS FileHistory ("
+            "repo_id CHAR(37), path_id CHAR(41), commit_id CHAR(41), "
+            "ctime BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE INDEX IF NOT EXISTS filehistory_path_index ON "
+            "FileHistory (repo_id, path_id)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    }
+
+    if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL)
+        sql = "SHOW TABLES LIKE 'DeletedEntry'";
+    else
+        sql = "SELECT name FROM sqlite_master WHERE type='table' "
+            "AND name='DeletedEntry'";
+    existed = seaf_db_check_for_existence (db, sql);
+
+    /* Files and dirs removed by each commit, for the trash. Names are
+     * bound as statement parameters. */
+    if (seaf_db_type (db) == SEAF_DB_TYPE_MYSQL) {
+        sql = "CREATE TABLE IF NOT EXISTS DeletedEntry ("
+            "repo_id CHAR(37), path_id CHAR(41), commit_id CHAR(41), "
+            "obj_id CHAR(41), obj_name TEXT, basedir TEXT, mode INTEGER, "
+            "file_size BIGINT, delete_time BIGINT, "
+            "INDEX (repo_id, delete_time))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    } else {
+        sql = "CREATE TABLE IF NOT EXISTS DeletedEntry ("
+            "repo_id CHAR(37), path_id CHAR(41), commit_id CHAR(41), "
+            "obj_id CHAR(41), obj_name TEXT, basedir TEXT, mode INTEGER, "
+            "file_size BIGINT, delete_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE INDEX IF NOT EXISTS deletedentry_time_index ON "
+            "DeletedEntry (repo_id, delete_time)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    }
+
+    /* Indexes built before deleted entries were kept are rebuilt. */
+    if (!existed && seaf_db_query (db, "DELETE FROM FileHistoryHead") < 0)
+        return -1;
+
+    return 0;
+}
+
+int
+seaf_file_history_manager_start (SeafFileHistoryManager *mgr)
+{
+    mgr->priv->update_pool = g_thread_pool_new (update_worker, mgr,
+                                                1, FALSE, NULL);
+    if (!mgr->priv->update_pool) {
+        g_warning ("Failed to start file history update thread.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* "a//b/" and "/a/b" are both "a/b". */
+static char *
+normalize_path (const char *path)
+{
+    char **parts, **p;
+    GString *buf = g_string_new ("");
+
+    parts = g_strsplit (path, "/", 0);
+    for (p = parts; *p != NULL; ++p) {
+        if (**p == '\0')
+            continue;
+        if (buf->len > 0)
+            g_string_append_c (buf, '/');
+        g_string_append (buf, *p);
+    }
+    g_strfreev (parts);
+
+    return g_string_free (buf, FALSE);
+}
+
+static void
+path_to_id (const char *path, char *path_id)
+{
+    unsigned char sha1[20];
+
+    calculate_sha1 (sha1, path);
+    rawdata_to_hex (sha1, path_id, 20);
+}
+
+/*
+ * Diff.
+ */
+
+static GHashTable *
+dir_entries_by_name (SeafDir *dir)
+{
+    GHashTable *entries = g_hash_table_new (g_str_hash, g_str_equal);
+    SeafDirent *dent;
+    GList *ptr;
+
+    for (ptr = dir->entries; ptr != NULL; ptr = ptr->next) {
+        dent = ptr->data;
+        g_hash_table_insert (entries, dent->name, dent);
+    }
+
+    return entries;
+}
+
+/*
+ * Collect the files under @dir_id that differ from the same path in all
+ * of the parent dirs. A NULL parent id means the dir isn't in that
+ * parent. Subdirs that are the same as in one of the parents are skipped.
+ */
+static int
+collect_changed_files (const char *dir_id,
+                       const char **parent_ids,
+                       int n_parents,
+                       const char *base,
+                       GList **paths)
+{
+    SeafDir *dir = NULL;
+    SeafDir *parent_dirs[2] = { NULL, NULL };
+    GHashTable *parent_entries[2] = { NULL, NULL };
+    const char *child_parent_ids[2];
+    SeafDirent *dent, *pdent;
+    GList *ptr;
+    char *path;
+    int i, ret = 0;
+    gboolean changed;
+
+    for (i = 0; i < n_parents; ++i) {
+        if (parent_ids[i] && strcmp (parent_ids[i], dir_id) == 0)
+            return 0;
+    }
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        seaf_warning ("Failed to find dir %s.\n", dir_id);
+        return -1;
+    }
+
+    for (i = 0; i < n_parents; ++i) {
+        if (!parent_ids[i])
+            continue;
+        parent_dirs[i] = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                                      parent_ids[i]);
+        if (!parent_dirs[i]) {
+            seaf_warning ("Failed to find dir %s.\n", parent_ids[i]);
+            ret = -1;
+            goto out;
+        }
+        parent_entries[i] = dir_entries_by_name (parent_dirs[i]);
+    }
+
+    for (ptr = dir->entries; ptr != NULL; ptr = ptr->next) {
+        dent = ptr->data;
+        if (base[0] != '\0')
+            path = g_strconcat (base, "/", dent->name, NULL);
+        else
+            path = g_strdup (dent->name);
+
+        if (S_ISDIR(dent->mode)) {
+            for (i = 0; i < n_parents; ++i) {
+                pdent = NULL;
+                if (parent_entries[i])
+                    pdent = g_hash_table_lookup (parent_entries[i], dent->name);
+                if (pdent && S_ISDIR(pdent->mode))
+                    child_parent_ids[i] = pdent->id;
+                else
+                    child_parent_ids[i] = NULL;
+            }
+            ret = collect_changed_files (dent->id, child_parent_ids,
+                                         n_parents, path, paths);
+            g_free (path);
+            if (ret < 0)
+                goto out;
+            continue;
+        }
+
+        changed = TRUE;
+        for (i = 0; i < n_parents; ++i) {
+            pdent = NULL;
+            if (parent_entries[i])
+                pdent = g_hash_table_lookup (parent_entries[i], dent->name);
+            if (pdent && !S_ISDIR(pdent->mode) &&
+                strcmp (pdent->id, dent->id) == 0) {
+                changed = FALSE;
+                break;
+            }
+        }
+
+        if (changed)
+            *paths = g_list_prepend (*paths, path);
+        else
+            g_free (path);
+    }
+
+out:
+    for (i = 0; i < 2; ++i) {
+        if (parent_entries[i])
+            g_hash_table_destroy (parent_entries[i]);
+        if (parent_dirs[i])
+            seaf_dir_free (parent_dirs[i]);
+    }
+    seaf_dir_free (dir);
+
+    return ret;
+}
+
+static int
+add_deleted_entry (SeafDBTrans *trans,
+                   SeafCommit *commit,
+                   SeafCommit *parent,
+                   const char *base,
+                   SeafDirent *dent)
+{
+    char *path, *norm_path;
+    char path_id[41];
+    gint64 file_size = 0;
+    int ret;
+
+    if (S_ISREG(dent->mode)) {
+        file_size = seaf_fs_manager_get_file_size (seaf->fs_mgr, dent->id);
+        if (file_size < 0) {
+            seaf_warning ("Failed to find file %s.\n", dent->id);
+            return 0;
+        }
+    }
+
+    path = g_strconcat (base, dent->name, NULL);
+    norm_path = normalize_path (path);
+    path_to_id (norm_path, path_id);
+    g_free (norm_path);
+    g_free (path);
+
+    ret = seaf_db_trans_statement_query (trans,
+                                         "INSERT INTO DeletedEntry VALUES "
+                                         "(?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                                         9, "string", commit->repo_id,
+                                         "string", path_id,
+                                         "string", parent->commit_id,
+                                         "string", dent->id,
+                                         "string", dent->name,
+                                         "string", base,
+                                         "int", (int)dent->mode,
+                                         "int64", file_size,
+                                         "int64", (gint64)commit->ctime);
+    return ret;
+}
+
+/*
+ * Record the entries of @parent_dir_id that are not in @dir_id, or are
+ * there with another type, the same rule as the trash walk uses.
+ * @base is "/" or "/a/b/".
+ */
+static int
+collect_deleted_entries (SeafDBTrans *trans,
+                         SeafCommit *commit,
+                         SeafCommit *parent,
+                         const char *dir_id,
+                         const char *parent_dir_id,
+                         const char *base)
+{
+    SeafDir *dir = NULL, *parent_dir = NULL;
+    GHashTable *entries = NULL;
+    SeafDirent *dent, *pdent;
+    GList *ptr;
+    char *new_base;
+    int ret = 0;
+
+    if (strcmp (dir_id, parent_dir_id) == 0)
+        return 0;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        seaf_warning ("Failed to find dir %s.\n", dir_id);
+        return -1;
+    }
+    parent_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, parent_dir_id);
+    if (!parent_dir) {
+        seaf_warning ("Failed to find dir %s.\n", parent_dir_id);
+        ret = -1;
+        goto out;
+    }
+    entries = dir_entries_by_name (dir);
+
+    for (ptr = parent_dir->entries; ptr != NULL; ptr = ptr->next) {
+        pdent = ptr->data;
+        dent = g_hash_table_lookup (entries, pdent->name);
+
+        if (dent && (dent->mode & S_IFMT) == (pdent->mode & S_IFMT)) {
+            if (!S_ISDIR(dent->mode))
+                continue;
+            new_base = g_strconcat (base, dent->name, "/", NULL);
+            ret = collect_deleted_entries (trans, commit, parent,
+                                           dent->id, pdent->id, new_base);
+            g_free (new_base);
+        } else
+            ret = add_deleted_entry (trans, commit, parent, base, pdent);
+
+        if (ret < 0)
+            goto out;
+    }
+
+out:
+    if (entries)
+        g_hash_table_destroy (entries);
+    if (parent_dir)
+        seaf_dir_free (parent_dir);
+    seaf_dir_free (dir);
+    return ret;
+}
+
+static int
+index_commit (SeafDBTrans *trans, SeafCommit *commit)
+{
+    SeafCommit *parents[2] = { NULL, NULL };
+    const char *parent_roots[2];
+    int n_parents = 0;
+    GList *paths = NULL, *ptr;
+    char path_id[41];
+    SeafDBBatch *batch = NULL;
+    int i, ret = 0;
+
+    if (commit->parent_id)
+        parents[n_parents++] =
+            seaf_commit_manager_get_commit (seaf->commit_mgr, commit->parent_id);
+    if (commit->second_parent_id)
+        parents[n_parents++] =
+            seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                            commit->second_parent_id);
+
+    for (i = 0; i < n_parents; ++i) {
+        if (!parents[i]) {
+            seaf_warning ("Failed to load parent of commit %s.\n",
+                          commit->commit_id);
+            ret = -1;
+            goto out;
+        }
+        parent_roots[i] = parents[i]->root_id;
+    }
+
+    if (collect_changed_files (commit->root_id, parent_roots, n_parents,
+                               "", &paths) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    /* Sent as multi-row INSERTs. */
+    batch = seaf_db_batch_new ();
+    for (ptr = paths; ptr != NULL; ptr = ptr->next) {
+        path_to_id ((char *)ptr->data, path_id);
+        seaf_db_batch_add_row (batch, "INSERT INTO FileHistory VALUES",
+                               "('%s', '%s', '%s', %"G_GINT64_FORMAT")",
+                               commit->repo_id, path_id, commit->commit_id,
+                               (gint64)commit->ctime);
+    }
+    if (seaf_db_trans_batch_exec (trans, batch) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n_parents; ++i) {
+        if (collect_deleted_entries (trans, commit, parents[i],
+                                     commit->root_id, parents[i]->root_id,
+                                     "/") < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+out:
+    seaf_db_batch_free (batch);
+    string_list_free (paths);
+    for (i = 0; i < n_parents; ++i) {
+        if (parents[i])
+            seaf_commit_unref (parents[i]);
+    }
+    return ret;
+}
+
+/*
+ * Index update.
+ */
+
+static char *
+get_indexed_head (SeafFileHistoryManager *mgr, const char *repo_id)
+{
+    char sql[256];
+
+    snprintf (sql, sizeof(sql),
+              "SELECT commit_id FROM FileHistoryHead WHERE repo_id='%s'",
+              repo_id);
+    return seaf_db_get_string (mgr->session->db, sql);
+}
+
+/*
+ * Index the commits between @head_id and the indexed head, newest first.
+ * If the process stops half way, the same commits are indexed again next
+ * time, so lookups drop duplicate rows.
+ */
+static int
+update_index (SeafFileHistoryManager *mgr,
+              const char *repo_id,
+              const char *head_id)
+{
+    SeafDB *db = mgr->session->db;
+    CommitGraph *graph;
+    char *indexed = NULL;
+    GQueue queue = G_QUEUE_INIT;
+    GHashTable *visited;
+    SeafDBTrans *trans = NULL;
+    SeafCommit *commit;
+    char *id;
+    char sql[256];
+    int n_commits = 0, ret = 0;
+
+    graph = seaf_commit_manager_get_graph (seaf->commit_mgr, repo_id);
+    if (!graph)
+        return -1;
+
+    pthread_mutex_lock (&mgr->priv->update_lock);
+
+    indexed = get_indexed_head (mgr, repo_id);
+    if (g_strcmp0 (indexed, head_id) == 0)
+        goto out;
+
+    /* The branch was reset to a commit that isn't a descendant. */
+    if (indexed && commit_graph_is_ancestor (graph, indexed, head_id) != 1) {
+        seaf_message ("Rebuilding file history of repo %.8s.\n", repo_id);
+        g_free (indexed);
+        indexed = NULL;
+    }
+
+    /* Drop rows left by an unfinished build. */
+    if (!indexed) {
+        snprintf (sql, sizeof(sql),
+                  "DELETE FROM FileHistory WHERE repo_id='%s'", repo_id);
+        if (seaf_db_query (db, sql) < 0) {
+            ret = -1;
+            goto out;
+        }
+        snprintf (sql, sizeof(sql),
+                  "DELETE FROM DeletedEntry WHERE repo_id='%s'", repo_id);
+        if (seaf_db_query (db, sql) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    visited = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_queue_push_tail (&queue, g_strdup (head_id));
+
+    while ((id = g_queue_pop_head (&queue)) != NULL) {
+        if (g_hash_table_lookup (visited, id)) {
+            g_free (id);
+            continue;
+        }
+        g_hash_table_insert (visited, id, id);
+
+        if (indexed &&
+            (strcmp (id, indexed) == 0 ||
+             commit_graph_is_ancestor (graph, id, indexed) == 1))
+            continue;
+
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr, id);
+        if (!commit) {
+            seaf_warning ("Failed to load commit %s.\n", id);
+            ret = -1;
+            break;
+        }
+
+        if (!trans) {
+            trans = seaf_db_begin_transaction (db);
+            if (!trans) {
+                seaf_commit_unref (commit);
+                ret = -1;
+                break;
+            }
+        }
+
+        if (index_commit (trans, commit) < 0) {
+            seaf_warning ("Failed to index commit %s of repo %.8s.\n",
+                          id, repo_id);
+            seaf_commit_unref (commit);
+            ret = -1;
+            break;
+        }
+
+        if (commit->parent_id)
+            g_queue_push_tail (&queue, g_strdup (commit->parent_id));
+        if (commit->second_parent_id)
+            g_queue_push_tail (&queue, g_strdup (commit->second_parent_id));
+        seaf_commit_unref (commit);
+
+        if (++n_commits % COMMITS_PER_TRANS == 0) {
+            seaf_db_commit (trans);
+            trans = NULL;
+        }
+    }
+
+    while ((id = g_queue_pop_head (&queue)) != NULL)
+        g_free (id);
+    g_hash_table_destroy (visited);
+
+    if (ret < 0) {
+        if (trans)
+            seaf_db_rollback (trans);
+        goto out;
+    }
+    if (trans)
+        seaf_db_commit (trans);
+
+    snprintf (sql, sizeof(sql),
+              "REPLACE INTO FileHistoryHead VALUES ('%s', '%s')",
+              repo_id, head_id);
+    if (seaf_db_query (db, sql) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    /* Entries deleted before the kept history can't be restored. */
+    if (seaf->keep_history_days > 0) {
+        snprintf (sql, sizeof(sql),
+                  "DELETE FROM DeletedEntry WHERE repo_id='%s' AND "
+                  "delete_time < %"G_GINT64_FORMAT, repo_id,
+                  (gint64)time(NULL) - seaf->keep_history_days * 24 * 3600);
+        seaf_db_query (db, sql);
+    }
+
+out:
+    pthread_mutex_unlock (&mgr->priv->update_lock);
+    g_free (indexed);
+    return ret;
+}
+
+static void
+update_worker (gpointer vrepo_id, gpointer vmgr)
+{
+    SeafFileHistoryManager *mgr = vmgr;
+    char *repo_id = vrepo_id;
+    SeafBranch *branch;
+
+    /* Later updates of the repo need another run. */
+    pthread_mutex_lock (&mgr->priv->queue_lock);
+    g_hash_table_remove (mgr->priv->queued_repos, repo_id);
+    pthread_mutex_unlock (&mgr->priv->queue_lock);
+
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             repo_id, "master");
+    if (branch) {
+        update_index (mgr, repo_id, branch->commit_id);
+        seaf_branch_unref (branch);
+    }
+
+    g_free (repo_id);
+}
+
+void
+seaf_file_history_manager_queue_update (SeafFileHistoryManager *mgr,
+                                        const char *repo_id)
+{
+    gboolean queued;
+
+    if (!mgr->priv->update_pool)
+        return;
+
+    pthread_mutex_lock (&mgr->priv->queue_lock);
+    queued = (g_hash_table_lookup (mgr->priv->queued_repos, repo_id) != NULL);
+    if (!queued)
+        g_hash_table_insert (mgr->priv->queued_repos,
+                             g_strdup (repo_id), GINT_TO_POINTER(1));
+    pthread_mutex_unlock (&mgr->priv->queue_lock);
+
+    if (!queued)
+        g_thread_pool_push (mgr->priv->update_pool, g_strdup (repo_id), NULL);
+}
+
+/*
+ * Lookup.
+ */
+
+/* Catch the index up with @head_id if it's already built. */
+static int
+prepare_index (SeafFileHistoryManager *mgr,
+               const char *repo_id,
+               const char *head_id)
+{
+    char *indexed;
+    int rc;
+
+    /* Building the index of a long history takes a while, leave it to the
+     * update thread. */
+    indexed = get_indexed_head (mgr, repo_id);
+    if (!indexed) {
+        seaf_file_history_manager_queue_update (mgr, repo_id);
+        return -1;
+    }
+    rc = strcmp (indexed, head_id);
+    g_free (indexed);
+    if (rc != 0 && update_index (mgr, repo_id, head_id) < 0)
+        return -1;
+
+    return 0;
+}
+
+typedef struct {
+    GList *revisions;
+    GHashTable *seen;
+    gint64 truncate_time;
+} CollectRevisionsData;
+
+static gboolean
+collect_revision (SeafDBRow *row, void *vdata)
+{
+    CollectRevisionsData *data = vdata;
+    const char *commit_id;
+    gint64 ctime;
+
+    commit_id = seaf_db_row_get_column_text (row, 0);
+    ctime = seaf_db_row_get_column_int64 (row, 1);
+
+    /* At least return the latest revision. */
+    if (data->revisions != NULL) {
+        if (data->truncate_time == 0)
+            return FALSE;
+        if (data->truncate_time > 0 && ctime < data->truncate_time)
+            return FALSE;
+    }
+
+    if (g_hash_table_lookup (data->seen, commit_id))
+        return TRUE;
+    g_hash_table_insert (data->seen, g_strdup (commit_id), GINT_TO_POINTER(1));
+
+    data->revisions = g_list_prepend (data->revisions, g_strdup (commit_id));
+    return TRUE;
+}
+
+int
+seaf_file_history_manager_get_revisions (SeafFileHistoryManager *mgr,
+                                         const char *repo_id,
+                                         const char *head_id,
+                                         const char *path,
+                                         gint64 truncate_time,
+                                         GList **commit_ids)
+{
+    CollectRevisionsData data;
+    char *norm_path;
+    char path_id[41];
+    char sql[256];
+
+    *commit_ids = NULL;
+
+    if (prepare_index (mgr, repo_id, head_id) < 0)
+        return -1;
+
+    norm_path = normalize_path (path);
+    path_to_id (norm_path, path_id);
+    g_free (norm_path);
+
+    memset (&data, 0, sizeof(data));
+    data.seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data.truncate_time = truncate_time;
+
+    snprintf (sql, sizeof(sql),
+              "SELECT commit_id, ctime FROM FileHistory "
+              "WHERE repo_id='%s' AND path_id='%s' ORDER BY ctime DESC",
+              repo_id, path_id);
+    if (seaf_db_foreach_selected_row (mgr->session->db, sql,
+                                      collect_revision, &data) < 0) {
+        string_list_free (data.revisions);
+        g_hash_table_destroy (data.seen);
+        return -1;
+    }
+    g_hash_table_destroy (data.seen);
+
+    *commit_ids = g_list_reverse (data.revisions);
+    return 0;
+}
+
+typedef struct {
+    GList *entries;
+    GHashTable *seen;
+} CollectDeletedData;
+
+static gboolean
+collect_deleted_entry (SeafDBRow *row, void *vdata)
+{
+    CollectDeletedData *data = vdata;
+    const char *path_id;
+    SeafileDeletedEntry *entry;
+
+    /* Rows are latest first, keep the latest deletion of a path. */
+    path_id = seaf_db_row_get_column_text (row, 0);
+    if (g_hash_table_lookup (data->seen, path_id))
+        return TRUE;
+    g_hash_table_insert (data->seen, g_strdup (path_id), GINT_TO_POINTER(1));
+
+    entry = g_object_new (SEAFILE_TYPE_DELETED_ENTRY,
+                          "commit_id", seaf_db_row_get_column_text (row, 1),
+                          "obj_id", seaf_db_row_get_column_text (row, 2),
+                          "obj_name", seaf_db_row_get_column_text (row, 3),
+                          "basedir", seaf_db_row_get_column_text (row, 4),
+                          "mode", seaf_db_row_get_column_int (row, 5),
+                          "file_size", seaf_db_row_get_column_int64 (row, 6),
+                          "delete_time",
+                          (int)seaf_db_row_get_column_int64 (row, 7),
+                          NULL);
+    data->entries = g_list_prepend (data->entries, entry);
+
+    return TRUE;
+}
+
+int
+seaf_file_history_manager_get_deleted (SeafFileHistoryManager *mgr,
+                                       const char *repo_id,
+                                       const char *head_id,
+                                       gint64 since,
+                                       GList **entries)
+{
+    CollectDeletedData data;
+    GList *ptr;
+    int rc;
+
+    *entries = NULL;
+
+    if (prepare_index (mgr, repo_id, head_id) < 0)
+        return -1;
+
+    memset (&data, 0, sizeof(data));
+    data.seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    rc = seaf_db_statement_foreach_row (mgr->session->db,
+                                        "SELECT path_id, commit_id, obj_id, "
+                                        "obj_name, basedir, mode, file_size, "
+                                        "delete_time FROM DeletedEntry "
+                                        "WHERE repo_id=? AND delete_time>=? "
+                                        "ORDER BY delete_time DESC",
+                                        collect_deleted_entry, &data,
+                                        2, "string", repo_id,
+                                        "int64", since);
+    g_hash_table_destroy (data.seen);
+    if (rc < 0) {
+        for (ptr = data.entries; ptr; ptr = ptr->next)
+            g_object_unref (ptr->data);
+        g_list_free (data.entries);
+        return -1;
+    }
+
+    *entries = g_list_reverse (data.entries);
+    return 0;
+}
+
+void
+seaf_file_history_manager_remove_repo (SeafFileHistoryManager *mgr,
+                                       const char *repo_id)
+{
+    char sql[256];
+
+    pthread_mutex_lock (&mgr->priv->update_lock);
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM FileHistoryHead WHERE repo_id='%s'", repo_id);
+    seaf_db_query (mgr->session->db, sql);
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM FileHistory WHERE repo_id='%s'", repo_id);
+    seaf_db_query (mgr->session->db, sql);
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM DeletedEntry WHERE repo_id='%s'", repo_id);
+    seaf_db_query (mgr->session->db, sql);
+
+    pthread_mutex_unlock (&mgr->priv->update_lock);
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef FILE_HISTORY_MGR_H
+#define FILE_HISTORY_MGR_H
+
+#include <glib.h>
+
+/*
+ * Per-repo index of file revisions: for every path, the commits that
+ * changed the file at that path. A commit changes a file when the file
+ * exists in the commit and differs from the file at the same path in
+ * each of its parents, the same rule as list_file_revisions uses.
+ *
+ * It also keeps the files and dirs each commit deleted, so that the trash
+ * doesn't have to diff every commit of the kept history.
+ *
+ * The index is updated in a background thread when a branch is updated,
+ * and caught up on lookup if it's behind.
+ */
+
+struct _SeafileSession;
+struct _SeafFileHistoryManagerPriv;
+
+struct _SeafFileHistoryManager {
+    struct _SeafileSession *session;
+    struct _SeafFileHistoryManagerPriv *priv;
+};
+typedef struct _SeafFileHistoryManager SeafFileHistoryManager;
+
+SeafFileHistoryManager *
+seaf_file_history_manager_new (struct _SeafileSession *session);
+
+int
+seaf_file_history_manager_init (SeafFileHistoryManager *mgr);
+
+int
+seaf_file_history_manager_start (SeafFileHistoryManager *mgr);
+
+/* Index the new commits of @repo_id in the background. */
+void
+seaf_file_history_manager_queue_update (SeafFileHistoryManager *mgr,
+                                        const char *repo_id);
+
+/*
+ * Returns the ids of the commits that changed @path, latest first, up to
+ * @head_id. History older than @truncate_time is dropped like in
+ * list_file_revisions, except for the latest revision.
+ *
+ * Returns -1 if the index can't be used, e.g. it's not built yet, and the
+ * caller should walk the history instead.
+ */
+int
+seaf_file_history_manager_get_revisions (SeafFileHistoryManager *mgr,
+                                         const char *repo_id,
+                                         const char *head_id,
+                                         const char *path,
+                                         gint64 truncate_time,
+                                         GList **commit_ids);
+
+/*
+ * Returns the SeafileDeletedEntry deleted since @since in the history of
+ * @head_id, latest first. Only the latest deletion of a path is returned.
+ * Entries that are in @head_id again are not filtered out.
+ *
+ * Returns -1 if the index can't be used.
+ */
+int
+seaf_file_history_manager_get_deleted (SeafFileHistoryManager *mgr,
+                                       const char *repo_id,
+                                       const char *head_id,
+                                       gint64 since,
+                                       GList **entries);
+
+void
+seaf_file_history_manager_remove_repo (SeafFileHistoryManager *mgr,
+                                       const char *repo_id);
+
+#endif
@@ -0,0 +1,246 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "seaf-fuse.h"
+
+/*
+ * An open file. Blocks are read through a prefetcher, so sequential
+ * reads find the next blocks already fetched. The offsets of the blocks
+ * are learned as they are read; a read far ahead stats the blocks in
+ * between instead of reading them, and restarts the prefetcher there.
+ *
+ * FUSE may call read from several threads for the same file, @lock
+ * serializes them.
+ */
+typedef struct FuseFile {
+    pthread_mutex_t lock;
+    Seafile *file;
+
+    /* offsets[i] is the start of block i, for i <= n_known. */
+    gint64 *offsets;
+    int n_known;
+
+    /* Block @cur, -1 if none is read yet. */
+    int cur;
+    char *data;
+    int len;
+
+    SeafBlockPrefetcher *pf;
+    int pf_next;                /* the block pf returns next */
+} FuseFile;
+
+int
+seaf_fuse_open (const char *path, struct fuse_file_info *info)
+{
+    FusePath fpath;
+    FuseRepo *repo = NULL;
+    char *file_id = NULL;
+    guint32 mode = 0;
+    GError *error = NULL;
+    Seafile *file;
+    FuseFile *ff;
+    int ret = 0;
+
+    if ((info->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+
+    if (parse_fuse_path (path, &fpath) < 0)
+        return -ENOENT;
+    if (fpath.type != FUSE_PATH_REPO_FILE) {
+        ret = -EISDIR;
+        goto out;
+    }
+
+    repo = fuse_path_get_repo (&fpath);
+    if (!repo) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    file_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, repo->root_id,
+                                              fpath.repo_path, &mode, &error);
+    if (!file_id) {
+        ret = error ? -EIO : -ENOENT;
+        g_clear_error (&error);
+        goto out;
+    }
+    if (!S_ISREG(mode)) {
+        ret = -EISDIR;
+        goto out;
+    }
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!file) {
+        seaf_warning ("Failed to get file object %s.\n", file_id);
+        ret = -EIO;
+        goto out;
+    }
+
+    ff = g_new0 (FuseFile, 1);
+    pthread_mutex_init (&ff->lock, NULL);
+    ff->file = file;
+    ff->offsets = g_new0 (gint64, file->n_blocks + 1);
+    ff->cur = -1;
+    info->fh = (uint64_t)(uintptr_t)ff;
+
+out:
+    g_free (file_id);
+    fuse_repo_free (repo);
+    fuse_path_clear (&fpath);
+    return ret;
+}
+
+int
+seaf_fuse_release (const char *path, struct fuse_file_info *info)
+{
+    FuseFile *ff = (FuseFile *)(uintptr_t)info->fh;
+
+    if (!ff)
+        return 0;
+
+    if (ff->pf)
+        seaf_block_prefetcher_free (ff->pf);
+    g_free (ff->data);
+    g_free (ff->offsets);
+    seafile_unref (ff->file);
+    pthread_mutex_destroy (&ff->lock);
+    g_free (ff);
+
+    return 0;
+}
+
+static void
+learn_block_size (FuseFile *ff, int i, gint64 size)
+{
+    if (i == ff->n_known) {
+        ff->offsets[i + 1] = ff->offsets[i] + size;
+        ++ff->n_known;
+    }
+}
+
+static int
+load_block (FuseFile *ff, int i)
+{
+    Seafile *file = ff->file;
+    int rc;
+
+    if (!ff->pf || ff->pf_next != i) {
+        if (ff->pf)
+            seaf_block_prefetcher_free (ff->pf);
+        ff->pf = seaf_block_manager_prefetch_blocks (seaf->block_mgr,
+                                                     &file->blk_sha1s[i],
+                                                     file->n_blocks - i);
+        ff->pf_next = i;
+    }
+
+    g_free (ff->data);
+    ff->data = NULL;
+    ff->cur = -1;
+
+    rc = seaf_block_prefetcher_next (ff->pf, &ff->data, &ff->len);
+    if (rc != 0) {
+        seaf_warning ("Failed to read block %s.\n", file->blk_sha1s[i]);
+        seaf_block_prefetcher_free (ff->pf);
+        ff->pf = NULL;
+        return -1;
+    }
+    ff->cur = i;
+    ++ff->pf_next;
+    learn_block_size (ff, i, ff->len);
+
+    return 0;
+}
+
+/* Returns the index of the block containing @offset, or -1. */
+static int
+find_block (FuseFile *ff, gint64 offset)
+{
+    Seafile *file = ff->file;
+    BlockMetadata *bmd;
+    int lo, hi, mid;
+
+    if (offset < ff->offsets[ff->n_known]) {
+        lo = 0;
+        hi = ff->n_known - 1;
+        while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if (ff->offsets[mid] <= offset)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        return lo;
+    }
+
+    /* Reading on right after the blocks read so far. */
+    if (offset == ff->offsets[ff->n_known])
+        return (ff->n_known < file->n_blocks) ? ff->n_known : -1;
+
+    while (ff->n_known < file->n_blocks) {
+        int i = ff->n_known;
+
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             file->blk_sha1s[i]);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s.\n", file->blk_sha1s[i]);
+            return -1;
+        }
+        learn_block_size (ff, i, bmd->size);
+        g_free (bmd);
+
+        if (offset < ff->offsets[i + 1])
+            return i;
+    }
+
+    return -1;
+}
+
+int
+seaf_fuse_read (const char *path, char *buf, size_t size,
+                off_t offset, struct fuse_file_info *info)
+{
+    FuseFile *ff = (FuseFile *)(uintptr_t)info->fh;
+    gint64 file_size, start, n;
+    size_t done = 0;
+    int i;
+
+    if (!ff)
+        return -EBADF;
+
+    file_size = (gint64)ff->file->file_size;
+
+    pthread_mutex_lock (&ff->lock);
+
+    while (done < size && offset < file_size) {
+        if (ff->cur < 0 ||
+            offset < ff->offsets[ff->cur] ||
+            offset >= ff->offsets[ff->cur] + ff->len) {
+            i = find_block (ff, offset);
+            if (i < 0 || load_block (ff, i) < 0)
+                goto error;
+            /* An empty block would never cover the offset. */
+            if (ff->len == 0)
+                goto error;
+            continue;
+        }
+
+        start = offset - ff->offsets[ff->cur];
+        n = MIN ((gint64)(size - done), ff->len - start);
+        memcpy (buf + done, ff->data + start, n);
+        done += n;
+        offset += n;
+    }
+
+    pthread_mutex_unlock (&ff->lock);
+    return (int)done;
+
+error:
+    pthread_mutex_unlock (&ff->lock);
+    return -EIO;
+}
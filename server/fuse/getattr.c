@@ -0,0 +1,117 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "seaf-fuse.h"
+
+static void
+fill_dir_stat (struct stat *stbuf, gint64 mtime)
+{
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    stbuf->st_size = 4096;
+    stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = (time_t)mtime;
+}
+
+static int
+getattr_owner (FusePath *fpath, struct stat *stbuf)
+{
+    GList *owners;
+    gboolean found;
+
+    owners = repo_cache_get_owners ();
+    found = (g_list_find_custom (owners, fpath->owner,
+                                 (GCompareFunc)strcmp) != NULL);
+    string_list_free (owners);
+
+    if (!found)
+        return -ENOENT;
+
+    fill_dir_stat (stbuf, 0);
+    return 0;
+}
+
+static int
+getattr_repo_file (FusePath *fpath, struct stat *stbuf)
+{
+    FuseRepo *repo;
+    char *obj_id = NULL;
+    guint32 mode = 0;
+    gint64 size;
+    GError *error = NULL;
+    int ret = 0;
+
+    repo = fuse_path_get_repo (fpath);
+    if (!repo)
+        return -ENOENT;
+
+    if (fpath->type == FUSE_PATH_REPO) {
+        fill_dir_stat (stbuf, repo->mtime);
+        goto out;
+    }
+
+    obj_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, repo->root_id,
+                                             fpath->repo_path, &mode, &error);
+    if (!obj_id) {
+        ret = error ? -EIO : -ENOENT;
+        g_clear_error (&error);
+        goto out;
+    }
+
+    if (S_ISDIR(mode)) {
+        fill_dir_stat (stbuf, repo->mtime);
+        goto out;
+    }
+
+    size = seaf_fs_manager_get_file_size (seaf->fs_mgr, obj_id);
+    if (size < 0) {
+        seaf_warning ("Failed to get size of file %s.\n", obj_id);
+        ret = -EIO;
+        goto out;
+    }
+
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = size;
+    stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = (time_t)repo->mtime;
+
+out:
+    g_free (obj_id);
+    fuse_repo_free (repo);
+    return ret;
+}
+
+int
+seaf_fuse_getattr (const char *path, struct stat *stbuf)
+{
+    FusePath fpath;
+    int ret;
+
+    memset (stbuf, 0, sizeof(struct stat));
+    stbuf->st_uid = getuid ();
+    stbuf->st_gid = getgid ();
+
+    if (parse_fuse_path (path, &fpath) < 0)
+        return -ENOENT;
+
+    switch (fpath.type) {
+    case FUSE_PATH_ROOT:
+        fill_dir_stat (stbuf, 0);
+        ret = 0;
+        break;
+    case FUSE_PATH_OWNER:
+        ret = getattr_owner (&fpath, stbuf);
+        break;
+    default:
+        ret = getattr_repo_file (&fpath, stbuf);
+        break;
+    }
+
+    fuse_path_clear (&fpath);
+    return ret;
+}
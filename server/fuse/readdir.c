@@ -0,0 +1,109 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "log.h"
+#include "utils.h"
+#include "seafile-error.h"
+
+#include "seaf-fuse.h"
+
+static int
+readdir_root (void *buf, fuse_fill_dir_t filler)
+{
+    GList *owners, *ptr;
+
+    owners = repo_cache_get_owners ();
+    for (ptr = owners; ptr; ptr = ptr->next)
+        filler (buf, (char *)ptr->data, NULL, 0);
+    string_list_free (owners);
+
+    return 0;
+}
+
+static int
+readdir_owner (FusePath *fpath, void *buf, fuse_fill_dir_t filler)
+{
+    GList *repos, *ptr;
+    FuseRepo *repo;
+    char *name;
+
+    repos = repo_cache_get_repos_by_owner (fpath->owner);
+    if (!repos)
+        return -ENOENT;
+
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        if (!repo->encrypted) {
+            name = g_strdup_printf ("%s_%s", repo->repo_id, repo->name);
+            filler (buf, name, NULL, 0);
+            g_free (name);
+        }
+        fuse_repo_free (repo);
+    }
+    g_list_free (repos);
+
+    return 0;
+}
+
+static int
+readdir_repo (FusePath *fpath, void *buf, fuse_fill_dir_t filler)
+{
+    FuseRepo *repo;
+    SeafDir *dir;
+    GList *ptr;
+    GError *error = NULL;
+    int ret = 0;
+
+    repo = fuse_path_get_repo (fpath);
+    if (!repo)
+        return -ENOENT;
+
+    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, repo->root_id,
+                                               fpath->repo_path, &error);
+    if (!dir) {
+        ret = (error && error->code == SEAF_ERR_PATH_NO_EXIST) ? -ENOENT : -EIO;
+        g_clear_error (&error);
+        goto out;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        SeafDirent *dent = ptr->data;
+        filler (buf, dent->name, NULL, 0);
+    }
+    seaf_dir_free (dir);
+
+out:
+    fuse_repo_free (repo);
+    return ret;
+}
+
+int
+seaf_fuse_readdir (const char *path, void *buf,
+                   fuse_fill_dir_t filler, off_t offset,
+                   struct fuse_file_info *info)
+{
+    FusePath fpath;
+    int ret;
+
+    if (parse_fuse_path (path, &fpath) < 0)
+        return -ENOENT;
+
+    filler (buf, ".", NULL, 0);
+    filler (buf, "..", NULL, 0);
+
+    switch (fpath.type) {
+    case FUSE_PATH_ROOT:
+        ret = readdir_root (buf, filler);
+        break;
+    case FUSE_PATH_OWNER:
+        ret = readdir_owner (&fpath, buf, filler);
+        break;
+    default:
+        ret = readdir_repo (&fpath, buf, filler);
+        break;
+    }
+
+    fuse_path_clear (&fpath);
+    return ret;
+}
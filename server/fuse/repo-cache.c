@@ -0,0 +1,271 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "seaf-fuse.h"
+
+/* Expired entries are dropped when there are more repos than this. */
+#define MAX_CACHED_REPOS 10000
+
+typedef struct CachedRepo {
+    FuseRepo repo;
+    gint64   expire;
+} CachedRepo;
+
+typedef struct CachedIdList {
+    GList  *ids;
+    gint64  expire;
+} CachedIdList;
+
+static int cache_ttl;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *repos;       /* repo id -> CachedRepo */
+static GHashTable *owner_repos; /* owner -> CachedIdList of repo ids */
+static CachedIdList owners;
+
+static void
+cached_repo_free (CachedRepo *cached)
+{
+    g_free (cached->repo.name);
+    g_free (cached);
+}
+
+static void
+cached_id_list_free (CachedIdList *list)
+{
+    string_list_free (list->ids);
+    g_free (list);
+}
+
+void
+repo_cache_init (int ttl)
+{
+    cache_ttl = ttl;
+    repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)cached_repo_free);
+    owner_repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)cached_id_list_free);
+}
+
+static gint64
+now ()
+{
+    return (gint64)time(NULL);
+}
+
+static GList *
+string_list_copy (GList *list)
+{
+    GList *copy = NULL, *ptr;
+
+    for (ptr = list; ptr; ptr = ptr->next)
+        copy = g_list_prepend (copy, g_strdup(ptr->data));
+    return g_list_reverse (copy);
+}
+
+static FuseRepo *
+fuse_repo_copy (const FuseRepo *repo)
+{
+    FuseRepo *copy = g_new0 (FuseRepo, 1);
+
+    memcpy (copy, repo, sizeof(FuseRepo));
+    copy->name = g_strdup (repo->name);
+    return copy;
+}
+
+void
+fuse_repo_free (FuseRepo *repo)
+{
+    if (!repo)
+        return;
+    g_free (repo->name);
+    g_free (repo);
+}
+
+static CachedRepo *
+load_repo (const char *repo_id)
+{
+    SeafRepo *repo;
+    SeafCommit *commit;
+    CachedRepo *cached = NULL;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return NULL;
+
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             repo->head->commit_id);
+    if (!commit) {
+        seaf_warning ("Failed to get head commit of repo %s.\n", repo_id);
+        goto out;
+    }
+
+    cached = g_new0 (CachedRepo, 1);
+    memcpy (cached->repo.repo_id, repo->id, 37);
+    cached->repo.name = g_strdup (repo->name);
+    memcpy (cached->repo.root_id, commit->root_id, 41);
+    cached->repo.mtime = (gint64)commit->ctime;
+    cached->repo.encrypted = repo->encrypted;
+    cached->expire = now() + cache_ttl;
+
+    seaf_commit_unref (commit);
+
+out:
+    seaf_repo_unref (repo);
+    return cached;
+}
+
+static gboolean
+remove_expired (gpointer key, gpointer value, gpointer now)
+{
+    CachedRepo *cached = value;
+
+    return cached->expire <= *(gint64 *)now;
+}
+
+/* The database is queried without the lock, so that other threads can
+ * use the cache in the meantime.
+ */
+FuseRepo *
+repo_cache_get_repo (const char *repo_id)
+{
+    CachedRepo *cached;
+    FuseRepo *ret = NULL;
+    gint64 t = now();
+
+    pthread_mutex_lock (&cache_lock);
+    cached = g_hash_table_lookup (repos, repo_id);
+    if (cached && cached->expire > t)
+        ret = fuse_repo_copy (&cached->repo);
+    pthread_mutex_unlock (&cache_lock);
+
+    if (ret)
+        return ret;
+
+    cached = load_repo (repo_id);
+    if (!cached)
+        return NULL;
+    ret = fuse_repo_copy (&cached->repo);
+
+    pthread_mutex_lock (&cache_lock);
+    if (g_hash_table_size (repos) >= MAX_CACHED_REPOS)
+        g_hash_table_foreach_remove (repos, remove_expired, &t);
+    g_hash_table_replace (repos, g_strdup(repo_id), cached);
+    pthread_mutex_unlock (&cache_lock);
+
+    return ret;
+}
+
+static gboolean
+collect_column (SeafDBRow *row, void *data)
+{
+    GList **p_list = data;
+    const char *value = seaf_db_row_get_column_text (row, 0);
+
+    *p_list = g_list_prepend (*p_list, g_strdup(value));
+    return TRUE;
+}
+
+GList *
+repo_cache_get_owners ()
+{
+    GList *list = NULL, *ret;
+    gint64 t = now();
+
+    pthread_mutex_lock (&cache_lock);
+    if (owners.expire > t) {
+        ret = string_list_copy (owners.ids);
+        pthread_mutex_unlock (&cache_lock);
+        return ret;
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    if (seaf_db_foreach_selected_row (seaf->db,
+                                      "SELECT DISTINCT owner_id FROM RepoOwner",
+                                      collect_column, &list) < 0) {
+        seaf_warning ("Failed to get library owners.\n");
+        return NULL;
+    }
+    list = g_list_reverse (list);
+    ret = string_list_copy (list);
+
+    pthread_mutex_lock (&cache_lock);
+    string_list_free (owners.ids);
+    owners.ids = list;
+    owners.expire = t + cache_ttl;
+    pthread_mutex_unlock (&cache_lock);
+
+    return ret;
+}
+
+static GList *
+get_owner_repo_ids (const char *owner)
+{
+    CachedIdList *cached;
+    GList *list = NULL, *ret;
+    gint64 t = now();
+
+    pthread_mutex_lock (&cache_lock);
+    cached = g_hash_table_lookup (owner_repos, owner);
+    if (cached && cached->expire > t) {
+        ret = string_list_copy (cached->ids);
+        pthread_mutex_unlock (&cache_lock);
+        return ret;
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT repo_id FROM RepoOwner "
+                                       "WHERE owner_id=?",
+                                       collect_column, &list,
+                                       1, "string", owner) < 0) {
+        seaf_warning ("Failed to get libraries of %s.\n", owner);
+        return NULL;
+    }
+    ret = string_list_copy (list);
+
+    cached = g_new0 (CachedIdList, 1);
+    cached->ids = list;
+    cached->expire = t + cache_ttl;
+
+    pthread_mutex_lock (&cache_lock);
+    g_hash_table_replace (owner_repos, g_strdup(owner), cached);
+    pthread_mutex_unlock (&cache_lock);
+
+    return ret;
+}
+
+GList *
+repo_cache_get_repos_by_owner (const char *owner)
+{
+    GList *ids, *ptr, *ret = NULL;
+    FuseRepo *repo;
+
+    ids = get_owner_repo_ids (owner);
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        repo = repo_cache_get_repo (ptr->data);
+        if (repo)
+            ret = g_list_prepend (ret, repo);
+    }
+    string_list_free (ids);
+
+    return g_list_reverse (ret);
+}
+
+gboolean
+repo_cache_owner_has_repo (const char *owner, const char *repo_id)
+{
+    GList *ids;
+    gboolean ret;
+
+    ids = get_owner_repo_ids (owner);
+    ret = (g_list_find_custom (ids, repo_id, (GCompareFunc)strcmp) != NULL);
+    string_list_free (ids);
+
+    return ret;
+}
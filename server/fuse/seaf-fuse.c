@@ -0,0 +1,216 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Read-only FUSE mount of the libraries on the server, for backups,
+ * indexing and scanning at storage speed.
+ *
+ * Objects are read through the fs manager, whose object and path caches
+ * are sized in the [fs_cache] section of seafile.conf. Blocks are read
+ * ahead by the block manager's prefetcher, see prefetch_blocks in
+ * [block_backend], and can be kept in a local block cache in front of a
+ * remote backend the same way as for seaf-server.
+ *
+ * FUSE runs the operations in several threads, unless -s is given.
+ */
+
+#include "common.h"
+#include "log.h"
+
+#include <stddef.h>
+
+#include <ccnet.h>
+
+#include "utils.h"
+
+#include "seaf-fuse.h"
+
+#define DEFAULT_CACHE_TTL 10
+
+CcnetClient *ccnet_client;
+SeafileSession *seaf;
+
+struct options {
+    char *config_dir;
+    char *seafile_dir;
+    int cache_ttl;
+} options;
+
+#define SEAF_FUSE_OPT_KEY(t, p, v) { t, offsetof(struct options, p), v }
+
+enum {
+    KEY_HELP,
+};
+
+static struct fuse_opt seaf_fuse_opts[] = {
+    SEAF_FUSE_OPT_KEY("-c %s", config_dir, 0),
+    SEAF_FUSE_OPT_KEY("--config=%s", config_dir, 0),
+    SEAF_FUSE_OPT_KEY("--seafdir=%s", seafile_dir, 0),
+    SEAF_FUSE_OPT_KEY("--cache-ttl=%d", cache_ttl, 0),
+
+    FUSE_OPT_KEY("-h", KEY_HELP),
+    FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_END
+};
+
+static void usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-fuse [-c config_dir] [--seafdir=seafile_dir] "
+             "[--cache-ttl=seconds] [FUSE options] mount_point\n"
+             "--cache-ttl: how long the library list and heads are cached, "
+             "defaults to %d\n",
+             DEFAULT_CACHE_TTL);
+}
+
+static int
+seaf_fuse_opt_proc (void *data, const char *arg, int key,
+                    struct fuse_args *outargs)
+{
+    if (key == KEY_HELP) {
+        usage ();
+        exit (0);
+    }
+
+    return 1;
+}
+
+int
+parse_fuse_path (const char *path, FusePath *fpath)
+{
+    char **tokens;
+    int n, ret = 0;
+    const char *repo_dir;
+
+    memset (fpath, 0, sizeof(FusePath));
+
+    /* Skip the leading '/', the rest is split into owner, repo dir and
+     * the path in the repo.
+     */
+    while (*path == '/')
+        ++path;
+    tokens = g_strsplit (path, "/", 3);
+    n = g_strv_length (tokens);
+
+    if (n == 0 || tokens[0][0] == '\0') {
+        fpath->type = FUSE_PATH_ROOT;
+        goto out;
+    }
+
+    fpath->owner = g_strdup (tokens[0]);
+    if (n == 1 || tokens[1][0] == '\0') {
+        fpath->type = FUSE_PATH_OWNER;
+        goto out;
+    }
+
+    /* <repo-id>_<name> */
+    repo_dir = tokens[1];
+    if (strlen (repo_dir) < 37 || repo_dir[36] != '_') {
+        ret = -1;
+        goto out;
+    }
+    memcpy (fpath->repo_id, repo_dir, 36);
+    fpath->repo_id[36] = '\0';
+    if (!is_uuid_valid (fpath->repo_id)) {
+        ret = -1;
+        goto out;
+    }
+    fpath->repo_name = g_strdup (repo_dir + 37);
+
+    if (n == 2 || tokens[2][0] == '\0') {
+        fpath->type = FUSE_PATH_REPO;
+        fpath->repo_path = g_strdup ("/");
+    } else {
+        fpath->type = FUSE_PATH_REPO_FILE;
+        fpath->repo_path = g_strconcat ("/", tokens[2], NULL);
+    }
+
+out:
+    g_strfreev (tokens);
+    if (ret < 0)
+        fuse_path_clear (fpath);
+    return ret;
+}
+
+void
+fuse_path_clear (FusePath *fpath)
+{
+    g_free (fpath->owner);
+    g_free (fpath->repo_name);
+    g_free (fpath->repo_path);
+    memset (fpath, 0, sizeof(FusePath));
+}
+
+FuseRepo *
+fuse_path_get_repo (FusePath *fpath)
+{
+    FuseRepo *repo;
+
+    repo = repo_cache_get_repo (fpath->repo_id);
+    if (!repo)
+        return NULL;
+
+    if (repo->encrypted ||
+        g_strcmp0 (repo->name, fpath->repo_name) != 0 ||
+        !repo_cache_owner_has_repo (fpath->owner, fpath->repo_id)) {
+        fuse_repo_free (repo);
+        return NULL;
+    }
+
+    return repo;
+}
+
+static struct fuse_operations seaf_fuse_ops = {
+    .getattr = seaf_fuse_getattr,
+    .readdir = seaf_fuse_readdir,
+    .open    = seaf_fuse_open,
+    .read    = seaf_fuse_read,
+    .release = seaf_fuse_release,
+};
+
+int
+main (int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    memset (&options, 0, sizeof(options));
+    options.cache_ttl = DEFAULT_CACHE_TTL;
+
+    if (fuse_opt_parse (&args, &options, seaf_fuse_opts,
+                        seaf_fuse_opt_proc) < 0) {
+        usage ();
+        exit (1);
+    }
+
+    /* Nothing in the mount can be written. */
+    fuse_opt_add_arg (&args, "-oro");
+
+    if (!options.config_dir)
+        options.config_dir = DEFAULT_CONFIG_DIR;
+    if (options.cache_ttl < 0)
+        options.cache_ttl = 0;
+
+    g_type_init ();
+    /* The operations and the prefetcher run in several threads. */
+    if (!g_thread_supported ())
+        g_thread_init (NULL);
+
+    ccnet_client = ccnet_client_new ();
+    if ((ccnet_client_load_confdir (ccnet_client, options.config_dir)) < 0) {
+        g_warning ("Read config dir error\n");
+        return -1;
+    }
+
+    if (options.seafile_dir == NULL)
+        options.seafile_dir = g_build_filename (options.config_dir,
+                                                "seafile-data", NULL);
+
+    seaf = seafile_session_new (options.seafile_dir, ccnet_client);
+    if (!seaf) {
+        g_warning ("Failed to create seafile session.\n");
+        exit (1);
+    }
+
+    repo_cache_init (options.cache_ttl);
+
+    return fuse_main (args.argc, args.argv, &seaf_fuse_ops, NULL);
+}
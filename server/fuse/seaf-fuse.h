@@ -0,0 +1,107 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_FUSE_H
+#define SEAF_FUSE_H
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
+#include "seafile-session.h"
+
+/*
+ * The mount point shows one dir per library owner, with one dir
+ * "<repo-id>_<name>" per library of the owner, in which the latest
+ * version of the library is found:
+ *
+ *   /<owner>/<repo-id>_<name>/<path in library>
+ *
+ * Everything is read-only. Encrypted libraries are not shown, since the
+ * server can't decrypt them.
+ */
+
+/* Number of components parsed from a path. */
+enum {
+    FUSE_PATH_ROOT = 0,
+    FUSE_PATH_OWNER,
+    FUSE_PATH_REPO,
+    FUSE_PATH_REPO_FILE,
+};
+
+typedef struct FusePath {
+    int   type;
+    char *owner;
+    char  repo_id[37];
+    char *repo_name;
+    char *repo_path;            /* "/" for the root of the library */
+} FusePath;
+
+/* Returns -1 if @path can't be in the mount, e.g. a malformed repo id. */
+int
+parse_fuse_path (const char *path, FusePath *fpath);
+
+void
+fuse_path_clear (FusePath *fpath);
+
+/*
+ * Heads of the libraries and their owners, read from the database at
+ * most once every @ttl seconds. The content under a head is immutable
+ * and is cached by the fs and block managers.
+ */
+
+typedef struct FuseRepo {
+    char     repo_id[37];
+    char    *name;
+    char     root_id[41];
+    gint64   mtime;             /* ctime of the head commit */
+    gboolean encrypted;
+} FuseRepo;
+
+void
+repo_cache_init (int ttl);
+
+/* Returns a copy, free it with fuse_repo_free(). NULL if not found. */
+FuseRepo *
+repo_cache_get_repo (const char *repo_id);
+
+void
+fuse_repo_free (FuseRepo *repo);
+
+/* Returns the owners, a list of strings. */
+GList *
+repo_cache_get_owners ();
+
+/* Returns the repos of @owner, a list of FuseRepo. */
+GList *
+repo_cache_get_repos_by_owner (const char *owner);
+
+gboolean
+repo_cache_owner_has_repo (const char *owner, const char *repo_id);
+
+/*
+ * The library of @fpath, if it's shown under the owner and name in the
+ * path. Free it with fuse_repo_free().
+ */
+FuseRepo *
+fuse_path_get_repo (FusePath *fpath);
+
+/* FUSE operations. */
+
+int
+seaf_fuse_getattr (const char *path, struct stat *stbuf);
+
+int
+seaf_fuse_readdir (const char *path, void *buf,
+                   fuse_fill_dir_t filler, off_t offset,
+                   struct fuse_file_info *info);
+
+int
+seaf_fuse_open (const char *path, struct fuse_file_info *info);
+
+int
+seaf_fuse_read (const char *path, char *buf, size_t size,
+                off_t offset, struct fuse_file_info *info);
+
+int
+seaf_fuse_release (const char *path, struct fuse_file_info *info);
+
+#endif
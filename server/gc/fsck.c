@@ -0,0 +1,680 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "seafile-session.h"
+#include "obj-id-set.h"
+#include "cdc/seaf-sha1.h"
+#include "utils.h"
+#include "log.h"
+#include "history-compact.h"
+
+#include "fsck.h"
+
+/*
+ * The check runs in two passes.
+ *
+ * The first one is laid out like verify.c: repos are traversed by several
+ * threads, and blocks are read and hashed in batches by a pool of
+ * threads. Every commit, fs object and block reachable from the branch
+ * heads is checked once across all repos: it must exist, and its id must
+ * be the hash of its content. The ids of the broken objects are collected.
+ *
+ * The ids of checked repos and of broken objects are appended to a
+ * checkpoint file, so that a stopped run can be resumed. It's removed
+ * when all repos are checked.
+ *
+ * If anything is broken, the second pass walks the head trees again,
+ * without reading blocks, to find the repos whose heads are not
+ * intact. With @repair, each of those branches gets a new commit with
+ * the tree of the last intact commit on its first-parent history.
+ */
+#define CHECK_BATCH_SIZE 64
+#define CHECKPOINT_FILE "fsck-checkpoint"
+
+/* Commits looked through for an intact one, from the head. */
+#define MAX_REPAIR_DEPTH 1000
+
+typedef struct FsckShared {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    GList           *next_repo;
+    GHashTable      *done_repos;    /* from the checkpoint */
+    FILE            *checkpoint;
+
+    ObjIdSet        *visited;       /* commits and fs objects */
+    ObjIdSet        *checked;       /* blocks */
+    GHashTable      *broken;        /* ids of broken objects, under @lock */
+
+    GThreadPool     *check_pool;
+    int             pending;        /* batches queued or being checked */
+    int             max_pending;
+
+    int             n_failed;
+} FsckShared;
+
+typedef struct FsckData {
+    FsckShared *shared;
+    SeafRepo *repo;
+    struct CheckBatch *batch;
+    int pending;                    /* batches of this repo */
+    gint64 truncate_time;
+    gboolean traversed_head;
+    HistoryCompactor compactor;
+} FsckData;
+
+typedef struct CheckBatch {
+    FsckData *owner;
+    int n;
+    char *block_ids[CHECK_BATCH_SIZE];
+} CheckBatch;
+
+/* Counters are updated atomically by the fsck threads. */
+static FsckProgress progress;
+
+void
+fsck_get_progress (FsckProgress *p)
+{
+    __sync_synchronize ();
+    *p = progress;
+}
+
+char *
+fsck_format_progress (const FsckProgress *p)
+{
+    return g_strdup_printf ("repos_total\t%u\n"
+                            "repos_done\t%u\n"
+                            "commits\t%"G_GUINT64_FORMAT"\n"
+                            "fs_objects\t%"G_GUINT64_FORMAT"\n"
+                            "blocks\t%"G_GUINT64_FORMAT"\n"
+                            "bytes_read\t%"G_GUINT64_FORMAT"\n"
+                            "missing\t%"G_GUINT64_FORMAT"\n"
+                            "corrupt\t%"G_GUINT64_FORMAT"\n"
+                            "repos_repaired\t%u\n",
+                            p->repos_total, p->repos_done, p->commits,
+                            p->fs_objects, p->blocks, p->bytes_read,
+                            p->missing, p->corrupt, p->repos_repaired);
+}
+
+static void
+mark_broken (FsckShared *shared, const char *kind, const char *obj_id,
+             gboolean missing, const char *repo_id)
+{
+    g_message ("%s %s of repo %s is %s.\n",
+               kind, obj_id, repo_id, missing ? "missing" : "corrupt");
+    if (missing)
+        __sync_fetch_and_add (&progress.missing, 1);
+    else
+        __sync_fetch_and_add (&progress.corrupt, 1);
+
+    pthread_mutex_lock (&shared->lock);
+    g_hash_table_insert (shared->broken, g_strdup (obj_id), GINT_TO_POINTER(1));
+    if (shared->checkpoint) {
+        fprintf (shared->checkpoint, "broken %s\n", obj_id);
+        fflush (shared->checkpoint);
+    }
+    pthread_mutex_unlock (&shared->lock);
+}
+
+static void
+check_block (FsckShared *shared, const char *block_id, const char *repo_id)
+{
+    SeafSHA1Ctx ctx;
+    uint8_t sha1[20];
+    char id[41];
+    char *data = NULL;
+    int len;
+
+    if (seaf_block_manager_read_whole_block (seaf->block_mgr, block_id,
+                                             &data, &len) < 0) {
+        mark_broken (shared, "Block", block_id,
+                     !seaf_block_manager_block_exists (seaf->block_mgr,
+                                                       block_id),
+                     repo_id);
+        return;
+    }
+    __sync_fetch_and_add (&progress.bytes_read, (guint64)len);
+
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, data, len);
+    seaf_sha1_final (sha1, &ctx);
+    rawdata_to_hex (sha1, id, 20);
+    if (memcmp (id, block_id, 40) != 0)
+        mark_broken (shared, "Block", block_id, FALSE, repo_id);
+
+    g_free (data);
+}
+
+static void
+check_batch (gpointer vbatch, gpointer vshared)
+{
+    CheckBatch *batch = vbatch;
+    FsckShared *shared = vshared;
+    FsckData *owner = batch->owner;
+    int i;
+
+    for (i = 0; i < batch->n; ++i) {
+        check_block (shared, batch->block_ids[i], owner->repo->id);
+        g_free (batch->block_ids[i]);
+    }
+    __sync_fetch_and_add (&progress.blocks, batch->n);
+    g_free (batch);
+
+    pthread_mutex_lock (&shared->lock);
+    --shared->pending;
+    --owner->pending;
+    pthread_cond_broadcast (&shared->cond);
+    pthread_mutex_unlock (&shared->lock);
+}
+
+static void
+submit_batch (FsckData *data)
+{
+    FsckShared *shared = data->shared;
+    CheckBatch *batch = data->batch;
+
+    data->batch = NULL;
+    if (!batch)
+        return;
+
+    /* Keep the traversal from running too far ahead of the checks. */
+    pthread_mutex_lock (&shared->lock);
+    while (shared->pending >= shared->max_pending)
+        pthread_cond_wait (&shared->cond, &shared->lock);
+    ++shared->pending;
+    ++data->pending;
+    pthread_mutex_unlock (&shared->lock);
+
+    g_thread_pool_push (shared->check_pool, batch, NULL);
+}
+
+static void
+check_file (FsckData *data, const char *file_id)
+{
+    FsckShared *shared = data->shared;
+    Seafile *seafile;
+    int i;
+
+    if (!obj_id_set_add (shared->visited, file_id))
+        return;
+    __sync_fetch_and_add (&progress.fs_objects, 1);
+
+    seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!seafile) {
+        mark_broken (shared, "File", file_id,
+                     !seaf_fs_manager_object_exists (seaf->fs_mgr, file_id),
+                     data->repo->id);
+        return;
+    }
+    if (!seafile_verify_id (seafile))
+        mark_broken (shared, "File", file_id, FALSE, data->repo->id);
+
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        if (!obj_id_set_add (shared->checked, seafile->blk_sha1s[i]))
+            continue;
+
+        if (!data->batch) {
+            data->batch = g_new0 (CheckBatch, 1);
+            data->batch->owner = data;
+        }
+        data->batch->block_ids[data->batch->n++] = g_strdup (seafile->blk_sha1s[i]);
+        if (data->batch->n == CHECK_BATCH_SIZE)
+            submit_batch (data);
+    }
+
+    seafile_unref (seafile);
+}
+
+/* Unlike seaf_fs_manager_traverse_tree(), carries on after broken objects. */
+static void
+check_dir (FsckData *data, const char *dir_id)
+{
+    FsckShared *shared = data->shared;
+    SeafDir *dir;
+    SeafDirent *dent;
+    GList *ptr;
+
+    if (!obj_id_set_add (shared->visited, dir_id))
+        return;
+    __sync_fetch_and_add (&progress.fs_objects, 1);
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        mark_broken (shared, "Dir", dir_id,
+                     !seaf_fs_manager_object_exists (seaf->fs_mgr, dir_id),
+                     data->repo->id);
+        return;
+    }
+    if (!seaf_dir_verify_id (dir))
+        mark_broken (shared, "Dir", dir_id, FALSE, data->repo->id);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (S_ISDIR(dent->mode))
+            check_dir (data, dent->id);
+        else if (S_ISREG(dent->mode))
+            check_file (data, dent->id);
+    }
+
+    seaf_dir_free (dir);
+}
+
+static gboolean
+traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    FsckData *data = vdata;
+
+    if (data->truncate_time == 0)
+    {
+        *stop = TRUE;
+        /* Stop after traversing the head commit. */
+    }
+    else if (data->truncate_time > 0 &&
+             commit->ctime < data->truncate_time &&
+             data->traversed_head)
+    {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    /* GC doesn't keep the trees between checkpoints. */
+    if (!history_compactor_keep (&data->compactor, commit->ctime) &&
+        data->traversed_head)
+        return TRUE;
+
+    if (!data->traversed_head)
+        data->traversed_head = TRUE;
+
+    /* Shared history of forks and copies is checked once. */
+    if (!obj_id_set_add (data->shared->visited, commit->commit_id)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+    __sync_fetch_and_add (&progress.commits, 1);
+
+    if (!seaf_commit_verify_id (commit))
+        mark_broken (data->shared, "Commit", commit->commit_id, FALSE,
+                     data->repo->id);
+
+    check_dir (data, commit->root_id);
+
+    return TRUE;
+}
+
+static int
+check_repo (SeafRepo *repo, FsckShared *shared)
+{
+    GList *branches, *ptr;
+    SeafBranch *branch;
+    int ret = 0;
+    FsckData data = {0};
+
+    data.shared = shared;
+    data.repo = repo;
+
+    if (seaf->keep_history_days > 0) {
+        data.truncate_time =
+            (gint64)time(NULL) - seaf->keep_history_days * 24 * 3600;
+    } else if (seaf->keep_history_days < 0) {
+        data.truncate_time = -1;
+    }
+
+    branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo->id);
+    if (branches == NULL) {
+        seaf_warning ("Failed to get branch list of repo %s.\n", repo->id);
+        return -1;
+    }
+
+    for (ptr = branches; ptr != NULL; ptr = ptr->next) {
+        branch = ptr->data;
+        data.traversed_head = FALSE;
+        history_compactor_init (&data.compactor);
+        /* Fails on a commit that can't be read, the rest of the history
+         * is not reachable then. */
+        if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                       branch->commit_id,
+                                                       traverse_commit,
+                                                       &data)) {
+            g_message ("History of branch %s of repo %s is broken.\n",
+                       branch->name, repo->id);
+            if (!seaf_commit_manager_commit_exists (seaf->commit_mgr,
+                                                    branch->commit_id))
+                mark_broken (shared, "Commit", branch->commit_id, TRUE,
+                             repo->id);
+            ret = -1;
+        }
+        seaf_branch_unref (branch);
+    }
+
+    g_list_free (branches);
+
+    /* The repo is checked when all its blocks are checked. */
+    submit_batch (&data);
+    pthread_mutex_lock (&shared->lock);
+    while (data.pending > 0)
+        pthread_cond_wait (&shared->cond, &shared->lock);
+    if (ret == 0 && shared->checkpoint) {
+        fprintf (shared->checkpoint, "repo %s\n", repo->id);
+        fflush (shared->checkpoint);
+    }
+    pthread_mutex_unlock (&shared->lock);
+
+    return ret;
+}
+
+static void *
+fsck_worker (void *vshared)
+{
+    FsckShared *shared = vshared;
+    SeafRepo *repo;
+
+    while (1) {
+        pthread_mutex_lock (&shared->lock);
+        repo = NULL;
+        while (shared->next_repo && !repo) {
+            repo = shared->next_repo->data;
+            shared->next_repo = shared->next_repo->next;
+            if (shared->done_repos &&
+                g_hash_table_lookup (shared->done_repos, repo->id))
+                repo = NULL;
+        }
+        pthread_mutex_unlock (&shared->lock);
+        if (!repo)
+            break;
+
+        /* Carry on with the other repos. */
+        if (check_repo (repo, shared) < 0)
+            __sync_fetch_and_add (&shared->n_failed, 1);
+        __sync_fetch_and_add (&progress.repos_done, 1);
+    }
+
+    return NULL;
+}
+
+static GHashTable *
+load_checkpoint (const char *path, GHashTable *broken)
+{
+    GHashTable *done;
+    FILE *fp;
+    char line[256];
+
+    fp = g_fopen (path, "r");
+    if (!fp)
+        return NULL;
+
+    done = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    while (fgets (line, sizeof(line), fp)) {
+        g_strchomp (line);
+        if (strncmp (line, "repo ", 5) == 0)
+            g_hash_table_insert (done, g_strdup (line + 5), GINT_TO_POINTER(1));
+        else if (strncmp (line, "broken ", 7) == 0)
+            g_hash_table_insert (broken, g_strdup (line + 7), GINT_TO_POINTER(1));
+    }
+    fclose (fp);
+
+    g_message ("Resuming fsck, %u repos already checked, "
+               "%u broken objects found.\n",
+               g_hash_table_size (done), g_hash_table_size (broken));
+    return done;
+}
+
+/*
+ * Second pass, single-threaded. Intact dirs are remembered in @intact,
+ * since the trees of consecutive commits share most of their dirs.
+ */
+static gboolean
+tree_is_intact (GHashTable *broken, GHashTable *intact, const char *dir_id)
+{
+    SeafDir *dir;
+    SeafDirent *dent;
+    Seafile *seafile;
+    GList *ptr;
+    gboolean ret = TRUE;
+    int i;
+
+    if (g_hash_table_lookup (broken, dir_id))
+        return FALSE;
+    if (g_hash_table_lookup (intact, dir_id))
+        return TRUE;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dir_id);
+    if (!dir)
+        return FALSE;
+
+    for (ptr = dir->entries; ptr && ret; ptr = ptr->next) {
+        dent = ptr->data;
+        if (S_ISDIR(dent->mode)) {
+            ret = tree_is_intact (broken, intact, dent->id);
+        } else if (S_ISREG(dent->mode)) {
+            if (g_hash_table_lookup (broken, dent->id))
+                ret = FALSE;
+            else if (!(seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                                              dent->id)))
+                ret = FALSE;
+            else {
+                for (i = 0; i < seafile->n_blocks && ret; ++i)
+                    if (g_hash_table_lookup (broken, seafile->blk_sha1s[i]))
+                        ret = FALSE;
+                seafile_unref (seafile);
+            }
+        }
+    }
+    seaf_dir_free (dir);
+
+    if (ret)
+        g_hash_table_insert (intact, g_strdup (dir_id), GINT_TO_POINTER(1));
+    return ret;
+}
+
+static gboolean
+commit_is_intact (GHashTable *broken, GHashTable *intact, SeafCommit *commit)
+{
+    return !g_hash_table_lookup (broken, commit->commit_id) &&
+        tree_is_intact (broken, intact, commit->root_id);
+}
+
+/* The last intact commit on the first-parent history of @head, or NULL. */
+static SeafCommit *
+find_intact_commit (GHashTable *broken, GHashTable *intact, SeafCommit *head)
+{
+    SeafCommit *commit, *parent;
+    int depth;
+
+    seaf_commit_ref (head);
+    commit = head;
+    for (depth = 0; depth < MAX_REPAIR_DEPTH; ++depth) {
+        if (commit_is_intact (broken, intact, commit))
+            return commit;
+        if (!commit->parent_id)
+            break;
+        parent = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 commit->parent_id);
+        seaf_commit_unref (commit);
+        if (!parent)
+            return NULL;
+        commit = parent;
+    }
+
+    seaf_commit_unref (commit);
+    return NULL;
+}
+
+/*
+ * The head is moved forward to a copy of the intact commit, so clients
+ * fast-forward to it, and the broken commits stay in the history.
+ */
+static int
+reset_branch (SeafBranch *branch, SeafCommit *head, SeafCommit *intact)
+{
+    SeafCommit *commit;
+    char *desc;
+    int ret = 0;
+
+    desc = g_strdup_printf ("Reset to %.8s by fsck, later changes were "
+                            "damaged", intact->commit_id);
+    commit = seaf_commit_new (NULL, head->repo_id, intact->root_id,
+                              head->creator_name, head->creator_id,
+                              desc, 0);
+    g_free (desc);
+
+    commit->parent_id = g_strdup (head->commit_id);
+    commit->repo_name = g_strdup (head->repo_name);
+    commit->repo_desc = g_strdup (head->repo_desc);
+    commit->repo_category = g_strdup (head->repo_category);
+    commit->encrypted = head->encrypted;
+    commit->enc_version = head->enc_version;
+    commit->magic = g_strdup (head->magic);
+    commit->no_local_history = head->no_local_history;
+    commit->chunker = head->chunker;
+    commit->chunk_policy = g_strdup (head->chunk_policy);
+
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    seaf_branch_set_commit (branch, commit->commit_id);
+    if (seaf_branch_manager_update_branch (seaf->branch_mgr, branch) < 0)
+        ret = -1;
+
+out:
+    seaf_commit_unref (commit);
+    return ret;
+}
+
+static void
+check_heads (GList *repos, GHashTable *broken, gboolean repair)
+{
+    GHashTable *intact;
+    GList *ptr, *branches, *b;
+    SeafRepo *repo;
+    SeafBranch *branch;
+    SeafCommit *head, *good;
+
+    intact = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (ptr = repos; ptr != NULL; ptr = ptr->next) {
+        repo = ptr->data;
+        branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr,
+                                                        repo->id);
+        for (b = branches; b != NULL; b = b->next) {
+            branch = b->data;
+            head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                   branch->commit_id);
+            if (head && commit_is_intact (broken, intact, head)) {
+                seaf_commit_unref (head);
+                seaf_branch_unref (branch);
+                continue;
+            }
+
+            good = head ? find_intact_commit (broken, intact, head) : NULL;
+            if (!good) {
+                g_message ("Branch %s of repo %s is damaged, no intact "
+                           "commit found.\n", branch->name, repo->id);
+            } else if (!repair) {
+                g_message ("Branch %s of repo %s is damaged, last intact "
+                           "commit is %s.\n",
+                           branch->name, repo->id, good->commit_id);
+            } else if (reset_branch (branch, head, good) < 0) {
+                seaf_warning ("Failed to reset branch %s of repo %s.\n",
+                              branch->name, repo->id);
+            } else {
+                g_message ("Reset branch %s of repo %s to commit %s.\n",
+                           branch->name, repo->id, good->commit_id);
+                __sync_fetch_and_add (&progress.repos_repaired, 1);
+            }
+
+            if (good)
+                seaf_commit_unref (good);
+            if (head)
+                seaf_commit_unref (head);
+            seaf_branch_unref (branch);
+        }
+        g_list_free (branches);
+    }
+
+    g_hash_table_destroy (intact);
+}
+
+int
+fsck_repos (int n_threads, gboolean resume, gboolean repair)
+{
+    GList *repos = NULL, *ptr;
+    FsckShared shared;
+    pthread_t *threads;
+    char *checkpoint_path;
+    int i, n_started = 0;
+
+    memset (&progress, 0, sizeof(progress));
+    memset (&shared, 0, sizeof(shared));
+    pthread_mutex_init (&shared.lock, NULL);
+    pthread_cond_init (&shared.cond, NULL);
+
+    n_threads = MAX (n_threads, 1);
+
+    shared.broken = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    checkpoint_path = g_build_filename (seaf->seaf_dir, CHECKPOINT_FILE, NULL);
+    if (resume)
+        shared.done_repos = load_checkpoint (checkpoint_path, shared.broken);
+    shared.checkpoint = g_fopen (checkpoint_path, resume ? "a" : "w");
+    if (!shared.checkpoint)
+        seaf_warning ("Failed to open %s, fsck can't be resumed.\n",
+                      checkpoint_path);
+
+    shared.visited = obj_id_set_new ();
+    shared.checked = obj_id_set_new ();
+    shared.max_pending = n_threads * 4;
+    shared.check_pool = g_thread_pool_new (check_batch, &shared,
+                                           n_threads, FALSE, NULL);
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    shared.next_repo = repos;
+    progress.repos_total = g_list_length (repos);
+    if (shared.done_repos)
+        progress.repos_done = g_hash_table_size (shared.done_repos);
+
+    threads = g_new0 (pthread_t, n_threads);
+    for (i = 1; i < n_threads; ++i) {
+        if (pthread_create (&threads[i], NULL, fsck_worker, &shared) != 0)
+            break;
+        ++n_started;
+    }
+    fsck_worker (&shared);
+    for (i = 1; i <= n_started; ++i)
+        pthread_join (threads[i], NULL);
+    g_free (threads);
+
+    /* Waits for the queued batches. */
+    g_thread_pool_free (shared.check_pool, FALSE, TRUE);
+
+    g_message ("Checked %"G_GUINT64_FORMAT" commits, %"G_GUINT64_FORMAT
+               " fs objects and %"G_GUINT64_FORMAT" blocks, %u broken "
+               "objects found.\n", progress.commits, progress.fs_objects,
+               progress.blocks, g_hash_table_size (shared.broken));
+
+    if (g_hash_table_size (shared.broken) > 0)
+        check_heads (repos, shared.broken, repair);
+
+    if (shared.checkpoint)
+        fclose (shared.checkpoint);
+    if (shared.n_failed == 0)
+        g_unlink (checkpoint_path);
+
+    for (ptr = repos; ptr != NULL; ptr = ptr->next)
+        seaf_repo_unref ((SeafRepo *)ptr->data);
+    g_list_free (repos);
+    if (shared.done_repos)
+        g_hash_table_destroy (shared.done_repos);
+    g_hash_table_destroy (shared.broken);
+    obj_id_set_free (shared.visited);
+    obj_id_set_free (shared.checked);
+    g_free (checkpoint_path);
+    pthread_cond_destroy (&shared.cond);
+    pthread_mutex_destroy (&shared.lock);
+
+    return (shared.n_failed || progress.missing || progress.corrupt) ? -1 : 0;
+}
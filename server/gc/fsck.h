@@ -0,0 +1,32 @@
+#ifndef GC_FSCK_H
+#define GC_FSCK_H
+
+typedef struct FsckProgress {
+    guint       repos_total;
+    guint       repos_done;
+    guint64     commits;
+    guint64     fs_objects;
+    guint64     blocks;
+    guint64     bytes_read;
+    guint64     missing;
+    guint64     corrupt;
+    guint       repos_repaired;
+} FsckProgress;
+
+/*
+ * Check that every commit, fs object and block reachable from the
+ * branch heads exists and matches its id. Branches whose head is damaged
+ * are reset to their last intact commit if @repair is TRUE. Repos listed
+ * in the checkpoint of an unfinished run are skipped if @resume is TRUE.
+ *
+ * Returns -1 if anything is broken.
+ */
+int fsck_repos (int n_threads, gboolean resume, gboolean repair);
+
+/* Can be called from any thread. */
+void fsck_get_progress (FsckProgress *progress);
+
+/* "name\tvalue" lines, freed by the caller. */
+char *fsck_format_progress (const FsckProgress *progress);
+
+#endif
@@ -0,0 +1,1025 @@
+/*
+ * Benchmark for the GC, on a generated store.
+ *
+ * The generator writes a seafile data dir with the given number of
+ * repos, each with a history of commits on one branch. A repo has
+ * n_files files in dirs of DIR_FILES files and every commit after the
+ * first changes n_changes of them. Each file of a repo comes from a pool
+ * shared by all repos with the given probability, like the files of
+ * forked or copied libraries, otherwise its content is unique. Garbage
+ * blocks, referenced by no file, are added until they are the given
+ * ratio of all blocks.
+ *
+ * The generator knows which blocks are live, so after GC it is checked
+ * that none of them were removed, and the dead blocks that are left are
+ * counted. In normal and incremental mode the bloom filter's false
+ * positives leave some dead blocks; in exact mode there should be none.
+ *
+ * Each mode runs on a freshly generated store. Incremental mode runs
+ * twice: the first, without a checkpoint, is a full GC; the second runs
+ * from its checkpoint after some repos got a new commit, some were
+ * deleted and more garbage was added. Blocks of the deleted repos are
+ * kept by that run, until the next full GC. verify_repos() is run after
+ * every GC.
+ *
+ * For each run the wall time, the memory added at the peak, the blocks
+ * removed and left, and the calls into the backends are printed, as
+ * JSON objects with -j. With -g, only the store is generated, in the
+ * given dir, for use with seafserv-gc.
+ */
+
+#include "common.h"
+#include "log.h"
+
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <ccnet.h>
+
+#include "utils.h"
+#include "seafile-session.h"
+#include "backend-stats.h"
+#include "obj-store.h"
+#include "gc-core.h"
+#include "verify.h"
+
+#define DIR_FILES 100
+
+CcnetClient *ccnet_client;
+SeafileSession *seaf;
+
+static struct {
+    int n_repos;
+    int n_files;                /* per repo */
+    int depth;                  /* commits per repo */
+    int n_changes;              /* files changed per commit */
+    double share_ratio;
+    double garbage_ratio;
+    double delete_ratio;        /* of repos, before the incremental run */
+    int file_size;
+    int keep_history_days;      /* -1 (all) or 0 (head only) */
+    int n_threads;
+    const char *conf_file;      /* appended to seafile.conf */
+    gboolean json;
+} opts = { 100, 1000, 10, 100, 0.2, 0.3, 0.1, 8192, -1, 8, NULL, FALSE };
+
+/*
+ * The blocks of every file version are recorded, with the version that
+ * wrote them, or -1 for garbage. Whether a version is live is decided
+ * by the history setting, the repos deleted, and for the shared files,
+ * the number of repos still referring to them.
+ */
+typedef struct Version {
+    int repo;
+    int pool;                   /* shared file, or -1 */
+    gboolean superseded;
+} Version;
+
+typedef struct BlockRecord {
+    char id[41];
+    int version;
+    gboolean was_live;          /* at the last check */
+} BlockRecord;
+
+typedef struct GenRepo {
+    char id[37];
+    char head[41];
+    int n_commits;
+    gboolean deleted;
+    int *cur_version;           /* of each file */
+    gboolean *shared;           /* the first version is from the pool */
+    char (*file_ids)[41];
+    char (*dir_ids)[41];
+    gboolean *dirty;
+} GenRepo;
+
+static GenRepo *repos;
+static GArray *versions;
+static GArray *records;
+static int *pool_version;
+static char (*pool_file_ids)[41];
+static int *pool_refs;
+static int n_garbage;
+
+static guint32 rand_state;
+
+static guint32
+next_rand ()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static gboolean
+rand_chance (double p)
+{
+    return (next_rand () % 1000000) < p * 1000000;
+}
+
+/* Generator */
+
+static void
+fill_content (char *buf, const char *header)
+{
+    int i, n;
+
+    /* The header makes the content unique, the rest is hex digits, so a
+     * block is also a string for calculate_sha1(). */
+    n = MIN ((int)strlen(header), opts.file_size);
+    memcpy (buf, header, n);
+    for (i = n; i < opts.file_size; ++i)
+        buf[i] = "0123456789abcdef"[next_rand () & 0xf];
+    buf[opts.file_size] = '\0';
+}
+
+/* Writes the file and records its blocks for version @v. */
+static int
+write_file (const char *header, char *buf, int v, char *file_id)
+{
+    SeafIndexStream *is;
+    Seafile *seafile;
+    BlockRecord rec;
+    unsigned char sha1[20];
+    int i, ret = -1;
+
+    fill_content (buf, header);
+
+    is = seaf_fs_manager_index_stream_new (seaf->fs_mgr, header,
+                                           opts.file_size, NULL,
+                                           CDC_ALGO_RABIN);
+    if (!is)
+        return -1;
+    if (seaf_fs_manager_index_stream_feed (is, buf, opts.file_size) < 0 ||
+        seaf_fs_manager_index_stream_finish (is, sha1) < 0)
+        goto out;
+    rawdata_to_hex (sha1, file_id, 20);
+
+    seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!seafile)
+        goto out;
+    memset (&rec, 0, sizeof(rec));
+    rec.version = v;
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        memcpy (rec.id, seafile->blk_sha1s[i], 41);
+        g_array_append_val (records, rec);
+    }
+    seafile_unref (seafile);
+    ret = 0;
+
+out:
+    seaf_fs_manager_index_stream_free (is);
+    return ret;
+}
+
+static int
+new_version (int repo, int pool)
+{
+    Version v;
+
+    v.repo = repo;
+    v.pool = pool;
+    v.superseded = FALSE;
+    g_array_append_val (versions, v);
+
+    return versions->len - 1;
+}
+
+/* Write file @f of repo @r as a new version, or as the shared one. */
+static int
+write_repo_file (int r, int f, gboolean shared, char *buf)
+{
+    GenRepo *repo = &repos[r];
+    char header[128];
+    int v;
+
+    if (shared) {
+        if (pool_version[f] < 0) {
+            pool_version[f] = new_version (-1, f);
+            snprintf (header, sizeof(header), "shared file %d\n", f);
+            if (write_file (header, buf, pool_version[f], pool_file_ids[f]) < 0)
+                return -1;
+        }
+        memcpy (repo->file_ids[f], pool_file_ids[f], 41);
+        repo->cur_version[f] = pool_version[f];
+        ++pool_refs[f];
+    } else {
+        v = new_version (r, -1);
+        snprintf (header, sizeof(header), "repo %d file %d commit %d\n",
+                  r, f, repo->n_commits);
+        if (write_file (header, buf, v, repo->file_ids[f]) < 0)
+            return -1;
+        repo->cur_version[f] = v;
+    }
+
+    repo->dirty[f / DIR_FILES] = TRUE;
+    return 0;
+}
+
+/* A changed file's old version is no longer referenced by the head. */
+static void
+supersede_file (int r, int f)
+{
+    GenRepo *repo = &repos[r];
+    Version *v = &g_array_index (versions, Version, repo->cur_version[f]);
+
+    if (opts.keep_history_days != 0)
+        return;
+    if (v->pool >= 0)
+        --pool_refs[v->pool];
+    else
+        v->superseded = TRUE;
+}
+
+static int
+save_dir (GList *entries, char *dir_id)
+{
+    SeafDir *dir;
+    int ret;
+
+    dir = seaf_dir_new (NULL, entries, 0);
+    ret = seaf_dir_save (seaf->fs_mgr, dir);
+    memcpy (dir_id, dir->dir_id, 41);
+    seaf_dir_free (dir);
+
+    return ret;
+}
+
+/* Only the dirs with changed files are saved again. */
+static int
+save_tree (GenRepo *repo, char *root_id)
+{
+    int n_dirs = (opts.n_files + DIR_FILES - 1) / DIR_FILES;
+    GList *entries = NULL;
+    char name[64];
+    int d, f;
+
+    for (d = 0; d < n_dirs; ++d) {
+        if (!repo->dirty[d])
+            continue;
+        /* Prepended in ascending order, so they end up descending. */
+        for (f = d * DIR_FILES; f < MIN ((d + 1) * DIR_FILES, opts.n_files); ++f) {
+            snprintf (name, sizeof(name), "f-%06d", f);
+            entries = g_list_prepend (entries,
+                                      seaf_dirent_new (repo->file_ids[f],
+                                                       S_IFREG | 0644, name));
+        }
+        if (save_dir (entries, repo->dir_ids[d]) < 0)
+            return -1;
+        entries = NULL;
+        repo->dirty[d] = FALSE;
+    }
+
+    for (d = 0; d < n_dirs; ++d) {
+        snprintf (name, sizeof(name), "d-%04d", d);
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (repo->dir_ids[d],
+                                                   S_IFDIR, name));
+    }
+
+    return save_dir (entries, root_id);
+}
+
+static int
+commit_repo (int r)
+{
+    GenRepo *repo = &repos[r];
+    SeafCommit *commit;
+    SeafBranch *branch;
+    char root_id[41], desc[64];
+    int ret = 0;
+
+    if (save_tree (repo, root_id) < 0)
+        return -1;
+
+    /* Older commits a second apart, so that they are in order. */
+    snprintf (desc, sizeof(desc), "Commit %d", repo->n_commits);
+    commit = seaf_commit_new (NULL, repo->id, root_id, "bench",
+                              EMPTY_SHA1, desc,
+                              (guint64)time(NULL) - opts.depth + repo->n_commits);
+    commit->repo_name = g_strdup_printf ("bench-%d", r);
+    commit->repo_desc = g_strdup ("");
+    if (repo->head[0])
+        commit->parent_id = g_strdup (repo->head);
+
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+        fprintf (stderr, "Failed to save commit of repo %s.\n", repo->id);
+        seaf_commit_unref (commit);
+        return -1;
+    }
+
+    branch = seaf_branch_new ("master", repo->id, commit->commit_id);
+    if (repo->head[0])
+        ret = seaf_branch_manager_update_branch (seaf->branch_mgr, branch);
+    else
+        ret = seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+    seaf_branch_unref (branch);
+
+    memcpy (repo->head, commit->commit_id, 41);
+    ++repo->n_commits;
+    seaf_commit_unref (commit);
+
+    return ret;
+}
+
+/* The changed files are consecutive, so no file changes twice. */
+static int
+change_files (int r, char *buf)
+{
+    int start = next_rand () % opts.n_files;
+    int i, f;
+
+    for (i = 0; i < MIN (opts.n_changes, opts.n_files); ++i) {
+        f = (start + i) % opts.n_files;
+        supersede_file (r, f);
+        if (write_repo_file (r, f, FALSE, buf) < 0)
+            return -1;
+    }
+
+    return commit_repo (r);
+}
+
+static int
+add_repo_to_db (GenRepo *repo)
+{
+    char sql[256];
+
+    snprintf (sql, sizeof(sql), "INSERT INTO Repo VALUES ('%s')", repo->id);
+    if (seaf_db_query (seaf->db, sql) < 0)
+        return -1;
+    snprintf (sql, sizeof(sql), "INSERT INTO RepoHead VALUES ('%s', 'master')",
+              repo->id);
+    return seaf_db_query (seaf->db, sql);
+}
+
+static int
+generate_repo (int r, char *buf)
+{
+    GenRepo *repo = &repos[r];
+    int n_dirs = (opts.n_files + DIR_FILES - 1) / DIR_FILES;
+    int f, c;
+
+    gen_uuid_inplace (repo->id);
+    repo->cur_version = g_new0 (int, opts.n_files);
+    repo->shared = g_new0 (gboolean, opts.n_files);
+    repo->file_ids = g_new0 (char[41], opts.n_files);
+    repo->dir_ids = g_new0 (char[41], n_dirs);
+    repo->dirty = g_new0 (gboolean, n_dirs);
+
+    for (f = 0; f < opts.n_files; ++f) {
+        repo->shared[f] = rand_chance (opts.share_ratio);
+        if (write_repo_file (r, f, repo->shared[f], buf) < 0)
+            return -1;
+    }
+    if (commit_repo (r) < 0)
+        return -1;
+
+    for (c = 1; c < opts.depth; ++c)
+        if (change_files (r, buf) < 0)
+            return -1;
+
+    return add_repo_to_db (repo);
+}
+
+static int
+add_garbage (int n, char *buf)
+{
+    BlockRecord rec;
+    BlockHandle *handle;
+    unsigned char sha1[20];
+    char header[64];
+    int i, ret = 0;
+
+    memset (&rec, 0, sizeof(rec));
+    rec.version = -1;
+
+    for (i = 0; i < n && ret == 0; ++i) {
+        snprintf (header, sizeof(header), "garbage %d\n", n_garbage++);
+        fill_content (buf, header);
+        calculate_sha1 (sha1, buf);
+        rawdata_to_hex (sha1, rec.id, 20);
+
+        handle = seaf_block_manager_open_block (seaf->block_mgr, rec.id,
+                                                BLOCK_WRITE);
+        if (!handle)
+            return -1;
+        if (seaf_block_manager_write_block (seaf->block_mgr, handle,
+                                            buf, opts.file_size) < 0 ||
+            seaf_block_manager_close_block (seaf->block_mgr, handle) < 0 ||
+            seaf_block_manager_commit_block (seaf->block_mgr, handle) < 0)
+            ret = -1;
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+
+        g_array_append_val (records, rec);
+    }
+
+    return ret;
+}
+
+/* Garbage to make up the given ratio of the blocks written since @start. */
+static int
+add_garbage_for (guint start, char *buf)
+{
+    guint n = records->len - start;
+
+    return add_garbage ((int)(n * opts.garbage_ratio /
+                              (1 - opts.garbage_ratio)), buf);
+}
+
+static int
+write_config (const char *dir)
+{
+    GString *conf = g_string_new ("[database]\ntype = sqlite\n");
+    char *path, *extra = NULL;
+    int ret = 0;
+
+    g_string_append_printf (conf, "\n[history]\nkeep_days = %d\n",
+                            opts.keep_history_days);
+
+    if (opts.conf_file) {
+        if (!g_file_get_contents (opts.conf_file, &extra, NULL, NULL)) {
+            fprintf (stderr, "Failed to read %s.\n", opts.conf_file);
+            g_string_free (conf, TRUE);
+            return -1;
+        }
+        g_string_append_printf (conf, "\n%s", extra);
+        g_free (extra);
+    }
+
+    path = g_build_filename (dir, "seafile.conf", NULL);
+    if (!g_file_set_contents (path, conf->str, -1, NULL)) {
+        fprintf (stderr, "Failed to write %s.\n", path);
+        ret = -1;
+    }
+
+    g_free (path);
+    g_string_free (conf, TRUE);
+    return ret;
+}
+
+/* The tables that the GC reads, as created by the server. */
+static int
+create_tables ()
+{
+    if (seaf_db_query (seaf->db, "CREATE TABLE IF NOT EXISTS Repo "
+                       "(repo_id CHAR(37) PRIMARY KEY)") < 0 ||
+        seaf_db_query (seaf->db, "CREATE TABLE IF NOT EXISTS RepoHead ("
+                       "repo_id CHAR(37) PRIMARY KEY, "
+                       "branch_name VARCHAR(10))") < 0)
+        return -1;
+
+    return seaf_branch_manager_init (seaf->branch_mgr);
+}
+
+static int
+open_store (const char *dir)
+{
+    char *tmp_dir = g_build_filename (dir, "tmpfiles", NULL);
+    char *log_file = g_build_filename (dir, "gc-bench.log", NULL);
+    int ret = -1;
+
+    if (g_mkdir_with_parents (tmp_dir, 0700) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", tmp_dir);
+        goto out;
+    }
+    if (write_config (dir) < 0)
+        goto out;
+
+    /* Keep the messages of the GC out of the results. */
+    if (seafile_log_init (log_file, "info", "info") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        goto out;
+    }
+
+    seaf = seafile_session_new (dir, ccnet_client);
+    if (!seaf) {
+        fprintf (stderr, "Failed to open store in %s.\n", dir);
+        goto out;
+    }
+    seaf->keep_history_days = opts.keep_history_days;
+
+    if (seaf_fs_manager_init (seaf->fs_mgr) < 0 || create_tables () < 0) {
+        fprintf (stderr, "Failed to init store in %s.\n", dir);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    g_free (tmp_dir);
+    g_free (log_file);
+    return ret;
+}
+
+static void
+reset_generator ()
+{
+    int r;
+
+    for (r = 0; repos && r < opts.n_repos; ++r) {
+        g_free (repos[r].cur_version);
+        g_free (repos[r].shared);
+        g_free (repos[r].file_ids);
+        g_free (repos[r].dir_ids);
+        g_free (repos[r].dirty);
+    }
+    g_free (repos);
+    g_free (pool_version);
+    g_free (pool_file_ids);
+    g_free (pool_refs);
+    if (versions)
+        g_array_free (versions, TRUE);
+    if (records)
+        g_array_free (records, TRUE);
+
+    /* Every store is the same. */
+    rand_state = 1;
+    n_garbage = 0;
+    repos = g_new0 (GenRepo, opts.n_repos);
+    pool_version = g_new (int, opts.n_files);
+    memset (pool_version, 0xff, opts.n_files * sizeof(int));
+    pool_file_ids = g_new0 (char[41], opts.n_files);
+    pool_refs = g_new0 (int, opts.n_files);
+    versions = g_array_new (FALSE, FALSE, sizeof(Version));
+    records = g_array_new (FALSE, FALSE, sizeof(BlockRecord));
+}
+
+static void print_generated (const char *what, gint64 usec);
+
+static int
+generate_store (const char *dir)
+{
+    char *buf = g_malloc (opts.file_size + 1);
+    gint64 start = get_current_time ();
+    int r, ret = 0;
+
+    reset_generator ();
+    if (open_store (dir) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    for (r = 0; r < opts.n_repos && ret == 0; ++r)
+        ret = generate_repo (r, buf);
+    if (ret == 0)
+        ret = add_garbage_for (0, buf);
+    if (ret < 0) {
+        fprintf (stderr, "Failed to generate store in %s.\n", dir);
+        goto out;
+    }
+
+    print_generated ("generate", get_current_time () - start);
+
+out:
+    g_free (buf);
+    return ret;
+}
+
+/* Give some repos a new commit, delete some others and add garbage. */
+static int
+mutate_store ()
+{
+    char *buf = g_malloc (opts.file_size + 1);
+    guint start = records->len;
+    gint64 t = get_current_time ();
+    char sql[256];
+    int r, f, ret = 0;
+
+    for (r = 0; r < opts.n_repos && ret == 0; ++r) {
+        GenRepo *repo = &repos[r];
+
+        if (rand_chance (opts.delete_ratio)) {
+            snprintf (sql, sizeof(sql), "DELETE FROM Repo WHERE repo_id='%s'",
+                      repo->id);
+            ret = seaf_db_query (seaf->db, sql);
+            repo->deleted = TRUE;
+            for (f = 0; f < opts.n_files; ++f)
+                if (repo->shared[f] && (opts.keep_history_days != 0 ||
+                                        repo->cur_version[f] == pool_version[f]))
+                    --pool_refs[f];
+        } else if (rand_chance (0.5)) {
+            ret = change_files (r, buf);
+        }
+    }
+    if (ret == 0)
+        ret = add_garbage_for (start, buf);
+    if (ret < 0)
+        fprintf (stderr, "Failed to change store.\n");
+    else
+        print_generated ("mutate", get_current_time () - t);
+
+    g_free (buf);
+    return ret;
+}
+
+static gboolean
+is_live (BlockRecord *rec)
+{
+    Version *v;
+
+    if (rec->version < 0)
+        return FALSE;
+    v = &g_array_index (versions, Version, rec->version);
+    if (v->pool >= 0)
+        return pool_refs[v->pool] > 0;
+    return !repos[v->repo].deleted && !v->superseded;
+}
+
+/* Harness */
+
+typedef struct CheckResult {
+    guint64 live;
+    guint64 dead;
+    guint64 live_missing;
+    guint64 dead_kept;
+    guint64 new_dead;           /* died since the last check */
+    guint64 new_dead_kept;
+} CheckResult;
+
+/*
+ * Existence is only checked after a GC, which these results are of: the
+ * blocks that died since are counted in new_dead.
+ */
+static void
+check_blocks (CheckResult *res, gboolean after_gc)
+{
+    GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+    BlockRecord *rec;
+    gboolean live, exists;
+    guint i;
+
+    memset (res, 0, sizeof(*res));
+
+    for (i = 0; i < records->len; ++i) {
+        rec = &g_array_index (records, BlockRecord, i);
+        /* A shared block is recorded once, but its content could still
+         * repeat; count each id once. */
+        if (g_hash_table_lookup (seen, rec->id))
+            continue;
+        g_hash_table_insert (seen, rec->id, rec);
+
+        live = is_live (rec);
+        if (!after_gc) {
+            if (live)
+                ++res->live;
+            else
+                ++res->dead;
+            continue;
+        }
+
+        exists = seaf_block_manager_block_exists (seaf->block_mgr, rec->id);
+        if (live) {
+            ++res->live;
+            if (!exists)
+                ++res->live_missing;
+        } else {
+            ++res->dead;
+            if (exists)
+                ++res->dead_kept;
+            if (rec->was_live) {
+                ++res->new_dead;
+                if (exists)
+                    ++res->new_dead_kept;
+            }
+        }
+        rec->was_live = live;
+    }
+
+    g_hash_table_destroy (seen);
+}
+
+static guint64
+read_status_kb (const char *key)
+{
+    char line[256];
+    guint64 value = 0;
+    int len = strlen (key);
+    FILE *fp;
+
+    fp = fopen ("/proc/self/status", "r");
+    if (!fp)
+        return 0;
+    while (fgets (line, sizeof(line), fp)) {
+        if (strncmp (line, key, len) == 0 && line[len] == ':') {
+            value = g_ascii_strtoull (line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose (fp);
+
+    return value;
+}
+
+/* So that VmHWM is the peak of the next run only. Needs Linux 4.0. */
+static void
+reset_peak_rss ()
+{
+    int fd = open ("/proc/self/clear_refs", O_WRONLY);
+
+    if (fd < 0)
+        return;
+    if (write (fd, "5", 1) != 1)
+        seaf_debug ("Can't reset peak RSS, it's since the start.\n");
+    close (fd);
+}
+
+#define N_STORES 3
+static const char *store_names[N_STORES] = { "fs", "commits", "blocks" };
+
+static void
+get_store_stats (BackendStats **stats)
+{
+    stats[0] = seaf_obj_store_get_backend_stats (seaf->fs_mgr->obj_store);
+    stats[1] = seaf_obj_store_get_backend_stats (seaf->commit_mgr->obj_store);
+    stats[2] = seaf->block_mgr->stats;
+}
+
+static void
+reset_backend_stats ()
+{
+    BackendStats *stats[N_STORES];
+    BackendOpStats st;
+    int i, op;
+
+    get_store_stats (stats);
+    for (i = 0; i < N_STORES; ++i)
+        for (op = 0; stats[i] && op < N_BACKEND_OPS; ++op)
+            backend_stats_get (stats[i], op, &st, TRUE);
+}
+
+/* Append the count of each op that was called, as "<store>_<op>". */
+static void
+append_backend_ops (GString *buf)
+{
+    BackendStats *stats[N_STORES];
+    BackendOpStats st;
+    int i, op;
+
+    get_store_stats (stats);
+    for (i = 0; i < N_STORES; ++i) {
+        for (op = 0; stats[i] && op < N_BACKEND_OPS; ++op) {
+            backend_stats_get (stats[i], op, &st, TRUE);
+            if (st.n_ops == 0)
+                continue;
+            if (opts.json)
+                g_string_append_printf (buf, ", \"%s_%s\": %"G_GUINT64_FORMAT,
+                                        store_names[i],
+                                        backend_stats_op_name (op), st.n_ops);
+            else
+                g_string_append_printf (buf, " %s_%s=%"G_GUINT64_FORMAT,
+                                        store_names[i],
+                                        backend_stats_op_name (op), st.n_ops);
+        }
+    }
+}
+
+static void
+print_generated (const char *what, gint64 usec)
+{
+    CheckResult res;
+
+    check_blocks (&res, FALSE);
+
+    if (opts.json) {
+        printf ("{\"bench\": \"%s\", \"repos\": %d, \"versions\": %u, "
+                "\"live_blocks\": %"G_GUINT64_FORMAT", "
+                "\"dead_blocks\": %"G_GUINT64_FORMAT", \"seconds\": %.3f}\n",
+                what, opts.n_repos, versions->len, res.live, res.dead,
+                usec / 1e6);
+        return;
+    }
+
+    printf ("%-18s %d repos, %u file versions, %"G_GUINT64_FORMAT" live, "
+            "%"G_GUINT64_FORMAT" dead blocks in %.3fs\n",
+            what, opts.n_repos, versions->len, res.live, res.dead,
+            usec / 1e6);
+}
+
+/* Returns -1 if the run failed or removed live blocks. */
+static int
+run_gc (const char *name, GCMode mode)
+{
+    GCOptions options;
+    GCProgress progress;
+    CheckResult res;
+    GString *ops = g_string_new ("");
+    guint64 base_kb, peak_kb;
+    gint64 start, gc_usec, verify_usec;
+    int ret, verify_ret;
+
+    memset (&options, 0, sizeof(options));
+    options.n_threads = opts.n_threads;
+    options.mode = mode;
+
+    reset_backend_stats ();
+    reset_peak_rss ();
+    base_kb = read_status_kb ("VmRSS");
+
+    start = get_current_time ();
+    ret = gc_core_run (&options);
+    gc_usec = get_current_time () - start;
+
+    peak_kb = read_status_kb ("VmHWM");
+    gc_core_get_progress (&progress);
+    append_backend_ops (ops);
+
+    start = get_current_time ();
+    verify_ret = verify_repos (opts.n_threads, FALSE);
+    verify_usec = get_current_time () - start;
+    reset_backend_stats ();
+
+    check_blocks (&res, TRUE);
+
+    if (opts.json) {
+        printf ("{\"bench\": \"%s\", \"ok\": %s, \"seconds\": %.3f, "
+                "\"verify_seconds\": %.3f, \"peak_rss_delta_kb\": %"
+                G_GUINT64_FORMAT", \"objects_visited\": %"G_GUINT64_FORMAT", "
+                "\"blocks_removed\": %"G_GUINT64_FORMAT", "
+                "\"live_blocks\": %"G_GUINT64_FORMAT", "
+                "\"live_missing\": %"G_GUINT64_FORMAT", "
+                "\"dead_blocks\": %"G_GUINT64_FORMAT", "
+                "\"dead_kept\": %"G_GUINT64_FORMAT", \"loss\": %.4f, "
+                "\"new_dead_kept\": %"G_GUINT64_FORMAT"%s}\n",
+                name, (ret == 0 && verify_ret == 0) ? "true" : "false",
+                gc_usec / 1e6, verify_usec / 1e6,
+                peak_kb > base_kb ? peak_kb - base_kb : 0,
+                progress.objects_visited, progress.blocks_removed,
+                res.live, res.live_missing, res.dead, res.dead_kept,
+                res.dead ? (double)res.dead_kept / res.dead : 0.0,
+                res.new_dead_kept, ops->str);
+    } else {
+        printf ("%-18s %s: gc %.3fs, verify %.3fs, peak +%"G_GUINT64_FORMAT
+                " kB, %"G_GUINT64_FORMAT" objects, %"G_GUINT64_FORMAT
+                " removed, %"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT
+                " dead kept (%.2f%%, %"G_GUINT64_FORMAT" died since last "
+                "run), %"G_GUINT64_FORMAT" live missing\n"
+                "%-18s backend ops:%s\n",
+                name, (ret == 0 && verify_ret == 0) ? "ok" : "FAILED",
+                gc_usec / 1e6, verify_usec / 1e6,
+                peak_kb > base_kb ? peak_kb - base_kb : 0,
+                progress.objects_visited, progress.blocks_removed,
+                res.dead_kept, res.dead,
+                res.dead ? 100.0 * res.dead_kept / res.dead : 0.0,
+                res.new_dead_kept, res.live_missing, "", ops->str);
+    }
+
+    g_string_free (ops, TRUE);
+
+    if (res.live_missing > 0) {
+        fprintf (stderr, "%s removed %"G_GUINT64_FORMAT" live blocks.\n",
+                 name, res.live_missing);
+        return -1;
+    }
+    return (ret < 0 || verify_ret < 0) ? -1 : 0;
+}
+
+static int
+run_mode (const char *tmp_dir, const char *mode)
+{
+    char *dir;
+    int ret = -1;
+
+    dir = g_strdup_printf ("%s/gc-bench-%s-XXXXXX", tmp_dir, mode);
+    if (!mkdtemp (dir)) {
+        fprintf (stderr, "Failed to create temp dir in %s.\n", tmp_dir);
+        g_free (dir);
+        return -1;
+    }
+
+    if (generate_store (dir) < 0)
+        goto out;
+
+    if (strcmp (mode, "normal") == 0) {
+        ret = run_gc ("normal", GC_MODE_NORMAL);
+    } else if (strcmp (mode, "exact") == 0) {
+        ret = run_gc ("exact", GC_MODE_EXACT);
+    } else {
+        if (run_gc ("incremental-full", GC_MODE_INCREMENTAL) < 0 ||
+            mutate_store () < 0)
+            goto out;
+        ret = run_gc ("incremental", GC_MODE_INCREMENTAL);
+    }
+
+out:
+    if (!opts.json)
+        printf ("%s store left in %s\n", mode, dir);
+    g_free (dir);
+    return ret;
+}
+
+static void
+usage ()
+{
+    fprintf (stderr,
+             "usage: seafserv-gc-bench [-m normal|exact|incremental] "
+             "[-d tmpdir] [-g dir]\n"
+             "    [-R repos] [-F files] [-D depth] [-c changes] "
+             "[-S share_ratio] [-G garbage_ratio]\n"
+             "    [-x delete_ratio] [-s file_size] [-k keep_days] "
+             "[-t threads] [-C conf] [-j]\n"
+             "  -m  only run this mode; all of them run by default\n"
+             "  -g  only generate a store in dir\n"
+             "  -k  -1 to keep all history, 0 to keep the head only\n"
+             "  -C  append this file to the generated seafile.conf\n"
+             "  -j  print results as JSON, one object per line\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+    static const char *modes[] = { "normal", "exact", "incremental" };
+    const char *tmp_dir = g_get_tmp_dir ();
+    const char *mode = NULL, *gen_dir = NULL;
+    int c, i, ret = 0;
+
+    while ((c = getopt (argc, argv, "hm:d:g:R:F:D:c:S:G:x:s:k:t:C:j")) != EOF) {
+        switch (c) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'd':
+            tmp_dir = optarg;
+            break;
+        case 'g':
+            gen_dir = optarg;
+            break;
+        case 'R':
+            opts.n_repos = atoi (optarg);
+            break;
+        case 'F':
+            opts.n_files = atoi (optarg);
+            break;
+        case 'D':
+            opts.depth = atoi (optarg);
+            break;
+        case 'c':
+            opts.n_changes = atoi (optarg);
+            break;
+        case 'S':
+            opts.share_ratio = g_ascii_strtod (optarg, NULL);
+            break;
+        case 'G':
+            opts.garbage_ratio = g_ascii_strtod (optarg, NULL);
+            break;
+        case 'x':
+            opts.delete_ratio = g_ascii_strtod (optarg, NULL);
+            break;
+        case 's':
+            opts.file_size = atoi (optarg);
+            break;
+        case 'k':
+            opts.keep_history_days = atoi (optarg);
+            break;
+        case 't':
+            opts.n_threads = atoi (optarg);
+            break;
+        case 'C':
+            opts.conf_file = optarg;
+            break;
+        case 'j':
+            opts.json = TRUE;
+            break;
+        default:
+            usage ();
+            exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    if (opts.n_repos <= 0 || opts.n_files <= 0 || opts.depth <= 0 ||
+        opts.n_changes < 0 || opts.file_size <= 0 || opts.n_threads <= 0 ||
+        opts.share_ratio < 0 || opts.share_ratio > 1 ||
+        opts.garbage_ratio < 0 || opts.garbage_ratio >= 1 ||
+        opts.delete_ratio < 0 || opts.delete_ratio > 1 ||
+        (opts.keep_history_days != -1 && opts.keep_history_days != 0) ||
+        (mode && strcmp (mode, "normal") != 0 &&
+         strcmp (mode, "exact") != 0 && strcmp (mode, "incremental") != 0)) {
+        usage ();
+        exit (1);
+    }
+
+    g_type_init ();
+#if !GLIB_CHECK_VERSION(2,32,0)
+    g_thread_init (NULL);
+#endif
+
+    /* Only needed for the session, no daemon is connected to. */
+    ccnet_client = ccnet_client_new ();
+
+    if (gen_dir) {
+        if (checkdir_with_mkdir (gen_dir) < 0) {
+            fprintf (stderr, "Failed to create %s.\n", gen_dir);
+            exit (1);
+        }
+        return generate_store (gen_dir) < 0 ? 1 : 0;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(modes); ++i) {
+        if (mode && strcmp (mode, modes[i]) != 0)
+            continue;
+        if (run_mode (tmp_dir, modes[i]) < 0)
+            ret = 1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,177 @@
+#include "common.h"
+
+#include "seafile-session.h"
+#include "obj-id-set.h"
+#include "rate-limiter.h"
+#include "gc-core.h"
+#include "log.h"
+
+#include "reclaim.h"
+
+/*
+ * seaf-server purges the metadata of deleted repos in the background,
+ * and keeps their heads in GarbageRepoHeads. The blocks of their history
+ * are the candidates of a GC run that checks no other block, but still
+ * traverses the live repos, so that blocks shared with forks or copies
+ * are kept.
+ *
+ * The candidates of a run are limited to MAX_CANDIDATES blocks, the rest
+ * of the repos wait for the next run. A full GC reclaims the blocks of
+ * repos that can't be traversed.
+ */
+#define MAX_CANDIDATES 1000000
+
+typedef struct ReclaimData {
+    GHashTable  *candidates;
+    ObjIdSet    *visited;
+    RateLimiter *limiter;
+} ReclaimData;
+
+static gboolean
+collect_heads (SeafDBRow *row, void *vheads)
+{
+    GHashTable *heads = vheads;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+    GList *list;
+
+    list = g_hash_table_lookup (heads, repo_id);
+    list = g_list_prepend (list, g_strdup (commit_id));
+    g_hash_table_replace (heads, g_strdup (repo_id), list);
+
+    return TRUE;
+}
+
+static void
+free_head_list (gpointer list)
+{
+    string_list_free ((GList *)list);
+}
+
+static gboolean
+add_fs_blocks (SeafFSManager *mgr, const char *obj_id, int type,
+               void *vdata, gboolean *stop)
+{
+    ReclaimData *data = vdata;
+    Seafile *file;
+    int i;
+
+    if (!obj_id_set_add (data->visited, obj_id)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+    rate_limiter_acquire (data->limiter, 1);
+
+    if (type != SEAF_METADATA_TYPE_FILE)
+        return TRUE;
+
+    file = seaf_fs_manager_get_seafile (mgr, obj_id);
+    if (!file) {
+        seaf_warning ("Failed to find file %s.\n", obj_id);
+        return FALSE;
+    }
+    for (i = 0; i < file->n_blocks; ++i)
+        g_hash_table_insert (data->candidates, g_strdup (file->blk_sha1s[i]),
+                             GINT_TO_POINTER(1));
+    seafile_unref (file);
+
+    return TRUE;
+}
+
+static gboolean
+add_commit_blocks (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    ReclaimData *data = vdata;
+
+    rate_limiter_acquire (data->limiter, 1);
+    if (seaf_fs_manager_traverse_tree (seaf->fs_mgr, commit->root_id,
+                                       add_fs_blocks, data) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+static void
+remove_garbage_heads (GList *repo_ids)
+{
+    GList *ptr;
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        if (seaf_db_statement_query (seaf->db,
+                                     "DELETE FROM GarbageRepoHeads "
+                                     "WHERE repo_id = ?",
+                                     1, "string", (char *)ptr->data) < 0)
+            seaf_warning ("Failed to remove heads of deleted repo %s.\n",
+                          (char *)ptr->data);
+    }
+}
+
+int
+reclaim_deleted_repos (const GCOptions *base_options)
+{
+    GHashTable *heads;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *done = NULL, *ptr;
+    ReclaimData data;
+    GCOptions options;
+    GCProgress progress;
+    int ret = 0;
+
+    heads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, free_head_list);
+    if (seaf_db_foreach_selected_row (seaf->db,
+                                      "SELECT repo_id, commit_id "
+                                      "FROM GarbageRepoHeads",
+                                      collect_heads, heads) < 0) {
+        g_hash_table_destroy (heads);
+        return -1;
+    }
+
+    memset (&data, 0, sizeof(data));
+    data.candidates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    data.visited = obj_id_set_new ();
+    data.limiter = rate_limiter_new (base_options->traverse_iops);
+
+    g_hash_table_iter_init (&iter, heads);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (g_hash_table_size (data.candidates) >= MAX_CANDIDATES)
+            break;
+
+        for (ptr = value; ptr; ptr = ptr->next) {
+            if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                           ptr->data,
+                                                           add_commit_blocks,
+                                                           &data))
+                seaf_warning ("Failed to traverse deleted repo %s, its blocks "
+                              "are left to the full GC.\n", (char *)key);
+        }
+        done = g_list_prepend (done, key);
+    }
+
+    g_message ("%u deleted repos, %u blocks to check.\n",
+               g_list_length (done), g_hash_table_size (data.candidates));
+
+    if (g_hash_table_size (data.candidates) > 0) {
+        options = *base_options;
+        options.mode = GC_MODE_CANDIDATES;
+        options.candidates = data.candidates;
+        ret = gc_core_run (&options);
+
+        /* The repos are done again by the next run if this one stopped. */
+        gc_core_get_progress (&progress);
+        if (progress.phase != GC_PHASE_DONE)
+            goto out;
+    }
+
+    remove_garbage_heads (done);
+
+out:
+    g_list_free (done);
+    rate_limiter_free (data.limiter);
+    obj_id_set_free (data.visited);
+    g_hash_table_destroy (data.candidates);
+    g_hash_table_destroy (heads);
+    return ret;
+}
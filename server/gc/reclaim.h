@@ -0,0 +1,10 @@
+#ifndef GC_RECLAIM_H
+#define GC_RECLAIM_H
+
+#include "gc-core.h"
+
+/* Remove the blocks only used by the repos deleted since the last run,
+ * with the limits of @options. */
+int reclaim_deleted_repos (const GCOptions *options);
+
+#endif
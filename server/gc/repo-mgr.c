@@ -104,6 +104,8 @@ seaf_repo_from_commit (SeafRepo *repo, SeafCommit *commit)
             memcpy (repo->magic, commit->magic, 33);
     }
     repo->no_local_history = commit->no_local_history;
+    repo->chunker = chunker_with_policy (commit->chunker,
+                                         commit->chunk_policy);
 }
 
 void
@@ -118,6 +120,8 @@ seaf_repo_to_commit (SeafRepo *repo, SeafCommit *commit)
             commit->magic = g_strdup (repo->magic);
     }
     commit->no_local_history = repo->no_local_history;
+    commit->chunker = CHUNKER_ALGO (repo->chunker);
+    commit->chunk_policy = g_strdup (chunker_get_policy (repo->chunker));
 }
 
 static gboolean
@@ -32,6 +32,8 @@ struct _SeafileSession {
     SeafRepoManager     *repo_mgr;
 
     int                  keep_history_days;
+    int                  compact_after_days;
+    int                  compact_hourly_days;
 };
 
 extern SeafileSession *seaf;
@@ -2,12 +2,21 @@
 #include "log.h"
 
 #include <getopt.h>
+#include <pthread.h>
 
 #include <ccnet.h>
 
 #include "seafile-session.h"
 #include "gc-core.h"
 #include "verify.h"
+#include "fsck.h"
+#include "reclaim.h"
+#include "history-compact.h"
+
+#define DEFAULT_THREADS 8
+
+/* Seconds between updates of the status file. */
+#define STATUS_INTERVAL 5
 
 static char *config_dir = NULL;
 static char *seafile_dir = NULL;
@@ -15,13 +24,22 @@ static char *seafile_dir = NULL;
 CcnetClient *ccnet_client;
 SeafileSession *seaf;
 
-static const char *short_opts = "hvc:d:V";
+static const char *short_opts = "hvc:d:Vt:eirFRDo";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
     { "config-file", required_argument, NULL, 'c', },
     { "seafdir", required_argument, NULL, 'd', },
     { "verify", no_argument, NULL, 'V' },
+    { "threads", required_argument, NULL, 't' },
+    { "exact", no_argument, NULL, 'e' },
+    { "incremental", no_argument, NULL, 'i' },
+    { "resume", no_argument, NULL, 'r' },
+    { "fsck", no_argument, NULL, 'F' },
+    { "repair", no_argument, NULL, 'R' },
+    { "deleted", no_argument, NULL, 'D' },
+    { "objects", no_argument, NULL, 'o' },
+    { 0, 0, 0, 0 },
 };
 
 static void usage ()
@@ -29,7 +47,23 @@ static void usage ()
     fprintf (stderr,
              "usage: seafserv-gc [-c config_dir] [-d seafile_dir]\n"
              "Additional options:\n"
-             "-V, --verify: check for missing blocks\n");
+             "-V, --verify: check for missing blocks\n"
+             "-F, --fsck: check that all commits, fs objects and blocks "
+             "exist and match their ids\n"
+             "-R, --repair: with -F, reset damaged branches to their last "
+             "intact commit, run it with the server stopped\n"
+             "-r, --resume: with -V or -F, skip repos checked by the last "
+             "unfinished run\n"
+             "-t, --threads <n>: number of threads, defaults to %d\n"
+             "-e, --exact: remove all unused blocks, using temp files "
+             "instead of a bloom filter\n"
+             "-i, --incremental: only check data added since the last "
+             "incremental run, with a full run every week\n"
+             "-D, --deleted: only remove the blocks of libraries deleted "
+             "since the last run\n"
+             "-o, --objects: also remove unused commits and fs objects, "
+             "run it with the server stopped\n",
+             DEFAULT_THREADS);
 }
 
 static void
@@ -48,6 +82,82 @@ load_history_config ()
         keep_history_days = 0;
     if (error == NULL)
         seaf->keep_history_days = keep_history_days;
+    g_clear_error (&error);
+
+    /* See history-compact.h. */
+    seaf->compact_after_days = g_key_file_get_integer (seaf->config, "history",
+                                                       "compact_after_days",
+                                                       NULL);
+    seaf->compact_hourly_days = g_key_file_get_integer (seaf->config, "history",
+                                                        "compact_hourly_days",
+                                                        NULL);
+    if (seaf->compact_hourly_days <= 0)
+        seaf->compact_hourly_days = DEFAULT_COMPACT_HOURLY_DAYS;
+}
+
+/*
+ * Optional limits in the [gc] section of seafile.conf:
+ * traverse_iops, sweep_iops, sweep_bandwidth (MB/s) and
+ * max_run_time (minutes).
+ */
+static void
+load_gc_config (GCOptions *options)
+{
+    options->traverse_iops = g_key_file_get_integer (seaf->config, "gc",
+                                                     "traverse_iops", NULL);
+    options->sweep_iops = g_key_file_get_integer (seaf->config, "gc",
+                                                  "sweep_iops", NULL);
+    options->sweep_bandwidth = (gint64)g_key_file_get_integer (seaf->config, "gc",
+                                                               "sweep_bandwidth",
+                                                               NULL) << 20;
+    options->max_run_time = g_key_file_get_integer (seaf->config, "gc",
+                                                    "max_run_time", NULL) * 60;
+}
+
+/*
+ * Progress is written to <seafile-data>/gc-status, where the server
+ * reads it for the seafile_get_gc_stats RPC, or to fsck-status.
+ */
+static volatile gboolean gc_done = FALSE;
+static gboolean fsck = FALSE;
+
+static void
+write_gc_status ()
+{
+    GCProgress progress;
+    FsckProgress fsck_progress;
+    char *status, *path;
+
+    if (fsck) {
+        fsck_get_progress (&fsck_progress);
+        status = fsck_format_progress (&fsck_progress);
+    } else {
+        gc_core_get_progress (&progress);
+        status = gc_core_format_progress (&progress);
+    }
+
+    /* Replaced atomically. */
+    path = g_build_filename (seaf->seaf_dir,
+                             fsck ? "fsck-status" : "gc-status", NULL);
+    if (!g_file_set_contents (path, status, -1, NULL))
+        g_warning ("Failed to write %s.\n", path);
+
+    g_free (path);
+    g_free (status);
+}
+
+static void *
+status_thread (void *arg)
+{
+    int i;
+
+    while (!gc_done) {
+        write_gc_status ();
+        for (i = 0; i < STATUS_INTERVAL && !gc_done; ++i)
+            sleep (1);
+    }
+
+    return NULL;
 }
 
 int
@@ -55,6 +165,13 @@ main(int argc, char *argv[])
 {
     int c;
     int verify = 0;
+    gboolean resume = FALSE, repair = FALSE, deleted = FALSE;
+    gboolean remove_objects = FALSE;
+    int ret;
+    int n_threads = DEFAULT_THREADS;
+    GCMode mode = GC_MODE_NORMAL;
+    GCOptions options;
+    pthread_t status_tid;
 
     config_dir = DEFAULT_CONFIG_DIR;
 
@@ -76,6 +193,32 @@ main(int argc, char *argv[])
         case 'V':
             verify = 1;
             break;
+        case 't':
+            n_threads = atoi(optarg);
+            if (n_threads <= 0)
+                n_threads = 1;
+            break;
+        case 'e':
+            mode = GC_MODE_EXACT;
+            break;
+        case 'i':
+            mode = GC_MODE_INCREMENTAL;
+            break;
+        case 'r':
+            resume = TRUE;
+            break;
+        case 'F':
+            fsck = TRUE;
+            break;
+        case 'R':
+            repair = TRUE;
+            break;
+        case 'D':
+            deleted = TRUE;
+            break;
+        case 'o':
+            remove_objects = TRUE;
+            break;
         default:
             usage();
             exit(-1);
@@ -83,6 +226,9 @@ main(int argc, char *argv[])
     }
 
     g_type_init();
+    /* Verify and fsck check blocks in a GThreadPool. */
+    if (!g_thread_supported ())
+        g_thread_init (NULL);
 
     ccnet_client = ccnet_client_new();
     if ((ccnet_client_load_confdir(ccnet_client, config_dir)) < 0) {
@@ -102,11 +248,42 @@ main(int argc, char *argv[])
     load_history_config ();
 
     if (verify) {
-        verify_repos ();
+        if (verify_repos (n_threads, resume) < 0)
+            return 1;
         return 0;
     }
 
-    gc_core_run ();
+    if (fsck) {
+        if (pthread_create (&status_tid, NULL, status_thread, NULL) != 0) {
+            g_warning ("Failed to start status thread.\n");
+            exit (1);
+        }
+        ret = fsck_repos (n_threads, resume, repair);
+        gc_done = TRUE;
+        pthread_join (status_tid, NULL);
+        write_gc_status ();
+        return (ret < 0) ? 1 : 0;
+    }
+
+    memset (&options, 0, sizeof(options));
+    options.n_threads = n_threads;
+    options.mode = mode;
+    options.remove_objects = remove_objects;
+    load_gc_config (&options);
+
+    if (pthread_create (&status_tid, NULL, status_thread, NULL) != 0) {
+        g_warning ("Failed to start status thread.\n");
+        exit (1);
+    }
+
+    if (deleted)
+        reclaim_deleted_repos (&options);
+    else
+        gc_core_run (&options);
+
+    gc_done = TRUE;
+    pthread_join (status_tid, NULL);
+    write_gc_status ();
 
     return 0;
 }
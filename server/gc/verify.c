@@ -1,13 +1,111 @@
+#include <pthread.h>
+#include <glib/gstdio.h>
+
 #include "seafile-session.h"
+#include "obj-id-set.h"
+#include "history-compact.h"
 #include "log.h"
 
+/*
+ * Repos are traversed by several threads. The blocks found are checked
+ * in batches by a pool of threads, so large repos are checked in parallel
+ * too. Fs objects and blocks are checked only once across all repos.
+ *
+ * The ids of verified repos are appended to a checkpoint file, so that a
+ * stopped run can be resumed. It's removed when all repos are verified.
+ */
+#define CHECK_BATCH_SIZE 256
+#define CHECKPOINT_FILE "verify-checkpoint"
+
+typedef struct VerifyShared {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    GList           *next_repo;
+    GHashTable      *done_repos;    /* from the checkpoint */
+    FILE            *checkpoint;
+
+    ObjIdSet        *visited;       /* fs objects */
+    ObjIdSet        *checked;       /* blocks */
+
+    GThreadPool     *check_pool;
+    int             pending;        /* batches queued or being checked */
+    int             max_pending;
+
+    guint64         n_checked;
+    guint64         n_missing;
+    int             n_failed;
+} VerifyShared;
+
 typedef struct VerifyData {
+    VerifyShared *shared;
+    SeafRepo *repo;
+    struct CheckBatch *batch;
+    int pending;                    /* batches of this repo */
     gint64 truncate_time;
     gboolean traversed_head;
+    HistoryCompactor compactor;
 } VerifyData;
 
+typedef struct CheckBatch {
+    VerifyData *owner;
+    int n;
+    char *block_ids[CHECK_BATCH_SIZE];
+} CheckBatch;
+
+static void
+check_batch (gpointer vbatch, gpointer vshared)
+{
+    CheckBatch *batch = vbatch;
+    VerifyShared *shared = vshared;
+    VerifyData *owner = batch->owner;
+    gboolean exists[CHECK_BATCH_SIZE];
+    int i;
+
+    seaf_block_manager_blocks_exist (seaf->block_mgr,
+                                     (const char **)batch->block_ids,
+                                     batch->n, exists);
+
+    for (i = 0; i < batch->n; ++i) {
+        if (!exists[i]) {
+            g_message ("Block %s of repo %s is missing.\n",
+                       batch->block_ids[i], owner->repo->id);
+            __sync_fetch_and_add (&shared->n_missing, 1);
+        }
+        g_free (batch->block_ids[i]);
+    }
+    __sync_fetch_and_add (&shared->n_checked, batch->n);
+    g_free (batch);
+
+    pthread_mutex_lock (&shared->lock);
+    --shared->pending;
+    --owner->pending;
+    pthread_cond_broadcast (&shared->cond);
+    pthread_mutex_unlock (&shared->lock);
+}
+
+static void
+submit_batch (VerifyData *data)
+{
+    VerifyShared *shared = data->shared;
+    CheckBatch *batch = data->batch;
+
+    data->batch = NULL;
+    if (!batch)
+        return;
+
+    /* Keep the traversal from running too far ahead of the checks. */
+    pthread_mutex_lock (&shared->lock);
+    while (shared->pending >= shared->max_pending)
+        pthread_cond_wait (&shared->cond, &shared->lock);
+    ++shared->pending;
+    ++data->pending;
+    pthread_mutex_unlock (&shared->lock);
+
+    g_thread_pool_push (shared->check_pool, batch, NULL);
+}
+
 static int
-check_blocks (SeafFSManager *mgr, const char *file_id)
+check_blocks (SeafFSManager *mgr, VerifyData *data, const char *file_id)
 {
     Seafile *seafile;
     int i;
@@ -19,9 +117,16 @@ check_blocks (SeafFSManager *mgr, const char *file_id)
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        if (!seaf_block_manager_block_exists (seaf->block_mgr,
-                                              seafile->blk_sha1s[i]))
-            g_message ("Block %s is missing.\n", seafile->blk_sha1s[i]);
+        if (!obj_id_set_add (data->shared->checked, seafile->blk_sha1s[i]))
+            continue;
+
+        if (!data->batch) {
+            data->batch = g_new0 (CheckBatch, 1);
+            data->batch->owner = data;
+        }
+        data->batch->block_ids[data->batch->n++] = g_strdup (seafile->blk_sha1s[i]);
+        if (data->batch->n == CHECK_BATCH_SIZE)
+            submit_batch (data);
     }
 
     seafile_unref (seafile);
@@ -36,7 +141,15 @@ fs_callback (SeafFSManager *mgr,
              void *user_data,
              gboolean *stop)
 {
-    if (type == SEAF_METADATA_TYPE_FILE && check_blocks (mgr, obj_id) < 0)
+    VerifyData *data = user_data;
+
+    /* Already checked as part of this or another repo. */
+    if (!obj_id_set_add (data->shared->visited, obj_id)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    if (type == SEAF_METADATA_TYPE_FILE && check_blocks (mgr, data, obj_id) < 0)
         return FALSE;
 
     return TRUE;
@@ -61,6 +174,11 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
         return TRUE;
     }
 
+    /* GC doesn't keep the trees between checkpoints. */
+    if (!history_compactor_keep (&data->compactor, commit->ctime) &&
+        data->traversed_head)
+        return TRUE;
+
     if (!data->traversed_head)
         data->traversed_head = TRUE;
 
@@ -75,15 +193,18 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
 }
 
 static int
-verify_repo (SeafRepo *repo)
+verify_repo (SeafRepo *repo, VerifyShared *shared)
 {
     GList *branches, *ptr;
     SeafBranch *branch;
     int ret = 0;
     VerifyData data = {0};
 
+    data.shared = shared;
+    data.repo = repo;
+
     if (seaf->keep_history_days > 0) {
-        data.truncate_time = 
+        data.truncate_time =
             (gint64)time(NULL) - seaf->keep_history_days * 24 * 3600;
     } else if (seaf->keep_history_days < 0) {
         data.truncate_time = -1;
@@ -97,6 +218,8 @@ verify_repo (SeafRepo *repo)
 
     for (ptr = branches; ptr != NULL; ptr = ptr->next) {
         branch = ptr->data;
+        data.traversed_head = FALSE;
+        history_compactor_init (&data.compactor);
         gboolean res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
                                                                  branch->commit_id,
                                                                  traverse_commit,
@@ -110,22 +233,139 @@ verify_repo (SeafRepo *repo)
 
     g_list_free (branches);
 
+    /* The repo is verified when all its blocks are checked. */
+    submit_batch (&data);
+    pthread_mutex_lock (&shared->lock);
+    while (data.pending > 0)
+        pthread_cond_wait (&shared->cond, &shared->lock);
+    if (ret == 0 && shared->checkpoint) {
+        fprintf (shared->checkpoint, "%s\n", repo->id);
+        fflush (shared->checkpoint);
+    }
+    pthread_mutex_unlock (&shared->lock);
+
     return ret;
 }
 
+static void *
+verify_worker (void *vshared)
+{
+    VerifyShared *shared = vshared;
+    SeafRepo *repo;
+
+    while (1) {
+        pthread_mutex_lock (&shared->lock);
+        repo = NULL;
+        while (shared->next_repo && !repo) {
+            repo = shared->next_repo->data;
+            shared->next_repo = shared->next_repo->next;
+            if (shared->done_repos &&
+                g_hash_table_lookup (shared->done_repos, repo->id))
+                repo = NULL;
+        }
+        pthread_mutex_unlock (&shared->lock);
+        if (!repo)
+            break;
+
+        /* Carry on with the other repos. */
+        if (verify_repo (repo, shared) < 0) {
+            seaf_warning ("Failed to verify repo %s.\n", repo->id);
+            __sync_fetch_and_add (&shared->n_failed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+static GHashTable *
+load_checkpoint (const char *path)
+{
+    GHashTable *done;
+    FILE *fp;
+    char line[256];
+
+    fp = g_fopen (path, "r");
+    if (!fp)
+        return NULL;
+
+    done = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    while (fgets (line, sizeof(line), fp)) {
+        g_strchomp (line);
+        if (line[0] != '\0')
+            g_hash_table_insert (done, g_strdup (line), GINT_TO_POINTER(1));
+    }
+    fclose (fp);
+
+    g_message ("Resuming verification, %u repos already verified.\n",
+               g_hash_table_size (done));
+    return done;
+}
+
 int
-verify_repos ()
+verify_repos (int n_threads, gboolean resume)
 {
     GList *repos = NULL, *ptr;
-    int ret = 0;
+    VerifyShared shared;
+    pthread_t *threads;
+    char *checkpoint_path;
+    int i, n_started = 0;
+
+    memset (&shared, 0, sizeof(shared));
+    pthread_mutex_init (&shared.lock, NULL);
+    pthread_cond_init (&shared.cond, NULL);
+
+    n_threads = MAX (n_threads, 1);
+
+    checkpoint_path = g_build_filename (seaf->seaf_dir, CHECKPOINT_FILE, NULL);
+    if (resume)
+        shared.done_repos = load_checkpoint (checkpoint_path);
+    shared.checkpoint = g_fopen (checkpoint_path, resume ? "a" : "w");
+    if (!shared.checkpoint)
+        seaf_warning ("Failed to open %s, verification can't be resumed.\n",
+                      checkpoint_path);
+
+    shared.visited = obj_id_set_new ();
+    shared.checked = obj_id_set_new ();
+    shared.max_pending = n_threads * 4;
+    shared.check_pool = g_thread_pool_new (check_batch, &shared,
+                                           n_threads, FALSE, NULL);
 
     repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
-    for (ptr = repos; ptr != NULL; ptr = ptr->next) {
-        ret = verify_repo ((SeafRepo *)ptr->data);
-        seaf_repo_unref ((SeafRepo *)ptr->data);
-        if (ret < 0)
+    shared.next_repo = repos;
+
+    threads = g_new0 (pthread_t, n_threads);
+    for (i = 1; i < n_threads; ++i) {
+        if (pthread_create (&threads[i], NULL, verify_worker, &shared) != 0)
             break;
+        ++n_started;
     }
+    verify_worker (&shared);
+    for (i = 1; i <= n_started; ++i)
+        pthread_join (threads[i], NULL);
+    g_free (threads);
 
-    return ret;
+    /* Waits for the queued batches. */
+    g_thread_pool_free (shared.check_pool, FALSE, TRUE);
+
+    g_message ("Verified %"G_GUINT64_FORMAT" blocks, "
+               "%"G_GUINT64_FORMAT" are missing.\n",
+               shared.n_checked, shared.n_missing);
+
+    if (shared.checkpoint)
+        fclose (shared.checkpoint);
+    if (shared.n_failed == 0)
+        g_unlink (checkpoint_path);
+
+    for (ptr = repos; ptr != NULL; ptr = ptr->next)
+        seaf_repo_unref ((SeafRepo *)ptr->data);
+    g_list_free (repos);
+    if (shared.done_repos)
+        g_hash_table_destroy (shared.done_repos);
+    obj_id_set_free (shared.visited);
+    obj_id_set_free (shared.checked);
+    g_free (checkpoint_path);
+    pthread_cond_destroy (&shared.cond);
+    pthread_mutex_destroy (&shared.lock);
+
+    return shared.n_failed ? -1 : 0;
 }
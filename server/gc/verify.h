@@ -1,6 +1,8 @@
 #ifndef GC_VERIFY_H
 #define GC_VERIFY_H
 
-int verify_repos ();
+/* Repos listed in the checkpoint of an unfinished run are skipped
+ * if @resume is TRUE. */
+int verify_repos (int n_threads, gboolean resume);
 
 #endif
@@ -0,0 +1,221 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <ccnet/timer.h>
+
+#include "seafile-session.h"
+#include "notif-mgr.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define NOTIFY_WINDOW 1000      /* 1s */
+
+typedef struct {
+    SeafNotifFunc   func;
+    void           *data;
+    GHashTable     *repos;      /* set of watched repo ids */
+    GString        *batch;      /* updates of the current flush */
+} Subscriber;
+
+struct _SeafNotifManagerPriv {
+    /* repo_id -> latest commit_id, the updates of the current window */
+    GHashTable     *pending;
+    /* repo_id -> set of Subscriber */
+    GHashTable     *watchers;
+    /* data -> Subscriber */
+    GHashTable     *subscribers;
+    CcnetTimer     *flush_timer;
+};
+
+static int flush_updates (void *vmgr);
+
+static void
+subscriber_free (Subscriber *sub)
+{
+    g_hash_table_destroy (sub->repos);
+    if (sub->batch)
+        g_string_free (sub->batch, TRUE);
+    g_free (sub);
+}
+
+SeafNotifManager *
+seaf_notif_manager_new (SeafileSession *seaf)
+{
+    SeafNotifManager *mgr = g_new0 (SeafNotifManager, 1);
+    SeafNotifManagerPriv *priv = g_new0 (SeafNotifManagerPriv, 1);
+
+    mgr->seaf = seaf;
+    mgr->priv = priv;
+
+    priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+    priv->watchers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify)g_hash_table_destroy);
+    priv->subscribers = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                               NULL,
+                                               (GDestroyNotify)subscriber_free);
+
+    return mgr;
+}
+
+void
+seaf_notif_manager_repo_updated (SeafNotifManager *mgr,
+                                 const char *repo_id,
+                                 const char *commit_id)
+{
+    SeafNotifManagerPriv *priv = mgr->priv;
+
+    /* Nobody to tell. */
+    if (!g_hash_table_lookup (priv->watchers, repo_id))
+        return;
+
+    g_hash_table_replace (priv->pending, g_strdup(repo_id), g_strdup(commit_id));
+
+    if (!priv->flush_timer)
+        priv->flush_timer = ccnet_timer_new (flush_updates, mgr, NOTIFY_WINDOW);
+}
+
+static int
+flush_updates (void *vmgr)
+{
+    SeafNotifManager *mgr = vmgr;
+    SeafNotifManagerPriv *priv = mgr->priv;
+    GHashTableIter iter, sub_iter;
+    gpointer key, value, vsub;
+    GList *touched = NULL, *ptr;
+    Subscriber *sub;
+    GString *batch;
+
+    g_hash_table_iter_init (&iter, priv->pending);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        GHashTable *subs = g_hash_table_lookup (priv->watchers, key);
+        if (!subs)
+            continue;
+
+        g_hash_table_iter_init (&sub_iter, subs);
+        while (g_hash_table_iter_next (&sub_iter, &vsub, NULL)) {
+            sub = vsub;
+            if (!sub->batch) {
+                sub->batch = g_string_new (NULL);
+                touched = g_list_prepend (touched, sub);
+            }
+            g_string_append_printf (sub->batch, "%s %s\n",
+                                    (char *)key, (char *)value);
+        }
+    }
+    g_hash_table_remove_all (priv->pending);
+
+    seaf_debug ("Notify %u subscribers of repo updates.\n",
+                g_list_length (touched));
+
+    /* The subscriber may unsubscribe in func, don't touch it after. */
+    for (ptr = touched; ptr; ptr = ptr->next) {
+        sub = ptr->data;
+        batch = sub->batch;
+        sub->batch = NULL;
+        sub->func (batch->str, batch->len + 1, sub->data);
+        g_string_free (batch, TRUE);
+    }
+    g_list_free (touched);
+
+    /* Freed by returning FALSE. */
+    priv->flush_timer = NULL;
+    return FALSE;
+}
+
+int
+seaf_notif_manager_subscribe (SeafNotifManager *mgr,
+                              const char *repo_id,
+                              SeafNotifFunc func,
+                              void *data)
+{
+    SeafNotifManagerPriv *priv = mgr->priv;
+    Subscriber *sub;
+    GHashTable *subs;
+
+    sub = g_hash_table_lookup (priv->subscribers, data);
+    if (!sub) {
+        sub = g_new0 (Subscriber, 1);
+        sub->func = func;
+        sub->data = data;
+        sub->repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+        g_hash_table_insert (priv->subscribers, data, sub);
+    } else if (sub->func != func)
+        return -1;
+
+    if (g_hash_table_lookup (sub->repos, repo_id))
+        return 0;
+    g_hash_table_insert (sub->repos, g_strdup(repo_id), (gpointer)1);
+
+    subs = g_hash_table_lookup (priv->watchers, repo_id);
+    if (!subs) {
+        subs = g_hash_table_new (g_direct_hash, g_direct_equal);
+        g_hash_table_insert (priv->watchers, g_strdup(repo_id), subs);
+    }
+    g_hash_table_insert (subs, sub, sub);
+
+    return 0;
+}
+
+static void
+remove_watcher (SeafNotifManager *mgr, const char *repo_id, Subscriber *sub)
+{
+    GHashTable *subs;
+
+    subs = g_hash_table_lookup (mgr->priv->watchers, repo_id);
+    if (!subs)
+        return;
+
+    g_hash_table_remove (subs, sub);
+    if (g_hash_table_size (subs) == 0)
+        g_hash_table_remove (mgr->priv->watchers, repo_id);
+}
+
+void
+seaf_notif_manager_unsubscribe (SeafNotifManager *mgr,
+                                const char *repo_id,
+                                void *data)
+{
+    Subscriber *sub;
+
+    sub = g_hash_table_lookup (mgr->priv->subscribers, data);
+    if (!sub || !g_hash_table_lookup (sub->repos, repo_id))
+        return;
+
+    remove_watcher (mgr, repo_id, sub);
+    g_hash_table_remove (sub->repos, repo_id);
+}
+
+void
+seaf_notif_manager_unsubscribe_all (SeafNotifManager *mgr, void *data)
+{
+    Subscriber *sub;
+    GHashTableIter iter;
+    gpointer key;
+
+    sub = g_hash_table_lookup (mgr->priv->subscribers, data);
+    if (!sub)
+        return;
+
+    g_hash_table_iter_init (&iter, sub->repos);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        remove_watcher (mgr, key, sub);
+
+    /* Frees sub. */
+    g_hash_table_remove (mgr->priv->subscribers, data);
+}
+
+int
+seaf_notif_manager_count_subscriptions (SeafNotifManager *mgr, void *data)
+{
+    Subscriber *sub;
+
+    sub = g_hash_table_lookup (mgr->priv->subscribers, data);
+    if (!sub)
+        return 0;
+    return g_hash_table_size (sub->repos);
+}
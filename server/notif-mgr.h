@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_NOTIF_MANAGER_H
+#define SEAF_NOTIF_MANAGER_H
+
+/**
+ * Notifies connected clients of repo head updates.
+ *
+ * Clients subscribe to the repos they sync through the watch-repos
+ * processor, instead of polling every repo every few seconds. Updates
+ * are collected for NOTIFY_WINDOW msecs; the updates of a repo within
+ * a window are coalesced to the latest head, and every subscriber gets
+ * the updates of all its repos in one batch.
+ *
+ * Nothing runs while no repo is updated, so idle subscribers only cost
+ * the memory of their subscriptions. Only used in the main thread.
+ */
+
+typedef struct _SeafNotifManager        SeafNotifManager;
+typedef struct _SeafNotifManagerPriv    SeafNotifManagerPriv;
+
+struct _SeafileSession;
+
+struct _SeafNotifManager {
+    struct _SeafileSession *seaf;
+    SeafNotifManagerPriv *priv;
+};
+
+/*
+ * Called with a batch of "<repo_id> <commit_id>\n" lines, the updates of
+ * the repos watched by @data.
+ */
+typedef void (*SeafNotifFunc) (const char *updates, int len, void *data);
+
+SeafNotifManager *
+seaf_notif_manager_new (struct _SeafileSession *seaf);
+
+void
+seaf_notif_manager_repo_updated (SeafNotifManager *mgr,
+                                 const char *repo_id,
+                                 const char *commit_id);
+
+/*
+ * @data identifies the subscriber. All subscriptions of a subscriber
+ * must use the same @func.
+ */
+int
+seaf_notif_manager_subscribe (SeafNotifManager *mgr,
+                              const char *repo_id,
+                              SeafNotifFunc func,
+                              void *data);
+
+void
+seaf_notif_manager_unsubscribe (SeafNotifManager *mgr,
+                                const char *repo_id,
+                                void *data);
+
+void
+seaf_notif_manager_unsubscribe_all (SeafNotifManager *mgr, void *data);
+
+/* Number of repos @data is subscribed to. */
+int
+seaf_notif_manager_count_subscriptions (SeafNotifManager *mgr, void *data);
+
+#endif
@@ -4,6 +4,12 @@
 #include <glib.h>
 #include <ccnet/timer.h>
 
+#include <sys/mman.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
 #include "seafile-session.h"
 #include "seafile-object.h"
 #include "seafile-error.h"
@@ -14,15 +20,42 @@
 #define REAP_INTERVAL 60
 #define REAP_THRESHOLD 3600
 
+/* Derived-key cache. */
+#define MAX_CACHED_KEYS 512
+#define KEY_CACHE_TTL 3600
+
 typedef struct {
     unsigned char key[16];
     unsigned char iv[16];
     guint64 expire_time;
 } DecryptKey;
 
+/*
+ * A key derived from a verified password, so that setting the same
+ * password again skips the key derivation. The password itself is not
+ * kept, only a keyed digest of it and of the repo magic, so a changed
+ * password or magic never matches.
+ */
+typedef struct {
+    gboolean in_use;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    unsigned char key[16];
+    unsigned char iv[16];
+    guint64 expire_time;
+} CachedKey;
+
+typedef struct {
+    unsigned char secret[32];   /* random, for the digests */
+    CachedKey entries[MAX_CACHED_KEYS];
+} KeyCachePool;
+
 struct _SeafPasswdManagerPriv {
     GHashTable *decrypt_keys;
     CcnetTimer *reap_timer;
+
+    /* "repo_id.user" -> CachedKey in pool, which is locked in memory. */
+    GHashTable *cached_keys;
+    KeyCachePool *pool;
 };
 
 static int reap_expired_passwd (void *vmgr);
@@ -37,9 +70,133 @@ seaf_passwd_manager_new (struct _SeafileSession *session)
     mgr->priv->decrypt_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                      g_free, g_free);
 
+    mgr->priv->pool = mmap (NULL, sizeof(KeyCachePool), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mgr->priv->pool == MAP_FAILED) {
+        g_warning ("Failed to map key cache, derived keys won't be cached.\n");
+        mgr->priv->pool = NULL;
+    } else if (mlock (mgr->priv->pool, sizeof(KeyCachePool)) < 0 ||
+               RAND_bytes (mgr->priv->pool->secret,
+                           sizeof(mgr->priv->pool->secret)) != 1) {
+        /* Derived keys must not be swapped out. */
+        g_warning ("Failed to lock key cache, derived keys won't be cached.\n");
+        munmap (mgr->priv->pool, sizeof(KeyCachePool));
+        mgr->priv->pool = NULL;
+    }
+    mgr->priv->cached_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+
     return mgr;
 }
 
+static void
+passwd_digest (SeafPasswdManager *mgr, SeafRepo *repo, const char *passwd,
+               unsigned char *digest)
+{
+    GString *buf = g_string_new (NULL);
+
+    g_string_append_printf (buf, "%s\n%s", repo->magic, passwd);
+    HMAC (EVP_sha1(), mgr->priv->pool->secret, sizeof(mgr->priv->pool->secret),
+          (unsigned char *)buf->str, buf->len, digest, NULL);
+
+    memset (buf->str, 0, buf->len);
+    g_string_free (buf, TRUE);
+}
+
+static void
+drop_cached_key (SeafPasswdManager *mgr, const char *hash_key)
+{
+    CachedKey *entry;
+
+    entry = g_hash_table_lookup (mgr->priv->cached_keys, hash_key);
+    if (!entry)
+        return;
+    memset (entry, 0, sizeof(CachedKey));
+    g_hash_table_remove (mgr->priv->cached_keys, hash_key);
+}
+
+/* Returns 0 if @passwd was verified recently for @hash_key. */
+static int
+lookup_cached_key (SeafPasswdManager *mgr, const char *hash_key,
+                   SeafRepo *repo, const char *passwd,
+                   unsigned char *key, unsigned char *iv)
+{
+    CachedKey *entry;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    int ret = -1;
+
+    if (!mgr->priv->pool)
+        return -1;
+
+    entry = g_hash_table_lookup (mgr->priv->cached_keys, hash_key);
+    if (!entry)
+        return -1;
+
+    if (entry->expire_time <= (guint64)time(NULL)) {
+        drop_cached_key (mgr, hash_key);
+        return -1;
+    }
+
+    passwd_digest (mgr, repo, passwd, digest);
+    if (CRYPTO_memcmp (digest, entry->digest, sizeof(digest)) == 0) {
+        memcpy (key, entry->key, 16);
+        memcpy (iv, entry->iv, 16);
+        ret = 0;
+    }
+
+    memset (digest, 0, sizeof(digest));
+    return ret;
+}
+
+static void
+cache_key (SeafPasswdManager *mgr, const char *hash_key,
+           SeafRepo *repo, const char *passwd,
+           const unsigned char *key, const unsigned char *iv)
+{
+    CachedKey *entry = NULL, *e;
+    GHashTableIter iter;
+    gpointer k, v;
+    int i;
+
+    if (!mgr->priv->pool)
+        return;
+
+    drop_cached_key (mgr, hash_key);
+
+    for (i = 0; i < MAX_CACHED_KEYS; ++i) {
+        if (!mgr->priv->pool->entries[i].in_use) {
+            entry = &mgr->priv->pool->entries[i];
+            break;
+        }
+    }
+
+    /* Full, evict the entry that expires first. */
+    if (!entry) {
+        char *victim = NULL;
+
+        g_hash_table_iter_init (&iter, mgr->priv->cached_keys);
+        while (g_hash_table_iter_next (&iter, &k, &v)) {
+            e = v;
+            if (!entry || e->expire_time < entry->expire_time) {
+                entry = e;
+                victim = k;
+            }
+        }
+        if (!entry)
+            return;
+        memset (entry, 0, sizeof(CachedKey));
+        g_hash_table_remove (mgr->priv->cached_keys, victim);
+    }
+
+    entry->in_use = TRUE;
+    passwd_digest (mgr, repo, passwd, entry->digest);
+    memcpy (entry->key, key, 16);
+    memcpy (entry->iv, iv, 16);
+    entry->expire_time = (guint64)time(NULL) + KEY_CACHE_TTL;
+
+    g_hash_table_insert (mgr->priv->cached_keys, g_strdup (hash_key), entry);
+}
+
 int
 seaf_passwd_manager_start (SeafPasswdManager *mgr)
 {
@@ -72,28 +229,38 @@ seaf_passwd_manager_set_passwd (SeafPasswdManager *mgr,
         return -1;
     }
 
-    if (seaf_repo_verify_passwd (repo, passwd) < 0) {
-        seaf_repo_unref (repo);
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
-                     "Incorrect password");
-        return -1;
-    }
+    hash_key = g_string_new (NULL);
+    g_string_printf (hash_key, "%s.%s", repo_id, user);
 
     crypt_key = g_new0 (DecryptKey, 1);
     if (!crypt_key) {
         g_warning ("Failed to alloc crypt key struct.\n");
+        g_string_free (hash_key, TRUE);
         seaf_repo_unref (repo);
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
                      "Internal server error");
         return -1;
     }
 
-    seafile_generate_enc_key (passwd, strlen(passwd), repo->enc_version,
-                              crypt_key->key, crypt_key->iv);
-    crypt_key->expire_time = (guint64)time(NULL) + REAP_THRESHOLD;
+    /* Both the verification and the decryption key need a slow key
+     * derivation, skip them if we've seen this password recently. */
+    if (lookup_cached_key (mgr, hash_key->str, repo, passwd,
+                           crypt_key->key, crypt_key->iv) < 0) {
+        if (seaf_repo_verify_passwd (repo, passwd) < 0) {
+            g_free (crypt_key);
+            g_string_free (hash_key, TRUE);
+            seaf_repo_unref (repo);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Incorrect password");
+            return -1;
+        }
 
-    hash_key = g_string_new (NULL);
-    g_string_printf (hash_key, "%s.%s", repo_id, user);
+        seafile_generate_enc_key (passwd, strlen(passwd), repo->enc_version,
+                                  crypt_key->key, crypt_key->iv);
+        cache_key (mgr, hash_key->str, repo, passwd,
+                   crypt_key->key, crypt_key->iv);
+    }
+    crypt_key->expire_time = (guint64)time(NULL) + REAP_THRESHOLD;
 
     /* g_debug ("[passwd mgr] Set passwd for %s\n", hash_key->str); */
 
@@ -116,6 +283,7 @@ seaf_passwd_manager_unset_passwd (SeafPasswdManager *mgr,
     hash_key = g_string_new (NULL);
     g_string_printf (hash_key, "%s.%s", repo_id, user);
     g_hash_table_remove (mgr->priv->decrypt_keys, hash_key->str);
+    drop_cached_key (mgr, hash_key->str);
     g_string_free (hash_key, TRUE);
 
     return 0;
@@ -213,5 +381,14 @@ reap_expired_passwd (void *vmgr)
         }
     }
 
+    g_hash_table_iter_init (&iter, mgr->priv->cached_keys);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        CachedKey *entry = value;
+        if (entry->expire_time <= now) {
+            memset (entry, 0, sizeof(CachedKey));
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
     return 1;
 }
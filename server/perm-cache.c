@@ -0,0 +1,148 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "perm-cache.h"
+
+#define PERM_CACHE_TTL      10      /* 10s */
+#define MAX_CACHED_PERMS    100000
+
+typedef struct {
+    char   *perm;
+    gint64  expire;
+} CachedPerm;
+
+struct _SeafPermCache {
+    /* repo_id -> (user -> CachedPerm) */
+    GHashTable     *repos;
+    guint           n_perms;
+    /* Bumped by every invalidation. */
+    guint           gen;
+    pthread_mutex_t lock;
+};
+
+static void
+cached_perm_free (CachedPerm *cp)
+{
+    g_free (cp->perm);
+    g_free (cp);
+}
+
+SeafPermCache *
+seaf_perm_cache_new ()
+{
+    SeafPermCache *cache = g_new0 (SeafPermCache, 1);
+
+    cache->repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)g_hash_table_destroy);
+    pthread_mutex_init (&cache->lock, NULL);
+
+    return cache;
+}
+
+gboolean
+seaf_perm_cache_lookup (SeafPermCache *cache,
+                        const char *repo_id,
+                        const char *user,
+                        char **perm)
+{
+    GHashTable *users;
+    CachedPerm *cp = NULL;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&cache->lock);
+
+    users = g_hash_table_lookup (cache->repos, repo_id);
+    if (users)
+        cp = g_hash_table_lookup (users, user);
+    if (cp && cp->expire > (gint64)time(NULL)) {
+        *perm = g_strdup (cp->perm);
+        found = TRUE;
+    }
+
+    pthread_mutex_unlock (&cache->lock);
+
+    return found;
+}
+
+guint
+seaf_perm_cache_get_gen (SeafPermCache *cache)
+{
+    guint gen;
+
+    pthread_mutex_lock (&cache->lock);
+    gen = cache->gen;
+    pthread_mutex_unlock (&cache->lock);
+
+    return gen;
+}
+
+void
+seaf_perm_cache_insert (SeafPermCache *cache,
+                        const char *repo_id,
+                        const char *user,
+                        const char *perm,
+                        guint gen)
+{
+    GHashTable *users;
+    CachedPerm *cp;
+
+    pthread_mutex_lock (&cache->lock);
+
+    if (gen != cache->gen)
+        goto out;
+
+    if (cache->n_perms >= MAX_CACHED_PERMS) {
+        g_hash_table_remove_all (cache->repos);
+        cache->n_perms = 0;
+    }
+
+    users = g_hash_table_lookup (cache->repos, repo_id);
+    if (!users) {
+        users = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)cached_perm_free);
+        g_hash_table_insert (cache->repos, g_strdup (repo_id), users);
+    }
+
+    cp = g_new0 (CachedPerm, 1);
+    cp->perm = g_strdup (perm);
+    cp->expire = (gint64)time(NULL) + PERM_CACHE_TTL;
+
+    if (!g_hash_table_lookup (users, user))
+        ++cache->n_perms;
+    g_hash_table_replace (users, g_strdup (user), cp);
+
+out:
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+seaf_perm_cache_invalidate_repo (SeafPermCache *cache, const char *repo_id)
+{
+    GHashTable *users;
+
+    pthread_mutex_lock (&cache->lock);
+
+    ++cache->gen;
+    users = g_hash_table_lookup (cache->repos, repo_id);
+    if (users) {
+        cache->n_perms -= g_hash_table_size (users);
+        g_hash_table_remove (cache->repos, repo_id);
+    }
+
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+seaf_perm_cache_invalidate_all (SeafPermCache *cache)
+{
+    pthread_mutex_lock (&cache->lock);
+
+    ++cache->gen;
+    g_hash_table_remove_all (cache->repos);
+    cache->n_perms = 0;
+
+    pthread_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_PERM_CACHE_H
+#define SEAF_PERM_CACHE_H
+
+#include <glib.h>
+
+/**
+ * Cache of resolved repo permissions, by (repo, user).
+ *
+ * Resolving a permission reads the owner, share, group and public share
+ * tables and asks ccnet for the groups of the user. The result is kept
+ * for PERM_CACHE_TTL seconds. The mutators of those tables invalidate
+ * the repo; group membership is only picked up when the entry expires.
+ *
+ * Thread safe.
+ */
+
+typedef struct _SeafPermCache SeafPermCache;
+
+SeafPermCache *
+seaf_perm_cache_new ();
+
+/*
+ * Returns TRUE if a permission is cached. @perm is set to a copy of it,
+ * which is NULL if the user has no access.
+ */
+gboolean
+seaf_perm_cache_lookup (SeafPermCache *cache,
+                        const char *repo_id,
+                        const char *user,
+                        char **perm);
+
+/*
+ * Entries are only inserted if nothing was invalidated since @gen was
+ * returned by seaf_perm_cache_get_gen(), so take it before resolving.
+ */
+guint
+seaf_perm_cache_get_gen (SeafPermCache *cache);
+
+void
+seaf_perm_cache_insert (SeafPermCache *cache,
+                        const char *repo_id,
+                        const char *user,
+                        const char *perm,
+                        guint gen);
+
+void
+seaf_perm_cache_invalidate_repo (SeafPermCache *cache, const char *repo_id);
+
+void
+seaf_perm_cache_invalidate_all (SeafPermCache *cache);
+
+#endif
@@ -197,53 +197,36 @@ check_tx (void *vprocessor)
     CcnetProcessor *processor = vprocessor;
     USE_PRIV;
 
-    char *user = NULL;
     char *repo_id = priv->repo_id;
 
-    if (!seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id)) {
-        priv->rsp_code = g_strdup(SC_BAD_REPO);
-        priv->rsp_msg = g_strdup(SS_BAD_REPO);
-        goto out;
-    }
-
     if (decrypt_token (processor) < 0) {
         priv->rsp_code = g_strdup(SC_ACCESS_DENIED);
         priv->rsp_msg = g_strdup(SS_ACCESS_DENIED);
         goto out;
     }
 
-    user = seaf_repo_manager_get_email_by_token (
-        seaf->repo_mgr, repo_id, priv->token);
-    
-    if (!user) {
-        priv->rsp_code = g_strdup(SC_ACCESS_DENIED);
-        priv->rsp_msg = g_strdup(SS_ACCESS_DENIED);
-        goto out;
-    }
-
-    if (priv->type == CHECK_TX_TYPE_UPLOAD &&
-        seaf_quota_manager_check_quota (seaf->quota_mgr, repo_id) < 0) {
+    switch (seaf_repo_manager_authorize_sync (seaf->repo_mgr, repo_id,
+                                              priv->token,
+                                              priv->type == CHECK_TX_TYPE_UPLOAD,
+                                              NULL)) {
+    case SYNC_AUTH_OK:
+        get_branch_head (processor);
+        break;
+    case SYNC_AUTH_NO_REPO:
+        priv->rsp_code = g_strdup(SC_BAD_REPO);
+        priv->rsp_msg = g_strdup(SS_BAD_REPO);
+        break;
+    case SYNC_AUTH_QUOTA_FULL:
         priv->rsp_code = g_strdup(SC_QUOTA_FULL);
         priv->rsp_msg = g_strdup(SS_QUOTA_FULL);
-        goto out;
-    }
-    
-    char *perm = seaf_repo_manager_check_permission (seaf->repo_mgr,
-                                                     repo_id, user, NULL);
-    if (!perm ||
-        (strcmp (perm, "r") == 0 && priv->type == CHECK_TX_TYPE_UPLOAD))
-    {
+        break;
+    default:
         priv->rsp_code = g_strdup(SC_ACCESS_DENIED);
         priv->rsp_msg = g_strdup(SS_ACCESS_DENIED);
-        g_free (perm);
-        goto out;
+        break;
     }
-    g_free (perm);
-
-    get_branch_head (processor);
 
 out:
-    g_free (user);
     return vprocessor;    
 }
 
@@ -0,0 +1,79 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include <ccnet.h>
+
+#include "seafile-session.h"
+#include "chunkserv-mgr.h"
+#include "getcsload-proc.h"
+
+G_DEFINE_TYPE (SeafileGetcsloadProc, seafile_getcsload_proc, CCNET_TYPE_PROCESSOR)
+
+static int start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_response (CcnetProcessor *processor,
+                             char *code, char *code_msg,
+                             char *content, int clen);
+
+static void
+release_resource(CcnetProcessor *processor)
+{
+    CCNET_PROCESSOR_CLASS (seafile_getcsload_proc_parent_class)->release_resource (processor);
+}
+
+
+static void
+seafile_getcsload_proc_class_init (SeafileGetcsloadProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "getcsload-proc";
+    proc_class->start = start;
+    proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
+}
+
+static void
+seafile_getcsload_proc_init (SeafileGetcsloadProc *processor)
+{
+}
+
+
+static int
+start (CcnetProcessor *processor, int argc, char **argv)
+{
+    char buf[256];
+
+    snprintf (buf, 256, "remote %s seafile-putcsload", processor->peer_id);
+    ccnet_processor_send_request (processor, buf);
+
+    return 0;
+}
+
+static void
+handle_response (CcnetProcessor *processor,
+                 char *code, char *code_msg,
+                 char *content, int clen)
+{
+    ChunkServerLoad load;
+
+    if (memcmp (code, SC_OK, 3) != 0) {
+        g_warning ("Bad response: %s %s.\n", code, code_msg);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    memset (&load, 0, sizeof(load));
+    if (clen == 0 || content[clen-1] != '\0' ||
+        sscanf (content, "%d %d %d %d", &load.n_transfers, &load.rate,
+                &load.n_done, &load.n_errors) != 4) {
+        g_warning ("Bad chunk server load format.\n");
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    seaf_cs_manager_update_load (seaf->cs_mgr, processor->peer_id, &load);
+    ccnet_processor_done (processor, TRUE);
+}
@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAFILE_GETCSLOAD_PROC_H
+#define SEAFILE_GETCSLOAD_PROC_H
+
+#include <glib-object.h>
+#include <ccnet/processor.h>
+
+#define SEAFILE_TYPE_GETCSLOAD_PROC                  (seafile_getcsload_proc_get_type ())
+#define SEAFILE_GETCSLOAD_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), SEAFILE_TYPE_GETCSLOAD_PROC, SeafileGetcsloadProc))
+#define SEAFILE_IS_GETCSLOAD_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SEAFILE_TYPE_GETCSLOAD_PROC))
+#define SEAFILE_GETCSLOAD_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), SEAFILE_TYPE_GETCSLOAD_PROC, SeafileGetcsloadProcClass))
+#define IS_SEAFILE_GETCSLOAD_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), SEAFILE_TYPE_GETCSLOAD_PROC))
+#define SEAFILE_GETCSLOAD_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), SEAFILE_TYPE_GETCSLOAD_PROC, SeafileGetcsloadProcClass))
+
+typedef struct _SeafileGetcsloadProc SeafileGetcsloadProc;
+typedef struct _SeafileGetcsloadProcClass SeafileGetcsloadProcClass;
+
+struct _SeafileGetcsloadProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _SeafileGetcsloadProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType seafile_getcsload_proc_get_type ();
+
+#endif
+
@@ -166,6 +166,21 @@ send_commit (CcnetProcessor *processor, char *object_id)
         goto fail;
     }
 
+    /* Clients only read JSON commits. */
+    if (seaf_commit_data_is_binary (data, len)) {
+        char *json;
+        gsize json_len;
+
+        json = seaf_commit_data_to_json (object_id, data, len, &json_len);
+        g_free (data);
+        if (!json) {
+            g_warning ("Failed to convert commit %s.\n", object_id);
+            goto fail;
+        }
+        data = json;
+        len = (int)json_len;
+    }
+
     pack_size = sizeof(ObjectPack) + len;
     pack = malloc (pack_size);
     memcpy (pack->id, object_id, 41);
@@ -15,6 +15,7 @@
 #include "putcommit-v2-proc.h"
 #include "processors/objecttx-common.h"
 #include "vc-common.h"
+#include "seaf-probes.h"
 
 typedef struct  {
     char        head_commit_id[41];
@@ -49,6 +50,8 @@ release_resource (CcnetProcessor *processor)
     if (priv->registered)
         seaf_obj_store_unregister_async_read (seaf->commit_mgr->obj_store,
                                               priv->reader_id);
+
+    SEAF_PROBE_PROC_DONE (processor);
 }
 
 static void
@@ -68,13 +71,26 @@ seafile_putcommit_v2_proc_init (SeafilePutcommitV2Proc *processor)
 {
 }
 
-static void
+static int
 send_commit (CcnetProcessor *processor,
              const char *commit_id,
              char *data, int len)
 {
     ObjectPack *pack = NULL;
     int pack_size;
+    char *json = NULL;
+    gsize json_len;
+
+    /* Clients only read JSON commits. */
+    if (seaf_commit_data_is_binary (data, len)) {
+        json = seaf_commit_data_to_json (commit_id, data, len, &json_len);
+        if (!json) {
+            g_warning ("[putcommit] Failed to convert commit %s.\n", commit_id);
+            return -1;
+        }
+        data = json;
+        len = (int)json_len;
+    }
 
     pack_size = sizeof(ObjectPack) + len;
     pack = malloc (pack_size);
@@ -84,6 +100,8 @@ send_commit (CcnetProcessor *processor,
     ccnet_processor_send_response (processor, SC_OBJECT, SS_OBJECT,
                                    (char *)pack, pack_size);
     free (pack);
+    g_free (json);
+    return 0;
 }
 
 static int
@@ -121,7 +139,8 @@ read_done_cb (OSAsyncResult *res, void *cb_data)
         goto bad;
     }
 
-    send_commit (processor, res->obj_id, res->data, res->len);
+    if (send_commit (processor, res->obj_id, res->data, res->len) < 0)
+        goto bad;
 
     seaf_debug ("Send commit %.8s.\n", res->obj_id);
 
@@ -293,6 +312,8 @@ put_commit_start (CcnetProcessor *processor, int argc, char **argv)
     char *session_token;
     USE_PRIV;
 
+    SEAF_PROBE_PROC_START (processor);
+
     if (argc < 2) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -39,7 +39,8 @@ start (CcnetProcessor *processor, int argc, char **argv)
     GList *chunk_servers, *cs;
     char *cs_id;
 
-    chunk_servers = seaf_cs_manager_get_chunk_servers (seaf->cs_mgr);
+    /* Least loaded first, unhealthy servers left out. */
+    chunk_servers = seaf_cs_manager_get_usable_chunk_servers (seaf->cs_mgr);
     cs = chunk_servers;
     while (cs) {
         cs_id = cs->data;
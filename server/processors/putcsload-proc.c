@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <ccnet.h>
+#include "seafile-session.h"
+#include "chunkserv-mgr.h"
+#include "putcsload-proc.h"
+
+/*
+ * Reply with the load of this chunk server:
+ *
+ *   "<transfers running> <KB/s> <transfers done> <transfers failed>"
+ */
+
+G_DEFINE_TYPE (SeafilePutcsloadProc, seafile_putcsload_proc, CCNET_TYPE_PROCESSOR)
+
+static int start (CcnetProcessor *processor, int argc, char **argv);
+
+static void
+release_resource(CcnetProcessor *processor)
+{
+    CCNET_PROCESSOR_CLASS (seafile_putcsload_proc_parent_class)->release_resource (processor);
+}
+
+
+static void
+seafile_putcsload_proc_class_init (SeafilePutcsloadProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "putcsload-proc";
+    proc_class->start = start;
+    proc_class->release_resource = release_resource;
+}
+
+static void
+seafile_putcsload_proc_init (SeafilePutcsloadProc *processor)
+{
+}
+
+
+static int
+start (CcnetProcessor *processor, int argc, char **argv)
+{
+    ChunkServerLoad load;
+    char buf[128];
+    int len;
+
+    seaf_cs_manager_get_my_load (seaf->cs_mgr, &load);
+    len = snprintf (buf, sizeof(buf), "%d %d %d %d",
+                    load.n_transfers, load.rate, load.n_done, load.n_errors);
+
+    ccnet_processor_send_response (processor, SC_OK, SS_OK, buf, len + 1);
+    ccnet_processor_done (processor, TRUE);
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAFILE_PUTCSLOAD_PROC_H
+#define SEAFILE_PUTCSLOAD_PROC_H
+
+#include <glib-object.h>
+#include <ccnet/processor.h>
+
+#define SEAFILE_TYPE_PUTCSLOAD_PROC                  (seafile_putcsload_proc_get_type ())
+#define SEAFILE_PUTCSLOAD_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), SEAFILE_TYPE_PUTCSLOAD_PROC, SeafilePutcsloadProc))
+#define SEAFILE_IS_PUTCSLOAD_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SEAFILE_TYPE_PUTCSLOAD_PROC))
+#define SEAFILE_PUTCSLOAD_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), SEAFILE_TYPE_PUTCSLOAD_PROC, SeafilePutcsloadProcClass))
+#define IS_SEAFILE_PUTCSLOAD_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), SEAFILE_TYPE_PUTCSLOAD_PROC))
+#define SEAFILE_PUTCSLOAD_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), SEAFILE_TYPE_PUTCSLOAD_PROC, SeafilePutcsloadProcClass))
+
+typedef struct _SeafilePutcsloadProc SeafilePutcsloadProc;
+typedef struct _SeafilePutcsloadProcClass SeafilePutcsloadProcClass;
+
+struct _SeafilePutcsloadProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _SeafilePutcsloadProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType seafile_putcsload_proc_get_type ();
+
+#endif
+
@@ -7,19 +7,66 @@
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include <ccnet.h>
+#include <ccnet/cevent.h>
 #include "utils.h"
 
 #include "seafile-session.h"
 #include "commit-mgr.h"
 #include "fs-mgr.h"
+#include "buf-pool.h"
+#include "seaf-probes.h"
 #include "processors/objecttx-common.h"
 #include "putfs-proc.h"
 
+/*
+ * Pack mode. A worker thread walks each wanted tree, skips the subtrees
+ * that are the same as in its base tree, and appends the objects to the
+ * pack stream. The stream is cut into segments that are handed to the
+ * main thread to be sent, at most PACK_WINDOW of them unacked.
+ */
+
+/* Objects that appear twice in the trees are sent once, as long as
+ * there's room to remember them. */
+#define MAX_SEEN_OBJECTS 200000
+
+typedef struct {
+    char    want[41];
+    char    base[41];           /* empty if there's none */
+} PackRoot;
+
+enum {
+    PACK_EVENT_SEGMENT,
+    PACK_EVENT_END,
+    PACK_EVENT_ERROR,
+};
+
+typedef struct {
+    int         type;
+    GByteArray  *seg;
+} PackEvent;
+
+typedef struct {
+    /* Never dereference this in the worker thread. */
+    CcnetProcessor  *processor;
+    uint32_t        cevent_id;
+    GList           *roots;
+    GByteArray      *stream;
+    GHashTable      *seen;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             in_flight;
+    gboolean        processor_done;
+    gboolean        thread_running;
+} PackData;
+
 typedef struct  {
     guint32     reader_id;
     gboolean    registered;
+    PackData    *pack;
 } PutfsProcPriv;
 
 #define GET_PRIV(o)  \
@@ -37,6 +84,17 @@ static void handle_update (CcnetProcessor *processor,
 static void
 read_done_cb (OSAsyncResult *res, void *cb_data);
 
+static void
+pack_data_free (PackData *pdata)
+{
+    g_list_free_full (pdata->roots, g_free);
+    g_byte_array_free (pdata->stream, TRUE);
+    g_hash_table_destroy (pdata->seen);
+    pthread_mutex_destroy (&pdata->lock);
+    pthread_cond_destroy (&pdata->cond);
+    g_free (pdata);
+}
+
 static void
 release_resource(CcnetProcessor *processor)
 {
@@ -46,6 +104,21 @@ release_resource(CcnetProcessor *processor)
         seaf_obj_store_unregister_async_read (seaf->fs_mgr->obj_store,
                                               priv->reader_id);
 
+    if (priv->pack) {
+        cevent_manager_unregister (seaf->ev_mgr, priv->pack->cevent_id);
+        /* The worker thread frees it when it's running. */
+        if (priv->pack->thread_running) {
+            pthread_mutex_lock (&priv->pack->lock);
+            priv->pack->processor_done = TRUE;
+            pthread_cond_signal (&priv->pack->cond);
+            pthread_mutex_unlock (&priv->pack->lock);
+        } else
+            pack_data_free (priv->pack);
+        priv->pack = NULL;
+    }
+
+    SEAF_PROBE_PROC_DONE (processor);
+
     CCNET_PROCESSOR_CLASS (seafile_putfs_proc_parent_class)->release_resource (processor);
 }
 
@@ -75,6 +148,8 @@ start (CcnetProcessor *processor, int argc, char **argv)
     char *session_token;
     USE_PRIV;
 
+    SEAF_PROBE_PROC_START (processor);
+
     if (argc != 1) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -98,7 +173,8 @@ start (CcnetProcessor *processor, int argc, char **argv)
                                             read_done_cb,
                                             processor);
 
-    ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+    ccnet_processor_send_response (processor, SC_OK, SS_OK,
+                                   PACK_TOKEN, sizeof(PACK_TOKEN));
 
     return 0;
 }
@@ -118,10 +194,32 @@ read_done_cb (OSAsyncResult *res, void *cb_data)
         return;
     }
 
-    pack_size = sizeof(ObjectPack) + res->len;
-    pack = malloc (pack_size);
-    memcpy (pack->id, res->obj_id, 41);
-    memcpy (pack->object, res->data, res->len);
+    /* Clients only understand the plain dir format. */
+    if (seaf_dir_data_is_indexed (res->data, res->len) ||
+        seaf_dir_data_is_sharded (res->data, res->len)) {
+        int plain_len;
+        void *plain = seaf_fs_manager_dir_data_to_plain (seaf->fs_mgr,
+                                                         res->obj_id,
+                                                         res->data, res->len,
+                                                         &plain_len);
+        if (!plain) {
+            g_warning ("[putfs] Bad dir object %s.\n", res->obj_id);
+            ccnet_processor_send_response (processor, SC_NOT_FOUND,
+                                           SS_NOT_FOUND, NULL, 0);
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
+        pack_size = sizeof(ObjectPack) + plain_len;
+        pack = buf_pool_alloc (pack_size);
+        memcpy (pack->id, res->obj_id, 41);
+        memcpy (pack->object, plain, plain_len);
+        g_free (plain);
+    } else {
+        pack_size = sizeof(ObjectPack) + res->len;
+        pack = buf_pool_alloc (pack_size);
+        memcpy (pack->id, res->obj_id, 41);
+        memcpy (pack->object, res->data, res->len);
+    }
 
     if (pack_size <= MAX_OBJ_SEG_SIZE) {
         ccnet_processor_send_response (processor, SC_OBJECT, SS_OBJECT,
@@ -148,33 +246,17 @@ read_done_cb (OSAsyncResult *res, void *cb_data)
         }
     }
 
-    free (pack);
+    buf_pool_free (pack);
 
     seaf_debug ("Send fs object %.8s.\n", res->obj_id);
 }
 
-static gboolean
-send_fs_object (CcnetProcessor *processor, char *object_id)
-{
-    USE_PRIV;
-
-    if (seaf_obj_store_async_read (seaf->fs_mgr->obj_store,
-                                   priv->reader_id,
-                                   object_id) < 0) {
-        g_warning ("[putfs] Failed to start async read of %s.\n", object_id);
-        ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
-                                       NULL, 0);
-        ccnet_processor_done (processor, FALSE);
-        return FALSE;
-    }
-
-    return TRUE;
-}
-
 static void
 send_fs_objects (CcnetProcessor *processor, char *content, int clen)
 {
+    USE_PRIV;
     char *object_id;
+    const char **obj_ids;
     int n_objects;
     int i;
 
@@ -186,14 +268,370 @@ send_fs_objects (CcnetProcessor *processor, char *content, int clen)
     }
 
     n_objects = clen/41;
+    if (n_objects == 0)
+        return;
 
+    obj_ids = g_new (const char *, n_objects);
     object_id = content;
     for (i = 0; i < n_objects; ++i) {
         object_id[40] = '\0';
-        if (send_fs_object (processor, object_id) == FALSE)
-            return;
+        obj_ids[i] = object_id;
         object_id += 41;
     }
+
+    /* Read the whole list in one obj store task. */
+    if (seaf_obj_store_async_read_batch (seaf->fs_mgr->obj_store,
+                                         priv->reader_id,
+                                         obj_ids, n_objects) < 0) {
+        g_warning ("[putfs] Failed to start async read of %s.\n", obj_ids[0]);
+        ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+    }
+
+    g_free (obj_ids);
+}
+
+/* Pack mode, the code below runs in the worker thread. */
+
+static void
+post_pack_event (PackData *pdata, int type, GByteArray *seg)
+{
+    PackEvent *ev = g_new0 (PackEvent, 1);
+
+    ev->type = type;
+    ev->seg = seg;
+    cevent_manager_add_event (seaf->ev_mgr, pdata->cevent_id, ev);
+}
+
+/* Send the first @len bytes of the stream, waiting for room in the window. */
+static int
+pack_flush (PackData *pdata, int len)
+{
+    GByteArray *seg;
+
+    pthread_mutex_lock (&pdata->lock);
+    while (pdata->in_flight >= PACK_WINDOW && !pdata->processor_done)
+        pthread_cond_wait (&pdata->cond, &pdata->lock);
+    if (pdata->processor_done) {
+        pthread_mutex_unlock (&pdata->lock);
+        return -1;
+    }
+    ++pdata->in_flight;
+    pthread_mutex_unlock (&pdata->lock);
+
+    seg = g_byte_array_sized_new (len);
+    g_byte_array_append (seg, pdata->stream->data, len);
+    g_byte_array_remove_range (pdata->stream, 0, len);
+    post_pack_event (pdata, PACK_EVENT_SEGMENT, seg);
+
+    return 0;
+}
+
+static int
+pack_object (PackData *pdata, const char *obj_id, const void *data, int len)
+{
+    PackedObject hdr;
+
+    hdr.len = htonl (len);
+    memcpy (hdr.id, obj_id, 41);
+    g_byte_array_append (pdata->stream, (guint8 *)&hdr, sizeof(hdr));
+    g_byte_array_append (pdata->stream, data, len);
+
+    while (pdata->stream->len >= MAX_OBJ_SEG_SIZE) {
+        if (pack_flush (pdata, MAX_OBJ_SEG_SIZE) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Returns TRUE if @obj_id was packed already. */
+static gboolean
+pack_seen (PackData *pdata, const char *obj_id)
+{
+    if (g_hash_table_lookup (pdata->seen, obj_id))
+        return TRUE;
+
+    if (g_hash_table_size (pdata->seen) < MAX_SEEN_OBJECTS)
+        g_hash_table_insert (pdata->seen, g_strdup(obj_id), (gpointer)1);
+    return FALSE;
+}
+
+/* Read an fs object, with dirs in the plain format. */
+static void *
+read_plain_object (const char *obj_id, int *len)
+{
+    void *data = NULL, *plain;
+    int plain_len;
+
+    if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, obj_id,
+                                 &data, len) < 0) {
+        g_warning ("[putfs] Failed to read %s.\n", obj_id);
+        return NULL;
+    }
+
+    if (seaf_dir_data_is_indexed (data, *len) ||
+        seaf_dir_data_is_sharded (data, *len)) {
+        plain = seaf_fs_manager_dir_data_to_plain (seaf->fs_mgr, obj_id,
+                                                   data, *len, &plain_len);
+        g_free (data);
+        if (!plain)
+            g_warning ("[putfs] Bad dir object %s.\n", obj_id);
+        *len = plain_len;
+        return plain;
+    }
+
+    return data;
+}
+
+static int
+pack_file (PackData *pdata, const char *file_id)
+{
+    void *data;
+    int len, ret;
+
+    if (strcmp (file_id, EMPTY_SHA1) == 0 || pack_seen (pdata, file_id))
+        return 0;
+
+    data = read_plain_object (file_id, &len);
+    if (!data)
+        return -1;
+    ret = pack_object (pdata, file_id, data, len);
+    g_free (data);
+
+    return ret;
+}
+
+/*
+ * Pack the dir @dir_id and what's under it, except what's the same as
+ * in @base_id, which the client has.
+ */
+static int
+pack_tree (PackData *pdata, const char *dir_id, const char *base_id)
+{
+    void *data = NULL;
+    int len;
+    SeafDir *dir = NULL, *base = NULL;
+    GHashTable *base_dents = NULL;
+    SeafDirent *dent, *bdent;
+    GList *ptr;
+    int ret = -1;
+
+    if (base_id && strcmp (dir_id, base_id) == 0)
+        return 0;
+    if (strcmp (dir_id, EMPTY_SHA1) == 0 || pack_seen (pdata, dir_id))
+        return 0;
+
+    data = read_plain_object (dir_id, &len);
+    if (!data)
+        goto out;
+    dir = seaf_dir_from_data (dir_id, data, len);
+    if (!dir) {
+        g_warning ("[putfs] Bad dir object %s.\n", dir_id);
+        goto out;
+    }
+    if (pack_object (pdata, dir_id, data, len) < 0)
+        goto out;
+
+    /* A base we don't have only means more objects are sent. */
+    if (base_id)
+        base = seaf_fs_manager_get_seafdir (seaf->fs_mgr, base_id);
+    if (base) {
+        base_dents = g_hash_table_new (g_str_hash, g_str_equal);
+        for (ptr = base->entries; ptr; ptr = ptr->next) {
+            bdent = ptr->data;
+            g_hash_table_insert (base_dents, bdent->name, bdent);
+        }
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        bdent = base_dents ? g_hash_table_lookup (base_dents, dent->name) : NULL;
+        if (bdent && strcmp (bdent->id, dent->id) == 0)
+            continue;
+
+        if (S_ISDIR(dent->mode)) {
+            if (bdent && !S_ISDIR(bdent->mode))
+                bdent = NULL;
+            if (pack_tree (pdata, dent->id, bdent ? bdent->id : NULL) < 0)
+                goto out;
+        } else if (pack_file (pdata, dent->id) < 0)
+            goto out;
+    }
+    ret = 0;
+
+out:
+    if (base_dents)
+        g_hash_table_destroy (base_dents);
+    if (base)
+        seaf_dir_free (base);
+    if (dir)
+        seaf_dir_free (dir);
+    g_free (data);
+    return ret;
+}
+
+static void *
+pack_thread (void *vdata)
+{
+    PackData *pdata = vdata;
+    PackRoot *root;
+    GList *ptr;
+
+    for (ptr = pdata->roots; ptr; ptr = ptr->next) {
+        root = ptr->data;
+        if (pack_tree (pdata, root->want,
+                       root->base[0] ? root->base : NULL) < 0)
+            goto error;
+    }
+
+    if (pdata->stream->len > 0 && pack_flush (pdata, pdata->stream->len) < 0)
+        goto error;
+
+    post_pack_event (pdata, PACK_EVENT_END, NULL);
+    return vdata;
+
+error:
+    post_pack_event (pdata, PACK_EVENT_ERROR, NULL);
+    return vdata;
+}
+
+/* Back in the main thread. */
+
+static void
+pack_thread_done (void *vdata)
+{
+    PackData *pdata = vdata;
+
+    if (pdata->processor_done)
+        pack_data_free (pdata);
+    else
+        pdata->thread_running = FALSE;
+}
+
+static void
+pack_event_cb (CEvent *event, void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    PackEvent *ev = event->data;
+
+    switch (ev->type) {
+    case PACK_EVENT_SEGMENT:
+        ccnet_processor_send_response (processor, SC_PACK, SS_PACK,
+                                       (char *)ev->seg->data, ev->seg->len);
+        g_byte_array_free (ev->seg, TRUE);
+        break;
+    case PACK_EVENT_END:
+        seaf_debug ("[putfs] Pack sent.\n");
+        ccnet_processor_send_response (processor, SC_PACK_END, SS_PACK_END,
+                                       NULL, 0);
+        break;
+    case PACK_EVENT_ERROR:
+        ccnet_processor_send_response (processor, SC_NOT_FOUND, SS_NOT_FOUND,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        break;
+    }
+
+    g_free (ev);
+}
+
+static PackData *
+get_pack_data (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    PackData *pdata;
+
+    if (priv->pack)
+        return priv->pack;
+
+    pdata = g_new0 (PackData, 1);
+    pdata->processor = processor;
+    pdata->stream = g_byte_array_new ();
+    pdata->seen = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, NULL);
+    pthread_mutex_init (&pdata->lock, NULL);
+    pthread_cond_init (&pdata->cond, NULL);
+    pdata->cevent_id = cevent_manager_register (seaf->ev_mgr,
+                                                (cevent_handler)pack_event_cb,
+                                                processor);
+    priv->pack = pdata;
+
+    return pdata;
+}
+
+static void
+add_pack_roots (CcnetProcessor *processor, char *content, int clen)
+{
+    PackData *pdata;
+    PackRoot *root;
+    char **lines, **ptr;
+    int len, ret = 0;
+
+    if (clen == 0 || content[clen-1] != '\0') {
+        ret = -1;
+        goto out;
+    }
+
+    pdata = get_pack_data (processor);
+    lines = g_strsplit (content, "\n", 0);
+    for (ptr = lines; *ptr; ++ptr) {
+        len = strlen (*ptr);
+        if (len == 0)
+            continue;
+        if (!(len == 81 && (*ptr)[40] == ' ') &&
+            !(len == 42 && strcmp (*ptr + 40, " -") == 0)) {
+            ret = -1;
+            break;
+        }
+        root = g_new0 (PackRoot, 1);
+        memcpy (root->want, *ptr, 40);
+        if (len == 81)
+            memcpy (root->base, *ptr + 41, 40);
+        pdata->roots = g_list_prepend (pdata->roots, root);
+    }
+    g_strfreev (lines);
+
+out:
+    if (ret < 0) {
+        g_warning ("[putfs] Bad pack roots.\n");
+        ccnet_processor_send_response (processor, SC_BAD_OL, SS_BAD_OL,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+    }
+}
+
+static void
+start_pack (CcnetProcessor *processor)
+{
+    PackData *pdata = get_pack_data (processor);
+
+    if (pdata->thread_running)
+        return;
+
+    pdata->roots = g_list_reverse (pdata->roots);
+    pdata->thread_running = TRUE;
+    ccnet_job_manager_schedule_job (seaf->job_mgr,
+                                    pack_thread,
+                                    pack_thread_done,
+                                    pdata);
+}
+
+static void
+ack_pack (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+    int n;
+
+    if (!priv->pack || clen == 0 || content[clen-1] != '\0')
+        return;
+
+    n = atoi (content);
+    pthread_mutex_lock (&priv->pack->lock);
+    priv->pack->in_flight = MAX (priv->pack->in_flight - n, 0);
+    pthread_cond_signal (&priv->pack->cond);
+    pthread_mutex_unlock (&priv->pack->lock);
 }
 
 static void
@@ -203,6 +641,12 @@ handle_update (CcnetProcessor *processor,
 {
     if (strncmp(code, SC_GET_OBJECT, 3) == 0) {
         send_fs_objects (processor, content, clen);
+    } else if (strncmp(code, SC_PACK_ROOTS, 3) == 0) {
+        add_pack_roots (processor, content, clen);
+    } else if (strncmp(code, SC_PACK_START, 3) == 0) {
+        start_pack (processor);
+    } else if (strncmp(code, SC_PACK_ACK, 3) == 0) {
+        ack_pack (processor, content, clen);
     } else if (strncmp(code, SC_END, 3) == 0) {
         ccnet_processor_done (processor, TRUE);     
     } else {
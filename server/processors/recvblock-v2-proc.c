@@ -17,6 +17,10 @@
 #include "seafile-session.h"
 #include "fs-mgr.h"
 #include "block-mgr.h"
+#include "commit-mgr.h"
+#include "repo-mgr.h"
+#include "exists-filter.h"
+#include "seaf-probes.h"
 #include "recvblock-v2-proc.h"
 
 enum {
@@ -42,6 +46,348 @@ G_DEFINE_TYPE (SeafileRecvblockV2Proc, seafile_recvblock_v2_proc, CCNET_TYPE_PRO
 #define RECVBLOCK_PROC
 #include "processors/blocktx-common-impl-v2.h"
 
+/*
+ * Have filters: a bloom filter of the blocks of each repo uploaded to
+ * recently. It's built from the tree of the repo head, then only the
+ * dirs that changed are walked when the head moves. Blocks received for
+ * the repo are added too, so an interrupted upload isn't repeated.
+ * Blocks received before a restart but never committed are missed, they
+ * are only uploaded again.
+ *
+ * The filters are only used in the main thread, except by the job that
+ * builds a filter, which only adds to it.
+ */
+#define MAX_HAVE_FILTERS 32
+#define MAX_HAVE_FILTER_BITS ((guint64)1 << 27)
+#define MIN_HAVE_FILTER_CAPACITY 8192
+/* For guessing the number of blocks of a repo from its size. */
+#define HAVE_FILTER_BLOCK_SIZE (256 * 1024)
+
+typedef struct HaveFilter {
+    char          repo_id[37];
+    ExistsFilter *filter;
+    guint64       capacity;
+    char          head_id[41];      /* the commit the filter covers */
+    GHashTable   *dirs;             /* dirs whose blocks are all added */
+    /* Set while a job builds a new filter, which replaces @filter. */
+    ExistsFilter *next_filter;
+    gboolean      building;
+    gboolean      rebuild;
+    gint64        last_used;
+} HaveFilter;
+
+typedef struct FilterJob {
+    HaveFilter   *hf;
+    char          head_id[41];
+    ExistsFilter *filter;
+    GHashTable   *dirs;
+    guint64       capacity;
+    gboolean      overfull;
+    guint64       n_listed;         /* blocks the master wants to list */
+    int           result;
+    CcnetProcessor *processor;
+    gboolean      processor_done;
+} FilterJob;
+
+static GHashTable *have_filters;
+
+static void
+have_filter_free (HaveFilter *hf)
+{
+    exists_filter_free (hf->filter);
+    if (hf->dirs)
+        g_hash_table_destroy (hf->dirs);
+    g_free (hf);
+}
+
+static HaveFilter *
+get_have_filter (const char *repo_id)
+{
+    HaveFilter *hf, *oldest = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!have_filters)
+        have_filters = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify)have_filter_free);
+
+    hf = g_hash_table_lookup (have_filters, repo_id);
+    if (hf)
+        goto out;
+
+    if (g_hash_table_size (have_filters) >= MAX_HAVE_FILTERS) {
+        g_hash_table_iter_init (&iter, have_filters);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            hf = value;
+            if (!hf->building &&
+                (!oldest || hf->last_used < oldest->last_used))
+                oldest = hf;
+        }
+        if (!oldest)
+            return NULL;
+        g_hash_table_remove (have_filters, oldest->repo_id);
+    }
+
+    hf = g_new0 (HaveFilter, 1);
+    memcpy (hf->repo_id, repo_id, 37);
+    g_hash_table_insert (have_filters, hf->repo_id, hf);
+
+out:
+    hf->last_used = (gint64)time(NULL);
+    return hf;
+}
+
+static void
+have_filter_add (const char *repo_id, const char *block_id)
+{
+    HaveFilter *hf;
+
+    if (!have_filters)
+        return;
+
+    hf = g_hash_table_lookup (have_filters, repo_id);
+    if (!hf)
+        return;
+
+    if (hf->filter)
+        exists_filter_add (hf->filter, block_id);
+    if (hf->next_filter)
+        exists_filter_add (hf->next_filter, block_id);
+}
+
+static gboolean
+add_tree_blocks (SeafFSManager *mgr,
+                 const char *obj_id,
+                 int type,
+                 void *user_data,
+                 gboolean *stop)
+{
+    FilterJob *job = user_data;
+    Seafile *seafile;
+    int i;
+
+    if (type == SEAF_METADATA_TYPE_DIR) {
+        /* Unchanged dirs are covered already. */
+        if (g_hash_table_lookup (job->dirs, obj_id))
+            *stop = TRUE;
+        else
+            g_hash_table_insert (job->dirs, g_strdup(obj_id), (gpointer)1);
+        return TRUE;
+    }
+
+    if (type != SEAF_METADATA_TYPE_FILE)
+        return TRUE;
+
+    seafile = seaf_fs_manager_get_seafile (mgr, obj_id);
+    if (!seafile) {
+        seaf_warning ("Failed to get file %s.\n", obj_id);
+        return FALSE;
+    }
+    for (i = 0; i < seafile->n_blocks; ++i)
+        exists_filter_add (job->filter, seafile->blk_sha1s[i]);
+    seafile_unref (seafile);
+
+    return TRUE;
+}
+
+static void *
+build_filter_thread (void *vdata)
+{
+    FilterJob *job = vdata;
+    SeafCommit *head;
+    ExistsFilterStats st;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr, job->head_id);
+    if (!head) {
+        seaf_warning ("Failed to get commit %s.\n", job->head_id);
+        job->result = -1;
+        return vdata;
+    }
+
+    job->result = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
+                                                 head->root_id,
+                                                 add_tree_blocks, job);
+    seaf_commit_unref (head);
+
+    /* Too full to be useful, the next request builds a bigger one. */
+    exists_filter_get_stats (job->filter, &st);
+    if (job->result == 0 && st.n_added > 2 * job->capacity) {
+        job->capacity = st.n_added;
+        job->overfull = TRUE;
+    }
+
+    return vdata;
+}
+
+static void
+send_have_filter (CcnetProcessor *processor, ExistsFilter *filter)
+{
+    const guint32 *bits;
+    guint32 buf[FILTER_PIECE_LEN / 4];
+    guint64 n_bits, i, n_words;
+    int n = 0;
+    char end[32];
+    int len;
+
+    if (filter) {
+        bits = exists_filter_get_bits (filter, &n_bits);
+        n_words = n_bits / 32;
+        for (i = 0; i < n_words; ++i) {
+            buf[n++] = GUINT32_TO_LE (bits[i]);
+            if (n == G_N_ELEMENTS(buf) || i == n_words - 1) {
+                ccnet_processor_send_response (processor,
+                                               SC_FILTER, SS_FILTER,
+                                               (char *)buf, n * 4);
+                n = 0;
+            }
+        }
+    } else {
+        n_bits = 0;
+    }
+
+    len = snprintf (end, sizeof(end), "%"G_GUINT64_FORMAT, n_bits);
+    ccnet_processor_send_response (processor, SC_FILTER_END, SS_FILTER_END,
+                                   end, len + 1);
+}
+
+/* Only send filters that are much smaller than the block list. */
+static gboolean
+filter_is_worth_it (HaveFilter *hf, guint64 n_listed)
+{
+    guint64 n_bits;
+
+    if (!hf->filter)
+        return FALSE;
+    exists_filter_get_bits (hf->filter, &n_bits);
+    return (n_bits / 8 < n_listed * 41 / 4);
+}
+
+static void
+build_filter_done (void *vdata)
+{
+    FilterJob *job = vdata;
+    HaveFilter *hf = job->hf;
+
+    hf->building = FALSE;
+    hf->next_filter = NULL;
+
+    if (job->result < 0) {
+        if (job->filter != hf->filter)
+            exists_filter_free (job->filter);
+        if (job->dirs != hf->dirs)
+            g_hash_table_destroy (job->dirs);
+        /* Dirs may be recorded without all their blocks. */
+        hf->rebuild = TRUE;
+    } else {
+        if (job->filter != hf->filter) {
+            exists_filter_free (hf->filter);
+            hf->filter = job->filter;
+        }
+        if (job->dirs != hf->dirs) {
+            if (hf->dirs)
+                g_hash_table_destroy (hf->dirs);
+            hf->dirs = job->dirs;
+        }
+        memcpy (hf->head_id, job->head_id, 41);
+        hf->rebuild = job->overfull;
+        hf->capacity = job->capacity;
+    }
+
+    if (!job->processor_done) {
+        SeafileRecvblockV2Proc *proc = (SeafileRecvblockV2Proc *)job->processor;
+
+        proc->filter_job = NULL;
+        if (job->result == 0 && filter_is_worth_it (hf, job->n_listed))
+            send_have_filter (job->processor, hf->filter);
+        else
+            send_have_filter (job->processor, NULL);
+    }
+
+    g_free (job);
+}
+
+static guint64
+guess_capacity (const char *repo_id)
+{
+    gint64 size = seaf_repo_manager_get_repo_size (seaf->repo_mgr, repo_id);
+
+    return MAX (size / HAVE_FILTER_BLOCK_SIZE, MIN_HAVE_FILTER_CAPACITY);
+}
+
+/* "308 GET HAVE FILTER <n blocks>" */
+static void
+process_get_filter (CcnetProcessor *processor, char *content, int clen)
+{
+    SeafileRecvblockV2Proc *proc = (SeafileRecvblockV2Proc *)processor;
+    SeafRepo *repo;
+    HaveFilter *hf;
+    FilterJob *job;
+    guint64 n_listed;
+    char head_id[41];
+
+    if (clen == 0 || content[clen-1] != '\0') {
+        seaf_warning ("Bad have filter request.\n");
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+    n_listed = g_ascii_strtoull (content, NULL, 10);
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, proc->repo_id);
+    if (!repo || !repo->head) {
+        if (repo)
+            seaf_repo_unref (repo);
+        send_have_filter (processor, NULL);
+        return;
+    }
+    memcpy (head_id, repo->head->commit_id, 41);
+    seaf_repo_unref (repo);
+
+    hf = get_have_filter (proc->repo_id);
+    if (!hf || hf->building) {
+        send_have_filter (processor, NULL);
+        return;
+    }
+
+    if (hf->filter && !hf->rebuild && strcmp (hf->head_id, head_id) == 0) {
+        send_have_filter (processor,
+                          filter_is_worth_it (hf, n_listed) ? hf->filter : NULL);
+        return;
+    }
+
+    job = g_new0 (FilterJob, 1);
+    job->hf = hf;
+    memcpy (job->head_id, head_id, 41);
+    job->n_listed = n_listed;
+    job->processor = processor;
+
+    if (!hf->filter || hf->rebuild) {
+        job->capacity = hf->capacity ? hf->capacity :
+            guess_capacity (proc->repo_id);
+        job->capacity += job->capacity / 4;
+        if (job->capacity * 10 > MAX_HAVE_FILTER_BITS) {
+            g_free (job);
+            send_have_filter (processor, NULL);
+            return;
+        }
+        job->filter = exists_filter_new_empty (job->capacity);
+        job->dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+        hf->next_filter = job->filter;
+    } else {
+        job->capacity = hf->capacity;
+        job->filter = hf->filter;
+        job->dirs = hf->dirs;
+    }
+
+    hf->building = TRUE;
+    proc->filter_job = job;
+    ccnet_job_manager_schedule_job (seaf->job_mgr,
+                                    build_filter_thread,
+                                    build_filter_done,
+                                    job);
+}
+
 static void
 seafile_recvblock_v2_proc_class_init (SeafileRecvblockV2ProcClass *klass)
 {
@@ -63,7 +409,12 @@ seafile_recvblock_v2_proc_init (SeafileRecvblockV2Proc *processor)
 static int
 block_proc_start (CcnetProcessor *processor, int argc, char **argv)
 {
-    if (verify_session_token (processor, argc, argv) < 0) {
+    SeafileRecvblockV2Proc *proc = (SeafileRecvblockV2Proc *)processor;
+    BlockProcPriv *priv;
+
+    SEAF_PROBE_PROC_START (processor);
+
+    if (verify_session_token (processor, argc, argv, proc->repo_id) < 0) {
         ccnet_processor_send_response (processor, 
                                        SC_ACCESS_DENIED, SS_ACCESS_DENIED,
                                        NULL, 0);
@@ -72,7 +423,11 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
     }
     
     prepare_thread_data(processor, recv_blocks, recv_block_cb);
-    ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
+    priv = GET_PRIV (processor);
+    memcpy (priv->tdata->repo_id, proc->repo_id, 37);
+    ccnet_processor_send_response (processor, "200", "OK",
+                                   RECV_SLAVE_OPTIONS,
+                                   sizeof(RECV_SLAVE_OPTIONS));
 
     return 0;
 }
@@ -80,8 +435,18 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
 static void
 release_resource (CcnetProcessor *processor)
 {
+    SeafileRecvblockV2Proc *proc = (SeafileRecvblockV2Proc *)processor;
+    USE_PRIV;
+
+    if (proc->filter_job)
+        proc->filter_job->processor_done = TRUE;
+    /* The master only reuses the connection if it was clean too. */
+    if (priv->tdata)
+        priv->tdata->keep_conn = (processor->state == ESTABLISHED);
     release_thread (processor);
 
+    SEAF_PROBE_PROC_DONE (processor);
+
     CCNET_PROCESSOR_CLASS(seafile_recvblock_v2_proc_parent_class)->release_resource (processor);
 }
 
@@ -89,10 +454,17 @@ static void
 recv_block_cb (CEvent *event, void *vprocessor)
 {
     CcnetProcessor *processor = vprocessor;
+    SeafileRecvblockV2Proc *proc = vprocessor;
     BlockResponse *blk_rsp = event->data;
     char buf[32];
     int len;
 
+    if (blk_rsp->block_id[0] != '\0') {
+        have_filter_add (proc->repo_id, blk_rsp->block_id);
+        seaf_quota_manager_add_usage (seaf->quota_mgr, proc->repo_id,
+                                      blk_rsp->tx_bytes);
+    }
+
     len = snprintf (buf, 32, "%d", blk_rsp->block_idx);
     ccnet_processor_send_response (processor, SC_ACK, SS_ACK,
                                    buf, len + 1);
@@ -109,7 +481,11 @@ static void handle_update (CcnetProcessor *processor,
         if (memcmp (code, SC_BLOCKLIST, 3) == 0) {
             process_block_list (processor, content, clen);
             return;
+        } else if (memcmp (code, SC_GET_FILTER, 3) == 0) {
+            process_get_filter (processor, content, clen);
+            return;
         } else if (memcmp (code, SC_GET_PORT, 3) == 0) {
+            accept_options (processor, content, clen);
             send_port (processor);
             return;
         }
@@ -15,8 +15,13 @@
 typedef struct _SeafileRecvblockV2Proc SeafileRecvblockV2Proc;
 typedef struct _SeafileRecvblockV2ProcClass SeafileRecvblockV2ProcClass;
 
+struct FilterJob;
+
 struct _SeafileRecvblockV2Proc {
     CcnetProcessor parent_instance;
+
+    char              repo_id[37];
+    struct FilterJob *filter_job;
 };
 
 struct _SeafileRecvblockV2ProcClass {
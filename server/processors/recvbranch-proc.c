@@ -7,7 +7,6 @@
 #include "seafile-session.h"
 #include "recvbranch-proc.h"
 #include "vc-common.h"
-#include "monitor-rpc-wrappers.h"
 
 #define SC_BAD_COMMIT   "401"
 #define SS_BAD_COMMIT   "Commit does not exist"
@@ -212,12 +211,6 @@ out:
     return vprocessor;
 }
 
-static void
-compute_callback (void *result, void *data, GError *error)
-{
-    /* nothing to do */
-}
-
 static void 
 thread_done (void *result)
 {
@@ -231,15 +224,7 @@ thread_done (void *result)
 
     if (strcmp (priv->rsp_code, SC_OK) == 0) {
         /* Repo is updated, trigger repo size computation. */
-        if (seaf->monitor_id != NULL &&
-            (strcmp (seaf->monitor_id, seaf->session->base.id) == 0 ||
-             ccnet_peer_is_ready (seaf->ccnetrpc_client, seaf->monitor_id)))
-        {
-            monitor_compute_repo_size_async_wrapper (seaf->monitor_id, 
-                                                     priv->repo_id,
-                                                     compute_callback,
-                                                     NULL);
-        }
+        seaf_size_notifier_repo_changed (seaf->size_notifier, priv->repo_id);
 
         ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
         ccnet_processor_done (processor, TRUE);
@@ -15,6 +15,7 @@
 #include "recvcommit-v3-proc.h"
 #include "processors/objecttx-common.h"
 #include "seaf-utils.h"
+#include "seaf-probes.h"
 
 enum {
     INIT,
@@ -50,6 +51,8 @@ release_resource (CcnetProcessor *processor)
     if (priv->registered)
         seaf_obj_store_unregister_async_write (seaf->commit_mgr->obj_store,
                                                priv->writer_id);
+
+    SEAF_PROBE_PROC_DONE (processor);
 }
 
 static void
@@ -76,6 +79,8 @@ recv_commit_start (CcnetProcessor *processor, int argc, char **argv)
     USE_PRIV;
     char *session_token;
 
+    SEAF_PROBE_PROC_START (processor);
+
     if (argc != 2) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -0,0 +1,290 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
+#include "log.h"
+
+#include <fcntl.h>
+
+#include <ccnet.h>
+#include "net.h"
+#include "utils.h"
+
+#include "seafile-session.h"
+#include "recvcommit-v4-proc.h"
+#include "processors/objecttx-common.h"
+#include "seaf-utils.h"
+
+/*
+ * Receives the commit pack of sendcommit-v4. The commits of each segment
+ * are written in one async batch. Segments are acked once all commits
+ * received so far are written, so the sender is held back by the backend.
+ */
+
+enum {
+    INIT,
+    RECV_PACK
+};
+
+/* Commit objects are small, anything larger is a broken pack. */
+#define MAX_PACKED_COMMIT_SIZE (1 << 20)
+
+typedef struct {
+    guint32 writer_id;
+    gboolean registered;
+
+    GByteArray *pack_buf;
+    int         n_pending;      /* commits being written */
+    int         n_segs;         /* segments received and not acked */
+    int         n_commits;
+    gboolean    end_received;
+} RecvcommitPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), SEAFILE_TYPE_RECVCOMMIT_V4_PROC, RecvcommitPriv))
+
+#define USE_PRIV \
+    RecvcommitPriv *priv = GET_PRIV(processor);
+
+static int recv_commit_start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen);
+static void
+write_done_cb (OSAsyncResult *res, void *cb_data);
+
+
+G_DEFINE_TYPE (SeafileRecvcommitV4Proc, seafile_recvcommit_v4_proc, CCNET_TYPE_PROCESSOR)
+
+static void
+release_resource (CcnetProcessor *processor)
+{
+    USE_PRIV;
+
+    if (priv->registered)
+        seaf_obj_store_unregister_async_write (seaf->commit_mgr->obj_store,
+                                               priv->writer_id);
+    if (priv->pack_buf)
+        g_byte_array_free (priv->pack_buf, TRUE);
+}
+
+static void
+seafile_recvcommit_v4_proc_class_init (SeafileRecvcommitV4ProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "recvcommit-v4-proc";
+    proc_class->start = recv_commit_start;
+    proc_class->handle_update = handle_update;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (RecvcommitPriv));
+}
+
+static void
+seafile_recvcommit_v4_proc_init (SeafileRecvcommitV4Proc *processor)
+{
+}
+
+static int
+recv_commit_start (CcnetProcessor *processor, int argc, char **argv)
+{
+    USE_PRIV;
+    char *session_token;
+
+    if (argc != 2) {
+        ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return -1;
+    }
+
+    session_token = argv[1];
+    if (seaf_token_manager_verify_token (seaf->token_mgr,
+                                         processor->peer_id,
+                                         session_token, NULL) == 0) {
+        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+        processor->state = RECV_PACK;
+        priv->pack_buf = g_byte_array_new ();
+        priv->writer_id =
+            seaf_obj_store_register_async_write (seaf->commit_mgr->obj_store,
+                                                 write_done_cb,
+                                                 processor);
+        priv->registered = TRUE;
+        return 0;
+    } else {
+        ccnet_processor_send_response (processor, 
+                                       SC_ACCESS_DENIED, SS_ACCESS_DENIED,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return -1;
+    }
+}
+
+/* Ack what was received once nothing is left to write. */
+static void
+check_written (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    char ack[16];
+    int len;
+
+    if (priv->n_pending > 0)
+        return;
+
+    if (priv->n_segs > 0) {
+        len = snprintf (ack, sizeof(ack), "%d", priv->n_segs);
+        ccnet_processor_send_response (processor, SC_PACK_ACK, SS_PACK_ACK,
+                                       ack, len + 1);
+        priv->n_segs = 0;
+    }
+
+    if (priv->end_received) {
+        seaf_debug ("[recvcommit] Received %d commits.\n", priv->n_commits);
+        ccnet_processor_send_response (processor, SC_ACK, SS_ACK, NULL, 0);
+        ccnet_processor_done (processor, TRUE);
+    }
+}
+
+static void
+write_done_cb (OSAsyncResult *res, void *cb_data)
+{
+    CcnetProcessor *processor = cb_data;
+    USE_PRIV;
+
+    if (!res->success) {
+        ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
+                                       NULL, 0);
+        g_warning ("[recvcommit] Failed to write commit object %s.\n",
+                   res->obj_id);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    --priv->n_pending;
+    check_written (processor);
+}
+
+static gboolean
+packed_commit_is_valid (PackedObject *obj, guint32 len)
+{
+    SeafCommit *commit;
+    int i;
+
+    for (i = 0; i < 40; ++i)
+        if (!g_ascii_isxdigit (obj->id[i]))
+            return FALSE;
+
+    commit = seaf_commit_from_data (obj->id, (const char *)obj->object, len);
+    if (!commit)
+        return FALSE;
+    seaf_commit_unref (commit);
+
+    return TRUE;
+}
+
+static void
+receive_pack (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+    PackedObject *obj;
+    guint32 len, pos = 0;
+    GPtrArray *ids = g_ptr_array_new ();
+    GPtrArray *data = g_ptr_array_new ();
+    GArray *lens = g_array_new (FALSE, FALSE, sizeof(int));
+    int ilen;
+
+    g_byte_array_append (priv->pack_buf, (guint8 *)content, clen);
+
+    while (priv->pack_buf->len - pos >= sizeof(PackedObject)) {
+        obj = (PackedObject *)(priv->pack_buf->data + pos);
+        len = ntohl (obj->len);
+        if (len == 0 || len > MAX_PACKED_COMMIT_SIZE) {
+            g_warning ("[recvcommit] Bad commit length %u in pack.\n", len);
+            goto bad;
+        }
+        if (priv->pack_buf->len - pos < sizeof(PackedObject) + len)
+            break;
+
+        obj->id[40] = '\0';
+        if (!packed_commit_is_valid (obj, len)) {
+            g_warning ("[recvcommit] Bad commit %.40s in pack.\n", obj->id);
+            goto bad;
+        }
+
+        ilen = (int)len;
+        g_ptr_array_add (ids, obj->id);
+        g_ptr_array_add (data, obj->object);
+        g_array_append_val (lens, ilen);
+        pos += sizeof(PackedObject) + len;
+    }
+
+    if (ids->len > 0) {
+        if (seaf_obj_store_async_write_batch (seaf->commit_mgr->obj_store,
+                                              priv->writer_id,
+                                              (const char **)ids->pdata,
+                                              (const void **)data->pdata,
+                                              (const int *)lens->data,
+                                              ids->len) < 0)
+            goto bad;
+        priv->n_pending += ids->len;
+        priv->n_commits += ids->len;
+    }
+    g_byte_array_remove_range (priv->pack_buf, 0, pos);
+
+    g_ptr_array_free (ids, TRUE);
+    g_ptr_array_free (data, TRUE);
+    g_array_free (lens, TRUE);
+
+    ++priv->n_segs;
+    check_written (processor);
+    return;
+
+bad:
+    g_ptr_array_free (ids, TRUE);
+    g_ptr_array_free (data, TRUE);
+    g_array_free (lens, TRUE);
+    ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
+                                   NULL, 0);
+    ccnet_processor_done (processor, FALSE);
+}
+
+static void
+end_pack (CcnetProcessor *processor)
+{
+    USE_PRIV;
+
+    if (priv->pack_buf->len != 0) {
+        g_warning ("[recvcommit] Pack ends in the middle of a commit.\n");
+        ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    priv->end_received = TRUE;
+    check_written (processor);
+}
+
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen)
+{
+    switch (processor->state) {
+    case RECV_PACK:
+        if (strncmp(code, SC_PACK, 3) == 0) {
+            receive_pack (processor, content, clen);
+        } else if (strncmp(code, SC_PACK_END, 3) == 0) {
+            end_pack (processor);
+        } else {
+            g_warning ("[recvcommit] Bad update: %s %s\n", code, code_msg);
+            ccnet_processor_send_response (processor,
+                                           SC_BAD_UPDATE_CODE, SS_BAD_UPDATE_CODE,
+                                           NULL, 0);
+            ccnet_processor_done (processor, FALSE);
+        }
+        break;
+    default:
+        g_assert (0);
+    }
+}
@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAFILE_RECVCOMMIT_V4_PROC_H
+#define SEAFILE_RECVCOMMIT_V4_PROC_H
+
+#include <glib-object.h>
+
+
+#define SEAFILE_TYPE_RECVCOMMIT_V4_PROC                  (seafile_recvcommit_v4_proc_get_type ())
+#define SEAFILE_RECVCOMMIT_V4_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), SEAFILE_TYPE_RECVCOMMIT_V4_PROC, SeafileRecvcommitV4Proc))
+#define SEAFILE_IS_RECVCOMMIT_V4_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SEAFILE_TYPE_RECVCOMMIT_V4_PROC))
+#define SEAFILE_RECVCOMMIT_V4_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), SEAFILE_TYPE_RECVCOMMIT_V4_PROC, SeafileRecvcommitV4ProcClass))
+#define IS_SEAFILE_RECVCOMMIT_V4_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), SEAFILE_TYPE_RECVCOMMIT_V4_PROC))
+#define SEAFILE_RECVCOMMIT_V4_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), SEAFILE_TYPE_RECVCOMMIT_V4_PROC, SeafileRecvcommitV4ProcClass))
+
+typedef struct _SeafileRecvcommitV4Proc SeafileRecvcommitV4Proc;
+typedef struct _SeafileRecvcommitV4ProcClass SeafileRecvcommitV4ProcClass;
+
+struct _SeafileRecvcommitV4Proc {
+    CcnetProcessor parent_instance;
+};
+
+struct _SeafileRecvcommitV4ProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType seafile_recvcommit_v4_proc_get_type ();
+
+#endif
@@ -18,10 +18,21 @@
 #include "processors/objecttx-common.h"
 #include "recvfs-proc.h"
 #include "seaf-utils.h"
+#include "seaf-probes.h"
 
 #define CHECK_INTERVAL 100      /* 100ms */
 #define MAX_NUM_BATCH  64
 
+/*
+ * The server offers "push" with its 200 OK. A client that knows the head
+ * the server has may then send the objects that are not in it, before
+ * the roots, children first. Objects that are not pushed are then taken
+ * to be in the head, with complete sub-trees. They are only stat'ed, and
+ * the existing dirs are not walked. Anything missing is requested as in
+ * the old protocol. Old clients ignore the offer.
+ */
+#define PUSH_OFFER "push"
+
 enum {
     RECV_ROOT,
     FETCH_OBJECT
@@ -43,8 +54,48 @@ typedef struct  {
     guint32  reader_id;
     guint32  writer_id;
     guint32  stat_id;
+
+    /* Objects pushed by the client. */
+    GHashTable *pushed;
+    /* Entries of the pushed dirs, checked after the roots are in. */
+    GHashTable *pushed_children;
+
+    /* Dirs being parsed. */
+    int parsing_objects;
+    struct ParseCtx *parse_ctx;
 } SeafileRecvfsProcPriv;
 
+/*
+ * Dir objects, received or read from the obj store, are parsed in the
+ * job manager's threads, and their children are stat'ed or read in
+ * batches as soon as they are parsed. Missing objects are requested as
+ * soon as nothing is being inspected, so the dirs of several levels of
+ * a new tree can be in flight at once.
+ *
+ * The parse context is shared with the jobs, which may finish after the
+ * processor is done.
+ */
+typedef struct ParseCtx {
+    CcnetProcessor *processor;
+    gboolean processor_done;
+    int ref;                    /* only touched in the main thread */
+} ParseCtx;
+
+typedef struct ParseJob {
+    ParseCtx *ctx;
+    char obj_id[41];
+    char *data;
+    int len;
+    /* Received from the client, saved once it's parsed. */
+    gboolean received;
+    gboolean sharded;
+
+    /* Results */
+    gboolean ok;
+    GPtrArray *dir_ids;
+    GPtrArray *file_ids;
+} ParseJob;
+
 #define GET_PRIV(o)  \
    (G_TYPE_INSTANCE_GET_PRIVATE ((o), SEAFILE_TYPE_RECVFS_PROC, SeafileRecvfsProcPriv))
 
@@ -59,12 +110,29 @@ static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen);
 
+static void
+parse_ctx_unref (ParseCtx *ctx)
+{
+    if (--ctx->ref == 0)
+        g_free (ctx);
+}
+
 static void
 release_resource(CcnetProcessor *processor)
 {
     USE_PRIV;
 
+    if (priv->parse_ctx) {
+        priv->parse_ctx->processor_done = TRUE;
+        parse_ctx_unref (priv->parse_ctx);
+        priv->parse_ctx = NULL;
+    }
+
     g_hash_table_destroy (priv->fs_objects);
+    if (priv->pushed)
+        g_hash_table_destroy (priv->pushed);
+    if (priv->pushed_children)
+        g_hash_table_destroy (priv->pushed_children);
 
     string_list_free (priv->fs_roots);
 
@@ -79,6 +147,8 @@ release_resource(CcnetProcessor *processor)
                                               priv->stat_id);
     }
 
+    SEAF_PROBE_PROC_DONE (processor);
+
     CCNET_PROCESSOR_CLASS (seafile_recvfs_proc_parent_class)->release_resource (processor);
 }
 
@@ -144,79 +214,213 @@ request_object_batch (CcnetProcessor *processor,
     ++priv->pending_objects;
 }
 
+/*
+ * Sub-dirs are read and files are stat'ed in batches of up to
+ * MAX_NUM_BATCH objects, so that the obj store handles each batch in
+ * one task.
+ */
 static int
-check_seafdir (CcnetProcessor *processor, SeafDir *dir)
+inspect_object_batch (CcnetProcessor *processor,
+                      const char **obj_ids, int n_objs, gboolean is_dir)
 {
     USE_PRIV;
+    int ret;
+
+    if (n_objs == 0)
+        return 0;
+
+    if (is_dir)
+        ret = seaf_obj_store_async_read_batch (seaf->fs_mgr->obj_store,
+                                               priv->reader_id,
+                                               obj_ids, n_objs);
+    else
+        /* For file, we just need to check existence. */
+        ret = seaf_obj_store_async_stat_batch (seaf->fs_mgr->obj_store,
+                                               priv->stat_id,
+                                               obj_ids, n_objs);
+    if (ret < 0) {
+        g_warning ("[recvfs] Failed to start async %s of %s.\n",
+                   is_dir ? "read" : "stat", obj_ids[0]);
+        return -1;
+    }
+
+    priv->inspect_objects += n_objs;
+    return 0;
+}
+
+/* @ids are inspected in batches of MAX_NUM_BATCH. */
+static int
+inspect_objects (CcnetProcessor *processor, GPtrArray *ids, gboolean is_dir)
+{
+    int i, n;
+
+    for (i = 0; i < ids->len; i += n) {
+        n = MIN (ids->len - i, MAX_NUM_BATCH);
+        if (inspect_object_batch (processor,
+                                  (const char **)ids->pdata + i, n,
+                                  is_dir) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void *
+parse_thread (void *vjob)
+{
+    ParseJob *job = vjob;
+    SeafDir *dir;
     GList *ptr;
     SeafDirent *dent;
 
+    /* The shards of a sharded dir are read by the fs manager. */
+    if (job->sharded)
+        dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, job->obj_id);
+    else
+        dir = seaf_dir_from_data (job->obj_id, job->data, job->len);
+    if (!dir)
+        return vjob;
+
+    job->dir_ids = g_ptr_array_new_with_free_func (g_free);
+    job->file_ids = g_ptr_array_new_with_free_func (g_free);
     for (ptr = dir->entries; ptr != NULL; ptr = ptr->next) {
         dent = ptr->data;
 
         if (strcmp (dent->id, EMPTY_SHA1) == 0)
             continue;
 
+        if (S_ISDIR(dent->mode))
+            g_ptr_array_add (job->dir_ids, g_strdup (dent->id));
+        else
+            g_ptr_array_add (job->file_ids, g_strdup (dent->id));
+    }
+    seaf_dir_free (dir);
+
+    job->ok = TRUE;
+    return vjob;
+}
+
+static void
+parse_job_free (ParseJob *job)
+{
+    parse_ctx_unref (job->ctx);
+    g_free (job->data);
+    if (job->dir_ids)
+        g_ptr_array_free (job->dir_ids, TRUE);
+    if (job->file_ids)
+        g_ptr_array_free (job->file_ids, TRUE);
+    g_free (job);
+}
+
+static int save_fs_object (CcnetProcessor *processor,
+                           const char *obj_id, const char *data, int len);
+
+static void
+parse_done (void *vjob)
+{
+    ParseJob *job = vjob;
+    CcnetProcessor *processor = job->ctx->processor;
+    SeafileRecvfsProcPriv *priv;
+
+    if (job->ctx->processor_done) {
+        parse_job_free (job);
+        return;
+    }
+
+    priv = GET_PRIV (processor);
+    --(priv->parsing_objects);
+
+    if (!job->ok) {
+        if (job->received) {
+            g_warning ("Bad directory object %s.\n", job->obj_id);
+            goto bad;
+        }
+        g_warning ("[recvfs] Corrupt dir object %s.\n", job->obj_id);
+        request_object_batch (processor, priv, job->obj_id);
+        goto out;
+    }
+
 #ifdef DEBUG
-        seaf_debug ("[recvfs] Inspect object %s.\n", dent->id);
+    seaf_debug ("[recvfs] Parsed seafdir %s.\n", job->obj_id);
 #endif
 
-        if (S_ISDIR(dent->mode)) {
-            if (seaf_obj_store_async_read (seaf->fs_mgr->obj_store,
-                                           priv->reader_id,
-                                           dent->id) < 0) {
-                g_warning ("[recvfs] Failed to start async read of %s.\n",
-                           dent->id);
-                goto bad;
-            }
-        } else {
-            /* For file, we just need to check existence. */
-            if (seaf_obj_store_async_stat (seaf->fs_mgr->obj_store,
-                                           priv->stat_id,
-                                           dent->id) < 0) {
-                g_warning ("[recvfs] Failed to start async stat of %s.\n",
-                           dent->id);
-                goto bad;
-            }
-        }
-        ++(priv->inspect_objects);
+    if (inspect_objects (processor, job->dir_ids, TRUE) < 0 ||
+        inspect_objects (processor, job->file_ids, FALSE) < 0)
+        goto bad;
+
+    if (job->received) {
+        if (save_fs_object (processor, job->obj_id, job->data, job->len) < 0)
+            goto bad;
+        g_hash_table_remove (priv->fs_objects, job->obj_id);
     }
 
-    return 0;
+out:
+    if (priv->inspect_objects == 0)
+        request_object_batch_flush (processor, priv);
+    parse_job_free (job);
+    return;
 
 bad:
     ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
                                    NULL, 0);
     ccnet_processor_done (processor, FALSE);
-    return -1;
+    parse_job_free (job);
+}
+
+/* Takes @data. */
+static void
+parse_seafdir (CcnetProcessor *processor, const char *obj_id,
+               char *data, int len, gboolean received)
+{
+    USE_PRIV;
+    ParseJob *job;
+
+    if (!priv->parse_ctx) {
+        priv->parse_ctx = g_new0 (ParseCtx, 1);
+        priv->parse_ctx->processor = processor;
+        priv->parse_ctx->ref = 1;
+    }
+
+    job = g_new0 (ParseJob, 1);
+    job->ctx = priv->parse_ctx;
+    ++job->ctx->ref;
+    memcpy (job->obj_id, obj_id, 40);
+    job->data = data;
+    job->len = len;
+    job->received = received;
+    if (!received)
+        job->sharded = seaf_dir_data_is_sharded (data, len);
+
+    ++(priv->parsing_objects);
+    ccnet_job_manager_schedule_job (seaf->job_mgr,
+                                    parse_thread,
+                                    parse_done,
+                                    job);
 }
 
 static void
 on_seafdir_read (OSAsyncResult *res, void *cb_data)
 {
     CcnetProcessor *processor = cb_data;
-    SeafDir *dir;
     USE_PRIV;
 
     --(priv->inspect_objects);
 
     if (!res->success) {
         request_object_batch (processor, priv, res->obj_id);
-        return;
+        goto out;
     }
 
 #ifdef DEBUG
     seaf_debug ("[recvfs] Read seafdir %s.\n", res->obj_id);
 #endif
 
-    dir = seaf_dir_from_data (res->obj_id, res->data, res->len);
-    if (!dir) {
-        g_warning ("[recvfs] Corrupt dir object %s.\n", res->obj_id);
-        request_object_batch (processor, priv, res->obj_id);
-        return;
-    }
-    check_seafdir (processor, dir);
-    seaf_dir_free (dir);
+    parse_seafdir (processor, res->obj_id,
+                   g_memdup (res->data, res->len), res->len, FALSE);
+
+out:
+    if (priv->inspect_objects == 0)
+        request_object_batch_flush (processor, priv);
 }
 
 static void
@@ -233,6 +437,9 @@ on_seafile_stat (OSAsyncResult *res, void *cb_data)
 
     if (!res->success)
         request_object_batch (processor, priv, res->obj_id);
+
+    if (priv->inspect_objects == 0)
+        request_object_batch_flush (processor, priv);
 }
 
 static void
@@ -260,7 +467,8 @@ check_end_condition (CcnetProcessor *processor)
     /* Flush periodically. */
     request_object_batch_flush (processor, priv);
 
-    if (priv->pending_objects == 0 && priv->inspect_objects == 0) {
+    if (priv->pending_objects == 0 && priv->inspect_objects == 0 &&
+        priv->parsing_objects == 0) {
         seaf_debug ("Recv fs roots end.\n");
         ccnet_processor_send_response (processor, SC_END, SS_END, NULL, 0);
         ccnet_processor_done (processor, TRUE);
@@ -292,6 +500,8 @@ start (CcnetProcessor *processor, int argc, char **argv)
     char *session_token;
     USE_PRIV;
 
+    SEAF_PROBE_PROC_START (processor);
+
     if (argc != 1) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -302,10 +512,16 @@ start (CcnetProcessor *processor, int argc, char **argv)
     if (seaf_token_manager_verify_token (seaf->token_mgr,
                                          processor->peer_id,
                                          session_token, NULL) == 0) {
-        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+        ccnet_processor_send_response (processor, SC_OK, SS_OK,
+                                       PUSH_OFFER, sizeof(PUSH_OFFER));
         processor->state = RECV_ROOT;
         priv->fs_objects = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                   g_free, NULL);
+        priv->pushed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+        priv->pushed_children = g_hash_table_new_full (g_str_hash,
+                                                       g_str_equal,
+                                                       g_free, NULL);
         register_async_io (processor);
         return 0;
     } else {
@@ -318,15 +534,14 @@ start (CcnetProcessor *processor, int argc, char **argv)
 }
 
 static int
-save_fs_object (CcnetProcessor *processor, ObjectPack *pack, int len)
+save_fs_object (CcnetProcessor *processor,
+                const char *obj_id, const char *data, int len)
 {
     USE_PRIV;
 
     return seaf_obj_store_async_write (seaf->fs_mgr->obj_store,
                                        priv->writer_id,
-                                       pack->id,
-                                       pack->object,
-                                       len - 41);
+                                       obj_id, data, len);
 }
 
 static int
@@ -347,16 +562,10 @@ recv_fs_object (CcnetProcessor *processor, char *content, int clen)
 
     type = seaf_metadata_type_from_data(pack->object, clen);
     if (type == SEAF_METADATA_TYPE_DIR) {
-        SeafDir *dir;
-        dir = seaf_dir_from_data (pack->id, pack->object, clen - 41);
-        if (!dir) {
-            g_warning ("Bad directory object %s.\n", pack->id);
-            goto bad;
-        }
-        int ret = check_seafdir (processor, dir);
-        seaf_dir_free (dir);
-        if (ret < 0)
-            goto bad;
+        /* Saved once it's parsed. */
+        parse_seafdir (processor, pack->id,
+                       g_memdup (pack->object, clen - 41), clen - 41, TRUE);
+        return 0;
     } else if (type == SEAF_METADATA_TYPE_FILE) {
         /* TODO: check seafile format. */
 #if 0
@@ -370,7 +579,7 @@ recv_fs_object (CcnetProcessor *processor, char *content, int clen)
         goto bad;
     }
 
-    if (save_fs_object (processor, pack, clen) < 0) {
+    if (save_fs_object (processor, pack->id, pack->object, clen - 41) < 0) {
         goto bad;
     }
 
@@ -386,6 +595,57 @@ bad:
     return -1;
 }
 
+static int
+recv_pushed_object (CcnetProcessor *processor, char *content, int clen)
+{
+    USE_PRIV;
+    ObjectPack *pack = (ObjectPack *)content;
+    SeafDir *dir;
+    GList *ptr;
+    SeafDirent *dent;
+    uint32_t type;
+
+    if (clen < sizeof(ObjectPack) || pack->id[40] != '\0') {
+        g_warning ("invalid object id.\n");
+        goto bad;
+    }
+
+    seaf_debug ("[recvfs] Recv pushed fs object %.8s.\n", pack->id);
+
+    type = seaf_metadata_type_from_data(pack->object, clen);
+    if (type == SEAF_METADATA_TYPE_DIR) {
+        dir = seaf_dir_from_data (pack->id, pack->object, clen - 41);
+        if (!dir) {
+            g_warning ("Bad directory object %s.\n", pack->id);
+            goto bad;
+        }
+        for (ptr = dir->entries; ptr != NULL; ptr = ptr->next) {
+            dent = ptr->data;
+            if (strcmp (dent->id, EMPTY_SHA1) != 0)
+                g_hash_table_insert (priv->pushed_children,
+                                     g_strdup (dent->id), (gpointer)1);
+        }
+        seaf_dir_free (dir);
+    } else if (type != SEAF_METADATA_TYPE_FILE) {
+        g_warning ("Invalid object type.\n");
+        goto bad;
+    }
+
+    if (save_fs_object (processor, pack->id, pack->object, clen - 41) < 0)
+        goto bad;
+
+    g_hash_table_insert (priv->pushed, g_strdup (pack->id), (gpointer)1);
+    return 0;
+
+bad:
+    ccnet_processor_send_response (processor, SC_BAD_OBJECT,
+                                   SS_BAD_OBJECT, NULL, 0);
+    g_warning ("[recvfs] Bad fs object received.\n");
+    ccnet_processor_done (processor, FALSE);
+
+    return -1;
+}
+
 static void
 recv_fs_object_seg (CcnetProcessor *processor, char *content, int clen)
 {
@@ -405,14 +665,64 @@ static void
 process_fs_object_seg (CcnetProcessor *processor)
 {
     USE_PRIV;
+    int ret;
 
-    if (recv_fs_object (processor, priv->obj_seg, priv->obj_seg_len) == 0) {
+    if (processor->state == RECV_ROOT)
+        ret = recv_pushed_object (processor, priv->obj_seg, priv->obj_seg_len);
+    else
+        ret = recv_fs_object (processor, priv->obj_seg, priv->obj_seg_len);
+    if (ret == 0) {
         g_free (priv->obj_seg);
         priv->obj_seg = NULL;
         priv->obj_seg_len = 0;
     }
 }
 
+/*
+ * Roots and entries of pushed dirs that were not pushed are in the head,
+ * so they only have to exist.
+ */
+static void
+process_pushed_fsroot_list (CcnetProcessor *processor)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ptr;
+    const char *ids[MAX_NUM_BATCH];
+    int n = 0;
+    USE_PRIV;
+
+    for (ptr = priv->fs_roots; ptr != NULL; ptr = ptr->next) {
+        if (strcmp (ptr->data, EMPTY_SHA1) != 0)
+            g_hash_table_insert (priv->pushed_children,
+                                 g_strdup (ptr->data), (gpointer)1);
+    }
+
+    g_hash_table_iter_init (&iter, priv->pushed_children);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (g_hash_table_lookup (priv->pushed, key))
+            continue;
+
+        ids[n++] = key;
+        if (n == MAX_NUM_BATCH) {
+            if (inspect_object_batch (processor, ids, n, FALSE) < 0)
+                goto bad;
+            n = 0;
+        }
+    }
+    if (inspect_object_batch (processor, ids, n, FALSE) < 0)
+        goto bad;
+
+    string_list_free (priv->fs_roots);
+    priv->fs_roots = NULL;
+    return;
+
+bad:
+    ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
+                                   NULL, 0);
+    ccnet_processor_done (processor, FALSE);
+}
+
 static void
 process_fsroot_list (CcnetProcessor *processor)
 {
@@ -422,6 +732,11 @@ process_fsroot_list (CcnetProcessor *processor)
 
     request_object_batch_begin (priv);
 
+    if (g_hash_table_size (priv->pushed) > 0) {
+        process_pushed_fsroot_list (processor);
+        return;
+    }
+
     for (ptr = priv->fs_roots; ptr != NULL; ptr = ptr->next) {
         object_id = ptr->data;
 
@@ -488,6 +803,13 @@ handle_update (CcnetProcessor *processor,
    case RECV_ROOT:
         if (strncmp(code, SC_ROOT, 3) == 0) {
             queue_fs_roots (processor, content, clen);
+        } else if (strncmp(code, SC_OBJ_SEG, 3) == 0) {
+            recv_fs_object_seg (processor, content, clen);
+        } else if (strncmp(code, SC_OBJ_SEG_END, 3) == 0) {
+            recv_fs_object_seg (processor, content, clen);
+            process_fs_object_seg (processor);
+        } else if (strncmp(code, SC_OBJECT, 3) == 0) {
+            recv_pushed_object (processor, content, clen);
         } else if (strncmp(code, SC_ROOT_END, 3) == 0) {
             /* change state to FETCH_OBJECT */
             process_fsroot_list (processor);
@@ -0,0 +1,169 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <ccnet.h>
+
+#include "seafile-session.h"
+#include "rpc-dispatcher.h"
+
+#include "rpc-dispatch-proc.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+/*
+ * Serves a threaded rpc service with the protocol of ccnet's threaded
+ * rpcserver processor, running the calls in the rpc dispatcher.
+ */
+
+#define SC_CLIENT_CALL  "301"
+#define SS_CLIENT_CALL  "CLIENT CALL"
+#define SC_CLIENT_MORE  "302"
+#define SS_CLIENT_MORE  "MORE"
+#define SC_SERVER_RET   "311"
+#define SS_SERVER_RET   "SERVER RET"
+#define SC_SERVER_MORE  "312"
+#define SS_SERVER_MORE  "HAS MORE"
+#define SC_SERVER_ERR   "411"
+#define SS_SERVER_ERR   "Fail to invoke the function, check the function"
+
+/* The max length of the data sent in one response. */
+#define MAX_TRANSFER_LENGTH 65535
+
+typedef struct {
+    RpcCall     *call;
+
+    /* The part of the last result not sent yet. */
+    char        *buf;
+    gsize       len;
+    gsize       off;
+} SeafileRpcDispatchProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), SEAFILE_TYPE_RPC_DISPATCH_PROC, SeafileRpcDispatchProcPriv))
+
+#define USE_PRIV \
+    SeafileRpcDispatchProcPriv *priv = GET_PRIV(processor);
+
+G_DEFINE_TYPE (SeafileRpcDispatchProc, seafile_rpc_dispatch_proc, CCNET_TYPE_PROCESSOR)
+
+static int start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen);
+
+static void
+release_resource (CcnetProcessor *processor)
+{
+    USE_PRIV;
+
+    if (priv->call) {
+        seaf_rpc_dispatcher_cancel (seaf->rpc_dispatcher, priv->call);
+        priv->call = NULL;
+    }
+    g_free (priv->buf);
+    priv->buf = NULL;
+
+    CCNET_PROCESSOR_CLASS (seafile_rpc_dispatch_proc_parent_class)->release_resource (processor);
+}
+
+static void
+seafile_rpc_dispatch_proc_class_init (SeafileRpcDispatchProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "seafile-rpc-dispatch-proc";
+    proc_class->start = start;
+    proc_class->handle_update = handle_update;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (SeafileRpcDispatchProcPriv));
+}
+
+static void
+seafile_rpc_dispatch_proc_init (SeafileRpcDispatchProc *processor)
+{
+}
+
+static int
+start (CcnetProcessor *processor, int argc, char **argv)
+{
+    ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+    return 0;
+}
+
+static void
+send_next_piece (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    gsize n = MIN (priv->len - priv->off, MAX_TRANSFER_LENGTH);
+
+    if (priv->off + n < priv->len) {
+        ccnet_processor_send_response (processor,
+                                       SC_SERVER_MORE, SS_SERVER_MORE,
+                                       priv->buf + priv->off, n);
+        priv->off += n;
+        return;
+    }
+
+    ccnet_processor_send_response (processor, SC_SERVER_RET, SS_SERVER_RET,
+                                   priv->buf + priv->off, n);
+    g_free (priv->buf);
+    priv->buf = NULL;
+}
+
+static void
+call_done (char *ret, gsize ret_len, void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    USE_PRIV;
+
+    priv->call = NULL;
+
+    if (!ret) {
+        ccnet_processor_send_response (processor, SC_SERVER_ERR, SS_SERVER_ERR,
+                                       NULL, 0);
+        return;
+    }
+
+    priv->buf = ret;
+    priv->len = ret_len;
+    priv->off = 0;
+    send_next_piece (processor);
+}
+
+static void
+handle_update (CcnetProcessor *processor,
+               char *code, char *code_msg,
+               char *content, int clen)
+{
+    USE_PRIV;
+
+    if (memcmp (code, SC_CLIENT_CALL, 3) == 0) {
+        /* Clients wait for the result before the next call. */
+        if (priv->call || priv->buf) {
+            seaf_warning ("[rpc] Call before the last one returned.\n");
+            ccnet_processor_send_response (processor,
+                                           SC_SERVER_ERR, SS_SERVER_ERR,
+                                           NULL, 0);
+            return;
+        }
+        priv->call = seaf_rpc_dispatcher_call (seaf->rpc_dispatcher,
+                                               processor->name,
+                                               g_memdup (content, clen), clen,
+                                               call_done, processor);
+        return;
+    }
+
+    if (memcmp (code, SC_CLIENT_MORE, 3) == 0) {
+        if (priv->buf)
+            send_next_piece (processor);
+        return;
+    }
+
+    seaf_debug ("[rpc] Bad update: %s %s.\n", code, code_msg);
+    ccnet_processor_send_response (processor, SC_BAD_UPDATE_CODE,
+                                   SS_BAD_UPDATE_CODE, NULL, 0);
+    ccnet_processor_done (processor, FALSE);
+}
@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAFILE_RPC_DISPATCH_PROC_H
+#define SEAFILE_RPC_DISPATCH_PROC_H
+
+#include <glib-object.h>
+#include <ccnet.h>
+
+#define SEAFILE_TYPE_RPC_DISPATCH_PROC                  (seafile_rpc_dispatch_proc_get_type ())
+#define SEAFILE_RPC_DISPATCH_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), SEAFILE_TYPE_RPC_DISPATCH_PROC, SeafileRpcDispatchProc))
+#define SEAFILE_IS_RPC_DISPATCH_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SEAFILE_TYPE_RPC_DISPATCH_PROC))
+#define SEAFILE_RPC_DISPATCH_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), SEAFILE_TYPE_RPC_DISPATCH_PROC, SeafileRpcDispatchProcClass))
+#define IS_SEAFILE_RPC_DISPATCH_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), SEAFILE_TYPE_RPC_DISPATCH_PROC))
+#define SEAFILE_RPC_DISPATCH_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), SEAFILE_TYPE_RPC_DISPATCH_PROC, SeafileRpcDispatchProcClass))
+
+typedef struct _SeafileRpcDispatchProc SeafileRpcDispatchProc;
+typedef struct _SeafileRpcDispatchProcClass SeafileRpcDispatchProcClass;
+
+struct _SeafileRpcDispatchProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _SeafileRpcDispatchProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType seafile_rpc_dispatch_proc_get_type ();
+
+#endif
@@ -0,0 +1,138 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "notif-mgr.h"
+#include "utils.h"
+
+#include "watch-repos-slave-proc.h"
+#include "watch-repos-common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+G_DEFINE_TYPE (SeafileWatchReposSlaveProc, seafile_watch_repos_slave_proc, CCNET_TYPE_PROCESSOR)
+
+static int start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen);
+
+static void
+release_resource(CcnetProcessor *processor)
+{
+    seaf_notif_manager_unsubscribe_all (seaf->notif_mgr, processor);
+
+    CCNET_PROCESSOR_CLASS (seafile_watch_repos_slave_proc_parent_class)->release_resource (processor);
+}
+
+static void
+seafile_watch_repos_slave_proc_class_init (SeafileWatchReposSlaveProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "seafile-watch-repos-slave-proc";
+    proc_class->start = start;
+    proc_class->handle_update = handle_update;
+    proc_class->release_resource = release_resource;
+}
+
+static void
+seafile_watch_repos_slave_proc_init (SeafileWatchReposSlaveProc *processor)
+{
+}
+
+static int
+start (CcnetProcessor *processor, int argc, char **argv)
+{
+    ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+    return 0;
+}
+
+/* Send the batch in pieces, at line boundaries. */
+static void
+send_repo_updates (const char *updates, int len, void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    const char *p = updates, *end;
+    char *piece;
+
+    while (*p) {
+        end = p + strlen(p);
+        if (end - p > WATCH_PIECE_LEN) {
+            end = p + WATCH_PIECE_LEN;
+            while (end > p && *(end - 1) != '\n')
+                --end;
+            /* A line is never that long. */
+            if (end == p)
+                return;
+        }
+
+        piece = g_strndup (p, end - p);
+        ccnet_processor_send_response (processor,
+                                       SC_REPO_UPDATES, SS_REPO_UPDATES,
+                                       piece, (end - p) + 1);
+        g_free (piece);
+
+        p = end;
+    }
+}
+
+static void
+process_watch (CcnetProcessor *processor, char *content, int clen,
+               gboolean watch)
+{
+    char **repo_ids, **ptr;
+
+    if (clen == 0 || content[clen-1] != '\0') {
+        seaf_warning ("[watch-repos] Bad repo list.\n");
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    repo_ids = g_strsplit (content, "\n", -1);
+    for (ptr = repo_ids; *ptr; ++ptr) {
+        if (!is_uuid_valid (*ptr))
+            continue;
+
+        if (!watch) {
+            seaf_notif_manager_unsubscribe (seaf->notif_mgr, *ptr, processor);
+            continue;
+        }
+
+        if (seaf_notif_manager_count_subscriptions (seaf->notif_mgr,
+                                                    processor) >= MAX_WATCHED_REPOS) {
+            seaf_warning ("[watch-repos] %.8s watches too many repos.\n",
+                          processor->peer_id);
+            ccnet_processor_send_response (processor,
+                                           SC_TOO_MANY_REPOS, SS_TOO_MANY_REPOS,
+                                           NULL, 0);
+            ccnet_processor_done (processor, FALSE);
+            break;
+        }
+        seaf_notif_manager_subscribe (seaf->notif_mgr, *ptr,
+                                      send_repo_updates, processor);
+    }
+    g_strfreev (repo_ids);
+}
+
+static void
+handle_update (CcnetProcessor *processor,
+               char *code, char *code_msg,
+               char *content, int clen)
+{
+    if (memcmp (code, SC_WATCH, 3) == 0) {
+        process_watch (processor, content, clen, TRUE);
+        return;
+    }
+    if (memcmp (code, SC_UNWATCH, 3) == 0) {
+        process_watch (processor, content, clen, FALSE);
+        return;
+    }
+
+    seaf_warning ("[watch-repos] Bad update: %s %s\n", code, code_msg);
+    ccnet_processor_send_response (processor, SC_BAD_UPDATE_CODE,
+                                   SS_BAD_UPDATE_CODE, NULL, 0);
+    ccnet_processor_done (processor, FALSE);
+}
@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAFILE_WATCH_REPOS_SLAVE_PROC_H
+#define SEAFILE_WATCH_REPOS_SLAVE_PROC_H
+
+#include <glib-object.h>
+#include <ccnet.h>
+
+#define SEAFILE_TYPE_WATCH_REPOS_SLAVE_PROC                  (seafile_watch_repos_slave_proc_get_type ())
+#define SEAFILE_WATCH_REPOS_SLAVE_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), SEAFILE_TYPE_WATCH_REPOS_SLAVE_PROC, SeafileWatchReposSlaveProc))
+#define SEAFILE_IS_WATCH_REPOS_SLAVE_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SEAFILE_TYPE_WATCH_REPOS_SLAVE_PROC))
+#define SEAFILE_WATCH_REPOS_SLAVE_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), SEAFILE_TYPE_WATCH_REPOS_SLAVE_PROC, SeafileWatchReposSlaveProcClass))
+#define IS_SEAFILE_WATCH_REPOS_SLAVE_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), SEAFILE_TYPE_WATCH_REPOS_SLAVE_PROC))
+#define SEAFILE_WATCH_REPOS_SLAVE_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), SEAFILE_TYPE_WATCH_REPOS_SLAVE_PROC, SeafileWatchReposSlaveProcClass))
+
+typedef struct _SeafileWatchReposSlaveProc SeafileWatchReposSlaveProc;
+typedef struct _SeafileWatchReposSlaveProcClass SeafileWatchReposSlaveProcClass;
+
+struct _SeafileWatchReposSlaveProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _SeafileWatchReposSlaveProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType seafile_watch_repos_slave_proc_get_type ();
+
+#endif
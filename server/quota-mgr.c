@@ -3,10 +3,47 @@
 #include "common.h"
 #include "log.h"
 
+#include <pthread.h>
+
 #include "seafile-session.h"
 #include "seaf-db.h"
 #include "quota-mgr.h"
 
+#define OWNER_CACHE_TTL     300     /* 5min */
+#define USAGE_CACHE_TTL     60      /* 1min */
+/* A usage is read again before refusing an upload, unless it's that new. */
+#define MIN_RELOAD_INTERVAL 5
+#define MAX_CACHED_ENTRIES  100000
+
+/* Usage and quota of a user or an org. */
+typedef struct QuotaUsage {
+    gint64 quota;
+    gint64 usage;
+    gint64 loaded;
+} QuotaUsage;
+
+/* Whose quota a repo counts to, "user" or "org:<id>". */
+typedef struct RepoOwner {
+    char  *key;
+    char  *user;
+    int    org_id;
+    gint64 loaded;
+} RepoOwner;
+
+struct _SeafQuotaManagerPriv {
+    pthread_mutex_t lock;
+    GHashTable *owners;         /* repo_id -> RepoOwner */
+    GHashTable *usages;         /* owner key -> QuotaUsage */
+};
+
+static void
+repo_owner_free (RepoOwner *owner)
+{
+    g_free (owner->key);
+    g_free (owner->user);
+    g_free (owner);
+}
+
 static gint64
 get_default_quota (GKeyFile *config)
 {
@@ -29,6 +66,18 @@ seaf_quota_manager_new (struct _SeafileSession *session)
     mgr->session = session;
 
     mgr->default_quota = get_default_quota (session->config);
+    mgr->grace_percent = g_key_file_get_integer (session->config,
+                                                 "quota", "grace_percent",
+                                                 NULL);
+    if (mgr->grace_percent < 0)
+        mgr->grace_percent = 0;
+
+    mgr->priv = g_new0 (SeafQuotaManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->lock, NULL);
+    mgr->priv->owners = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)repo_owner_free);
+    mgr->priv->usages = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
 
     return mgr;
 }
@@ -57,30 +106,37 @@ seaf_quota_manager_init (SeafQuotaManager *mgr)
     return 0;
 }
 
+static void
+forget_usage (SeafQuotaManager *mgr, const char *key)
+{
+    pthread_mutex_lock (&mgr->priv->lock);
+    g_hash_table_remove (mgr->priv->usages, key);
+    pthread_mutex_unlock (&mgr->priv->lock);
+}
+
 int
 seaf_quota_manager_set_user_quota (SeafQuotaManager *mgr,
                                    const char *user,
                                    gint64 quota)
 {
-    char sql[512];
+    int ret;
 
-    snprintf (sql, sizeof(sql),
-              "REPLACE INTO UserQuota VALUES ('%s', %"G_GINT64_FORMAT")",
-              user, quota);
-    return seaf_db_query (mgr->session->db, sql);
+    ret = seaf_db_statement_query (mgr->session->db,
+                                   "REPLACE INTO UserQuota VALUES (?, ?)",
+                                   2, "string", user, "int64", quota);
+    forget_usage (mgr, user);
+    return ret;
 }
 
 gint64
 seaf_quota_manager_get_user_quota (SeafQuotaManager *mgr,
                                    const char *user)
 {
-    char sql[512];
     gint64 quota;
 
-    snprintf (sql, sizeof(sql),
-              "SELECT quota FROM UserQuota WHERE user='%s'",
-              user);
-    quota = seaf_db_get_int64 (mgr->session->db, sql);
+    quota = seaf_db_statement_get_int64 (mgr->session->db,
+                                         "SELECT quota FROM UserQuota WHERE user=?",
+                                         1, "string", user);
     if (quota <= 0)
         quota = mgr->default_quota;
 
@@ -92,25 +148,26 @@ seaf_quota_manager_set_org_quota (SeafQuotaManager *mgr,
                                   int org_id,
                                   gint64 quota)
 {
-    char sql[512];
-
-    snprintf (sql, sizeof(sql),
-              "REPLACE INTO OrgQuota VALUES ('%d', %"G_GINT64_FORMAT")",
-              org_id, quota);
-    return seaf_db_query (mgr->session->db, sql);
+    char key[32];
+    int ret;
+
+    ret = seaf_db_statement_query (mgr->session->db,
+                                   "REPLACE INTO OrgQuota VALUES (?, ?)",
+                                   2, "int", org_id, "int64", quota);
+    snprintf (key, sizeof(key), "org:%d", org_id);
+    forget_usage (mgr, key);
+    return ret;
 }
 
 gint64
 seaf_quota_manager_get_org_quota (SeafQuotaManager *mgr,
                                   int org_id)
 {
-    char sql[512];
     gint64 quota;
 
-    snprintf (sql, sizeof(sql),
-              "SELECT quota FROM OrgQuota WHERE org_id='%d'",
-              org_id);
-    quota = seaf_db_get_int64 (mgr->session->db, sql);
+    quota = seaf_db_statement_get_int64 (mgr->session->db,
+                                         "SELECT quota FROM OrgQuota WHERE org_id=?",
+                                         1, "int", org_id);
     if (quota <= 0)
         quota = mgr->default_quota;
 
@@ -123,12 +180,10 @@ seaf_quota_manager_set_org_user_quota (SeafQuotaManager *mgr,
                                        const char *user,
                                        gint64 quota)
 {
-    char sql[512];
-
-    snprintf (sql, sizeof(sql),
-              "REPLACE INTO OrgUserQuota VALUES ('%d', '%s', %"G_GINT64_FORMAT")",
-              org_id, user, quota);
-    return seaf_db_query (mgr->session->db, sql);
+    return seaf_db_statement_query (mgr->session->db,
+                                    "REPLACE INTO OrgUserQuota VALUES (?, ?, ?)",
+                                    3, "int", org_id, "string", user,
+                                    "int64", quota);
 }
 
 gint64
@@ -136,13 +191,12 @@ seaf_quota_manager_get_org_user_quota (SeafQuotaManager *mgr,
                                        int org_id,
                                        const char *user)
 {
-    char sql[512];
     gint64 quota;
 
-    snprintf (sql, sizeof(sql),
-              "SELECT quota FROM OrgUserQuota WHERE org_id='%d' AND user='%s'",
-              org_id, user);
-    quota = seaf_db_get_int64 (mgr->session->db, sql);
+    quota = seaf_db_statement_get_int64 (mgr->session->db,
+                                         "SELECT quota FROM OrgUserQuota "
+                                         "WHERE org_id=? AND user=?",
+                                         2, "int", org_id, "string", user);
     /* return org quota if per user quota is not set. */
     if (quota <= 0)
         quota = seaf_quota_manager_get_org_quota (mgr, org_id);
@@ -150,40 +204,169 @@ seaf_quota_manager_get_org_user_quota (SeafQuotaManager *mgr,
     return quota;
 }
 
-int
-seaf_quota_manager_check_quota (SeafQuotaManager *mgr,
-                                const char *repo_id)
+/* Caller must hold the lock. */
+static void
+trim_cache (GHashTable *table)
 {
-    char *user = NULL;
-    int org_id;
-    gint64 quota, usage;
+    if (g_hash_table_size (table) >= MAX_CACHED_ENTRIES)
+        g_hash_table_remove_all (table);
+}
+
+/* Returns a new RepoOwner, or NULL if the repo has no owner. */
+static RepoOwner *
+lookup_repo_owner (SeafQuotaManager *mgr, const char *repo_id)
+{
+    SeafQuotaManagerPriv *priv = mgr->priv;
+    RepoOwner *owner, *copy = NULL;
+    char *user;
+    int org_id = -1;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&priv->lock);
+    owner = g_hash_table_lookup (priv->owners, repo_id);
+    if (owner && now - owner->loaded < OWNER_CACHE_TTL) {
+        copy = g_new0 (RepoOwner, 1);
+        copy->key = g_strdup (owner->key);
+        copy->user = g_strdup (owner->user);
+        copy->org_id = owner->org_id;
+    }
+    pthread_mutex_unlock (&priv->lock);
+    if (copy)
+        return copy;
 
     user = seaf_repo_manager_get_repo_owner (seaf->repo_mgr, repo_id);
-    if (user != NULL) {
-        quota = seaf_quota_manager_get_user_quota (mgr, user);
-    } else if (seaf->cloud_mode) {
+    if (!user && seaf->cloud_mode)
         org_id = seaf_repo_manager_get_repo_org (seaf->repo_mgr, repo_id);
-        if (org_id < 0) {
-            seaf_warning ("Repo %s has no owner.\n", repo_id);
-            return -1;
-        }
+    if (!user && org_id < 0) {
+        seaf_warning ("Repo %s has no owner.\n", repo_id);
+        return NULL;
+    }
 
-        quota = seaf_quota_manager_get_org_quota (mgr, org_id);
+    owner = g_new0 (RepoOwner, 1);
+    owner->user = user;
+    owner->org_id = org_id;
+    owner->key = user ? g_strdup (user) : g_strdup_printf ("org:%d", org_id);
+    owner->loaded = now;
+
+    copy = g_new0 (RepoOwner, 1);
+    copy->key = g_strdup (owner->key);
+    copy->user = g_strdup (owner->user);
+    copy->org_id = owner->org_id;
+
+    pthread_mutex_lock (&priv->lock);
+    trim_cache (priv->owners);
+    g_hash_table_replace (priv->owners, g_strdup (repo_id), owner);
+    pthread_mutex_unlock (&priv->lock);
+
+    return copy;
+}
+
+static int
+load_usage (SeafQuotaManager *mgr, RepoOwner *owner, QuotaUsage *out)
+{
+    QuotaUsage *qu;
+
+    if (owner->user) {
+        out->quota = seaf_quota_manager_get_user_quota (mgr, owner->user);
+        out->usage = (out->quota == INFINITE_QUOTA) ? 0 :
+            get_user_quota_usage (seaf, owner->user);
     } else {
-        seaf_warning ("Repo %s has no owner.\n", repo_id);
+        out->quota = seaf_quota_manager_get_org_quota (mgr, owner->org_id);
+        out->usage = (out->quota == INFINITE_QUOTA) ? 0 :
+            get_org_quota_usage (seaf, owner->org_id);
+    }
+    if (out->usage < 0)
         return -1;
+    out->loaded = (gint64)time(NULL);
+
+    qu = g_memdup (out, sizeof(QuotaUsage));
+    pthread_mutex_lock (&mgr->priv->lock);
+    trim_cache (mgr->priv->usages);
+    g_hash_table_replace (mgr->priv->usages, g_strdup (owner->key), qu);
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    return 0;
+}
+
+static gboolean
+get_cached_usage (SeafQuotaManager *mgr, const char *key, QuotaUsage *out)
+{
+    QuotaUsage *qu;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    qu = g_hash_table_lookup (mgr->priv->usages, key);
+    if (qu && (gint64)time(NULL) - qu->loaded < USAGE_CACHE_TTL) {
+        *out = *qu;
+        found = TRUE;
     }
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    return found;
+}
 
-    if (quota == INFINITE_QUOTA)
-        return 0;
+static gboolean
+within_quota (SeafQuotaManager *mgr, const QuotaUsage *qu)
+{
+    gint64 limit;
+
+    if (qu->quota == INFINITE_QUOTA)
+        return TRUE;
+
+    limit = qu->quota + qu->quota / 100 * mgr->grace_percent;
+    return qu->usage < limit;
+}
 
-    if (user)
-        usage = get_user_quota_usage (seaf, user);
-    else
-        usage = get_org_quota_usage (seaf, org_id);
+int
+seaf_quota_manager_check_quota (SeafQuotaManager *mgr,
+                                const char *repo_id)
+{
+    RepoOwner *owner;
+    QuotaUsage qu;
+    int ret = 0;
 
-    if (usage < 0 || usage >= quota)
+    owner = lookup_repo_owner (mgr, repo_id);
+    if (!owner)
         return -1;
 
-    return 0;
+    if (!get_cached_usage (mgr, owner->key, &qu) &&
+        load_usage (mgr, owner, &qu) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (within_quota (mgr, &qu))
+        goto out;
+
+    /* The cached usage only grows between loads, check the real one. */
+    if ((gint64)time(NULL) - qu.loaded >= MIN_RELOAD_INTERVAL &&
+        load_usage (mgr, owner, &qu) == 0 &&
+        within_quota (mgr, &qu))
+        goto out;
+
+    ret = -1;
+
+out:
+    repo_owner_free (owner);
+    return ret;
+}
+
+void
+seaf_quota_manager_add_usage (SeafQuotaManager *mgr,
+                              const char *repo_id,
+                              gint64 delta)
+{
+    SeafQuotaManagerPriv *priv = mgr->priv;
+    RepoOwner *owner;
+    QuotaUsage *qu;
+
+    /* Only the owners that were checked are kept up to date. */
+    pthread_mutex_lock (&priv->lock);
+    owner = g_hash_table_lookup (priv->owners, repo_id);
+    if (owner) {
+        qu = g_hash_table_lookup (priv->usages, owner->key);
+        if (qu)
+            qu->usage += delta;
+    }
+    pthread_mutex_unlock (&priv->lock);
 }
@@ -5,10 +5,16 @@
 
 #define INFINITE_QUOTA (gint64)-2
 
+typedef struct _SeafQuotaManagerPriv SeafQuotaManagerPriv;
+
 struct _SeafQuotaManager {
     struct _SeafileSession *session;
 
     gint64 default_quota;
+    /* Uploads are accepted until usage exceeds quota by this percentage. */
+    int grace_percent;
+
+    SeafQuotaManagerPriv *priv;
 };
 typedef struct _SeafQuotaManager SeafQuotaManager;
 
@@ -54,9 +60,19 @@ seaf_quota_manager_get_org_user_quota (SeafQuotaManager *mgr,
 
 /*
  * Check if @repo_id still has free space for upload.
+ *
+ * The usage of the owner is cached for a while and updated with
+ * seaf_quota_manager_add_usage() meanwhile, so it is only approximate.
+ * It is read again from the database before an upload is refused.
  */
 int
 seaf_quota_manager_check_quota (SeafQuotaManager *mgr,
                                 const char *repo_id);
 
+/* Add @delta bytes to the cached usage of the owner of @repo_id. */
+void
+seaf_quota_manager_add_usage (SeafQuotaManager *mgr,
+                              const char *repo_id,
+                              gint64 delta);
+
 #endif
@@ -9,6 +9,8 @@
 
 #include <ccnet.h>
 #include <ccnet/ccnet-object.h>
+#include <ccnet/job-mgr.h>
+#include <ccnet/timer.h>
 #include "utils.h"
 #include "log.h"
 #include "seafile.h"
@@ -17,6 +19,7 @@
 #include "commit-mgr.h"
 #include "branch-mgr.h"
 #include "repo-mgr.h"
+#include "repo-cache.h"
 #include "fs-mgr.h"
 #include "seafile-error.h"
 #include "seafile-crypt.h"
@@ -26,8 +29,24 @@
 #include "seaf-db.h"
 
 
+/*
+ * Deleted repos are only removed from the Repo table right away. The rest
+ * of their metadata is purged in the background, DELETE_BATCH_SIZE repos
+ * per transaction, with a pause in between so that live traffic isn't
+ * slowed down. Their heads are kept in GarbageRepoHeads, from which
+ * seafserv-gc reclaims their blocks.
+ */
+#define DELETE_BATCH_SIZE 50
+#define DELETE_BATCH_PAUSE 1    /* seconds */
+#define DELETE_CHECK_INTERVAL (5 * 1000) /* msec */
+
 struct _SeafRepoManagerPriv {
-    int dummy;
+    SeafRepoCache *repo_cache;
+
+    /* Set when repos are queued for deletion, main thread only. */
+    gint          delete_pending;
+    gboolean      purging;
+    CcnetTimer   *purge_timer;
 };
 
 static const char *ignore_table[] = {
@@ -145,6 +164,8 @@ seaf_repo_from_commit (SeafRepo *repo, SeafCommit *commit)
             memcpy (repo->magic, commit->magic, 33);
     }
     repo->no_local_history = commit->no_local_history;
+    repo->chunker = chunker_with_policy (commit->chunker,
+                                         commit->chunk_policy);
 }
 
 void
@@ -159,6 +180,8 @@ seaf_repo_to_commit (SeafRepo *repo, SeafCommit *commit)
             commit->magic = g_strdup (repo->magic);
     }
     commit->no_local_history = repo->no_local_history;
+    commit->chunker = CHUNKER_ALGO (repo->chunker);
+    commit->chunk_policy = g_strdup (chunker_get_policy (repo->chunker));
 }
 
 static gboolean
@@ -279,6 +302,10 @@ seaf_repo_manager_new (SeafileSession *seaf)
 
     mgr->priv = g_new0 (SeafRepoManagerPriv, 1);
     mgr->seaf = seaf;
+    mgr->priv->repo_cache = seaf_repo_cache_new ((SeafRepoRefFunc)seaf_repo_ref,
+                                                 (SeafRepoRefFunc)seaf_repo_unref);
+    mgr->perm_cache = seaf_perm_cache_new ();
+    mgr->token_cache = seaf_perm_cache_new ();
 
     ignore_patterns = g_new0 (GPatternSpec*, G_N_ELEMENTS(ignore_table));
     int i;
@@ -303,9 +330,45 @@ seaf_repo_manager_init (SeafRepoManager *mgr)
     return 0;
 }
 
+static void *purge_deleted_repos (void *vmgr);
+static gboolean collect_repo_id (SeafDBRow *row, void *data);
+
+static void
+purge_done (void *vmgr)
+{
+    SeafRepoManager *mgr = vmgr;
+
+    mgr->priv->purging = FALSE;
+}
+
+static int
+purge_pulse (void *vmgr)
+{
+    SeafRepoManager *mgr = vmgr;
+
+    if (mgr->priv->purging ||
+        !g_atomic_int_compare_and_exchange (&mgr->priv->delete_pending, 1, 0))
+        return TRUE;
+
+    mgr->priv->purging = TRUE;
+    if (ccnet_job_manager_schedule_job (mgr->seaf->job_mgr,
+                                        purge_deleted_repos,
+                                        purge_done, mgr) < 0) {
+        seaf_warning ("[repo mgr] failed to start purging deleted repos.\n");
+        mgr->priv->purging = FALSE;
+        g_atomic_int_set (&mgr->priv->delete_pending, 1);
+    }
+
+    return TRUE;
+}
+
 int
 seaf_repo_manager_start (SeafRepoManager *mgr)
 {
+    /* Repos may be left in the queue by the last run. */
+    g_atomic_int_set (&mgr->priv->delete_pending, 1);
+    mgr->priv->purge_timer = ccnet_timer_new (purge_pulse, mgr,
+                                              DELETE_CHECK_INTERVAL);
     return 0;
 }
 
@@ -328,64 +391,138 @@ seaf_repo_manager_add_repo (SeafRepoManager *manager,
 static int
 remove_repo_ondisk (SeafRepoManager *mgr, const char *repo_id)
 {
-    char sql[256];
-    SeafDB *db = mgr->seaf->db;
+    SeafDBBatch *batch;
+    int ret;
 
-    /* Remove record in repo table first.
-     * Once this is commited, we can gc the other tables later even if
-     * we're interrupted.
+    seaf_repo_cache_remove (mgr->priv->repo_cache, repo_id);
+
+    /* Remove record in repo table first, and queue the rest.
+     * Once this is commited, the purge can be resumed even if we're
+     * interrupted.
      */
-    snprintf (sql, sizeof(sql), "DELETE FROM Repo WHERE repo_id = '%s'", repo_id);
-    if (seaf_db_query (db, sql) < 0)
+    batch = seaf_db_batch_new ();
+    seaf_db_batch_add (batch, "DELETE FROM Repo WHERE repo_id = '%s'", repo_id);
+    seaf_db_batch_add (batch, "REPLACE INTO RepoDeleteQueue VALUES ('%s')",
+                       repo_id);
+    ret = seaf_db_batch_exec (mgr->seaf->db, batch);
+    seaf_db_batch_free (batch);
+    if (ret < 0)
         return -1;
 
-    /* remove branch */
-    GList *p;
-    GList *branch_list = 
-        seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo_id);
-    for (p = branch_list; p; p = p->next) {
-        SeafBranch *b = (SeafBranch *)p->data;
-        seaf_repo_manager_branch_repo_unmap (mgr, b);
-        seaf_branch_manager_del_branch (seaf->branch_mgr, repo_id, b->name);
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    seaf_perm_cache_invalidate_repo (mgr->token_cache, repo_id);
+    g_atomic_int_set (&mgr->priv->delete_pending, 1);
+
+    seaf_block_ref_manager_repo_changed (seaf->block_ref_mgr, repo_id);
+
+    return 0;
+}
+
+/* Add the deletes of a queued repo's metadata to @batch. */
+static void
+add_repo_purge (SeafDBBatch *batch, const char *repo_id)
+{
+    GList *branches, *ptr;
+    SeafBranch *b;
+
+    /* Keep the heads for seafserv-gc to reclaim the blocks. */
+    branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo_id);
+    for (ptr = branches; ptr; ptr = ptr->next) {
+        b = ptr->data;
+        seaf_db_batch_add_row (batch, "INSERT INTO GarbageRepoHeads VALUES",
+                               "('%s', '%s')", repo_id, b->commit_id);
     }
-    seaf_branch_list_free (branch_list);
+    seaf_branch_list_free (branches);
 
-    snprintf (sql, sizeof(sql), "DELETE FROM RepoOwner WHERE repo_id = '%s'", 
-              repo_id);
-    seaf_db_query (db, sql);
+    seaf_db_batch_add (batch, "DELETE FROM RepoHead WHERE repo_id = '%s'",
+                       repo_id);
+    seaf_db_batch_add (batch, "DELETE FROM Branch WHERE repo_id = '%s'",
+                       repo_id);
 
-    snprintf (sql, sizeof(sql), "DELETE FROM RepoGroup WHERE repo_id = '%s'", 
-              repo_id);
-    seaf_db_query (db, sql);
+    seaf_db_batch_add (batch, "DELETE FROM RepoOwner WHERE repo_id = '%s'",
+                       repo_id);
+    seaf_db_batch_add (batch, "DELETE FROM RepoGroup WHERE repo_id = '%s'",
+                       repo_id);
 
     if (!seaf->cloud_mode) {
-        snprintf (sql, sizeof(sql), "DELETE FROM InnerPubRepo WHERE repo_id = '%s'", 
-                  repo_id);
-        seaf_db_query (db, sql);
+        seaf_db_batch_add (batch,
+                           "DELETE FROM InnerPubRepo WHERE repo_id = '%s'",
+                           repo_id);
     }
 
     if (seaf->cloud_mode) {
-        snprintf (sql, sizeof(sql),
-                  "DELETE FROM OrgRepo WHERE repo_id = '%s'", 
-                  repo_id);
-        seaf_db_query (db, sql);
-
-        snprintf (sql, sizeof(sql),
-                  "DELETE FROM OrgGroupRepo WHERE repo_id = '%s'", 
-                  repo_id);
-        seaf_db_query (db, sql);
-
-        snprintf (sql, sizeof(sql),
-                  "DELETE FROM OrgInnerPubRepo WHERE repo_id = '%s'", 
-                  repo_id);
-        seaf_db_query (db, sql);
+        seaf_db_batch_add (batch, "DELETE FROM OrgRepo WHERE repo_id = '%s'",
+                           repo_id);
+        seaf_db_batch_add (batch,
+                           "DELETE FROM OrgGroupRepo WHERE repo_id = '%s'",
+                           repo_id);
+        seaf_db_batch_add (batch,
+                           "DELETE FROM OrgInnerPubRepo WHERE repo_id = '%s'",
+                           repo_id);
     }
 
-    snprintf (sql, sizeof(sql), "DELETE FROM RepoUserToken WHERE repo_id = '%s'", 
-              repo_id);
-    seaf_db_query (db, sql);
+    seaf_db_batch_add (batch, "DELETE FROM RepoUserToken WHERE repo_id = '%s'",
+                       repo_id);
+    seaf_db_batch_add (batch, "DELETE FROM RepoDeleteQueue WHERE repo_id = '%s'",
+                       repo_id);
+}
 
-    return 0;
+static int
+purge_repo_batch (SeafRepoManager *mgr)
+{
+    GList *ids = NULL, *ptr;
+    SeafDBBatch *batch;
+    char sql[256];
+    int n, ret;
+
+    snprintf (sql, sizeof(sql), "SELECT repo_id FROM RepoDeleteQueue LIMIT %d",
+              DELETE_BATCH_SIZE);
+    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql,
+                                      collect_repo_id, &ids) < 0)
+        return -1;
+    if (!ids)
+        return 0;
+
+    batch = seaf_db_batch_new ();
+    for (ptr = ids; ptr; ptr = ptr->next)
+        add_repo_purge (batch, ptr->data);
+    ret = seaf_db_batch_exec (mgr->seaf->db, batch);
+    seaf_db_batch_free (batch);
+
+    n = 0;
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        seaf_branch_manager_invalidate_cache (seaf->branch_mgr, ptr->data);
+        if (ret == 0) {
+            seaf_file_history_manager_remove_repo (seaf->file_history_mgr,
+                                                   ptr->data);
+            ++n;
+        }
+    }
+    string_list_free (ids);
+
+    return (ret < 0) ? -1 : n;
+}
+
+static void *
+purge_deleted_repos (void *vmgr)
+{
+    SeafRepoManager *mgr = vmgr;
+    int n, total = 0;
+
+    while ((n = purge_repo_batch (mgr)) > 0) {
+        total += n;
+        g_usleep (DELETE_BATCH_PAUSE * G_USEC_PER_SEC);
+    }
+
+    if (n < 0) {
+        seaf_warning ("[repo mgr] Failed to purge deleted repos.\n");
+        /* Try again at the next check. */
+        g_atomic_int_set (&mgr->priv->delete_pending, 1);
+    }
+    if (total > 0)
+        seaf_message ("[repo mgr] Purged %d deleted repos.\n", total);
+
+    return vmgr;
 }
 
 int
@@ -401,29 +538,30 @@ seaf_repo_manager_del_repo (SeafRepoManager *mgr,
 static gboolean
 repo_exists_in_db (SeafDB *db, const char *id)
 {
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "SELECT repo_id FROM Repo WHERE repo_id = '%s'",
-              id);
-    return seaf_db_check_for_existence (db, sql);
+    return seaf_db_statement_exists (db,
+                                     "SELECT repo_id FROM Repo WHERE repo_id = ?",
+                                     1, "string", id);
 }
 
 SeafRepo*
 seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
 {
-    SeafRepo repo;
+    SeafRepo *cached;
     int len = strlen(id);
 
     if (len >= 37)
         return NULL;
 
-    memcpy (repo.id, id, len + 1);
+    cached = seaf_repo_cache_lookup (manager->priv->repo_cache, id);
+    if (cached)
+        return cached;
 
     if (repo_exists_in_db (manager->seaf->db, id)) {
         SeafRepo *ret = load_repo (manager, id);
         if (!ret)
             return NULL;
-        /* seaf_repo_ref (ret); */
+        seaf_repo_cache_insert (manager->priv->repo_cache, id,
+                                ret->head->name, ret->head->commit_id, ret);
         return ret;
     }
 
@@ -442,22 +580,20 @@ seaf_repo_manager_repo_exists (SeafRepoManager *manager, const gchar *id)
 static int
 save_branch_repo_map (SeafRepoManager *manager, SeafBranch *branch)
 {
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "REPLACE INTO RepoHead VALUES ('%s', '%s')",
-              branch->repo_id, branch->name);
-    return seaf_db_query (seaf->db, sql);
+    return seaf_db_statement_query (seaf->db,
+                                    "REPLACE INTO RepoHead VALUES (?, ?)",
+                                    2, "string", branch->repo_id,
+                                    "string", branch->name);
 }
 
 int
 seaf_repo_manager_branch_repo_unmap (SeafRepoManager *manager, SeafBranch *branch)
 {
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "DELETE FROM RepoHead WHERE branch_name = '%s'"
-              " AND repo_id = '%s'",
-              branch->name, branch->repo_id);
-    return seaf_db_query (seaf->db, sql);
+    return seaf_db_statement_query (seaf->db,
+                                    "DELETE FROM RepoHead WHERE branch_name = ?"
+                                    " AND repo_id = ?",
+                                    2, "string", branch->name,
+                                    "string", branch->repo_id);
 }
 
 static void
@@ -506,7 +642,6 @@ load_branch_cb (SeafDBRow *row, void *vrepo)
 static SeafRepo *
 load_repo (SeafRepoManager *manager, const char *repo_id)
 {
-    char sql[256];
     int n;
 
     SeafRepo *repo = seaf_repo_new(repo_id, NULL, NULL);
@@ -517,12 +652,14 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
 
     repo->manager = manager;
 
-    snprintf(sql, 256, "SELECT branch_name FROM RepoHead WHERE repo_id='%s'",
-             repo->id);
     /* Note that it's also an error if repo head is not set.
      * This means the repo is corrupted.
      */
-    n = seaf_db_foreach_selected_row (seaf->db, sql, load_branch_cb, repo);
+    n = seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT branch_name FROM RepoHead "
+                                       "WHERE repo_id=?",
+                                       load_branch_cb, repo,
+                                       1, "string", repo->id);
     if (n < 0) {
         seaf_warning ("Error read branch for repo %s.\n", repo->id);
         seaf_repo_free (repo);
@@ -722,6 +859,19 @@ create_db_tables_if_not_exist (SeafRepoManager *mgr)
             return -1;
     }
 
+    /* Deleted repos waiting to be purged, and the heads of the purged
+     * ones, waiting for seafserv-gc.
+     */
+    sql = "CREATE TABLE IF NOT EXISTS RepoDeleteQueue ("
+        "repo_id CHAR(37) PRIMARY KEY)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GarbageRepoHeads ("
+        "repo_id CHAR(37), commit_id CHAR(41))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS RepoHead ("
         "repo_id CHAR(37) PRIMARY KEY, branch_name VARCHAR(10))";
     if (seaf_db_query (db, sql) < 0)
@@ -732,6 +882,16 @@ create_db_tables_if_not_exist (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    /* Filled in by the monitor, created here too so that the joined
+     * repo listings work before the monitor first runs.
+     */
+    sql = "CREATE TABLE IF NOT EXISTS RepoSize ("
+        "repo_id CHAR(37) PRIMARY KEY,"
+        "size BIGINT UNSIGNED,"
+        "head_id CHAR(41))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     return 0;
 }
 
@@ -764,18 +924,17 @@ seaf_repo_manager_set_repo_token (SeafRepoManager *mgr,
                                   const char *email,
                                   const char *token)
 {
-    char sql[512];
-
-    snprintf (sql, sizeof(sql),
-              "REPLACE INTO RepoUserToken VALUES ('%s', '%s', '%s')",
-              repo_id, email, token);
-
-    if (seaf_db_query (mgr->seaf->db, sql) < 0) {
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "REPLACE INTO RepoUserToken VALUES (?, ?, ?)",
+                                 3, "string", repo_id, "string", email,
+                                 "string", token) < 0) {
         seaf_warning ("failed to set repo token. repo = %s, email = %s\n",
                       repo_id, email);
         return -1;
     }
 
+    /* The old token of the user is replaced. */
+    seaf_perm_cache_invalidate_repo (mgr->token_cache, repo_id);
     return 0;
 }
 
@@ -795,18 +954,17 @@ seaf_repo_manager_get_repo_token_nonnull (SeafRepoManager *mgr,
                                           const char *repo_id,
                                           const char *email)
 {
-    char sql[256];
     char *token = NULL;
 
     if (!repo_exists_in_db (mgr->seaf->db, repo_id))
         return NULL;
     
-    snprintf (sql, sizeof(sql), 
-              "SELECT token FROM RepoUserToken WHERE repo_id='%s' and email='%s'",
-              repo_id, email);
-
-    int n_row = seaf_db_foreach_selected_row (mgr->seaf->db, sql,
-                                              get_token, &token);
+    int n_row = seaf_db_statement_foreach_row (mgr->seaf->db,
+                                               "SELECT token FROM RepoUserToken "
+                                               "WHERE repo_id=? and email=?",
+                                               get_token, &token,
+                                               2, "string", repo_id,
+                                               "string", email);
     if (n_row < 0) {
         seaf_warning ("DB error when get token for repo %s, email %s.\n",
                       repo_id, email);
@@ -829,18 +987,17 @@ seaf_repo_manager_get_repo_token (SeafRepoManager *mgr,
                                   const char *repo_id,
                                   const char *email)
 {
-    char sql[256];
     char *token = NULL;
 
     if (!repo_exists_in_db (mgr->seaf->db, repo_id))
         return NULL;
 
-    snprintf (sql, sizeof(sql), 
-              "SELECT token FROM RepoUserToken WHERE repo_id='%s' and email='%s'",
-              repo_id, email);
-
-    int n_row = seaf_db_foreach_selected_row (mgr->seaf->db, sql,
-                                              get_token, &token);
+    int n_row = seaf_db_statement_foreach_row (mgr->seaf->db,
+                                               "SELECT token FROM RepoUserToken "
+                                               "WHERE repo_id=? and email=?",
+                                               get_token, &token,
+                                               2, "string", repo_id,
+                                               "string", email);
     if (n_row < 0) {
         seaf_warning ("DB error when get token for repo %s, email %s.\n",
                       repo_id, email);
@@ -868,18 +1025,13 @@ seaf_repo_manager_get_email_by_token (SeafRepoManager *manager,
         return NULL;
     
     char *email = NULL;
-    GString *buf = g_string_new(NULL);
 
-    g_string_append_printf (
-        buf, "SELECT email FROM RepoUserToken "
-        "WHERE repo_id = '%s' AND token = '%s'",
-        repo_id, token);
+    seaf_db_statement_foreach_row (seaf->db,
+                                   "SELECT email FROM RepoUserToken "
+                                   "WHERE repo_id = ? AND token = ?",
+                                   get_email_by_token_cb, &email,
+                                   2, "string", repo_id, "string", token);
 
-    seaf_db_foreach_selected_row (seaf->db, buf->str,
-                                  get_email_by_token_cb, &email);
-
-    g_string_free (buf, TRUE);
-    
     return email;
 }
 
@@ -897,13 +1049,11 @@ gint64
 seaf_repo_manager_get_repo_size (SeafRepoManager *mgr, const char *repo_id)
 {
     gint64 size = 0;
-    char sql[256];
 
-    snprintf (sql, sizeof(sql), "SELECT size FROM RepoSize WHERE repo_id='%s'",
-              repo_id);
-
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql,
-                                      get_repo_size, &size) < 0)
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT size FROM RepoSize WHERE repo_id=?",
+                                       get_repo_size, &size,
+                                       1, "string", repo_id) < 0)
         return -1;
 
     return size;
@@ -920,13 +1070,12 @@ seaf_repo_manager_set_repo_owner (SeafRepoManager *mgr,
                                   const char *repo_id,
                                   const char *email)
 {
-    char sql[256];
-
-    snprintf (sql, sizeof(sql), "REPLACE INTO RepoOwner VALUES ('%s', '%s')",
-              repo_id, email);
-    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "REPLACE INTO RepoOwner VALUES (?, ?)",
+                                 2, "string", repo_id, "string", email) < 0)
         return -1;
 
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
     return 0;
 }
 
@@ -944,14 +1093,13 @@ char *
 seaf_repo_manager_get_repo_owner (SeafRepoManager *mgr,
                                   const char *repo_id)
 {
-    char sql[256];
     char *ret = NULL;
 
-    snprintf (sql, sizeof(sql), 
-              "SELECT owner_id FROM RepoOwner WHERE repo_id='%s'",
-              repo_id);
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql,
-                                      get_owner, &ret) < 0) {
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT owner_id FROM RepoOwner "
+                                       "WHERE repo_id=?",
+                                       get_owner, &ret,
+                                       1, "string", repo_id) < 0) {
         seaf_warning ("Failed to get owner id for repo %s.\n", repo_id);
         return NULL;
     }
@@ -982,13 +1130,12 @@ seaf_repo_manager_get_repos_by_owner (SeafRepoManager *mgr,
                                       const char *email)
 {
     GList *ret = NULL;
-    char sql[256];
-
-    snprintf (sql, 256, "SELECT repo_id FROM RepoOwner WHERE owner_id='%s'",
-              email);
 
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql, 
-                                      collect_repos, &ret) < 0)
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT repo_id FROM RepoOwner "
+                                       "WHERE owner_id=?",
+                                       collect_repos, &ret,
+                                       1, "string", email) < 0)
         return NULL;
 
     return g_list_reverse (ret);
@@ -1032,8 +1179,9 @@ seaf_repo_manager_get_repo_list (SeafRepoManager *mgr, int start, int limit)
     else
         snprintf (sql, 256, "SELECT repo_id FROM Repo LIMIT %d, %d", start, limit);
 
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql, 
-                                      collect_repos, &ret) < 0)
+    /* A listing, it may miss the latest repos. */
+    if (seaf_db_foreach_selected_row_replica (mgr->seaf->db, sql,
+                                              collect_repos, &ret) < 0)
         return NULL;
 
     return g_list_reverse (ret);
@@ -1108,6 +1256,7 @@ seaf_repo_manager_add_group_repo (SeafRepoManager *mgr,
     if (seaf_db_query (mgr->seaf->db, sql) < 0)
         return -1;
 
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
     return 0;
 }
 
@@ -1122,7 +1271,11 @@ seaf_repo_manager_del_group_repo (SeafRepoManager *mgr,
     snprintf (sql, sizeof(sql), "DELETE FROM RepoGroup WHERE group_id=%d "
               "AND repo_id='%s'", group_id, repo_id);
 
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 static gboolean
@@ -1207,7 +1360,11 @@ seaf_repo_manager_set_group_repo_perm (SeafRepoManager *mgr,
               "UPDATE RepoGroup SET permission='%s' WHERE "
               "repo_id='%s' AND group_id=%d",
               permission, repo_id, group_id);
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 static gboolean
@@ -1344,7 +1501,11 @@ seaf_repo_manager_remove_group_repos (SeafRepoManager *mgr,
                   "user_name = '%s'", group_id, owner);
     }
 
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_all (mgr->perm_cache);
+    return 0;
 }
 
 /* Inner public repos */
@@ -1359,7 +1520,11 @@ seaf_repo_manager_set_inner_pub_repo (SeafRepoManager *mgr,
     snprintf (sql, sizeof(sql),
               "REPLACE INTO InnerPubRepo VALUES ('%s', '%s')",
               repo_id, permission);
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 int
@@ -1371,7 +1536,11 @@ seaf_repo_manager_unset_inner_pub_repo (SeafRepoManager *mgr,
     snprintf (sql, sizeof(sql),
               "DELETE FROM InnerPubRepo WHERE repo_id = '%s'",
               repo_id);
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 gboolean
@@ -1523,6 +1692,7 @@ seaf_repo_manager_set_org_repo (SeafRepoManager *mgr,
     if (seaf_db_query (mgr->seaf->db, sql) < 0)
         return -1;
 
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
     return 0;
 }
 
@@ -1554,7 +1724,11 @@ seaf_repo_manager_remove_org_repo_by_org_id (SeafRepoManager *mgr,
     snprintf (sql, sizeof(sql), "DELETE FROM OrgRepo WHERE org_id = %d",
               org_id);
 
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_all (mgr->perm_cache);
+    return 0;
 }
 
 GList *
@@ -1609,6 +1783,7 @@ seaf_repo_manager_add_org_group_repo (SeafRepoManager *mgr,
     if (seaf_db_query (mgr->seaf->db, sql) < 0)
         return -1;
 
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
     return 0;
 }
 
@@ -1626,7 +1801,11 @@ seaf_repo_manager_del_org_group_repo (SeafRepoManager *mgr,
               "org_id=%d AND group_id=%d AND repo_id='%s'",
               org_id, group_id, repo_id);
 
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 GList *
@@ -1708,7 +1887,11 @@ seaf_repo_manager_set_org_group_repo_perm (SeafRepoManager *mgr,
               "UPDATE OrgGroupRepo SET permission='%s' WHERE "
               "repo_id='%s' AND org_id=%d AND group_id=%d",
               permission, repo_id, org_id, group_id);
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 char *
@@ -1765,7 +1948,11 @@ seaf_repo_manager_set_org_inner_pub_repo (SeafRepoManager *mgr,
     snprintf (sql, sizeof(sql),
               "REPLACE INTO OrgInnerPubRepo VALUES (%d, '%s', '%s')",
               org_id, repo_id, permission);
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 int
@@ -1778,7 +1965,11 @@ seaf_repo_manager_unset_org_inner_pub_repo (SeafRepoManager *mgr,
     snprintf (sql, sizeof(sql),
               "DELETE FROM OrgInnerPubRepo WHERE org_id = %d AND repo_id = '%s'",
               org_id, repo_id);
-    return seaf_db_query (mgr->seaf->db, sql);
+    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+        return -1;
+
+    seaf_perm_cache_invalidate_repo (mgr->perm_cache, repo_id);
+    return 0;
 }
 
 gboolean
@@ -1858,6 +2049,285 @@ seaf_repo_manager_get_org_inner_pub_repo_perm (SeafRepoManager *mgr,
     return seaf_db_get_string(mgr->seaf->db, sql);
 }
 
+/*
+ * Joined repo listings.
+ *
+ * The listings above look up every repo and its head commit separately,
+ * which costs a few queries per repo. These get the share, head commit id,
+ * size and owner of a page of repos in one query, and only read the head
+ * commits for names and mtimes.
+ */
+
+/*
+ * Every listing selects (repo_id, group_id, user, permission, commit_id,
+ * size, owner), with the share table joined as "t".
+ */
+#define JOIN_HEAD_AND_SIZE                                              \
+    "INNER JOIN Branch b ON t.repo_id = b.repo_id AND b.name = 'master' " \
+    "LEFT JOIN RepoSize s ON t.repo_id = s.repo_id "
+
+typedef struct {
+    const char *share_type;
+    GList *repos;
+} JoinedListData;
+
+static gboolean
+collect_joined_repos (SeafDBRow *row, void *vdata)
+{
+    JoinedListData *data = vdata;
+    SeafCommit *commit;
+    SeafileSharedRepo *srepo;
+
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    int group_id = seaf_db_row_get_column_int (row, 1);
+    const char *user = seaf_db_row_get_column_text (row, 2);
+    const char *permission = seaf_db_row_get_column_text (row, 3);
+    const char *commit_id = seaf_db_row_get_column_text (row, 4);
+    gint64 size = seaf_db_row_get_column_int64 (row, 5);
+    const char *owner = seaf_db_row_get_column_text (row, 6);
+
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr, commit_id);
+    if (!commit) {
+        seaf_warning ("Failed to get head commit %.8s of repo %.8s.\n",
+                      commit_id, repo_id);
+        return TRUE;
+    }
+
+    srepo = g_object_new (SEAFILE_TYPE_SHARED_REPO,
+                          "share_type", data->share_type,
+                          "repo_id", repo_id,
+                          "repo_name", commit->repo_name,
+                          "repo_desc", commit->repo_desc,
+                          "encrypted", commit->encrypted,
+                          "group_id", group_id,
+                          "user", user,
+                          "permission", permission,
+                          "last_modified", commit->ctime,
+                          "owner", owner,
+                          "head_cmmt_id", commit_id,
+                          "size", size,
+                          NULL);
+    data->repos = g_list_prepend (data->repos, srepo);
+
+    seaf_commit_unref (commit);
+    return TRUE;
+}
+
+static gboolean
+collect_repo_summaries (SeafDBRow *row, void *vrepos)
+{
+    GList **repos = vrepos;
+    SeafileRepoSummary *summary;
+
+    summary = g_object_new (SEAFILE_TYPE_REPO_SUMMARY,
+                            "repo_id", seaf_db_row_get_column_text (row, 0),
+                            "head_cmmt_id", seaf_db_row_get_column_text (row, 1),
+                            "size", seaf_db_row_get_column_int64 (row, 2),
+                            "owner", seaf_db_row_get_column_text (row, 3),
+                            NULL);
+    *repos = g_list_prepend (*repos, summary);
+
+    return TRUE;
+}
+
+/*
+ * Unlike seaf_repo_manager_get_repo_list(), the page starts from a repo id
+ * instead of an offset, so deep pages are found in the primary key index.
+ */
+GList *
+seaf_repo_manager_list_repo_summaries (SeafRepoManager *mgr,
+                                       const char *last_repo_id,
+                                       int limit)
+{
+    GList *repos = NULL, *ptr;
+
+    if (limit < 0)
+        limit = G_MAXINT;
+
+    if (seaf_db_statement_foreach_row_replica (
+            mgr->seaf->db,
+            "SELECT r.repo_id, b.commit_id, s.size, o.owner_id FROM Repo r "
+            "INNER JOIN Branch b ON r.repo_id = b.repo_id AND b.name = 'master' "
+            "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
+            "LEFT JOIN RepoOwner o ON r.repo_id = o.repo_id "
+            "WHERE r.repo_id > ? ORDER BY r.repo_id LIMIT ?",
+            collect_repo_summaries, &repos,
+            2, "string", last_repo_id ? last_repo_id : "",
+            "int", limit) < 0) {
+        for (ptr = repos; ptr; ptr = ptr->next)
+            g_object_unref (ptr->data);
+        g_list_free (repos);
+        return NULL;
+    }
+
+    return g_list_reverse (repos);
+}
+
+static void
+normalize_page (int *start, int *limit)
+{
+    if (*start < 0)
+        *start = 0;
+    if (*limit < 0)
+        *limit = G_MAXINT;
+}
+
+static GList *
+joined_repos_result (JoinedListData *data, int ret)
+{
+    GList *ptr;
+
+    if (ret < 0) {
+        for (ptr = data->repos; ptr; ptr = ptr->next)
+            g_object_unref (ptr->data);
+        g_list_free (data->repos);
+        return NULL;
+    }
+
+    return g_list_reverse (data->repos);
+}
+
+GList *
+seaf_repo_manager_list_group_repos (SeafRepoManager *mgr,
+                                    int group_id,
+                                    int start,
+                                    int limit)
+{
+    JoinedListData data = { "group", NULL };
+    int ret;
+
+    normalize_page (&start, &limit);
+    ret = seaf_db_statement_foreach_row (
+        mgr->seaf->db,
+        "SELECT t.repo_id, t.group_id, t.user_name, t.permission, "
+        "b.commit_id, s.size, o.owner_id FROM RepoGroup t "
+        JOIN_HEAD_AND_SIZE
+        "LEFT JOIN RepoOwner o ON t.repo_id = o.repo_id "
+        "WHERE t.group_id = ? ORDER BY t.repo_id LIMIT ?, ?",
+        collect_joined_repos, &data,
+        3, "int", group_id, "int", start, "int", limit);
+
+    return joined_repos_result (&data, ret);
+}
+
+GList *
+seaf_repo_manager_list_group_repos_by_owner (SeafRepoManager *mgr,
+                                             const char *owner,
+                                             int start,
+                                             int limit)
+{
+    JoinedListData data = { "group", NULL };
+    int ret;
+
+    normalize_page (&start, &limit);
+    ret = seaf_db_statement_foreach_row (
+        mgr->seaf->db,
+        "SELECT t.repo_id, t.group_id, t.user_name, t.permission, "
+        "b.commit_id, s.size, o.owner_id FROM RepoGroup t "
+        JOIN_HEAD_AND_SIZE
+        "LEFT JOIN RepoOwner o ON t.repo_id = o.repo_id "
+        "WHERE t.user_name = ? ORDER BY t.repo_id LIMIT ?, ?",
+        collect_joined_repos, &data,
+        3, "string", owner, "int", start, "int", limit);
+
+    return joined_repos_result (&data, ret);
+}
+
+GList *
+seaf_repo_manager_list_inner_pub_repos_paged (SeafRepoManager *mgr,
+                                              int start,
+                                              int limit)
+{
+    JoinedListData data = { "public", NULL };
+    int ret;
+
+    normalize_page (&start, &limit);
+    ret = seaf_db_statement_foreach_row (
+        mgr->seaf->db,
+        "SELECT t.repo_id, 0, o.owner_id, t.permission, "
+        "b.commit_id, s.size, o.owner_id FROM InnerPubRepo t "
+        "INNER JOIN RepoOwner o ON t.repo_id = o.repo_id "
+        JOIN_HEAD_AND_SIZE
+        "ORDER BY t.repo_id LIMIT ?, ?",
+        collect_joined_repos, &data,
+        2, "int", start, "int", limit);
+
+    return joined_repos_result (&data, ret);
+}
+
+GList *
+seaf_repo_manager_list_org_group_repos (SeafRepoManager *mgr,
+                                        int org_id,
+                                        int group_id,
+                                        int start,
+                                        int limit)
+{
+    JoinedListData data = { "group", NULL };
+    int ret;
+
+    normalize_page (&start, &limit);
+    ret = seaf_db_statement_foreach_row (
+        mgr->seaf->db,
+        "SELECT t.repo_id, t.group_id, t.owner, t.permission, "
+        "b.commit_id, s.size, o.user FROM OrgGroupRepo t "
+        JOIN_HEAD_AND_SIZE
+        "LEFT JOIN OrgRepo o ON t.repo_id = o.repo_id "
+        "WHERE t.org_id = ? AND t.group_id = ? "
+        "ORDER BY t.repo_id LIMIT ?, ?",
+        collect_joined_repos, &data,
+        4, "int", org_id, "int", group_id, "int", start, "int", limit);
+
+    return joined_repos_result (&data, ret);
+}
+
+GList *
+seaf_repo_manager_list_org_group_repos_by_owner (SeafRepoManager *mgr,
+                                                 int org_id,
+                                                 const char *owner,
+                                                 int start,
+                                                 int limit)
+{
+    JoinedListData data = { "group", NULL };
+    int ret;
+
+    normalize_page (&start, &limit);
+    ret = seaf_db_statement_foreach_row (
+        mgr->seaf->db,
+        "SELECT t.repo_id, t.group_id, t.owner, t.permission, "
+        "b.commit_id, s.size, o.user FROM OrgGroupRepo t "
+        JOIN_HEAD_AND_SIZE
+        "LEFT JOIN OrgRepo o ON t.repo_id = o.repo_id "
+        "WHERE t.org_id = ? AND t.owner = ? "
+        "ORDER BY t.repo_id LIMIT ?, ?",
+        collect_joined_repos, &data,
+        4, "int", org_id, "string", owner, "int", start, "int", limit);
+
+    return joined_repos_result (&data, ret);
+}
+
+GList *
+seaf_repo_manager_list_org_inner_pub_repos_paged (SeafRepoManager *mgr,
+                                                  int org_id,
+                                                  int start,
+                                                  int limit)
+{
+    JoinedListData data = { "public", NULL };
+    int ret;
+
+    normalize_page (&start, &limit);
+    ret = seaf_db_statement_foreach_row (
+        mgr->seaf->db,
+        "SELECT t.repo_id, 0, o.user, t.permission, "
+        "b.commit_id, s.size, o.user FROM OrgInnerPubRepo t "
+        "INNER JOIN OrgRepo o ON t.repo_id = o.repo_id "
+        JOIN_HEAD_AND_SIZE
+        "WHERE t.org_id = ? ORDER BY t.repo_id LIMIT ?, ?",
+        collect_joined_repos, &data,
+        3, "int", org_id, "int", start, "int", limit);
+
+    return joined_repos_result (&data, ret);
+}
+
 
 
 int
@@ -1891,6 +2361,30 @@ seaf_repo_generate_magic (SeafRepo *repo, const char *passwd)
     rawdata_to_hex (key, repo->magic, 16);
 }
 
+/*
+ * Chunking algorithm for new repos, set by "algorithm" in the [chunking]
+ * section of seafile.conf. Existing repos keep the one in their commits.
+ */
+static int
+get_default_chunker ()
+{
+    char *name;
+    int chunker;
+
+    name = g_key_file_get_string (seaf->config, "chunking", "algorithm", NULL);
+    if (!name)
+        return CDC_ALGO_RABIN;
+
+    chunker = cdc_algo_from_name (name);
+    if (chunker < 0) {
+        seaf_warning ("Unknown chunking algorithm %s, use rabin.\n", name);
+        chunker = CDC_ALGO_RABIN;
+    }
+
+    g_free (name);
+    return chunker;
+}
+
 static char *
 create_repo_common (SeafRepoManager *mgr,
                     const char *repo_name,
@@ -1910,6 +2404,8 @@ create_repo_common (SeafRepoManager *mgr,
     g_free (repo_id);
 
     repo->no_local_history = TRUE;
+    repo->chunker = chunker_with_policy (get_default_chunker (),
+                                         local_chunk_policy ());
     if (passwd != NULL && passwd[0] != '\0') {
         repo->encrypted = TRUE;
         repo->enc_version = CURRENT_ENC_VERSION;
@@ -8,6 +8,7 @@
 #include "seafile-object.h"
 #include "commit-mgr.h"
 #include "branch-mgr.h"
+#include "perm-cache.h"
 
 #define REPO_AUTO_SYNC        "auto-sync"
 #define REPO_AUTO_FETCH       "auto-fetch"
@@ -34,6 +35,7 @@ struct _SeafRepo {
     int         enc_version;
     gchar       magic[33];       /* hash(repo_id + passwd), key stretched. */
     gboolean    no_local_history;
+    int         chunker;         /* CDC_ALGO_*, recorded in commits */
 
     SeafBranch *head;
 
@@ -88,6 +90,11 @@ typedef struct _SeafRepoManagerPriv SeafRepoManagerPriv;
 struct _SeafRepoManager {
     struct _SeafileSession *seaf;
 
+    /* Resolved permissions, see seaf_repo_manager_check_permission(). */
+    SeafPermCache *perm_cache;
+    /* Emails of verified sync tokens, by (repo, token). */
+    SeafPermCache *token_cache;
+
     SeafRepoManagerPriv *priv;
 };
 
@@ -128,6 +135,16 @@ seaf_repo_manager_get_repo_list (SeafRepoManager *mgr, int start, int limit);
 GList *
 seaf_repo_manager_get_repo_id_list (SeafRepoManager *mgr);
 
+/*
+ * Get SeafileRepoSummary objects of up to @limit repos with ids after
+ * @last_repo_id, in id order. Pass NULL to start from the first repo, and
+ * the last id returned for the next page.
+ */
+GList *
+seaf_repo_manager_list_repo_summaries (SeafRepoManager *mgr,
+                                       const char *last_repo_id,
+                                       int limit);
+
 int
 seaf_repo_manager_branch_repo_unmap (SeafRepoManager *manager, SeafBranch *branch);
 
@@ -201,6 +218,19 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     const char *user,
                                     GError **error);
 
+/*
+ * Like seaf_repo_manager_post_multi_files(), for files that are already
+ * indexed. @file_ids_json is a json array of their seafile ids.
+ */
+int
+seaf_repo_manager_post_indexed_files (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *parent_dir,
+                                      const char *filenames_json,
+                                      const char *file_ids_json,
+                                      const char *user,
+                                      GError **error);
+
 int
 seaf_repo_manager_post_empty_file (SeafRepoManager *mgr,
                                    const char *repo_id,
@@ -241,6 +271,18 @@ seaf_repo_manager_del_file (SeafRepoManager *mgr,
                             const char *user,
                             GError **error);
 
+/*
+ * Whether the fs objects and blocks of @src_repo can be linked into
+ * @dst_repo by id. Blocks of encrypted repos are encrypted with the repo
+ * key, so they're only shared between repos with the same key, and @user
+ * must have set the passwords of both.
+ */
+gboolean
+seaf_repo_manager_can_share_objects (SeafRepoManager *mgr,
+                                     SeafRepo *src_repo,
+                                     SeafRepo *dst_repo,
+                                     const char *user);
+
 int
 seaf_repo_manager_copy_file (SeafRepoManager *mgr,
                              const char *src_repo_id,
@@ -272,6 +314,50 @@ seaf_repo_manager_rename_file (SeafRepoManager *mgr,
                                const char *user,
                                GError **error);
 
+/*
+ * Apply a list of operations in one commit. @ops_json is an array of
+ *
+ *   {"op": "del", "parent_dir": "/a", "name": "f"}
+ *   {"op": "add", "parent_dir": "/a", "name": "d", "is_dir": true}
+ *   {"op": "rename", "parent_dir": "/a", "name": "f", "new_name": "g"}
+ *   {"op": "move", "parent_dir": "/a", "name": "f",
+ *    "dst_dir": "/b", "new_name": "g"}
+ *
+ * applied in order. "add" adds an empty file or dir, or the existing
+ * object "obj_id". If any operation fails, nothing is committed.
+ */
+int
+seaf_repo_manager_batch_edit (SeafRepoManager *mgr,
+                              const char *repo_id,
+                              const char *ops_json,
+                              const char *user,
+                              GError **error);
+
+/*
+ * Called before each item with the number of items done, and once more
+ * when all are. Return FALSE to cancel.
+ */
+typedef gboolean (*RestoreProgressFunc) (int n_done, void *data);
+
+/*
+ * Restore files and dirs from history in one commit. @items_json is an
+ * array of
+ *
+ *   {"path": "/a/f", "commit_id": "<id of a commit of the repo>"}
+ *
+ * Each item is restored like seaf_repo_manager_revert_file() or
+ * seaf_repo_manager_revert_dir() would. If any item fails or the restore
+ * is canceled, nothing is committed.
+ */
+int
+seaf_repo_manager_restore_entries (SeafRepoManager *mgr,
+                                   const char *repo_id,
+                                   const char *items_json,
+                                   const char *user,
+                                   RestoreProgressFunc progress,
+                                   void *data,
+                                   GError **error);
+
 int
 seaf_repo_manager_is_valid_filename (SeafRepoManager *mgr,
                                      const char *repo_id,
@@ -322,11 +408,16 @@ seaf_repo_manager_revert_dir (SeafRepoManager *mgr,
                               GError **error);
 
 /*
- * Return deleted files/dirs during the last 30 days.
+ * Return deleted files/dirs during the last @show_days days, latest first.
+ * @show_days is capped by keep_history_days, or 30 days if all history is
+ * kept; <= 0 means the whole kept period. @limit < 0 means no limit.
  */
 GList *
 seaf_repo_manager_get_deleted_entries (SeafRepoManager *mgr,
                                        const char *repo_id,
+                                       int show_days,
+                                       int start,
+                                       int limit,
                                        GError **error);
 
 /*
@@ -552,6 +643,50 @@ seaf_repo_manager_get_org_inner_pub_repo_perm (SeafRepoManager *mgr,
                                                int org_id,
                                                const char *repo_id);
 
+/*
+ * Joined listings.
+ *
+ * Return a page of SeafileSharedRepo objects, with owner, head commit id
+ * and size set, in one query. A negative @start or @limit lists all.
+ */
+
+GList *
+seaf_repo_manager_list_group_repos (SeafRepoManager *mgr,
+                                    int group_id,
+                                    int start,
+                                    int limit);
+
+GList *
+seaf_repo_manager_list_group_repos_by_owner (SeafRepoManager *mgr,
+                                             const char *owner,
+                                             int start,
+                                             int limit);
+
+GList *
+seaf_repo_manager_list_inner_pub_repos_paged (SeafRepoManager *mgr,
+                                              int start,
+                                              int limit);
+
+GList *
+seaf_repo_manager_list_org_group_repos (SeafRepoManager *mgr,
+                                        int org_id,
+                                        int group_id,
+                                        int start,
+                                        int limit);
+
+GList *
+seaf_repo_manager_list_org_group_repos_by_owner (SeafRepoManager *mgr,
+                                                 int org_id,
+                                                 const char *owner,
+                                                 int start,
+                                                 int limit);
+
+GList *
+seaf_repo_manager_list_org_inner_pub_repos_paged (SeafRepoManager *mgr,
+                                                  int org_id,
+                                                  int start,
+                                                  int limit);
+
 /*
  * Comprehensive repo permission checker.
  * It checks if @user have permission to access @repo_id.
@@ -562,6 +697,26 @@ seaf_repo_manager_check_permission (SeafRepoManager *mgr,
                                     const char *user,
                                     GError **error);
 
+/*
+ * The check of a sync session: @token of @repo_id, then with @upload the
+ * quota, then the permission. The token, permission and quota usage are
+ * answered from caches, so polling clients don't query the DB each time.
+ * The email of the token is returned in @email if not NULL.
+ */
+enum {
+    SYNC_AUTH_OK = 0,
+    SYNC_AUTH_NO_REPO,
+    SYNC_AUTH_DENIED,
+    SYNC_AUTH_QUOTA_FULL,
+};
+
+int
+seaf_repo_manager_authorize_sync (SeafRepoManager *mgr,
+                                  const char *repo_id,
+                                  const char *token,
+                                  gboolean upload,
+                                  char **email);
+
 /* Web access permission. */
 
 int
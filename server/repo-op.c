@@ -27,7 +27,7 @@
 #include "unpack-trees.h"
 #include "diff-simple.h"
 #include "merge-new.h"
-#include "monitor-rpc-wrappers.h"
+#include "history-compact.h"
 
 #include "seaf-db.h"
 
@@ -40,33 +40,125 @@ should_ignore_file(const char *filename, void *data);
  * Repo operations.
  */
 
-static gint
-compare_dirents (gconstpointer a, gconstpointer b)
+static inline SeafDirent *
+dup_seaf_dirent (const SeafDirent *dent)
+{
+    return seaf_dirent_new (dent->id, dent->mode, dent->name);
+}
+
+/* Dirs from the fs manager may be cached, so the new id of a sub-dir is
+ * set in the duplicated entries, not in the old dir.
+ */
+static void
+set_dirent_id (GPtrArray *entries, const char *name, const char *id)
 {
-    const SeafDirent *ent_a = a, *ent_b = b;
+    SeafDirent *dent;
+    int i;
 
-    return strcmp (ent_b->name, ent_a->name);
+    i = seaf_dirent_array_find (entries, name, NULL);
+    if (i < 0)
+        return;
+    dent = g_ptr_array_index (entries, i);
+    memcpy (dent->id, id, 40);
+    dent->id[40] = '\0';
 }
 
-static inline SeafDirent *
-dup_seaf_dirent (const SeafDirent *dent)
+/*
+ * Copy-on-write dir builder.
+ *
+ * A new version of a dir shares the unchanged dirents with the old dir,
+ * which may be cached by the fs manager and must not be changed. Only the
+ * array is copied; the dirents added or replaced are owned by the builder.
+ */
+typedef struct DirBuilder {
+    GPtrArray *entries;         /* sorted, borrowed or in @owned */
+    GList *owned;
+} DirBuilder;
+
+static void
+dir_builder_init (DirBuilder *b, SeafDir *base)
 {
-    return seaf_dirent_new (dent->id, dent->mode, dent->name);
+    b->entries = seaf_dirent_array_new (base->entries);
+    b->owned = NULL;
+}
+
+/* Add @dent at its sorted position. @dent is taken over. */
+static void
+dir_builder_add (DirBuilder *b, SeafDirent *dent)
+{
+    seaf_dirent_array_insert_sorted (b->entries, dent);
+    b->owned = g_list_prepend (b->owned, dent);
+}
+
+/* Unlink the entry @name, which stays valid until the builder is done. */
+static SeafDirent *
+dir_builder_remove (DirBuilder *b, const char *name)
+{
+    return seaf_dirent_array_remove (b->entries, name);
+}
+
+/* Replace the entry of the same name as @dent, which is taken over. */
+static void
+dir_builder_replace (DirBuilder *b, SeafDirent *dent)
+{
+    int i;
+
+    b->owned = g_list_prepend (b->owned, dent);
+    i = seaf_dirent_array_find (b->entries, dent->name, NULL);
+    if (i >= 0)
+        b->entries->pdata[i] = dent;
+}
+
+static void
+dir_builder_free (DirBuilder *b)
+{
+    GList *ptr;
+
+    /* The borrowed entries belong to the old dir. */
+    g_ptr_array_free (b->entries, TRUE);
+
+    for (ptr = b->owned; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (b->owned);
+}
+
+/* Save the new dir and free the builder. Returns the id of the new dir. */
+static char *
+dir_builder_save (DirBuilder *b)
+{
+    SeafDir *newdir;
+    GList *entries;
+    char *id = NULL;
+
+    entries = seaf_dirent_array_to_list (b->entries);
+    newdir = seaf_dir_new (NULL, entries, 0);
+    if (seaf_dir_save (seaf->fs_mgr, newdir) < 0)
+        seaf_warning ("Failed to save dir %s.\n", newdir->dir_id);
+    else
+        id = g_strdup (newdir->dir_id);
+    g_free (newdir);
+    g_list_free (entries);
+
+    dir_builder_free (b);
+    return id;
 }
 
-static inline GList *
-dup_seafdir_entries (const GList *entries)
+/* New version of @olddir with its sub-dir @name pointing to @id. */
+static char *
+replace_subdir_id (SeafDir *olddir, const char *name, const char *id)
 {
-    const GList *p;
-    GList *newentries = NULL;
+    DirBuilder b;
     SeafDirent *dent;
-    
-    for (p = entries; p; p = p->next) {
-        dent = p->data;
-        newentries = g_list_prepend (newentries, dup_seaf_dirent(dent));
+    int i;
+
+    dir_builder_init (&b, olddir);
+    i = seaf_dirent_array_find (b.entries, name, NULL);
+    if (i >= 0) {
+        dent = g_ptr_array_index (b.entries, i);
+        dir_builder_replace (&b, seaf_dirent_new (id, dent->mode, name));
     }
 
-    return g_list_reverse(newentries);
+    return dir_builder_save (&b);
 }
 
 /* We need to call this function recursively because every dirs in canon_path
@@ -77,7 +169,7 @@ post_file_recursive (const char *dir_id,
                      const char *to_path,
                      SeafDirent *newdent)
 {
-    SeafDir *olddir, *newdir;
+    SeafDir *olddir;
     SeafDirent *dent;
     GList *ptr;
     char *slash;
@@ -91,19 +183,11 @@ post_file_recursive (const char *dir_id,
 
     /* we reach the target dir.  new dir entry is added */
     if (*to_path == '\0') {
-        GList *newentries;
-
-        newentries = dup_seafdir_entries (olddir->entries);
+        DirBuilder b;
 
-        newentries = g_list_insert_sorted (newentries,
-                                           dup_seaf_dirent(newdent),
-                                           compare_dirents);
-
-        newdir = seaf_dir_new (NULL, newentries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        id = g_strndup (newdir->dir_id, 41);
-        id[40] = '\0';
-        seaf_dir_free (newdir);
+        dir_builder_init (&b, olddir);
+        dir_builder_add (&b, dup_seaf_dirent(newdent));
+        id = dir_builder_save (&b);
 
         goto out;
     }
@@ -125,26 +209,15 @@ post_file_recursive (const char *dir_id,
             continue;
 
         id = post_file_recursive (dent->id, remain, newdent);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-        }
         break;
     }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        
-        g_free(id);
-        id = g_strndup(newdir->dir_id, 41);
-        id[40] = '\0';
-        
-        seaf_dir_free (newdir);
+        char *new_id = replace_subdir_id (olddir, to_path_dup, id);
+
+        g_free (id);
+        id = new_id;
     }
 
 out:
@@ -305,7 +378,8 @@ gen_new_commit (const char *repo_id,
 {
     SeafRepo *repo = NULL;
     SeafCommit *new_commit = NULL, *current_head = NULL;
-    int ret = 0;
+    SeafBranch *branch;
+    int ret = 0, rc;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
@@ -385,11 +459,15 @@ retry:
         new_commit = merged_commit;
     }
 
-    seaf_branch_set_commit(repo->head, new_commit->commit_id);
-
-    if (seaf_branch_manager_test_and_update_branch(seaf->branch_mgr,
-                                                   repo->head,
-                                                   current_head->commit_id) < 0)
+    /* The repo object is shared through the repo cache, update a copy
+     * of its head. */
+    branch = seaf_branch_new (repo->head->name, repo_id,
+                              new_commit->commit_id);
+    rc = seaf_branch_manager_test_and_update_branch (seaf->branch_mgr,
+                                                     branch,
+                                                     current_head->commit_id);
+    seaf_branch_unref (branch);
+    if (rc < 0)
     {
         seaf_message ("Concurrent branch update, retry.\n");
 
@@ -416,50 +494,11 @@ out:
     return ret;
 }
 
+/* The monitor recomputes the size later, see size-notifier.h. */
 static void
 update_repo_size(const char *repo_id)
 {
-    if (seaf->monitor_id == NULL)
-        return;
-
-    SearpcClient *ccnet_rpc_client = NULL, *monitor_rpc_client = NULL;
-    GError *error = NULL;
-
-    if (strcmp(seaf->monitor_id, seaf->session->base.id) != 0) {
-        ccnet_rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
-                                                           NULL,
-                                                           "ccnet-rpcserver");
-        if (!ccnet_rpc_client) {
-            seaf_warning ("failed to create ccnet rpc client\n");
-            goto out;
-        }
-
-        if (!ccnet_peer_is_ready (ccnet_rpc_client, seaf->monitor_id)) {
-            goto out;
-        }
-    }
-
-    monitor_rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
-                                                         NULL,
-                                                         "monitor-rpcserver");
-    if (!monitor_rpc_client) {
-        seaf_warning ("failed to create monitor rpc client\n");
-        goto out;
-    }
-
-    searpc_client_call__int (monitor_rpc_client, "compute_repo_size",
-                             &error, 1, "string", repo_id);
-
-    if (error) {
-        seaf_warning ("error when compute_repo_size: %s", error->message);
-        g_error_free (error);
-    }
-
-out:
-    if (ccnet_rpc_client)
-        ccnet_rpc_client_free (ccnet_rpc_client);
-    if (monitor_rpc_client)
-        ccnet_rpc_client_free (monitor_rpc_client);
+    seaf_size_notifier_repo_changed (seaf->size_notifier, repo_id);
 }
 
 int
@@ -530,7 +569,8 @@ seaf_repo_manager_post_file (SeafRepoManager *mgr,
     }
 
     if (seaf_fs_manager_index_blocks (seaf->fs_mgr, temp_file_path,
-                                      sha1, crypt) < 0) {
+                                      file_name, sha1, crypt,
+                                      repo->chunker) < 0) {
         seaf_warning ("failed to index blocks");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                      "Failed to index blocks");
@@ -572,21 +612,6 @@ out:
     return ret;
 }
 
-static gboolean
-filename_exists (GList *entries, const char *filename)
-{
-    GList *ptr;
-    SeafDirent *dent;
-
-    for (ptr = entries; ptr != NULL; ptr = ptr->next) {
-        dent = ptr->data;
-        if (strcmp (dent->name, filename) == 0)
-            return TRUE;
-    }
-
-    return FALSE;
-}
-
 static void
 split_filename (const char *filename, char **name, char **ext)
 {
@@ -603,7 +628,7 @@ split_filename (const char *filename, char **name, char **ext)
 }
 
 static int
-add_new_entries (GList **entries, GList *filenames, GList *id_list)
+add_new_entries (DirBuilder *b, GList *filenames, GList *id_list)
 {
     GList *ptr1, *ptr2;
     char *file, *id;
@@ -621,7 +646,8 @@ add_new_entries (GList **entries, GList *filenames, GList *id_list)
 
         unique_name = g_strdup(file);
         split_filename (unique_name, &name, &ext);
-        while (filename_exists (*entries, unique_name) && i <= 16) {
+        while (seaf_dirent_array_find (b->entries, unique_name, NULL) >= 0 &&
+               i <= 16) {
             g_free (unique_name);
             if (ext)
                 unique_name = g_strdup_printf ("%s (%d).%s", name, i, ext);
@@ -632,7 +658,7 @@ add_new_entries (GList **entries, GList *filenames, GList *id_list)
 
         if (i <= 16) {
             newdent = seaf_dirent_new (id, S_IFREG, unique_name);
-            *entries = g_list_insert_sorted (*entries, newdent, compare_dirents);
+            dir_builder_add (b, newdent);
         }
 
         g_free (name);
@@ -652,7 +678,7 @@ post_multi_files_recursive (const char *dir_id,
                             GList *filenames,
                             GList *id_list)
 {
-    SeafDir *olddir, *newdir;
+    SeafDir *olddir;
     SeafDirent *dent;
     GList *ptr;
     char *slash;
@@ -666,18 +692,14 @@ post_multi_files_recursive (const char *dir_id,
 
     /* we reach the target dir.  new dir entry is added */
     if (*to_path == '\0') {
-        GList *newentries;
+        DirBuilder b;
 
-        newentries = dup_seafdir_entries (olddir->entries);
-
-        if (add_new_entries (&newentries, filenames, id_list) < 0)
+        dir_builder_init (&b, olddir);
+        if (add_new_entries (&b, filenames, id_list) < 0) {
+            dir_builder_free (&b);
             goto out;
-
-        newdir = seaf_dir_new (NULL, newentries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        id = g_strndup (newdir->dir_id, 41);
-        id[40] = '\0';
-        seaf_dir_free (newdir);
+        }
+        id = dir_builder_save (&b);
 
         goto out;
     }
@@ -699,26 +721,15 @@ post_multi_files_recursive (const char *dir_id,
             continue;
 
         id = post_multi_files_recursive (dent->id, remain, filenames, id_list);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-        }
         break;
     }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        
-        g_free(id);
-        id = g_strndup(newdir->dir_id, 41);
-        id[40] = '\0';
-        
-        seaf_dir_free (newdir);
+        char *new_id = replace_subdir_id (olddir, to_path_dup, id);
+
+        g_free (id);
+        id = new_id;
     }
 
 out:
@@ -773,6 +784,73 @@ json_to_file_list (const char *files_json)
     return files;
 }
 
+static int
+check_post_files_args (const char *parent_dir, GList *filenames, GError **error)
+{
+    GList *ptr;
+    char *filename;
+
+    for (ptr = filenames; ptr; ptr = ptr->next) {
+        filename = ptr->data;
+        if (should_ignore_file (filename, NULL)) {
+            seaf_warning ("[post files] Invalid filename %s.\n", filename);
+            g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_FILENAME,
+                         "%s", filename);
+            return -1;
+        }
+    }
+
+    if (strstr (parent_dir, "//") != NULL) {
+        seaf_warning ("[post file] parent_dir cantains // sequence.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid parent dir");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Add the files in @id_list to parent dir and commit. */
+static int
+commit_new_files (const char *repo_id,
+                  SeafCommit *head_commit,
+                  const char *canon_path,
+                  GList *filenames,
+                  GList *id_list,
+                  const char *user,
+                  GError **error)
+{
+    GString *buf = g_string_new (NULL);
+    char *root_id = NULL;
+    int ret = 0;
+
+    root_id = do_post_multi_files (head_commit->root_id, canon_path,
+                                   filenames, id_list);
+    if (!root_id) {
+        seaf_warning ("[post file] Failed to put file.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
+                     "Failed to put file");
+        ret = -1;
+        goto out;
+    }
+
+    guint len = g_list_length (filenames);
+    if (len > 1)
+        g_string_printf (buf, "Added \"%s\" and %u more files.",
+                         (char *)(filenames->data), len - 1);
+    else
+        g_string_printf (buf, "Added \"%s\".", (char *)(filenames->data));
+
+    if (gen_new_commit (repo_id, head_commit, root_id,
+                        user, buf->str, error) < 0)
+        ret = -1;
+
+out:
+    g_string_free (buf, TRUE);
+    g_free (root_id);
+    return ret;
+}
+
 int
 seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     const char *repo_id,
@@ -785,11 +863,9 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
     SeafRepo *repo = NULL;
     SeafCommit *head_commit = NULL;
     char *canon_path = NULL;
-    GList *filenames = NULL, *paths = NULL, *id_list = NULL, *ptr;
+    GList *filenames = NULL, *paths = NULL, *id_list = NULL, *ptr, *name_ptr;
     char *filename, *path;
     unsigned char sha1[20];
-    GString *buf = g_string_new (NULL);
-    char *root_id = NULL;
     SeafileCrypt *crypt = NULL;
     char hex[41];
     int ret = 0;
@@ -810,21 +886,7 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
     }
 
     /* Check inputs. */
-    for (ptr = filenames; ptr; ptr = ptr->next) {
-        filename = ptr->data;
-        if (should_ignore_file (filename, NULL)) {
-            seaf_warning ("[post files] Invalid filename %s.\n", filename);
-            g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_FILENAME,
-                         "%s", filename);
-            ret = -1;
-            goto out;
-        }
-    }
-
-    if (strstr (parent_dir, "//") != NULL) {
-        seaf_warning ("[post file] parent_dir cantains // sequence.\n");
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
-                     "Invalid parent dir");
+    if (check_post_files_args (parent_dir, filenames, error) < 0) {
         ret = -1;
         goto out;
     }
@@ -844,9 +906,13 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
         crypt = seafile_crypt_new (repo->enc_version, key, iv);
     }
 
-    for (ptr = paths; ptr; ptr = ptr->next) {
+    for (ptr = paths, name_ptr = filenames; ptr; ptr = ptr->next) {
         path = ptr->data;
-        if (seaf_fs_manager_index_blocks (seaf->fs_mgr, path, sha1, crypt) < 0) {
+        filename = name_ptr ? name_ptr->data : NULL;
+        if (name_ptr)
+            name_ptr = name_ptr->next;
+        if (seaf_fs_manager_index_blocks (seaf->fs_mgr, path, filename, sha1,
+                                          crypt, repo->chunker) < 0) {
             seaf_warning ("failed to index blocks");
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                          "Failed to index blocks");
@@ -859,27 +925,79 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
     }
     id_list = g_list_reverse (id_list);
 
-    /* Add the files to parent dir and commit. */
-    root_id = do_post_multi_files (head_commit->root_id, canon_path,
-                                   filenames, id_list);
-    if (!root_id) {
-        seaf_warning ("[post file] Failed to put file.\n");
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
-                     "Failed to put file");
+    ret = commit_new_files (repo_id, head_commit, canon_path,
+                            filenames, id_list, user, error);
+
+out:
+    if (repo)
+        seaf_repo_unref (repo);
+    if (head_commit)
+        seaf_commit_unref(head_commit);
+    string_list_free (filenames);
+    string_list_free (paths);
+    string_list_free (id_list);
+    g_free (canon_path);
+    g_free (crypt);
+
+    if (ret == 0)
+        update_repo_size(repo_id);
+
+    return ret;
+}
+
+int
+seaf_repo_manager_post_indexed_files (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *parent_dir,
+                                      const char *filenames_json,
+                                      const char *file_ids_json,
+                                      const char *user,
+                                      GError **error)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head_commit = NULL;
+    char *canon_path = NULL;
+    GList *filenames = NULL, *id_list = NULL, *ptr;
+    char *file_id;
+    int ret = 0;
+
+    GET_REPO_OR_FAIL(repo, repo_id);
+    GET_COMMIT_OR_FAIL(head_commit,repo->head->commit_id);
+
+    canon_path = get_canonical_path (parent_dir);
+
+    filenames = json_to_file_list (filenames_json);
+    id_list = json_to_file_list (file_ids_json);
+    if (!filenames || !id_list ||
+        g_list_length (filenames) != g_list_length (id_list)) {
+        seaf_warning ("[post files] Invalid filenames or file ids.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid files");
         ret = -1;
         goto out;
     }
 
-    guint len = g_list_length (filenames);
-    if (len > 1)
-        g_string_printf (buf, "Added \"%s\" and %u more files.",
-                         (char *)(filenames->data), len - 1);
-    else
-        g_string_printf (buf, "Added \"%s\".", (char *)(filenames->data));
-
-    if (gen_new_commit (repo_id, head_commit, root_id,
-                        user, buf->str, error) < 0)
+    if (check_post_files_args (parent_dir, filenames, error) < 0) {
         ret = -1;
+        goto out;
+    }
+
+    /* The files must have been fully indexed by the caller. */
+    for (ptr = id_list; ptr; ptr = ptr->next) {
+        file_id = ptr->data;
+        if (strlen (file_id) != 40 ||
+            (strcmp (file_id, EMPTY_SHA1) != 0 &&
+             seaf_fs_manager_get_type (seaf->fs_mgr,
+                                       file_id) != SEAF_METADATA_TYPE_FILE)) {
+            seaf_warning ("[post files] Bad file id %s.\n", file_id);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid file id");
+            ret = -1;
+            goto out;
+        }
+    }
+
+    ret = commit_new_files (repo_id, head_commit, canon_path,
+                            filenames, id_list, user, error);
 
 out:
     if (repo)
@@ -887,12 +1005,8 @@ out:
     if (head_commit)
         seaf_commit_unref(head_commit);
     string_list_free (filenames);
-    string_list_free (paths);
     string_list_free (id_list);
-    g_string_free (buf, TRUE);
-    g_free (root_id);
     g_free (canon_path);
-    g_free (crypt);
 
     if (ret == 0)
         update_repo_size(repo_id);
@@ -905,7 +1019,7 @@ del_file_recursive(const char *dir_id,
                    const char *to_path,
                    const char *filename)
 {
-    SeafDir *olddir, *newdir;
+    SeafDir *olddir;
     SeafDirent *dent;
     GList *ptr;
     char *to_path_dup = NULL;
@@ -919,24 +1033,11 @@ del_file_recursive(const char *dir_id,
 
     /* we reach the target dir. Remove the given entry from it. */
     if (*to_path == '\0') {
-        SeafDirent *old, *new;
-        GList *newentries = NULL, *p;
-
-        for (p = olddir->entries; p != NULL; p = p->next) {
-            old = p->data;
-            if (strcmp(old->name, filename) != 0) {
-                new = seaf_dirent_new (old->id, old->mode, old->name);
-                newentries = g_list_prepend (newentries, new);
-            }
-        }
+        DirBuilder b;
 
-        newentries = g_list_reverse (newentries);
-
-        newdir = seaf_dir_new(NULL, newentries, 0);
-        seaf_dir_save(seaf->fs_mgr, newdir);
-        id = g_strndup(newdir->dir_id, 41);
-        id[40] = '\0';
-        seaf_dir_free(newdir);
+        dir_builder_init (&b, olddir);
+        dir_builder_remove (&b, filename);
+        id = dir_builder_save (&b);
 
         goto out;
     }
@@ -958,25 +1059,14 @@ del_file_recursive(const char *dir_id,
             continue;
 
         id = del_file_recursive(dent->id, remain, filename);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-        }
         break;
     }
     if (id != NULL) {
         /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        
-        g_free(id);
-        id = g_strndup(newdir->dir_id, 41);
-        id[40] = '\0';
-        
-        seaf_dir_free (newdir);
+        char *new_id = replace_subdir_id (olddir, to_path_dup, id);
+
+        g_free (id);
+        id = new_id;
     }
 
 out:
@@ -1157,11 +1247,37 @@ out:
     return ret;
 }
 
+gboolean
+seaf_repo_manager_can_share_objects (SeafRepoManager *mgr,
+                                     SeafRepo *src_repo,
+                                     SeafRepo *dst_repo,
+                                     const char *user)
+{
+    unsigned char src_key[16], src_iv[16], dst_key[16], dst_iv[16];
+
+    if (!src_repo->encrypted && !dst_repo->encrypted)
+        return TRUE;
+    if (!src_repo->encrypted || !dst_repo->encrypted ||
+        src_repo->enc_version != dst_repo->enc_version)
+        return FALSE;
+
+    if (seaf_passwd_manager_get_decrypt_key_raw (seaf->passwd_mgr,
+                                                 src_repo->id, user,
+                                                 src_key, src_iv) < 0 ||
+        seaf_passwd_manager_get_decrypt_key_raw (seaf->passwd_mgr,
+                                                 dst_repo->id, user,
+                                                 dst_key, dst_iv) < 0)
+        return FALSE;
+
+    return (memcmp (src_key, dst_key, 16) == 0 &&
+            memcmp (src_iv, dst_iv, 16) == 0);
+}
+
 /**
  * Copy a SeafDirent from a SeafDir to another.
  * 
- * 1. When @src_repo and @dst_repo are not the same repo, neither of them
- *    should be encrypted.
+ * 1. When @src_repo and @dst_repo are not the same repo, they must be
+ *    able to share objects, see seaf_repo_manager_can_share_objects().
  * 
  * 2. the file being copied must not exist in the dst path of the dst repo.
  */
@@ -1187,9 +1303,10 @@ seaf_repo_manager_copy_file (SeafRepoManager *mgr,
     if (strcmp(src_repo_id, dst_repo_id) != 0) {
         GET_REPO_OR_FAIL(dst_repo, dst_repo_id);
 
-        if (src_repo->encrypted || dst_repo->encrypted) {
+        if (!seaf_repo_manager_can_share_objects (mgr, src_repo, dst_repo,
+                                                  user)) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
-                         "Can't copy files between encrypted repo(s)");
+                         "Can't copy files between repos with different keys");
             ret = -1;
             goto out;
         }
@@ -1326,9 +1443,10 @@ seaf_repo_manager_move_file (SeafRepoManager *mgr,
     if (strcmp(src_repo_id, dst_repo_id) != 0) {
         GET_REPO_OR_FAIL(dst_repo, dst_repo_id);
 
-        if (src_repo->encrypted || dst_repo->encrypted) {
+        if (!seaf_repo_manager_can_share_objects (mgr, src_repo, dst_repo,
+                                                  user)) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
-                         "Can't copy files between encrypted repo(s)");
+                         "Can't copy files between repos with different keys");
             ret = -1;
             goto out;
         }
@@ -1524,7 +1642,7 @@ rename_file_recursive(const char *dir_id,
                       const char *oldname,
                       const char *newname)
 {
-    SeafDir *olddir, *newdir;
+    SeafDir *olddir;
     SeafDirent *dent;
     GList *ptr;
     char *to_path_dup = NULL;
@@ -1538,37 +1656,22 @@ rename_file_recursive(const char *dir_id,
 
     /* we reach the target dir. */
     if (*to_path == '\0') {
-        SeafDirent *old, *newdent = NULL;
-        GList *newentries = NULL, *p;
+        DirBuilder b;
+        SeafDirent *old;
 
         /* When renameing, there is a pitfall: we can't simply rename the
          * dirent, since the dirents are required to be sorted in descending
-         * order. We need to copy all old dirents except the target dirent,
-         * and then rename the target dirent, and then insert the new
-         * dirent, so that we can maintain the descending order of dirents. */
-        for (p = olddir->entries; p != NULL; p = p->next) {
-            old = p->data;
-            if (strcmp(old->name, oldname) != 0) {
-                newentries = g_list_prepend (newentries, dup_seaf_dirent(old));
-            } else {
-                newdent = seaf_dirent_new (old->id, old->mode, newname);
-            }
-        }
+         * order. We need to remove the target dirent, and then insert the
+         * renamed dirent, so that we can maintain the descending order of
+         * dirents. */
+        dir_builder_init (&b, olddir);
+        old = dir_builder_remove (&b, oldname);
+        if (old)
+            dir_builder_add (&b, seaf_dirent_new (old->id, old->mode, newname));
+        id = dir_builder_save (&b);
 
-        newentries = g_list_reverse (newentries);
-
-        if (newdent) {
-            newentries = g_list_insert_sorted(newentries, newdent, compare_dirents);
-        }
-
-        newdir = seaf_dir_new (NULL, newentries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        id = g_strndup (newdir->dir_id, 41);
-        id[40] = '\0';
-        seaf_dir_free (newdir);
-
-        goto out;
-    }
+        goto out;
+    }
 
     to_path_dup = g_strdup (to_path);
     slash = strchr (to_path_dup, '/');
@@ -1587,26 +1690,15 @@ rename_file_recursive(const char *dir_id,
             continue;
 
         id = rename_file_recursive (dent->id, remain, oldname, newname);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-        }
         break;
     }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        
-        g_free(id);
-        id = g_strndup(newdir->dir_id, 41);
-        id[40] = '\0';
-        
-        seaf_dir_free (newdir);
+        char *new_id = replace_subdir_id (olddir, to_path_dup, id);
+
+        g_free (id);
+        id = new_id;
     }
 
 out:
@@ -1689,12 +1781,440 @@ out:
     return ret;
 }
 
+/*
+ * Batch edits.
+ *
+ * Each operation above rewrites all the dirs on its path and creates a
+ * commit. A batch edit loads the dirs it touches into an in-memory tree
+ * once, applies all the operations to that tree, saves every changed dir
+ * once, bottom-up, and creates a single commit.
+ */
+
+typedef struct EditDir {
+    char        dir_id[41];     /* id of the dir as loaded */
+    GPtrArray  *entries;        /* sorted like the entries of SeafDir */
+    GHashTable *subdirs;        /* name -> EditDir, the sub-dirs loaded */
+    gboolean    changed;
+} EditDir;
+
+static void
+edit_dir_free (EditDir *ed)
+{
+    guint i;
+
+    for (i = 0; i < ed->entries->len; ++i)
+        g_free (g_ptr_array_index (ed->entries, i));
+    g_ptr_array_free (ed->entries, TRUE);
+    g_hash_table_destroy (ed->subdirs);
+    g_free (ed);
+}
+
+static EditDir *
+edit_dir_load (const char *dir_id)
+{
+    SeafDir *dir;
+    EditDir *ed;
+    GList *ptr;
+
+    dir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        seaf_warning ("[batch edit] Failed to load dir %s.\n", dir_id);
+        return NULL;
+    }
+
+    ed = g_new0 (EditDir, 1);
+    memcpy (ed->dir_id, dir_id, 40);
+    ed->entries = seaf_dirent_array_new (NULL);
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        g_ptr_array_add (ed->entries, dup_seaf_dirent (ptr->data));
+    ed->subdirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)edit_dir_free);
+
+    seaf_dir_free (dir);
+    return ed;
+}
+
+static SeafDirent *
+edit_dir_lookup (EditDir *ed, const char *name)
+{
+    int i = seaf_dirent_array_find (ed->entries, name, NULL);
+
+    return i < 0 ? NULL : g_ptr_array_index (ed->entries, i);
+}
+
+static EditDir *
+edit_dir_get_subdir (EditDir *ed, const char *name)
+{
+    EditDir *sub;
+    SeafDirent *dent;
+
+    sub = g_hash_table_lookup (ed->subdirs, name);
+    if (sub)
+        return sub;
+
+    dent = edit_dir_lookup (ed, name);
+    if (!dent || !S_ISDIR(dent->mode))
+        return NULL;
+
+    sub = edit_dir_load (dent->id);
+    if (!sub)
+        return NULL;
+    g_hash_table_insert (ed->subdirs, g_strdup(name), sub);
+
+    return sub;
+}
+
+static EditDir *
+edit_dir_get_by_path (EditDir *root, const char *path)
+{
+    char **names, **p;
+    EditDir *ed = root;
+
+    names = g_strsplit (path, "/", -1);
+    for (p = names; *p != NULL && ed != NULL; ++p) {
+        if (**p == '\0')
+            continue;
+        ed = edit_dir_get_subdir (ed, *p);
+    }
+    g_strfreev (names);
+
+    return ed;
+}
+
+/* @dent and @sub are taken over by @ed. */
+static void
+edit_dir_add (EditDir *ed, SeafDirent *dent, EditDir *sub)
+{
+    seaf_dirent_array_insert_sorted (ed->entries, dent);
+    if (sub)
+        g_hash_table_insert (ed->subdirs, g_strdup(dent->name), sub);
+    ed->changed = TRUE;
+}
+
+/*
+ * Detach @name from @ed. The dirent is returned, and its loaded sub-dir,
+ * if any, in @sub. Both belong to the caller then.
+ */
+static SeafDirent *
+edit_dir_remove (EditDir *ed, const char *name, EditDir **sub)
+{
+    SeafDirent *dent;
+    gpointer key, value;
+
+    *sub = NULL;
+
+    dent = edit_dir_lookup (ed, name);
+    if (!dent)
+        return NULL;
+
+    if (g_hash_table_lookup_extended (ed->subdirs, dent->name, &key, &value)) {
+        g_hash_table_steal (ed->subdirs, dent->name);
+        g_free (key);
+        *sub = value;
+    }
+    seaf_dirent_array_remove (ed->entries, dent->name);
+    ed->changed = TRUE;
+
+    return dent;
+}
+
+/* Save the changed dirs under @ed and @ed itself. Returns the new id. */
+static char *
+edit_dir_save (EditDir *ed)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    EditDir *sub;
+    SeafDir *dir;
+    GList *entries;
+    guint i;
+    char *id;
+
+    g_hash_table_iter_init (&iter, ed->subdirs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        sub = value;
+        id = edit_dir_save (sub);
+        if (!id)
+            return NULL;
+        if (strcmp (id, sub->dir_id) != 0) {
+            set_dirent_id (ed->entries, key, id);
+            ed->changed = TRUE;
+        }
+        g_free (id);
+    }
+
+    if (!ed->changed)
+        return g_strdup (ed->dir_id);
+
+    entries = NULL;
+    for (i = ed->entries->len; i > 0; --i)
+        entries = g_list_prepend (entries,
+                                  dup_seaf_dirent (g_ptr_array_index (ed->entries,
+                                                                      i - 1)));
+    dir = seaf_dir_new (NULL, entries, 0);
+    if (seaf_dir_save (seaf->fs_mgr, dir) < 0) {
+        seaf_warning ("[batch edit] Failed to save dir %s.\n", dir->dir_id);
+        seaf_dir_free (dir);
+        return NULL;
+    }
+    id = g_strdup (dir->dir_id);
+    seaf_dir_free (dir);
+
+    return id;
+}
+
+static const char *
+get_op_member (JsonObject *object, const char *member)
+{
+    if (!json_object_has_member (object, member))
+        return NULL;
+    return json_object_get_string_member (object, member);
+}
+
+static gboolean
+is_valid_new_name (const char *name)
+{
+    return (name != NULL && *name != '\0' && strchr (name, '/') == NULL &&
+            !should_ignore_file (name, NULL));
+}
+
+/* Move or rename @name of @parent_dir to @new_name of @dst_dir. */
+static int
+edit_move (EditDir *root,
+           const char *parent_dir, const char *name,
+           const char *dst_dir, const char *new_name,
+           GError **error)
+{
+    EditDir *src, *dst, *sub;
+    SeafDirent *dent;
+
+    src = edit_dir_get_by_path (root, parent_dir);
+    if (!src || !(dent = edit_dir_remove (src, name, &sub))) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "file %s/%s does not exist", parent_dir, name);
+        return -1;
+    }
+
+    /* Looked up after @name is detached, so a dir can't be moved into
+     * itself.
+     */
+    dst = edit_dir_get_by_path (root, dst_dir);
+    if (!dst || edit_dir_lookup (dst, new_name) != NULL) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     dst ? "file already exists" : "Invalid dst dir");
+        g_free (dent);
+        if (sub)
+            edit_dir_free (sub);
+        return -1;
+    }
+
+    edit_dir_add (dst, seaf_dirent_new (dent->id, dent->mode, new_name), sub);
+    g_free (dent);
+
+    return 0;
+}
+
+static int
+apply_edit_op (EditDir *root, JsonObject *object,
+               GString *desc, GError **error)
+{
+    const char *op, *parent_dir, *name, *new_name, *dst_dir, *obj_id;
+    char *canon_dir = NULL, *canon_dst = NULL;
+    EditDir *ed, *sub;
+    SeafDirent *dent;
+    int mode;
+    int ret = 0;
+
+    op = get_op_member (object, "op");
+    parent_dir = get_op_member (object, "parent_dir");
+    name = get_op_member (object, "name");
+    if (!op || !parent_dir || !name || *name == '\0') {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid operation");
+        return -1;
+    }
+    canon_dir = get_canonical_path (parent_dir);
+
+    if (strcmp (op, "del") == 0) {
+        ed = edit_dir_get_by_path (root, canon_dir);
+        dent = ed ? edit_dir_remove (ed, name, &sub) : NULL;
+        /* Like seaf_repo_manager_del_file(), missing files are skipped. */
+        if (!dent)
+            goto out;
+        if (desc->len == 0)
+            g_string_printf (desc, S_ISDIR(dent->mode) ?
+                             "Removed directory \"%s\"" : "Deleted \"%s\"",
+                             name);
+        g_free (dent);
+        if (sub)
+            edit_dir_free (sub);
+
+    } else if (strcmp (op, "add") == 0) {
+        obj_id = get_op_member (object, "obj_id");
+        if (!obj_id)
+            obj_id = EMPTY_SHA1;
+        mode = (json_object_has_member (object, "is_dir") &&
+                json_object_get_boolean_member (object, "is_dir")) ?
+            S_IFDIR : S_IFREG;
+
+        if (!is_valid_new_name (name) || strlen(obj_id) != 40 ||
+            (strcmp (obj_id, EMPTY_SHA1) != 0 &&
+             !seaf_fs_manager_object_exists_unfiltered (seaf->fs_mgr,
+                                                        obj_id))) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid file to add");
+            ret = -1;
+            goto out;
+        }
+
+        ed = edit_dir_get_by_path (root, canon_dir);
+        if (!ed || edit_dir_lookup (ed, name) != NULL) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         ed ? "file already exists" : "Invalid parent dir");
+            ret = -1;
+            goto out;
+        }
+        edit_dir_add (ed, seaf_dirent_new (obj_id, mode, name), NULL);
+        if (desc->len == 0)
+            g_string_printf (desc, S_ISDIR(mode) ?
+                             "Added directory \"%s\"" : "Added \"%s\"", name);
+
+    } else if (strcmp (op, "move") == 0 || strcmp (op, "rename") == 0) {
+        new_name = get_op_member (object, "new_name");
+        dst_dir = get_op_member (object, "dst_dir");
+        if (!new_name)
+            new_name = name;
+        if (strcmp (op, "rename") == 0 || !dst_dir)
+            dst_dir = parent_dir;
+        canon_dst = get_canonical_path (dst_dir);
+
+        if (!is_valid_new_name (new_name)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid filename");
+            ret = -1;
+            goto out;
+        }
+
+        if (edit_move (root, canon_dir, name, canon_dst, new_name, error) < 0) {
+            ret = -1;
+            goto out;
+        }
+        if (desc->len == 0)
+            g_string_printf (desc, strcmp (op, "move") == 0 ?
+                             "Moved \"%s\"" : "Renamed \"%s\"", name);
+
+    } else {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Unknown operation %s", op);
+        ret = -1;
+    }
+
+out:
+    g_free (canon_dir);
+    g_free (canon_dst);
+    return ret;
+}
+
+int
+seaf_repo_manager_batch_edit (SeafRepoManager *mgr,
+                              const char *repo_id,
+                              const char *ops_json,
+                              const char *user,
+                              GError **error)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head_commit = NULL;
+    JsonParser *parser = NULL;
+    JsonNode *node;
+    JsonArray *array;
+    EditDir *root = NULL;
+    char *root_id = NULL;
+    GString *desc = g_string_new (NULL);
+    guint i, n_ops = 0;
+    int ret = 0;
+
+    GET_REPO_OR_FAIL(repo, repo_id);
+    GET_COMMIT_OR_FAIL(head_commit, repo->head->commit_id);
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_data (parser, ops_json, -1, NULL) ||
+        !(node = json_parser_get_root (parser)) ||
+        !JSON_NODE_HOLDS_ARRAY (node)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid operation list");
+        ret = -1;
+        goto out;
+    }
+    array = json_node_get_array (node);
+    n_ops = json_array_get_length (array);
+    if (n_ops == 0)
+        goto out;
+
+    root = edit_dir_load (head_commit->root_id);
+    if (!root) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to load root dir");
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n_ops; ++i) {
+        node = json_array_get_element (array, i);
+        if (!JSON_NODE_HOLDS_OBJECT (node)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid operation");
+            ret = -1;
+            goto out;
+        }
+        if (apply_edit_op (root, json_node_get_object (node), desc, error) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    root_id = edit_dir_save (root);
+    if (!root_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to save dirs");
+        ret = -1;
+        goto out;
+    }
+
+    /* Nothing changed, e.g. all deleted files were missing. */
+    if (strcmp (root_id, head_commit->root_id) == 0)
+        goto out;
+
+    if (n_ops > 1)
+        g_string_append_printf (desc, " and %u more changes", n_ops - 1);
+
+    if (gen_new_commit (repo_id, head_commit, root_id,
+                        user, desc->str, error) < 0)
+        ret = -1;
+
+out:
+    if (repo)
+        seaf_repo_unref (repo);
+    if (head_commit)
+        seaf_commit_unref (head_commit);
+    if (parser)
+        g_object_unref (parser);
+    if (root)
+        edit_dir_free (root);
+    g_free (root_id);
+    g_string_free (desc, TRUE);
+
+    if (ret == 0 && n_ops > 0)
+        update_repo_size (repo_id);
+
+    return ret;
+}
+
 static char *
 put_file_recursive(const char *dir_id,
                    const char *to_path,
                    SeafDirent *newdent)
 {
-    SeafDir *olddir, *newdir;
+    SeafDir *olddir;
     SeafDirent *dent;
     GList *ptr;
     char *to_path_dup = NULL;
@@ -1708,24 +2228,11 @@ put_file_recursive(const char *dir_id,
 
     /* we reach the target dir. Update the target dirent. */
     if (*to_path == '\0') {
-        GList *newentries = NULL, *p;
-        SeafDirent *dent;
+        DirBuilder b;
 
-        for (p = olddir->entries; p; p = p->next) {
-            dent = p->data;
-            if (strcmp(dent->name, newdent->name) == 0) {
-                newentries = g_list_prepend (newentries, dup_seaf_dirent(newdent));
-            } else {
-                newentries = g_list_prepend (newentries, dup_seaf_dirent(dent));
-            }
-        }
-
-        newentries = g_list_reverse (newentries);
-        newdir = seaf_dir_new (NULL, newentries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        id = g_strndup (newdir->dir_id, 41);
-        id[40] = '\0';
-        seaf_dir_free (newdir);
+        dir_builder_init (&b, olddir);
+        dir_builder_replace (&b, dup_seaf_dirent(newdent));
+        id = dir_builder_save (&b);
 
         goto out;
     }
@@ -1747,26 +2254,15 @@ put_file_recursive(const char *dir_id,
             continue;
 
         id = put_file_recursive (dent->id, remain, newdent);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-        }
         break;
     }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
-        GList *new_entries;
-        
-        new_entries = dup_seafdir_entries (olddir->entries);
-        newdir = seaf_dir_new (NULL, new_entries, 0);
-        seaf_dir_save (seaf->fs_mgr, newdir);
-        
-        g_free(id);
-        id = g_strndup(newdir->dir_id, 41);
-        id[40] = '\0';
-        
-        seaf_dir_free (newdir);
+        char *new_id = replace_subdir_id (olddir, to_path_dup, id);
+
+        g_free (id);
+        id = new_id;
     }
 
 out:
@@ -1858,7 +2354,8 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
     }
 
     if (seaf_fs_manager_index_blocks (seaf->fs_mgr, temp_file_path,
-                                      sha1, crypt) < 0) {
+                                      file_name, sha1, crypt,
+                                      repo->chunker) < 0) {
         seaf_warning ("failed to index blocks");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                      "Failed to index blocks");
@@ -2082,6 +2579,221 @@ out:
     return new_root_id;
 }
 
+/*
+ * Restore @path of @old_commit into @root. Like the revert functions, a
+ * file replaces a different file of the same name, and otherwise the
+ * restored entry gets a new name if its name is taken. If the parent dir
+ * doesn't exist any more, the entry is restored to the root dir.
+ */
+static int
+restore_entry (EditDir *root, SeafCommit *old_commit, const char *path,
+               GError **error)
+{
+    char *canon_path, *parent_dir = NULL, *name = NULL;
+    char *basename = NULL, *ext = NULL;
+    char *obj_id = NULL, *new_name = NULL;
+    guint32 mode = 0;
+    EditDir *ed, *sub;
+    SeafDirent *dent;
+    int i = 1, ret = 0;
+
+    canon_path = get_canonical_path (path);
+    while (*canon_path && canon_path[strlen(canon_path) - 1] == '/')
+        canon_path[strlen(canon_path) - 1] = '\0';
+    if (canon_path[strspn (canon_path, "/")] == '\0') {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid path %s", path);
+        ret = -1;
+        goto out;
+    }
+
+    obj_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, old_commit->root_id,
+                                             canon_path, &mode, NULL);
+    if (!obj_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "%s does not exist in commit %.8s",
+                     path, old_commit->commit_id);
+        ret = -1;
+        goto out;
+    }
+
+    parent_dir = g_path_get_dirname (canon_path);
+    name = g_path_get_basename (canon_path);
+    filename_splitext (name, &basename, &ext);
+
+    ed = edit_dir_get_by_path (root, parent_dir);
+    if (!ed)
+        ed = root;
+
+    new_name = g_strdup (name);
+    while ((dent = edit_dir_lookup (ed, new_name)) != NULL) {
+        if ((dent->mode & S_IFMT) == (mode & S_IFMT) &&
+            strcmp (dent->id, obj_id) == 0)
+            goto out;
+
+        /* Same named file with other content, overwrite it. */
+        if (S_ISREG(dent->mode) && S_ISREG(mode)) {
+            g_free (edit_dir_remove (ed, new_name, &sub));
+            break;
+        }
+
+        g_free (new_name);
+        if (S_ISDIR(mode))
+            new_name = g_strdup_printf ("%s (%d)", name, i++);
+        else
+            new_name = g_strdup_printf ("%s (%d)%s", basename, i++, ext);
+    }
+
+    edit_dir_add (ed, seaf_dirent_new (obj_id, mode, new_name), NULL);
+
+out:
+    g_free (canon_path);
+    g_free (parent_dir);
+    g_free (name);
+    g_free (basename);
+    g_free (ext);
+    g_free (obj_id);
+    g_free (new_name);
+    return ret;
+}
+
+int
+seaf_repo_manager_restore_entries (SeafRepoManager *mgr,
+                                   const char *repo_id,
+                                   const char *items_json,
+                                   const char *user,
+                                   RestoreProgressFunc progress,
+                                   void *data,
+                                   GError **error)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head_commit = NULL, *old_commit = NULL;
+    JsonParser *parser = NULL;
+    JsonNode *node;
+    JsonArray *array;
+    JsonObject *object;
+    EditDir *root = NULL;
+    const char *path, *commit_id;
+    char *root_id = NULL;
+    char *first_name = NULL;
+    char buf[PATH_MAX];
+    guint i, n_items = 0;
+    int ret = 0;
+
+    GET_REPO_OR_FAIL(repo, repo_id);
+    GET_COMMIT_OR_FAIL(head_commit, repo->head->commit_id);
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_data (parser, items_json, -1, NULL) ||
+        !(node = json_parser_get_root (parser)) ||
+        !JSON_NODE_HOLDS_ARRAY (node)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid restore list");
+        ret = -1;
+        goto out;
+    }
+    array = json_node_get_array (node);
+    n_items = json_array_get_length (array);
+    if (n_items == 0)
+        goto out;
+
+    root = edit_dir_load (head_commit->root_id);
+    if (!root) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to load root dir");
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n_items; ++i) {
+        if (progress && !progress (i, data)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Canceled");
+            ret = -1;
+            goto out;
+        }
+
+        node = json_array_get_element (array, i);
+        if (!JSON_NODE_HOLDS_OBJECT (node)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid restore item");
+            ret = -1;
+            goto out;
+        }
+        object = json_node_get_object (node);
+        path = get_op_member (object, "path");
+        commit_id = get_op_member (object, "commit_id");
+        if (!path || !commit_id) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid restore item");
+            ret = -1;
+            goto out;
+        }
+
+        /* Items are usually restored from a few commits. */
+        if (!old_commit || strcmp (old_commit->commit_id, commit_id) != 0) {
+            if (old_commit)
+                seaf_commit_unref (old_commit);
+            GET_COMMIT_OR_FAIL(old_commit, commit_id);
+            if (strcmp (old_commit->repo_id, repo_id) != 0) {
+                g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_COMMIT,
+                             "bad commit id");
+                ret = -1;
+                goto out;
+            }
+        }
+
+        if (restore_entry (root, old_commit, path, error) < 0) {
+            ret = -1;
+            goto out;
+        }
+        if (!first_name)
+            first_name = g_path_get_basename (path);
+    }
+    if (progress)
+        progress (n_items, data);
+
+    root_id = edit_dir_save (root);
+    if (!root_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to save dirs");
+        ret = -1;
+        goto out;
+    }
+
+    /* Everything was already as in history. */
+    if (strcmp (root_id, head_commit->root_id) == 0)
+        goto out;
+
+    if (n_items > 1)
+        snprintf (buf, sizeof(buf), "Reverted \"%s\" and %u more files",
+                  first_name, n_items - 1);
+    else
+        snprintf (buf, sizeof(buf), "Reverted \"%s\"", first_name);
+
+    if (gen_new_commit (repo_id, head_commit, root_id,
+                        user, buf, error) < 0)
+        ret = -1;
+
+out:
+    if (repo)
+        seaf_repo_unref (repo);
+    if (head_commit)
+        seaf_commit_unref (head_commit);
+    if (old_commit)
+        seaf_commit_unref (old_commit);
+    if (parser)
+        g_object_unref (parser);
+    if (root)
+        edit_dir_free (root);
+    g_free (root_id);
+    g_free (first_name);
+
+    if (ret == 0 && n_items > 0)
+        update_repo_size (repo_id);
+
+    return ret;
+}
+
 static gboolean
 detect_path_exist (const char *root_id,
                    const char *path,
@@ -2610,6 +3322,72 @@ compare_commit_by_time (const SeafCommit *a, const SeafCommit *b)
     return (b->ctime - a->ctime);
 }
 
+/* Returns -1 if the file history index can't be used. */
+static int
+list_file_revisions_from_index (SeafRepo *repo,
+                                const char *path,
+                                gint64 truncate_time,
+                                GList **commit_list)
+{
+    GList *commit_ids = NULL, *ptr;
+    SeafCommit *commit;
+    int ret = 0;
+
+    if (seaf_file_history_manager_get_revisions (seaf->file_history_mgr,
+                                                 repo->id,
+                                                 repo->head->commit_id,
+                                                 path, truncate_time,
+                                                 &commit_ids) < 0)
+        return -1;
+
+    for (ptr = commit_ids; ptr != NULL; ptr = ptr->next) {
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr, ptr->data);
+        if (!commit) {
+            ret = -1;
+            break;
+        }
+        *commit_list = g_list_prepend (*commit_list, commit);
+    }
+    string_list_free (commit_ids);
+
+    if (ret < 0) {
+        g_list_foreach (*commit_list, (GFunc)seaf_commit_unref, NULL);
+        g_list_free (*commit_list);
+        *commit_list = NULL;
+        return -1;
+    }
+
+    *commit_list = g_list_reverse (*commit_list);
+    return 0;
+}
+
+/*
+ * In compacted history, a revision still has its content if it's the
+ * latest one of its period, which the checkpoint commit has. The list is
+ * latest first, and the current revision is always kept.
+ */
+static GList *
+drop_compacted_revisions (GList *commit_list)
+{
+    HistoryCompactor compactor;
+    SeafCommit *commit;
+    GList *ptr, *next;
+
+    history_compactor_init (&compactor);
+
+    for (ptr = commit_list; ptr != NULL; ptr = next) {
+        next = ptr->next;
+        commit = ptr->data;
+        if (history_compactor_keep (&compactor, commit->ctime) ||
+            ptr == commit_list)
+            continue;
+        seaf_commit_unref (commit);
+        commit_list = g_list_delete_link (commit_list, ptr);
+    }
+
+    return commit_list;
+}
+
 GList *
 seaf_repo_manager_list_file_revisions (SeafRepoManager *mgr,
                                        const char *repo_id,
@@ -2638,6 +3416,13 @@ seaf_repo_manager_list_file_revisions (SeafRepoManager *mgr,
         data.truncate_time = -1;
     }
 
+    /* A limited walk is cheap, and the index doesn't know which commits
+     * it would reach. */
+    if (limit <= 0 &&
+        list_file_revisions_from_index (repo, path, data.truncate_time,
+                                        &commit_list) == 0)
+        goto out;
+
     /* A (commit id, commit) hash table. We specify a value destroy
      * function, so that even if we fail in half way of traversing, we can
      * free all commits in the hashtbl.*/
@@ -2670,6 +3455,7 @@ seaf_repo_manager_list_file_revisions (SeafRepoManager *mgr,
     }
 
 out:
+    commit_list = drop_compacted_revisions (commit_list);
     if (repo)
         seaf_repo_unref (repo);
     if (data.wanted_commits)
@@ -2689,8 +3475,9 @@ seaf_repo_manager_revert_on_server (SeafRepoManager *mgr,
 {
     SeafRepo *repo;
     SeafCommit *commit, *new_commit;
+    SeafBranch *branch;
     char desc[512];
-    int ret = 0;
+    int ret = 0, rc;
 
 retry:
     repo = seaf_repo_manager_get_repo (mgr, repo_id);
@@ -2724,10 +3511,13 @@ retry:
         goto out;
     }
 
-    seaf_branch_set_commit (repo->head, new_commit->commit_id);
-    if (seaf_branch_manager_test_and_update_branch (seaf->branch_mgr,
-                                                    repo->head,
-                                                    new_commit->parent_id) < 0)
+    branch = seaf_branch_new (repo->head->name, repo_id,
+                              new_commit->commit_id);
+    rc = seaf_branch_manager_test_and_update_branch (seaf->branch_mgr,
+                                                     branch,
+                                                     new_commit->parent_id);
+    seaf_branch_unref (branch);
+    if (rc < 0)
     {
         seaf_warning ("[revert] Concurrent branch update, retry.\n");
         seaf_repo_unref (repo);
@@ -2870,19 +3660,20 @@ out:
 
 #define DEFAULT_TRUNCATE_DAYS 30
 
+typedef struct {
+    GHashTable *entries;
+    gint64 truncate_time;
+} CollectDeletedData;
+
 static gboolean
-collect_deleted (SeafCommit *commit, void *data, gboolean *stop)
+collect_deleted (SeafCommit *commit, void *vdata, gboolean *stop)
 {
-    GHashTable *entries = data;
+    CollectDeletedData *data = vdata;
+    GHashTable *entries = data->entries;
     gint64 now = time(NULL);
-    gint64 truncate_time;
+    gint64 truncate_time = data->truncate_time;
     SeafCommit *p1, *p2;
 
-    if (seaf->keep_history_days > 0)
-        truncate_time = seaf->keep_history_days * 24 * 3600;
-    else
-        truncate_time = DEFAULT_TRUNCATE_DAYS * 24 * 3600;
-
     if (now - commit->ctime >= truncate_time) {
         *stop = TRUE;
         return TRUE;
@@ -2926,16 +3717,18 @@ collect_deleted (SeafCommit *commit, void *data, gboolean *stop)
     return TRUE;
 }
 
+/* Some files may be added back after deletion. */
 static gboolean
-remove_existing (gpointer key, gpointer value, gpointer user_data)
+exists_in_head (SeafileDeletedEntry *e, SeafCommit *head)
 {
-    SeafileDeletedEntry *e = value;
-    SeafCommit *head = user_data;
     guint32 mode = seafile_deleted_entry_get_mode(e), mode_out = 0;
-    char *path = key;
+    char *path, *obj_id;
 
-    char *obj_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, head->root_id,
-                                                    path, &mode_out, NULL);
+    path = g_strconcat (seafile_deleted_entry_get_basedir (e),
+                        seafile_deleted_entry_get_obj_name (e), NULL);
+    obj_id = seaf_fs_manager_path_to_obj_id (seaf->fs_mgr, head->root_id,
+                                             path, &mode_out, NULL);
+    g_free (path);
     if (obj_id == NULL)
         return FALSE;
     g_free (obj_id);
@@ -2943,29 +3736,7 @@ remove_existing (gpointer key, gpointer value, gpointer user_data)
     /* If path exist in head commit and with the same type,
      * remove it from deleted entries.
      */
-    if ((mode & S_IFMT) == (mode_out & S_IFMT)) {
-        /* g_debug ("%s exists in head commit.\n", path); */
-        return TRUE;
-    }
-
-    return FALSE;
-}
-
-static int
-filter_out_existing_entries (GHashTable *entries, const char *head_id)
-{
-    SeafCommit *head;
-
-    head = seaf_commit_manager_get_commit (seaf->commit_mgr, head_id);
-    if (!head) {
-        seaf_warning ("Failed to find head commit %s.\n", head_id);
-        return -1;
-    }
-
-    g_hash_table_foreach_remove (entries, remove_existing, head);
-
-    seaf_commit_unref (head);
-    return 0;
+    return ((mode & S_IFMT) == (mode_out & S_IFMT));
 }
 
 static gboolean
@@ -2979,18 +3750,70 @@ hash_to_list (gpointer key, gpointer value, gpointer user_data)
     return TRUE;
 }
 
+static gint
+compare_delete_time (gconstpointer a, gconstpointer b)
+{
+    int ta = seafile_deleted_entry_get_delete_time ((SeafileDeletedEntry *)a);
+    int tb = seafile_deleted_entry_get_delete_time ((SeafileDeletedEntry *)b);
+
+    return (tb - ta);
+}
+
+/* Walk the history within @truncate_time when the index isn't built. */
+static int
+walk_deleted_entries (const char *head_id, gint64 truncate_time,
+                      GList **entries)
+{
+    CollectDeletedData data;
+
+    data.entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_object_unref);
+    data.truncate_time = truncate_time;
+    if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                   head_id,
+                                                   collect_deleted,
+                                                   &data)) {
+        g_hash_table_destroy (data.entries);
+        return -1;
+    }
+
+    *entries = NULL;
+    g_hash_table_foreach_steal (data.entries, hash_to_list, entries);
+    g_hash_table_destroy (data.entries);
+
+    *entries = g_list_sort (*entries, compare_delete_time);
+    return 0;
+}
+
 GList *
 seaf_repo_manager_get_deleted_entries (SeafRepoManager *mgr,
                                        const char *repo_id,
+                                       int show_days,
+                                       int start,
+                                       int limit,
                                        GError **error)
 {
     SeafRepo *repo;
-    GHashTable *entries;
-    GList *ret = NULL;
+    SeafCommit *head;
+    GList *entries = NULL, *ret = NULL, *ptr;
+    SeafileDeletedEntry *e;
+    int days, skipped = 0, n = 0;
+    gint64 truncate_time;
 
     if (seaf->keep_history_days == 0)
         return NULL;
 
+    if (seaf->keep_history_days > 0)
+        days = seaf->keep_history_days;
+    else
+        days = DEFAULT_TRUNCATE_DAYS;
+    if (show_days > 0 && show_days < days)
+        days = show_days;
+    truncate_time = (gint64)days * 24 * 3600;
+
+    if (start < 0)
+        start = 0;
+
     repo = seaf_repo_manager_get_repo (mgr, repo_id);
     if (!repo) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
@@ -2998,33 +3821,52 @@ seaf_repo_manager_get_deleted_entries (SeafRepoManager *mgr,
         return NULL;
     }
 
-    entries = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                     g_free, g_object_unref);
-    if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
-                                                   repo->head->commit_id,
-                                                   collect_deleted,
-                                                   entries))
-    {
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo->head->commit_id);
+    if (!head) {
+        seaf_warning ("Failed to find head commit %s.\n",
+                      repo->head->commit_id);
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
                      "Internal error");
-        g_hash_table_destroy (entries);
         seaf_repo_unref (repo);
         return NULL;
     }
 
-    /* Remove entries exist in the current commit.
-     * This is necessary because some files may be added back after deletion.
-     */
-    filter_out_existing_entries (entries, repo->head->commit_id);
+    if (seaf_file_history_manager_get_deleted (seaf->file_history_mgr,
+                                               repo_id, head->commit_id,
+                                               (gint64)time(NULL) - truncate_time,
+                                               &entries) < 0 &&
+        walk_deleted_entries (head->commit_id, truncate_time, &entries) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
+                     "Internal error");
+        seaf_commit_unref (head);
+        seaf_repo_unref (repo);
+        return NULL;
+    }
 
-    g_hash_table_foreach_steal (entries, hash_to_list, &ret);
-    g_hash_table_destroy (entries);
+    /* Existing entries are filtered out before paging, only as far as the
+     * requested page. */
+    for (ptr = entries; ptr != NULL; ptr = ptr->next) {
+        e = ptr->data;
+        if ((limit < 0 || n < limit) && !exists_in_head (e, head)) {
+            if (skipped < start) {
+                ++skipped;
+            } else {
+                ret = g_list_prepend (ret, e);
+                ++n;
+                continue;
+            }
+        }
+        g_object_unref (e);
+    }
+    g_list_free (entries);
 
-    return ret;
+    seaf_commit_unref (head);
+    seaf_repo_unref (repo);
+    return g_list_reverse (ret);
 }
 
 
-
 static SeafCommit *
 get_commit(SeafRepo *repo, const char *branch_or_commit)
 {
@@ -194,6 +194,11 @@ seaf_repo_manager_check_permission (SeafRepoManager *mgr,
     char *owner = NULL;
     int org_id;
     char *permission = NULL;
+    guint gen;
+
+    if (seaf_perm_cache_lookup (mgr->perm_cache, repo_id, user, &permission))
+        return permission;
+    gen = seaf_perm_cache_get_gen (mgr->perm_cache);
 
     owner = seaf_repo_manager_get_repo_owner (mgr, repo_id);
     if (owner != NULL) {
@@ -222,7 +227,55 @@ seaf_repo_manager_check_permission (SeafRepoManager *mgr,
                                                           repo_id, user);
     }
 
+    seaf_perm_cache_insert (mgr->perm_cache, repo_id, user, permission, gen);
+
 out:
     g_free (owner);
     return permission;
 }
+
+int
+seaf_repo_manager_authorize_sync (SeafRepoManager *mgr,
+                                  const char *repo_id,
+                                  const char *token,
+                                  gboolean upload,
+                                  char **email)
+{
+    char *user = NULL;
+    char *perm = NULL;
+    guint gen;
+    int ret = SYNC_AUTH_OK;
+
+    /* Entries are dropped when the repo is deleted, so a cached token
+     * also means the repo exists. Invalid tokens are not cached. */
+    if (!seaf_perm_cache_lookup (mgr->token_cache, repo_id, token, &user) ||
+        !user) {
+        gen = seaf_perm_cache_get_gen (mgr->token_cache);
+
+        if (!seaf_repo_manager_repo_exists (mgr, repo_id))
+            return SYNC_AUTH_NO_REPO;
+
+        user = seaf_repo_manager_get_email_by_token (mgr, repo_id, token);
+        if (!user)
+            return SYNC_AUTH_DENIED;
+        seaf_perm_cache_insert (mgr->token_cache, repo_id, token, user, gen);
+    }
+
+    if (upload &&
+        seaf_quota_manager_check_quota (seaf->quota_mgr, repo_id) < 0) {
+        ret = SYNC_AUTH_QUOTA_FULL;
+        goto out;
+    }
+
+    perm = seaf_repo_manager_check_permission (mgr, repo_id, user, NULL);
+    if (!perm || (upload && strcmp (perm, "r") == 0))
+        ret = SYNC_AUTH_DENIED;
+
+out:
+    g_free (perm);
+    if (ret == SYNC_AUTH_OK && email)
+        *email = user;
+    else
+        g_free (user);
+    return ret;
+}
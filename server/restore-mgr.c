@@ -0,0 +1,255 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <json-glib/json-glib.h>
+
+#include "seafile-session.h"
+#include "seafile-object.h"
+#include "seafile-error.h"
+#include "restore-mgr.h"
+
+#include "utils.h"
+
+#define RESTORE_WORKERS 2
+#define FINISHED_TASK_TTL 3600
+
+typedef struct RestoreTask {
+    char        task_id[37];
+    char       *repo_id;
+    char       *items_json;
+    char       *user;
+    int         total;
+
+    /* Progress, protected by the manager lock. */
+    int         done;
+    gboolean    canceled;
+    gboolean    finished;
+    gboolean    successful;
+    char       *error_str;
+    gint64      finish_time;
+} RestoreTask;
+
+struct _SeafRestoreManagerPriv {
+    GThreadPool     *workers;
+
+    pthread_mutex_t lock;
+    GHashTable      *tasks;
+};
+
+static void restore_worker (gpointer vtask, gpointer vmgr);
+
+static void
+restore_task_free (RestoreTask *task)
+{
+    g_free (task->repo_id);
+    g_free (task->items_json);
+    g_free (task->user);
+    g_free (task->error_str);
+    g_free (task);
+}
+
+SeafRestoreManager *
+seaf_restore_manager_new (struct _SeafileSession *session)
+{
+    SeafRestoreManager *mgr = g_new0 (SeafRestoreManager, 1);
+
+    mgr->session = session;
+    mgr->priv = g_new0 (SeafRestoreManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->lock, NULL);
+    mgr->priv->tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify)restore_task_free);
+
+    return mgr;
+}
+
+int
+seaf_restore_manager_start (SeafRestoreManager *mgr)
+{
+    mgr->priv->workers = g_thread_pool_new (restore_worker, mgr,
+                                            RESTORE_WORKERS, FALSE, NULL);
+    if (!mgr->priv->workers) {
+        g_warning ("Failed to start restore threads.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static gboolean
+is_expired (gpointer key, gpointer value, gpointer now)
+{
+    RestoreTask *task = value;
+
+    return (task->finished &&
+            *(gint64 *)now - task->finish_time > FINISHED_TASK_TTL);
+}
+
+/* Returns the number of items, or -1 if @items_json isn't an array. */
+static int
+count_items (const char *items_json)
+{
+    JsonParser *parser = json_parser_new ();
+    JsonNode *node;
+    int n = -1;
+
+    if (json_parser_load_from_data (parser, items_json, -1, NULL) &&
+        (node = json_parser_get_root (parser)) != NULL &&
+        JSON_NODE_HOLDS_ARRAY (node))
+        n = json_array_get_length (json_node_get_array (node));
+
+    g_object_unref (parser);
+    return n;
+}
+
+char *
+seaf_restore_manager_add_task (SeafRestoreManager *mgr,
+                               const char *repo_id,
+                               const char *items_json,
+                               const char *user,
+                               GError **error)
+{
+    SeafRepo *repo;
+    RestoreTask *task;
+    char *uuid;
+    int n_items;
+    gint64 now;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo");
+        return NULL;
+    }
+    seaf_repo_unref (repo);
+
+    /* Fail early instead of in the worker. */
+    n_items = count_items (items_json);
+    if (n_items < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid restore list");
+        return NULL;
+    }
+
+    task = g_new0 (RestoreTask, 1);
+    uuid = gen_uuid ();
+    memcpy (task->task_id, uuid, 36);
+    g_free (uuid);
+    task->repo_id = g_strdup (repo_id);
+    task->items_json = g_strdup (items_json);
+    task->user = g_strdup (user);
+    task->total = n_items;
+
+    now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    g_hash_table_foreach_remove (mgr->priv->tasks, is_expired, &now);
+    g_hash_table_insert (mgr->priv->tasks, task->task_id, task);
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    g_thread_pool_push (mgr->priv->workers, task, NULL);
+
+    return g_strdup (task->task_id);
+}
+
+GObject *
+seaf_restore_manager_get_task (SeafRestoreManager *mgr, const char *task_id)
+{
+    RestoreTask *task;
+    GObject *ret = NULL;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    task = g_hash_table_lookup (mgr->priv->tasks, task_id);
+    if (task)
+        ret = g_object_new (SEAFILE_TYPE_RESTORE_TASK,
+                            "task_id", task->task_id,
+                            "repo_id", task->repo_id,
+                            "total", task->total,
+                            "done", task->done,
+                            "canceled", task->canceled,
+                            "finished", task->finished,
+                            "successful", task->successful,
+                            "error_str", task->error_str,
+                            NULL);
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    return ret;
+}
+
+int
+seaf_restore_manager_cancel_task (SeafRestoreManager *mgr,
+                                  const char *task_id)
+{
+    RestoreTask *task;
+    int ret = -1;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    task = g_hash_table_lookup (mgr->priv->tasks, task_id);
+    if (task && !task->finished) {
+        task->canceled = TRUE;
+        ret = 0;
+    }
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    return ret;
+}
+
+typedef struct {
+    SeafRestoreManager *mgr;
+    RestoreTask *task;
+} ProgressData;
+
+static gboolean
+update_progress (int n_done, void *vdata)
+{
+    ProgressData *data = vdata;
+    gboolean canceled;
+
+    pthread_mutex_lock (&data->mgr->priv->lock);
+    data->task->done = n_done;
+    canceled = data->task->canceled;
+    pthread_mutex_unlock (&data->mgr->priv->lock);
+
+    return !canceled;
+}
+
+static void
+finish_task (SeafRestoreManager *mgr, RestoreTask *task, const char *error_str)
+{
+    pthread_mutex_lock (&mgr->priv->lock);
+    task->finished = TRUE;
+    task->successful = (error_str == NULL);
+    task->error_str = g_strdup (error_str);
+    task->finish_time = (gint64)time(NULL);
+    pthread_mutex_unlock (&mgr->priv->lock);
+}
+
+static void
+restore_worker (gpointer vtask, gpointer vmgr)
+{
+    SeafRestoreManager *mgr = vmgr;
+    RestoreTask *task = vtask;
+    ProgressData data;
+    GError *error = NULL;
+
+    data.mgr = mgr;
+    data.task = task;
+
+    if (!update_progress (0, &data)) {
+        finish_task (mgr, task, "Canceled");
+        return;
+    }
+
+    if (seaf_repo_manager_restore_entries (seaf->repo_mgr, task->repo_id,
+                                           task->items_json, task->user,
+                                           update_progress, &data,
+                                           &error) < 0) {
+        finish_task (mgr, task, error ? error->message : "Internal error");
+        g_clear_error (&error);
+        return;
+    }
+
+    finish_task (mgr, task, NULL);
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_RESTORE_MGR_H
+#define SEAF_RESTORE_MGR_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+/*
+ * Restores sets of files and dirs from history in the background.
+ *
+ * Reverting a folder tree file by file blocks an RPC worker for each file
+ * and makes a commit for each. A restore task applies all its items to
+ * the tree in memory and makes a single commit, see
+ * seaf_repo_manager_restore_entries(). The caller gets a task id, polls
+ * the progress and may cancel the task before it commits.
+ */
+
+typedef struct _SeafRestoreManager        SeafRestoreManager;
+typedef struct _SeafRestoreManagerPriv    SeafRestoreManagerPriv;
+
+struct _SeafileSession;
+
+struct _SeafRestoreManager {
+    struct _SeafileSession  *session;
+    SeafRestoreManagerPriv  *priv;
+};
+
+SeafRestoreManager *
+seaf_restore_manager_new (struct _SeafileSession *session);
+
+int
+seaf_restore_manager_start (SeafRestoreManager *mgr);
+
+/* Returns the id of the new task, or NULL with @error set. */
+char *
+seaf_restore_manager_add_task (SeafRestoreManager *mgr,
+                               const char *repo_id,
+                               const char *items_json,
+                               const char *user,
+                               GError **error);
+
+/*
+ * Returns a SeafileRestoreTask, or NULL if @task_id is unknown. Finished
+ * tasks are kept for FINISHED_TASK_TTL seconds.
+ */
+GObject *
+seaf_restore_manager_get_task (SeafRestoreManager *mgr, const char *task_id);
+
+/* Returns -1 if @task_id is unknown or already finished. */
+int
+seaf_restore_manager_cancel_task (SeafRestoreManager *mgr,
+                                  const char *task_id);
+
+#endif
@@ -0,0 +1,348 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <ccnet.h>
+#include <ccnet/job-mgr.h>
+#include <searpc-server.h>
+
+#include "seafile-session.h"
+#include "rpc-dispatcher.h"
+#include "utils.h"
+
+#include "log.h"
+
+#define DEFAULT_WORKERS 16
+#define MAX_METHOD_NAME 128
+
+/* Limits of the calls known to take long, unless configured. */
+static const struct {
+    const char *method;
+    int limit;
+} default_limits[] = {
+    { "seafile_list_file_revisions", 4 },
+    { "seafile_calc_files_last_modified", 4 },
+    { "seafile_copy_file", 4 },
+    { "seafile_move_file", 4 },
+    { "get_deleted", 4 },
+    { "seafile_diff", 4 },
+    { NULL, 0 },
+};
+
+typedef struct MethodState {
+    char        *name;
+    int         limit;          /* 0 means no limit but the workers */
+    int         running;
+    int         queued;
+
+    guint64     calls;
+    gint64      queue_time;     /* usecs, in total */
+    gint64      max_queue_time;
+    gint64      run_time;
+} MethodState;
+
+struct _RpcCall {
+    SeafRpcDispatcher *dispatcher;
+    MethodState *method;
+    char        *service;
+    char        *fcall;
+    gsize       fcall_len;
+    RpcCallDoneFunc done;
+    void        *data;
+    gboolean    canceled;
+
+    gint64      queued_at;
+    gint64      started_at;     /* 0 while queued */
+
+    char        *ret;
+    gsize       ret_len;
+};
+
+struct _SeafRpcDispatcherPriv {
+    CcnetJobManager *job_mgr;
+    int             workers;
+    int             running;
+    GQueue          *waiting;
+
+    /* Protects the stats of the methods, which are read in rpc threads. */
+    pthread_mutex_t lock;
+    GHashTable      *methods;   /* name -> MethodState */
+    GHashTable      *limits;    /* name -> limit */
+};
+
+static void
+method_state_free (MethodState *m)
+{
+    g_free (m->name);
+    g_free (m);
+}
+
+static void
+load_limits (SeafRpcDispatcher *dispatcher)
+{
+    SeafRpcDispatcherPriv *priv = dispatcher->priv;
+    GKeyFile *config = dispatcher->seaf->config;
+    char **keys;
+    int i, value;
+    GError *error = NULL;
+
+    for (i = 0; default_limits[i].method != NULL; ++i)
+        g_hash_table_insert (priv->limits, g_strdup (default_limits[i].method),
+                             GINT_TO_POINTER(default_limits[i].limit));
+
+    value = g_key_file_get_integer (config, "rpc", "workers", &error);
+    if (error) {
+        g_clear_error (&error);
+        value = DEFAULT_WORKERS;
+    } else if (value <= 0) {
+        seaf_warning ("Invalid rpc workers %d.\n", value);
+        value = DEFAULT_WORKERS;
+    }
+    priv->workers = value;
+
+    keys = g_key_file_get_keys (config, "rpc_limits", NULL, NULL);
+    if (!keys)
+        return;
+    for (i = 0; keys[i] != NULL; ++i) {
+        value = g_key_file_get_integer (config, "rpc_limits", keys[i], &error);
+        if (error || value < 0) {
+            seaf_warning ("Invalid rpc limit of %s.\n", keys[i]);
+            g_clear_error (&error);
+            continue;
+        }
+        g_hash_table_insert (priv->limits, g_strdup (keys[i]),
+                             GINT_TO_POINTER(value));
+    }
+    g_strfreev (keys);
+}
+
+SeafRpcDispatcher *
+seaf_rpc_dispatcher_new (SeafileSession *seaf)
+{
+    SeafRpcDispatcher *dispatcher = g_new0 (SeafRpcDispatcher, 1);
+    SeafRpcDispatcherPriv *priv;
+
+    dispatcher->seaf = seaf;
+    priv = dispatcher->priv = g_new0 (SeafRpcDispatcherPriv, 1);
+
+    /* Separate from the jobs of the sync protocol. */
+    priv->job_mgr = ccnet_job_manager_new ();
+    priv->waiting = g_queue_new ();
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->methods = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL,
+                                           (GDestroyNotify)method_state_free);
+    priv->limits = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+
+    load_limits (dispatcher);
+
+    return dispatcher;
+}
+
+/* The function name is the first element of the fcall, ["name", ...]. */
+static void
+get_method_name (const char *fcall, gsize len, char *name)
+{
+    const char *p = fcall, *end = fcall + len;
+    int n = 0;
+
+    while (p < end && (*p == '[' || *p == ' '))
+        ++p;
+    if (p < end && *p == '"') {
+        ++p;
+        while (p < end && *p != '"' && *p != '\\' && n < MAX_METHOD_NAME - 1)
+            name[n++] = *p++;
+    }
+    name[n] = '\0';
+}
+
+/* The caller holds the lock. */
+static MethodState *
+get_method_state (SeafRpcDispatcherPriv *priv, const char *name)
+{
+    MethodState *m;
+
+    m = g_hash_table_lookup (priv->methods, name);
+    if (m)
+        return m;
+
+    m = g_new0 (MethodState, 1);
+    m->name = g_strdup (name);
+    m->limit = GPOINTER_TO_INT (g_hash_table_lookup (priv->limits, name));
+    g_hash_table_insert (priv->methods, m->name, m);
+
+    return m;
+}
+
+static void *
+call_thread (void *vcall)
+{
+    RpcCall *call = vcall;
+
+    call->ret = searpc_server_call_function (call->service,
+                                             call->fcall, call->fcall_len,
+                                             &call->ret_len);
+    return call;
+}
+
+static void
+rpc_call_free (RpcCall *call)
+{
+    g_free (call->service);
+    g_free (call->fcall);
+    g_free (call->ret);
+    g_free (call);
+}
+
+static void try_start_calls (SeafRpcDispatcher *dispatcher);
+
+static void
+call_done (void *vcall)
+{
+    RpcCall *call = vcall;
+    SeafRpcDispatcher *dispatcher = call->dispatcher;
+    SeafRpcDispatcherPriv *priv = dispatcher->priv;
+    char *ret;
+
+    pthread_mutex_lock (&priv->lock);
+    call->method->running--;
+    call->method->run_time += get_current_time() - call->started_at;
+    pthread_mutex_unlock (&priv->lock);
+    priv->running--;
+
+    if (!call->canceled) {
+        ret = call->ret;
+        call->ret = NULL;
+        call->done (ret, call->ret_len, call->data);
+    }
+    rpc_call_free (call);
+
+    try_start_calls (dispatcher);
+}
+
+static void
+start_call (SeafRpcDispatcher *dispatcher, RpcCall *call)
+{
+    SeafRpcDispatcherPriv *priv = dispatcher->priv;
+    MethodState *m = call->method;
+    gint64 waited;
+
+    call->started_at = get_current_time();
+    waited = call->started_at - call->queued_at;
+
+    pthread_mutex_lock (&priv->lock);
+    m->queued--;
+    m->running++;
+    m->calls++;
+    m->queue_time += waited;
+    if (waited > m->max_queue_time)
+        m->max_queue_time = waited;
+    pthread_mutex_unlock (&priv->lock);
+    priv->running++;
+
+    ccnet_job_manager_schedule_job (priv->job_mgr,
+                                    call_thread, call_done, call);
+}
+
+/* Start the first waiting calls that are within the limits. */
+static void
+try_start_calls (SeafRpcDispatcher *dispatcher)
+{
+    SeafRpcDispatcherPriv *priv = dispatcher->priv;
+    GList *link, *next;
+    RpcCall *call;
+
+    for (link = priv->waiting->head;
+         link != NULL && priv->running < priv->workers;
+         link = next) {
+        next = link->next;
+        call = link->data;
+        if (call->method->limit > 0 &&
+            call->method->running >= call->method->limit)
+            continue;
+        g_queue_delete_link (priv->waiting, link);
+        start_call (dispatcher, call);
+    }
+}
+
+RpcCall *
+seaf_rpc_dispatcher_call (SeafRpcDispatcher *dispatcher,
+                          const char *service,
+                          char *fcall,
+                          gsize fcall_len,
+                          RpcCallDoneFunc done,
+                          void *data)
+{
+    SeafRpcDispatcherPriv *priv = dispatcher->priv;
+    RpcCall *call = g_new0 (RpcCall, 1);
+    char name[MAX_METHOD_NAME];
+
+    get_method_name (fcall, fcall_len, name);
+
+    call->dispatcher = dispatcher;
+    call->service = g_strdup (service);
+    call->fcall = fcall;
+    call->fcall_len = fcall_len;
+    call->done = done;
+    call->data = data;
+    call->queued_at = get_current_time();
+
+    pthread_mutex_lock (&priv->lock);
+    call->method = get_method_state (priv, name);
+    call->method->queued++;
+    pthread_mutex_unlock (&priv->lock);
+
+    g_queue_push_tail (priv->waiting, call);
+    try_start_calls (dispatcher);
+
+    return call;
+}
+
+void
+seaf_rpc_dispatcher_cancel (SeafRpcDispatcher *dispatcher, RpcCall *call)
+{
+    SeafRpcDispatcherPriv *priv = dispatcher->priv;
+
+    /* A running call can't be stopped, its result is dropped. */
+    if (call->started_at != 0) {
+        call->canceled = TRUE;
+        return;
+    }
+
+    g_queue_remove (priv->waiting, call);
+    pthread_mutex_lock (&priv->lock);
+    call->method->queued--;
+    pthread_mutex_unlock (&priv->lock);
+    rpc_call_free (call);
+}
+
+char *
+seaf_rpc_dispatcher_get_stats (SeafRpcDispatcher *dispatcher)
+{
+    SeafRpcDispatcherPriv *priv = dispatcher->priv;
+    GString *buf = g_string_new (NULL);
+    GHashTableIter iter;
+    gpointer value;
+    MethodState *m;
+    gint64 avg_queue, avg_run;
+
+    pthread_mutex_lock (&priv->lock);
+    g_hash_table_iter_init (&iter, priv->methods);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        m = value;
+        avg_queue = m->calls ? m->queue_time / m->calls : 0;
+        avg_run = m->calls > m->running ?
+            m->run_time / (m->calls - m->running) : 0;
+        g_string_append_printf (buf, "%s\t%"G_GUINT64_FORMAT"\t%d\t%d\t"
+                                "%"G_GINT64_FORMAT"\t%"G_GINT64_FORMAT"\t"
+                                "%"G_GINT64_FORMAT"\n",
+                                m->name, m->calls, m->running, m->queued,
+                                avg_queue / 1000, m->max_queue_time / 1000,
+                                avg_run / 1000);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return g_string_free (buf, FALSE);
+}
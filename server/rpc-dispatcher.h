@@ -0,0 +1,66 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_RPC_DISPATCHER_H
+#define SEAF_RPC_DISPATCHER_H
+
+#include <glib.h>
+
+/*
+ * Runs the calls of the threaded rpc service in a pool of its own.
+ *
+ * Functions registered on "seafserv-threaded-rpcserver" are thread-safe,
+ * the others stay on the main loop with the sync protocol. At most
+ * "workers" calls run at once, and at most the limit of its method for
+ * each method, so that a few expensive calls can't take all the workers:
+ *
+ * [rpc]
+ * workers = 16
+ *
+ * [rpc_limits]
+ * seafile_list_file_revisions = 4
+ *
+ * Calls over the limits wait in FIFO order, and the time they wait is
+ * recorded per method.
+ *
+ * Only used in the main thread, except seaf_rpc_dispatcher_get_stats().
+ */
+
+typedef struct _SeafRpcDispatcher        SeafRpcDispatcher;
+typedef struct _SeafRpcDispatcherPriv    SeafRpcDispatcherPriv;
+typedef struct _RpcCall                  RpcCall;
+
+struct _SeafileSession;
+
+struct _SeafRpcDispatcher {
+    struct _SeafileSession *seaf;
+    SeafRpcDispatcherPriv  *priv;
+};
+
+/* @ret is NULL if the call failed, it belongs to the callee otherwise. */
+typedef void (*RpcCallDoneFunc) (char *ret, gsize ret_len, void *data);
+
+SeafRpcDispatcher *
+seaf_rpc_dispatcher_new (struct _SeafileSession *seaf);
+
+/*
+ * Call @fcall of @service, @done is called in the main loop when it
+ * returns. @fcall is taken over.
+ */
+RpcCall *
+seaf_rpc_dispatcher_call (SeafRpcDispatcher *dispatcher,
+                          const char *service,
+                          char *fcall,
+                          gsize fcall_len,
+                          RpcCallDoneFunc done,
+                          void *data);
+
+/* @done won't be called for @call. */
+void
+seaf_rpc_dispatcher_cancel (SeafRpcDispatcher *dispatcher, RpcCall *call);
+
+/* "<method>\t<calls>\t<running>\t<queued>\t<avg queue ms>\t<max queue ms>
+ * \t<avg run ms>\n" lines. */
+char *
+seaf_rpc_dispatcher_get_stats (SeafRpcDispatcher *dispatcher);
+
+#endif
@@ -19,9 +19,10 @@
 #include "seafile-session.h"
 #include "seafile-rpc.h"
 #include <ccnet/rpcserver-proc.h>
-#include <ccnet/threaded-rpcserver-proc.h>
 #include "log.h"
 #include "utils.h"
+#include "seaf-utils.h"
+#include "history-compact.h"
 
 #include "processors/check-tx-slave-proc.h"
 #include "processors/check-tx-slave-v2-proc.h"
@@ -38,6 +39,9 @@
 #include "processors/putcommit-v2-proc.h"
 #include "processors/recvcommit-v2-proc.h"
 #include "processors/recvcommit-v3-proc.h"
+#include "processors/recvcommit-v4-proc.h"
+#include "processors/watch-repos-slave-proc.h"
+#include "processors/rpc-dispatch-proc.h"
 #include "processors/putrepoemailtoken-proc.h"
 
 SeafileSession *seaf;
@@ -102,8 +106,12 @@ static void register_processors (CcnetClient *client)
                             SEAFILE_TYPE_RECVCOMMIT_V2_PROC, NULL);
     ccnet_register_service (client, "seafile-recvcommit-v3", "basic",
                             SEAFILE_TYPE_RECVCOMMIT_V3_PROC, NULL);
+    ccnet_register_service (client, "seafile-recvcommit-v4", "basic",
+                            SEAFILE_TYPE_RECVCOMMIT_V4_PROC, NULL);
     ccnet_register_service (client, "seafile-put-repo-email-token", "basic",
                             SEAFILE_TYPE_PUTREPOEMAILTOKEN_PROC, NULL);
+    ccnet_register_service (client, "seafile-watch-repos-slave", "basic",
+                            SEAFILE_TYPE_WATCH_REPOS_SLAVE_PROC, NULL);
 }
 
 #include <searpc.h>
@@ -120,7 +128,7 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
 
     searpc_create_service ("seafserv-threaded-rpcserver");
     ccnet_register_service (client, "seafserv-threaded-rpcserver", "rpc-inner",
-                            CCNET_TYPE_THREADED_RPCSERVER_PROC, NULL);
+                            SEAFILE_TYPE_RPC_DISPATCH_PROC, NULL);
 
     /* threaded services */
 
@@ -137,6 +145,10 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_get_repo_list,
                                      "seafile_get_repo_list",
                                      searpc_signature_objlist__int_int());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_list_repo_summaries,
+                                     "seafile_list_repo_summaries",
+                                     searpc_signature_objlist__string_int());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_repo_owner,
                                      "seafile_get_repo_owner",
@@ -155,6 +167,23 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_server_repo_size,
                                      "seafile_server_repo_size",
                                      searpc_signature_int64__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repo_unique_size,
+                                     "seafile_get_repo_unique_size",
+                                     searpc_signature_int64__string());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_set_repo_storage_class,
+                                     "seafile_set_repo_storage_class",
+                                     searpc_signature_int__string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_set_org_storage_class,
+                                     "seafile_set_org_storage_class",
+                                     searpc_signature_int__int_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repo_storage_class,
+                                     "seafile_get_repo_storage_class",
+                                     searpc_signature_string__string());
 
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_repo_set_access_property,
@@ -185,6 +214,11 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_post_multi_files",
                     searpc_signature_int__string_string_string_string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_post_indexed_files,
+                                     "seafile_post_indexed_files",
+                    searpc_signature_int__string_string_string_string_string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_put_file,
                                      "seafile_put_file",
@@ -205,6 +239,11 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_del_file",
                         searpc_signature_int__string_string_string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_batch_edit,
+                                     "seafile_batch_edit",
+                                     searpc_signature_int__string_string_string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_copy_file,
                                      "seafile_copy_file",
@@ -215,6 +254,47 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_move_file",
        searpc_signature_int__string_string_string_string_string_string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_copy_file_async,
+                                     "seafile_copy_file_async",
+       searpc_signature_string__string_string_string_string_string_string_string_int());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_copy_task,
+                                     "seafile_get_copy_task",
+                                     searpc_signature_object__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_restore_entries_async,
+                                     "seafile_restore_entries_async",
+                                     searpc_signature_string__string_string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_restore_task,
+                                     "seafile_get_restore_task",
+                                     searpc_signature_object__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_cancel_restore_task,
+                                     "seafile_cancel_restore_task",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_batch_call,
+                                     "seafile_batch_call",
+                                     searpc_signature_string__string());
+
+    /* web access tokens, also on the non-threaded service for old
+     * clients */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_web_get_access_token,
+                                     "seafile_web_get_access_token",
+                                     searpc_signature_string__string_string_string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_web_get_access_tokens,
+                                     "seafile_web_get_access_tokens",
+                                     searpc_signature_string__string_string_string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_web_query_access_token,
+                                     "seafile_web_query_access_token",
+                                     searpc_signature_object__string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_rename_file,
                                      "seafile_rename_file",
@@ -250,6 +330,11 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_list_dir_by_path",
                                      searpc_signature_objlist__string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_list_dir_by_path_paged,
+                                     "seafile_list_dir_by_path_paged",
+                                     searpc_signature_objlist__string_string_string_string_int_int());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_dirid_by_path,
                                      "seafile_get_dirid_by_path",
@@ -279,6 +364,10 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_get_deleted,
                                      "get_deleted",
                                      searpc_signature_objlist__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_deleted_entries,
+                                     "get_deleted_entries",
+                                     searpc_signature_objlist__string_int_int_int());
 
     /* share repo to user */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
@@ -293,6 +382,14 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_list_org_share_repos,
                                      "seafile_list_org_share_repos",
                                      searpc_signature_objlist__int_string_string_int_int());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_count_share_repos,
+                                     "seafile_count_share_repos",
+                                     searpc_signature_int__string_string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_count_org_share_repos,
+                                     "seafile_count_org_share_repos",
+                                     searpc_signature_int__int_string_string());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_remove_share,
                                      "seafile_remove_share",
@@ -325,6 +422,14 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_get_group_repos_by_owner,
                                      "get_group_repos_by_owner",
                                      searpc_signature_objlist__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_list_group_repos,
+                                     "list_group_repos",
+                                     searpc_signature_objlist__int_int_int());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_list_group_repos_by_owner,
+                                     "list_group_repos_by_owner",
+                                     searpc_signature_objlist__string_int_int());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_group_repo_owner,
                                      "get_group_repo_owner",
@@ -409,6 +514,48 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_get_monitor",
                                      searpc_signature_string__void());
 
+    /* object store statistics */
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_obj_store_stats,
+                                     "seafile_get_obj_store_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_fs_cache_stats,
+                                     "seafile_get_fs_cache_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_commit_cache_stats,
+                                     "seafile_get_commit_cache_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_exists_filter_stats,
+                                     "seafile_get_exists_filter_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_backend_stats,
+                                     "seafile_get_backend_stats",
+                                     searpc_signature_string__int());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_db_stats,
+                                     "seafile_get_db_stats",
+                                     searpc_signature_string__int());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_db_query_stats,
+                                     "seafile_get_db_query_stats",
+                                     searpc_signature_string__int());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_gc_stats,
+                                     "seafile_get_gc_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_rpc_stats,
+                                     "seafile_get_rpc_stats",
+                                     searpc_signature_string__void());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_get_metrics,
+                                     "seafile_get_metrics",
+                                     searpc_signature_string__void());
+
     /* password management */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_set_passwd,
@@ -489,6 +636,10 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                          seafile_list_inner_pub_repos_by_owner,
                                          "list_inner_pub_repos_by_owner",
                                          searpc_signature_objlist__string());
+        searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                         seafile_list_inner_pub_repos_paged,
+                                         "list_inner_pub_repos_paged",
+                                         searpc_signature_objlist__int_int());
     }
 
     /* Org repo */
@@ -567,6 +718,18 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                          seafile_list_org_inner_pub_repos_by_owner,
                                          "list_org_inner_pub_repos_by_owner",
                                          searpc_signature_objlist__int_string());
+        searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                         seafile_list_org_group_repos,
+                                         "list_org_group_repos",
+                                         searpc_signature_objlist__int_int_int_int());
+        searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                         seafile_list_org_group_repos_by_owner,
+                                         "list_org_group_repos_by_owner",
+                                         searpc_signature_objlist__int_string_int_int());
+        searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                         seafile_list_org_inner_pub_repos_paged,
+                                         "list_org_inner_pub_repos_paged",
+                                         searpc_signature_objlist__int_int_int());
     }
 }
 
@@ -663,6 +826,17 @@ load_history_config ()
         keep_history_days = 0;
     if (error == NULL)
         seaf->keep_history_days = keep_history_days;
+    g_clear_error (&error);
+
+    /* See history-compact.h. */
+    seaf->compact_after_days = g_key_file_get_integer (seaf->config, "history",
+                                                       "compact_after_days",
+                                                       NULL);
+    seaf->compact_hourly_days = g_key_file_get_integer (seaf->config, "history",
+                                                        "compact_hourly_days",
+                                                        NULL);
+    if (seaf->compact_hourly_days <= 0)
+        seaf->compact_hourly_days = DEFAULT_COMPACT_HOURLY_DAYS;
 }
 
 static void
@@ -793,6 +967,7 @@ main (int argc, char **argv)
 
     /* init seaf */
     seafile_session_init (seaf);
+    seaf_add_session_metrics (seaf);
 
     seafile_session_start (seaf);
 
@@ -804,6 +979,8 @@ main (int argc, char **argv)
     }
     atexit (on_seaf_server_exit);
 
+    seaf_notify_ready ();
+
     ccnet_main (client);
 
     return 0;
@@ -26,6 +26,7 @@
 
 #include "seaf-db.h"
 #include "seaf-utils.h"
+#include "obj-store.h"
 
 #define CONNECT_INTERVAL_MSEC 10 * 1000
 
@@ -137,6 +138,19 @@ seafile_session_new(const char *seafile_dir,
     if (!session->listen_mgr)
         goto onerror;
 
+    session->file_history_mgr = seaf_file_history_manager_new (session);
+    if (!session->file_history_mgr)
+        goto onerror;
+
+    session->block_ref_mgr = seaf_block_ref_manager_new (session);
+    session->storage_class_mgr = seaf_storage_class_manager_new (session);
+
+    session->copy_mgr = seaf_copy_manager_new (session);
+    session->restore_mgr = seaf_restore_manager_new (session);
+    session->notif_mgr = seaf_notif_manager_new (session);
+    session->size_notifier = seaf_size_notifier_new (session);
+    session->rpc_dispatcher = seaf_rpc_dispatcher_new (session);
+
     session->job_mgr = ccnet_job_manager_new ();
     session->ev_mgr = cevent_manager_new ();
     if (!session->ev_mgr)
@@ -145,6 +159,8 @@ seafile_session_new(const char *seafile_dir,
     session->mq_mgr = seaf_mq_manager_new (session);
     if (!session->mq_mgr)
         goto onerror;
+    if (g_key_file_get_boolean (config, "mq", "batch_events", NULL))
+        seaf_mq_manager_set_batch_events (session->mq_mgr, TRUE);
     
     return session;
 
@@ -165,6 +181,8 @@ seafile_session_init (SeafileSession *session)
     seaf_branch_manager_init (session->branch_mgr);
     seaf_repo_manager_init (session->repo_mgr);
     seaf_quota_manager_init (session->quota_mgr);
+    seaf_file_history_manager_init (session->file_history_mgr);
+    seaf_block_ref_manager_init (session->block_ref_mgr);
 
     seaf_mq_manager_init (session->mq_mgr);
     seaf_mq_manager_set_heartbeat_name (session->mq_mgr,
@@ -179,6 +197,18 @@ seafile_session_start (SeafileSession *session)
         return;
     }
 
+    /* Only seaf-server writes commits. httpserver also writes the blocks
+     * and file objects of uploads, which the filters don't see, so a
+     * filter miss only means another lookup or transfer. Checks of ids
+     * from clients use the unfiltered lookups.
+     */
+    seaf_obj_store_load_exists_filter (session->fs_mgr->obj_store,
+                                       session->config);
+    seaf_obj_store_load_exists_filter (session->commit_mgr->obj_store,
+                                       session->config);
+    seaf_block_manager_load_exists_filter (session->block_mgr,
+                                           session->config);
+
     if (seaf_cs_manager_start (session->cs_mgr) < 0) {
         g_error ("Failed to start chunk server manager.\n");
         return;
@@ -189,6 +219,11 @@ seafile_session_start (SeafileSession *session)
         return;
     }
 
+    if (seaf_repo_manager_start (session->repo_mgr) < 0) {
+        g_error ("Failed to start repo manager.\n");
+        return;
+    }
+
     if (seaf_web_at_manager_start (session->web_at_mgr) < 0) {
         g_error ("Failed to start web access check manager.\n");
         return;
@@ -208,6 +243,33 @@ seafile_session_start (SeafileSession *session)
         g_error ("Failed to start listen manager.\n");
         return;
     }
+
+    if (seaf_file_history_manager_start (session->file_history_mgr) < 0) {
+        g_error ("Failed to start file history manager.\n");
+        return;
+    }
+
+    if (seaf_block_ref_manager_start (session->block_ref_mgr) < 0) {
+        g_error ("Failed to start block ref manager.\n");
+        return;
+    }
+
+    if (seaf_storage_class_manager_start (session->storage_class_mgr) < 0) {
+        g_error ("Failed to start storage class manager.\n");
+        return;
+    }
+
+    if (seaf_copy_manager_start (session->copy_mgr) < 0) {
+        g_error ("Failed to start copy manager.\n");
+        return;
+    }
+
+    if (seaf_restore_manager_start (session->restore_mgr) < 0) {
+        g_error ("Failed to start restore manager.\n");
+        return;
+    }
+
+    seaf_size_notifier_start (session->size_notifier);
 }
 
 int
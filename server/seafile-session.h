@@ -22,6 +22,14 @@
 #include "passwd-mgr.h"
 #include "quota-mgr.h"
 #include "listen-mgr.h"
+#include "file-history-mgr.h"
+#include "block-ref-mgr.h"
+#include "storage-class-mgr.h"
+#include "copy-mgr.h"
+#include "restore-mgr.h"
+#include "notif-mgr.h"
+#include "size-notifier.h"
+#include "rpc-dispatcher.h"
 
 #include "mq-mgr.h"
 
@@ -63,6 +71,14 @@ struct _SeafileSession {
     SeafPasswdManager   *passwd_mgr;
     SeafQuotaManager    *quota_mgr;
     SeafListenManager   *listen_mgr;
+    SeafFileHistoryManager *file_history_mgr;
+    SeafBlockRefManager *block_ref_mgr;
+    SeafStorageClassManager *storage_class_mgr;
+    SeafCopyManager     *copy_mgr;
+    SeafRestoreManager  *restore_mgr;
+    SeafNotifManager    *notif_mgr;
+    SeafSizeNotifier    *size_notifier;
+    SeafRpcDispatcher   *rpc_dispatcher;
     
     SeafWebAccessTokenManager	*web_at_mgr;
 
@@ -76,6 +92,8 @@ struct _SeafileSession {
 
     int                  cloud_mode;
     int                  keep_history_days;
+    int                  compact_after_days;
+    int                  compact_hourly_days;
 };
 
 extern SeafileSession *seaf;
@@ -2,20 +2,18 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "seafile-session.h"
 #include "share-mgr.h"
 
 #include "seaf-db.h"
 
-SeafShareManager *
-seaf_share_manager_new (SeafileSession *seaf)
-{
-    SeafShareManager *mgr = g_new0 (SeafShareManager, 1);
-
-    mgr->seaf = seaf;
-
-    return mgr;
-}
+static void
+invalidate_user_lists (SeafShareManagerPriv *priv,
+                       const char *from_email, const char *to_email);
+static void
+invalidate_all_lists (SeafShareManagerPriv *priv);
 
 int
 seaf_share_manager_start (SeafShareManager *mgr)
@@ -50,21 +48,21 @@ seaf_share_manager_add_share (SeafShareManager *mgr, const char *repo_id,
                               const char *from_email, const char *to_email,
                               const char *permission)
 {
-    char sql[512];
-
-    snprintf (sql, sizeof(sql),
-              "SELECT repo_id from SharedRepo WHERE repo_id='%s' AND "
-              "from_email='%s' AND to_email='%s'", repo_id, from_email,
-              to_email);
-    if (seaf_db_check_for_existence (mgr->seaf->db, sql))
+    if (seaf_db_statement_exists (mgr->seaf->db,
+                                  "SELECT repo_id from SharedRepo WHERE "
+                                  "repo_id=? AND from_email=? AND to_email=?",
+                                  3, "string", repo_id, "string", from_email,
+                                  "string", to_email))
         return 0;
 
-    snprintf (sql, sizeof(sql),
-              "INSERT INTO SharedRepo VALUES ('%s', '%s', '%s', '%s')", repo_id,
-              from_email, to_email, permission);
-    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "INSERT INTO SharedRepo VALUES (?, ?, ?, ?)",
+                                 4, "string", repo_id, "string", from_email,
+                                 "string", to_email, "string", permission) < 0)
         return -1;
 
+    invalidate_user_lists (mgr->priv, from_email, to_email);
+    seaf_perm_cache_invalidate_repo (seaf->repo_mgr->perm_cache, repo_id);
     return 0;
 }
 
@@ -73,34 +71,309 @@ seaf_share_manager_set_permission (SeafShareManager *mgr, const char *repo_id,
                                    const char *from_email, const char *to_email,
                                    const char *permission)
 {
-    char sql[512];
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "UPDATE SharedRepo SET permission=? WHERE "
+                                 "repo_id=? AND from_email=? AND to_email=?",
+                                 4, "string", permission, "string", repo_id,
+                                 "string", from_email, "string", to_email) < 0)
+        return -1;
+
+    invalidate_user_lists (mgr->priv, from_email, to_email);
+    seaf_perm_cache_invalidate_repo (seaf->repo_mgr->perm_cache, repo_id);
+    return 0;
+}
+
+/*
+ * The web pages list the repos shared from and to the user on every
+ * load. The (repo_id, email, permission) rows of a listing are cached
+ * for SHARE_CACHE_TTL seconds, by type and email, then by org id, -1 for
+ * no org. Pages are cut from the cached rows and only the repos of the
+ * page are loaded, from the repo and commit caches.
+ *
+ * Share changes invalidate the lists of both users, removing a repo
+ * invalidates all of them.
+ */
+
+#define SHARE_CACHE_TTL 30      /* 30s */
+#define MAX_CACHED_LISTS 10000
+
+typedef struct ShareRow {
+    char repo_id[37];
+    char *email;
+    char *permission;
+} ShareRow;
+
+typedef struct ShareList {
+    GPtrArray *rows;
+    gint64 expire;
+} ShareList;
+
+struct _SeafShareManagerPriv {
+    /* "type\temail" -> (org id -> ShareList) */
+    GHashTable     *lists;
+    guint           n_lists;
+    /* Bumped by every invalidation, lists queried before are not cached. */
+    guint           gen;
+    pthread_mutex_t lock;
+};
+
+static void
+share_row_free (ShareRow *row)
+{
+    g_free (row->email);
+    g_free (row->permission);
+    g_free (row);
+}
+
+static void
+share_list_free (ShareList *list)
+{
+    g_ptr_array_foreach (list->rows, (GFunc)share_row_free, NULL);
+    g_ptr_array_free (list->rows, TRUE);
+    g_free (list);
+}
+
+static ShareList *
+share_list_dup (ShareList *list)
+{
+    ShareList *copy = g_new0 (ShareList, 1);
+    ShareRow *row, *new_row;
+    guint i;
+
+    copy->rows = g_ptr_array_sized_new (list->rows->len);
+    for (i = 0; i < list->rows->len; ++i) {
+        row = g_ptr_array_index (list->rows, i);
+        new_row = g_new0 (ShareRow, 1);
+        memcpy (new_row->repo_id, row->repo_id, 37);
+        new_row->email = g_strdup (row->email);
+        new_row->permission = g_strdup (row->permission);
+        g_ptr_array_add (copy->rows, new_row);
+    }
+    copy->expire = list->expire;
+
+    return copy;
+}
+
+static char *
+list_key (const char *type, const char *email)
+{
+    return g_strconcat (type, "\t", email, NULL);
+}
+
+/* Returns a copy of the cached list, or NULL. */
+static ShareList *
+lookup_share_list (SeafShareManagerPriv *priv,
+                   int org_id, const char *type, const char *email)
+{
+    char *key = list_key (type, email);
+    GHashTable *orgs;
+    ShareList *list = NULL;
+
+    pthread_mutex_lock (&priv->lock);
+    orgs = g_hash_table_lookup (priv->lists, key);
+    if (orgs)
+        list = g_hash_table_lookup (orgs, GINT_TO_POINTER(org_id));
+    if (list && list->expire > (gint64)time(NULL))
+        list = share_list_dup (list);
+    else
+        list = NULL;
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (key);
+    return list;
+}
+
+static void
+insert_share_list (SeafShareManagerPriv *priv,
+                   int org_id, const char *type, const char *email,
+                   ShareList *list, guint gen)
+{
+    GHashTable *orgs;
+    char *key;
 
-    snprintf (sql, sizeof(sql),
-              "UPDATE SharedRepo SET permission='%s' WHERE "
-              "repo_id='%s' AND from_email='%s' AND to_email='%s'",
-              permission, repo_id, from_email, to_email);
-    return seaf_db_query (mgr->seaf->db, sql);
+    pthread_mutex_lock (&priv->lock);
+
+    if (gen != priv->gen)
+        goto out;
+
+    if (priv->n_lists >= MAX_CACHED_LISTS) {
+        g_hash_table_remove_all (priv->lists);
+        priv->n_lists = 0;
+    }
+
+    key = list_key (type, email);
+    orgs = g_hash_table_lookup (priv->lists, key);
+    if (!orgs) {
+        orgs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                      (GDestroyNotify)share_list_free);
+        g_hash_table_insert (priv->lists, key, orgs);
+    } else {
+        g_free (key);
+    }
+
+    if (!g_hash_table_lookup (orgs, GINT_TO_POINTER(org_id)))
+        ++priv->n_lists;
+    g_hash_table_replace (orgs, GINT_TO_POINTER(org_id), share_list_dup (list));
+
+out:
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static void
+invalidate_user_lists (SeafShareManagerPriv *priv,
+                       const char *from_email, const char *to_email)
+{
+    GHashTable *orgs;
+    char *key;
+
+    pthread_mutex_lock (&priv->lock);
+
+    ++priv->gen;
+
+    key = list_key ("from_email", from_email);
+    orgs = g_hash_table_lookup (priv->lists, key);
+    if (orgs) {
+        priv->n_lists -= g_hash_table_size (orgs);
+        g_hash_table_remove (priv->lists, key);
+    }
+    g_free (key);
+
+    key = list_key ("to_email", to_email);
+    orgs = g_hash_table_lookup (priv->lists, key);
+    if (orgs) {
+        priv->n_lists -= g_hash_table_size (orgs);
+        g_hash_table_remove (priv->lists, key);
+    }
+    g_free (key);
+
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static void
+invalidate_all_lists (SeafShareManagerPriv *priv)
+{
+    pthread_mutex_lock (&priv->lock);
+    ++priv->gen;
+    g_hash_table_remove_all (priv->lists);
+    priv->n_lists = 0;
+    pthread_mutex_unlock (&priv->lock);
+}
+
+SeafShareManager *
+seaf_share_manager_new (SeafileSession *seaf)
+{
+    SeafShareManager *mgr = g_new0 (SeafShareManager, 1);
+    SeafShareManagerPriv *priv = g_new0 (SeafShareManagerPriv, 1);
+
+    mgr->seaf = seaf;
+    mgr->priv = priv;
+
+    priv->lists = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)g_hash_table_destroy);
+    pthread_mutex_init (&priv->lock, NULL);
+
+    return mgr;
 }
 
 static gboolean
-collect_repos (SeafDBRow *row, void *data)
+collect_share_row (SeafDBRow *row, void *data)
 {
-    GList **p_repos = data;
+    GPtrArray *rows = data;
     const char *repo_id;
-    const char *email;
-    const char *permission;
+    ShareRow *srow;
+
+    repo_id = seaf_db_row_get_column_text (row, 0);
+    if (!repo_id || strlen (repo_id) != 36)
+        return TRUE;
+
+    srow = g_new0 (ShareRow, 1);
+    memcpy (srow->repo_id, repo_id, 37);
+    srow->email = g_strdup (seaf_db_row_get_column_text (row, 1));
+    srow->permission = g_strdup (seaf_db_row_get_column_text (row, 2));
+    g_ptr_array_add (rows, srow);
+
+    return TRUE;
+}
+
+/* @org_id < 0 for the shares of all repos. */
+static ShareList *
+get_share_list (SeafShareManager *mgr,
+                int org_id, const char *type, const char *email)
+{
+    SeafShareManagerPriv *priv = mgr->priv;
+    ShareList *list;
+    gboolean from;
+    guint gen;
+    int rc;
+
+    if (g_strcmp0 (type, "from_email") == 0) {
+        from = TRUE;
+    } else if (g_strcmp0 (type, "to_email") == 0) {
+        from = FALSE;
+    } else {
+        /* should never reach here */
+        g_warning ("[share mgr] Wrong column type");
+        return NULL;
+    }
+
+    list = lookup_share_list (priv, org_id, type, email);
+    if (list)
+        return list;
+
+    pthread_mutex_lock (&priv->lock);
+    gen = priv->gen;
+    pthread_mutex_unlock (&priv->lock);
+
+    list = g_new0 (ShareList, 1);
+    list->rows = g_ptr_array_new ();
+
+    if (org_id < 0) {
+        rc = seaf_db_statement_foreach_row (mgr->seaf->db,
+                 from ?
+                 "SELECT SharedRepo.repo_id, to_email, permission FROM "
+                 "SharedRepo, RepoOwner WHERE from_email=? AND "
+                 "SharedRepo.repo_id=RepoOwner.repo_id" :
+                 "SELECT SharedRepo.repo_id, from_email, permission FROM "
+                 "SharedRepo, RepoOwner WHERE to_email=? AND "
+                 "SharedRepo.repo_id=RepoOwner.repo_id",
+                 collect_share_row, list->rows,
+                 1, "string", email);
+    } else {
+        rc = seaf_db_statement_foreach_row (mgr->seaf->db,
+                 from ?
+                 "SELECT SharedRepo.repo_id, to_email, permission FROM "
+                 "SharedRepo, OrgRepo WHERE from_email=? AND "
+                 "OrgRepo.org_id=? AND SharedRepo.repo_id=OrgRepo.repo_id" :
+                 "SELECT SharedRepo.repo_id, from_email, permission FROM "
+                 "SharedRepo, OrgRepo WHERE to_email=? AND "
+                 "OrgRepo.org_id=? AND SharedRepo.repo_id=OrgRepo.repo_id",
+                 collect_share_row, list->rows,
+                 2, "string", email, "int", org_id);
+    }
+    if (rc < 0) {
+        g_warning ("[share mgr] DB error when get shared repo id and email "
+                   "for %s.\n", email);
+        share_list_free (list);
+        return NULL;
+    }
+
+    list->expire = (gint64)time(NULL) + SHARE_CACHE_TTL;
+    insert_share_list (priv, org_id, type, email, list, gen);
+
+    return list;
+}
+
+static SeafileSharedRepo *
+shared_repo_from_row (ShareRow *row)
+{
     SeafRepo *repo = NULL;
     SeafCommit *commit = NULL;
-    SeafileSharedRepo *srepo;
-    
-    repo_id = seaf_db_row_get_column_text (row, 0);
-    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    SeafileSharedRepo *srepo = NULL;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, row->repo_id);
     if (!repo)
         goto out;
 
-    email = seaf_db_row_get_column_text (row, 1);
-    permission = seaf_db_row_get_column_text (row, 2);
-
     commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
                                              repo->head->commit_id);
     if (!commit)
@@ -108,88 +381,59 @@ collect_repos (SeafDBRow *row, void *data)
 
     srepo = g_object_new (SEAFILE_TYPE_SHARED_REPO,
                           "share_type", "personal",
-                          "repo_id", repo_id,
+                          "repo_id", row->repo_id,
                           "repo_name", repo->name,
                           "repo_desc", repo->desc,
                           "encrypted", repo->encrypted,
-                          "user", email,
-                          "permission", permission,
+                          "user", row->email,
+                          "permission", row->permission,
                           "last_modified", commit->ctime,
                           NULL);
-    
-    *p_repos = g_list_prepend (*p_repos, srepo);
 
 out:
     seaf_repo_unref (repo);
     seaf_commit_unref (commit);
-    return TRUE;
+    return srepo;
 }
 
-GList*
-seaf_share_manager_list_share_repos (SeafShareManager *mgr, const char *email,
-                                     const char *type, int start, int limit)
+static GList *
+list_share_repos (SeafShareManager *mgr, int org_id,
+                  const char *email, const char *type,
+                  int start, int limit)
 {
-    GList *ret = NULL, *p;
-    char sql[512];
-
-    if (start == -1 && limit == -1) {
-        if (g_strcmp0 (type, "from_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, to_email, permission FROM "
-                      "SharedRepo, RepoOwner "
-                      "WHERE from_email='%s' AND "
-                      "SharedRepo.repo_id=RepoOwner.repo_id",
-                      email);
-        } else if (g_strcmp0 (type, "to_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, from_email, permission FROM "
-                      "SharedRepo, RepoOwner "
-                      "WHERE to_email='%s' AND "
-                      "SharedRepo.repo_id=RepoOwner.repo_id",
-                      email);
-        } else {
-            /* should never reach here */
-            g_warning ("[share mgr] Wrong column type");
-            return NULL;
-        }
-    }
-    else {
-        if (g_strcmp0 (type, "from_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, to_email, permission FROM "
-                      "SharedRepo, RepoOwner WHERE "
-                      "from_email='%s' AND "
-                      "SharedRepo.repo_id=RepoOwner.repo_id "
-                      "LIMIT %d, %d",
-                      email, start, limit);
-        } else if (g_strcmp0 (type, "to_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, from_email, permission FROM "
-                      "SharedRepo, RepoOwner WHERE "
-                      "to_email='%s' AND "
-                      "SharedRepo.repo_id=RepoOwner.repo_id "
-                      "LIMIT %d, %d",
-                      email, start, limit);
-        } else {
-            /* should never reach here */
-            g_warning ("[share mgr] Wrong column type");
-            return NULL;
-        }
-    }
+    ShareList *list;
+    SeafileSharedRepo *srepo;
+    GList *ret = NULL;
+    guint i, end;
 
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql,
-                                      collect_repos, &ret) < 0) {
-        g_warning ("[share mgr] DB error when get shared repo id and email "
-                   "for %s.\n", email);
-        for (p = ret; p; p = p->next)
-            g_object_unref (p->data);
-        g_list_free (ret);
+    list = get_share_list (mgr, org_id, type, email);
+    if (!list)
         return NULL;
+
+    if (start < 0 || limit < 0) {
+        start = 0;
+        end = list->rows->len;
+    } else {
+        end = MIN ((guint)start + (guint)limit, list->rows->len);
     }
 
+    for (i = (guint)start; i < end; ++i) {
+        srepo = shared_repo_from_row (g_ptr_array_index (list->rows, i));
+        if (srepo)
+            ret = g_list_prepend (ret, srepo);
+    }
+
+    share_list_free (list);
     return g_list_reverse (ret);
 }
 
+GList*
+seaf_share_manager_list_share_repos (SeafShareManager *mgr, const char *email,
+                                     const char *type, int start, int limit)
+{
+    return list_share_repos (mgr, -1, email, type, start, limit);
+}
+
 GList*
 seaf_share_manager_list_org_share_repos (SeafShareManager *mgr,
                                          int org_id,
@@ -197,99 +441,68 @@ seaf_share_manager_list_org_share_repos (SeafShareManager *mgr,
                                          const char *type,
                                          int start, int limit)
 {
-    GList *ret = NULL, *p;
-    char sql[512];
-
-    if (start == -1 && limit == -1) {
-        if (g_strcmp0 (type, "from_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, to_email, permission FROM "
-                      "SharedRepo, OrgRepo "
-                      "WHERE from_email='%s' AND "
-                      "OrgRepo.org_id=%d AND "
-                      "SharedRepo.repo_id=OrgRepo.repo_id",
-                      email, org_id);
-        } else if (g_strcmp0 (type, "to_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, from_email, permission FROM "
-                      "SharedRepo, OrgRepo "
-                      "WHERE to_email='%s' AND "
-                      "OrgRepo.org_id=%d AND "
-                      "SharedRepo.repo_id=OrgRepo.repo_id",
-                      email, org_id);
-        } else {
-            /* should never reach here */
-            g_warning ("[share mgr] Wrong column type");
-            return NULL;
-        }
-    }
-    else {
-        if (g_strcmp0 (type, "from_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, to_email, permission FROM "
-                      "SharedRepo, OrgRepo WHERE "
-                      "from_email='%s' AND "
-                      "OrgRepo.org_id=%d AND "
-                      "SharedRepo.repo_id=OrgRepo.repo_id "
-                      "LIMIT %d, %d",
-                      email, org_id, start, limit);
-        } else if (g_strcmp0 (type, "to_email") == 0) {
-            snprintf (sql, sizeof(sql),
-                      "SELECT SharedRepo.repo_id, from_email, permission FROM "
-                      "SharedRepo, OrgRepo WHERE "
-                      "to_email='%s' AND "
-                      "OrgRepo.org_id=%d AND "
-                      "SharedRepo.repo_id=OrgRepo.repo_id "
-                      "LIMIT %d, %d",
-                      email, org_id, start, limit);
-        } else {
-            /* should never reach here */
-            g_warning ("[share mgr] Wrong column type");
-            return NULL;
-        }
-    }
+    return list_share_repos (mgr, org_id, email, type, start, limit);
+}
 
-    if (seaf_db_foreach_selected_row (mgr->seaf->db, sql,
-                                      collect_repos, &ret) < 0) {
-        g_warning ("[share mgr] DB error when get shared repo id and email "
-                   "for %s.\n", email);
-        for (p = ret; p; p = p->next)
-            g_object_unref (p->data);
-        g_list_free (ret);
-        return NULL;
-    }
+static int
+count_share_repos (SeafShareManager *mgr, int org_id,
+                   const char *email, const char *type)
+{
+    ShareList *list;
+    int n;
 
-    return g_list_reverse (ret);
+    list = get_share_list (mgr, org_id, type, email);
+    if (!list)
+        return -1;
+
+    n = (int)list->rows->len;
+    share_list_free (list);
+    return n;
+}
+
+int
+seaf_share_manager_count_share_repos (SeafShareManager *mgr,
+                                      const char *email,
+                                      const char *type)
+{
+    return count_share_repos (mgr, -1, email, type);
+}
+
+int
+seaf_share_manager_count_org_share_repos (SeafShareManager *mgr,
+                                          int org_id,
+                                          const char *email,
+                                          const char *type)
+{
+    return count_share_repos (mgr, org_id, email, type);
 }
 
 int
 seaf_share_manager_remove_share (SeafShareManager *mgr, const char *repo_id,
                                  const char *from_email, const char *to_email)
 {
-    char sql[512];
-
-    snprintf (sql, sizeof(sql),
-              "DELETE FROM SharedRepo WHERE repo_id = '%s' AND from_email ="
-              " '%s' AND to_email = '%s'", repo_id, from_email, to_email);
-    
-    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "DELETE FROM SharedRepo WHERE repo_id = ? AND "
+                                 "from_email = ? AND to_email = ?",
+                                 3, "string", repo_id, "string", from_email,
+                                 "string", to_email) < 0)
         return -1;
 
+    invalidate_user_lists (mgr->priv, from_email, to_email);
+    seaf_perm_cache_invalidate_repo (seaf->repo_mgr->perm_cache, repo_id);
     return 0;
 }
 
 int
 seaf_share_manager_remove_repo (SeafShareManager *mgr, const char *repo_id)
 {
-    char sql[512];
-
-    snprintf (sql, sizeof(sql),
-              "DELETE FROM SharedRepo WHERE repo_id = '%s'", 
-              repo_id);
-    
-    if (seaf_db_query (mgr->seaf->db, sql) < 0)
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "DELETE FROM SharedRepo WHERE repo_id = ?",
+                                 1, "string", repo_id) < 0)
         return -1;
 
+    invalidate_all_lists (mgr->priv);
+    seaf_perm_cache_invalidate_repo (seaf->repo_mgr->perm_cache, repo_id);
     return 0;
 }
 
@@ -298,10 +511,8 @@ seaf_share_manager_check_permission (SeafShareManager *mgr,
                                      const char *repo_id,
                                      const char *email)
 {
-    char sql[512];
-
-    snprintf (sql, sizeof(sql),
-              "SELECT permission FROM SharedRepo WHERE repo_id='%s' AND to_email='%s'",
-              repo_id, email);
-    return seaf_db_get_string (mgr->seaf->db, sql);
+    return seaf_db_statement_get_string (mgr->seaf->db,
+                                         "SELECT permission FROM SharedRepo "
+                                         "WHERE repo_id=? AND to_email=?",
+                                         2, "string", repo_id, "string", email);
 }
@@ -14,6 +14,7 @@ typedef struct _ShareRepoInfo ShareRepoInfo;
 struct _SeafShareManager {
     struct _SeafileSession *seaf;
 
+    SeafShareManagerPriv *priv;
 };
 
 SeafShareManager*
@@ -43,6 +44,21 @@ seaf_share_manager_list_org_share_repos (SeafShareManager *mgr,
                                          const char *type,
                                          int start, int limit);
 
+/*
+ * Number of repos listed by seaf_share_manager_list_share_repos(), or -1
+ * on error.
+ */
+int
+seaf_share_manager_count_share_repos (SeafShareManager *mgr,
+                                      const char *email,
+                                      const char *type);
+
+int
+seaf_share_manager_count_org_share_repos (SeafShareManager *mgr,
+                                          int org_id,
+                                          const char *email,
+                                          const char *type);
+
 int
 seaf_share_manager_remove_share (SeafShareManager *mgr, const char *repo_id,
                                  const char *from_email, const char *to_email);
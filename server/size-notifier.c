@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <ccnet.h>
+#include <ccnet/timer.h>
+
+#include "seafile-session.h"
+#include "monitor-rpc-wrappers.h"
+#include "size-notifier.h"
+
+#include "log.h"
+
+#define FLUSH_INTERVAL 2        /* seconds */
+#define MAX_PENDING_REPOS 100000
+
+struct _SeafSizeNotifierPriv {
+    pthread_mutex_t lock;
+    GHashTable      *pending;   /* repo ids */
+    gboolean        overflowed;
+
+    CcnetTimer      *flush_timer;
+};
+
+SeafSizeNotifier *
+seaf_size_notifier_new (SeafileSession *seaf)
+{
+    SeafSizeNotifier *notifier = g_new0 (SeafSizeNotifier, 1);
+
+    notifier->seaf = seaf;
+    notifier->priv = g_new0 (SeafSizeNotifierPriv, 1);
+    pthread_mutex_init (&notifier->priv->lock, NULL);
+    notifier->priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+
+    return notifier;
+}
+
+static gboolean
+monitor_is_local (SeafSizeNotifier *notifier)
+{
+    return (strcmp (notifier->seaf->monitor_id,
+                    notifier->seaf->session->base.id) == 0);
+}
+
+void
+seaf_size_notifier_repo_changed (SeafSizeNotifier *notifier,
+                                 const char *repo_id)
+{
+    SeafSizeNotifierPriv *priv = notifier->priv;
+
+    if (!notifier->seaf->monitor_id || monitor_is_local (notifier))
+        return;
+
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_size (priv->pending) < MAX_PENDING_REPOS)
+        g_hash_table_insert (priv->pending, g_strdup (repo_id),
+                             GINT_TO_POINTER(1));
+    else if (!priv->overflowed &&
+             !g_hash_table_lookup (priv->pending, repo_id)) {
+        seaf_warning ("Too many repo size updates queued, "
+                      "dropping the rest until the monitor is back.\n");
+        priv->overflowed = TRUE;
+    }
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static void
+compute_callback (void *result, void *data, GError *error)
+{
+    /* nothing to do */
+}
+
+static int
+flush_pending (void *vnotifier)
+{
+    SeafSizeNotifier *notifier = vnotifier;
+    SeafSizeNotifierPriv *priv = notifier->priv;
+    SeafileSession *seaf = notifier->seaf;
+    GHashTable *pending;
+    GHashTableIter iter;
+    gpointer key;
+    guint n_pending;
+
+    pthread_mutex_lock (&priv->lock);
+    n_pending = g_hash_table_size (priv->pending);
+    pthread_mutex_unlock (&priv->lock);
+
+    if (!seaf->monitor_id || n_pending == 0)
+        return TRUE;
+
+    if (!monitor_is_local (notifier) &&
+        !ccnet_peer_is_ready (seaf->ccnetrpc_client, seaf->monitor_id))
+        return TRUE;
+
+    pthread_mutex_lock (&priv->lock);
+    pending = priv->pending;
+    priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    priv->overflowed = FALSE;
+    pthread_mutex_unlock (&priv->lock);
+
+    g_hash_table_iter_init (&iter, pending);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        monitor_compute_repo_size_async_wrapper (seaf->monitor_id, key,
+                                                 compute_callback, NULL);
+    g_hash_table_destroy (pending);
+
+    return TRUE;
+}
+
+int
+seaf_size_notifier_start (SeafSizeNotifier *notifier)
+{
+    notifier->priv->flush_timer = ccnet_timer_new (flush_pending, notifier,
+                                                   FLUSH_INTERVAL * 1000);
+    return 0;
+}
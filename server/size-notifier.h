@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_SIZE_NOTIFIER_H
+#define SEAF_SIZE_NOTIFIER_H
+
+/*
+ * Tells the monitor which repos need their sizes recomputed.
+ *
+ * A monitor on the same host gets the repo-update events of the branch
+ * manager over the mq-mgr, so nothing is sent to it. A remote monitor is
+ * called asynchronously from the main loop every FLUSH_INTERVAL seconds
+ * with the repos updated since the last flush, each repo once. While the
+ * monitor is down the repos stay queued, up to MAX_PENDING_REPOS; the
+ * monitor refreshes all sizes when it starts anyway.
+ */
+
+typedef struct _SeafSizeNotifier        SeafSizeNotifier;
+typedef struct _SeafSizeNotifierPriv    SeafSizeNotifierPriv;
+
+struct _SeafileSession;
+
+struct _SeafSizeNotifier {
+    struct _SeafileSession *seaf;
+    SeafSizeNotifierPriv   *priv;
+};
+
+SeafSizeNotifier *
+seaf_size_notifier_new (struct _SeafileSession *seaf);
+
+int
+seaf_size_notifier_start (SeafSizeNotifier *notifier);
+
+/* Can be called from any thread, never blocks on the monitor. */
+void
+seaf_size_notifier_repo_changed (SeafSizeNotifier *notifier,
+                                 const char *repo_id);
+
+#endif
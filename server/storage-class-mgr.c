@@ -0,0 +1,208 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+#include "log.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "seaf-db.h"
+#include "storage-class-mgr.h"
+
+#include "utils.h"
+
+struct _SeafStorageClassManagerPriv {
+    GThreadPool     *migrate_pool;
+    pthread_mutex_t queue_lock;
+    GHashTable      *queued_repos;
+};
+
+static void migrate_worker (gpointer vrepo_id, gpointer vmgr);
+
+SeafStorageClassManager *
+seaf_storage_class_manager_new (struct _SeafileSession *session)
+{
+    SeafStorageClassManager *mgr = g_new0 (SeafStorageClassManager, 1);
+
+    mgr->session = session;
+    mgr->priv = g_new0 (struct _SeafStorageClassManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->queue_lock, NULL);
+    mgr->priv->queued_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+
+    return mgr;
+}
+
+int
+seaf_storage_class_manager_start (SeafStorageClassManager *mgr)
+{
+    if (!seaf_block_manager_has_storage_classes (mgr->session->block_mgr))
+        return 0;
+
+    /* One move at a time, so that migrations don't crowd out uploads. */
+    mgr->priv->migrate_pool = g_thread_pool_new (migrate_worker, mgr,
+                                                 1, FALSE, NULL);
+    if (!mgr->priv->migrate_pool) {
+        g_warning ("Failed to start storage class migration thread.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+seaf_storage_class_manager_migrate_repo (SeafStorageClassManager *mgr,
+                                         const char *repo_id)
+{
+    gboolean queued;
+
+    if (!mgr->priv->migrate_pool)
+        return;
+
+    pthread_mutex_lock (&mgr->priv->queue_lock);
+    queued = (g_hash_table_lookup (mgr->priv->queued_repos, repo_id) != NULL);
+    if (!queued)
+        g_hash_table_insert (mgr->priv->queued_repos,
+                             g_strdup (repo_id), GINT_TO_POINTER(1));
+    pthread_mutex_unlock (&mgr->priv->queue_lock);
+
+    if (!queued)
+        g_thread_pool_push (mgr->priv->migrate_pool, g_strdup (repo_id), NULL);
+}
+
+int
+seaf_storage_class_manager_set_repo_class (SeafStorageClassManager *mgr,
+                                           const char *repo_id,
+                                           const char *class_name)
+{
+    if (seaf_block_manager_set_repo_class (mgr->session->block_mgr,
+                                           repo_id, class_name) < 0)
+        return -1;
+
+    seaf_storage_class_manager_migrate_repo (mgr, repo_id);
+    return 0;
+}
+
+static gboolean
+collect_id (SeafDBRow *row, void *data)
+{
+    GList **ids = data;
+
+    *ids = g_list_prepend (*ids,
+                           g_strdup (seaf_db_row_get_column_text (row, 0)));
+    return TRUE;
+}
+
+int
+seaf_storage_class_manager_set_org_class (SeafStorageClassManager *mgr,
+                                          int org_id,
+                                          const char *class_name)
+{
+    GList *ids = NULL, *ptr;
+
+    if (seaf_block_manager_set_org_class (mgr->session->block_mgr,
+                                          org_id, class_name) < 0)
+        return -1;
+
+    if (seaf_db_statement_foreach_row (mgr->session->db,
+                                       "SELECT repo_id FROM OrgRepo "
+                                       "WHERE org_id=?",
+                                       collect_id, &ids,
+                                       1, "int", org_id) < 0) {
+        seaf_warning ("Failed to list repos of org %d.\n", org_id);
+        return -1;
+    }
+
+    for (ptr = ids; ptr; ptr = ptr->next)
+        seaf_storage_class_manager_migrate_repo (mgr, ptr->data);
+    string_list_free (ids);
+
+    return 0;
+}
+
+/* The root of the master branch. */
+static char *
+get_head_root (const char *repo_id)
+{
+    SeafBranch *branch;
+    SeafCommit *commit;
+    char *root_id;
+
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             repo_id, "master");
+    if (!branch)
+        return NULL;
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             branch->commit_id);
+    seaf_branch_unref (branch);
+    if (!commit)
+        return NULL;
+
+    root_id = g_strdup (commit->root_id);
+    seaf_commit_unref (commit);
+    return root_id;
+}
+
+static void
+migrate_repo (SeafStorageClassManager *mgr, const char *repo_id)
+{
+    SeafBlockManager *block_mgr = mgr->session->block_mgr;
+    char *root_id = NULL, *class_name = NULL;
+    BlockList *bl = NULL;
+    char block_id[41];
+    int i, n_failed = 0;
+
+    if (!seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id))
+        return;
+
+    root_id = get_head_root (repo_id);
+    if (!root_id) {
+        seaf_warning ("Failed to get head of repo %.8s.\n", repo_id);
+        goto out;
+    }
+
+    bl = block_list_new ();
+    if (seaf_fs_manager_populate_blocklist (seaf->fs_mgr, root_id, bl) < 0) {
+        seaf_warning ("Failed to list blocks of repo %.8s.\n", repo_id);
+        goto out;
+    }
+    block_list_sort (bl);
+
+    /* Looked up once, a class set during the move queues another run. */
+    class_name = seaf_block_manager_get_repo_class (block_mgr, repo_id);
+
+    for (i = 0; i < bl->n_blocks; ++i) {
+        block_list_get_id (bl, i, block_id);
+        if (seaf_block_manager_move_block (block_mgr, block_id,
+                                           class_name) < 0)
+            ++n_failed;
+    }
+
+    if (n_failed > 0)
+        seaf_warning ("Failed to move %d blocks of repo %.8s to %s.\n",
+                      n_failed, repo_id, class_name);
+    else
+        seaf_message ("Moved %u blocks of repo %.8s to %s.\n",
+                      bl->n_blocks, repo_id, class_name);
+
+out:
+    g_free (root_id);
+    g_free (class_name);
+    if (bl)
+        block_list_free (bl);
+}
+
+static void
+migrate_worker (gpointer vrepo_id, gpointer vmgr)
+{
+    SeafStorageClassManager *mgr = vmgr;
+    char *repo_id = vrepo_id;
+
+    pthread_mutex_lock (&mgr->priv->queue_lock);
+    g_hash_table_remove (mgr->priv->queued_repos, repo_id);
+    pthread_mutex_unlock (&mgr->priv->queue_lock);
+
+    migrate_repo (mgr, repo_id);
+
+    g_free (repo_id);
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef STORAGE_CLASS_MGR_H
+#define STORAGE_CLASS_MGR_H
+
+#include <glib.h>
+
+/*
+ * Storage classes of repos and orgs, see load_storage_classes() in
+ * block-backend.h for the configuration.
+ *
+ * Blocks uploaded to a repo are written to its class. When the class of
+ * a repo changes, the blocks of its head are moved to the new class in a
+ * background thread. Blocks only in the history of the repo, and blocks
+ * written through the fs manager, e.g. by web uploads, stay in the class
+ * they were written to until the repo's class is set again. They can
+ * always be read, blocks are looked up in all classes.
+ *
+ * Blocks are shared by repos, a block used by repos of different classes
+ * is in the class it was last moved to.
+ */
+
+struct _SeafileSession;
+struct _SeafStorageClassManagerPriv;
+
+struct _SeafStorageClassManager {
+    struct _SeafileSession *session;
+    struct _SeafStorageClassManagerPriv *priv;
+};
+typedef struct _SeafStorageClassManager SeafStorageClassManager;
+
+SeafStorageClassManager *
+seaf_storage_class_manager_new (struct _SeafileSession *session);
+
+int
+seaf_storage_class_manager_start (SeafStorageClassManager *mgr);
+
+/* Set the class of @repo_id and move its blocks there. */
+int
+seaf_storage_class_manager_set_repo_class (SeafStorageClassManager *mgr,
+                                           const char *repo_id,
+                                           const char *class_name);
+
+/* Set the class of @org_id and move the blocks of its repos there. */
+int
+seaf_storage_class_manager_set_org_class (SeafStorageClassManager *mgr,
+                                          int org_id,
+                                          const char *class_name);
+
+/* Move the head blocks of @repo_id to its class, in the background. */
+void
+seaf_storage_class_manager_migrate_repo (SeafStorageClassManager *mgr,
+                                         const char *repo_id);
+
+#endif
@@ -1,6 +1,9 @@
 #include <ccnet.h>
 
 #include "common.h"
+
+#include <pthread.h>
+
 #include "seafile-session.h"
 #include "utils.h"
 
@@ -16,9 +19,26 @@
 
 #define TOKEN_TIME_TO_EXPIRE 24 * 3600 /* a token is valid in 1 day. */
 
+/*
+ * Every processor of a sync session verifies the token, which asks ccnet
+ * to check the signature. Verified tokens are kept for a while.
+ */
+#define VERIFIED_TOKEN_TTL  300     /* 5 minutes */
+#define MAX_VERIFIED_TOKENS 10000
+
+typedef struct {
+    char    peer_id[41];
+    char    repo_id[37];
+    gint64  expire;
+} VerifiedToken;
+
 struct TokenManagerPriv {
     /* (master, client, repo) --> timestamp */
     GHashTable *token_hash;
+
+    /* token -> VerifiedToken */
+    GHashTable *verified;
+    pthread_mutex_t lock;
 };
 
 SeafTokenManager *
@@ -32,6 +52,9 @@ seaf_token_manager_new (struct _SeafileSession *session)
 
     /* mgr->priv->token_hash = g_hash_table_new_full (g_str_hash, g_str_equal, */
     /*                                                g_free, g_free); */
+    priv->verified = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+    pthread_mutex_init (&priv->lock, NULL);
 
     return mgr;
 }
@@ -58,6 +81,56 @@ seaf_token_manager_generate_token (SeafTokenManager *mgr,
     return g_string_free (token, FALSE);
 }
 
+static gboolean
+lookup_verified_token (SeafTokenManager *mgr,
+                       const char *peer_id,
+                       const char *token,
+                       char *ret_repo_id)
+{
+    struct TokenManagerPriv *priv = mgr->priv;
+    VerifiedToken *vt;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&priv->lock);
+    vt = g_hash_table_lookup (priv->verified, token);
+    if (vt && vt->expire > (gint64)time(NULL) &&
+        strcmp (vt->peer_id, peer_id) == 0) {
+        if (ret_repo_id != NULL)
+            memcpy (ret_repo_id, vt->repo_id, 37);
+        found = TRUE;
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return found;
+}
+
+static void
+add_verified_token (SeafTokenManager *mgr,
+                    const char *peer_id,
+                    const char *token,
+                    const char *repo_id,
+                    guint64 timestamp)
+{
+    struct TokenManagerPriv *priv = mgr->priv;
+    VerifiedToken *vt;
+    gint64 expire;
+
+    /* Not beyond the expiry of the token itself. */
+    expire = MIN ((gint64)time(NULL) + VERIFIED_TOKEN_TTL,
+                  (gint64)(timestamp + TOKEN_TIME_TO_EXPIRE));
+
+    vt = g_new0 (VerifiedToken, 1);
+    memcpy (vt->peer_id, peer_id, 40);
+    memcpy (vt->repo_id, repo_id, 36);
+    vt->expire = expire;
+
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_size (priv->verified) >= MAX_VERIFIED_TOKENS)
+        g_hash_table_remove_all (priv->verified);
+    g_hash_table_replace (priv->verified, g_strdup (token), vt);
+    pthread_mutex_unlock (&priv->lock);
+}
+
 int
 seaf_token_manager_verify_token (SeafTokenManager *mgr,
                                  const char *peer_id,
@@ -73,6 +146,9 @@ seaf_token_manager_verify_token (SeafTokenManager *mgr,
     if (token[0] == '\0')
         return -1;
 
+    if (lookup_verified_token (mgr, peer_id, token, ret_repo_id))
+        return 0;
+
     keys = g_strsplit (token, "\n", 5);
     if (g_strv_length(keys) != 5) {
         ret = -1;
@@ -125,6 +201,7 @@ seaf_token_manager_verify_token (SeafTokenManager *mgr,
     /* OK, the token is valid. */
     if (ret_repo_id != NULL)
         memcpy (ret_repo_id, repo_id, 37);
+    add_verified_token (mgr, peer_id, token, repo_id, timestamp);
 
 out:
     g_strfreev (keys);
@@ -2,6 +2,7 @@
 
 #include "common.h"
 
+#include <pthread.h>
 #include <ccnet/timer.h>
 
 #include "seafile-session.h"
@@ -9,10 +10,15 @@
 
 #include "utils.h"
 
-#define CLEANING_INTERVAL_MSEC 1000*300	/* 5 minutes */
 #define TOKEN_EXPIRE_TIME 3600	        /* 1 hour */
 #define TOKEN_LEN 8
 
+#define N_SHARDS 16
+
+/* Tokens expiring in the same minute share a wheel slot. */
+#define WHEEL_TICK 60
+#define WHEEL_SLOTS 64          /* > TOKEN_EXPIRE_TIME / WHEEL_TICK */
+
 /* #define DEBUG 1 */
 
 typedef struct {
@@ -28,156 +34,280 @@ typedef struct {
     long expire_time;
 } AccessToken;
 
+/* A token in the time wheel. */
+typedef struct {
+    char token[TOKEN_LEN + 1];
+    char *key;                  /* access info key */
+    long expire_time;
+} ExpireEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    GHashTable *tokens;         /* token -> access info */
+    GHashTable *infos;          /* access info key -> token */
+    GList *wheel[WHEEL_SLOTS];  /* expire entries of the tokens */
+} TokenShard;
+
+struct _SeafWebAccessTokenManagerPriv {
+    TokenShard shards[N_SHARDS];
+    long last_tick;             /* the last tick expired */
+};
+
+/* Tokens are sharded by token, infos by their key. */
+#define SHARD_OF(priv,s) (&(priv)->shards[g_str_hash(s) % N_SHARDS])
+
 SeafWebAccessTokenManager*
 seaf_web_at_manager_new (SeafileSession *seaf)
 {
     SeafWebAccessTokenManager *mgr = g_new0 (SeafWebAccessTokenManager, 1);
+    TokenShard *shard;
+    int i;
 
     mgr->seaf = seaf;
-    mgr->access_token_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                    g_free, g_free);
-    mgr->access_info_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                   g_free, g_free);
+    mgr->priv = g_new0 (SeafWebAccessTokenManagerPriv, 1);
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &mgr->priv->shards[i];
+        pthread_mutex_init (&shard->lock, NULL);
+        shard->tokens = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+        shard->infos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+    }
 
     return mgr;
 }
 
-static gboolean
-remove_expire_info (gpointer key, gpointer value, gpointer user_data)
+static void
+expire_entry_free (ExpireEntry *entry)
 {
-    AccessInfo *info = (AccessInfo *)value;
-    long now = *((long*)user_data);
+    g_free (entry->key);
+    g_free (entry);
+}
 
-    if (info && now >= info->expire_time) {
-        return TRUE;
-    }
+/* Drop the info -> token mapping if it still points to the expired token. */
+static void
+remove_expired_info (SeafWebAccessTokenManagerPriv *priv, ExpireEntry *entry)
+{
+    TokenShard *shard = SHARD_OF (priv, entry->key);
+    AccessToken *token;
 
-    return FALSE;
+    pthread_mutex_lock (&shard->lock);
+    token = g_hash_table_lookup (shard->infos, entry->key);
+    if (token && strcmp (token->token, entry->token) == 0)
+        g_hash_table_remove (shard->infos, entry->key);
+    pthread_mutex_unlock (&shard->lock);
 }
 
-static gboolean
-remove_expire_token (gpointer key, gpointer value, gpointer user_data)
+static void
+expire_slot (SeafWebAccessTokenManagerPriv *priv, int slot, long now)
 {
-    AccessToken *token = (AccessToken *)value;
-    long now = *((long*)user_data);
-
-    if (token && now >= token->expire_time) {
-        return TRUE;
+    TokenShard *shard;
+    GList *expired = NULL, *kept = NULL, *ptr;
+    ExpireEntry *entry;
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &priv->shards[i];
+
+        pthread_mutex_lock (&shard->lock);
+        for (ptr = shard->wheel[slot]; ptr; ptr = ptr->next) {
+            entry = ptr->data;
+            /* Entries of a later round of the wheel. */
+            if (entry->expire_time > now) {
+                kept = g_list_prepend (kept, entry);
+                continue;
+            }
+            g_hash_table_remove (shard->tokens, entry->token);
+            expired = g_list_prepend (expired, entry);
+        }
+        g_list_free (shard->wheel[slot]);
+        shard->wheel[slot] = kept;
+        kept = NULL;
+        pthread_mutex_unlock (&shard->lock);
     }
 
-    return FALSE;
+    for (ptr = expired; ptr; ptr = ptr->next) {
+        entry = ptr->data;
+        remove_expired_info (priv, entry);
+        expire_entry_free (entry);
+    }
+    g_list_free (expired);
 }
 
 static int
 clean_pulse (void *vmanager)
 {
     SeafWebAccessTokenManager *manager = vmanager;
+    SeafWebAccessTokenManagerPriv *priv = manager->priv;
     long now = (long)time(NULL);
+    /* The slots of the finished ticks. */
+    long tick = now / WHEEL_TICK - 1;
+    long t;
+
+    /* After a long pause every slot is visited once. */
+    if (tick - priv->last_tick > WHEEL_SLOTS)
+        priv->last_tick = tick - WHEEL_SLOTS;
+
+    for (t = priv->last_tick + 1; t <= tick; ++t)
+        expire_slot (priv, t % WHEEL_SLOTS, now);
+    priv->last_tick = tick;
 
-    g_hash_table_foreach_remove (manager->access_token_hash,
-                                 remove_expire_info, &now);
-    g_hash_table_foreach_remove (manager->access_info_hash,
-                                 remove_expire_token, &now);
-    
     return TRUE;
 }
 
 int
 seaf_web_at_manager_start (SeafWebAccessTokenManager *mgr)
 {
-    ccnet_timer_new (clean_pulse, mgr, CLEANING_INTERVAL_MSEC);
+    mgr->priv->last_tick = (long)time(NULL) / WHEEL_TICK - 1;
+    ccnet_timer_new (clean_pulse, mgr, WHEEL_TICK * 1000);
 
     return 0;
 }
 
-static char *
-gen_new_token (GHashTable *token_hash)
+/*
+ * Generate a token that doesn't conflict with an existing one, and add it
+ * for @info.
+ */
+static void
+add_new_token (SeafWebAccessTokenManagerPriv *priv, AccessInfo *info,
+               const char *key, char *token)
 {
     char uuid[37];
-    char *token;
+    TokenShard *shard;
+    ExpireEntry *entry;
+    int slot = (info->expire_time / WHEEL_TICK) % WHEEL_SLOTS;
 
     while (1) {
         gen_uuid_inplace (uuid);
-        token = g_strndup(uuid, TOKEN_LEN);
+        memcpy (token, uuid, TOKEN_LEN);
+        token[TOKEN_LEN] = '\0';
 
-        /* Make sure the new token doesn't conflict with an existing one. */
-        if (g_hash_table_lookup (token_hash, token) != NULL)
-            g_free (token);
-        else
-            return token;
+        shard = SHARD_OF (priv, token);
+
+        pthread_mutex_lock (&shard->lock);
+        if (g_hash_table_lookup (shard->tokens, token) != NULL) {
+            pthread_mutex_unlock (&shard->lock);
+            continue;
+        }
+
+        g_hash_table_insert (shard->tokens, g_strdup(token), info);
+
+        entry = g_new0 (ExpireEntry, 1);
+        memcpy (entry->token, token, TOKEN_LEN + 1);
+        entry->key = g_strdup (key);
+        entry->expire_time = info->expire_time;
+        shard->wheel[slot] = g_list_prepend (shard->wheel[slot], entry);
+        pthread_mutex_unlock (&shard->lock);
+
+        return;
     }
 }
 
-char *
-seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
-                                      const char *repo_id,
-                                      const char *obj_id,
-                                      const char *op,
-                                      const char *username)
+static char *
+get_access_token (SeafWebAccessTokenManagerPriv *priv,
+                  const char *repo_id,
+                  const char *obj_id,
+                  const char *op,
+                  const char *username,
+                  long now)
 {
-    GString *key = g_string_new (NULL);
+    char *key;
+    TokenShard *shard;
     AccessToken *token;
     AccessInfo *info;
-    long now = (long)time(NULL);
-    long expire;
-    char *t;
+    char t[TOKEN_LEN + 1];
 
-    g_string_printf (key, "%s %s %s %s", repo_id, obj_id, op, username);
+    key = g_strdup_printf ("%s %s %s %s", repo_id, obj_id, op, username);
+    shard = SHARD_OF (priv, key);
 
-    token = g_hash_table_lookup (mgr->access_info_hash, key->str);
     /* To avoid returning an almost expired token, we returns token
      * that has at least 1 minute "life time".
      */
-    if (!token || token->expire_time - now <= 60) {
-        t = gen_new_token (mgr->access_token_hash);
-        expire = now + TOKEN_EXPIRE_TIME;
+    pthread_mutex_lock (&shard->lock);
+    token = g_hash_table_lookup (shard->infos, key);
+    if (token && token->expire_time - now > 60) {
+        memcpy (t, token->token, TOKEN_LEN + 1);
+        pthread_mutex_unlock (&shard->lock);
+        g_free (key);
+        return g_strdup (t);
+    }
+    pthread_mutex_unlock (&shard->lock);
 
-        token = g_new0 (AccessToken, 1);
-        memcpy (token->token, t, TOKEN_LEN);
-        token->expire_time = expire;
+    info = g_new0 (AccessInfo, 1);
+    g_strlcpy (info->repo_id, repo_id, sizeof(info->repo_id));
+    g_strlcpy (info->obj_id, obj_id, sizeof(info->obj_id));
+    g_strlcpy (info->op, op, sizeof(info->op));
+    g_strlcpy (info->username, username, sizeof(info->username));
+    info->expire_time = now + TOKEN_EXPIRE_TIME;
 
-        g_hash_table_insert (mgr->access_info_hash, g_strdup(key->str), token);
+    add_new_token (priv, info, key, t);
 
-        info = g_new0 (AccessInfo, 1);
-        memcpy (info->repo_id, repo_id, 36);
-        memcpy (info->obj_id, obj_id, 40);
-        memcpy (info->op, op, 32);
-        memcpy (info->username, username, 255);
-        info->expire_time = expire;
+    /* If another thread issued a token for the same info meanwhile, both
+     * tokens are valid. */
+    token = g_new0 (AccessToken, 1);
+    memcpy (token->token, t, TOKEN_LEN + 1);
+    token->expire_time = info->expire_time;
 
-        g_hash_table_insert (mgr->access_token_hash, g_strdup(t), info);
+    pthread_mutex_lock (&shard->lock);
+    g_hash_table_replace (shard->infos, key, token);
+    pthread_mutex_unlock (&shard->lock);
 
-        g_free (t);
-    }
+    return g_strdup (t);
+}
 
-    g_string_free (key, TRUE);
-    return g_strdup(token->token);
+char *
+seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
+                                      const char *repo_id,
+                                      const char *obj_id,
+                                      const char *op,
+                                      const char *username)
+{
+    return get_access_token (mgr->priv, repo_id, obj_id, op, username,
+                             (long)time(NULL));
+}
+
+GList *
+seaf_web_at_manager_get_access_tokens (SeafWebAccessTokenManager *mgr,
+                                       const char *repo_id,
+                                       GList *obj_ids,
+                                       const char *op,
+                                       const char *username)
+{
+    GList *tokens = NULL, *ptr;
+    long now = (long)time(NULL);
+
+    for (ptr = obj_ids; ptr; ptr = ptr->next)
+        tokens = g_list_prepend (tokens,
+                                 get_access_token (mgr->priv, repo_id,
+                                                   ptr->data, op, username,
+                                                   now));
+
+    return g_list_reverse (tokens);
 }
 
 SeafileWebAccess *
 seaf_web_at_manager_query_access_token (SeafWebAccessTokenManager *mgr,
                                         const char *token)
 {
-    SeafileWebAccess *webaccess;
+    SeafileWebAccess *webaccess = NULL;
+    TokenShard *shard = SHARD_OF (mgr->priv, token);
     AccessInfo *info;
+    long now = (long)time(NULL);
 
-    info = g_hash_table_lookup (mgr->access_token_hash, token);
-    if (info != NULL) {
-        long expire_time = info->expire_time;
-        long now = (long)time(NULL);        
-
-        if (now - expire_time >= 0) {
-            return NULL;
-        } else {
-            webaccess = g_object_new (SEAFILE_TYPE_WEB_ACCESS,
-                                      "repo_id", info->repo_id,
-                                      "obj_id", info->obj_id,
-                                      "op", info->op,
-                                      "username", info->username,
-                                      NULL);
-            return webaccess;
-        }
+    pthread_mutex_lock (&shard->lock);
+
+    info = g_hash_table_lookup (shard->tokens, token);
+    if (info != NULL && now < info->expire_time) {
+        webaccess = g_object_new (SEAFILE_TYPE_WEB_ACCESS,
+                                  "repo_id", info->repo_id,
+                                  "obj_id", info->obj_id,
+                                  "op", info->op,
+                                  "username", info->username,
+                                  NULL);
     }
 
-    return NULL;
+    pthread_mutex_unlock (&shard->lock);
+
+    return webaccess;
 }
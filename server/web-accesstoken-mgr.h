@@ -7,10 +7,17 @@
 
 struct _SeafileSession;
 
+typedef struct _SeafWebAccessTokenManagerPriv SeafWebAccessTokenManagerPriv;
+
+/*
+ * Tokens live in a fixed number of shards, each with its own lock, so
+ * that issuing and querying tokens can run in rpc worker threads without
+ * serializing on one table. Expired tokens are dropped from a time wheel,
+ * one slot per minute, instead of sweeping all the tokens.
+ */
 struct _SeafWebAccessTokenManager {
     struct _SeafileSession	*seaf;
-    GHashTable		*access_token_hash; /* token -> access info */
-    GHashTable      *access_info_hash;  /* access info -> token */
+    SeafWebAccessTokenManagerPriv *priv;
 };
 typedef struct _SeafWebAccessTokenManager SeafWebAccessTokenManager;
 
@@ -30,6 +37,17 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
                                       const char *op,
                                       const char *username);
 
+/*
+ * Returns the access tokens for @obj_ids of the same repo, in the same
+ * order. The returned list and the tokens should be freed by the caller.
+ */
+GList *
+seaf_web_at_manager_get_access_tokens (SeafWebAccessTokenManager *mgr,
+                                       const char *repo_id,
+                                       GList *obj_ids,
+                                       const char *op,
+                                       const char *username);
+
 /*
  * Returns access info for the given token.
  */
@@ -38,4 +56,3 @@ seaf_web_at_manager_query_access_token (SeafWebAccessTokenManager *mgr,
                                         const char *token);
 
 #endif /* WEB_ACCESSTOKEN_MGR_H */
-
@@ -0,0 +1,510 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Benchmark for the chunker and the block hashing done when indexing.
+ *
+ * For each synthetic corpus, a base version and a modified version of a
+ * file are generated and chunked. The "index" mode hashes every chunk
+ * the way seaf_fs_manager_index_blocks() does, optionally through the
+ * pipelined chunker, but keeps the blocks in memory instead of writing
+ * them to a block backend, so that no seafile session is needed.
+ *
+ * Run "bench-cdc -h" for the options. With -j every result is printed
+ * as one JSON object per line.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "cdc/cdc.h"
+#include "cdc/seaf-sha1.h"
+
+#define MiB (1024 * 1024)
+
+#define HIST_BUCKETS 16
+
+/* Allocation counting, only with glibc where malloc can be wrapped. */
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static volatile gint n_allocs = 0;
+
+void *malloc (size_t size)
+{
+    g_atomic_int_inc (&n_allocs);
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+    g_atomic_int_inc (&n_allocs);
+    return __libc_calloc (n, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    g_atomic_int_inc (&n_allocs);
+    return __libc_realloc (ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#endif
+
+typedef struct BenchStats {
+    GHashTable *blocks;         /* block id -> size, for dedup */
+    pthread_mutex_t lock;
+    guint64 total_bytes;
+    guint64 unique_bytes;
+    guint32 n_chunks;
+    guint32 hist[HIST_BUCKETS];
+    uint32_t min_sz;
+    uint32_t max_sz;
+} BenchStats;
+
+static BenchStats stats;
+static gboolean hash_only = FALSE;
+
+static guint
+block_id_hash (gconstpointer key)
+{
+    guint h;
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+block_id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, CHECKSUM_LENGTH) == 0;
+}
+
+static void
+record_block (const uint8_t *checksum, uint32_t len)
+{
+    int bucket;
+
+    pthread_mutex_lock (&stats.lock);
+
+    stats.total_bytes += len;
+    stats.n_chunks++;
+
+    if (len > stats.min_sz)
+        bucket = (guint64)(len - stats.min_sz) * HIST_BUCKETS /
+            (stats.max_sz - stats.min_sz + 1);
+    else
+        bucket = 0;
+    stats.hist[bucket]++;
+
+    if (!checksum)
+        stats.unique_bytes += len;
+    else if (!g_hash_table_lookup (stats.blocks, checksum)) {
+        g_hash_table_insert (stats.blocks,
+                             g_memdup (checksum, CHECKSUM_LENGTH),
+                             GUINT_TO_POINTER(len));
+        stats.unique_bytes += len;
+    }
+
+    pthread_mutex_unlock (&stats.lock);
+}
+
+/* Serial path, like seafile_write_chunk(). */
+static int
+bench_write_chunk (CDCDescriptor *chunk_descr,
+                   struct SeafileCrypt *crypt,
+                   uint8_t *checksum,
+                   gboolean write_data)
+{
+    /* Boundaries only: no block ids, hence no dedup either. */
+    if (hash_only) {
+        memset (checksum, 0, CHECKSUM_LENGTH);
+        record_block (NULL, chunk_descr->len);
+        return 0;
+    }
+
+    seaf_sha1 (chunk_descr->block_buf, chunk_descr->len, checksum);
+    record_block (checksum, chunk_descr->len);
+    return 0;
+}
+
+/* Pipelined path. */
+static int
+bench_hash_chunk (CDCDescriptor *chunk_descr,
+                  struct SeafileCrypt *crypt,
+                  uint8_t *checksum,
+                  char **out_buf,
+                  int *out_len)
+{
+    *out_buf = NULL;
+    *out_len = 0;
+    seaf_sha1 (chunk_descr->block_buf, chunk_descr->len, checksum);
+    return 0;
+}
+
+static int
+bench_store_chunk (uint8_t *checksum, const char *buf, int len)
+{
+    record_block (checksum, len);
+    return 0;
+}
+
+/* Corpus generation */
+
+static guint32 rand_state = 1;
+
+static inline guint32
+next_rand ()
+{
+    /* xorshift32, reproducible across platforms. */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void
+fill_random (char *buf, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i)
+        buf[i] = next_rand () & 0xff;
+}
+
+/* Text-like data from a small vocabulary; compresses well. */
+static void
+fill_compressible (char *buf, size_t len)
+{
+    static const char *words[] = {
+        "seafile ", "block ", "commit ", "the ", "of ", "repo ", "data ",
+        "sync ", "file ", "and ", "to ", "index ", "\n", "chunk ", "a ",
+    };
+    size_t i = 0, n;
+    const char *w;
+
+    while (i < len) {
+        w = words[next_rand () % G_N_ELEMENTS(words)];
+        n = strlen (w);
+        if (n > len - i)
+            n = len - i;
+        memcpy (buf + i, w, n);
+        i += n;
+    }
+}
+
+static void
+fill_log (char *buf, size_t len)
+{
+    size_t i = 0;
+    int n;
+    char line[128];
+    guint32 seq = 0;
+
+    while (i < len) {
+        n = snprintf (line, sizeof(line),
+                      "2012-01-01 00:00:%02u [%08u] request %08x took %u ms\n",
+                      seq % 60, seq, next_rand (), next_rand () % 1000);
+        ++seq;
+        if ((size_t)n > len - i)
+            n = len - i;
+        memcpy (buf + i, line, n);
+        i += n;
+    }
+}
+
+typedef struct Corpus {
+    const char *name;
+    /* Generates base and modified version, returns the modified size. */
+    size_t (*generate) (char *base, size_t size, char *modified);
+} Corpus;
+
+static size_t
+gen_random (char *base, size_t size, char *modified)
+{
+    fill_random (base, size);
+    memcpy (modified, base, size);
+    /* Overwrite 4KB in the middle. */
+    fill_random (modified + size / 2, 4096);
+    return size;
+}
+
+static size_t
+gen_compressible (char *base, size_t size, char *modified)
+{
+    fill_compressible (base, size);
+    memcpy (modified, base, size);
+    fill_compressible (modified + size / 3, 4096);
+    return size;
+}
+
+static size_t
+gen_append_log (char *base, size_t size, char *modified)
+{
+    size_t extra = size / 16;
+
+    fill_log (base, size);
+    memcpy (modified, base, size);
+    fill_log (modified + size, extra);
+    return size + extra;
+}
+
+static size_t
+gen_shifted_insert (char *base, size_t size, char *modified)
+{
+    size_t pos = size / 2, ins = 1000;
+
+    fill_random (base, size);
+    memcpy (modified, base, pos);
+    fill_random (modified + pos, ins);
+    memcpy (modified + pos + ins, base + pos, size - pos);
+    return size + ins;
+}
+
+static Corpus corpora[] = {
+    { "random", gen_random },
+    { "compressible", gen_compressible },
+    { "append-log", gen_append_log },
+    { "shifted-insert", gen_shifted_insert },
+};
+
+static int
+write_file (const char *path, const char *buf, size_t len)
+{
+    GError *error = NULL;
+
+    if (!g_file_set_contents (path, buf, len, &error)) {
+        fprintf (stderr, "Failed to write %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+chunk_file (const char *path, int algo, int n_workers, double *elapsed)
+{
+    CDCFileDescriptor cdc;
+    GTimer *timer;
+    int fd, ret;
+
+    memset (&cdc, 0, sizeof(cdc));
+    /* Same sizes as calculate_chunk_size() for files under 2GB. */
+    cdc.block_sz = MiB;
+    cdc.block_min_sz = cdc.block_sz >> 2;
+    cdc.block_max_sz = cdc.block_sz << 2;
+    cdc.algo = algo;
+    cdc.write_block = bench_write_chunk;
+    cdc.map_file = TRUE;
+    if (n_workers > 1 && !hash_only) {
+        cdc.n_workers = n_workers;
+        cdc.hash_block = bench_hash_chunk;
+        cdc.store_block = bench_store_chunk;
+    }
+
+    stats.min_sz = cdc.block_min_sz;
+    stats.max_sz = cdc.block_max_sz;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        fprintf (stderr, "Failed to open %s.\n", path);
+        return -1;
+    }
+
+    timer = g_timer_new ();
+    ret = file_chunk_cdc (fd, &cdc, NULL, TRUE);
+    *elapsed += g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+    close (fd);
+
+    free (cdc.blk_sha1s);
+    free (cdc.blk_sizes);
+    return ret;
+}
+
+static void
+print_result (const char *corpus, int algo, int n_workers,
+              gboolean json, double elapsed, int allocs)
+{
+    double mbps = stats.total_bytes / (double)MiB / elapsed;
+    double dedup = stats.unique_bytes ?
+        (double)stats.total_bytes / stats.unique_bytes : 0;
+    double allocs_per_chunk = stats.n_chunks ?
+        (double)allocs / stats.n_chunks : 0;
+    guint64 avg = stats.n_chunks ? stats.total_bytes / stats.n_chunks : 0;
+    int i;
+
+    if (json) {
+        printf ("{\"corpus\": \"%s\", \"algo\": \"%s\", \"mode\": \"%s\", "
+                "\"workers\": %d, \"bytes\": %" G_GUINT64_FORMAT ", "
+                "\"seconds\": %.4f, \"mb_per_sec\": %.1f, \"chunks\": %u, "
+                "\"avg_chunk\": %" G_GUINT64_FORMAT ", "
+                "\"dedup_ratio\": %.4f, ",
+                corpus, cdc_algo_to_name (algo),
+                hash_only ? "chunk" : "index", n_workers,
+                stats.total_bytes, elapsed, mbps, stats.n_chunks, avg, dedup);
+        if (allocs >= 0)
+            printf ("\"allocs_per_chunk\": %.2f, ", allocs_per_chunk);
+        printf ("\"histogram_min\": %u, \"histogram_max\": %u, "
+                "\"histogram\": [", stats.min_sz, stats.max_sz);
+        for (i = 0; i < HIST_BUCKETS; ++i)
+            printf ("%s%u", i ? ", " : "", stats.hist[i]);
+        printf ("]}\n");
+        return;
+    }
+
+    printf ("%-15s %-6s %-6s workers %d: %7.1f MB/s, %5u chunks, "
+            "avg %7" G_GUINT64_FORMAT ", dedup %.3f",
+            corpus, cdc_algo_to_name (algo), hash_only ? "chunk" : "index",
+            n_workers, mbps, stats.n_chunks, avg, dedup);
+    if (allocs >= 0)
+        printf (", %.2f allocs/chunk", allocs_per_chunk);
+    printf ("\n  sizes %u..%u:", stats.min_sz, stats.max_sz);
+    for (i = 0; i < HIST_BUCKETS; ++i)
+        printf (" %u", stats.hist[i]);
+    printf ("\n");
+}
+
+static int
+run_corpus (Corpus *corpus, const char *dir, size_t size,
+            int algo, int n_workers, gboolean json)
+{
+    char *base, *modified;
+    char *base_path, *mod_path;
+    size_t mod_size;
+    double elapsed = 0;
+    int allocs = -1;
+    int ret = 0;
+
+    base = g_malloc (size);
+    modified = g_malloc (size + size / 16 + 4096);
+    rand_state = 1;
+    mod_size = corpus->generate (base, size, modified);
+
+    base_path = g_build_filename (dir, "base", NULL);
+    mod_path = g_build_filename (dir, "modified", NULL);
+    if (write_file (base_path, base, size) < 0 ||
+        write_file (mod_path, modified, mod_size) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    memset (stats.hist, 0, sizeof(stats.hist));
+    stats.total_bytes = stats.unique_bytes = 0;
+    stats.n_chunks = 0;
+    stats.blocks = g_hash_table_new_full (block_id_hash, block_id_equal,
+                                          g_free, NULL);
+
+#ifdef HAVE_ALLOC_COUNT
+    n_allocs = 0;
+#endif
+    if (chunk_file (base_path, algo, n_workers, &elapsed) < 0 ||
+        chunk_file (mod_path, algo, n_workers, &elapsed) < 0) {
+        fprintf (stderr, "Failed to chunk %s corpus.\n", corpus->name);
+        ret = -1;
+    } else {
+#ifdef HAVE_ALLOC_COUNT
+        /* Not counting the entries added to our own hash table. */
+        allocs = g_atomic_int_get (&n_allocs) -
+            (int)g_hash_table_size (stats.blocks);
+#endif
+        print_result (corpus->name, algo, n_workers, json, elapsed, allocs);
+    }
+
+    g_hash_table_destroy (stats.blocks);
+
+out:
+    g_unlink (base_path);
+    g_unlink (mod_path);
+    g_free (base_path);
+    g_free (mod_path);
+    g_free (base);
+    g_free (modified);
+    return ret;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-a rabin|gear] [-s size_mb] [-w workers] "
+             "[-c corpus] [-d tmpdir] [-n] [-j]\n"
+             "  -n  only find chunk boundaries, don't hash chunks\n"
+             "  -j  print results as JSON, one object per line\n"
+             "corpora: random, compressible, append-log, shifted-insert\n",
+             prog);
+}
+
+int main (int argc, char *argv[])
+{
+    const char *algo_name = NULL, *corpus_name = NULL;
+    const char *tmp_dir = g_get_tmp_dir ();
+    char *dir;
+    int size_mb = 64, n_workers = 1;
+    gboolean json = FALSE;
+    int algo, c, i, ret = 0;
+
+    while ((c = getopt (argc, argv, "a:s:w:c:d:njh")) != -1) {
+        switch (c) {
+        case 'a':
+            algo_name = optarg;
+            break;
+        case 's':
+            size_mb = atoi (optarg);
+            break;
+        case 'w':
+            n_workers = atoi (optarg);
+            break;
+        case 'c':
+            corpus_name = optarg;
+            break;
+        case 'd':
+            tmp_dir = optarg;
+            break;
+        case 'n':
+            hash_only = TRUE;
+            break;
+        case 'j':
+            json = TRUE;
+            break;
+        default:
+            usage (argv[0]);
+            exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    algo = cdc_algo_from_name (algo_name);
+    if (algo < 0 || size_mb <= 0) {
+        usage (argv[0]);
+        exit (1);
+    }
+
+    g_thread_init (NULL);
+    pthread_mutex_init (&stats.lock, NULL);
+
+    dir = g_build_filename (tmp_dir, "bench-cdc-XXXXXX", NULL);
+    if (!mkdtemp (dir)) {
+        fprintf (stderr, "Failed to create temp dir in %s.\n", tmp_dir);
+        exit (1);
+    }
+
+    if (!json)
+        printf ("SHA-1: %s\n", seaf_sha1_impl_name ());
+
+    for (i = 0; i < G_N_ELEMENTS(corpora); ++i) {
+        if (corpus_name && strcmp (corpus_name, corpora[i].name) != 0)
+            continue;
+        if (run_corpus (&corpora[i], dir, (size_t)size_mb * MiB,
+                        algo, n_workers, json) < 0)
+            ret = 1;
+    }
+
+    g_rmdir (dir);
+    g_free (dir);
+    return ret;
+}
@@ -0,0 +1,574 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Benchmark for the fs manager and the object store.
+ *
+ * A synthetic tree of the given depth and fan-out is written into a
+ * fresh seafile data dir for each object backend, then the tree
+ * operations used by the server are timed on it: path lookups,
+ * traversal, size calculation and block list population. The dir
+ * object codec is timed on its own, without a backend.
+ *
+ * Every file has unique content of the given size, so each file has one
+ * block, written to the fs block backend.
+ *
+ * Tree operations are run once on the newly written tree ("first"), then
+ * repeated, when the fs manager's caches are warm ("mean" of the
+ * repeats). The riak backend is only run with -r and a running server.
+ *
+ * Run "bench-fs -h" for the options. With -j every result is printed as
+ * one JSON object per line.
+ */
+
+#include "common.h"
+
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "seafile-session.h"
+#include "fs-mgr.h"
+#include "block-mgr.h"
+
+SeafileSession *seaf;
+
+typedef struct BenchOptions {
+    int depth;
+    int fanout;
+    int n_files;                /* per dir */
+    int file_size;
+    int iterations;
+    int n_workers;              /* for the parallel traversal */
+    gboolean json;
+} BenchOptions;
+
+static BenchOptions opts = { 3, 8, 16, 1024, 10, 1, FALSE };
+
+typedef struct TreeStats {
+    int n_dirs;
+    int n_files;
+    gint64 bytes;
+} TreeStats;
+
+static guint32 rand_state = 1;
+
+static inline guint32
+next_rand ()
+{
+    /* xorshift32, as in bench-cdc. */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void
+print_result (const char *backend, const char *bench,
+              int n_objects, double first, double total, int runs)
+{
+    double mean = runs > 0 ? total / runs : 0;
+    double ops = mean > 0 ? n_objects / mean : 0;
+
+    if (opts.json) {
+        printf ("{\"backend\": \"%s\", \"bench\": \"%s\", \"depth\": %d, "
+                "\"fanout\": %d, \"files_per_dir\": %d, "
+                "\"objects\": %d, \"first_sec\": %.6f, \"mean_sec\": %.6f, "
+                "\"runs\": %d, \"objects_per_sec\": %.1f}\n",
+                backend, bench, opts.depth, opts.fanout, opts.n_files,
+                n_objects, first, mean, runs, ops);
+        return;
+    }
+
+    printf ("%-8s %-22s %8d objs: first %9.6fs, mean %9.6fs, %10.1f objs/s\n",
+            backend, bench, n_objects, first, mean, ops);
+}
+
+/* Dir object codec */
+
+static SeafDir *
+make_dir (int n_entries)
+{
+    GList *entries = NULL;
+    char name[64], id[41];
+    int i, j;
+
+    /* Entries of a dir are sorted by name in descending order. */
+    for (i = 0; i < n_entries; ++i) {
+        snprintf (name, sizeof(name), "entry-%08d.txt", i);
+        for (j = 0; j < 40; ++j)
+            id[j] = "0123456789abcdef"[next_rand () & 0xf];
+        id[40] = '\0';
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (id, S_IFREG | 0644, name));
+    }
+
+    return seaf_dir_new (NULL, entries, 0);
+}
+
+static void
+bench_dir_codec (int n_entries)
+{
+    SeafDir *dir, *parsed;
+    GTimer *timer;
+    void *data;
+    double to_data, from_data;
+    int len, i, n;
+
+    /* Keep the total work about the same for any number of entries. */
+    n = MAX (opts.iterations * 100000 / MAX (n_entries, 1), 1);
+    dir = make_dir (n_entries);
+
+    timer = g_timer_new ();
+    for (i = 0; i < n; ++i) {
+        data = seaf_dir_to_data (dir, &len);
+        g_free (data);
+    }
+    to_data = g_timer_elapsed (timer, NULL);
+
+    data = seaf_dir_to_data (dir, &len);
+    g_timer_start (timer);
+    for (i = 0; i < n; ++i) {
+        parsed = seaf_dir_from_data (dir->dir_id, data, len);
+        if (!parsed) {
+            fprintf (stderr, "Failed to parse dir of %d entries.\n",
+                     n_entries);
+            break;
+        }
+        seaf_dir_free (parsed);
+    }
+    from_data = g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    if (opts.json) {
+        printf ("{\"bench\": \"dir-codec\", \"entries\": %d, \"bytes\": %d, "
+                "\"runs\": %d, \"to_data_ns\": %.1f, \"from_data_ns\": %.1f}\n",
+                n_entries, len, n, to_data * 1e9 / n, from_data * 1e9 / n);
+    } else {
+        printf ("dir-codec %6d entries, %8d bytes: to_data %10.1f ns, "
+                "from_data %10.1f ns\n",
+                n_entries, len, to_data * 1e9 / n, from_data * 1e9 / n);
+    }
+
+    g_free (data);
+    seaf_dir_free (dir);
+}
+
+/* Tree generation */
+
+static int
+write_file (SeafFSManager *mgr, const char *path, char *buf, char *file_id)
+{
+    SeafIndexStream *is;
+    unsigned char sha1[20];
+    int i, n, ret = -1;
+
+    /* The path makes the content unique, the rest is random. */
+    n = MIN ((int)strlen(path), opts.file_size);
+    memcpy (buf, path, n);
+    for (i = n; i < opts.file_size; ++i)
+        buf[i] = next_rand () & 0xff;
+
+    is = seaf_fs_manager_index_stream_new (mgr, path, opts.file_size,
+                                           NULL, CDC_ALGO_RABIN);
+    if (!is)
+        return -1;
+
+    if (seaf_fs_manager_index_stream_feed (is, buf, opts.file_size) < 0 ||
+        seaf_fs_manager_index_stream_finish (is, sha1) < 0)
+        goto out;
+
+    rawdata_to_hex (sha1, file_id, 20);
+    ret = 0;
+
+out:
+    seaf_fs_manager_index_stream_free (is);
+    return ret;
+}
+
+static int
+build_dir (SeafFSManager *mgr, const char *path, int depth,
+           char *buf, char *dir_id, TreeStats *stats)
+{
+    GList *entries = NULL;
+    SeafDir *dir;
+    char name[64], id[41];
+    char *sub;
+    int i, ret;
+
+    /* Names are built in ascending order, "d-" before "f-", and
+     * prepended, so the entries end up in descending order. */
+    for (i = 0; depth > 0 && i < opts.fanout; ++i) {
+        snprintf (name, sizeof(name), "d-%04d", i);
+        sub = g_strconcat (path, "/", name, NULL);
+        ret = build_dir (mgr, sub, depth - 1, buf, id, stats);
+        g_free (sub);
+        if (ret < 0)
+            goto error;
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (id, S_IFDIR, name));
+    }
+
+    for (i = 0; i < opts.n_files; ++i) {
+        snprintf (name, sizeof(name), "f-%06d", i);
+        sub = g_strconcat (path, "/", name, NULL);
+        ret = write_file (mgr, sub, buf, id);
+        g_free (sub);
+        if (ret < 0)
+            goto error;
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (id, S_IFREG | 0644, name));
+        ++stats->n_files;
+        stats->bytes += opts.file_size;
+    }
+
+    dir = seaf_dir_new (NULL, entries, 0);
+    ret = seaf_dir_save (mgr, dir);
+    memcpy (dir_id, dir->dir_id, 41);
+    seaf_dir_free (dir);
+    if (ret < 0)
+        return -1;
+
+    ++stats->n_dirs;
+    return 0;
+
+error:
+    g_list_foreach (entries, (GFunc)g_free, NULL);
+    g_list_free (entries);
+    return -1;
+}
+
+/* Session setup */
+
+static GKeyFile *
+make_config (const char *backend, const char *dir, const char *riak)
+{
+    GKeyFile *config = g_key_file_new ();
+    const char *group = "fs_object_backend";
+    char **riak_parts;
+    char *path;
+
+    if (strcmp (backend, "fs") == 0) {
+        path = g_build_filename (dir, "fs", NULL);
+        g_key_file_set_string (config, group, "name", "filesystem");
+        g_key_file_set_string (config, group, "object_dir", path);
+        g_free (path);
+    } else if (strcmp (backend, "pack") == 0) {
+        path = g_build_filename (dir, "fs-packs", NULL);
+        g_key_file_set_string (config, group, "name", "pack");
+        g_key_file_set_string (config, group, "pack_dir", path);
+        g_free (path);
+    } else {
+        /* host:port:bucket */
+        riak_parts = g_strsplit (riak, ":", 3);
+        if (g_strv_length (riak_parts) != 3) {
+            fprintf (stderr, "Riak server must be host:port:bucket.\n");
+            g_strfreev (riak_parts);
+            g_key_file_free (config);
+            return NULL;
+        }
+        g_key_file_set_string (config, group, "name", "riak");
+        g_key_file_set_string (config, group, "host", riak_parts[0]);
+        g_key_file_set_string (config, group, "port", riak_parts[1]);
+        g_key_file_set_string (config, group, "bucket", riak_parts[2]);
+        g_key_file_set_string (config, group, "write_policy", "quorum");
+        g_strfreev (riak_parts);
+    }
+
+    return config;
+}
+
+static SeafileSession *
+create_session (const char *backend, const char *dir, const char *riak)
+{
+    SeafileSession *session;
+
+    session = g_new0 (SeafileSession, 1);
+    session->seaf_dir = g_strdup (dir);
+    session->tmp_file_dir = g_build_filename (dir, "tmpfiles", NULL);
+    if (g_mkdir (session->tmp_file_dir, 0700) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", session->tmp_file_dir);
+        return NULL;
+    }
+
+    session->config = make_config (backend, dir, riak);
+    if (!session->config)
+        return NULL;
+
+    /* The managers look up the session through the global. */
+    seaf = session;
+
+    session->fs_mgr = seaf_fs_manager_new (session, dir);
+    session->block_mgr = seaf_block_manager_new (session, dir);
+    if (!session->fs_mgr || !session->block_mgr ||
+        seaf_fs_manager_init (session->fs_mgr) < 0 ||
+        seaf_block_manager_init (session->block_mgr) < 0) {
+        fprintf (stderr, "Failed to init %s backend.\n", backend);
+        return NULL;
+    }
+
+    return session;
+}
+
+/* Tree operations */
+
+static gboolean
+count_object (SeafFSManager *mgr, const char *obj_id, int type,
+              void *user_data, gboolean *stop)
+{
+    g_atomic_int_inc ((gint *)user_data);
+    return TRUE;
+}
+
+typedef int (*TreeOp) (SeafFSManager *mgr, const char *root_id, int run);
+
+static int
+op_lookup (SeafFSManager *mgr, const char *root_id, int run)
+{
+    GString *path = g_string_new ("");
+    SeafDir *dir;
+    int i, j, n = 0;
+
+    for (i = 0; i < 1000; ++i) {
+        g_string_truncate (path, 0);
+        for (j = 0; j < opts.depth; ++j)
+            g_string_append_printf (path, "/d-%04u", next_rand () % opts.fanout);
+        if (path->len == 0)
+            g_string_append_c (path, '/');
+
+        dir = seaf_fs_manager_get_seafdir_by_path (mgr, root_id, path->str,
+                                                   NULL);
+        if (!dir) {
+            fprintf (stderr, "Failed to look up %s.\n", path->str);
+            n = -1;
+            break;
+        }
+        seaf_dir_free (dir);
+        ++n;
+    }
+
+    g_string_free (path, TRUE);
+    return n;
+}
+
+static int
+op_traverse (SeafFSManager *mgr, const char *root_id, int run)
+{
+    int n = 0;
+
+    if (seaf_fs_manager_traverse_tree (mgr, root_id, count_object, &n) < 0)
+        return -1;
+    return n;
+}
+
+static int
+op_traverse_parallel (SeafFSManager *mgr, const char *root_id, int run)
+{
+    int n = 0;
+
+    if (seaf_fs_manager_traverse_tree_parallel (mgr, root_id, count_object,
+                                                &n, opts.n_workers) < 0)
+        return -1;
+    return n;
+}
+
+static int
+op_fs_size (SeafFSManager *mgr, const char *root_id, int run)
+{
+    return seaf_fs_manager_get_fs_size (mgr, root_id) < 0 ? -1 : 1;
+}
+
+static int
+op_populate_blocklist (SeafFSManager *mgr, const char *root_id, int run)
+{
+    BlockList *bl = block_list_new ();
+    int n = -1;
+
+    if (seaf_fs_manager_populate_blocklist (mgr, root_id, bl) == 0) {
+        block_list_sort (bl);
+        n = bl->n_blocks;
+    }
+
+    block_list_free (bl);
+    return n;
+}
+
+static struct {
+    const char *name;
+    TreeOp op;
+} tree_ops[] = {
+    { "get-seafdir-by-path", op_lookup },
+    { "traverse-tree", op_traverse },
+    { "traverse-tree-parallel", op_traverse_parallel },
+    { "get-fs-size", op_fs_size },
+    { "populate-blocklist", op_populate_blocklist },
+};
+
+static int
+run_tree_op (const char *backend, int i, SeafFSManager *mgr,
+             const char *root_id)
+{
+    GTimer *timer = g_timer_new ();
+    double first, total = 0;
+    int n, run;
+
+    if (tree_ops[i].op == op_traverse_parallel && opts.n_workers <= 1)
+        goto out;
+
+    rand_state = 1;
+    n = tree_ops[i].op (mgr, root_id, 0);
+    first = g_timer_elapsed (timer, NULL);
+    if (n < 0) {
+        fprintf (stderr, "%s failed on %s backend.\n",
+                 tree_ops[i].name, backend);
+        g_timer_destroy (timer);
+        return -1;
+    }
+
+    for (run = 1; run <= opts.iterations; ++run) {
+        g_timer_start (timer);
+        if (tree_ops[i].op (mgr, root_id, run) < 0)
+            break;
+        total += g_timer_elapsed (timer, NULL);
+    }
+
+    print_result (backend, tree_ops[i].name, n, first, total, run - 1);
+
+out:
+    g_timer_destroy (timer);
+    return 0;
+}
+
+static int
+run_backend (const char *backend, const char *tmp_dir, const char *riak)
+{
+    SeafileSession *session;
+    TreeStats stats;
+    GTimer *timer;
+    char *dir, *buf;
+    char root_id[41];
+    int i, ret = 0;
+
+    dir = g_strdup_printf ("%s/bench-fs-%s-XXXXXX", tmp_dir, backend);
+    if (!mkdtemp (dir)) {
+        fprintf (stderr, "Failed to create temp dir in %s.\n", tmp_dir);
+        g_free (dir);
+        return -1;
+    }
+
+    session = create_session (backend, dir, riak);
+    if (!session) {
+        ret = -1;
+        goto out;
+    }
+
+    memset (&stats, 0, sizeof(stats));
+    buf = g_malloc (opts.file_size);
+    rand_state = 1;
+
+    timer = g_timer_new ();
+    ret = build_dir (session->fs_mgr, "", opts.depth, buf, root_id, &stats);
+    if (ret == 0)
+        print_result (backend, "build-tree", stats.n_dirs + stats.n_files,
+                      g_timer_elapsed (timer, NULL), 0, 0);
+    g_timer_destroy (timer);
+    g_free (buf);
+
+    if (ret < 0) {
+        fprintf (stderr, "Failed to build tree on %s backend.\n", backend);
+        goto out;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(tree_ops); ++i)
+        if (run_tree_op (backend, i, session->fs_mgr, root_id) < 0)
+            ret = -1;
+
+out:
+    if (!opts.json)
+        printf ("%s backend data left in %s\n", backend, dir);
+    g_free (dir);
+    return ret;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-b fs|pack|riak] [-r host:port:bucket] [-D depth] "
+             "[-F fanout] [-f files_per_dir] [-s file_size] "
+             "[-n iterations] [-w workers] [-d tmpdir] [-j]\n"
+             "  -b  only run this backend; fs and pack run by default,\n"
+             "      and riak too if -r is given\n"
+             "  -w  also run the parallel traversal with this many workers\n"
+             "  -j  print results as JSON, one object per line\n",
+             prog);
+}
+
+int main (int argc, char *argv[])
+{
+    static const char *backends[] = { "fs", "pack", "riak" };
+    static const int codec_sizes[] = { 10, 100, 1000, 10000 };
+    const char *backend = NULL, *riak = NULL;
+    const char *tmp_dir = g_get_tmp_dir ();
+    int c, i, ret = 0;
+
+    while ((c = getopt (argc, argv, "b:r:D:F:f:s:n:w:d:jh")) != -1) {
+        switch (c) {
+        case 'b':
+            backend = optarg;
+            break;
+        case 'r':
+            riak = optarg;
+            break;
+        case 'D':
+            opts.depth = atoi (optarg);
+            break;
+        case 'F':
+            opts.fanout = atoi (optarg);
+            break;
+        case 'f':
+            opts.n_files = atoi (optarg);
+            break;
+        case 's':
+            opts.file_size = atoi (optarg);
+            break;
+        case 'n':
+            opts.iterations = atoi (optarg);
+            break;
+        case 'w':
+            opts.n_workers = atoi (optarg);
+            break;
+        case 'd':
+            tmp_dir = optarg;
+            break;
+        case 'j':
+            opts.json = TRUE;
+            break;
+        default:
+            usage (argv[0]);
+            exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    if (opts.depth < 0 || opts.fanout <= 0 || opts.n_files < 0 ||
+        opts.file_size <= 0 || opts.iterations < 0 ||
+        (backend && strcmp (backend, "fs") != 0 &&
+         strcmp (backend, "pack") != 0 && strcmp (backend, "riak") != 0) ||
+        (backend && strcmp (backend, "riak") == 0 && !riak)) {
+        usage (argv[0]);
+        exit (1);
+    }
+
+    g_thread_init (NULL);
+
+    for (i = 0; i < G_N_ELEMENTS(codec_sizes); ++i)
+        bench_dir_codec (codec_sizes[i]);
+
+    for (i = 0; i < G_N_ELEMENTS(backends); ++i) {
+        if (backend ? strcmp (backend, backends[i]) != 0 :
+            (strcmp (backends[i], "riak") == 0 && !riak))
+            continue;
+        if (run_backend (backends[i], tmp_dir, riak) < 0)
+            ret = 1;
+    }
+
+    return ret;
+}
@@ -1,105 +1,640 @@
-#include <glib.h>
-#include <glib/gprintf.h>
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Self-test and benchmark of the block encryption.
+ *
+ * The test checks that seafile_encrypt()/seafile_decrypt(), the reused
+ * cipher contexts and piecewise encryption of every enc_version give
+ * the same output, bit for bit, as a reference that only uses the plain
+ * AES block function of OpenSSL, without EVP and whatever accelerated
+ * code it picks. Key derivation is checked against a reference
+ * EVP_BytesToKey(), and the transport ciphers of the block tx v2
+ * protocol are checked the same way.
+ *
+ * With -b the throughput of each of them is measured too, on blocks
+ * from 4 KB to BLOCK_MAX_SZ, with -j as one JSON object per line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "common.h"
 #include "seafile-crypt.h"
+#include "cdc/cdc.h"
 
+#define PASSWD "this_is_user_passwd"
+#define MiB (1024 * 1024)
 
-#define CODE "this_is_user_passwd"
+/* Same as in seafile-crypt.c. */
+#define KEYGEN_ITERATION (1 << 19)
+static unsigned char salt[8] = { 0xda, 0x90, 0x45, 0xc3, 0x06, 0xc7, 0xcc, 0x26 };
 
-static int crypt_test (unsigned int len)
-{    
+/* Same as in processors/blocktx-common-impl-v2.h. */
+#define TX_SESSION_KEY "0123456789abcdef0123456789abcdef01234567"
+#define TX_GCM_SALT "seafgcm1"
+#define GCM_NONCE_LEN 12
+#define GCM_TAG_LEN 16
+/* Blocks are sent in pieces of this size. */
+#define TX_PIECE_SIZE 65536
 
-    if (len <= 0) {
-        g_printf (" [%s] line %d: len must be positive.\n", __func__, __LINE__);
-        return -1;
+static struct {
+    gboolean bench;
+    gboolean json;
+    double min_time;            /* seconds per measurement */
+} opts = { FALSE, FALSE, 0.5 };
+
+static int n_failed;
+
+static guint32 rand_state = 1;
+
+static guint32
+next_rand ()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static char *
+random_data (int len)
+{
+    char *buf = g_malloc (len);
+    int i;
+
+    for (i = 0; i < len; ++i)
+        buf[i] = next_rand () & 0xff;
+    return buf;
+}
+
+static void
+check (gboolean ok, const char *what, int version, int len)
+{
+    if (ok)
+        return;
+    printf ("[FAIL] %s, version %d, %d bytes\n", what, version, len);
+    ++n_failed;
+}
+
+/* Reference implementations */
+
+/*
+ * AES with PKCS#7 padding, in CBC mode, or in ECB mode if @iv is NULL,
+ * one block at a time with AES_encrypt().
+ */
+static char *
+ref_encrypt (const unsigned char *key, int bits, const unsigned char *iv,
+             const char *in, int len, int *out_len)
+{
+    AES_KEY aes_key;
+    unsigned char prev[16], block[16];
+    int n_blocks = len / 16 + 1;
+    unsigned char *out = g_malloc (n_blocks * 16);
+    int i, j, n;
+
+    AES_set_encrypt_key (key, bits, &aes_key);
+    if (iv)
+        memcpy (prev, iv, 16);
+
+    for (i = 0; i < n_blocks; ++i) {
+        n = MIN (16, len - i * 16);
+        if (n > 0)
+            memcpy (block, in + i * 16, n);
+        else
+            n = 0;
+        memset (block + n, 16 - n, 16 - n);
+
+        if (iv)
+            for (j = 0; j < 16; ++j)
+                block[j] ^= prev[j];
+        AES_encrypt (block, out + i * 16, &aes_key);
+        if (iv)
+            memcpy (prev, out + i * 16, 16);
     }
-    
-    char *msg = "Hello World!\n";
-    
-    GString *gstr = g_string_new (NULL);
 
-    while (gstr->len < len) {
-        g_string_append (gstr, msg);
+    *out_len = n_blocks * 16;
+    return (char *)out;
+}
+
+/* EVP_BytesToKey() with SHA-1, from its definition. */
+static void
+ref_bytes_to_key (const unsigned char *salt_in, const char *data, int len,
+                  int count, unsigned char *key, int key_len,
+                  unsigned char *iv, int iv_len)
+{
+    unsigned char md[SHA_DIGEST_LENGTH];
+    unsigned char out[128];
+    int n = 0, total = key_len + iv_len, i;
+    SHA_CTX ctx;
+
+    while (n < total) {
+        SHA1_Init (&ctx);
+        if (n > 0)
+            SHA1_Update (&ctx, md, sizeof(md));
+        SHA1_Update (&ctx, data, len);
+        if (salt_in)
+            SHA1_Update (&ctx, salt_in, 8);
+        SHA1_Final (md, &ctx);
+        for (i = 1; i < count; ++i)
+            SHA1 (md, sizeof(md), md);
+
+        memcpy (out + n, md, MIN (sizeof(md), (gsize)(total - n)));
+        n += sizeof(md);
+    }
+
+    memcpy (key, out, key_len);
+    if (iv)
+        memcpy (iv, out + key_len, iv_len);
+}
+
+/* Transport ciphers, as set up by the block tx v2 processors. */
+
+typedef struct TxKeys {
+    unsigned char key[32];
+    unsigned char iv[16];
+    unsigned char gcm_key[32];
+} TxKeys;
+
+static void
+derive_tx_keys (TxKeys *keys)
+{
+    EVP_BytesToKey (EVP_aes_256_cbc(), EVP_sha1(), NULL,
+                    (unsigned char *)TX_SESSION_KEY, strlen(TX_SESSION_KEY),
+                    3, keys->key, keys->iv);
+    EVP_BytesToKey (EVP_aes_256_gcm(), EVP_sha1(),
+                    (unsigned char *)TX_GCM_SALT,
+                    (unsigned char *)TX_SESSION_KEY, strlen(TX_SESSION_KEY),
+                    3, keys->gcm_key, NULL);
+
+    /* The processors derive the key into a 16 byte array followed by
+     * the IV, so the upper half of the key they use is the IV. */
+    memcpy (keys->key + 16, keys->iv, 16);
+}
+
+/* Encrypt @in in pieces of @piece bytes. out must hold len + 16 bytes. */
+static int
+tx_cbc_encrypt (const TxKeys *keys, const char *in, int len, int piece,
+                char *out)
+{
+    EVP_CIPHER_CTX ctx;
+    int n, out_len, total = 0, off, ret = -1;
+
+    EVP_CIPHER_CTX_init (&ctx);
+    if (!EVP_EncryptInit_ex (&ctx, EVP_aes_256_cbc(), NULL,
+                             keys->key, keys->iv))
+        goto out;
+
+    for (off = 0; off < len; off += n) {
+        n = MIN (piece, len - off);
+        if (!EVP_EncryptUpdate (&ctx, (unsigned char *)out + total, &out_len,
+                                (unsigned char *)in + off, n))
+            goto out;
+        total += out_len;
     }
+    if (!EVP_EncryptFinal_ex (&ctx, (unsigned char *)out + total, &out_len))
+        goto out;
+    ret = total + out_len;
+
+out:
+    EVP_CIPHER_CTX_cleanup (&ctx);
+    return ret;
+}
+
+/* GCM has no padding, out must hold len bytes. */
+static int
+tx_gcm_crypt (const TxKeys *keys, const unsigned char *nonce, int encrypt,
+              const char *in, int len, int piece, char *out,
+              unsigned char *tag)
+{
+    EVP_CIPHER_CTX ctx;
+    int n, out_len, off, ret = -1;
+
+    EVP_CIPHER_CTX_init (&ctx);
+    if (!EVP_CipherInit_ex (&ctx, EVP_aes_256_gcm(), NULL,
+                            keys->gcm_key, nonce, encrypt))
+        goto out;
 
-    char *enc_out = NULL;
-    int enc_out_len;
-
-    g_printf ("[setup] The input is %d bytes\n", len);
-    
-    int res = seafile_encrypt (&enc_out,
-                               &enc_out_len,
-                               gstr->str,
-                               len,
-                               CODE,
-                               strlen(CODE));
-
-    if (res == 0 && enc_out_len != -1)
-        g_printf ("[ENC] [PASS] Encrypted output length is %d bytes\n", enc_out_len);
-    else {
-        g_printf ("[ENC] FAILED.\n");
-        goto error;
+    for (off = 0; off < len; off += n) {
+        n = MIN (piece, len - off);
+        if (!EVP_CipherUpdate (&ctx, (unsigned char *)out + off, &out_len,
+                               (unsigned char *)in + off, n))
+            goto out;
     }
 
-    char *dec_out = NULL;
-    int dec_len;
-    
-    res = seafile_decrypt (&dec_out,
-                           &dec_len,
-                           enc_out,
-                           enc_out_len,
-                           CODE,
-                           strlen(CODE));
-
-    
-    if (res != 0 || (unsigned int)dec_len != len ||
-        strncmp (dec_out, gstr->str, len) != 0) {
-       
-        g_printf ("[DEC] FAILED.\n");
-        goto error;
-    }                
+    if (!encrypt &&
+        !EVP_CIPHER_CTX_ctrl (&ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_LEN, tag))
+        goto out;
+    if (!EVP_CipherFinal_ex (&ctx, (unsigned char *)out + len, &out_len))
+        goto out;
+    if (encrypt &&
+        !EVP_CIPHER_CTX_ctrl (&ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_LEN, tag))
+        goto out;
+    ret = len;
+
+out:
+    EVP_CIPHER_CTX_cleanup (&ctx);
+    return ret;
+}
+
+/* Self-test */
+
+static void
+test_reference ()
+{
+    /* FIPS-197, appendix C.1. */
+    static const unsigned char key[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    };
+    static const unsigned char plain[16] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+        0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+    };
+    static const unsigned char cipher[16] = {
+        0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+        0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+    };
+    char *out;
+    int out_len;
+
+    out = ref_encrypt (key, 128, NULL, (const char *)plain, 16, &out_len);
+    check (out_len == 32 && memcmp (out, cipher, 16) == 0,
+           "reference AES", 0, 16);
+    g_free (out);
+}
+
+static void
+test_key_derivation (int version, SeafileCrypt *crypt)
+{
+    unsigned char key[16], iv[16];
+
+    memset (iv, 0, sizeof(iv));
+    if (version >= 1)
+        ref_bytes_to_key (salt, PASSWD, strlen(PASSWD), KEYGEN_ITERATION,
+                          key, 16, iv, 16);
     else
-        g_printf ("[DEC] [PASS] Decrypted output is the totally same as input\n");
-        
-    g_string_free (gstr, TRUE);
-    g_free (enc_out);
-    g_free (dec_out);
+        /* ECB has no IV. */
+        ref_bytes_to_key (NULL, PASSWD, strlen(PASSWD), 3, key, 16, NULL, 0);
 
-    g_printf ("[TEST] Finished Successfully.\n");
+    check (memcmp (key, crypt->key, 16) == 0 &&
+           (version == 0 || memcmp (iv, crypt->iv, 16) == 0),
+           "key derivation", version, 0);
+}
 
-    return 0;
-    
-    
-error:    
+static void
+test_block (SeafileCrypt *crypt, SeafileCipher *enc, SeafileCipher *dec,
+            int len)
+{
+    char *in = random_data (len);
+    char *ref, *out = NULL, *plain = NULL, *buf;
+    int ref_len, out_len, plain_len, n, off, piece;
+    int v = crypt->version;
+
+    ref = ref_encrypt (crypt->key, 128, v >= 1 ? crypt->iv : NULL,
+                       in, len, &ref_len);
 
-    g_string_free (gstr, TRUE);
-    g_free (enc_out);
-    g_free (dec_out);
+    /* One-shot. */
+    check (seafile_encrypt (&out, &out_len, in, len, crypt) == 0 &&
+           out_len == ref_len && memcmp (out, ref, ref_len) == 0,
+           "seafile_encrypt", v, len);
+    check (seafile_decrypt (&plain, &plain_len, ref, ref_len, crypt) == 0 &&
+           plain_len == len && memcmp (plain, in, len) == 0,
+           "seafile_decrypt", v, len);
+    g_free (out);
+    g_free (plain);
 
-    g_printf ("[TEST] FAILED.\n");
-    
-    return -1;
+    /* Reused contexts, twice to check that the IV is reset. */
+    buf = g_malloc (len + BLK_SIZE);
+    for (n = 0; n < 2; ++n) {
+        check (seafile_cipher_block (enc, in, len, buf, &out_len) == 0 &&
+               out_len == ref_len && memcmp (buf, ref, ref_len) == 0,
+               "seafile_cipher_block encrypt", v, len);
+        check (seafile_cipher_block (dec, ref, ref_len, buf, &out_len) == 0 &&
+               out_len == len && memcmp (buf, in, len) == 0,
+               "seafile_cipher_block decrypt", v, len);
+    }
+    g_free (buf);
+
+    /* Piece by piece, in odd sizes. */
+    buf = g_malloc (len + 2 * BLK_SIZE);
+    out_len = 0;
+    piece = 1;
+    if (seafile_cipher_begin (enc) < 0)
+        check (FALSE, "seafile_cipher_begin", v, len);
+    for (off = 0; off < len; off += piece, piece = piece * 3 + 1) {
+        piece = MIN (piece, len - off);
+        if (seafile_cipher_update (enc, in + off, piece,
+                                   buf + out_len, &n) < 0)
+            break;
+        out_len += n;
+    }
+    check (off >= len &&
+           seafile_cipher_final (enc, buf + out_len, &n) == 0 &&
+           out_len + n == ref_len && memcmp (buf, ref, ref_len) == 0,
+           "seafile_cipher_update", v, len);
+    g_free (buf);
 
+    g_free (ref);
+    g_free (in);
 }
 
+static void
+test_transport (const TxKeys *keys, int len)
+{
+    unsigned char nonce[GCM_NONCE_LEN], tag[GCM_TAG_LEN], tag2[GCM_TAG_LEN];
+    char *in = random_data (len);
+    char *ref, *out = g_malloc (len + 16), *out2 = g_malloc (len + 16);
+    int ref_len, out_len;
+
+    ref = ref_encrypt (keys->key, 256, keys->iv, in, len, &ref_len);
+    out_len = tx_cbc_encrypt (keys, in, len, TX_PIECE_SIZE, out);
+    check (out_len == ref_len && memcmp (out, ref, ref_len) == 0,
+           "transport cbc", 2, len);
 
-int main (void)
+    /* GCM has no reference here, but the pieces must not matter, and
+     * the tag must verify. */
+    memset (nonce, 0x5a, sizeof(nonce));
+    check (tx_gcm_crypt (keys, nonce, 1, in, len, len, out, tag) == len &&
+           tx_gcm_crypt (keys, nonce, 1, in, len, 4099, out2, tag2) == len &&
+           memcmp (out, out2, len) == 0 && memcmp (tag, tag2, sizeof(tag)) == 0,
+           "transport gcm pieces", 2, len);
+    check (tx_gcm_crypt (keys, nonce, 0, out, len, TX_PIECE_SIZE,
+                         out2, tag) == len && memcmp (out2, in, len) == 0,
+           "transport gcm decrypt", 2, len);
+    tag[0] ^= 1;
+    check (tx_gcm_crypt (keys, nonce, 0, out, len, TX_PIECE_SIZE,
+                         out2, tag) < 0,
+           "transport gcm bad tag", 2, len);
+
+    g_free (ref);
+    g_free (out);
+    g_free (out2);
+    g_free (in);
+}
+
+static int test_sizes[] = {
+    1, 15, 16, 17, 100, 4096, 65536 + 7, BLOCK_SZ, BLOCK_MAX_SZ,
+};
+
+static SeafileCrypt *
+make_crypt (int version)
 {
-    unsigned int len[7] = {1, 8, 16, 50, 111, 1111, 11111};
+    unsigned char key[16], iv[16];
 
-    int i;
+    memset (iv, 0, sizeof(iv));
+    seafile_generate_enc_key (PASSWD, strlen(PASSWD), version, key, iv);
+    return seafile_crypt_new (version, key, iv);
+}
+
+static void
+run_tests (SeafileCrypt **crypts, const TxKeys *keys)
+{
+    SeafileCipher enc, dec;
+    int v, i;
+
+    test_reference ();
 
-    for (i = 0; i < 7; i ++) {
-        if (crypt_test (len[i]) != 0) {
-            g_printf ("TEST FAILED.\n");
-            return -1;
+    for (v = 0; v <= CURRENT_ENC_VERSION; ++v) {
+        test_key_derivation (v, crypts[v]);
+
+        if (seafile_cipher_init (&enc, crypts[v], 1) < 0 ||
+            seafile_cipher_init (&dec, crypts[v], 0) < 0) {
+            check (FALSE, "seafile_cipher_init", v, 0);
+            continue;
         }
+        for (i = 0; i < G_N_ELEMENTS(test_sizes); ++i)
+            test_block (crypts[v], &enc, &dec, test_sizes[i]);
+        seafile_cipher_cleanup (&enc);
+        seafile_cipher_cleanup (&dec);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(test_sizes); ++i)
+        test_transport (keys, test_sizes[i]);
+}
+
+/* Benchmark */
+
+typedef int (*BenchFunc) (void *data, const char *in, int len, char *out);
+
+static void
+print_result (const char *bench, int version, int len, int n, double secs)
+{
+    double usec = secs * 1e6 / n;
+    double mbps = len > 0 ? (double)len * n / secs / MiB : 0;
+
+    if (opts.json) {
+        printf ("{\"bench\": \"%s\", \"version\": %d, \"size\": %d, "
+                "\"ops\": %d, \"usec_per_op\": %.3f, \"mb_per_s\": %.1f}\n",
+                bench, version, len, n, usec, mbps);
+        return;
     }
 
-    
-    g_printf ("ALL TESTS FINISHED SUCCESSFULLY.\n");
+    if (len > 0)
+        printf ("%-14s v%d %8d bytes: %10.1f usec, %8.1f MB/s\n",
+                bench, version, len, usec, mbps);
+    else
+        printf ("%-14s v%d: %10.1f usec\n", bench, version, usec);
+}
+
+/* Run @func until opts.min_time has passed. */
+static void
+bench (const char *name, int version, BenchFunc func, void *data, int len)
+{
+    char *in = random_data (MAX (len, 1));
+    char *out = g_malloc (len + 2 * BLK_SIZE);
+    GTimer *timer = g_timer_new ();
+    int n = 0;
+
+    do {
+        if (func (data, in, len, out) < 0) {
+            printf ("[FAIL] %s failed, version %d, %d bytes\n",
+                    name, version, len);
+            ++n_failed;
+            break;
+        }
+        ++n;
+    } while (g_timer_elapsed (timer, NULL) < opts.min_time);
+
+    if (n > 0)
+        print_result (name, version, len, n, g_timer_elapsed (timer, NULL));
+
+    g_timer_destroy (timer);
+    g_free (out);
+    g_free (in);
+}
+
+static int
+bench_encrypt (void *crypt, const char *in, int len, char *out)
+{
+    char *enc;
+    int enc_len;
 
+    if (seafile_encrypt (&enc, &enc_len, in, len, crypt) < 0)
+        return -1;
+    g_free (enc);
+    return 0;
+}
+
+/* The input isn't valid cipher text, so the padding check fails;
+ * everything else is done. */
+static int
+bench_decrypt (void *crypt, const char *in, int len, char *out)
+{
+    char *dec;
+    int dec_len;
+
+    seafile_decrypt (&dec, &dec_len, in, len, crypt);
+    g_free (dec);
     return 0;
 }
 
-        
+static int
+bench_cipher_block (void *cipher, const char *in, int len, char *out)
+{
+    int out_len;
+
+    return seafile_cipher_block (cipher, in, len, out, &out_len);
+}
+
+static int
+bench_ref_encrypt (void *crypt, const char *in, int len, char *out)
+{
+    SeafileCrypt *c = crypt;
+    char *enc;
+    int enc_len;
+
+    enc = ref_encrypt (c->key, 128, c->version >= 1 ? c->iv : NULL,
+                       in, len, &enc_len);
+    g_free (enc);
+    return 0;
+}
+
+static int
+bench_tx_cbc (void *keys, const char *in, int len, char *out)
+{
+    return tx_cbc_encrypt (keys, in, len, TX_PIECE_SIZE, out) < 0 ? -1 : 0;
+}
+
+static int
+bench_tx_gcm (void *keys, const char *in, int len, char *out)
+{
+    unsigned char nonce[GCM_NONCE_LEN], tag[GCM_TAG_LEN];
+
+    memset (nonce, 0, sizeof(nonce));
+    return tx_gcm_crypt (keys, nonce, 1, in, len, TX_PIECE_SIZE,
+                         out, tag) < 0 ? -1 : 0;
+}
+
+static int
+bench_keygen (void *version, const char *in, int len, char *out)
+{
+    unsigned char key[16], iv[16];
+
+    seafile_generate_enc_key (PASSWD, strlen(PASSWD),
+                              GPOINTER_TO_INT(version), key, iv);
+    return 0;
+}
+
+static int
+bench_tx_keygen (void *data, const char *in, int len, char *out)
+{
+    TxKeys keys;
+
+    derive_tx_keys (&keys);
+    return 0;
+}
+
+static int bench_sizes[] = {
+    4096, 16384, 65536, 262144, BLOCK_SZ, BLOCK_MAX_SZ,
+};
+
+static void
+run_benchmarks (SeafileCrypt **crypts, TxKeys *keys)
+{
+    SeafileCipher enc;
+    int v, i, len;
+
+    for (v = 0; v <= CURRENT_ENC_VERSION; ++v)
+        bench ("keygen", v, bench_keygen, GINT_TO_POINTER(v), 0);
+    bench ("tx-keygen", 2, bench_tx_keygen, NULL, 0);
+
+    for (i = 0; i < G_N_ELEMENTS(bench_sizes); ++i) {
+        len = bench_sizes[i];
+
+        for (v = 0; v <= CURRENT_ENC_VERSION; ++v) {
+            bench ("encrypt", v, bench_encrypt, crypts[v], len);
+            bench ("decrypt", v, bench_decrypt, crypts[v], len);
+            if (seafile_cipher_init (&enc, crypts[v], 1) == 0) {
+                bench ("cipher-block", v, bench_cipher_block, &enc, len);
+                seafile_cipher_cleanup (&enc);
+            }
+            bench ("ref-encrypt", v, bench_ref_encrypt, crypts[v], len);
+        }
+
+        /* "Version" 2 is the transport. */
+        bench ("tx-cbc", 2, bench_tx_cbc, keys, len);
+        bench ("tx-gcm", 2, bench_tx_gcm, keys, len);
+    }
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-b] [-t seconds] [-j]\n"
+             "  -b  run the benchmarks after the tests\n"
+             "  -t  minimum time of each measurement, default 0.5\n"
+             "  -j  print results as JSON, one object per line\n",
+             prog);
+}
+
+int main (int argc, char *argv[])
+{
+    SeafileCrypt *crypts[CURRENT_ENC_VERSION + 1];
+    TxKeys keys;
+    int c, v;
+
+    while ((c = getopt (argc, argv, "bt:jh")) != -1) {
+        switch (c) {
+        case 'b':
+            opts.bench = TRUE;
+            break;
+        case 't':
+            opts.min_time = g_ascii_strtod (optarg, NULL);
+            break;
+        case 'j':
+            opts.json = TRUE;
+            break;
+        default:
+            usage (argv[0]);
+            exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    for (v = 0; v <= CURRENT_ENC_VERSION; ++v)
+        crypts[v] = make_crypt (v);
+    derive_tx_keys (&keys);
+
+    run_tests (crypts, &keys);
+    if (n_failed > 0) {
+        printf ("%d CHECKS FAILED.\n", n_failed);
+        return 1;
+    }
+    if (!opts.json)
+        printf ("ALL TESTS PASSED.\n");
+
+    if (opts.bench)
+        run_benchmarks (crypts, &keys);
+
+    for (v = 0; v <= CURRENT_ENC_VERSION; ++v)
+        g_free (crypts[v]);
+
+    return n_failed > 0 ? 1 : 0;
+}
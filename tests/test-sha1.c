@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "cdc/seaf-sha1.h"
+
+#define BUF_SZ (1024 * 1024)
+
+static int
+check (const char *what, size_t len, const unsigned char *md,
+       const unsigned char *data)
+{
+    unsigned char expected[20];
+
+    SHA1 (data, len, expected);
+    if (memcmp (md, expected, 20) != 0) {
+        printf ("[%s] FAILED for %lu bytes.\n", what, (unsigned long)len);
+        return -1;
+    }
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned char *buf;
+    unsigned char md[20 * 5];
+    SeafSHA1Ctx ctx;
+    const void *bufs[5];
+    size_t lens[5] = { BUF_SZ - 16, 1000, 77, 64 * 100, 0 };
+    size_t len, i;
+    int failed = 0;
+
+    buf = malloc (BUF_SZ);
+    srand (0);
+    for (i = 0; i < BUF_SZ; ++i)
+        buf[i] = rand ();
+
+    printf ("Using %s SHA-1.\n", seaf_sha1_impl_name ());
+
+    /* Every padding case. */
+    for (len = 0; len < 300; ++len) {
+        seaf_sha1 (buf, len, md);
+        if (check ("one shot", len, md, buf) < 0)
+            failed = 1;
+    }
+
+    /* Updates that don't line up with the block size. */
+    seaf_sha1_init (&ctx);
+    for (i = 0; i < 1000; ++i)
+        seaf_sha1_update (&ctx, buf + i * 37, 37);
+    seaf_sha1_final (md, &ctx);
+    if (check ("incremental", 37000, md, buf) < 0)
+        failed = 1;
+
+    for (i = 0; i < 5; ++i)
+        bufs[i] = buf + i * 3;
+    seaf_sha1_batch (bufs, lens, 5, md);
+    for (i = 0; i < 5; ++i)
+        if (check ("batch", lens[i], md + i * 20, bufs[i]) < 0)
+            failed = 1;
+
+    free (buf);
+
+    if (!failed)
+        printf ("[SHA-1] PASS.\n");
+    return failed;
+}
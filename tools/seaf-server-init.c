@@ -147,7 +147,8 @@ int main (int argc, char **argv)
     if (use_mysql) {
         SeafDB *db_root = seaf_db_new_mysql (config.mysql_host, "root",
                                              config.mysql_root_passwd,
-                                             NULL, config.mysql_socket);
+                                             NULL, config.mysql_socket,
+                                             0, 0);
         if (!db_root) {
         fprintf (stderr, "Out of memory!\n");
         return 1;